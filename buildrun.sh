@@ -91,25 +91,25 @@ build()
     then
         if [ "$buildonly" = "0" ]
         then
-            nnbuild -p $package all
+            nnbuild -j $NNJOBCOUNT -p $package all
             checkerr $? "unable to build NexNix"
         elif [ "$action" = "confbuild" ]
         then
-            nnbuild -p $package confbuild
+            nnbuild -j $NNJOBCOUNT -p $package confbuild
         else
-            nnbuild -p $package build
+            nnbuild -j $NNJOBCOUNT -p $package build
             checkerr $? "unable to build NexNix"
         fi
     else
         if [ "$buildonly" = "0" ]
         then
-            nnbuild -g $group all
+            nnbuild -j $NNJOBCOUNT -g $group all
             checkerr $? "unable to build NexNix"
         elif [ "$action" = "confbuild" ]
         then
-            nnbuild -g $group confbuild
+            nnbuild -j $NNJOBCOUNT -g $group confbuild
         else
-            nnbuild -g $group build
+            nnbuild -j $NNJOBCOUNT -g $group build
             checkerr $? "unable to build NexNix"
         fi
     fi
@@ -135,7 +135,7 @@ image()
     # Run the configuration script
     olddir=$(pwd)
     cd $output/conf/$target/$buildconf && . $PWD/nexnix-conf.sh
-    nnimage -l $NNCONFROOT/nnimage-list.lst $imgaction
+    nnimage -t -l $NNCONFROOT/nnimage-list.lst $imgaction
     checkerr $? "unable to generate image for NexNix"
     cd $olddir
 }
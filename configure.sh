@@ -331,6 +331,7 @@ buildfw=1
 # System configuration options
 loglevel=4
 graphicsmode=gui
+kernelargs=
 
 # Target specific features
 targetismp=
@@ -418,6 +419,9 @@ System configuration options:
   -graphicsmode mode
                         Specifies if graphical output mode
                         Can be "gui", "text", or "headless"
+  -kernelargs args
+                        Extra arguments nexboot passes to nexke
+                        e.g., "-boottime -bench" for scripts/perfrun.sh
 Options for target i386:
 These options should be passed after the -target option
   -pae val
@@ -593,6 +597,15 @@ HELPEND
         usesu=1
         shift
         ;;
+    -kernelargs)
+        # Kernel arguments start with a dash, so they can't go through getoptarg
+        if [ $# -lt 2 ]
+        then
+            panic "option $1 requires an argument" $0
+        fi
+        kernelargs="$2"
+        shift 2
+        ;;
     -loglevel)
         # Get the argument
         loglevelname=$(getoptarg "$2" "$1")
@@ -1086,6 +1099,7 @@ Run $0 -archs to see supported targets"
         echo "export NNIMGTYPE=\"$imagetype\"" >> nexnix-conf.sh
         echo "export NNLOGLEVEL=$loglevel" >> nexnix-conf.sh
         echo "export NNGRAPHICSMODE=\"$graphicsmode\"" >> nexnix-conf.sh
+        echo "export NNKERNELARGS=\"$kernelargs\"" >> nexnix-conf.sh
         echo "export NNBOOTIMG=\"$output/conf/$target/$conf/nnboot.img\"" >> nexnix-conf.sh
         echo "export NNALTBOOTIMG=\"$output/conf/$target/$conf/nnboot2.img\"" >> nexnix-conf.sh
         echo "export NNTARGETCONF=$tarconf" >> nexnix-conf.sh
@@ -48,4 +48,11 @@ writeconf()
     result=$(printf "%s" "$file" | sed -e 's/|/$/g')
     # Print result to nexboot.cfg
     printf "%s" "$result" > $NNDESTDIR/System/Core/Boot/nexboot.cfg
+    # Precompile it so nexboot doesn't have to parse it at boot
+    rm -f $NNDESTDIR/System/Core/Boot/nexboot.cfc
+    if command -v nbconfc > /dev/null
+    then
+        nbconfc $NNDESTDIR/System/Core/Boot/nexboot.cfg $NNDESTDIR/System/Core/Boot/nexboot.cfc
+        checkerr $? "unable to compile nexboot.cfg"
+    fi
 }
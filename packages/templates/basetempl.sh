@@ -14,6 +14,67 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+# Downloads are kept in NNDOWNLOADCACHE when it's set, so build trees on a host share them.
+# Tarballs are kept under a hash of their URL and pkg_downloadSum, and git repositories as
+# mirrors that get fetched into. A tarball that didn't finish downloading is resumed
+
+# Gets the key of the package's download in the cache
+downloadKey()
+{
+    echo "$pkg_downloadUrl $pkg_downloadSum" | sha256sum | cut -d ' ' -f 1
+}
+
+# Checks a tarball against pkg_downloadSum, if the package gives one
+checkSum()
+{
+    [ -z "$pkg_downloadSum" ] && return 0
+    echo "$pkg_downloadSum  $1" | sha256sum -c --status
+}
+
+# Fetches the tarball into the cache and copies it to $1
+fetchTarball()
+{
+    mkdir -p $NNDOWNLOADCACHE
+    cached=$NNDOWNLOADCACHE/$(downloadKey)
+    # Packages with the same tarball may be downloading at once
+    (
+        flock 9
+        if [ ! -f $cached ]
+        then
+            wget -c $pkg_downloadUrl -O $cached.part || exit 1
+            if ! checkSum $cached.part
+            then
+                rm -f $cached.part
+                exit 1
+            fi
+            mv $cached.part $cached
+        fi
+    ) 9>$cached.lock
+    checkerr $? "unable to download $pkg_name"
+    cp $cached $1
+    checkerr $? "unable to copy $pkg_name from download cache"
+}
+
+# Fetches the repository into its mirror in the cache and clones it from there to $1
+fetchGit()
+{
+    mkdir -p $NNDOWNLOADCACHE
+    mirror=$NNDOWNLOADCACHE/git-$(downloadKey)
+    (
+        flock 9
+        if [ -d $mirror ]
+        then
+            git -C $mirror fetch --prune || exit 1
+        else
+            git clone --mirror $pkg_downloadUrl $mirror || exit 1
+        fi
+    ) 9>$mirror.lock
+    checkerr $? "unable to download $pkg_name"
+    git clone $mirror $1
+    checkerr $? "unable to clone $pkg_name from download cache"
+    git -C $1 remote set-url origin $pkg_downloadUrl
+}
+
 # Downloads the source code
 download()
 {
@@ -21,15 +82,28 @@ download()
     if [ "$pkg_downloadType" = "git" ]
     then
         rm -rf $NNEXTSOURCEROOT/$pkg_name
-        git clone $pkg_downloadUrl $NNEXTSOURCEROOT/$pkg_name
-        checkerr $? "unable to download $pkg_name"
+        if [ ! -z "$NNDOWNLOADCACHE" ]
+        then
+            fetchGit $NNEXTSOURCEROOT/$pkg_name
+        else
+            git clone $pkg_downloadUrl $NNEXTSOURCEROOT/$pkg_name
+            checkerr $? "unable to download $pkg_name"
+        fi
     elif [ "$pkg_downloadType" = "tarball" ]
     then
+        tarball=$NNEXTSOURCEROOT/tarballs/$(basename $pkg_downloadUrl)
         mkdir -p $NNEXTSOURCEROOT/tarballs
-        rm -f $NNEXTSOURCEROOT/tarballs/$(basename $pkg_downloadUrl)
-        wget $pkg_downloadUrl -P $NNEXTSOURCEROOT/tarballs
-        checkerr $? "unable to download $pkg_name"
-        tar -C $NNEXTSOURCEROOT -xf $NNEXTSOURCEROOT/tarballs/$(basename $pkg_downloadUrl)
+        rm -f $tarball
+        if [ ! -z "$NNDOWNLOADCACHE" ]
+        then
+            fetchTarball $tarball
+        else
+            wget $pkg_downloadUrl -P $NNEXTSOURCEROOT/tarballs
+            checkerr $? "unable to download $pkg_name"
+            checkSum $tarball
+            checkerr $? "checksum of $pkg_name doesn't match"
+        fi
+        tar -C $NNEXTSOURCEROOT -xf $tarball
         checkerr $? "unable to extract $pkg_name"
     fi
 }
@@ -59,16 +59,19 @@ configure()
 build()
 {
     echo "Building $pkg_name..."
+    # Under a parallel nnbuild, make takes its jobs from nnbuild's jobserver
+    genjobs="-j$NNJOBCOUNT"
     if [ "$NNUSENINJA" = "1" ]
     then
         cmakegen=ninja
     else
         cmakegen=make
+        [ ! -z "$NNJOBSERVER" ] && genjobs=""
     fi
     cd $NNOBJDIR/${pkg_name}-build
-    $cmakegen -j $NNJOBCOUNT
+    $cmakegen $genjobs
     checkerr $? "unable to build $pkg_name"
-    $cmakegen install -j $NNJOBCOUNT
+    $cmakegen install $genjobs
     checkerr $? "unable to install $pkg_name"
 }
 
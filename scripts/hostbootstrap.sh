@@ -86,6 +86,12 @@ else
     makeargs="--no-print-directory"
 fi
 
+# Under a parallel nnbuild, make takes its jobs from nnbuild's jobserver
+makejobs="-j$NNJOBCOUNT"
+[ ! -z "$NNJOBSERVER" ] && makejobs=""
+genjobs=$makejobs
+[ $NNUSENINJA -eq 1 ] && genjobs="-j$NNJOBCOUNT"
+
 if [ "$component" = "hostlibs" ]
 then
     echo "Bootstraping host libraries..."
@@ -107,9 +113,9 @@ then
               -DCMAKE_BUILD_TYPE=Debug \
               -DCMAKE_INSTALL_PREFIX="$NNBUILDROOT/tools" $cmakeargs
         checkerr $? "unable to configure libchardet"
-        $cmakegen -j $NNJOBCOUNT
+        $cmakegen $genjobs
         checkerr $? "unable to build libchardet"
-        $cmakegen install -j $NNJOBCOUNT
+        $cmakegen install $genjobs
         checkerr $? "unable to build libchardet"
     fi
     # Build libnex
@@ -129,9 +135,9 @@ then
               -DCMAKE_BUILD_TYPE=Debug \
               -DCMAKE_INSTALL_PREFIX="$NNBUILDROOT/tools" $libnex_cmakeargs
         checkerr $? "unable to configure libnex"
-        $cmakegen -j $NNJOBCOUNT $makeargs
+        $cmakegen $genjobs $makeargs
         checkerr $? "unable to build libnex"
-        $cmakegen -j $NNJOBCOUNT $makeargs install
+        $cmakegen $genjobs $makeargs install
         checkerr $? "unable to install libnex"
         ctest -V
         checkerr $? "test suite failed"
@@ -155,9 +161,9 @@ then
              -DLIBCONF_LINK_DEPS=ON \
              $libconf_cmakeargs
         checkerr $? "unable to configure libconf"
-        $cmakegen -j $NNJOBCOUNT $makeargs
+        $cmakegen $genjobs $makeargs
         checkerr $? "unable to build libconf"
-        $cmakegen -j $NNJOBCOUNT $makeargs install
+        $cmakegen $genjobs $makeargs install
         checkerr $? "unable to install libconf"
         # Run tests
         ctest -V
@@ -184,9 +190,9 @@ then
               -DCMAKE_BUILD_TYPE=Debug \
               -DCMAKE_INSTALL_PREFIX="$NNBUILDROOT/tools" $tools_cmakeargs
         checkerr $? "unable to build host tools"
-        $cmakegen -j$NNJOBCOUNT $makeargs
+        $cmakegen $genjobs $makeargs
         checkerr $? "unable to build host tools"
-        $cmakegen install -j$NNJOBCOUNT $makeargs
+        $cmakegen install $genjobs $makeargs
         checkerr $? "unable to build host tools"
         # Run tests
         ctest -V
@@ -222,11 +228,11 @@ then
             $gmproot/configure --disable-shared --prefix=$NNBUILDROOT/tools CFLAGS="-O2 -DNDEBUG" \
                                 CXXFLAGS="-O2 -DNDEBUG"
             checkerr $? "unable to configure libgmp"
-            make -j$NNJOBCOUNT
+            make $makejobs
             checkerr $? "unable to build libgmp"
-            make install -j$NNJOBCOUNT
+            make install $makejobs
             checkerr $? "unable to install libgmp"
-            make check -j$NNJOBCOUNT
+            make check $makejobs
             checkerr $? "libgmp test suite failed"
         fi
 
@@ -250,11 +256,11 @@ then
                                 --with-gmp=$NNBUILDROOT/tools CFLAGS="-O2 -DNDEBUG" \
                                 CXXFLAGS="-O2 -DNDEBUG"
             checkerr $? "unable to configure libmpfr"
-            make -j$NNJOBCOUNT
+            make $makejobs
             checkerr $? "unable to build libmpfr"
-            make install -j$NNJOBCOUNT
+            make install $makejobs
             checkerr $? "unable to install libmpfr"
-            make check -j$NNJOBCOUNT
+            make check $makejobs
             checkerr $? "libmpfr test suite failed"
         fi
 
@@ -278,11 +284,11 @@ then
                                 --with-gmp=$NNBUILDROOT/tools --with-mpfr=$NNBUILDROOT/tools \
                                 CFLAGS="-O2 -DNDEBUG" CXXFLAGS="-O2 -DNDEBUG"
             checkerr $? "unable to configure libmpc"
-            make -j$NNJOBCOUNT
+            make $makejobs
             checkerr $? "unable to build libmpc"
-            make install -j$NNJOBCOUNT
+            make install $makejobs
             checkerr $? "unable to install libmpc"
-            make check -j$NNJOBCOUNT
+            make check $makejobs
             checkerr $? "libmpc test suite failed"
         fi
     fi
@@ -358,9 +364,9 @@ then
                                 CFLAGS="-O2 -DNDEBUG" \
                                 CXXFLAGS="-O2 -DNDEBUG"
             checkerr $? "unable to configure binutils"
-            make -j$NNJOBCOUNT
+            make $makejobs
             checkerr $? "unable to build binutils"
-            make install -j$NNJOBCOUNT
+            make install $makejobs
             checkerr $? "unable to install binutils"
         fi
 
@@ -391,9 +397,9 @@ then
                                 --prefix=$NNTOOLCHAINPATH/.. \
                                 --with-sysroot=$NNDESTDIR
             checkerr $? "unable to configure GCC"
-            make all-gcc -j$NNJOBCOUNT
+            make all-gcc $makejobs
             checkerr $? "unable to build GCC"
-            make install-gcc -j$NNJOBCOUNT
+            make install-gcc $makejobs
             checkerr $? "unable to install GCC"
         fi
     elif [ "$NNTOOLCHAIN" = "llvm" ]
@@ -413,9 +419,9 @@ then
     then
         gccroot="$NNEXTSOURCEROOT/tools/gcc-${gccver}"
         cd $NNBUILDROOT/build/tools/gcc-build
-        make all-target-libgcc -j $NNJOBCOUNT
+        make all-target-libgcc $makejobs
         checkerr $? "unable to build GCC"
-        make install-target-libgcc -j $NNJOBCOUNT
+        make install-target-libgcc $makejobs
         checkerr $? "unable to install GCC"
     fi
 elif [ "$component" = "firmware" ]
@@ -464,7 +470,7 @@ then
                 export GCC5_IA32_PREFIX=i686-linux-gnu-
                 cd $edk2root
                 . edk2/edksetup.sh
-                make -C edk2/BaseTools -j $NNJOBCOUNT
+                make -C edk2/BaseTools $makejobs
                 # Build it
                 if [ "$NNARCH" = "i386" ]
                 then
@@ -511,7 +517,7 @@ then
                 cd $ubootdir
                 export CROSS_COMPILE=$NNARCH-linux-gnu-
                 make qemu-${NNARCH}_defconfig
-                make -j $NNJOBCOUNT
+                make $makejobs
                 checkerr $? "unable to build U-Boot"
                 cp $ubootdir/u-boot $NNBUILDROOT/tools/firmware/u-boot-$NNARCH
                 touch $NNBUILDROOT/tools/firmware/fw${NNARCH}done
@@ -540,9 +546,9 @@ then
         cmake $nnpkgroot -DCMAKE_INSTALL_PREFIX="$NNBUILDROOT/tools" -DCMAKE_BUILD_TYPE=Debug \
               -DBUILD_SHARED_LIBS=OFF -DNNPKG_ENABLE_NLS=OFF $cmakeargs
         checkerr $? "unable to build nnpkg"
-        $cmakegen -j $NNJOBCOUNT
+        $cmakegen $genjobs
         checkerr $? "unable to build nnpkg"
-        $cmakegen install -j $NNJOBCOUNT
+        $cmakegen install $genjobs
         checkerr $? "unable to build nnpkg"
     fi
 elif [ "$component" = "nexnix-sdk" ]
@@ -555,9 +561,9 @@ then
          -DCMAKE_INSTALL_PREFIX=$NNDESTDIR/Programs/SDKs/NexNixSdk/0.0.1 \
          $cmakeargs
     checkerr $? "unable to configure NexNix SDK"
-    $cmakegen -j $NNJOBCOUNT $makeargs
+    $cmakegen $genjobs $makeargs
     checkerr $? "unable to build NexNix SDK"
-    $cmakegen -j $NNJOBCOUNT $makeargs install
+    $cmakegen $genjobs $makeargs install
     checkerr $? "unable to install NexNix SDK"
     # Add to package database
     nnpkg add $NNPKGROOT/NexNixSdk/sdkPackage.conf -c $NNCONFROOT/nnpkg.conf \
@@ -636,9 +642,9 @@ then
         export CROSS_COMPILE=$NNBUILDROOT/tools/$NNTOOLCHAIN/bin/$toolarch-nexnix-
         export PREFIX=/Programs/gnu-efi
         export CFLAGS="-I$NNSOURCEROOT/libraries/libc/include -I$NNSOURCEROOT/libraries/libc/arch/$NNARCH/include"
-        make -j$NNJOBCOUNT
+        make $makejobs
         checkerr $? "unable to build GNU-EFI"
-        make install -j $NNJOBCOUNT
+        make install $makejobs
         checkerr $? "unable to build GNU-EFI"
         nnpkg add $NNPKGROOT/gnu-efi/nnpkg-pkg.conf -c $NNCONFROOT/nnpkg.conf || true
     fi
@@ -0,0 +1,336 @@
+#!/bin/sh
+# perfrun.sh - checks NexNix's boot time and kernel benchmarks for regressions
+# Copyright 2024 The NexNix Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Each configuration is booted headless in QEMU, and its serial log is read for the boot
+# timeline (-boottime) and the kernel's benchmarks (-bench). Images have to be built from a
+# configuration made with -kernelargs "-boottime -bench" for those to show up
+# Results are saved as JSON next to the log, and compared against a saved baseline. Time to
+# the first thread and the median of each benchmark are compared, as those are the least noisy
+
+output="$PWD/output"
+basedir=
+configs=
+threshold=10
+timeout=300
+savebase=0
+emuargs=
+failed=0
+
+# Panics with a message and then exits
+panic()
+{
+    echo "$(basename $0): error: $1"
+    exit 1
+}
+
+# Checks return value and panics if an error occured
+checkerr()
+{
+    # Check if return value is success or not
+    if [ $1 -ne 0 ]
+    then
+        panic "$2"
+    fi
+}
+
+# Finds the argument to a given option
+getoptarg()
+{
+    isdash=$(echo "$1" | awk '/^-/')
+    if [ ! -z "$isdash" ]
+    then
+        panic "option $2 requires an argument"
+    fi
+    # Report it
+    echo "$1"
+}
+
+# Boots the current configuration and saves its serial log to $1
+# Returns 1 if the kernel didn't finish its benchmarks in time
+bootconf()
+{
+    log=$1
+    # Set image
+    if [ "$NNIMGTYPE" = "mbr" ] || [ "$NNIMGTYPE" = "gpt" ]
+    then
+        bootargs="-disk $NNCONFROOT/nndisk.img"
+    elif [ "$NNIMGBOOTMODE" = "isofloppy" ]
+    then
+        bootargs="-cdrom $NNCONFROOT/nncdrom.iso -floppy $NNCONFROOT/nndisk.flp -floppyboot"
+    else
+        bootargs="-cdrom $NNCONFROOT/nncdrom.iso -cdromboot"
+    fi
+    $NNPROJECTROOT/scripts/run.sh -headless $bootargs -fw $NNFIRMWARE $emuargs \
+                                  > $log 2>&1 &
+    emupid=$!
+    # Wait for the kernel to say it's done, or for QEMU to quit
+    waited=0
+    done=0
+    while kill -0 $emupid 2> /dev/null
+    do
+        if grep -q "nexke: bench done" $log
+        then
+            done=1
+            break
+        fi
+        if [ $waited -ge $timeout ]
+        then
+            break
+        fi
+        sleep 1
+        waited=$((waited + 1))
+    done
+    kill $emupid 2> /dev/null
+    wait $emupid 2> /dev/null
+    [ $done -eq 1 ] || grep -q "nexke: bench done" $log
+}
+
+# Turns serial log $1 of configuration $3 into JSON results in $2
+parselog()
+{
+    awk -v config="$3" '
+    BEGIN { nmetrics = 0; intimeline = 0 }
+    { sub(/\r$/, "") }
+    # Boot timeline
+    /^nexke: boot timeline, .* cycles per ms/ { intimeline = 1; timeunit = "ms"; next }
+    /^nexke: boot timeline, cycle counter rate unknown/ {
+        intimeline = 1
+        timeunit = "cycles"
+        next
+    }
+    intimeline && ($1 == "time" || $1 == "cycles") { next }
+    intimeline && /^ +[0-9]/ {
+        phase = $0
+        sub(/^ *[0-9.]+ +\+? *[0-9.]+ +/, "", phase)
+        metrics[nmetrics++] = "boot." phase
+        values["boot." phase] = $1
+        next
+    }
+    intimeline { intimeline = 0 }
+    # Benchmarks
+    /^nexke: bench [^ ]+: / { bench = $3; sub(/:$/, "", bench); next }
+    bench != "" && $1 == "mean" {
+        for (i = 1; i < NF; i += 2)
+        {
+            metrics[nmetrics++] = "bench." bench "." $i
+            values["bench." bench "." $i] = $(i + 1)
+        }
+        benchunit = $NF
+        bench = ""
+        next
+    }
+    END {
+        printf "{\n"
+        printf "    \"config\": \"%s\",\n", config
+        printf "    \"timeunit\": \"%s\",\n", timeunit
+        printf "    \"benchunit\": \"%s\",\n", benchunit
+        printf "    \"metrics\": {\n"
+        for (i = 0; i < nmetrics; ++i)
+        {
+            printf "        \"%s\": %s%s\n", metrics[i], values[metrics[i]],
+                   (i < nmetrics - 1) ? "," : ""
+        }
+        printf "    }\n"
+        printf "}\n"
+    }' $1 > $2
+}
+
+# Compares results $2 against baseline $1, returning 1 if anything regressed
+compare()
+{
+    awk -v threshold=$threshold '
+    {
+        if ($0 !~ /^ *"[^"]*": /)
+            next
+        key = $0
+        sub(/^ *"/, "", key)
+        sub(/".*$/, "", key)
+        val = $0
+        sub(/^ *"[^"]*": */, "", val)
+        sub(/,$/, "", val)
+        gsub(/"/, "", val)
+    }
+    FNR == NR { base[key] = val; next }
+    key == "timeunit" || key == "benchunit" {
+        if ((key in base) && base[key] != val)
+        {
+            printf "  %s changed from %s to %s, save a new baseline\n", key, base[key], val
+            bad = 1
+        }
+        next
+    }
+    key == "boot.first thread" || key ~ /^bench\..*\.p50$/ {
+        if (!(key in base))
+        {
+            printf "  %-36s %14s -> %14s  new\n", key, "", val
+            next
+        }
+        status = "ok"
+        if (val + 0 > base[key] * (1 + threshold / 100))
+        {
+            status = "REGRESSED"
+            bad = 1
+        }
+        printf "  %-36s %14s -> %14s  %s\n", key, base[key], val, status
+    }
+    END { exit bad }' $1 $2
+}
+
+# Runs configuration $1, given as target/conf
+runconf()
+{
+    confscript=$output/conf/$1/nexnix-conf.sh
+    if [ ! -f $confscript ]
+    then
+        echo "$1: configuration doesn't exist"
+        return 1
+    fi
+    . $confscript
+    resdir=$basedir/$1
+    mkdir -p $resdir
+    echo "$1: booting..."
+    bootconf $resdir/serial.log
+    booted=$?
+    parselog $resdir/serial.log $resdir/results.json $1
+    if ! grep -q '"boot.first thread"' $resdir/results.json
+    then
+        echo "$1: no boot timeline in serial log $resdir/serial.log"
+        echo "$1: was the configuration made with -kernelargs \"-boottime -bench\"?"
+        return 1
+    fi
+    if [ $booted -ne 0 ]
+    then
+        echo "$1: benchmarks didn't finish within $timeout seconds"
+        return 1
+    fi
+    if [ $savebase -eq 1 ]
+    then
+        cp $resdir/results.json $resdir/baseline.json
+        echo "$1: saved baseline"
+        return 0
+    fi
+    if [ ! -f $resdir/baseline.json ]
+    then
+        echo "$1: no baseline, run with -savebaseline first"
+        return 1
+    fi
+    compare $resdir/baseline.json $resdir/results.json
+    if [ $? -ne 0 ]
+    then
+        echo "$1: regressed by more than $threshold%"
+        return 1
+    fi
+    echo "$1: ok"
+}
+
+# Go through options
+while [ $# -gt 0 ]
+do
+    case $1 in
+    -help)
+        cat <<HELPEND
+$(basename $0) - checks NexNix's boot time and kernel benchmarks for regressions
+Usage: $0 [-help] [-output dir] [-basedir dir] [-config target/conf]
+          [-threshold percent] [-timeout seconds] [-savebaseline]
+          [-emulator-args args]
+
+Valid arguments:
+  -help
+                        Shows this screen
+  -output dir
+                        Build output directory configurations are in
+                        Default: ./output
+  -basedir dir
+                        Directory results and baselines are kept in
+                        Default: output directory/perf
+  -config target/conf
+                        Configuration to check, e.g., i386-pc/acpi
+                        Can be given more than once
+                        Default: every configuration in the output directory
+  -threshold percent
+                        How much slower than the baseline something can get
+                        Default: 10
+  -timeout seconds
+                        How long to wait for each configuration's benchmarks
+                        Default: 300
+  -savebaseline
+                        Saves the results as the new baseline instead of
+                        comparing against the old one
+  -emulator-args args
+                        Specifies extra arguments to pass to run.sh
+Configurations have to be made with -kernelargs "-boottime -bench" and have
+an image built before they can be checked
+Exits with 1 if any configuration regressed or couldn't be checked
+HELPEND
+        exit 0
+        ;;
+    -output)
+        output=$(getoptarg "$2" "$1")
+        shift 2
+        ;;
+    -basedir)
+        basedir=$(getoptarg "$2" "$1")
+        shift 2
+        ;;
+    -config)
+        configs="$configs $(getoptarg "$2" "$1")"
+        shift 2
+        ;;
+    -threshold)
+        threshold=$(getoptarg "$2" "$1")
+        shift 2
+        ;;
+    -timeout)
+        timeout=$(getoptarg "$2" "$1")
+        shift 2
+        ;;
+    -savebaseline)
+        savebase=1
+        shift
+        ;;
+    -emulator-args)
+        emuargs=$(getoptarg "$2" "$1")
+        shift 2
+        ;;
+    *)
+        panic "invalid argument $1"
+    esac
+done
+
+[ -z "$basedir" ] && basedir=$output/perf
+mkdir -p $basedir
+checkerr $? "unable to create $basedir"
+basedir=$(cd $basedir && pwd)
+
+# Find every configuration if none were given
+if [ -z "$configs" ]
+then
+    for confscript in $output/conf/*/*/nexnix-conf.sh
+    do
+        [ -f $confscript ] || continue
+        confdir=$(dirname $confscript)
+        configs="$configs $(basename $(dirname $confdir))/$(basename $confdir)"
+    done
+    [ -z "$configs" ] && panic "no configurations in $output"
+fi
+
+for config in $configs
+do
+    # Each configuration gets its own environment
+    (runconf $config)
+    [ $? -ne 0 ] && failed=1
+done
+exit $failed
@@ -40,7 +40,7 @@ Usage - $0 [-help]
             [-mem MEGS] [-cpus CPUCOUNT] [-drive DRIVETYPE] [-usbhci HCI]
             [-bus BUS] [-net NETDEV] [-input INPUTDEV] [-display DISPLAYDEV]
             [-sound SOUNDDEV] [-fw FIRMWARE] [-cpu CPU] [-machine MACHINE]
-            [-cdromboot]
+            [-cdromboot] [-headless]
 Valid arguments:
   -help
                         Shows this menu
@@ -94,6 +94,9 @@ Valid arguments:
                         Specifies if system should boot from CDROM
   -floppyboot
                         Specifies if system should boot from a floppy
+  -headless
+                        Runs without a display window, only the serial port
+                        Only has meaning for QEMU emulator
 HELPEND
         exit 0
     ;;
@@ -180,6 +183,10 @@ HELPEND
         shift
         EMU_FLOPPYBOOT=1
     ;;
+    -headless)
+        shift
+        EMU_HEADLESS=1
+    ;;
     *)
         echo "$0: invalid argument $1"
         exit 1
@@ -196,6 +203,7 @@ if [ "$emulator" = "qemu" ]
 then
     QEMUARGS="${QEMUARGS} -serial stdio"
     [ "$EMU_DEBUG" = "1" ] && QEMUARGS="${QEMUARGS} -S -s"
+    [ "$EMU_HEADLESS" = "1" ] && QEMUARGS="${QEMUARGS} -display none"
     [ "$EMU_KVM" = "1" ] && QEMUARGS="${QEMUARGS} -enable-kvm"
     if [ "$NNTARGETCONF" = "acpi-up" ]
     then
@@ -607,8 +615,8 @@ then
     then
         qemuarch="aarch64"
     fi
-    qemu-system-$qemuarch $QEMUARGS
-    exit $?
+    # Replace ourselves so whoever started us can stop QEMU
+    exec qemu-system-$qemuarch $QEMUARGS
 elif [ "$emulator" = "bochs" ]
 then
     cd $NNCONFROOT
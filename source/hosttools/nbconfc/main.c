@@ -0,0 +1,133 @@
+/*
+    main.c - contains entry point to nbconfc
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file main.c
+
+#include <conf.h>
+#include <libnex.h>
+#include <nexboot/nexboot.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// nbconfc parses a nexboot configuration file and writes the binary cache nexboot loads instead
+// of parsing it again at boot. The parser is nexboot's own, so it gets what nexboot would get
+
+// Largest cache that can be written
+#define CACHE_MAX_SZ (1024 * 1024)
+
+// The name of the program
+static const char* progName = NULL;
+
+// The nexboot functions the parser uses
+
+// Reads from the configuration file
+int32_t NbVfsReadFile (NbObject_t* fs, NbFile_t* file, void* buf, uint32_t count)
+{
+    return (int32_t) fread (buf, 1, count, file->internal);
+}
+
+// Logs a parser error
+void NbLogMessage (const char* fmt, int level, ...)
+{
+    va_list ap;
+    va_start (ap, level);
+    vfprintf (stderr, fmt, ap);
+    va_end (ap);
+}
+
+// Reads all of a file
+static void* readFile (const char* name, uint32_t* size)
+{
+    FILE* file = fopen (name, "rb");
+    if (!file)
+        return NULL;
+    fseek (file, 0, SEEK_END);
+    long sz = ftell (file);
+    fseek (file, 0, SEEK_SET);
+    void* buf = malloc (sz + 1);
+    if (!buf || fread (buf, 1, sz, file) != (size_t) sz)
+    {
+        free (buf);
+        fclose (file);
+        return NULL;
+    }
+    fclose (file);
+    *size = sz;
+    return buf;
+}
+
+int main (int argc, char** argv)
+{
+    progName = argv[0];
+    if (argc != 3)
+    {
+        printf ("%s - nexboot configuration compiler\n\
+Usage: %s CONFFILE OUTPUT\n",
+                progName,
+                progName);
+        return 1;
+    }
+    uint32_t srcSize = 0;
+    void* src = readFile (argv[1], &srcSize);
+    if (!src)
+    {
+        fprintf (stderr, "%s: unable to read %s\n", progName, argv[1]);
+        return 1;
+    }
+    // Parse it the way nexboot does, through the file reading path
+    NbFile_t confFile = {0};
+    confFile.size = srcSize;
+    confFile.internal = fopen (argv[1], "rb");
+    if (!confFile.internal)
+    {
+        fprintf (stderr, "%s: unable to read %s\n", progName, argv[1]);
+        return 1;
+    }
+    ConfContext_t ctx = {0};
+    ctx.isFile = true;
+    ctx.confFile = &confFile;
+    ListHead_t* blocks = NbConfParse (&ctx);
+    fclose (confFile.internal);
+    if (!blocks)
+    {
+        fprintf (stderr, "%s: unable to parse %s\n", progName, argv[1]);
+        return 1;
+    }
+    // Write out cache
+    void* cache = malloc (CACHE_MAX_SZ);
+    size_t cacheSz = 0;
+    if (cache)
+        cacheSz = NbConfWriteCache (blocks, src, srcSize, cache, CACHE_MAX_SZ);
+    if (!cacheSz)
+    {
+        fprintf (stderr, "%s: %s is too big to cache\n", progName, argv[1]);
+        return 1;
+    }
+    FILE* out = fopen (argv[2], "wb");
+    if (!out || fwrite (cache, 1, cacheSz, out) != cacheSz)
+    {
+        fprintf (stderr, "%s: unable to write %s\n", progName, argv[2]);
+        return 1;
+    }
+    fclose (out);
+    ListDestroy (blocks);
+    free (cache);
+    free (src);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+    host.h - contains host architecture definitions for nexke code
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file host.h
+
+// This is used as NEXKE_ARCH_HEADER when kernel code is built into a host program. It gives
+// the kernel headers the few architecture types they need, with nothing in them that the host
+// doesn't have. Everything kernel code calls that isn't built with it comes from shim.c
+
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// CPU page size
+#define NEXKE_CPU_PAGESZ     0x1000
+#define NEXKE_CPU_PAGE_SHIFT 12
+
+// PFN map. Nothing in the harness has page structures, this only has to build
+#define NEXKE_PFNMAP_BASE 0
+#define NEXKE_PFNMAP_MAX  0
+
+typedef uint64_t paddr_t;
+typedef uint64_t pte_t;
+
+// Interrupt and thread contexts. Host CPUs never take interrupts or switch threads
+typedef struct _intctx
+{
+    uint64_t intNo;
+} CpuIntContext_t;
+
+#define CPU_CTX_INTNUM(ctx) ((ctx)->intNo)
+
+typedef struct _context
+{
+    uint64_t sp;
+} CpuContext_t;
+
+typedef struct _cputhread
+{
+    int unused;
+} CpuThread_t;
+
+// Architecture part of CCB
+typedef struct _nkarchccb
+{
+    uint64_t timerDeadline;    // Time the fake timer of this CPU is armed for, 0 if none
+} NkArchCcb_t;
+
+// MUL address space
+typedef struct _mmspace
+{
+    int unused;
+} MmMulSpace_t;
+
+// Waits in a spin loop
+// Unlike CPUs, host threads get preempted while holding locks, so this gives up the host CPU
+// every so often, or waiters could spin through the holder's whole time slice
+void hostSpin();
+
+#define CpuSpin() hostSpin()
+
+#endif
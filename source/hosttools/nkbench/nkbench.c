@@ -0,0 +1,840 @@
+/*
+    nkbench.c - contains host checks and benchmarks of nexke code
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file nkbench.c
+
+// The slab allocator, kmalloc, the resource allocator, the time event wheel, LZ4 and red-black
+// trees are built into this program straight from the kernel's sources, on top of the fakes in shim.c. By default it
+// checks that they work, both on one CPU and with threads fighting over them. With -b it times
+// them instead, with 1, 2, 4 and so on threads running as CPUs, so changes to them can be
+// measured and profiled without booting the kernel
+//
+// Usage: nkbench [-v] [-memleak] [-b [-t threads] [-n ops] [benchmark...]]
+
+#define NEXTEST_NAME "nkbench"
+
+#include "nkbench.h"
+#include <nextest.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Check sizes
+#define CHECK_OBJS    4096     // Objects allocated by slab checks
+#define CHECK_ALLOCS  2048     // Allocations made by kmalloc check
+#define CHECK_IDS     1023     // IDs in resource check arena, which end on a chunk boundary
+#define CHECK_EVENTS  512      // Time events registered by time check
+#define CHECK_LZ4_SZ  4096     // Biggest buffer LZ4 check compresses
+#define CHECK_NODES   1024     // Nodes put in tree by red-black tree check
+#define CHECK_THREADS 4        // Threads used by contention checks
+#define CHECK_ROUNDS  20000    // Rounds each contention check thread does
+
+// Default number of operations each benchmark thread does
+#define BENCH_OPS (1 << 20)
+
+// Gets a pseudo random number
+static uint64_t randState = 0x9E3779B97F4A7C15;
+
+static uint64_t randNext()
+{
+    randState ^= randState << 13;
+    randState ^= randState >> 7;
+    randState ^= randState << 17;
+    return randState;
+}
+
+// Gets current time in nanoseconds
+static uint64_t getNs()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Runs func on CPUs 0 to numThreads - 1, each in a thread of its own
+static bool runOnCpus (int numThreads, void* (*func) (void*), void** args)
+{
+    pthread_t threads[NEXKE_MAX_CPUS];
+    for (int i = 0; i < numThreads; ++i)
+    {
+        if (pthread_create (&threads[i], NULL, func, args[i]))
+        {
+            fprintf (stderr, "nkbench: unable to create thread\n");
+            return false;
+        }
+    }
+    for (int i = 0; i < numThreads; ++i)
+        pthread_join (threads[i], NULL);
+    return true;
+}
+
+// Slab checks
+
+static int numCtors = 0;
+static int numDtors = 0;
+
+static void checkCtor (void* obj)
+{
+    ++numCtors;
+}
+
+static void checkDtor (void* obj)
+{
+    ++numDtors;
+}
+
+static void* slabObjs[CHECK_OBJS];
+
+// Fills every object with its index, then makes sure none of them got overwritten
+static bool checkSlabObjs (SlabCache_t* cache, size_t sz)
+{
+    for (int i = 0; i < CHECK_OBJS; ++i)
+    {
+        if (!slabObjs[i])
+            slabObjs[i] = MmCacheAlloc (cache);
+        if (!slabObjs[i] || ((uintptr_t) slabObjs[i] & (cache->align - 1)))
+            return false;
+        memset (slabObjs[i], i & 0xFF, sz);
+    }
+    for (int i = 0; i < CHECK_OBJS; ++i)
+    {
+        for (size_t j = 0; j < sz; ++j)
+        {
+            if (((uint8_t*) slabObjs[i])[j] != (i & 0xFF))
+                return false;
+        }
+    }
+    return true;
+}
+
+static int checkSlab()
+{
+    // Magazine cache. Free half the objects and reallocate them so the magazines get used
+    SlabCache_t* cache = MmCacheCreate (48, "check", MM_TAG_CORE, 16, 0);
+    TEST_BOOL (cache, "slab create");
+    memset (slabObjs, 0, sizeof (slabObjs));
+    TEST_BOOL (checkSlabObjs (cache, 48), "slab alloc");
+    for (int i = 0; i < CHECK_OBJS; i += 2)
+    {
+        MmCacheFree (cache, slabObjs[i]);
+        slabObjs[i] = NULL;
+    }
+    TEST_BOOL (checkSlabObjs (cache, 48), "slab realloc");
+    for (int i = 0; i < CHECK_OBJS; ++i)
+        MmCacheFree (cache, slabObjs[i]);
+    SlabCacheStats_t stats;
+    MmCacheGetStats (cache, &stats);
+    TEST_BOOL (stats.allocs == stats.frees, "slab stats");
+    TEST_BOOL (stats.allocs == CHECK_OBJS + CHECK_OBJS / 2, "slab alloc count");
+    TEST_BOOL (stats.magAllocs, "slab magazines");
+    MmCacheDestroy (cache);
+    // Without magazines, every slab should go back once everything is freed
+    cache = MmCacheCreate (64, "check", MM_TAG_CORE, 0, SLAB_CACHE_NO_MAG);
+    TEST_BOOL (cache, "slab create");
+    size_t pages = hostGetKvPages();
+    memset (slabObjs, 0, sizeof (slabObjs));
+    TEST_BOOL (checkSlabObjs (cache, 64), "slab no magazine alloc");
+    for (int i = 0; i < CHECK_OBJS; ++i)
+        MmCacheFree (cache, slabObjs[i]);
+    MmCacheReap (cache);
+    TEST_BOOL (hostGetKvPages() == pages, "slab reap");
+    MmCacheDestroy (cache);
+    // Objects too big to keep slab structures with them
+    cache = MmCacheCreateCtor (1000, "check", MM_TAG_CORE, 0, 0, checkCtor, checkDtor);
+    TEST_BOOL (cache, "slab create");
+    memset (slabObjs, 0, sizeof (slabObjs));
+    TEST_BOOL (checkSlabObjs (cache, 1000), "slab large alloc");
+    for (int i = 0; i < CHECK_OBJS; ++i)
+        TEST_BOOL (MmGetCacheFromPtr (slabObjs[i] + 999) == cache, "slab object cache");
+    for (int i = 0; i < CHECK_OBJS; ++i)
+        MmCacheFree (cache, slabObjs[i]);
+    MmCacheDestroy (cache);
+    TEST_BOOL (numCtors >= CHECK_OBJS && numCtors == numDtors, "slab constructors");
+    // Bulk allocations. Some objects are freed singly first so magazines get loaded, and the
+    // reallocation comes from magazines and slabs both
+    static void* bulkObjs[CHECK_OBJS / 2];
+    cache = MmCacheCreate (48, "check", MM_TAG_CORE, 0, 0);
+    TEST_BOOL (cache, "slab create");
+    TEST_BOOL (MmCacheAllocBulk (cache, CHECK_OBJS, slabObjs) == CHECK_OBJS, "slab bulk alloc");
+    TEST_BOOL (checkSlabObjs (cache, 48), "slab bulk objects");
+    for (int i = 0; i < CHECK_OBJS / 2; ++i)
+        bulkObjs[i] = slabObjs[i * 2];
+    for (int i = 0; i < CHECK_OBJS / 4; ++i)
+        MmCacheFree (cache, bulkObjs[i]);
+    MmCacheFreeBulk (cache, CHECK_OBJS / 4, bulkObjs + CHECK_OBJS / 4);
+    TEST_BOOL (MmCacheAllocBulk (cache, CHECK_OBJS / 2, bulkObjs) == CHECK_OBJS / 2,
+               "slab bulk realloc");
+    for (int i = 0; i < CHECK_OBJS / 2; ++i)
+        slabObjs[i * 2] = bulkObjs[i];
+    TEST_BOOL (checkSlabObjs (cache, 48), "slab bulk realloc objects");
+    MmCacheFreeBulk (cache, CHECK_OBJS, slabObjs);
+    MmCacheGetStats (cache, &stats);
+    TEST_BOOL (stats.allocs == stats.frees, "slab bulk stats");
+    TEST_BOOL (stats.magAllocs, "slab bulk magazines");
+    MmCacheDestroy (cache);
+    // Caches of the same geometry share slabs, but keep counts of their own
+    cache = MmCacheCreate (200, "check", MM_TAG_CORE, 0, 0);
+    SlabCache_t* other = MmCacheCreate (200, "check other", MM_TAG_CORE, 0, 0);
+    TEST_BOOL (cache && other, "slab create");
+    void* obj = MmCacheAlloc (cache);
+    void* otherObj = MmCacheAlloc (other);
+    TEST_BOOL (obj && otherObj, "slab merged alloc");
+    TEST_BOOL (MmGetCacheFromPtr (obj) == MmGetCacheFromPtr (otherObj), "slab merged cache");
+    MmCacheFree (other, otherObj);
+    MmCacheGetStats (other, &stats);
+    TEST_BOOL (stats.allocs == 1 && stats.frees == 1, "slab merged stats");
+    MmCacheDestroy (other);
+    MmCacheGetStats (cache, &stats);
+    TEST_BOOL (stats.allocs == 1 && !stats.frees, "slab merged stats");
+    MmCacheFree (cache, obj);
+    MmCacheDestroy (cache);
+    return 0;
+}
+
+// kmalloc check
+
+static int checkMalloc()
+{
+    static void* ptrs[CHECK_ALLOCS];
+    static size_t sizes[CHECK_ALLOCS];
+    MmTagCount_t before, after;
+    MmGetTagCount (MM_TAG_CORE, &before);
+    for (int i = 0; i < CHECK_ALLOCS; ++i)
+    {
+        // Mostly small allocations, with some too big for the size classes
+        sizes[i] = (randNext() % 8) ? (randNext() % 8192) + 1 : (randNext() % 65536) + 1;
+        ptrs[i] = kmalloc (sizes[i], MM_TAG_CORE);
+        TEST_BOOL (ptrs[i], "kmalloc");
+        memset (ptrs[i], i & 0xFF, sizes[i]);
+    }
+    for (int i = 0; i < CHECK_ALLOCS; ++i)
+    {
+        for (size_t j = 0; j < sizes[i]; ++j)
+            TEST_BOOL (((uint8_t*) ptrs[i])[j] == (i & 0xFF), "kmalloc overlap");
+    }
+    // Free in a random order, half without giving the size
+    for (int i = CHECK_ALLOCS - 1; i > 0; --i)
+    {
+        int j = randNext() % (i + 1);
+        void* ptr = ptrs[i];
+        size_t sz = sizes[i];
+        ptrs[i] = ptrs[j], sizes[i] = sizes[j];
+        ptrs[j] = ptr, sizes[j] = sz;
+    }
+    for (int i = 0; i < CHECK_ALLOCS; ++i)
+    {
+        if (i % 2)
+            kfreePtr (ptrs[i], MM_TAG_CORE);
+        else
+            kfree (ptrs[i], sizes[i], MM_TAG_CORE);
+    }
+    MmGetTagCount (MM_TAG_CORE, &after);
+    TEST_BOOL (after.bytes == before.bytes && after.objs == before.objs, "kmalloc tag");
+    return 0;
+}
+
+// Resource check
+
+static int checkResource()
+{
+    static bool used[CHECK_IDS + 1];
+    static id_t ids[CHECK_IDS];
+    NkResArena_t* arena = NkCreateResource ("check", 1, CHECK_IDS);
+    TEST_BOOL (arena, "resource create");
+    // Take every ID twice over, freeing them in between
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        memset (used, 0, sizeof (used));
+        for (int i = 0; i < CHECK_IDS; ++i)
+        {
+            ids[i] = NkAllocResource (arena);
+            TEST_BOOL (ids[i] >= 1 && ids[i] <= CHECK_IDS && !used[ids[i]], "resource alloc");
+            used[ids[i]] = true;
+        }
+        TEST_BOOL (NkAllocResource (arena) == -1, "resource exhaust");
+        for (int i = 0; i < CHECK_IDS; ++i)
+            NkFreeResource (arena, ids[i]);
+    }
+    // A range shouldn't be handed out again until it's freed
+    id_t range = NkAllocResourceRange (arena, 32);
+    TEST_BOOL (range >= 1 && range + 31 <= CHECK_IDS, "resource range");
+    int numIds = 0;
+    id_t id = 0;
+    while ((id = NkAllocResource (arena)) != -1)
+    {
+        TEST_BOOL (id < range || id >= range + 32, "resource range overlap");
+        ids[numIds++] = id;
+    }
+    TEST_BOOL (numIds == CHECK_IDS - 32, "resource range count");
+    NkFreeResourceRange (arena, range, 32);
+    for (int i = 0; i < numIds; ++i)
+        NkFreeResource (arena, ids[i]);
+    NkDestroyResource (arena);
+    return 0;
+}
+
+// Time event check
+
+typedef struct _checkevt
+{
+    NkTimeEvent_t* event;
+    ktime_t deadline;    // Deadline when it was registered
+    ktime_t firedAt;     // Time it went off
+    int fired;           // Number of times it went off
+    int limit;           // Times a periodic event goes off before it's stopped
+} checkEvt_t;
+
+static checkEvt_t checkEvts[CHECK_EVENTS];
+
+static void checkTimeCb (NkTimeEvent_t* event, void* arg)
+{
+    checkEvt_t* evt = arg;
+    evt->firedAt = hostGetTime();
+    ++evt->fired;
+    if (evt->limit && evt->fired == evt->limit)
+        NkTimeStopPeriodic (event);
+}
+
+static int checkTime()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    ktime_t start = hostGetTime();
+    // Spread deadlines over every level of the wheel. Every eighth one gets taken off again,
+    // every other one gets moved, and the first one is periodic
+    for (int i = 0; i < CHECK_EVENTS; ++i)
+    {
+        checkEvt_t* evt = &checkEvts[i];
+        memset (evt, 0, sizeof (checkEvt_t));
+        evt->event = NkTimeNewEvent();
+        TEST_BOOL (evt->event, "time event alloc");
+        NkTimeSetCbEvent (evt->event, checkTimeCb, evt);
+        ktime_t delta = randNext() % (1ULL << (20 + (i % 4) * 6 + 6));
+        NkTimeRegEvent (evt->event, delta, (i == 0) ? NK_TIME_REG_PERIODIC : 0);
+        if (i == 0)
+            evt->limit = 5;
+        else if (!(i % 8))
+            NkTimeDeRegEvent (evt->event);
+        else if (!(i % 2))
+            NkTimeRegEvent (evt->event, delta / 2, NK_TIME_REG_DEREG);
+        evt->deadline = evt->event->deadline;
+        TEST_BOOL (ccb->nextDeadline, "time arm");
+    }
+    // Run the timer until nothing is left
+    ktime_t last = start;
+    while (ccb->nextDeadline)
+    {
+        TEST_BOOL (ccb->nextDeadline >= last, "time order");
+        TEST_BOOL (ccb->archCcb.timerDeadline == ccb->nextDeadline, "time timer");
+        last = ccb->nextDeadline;
+        hostSetTime (last);
+        NkTimeHandler();
+    }
+    for (int i = 0; i < CHECK_EVENTS; ++i)
+    {
+        checkEvt_t* evt = &checkEvts[i];
+        if (i == 0)
+        {
+            TEST_BOOL (evt->fired == evt->limit, "time periodic");
+        }
+        else if (!(i % 8))
+        {
+            TEST_BOOL (!evt->fired, "time deregister");
+        }
+        else
+        {
+            TEST_BOOL (evt->fired == 1 && evt->firedAt == evt->deadline, "time deadline");
+        }
+        NkTimeFreeEvent (evt->event);
+    }
+    return 0;
+}
+
+// LZ4 check
+// Buffers go from all the same to all random, and from empty to a page
+
+static int checkLz4()
+{
+    static uint8_t src[CHECK_LZ4_SZ];
+    static uint8_t comp[CHECK_LZ4_SZ * 2];
+    static uint8_t out[CHECK_LZ4_SZ];
+    static uint32_t table[NK_LZ4_TABLE_SZ];
+    for (int i = 0; i < 64; ++i)
+    {
+        size_t sz = (i < 32) ? i : CHECK_LZ4_SZ - (randNext() % 64);
+        // Runs of a few symbols, with a random byte thrown in as often as i says
+        for (size_t j = 0; j < sz; ++j)
+            src[j] = (randNext() % 64 < (i % 16) * 4) ? randNext() : "abcd"[(j / 7) % 4];
+        size_t compSz = NkLz4Compress (src, sz, comp, sizeof (comp), table);
+        TEST_BOOL (compSz, "lz4 compress");
+        TEST_BOOL (NkLz4Decompress (comp, compSz, out, sz) == sz, "lz4 decompress size");
+        TEST_BOOL (!memcmp (src, out, sz), "lz4 round trip");
+        // Output that doesn't fit is refused, not overrun
+        if (compSz > 1)
+        {
+            memset (comp, 0xAA, sizeof (comp));
+            TEST_BOOL (!NkLz4Compress (src, sz, comp, compSz - 1, table), "lz4 fit");
+            TEST_BOOL (comp[compSz - 1] == 0xAA, "lz4 overrun");
+        }
+    }
+    // Corrupt blocks are caught, not followed
+    uint8_t bad[] = {0x1F, 'a', 0xFF, 0xFF};
+    TEST_BOOL (NkLz4Decompress (bad, sizeof (bad), out, sizeof (out)) == -1, "lz4 bad offset");
+    return 0;
+}
+
+// Red-black tree check
+// Random keys go in and come out in random order, with the tree checked as it changes
+
+typedef struct _checknode
+{
+    NkRbNode_t node;
+    uint64_t key;
+    bool inTree;
+} CheckNode_t;
+
+// Gets black height of a subtree, or -1 if it's broken
+static int checkRbHeight (NkRbNode_t* node, NkRbNode_t* parent)
+{
+    if (!node)
+        return 1;
+    if (node->parent != parent || (node->red && parent && parent->red))
+        return -1;
+    int left = checkRbHeight (node->left, node);
+    int right = checkRbHeight (node->right, node);
+    if (left < 0 || left != right)
+        return -1;
+    return left + !node->red;
+}
+
+// Checks tree holds count nodes in order
+static bool checkRbValid (NkRbTree_t* tree, int count)
+{
+    if ((tree->root && tree->root->red) || checkRbHeight (tree->root, NULL) < 0)
+        return false;
+    NkRbNode_t* first = tree->root;
+    while (first && first->left)
+        first = first->left;
+    if (NkRbFirst (tree) != first)
+        return false;
+    uint64_t last = 0;
+    for (NkRbNode_t* iter = first; iter; iter = NkRbNext (iter))
+    {
+        uint64_t key = LINK_CONTAINER (iter, CheckNode_t, node)->key;
+        if (key < last)
+            return false;
+        last = key;
+        --count;
+    }
+    return !count;
+}
+
+// Puts node in tree by key, equal keys going after each other
+static void checkRbAdd (NkRbTree_t* tree, CheckNode_t* node)
+{
+    NkRbNode_t** link = &tree->root;
+    NkRbNode_t* parent = NULL;
+    bool leftmost = true;
+    while (*link)
+    {
+        parent = *link;
+        if (node->key < LINK_CONTAINER (parent, CheckNode_t, node)->key)
+            link = &parent->left;
+        else
+        {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    NkRbLink (&node->node, parent, link);
+    NkRbInsert (tree, &node->node, leftmost);
+    node->inTree = true;
+}
+
+static int checkRbTree()
+{
+    static CheckNode_t nodes[CHECK_NODES];
+    NkRbTree_t tree;
+    NkRbInit (&tree);
+    int count = 0;
+    for (int i = 0; i < CHECK_NODES; ++i)
+    {
+        // Few distinct keys, so there are plenty of ties
+        nodes[i].key = randNext() % (CHECK_NODES / 4);
+        checkRbAdd (&tree, &nodes[i]);
+        ++count;
+        if (!(i % 64))
+            TEST_BOOL (checkRbValid (&tree, count), "rbtree insert");
+    }
+    TEST_BOOL (checkRbValid (&tree, count), "rbtree insert");
+    // Take out a random half, then put them back, then empty it from the front like a queue
+    for (int i = 0; i < CHECK_NODES; ++i)
+    {
+        CheckNode_t* node = &nodes[randNext() % CHECK_NODES];
+        if (!node->inTree)
+            continue;
+        NkRbRemove (&tree, &node->node);
+        node->inTree = false;
+        --count;
+        if (!(i % 64))
+            TEST_BOOL (checkRbValid (&tree, count), "rbtree remove");
+    }
+    TEST_BOOL (checkRbValid (&tree, count), "rbtree remove");
+    for (int i = 0; i < CHECK_NODES; ++i)
+    {
+        if (nodes[i].inTree)
+            continue;
+        nodes[i].key = randNext() % (CHECK_NODES / 4);
+        checkRbAdd (&tree, &nodes[i]);
+        ++count;
+    }
+    TEST_BOOL (checkRbValid (&tree, count), "rbtree reinsert");
+    while (NkRbFirst (&tree))
+    {
+        NkRbRemove (&tree, NkRbFirst (&tree));
+        --count;
+        if (!(count % 64))
+            TEST_BOOL (checkRbValid (&tree, count), "rbtree drain");
+    }
+    TEST_BOOL (!tree.root && !count, "rbtree empty");
+    return 0;
+}
+
+// Contention checks
+// Each thread writes its own pattern into what it's given, so anything handed out to two
+// threads at once gets caught
+
+typedef struct _checkArg
+{
+    int cpu;
+    SlabCache_t* cache;
+    NkResArena_t* arena;
+    uint8_t* owners;    // CPU that holds each ID, plus one
+    bool ok;
+} checkArg_t;
+
+static void* checkContendThread (void* data)
+{
+    checkArg_t* arg = data;
+    hostStartCpu (arg->cpu);
+    uint8_t pattern = arg->cpu + 1;
+    void* objs[64];
+    id_t ids[64];
+    for (int round = 0; round < CHECK_ROUNDS; ++round)
+    {
+        int num = (round % 64) + 1;
+        for (int i = 0; i < num; ++i)
+        {
+            objs[i] = MmCacheAlloc (arg->cache);
+            ids[i] = NkAllocResource (arg->arena);
+            if (!objs[i] || ids[i] == -1)
+                goto fail;
+            memset (objs[i], pattern, 128);
+            uint8_t owner = 0;
+            if (!__atomic_compare_exchange_n (&arg->owners[ids[i]],
+                                              &owner,
+                                              pattern,
+                                              false,
+                                              __ATOMIC_ACQ_REL,
+                                              __ATOMIC_RELAXED))
+            {
+                goto fail;
+            }
+        }
+        for (int i = 0; i < num; ++i)
+        {
+            for (int j = 0; j < 128; ++j)
+            {
+                if (((uint8_t*) objs[i])[j] != pattern)
+                    goto fail;
+            }
+            __atomic_store_n (&arg->owners[ids[i]], 0, __ATOMIC_RELEASE);
+            NkFreeResource (arg->arena, ids[i]);
+            MmCacheFree (arg->cache, objs[i]);
+        }
+    }
+    arg->ok = true;
+    return NULL;
+fail:
+    arg->ok = false;
+    return NULL;
+}
+
+static int checkContend()
+{
+    static uint8_t owners[CHECK_IDS + 1];
+    checkArg_t args[CHECK_THREADS];
+    void* argPtrs[CHECK_THREADS];
+    SlabCache_t* cache = MmCacheCreate (128, "check", MM_TAG_CORE, 0, 0);
+    NkResArena_t* arena = NkCreateResource ("check", 1, CHECK_IDS);
+    TEST_BOOL (cache && arena, "contend create");
+    memset (owners, 0, sizeof (owners));
+    for (int i = 0; i < CHECK_THREADS; ++i)
+    {
+        args[i] = (checkArg_t){.cpu = i, .cache = cache, .arena = arena, .owners = owners};
+        argPtrs[i] = &args[i];
+    }
+    TEST_BOOL (runOnCpus (CHECK_THREADS, checkContendThread, argPtrs), "contend threads");
+    for (int i = 0; i < CHECK_THREADS; ++i)
+        TEST_BOOL (args[i].ok, "contend");
+    SlabCacheStats_t stats;
+    MmCacheGetStats (cache, &stats);
+    TEST_BOOL (stats.allocs == stats.frees, "contend slab stats");
+    NkDestroyResource (arena);
+    MmCacheDestroy (cache);
+    return 0;
+}
+
+// Benchmarks
+
+typedef struct _bench
+{
+    const char* name;        // Name to pick it with
+    const char* desc;        // What each operation is
+    void (*setup)();         // Sets up shared state before threads start
+    void (*run) (long);      // Does ops operations on the calling CPU
+    void (*cleanup)();       // Tears down shared state
+} bench_t;
+
+static SlabCache_t* benchCache = NULL;
+static NkResArena_t* benchArena = NULL;
+
+static void benchSlabSetup()
+{
+    benchCache = MmCacheCreate (64, "bench", MM_TAG_CORE, 0, 0);
+}
+
+static void benchSlabNoMagSetup()
+{
+    benchCache = MmCacheCreate (64, "bench", MM_TAG_CORE, 0, SLAB_CACHE_NO_MAG);
+}
+
+static void benchSlabCleanup()
+{
+    MmCacheDestroy (benchCache);
+}
+
+static void benchSlabRun (long ops)
+{
+    for (long i = 0; i < ops; ++i)
+        MmCacheFree (benchCache, MmCacheAlloc (benchCache));
+}
+
+// Allocates objects in bursts, so the depot and slab layers get used
+static void benchSlabBurstRun (long ops)
+{
+    void* objs[256];
+    for (long i = 0; i < ops; i += 256)
+    {
+        for (int j = 0; j < 256; ++j)
+            objs[j] = MmCacheAlloc (benchCache);
+        for (int j = 0; j < 256; ++j)
+            MmCacheFree (benchCache, objs[j]);
+    }
+}
+
+// Same as bursts, but with the bulk interfaces
+static void benchSlabBulkRun (long ops)
+{
+    void* objs[256];
+    for (long i = 0; i < ops; i += 256)
+    {
+        MmCacheAllocBulk (benchCache, 256, objs);
+        MmCacheFreeBulk (benchCache, 256, objs);
+    }
+}
+
+static void benchMallocRun (long ops)
+{
+    for (long i = 0; i < ops; ++i)
+    {
+        size_t sz = 16 << (i % 8);
+        kfree (kmalloc (sz, MM_TAG_CORE), sz, MM_TAG_CORE);
+    }
+}
+
+static void benchResSetup()
+{
+    benchArena = NkCreateResource ("bench", 1, 1 << 20);
+}
+
+static void benchResCleanup()
+{
+    NkDestroyResource (benchArena);
+}
+
+static void benchResRun (long ops)
+{
+    for (long i = 0; i < ops; ++i)
+        NkFreeResource (benchArena, NkAllocResource (benchArena));
+}
+
+// Registers and takes off an event on this CPU's wheel
+static void benchTimeRun (long ops)
+{
+    NkTimeEvent_t* event = NkTimeNewEvent();
+    NkTimeSetCbEvent (event, NULL, NULL);
+    for (long i = 0; i < ops; ++i)
+    {
+        NkTimeRegEvent (event, ((i % 64) + 1) << 20, 0);
+        NkTimeDeRegEvent (event);
+    }
+    NkTimeFreeEvent (event);
+}
+
+static bench_t benches[] = {
+    {"slab", "cache alloc and free", benchSlabSetup, benchSlabRun, benchSlabCleanup},
+    {"slab-burst", "cache alloc and free in bursts", benchSlabSetup, benchSlabBurstRun,
+     benchSlabCleanup},
+    {"slab-bulk", "cache bulk alloc and free in bursts", benchSlabSetup, benchSlabBulkRun,
+     benchSlabCleanup},
+    {"slab-nomag", "cache alloc and free without magazines", benchSlabNoMagSetup, benchSlabRun,
+     benchSlabCleanup},
+    {"kmalloc", "kmalloc and kfree", NULL, benchMallocRun, NULL},
+    {"resource", "resource alloc and free", benchResSetup, benchResRun, benchResCleanup},
+    {"time", "time event register and deregister", NULL, benchTimeRun, NULL},
+};
+
+#define NUM_BENCHES (sizeof (benches) / sizeof (bench_t))
+
+typedef struct _benchArg
+{
+    int cpu;
+    bench_t* bench;
+    long ops;
+    pthread_barrier_t* barrier;
+    uint64_t time;    // Nanoseconds the thread took
+} benchArg_t;
+
+static void* benchThread (void* data)
+{
+    benchArg_t* arg = data;
+    hostStartCpu (arg->cpu);
+    pthread_barrier_wait (arg->barrier);
+    uint64_t start = getNs();
+    arg->bench->run (arg->ops);
+    arg->time = getNs() - start;
+    return NULL;
+}
+
+// Runs a benchmark with numThreads threads and prints results
+static bool runBench (bench_t* bench, int numThreads, long ops)
+{
+    benchArg_t args[NEXKE_MAX_CPUS];
+    void* argPtrs[NEXKE_MAX_CPUS];
+    pthread_barrier_t barrier;
+    pthread_barrier_init (&barrier, NULL, numThreads);
+    if (bench->setup)
+        bench->setup();
+    for (int i = 0; i < numThreads; ++i)
+    {
+        args[i] = (benchArg_t){.cpu = i, .bench = bench, .ops = ops, .barrier = &barrier};
+        argPtrs[i] = &args[i];
+    }
+    bool res = runOnCpus (numThreads, benchThread, argPtrs);
+    pthread_barrier_destroy (&barrier);
+    if (bench->cleanup)
+        bench->cleanup();
+    if (!res)
+        return false;
+    // The slowest thread decides how long the whole thing took
+    uint64_t time = 0;
+    for (int i = 0; i < numThreads; ++i)
+    {
+        if (args[i].time > time)
+            time = args[i].time;
+    }
+    printf ("%-12s %3d threads %10.1f ns/op %10.2f Mops/s\n",
+            bench->name,
+            numThreads,
+            (double) time / ops,
+            (double) ops * numThreads * 1000 / time);
+    return true;
+}
+
+static void usage()
+{
+    printf ("Usage: nkbench [-v] [-memleak] [-b [-t threads] [-n ops] [benchmark...]]\n");
+    printf ("Benchmarks:\n");
+    for (size_t i = 0; i < NUM_BENCHES; ++i)
+        printf ("  %-12s %s\n", benches[i].name, benches[i].desc);
+}
+
+int main (int argc, char** argv)
+{
+    bool bench = false;
+    int maxThreads = (int) sysconf (_SC_NPROCESSORS_ONLN);
+    long ops = BENCH_OPS;
+    const char* names[NUM_BENCHES];
+    int numNames = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp (argv[i], "-v"))
+            hostVerbose = true;
+        else if (!strcmp (argv[i], "-b"))
+            bench = true;
+        else if (!strcmp (argv[i], "-t") && i + 1 < argc)
+            maxThreads = atoi (argv[++i]);
+        else if (!strcmp (argv[i], "-n") && i + 1 < argc)
+            ops = atol (argv[++i]);
+        else if (!strcmp (argv[i], "-memleak"))
+            ;    // Read by kernel code
+        else if (argv[i][0] != '-' && numNames < (int) NUM_BENCHES)
+            names[numNames++] = argv[i];
+        else
+        {
+            usage();
+            return 1;
+        }
+    }
+    if (maxThreads < 1)
+        maxThreads = 1;
+    if (maxThreads > NEXKE_MAX_CPUS)
+        maxThreads = NEXKE_MAX_CPUS;
+    if (ops < 256)
+        ops = 256;
+    hostInit (argc, argv);
+    if (!bench)
+    {
+        if (checkSlab() || checkMalloc() || checkResource() || checkTime() || checkLz4() ||
+            checkRbTree() || checkContend())
+        {
+            return 1;
+        }
+        MmSlabReap();
+        if (NkReadArg ("-memleak"))
+            MmTagDump();
+        printf ("nkbench: all checks passed\n");
+        return 0;
+    }
+    for (size_t i = 0; i < NUM_BENCHES; ++i)
+    {
+        bool run = !numNames;
+        for (int j = 0; j < numNames; ++j)
+            run |= !strcmp (names[j], benches[i].name);
+        if (!run)
+            continue;
+        for (int threads = 1; threads <= maxThreads; threads *= 2)
+        {
+            if (!runBench (&benches[i], threads, ops))
+                return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+/*
+    nkbench.h - contains host harness for nexke code
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file nkbench.h
+
+#ifndef _NKBENCH_H
+#define _NKBENCH_H
+
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/// Whether kernel debug messages get printed
+extern bool hostVerbose;
+
+/// Sets up the fake kernel and initializes the kernel code built into us
+/// The calling thread becomes the first CPU. Kernel arguments are taken from argv
+void hostInit (int argc, char** argv);
+
+/// Makes the calling thread run as CPU cpuNum, so it can call into kernel code
+/// A CPU must only be run by one thread at a time. Returns the CCB of the CPU
+NkCcb_t* hostStartCpu (int cpuNum);
+
+/// Gets the time of the fake clock
+ktime_t hostGetTime();
+
+/// Sets the time of the fake clock. Nothing happens until NkTimeHandler is called
+void hostSetTime (ktime_t time);
+
+/// Gets the number of pages allocated from fake kernel memory
+size_t hostGetKvPages();
+
+#endif
@@ -0,0 +1,356 @@
+/*
+    shim.c - contains fake kernel services for nexke code on the host
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file shim.c
+
+// Kernel code built into the harness runs as it would in the kernel, locks and all. What it
+// calls outside of itself is faked here:
+// Each thread that calls into kernel code runs as a CPU, with a CCB of its own
+// Kernel memory comes from one big reservation, handed out in power of two blocks aligned to
+// their size, so slabs can be found by rounding down like they can in the kernel
+// The clock only moves when the harness sets it, and each CPU's timer just records the time it
+// was armed for, so time events can be driven step by step
+// There is no scheduler and no interrupts. IPLs are still tracked so imbalances are caught
+
+#include "nkbench.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <nexke/task.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+bool hostVerbose = false;
+
+// Kernel arguments
+static int hostArgc = 0;
+static char** hostArgv = NULL;
+
+// CPUs
+static NkCcb_t hostCcbs[NEXKE_MAX_CPUS];
+static __thread NkCcb_t* hostCcb = NULL;
+
+// Fake kernel memory
+#define HOST_KV_SIZE   (1ULL << 30)    // Size of reservation
+#define HOST_KV_ORDERS 16              // Largest block is 2 ^ (HOST_KV_ORDERS - 1) pages
+
+// What is known about each page
+typedef struct _hostKvPage
+{
+    void* owner;           // Owner of the region the page is in
+    uint32_t numPages;     // Pages asked for, in the first page of a region
+    uint8_t order;         // Order of the block the page is in
+} hostKvPage_t;
+
+static uint8_t* hostKvBase = NULL;
+static size_t hostKvNext = 0;                  // Offset of memory that was never handed out
+static hostKvPage_t* hostKvPageInfo = NULL;    // Info of each page
+static void* hostKvFree[HOST_KV_ORDERS];       // Freed blocks of each order
+static size_t hostKvPages = 0;                 // Pages allocated
+static pthread_mutex_t hostKvLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Fake clock and timer
+static ktime_t hostTime = 0;
+
+static ktime_t hostClockGetTime()
+{
+    return __atomic_load_n (&hostTime, __ATOMIC_ACQUIRE);
+}
+
+static void hostClockPoll (ktime_t time)
+{
+    __atomic_fetch_add (&hostTime, time, __ATOMIC_ACQ_REL);
+}
+
+static void hostTimerArm (ktime_t delta)
+{
+    CpuGetCcb()->archCcb.timerDeadline = hostClockGetTime() + delta;
+}
+
+static PltHwClock_t hostClock = {.type = PLT_CLOCK_GENERIC,
+                                 .precision = 1,
+                                 .getTime = hostClockGetTime,
+                                 .poll = hostClockPoll};
+
+static PltHwTimer_t hostTimer = {.type = PLT_TIMER_GENERIC,
+                                 .precision = 1,
+                                 .maxInterval = UINT64_MAX,
+                                 .armTimer = hostTimerArm};
+
+static NkPlatform_t hostPlatform = {.clock = &hostClock, .timer = &hostTimer};
+
+ktime_t hostGetTime()
+{
+    return hostClockGetTime();
+}
+
+void hostSetTime (ktime_t time)
+{
+    __atomic_store_n (&hostTime, time, __ATOMIC_RELEASE);
+}
+
+NkCcb_t* hostStartCpu (int cpuNum)
+{
+    assert (cpuNum < NEXKE_MAX_CPUS);
+    hostCcb = &hostCcbs[cpuNum];
+    return hostCcb;
+}
+
+size_t hostGetKvPages()
+{
+    pthread_mutex_lock (&hostKvLock);
+    size_t pages = hostKvPages;
+    pthread_mutex_unlock (&hostKvLock);
+    return pages;
+}
+
+void hostInit (int argc, char** argv)
+{
+    hostArgc = argc;
+    hostArgv = argv;
+    // Reserve kernel memory. Pages only get backed when they're touched
+    // Anonymous mappings aren't in POSIX, and the kernel headers clash with the host's when
+    // more than POSIX is asked for, so map /dev/zero instead
+    int fd = open ("/dev/zero", O_RDWR);
+    hostKvBase = mmap (NULL, HOST_KV_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (fd != -1)
+        close (fd);
+    hostKvPageInfo = calloc (HOST_KV_SIZE >> NEXKE_CPU_PAGE_SHIFT, sizeof (hostKvPage_t));
+    if (hostKvBase == MAP_FAILED || !hostKvPageInfo)
+    {
+        fprintf (stderr, "nkbench: unable to reserve kernel memory\n");
+        exit (1);
+    }
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+    {
+        hostCcbs[i].self = &hostCcbs[i];
+        hostCcbs[i].cpuNum = i;
+        hostCcbs[i].curIpl = PLT_IPL_LOW;
+    }
+    hostStartCpu (0);
+    // Bring up kernel code in the order the kernel does
+    MmSlabBootstrap();
+    MmInitTags();
+    MmMallocInit();
+    NkInitResource();
+    NkInitTime();
+    for (int i = 1; i < NEXKE_MAX_CPUS; ++i)
+        NkInitTimeCpu (&hostCcbs[i]);
+}
+
+// Kernel memory
+
+void* MmAllocKvRegion (size_t numPages, int flags)
+{
+    int order = 0;
+    while ((1ULL << order) < numPages)
+        ++order;
+    if (order >= HOST_KV_ORDERS)
+        return NULL;
+    size_t blockSz = (size_t) NEXKE_CPU_PAGESZ << order;
+    pthread_mutex_lock (&hostKvLock);
+    void* block = hostKvFree[order];
+    if (block)
+        hostKvFree[order] = *((void**) block);
+    else
+    {
+        // Carve a new block out of the reservation
+        size_t off = (hostKvNext + blockSz - 1) & ~(blockSz - 1);
+        if (off + blockSz > HOST_KV_SIZE)
+        {
+            pthread_mutex_unlock (&hostKvLock);
+            return NULL;
+        }
+        hostKvNext = off + blockSz;
+        block = hostKvBase + off;
+        for (size_t i = 0; i < (1ULL << order); ++i)
+            hostKvPageInfo[(off >> NEXKE_CPU_PAGE_SHIFT) + i].order = order;
+    }
+    hostKvPageInfo[((uint8_t*) block - hostKvBase) >> NEXKE_CPU_PAGE_SHIFT].numPages = numPages;
+    hostKvPages += 1ULL << order;
+    pthread_mutex_unlock (&hostKvLock);
+    return block;
+}
+
+void MmFreeKvRegion (void* mem)
+{
+    // Slabs are freed by their colored base, so find the block mem is in
+    size_t off = (uint8_t*) mem - hostKvBase;
+    assert (off < hostKvNext);
+    int order = hostKvPageInfo[off >> NEXKE_CPU_PAGE_SHIFT].order;
+    void* block = hostKvBase + (off & ~(((size_t) NEXKE_CPU_PAGESZ << order) - 1));
+    pthread_mutex_lock (&hostKvLock);
+    *((void**) block) = hostKvFree[order];
+    hostKvFree[order] = block;
+    hostKvPages -= 1ULL << order;
+    pthread_mutex_unlock (&hostKvLock);
+}
+
+size_t MmGetKvRegionPages (void* mem)
+{
+    size_t off = (uint8_t*) mem - hostKvBase;
+    assert (off < hostKvNext);
+    return hostKvPageInfo[off >> NEXKE_CPU_PAGE_SHIFT].numPages;
+}
+
+void MmSetKvOwner (void* mem, void* owner)
+{
+    size_t page = ((uint8_t*) mem - hostKvBase) >> NEXKE_CPU_PAGE_SHIFT;
+    for (size_t i = 0; i < hostKvPageInfo[page].numPages; ++i)
+        hostKvPageInfo[page + i].owner = owner;
+}
+
+void* MmGetKvOwner (void* ptr)
+{
+    size_t off = (uint8_t*) ptr - hostKvBase;
+    assert (off < hostKvNext);
+    return hostKvPageInfo[off >> NEXKE_CPU_PAGE_SHIFT].owner;
+}
+
+int MmGetAllocNode()
+{
+    return 0;
+}
+
+// CPU and platform
+
+#define HOST_SPIN_YIELD 64    // Spins between yields
+
+void hostSpin()
+{
+    static __thread unsigned int spins = 0;
+    if (!(++spins % HOST_SPIN_YIELD))
+        sched_yield();
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+NkCcb_t* CpuGetCcb()
+{
+    assert (hostCcb);
+    return hostCcb;
+}
+
+NkPlatform_t* PltGetPlatform()
+{
+    return &hostPlatform;
+}
+
+ipl_t PltRaiseIpl (ipl_t newIpl)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    if (ccb->curIpl > newIpl)
+        NkPanic ("nexke: invalid IPL to raise to");
+    ipl_t oldIpl = ccb->curIpl;
+    ccb->curIpl = newIpl;
+    return oldIpl;
+}
+
+void PltLowerIpl (ipl_t oldIpl)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    if (ccb->curIpl < oldIpl)
+        NkPanic ("nexke: Invalid IPL to lower to");
+    ccb->curIpl = oldIpl;
+}
+
+// Tasks. There is no scheduler, so there is nothing to preempt to or wake
+
+void TskEnablePreemptUnsafe()
+{
+}
+
+bool TskClearWait (TskWaitObj_t* waitObj, int result)
+{
+    NkPanic ("nkbench: wait objects aren't supported");
+}
+
+void TskWakeObj (TskWaitObj_t* obj)
+{
+    NkPanic ("nkbench: wait objects aren't supported");
+}
+
+// RCU. Nothing in the harness reads kernel lists while they're being torn down, so callbacks
+// can run right away
+
+void NkRcuCall (NkRcuHead_t* head, NkRcuCallback func)
+{
+    func (head);
+}
+
+// Tracing
+
+bool nkTraceOn = false;
+
+void NkTraceRecord (int event, uintptr_t arg1, uintptr_t arg2)
+{
+}
+
+// Logging and arguments
+
+void NkLogDebug (const char* fmt, ...)
+{
+    if (!hostVerbose)
+        return;
+    va_list ap;
+    va_start (ap, fmt);
+    vfprintf (stderr, fmt, ap);
+    va_end (ap);
+}
+
+void NkLogInfo (const char* fmt, ...)
+{
+    va_list ap;
+    va_start (ap, fmt);
+    vfprintf (stderr, fmt, ap);
+    va_end (ap);
+}
+
+void NkLogWarning (const char* fmt, ...)
+{
+    va_list ap;
+    va_start (ap, fmt);
+    vfprintf (stderr, fmt, ap);
+    va_end (ap);
+}
+
+void __attribute__ ((noreturn)) NkPanic (const char* fmt, ...)
+{
+    va_list ap;
+    va_start (ap, fmt);
+    vfprintf (stderr, fmt, ap);
+    va_end (ap);
+    fputc ('\n', stderr);
+    abort();
+}
+
+// Only flags are supported, which is all kernel code built into us reads
+const char* NkReadArg (const char* arg)
+{
+    for (int i = 1; i < hostArgc; ++i)
+    {
+        if (!strcmp (hostArgv[i], arg))
+            return "";
+    }
+    return NULL;
+}
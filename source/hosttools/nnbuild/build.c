@@ -1,239 +1,770 @@
-/*
-    build.c - contains build process manager for nnbuild
-    Copyright 2021 - 2024 The NexNix Project
-
-    Licensed under the Apache License, Version 2.0 (the "License");
-    you may not use this file except in compliance with the License.
-    You may obtain a copy of the License at
-
-         http://www.apache.org/licenses/LICENSE-2.0
-
-    Unless required by applicable law or agreed to in writing, software
-    distributed under the License is distributed on an "AS IS" BASIS,
-    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
-    See the License for the specific language governing permissions and
-    limitations under the License.
-*/
-
 // clang-format off
 #include <unistd.h>
 // clang-format on
 #include "nnbuild.h"
+#include <errno.h>
+#include <fcntl.h>
 #include <libconf/libconf.h>
 #include <libgen.h>
 #include <libnex/error.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/wait.h>
 
-// Child process ID
-static pid_t childPid = 0;
+// Build scheduling
+// The packages to build are queued up front, along with what each one waits on. That is its
+// dependencies, every package of the groups it depends on, and if it was queued by a group,
+// every package of that group's subgroups. Then every package with nothing left to wait on is
+// started, up to the job limit. Once one fails no new ones are started, but the ones running
+// are let finish
+// With more than one job, each package's output goes through a pipe so its lines can be
+// prefixed with its name, and child makes share a GNU make jobserver. nnbuild holds one job
+// itself, and takes a token from the jobserver for every other package it runs. The jobserver
+// is a socket pair rather than a pipe, so nnbuild can try to take a token without blocking
+// Downloads don't need anything built, so when an action downloads, every package's download
+// runs first, as many at once as the download limit allows and without jobserver tokens, as
+// they spend their time waiting on the network. The rest of the steps run once they're done
+
+#define BUILD_LINE_MAX 1024    // Longest line of output prefixed at once
+
+// Package states
+#define NODE_WAITING 0
+#define NODE_RUNNING 1
+#define NODE_DONE    2
+#define NODE_FAILED  3
+
+// Steps of an action
+#define STEP_DOWNLOAD  0
+#define STEP_CONFIGURE 1
+#define STEP_BUILD     2
+#define STEP_CLEAN     3
+#define STEP_CONFHELP  4
+#define STEP_END       -1
+
+// Steps each action runs
+typedef struct _buildaction
+{
+    const char* name;
+    int steps[4];
+} buildAction_t;
+
+static buildAction_t buildActions[] = {
+    {"download",  {STEP_DOWNLOAD, STEP_END}                           },
+    {"configure", {STEP_CONFIGURE, STEP_END}                          },
+    {"build",     {STEP_BUILD, STEP_END}                              },
+    {"clean",     {STEP_CLEAN, STEP_END}                              },
+    {"confbuild", {STEP_CONFIGURE, STEP_BUILD, STEP_END}              },
+    {"all",       {STEP_DOWNLOAD, STEP_CONFIGURE, STEP_BUILD, STEP_END}},
+    {NULL,        {STEP_END}                                          }
+};
+
+static const char* stepNames[] = {"download", "configure", "build", "clean", "confhelp"};
+
+// A queued package
+typedef struct _buildnode
+{
+    package_t* pkg;                 // Package being built
+    char* name;                     // Name of it
+    struct _buildnode** deps;       // Packages this waits on
+    size_t numDeps;                 // Number of them
+    size_t maxDeps;                 // Room in deps
+    int state;                      // State of package
+    const int* step;                // Step being run
+    pid_t pid;                      // Shell running step
+    int outFd;                      // Read end of output pipe, or -1
+    bool hasToken;                  // If this holds a jobserver token
+    uint64_t inputHash;             // Hash of everything that goes into this
+    uint64_t outHash;               // Hash of what this put out
+    bool useStamps;                 // If steps can be skipped by stamp
+    char* restoreCmd;               // Command restoring this from shared cache
+    bool archiving;                 // If outputs are being put in shared cache
+    char line[BUILD_LINE_MAX];      // Partial line of output
+    size_t lineLen;                 // Length of it
+} buildNode_t;
+
+// Queued packages
+static buildNode_t** nodes = NULL;
+static size_t numNodes = 0;
+static size_t maxNodes = 0;
+
+// Job state
+static int numJobs = 1;            // Packages that can be built at once
+static int numRunning = 0;         // Packages being built
+static bool ownJobFree = true;     // If nnbuild's own job is free
+static int jobServer[2] = {-1, -1};
+static bool buildFailed = false;
+static int numDownloads = 4;        // Downloads that can run at once
+static bool inDownloads = false;    // If downloads are being run
+
+static const int downloadSteps[] = {STEP_DOWNLOAD, STEP_END};
 
-// Redirects signals from parent process to shell
+// Sets number of packages to build at once
+void setBuildJobs (int jobs)
+{
+    numJobs = jobs;
+}
+
+// Sets number of downloads to run at once
+void setDownloadJobs (int jobs)
+{
+    numDownloads = jobs;
+}
+
+// Gets number of packages that can run at once
+static inline int getJobLimit()
+{
+    return (inDownloads) ? numDownloads : numJobs;
+}
+
+// Redirects signals from parent process to shells
 static void signalHandler (int signalNum)
 {
-    error ("child exiting on signal %d", signalNum);
-    // Kill child process
-    kill (childPid, signalNum);
+    error ("children exiting on signal %d", signalNum);
+    // Kill child processes
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        if (nodes[i]->state == NODE_RUNNING)
+            kill (nodes[i]->pid, signalNum);
+    }
+}
+
+// Grows an array of pointers
+static bool growArray (void*** array, size_t* max)
+{
+    size_t newMax = (*max) ? (*max * 2) : 16;
+    void** newArray = realloc (*array, newMax * sizeof (void*));
+    if (!newArray)
+    {
+        error ("%s", strerror (errno));
+        return false;
+    }
+    *array = newArray;
+    *max = newMax;
+    return true;
+}
+
+// Gets command of a step, setting up the default template if needed
+static char* getStepCmd (package_t* package, int step)
+{
+    static const char* templateSteps[] = {"download", "configure", "build", "clean", "confhelp"};
+    char* cmds[] = {package->downloadAction,
+                    package->configureAction,
+                    package->buildAction,
+                    package->cleanAction,
+                    package->confHelpAction};
+    // Check if we should set up template
+    if (package->useBuildPkg)
+    {
+        sprintf (cmds[step],
+                 "$NNSCRIPTROOT/buildpkg.sh %s %s",
+                 templateSteps[step],
+                 UnicodeToHost (package->name));
+    }
+    return (cmds[step][0]) ? cmds[step] : NULL;
+}
+
+// Finds the node of a queued package
+static buildNode_t* findNode (package_t* package)
+{
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        if (nodes[i]->pkg == package)
+            return nodes[i];
+    }
+    return NULL;
+}
+
+// Makes node wait on dep
+static bool addDep (buildNode_t* node, buildNode_t* dep)
+{
+    if (!dep)
+        return false;
+    if (dep == node)
+        return true;
+    if (node->numDeps == node->maxDeps && !growArray ((void***) &node->deps, &node->maxDeps))
+        return false;
+    node->deps[node->numDeps++] = dep;
+    return true;
+}
+
+static bool queueGroupInt (packageGroup_t* group);
+
+// Makes node wait on every package in group and its subgroups
+static bool addGroupDeps (buildNode_t* node, packageGroup_t* group)
+{
+    ListEntry_t* curGroupEntry = ListFront (group->subGroups);
+    while (curGroupEntry)
+    {
+        if (!addGroupDeps (node, ListEntryData (curGroupEntry)))
+            return false;
+        curGroupEntry = ListIterate (curGroupEntry);
+    }
+    ListEntry_t* curPkgEntry = ListFront (group->packages);
+    while (curPkgEntry)
+    {
+        if (!addDep (node, findNode (ListEntryData (curPkgEntry))))
+            return false;
+        curPkgEntry = ListIterate (curPkgEntry);
+    }
+    return true;
+}
+
+// Queues a package and everything it depends on
+static buildNode_t* queuePackageInt (package_t* package)
+{
+    if (package->isBuilt)
+        return findNode (package);
+    if (numNodes == maxNodes && !growArray ((void***) &nodes, &maxNodes))
+        return NULL;
+    buildNode_t* node = calloc_s (sizeof (buildNode_t));
+    if (!node)
+        return NULL;
+    node->pkg = package;
+    node->name = UnicodeToHost (package->name);
+    node->outFd = -1;
+    nodes[numNodes++] = node;
+    package->isBuilt = 1;
+    // Go through all dependent packages
+    ListEntry_t* curDepEntry = ListFront (package->depends);
+    while (curDepEntry)
+    {
+        if (!addDep (node, queuePackageInt (ListEntryData (curDepEntry))))
+            return NULL;
+        curDepEntry = ListIterate (curDepEntry);
+    }
+    // And dependent groups
+    ListEntry_t* curGroupEntry = ListFront (package->groupDeps);
+    while (curGroupEntry)
+    {
+        packageGroup_t* group = ListEntryData (curGroupEntry);
+        if (!queueGroupInt (group) || !addGroupDeps (node, group))
+            return NULL;
+        curGroupEntry = ListIterate (curGroupEntry);
+    }
+    return node;
 }
 
-static int runShell (char* cmd, char* action)
+// Queues a group. Its packages wait on its subgroups
+static bool queueGroupInt (packageGroup_t* group)
 {
+    if (group->isQueued)
+        return true;
+    group->isQueued = true;
+    ListEntry_t* curGroupEntry = ListFront (group->subGroups);
+    while (curGroupEntry)
+    {
+        if (!queueGroupInt (ListEntryData (curGroupEntry)))
+            return false;
+        curGroupEntry = ListIterate (curGroupEntry);
+    }
+    ListEntry_t* curPkgEntry = ListFront (group->packages);
+    while (curPkgEntry)
+    {
+        buildNode_t* node = queuePackageInt (ListEntryData (curPkgEntry));
+        if (!node)
+            return false;
+        curGroupEntry = ListFront (group->subGroups);
+        while (curGroupEntry)
+        {
+            if (!addGroupDeps (node, ListEntryData (curGroupEntry)))
+                return false;
+            curGroupEntry = ListIterate (curGroupEntry);
+        }
+        curPkgEntry = ListIterate (curPkgEntry);
+    }
+    return true;
+}
+
+// Queues a package to be built
+int queuePackage (package_t* package)
+{
+    return queuePackageInt (package) != NULL;
+}
+
+// Sets up the jobserver
+static bool startJobServer()
+{
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, jobServer) == -1)
+    {
+        error ("%s", strerror (errno));
+        return false;
+    }
+    // nnbuild's own job isn't a token
+    for (int i = 1; i < numJobs; ++i)
+    {
+        if (send (jobServer[1], "+", 1, 0) != 1)
+        {
+            error ("%s", strerror (errno));
+            return false;
+        }
+    }
+    // Tell child makes about it
+    char flags[ACTION_BUFSIZE];
+    const char* oldFlags = getenv ("MAKEFLAGS");
+    if (snprintf (flags,
+                  ACTION_BUFSIZE,
+                  " -j%d --jobserver-auth=%d,%d %s",
+                  numJobs,
+                  jobServer[0],
+                  jobServer[1],
+                  (oldFlags) ? oldFlags : "") >= ACTION_BUFSIZE)
+    {
+        error ("MAKEFLAGS too long");
+        return false;
+    }
+    setenv ("MAKEFLAGS", flags, 1);
+    // Lets build scripts know not to pass their own job count to make
+    setenv ("NNJOBSERVER", "1", 1);
+    return true;
+}
+
+// Takes a job for a package
+static bool takeJob (buildNode_t* node)
+{
+    if (inDownloads)
+        return true;
+    if (ownJobFree)
+    {
+        ownJobFree = false;
+        return true;
+    }
+    char token = 0;
+    if (jobServer[0] == -1 || recv (jobServer[0], &token, 1, MSG_DONTWAIT) != 1)
+        return false;
+    node->hasToken = true;
+    return true;
+}
+
+// Gives back a package's job
+static void releaseJob (buildNode_t* node)
+{
+    if (node->hasToken)
+    {
+        if (send (jobServer[1], "+", 1, 0) != 1)
+            error ("%s", strerror (errno));
+        node->hasToken = false;
+    }
+    else if (!inDownloads)
+        ownJobFree = true;
+    --numRunning;
+}
+
+// Starts the shell of a step, capturing its output if asked
+static bool startStep (buildNode_t* node, char* cmd, bool capture)
+{
+    int outPipe[2] = {-1, -1};
+    // Other packages' shells mustn't hold the pipe open
+    if (capture && (pipe (outPipe) == -1 || fcntl (outPipe[0], F_SETFD, FD_CLOEXEC) == -1 ||
+                        fcntl (outPipe[1], F_SETFD, FD_CLOEXEC) == -1))
+    {
+        error ("%s", strerror (errno));
+        return false;
+    }
     pid_t pid = fork();
     if (!pid)
     {
+        if (outPipe[1] != -1)
+        {
+            dup2 (outPipe[1], STDOUT_FILENO);
+            dup2 (outPipe[1], STDERR_FILENO);
+        }
         char* shell = "/bin/sh";
         execl (shell, shell, "-ec", cmd, NULL);
         // An error occured if we got here
         _Exit (1);
     }
-    else
+    else if (pid == -1)
     {
-        childPid = pid;
-        // Handle signals
-        signal (SIGINT, signalHandler);
-        signal (SIGQUIT, signalHandler);
-        signal (SIGHUP, signalHandler);
-        signal (SIGTERM, signalHandler);
-        // Wait for the shell to finish
-        int status = 0;
-        wait (&status);
-        // Exit if an error occured
-        if (status)
+        error ("%s", strerror (errno));
+        if (outPipe[0] != -1)
         {
-            error ("an error occured while invoking action \"%s\"", action);
-            return 0;
+            close (outPipe[0]);
+            close (outPipe[1]);
         }
+        return false;
     }
-    return 1;
+    node->pid = pid;
+    if (outPipe[0] != -1)
+    {
+        close (outPipe[1]);
+        node->outFd = outPipe[0];
+        node->lineLen = 0;
+    }
+    return true;
 }
 
-static int doDownload (package_t* package)
+// Hashes the inputs of a package whose dependencies are done
+static void hashInputs (buildNode_t* node, const int* steps)
 {
-    // Check if we should set up template
-    if (package->useBuildPkg)
+    // Order of dependencies doesn't matter. Downloads run before dependencies are built, so
+    // they're keyed on the package alone
+    uint64_t depHash = 0;
+    for (size_t i = 0; i < node->numDeps && !inDownloads; ++i)
+        depHash += node->deps[i]->outHash;
+    node->useStamps = hashPackageInputs (node->pkg, depHash, &node->inputHash);
+    if (!node->useStamps)
+        return;
+    // If the build step can be restored from the shared cache, the steps leading up to it
+    // aren't needed
+    for (const int* step = steps; *step != STEP_END; ++step)
     {
-        sprintf (package->downloadAction,
-                 "$NNSCRIPTROOT/buildpkg.sh download %s",
-                 UnicodeToHost (package->name));
+        if (*step != STEP_BUILD)
+            continue;
+        uint64_t key = getStepKey (node->inputHash, stepNames[STEP_BUILD]);
+        if (!checkStamp (node->name, stepNames[STEP_BUILD], key))
+            node->restoreCmd = getRestoreCmd (node->name, key);
     }
-    // Run the command
-    if (package->downloadAction[0])
-        return runShell (package->downloadAction, "download");
-    return 1;
 }
 
-static int doConfigure (package_t* package)
+// Starts the next step of a package with something to run
+// Returns false if there are no more steps
+static bool nextStep (buildNode_t* node)
 {
-    // Check if we should set up template
-    if (package->useBuildPkg)
+    while (*node->step != STEP_END)
     {
-        sprintf (package->configureAction,
-                 "$NNSCRIPTROOT/buildpkg.sh configure %s",
-                 UnicodeToHost (package->name));
+        int step = *node->step;
+        char* cmd = getStepCmd (node->pkg, step);
+        if (cmd && node->useStamps && step != STEP_CLEAN)
+        {
+            uint64_t key = getStepKey (node->inputHash, stepNames[step]);
+            if (checkStamp (node->name, stepNames[step], key))
+            {
+                printf ("%s: %s is up to date\n", node->name, stepNames[step]);
+                cmd = NULL;
+            }
+            else if (node->restoreCmd && step == STEP_BUILD)
+            {
+                printf ("%s: restoring build from cache\n", node->name);
+                cmd = node->restoreCmd;
+            }
+            else if (node->restoreCmd)
+            {
+                writeStamp (node->name, stepNames[step], key);
+                cmd = NULL;
+            }
+        }
+        if (cmd)
+        {
+            if (startStep (node, cmd, getJobLimit() > 1))
+                return true;
+            node->state = NODE_FAILED;
+            buildFailed = true;
+            return false;
+        }
+        ++node->step;
     }
-    // Run the command
-    if (package->configureAction[0])
-        return runShell (package->configureAction, "configure");
-    return 1;
+    node->state = NODE_DONE;
+    if (!hashPackageOutputs (node->pkg, &node->outHash))
+        node->outHash = node->inputHash;
+    return false;
 }
 
-static int doConfHelp (package_t* package)
+// Handles a step finishing
+static void stepDone (buildNode_t* node, int status)
 {
-    // Check if we should set up template
-    if (package->useBuildPkg)
+    int step = *node->step;
+    if (node->archiving)
     {
-        sprintf (package->confHelpAction,
-                 "$NNSCRIPTROOT/buildpkg.sh confhelp %s",
-                 UnicodeToHost (package->name));
+        // The build worked either way
+        if (status)
+            error ("%s: unable to store outputs in cache", node->name);
+        node->archiving = false;
+        status = 0;
     }
-    if (package->confHelpAction[0])
-        return runShell (package->confHelpAction, "confhelp");
-    return 1;
+    else if (status)
+    {
+        error ("%s: an error occured while invoking action \"%s\"",
+               node->name,
+               stepNames[*node->step]);
+        node->state = NODE_FAILED;
+        buildFailed = true;
+        releaseJob (node);
+        return;
+    }
+    else if (step == STEP_CLEAN)
+        removeStamps (node->name);
+    else if (node->useStamps)
+    {
+        uint64_t key = getStepKey (node->inputHash, stepNames[step]);
+        writeStamp (node->name, stepNames[step], key);
+        // Store outputs of a real build in the shared cache
+        char* archiveCmd = NULL;
+        if (step == STEP_BUILD && !node->restoreCmd &&
+            (archiveCmd = getArchiveCmd (node->pkg, node->name, key)))
+        {
+            node->archiving = startStep (node, archiveCmd, getJobLimit() > 1);
+            free (archiveCmd);
+            if (node->archiving)
+                return;
+        }
+    }
+    ++node->step;
+    if (!nextStep (node))
+        releaseJob (node);
 }
 
-static int doBuild (package_t* package)
+// Checks if a package has nothing left to wait on
+static bool isReady (buildNode_t* node)
 {
-    // Check if we should set up template
-    if (package->useBuildPkg)
+    if (inDownloads)
+        return true;
+    for (size_t i = 0; i < node->numDeps; ++i)
     {
-        sprintf (package->buildAction,
-                 "$NNSCRIPTROOT/buildpkg.sh build %s",
-                 UnicodeToHost (package->name));
+        if (node->deps[i]->state != NODE_DONE)
+            return false;
     }
-    // Run the command
-    if (package->buildAction[0])
-        return runShell (package->buildAction, "build");
-    return 1;
+    return true;
 }
 
-static int doClean (package_t* package)
+// Starts every package that can be
+// Returns true if a package is ready but has no job
+static bool startReady (const int* steps)
 {
-    // Check if we should set up template
-    if (package->useBuildPkg)
+    bool progress = true;
+    while (progress && !buildFailed)
     {
-        sprintf (package->cleanAction,
-                 "$NNSCRIPTROOT/buildpkg.sh clean %s",
-                 UnicodeToHost (package->name));
+        progress = false;
+        for (size_t i = 0; i < numNodes && !buildFailed; ++i)
+        {
+            buildNode_t* node = nodes[i];
+            if (node->state != NODE_WAITING || !isReady (node))
+                continue;
+            // Downloads never wait on the jobserver
+            if (numRunning == getJobLimit())
+                return !inDownloads;
+            if (!takeJob (node))
+                return true;
+            node->state = NODE_RUNNING;
+            node->step = steps;
+            ++numRunning;
+            hashInputs (node, steps);
+            if (!nextStep (node))
+            {
+                // Had nothing to run, so packages waiting on it may be ready
+                releaseJob (node);
+                progress = true;
+            }
+        }
     }
-    // Run the command
-    if (package->cleanAction[0])
-        return runShell (package->cleanAction, "clean");
-    return 1;
+    return false;
 }
 
-// Builds one package
-int buildPackage (package_t* package, char* action)
+// Prints a line of a package's output
+static void printLine (buildNode_t* node)
 {
-    //  Check if we are running confhelp action
-    if (!strcmp (action, "confhelp"))
-        return doConfHelp (package);
-    // Check if we need to build this package
-    if (package->isBuilt)
-        return 1;
-    // Go through all dependent packages
-    ListEntry_t* curDepEntry = ListFront (package->depends);
-    while (curDepEntry)
+    printf ("[%s] %.*s\n", node->name, (int) node->lineLen, node->line);
+    fflush (stdout);
+    node->lineLen = 0;
+}
+
+// Reads output from a package
+// Returns false once all of it's been read
+static bool readOutput (buildNode_t* node)
+{
+    char buf[BUILD_LINE_MAX];
+    ssize_t bytesRead = read (node->outFd, buf, BUILD_LINE_MAX);
+    if (bytesRead == -1 && errno == EINTR)
+        return true;
+    if (bytesRead <= 0)
     {
-        if (!buildPackage (ListEntryData (curDepEntry), action))
-            return 0;
-        curDepEntry = ListIterate (curDepEntry);
+        if (node->lineLen)
+            printLine (node);
+        return false;
     }
-    // And dependent groups
-    ListEntry_t* curGroupEntry = ListFront (package->groupDeps);
-    while (curGroupEntry)
+    for (ssize_t i = 0; i < bytesRead; ++i)
     {
-        if (!buildGroup (ListEntryData (curGroupEntry), action))
-            return 0;
-        curGroupEntry = ListIterate (curGroupEntry);
+        if (buf[i] == '\n')
+            printLine (node);
+        else
+        {
+            node->line[node->lineLen++] = buf[i];
+            if (node->lineLen == BUILD_LINE_MAX)
+                printLine (node);
+        }
     }
-    // Do the build, based on the action
-    if (!strcmp (action, "download"))
+    return true;
+}
+
+// Waits for running packages to do something
+static void waitForEvent (bool wantJob)
+{
+    if (getJobLimit() == 1)
     {
-        package->isBuilt = 1;
-        return doDownload (package);
+        int status = 0;
+        pid_t pid = wait (&status);
+        for (size_t i = 0; pid != -1 && i < numNodes; ++i)
+        {
+            if (nodes[i]->state == NODE_RUNNING && nodes[i]->pid == pid)
+                stepDone (nodes[i], status);
+        }
+        return;
     }
-    else if (!strcmp (action, "configure"))
+    // Wait on output of every running package, and on the jobserver if a package needs a job
+    struct pollfd* fds = calloc_s ((numRunning + 1) * sizeof (struct pollfd));
+    buildNode_t** fdNodes = calloc_s ((numRunning + 1) * sizeof (buildNode_t*));
+    int numFds = 0;
+    for (size_t i = 0; i < numNodes; ++i)
     {
-        package->isBuilt = 1;
-        return doConfigure (package);
+        if (nodes[i]->state == NODE_RUNNING)
+        {
+            fds[numFds].fd = nodes[i]->outFd;
+            fds[numFds].events = POLLIN;
+            fdNodes[numFds++] = nodes[i];
+        }
     }
-    else if (!strcmp (action, "confbuild"))
+    if (wantJob)
     {
-        // In case a future package tries to build it
-        package->isBuilt = 1;
-        if (!doConfigure (package))
-            return 0;
-        return doBuild (package);
+        fds[numFds].fd = jobServer[0];
+        fds[numFds++].events = POLLIN;
     }
-    else if (!strcmp (action, "build"))
+    if (poll (fds, numFds, -1) == -1)
+        goto end;
+    for (int i = 0; i < numFds; ++i)
     {
-        package->isBuilt = 1;
-        return doBuild (package);
+        buildNode_t* node = fdNodes[i];
+        if (!node || !fds[i].revents || readOutput (node))
+            continue;
+        // Output is done, so the shell is exiting
+        close (node->outFd);
+        node->outFd = -1;
+        int status = 0;
+        while (waitpid (node->pid, &status, 0) == -1 && errno == EINTR)
+            ;
+        stepDone (node, status);
     }
-    else if (!strcmp (action, "clean"))
+end:
+    free (fds);
+    free (fdNodes);
+}
+
+// Runs steps on every queued package
+static void runSteps (const int* steps)
+{
+    while (true)
     {
-        package->isBuilt = 1;
-        return doClean (package);
+        bool wantJob = startReady (steps);
+        if (!numRunning)
+            break;
+        waitForEvent (wantJob);
     }
-    else if (!strcmp (action, "all"))
+}
+
+// Builds every queued package
+int runQueue (char* action)
+{
+    const int* steps = NULL;
+    for (int i = 0; buildActions[i].name; ++i)
     {
-        package->isBuilt = 1;
-        if (!doDownload (package))
-            return 0;
-        if (!doConfigure (package))
-            return 0;
-        if (!doBuild (package))
-            return 0;
+        if (!strcmp (action, buildActions[i].name))
+            steps = buildActions[i].steps;
     }
-    else
+    if (!steps)
     {
         error ("invalid action %s", action);
         return 0;
     }
+    if (numJobs > 1 && !startJobServer())
+        return 0;
+    // Handle signals
+    signal (SIGINT, signalHandler);
+    signal (SIGQUIT, signalHandler);
+    signal (SIGHUP, signalHandler);
+    signal (SIGTERM, signalHandler);
+    if (*steps == STEP_DOWNLOAD)
+    {
+        inDownloads = true;
+        runSteps (downloadSteps);
+        inDownloads = false;
+        // Packages go through the rest of the steps from the start
+        if (*(++steps) != STEP_END)
+        {
+            for (size_t i = 0; i < numNodes; ++i)
+            {
+                if (nodes[i]->state == NODE_DONE)
+                    nodes[i]->state = NODE_WAITING;
+            }
+        }
+    }
+    if (!buildFailed && *steps != STEP_END)
+        runSteps (steps);
+    saveBuildIndex();
+    if (buildFailed)
+        return 0;
+    for (size_t i = 0; i < numNodes; ++i)
+    {
+        if (nodes[i]->state != NODE_DONE)
+        {
+            error ("package %s has a dependency cycle", nodes[i]->name);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Runs confhelp on a package
+static int doConfHelp (package_t* package)
+{
+    char* cmd = getStepCmd (package, STEP_CONFHELP);
+    if (!cmd)
+        return 1;
+    buildNode_t node = {.pkg = package, .outFd = -1};
+    int status = 1;
+    if (startStep (&node, cmd, false))
+    {
+        while (waitpid (node.pid, &status, 0) == -1 && errno == EINTR)
+            ;
+    }
+    if (status)
+    {
+        error ("an error occured while invoking action \"confhelp\"");
+        return 0;
+    }
     return 1;
 }
 
-// Builds a package group
-int buildGroup (packageGroup_t* group, char* action)
+// Builds one package
+int buildPackage (package_t* package, char* action)
 {
-    // Build all sub groups first
+    //  Check if we are running confhelp action
+    if (!strcmp (action, "confhelp"))
+        return doConfHelp (package);
+    if (!queuePackage (package))
+        return 0;
+    return runQueue (action);
+}
+
+// Queues a group's packages, or runs confhelp on them
+static int queueGroup (packageGroup_t* group, char* action)
+{
+    if (strcmp (action, "confhelp") != 0)
+        return queueGroupInt (group);
     ListEntry_t* curGroupEntry = ListFront (group->subGroups);
     while (curGroupEntry)
     {
-        if (!buildGroup (ListEntryData (curGroupEntry), action))
+        if (!queueGroup (ListEntryData (curGroupEntry), action))
             return 0;
         curGroupEntry = ListIterate (curGroupEntry);
     }
-    // Build all packages
     ListEntry_t* curPkgEntry = ListFront (group->packages);
     while (curPkgEntry)
     {
-        if (!buildPackage (ListEntryData (curPkgEntry), action))
+        if (!doConfHelp (ListEntryData (curPkgEntry)))
             return 0;
         curPkgEntry = ListIterate (curPkgEntry);
     }
     return 1;
 }
+
+// Builds a package group
+int buildGroup (packageGroup_t* group, char* action)
+{
+    if (!queueGroup (group, action))
+        return 0;
+    if (!strcmp (action, "confhelp"))
+        return 1;
+    return runQueue (action);
+}
@@ -0,0 +1,548 @@
+/*
+    cache.c - contains build stamps and cache for nnbuild
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file cache.c
+
+// Each step of a package that has inputs is stamped with a hash of everything that goes into
+// it, and is skipped if the stamp still matches. That hash covers the package's commands, the
+// NN* environment variables that hold the configuration, the contents of the package's inputs,
+// and the outputs of the packages it depends on. A package's outputs are the contents of its
+// outputs property if it has one, else the hash of its inputs
+// Inputs are files and directories listed in the inputs property. Packages using buildpkg.sh
+// default to their package and source directories. Packages without inputs always run, as
+// nnbuild can't tell what they read, though they may well skip work themselves
+// File contents are hashed by path relative to the input, so hashes match between checkouts.
+// An index of file sizes and times keeps unchanged files from being read again
+// With a shared cache directory, the outputs of a build step are archived there under its
+// hash, and any host with the same inputs extracts them instead of building
+
+#include "nnbuild.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libnex/error.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wordexp.h>
+
+extern char** environ;
+
+#define INDEX_HASH_SZ 16384    // Buckets in file index
+#define HASH_BUFSZ    65536    // Bytes of a file hashed at a time
+
+#define FNV_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// File in index
+typedef struct _indexent
+{
+    char* path;                 // Path of file
+    int64_t size;               // Size of it
+    int64_t mtime;              // Modification time in nanoseconds
+    uint64_t hash;              // Hash of contents
+    struct _indexent* next;     // Next in bucket
+} indexEnt_t;
+
+// Stamp state
+static bool stampsOn = true;           // If stamps are used
+static const char* cacheDir = NULL;    // Shared cache directory
+static char stampDir[PATH_MAX] = {0};
+
+// File index
+static indexEnt_t* fileIndex[INDEX_HASH_SZ] = {0};
+static bool indexLoaded = false;
+static bool indexDirty = false;
+
+// Hashes data into h
+static uint64_t fnvHash (uint64_t h, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+// Hashes a string, including its terminator
+static inline uint64_t fnvHashStr (uint64_t h, const char* s)
+{
+    return fnvHash (h, s, strlen (s) + 1);
+}
+
+// Turns off stamps
+void disableBuildStamps()
+{
+    stampsOn = false;
+}
+
+// Sets shared cache directory
+void setBuildCache (const char* dir)
+{
+    cacheDir = dir;
+    // Downloads are kept there too, unless they have a cache of their own
+    char downloadDir[PATH_MAX];
+    if (!getenv ("NNDOWNLOADCACHE") &&
+        (size_t) snprintf (downloadDir, PATH_MAX, "%s/downloads", dir) < PATH_MAX)
+    {
+        setenv ("NNDOWNLOADCACHE", downloadDir, 1);
+    }
+}
+
+// Gets the stamp directory, making it if needed
+static const char* getStampDir()
+{
+    if (stampDir[0])
+        return stampDir;
+    const char* objDir = getenv ("NNOBJDIR");
+    snprintf (stampDir, PATH_MAX, "%s/nnbuild-stamps", (objDir) ? objDir : ".");
+    if (objDir && mkdir (objDir, 0755) == -1 && errno != EEXIST)
+        error ("%s: %s", objDir, strerror (errno));
+    if (mkdir (stampDir, 0755) == -1 && errno != EEXIST)
+        error ("%s: %s", stampDir, strerror (errno));
+    return stampDir;
+}
+
+// File index
+
+static inline indexEnt_t** getBucket (const char* path)
+{
+    return &fileIndex[fnvHashStr (FNV_BASIS, path) & (INDEX_HASH_SZ - 1)];
+}
+
+static indexEnt_t* findIndexEnt (const char* path)
+{
+    for (indexEnt_t* ent = *getBucket (path); ent; ent = ent->next)
+    {
+        if (!strcmp (ent->path, path))
+            return ent;
+    }
+    return NULL;
+}
+
+static indexEnt_t* addIndexEnt (const char* path)
+{
+    indexEnt_t* ent = calloc_s (sizeof (indexEnt_t));
+    if (!ent)
+        return NULL;
+    ent->path = strdup (path);
+    indexEnt_t** bucket = getBucket (path);
+    ent->next = *bucket;
+    *bucket = ent;
+    return ent;
+}
+
+// Reads in the file index
+static void loadIndex()
+{
+    indexLoaded = true;
+    char file[PATH_MAX];
+    snprintf (file, PATH_MAX, "%s/index", getStampDir());
+    FILE* fp = fopen (file, "r");
+    if (!fp)
+        return;
+    char* line = NULL;
+    size_t lineSz = 0;
+    ssize_t len = 0;
+    while ((len = getline (&line, &lineSz, fp)) > 0)
+    {
+        if (line[len - 1] == '\n')
+            line[len - 1] = 0;
+        // Line is hash, size, time, and path, seperated by tabs
+        char* size = strchr (line, '\t');
+        char* mtime = (size) ? strchr (size + 1, '\t') : NULL;
+        char* path = (mtime) ? strchr (mtime + 1, '\t') : NULL;
+        if (!path)
+            continue;
+        indexEnt_t* ent = addIndexEnt (path + 1);
+        if (!ent)
+            break;
+        ent->hash = strtoull (line, NULL, 16);
+        ent->size = strtoll (size + 1, NULL, 10);
+        ent->mtime = strtoll (mtime + 1, NULL, 10);
+    }
+    free (line);
+    fclose (fp);
+}
+
+// Writes out the file index
+void saveBuildIndex()
+{
+    if (!indexDirty)
+        return;
+    char file[PATH_MAX];
+    char tmpFile[PATH_MAX];
+    snprintf (file, PATH_MAX, "%s/index", getStampDir());
+    snprintf (tmpFile, PATH_MAX, "%s/index.new", getStampDir());
+    FILE* fp = fopen (tmpFile, "w");
+    if (!fp)
+    {
+        error ("%s: %s", tmpFile, strerror (errno));
+        return;
+    }
+    for (int i = 0; i < INDEX_HASH_SZ; ++i)
+    {
+        for (indexEnt_t* ent = fileIndex[i]; ent; ent = ent->next)
+        {
+            fprintf (fp,
+                     "%016" PRIx64 "\t%" PRId64 "\t%" PRId64 "\t%s\n",
+                     ent->hash,
+                     ent->size,
+                     ent->mtime,
+                     ent->path);
+        }
+    }
+    if (fclose (fp) == EOF || rename (tmpFile, file) == -1)
+        error ("%s: %s", file, strerror (errno));
+    indexDirty = false;
+}
+
+// Hashes a file's contents, using the index if it hasn't changed
+static bool hashFile (const char* path, struct stat* st, uint64_t* hash)
+{
+    if (!indexLoaded)
+        loadIndex();
+    int64_t mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+    indexEnt_t* ent = findIndexEnt (path);
+    if (ent && ent->size == st->st_size && ent->mtime == mtime)
+    {
+        *hash = ent->hash;
+        return true;
+    }
+    int fd = open (path, O_RDONLY);
+    if (fd == -1)
+    {
+        error ("%s: %s", path, strerror (errno));
+        return false;
+    }
+    uint8_t* buf = malloc_s (HASH_BUFSZ);
+    if (!buf)
+    {
+        close (fd);
+        return false;
+    }
+    uint64_t h = FNV_BASIS;
+    ssize_t bytesRead = 0;
+    while ((bytesRead = read (fd, buf, HASH_BUFSZ)) > 0)
+        h = fnvHash (h, buf, bytesRead);
+    free (buf);
+    close (fd);
+    if (bytesRead == -1)
+    {
+        error ("%s: %s", path, strerror (errno));
+        return false;
+    }
+    if (!ent && !(ent = addIndexEnt (path)))
+        return false;
+    ent->size = st->st_size;
+    ent->mtime = mtime;
+    ent->hash = h;
+    indexDirty = true;
+    *hash = h;
+    return true;
+}
+
+// Hashes a file or directory tree
+// Each file's hash is added up, so the order directories are read in doesn't matter
+static bool hashTree (const char* path, const char* relPath, uint64_t* sum)
+{
+    struct stat st;
+    if (lstat (path, &st) == -1)
+    {
+        // Inputs that don't exist yet just hash as missing
+        if (errno == ENOENT)
+        {
+            *sum += fnvHashStr (FNV_BASIS, relPath);
+            return true;
+        }
+        error ("%s: %s", path, strerror (errno));
+        return false;
+    }
+    uint64_t h = fnvHashStr (FNV_BASIS, relPath);
+    h = fnvHash (h, &st.st_mode, sizeof (st.st_mode));
+    if (S_ISREG (st.st_mode))
+    {
+        uint64_t contents = 0;
+        if (!hashFile (path, &st, &contents))
+            return false;
+        h = fnvHash (h, &contents, sizeof (contents));
+    }
+    else if (S_ISLNK (st.st_mode))
+    {
+        char target[PATH_MAX];
+        ssize_t len = readlink (path, target, PATH_MAX);
+        if (len > 0)
+            h = fnvHash (h, target, len);
+    }
+    *sum += h;
+    if (!S_ISDIR (st.st_mode))
+        return true;
+    DIR* dir = opendir (path);
+    if (!dir)
+    {
+        error ("%s: %s", path, strerror (errno));
+        return false;
+    }
+    struct dirent* curDir = NULL;
+    while ((curDir = readdir (dir)))
+    {
+        // Version control data changes without the tree changing
+        if (!strcmp (curDir->d_name, ".") || !strcmp (curDir->d_name, "..") ||
+            !strcmp (curDir->d_name, ".git"))
+        {
+            continue;
+        }
+        char subPath[PATH_MAX];
+        char subRelPath[PATH_MAX];
+        if (snprintf (subPath, PATH_MAX, "%s/%s", path, curDir->d_name) >= PATH_MAX ||
+            snprintf (subRelPath, PATH_MAX, "%s/%s", relPath, curDir->d_name) >= PATH_MAX)
+        {
+            closedir (dir);
+            error ("buffer overflow detected");
+            return false;
+        }
+        if (!hashTree (subPath, subRelPath, sum))
+        {
+            closedir (dir);
+            return false;
+        }
+    }
+    closedir (dir);
+    return true;
+}
+
+// Hashes every path in a list. Returns false if the list is empty or hashing fails
+static bool hashPaths (const char* list, uint64_t* hash)
+{
+    wordexp_t words;
+    if (wordexp (list, &words, WRDE_NOCMD) != 0)
+    {
+        error ("unable to expand \"%s\"", list);
+        return false;
+    }
+    bool res = words.we_wordc != 0;
+    uint64_t h = 0;
+    for (size_t i = 0; res && i < words.we_wordc; ++i)
+    {
+        // Relative paths are numbered, so the same tree in a different place hashes the same
+        char relPath[32];
+        snprintf (relPath, 32, "%zu", i);
+        res = hashTree (words.we_wordv[i], relPath, &h);
+    }
+    wordfree (&words);
+    *hash = h;
+    return res;
+}
+
+// Gets a package's inputs
+static const char* getInputs (package_t* package, char* buf, size_t bufSz)
+{
+    if (package->inputs[0])
+        return package->inputs;
+    if (!package->useBuildPkg)
+        return NULL;
+    const char* name = UnicodeToHost (package->name);
+    snprintf (buf, bufSz, "$NNPKGROOT/%s $NNSOURCEROOT/%s", name, name);
+    return buf;
+}
+
+// Compares environment variables for sorting
+static int envCmp (const void* a, const void* b)
+{
+    return strcmp (*(const char**) a, *(const char**) b);
+}
+
+// Hashes the configuration in the environment
+static uint64_t hashEnv (uint64_t h)
+{
+    size_t numVars = 0;
+    while (environ[numVars])
+        ++numVars;
+    const char** vars = malloc_s ((numVars + 1) * sizeof (char*));
+    if (!vars)
+        return h;
+    size_t numNnVars = 0;
+    for (size_t i = 0; i < numVars; ++i)
+    {
+        // Job counts don't change what gets built
+        if (!strncmp (environ[i], "NN", 2) && strncmp (environ[i], "NNJOBCOUNT=", 11) != 0 &&
+            strncmp (environ[i], "NNJOBSERVER=", 12) != 0)
+        {
+            vars[numNnVars++] = environ[i];
+        }
+    }
+    qsort (vars, numNnVars, sizeof (char*), envCmp);
+    for (size_t i = 0; i < numNnVars; ++i)
+        h = fnvHashStr (h, vars[i]);
+    free (vars);
+    return h;
+}
+
+// Hashes the inputs of a package, starting with the hash of its dependencies' outputs
+// Returns false if the package has no inputs, in which case its steps always run
+bool hashPackageInputs (package_t* package, uint64_t depHash, uint64_t* hash)
+{
+    uint64_t h = fnvHash (FNV_BASIS, &depHash, sizeof (depHash));
+    h = fnvHashStr (h, UnicodeToHost (package->name));
+    h = fnvHashStr (h, package->downloadAction);
+    h = fnvHashStr (h, package->configureAction);
+    h = fnvHashStr (h, package->buildAction);
+    h = fnvHashStr (h, package->cleanAction);
+    h = fnvHashStr (h, package->outputs);
+    h = fnvHash (h, &package->useBuildPkg, sizeof (bool));
+    h = fnvHash (h, &package->bindInstall, sizeof (bool));
+    h = hashEnv (h);
+    *hash = h;
+    char buf[ACTION_BUFSIZE];
+    const char* inputs = getInputs (package, buf, ACTION_BUFSIZE);
+    if (!stampsOn || !inputs)
+        return false;
+    uint64_t treeHash = 0;
+    if (!hashPaths (inputs, &treeHash))
+        return false;
+    *hash = fnvHash (h, &treeHash, sizeof (treeHash));
+    return true;
+}
+
+// Hashes the outputs of a package. Returns false if it doesn't list them
+bool hashPackageOutputs (package_t* package, uint64_t* hash)
+{
+    if (!package->outputs[0])
+        return false;
+    return hashPaths (package->outputs, hash);
+}
+
+// Gets the key of a step
+uint64_t getStepKey (uint64_t inputHash, const char* step)
+{
+    return fnvHashStr (fnvHash (FNV_BASIS, &inputHash, sizeof (inputHash)), step);
+}
+
+// Checks if a step's stamp matches key
+bool checkStamp (const char* name, const char* step, uint64_t key)
+{
+    char file[PATH_MAX];
+    snprintf (file, PATH_MAX, "%s/%s.%s", getStampDir(), name, step);
+    FILE* fp = fopen (file, "r");
+    if (!fp)
+        return false;
+    uint64_t stampKey = 0;
+    bool res = fscanf (fp, "%" SCNx64, &stampKey) == 1 && stampKey == key;
+    fclose (fp);
+    return res;
+}
+
+// Stamps a step as done with key
+void writeStamp (const char* name, const char* step, uint64_t key)
+{
+    char file[PATH_MAX];
+    snprintf (file, PATH_MAX, "%s/%s.%s", getStampDir(), name, step);
+    FILE* fp = fopen (file, "w");
+    if (!fp)
+    {
+        error ("%s: %s", file, strerror (errno));
+        return;
+    }
+    fprintf (fp, "%016" PRIx64 "\n", key);
+    fclose (fp);
+}
+
+// Removes every stamp of a package
+void removeStamps (const char* name)
+{
+    static const char* steps[] = {"download", "configure", "build"};
+    for (int i = 0; i < 3; ++i)
+    {
+        char file[PATH_MAX];
+        snprintf (file, PATH_MAX, "%s/%s.%s", getStampDir(), name, steps[i]);
+        unlink (file);
+    }
+}
+
+// Gets name of a package's archive in the shared cache
+static bool getArchive (const char* name, uint64_t key, char* buf, size_t bufSz)
+{
+    return (size_t) snprintf (buf, bufSz, "%s/%s-%016" PRIx64 ".tar", cacheDir, name, key) <
+           bufSz;
+}
+
+// Gets the command restoring a package's outputs from the shared cache, or NULL if they aren't
+// there
+char* getRestoreCmd (const char* name, uint64_t key)
+{
+    char archive[PATH_MAX];
+    if (!cacheDir || !getArchive (name, key, archive, PATH_MAX) || access (archive, R_OK) == -1)
+        return NULL;
+    char* cmd = malloc_s (ACTION_BUFSIZE);
+    if (!cmd)
+        return NULL;
+    if (snprintf (cmd, ACTION_BUFSIZE, "tar -C / -xf '%s'", archive) >= ACTION_BUFSIZE)
+    {
+        free (cmd);
+        return NULL;
+    }
+    return cmd;
+}
+
+// Gets the command storing a package's outputs in the shared cache, or NULL if there's no
+// cache or the package doesn't list them
+char* getArchiveCmd (package_t* package, const char* name, uint64_t key)
+{
+    char archive[PATH_MAX];
+    if (!cacheDir || !package->outputs[0] || !getArchive (name, key, archive, PATH_MAX))
+        return NULL;
+    wordexp_t words;
+    if (wordexp (package->outputs, &words, WRDE_NOCMD) != 0)
+        return NULL;
+    char* cmd = malloc_s (ACTION_BUFSIZE);
+    if (!cmd)
+    {
+        wordfree (&words);
+        return NULL;
+    }
+    // Write it under a temporary name, so other hosts never see half of it
+    size_t len = snprintf (cmd, ACTION_BUFSIZE, "tar -C / -cf '%s.%d'", archive, getpid());
+    for (size_t i = 0; i < words.we_wordc && len < ACTION_BUFSIZE; ++i)
+    {
+        const char* path = words.we_wordv[i];
+        while (*path == '/')
+            ++path;
+        len += snprintf (cmd + len, ACTION_BUFSIZE - len, " '%s'", path);
+    }
+    if (len < ACTION_BUFSIZE)
+    {
+        len += snprintf (cmd + len,
+                         ACTION_BUFSIZE - len,
+                         " && mv '%s.%d' '%s'",
+                         archive,
+                         getpid(),
+                         archive);
+    }
+    wordfree (&words);
+    if (len >= ACTION_BUFSIZE)
+    {
+        free (cmd);
+        return NULL;
+    }
+    return cmd;
+}
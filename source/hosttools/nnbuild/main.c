@@ -21,6 +21,7 @@
 #include <libconf/libconf.h>
 #include <libnex.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // The package group to be built. Default is "all"
@@ -35,11 +36,17 @@ static char* action = NULL;
 // The file to use
 static char* confName = "nnbuild.conf";
 
+// Packages to build at once
+static int jobs = 1;
+
+// Downloads to run at once
+static int downloads = 4;
+
 // Parses arguments passed to nnbuild
 static int parseArgs (int argc, char** argv)
 {
 // The list of arguments that are valid
-#define VALIDOPTS "g:p:hf:"
+#define VALIDOPTS "g:p:hf:j:d:c:n"
     int arg = 0;
     const char* progName = getprogname();
     while ((arg = getopt (argc, argv, VALIDOPTS)) != -1)
@@ -50,7 +57,8 @@ static int parseArgs (int argc, char** argv)
             case 'h':
                 printf ("\
 %s - manages the build process of NexNix\n\
-Usage: %s [-h] [-g PACKAGE_GROUP] [-p PACKAGE] [-f FILE] ACTION\n\
+Usage: %s [-h] [-g PACKAGE_GROUP] [-p PACKAGE] [-f FILE] [-j JOBS] [-d DOWNLOADS] [-c DIR]\n\
+          [-n] ACTION\n\
 Valid Arguments:\n\
   -h\n\
              prints help and then exits\n\
@@ -60,6 +68,17 @@ Valid Arguments:\n\
              builds the specified package\n\
   -f FILE\n\
              reads configuration from the specified file\n\
+  -j JOBS\n\
+             builds up to JOBS packages at once, sharing JOBS jobs\n\
+             with their makes\n\
+  -d DOWNLOADS\n\
+             runs up to DOWNLOADS downloads at once. Defaults to 4\n\
+  -c DIR\n\
+             shares built outputs of packages with other hosts through DIR,\n\
+             and keeps downloads in DIR/downloads unless NNDOWNLOADCACHE\n\
+             is set\n\
+  -n\n\
+             runs every step, even if its inputs haven't changed\n\
 \n\
 ACTION can be either clean, download, configure, all, build, confbuild,\n\
 or install.  The configuration gets read from the file nnbuild.conf in the\n\
@@ -76,6 +95,28 @@ current directory if a file isn't specified on the command line\n",
             case 'f':
                 confName = optarg;
                 break;
+            case 'j':
+                jobs = atoi (optarg);
+                if (jobs < 1)
+                {
+                    error ("invalid job count %s", optarg);
+                    return 0;
+                }
+                break;
+            case 'd':
+                downloads = atoi (optarg);
+                if (downloads < 1)
+                {
+                    error ("invalid download count %s", optarg);
+                    return 0;
+                }
+                break;
+            case 'c':
+                setBuildCache (optarg);
+                break;
+            case 'n':
+                disableBuildStamps();
+                break;
             case '?':
                 return 0;
         }
@@ -123,6 +164,8 @@ int main (int argc, char** argv)
         return 1;
     }
     // Build the packages
+    setBuildJobs (jobs);
+    setDownloadJobs (downloads);
     int res = 0;
     if (pkgGroup)
         res = buildPackages (0, pkgGroup, action);
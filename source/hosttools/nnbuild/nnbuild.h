@@ -35,6 +35,7 @@ typedef struct _pkggroup
     char32_t* name;           ///< Name of this package group
     ListHead_t* packages;     ///< The packages contained within
     ListHead_t* subGroups;    ///< Sub groups of this group
+    bool isQueued;            ///< If this group's packages have been queued
 } packageGroup_t;
 
 /// A package
@@ -47,9 +48,11 @@ typedef struct _package
     char buildAction[ACTION_BUFSIZE];        ///< ... and so on
     char cleanAction[ACTION_BUFSIZE];
     char confHelpAction[ACTION_BUFSIZE];
+    char inputs[ACTION_BUFSIZE];             ///< Files and directories the package reads
+    char outputs[ACTION_BUFSIZE];            ///< Files and directories the package installs
     ListHead_t* depends;      ///< Dependencies of this package
     ListHead_t* groupDeps;    ///< Group dependencies of package
-    bool isBuilt;             ///< If this package has been buit or not
+    bool isBuilt;             ///< If this package has been queued to be built
     bool isInstalled;         ///< If this package has been built yet
     bool bindInstall;         ///< If installation and building should be one step
     bool useBuildPkg;         ///< If we should use the default template for building
@@ -70,6 +73,52 @@ int buildGroup (packageGroup_t* group, char* action);
 /// Builds one package
 int buildPackage (package_t* package, char* action);
 
+/// Sets number of packages to build at once
+void setBuildJobs (int jobs);
+
+/// Sets number of downloads to run at once
+void setDownloadJobs (int jobs);
+
+/// Queues a package and its dependencies to be built
+int queuePackage (package_t* package);
+
+/// Builds every queued package
+int runQueue (char* action);
+
+/// Turns off skipping steps whose inputs haven't changed
+void disableBuildStamps();
+
+/// Sets directory of shared build cache
+void setBuildCache (const char* dir);
+
+/// Hashes the inputs of a package, starting with the hash of its dependencies' outputs
+/// Returns false if the package has no inputs, in which case its steps always run
+bool hashPackageInputs (package_t* package, uint64_t depHash, uint64_t* hash);
+
+/// Hashes the outputs of a package. Returns false if it doesn't list them
+bool hashPackageOutputs (package_t* package, uint64_t* hash);
+
+/// Gets the key of a step
+uint64_t getStepKey (uint64_t inputHash, const char* step);
+
+/// Checks if a step's stamp matches key
+bool checkStamp (const char* name, const char* step, uint64_t key);
+
+/// Stamps a step as done with key
+void writeStamp (const char* name, const char* step, uint64_t key);
+
+/// Removes every stamp of a package
+void removeStamps (const char* name);
+
+/// Gets the command restoring a package's outputs from the shared cache
+char* getRestoreCmd (const char* name, uint64_t key);
+
+/// Gets the command storing a package's outputs in the shared cache
+char* getArchiveCmd (package_t* package, const char* name, uint64_t key);
+
+/// Writes out the index of hashed files
+void saveBuildIndex();
+
 // Deletes package tree
 void freePackageTree();
 
@@ -332,6 +332,32 @@ int addProperty (char32_t* newProp, union val* val, int isStart, int dataType)
             if (!addDependencyToPackage (val->strVal))
                 return 0;
         }
+        else if (!c32cmp (prop, U"inputs") || !c32cmp (prop, U"outputs"))
+        {
+            if (dataType != DATATYPE_STRING)
+            {
+                error ("%s:%d: property \"%s\" requires a string value",
+                       ConfGetFileName(),
+                       lineNo,
+                       UnicodeToHost (prop));
+                return 0;
+            }
+            // Paths are kept as one list, split up when they're expanded
+            char* paths = (!c32cmp (prop, U"inputs")) ? curPackage->inputs : curPackage->outputs;
+            size_t len = strlen (paths);
+            mbstate_t state = {0};
+            if (len)
+                paths[len++] = ' ';
+            if (len >= ACTION_BUFSIZE ||
+                c32stombs (paths + len, val->strVal, ACTION_BUFSIZE - len, &state) < 0)
+            {
+                error ("%s:%d: property \"%s\" too long",
+                       ConfGetFileName(),
+                       lineNo,
+                       UnicodeToHost (prop));
+                return 0;
+            }
+        }
         else if (!c32cmp (prop, U"usebuildpkg"))
         {
             if (dataType != DATATYPE_IDENTIFIER)
@@ -428,15 +454,18 @@ int buildPackages (int groupOrPkg, char* name, char* action)
         else
         {
             // Build every package
+            bool isConfHelp = !strcmp (action, "confhelp");
             ListEntry_t* curPkgEntry = ListFront (packages);
             while (curPkgEntry)
             {
                 package_t* curPkg = ListEntryData (curPkgEntry);
-                if (!buildPackage (curPkg, action))
+                if (isConfHelp && !buildPackage (curPkg, action))
+                    return 0;
+                else if (!isConfHelp && !queuePackage (curPkg))
                     return 0;
                 curPkgEntry = ListIterate (curPkgEntry);
             }
-            return 1;
+            return (isConfHelp) ? 1 : runQueue (action);
         }
     }
     else
@@ -0,0 +1,1016 @@
+/*
+    fat.c - contains direct FAT file system writer
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file fat.c
+
+// Writes files straight into a FAT12, FAT16, or FAT32 file system in a raw image, so updating a
+// FAT partition doesn't need the libguestfs appliance. Formatting still goes through the
+// appliance, so this only has to work with file systems that are already there
+// The whole FAT is kept in memory and written back to every copy when the volume is closed.
+// Directories are read in whole, changed, and written back. Long names are read and written,
+// and short names that only differ from the long name in case are stored with the case flags,
+// like Linux does. Times are kept in UTC, as the appliance does
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nnimage.h"
+#include <libnex.h>
+
+#define FAT_DIRENT_SZ  32                 // Size of directory entry
+#define FAT_LFN_CHARS  13                 // Characters in long name entry
+#define FAT_NAME_MAX   255                // Longest long name
+#define FAT_WRITE_SZ   (1024 * 1024)      // Bytes of file data written at once
+
+// Directory entry attributes
+#define FAT_ATTR_VOLID   0x08
+#define FAT_ATTR_DIR     0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LFN     0x0F
+
+// Case flags of short names
+#define FAT_CASE_BASE 0x08    // Base name is lowercase
+#define FAT_CASE_EXT  0x10    // Extension is lowercase
+
+// Directory entry markers
+#define FAT_ENT_END  0x00
+#define FAT_ENT_FREE 0xE5
+
+// Offsets in directory entry
+#define FAT_ENT_ATTR    11
+#define FAT_ENT_CASE    12
+#define FAT_ENT_CTIME   14
+#define FAT_ENT_CDATE   16
+#define FAT_ENT_ADATE   18
+#define FAT_ENT_CLUSTHI 20
+#define FAT_ENT_MTIME   22
+#define FAT_ENT_MDATE   24
+#define FAT_ENT_CLUSTLO 26
+#define FAT_ENT_SIZE    28
+
+// Offsets of characters in long name entry
+static const int fatLfnOffs[FAT_LFN_CHARS] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+// A mounted volume
+struct _fatvol
+{
+    int fd;                   // Image file
+    off_t base;               // Offset of volume in image
+    int type;                 // 12, 16, or 32
+    uint32_t sectSz;          // Bytes per sector
+    uint32_t clustSz;         // Bytes per cluster
+    uint32_t resvdSects;      // Sectors before first FAT
+    uint32_t numFats;         // Copies of FAT
+    uint32_t fatSects;        // Sectors in one FAT
+    uint32_t rootEnts;        // Entries in FAT12/16 root directory
+    uint32_t dataStart;       // First sector of cluster 2
+    uint32_t numClusts;       // Clusters in data area
+    uint32_t rootClust;       // First cluster of FAT32 root directory
+    uint32_t fsInfoSect;      // FSInfo sector of FAT32
+    uint8_t* fat;             // FAT in memory
+    size_t fatBytes;          // Size of it
+    bool fatDirty;            // If FAT needs to be written
+    uint32_t nextFree;        // Where to start looking for a free cluster
+};
+
+// A directory read into memory
+typedef struct _fatdir
+{
+    uint32_t clust;    // First cluster, 0 for FAT12/16 root
+    uint8_t* buf;      // Entries
+    size_t size;       // Size of entries
+} fatDir_t;
+
+static inline uint16_t rd16 (const uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t rd32 (const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline void wr16 (uint8_t* p, uint16_t val)
+{
+    p[0] = val & 0xFF;
+    p[1] = val >> 8;
+}
+
+static inline void wr32 (uint8_t* p, uint32_t val)
+{
+    wr16 (p, val & 0xFFFF);
+    wr16 (p + 2, val >> 16);
+}
+
+// Reads or writes the whole of a buffer at an offset
+static bool fatIo (FatVol_t* vol, void* data, size_t sz, off_t off, bool write)
+{
+    uint8_t* buf = data;
+    while (sz)
+    {
+        ssize_t res = (write) ? pwrite (vol->fd, buf, sz, vol->base + off)
+                              : pread (vol->fd, buf, sz, vol->base + off);
+        if (res <= 0)
+        {
+            error ("FAT volume: %s", (res == 0) ? "unexpected end of image" : strerror (errno));
+            return false;
+        }
+        buf += res;
+        sz -= res;
+        off += res;
+    }
+    return true;
+}
+
+// FAT table
+
+static uint32_t fatGet (FatVol_t* vol, uint32_t clust)
+{
+    if (vol->type == 12)
+    {
+        uint16_t val = rd16 (vol->fat + clust + (clust / 2));
+        return (clust & 1) ? (val >> 4) : (val & 0xFFF);
+    }
+    else if (vol->type == 16)
+        return rd16 (vol->fat + (clust * 2));
+    return rd32 (vol->fat + (clust * 4)) & 0x0FFFFFFF;
+}
+
+static void fatSet (FatVol_t* vol, uint32_t clust, uint32_t val)
+{
+    if (vol->type == 12)
+    {
+        uint8_t* p = vol->fat + clust + (clust / 2);
+        if (clust & 1)
+        {
+            p[0] = (p[0] & 0x0F) | ((val << 4) & 0xF0);
+            p[1] = (val >> 4) & 0xFF;
+        }
+        else
+        {
+            p[0] = val & 0xFF;
+            p[1] = (p[1] & 0xF0) | ((val >> 8) & 0x0F);
+        }
+    }
+    else if (vol->type == 16)
+        wr16 (vol->fat + (clust * 2), val);
+    else
+    {
+        uint8_t* p = vol->fat + (clust * 4);
+        wr32 (p, (rd32 (p) & 0xF0000000) | (val & 0x0FFFFFFF));
+    }
+    vol->fatDirty = true;
+}
+
+// Gets end of chain marker
+static inline uint32_t fatEoc (FatVol_t* vol)
+{
+    return (vol->type == 12) ? 0xFFF : (vol->type == 16) ? 0xFFFF : 0x0FFFFFFF;
+}
+
+// Checks if a FAT entry points to another cluster
+static inline bool fatIsNext (FatVol_t* vol, uint32_t val)
+{
+    return val >= 2 && val < vol->numClusts + 2;
+}
+
+// Allocates a cluster, linking it after prev if prev isn't 0
+static uint32_t fatAllocClust (FatVol_t* vol, uint32_t prev)
+{
+    for (uint32_t i = 0; i < vol->numClusts; ++i)
+    {
+        uint32_t clust = vol->nextFree + i;
+        if (clust >= vol->numClusts + 2)
+            clust -= vol->numClusts;
+        if (fatGet (vol, clust) == 0)
+        {
+            fatSet (vol, clust, fatEoc (vol));
+            if (prev)
+                fatSet (vol, prev, clust);
+            vol->nextFree = clust + 1;
+            if (vol->nextFree >= vol->numClusts + 2)
+                vol->nextFree = 2;
+            return clust;
+        }
+    }
+    error ("FAT volume is full");
+    return 0;
+}
+
+// Frees a chain of clusters
+static void fatFreeChain (FatVol_t* vol, uint32_t clust)
+{
+    while (fatIsNext (vol, clust))
+    {
+        uint32_t next = fatGet (vol, clust);
+        fatSet (vol, clust, 0);
+        clust = next;
+    }
+}
+
+// Gets offset of a cluster in the volume
+static inline off_t fatClustOff (FatVol_t* vol, uint32_t clust)
+{
+    return (vol->dataStart * (off_t) vol->sectSz) + ((clust - 2) * (off_t) vol->clustSz);
+}
+
+// Directories
+
+// Reads in a directory
+static bool fatReadDir (FatVol_t* vol, uint32_t clust, fatDir_t* dir)
+{
+    dir->clust = clust;
+    if (!clust && vol->type != 32)
+    {
+        dir->size = vol->rootEnts * FAT_DIRENT_SZ;
+        dir->buf = malloc_s (dir->size);
+        off_t off = (vol->resvdSects + (vol->numFats * vol->fatSects)) * (off_t) vol->sectSz;
+        return fatIo (vol, dir->buf, dir->size, off, false);
+    }
+    if (!clust)
+        clust = dir->clust = vol->rootClust;
+    // Size up the chain first
+    size_t numClusts = 0;
+    for (uint32_t cur = clust; fatIsNext (vol, cur); cur = fatGet (vol, cur))
+    {
+        if (++numClusts > vol->numClusts)
+        {
+            error ("FAT volume has a looping cluster chain");
+            return false;
+        }
+    }
+    dir->size = numClusts * vol->clustSz;
+    dir->buf = malloc_s (dir->size);
+    size_t off = 0;
+    for (uint32_t cur = clust; fatIsNext (vol, cur); cur = fatGet (vol, cur))
+    {
+        if (!fatIo (vol, dir->buf + off, vol->clustSz, fatClustOff (vol, cur), false))
+            return false;
+        off += vol->clustSz;
+    }
+    return true;
+}
+
+// Writes a directory back
+static bool fatWriteDir (FatVol_t* vol, fatDir_t* dir)
+{
+    if (!dir->clust)
+    {
+        off_t off = (vol->resvdSects + (vol->numFats * vol->fatSects)) * (off_t) vol->sectSz;
+        return fatIo (vol, dir->buf, dir->size, off, true);
+    }
+    size_t off = 0;
+    for (uint32_t cur = dir->clust; fatIsNext (vol, cur) && off < dir->size;
+         cur = fatGet (vol, cur))
+    {
+        if (!fatIo (vol, dir->buf + off, vol->clustSz, fatClustOff (vol, cur), true))
+            return false;
+        off += vol->clustSz;
+    }
+    return true;
+}
+
+// Adds a cluster to a directory
+static bool fatExtendDir (FatVol_t* vol, fatDir_t* dir)
+{
+    if (!dir->clust)
+    {
+        error ("FAT root directory is full");
+        return false;
+    }
+    uint32_t last = dir->clust;
+    while (fatIsNext (vol, fatGet (vol, last)))
+        last = fatGet (vol, last);
+    if (!fatAllocClust (vol, last))
+        return false;
+    uint8_t* buf = realloc (dir->buf, dir->size + vol->clustSz);
+    if (!buf)
+    {
+        error ("%s", strerror (errno));
+        return false;
+    }
+    memset (buf + dir->size, 0, vol->clustSz);
+    dir->buf = buf;
+    dir->size += vol->clustSz;
+    return true;
+}
+
+// Computes checksum of short name for long name entries
+static uint8_t fatLfnSum (const uint8_t* shortName)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; ++i)
+        sum = ((sum & 1) << 7) + (sum >> 1) + shortName[i];
+    return sum;
+}
+
+// Converts UTF-16 name to UTF-8
+static void fatUtf16To8 (const uint16_t* in, int len, char* out, size_t outSz)
+{
+    size_t o = 0;
+    for (int i = 0; i < len && in[i] && o + 4 < outSz; ++i)
+    {
+        uint16_t c = in[i];
+        if (c < 0x80)
+            out[o++] = c;
+        else if (c < 0x800)
+        {
+            out[o++] = 0xC0 | (c >> 6);
+            out[o++] = 0x80 | (c & 0x3F);
+        }
+        else
+        {
+            out[o++] = 0xE0 | (c >> 12);
+            out[o++] = 0x80 | ((c >> 6) & 0x3F);
+            out[o++] = 0x80 | (c & 0x3F);
+        }
+    }
+    out[o] = 0;
+}
+
+// Converts UTF-8 name to UTF-16. Returns length, or -1 if it's too long
+static int fatUtf8To16 (const char* in, uint16_t* out)
+{
+    const uint8_t* p = (const uint8_t*) in;
+    int len = 0;
+    while (*p)
+    {
+        if (len == FAT_NAME_MAX)
+            return -1;
+        uint16_t c = *p++;
+        if (c >= 0xE0 && p[0] && p[1])
+        {
+            c = ((c & 0x0F) << 12) | ((p[0] & 0x3F) << 6) | (p[1] & 0x3F);
+            p += 2;
+        }
+        else if (c >= 0xC0 && p[0])
+        {
+            c = ((c & 0x1F) << 6) | (p[0] & 0x3F);
+            ++p;
+        }
+        out[len++] = c;
+    }
+    return len;
+}
+
+// Gets the name of a short entry
+static void fatGetShortName (const uint8_t* ent, char* out)
+{
+    int o = 0;
+    bool lowerBase = ent[FAT_ENT_CASE] & FAT_CASE_BASE;
+    bool lowerExt = ent[FAT_ENT_CASE] & FAT_CASE_EXT;
+    for (int i = 0; i < 8 && ent[i] != ' '; ++i)
+        out[o++] = (lowerBase && ent[i] >= 'A' && ent[i] <= 'Z') ? ent[i] + 32 : ent[i];
+    // 0x05 stands for a leading 0xE5
+    if (o && (uint8_t) out[0] == 0x05)
+        out[0] = (char) 0xE5;
+    if (ent[8] != ' ')
+    {
+        out[o++] = '.';
+        for (int i = 8; i < 11 && ent[i] != ' '; ++i)
+            out[o++] = (lowerExt && ent[i] >= 'A' && ent[i] <= 'Z') ? ent[i] + 32 : ent[i];
+    }
+    out[o] = 0;
+}
+
+// Finds an entry in a directory
+// Returns false if it isn't there. first is set to the first entry of its long name
+static bool fatFindEnt (fatDir_t* dir, const char* name, size_t* idx, size_t* first)
+{
+    uint16_t lfn[FAT_NAME_MAX + FAT_LFN_CHARS] = {0};
+    bool haveLfn = false;
+    size_t lfnStart = 0;
+    uint8_t lfnSum = 0;
+    char entName[FAT_NAME_MAX * 3 + 1];
+    for (size_t i = 0; i < dir->size; i += FAT_DIRENT_SZ)
+    {
+        uint8_t* ent = dir->buf + i;
+        if (ent[0] == FAT_ENT_END)
+            break;
+        if (ent[0] == FAT_ENT_FREE)
+        {
+            haveLfn = false;
+            continue;
+        }
+        if (ent[FAT_ENT_ATTR] == FAT_ATTR_LFN)
+        {
+            int seq = ent[0] & 0x3F;
+            if (ent[0] & 0x40)
+            {
+                memset (lfn, 0, sizeof (lfn));
+                haveLfn = true;
+                lfnStart = i;
+                lfnSum = ent[13];
+            }
+            if (!seq || seq > (FAT_NAME_MAX + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS)
+            {
+                haveLfn = false;
+                continue;
+            }
+            for (int j = 0; j < FAT_LFN_CHARS; ++j)
+                lfn[((seq - 1) * FAT_LFN_CHARS) + j] = rd16 (ent + fatLfnOffs[j]);
+            continue;
+        }
+        if (ent[FAT_ENT_ATTR] & FAT_ATTR_VOLID)
+        {
+            haveLfn = false;
+            continue;
+        }
+        bool useLfn = haveLfn && fatLfnSum (ent) == lfnSum;
+        if (useLfn)
+            fatUtf16To8 (lfn, FAT_NAME_MAX, entName, sizeof (entName));
+        else
+            fatGetShortName (ent, entName);
+        haveLfn = false;
+        if (!strcasecmp (entName, name))
+        {
+            *idx = i;
+            *first = (useLfn) ? lfnStart : i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Checks if a short name is in a directory
+static bool fatShortExists (fatDir_t* dir, const uint8_t* shortName)
+{
+    for (size_t i = 0; i < dir->size; i += FAT_DIRENT_SZ)
+    {
+        uint8_t* ent = dir->buf + i;
+        if (ent[0] == FAT_ENT_END)
+            break;
+        if (ent[0] != FAT_ENT_FREE && ent[FAT_ENT_ATTR] != FAT_ATTR_LFN &&
+            !memcmp (ent, shortName, 11))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Checks if a character can be in a short name
+// Short names are in an OEM code page, so anything that isn't ASCII needs a long name
+static bool fatIsShortChar (char c)
+{
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))
+        return true;
+    return c && strchr ("!#$%&'()-@^_`{}~", c);
+}
+
+// Fills in one part of a short name. Returns false if it doesn't fit exactly
+static bool fatFillShort (uint8_t* out, const char* in, size_t inLen, size_t outLen, bool* lower)
+{
+    bool hasLower = false, hasUpper = false, fits = inLen <= outLen;
+    size_t o = 0;
+    for (size_t i = 0; i < inLen; ++i)
+    {
+        char c = in[i];
+        if (c >= 'a' && c <= 'z')
+        {
+            hasLower = true;
+            c -= 32;
+        }
+        else if (c >= 'A' && c <= 'Z')
+            hasUpper = true;
+        if (!fatIsShortChar (c))
+        {
+            fits = false;
+            // Drop spaces, dots, and UTF-8 continuation bytes
+            if (c == ' ' || c == '.' || ((uint8_t) c >= 0x80 && (uint8_t) c < 0xC0))
+                continue;
+            c = '_';
+        }
+        if (o < outLen)
+            out[o++] = c;
+    }
+    *lower = hasLower;
+    return fits && !(hasLower && hasUpper);
+}
+
+// Makes the short name of name. Returns true if a long name is needed as well
+static bool fatMakeShortName (fatDir_t* dir, const char* name, uint8_t* shortName, uint8_t* flags)
+{
+    memset (shortName, ' ', 11);
+    *flags = 0;
+    const char* dot = strrchr (name, '.');
+    if (dot == name)
+        dot = NULL;    // Leading dot isn't an extension
+    size_t baseLen = (dot) ? (size_t) (dot - name) : strlen (name);
+    bool lowerBase = false, lowerExt = false;
+    bool fits = fatFillShort (shortName, name, baseLen, 8, &lowerBase) && baseLen;
+    if (dot && !fatFillShort (shortName + 8, dot + 1, strlen (dot + 1), 3, &lowerExt))
+        fits = false;
+    if (fits && !fatShortExists (dir, shortName))
+    {
+        *flags = ((lowerBase) ? FAT_CASE_BASE : 0) | ((lowerExt) ? FAT_CASE_EXT : 0);
+        return false;
+    }
+    // Make a numbered short name
+    if (shortName[0] == ' ')
+        shortName[0] = '_';
+    int baseChars = 0;
+    while (baseChars < 6 && shortName[baseChars] != ' ')
+        ++baseChars;
+    for (int num = 1; num < 1000000; ++num)
+    {
+        char tail[8];
+        int tailLen = snprintf (tail, sizeof (tail), "~%d", num);
+        int keep = (baseChars + tailLen > 8) ? 8 - tailLen : baseChars;
+        memset (shortName + keep, ' ', 8 - keep);
+        memcpy (shortName + keep, tail, tailLen);
+        if (!fatShortExists (dir, shortName))
+            break;
+    }
+    return true;
+}
+
+// Converts a time to FAT date and time
+static void fatPutTime (time_t t, uint8_t* timeOut, uint8_t* dateOut)
+{
+    struct tm tm;
+    gmtime_r (&t, &tm);
+    if (tm.tm_year < 80)
+    {
+        wr16 (timeOut, 0);
+        wr16 (dateOut, (1 << 5) | 1);
+        return;
+    }
+    wr16 (timeOut, (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2));
+    wr16 (dateOut, ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday);
+}
+
+// Converts FAT date and time to a time
+static time_t fatGetTime (const uint8_t* timeIn, const uint8_t* dateIn)
+{
+    uint16_t t = rd16 (timeIn);
+    uint16_t d = rd16 (dateIn);
+    struct tm tm = {0};
+    tm.tm_sec = (t & 0x1F) * 2;
+    tm.tm_min = (t >> 5) & 0x3F;
+    tm.tm_hour = t >> 11;
+    tm.tm_mday = d & 0x1F;
+    tm.tm_mon = ((d >> 5) & 0x0F) - 1;
+    tm.tm_year = (d >> 9) + 80;
+    return timegm (&tm);
+}
+
+// Gets first cluster of an entry
+static inline uint32_t fatEntClust (FatVol_t* vol, const uint8_t* ent)
+{
+    uint32_t clust = rd16 (ent + FAT_ENT_CLUSTLO);
+    if (vol->type == 32)
+        clust |= (uint32_t) rd16 (ent + FAT_ENT_CLUSTHI) << 16;
+    return clust;
+}
+
+static inline void fatSetEntClust (const FatVol_t* vol, uint8_t* ent, uint32_t clust)
+{
+    wr16 (ent + FAT_ENT_CLUSTLO, clust & 0xFFFF);
+    wr16 (ent + FAT_ENT_CLUSTHI, (vol->type == 32) ? clust >> 16 : 0);
+}
+
+// Adds entries for name to a directory. Returns offset of short entry, or -1 on error
+static ssize_t fatAddEnt (FatVol_t* vol, fatDir_t* dir, const char* name, time_t t)
+{
+    uint16_t name16[FAT_NAME_MAX + FAT_LFN_CHARS];
+    int len16 = fatUtf8To16 (name, name16);
+    if (len16 <= 0)
+    {
+        error ("FAT volume: bad name \"%s\"", name);
+        return -1;
+    }
+    uint8_t shortName[11];
+    uint8_t flags = 0;
+    bool needLfn = fatMakeShortName (dir, name, shortName, &flags);
+    size_t numLfn = (needLfn) ? (len16 + FAT_LFN_CHARS - 1) / FAT_LFN_CHARS : 0;
+    size_t numEnts = numLfn + 1;
+    // Find a run of free entries
+    size_t run = 0, start = 0;
+    size_t i = 0;
+    while (run < numEnts)
+    {
+        if (i >= dir->size && !fatExtendDir (vol, dir))
+            return -1;
+        uint8_t first = dir->buf[i];
+        if (first == FAT_ENT_END || first == FAT_ENT_FREE)
+        {
+            if (!run)
+                start = i;
+            ++run;
+        }
+        else
+            run = 0;
+        i += FAT_DIRENT_SZ;
+    }
+    // Write long name, last part first
+    uint8_t sum = fatLfnSum (shortName);
+    for (size_t j = 0; j < numLfn; ++j)
+    {
+        size_t seq = numLfn - j;
+        uint8_t* ent = dir->buf + start + (j * FAT_DIRENT_SZ);
+        memset (ent, 0, FAT_DIRENT_SZ);
+        ent[0] = seq | ((j == 0) ? 0x40 : 0);
+        ent[FAT_ENT_ATTR] = FAT_ATTR_LFN;
+        ent[13] = sum;
+        for (int k = 0; k < FAT_LFN_CHARS; ++k)
+        {
+            int pos = ((seq - 1) * FAT_LFN_CHARS) + k;
+            uint16_t c = (pos < len16) ? name16[pos] : (pos == len16) ? 0 : 0xFFFF;
+            wr16 (ent + fatLfnOffs[k], c);
+        }
+    }
+    uint8_t* ent = dir->buf + start + (numLfn * FAT_DIRENT_SZ);
+    memset (ent, 0, FAT_DIRENT_SZ);
+    memcpy (ent, shortName, 11);
+    ent[FAT_ENT_CASE] = flags;
+    fatPutTime (t, ent + FAT_ENT_CTIME, ent + FAT_ENT_CDATE);
+    fatPutTime (t, ent + FAT_ENT_MTIME, ent + FAT_ENT_MDATE);
+    memcpy (ent + FAT_ENT_ADATE, ent + FAT_ENT_MDATE, 2);
+    return (ssize_t) (start + (numLfn * FAT_DIRENT_SZ));
+}
+
+// Makes a directory in a directory. Returns its first cluster, or 0 on error
+static uint32_t fatMakeDir (FatVol_t* vol, fatDir_t* parent, const char* name)
+{
+    time_t now = time (NULL);
+    ssize_t off = fatAddEnt (vol, parent, name, now);
+    if (off == -1)
+        return 0;
+    uint32_t clust = fatAllocClust (vol, 0);
+    if (!clust)
+        return 0;
+    uint8_t* ent = parent->buf + off;
+    ent[FAT_ENT_ATTR] = FAT_ATTR_DIR;
+    fatSetEntClust (vol, ent, clust);
+    // Write out the new directory with its dot entries
+    uint8_t* buf = calloc_s (vol->clustSz);
+    memcpy (buf, ent, FAT_DIRENT_SZ);
+    memcpy (buf, ".          ", 11);
+    buf[FAT_ENT_CASE] = 0;
+    memcpy (buf + FAT_DIRENT_SZ, buf, FAT_DIRENT_SZ);
+    memcpy (buf + FAT_DIRENT_SZ, "..         ", 11);
+    // The root is always cluster 0 here
+    uint32_t parentClust = (parent->clust == vol->rootClust) ? 0 : parent->clust;
+    fatSetEntClust (vol, buf + FAT_DIRENT_SZ, parentClust);
+    bool res = fatIo (vol, buf, vol->clustSz, fatClustOff (vol, clust), true);
+    free (buf);
+    if (!res || !fatWriteDir (vol, parent))
+        return 0;
+    return clust;
+}
+
+// Finds the directory a path is in, making directories if asked
+// Returns false on error, with dir read in if it worked. Sets *base to last component
+static bool fatWalk (FatVol_t* vol, const char* path, bool create, fatDir_t* dir, char** base)
+{
+    char* copy = strdup (path);
+    char* last = strrchr (copy, '/');
+    *base = strdup ((last) ? last + 1 : copy);
+    if (!fatReadDir (vol, 0, dir))
+        goto fail;
+    if (!last)
+    {
+        free (copy);
+        return true;
+    }
+    *last = 0;
+    char* save = NULL;
+    for (char* comp = strtok_r (copy, "/", &save); comp; comp = strtok_r (NULL, "/", &save))
+    {
+        size_t idx = 0, first = 0;
+        uint32_t clust = 0;
+        if (fatFindEnt (dir, comp, &idx, &first))
+        {
+            uint8_t* ent = dir->buf + idx;
+            if (!(ent[FAT_ENT_ATTR] & FAT_ATTR_DIR))
+            {
+                error ("FAT volume: %s is not a directory", comp);
+                goto fail;
+            }
+            clust = fatEntClust (vol, ent);
+        }
+        else if (!create)
+            goto fail;
+        else if (!(clust = fatMakeDir (vol, dir, comp)))
+            goto fail;
+        free (dir->buf);
+        dir->buf = NULL;
+        if (!fatReadDir (vol, clust, dir))
+            goto fail;
+    }
+    free (copy);
+    return true;
+fail:
+    free (copy);
+    free (*base);
+    free (dir->buf);
+    dir->buf = NULL;
+    return false;
+}
+
+FatVol_t* fatOpen (const char* file, off_t base)
+{
+    FatVol_t* vol = calloc_s (sizeof (FatVol_t));
+    vol->base = base;
+    vol->fd = open (file, O_RDWR);
+    if (vol->fd == -1)
+    {
+        error ("%s: %s", file, strerror (errno));
+        free (vol);
+        return NULL;
+    }
+    // Read in the BPB
+    uint8_t bpb[IMG_SECT_SZ];
+    if (!fatIo (vol, bpb, IMG_SECT_SZ, 0, false))
+        goto fail;
+    vol->sectSz = rd16 (bpb + 11);
+    uint32_t clustSects = bpb[13];
+    vol->resvdSects = rd16 (bpb + 14);
+    vol->numFats = bpb[16];
+    vol->rootEnts = rd16 (bpb + 17);
+    uint32_t totalSects = (rd16 (bpb + 19)) ? rd16 (bpb + 19) : rd32 (bpb + 32);
+    vol->fatSects = (rd16 (bpb + 22)) ? rd16 (bpb + 22) : rd32 (bpb + 36);
+    if (rd16 (bpb + 510) != 0xAA55 || vol->sectSz < 512 || (vol->sectSz & (vol->sectSz - 1)) ||
+        !clustSects || (clustSects & (clustSects - 1)) || !vol->numFats || !vol->fatSects)
+    {
+        error ("%s: partition doesn't have a FAT file system", file);
+        goto fail;
+    }
+    vol->clustSz = vol->sectSz * clustSects;
+    uint32_t rootSects = ((vol->rootEnts * FAT_DIRENT_SZ) + vol->sectSz - 1) / vol->sectSz;
+    vol->dataStart = vol->resvdSects + (vol->numFats * vol->fatSects) + rootSects;
+    if (totalSects <= vol->dataStart)
+    {
+        error ("%s: partition doesn't have a FAT file system", file);
+        goto fail;
+    }
+    vol->numClusts = (totalSects - vol->dataStart) / clustSects;
+    if (vol->numClusts < 4085)
+        vol->type = 12;
+    else if (vol->numClusts < 65525)
+        vol->type = 16;
+    else
+    {
+        vol->type = 32;
+        vol->rootClust = rd32 (bpb + 44);
+        vol->fsInfoSect = rd16 (bpb + 48);
+    }
+    // Read in the first FAT
+    vol->fatBytes = vol->fatSects * (size_t) vol->sectSz;
+    size_t neededBytes = ((vol->numClusts + 2) * (size_t) vol->type + 7) / 8;
+    if (neededBytes > vol->fatBytes)
+    {
+        error ("%s: FAT is too small for partition", file);
+        goto fail;
+    }
+    vol->fat = malloc_s (vol->fatBytes);
+    if (!fatIo (vol, vol->fat, vol->fatBytes, vol->resvdSects * (off_t) vol->sectSz, false))
+        goto fail;
+    vol->nextFree = 2;
+    return vol;
+fail:
+    close (vol->fd);
+    free (vol->fat);
+    free (vol);
+    return NULL;
+}
+
+bool fatGetMtime (FatVol_t* vol, const char* path, bool* exists, time_t* mtime)
+{
+    *exists = false;
+    fatDir_t dir = {0};
+    char* base = NULL;
+    if (!fatWalk (vol, path, false, &dir, &base))
+        return true;    // Directory isn't there either
+    size_t idx = 0, first = 0;
+    if (fatFindEnt (&dir, base, &idx, &first))
+    {
+        uint8_t* ent = dir.buf + idx;
+        *exists = !(ent[FAT_ENT_ATTR] & FAT_ATTR_DIR);
+        *mtime = fatGetTime (ent + FAT_ENT_MTIME, ent + FAT_ENT_MDATE);
+    }
+    free (dir.buf);
+    free (base);
+    return true;
+}
+
+bool fatMkdir (FatVol_t* vol, const char* path)
+{
+    if (!*path)
+        return true;
+    // Walk to a child of the directory, so the whole path gets made
+    char* child = malloc_s (strlen (path) + 3);
+    sprintf (child, "%s/x", path);
+    fatDir_t dir = {0};
+    char* base = NULL;
+    bool res = fatWalk (vol, child, true, &dir, &base);
+    free (child);
+    if (res)
+    {
+        free (dir.buf);
+        free (base);
+    }
+    return res;
+}
+
+// Writes out file data to a new cluster chain. Returns first cluster, or 0 if it's empty
+static bool fatWriteData (FatVol_t* vol, int srcFd, uint64_t size, uint32_t* first)
+{
+    *first = 0;
+    size_t bufSz = (FAT_WRITE_SZ / vol->clustSz) * vol->clustSz;
+    if (!bufSz)
+        bufSz = vol->clustSz;
+    uint8_t* buf = malloc_s (bufSz);
+    uint32_t prev = 0;
+    uint64_t left = size;
+    bool res = true;
+    while (left && res)
+    {
+        size_t chunk = (left < bufSz) ? left : bufSz;
+        size_t got = 0;
+        while (got < chunk)
+        {
+            ssize_t bytesRead = read (srcFd, buf + got, chunk - got);
+            if (bytesRead <= 0)
+            {
+                error ("%s", (bytesRead == 0) ? "file shrank while copying" : strerror (errno));
+                res = false;
+                break;
+            }
+            got += bytesRead;
+        }
+        if (!res)
+            break;
+        size_t numClusts = (chunk + vol->clustSz - 1) / vol->clustSz;
+        memset (buf + chunk, 0, (numClusts * vol->clustSz) - chunk);
+        // Write runs of contiguous clusters together
+        size_t runStart = 0;
+        uint32_t runClust = 0;
+        for (size_t i = 0; i < numClusts && res; ++i)
+        {
+            uint32_t clust = fatAllocClust (vol, prev);
+            if (!clust)
+            {
+                res = false;
+                break;
+            }
+            if (!*first)
+                *first = clust;
+            if (i && clust != prev + 1)
+            {
+                res = fatIo (vol,
+                             buf + (runStart * vol->clustSz),
+                             (i - runStart) * vol->clustSz,
+                             fatClustOff (vol, runClust),
+                             true);
+                runStart = i;
+                runClust = clust;
+            }
+            else if (!i)
+                runClust = clust;
+            prev = clust;
+        }
+        if (res)
+        {
+            res = fatIo (vol,
+                         buf + (runStart * vol->clustSz),
+                         (numClusts - runStart) * vol->clustSz,
+                         fatClustOff (vol, runClust),
+                         true);
+        }
+        left -= chunk;
+    }
+    free (buf);
+    if (!res)
+    {
+        fatFreeChain (vol, *first);
+        *first = 0;
+    }
+    return res;
+}
+
+bool fatWriteFile (FatVol_t* vol, const char* path, const char* src, struct stat* srcSt)
+{
+    if ((uint64_t) srcSt->st_size > UINT32_MAX)
+    {
+        error ("%s: too big for FAT", src);
+        return false;
+    }
+    int srcFd = open (src, O_RDONLY);
+    if (srcFd == -1)
+    {
+        error ("%s: %s", src, strerror (errno));
+        return false;
+    }
+    fatDir_t dir = {0};
+    char* base = NULL;
+    if (!fatWalk (vol, path, true, &dir, &base))
+    {
+        close (srcFd);
+        return false;
+    }
+    bool res = false;
+    uint32_t first = 0;
+    size_t idx = 0, firstEnt = 0;
+    ssize_t off = 0;
+    if (fatFindEnt (&dir, base, &idx, &firstEnt))
+    {
+        if (dir.buf[idx + FAT_ENT_ATTR] & FAT_ATTR_DIR)
+        {
+            error ("FAT volume: %s is a directory", path);
+            goto end;
+        }
+        fatFreeChain (vol, fatEntClust (vol, dir.buf + idx));
+        off = idx;
+    }
+    else if ((off = fatAddEnt (vol, &dir, base, srcSt->st_mtime)) == -1)
+        goto end;
+    if (!fatWriteData (vol, srcFd, srcSt->st_size, &first))
+        goto end;
+    uint8_t* ent = dir.buf + off;
+    ent[FAT_ENT_ATTR] = FAT_ATTR_ARCHIVE;
+    fatSetEntClust (vol, ent, first);
+    wr32 (ent + FAT_ENT_SIZE, srcSt->st_size);
+    fatPutTime (srcSt->st_mtime, ent + FAT_ENT_MTIME, ent + FAT_ENT_MDATE);
+    memcpy (ent + FAT_ENT_ADATE, ent + FAT_ENT_MDATE, 2);
+    res = fatWriteDir (vol, &dir);
+end:
+    close (srcFd);
+    free (dir.buf);
+    free (base);
+    return res;
+}
+
+bool fatRemove (FatVol_t* vol, const char* path)
+{
+    fatDir_t dir = {0};
+    char* base = NULL;
+    if (!fatWalk (vol, path, false, &dir, &base))
+        return true;
+    bool res = true;
+    size_t idx = 0, first = 0;
+    if (fatFindEnt (&dir, base, &idx, &first) && !(dir.buf[idx + FAT_ENT_ATTR] & FAT_ATTR_DIR))
+    {
+        fatFreeChain (vol, fatEntClust (vol, dir.buf + idx));
+        for (size_t i = first; i <= idx; i += FAT_DIRENT_SZ)
+            dir.buf[i] = FAT_ENT_FREE;
+        res = fatWriteDir (vol, &dir);
+    }
+    free (dir.buf);
+    free (base);
+    return res;
+}
+
+bool fatClose (FatVol_t* vol)
+{
+    bool res = true;
+    if (vol->fatDirty)
+    {
+        for (uint32_t i = 0; i < vol->numFats && res; ++i)
+        {
+            off_t off = (vol->resvdSects + (i * vol->fatSects)) * (off_t) vol->sectSz;
+            res = fatIo (vol, vol->fat, vol->fatBytes, off, true);
+        }
+        // Keep the free count in FSInfo right
+        uint8_t fsInfo[IMG_SECT_SZ];
+        off_t infoOff = vol->fsInfoSect * (off_t) vol->sectSz;
+        if (res && vol->type == 32 && vol->fsInfoSect &&
+            fatIo (vol, fsInfo, IMG_SECT_SZ, infoOff, false) && rd32 (fsInfo) == 0x41615252 &&
+            rd32 (fsInfo + 484) == 0x61417272)
+        {
+            uint32_t numFree = 0;
+            for (uint32_t clust = 2; clust < vol->numClusts + 2; ++clust)
+                numFree += !fatGet (vol, clust);
+            wr32 (fsInfo + 488, numFree);
+            wr32 (fsInfo + 492, vol->nextFree);
+            res = fatIo (vol, fsInfo, IMG_SECT_SZ, infoOff, true);
+        }
+    }
+    if (close (vol->fd) == -1)
+        res = false;
+    free (vol->fat);
+    free (vol);
+    return res;
+}
@@ -63,14 +63,21 @@ static bool askOverwrite (const char* file)
         return false;
 }
 
-static bool createImageInternal (const char* action,
+// Creates an image file
+// Raw images are made sparse with ftruncate, or allocated up front with posix_fallocate, rather
+// than writing out zeroes. QCOW2 images are made by libguestfs
+static bool createImageInternal (guestfs_h* guestFs,
+                                 const char* action,
                                  bool overwrite,
                                  const char* file,
                                  size_t mul,
-                                 size_t sz)
+                                 size_t sz,
+                                 short alloc,
+                                 short fileFormat)
 {
     int fileNo = 0;
     struct stat st;
+    off_t size = muls[mul] * (off_t) sz;
     // Check if file exists
     if ((stat (file, &st) == -1))
     {
@@ -85,7 +92,9 @@ static bool createImageInternal (const char* action,
         if (strcmp (action, "create") != 0)
         {
             // Check size of file to see if its has already been created
-            if (st.st_size == (muls[mul] * (long) sz))
+            if (fileFormat == IMG_FILE_QCOW2 && guestfs_disk_virtual_size (guestFs, file) == size)
+                return true;
+            else if (fileFormat == IMG_FILE_RAW && st.st_size == size)
                 return true;
         }
         // Check if we need to ask the user if we should overwrite the file
@@ -95,6 +104,17 @@ static bool createImageInternal (const char* action,
         if (!overwrite)
             return false;
     }
+    if (fileFormat == IMG_FILE_QCOW2)
+    {
+        const char* prealloc = (alloc == IMG_ALLOC_FULL) ? "falloc" : "off";
+        return guestfs_disk_create (guestFs,
+                                    file,
+                                    "qcow2",
+                                    size,
+                                    GUESTFS_DISK_CREATE_PREALLOCATION,
+                                    prealloc,
+                                    -1) != -1;
+    }
     // Create the file
     fileNo = open (file, O_RDWR | O_CREAT | O_TRUNC, 0755);
     if (fileNo == -1)
@@ -102,22 +122,17 @@ static bool createImageInternal (const char* action,
         error ("%s: %s", file, strerror (errno));
         return false;
     }
-    // Write out as many zeroes as conf specified
-    uint8_t* buf = malloc_s (muls[mul]);
-    if (!buf)
-        return false;
-    memset (buf, 0, muls[mul]);
-    for (int i = 0; i < sz; ++i)
+    int res = 0;
+    if (alloc == IMG_ALLOC_FULL)
+        res = posix_fallocate (fileNo, 0, size);
+    else if (ftruncate (fileNo, size) == -1)
+        res = errno;
+    close (fileNo);
+    if (res)
     {
-        if (write (fileNo, buf, muls[mul]) == -1)
-        {
-            error ("%s", strerror (errno));
-            free (buf);
-            return false;
-        }
+        error ("%s: %s", file, strerror (res));
+        return false;
     }
-    free (buf);
-    close (fileNo);
     return true;
 }
 
@@ -133,10 +148,6 @@ static bool createImage (Image_t* img, const char* action, bool overwrite, const
         error ("default image name not specified");
         return false;
     }
-    // Create guestfs instance
-    img->guestFs = guestfs_create();
-    if (!img->guestFs)
-        return false;
     if (!strcmp (action, "all") || !strcmp (action, "create"))
     {
         if (img->format != IMG_FORMAT_ISO9660)
@@ -149,7 +160,14 @@ static bool createImage (Image_t* img, const char* action, bool overwrite, const
         // If this is an ISO image, bail out
         if (img->format == IMG_FORMAT_ISO9660)
             return true;
-        return createImageInternal (action, overwrite, img->file, img->mul, img->sz);
+        return createImageInternal (img->guestFs,
+                                    action,
+                                    overwrite,
+                                    img->file,
+                                    img->mul,
+                                    img->sz,
+                                    img->alloc,
+                                    img->fileFormat);
     }
     else
     {
@@ -205,9 +223,9 @@ static bool formatPartition (const char* action, Image_t* img, Partition_t* part
             part->name,
             fsTypeNames[part->filesys]);
     // Device used by guestfs to represent disk to partition
-    const char* guestFsDev = "/dev/sdb";
+    const char* guestFsDev = img->dev;
     if (part->isAltBootPart)
-        guestFsDev = "/dev/sdc";
+        guestFsDev = img->altDev;
     // Handle ISO9660 boot partition case
     if (img->format == IMG_FORMAT_ISO9660)
     {
@@ -369,7 +387,8 @@ static bool runScript (const char* script, const char** argv)
 }
 
 // Runs writeiso.sh to create ISO9660 image
-bool writeIso (Image_t* img)
+// On updates, changed files are patched into the last image instead when they still fit
+bool writeIso (Image_t* img, const char* action)
 {
     // Prepare script name
     const char* script = "writeiso.sh";
@@ -386,6 +405,13 @@ bool writeIso (Image_t* img)
             return false;
         }
     }
+    // TODO: allow xorriso list file to be dynamically changed
+    const char* listFile = "xorrisolst.txt";
+    if (!strcmp (action, "update") && patchIso (img, listFile))
+    {
+        free (scriptPath);
+        return true;
+    }
     // Prepare argv
     static const char* argv[9];
     const char* empty = "";
@@ -393,8 +419,7 @@ bool writeIso (Image_t* img)
         argv[i] = empty;
     argv[0] = script;
     argv[1] = img->file;
-    // TODO: allow xorriso list file to be dynamically changed
-    argv[2] = "xorrisolst.txt";
+    argv[2] = listFile;
     // FIXME: memory leak
     if (bootImg)
         argv[3] = basename (strdup (bootImg));
@@ -407,403 +432,574 @@ bool writeIso (Image_t* img)
     // Run it
     if (!runScript (scriptPath, argv))
         return false;
+    // Remember where files were put for the next update
+    saveIsoLayout (img, listFile);
     return true;
 }
 
-bool createImages (ListHead_t* images,
-                   const char* action,
-                   bool overwrite,
-                   const char* file,
-                   const char* listFile)
+// Checks if an update can write an image's partitions without the appliance
+static bool canWriteFat (Image_t* img)
 {
-    // Get host prefix
-    hostPrefix = getenv ("NNDESTDIR");
-    if (!hostPrefix)
+    if (img->format == IMG_FORMAT_ISO9660 || img->fileFormat != IMG_FILE_RAW)
+        return false;
+    // Floppies are always FAT12
+    if (img->format == IMG_FORMAT_FLOPPY)
+        return true;
+    ListEntry_t* partEntry = ListFront (img->partsList);
+    while (partEntry)
     {
-        error ("variable NNDESTDIR must be set");
+        Partition_t* part = ListEntryData (partEntry);
+        if (part->filesys != IMG_FILESYS_FAT12 && part->filesys != IMG_FILESYS_FAT16 &&
+            part->filesys != IMG_FILESYS_FAT32)
+        {
+            return false;
+        }
+        partEntry = ListIterate (partEntry);
+    }
+    return true;
+}
+
+// Appliance shared by the disk images of a run
+// Launching the appliance takes most of the time of a run, so the drives of every disk image
+// are added to one handle that is launched once. ISO9660 images get a handle of their own, as
+// the El Torito boot images they attach are the same files for every image
+static guestfs_h* sessionFs = NULL;
+
+// Drives added to the shared appliance
+static int sessionDrives = 0;
+
+// Gets the device of a drive in the appliance
+static void getDriveName (int drive, char* dev)
+{
+    if (drive < 26)
+        sprintf (dev, "/dev/sd%c", 'a' + drive);
+    else
+        sprintf (dev, "/dev/sd%c%c", 'a' + (drive / 26) - 1, 'a' + (drive % 26));
+}
+
+// Gets the handle an image is worked on with
+static bool getImageFs (Image_t* img, const char* rootImage)
+{
+    if (img->format == IMG_FORMAT_ISO9660)
+    {
+        img->guestFs = guestfs_create();
+        if (!img->guestFs)
+            return false;
+        strcpy (img->dev, "/dev/sdb");
+        strcpy (img->altDev, "/dev/sdc");
+        return guestfs_add_drive (img->guestFs, rootImage) != -1;
+    }
+    if (!sessionFs)
+    {
+        sessionFs = guestfs_create();
+        if (!sessionFs)
+            return false;
+        // Root file system is always the first drive
+        if (guestfs_add_drive (sessionFs, rootImage) == -1)
+        {
+            guestfs_close (sessionFs);
+            sessionFs = NULL;
+            return false;
+        }
+        sessionDrives = 1;
+    }
+    img->guestFs = sessionFs;
+    return true;
+}
+
+// Checks an image, creates its files, and adds its drives to the appliance
+static bool setupImage (Image_t* img,
+                        const char* action,
+                        bool overwrite,
+                        const char* file,
+                        const char* rootImage)
+{
+    // Sanity checks
+    // Ensure a partition format was specified
+    if (!img->format)
+    {
+        error ("partition table format not specified on image %s", img->name);
         return false;
     }
-    // Get script root
-    scriptRoot = getenv ("NNSCRIPTROOT");
-    if (!scriptRoot)
+    if (!img->sz && (img->format != IMG_FORMAT_FLOPPY && img->format != IMG_FORMAT_ISO9660))
     {
-        error ("variable NNSCRIPTROOT must be set");
+        error ("image size not set on image %s", img->name);
         return false;
     }
-    // Get path of root image
-    char rootImage[256];
-    // We reserve space for file name
-    if (strlcpy (rootImage, scriptRoot, 256) >= (256 - 17))
+    // Set default multiplier. KiB on floppies, MiB elsewhere
+    if (!img->mul)
     {
-        error ("buffer overflow detected");
+        if (img->format == IMG_FORMAT_FLOPPY)
+            img->mul = IMG_MUL_KIB;
+        else
+            img->mul = IMG_MUL_MIB;
+    }
+    // Ensure that a boot emulation was specified only on ISO9660
+    if (!img->bootMode)
+        img->bootMode = IMG_BOOTMODE_NOBOOT;
+    // Boot records are written straight to the image file, and xorriso writes ISOs
+    if (img->fileFormat == IMG_FILE_QCOW2 &&
+        (img->format == IMG_FORMAT_ISO9660 || img->bootMode == IMG_BOOTMODE_BIOS ||
+         img->bootMode == IMG_BOOTMODE_HYBRID))
+    {
+        error ("QCOW2 image %s can't be an ISO9660 image or boot with BIOS", img->name);
         return false;
     }
-    strcat (rootImage, "guestfs_root.img");
-    // Loop through every image
-    ListEntry_t* imgEntry = ListFront (images);
-    while (imgEntry)
+    // Ensure partition count for MBR is less than 4
+    if (img->format == IMG_FORMAT_MBR)
     {
-        Image_t* img = ListEntryData (imgEntry);
-        // Sanity checks
-        // Ensure a partition format was specified
-        if (!img->format)
+        if (img->partCount > 4)
         {
-            error ("partition table format not specified on image %s", img->name);
-            goto nextImg;
-        }
-        if (!img->sz && (img->format != IMG_FORMAT_FLOPPY && img->format != IMG_FORMAT_ISO9660))
-        {
-            error ("image size not set on image %s", img->name);
-            goto nextImg;
+            error ("partition count > 4 not allowed on MBR disks!");
+            return false;
         }
-        // Set default multiplier. KiB on floppies, MiB elsewhere
-        if (!img->mul)
+    }
+    else if (img->format == IMG_FORMAT_ISO9660)
+    {
+        if (!img->bootEmu)
+            img->bootEmu = IMG_BOOTEMU_NONE;
+    }
+    // Check if we need a bootable partition
+    if (img->bootMode != IMG_BOOTMODE_NOBOOT && img->bootEmu != IMG_BOOTEMU_NONE)
+    {
+        if (!getBootPart (img))
         {
-            if (img->format == IMG_FORMAT_FLOPPY)
-                img->mul = IMG_MUL_KIB;
-            else
-                img->mul = IMG_MUL_MIB;
+            error ("bootable partition not found on image %s", img->name);
+            return false;
         }
-        // Ensure that a boot emulation was specified only on ISO9660
-        if (!img->bootMode)
-            img->bootMode = IMG_BOOTMODE_NOBOOT;
-        // Ensure partition count for MBR is less than 4
-        if (img->format == IMG_FORMAT_MBR)
+        // Check if we need an alternate boot partition
+        if (img->format == IMG_FORMAT_ISO9660 && img->bootMode == IMG_BOOTMODE_HYBRID &&
+            !getAltBootPart (img))
         {
-            if (img->partCount > 4)
-            {
-                error ("partition count > 4 not allowed on MBR disks!");
-                goto nextImg;
-            }
+            error ("alternate boot partition not found on image %s", img->name);
+            return false;
         }
-        else if (img->format == IMG_FORMAT_ISO9660)
+    }
+    if (!getImageFs (img, rootImage))
+        return false;
+    if (!createImage (img, action, overwrite, file))
+        return false;
+    // Updating FAT partitions is done straight on the image file, which saves booting the
+    // appliance. Formatting still needs it, so this is only for updates
+    img->fatDirect = !strcmp (action, "update") && canWriteFat (img);
+    if (img->fatDirect)
+        return true;
+    // Add image to guestfs handle
+    if (img->format != IMG_FORMAT_ISO9660)
+    {
+        const char* format = (img->fileFormat == IMG_FILE_QCOW2) ? "qcow2" : "raw";
+        if (guestfs_add_drive_opts (img->guestFs,
+                                    img->file,
+                                    GUESTFS_ADD_DRIVE_OPTS_FORMAT,
+                                    format,
+                                    -1) == -1)
         {
-            if (!img->bootEmu)
-                img->bootEmu = IMG_BOOTEMU_NONE;
+            return false;
         }
-        // Check if we need a bootable partition
-        if (img->bootMode != IMG_BOOTMODE_NOBOOT && img->bootEmu != IMG_BOOTEMU_NONE)
+        getDriveName (sessionDrives++, img->dev);
+    }
+    else
+    {
+        // Check if image needs a temp boot image
+        if (getBootPart (img))
         {
-            if (!getBootPart (img))
+            // Create temporary image
+            bootImg = getenv ("NNBOOTIMG");
+            if (!bootImg)
             {
-                error ("bootable partition not found on image %s", img->name);
-                goto nextImgNoClean;
+                error ("NNBOOTIMG not set in environment");
+                return false;
             }
-            // Check if we need an alternate boot partition
-            if (img->format == IMG_FORMAT_ISO9660 && img->bootMode == IMG_BOOTMODE_HYBRID &&
-                !getAltBootPart (img))
+            size_t sz = getBootPart (img)->start;
+            if (img->bootEmu == IMG_BOOTEMU_FDD)
+                sz = getBootPart (img)->sz;
+            else
+                sz += getBootPart (img)->sz + 10;
+            if (!createImageInternal (img->guestFs,
+                                      action,
+                                      true,
+                                      bootImg,
+                                      img->mul,
+                                      sz,
+                                      img->alloc,
+                                      IMG_FILE_RAW))
             {
-                error ("alternate boot partition not found on image %s", img->name);
-                goto nextImgNoClean;
+                return false;
             }
+            // Add to guestfs
+            if (guestfs_add_drive (img->guestFs, bootImg) == -1)
+                return false;
         }
-        if (!createImage (img, action, overwrite, file))
-            goto nextImgNoClean;
-        // Add root filesystem
-        if (guestfs_add_drive (img->guestFs, rootImage) == -1)
-            goto nextImg;
-        // Add image to guestfs handle
-        if (img->format != IMG_FORMAT_ISO9660)
-        {
-            if (guestfs_add_drive (img->guestFs, img->file) == -1)
-                goto nextImg;
-        }
-        else
+        if (img->bootMode == IMG_BOOTMODE_HYBRID && img->format == IMG_FORMAT_ISO9660)
         {
-            // Check if image needs a temp boot image
-            if (getBootPart (img))
+            // Make sure an alt boot partition exists
+            if (!getAltBootPart (img))
             {
-                // Create temporary image
-                bootImg = getenv ("NNBOOTIMG");
-                if (!bootImg)
-                {
-                    error ("NNBOOTIMG not set in environment");
-                    goto nextImg;
-                }
-                size_t sz = getBootPart (img)->start;
-                if (img->bootEmu == IMG_BOOTEMU_FDD)
-                    sz = getBootPart (img)->sz;
-                else
-                    sz += getBootPart (img)->sz + 10;
-                if (!createImageInternal (action, true, bootImg, img->mul, sz))
-                    goto nextImg;
-                // Add to guestfs
-                if (guestfs_add_drive (img->guestFs, bootImg) == -1)
-                    goto nextImg;
+                error ("alternate boot partition required on hybrid ISO9660 "
+                       "images");
+                return false;
             }
-            if (img->bootMode == IMG_BOOTMODE_HYBRID && img->format == IMG_FORMAT_ISO9660)
+            // Do the same as above
+            altBootImg = getenv ("NNALTBOOTIMG");
+            if (!altBootImg)
             {
-                // Make sure an alt boot partition exists
-                if (!getAltBootPart (img))
-                {
-                    error ("alternate boot partition required on hybrid ISO9660 "
-                           "images");
-                    goto nextImg;
-                }
-                // Do the same as above
-                altBootImg = getenv ("NNALTBOOTIMG");
-                if (!altBootImg)
-                {
-                    error ("NNALTBOOTIMG not set in environment");
-                    goto nextImg;
-                }
-                if (!createImageInternal (action,
-                                          true,
-                                          altBootImg,
-                                          img->mul,
-                                          getAltBootPart (img)->sz + 1))
-                    return false;
-                // Add to guestfs
-                if (guestfs_add_drive (img->guestFs, altBootImg) == -1)
-                    goto nextImg;
+                error ("NNALTBOOTIMG not set in environment");
+                return false;
             }
-        }
-        if (guestfs_launch (img->guestFs) == -1)
-            goto nextImg;
-        // Mount root
-        if (guestfs_mount (img->guestFs, "/dev/sda3", "/") == -1)
-            goto nextImg;
-        // CHeck if a partition table needs to be created
-        if (!strcmp (action, "partition") || !strcmp (action, "all"))
-        {
-            if (img->format != IMG_FORMAT_FLOPPY && img->bootEmu != IMG_BOOTEMU_FDD &&
-                img->bootEmu != IMG_BOOTEMU_NONE)
+            if (!createImageInternal (img->guestFs,
+                                      action,
+                                      true,
+                                      altBootImg,
+                                      img->mul,
+                                      getAltBootPart (img)->sz + 1,
+                                      img->alloc,
+                                      IMG_FILE_RAW))
             {
-                // Create a new partition table
-                if (img->bootEmu == IMG_BOOTEMU_HDD)
-                {
-                    if (guestfs_part_init (img->guestFs, "/dev/sdb", "msdos") == -1)
-                        goto nextImg;
-                }
-                else
-                {
-                    if (guestfs_part_init (img->guestFs, "/dev/sdb", partTypeNames[img->format]) ==
-                        -1)
-                        goto nextImg;
-                }
+                return false;
             }
+            // Add to guestfs
+            if (guestfs_add_drive (img->guestFs, altBootImg) == -1)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Partitions, formats, and updates an image, then writes its boot records
+static bool processImage (Image_t* img,
+                          const char* action,
+                          const char* listFile,
+                          bool useTar)
+{
+    partNum = 0;
+    if (img->fatDirect)
+    {
+        if (!listFile)
+        {
+            error ("list file not specified on command line");
+            goto nextImg;
         }
         ListEntry_t* partEntry = ListFront (img->partsList);
         while (partEntry)
         {
-            ++partNum;
             Partition_t* part = ListEntryData (partEntry);
-            // Set partition device
-            if (!part->isAltBootPart)
-                strcpy (partDev, "/dev/sdb");
+            if (!part->prefix)
+                error ("prefix not specified on partition %s", part->name);
             else
-                strcpy (partDev, "/dev/sdc");
-            if (img->format != IMG_FORMAT_FLOPPY && img->format != IMG_FORMAT_ISO9660)
+                updatePartition (img, part, listFile, "/mnt", hostPrefix, useTar);
+            partEntry = ListIterate (partEntry);
+        }
+        goto nextImg;
+    }
+    // Launch the appliance the first time it's needed
+    if (guestfs_is_config (img->guestFs) == 1)
+    {
+        if (guestfs_launch (img->guestFs) == -1)
+            goto nextImg;
+        // Mount root
+        if (guestfs_mount (img->guestFs, "/dev/sda3", "/") == -1)
+            goto nextImg;
+    }
+    // CHeck if a partition table needs to be created
+    if (!strcmp (action, "partition") || !strcmp (action, "all"))
+    {
+        if (img->format != IMG_FORMAT_FLOPPY && img->bootEmu != IMG_BOOTEMU_FDD &&
+            img->bootEmu != IMG_BOOTEMU_NONE)
+        {
+            // Create a new partition table
+            if (img->bootEmu == IMG_BOOTEMU_HDD)
             {
-                // Convert number to ASCII
-                int numSize = sprintf (partDev + 8, "%d", partNum);
-                partDev[numSize + 8] = 0;
+                if (guestfs_part_init (img->guestFs, img->dev, "msdos") == -1)
+                    goto nextImg;
             }
-            // Check required fields
-            if (!part->prefix)
+            else
             {
-                error ("prefix not specified on partition %s", part->name);
-                goto nextPart;
+                if (guestfs_part_init (img->guestFs, img->dev, partTypeNames[img->format]) ==
+                    -1)
+                    goto nextImg;
             }
+        }
+    }
+    ListEntry_t* partEntry = ListFront (img->partsList);
+    while (partEntry)
+    {
+        ++partNum;
+        Partition_t* part = ListEntryData (partEntry);
+        // Set partition device
+        if (!part->isAltBootPart)
+            strcpy (partDev, img->dev);
+        else
+            strcpy (partDev, img->altDev);
+        if (img->format != IMG_FORMAT_FLOPPY && img->format != IMG_FORMAT_ISO9660)
+            sprintf (partDev + strlen (partDev), "%d", partNum);
+        // Check required fields
+        if (!part->prefix)
+        {
+            error ("prefix not specified on partition %s", part->name);
+            goto nextPart;
+        }
 
-            if (img->format == IMG_FORMAT_FLOPPY ||
-                (img->format == IMG_FORMAT_ISO9660 && img->bootEmu == IMG_BOOTEMU_FDD &&
-                 part->isBootPart))
-            {
-                if (img->format == IMG_FORMAT_FLOPPY)
-                {
-                    // Ensure we have only 1 partition on floppies
-                    if (img->partCount != 1)
-                    {
-                        error ("floppy image %s has more then 1 partition specified", img->name);
-                        goto nextPart;
-                    }
-                    if (img->mul != IMG_MUL_KIB)
-                    {
-                        error ("floppy image %s using multiplier other KiB", img->name);
-                        goto nextPart;
-                    }
-                    // Check that the size is 720K, 1.44M, or 2.88M
-                    if (img->sz != 720 && img->sz != 1440 && img->sz != 2880)
-                    {
-                        error ("floppy image %s doesn't have a size of either 720, "
-                               "1440, or 2880",
-                               img->name);
-                        goto nextPart;
-                    }
-                    img->bootMode = IMG_BOOTMODE_BIOS;
-                }
-                else
-                {
-                    if (img->mul != IMG_MUL_KIB)
-                    {
-                        error ("CD-ROM with floppy image %s using multiplier other KiB", img->name);
-                        goto nextPart;
-                    }
-                    // Check that the size is 720K, 1.44M, or 2.88M
-                    if (part->sz != 720 && part->sz != 1440 && part->sz != 2880)
-                    {
-                        error ("floppy image %s doesn't have a size of either 720, "
-                               "1440, or 2880",
-                               img->name);
-                        goto nextPart;
-                    }
-                }
-                part->filesys = IMG_FILESYS_FAT12;
-            }
-            else if (img->format == IMG_FORMAT_ISO9660)
+        if (img->format == IMG_FORMAT_FLOPPY ||
+            (img->format == IMG_FORMAT_ISO9660 && img->bootEmu == IMG_BOOTEMU_FDD &&
+             part->isBootPart))
+        {
+            if (img->format == IMG_FORMAT_FLOPPY)
             {
-                if (!part->filesys)
+                // Ensure we have only 1 partition on floppies
+                if (img->partCount != 1)
                 {
-                    error ("file system type not specified on partition %s", part->name);
+                    error ("floppy image %s has more then 1 partition specified", img->name);
                     goto nextPart;
                 }
-                if (part->filesys == IMG_FILESYS_FAT12)
+                if (img->mul != IMG_MUL_KIB)
                 {
-                    error ("FAT12 not allowed on CD-ROMs");
+                    error ("floppy image %s using multiplier other KiB", img->name);
                     goto nextPart;
                 }
-                else if (part->filesys == IMG_FILESYS_EXT2)
+                // Check that the size is 720K, 1.44M, or 2.88M
+                if (img->sz != 720 && img->sz != 1440 && img->sz != 2880)
                 {
-                    error ("ext2 not allowed on CD-ROMs");
+                    error ("floppy image %s doesn't have a size of either 720, "
+                           "1440, or 2880",
+                           img->name);
                     goto nextPart;
                 }
-                else if (part->filesys != IMG_FILESYS_ISO9660)
-                {
-                    if (!part->sz)
-                    {
-                        error ("bounds not specified on partition %s", part->name);
-                        goto nextPart;
-                    }
-                }
-
-                if (img->bootEmu == IMG_BOOTEMU_HDD)
-                    strcpy (partDev, "/dev/sdb1");
+                img->bootMode = IMG_BOOTMODE_BIOS;
             }
             else
             {
-                if (!part->filesys)
+                if (img->mul != IMG_MUL_KIB)
                 {
-                    error ("file system type not specified on partition %s", part->name);
+                    error ("CD-ROM with floppy image %s using multiplier other KiB", img->name);
                     goto nextPart;
                 }
-                if (part->filesys == IMG_FILESYS_FAT12)
+                // Check that the size is 720K, 1.44M, or 2.88M
+                if (part->sz != 720 && part->sz != 1440 && part->sz != 2880)
                 {
-                    error ("FAT12 not allowed on hard disks");
+                    error ("floppy image %s doesn't have a size of either 720, "
+                           "1440, or 2880",
+                           img->name);
                     goto nextPart;
                 }
-                if (!part->start || !part->sz)
+            }
+            part->filesys = IMG_FILESYS_FAT12;
+        }
+        else if (img->format == IMG_FORMAT_ISO9660)
+        {
+            if (!part->filesys)
+            {
+                error ("file system type not specified on partition %s", part->name);
+                goto nextPart;
+            }
+            if (part->filesys == IMG_FILESYS_FAT12)
+            {
+                error ("FAT12 not allowed on CD-ROMs");
+                goto nextPart;
+            }
+            else if (part->filesys == IMG_FILESYS_EXT2)
+            {
+                error ("ext2 not allowed on CD-ROMs");
+                goto nextPart;
+            }
+            else if (part->filesys != IMG_FILESYS_ISO9660)
+            {
+                if (!part->sz)
                 {
                     error ("bounds not specified on partition %s", part->name);
                     goto nextPart;
                 }
             }
-            // Go through partitions
-            if (!strcmp (action, "all") || !strcmp (action, "partition"))
+
+            if (img->bootEmu == IMG_BOOTEMU_HDD)
+                sprintf (partDev, "%s1", img->dev);
+        }
+        else
+        {
+            if (!part->filesys)
             {
-                // Format partition
-                if (!formatPartition (action, img, part))
-                    goto nextPart;
-                // Clean up partition file system data
-                if (strcmp (action, "all") != 0)
-                {
-                    if (!cleanPartition (action, img, part))
-                        goto nextPart;
-                }
-                else
-                    goto update;
+                error ("file system type not specified on partition %s", part->name);
+                goto nextPart;
             }
-            else if (!strcmp (action, "update"))
+            if (part->filesys == IMG_FILESYS_FAT12)
+            {
+                error ("FAT12 not allowed on hard disks");
+                goto nextPart;
+            }
+            if (!part->start || !part->sz)
+            {
+                error ("bounds not specified on partition %s", part->name);
+                goto nextPart;
+            }
+        }
+        // Go through partitions
+        if (!strcmp (action, "all") || !strcmp (action, "partition"))
+        {
+            // Format partition. Its files are gone, so the manifest has to forget them
+            if (!formatPartition (action, img, part) || !forgetManifest (img, part))
+                goto nextPart;
+            // Clean up partition file system data
+            if (strcmp (action, "all") != 0)
             {
-            update:
-                // Ensure a list file was specified
-                if (!listFile)
-                {
-                    error ("list file not specified on command line");
-                    goto nextImg;
-                }
-                // Mount the partition
-                if (!mountPartition (action, img, part))
-                    goto nextPart;
-                if (!updatePartition (img, part, listFile, "/mnt", hostPrefix))
-                    goto nextPart;
-                // Clean up partition file system data
                 if (!cleanPartition (action, img, part))
                     goto nextPart;
             }
-            else if (!strcmp (action, "create"))
-                ;
             else
+                goto update;
+        }
+        else if (!strcmp (action, "update"))
+        {
+        update:
+            // Ensure a list file was specified
+            if (!listFile)
             {
-                error ("invalid action \"%s\"", action);
-                return false;
+                error ("list file not specified on command line");
+                goto nextImg;
             }
-        nextPart:
-            partEntry = ListIterate (partEntry);
+            // Mount the partition
+            if (!mountPartition (action, img, part))
+                goto nextPart;
+            if (!updatePartition (img, part, listFile, "/mnt", hostPrefix, useTar))
+                goto nextPart;
+            // Clean up partition file system data
+            if (!cleanPartition (action, img, part))
+                goto nextPart;
         }
-    nextImg:
-        // Destroy handle
-        if (img->guestFs)
+        else if (!strcmp (action, "create"))
+            ;
+        else
         {
-            guestfs_shutdown (img->guestFs);
-            guestfs_close (img->guestFs);
+            error ("invalid action \"%s\"", action);
+            return false;
         }
-        // Decide if we should write out the VBR and MBR
-        if (!strcmp (action, "update") || !strcmp (action, "all"))
+    nextPart:
+        partEntry = ListIterate (partEntry);
+    }
+nextImg:
+    if (img->guestFs != sessionFs)
+    {
+        // Destroy handle
+        guestfs_shutdown (img->guestFs);
+        guestfs_close (img->guestFs);
+        img->guestFs = NULL;
+    }
+    else if (guestfs_is_ready (sessionFs) == 1)
+    {
+        // Leave the shared appliance ready for the next image, and get everything written to
+        // the image file before boot records are written to it directly
+        guestfs_push_error_handler (sessionFs, NULL, NULL);
+        guestfs_umount (sessionFs, "/mnt");
+        guestfs_pop_error_handler (sessionFs);
+        if (guestfs_sync (sessionFs) == -1)
+            return true;
+    }
+    // Decide if we should write out the VBR and MBR
+    if (!strcmp (action, "update") || !strcmp (action, "all"))
+    {
+        // Check if this image needs a VBR or MBR
+        if ((img->bootMode == IMG_BOOTMODE_HYBRID || img->bootMode == IMG_BOOTMODE_BIOS) &&
+            img->bootEmu != IMG_BOOTEMU_NONE)
         {
-            // Check if this image needs a VBR or MBR
-            if ((img->bootMode == IMG_BOOTMODE_HYBRID || img->bootMode == IMG_BOOTMODE_BIOS) &&
-                img->bootEmu != IMG_BOOTEMU_NONE)
+            if (img->format != IMG_FORMAT_FLOPPY)
             {
-                if (img->format != IMG_FORMAT_FLOPPY)
-                {
-                    if (!getBootPart (img)->vbrFile)
-                    {
-                        error ("\"vbrFile\" property not set on BIOS bootable image");
-                        return false;
-                    }
-                }
-                else
+                if (!getBootPart (img)->vbrFile)
                 {
-                    if (!img->mbrFile)
-                    {
-                        error ("\"mbrFile\" property not set on BIOS bootable image");
-                        return false;
-                    }
-                    getBootPart (img)->vbrFile = strdup (img->mbrFile);
+                    error ("\"vbrFile\" property not set on BIOS bootable image");
+                    return false;
                 }
-                if (!updateVbr (img, getBootPart (img)))
+            }
+            else
+            {
+                if (!img->mbrFile)
                 {
-                    imgEntry = ListIterate (imgEntry);
-                    continue;
+                    error ("\"mbrFile\" property not set on BIOS bootable image");
+                    return false;
                 }
-                // Check if we need to write out MBR
-                if ((img->format != IMG_FORMAT_ISO9660 || img->bootEmu == IMG_BOOTEMU_HDD) &&
-                    img->format != IMG_FORMAT_FLOPPY)
+                getBootPart (img)->vbrFile = strdup (img->mbrFile);
+            }
+            if (!updateVbr (img, getBootPart (img)))
+                return true;
+            // Check if we need to write out MBR
+            if ((img->format != IMG_FORMAT_ISO9660 || img->bootEmu == IMG_BOOTEMU_HDD) &&
+                img->format != IMG_FORMAT_FLOPPY)
+            {
+                if (!img->mbrFile)
                 {
-                    if (!img->mbrFile)
-                    {
-                        error ("\"mbrFile\" property not set on BIOS bootable hard "
-                               "disk image");
-                        return false;
-                    }
-                    // Write it out
-                    if (!updateMbr (img))
-                    {
-                        imgEntry = ListIterate (imgEntry);
-                        continue;
-                    }
+                    error ("\"mbrFile\" property not set on BIOS bootable hard "
+                           "disk image");
+                    return false;
                 }
+                // Write it out
+                if (!updateMbr (img))
+                    return true;
             }
         }
-        // If this is an ISO image, write it out if the action is update
-        if (img->format == IMG_FORMAT_ISO9660 &&
-            (!strcmp (action, "update") || !strcmp (action, "all")))
+    }
+    // If this is an ISO image, write it out if the action is update
+    if (img->format == IMG_FORMAT_ISO9660 &&
+        (!strcmp (action, "update") || !strcmp (action, "all")))
+    {
+        writeIso (img, action);
+    }
+    return true;
+}
+
+bool createImages (ListHead_t* images,
+                   const char* action,
+                   bool overwrite,
+                   const char* file,
+                   const char* listFile,
+                   bool useTar)
+{
+    // Get host prefix
+    hostPrefix = getenv ("NNDESTDIR");
+    if (!hostPrefix)
+    {
+        error ("variable NNDESTDIR must be set");
+        return false;
+    }
+    // Get script root
+    scriptRoot = getenv ("NNSCRIPTROOT");
+    if (!scriptRoot)
+    {
+        error ("variable NNSCRIPTROOT must be set");
+        return false;
+    }
+    // Get path of root image
+    char rootImage[256];
+    // We reserve space for file name
+    if (strlcpy (rootImage, scriptRoot, 256) >= (256 - 17))
+    {
+        error ("buffer overflow detected");
+        return false;
+    }
+    strcat (rootImage, "guestfs_root.img");
+    // Set up every image first, so the shared appliance has all drives when it's launched
+    ListEntry_t* imgEntry = ListFront (images);
+    while (imgEntry)
+    {
+        Image_t* img = ListEntryData (imgEntry);
+        img->isReady = setupImage (img, action, overwrite, file, rootImage);
+        if (!img->isReady && img->guestFs && img->guestFs != sessionFs)
         {
-            writeIso (img);
+            guestfs_close (img->guestFs);
+            img->guestFs = NULL;
         }
-    nextImgNoClean:
         imgEntry = ListIterate (imgEntry);
     }
-    return true;
+    bool res = true;
+    imgEntry = ListFront (images);
+    while (imgEntry && res)
+    {
+        Image_t* img = ListEntryData (imgEntry);
+        if (img->isReady)
+            res = processImage (img, action, listFile, useTar);
+        imgEntry = ListIterate (imgEntry);
+    }
+    if (sessionFs)
+    {
+        guestfs_shutdown (sessionFs);
+        guestfs_close (sessionFs);
+        sessionFs = NULL;
+    }
+    return res;
 }
@@ -278,6 +278,50 @@ bool addProperty (const char32_t* newProp, union val* val, bool isStart, int dat
                 return false;
             }
         }
+        else if (!c32cmp (prop, U"allocation"))
+        {
+            if (dataType != DATATYPE_IDENTIFIER)
+            {
+                error ("%s:%d: property \"allocation\" requires an identifier value",
+                       ConfGetFileName(),
+                       lineNo);
+                return false;
+            }
+            if (!strcmp (val->strVal, "sparse"))
+                img->alloc = IMG_ALLOC_SPARSE;
+            else if (!strcmp (val->strVal, "full"))
+                img->alloc = IMG_ALLOC_FULL;
+            else
+            {
+                error ("%s:%d: allocation \"%s\" is unsupported",
+                       ConfGetFileName(),
+                       lineNo,
+                       val->strVal);
+                return false;
+            }
+        }
+        else if (!c32cmp (prop, U"fileFormat"))
+        {
+            if (dataType != DATATYPE_IDENTIFIER)
+            {
+                error ("%s:%d: property \"fileFormat\" requires an identifier value",
+                       ConfGetFileName(),
+                       lineNo);
+                return false;
+            }
+            if (!strcmp (val->strVal, "raw"))
+                img->fileFormat = IMG_FILE_RAW;
+            else if (!strcmp (val->strVal, "qcow2"))
+                img->fileFormat = IMG_FILE_QCOW2;
+            else
+            {
+                error ("%s:%d: file format \"%s\" is unsupported",
+                       ConfGetFileName(),
+                       lineNo,
+                       val->strVal);
+                return false;
+            }
+        }
         else if (!c32cmp (prop, U"mbrFile"))
         {
             if (dataType != DATATYPE_STRING)
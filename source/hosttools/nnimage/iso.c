@@ -0,0 +1,649 @@
+/*
+    iso.c - contains incremental ISO9660 image updates
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file iso.c
+
+// Rebuilding an ISO9660 image with xorriso rewrites every file, even when only the boot image
+// changed. After a full build, the image's directory tree is walked and each file record is
+// matched to the file it came from by hashing its data. That layout is saved next to the image.
+// On the next update, if the same files are in the list and every changed file still fits in
+// the blocks it has, the new data is written over the old extent and the directory record's
+// size and date are fixed up. Anything else falls back to a full rebuild
+// Files whose data doesn't match their source, like boot images xorriso patches a boot info
+// table into, are recorded as unmatched and force a rebuild when they change
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nnimage.h"
+#include <libnex.h>
+
+#define ISO_BLOCK_SZ  2048    // Size of logical block
+#define ISO_PVD_BLOCK 16      // Block of primary volume descriptor
+#define ISO_MAX_DEPTH 64      // Deepest directory walked in image
+#define ISO_COPY_SZ   (1024 * 1024)
+
+// Directory record fields
+#define ISO_REC_LEN    0
+#define ISO_REC_EXTENT 2
+#define ISO_REC_SIZE   10
+#define ISO_REC_DATE   18
+#define ISO_REC_FLAGS  25
+#define ISO_REC_NAMELN 32
+
+#define ISO_FLAG_DIR   0x02
+#define ISO_FLAG_MULTI 0x80
+
+// Layout entry types
+#define ISO_ENT_FILE      'f'    // File with an extent it can be patched in
+#define ISO_ENT_UNMATCHED 'u'    // File that wasn't found in the image
+#define ISO_ENT_DIR       'd'    // Directory
+
+// A file or directory of the image
+typedef struct _isoEnt
+{
+    char type;          // Type of entry
+    char* dest;         // Path in image
+    char* src;          // Path on host
+    off_t size;         // Size of file
+    time_t mtime;       // Modification time of file
+    uint32_t lba;       // Block of data
+    uint32_t blocks;    // Blocks data can take up
+    off_t recOff;       // Offset of directory record
+    uint64_t hash;      // Hash of source, when hashed
+    bool isHashed;      // If hash is set
+} isoEnt_t;
+
+// A list of entries
+typedef struct _isoList
+{
+    isoEnt_t* ents;
+    size_t count;
+    size_t max;
+} isoList_t;
+
+// A file record found in the image
+typedef struct _isoRec
+{
+    uint32_t lba;
+    uint32_t size;
+    off_t recOff;
+} isoRec_t;
+
+static inline uint32_t rd32 (const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Writes a both-endian 32 bit value
+static inline void wrBoth32 (uint8_t* p, uint32_t val)
+{
+    for (int i = 0; i < 4; ++i)
+    {
+        p[i] = (val >> (i * 8)) & 0xFF;
+        p[7 - i] = p[i];
+    }
+}
+
+static isoEnt_t* addEnt (isoList_t* list, char type, const char* dest, const char* src)
+{
+    if (list->count == list->max)
+    {
+        list->max = (list->max) ? list->max * 2 : 64;
+        list->ents = realloc (list->ents, list->max * sizeof (isoEnt_t));
+        if (!list->ents)
+        {
+            error ("%s", strerror (errno));
+            exit (1);
+        }
+    }
+    isoEnt_t* ent = &list->ents[list->count++];
+    memset (ent, 0, sizeof (isoEnt_t));
+    ent->type = type;
+    ent->dest = strdup (dest);
+    ent->src = strdup (src);
+    return ent;
+}
+
+static void freeList (isoList_t* list)
+{
+    for (size_t i = 0; i < list->count; ++i)
+    {
+        free (list->ents[i].dest);
+        free (list->ents[i].src);
+    }
+    free (list->ents);
+    memset (list, 0, sizeof (isoList_t));
+}
+
+static int cmpEntDest (const void* a, const void* b)
+{
+    const isoEnt_t* entA = a;
+    const isoEnt_t* entB = b;
+    int res = strcmp (entA->dest, entB->dest);
+    return (res) ? res : strcmp (entA->src, entB->src);
+}
+
+static int cmpEntSize (const void* a, const void* b)
+{
+    const isoEnt_t* entA = *(const isoEnt_t**) a;
+    const isoEnt_t* entB = *(const isoEnt_t**) b;
+    return (entA->size > entB->size) - (entA->size < entB->size);
+}
+
+// Adds a host file and everything under it to list
+static bool addHostFile (isoList_t* list, const char* dest, const char* src)
+{
+    struct stat st;
+    if (stat (src, &st) == -1)
+    {
+        error ("%s: %s", src, strerror (errno));
+        return false;
+    }
+    if (!S_ISDIR (st.st_mode))
+    {
+        isoEnt_t* ent = addEnt (list, ISO_ENT_UNMATCHED, dest, src);
+        ent->size = st.st_size;
+        ent->mtime = st.st_mtime;
+        return true;
+    }
+    addEnt (list, ISO_ENT_DIR, dest, src);
+    DIR* dir = opendir (src);
+    if (!dir)
+    {
+        error ("%s: %s", src, strerror (errno));
+        return false;
+    }
+    struct dirent* curDir = NULL;
+    while ((curDir = readdir (dir)))
+    {
+        if (!strcmp (curDir->d_name, ".") || !strcmp (curDir->d_name, ".."))
+            continue;
+        char fullSrc[PATH_MAX];
+        char fullDest[PATH_MAX];
+        if (snprintf (fullSrc, PATH_MAX, "%s/%s", src, curDir->d_name) >= PATH_MAX ||
+            snprintf (fullDest, PATH_MAX, "%s/%s", dest, curDir->d_name) >= PATH_MAX)
+        {
+            closedir (dir);
+            error ("buffer overflow detected");
+            return false;
+        }
+        if (!addHostFile (list, fullDest, fullSrc))
+        {
+            closedir (dir);
+            return false;
+        }
+    }
+    closedir (dir);
+    return true;
+}
+
+// Reads in the files named by an xorriso list file
+static bool readHostFiles (const char* listFile, isoList_t* list)
+{
+    FILE* fp = fopen (listFile, "r");
+    if (!fp)
+    {
+        error ("%s: %s", listFile, strerror (errno));
+        return false;
+    }
+    char line[PATH_MAX * 2];
+    bool res = true;
+    while (res && fgets (line, sizeof (line), fp))
+    {
+        line[strcspn (line, "\n")] = 0;
+        char* sep = strchr (line, '=');
+        if (!sep)
+            continue;
+        *sep = 0;
+        res = addHostFile (list, line, sep + 1);
+    }
+    fclose (fp);
+    qsort (list->ents, list->count, sizeof (isoEnt_t), cmpEntDest);
+    return res;
+}
+
+// Gets the layout file of an image
+static bool getLayoutFile (Image_t* img, char* buf, size_t bufSz)
+{
+    return (size_t) snprintf (buf, bufSz, "%s.layout", img->file) < bufSz;
+}
+
+// Writes out a layout
+static bool saveLayout (Image_t* img, isoList_t* list)
+{
+    char file[PATH_MAX];
+    char tmpFile[PATH_MAX];
+    if (!getLayoutFile (img, file, PATH_MAX) ||
+        (size_t) snprintf (tmpFile, PATH_MAX, "%s.new", file) >= PATH_MAX)
+    {
+        error ("buffer overflow detected");
+        return false;
+    }
+    struct stat st;
+    if (stat (img->file, &st) == -1)
+    {
+        error ("%s: %s", img->file, strerror (errno));
+        return false;
+    }
+    FILE* fp = fopen (tmpFile, "w");
+    if (!fp)
+    {
+        error ("%s: %s", tmpFile, strerror (errno));
+        return false;
+    }
+    fprintf (fp,
+             "iso\t%lld\t%lld\t%ld\n",
+             (long long) st.st_size,
+             (long long) st.st_mtim.tv_sec,
+             st.st_mtim.tv_nsec);
+    for (size_t i = 0; i < list->count; ++i)
+    {
+        isoEnt_t* ent = &list->ents[i];
+        fprintf (fp,
+                 "%c\t%u\t%u\t%lld\t%lld\t%lld\t%s\t%s\n",
+                 ent->type,
+                 ent->lba,
+                 ent->blocks,
+                 (long long) ent->recOff,
+                 (long long) ent->size,
+                 (long long) ent->mtime,
+                 ent->dest,
+                 ent->src);
+    }
+    if (fclose (fp) == EOF || rename (tmpFile, file) == -1)
+    {
+        error ("%s: %s", file, strerror (errno));
+        unlink (tmpFile);
+        return false;
+    }
+    return true;
+}
+
+// Reads in a layout. Returns false if there isn't a usable one
+static bool loadLayout (Image_t* img, isoList_t* list)
+{
+    char file[PATH_MAX];
+    if (!getLayoutFile (img, file, PATH_MAX))
+        return false;
+    FILE* fp = fopen (file, "r");
+    if (!fp)
+        return false;
+    char line[PATH_MAX * 2 + 128];
+    bool res = false;
+    // The image must be the one the layout was saved for
+    long long isoSize = 0, isoSec = 0;
+    long isoNsec = 0;
+    struct stat st;
+    if (fgets (line, sizeof (line), fp) &&
+        sscanf (line, "iso\t%lld\t%lld\t%ld", &isoSize, &isoSec, &isoNsec) == 3 &&
+        stat (img->file, &st) != -1 && st.st_size == isoSize && st.st_mtim.tv_sec == isoSec &&
+        st.st_mtim.tv_nsec == isoNsec)
+    {
+        res = true;
+    }
+    while (res && fgets (line, sizeof (line), fp))
+    {
+        line[strcspn (line, "\n")] = 0;
+        char type = 0;
+        unsigned lba = 0, blocks = 0;
+        long long recOff = 0, size = 0, mtime = 0;
+        int nameOff = 0;
+        if (sscanf (line,
+                    "%c\t%u\t%u\t%lld\t%lld\t%lld\t%n",
+                    &type,
+                    &lba,
+                    &blocks,
+                    &recOff,
+                    &size,
+                    &mtime,
+                    &nameOff) != 6 ||
+            !nameOff)
+        {
+            res = false;
+            break;
+        }
+        char* dest = line + nameOff;
+        char* src = strchr (dest, '\t');
+        if (!src)
+        {
+            res = false;
+            break;
+        }
+        *src++ = 0;
+        isoEnt_t* ent = addEnt (list, type, dest, src);
+        ent->lba = lba;
+        ent->blocks = blocks;
+        ent->recOff = recOff;
+        ent->size = size;
+        ent->mtime = mtime;
+    }
+    fclose (fp);
+    return res;
+}
+
+// Walks a directory extent of the image, collecting file records
+static bool walkIsoDir (int fd,
+                        uint32_t lba,
+                        uint32_t size,
+                        int depth,
+                        isoRec_t** recs,
+                        size_t* count,
+                        size_t* max)
+{
+    uint8_t* buf = malloc_s (size);
+    if (pread (fd, buf, size, lba * (off_t) ISO_BLOCK_SZ) != (ssize_t) size)
+    {
+        free (buf);
+        return false;
+    }
+    bool res = true;
+    uint32_t off = 0;
+    while (res && off < size)
+    {
+        uint8_t* rec = buf + off;
+        uint8_t len = rec[ISO_REC_LEN];
+        // Records don't cross blocks, so a zero length means go to the next one
+        if (!len)
+        {
+            off = (off / ISO_BLOCK_SZ + 1) * ISO_BLOCK_SZ;
+            continue;
+        }
+        if (off + len > size || len < ISO_REC_NAMELN + 1)
+            break;
+        uint8_t nameLen = rec[ISO_REC_NAMELN];
+        bool isDot = nameLen == 1 && (rec[ISO_REC_NAMELN + 1] == 0 || rec[ISO_REC_NAMELN + 1] == 1);
+        uint32_t extent = rd32 (rec + ISO_REC_EXTENT);
+        uint32_t dataLen = rd32 (rec + ISO_REC_SIZE);
+        if (isDot)
+            ;
+        else if (rec[ISO_REC_FLAGS] & ISO_FLAG_DIR)
+        {
+            if (depth < ISO_MAX_DEPTH)
+                res = walkIsoDir (fd, extent, dataLen, depth + 1, recs, count, max);
+        }
+        else if (!(rec[ISO_REC_FLAGS] & ISO_FLAG_MULTI))
+        {
+            if (*count == *max)
+            {
+                *max = (*max) ? *max * 2 : 64;
+                *recs = realloc (*recs, *max * sizeof (isoRec_t));
+                if (!*recs)
+                {
+                    error ("%s", strerror (errno));
+                    exit (1);
+                }
+            }
+            isoRec_t* isoRec = &(*recs)[(*count)++];
+            isoRec->lba = extent;
+            isoRec->size = dataLen;
+            isoRec->recOff = (lba * (off_t) ISO_BLOCK_SZ) + off;
+        }
+        off += len;
+    }
+    free (buf);
+    return res;
+}
+
+bool saveIsoLayout (Image_t* img, const char* listFile)
+{
+    isoList_t list = {0};
+    if (!readHostFiles (listFile, &list))
+    {
+        freeList (&list);
+        return false;
+    }
+    int fd = open (img->file, O_RDONLY);
+    if (fd == -1)
+    {
+        error ("%s: %s", img->file, strerror (errno));
+        freeList (&list);
+        return false;
+    }
+    // Walk the tree from the root record in the primary volume descriptor
+    uint8_t pvd[ISO_BLOCK_SZ];
+    isoRec_t* recs = NULL;
+    size_t numRecs = 0, maxRecs = 0;
+    bool res = pread (fd, pvd, ISO_BLOCK_SZ, ISO_PVD_BLOCK * ISO_BLOCK_SZ) == ISO_BLOCK_SZ &&
+               pvd[0] == 1 && !memcmp (pvd + 1, "CD001", 5) &&
+               (pvd[128] | (pvd[129] << 8)) == ISO_BLOCK_SZ;
+    if (res)
+    {
+        uint8_t* root = pvd + 156;
+        res = walkIsoDir (fd,
+                          rd32 (root + ISO_REC_EXTENT),
+                          rd32 (root + ISO_REC_SIZE),
+                          0,
+                          &recs,
+                          &numRecs,
+                          &maxRecs);
+    }
+    if (!res)
+    {
+        error ("%s: can't read ISO9660 directory tree", img->file);
+        goto end;
+    }
+    // Sort host files by size, so each record is only checked against files its size
+    isoEnt_t** bySize = malloc_s ((list.count + 1) * sizeof (isoEnt_t*));
+    size_t numFiles = 0;
+    for (size_t i = 0; i < list.count; ++i)
+    {
+        if (list.ents[i].type != ISO_ENT_DIR)
+            bySize[numFiles++] = &list.ents[i];
+    }
+    qsort (bySize, numFiles, sizeof (isoEnt_t*), cmpEntSize);
+    for (size_t i = 0; i < numRecs && res; ++i)
+    {
+        isoRec_t* rec = &recs[i];
+        // Find files of this size
+        size_t lo = 0, hi = numFiles;
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (bySize[mid]->size < rec->size)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == numFiles || bySize[lo]->size != rec->size)
+            continue;
+        uint64_t recHash = 0;
+        if (!hashExtent (fd, rec->lba * (off_t) ISO_BLOCK_SZ, rec->size, &recHash))
+            continue;
+        // Match only when exactly one file has this data
+        isoEnt_t* match = NULL;
+        int numMatches = 0;
+        for (size_t j = lo; j < numFiles && bySize[j]->size == rec->size; ++j)
+        {
+            isoEnt_t* ent = bySize[j];
+            if (!ent->isHashed)
+            {
+                if (!hashFile (ent->src, &ent->hash))
+                {
+                    res = false;
+                    break;
+                }
+                ent->isHashed = true;
+            }
+            if (ent->hash == recHash)
+            {
+                match = ent;
+                ++numMatches;
+            }
+        }
+        if (numMatches != 1 || match->type == ISO_ENT_FILE)
+            continue;
+        match->type = ISO_ENT_FILE;
+        match->lba = rec->lba;
+        match->blocks = (rec->size + ISO_BLOCK_SZ - 1) / ISO_BLOCK_SZ;
+        match->recOff = rec->recOff;
+    }
+    free (bySize);
+    if (res)
+        res = saveLayout (img, &list);
+end:
+    close (fd);
+    free (recs);
+    freeList (&list);
+    return res;
+}
+
+// Writes a host file over its extent and fixes up its directory record
+static bool patchFile (int fd, isoEnt_t* ent, struct stat* st)
+{
+    int srcFd = open (ent->src, O_RDONLY);
+    if (srcFd == -1)
+    {
+        error ("%s: %s", ent->src, strerror (errno));
+        return false;
+    }
+    uint8_t* buf = malloc_s (ISO_COPY_SZ);
+    off_t off = ent->lba * (off_t) ISO_BLOCK_SZ;
+    off_t end = off + (ent->blocks * (off_t) ISO_BLOCK_SZ);
+    bool res = true;
+    ssize_t bytesRead = 0;
+    while ((bytesRead = read (srcFd, buf, ISO_COPY_SZ)) > 0)
+    {
+        if (off + bytesRead > end || pwrite (fd, buf, bytesRead, off) != bytesRead)
+        {
+            res = false;
+            break;
+        }
+        off += bytesRead;
+    }
+    if (bytesRead == -1)
+        res = false;
+    // Clear out what's left of the old data
+    if (res && off < end)
+    {
+        memset (buf, 0, ISO_BLOCK_SZ);
+        while (res && off < end)
+        {
+            size_t chunk = ISO_BLOCK_SZ - (off % ISO_BLOCK_SZ);
+            res = pwrite (fd, buf, chunk, off) == (ssize_t) chunk;
+            off += chunk;
+        }
+    }
+    free (buf);
+    close (srcFd);
+    if (!res)
+    {
+        error ("%s: %s", ent->src, strerror (errno));
+        return false;
+    }
+    // Fix up size and date in the directory record
+    uint8_t rec[ISO_REC_FLAGS];
+    if (pread (fd, rec, ISO_REC_FLAGS, ent->recOff) != ISO_REC_FLAGS)
+        return false;
+    wrBoth32 (rec + ISO_REC_SIZE, st->st_size);
+    struct tm tm;
+    gmtime_r (&st->st_mtime, &tm);
+    uint8_t* date = rec + ISO_REC_DATE;
+    date[0] = tm.tm_year;
+    date[1] = tm.tm_mon + 1;
+    date[2] = tm.tm_mday;
+    date[3] = tm.tm_hour;
+    date[4] = tm.tm_min;
+    date[5] = tm.tm_sec;
+    date[6] = 0;    // GMT
+    if (pwrite (fd, rec, ISO_REC_FLAGS, ent->recOff) != ISO_REC_FLAGS)
+        return false;
+    ent->size = st->st_size;
+    ent->mtime = st->st_mtime;
+    return true;
+}
+
+bool patchIso (Image_t* img, const char* listFile)
+{
+    isoList_t layout = {0};
+    isoList_t host = {0};
+    bool res = false;
+    int fd = -1;
+    if (!loadLayout (img, &layout) || !readHostFiles (listFile, &host))
+        goto end;
+    qsort (layout.ents, layout.count, sizeof (isoEnt_t), cmpEntDest);
+    // The same files must be in the image
+    if (layout.count != host.count)
+        goto end;
+    size_t numChanged = 0;
+    for (size_t i = 0; i < host.count; ++i)
+    {
+        isoEnt_t* ent = &layout.ents[i];
+        isoEnt_t* hostEnt = &host.ents[i];
+        bool isDir = ent->type == ISO_ENT_DIR;
+        if (cmpEntDest (ent, hostEnt) || isDir != (hostEnt->type == ISO_ENT_DIR))
+            goto end;
+        if (isDir || (ent->size == hostEnt->size && ent->mtime == hostEnt->mtime))
+            continue;
+        // Changed files must have an extent they still fit in
+        if (ent->type != ISO_ENT_FILE || hostEnt->size > ent->blocks * (off_t) ISO_BLOCK_SZ)
+            goto end;
+        ++numChanged;
+    }
+    res = true;
+    if (!numChanged)
+    {
+        printf ("ISO9660 image %s is up to date\n", img->name);
+        goto end;
+    }
+    printf ("Patching %zu changed files into ISO9660 image %s...\n", numChanged, img->name);
+    fd = open (img->file, O_RDWR);
+    if (fd == -1)
+    {
+        error ("%s: %s", img->file, strerror (errno));
+        res = false;
+        goto end;
+    }
+    for (size_t i = 0; i < host.count && res; ++i)
+    {
+        isoEnt_t* ent = &layout.ents[i];
+        isoEnt_t* hostEnt = &host.ents[i];
+        if (ent->type != ISO_ENT_FILE ||
+            (ent->size == hostEnt->size && ent->mtime == hostEnt->mtime))
+        {
+            continue;
+        }
+        struct stat st;
+        if (stat (ent->src, &st) == -1 || st.st_size > ent->blocks * (off_t) ISO_BLOCK_SZ)
+            res = false;
+        else
+            res = patchFile (fd, ent, &st);
+    }
+    if (close (fd) == -1)
+        res = false;
+    // A half patched image has to be rebuilt, so don't leave a layout behind for it
+    if (res)
+        res = saveLayout (img, &layout);
+    else
+    {
+        char file[PATH_MAX];
+        if (getLayoutFile (img, file, PATH_MAX))
+            unlink (file);
+    }
+end:
+    freeList (&layout);
+    freeList (&host);
+    return res;
+}
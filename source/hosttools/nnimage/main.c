@@ -42,11 +42,14 @@ static const char* listFile = NULL;
 // If the image file should be overtwritten
 static bool overwrite = false;
 
+// If updates should be uploaded as one tar stream
+static bool useTar = false;
+
 // Read the arguments passed
 static int parseArgs (int argc, char** argv)
 {
 // The list of options that are valid
-#define ARGS_VALIDARGS "f:o:hd:wl:"
+#define ARGS_VALIDARGS "f:o:hd:wl:tm:"
     int arg = 0;
     while ((arg = getopt (argc, argv, ARGS_VALIDARGS)) != -1)
     {
@@ -55,7 +58,7 @@ static int parseArgs (int argc, char** argv)
             case 'h':
                 printf ("\
 %s - image building helper\n\
-Usage: %s [-h] [-f CONFFILE] [-o OUTPUT] [-d DIRECTORY] [-l FILELIST] [-w] ACTION\n\
+Usage: %s [-h] [-f CONFFILE] [-o OUTPUT] [-d DIRECTORY] [-l FILELIST] [-m MANIFEST] [-w] [-t] ACTION\n\
 Valid arguments:\n\
   -h\n\
               prints help and then exits\n\
@@ -67,10 +70,16 @@ Valid arguments:\n\
               directory where image data is\n\
   -l FILELIST\n\
               specifies a file containing a list of files to update\n\
+  -m MANIFEST\n\
+              keeps the manifest of uploaded files in MANIFEST, instead of\n\
+              next to each image, so it can be shared\n\
   -w\n\
               specifies that if the image file specified in nnimage.conf\n\
               already exists, it should be overwitten without the user's\n\
               consent\n\
+  -t\n\
+              uploads changed files to each partition in one tar stream,\n\
+              instead of one file at a time\n\
 \n\
 ACTION can be create, partition, update, or all. By default,\n\
 configuration is read from nnimage.conf in the current directory\n",
@@ -87,9 +96,15 @@ configuration is read from nnimage.conf in the current directory\n",
             case 'l':
                 listFile = optarg;
                 break;
+            case 'm':
+                setManifestFile (optarg);
+                break;
             case 'w':
                 overwrite = true;
                 break;
+            case 't':
+                useTar = true;
+                break;
             case '?':
                 error ("unknown argument '%c'", optopt);
                 return 0;
@@ -131,7 +146,7 @@ int main (int argc, char** argv)
         return 1;
     }
     // Create the image
-    bool res = createImages (images, action, overwrite, outputName, listFile);
+    bool res = createImages (images, action, overwrite, outputName, listFile, useTar);
     ListDestroy (images);
     ConfFreeParseTree (confBlocks);
     return !res;
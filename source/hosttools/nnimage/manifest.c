@@ -0,0 +1,521 @@
+/*
+    manifest.c - contains image content manifests
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+/// @file manifest.c
+
+// A manifest records the size, modification time, and content hash of every file that was put
+// on a partition, so an update only uploads files whose content really changed. A file whose
+// size and time match isn't read at all; otherwise it's hashed, and only uploaded if the hash
+// differs. Files that were uploaded before but are gone from the host are deleted at the end
+// Each line is keyed by image and partition, so one manifest can be shared by several images,
+// and by several hosts building the same image. Times only save hashing, so sharing a manifest
+// between hosts is safe
+// The manifest is trusted; an image that's changed by anything else should be recreated
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nnimage.h"
+#include <libnex.h>
+
+#define MANIFEST_HASH_SZ 16384          // Buckets in entry table
+#define MANIFEST_BUFSZ   (1024 * 1024)    // Bytes hashed at a time
+
+// Manifest entry
+typedef struct _manifestEnt
+{
+    char* key;                    // Image and partition this file is on
+    char* name;                   // Path in partition
+    char* src;                    // Path on host
+    uint64_t size;                // Size of file
+    int64_t mtime;                // Modification time on host
+    uint64_t hash;                // Hash of contents
+    bool seen;                    // If file was looked at in this update
+    struct _manifestEnt* next;    // Next entry in bucket
+} manifestEnt_t;
+
+// Manifest file being used, NULL to use one next to each image
+static const char* manifestFile = NULL;
+
+// Loaded manifest
+static char* loadedFile = NULL;    // File it was loaded from
+static char* curKey = NULL;        // Key of partition being updated
+static manifestEnt_t* entTable[MANIFEST_HASH_SZ] = {0};
+
+// Hash of last file that was hashed
+static const char* lastHashed = NULL;
+static uint64_t lastHash = 0;
+
+// XXH64
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline uint64_t xxhRotl (uint64_t val, int shift)
+{
+    return (val << shift) | (val >> (64 - shift));
+}
+
+static inline uint64_t xxhRead64 (const uint8_t* p)
+{
+    uint64_t val;
+    memcpy (&val, p, 8);
+    return val;
+}
+
+static inline uint32_t xxhRead32 (const uint8_t* p)
+{
+    uint32_t val;
+    memcpy (&val, p, 4);
+    return val;
+}
+
+static inline uint64_t xxhRound (uint64_t acc, uint64_t in)
+{
+    acc += in * XXH_P2;
+    acc = xxhRotl (acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxhMerge (uint64_t acc, uint64_t val)
+{
+    acc ^= xxhRound (0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+// Hashes a buffer with XXH64
+static uint64_t xxh64 (const uint8_t* p, size_t len, uint64_t seed)
+{
+    const uint8_t* end = p + len;
+    uint64_t h;
+    if (len >= 32)
+    {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+        while ((end - p) >= 32)
+        {
+            v1 = xxhRound (v1, xxhRead64 (p));
+            v2 = xxhRound (v2, xxhRead64 (p + 8));
+            v3 = xxhRound (v3, xxhRead64 (p + 16));
+            v4 = xxhRound (v4, xxhRead64 (p + 24));
+            p += 32;
+        }
+        h = xxhRotl (v1, 1) + xxhRotl (v2, 7) + xxhRotl (v3, 12) + xxhRotl (v4, 18);
+        h = xxhMerge (h, v1);
+        h = xxhMerge (h, v2);
+        h = xxhMerge (h, v3);
+        h = xxhMerge (h, v4);
+    }
+    else
+        h = seed + XXH_P5;
+    h += len;
+    while ((end - p) >= 8)
+    {
+        h ^= xxhRound (0, xxhRead64 (p));
+        h = xxhRotl (h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if ((end - p) >= 4)
+    {
+        h ^= (uint64_t) xxhRead32 (p) * XXH_P1;
+        h = xxhRotl (h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end)
+    {
+        h ^= *p * XXH_P5;
+        h = xxhRotl (h, 11) * XXH_P1;
+        ++p;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+bool hashExtent (int fd, off_t off, uint64_t len, uint64_t* hash)
+{
+    uint8_t* buf = malloc_s (MANIFEST_BUFSZ);
+    uint64_t h = 0;
+    while (len)
+    {
+        size_t chunk = (len < MANIFEST_BUFSZ) ? len : MANIFEST_BUFSZ;
+        ssize_t bytesRead = pread (fd, buf, chunk, off);
+        if (bytesRead <= 0)
+        {
+            free (buf);
+            return false;
+        }
+        h = xxh64 (buf, bytesRead, h);
+        off += bytesRead;
+        len -= bytesRead;
+    }
+    free (buf);
+    *hash = h;
+    return true;
+}
+
+bool hashFile (const char* src, uint64_t* hash)
+{
+    int fd = open (src, O_RDONLY);
+    if (fd == -1)
+    {
+        error ("%s: %s", src, strerror (errno));
+        return false;
+    }
+    struct stat st;
+    bool res = fstat (fd, &st) != -1 && hashExtent (fd, 0, st.st_size, hash);
+    if (!res)
+        error ("%s: %s", src, strerror (errno));
+    close (fd);
+    return res;
+}
+
+// Entry table
+
+static inline manifestEnt_t** getBucket (const char* name)
+{
+    return &entTable[xxh64 ((const uint8_t*) name, strlen (name), 0) & (MANIFEST_HASH_SZ - 1)];
+}
+
+// Finds entry of name in current partition
+static manifestEnt_t* findEnt (const char* name)
+{
+    for (manifestEnt_t* ent = *getBucket (name); ent; ent = ent->next)
+    {
+        if (!strcmp (ent->key, curKey) && !strcmp (ent->name, name))
+            return ent;
+    }
+    return NULL;
+}
+
+static manifestEnt_t* addEnt (const char* key, const char* name, const char* src)
+{
+    manifestEnt_t* ent = calloc_s (sizeof (manifestEnt_t));
+    ent->key = strdup (key);
+    ent->name = strdup (name);
+    ent->src = strdup (src);
+    manifestEnt_t** bucket = getBucket (name);
+    ent->next = *bucket;
+    *bucket = ent;
+    return ent;
+}
+
+static void freeEnt (manifestEnt_t* ent)
+{
+    free (ent->key);
+    free (ent->name);
+    free (ent->src);
+    free (ent);
+}
+
+// Frees the loaded manifest
+static void freeManifest()
+{
+    for (int i = 0; i < MANIFEST_HASH_SZ; ++i)
+    {
+        manifestEnt_t* ent = entTable[i];
+        while (ent)
+        {
+            manifestEnt_t* next = ent->next;
+            freeEnt (ent);
+            ent = next;
+        }
+        entTable[i] = NULL;
+    }
+    free (loadedFile);
+    free (curKey);
+    loadedFile = NULL;
+    curKey = NULL;
+}
+
+// Gets manifest file of img
+static bool getManifestFile (Image_t* img, char* buf, size_t bufSz)
+{
+    if (manifestFile)
+        return strlcpy (buf, manifestFile, bufSz) < bufSz;
+    return (size_t) snprintf (buf, bufSz, "%s.manifest", img->file) < bufSz;
+}
+
+// Reads in a manifest. A manifest that doesn't exist yet is empty
+static bool loadManifest (const char* file)
+{
+    loadedFile = strdup (file);
+    FILE* fp = fopen (file, "r");
+    if (!fp)
+    {
+        if (errno == ENOENT)
+            return true;
+        error ("%s: %s", file, strerror (errno));
+        return false;
+    }
+    char* line = NULL;
+    size_t lineSz = 0;
+    ssize_t len = 0;
+    while ((len = getline (&line, &lineSz, fp)) > 0)
+    {
+        if (line[len - 1] == '\n')
+            line[len - 1] = 0;
+        // Line is key, hash, size, time, name, and source, seperated by tabs
+        char* fields[6];
+        char* cur = line;
+        int numFields = 0;
+        while (numFields < 6 && cur)
+        {
+            fields[numFields++] = cur;
+            cur = strchr (cur, '\t');
+            if (cur)
+                *cur++ = 0;
+        }
+        if (numFields != 6)
+            continue;    // Skip broken lines
+        manifestEnt_t* ent = addEnt (fields[0], fields[4], fields[5]);
+        ent->hash = strtoull (fields[1], NULL, 16);
+        ent->size = strtoull (fields[2], NULL, 10);
+        ent->mtime = strtoll (fields[3], NULL, 10);
+    }
+    free (line);
+    fclose (fp);
+    return true;
+}
+
+// Writes out the loaded manifest
+static bool saveManifest()
+{
+    // Write to a new file and move it over, so a failed write doesn't lose the old one
+    char tmpFile[PATH_MAX];
+    if ((size_t) snprintf (tmpFile, PATH_MAX, "%s.new", loadedFile) >= PATH_MAX)
+    {
+        error ("buffer overflow detected");
+        return false;
+    }
+    FILE* fp = fopen (tmpFile, "w");
+    if (!fp)
+    {
+        error ("%s: %s", tmpFile, strerror (errno));
+        return false;
+    }
+    for (int i = 0; i < MANIFEST_HASH_SZ; ++i)
+    {
+        for (manifestEnt_t* ent = entTable[i]; ent; ent = ent->next)
+        {
+            fprintf (fp,
+                     "%s\t%016" PRIx64 "\t%" PRIu64 "\t%" PRId64 "\t%s\t%s\n",
+                     ent->key,
+                     ent->hash,
+                     ent->size,
+                     ent->mtime,
+                     ent->name,
+                     ent->src);
+        }
+    }
+    if (fclose (fp) == EOF || rename (tmpFile, loadedFile) == -1)
+    {
+        error ("%s: %s", loadedFile, strerror (errno));
+        unlink (tmpFile);
+        return false;
+    }
+    return true;
+}
+
+// Makes key of partition
+static char* makeKey (Image_t* img, Partition_t* part)
+{
+    size_t sz = strlen (img->name) + strlen (part->name) + 2;
+    char* key = malloc_s (sz);
+    snprintf (key, sz, "%s:%s", img->name, part->name);
+    return key;
+}
+
+// Checks if a path can be stored in the manifest
+static bool canStore (const char* s)
+{
+    return !strpbrk (s, "\t\n");
+}
+
+void setManifestFile (const char* file)
+{
+    manifestFile = file;
+}
+
+bool openManifest (Image_t* img, Partition_t* part)
+{
+    char file[PATH_MAX];
+    if (!getManifestFile (img, file, PATH_MAX))
+    {
+        error ("buffer overflow detected");
+        return false;
+    }
+    if (!loadManifest (file))
+    {
+        freeManifest();
+        return false;
+    }
+    curKey = makeKey (img, part);
+    lastHashed = NULL;
+    return true;
+}
+
+int checkManifest (const char* name, const char* src, struct stat* srcSt)
+{
+    lastHashed = NULL;
+    manifestEnt_t* ent = findEnt (name);
+    if (!ent)
+        return MANIFEST_UNKNOWN;
+    ent->seen = true;
+    if (ent->size != (uint64_t) srcSt->st_size)
+        return MANIFEST_CHANGED;
+    if (ent->mtime == srcSt->st_mtime)
+        return MANIFEST_SAME;
+    // Time changed, so see if the contents did
+    uint64_t hash = 0;
+    if (!hashFile (src, &hash))
+        return MANIFEST_CHANGED;
+    lastHashed = src;
+    lastHash = hash;
+    if (hash != ent->hash)
+        return MANIFEST_CHANGED;
+    // Same contents, so remember the new time to save hashing it next time
+    ent->mtime = srcSt->st_mtime;
+    return MANIFEST_SAME;
+}
+
+bool recordManifest (const char* name, const char* src, struct stat* srcSt)
+{
+    if (!canStore (name) || !canStore (src))
+        return true;    // It just won't be skipped next time
+    uint64_t hash = 0;
+    if (lastHashed && !strcmp (lastHashed, src))
+        hash = lastHash;
+    else if (!hashFile (src, &hash))
+        return false;
+    lastHashed = NULL;
+    manifestEnt_t* ent = findEnt (name);
+    if (!ent)
+        ent = addEnt (curKey, name, src);
+    else if (strcmp (ent->src, src) != 0)
+    {
+        free (ent->src);
+        ent->src = strdup (src);
+    }
+    ent->size = srcSt->st_size;
+    ent->mtime = srcSt->st_mtime;
+    ent->hash = hash;
+    ent->seen = true;
+    return true;
+}
+
+bool closeManifest (bool (*removeFile) (const char*), bool commit)
+{
+    if (!loadedFile)
+        return true;
+    if (!commit)
+    {
+        freeManifest();
+        return true;
+    }
+    // Find files that are gone from the host
+    size_t numGone = 0;
+    manifestEnt_t* gone = NULL;
+    for (int i = 0; i < MANIFEST_HASH_SZ; ++i)
+    {
+        manifestEnt_t** prev = &entTable[i];
+        manifestEnt_t* ent = *prev;
+        while (ent)
+        {
+            struct stat st;
+            if (!ent->seen && !strcmp (ent->key, curKey) && lstat (ent->src, &st) == -1 &&
+                errno == ENOENT)
+            {
+                *prev = ent->next;
+                ent->next = gone;
+                gone = ent;
+                ++numGone;
+            }
+            else
+                prev = &ent->next;
+            ent = *prev;
+        }
+    }
+    // Delete them all together
+    bool res = true;
+    if (numGone)
+        printf ("Deleting %zu files that were removed...\n", numGone);
+    while (gone)
+    {
+        manifestEnt_t* next = gone->next;
+        if (!removeFile (gone->name))
+            res = false;
+        freeEnt (gone);
+        gone = next;
+    }
+    if (!saveManifest())
+        res = false;
+    freeManifest();
+    return res;
+}
+
+bool forgetManifest (Image_t* img, Partition_t* part)
+{
+    char file[PATH_MAX];
+    if (!getManifestFile (img, file, PATH_MAX))
+    {
+        error ("buffer overflow detected");
+        return false;
+    }
+    if (access (file, F_OK) == -1)
+        return true;
+    if (!loadManifest (file))
+    {
+        freeManifest();
+        return false;
+    }
+    curKey = makeKey (img, part);
+    for (int i = 0; i < MANIFEST_HASH_SZ; ++i)
+    {
+        manifestEnt_t** prev = &entTable[i];
+        manifestEnt_t* ent = *prev;
+        while (ent)
+        {
+            if (!strcmp (ent->key, curKey))
+            {
+                *prev = ent->next;
+                freeEnt (ent);
+            }
+            else
+                prev = &ent->next;
+            ent = *prev;
+        }
+    }
+    bool res = saveManifest();
+    freeManifest();
+    return res;
+}
@@ -22,6 +22,7 @@
 
 #include <guestfs.h>
 #include <libnex.h>
+#include <sys/stat.h>
 
 /// Valid image formats
 #define IMG_FORMAT_MBR     1
@@ -45,12 +46,26 @@ typedef struct _image
     short bootEmu;                ///< Emulation mode of image (on ISO images)
     bool isUniversal;             ///< Is it a universal disk image?
     char* mbrFile;                /// Path to file used for MBR
+    short alloc;                  ///< How the image file is allocated
+    short fileFormat;             ///< Format of image file
+    bool fatDirect;               ///< If FAT partitions are written without the appliance
     guestfs_h* guestFs;           ///< Handle to libguestfs instance
+    char dev[16];                 ///< Device of image in libguestfs
+    char altDev[16];              ///< Device of alternate boot image in libguestfs
+    bool isReady;                 ///< If the image was set up to be worked on
     ListHead_t* partsList;        ///< List of partitions
     struct _part* bootPart;       ///< Boot partition
     struct _part* altBootPart;    ///< Alternate boot partition
 } Image_t;
 
+/// Image file allocation
+#define IMG_ALLOC_SPARSE 0    ///< Blocks are allocated as they're written
+#define IMG_ALLOC_FULL   1    ///< Blocks are allocated up front
+
+/// Image file formats
+#define IMG_FILE_RAW   0
+#define IMG_FILE_QCOW2 1
+
 /// Valid filesystems
 #define IMG_FILESYS_FAT32   1
 #define IMG_FILESYS_FAT16   2
@@ -130,18 +145,80 @@ Partition_t* getBootPart (Image_t* img);
 Partition_t* getAltBootPart (Image_t* img);
 
 /// Creates images, partitions, and filesystems, and copies files
+/// If useTar is set, changed files are uploaded to each partition in one tar stream
 bool createImages (ListHead_t* images,
                    const char* action,
                    bool overwrite,
                    const char* file,
-                   const char* listFile);
+                   const char* listFile,
+                   bool useTar);
 
 /// Update a partition's files
 bool updatePartition (Image_t* img,
                       Partition_t* part,
                       const char* listFile,
                       const char* mount,
-                      const char* host);
+                      const char* host,
+                      bool useTar);
+
+/// Sets manifest file to use instead of one next to each image
+void setManifestFile (const char* file);
+
+/// Loads the manifest of a partition for an update
+bool openManifest (Image_t* img, Partition_t* part);
+
+/// Manifest check results
+#define MANIFEST_SAME    0    ///< File hasn't changed since it was recorded
+#define MANIFEST_CHANGED 1    ///< File has changed
+#define MANIFEST_UNKNOWN 2    ///< File isn't in manifest
+
+/// Checks if a file changed since it was recorded in the manifest
+int checkManifest (const char* name, const char* src, struct stat* srcSt);
+
+/// Records a file that's up to date in the partition
+bool recordManifest (const char* name, const char* src, struct stat* srcSt);
+
+/// Finishes an update, deleting removed files and saving the manifest if commit is set
+/// removeFile is called with the path of each removed file relative to the partition
+bool closeManifest (bool (*removeFile) (const char*), bool commit);
+
+/// Drops a partition from the manifest after it's formatted
+bool forgetManifest (Image_t* img, Partition_t* part);
+
+/// Hashes len bytes of fd at off
+/// Each 1 MiB block is hashed with the hash of the blocks before it as seed
+bool hashExtent (int fd, off_t off, uint64_t len, uint64_t* hash);
+
+/// Hashes a file's contents the same way as hashExtent
+bool hashFile (const char* src, uint64_t* hash);
+
+/// Patches changed files into an ISO9660 image written before
+/// Returns false if the image has to be rebuilt
+bool patchIso (Image_t* img, const char* listFile);
+
+/// Saves where each file's data is in a freshly written ISO9660 image
+bool saveIsoLayout (Image_t* img, const char* listFile);
+
+/// A FAT file system written without the appliance
+typedef struct _fatvol FatVol_t;
+
+/// Opens the FAT file system at base in a raw image file
+FatVol_t* fatOpen (const char* file, off_t base);
+
+/// Gets the modification time of a file. exists is cleared if it isn't a file on the volume
+bool fatGetMtime (FatVol_t* vol, const char* path, bool* exists, time_t* mtime);
+
+/// Makes a directory and its parents
+bool fatMkdir (FatVol_t* vol, const char* path);
+
+/// Writes a host file to path, making directories as needed
+bool fatWriteFile (FatVol_t* vol, const char* path, const char* src, struct stat* srcSt);
+
+/// Removes a file if it exists
+bool fatRemove (FatVol_t* vol, const char* path);
+
+/// Writes out the FATs and closes the volume
+bool fatClose (FatVol_t* vol);
 
 /// Updates the VBR of a partition
 bool updateVbr (Image_t* img, Partition_t* part);
@@ -27,6 +27,8 @@
 #include <fcntl.h>
 #include <guestfs.h>
 #include <libgen.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -50,6 +52,18 @@ static const char* hostPrefix = NULL;
 // Partition of update state
 static Partition_t* curPart = NULL;
 
+// Image of update state
+static Image_t* curImg = NULL;
+
+// Gets path of dest relative to mount directory
+static const char* getRelDest (const char* dest)
+{
+    dest += strlen (mountDir);
+    while (*dest == '/')
+        ++dest;
+    return dest;
+}
+
 // Converts multiplier value to sectors
 #define IMG_MUL_TO_SECT(mulSz) (((mulSz) * (muls[img->mul])) / 512)
 
@@ -313,6 +327,10 @@ static bool updateRegFile (guestfs_h* guestFs,
                            const char* dest,
                            struct stat* srcSt)
 {
+    // Files the manifest knows are unchanged don't need to be looked at in the image
+    int state = checkManifest (getRelDest (dest), src, srcSt);
+    if (state == MANIFEST_SAME)
+        return true;
     // Check for dest, and maybe stat it
     struct guestfs_statns* destSt = NULL;
     bool destExist = false;
@@ -328,7 +346,7 @@ static bool updateRegFile (guestfs_h* guestFs,
     }
 
     // Check if we need to update this file
-    if (!destExist || (srcSt->st_mtime > destSt->st_mtime_sec))
+    if (!destExist || state == MANIFEST_CHANGED || (srcSt->st_mtime > destSt->st_mtime_sec))
     {
         // Create directories
         // Backup dest
@@ -378,14 +396,15 @@ static bool updateRegFile (guestfs_h* guestFs,
         // Cleanup
         if (destSt)
             guestfs_free_statns (destSt);
+        bool res = recordManifest (getRelDest (backupDest), src, srcSt);
         free (backupDest);
-        return true;
+        return res;
     }
     else
     {
         if (destSt)
             guestfs_free_statns (destSt);
-        return true;
+        return recordManifest (getRelDest (dest), src, srcSt);
     }
 }
 
@@ -506,16 +525,511 @@ bool updateFile (guestfs_h* guestFs, const char* src, const char* dest)
     }
 }
 
+// Tar upload
+// Going file by file costs several round trips into the appliance per file. Instead, the
+// image's files are listed and stat'ed in bulk up front, changed files are written into a
+// local tar file, and that is extracted in the image with one upload
+// Symlinks still go through updateSymlink, as they are few and need their targets fixed up
+
+#define TAR_BLKSZ      512
+#define TAR_STAT_BATCH 256    // Names stat'ed per round trip
+
+// File in image
+typedef struct _imgFile
+{
+    char* name;         // Path relative to mount directory
+    int64_t mtime;      // Modification time
+    bool isReg;         // If this is a regular file
+} imgFile_t;
+
+// Files in image, sorted by name
+static imgFile_t* imgFiles = NULL;
+static size_t numImgFiles = 0;
+
+// Tar file being built
+static FILE* tarFile = NULL;
+static size_t tarCount = 0;    // Entries written to tar file
+
+static int imgFileCmp (const void* a, const void* b)
+{
+    return strcmp (((const imgFile_t*) a)->name, ((const imgFile_t*) b)->name);
+}
+
+// Frees the list of files in the image
+static void freeImgFiles()
+{
+    for (size_t i = 0; i < numImgFiles; ++i)
+        free (imgFiles[i].name);
+    free (imgFiles);
+    imgFiles = NULL;
+    numImgFiles = 0;
+}
+
+// Lists every file in the image along with its modification time
+static bool listImgFiles (guestfs_h* guestFs)
+{
+    // Get the names into a temporary file
+    char listName[] = "/tmp/nnimageXXXXXX";
+    int listFd = mkstemp (listName);
+    if (listFd == -1)
+    {
+        error ("%s: %s", listName, strerror (errno));
+        return false;
+    }
+    close (listFd);
+    if (guestfs_find0 (guestFs, mountDir, listName) == -1)
+    {
+        unlink (listName);
+        return false;
+    }
+    FILE* list = fopen (listName, "r");
+    unlink (listName);
+    if (!list)
+    {
+        error ("%s: %s", listName, strerror (errno));
+        return false;
+    }
+    // Read them in
+    size_t maxFiles = 0;
+    char* name = NULL;
+    size_t nameSz = 0;
+    ssize_t len = 0;
+    while ((len = getdelim (&name, &nameSz, '\0', list)) > 0)
+    {
+        if (numImgFiles == maxFiles)
+        {
+            maxFiles = maxFiles ? maxFiles * 2 : 1024;
+            imgFiles = realloc (imgFiles, maxFiles * sizeof (imgFile_t));
+            if (!imgFiles)
+            {
+                error ("out of memory");
+                free (name);
+                fclose (list);
+                return false;
+            }
+        }
+        imgFiles[numImgFiles].name = strdup (name);
+        imgFiles[numImgFiles].mtime = 0;
+        imgFiles[numImgFiles].isReg = false;
+        ++numImgFiles;
+    }
+    free (name);
+    fclose (list);
+    // Stat them a batch at a time
+    char* names[TAR_STAT_BATCH + 1];
+    for (size_t i = 0; i < numImgFiles; i += TAR_STAT_BATCH)
+    {
+        size_t count = numImgFiles - i;
+        if (count > TAR_STAT_BATCH)
+            count = TAR_STAT_BATCH;
+        for (size_t j = 0; j < count; ++j)
+            names[j] = imgFiles[i + j].name;
+        names[count] = NULL;
+        struct guestfs_statns_list* stats = guestfs_lstatnslist (guestFs, mountDir, names);
+        if (!stats)
+            return false;
+        for (size_t j = 0; j < count && j < stats->len; ++j)
+        {
+            imgFiles[i + j].mtime = stats->val[j].st_mtime_sec;
+            imgFiles[i + j].isReg = S_ISREG (stats->val[j].st_mode);
+        }
+        guestfs_free_statns_list (stats);
+    }
+    qsort (imgFiles, numImgFiles, sizeof (imgFile_t), imgFileCmp);
+    return true;
+}
+
+// Finds a file in the image, or returns NULL if it doesn't exist
+static imgFile_t* findImgFile (const char* name)
+{
+    imgFile_t key = {.name = (char*) name};
+    return bsearch (&key, imgFiles, numImgFiles, sizeof (imgFile_t), imgFileCmp);
+}
+
+// Writes an octal tar header field
+static void tarOctal (char* field, size_t sz, uint64_t val)
+{
+    snprintf (field, sz, "%0*llo", (int) sz - 1, (unsigned long long) val);
+}
+
+// Writes a tar header
+static bool tarWriteHeader (const char* name, char type, int mode, uint64_t size, int64_t mtime)
+{
+    char hdr[TAR_BLKSZ] = {0};
+    // Names that don't fit are split between the prefix and name fields at a slash
+    size_t nameLen = strlen (name);
+    const char* base = name;
+    if (nameLen > 100)
+    {
+        const char* split = name + nameLen - 101;
+        while (*split && *split != '/')
+            ++split;
+        if (!*split || (size_t) (split - name) > 155)
+        {
+            error ("%s: path too long for tar", name);
+            return false;
+        }
+        memcpy (hdr + 345, name, split - name);
+        base = split + 1;
+    }
+    memcpy (hdr, base, strlen (base));
+    tarOctal (hdr + 100, 8, mode);
+    tarOctal (hdr + 108, 8, 0);
+    tarOctal (hdr + 116, 8, 0);
+    tarOctal (hdr + 124, 12, size);
+    tarOctal (hdr + 136, 12, mtime);
+    hdr[156] = type;
+    memcpy (hdr + 257, "ustar", 6);
+    memcpy (hdr + 263, "00", 2);
+    // Checksum is taken with the checksum field filled with spaces
+    memset (hdr + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLKSZ; ++i)
+        sum += (uint8_t) hdr[i];
+    snprintf (hdr + 148, 7, "%06o", sum);
+    hdr[155] = ' ';
+    if (fwrite (hdr, TAR_BLKSZ, 1, tarFile) != 1)
+    {
+        error ("tar file: %s", strerror (errno));
+        return false;
+    }
+    ++tarCount;
+    return true;
+}
+
+// Gets mode a file gets on this partition
+// FAT can't store modes, and refuses to change the ones it makes up
+static int tarGetMode (struct stat* srcSt)
+{
+    if (curPart->filesys == IMG_FILESYS_EXT2)
+        return srcSt->st_mode & 0777;
+    return 0755;
+}
+
+// Adds a regular file to the tar file
+static bool tarAddRegFile (const char* src, const char* name, struct stat* srcSt)
+{
+    if (!tarWriteHeader (name, '0', tarGetMode (srcSt), srcSt->st_size, srcSt->st_mtime))
+        return false;
+    int srcFd = open (src, O_RDONLY);
+    if (srcFd == -1)
+    {
+        error ("%s: %s", src, strerror (errno));
+        return false;
+    }
+    uint8_t* buf = (uint8_t*) malloc_s (BLKSIZET);
+    off_t left = srcSt->st_size;
+    while (left)
+    {
+        size_t count = (left > BLKSIZE) ? BLKSIZET : (size_t) left;
+        ssize_t bytesRead = read (srcFd, buf, count);
+        if (bytesRead <= 0)
+        {
+            error ("%s: %s", src, bytesRead ? strerror (errno) : "file shrunk while copying");
+            free (buf);
+            close (srcFd);
+            return false;
+        }
+        if (fwrite (buf, bytesRead, 1, tarFile) != 1)
+        {
+            error ("tar file: %s", strerror (errno));
+            free (buf);
+            close (srcFd);
+            return false;
+        }
+        left -= bytesRead;
+    }
+    free (buf);
+    close (srcFd);
+    // Pad out to a whole block
+    static const char pad[TAR_BLKSZ] = {0};
+    size_t padSz = (TAR_BLKSZ - (srcSt->st_size % TAR_BLKSZ)) % TAR_BLKSZ;
+    if (padSz && fwrite (pad, padSz, 1, tarFile) != 1)
+    {
+        error ("tar file: %s", strerror (errno));
+        return false;
+    }
+    return true;
+}
+
+static bool tarAddFile (guestfs_h* guestFs, const char* src, const char* dest);
+
+// Adds changed files in a directory to the tar file
+static bool tarAddSubDir (guestfs_h* guestFs,
+                          const char* srcDir,
+                          const char* destDir,
+                          struct stat* srcSt)
+{
+    // Make sure the directory itself gets made
+    const char* name = getRelDest (destDir);
+    if (*name && !findImgFile (name) &&
+        !tarWriteHeader (name, '5', tarGetMode (srcSt), 0, srcSt->st_mtime))
+    {
+        return false;
+    }
+    DIR* dir = opendir (srcDir);
+    if (!dir)
+    {
+        error ("%s: %s", srcDir, strerror (errno));
+        return false;
+    }
+    struct dirent* curDir = NULL;
+    while ((curDir = readdir (dir)))
+    {
+        if (!strcmp (curDir->d_name, ".") || !strcmp (curDir->d_name, ".."))
+            continue;
+        char fullSrc[PATH_MAX];
+        char fullDest[PATH_MAX];
+        if (snprintf (fullSrc, PATH_MAX, "%s/%s", srcDir, curDir->d_name) >= PATH_MAX ||
+            snprintf (fullDest, PATH_MAX, "%s/%s", destDir, curDir->d_name) >= PATH_MAX)
+        {
+            closedir (dir);
+            error ("buffer overflow detected");
+            return false;
+        }
+        if (!tarAddFile (guestFs, fullSrc, fullDest))
+        {
+            closedir (dir);
+            return false;
+        }
+    }
+    closedir (dir);
+    return true;
+}
+
+// Adds a file to the tar file if it changed
+static bool tarAddFile (guestfs_h* guestFs, const char* src, const char* dest)
+{
+    struct stat srcSt;
+    if (lstat (src, &srcSt) == -1)
+    {
+        error ("%s: %s", src, strerror (errno));
+        return false;
+    }
+    if (S_ISLNK (srcSt.st_mode))
+    {
+        // updateSymlink changes dest
+        char* destCopy = strdup (dest);
+        bool res = updateSymlink (guestFs, src, destCopy, &srcSt);
+        free (destCopy);
+        return res;
+    }
+    else if (S_ISREG (srcSt.st_mode))
+    {
+        const char* name = getRelDest (dest);
+        imgFile_t* destFile = findImgFile (name);
+        int state = checkManifest (name, src, &srcSt);
+        if (destFile && destFile->isReg &&
+            (state == MANIFEST_SAME ||
+             (state == MANIFEST_UNKNOWN && srcSt.st_mtime <= destFile->mtime)))
+        {
+            return recordManifest (name, src, &srcSt);    // Up to date
+        }
+        // The manifest isn't saved unless the upload works
+        if (!recordManifest (name, src, &srcSt))
+            return false;
+        return tarAddRegFile (src, name, &srcSt);
+    }
+    else if (S_ISDIR (srcSt.st_mode))
+        return tarAddSubDir (guestFs, src, dest, &srcSt);
+    error ("%s is not regular file, symlink, or directory", src);
+    return false;
+}
+
+// Updates a partition's files with one tar upload
+static bool tarUpdatePartition (Image_t* img)
+{
+    if (!listImgFiles (img->guestFs))
+    {
+        freeImgFiles();
+        return false;
+    }
+    char tarName[] = "/tmp/nnimageXXXXXX";
+    int tarFd = mkstemp (tarName);
+    if (tarFd == -1 || !(tarFile = fdopen (tarFd, "w")))
+    {
+        error ("%s: %s", tarName, strerror (errno));
+        freeImgFiles();
+        return false;
+    }
+    tarCount = 0;
+    bool res = true;
+    listFile_t* curFile = getNextFile();
+    while (curFile)
+    {
+        if (curFile == (listFile_t*) -1)
+        {
+            res = false;
+            break;
+        }
+        res = tarAddFile (img->guestFs, curFile->srcFile, curFile->destFile);
+        free (curFile);
+        if (!res)
+            break;
+        curFile = getNextFile();
+    }
+    freeImgFiles();
+    // End of archive is two zero blocks
+    static const char end[TAR_BLKSZ * 2] = {0};
+    if (res && fwrite (end, sizeof (end), 1, tarFile) != 1)
+    {
+        error ("%s: %s", tarName, strerror (errno));
+        res = false;
+    }
+    if (fclose (tarFile) == EOF && res)
+    {
+        error ("%s: %s", tarName, strerror (errno));
+        res = false;
+    }
+    tarFile = NULL;
+    if (res && tarCount)
+    {
+        printf ("Uploading %zu changed files and directories...\n", tarCount);
+        if (guestfs_tar_in (img->guestFs, tarName, mountDir) == -1)
+            res = false;
+    }
+    unlink (tarName);
+    return res;
+}
+
+// Removes a file the manifest found was deleted
+static bool guestFsRemove (const char* name)
+{
+    char path[PATH_MAX];
+    if ((size_t) snprintf (path, PATH_MAX, "%s/%s", mountDir, name) >= PATH_MAX)
+    {
+        error ("buffer overflow detected");
+        return false;
+    }
+    return guestfs_rm_f (curImg->guestFs, path) != -1;
+}
+
+// Direct FAT update
+// FAT partitions in raw images are written by fat.c straight to the image file, so the files
+// in them can be updated without launching the appliance. Destination paths still start with
+// the mount directory, which is stripped off by getRelDest
+
+// Volume being updated
+static FatVol_t* fatVol = NULL;
+
+static bool fatRemoveFile (const char* name)
+{
+    return fatRemove (fatVol, name);
+}
+
+static bool fatUpdateFile (const char* src, const char* dest);
+
+// Updates the files in a directory
+static bool fatUpdateSubDir (const char* srcDir, const char* destDir)
+{
+    if (!fatMkdir (fatVol, getRelDest (destDir)))
+        return false;
+    DIR* dir = opendir (srcDir);
+    if (!dir)
+    {
+        error ("%s: %s", srcDir, strerror (errno));
+        return false;
+    }
+    struct dirent* curDir = NULL;
+    while ((curDir = readdir (dir)))
+    {
+        if (!strcmp (curDir->d_name, ".") || !strcmp (curDir->d_name, ".."))
+            continue;
+        char fullSrc[PATH_MAX];
+        char fullDest[PATH_MAX];
+        if (snprintf (fullSrc, PATH_MAX, "%s/%s", srcDir, curDir->d_name) >= PATH_MAX ||
+            snprintf (fullDest, PATH_MAX, "%s/%s", destDir, curDir->d_name) >= PATH_MAX)
+        {
+            closedir (dir);
+            error ("buffer overflow detected");
+            return false;
+        }
+        if (!fatUpdateFile (fullSrc, fullDest))
+        {
+            closedir (dir);
+            return false;
+        }
+    }
+    closedir (dir);
+    return true;
+}
+
+// Updates a file if it changed
+static bool fatUpdateFile (const char* src, const char* dest)
+{
+    struct stat srcSt;
+    if (lstat (src, &srcSt) == -1)
+    {
+        error ("%s: %s", src, strerror (errno));
+        return false;
+    }
+    const char* name = getRelDest (dest);
+    if (S_ISDIR (srcSt.st_mode))
+        return fatUpdateSubDir (src, dest);
+    else if (!S_ISREG (srcSt.st_mode))
+    {
+        error ("%s: only files and directories can be put on FAT partitions", src);
+        return false;
+    }
+    int state = checkManifest (name, src, &srcSt);
+    if (state == MANIFEST_SAME)
+        return true;
+    bool destExist = false;
+    time_t destTime = 0;
+    if (!fatGetMtime (fatVol, name, &destExist, &destTime))
+        return false;
+    // FAT times only have 2 second resolution
+    if (!destExist || state == MANIFEST_CHANGED || srcSt.st_mtime > destTime + 1)
+    {
+        if (!fatWriteFile (fatVol, name, src, &srcSt))
+            return false;
+    }
+    return recordManifest (name, src, &srcSt);
+}
+
+// Updates a FAT partition straight on the image file
+static bool fatUpdatePartition (Image_t* img, Partition_t* part)
+{
+    off_t base = 0;
+    if (img->format != IMG_FORMAT_FLOPPY)
+        base = IMG_MUL_TO_SECT (part->start) * (off_t) IMG_SECT_SZ;
+    fatVol = fatOpen (img->file, base);
+    if (!fatVol)
+        return false;
+    bool res = true;
+    listFile_t* curFile = getNextFile();
+    while (curFile)
+    {
+        if (curFile == (listFile_t*) -1)
+        {
+            res = false;
+            break;
+        }
+        res = fatUpdateFile (curFile->srcFile, curFile->destFile);
+        free (curFile);
+        if (!res)
+            break;
+        curFile = getNextFile();
+    }
+    // Deleted files have to be removed before the FATs are written out
+    res = closeManifest (fatRemoveFile, res) && res;
+    res = fatClose (fatVol) && res;
+    fatVol = NULL;
+    return res;
+}
+
 bool updatePartition (Image_t* img,
                       Partition_t* part,
                       const char* listFile,
                       const char* mount,
-                      const char* host)
+                      const char* host,
+                      bool useTar)
 {
     printf ("Updating partition %s on prefix %s...\n", part->name, part->prefix);
     mountDir = mount;
     hostPrefix = host;
     curPart = part;
+    curImg = img;
     listFileName = listFile;
     // Open list file
     listFileFd = fopen (listFile, "r");
@@ -537,16 +1051,38 @@ bool updatePartition (Image_t* img,
             return false;
         }
     }
+    else if (!openManifest (img, part))
+    {
+        fclose (listFileFd);
+        return false;
+    }
+    if (img->fatDirect)
+    {
+        bool res = fatUpdatePartition (img, part);
+        fclose (listFileFd);
+        return res;
+    }
+    // Everything but ISO 9660 can be updated in one upload
+    if (useTar && part->filesys != IMG_FILESYS_ISO9660)
+    {
+        bool res = tarUpdatePartition (img);
+        fclose (listFileFd);
+        return closeManifest (guestFsRemove, res) && res;
+    }
     listFile_t* curFile = getNextFile();
     while (curFile)
     {
         if (curFile == (listFile_t*) -1)
+        {
+            closeManifest (guestFsRemove, false);
             return false;
+        }
         if (part->filesys != IMG_FILESYS_ISO9660)
         {
             // Update file
             if (!updateFile (img->guestFs, curFile->srcFile, curFile->destFile))
             {
+                closeManifest (guestFsRemove, false);
                 free (curFile);
                 fclose (listFileFd);
                 return false;
@@ -588,7 +1124,7 @@ bool updatePartition (Image_t* img,
         fclose (xorrisoList);
     }
     fclose (listFileFd);
-    return true;
+    return closeManifest (guestFsRemove, true);
 }
 
 // Updates the VBR of a partition
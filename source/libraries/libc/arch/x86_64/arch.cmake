@@ -17,3 +17,9 @@
 
 list(APPEND LIBC_SOURCE_CRT0
     arch/x86_64/crt0.asm)
+
+# String instructions beat the generic loops for these
+list(APPEND LIBC_STRING_OVERRIDES memcpy memset)
+list(APPEND LIBC_SOURCE_ARCH
+    arch/x86_64/string/memcpy.c
+    arch/x86_64/string/memset.c)
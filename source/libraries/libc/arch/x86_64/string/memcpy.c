@@ -0,0 +1,33 @@
+/*
+    memcpy.c - contains x86_64 memcpy for libc
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+void* memcpy (void* restrict dest, const void* restrict src, size_t n)
+{
+    void* d = dest;
+    size_t qwords = n >> 3;
+    size_t rem = n & 7;
+    asm volatile ("rep movsq\n"
+                  "mov %[rem], %%rcx\n"
+                  "rep movsb"
+                  : "+D"(d), "+S"(src), "+c"(qwords)
+                  : [rem] "r"(rem)
+                  : "memory");
+    return dest;
+}
@@ -0,0 +1,34 @@
+/*
+    memset.c - contains x86_64 memset for libc
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+void* memset (void* str, int ch, size_t count)
+{
+    void* s = str;
+    uint64_t val = 0x0101010101010101ULL * (uint8_t) ch;
+    size_t qwords = count >> 3;
+    size_t rem = count & 7;
+    asm volatile ("rep stosq\n"
+                  "mov %[rem], %%rcx\n"
+                  "rep stosb"
+                  : "+D"(s), "+c"(qwords)
+                  : "a"(val), [rem] "r"(rem)
+                  : "memory");
+    return str;
+}
@@ -28,6 +28,8 @@
 void* memset (void* str, int ch, size_t count);
 int memcmp (const void* s1, const void* s2, size_t n);
 void* memcpy (void* restrict dest, const void* restrict src, size_t n);
+void* memmove (void* dest, const void* src, size_t n);
+void* memchr (const void* s, int ch, size_t n);
 
 int strcmp (const char* s1, const char* s2);
 size_t strlen (const char* s);
@@ -27,11 +27,11 @@
 // Contains printf out data
 typedef struct _printfOut
 {
-    int (*out) (struct _printfOut*, char);    // Function to be called
-    char* buf;                                // Buffer being written to
-    size_t bufSize;                           // Size of buffer
-    size_t bufPos;                            // Current position in buffer
-    int charsPrinted;                         // Number of characters printed
+    int (*out) (struct _printfOut*, const char*, size_t);    // Writes a span of characters
+    char* buf;                                               // Buffer being written to
+    size_t bufSize;                                          // Size of buffer
+    size_t bufPos;                                           // Current position in buffer
+    int charsPrinted;                                        // Number of characters printed
 } _printfOut_t;
 
 // Contains printf format string part decoding
@@ -88,25 +88,37 @@ static int lenToSizeUint[] = {PRINTF_SIZE_UINT,
                               PRINTF_SIZE_SIZET,
                               PRINTF_SIZE_PTRDIFF};
 
-#define IS_DIGIT1TO9(c)                                                                  \
-    ((c) == '1' || (c) == '2' || (c) == '3' || (c) == '4' || (c) == '5' || (c) == '6' || \
-     (c) == '7' || (c) == '8' || (c) == '9')
+#define IS_DIGIT1TO9(c) ((c) >= '1' && (c) <= '9')
+#define IS_DIGIT(c)     ((c) >= '0' && (c) <= '9')
 #define INC_FORMAT \
     ++fmt;         \
     ++fmtOffset;
 
+// Longest number we can convert, which is a 64 bit octal number
+#define PRINTF_NUM_MAX 24
+
+// Pairs of decimal digits, so we can divide by 100 instead of 10
+static const char decPairs[] = "00010203040506070809"
+                               "10111213141516171819"
+                               "20212223242526272829"
+                               "30313233343536373839"
+                               "40414243444546474849"
+                               "50515253545556575859"
+                               "60616263646566676869"
+                               "70717273747576777879"
+                               "80818283848586878889"
+                               "90919293949596979899";
+
+static const char lowerDigits[] = "0123456789abcdef";
+static const char upperDigits[] = "0123456789ABCDEF";
+
 static int __fmtStrToNum (const char** fmts, int* fmtOffset)
 {
-    int i = 0;
     int num = 0;
     const char* fmt = *fmts;
-    while (IS_DIGIT1TO9 (*fmt))
+    while (IS_DIGIT (*fmt))
     {
-        // Convert to number
-        if (num)
-            num *= 10;    // Move to next base
-        num += (*fmt - '0');
-        ++i;
+        num = (num * 10) + (*fmt - '0');
         ++fmt;
         *fmtOffset += 1;
     }
@@ -114,68 +126,69 @@ static int __fmtStrToNum (const char** fmts, int* fmtOffset)
     return num;
 }
 
-static bool __fmtSignedNumToStr (char* s, intmax_t num)
+// Converts num to decimal, writing backwards from end
+// Returns the first character
+static char* __fmtDecToStr (char* end, uintmax_t num)
 {
-    // Determine sign
-    bool sign = 0;
-    if (num >= 0)
-        sign = 1;
-    else
+    char* s = end;
+    // Do wide divisions only while we have to, as they're slow on 32 bit CPUs
+    while (num > (unsigned long) -1)
     {
-        sign = 0;
-        num *= -1;    // Change to positive to make it easier to work with
+        unsigned idx = (unsigned) (num % 100) * 2;
+        num /= 100;
+        *--s = decPairs[idx + 1];
+        *--s = decPairs[idx];
     }
-    char buf[25];
-    int bufPos = 0;
-    // Begin converting
-    do
+    unsigned long n = (unsigned long) num;
+    while (n >= 100)
     {
-        buf[bufPos] = ((char) (num % 10)) + '0';
-        num /= 10;
-        ++bufPos;
-    } while (num);
-    // So, we have a string, it's just backwards. Let's fix that
-    for (int i = 0, j = bufPos; j != 0; j--, i++)
-        s[i] = buf[j - 1];
-    return sign;
+        unsigned idx = (unsigned) (n % 100) * 2;
+        n /= 100;
+        *--s = decPairs[idx + 1];
+        *--s = decPairs[idx];
+    }
+    if (n >= 10)
+    {
+        *--s = decPairs[n * 2 + 1];
+        *--s = decPairs[n * 2];
+    }
+    else
+        *--s = (char) n + '0';
+    return s;
 }
 
-static void __fmtUnsignedNumToStr (char* s, uintmax_t num, int base, bool upperCase)
+// Converts num to a power of two base, writing backwards from end
+static char* __fmtPow2ToStr (char* end, uintmax_t num, int shift, bool upperCase)
 {
-    char obuf[25];
-    char* buf = obuf;
-    int bufPos = 0;
-    // Begin converting
+    const char* digits = (upperCase) ? upperDigits : lowerDigits;
+    unsigned mask = (1U << shift) - 1;
+    char* s = end;
     do
     {
-        char curNum = ((char) (num % base));
-        if (curNum >= 10)
-        {
-            // Convert to a letter
-            if (upperCase)
-                curNum += ('A' - 10);
-            else
-                curNum += ('a' - 10);
-        }
-        else
-            curNum += '0';
-        buf[bufPos] = curNum;
-        num /= base;
-        ++bufPos;
+        *--s = digits[num & mask];
+        num >>= shift;
     } while (num);
-    // So, we have a string, it's just backwards. Let's fix that
-    for (int i = 0, j = bufPos; j != 0; j--, i++)
-        s[i] = buf[j - 1];
+    return s;
+}
+
+static int __outString (_printfOut_t* out, const char* s, size_t len)
+{
+    if (!len)
+        return 0;
+    return out->out (out, s, len);
 }
 
-static int __outString (_printfOut_t* out, const char* s, size_t charsToPrint)
+// Writes count copies of c
+static int __outRepeat (_printfOut_t* out, char c, int count)
 {
-    while (*s && charsToPrint)
+    char buf[16];
+    memset (buf, c, sizeof (buf));
+    while (count > 0)
     {
-        if (out->out (out, *s) == EOF)
+        int len = (count > (int) sizeof (buf)) ? (int) sizeof (buf) : count;
+        if (out->out (out, buf, len) == EOF)
             return EOF;
-        ++s;
-        --charsToPrint;
+        count -= len;
     }
     return 0;
 }
@@ -183,177 +196,117 @@ static int __outString (_printfOut_t* out, const char* s, size_t charsToPrint)
 static int __printArg (_printfFmt_t* fmt, _printfOut_t* out)
 {
     const char* s = NULL;
-    char buf[64] = {0};
-    bool accountPrecision = false;
-    int precisionChars = 0;
-    int widthChars = 0;
-    int prefixChars = 0;
-    char fieldWidthChar = ' ';
-    bool sign = true;
-    size_t charsToPrint = SIZE_MAX;
+    size_t len = 0;
+    char buf[PRINTF_NUM_MAX];
+    char* bufEnd = buf + sizeof (buf);
+    const char* prefix = "";    // Sign or base prefix
+    bool isNum = true;
+    char c;
     // Figure out the conversion to do
     switch (fmt->conv)
     {
-        case PRINTF_CONV_DECIMAL:
-            //  Convert to signed value
-            sign = __fmtSignedNumToStr (buf, fmt->sdata);
-            s = buf;
-            accountPrecision = true;
-            if (fmt->sdata == 0 && fmt->precision == 0)
-                return 0;    // Special case in spec
-            // Add prefix characters
-            if (fmt->sdata <= 0 ||
-                ((fmt->flags & PRINTF_FLAG_ALWAYS_SIGN) == PRINTF_FLAG_ALWAYS_SIGN))
+        case PRINTF_CONV_DECIMAL: {
+            uintmax_t mag = (uintmax_t) fmt->sdata;
+            if (fmt->sdata < 0)
             {
-                ++prefixChars;
+                mag = -mag;
+                prefix = "-";
             }
-            goto numCommon;
+            else if (fmt->flags & PRINTF_FLAG_ALWAYS_SIGN)
+                prefix = "+";
+            else if (fmt->flags & PRINTF_FLAG_SPACE_SIGN)
+                prefix = " ";
+            s = __fmtDecToStr (bufEnd, mag);
+            break;
+        }
         case PRINTF_CONV_UNSIGNED:
-            __fmtUnsignedNumToStr (buf, fmt->udata, 10, false);
-            s = buf;
-            accountPrecision = true;
-            goto numCommon;
+            s = __fmtDecToStr (bufEnd, fmt->udata);
+            break;
         case PRINTF_CONV_HEX_LOWER:
-            __fmtUnsignedNumToStr (buf, fmt->udata, 16, false);
-            s = buf;
-            accountPrecision = true;
-            if ((fmt->flags & PRINTF_FLAG_PREFIX) == PRINTF_FLAG_PREFIX)
-                prefixChars += 2;
-            goto numCommon;
         case PRINTF_CONV_HEX_UPPER:
-            __fmtUnsignedNumToStr (buf, fmt->udata, 16, true);
-            s = buf;
-            accountPrecision = true;
-            if ((fmt->flags & PRINTF_FLAG_PREFIX) == PRINTF_FLAG_PREFIX)
-                prefixChars += 2;
-            goto numCommon;
+            s = __fmtPow2ToStr (bufEnd, fmt->udata, 4, fmt->conv == PRINTF_CONV_HEX_UPPER);
+            if ((fmt->flags & PRINTF_FLAG_PREFIX) && fmt->udata)
+                prefix = (fmt->conv == PRINTF_CONV_HEX_UPPER) ? "0X" : "0x";
+            break;
         case PRINTF_CONV_OCTAL:
-            __fmtUnsignedNumToStr (buf, fmt->udata, 8, false);
-            s = buf;
-            accountPrecision = true;
-            if ((fmt->flags & PRINTF_FLAG_PREFIX) == PRINTF_FLAG_PREFIX)
-                prefixChars++;
-            goto numCommon;
-        numCommon:
-            if ((fmt->flags & PRINTF_FLAG_0PAD) == PRINTF_FLAG_0PAD)
-                fieldWidthChar = '0';
-            if (fmt->conv != PRINTF_CONV_DECIMAL && fmt->udata == 0 && fmt->precision == 0)
-            {
-                return 0;    // Special case
-            }
+            s = __fmtPow2ToStr (bufEnd, fmt->udata, 3, false);
+            if (fmt->flags & PRINTF_FLAG_PREFIX)
+                prefix = "0";
             break;
         case PRINTF_CONV_PTR:
-            __fmtUnsignedNumToStr (buf, fmt->ptr, 16, true);
-            prefixChars = 2;
-            fmt->flags |= PRINTF_FLAG_PREFIX;
-            s = buf;
+            s = __fmtPow2ToStr (bufEnd, fmt->ptr, 4, true);
+            prefix = "0x";
             break;
         case PRINTF_CONV_CHAR:
-            out->out (out, (char) fmt->udata);
-            return 0;
+            c = (char) fmt->udata;
+            s = &c;
+            len = 1;
+            isNum = false;
+            break;
         case PRINTF_CONV_STRING:
             s = (const char*) fmt->ptr;
-            accountPrecision = true;
-
-            break;
-        case PRINTF_CONV_WRITTEN_CHARS:
+            // On strings, precision is the most characters to print
+            if (fmt->precisionIsDefault)
+                len = strlen (s);
+            else
+            {
+                const char* end = memchr (s, 0, fmt->precision);
+                len = (end) ? (size_t) (end - s) : (size_t) fmt->precision;
+            }
+            isNum = false;
             break;
         default:
             return 0;
     }
-    if (accountPrecision)
+    int precisionChars = 0;
+    char fieldWidthChar = ' ';
+    if (isNum)
     {
-        // On strings, precision is number of characters to print
-        if (fmt->conv == PRINTF_CONV_STRING)
-        {
-            size_t strLen = strlen (s);
-            charsToPrint = (strLen > fmt->precision) ? fmt->precision : strLen;
-            if (fmt->precisionIsDefault)
-            {
-                fmt->precision = charsToPrint;
-                charsToPrint = strLen;
-            }
-        }
-        // Figure out current number of characters
-        int curCharCount = (int) strlen (s);
-        precisionChars = fmt->precision - curCharCount;
+        len = bufEnd - s;
+        // A zero with no precision prints nothing
+        if (!fmt->precision && len == 1 && *s == '0')
+            len = 0;
+        if (fmt->conv == PRINTF_CONV_OCTAL && *prefix && len && *s == '0')
+            prefix = "";    // Already starts with a 0
+        // Precision is the least number of digits to print
+        precisionChars = fmt->precision - (int) len;
         if (precisionChars < 0)
-            precisionChars = 0;    // If negative, treat as zero
-    }
-    // Account for field width
-    if (fmt->width)
-    {
-        // Determine number of field with characters
-        int curCharCount = (int) strlen (s);
-        if (curCharCount > charsToPrint)
-            curCharCount = charsToPrint;
-        widthChars = fmt->width - (curCharCount + precisionChars);
-        if (widthChars < 0)
-            widthChars = 0;
-    }
-    // Write prefix (if any)
-    if ((fmt->flags & PRINTF_FLAG_PREFIX) == PRINTF_FLAG_PREFIX)
-    {
-        switch (fmt->conv)
+            precisionChars = 0;
+        // Zero padding goes away with a precision
+        if ((fmt->flags & PRINTF_FLAG_0PAD) && fmt->precisionIsDefault &&
+            !(fmt->flags & PRINTF_FLAG_LEFT_JUSTIFY))
         {
-            case PRINTF_CONV_HEX_LOWER:
-            case PRINTF_CONV_HEX_UPPER:
-            case PRINTF_CONV_PTR:
-                if (__outString (out, "0x", SIZE_MAX) == EOF)
-                    return EOF;
-                break;
-            case PRINTF_CONV_OCTAL:
-                if (out->out (out, '0') == EOF)
-                    return EOF;
-                break;
+            fieldWidthChar = '0';
         }
     }
-    // If being right justified, go ahead and write field width characters
-    if ((fmt->flags & PRINTF_FLAG_LEFT_JUSTIFY) != PRINTF_FLAG_LEFT_JUSTIFY)
-    {
-        for (int i = 0; i < widthChars; ++i)
-        {
-            if (out->out (out, fieldWidthChar) == EOF)
-                return EOF;
-        }
-    }
-    // Write sign
-    if (fmt->conv == PRINTF_CONV_DECIMAL)
+    size_t prefixLen = strlen (prefix);
+    // Account for field width
+    int widthChars = fmt->width - (int) (len + prefixLen + precisionChars);
+    if (widthChars < 0)
+        widthChars = 0;
+    // Right justification pads before the prefix with spaces, or after it with zeroes
+    if (!(fmt->flags & PRINTF_FLAG_LEFT_JUSTIFY) && fieldWidthChar == ' ')
     {
-        if (sign)
-        {
-            if ((fmt->flags & PRINTF_FLAG_ALWAYS_SIGN) == PRINTF_FLAG_ALWAYS_SIGN)
-            {
-                if (out->out (out, '+') == EOF)
-                    return EOF;
-            }
-        }
-        else
-        {
-            if (out->out (out, '-') == EOF)
-                return EOF;
-        }
+        if (__outRepeat (out, ' ', widthChars) == EOF)
+            return EOF;
     }
-    // Write precision characters
-    if (accountPrecision)
+    if (__outString (out, prefix, prefixLen) == EOF)
+        return EOF;
+    if (!(fmt->flags & PRINTF_FLAG_LEFT_JUSTIFY) && fieldWidthChar == '0')
     {
-        for (int i = 0; i < precisionChars; ++i)
-        {
-            if (out->out (out, '0') == EOF)
-                return EOF;
-        }
+        if (__outRepeat (out, '0', widthChars) == EOF)
+            return EOF;
     }
-    // Write actual string.
-    if (__outString (out, s, charsToPrint) == EOF)
+    if (__outRepeat (out, '0', precisionChars) == EOF)
+        return EOF;
+    // Write actual string
+    if (__outString (out, s, len) == EOF)
         return EOF;
     // If being left justified, now write out field width stuff
-    if ((fmt->flags & PRINTF_FLAG_LEFT_JUSTIFY) == PRINTF_FLAG_LEFT_JUSTIFY)
+    if (fmt->flags & PRINTF_FLAG_LEFT_JUSTIFY)
     {
-        for (int i = 0; i < widthChars; ++i)
-        {
-            if (out->out (out, fieldWidthChar) == EOF)
-                return EOF;
-        }
+        if (__outRepeat (out, ' ', widthChars) == EOF)
+            return EOF;
     }
     return 0;
 }
@@ -458,6 +411,12 @@ static int __parseFormat (_printfOut_t* outData, _printfFmt_t* fmtRes, const cha
     if (*fmt == '*')
     {
         fmtRes->width = (int) va_arg (*ap, int);
+        // A negative width means left justify
+        if (fmtRes->width < 0)
+        {
+            fmtRes->flags |= PRINTF_FLAG_LEFT_JUSTIFY;
+            fmtRes->width = -fmtRes->width;
+        }
         INC_FORMAT
     }
     // Check if it's a numeric field width
@@ -472,12 +431,18 @@ static int __parseFormat (_printfOut_t* outData, _printfFmt_t* fmtRes, const cha
         if (*fmt == '*')
         {
             fmtRes->precision = (int) va_arg (*ap, int);
+            // A negative precision is the same as none
+            if (fmtRes->precision < 0)
+            {
+                fmtRes->precision = 1;
+                fmtRes->precisionIsDefault = true;
+            }
             INC_FORMAT
         }
         else
         {
             // Convert to number, if there is a number
-            if (IS_DIGIT1TO9 (*fmt))
+            if (IS_DIGIT (*fmt))
                 fmtRes->precision = __fmtStrToNum (&fmt, &fmtOffset);
             else
                 fmtRes->precision = 0;    // If precision is blank, set it 0
@@ -578,37 +543,35 @@ int vprintfCore (_printfOut_t* outData, const char* fmt, va_list ap)
     va_copy (ap2, ap);
     while (*fmt)
     {
-        // Determine what the current character does
-        switch (*fmt)
+        // Write out everything up to the next conversion in one go
+        const char* next = strchr (fmt, '%');
+        size_t runLen = (next) ? (size_t) (next - fmt) : strlen (fmt);
+        if (__outString (outData, fmt, runLen) == EOF)
+            return EOF;
+        fmt += runLen;
+        if (!*fmt)
+            break;
+        // Figure out if the next character is another percent sign
+        if (fmt[1] == '%')
         {
-            case '%':
-                // Figure out if the next character is another percent sign
-                if (fmt[1] == '%')
-                {
-                    if (outData->out (outData, '%') == EOF)
-                        return EOF;
-                    fmt += 2;
-                    break;
-                }
-                ++fmt;
-                // Parse format string
-                _printfFmt_t fmtParse = {0};
-                fmtParse.precision = 1;    // Default precision
-                fmtParse.precisionIsDefault = true;
-                int fmtOffset = __parseFormat (outData, &fmtParse, fmt, &ap2);
-                if (fmtOffset == EOF)
-                    return EOF;
-                fmt += fmtOffset;
-                // Format and print the argument
-                if (__printArg (&fmtParse, outData) == EOF)
-                    return EOF;
-                break;
-            default:
-                if (outData->out (outData, *fmt) == EOF)
-                    return EOF;
-                ++fmt;
-                break;
+            if (outData->out (outData, "%", 1) == EOF)
+                return EOF;
+            fmt += 2;
+            continue;
         }
+        ++fmt;
+        // Parse format string
+        _printfFmt_t fmtParse = {0};
+        fmtParse.precision = 1;    // Default precision
+        fmtParse.precisionIsDefault = true;
+        int fmtOffset = __parseFormat (outData, &fmtParse, fmt, &ap2);
+        if (fmtOffset == EOF)
+            return EOF;
+        fmt += fmtOffset;
+        // Format and print the argument
+        if (__printArg (&fmtParse, outData) == EOF)
+            return EOF;
     }
+    va_end (ap2);
     return outData->charsPrinted;
 }
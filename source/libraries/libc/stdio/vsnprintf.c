@@ -17,15 +17,18 @@
 
 #include "printf_family.h"
 #include <stdio.h>
+#include <string.h>
 
-static int _printOut (_printfOut_t* outData, char c)
+static int _printOut (_printfOut_t* outData, const char* s, size_t len)
 {
-    // Ensure this won't overflow
-    if (outData->bufPos == outData->bufSize)
+    // Copy what fits, and stop if that wasn't everything
+    size_t left = outData->bufSize - outData->bufPos;
+    size_t copyLen = (len > left) ? left : len;
+    memcpy (outData->buf + outData->bufPos, s, copyLen);
+    outData->bufPos += copyLen;
+    outData->charsPrinted += copyLen;
+    if (copyLen != len)
         return EOF;
-    outData->buf[outData->bufPos] = c;
-    ++outData->bufPos;
-    ++outData->charsPrinted;
     return 0;
 }
 
@@ -35,11 +38,12 @@ int vsnprintf (char* restrict str, size_t n, const char* fmt, va_list ap)
     // Prepare output structures
     out.out = _printOut;
     out.buf = str;
-    out.bufSize = n;
+    out.bufSize = (n) ? n - 1 : 0;    // Leave room for the terminator
     out.bufPos = 0;
     out.charsPrinted = 0;
     int res = vprintfCore (&out, fmt, ap);
     // Null terminate
-    out.buf[out.bufPos] = 0;
+    if (n)
+        out.buf[out.bufPos] = 0;
     return res;
 }
@@ -0,0 +1,42 @@
+/*
+    memchr.c - contains memchr for libc
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "strword.h"
+#include <stdint.h>
+#include <string.h>
+
+void* memchr (const void* s, int ch, size_t n)
+{
+    const uint8_t* p = s;
+    uint8_t c = (uint8_t) ch;
+    for (; n && !STRWORD_ALIGNED (p); ++p, --n)
+    {
+        if (*p == c)
+            return (void*) p;
+    }
+    // XORing with c turns the bytes equal to c into zeroes
+    const strword_t* w = (const strword_t*) p;
+    strword_t rep = STRWORD_REPEAT (c);
+    for (; n >= STRWORD_SZ && !STRWORD_HASZERO (*w ^ rep); n -= STRWORD_SZ)
+        ++w;
+    for (p = (const uint8_t*) w; n; ++p, --n)
+    {
+        if (*p == c)
+            return (void*) p;
+    }
+    return NULL;
+}
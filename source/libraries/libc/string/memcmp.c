@@ -15,6 +15,7 @@
     limitations under the License.
 */
 
+#include "strword.h"
 #include <stdint.h>
 #include <string.h>
 
@@ -22,6 +23,25 @@ int memcmp (const void* s1, const void* s2, size_t n)
 {
     const uint8_t* _s1 = s1;
     const uint8_t* _s2 = s2;
+    if (STRWORD_COALIGNED (_s1, _s2))
+    {
+        for (; n && !STRWORD_ALIGNED (_s1); ++_s1, ++_s2, --n)
+        {
+            if (*_s1 != *_s2)
+                return *_s1 - *_s2;
+        }
+        // Skip over equal words. The bytes of the first unequal one get compared below
+        const strword_t* w1 = (const strword_t*) _s1;
+        const strword_t* w2 = (const strword_t*) _s2;
+        while (n >= STRWORD_SZ && *w1 == *w2)
+        {
+            ++w1;
+            ++w2;
+            n -= STRWORD_SZ;
+        }
+        _s1 = (const uint8_t*) w1;
+        _s2 = (const uint8_t*) w2;
+    }
     while (n && (*_s1 == *_s2))
     {
         ++_s1;
@@ -0,0 +1,64 @@
+/*
+    memmove.c - contains memmove for libc
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "strword.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+void* memmove (void* dest, const void* src, size_t n)
+{
+    const uint8_t* s = src;
+    uint8_t* d = dest;
+    bool words = STRWORD_COALIGNED (d, s);
+    // Copy backwards if the destination overlaps the end of the source
+    if ((uintptr_t) d - (uintptr_t) s < n)
+    {
+        s += n;
+        d += n;
+        if (words)
+        {
+            for (; n && !STRWORD_ALIGNED (d); --n)
+                *--d = *--s;
+            strword_t* dw = (strword_t*) d;
+            const strword_t* sw = (const strword_t*) s;
+            for (; n >= STRWORD_SZ; n -= STRWORD_SZ)
+                *--dw = *--sw;
+            d = (uint8_t*) dw;
+            s = (const uint8_t*) sw;
+        }
+        while (n--)
+            *--d = *--s;
+    }
+    else
+    {
+        if (words)
+        {
+            for (; n && !STRWORD_ALIGNED (d); --n)
+                *d++ = *s++;
+            strword_t* dw = (strword_t*) d;
+            const strword_t* sw = (const strword_t*) s;
+            for (; n >= STRWORD_SZ; n -= STRWORD_SZ)
+                *dw++ = *sw++;
+            d = (uint8_t*) dw;
+            s = (const uint8_t*) sw;
+        }
+        while (n--)
+            *d++ = *s++;
+    }
+    return dest;
+}
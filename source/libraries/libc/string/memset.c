@@ -15,13 +15,21 @@
     limitations under the License.
 */
 
+#include "strword.h"
 #include <stdint.h>
 #include <string.h>
 
 void* memset (void* str, int ch, size_t count)
 {
     uint8_t* s = str;
-    for (int i = 0; i < count; ++i)
-        s[i] = (unsigned char) ch;
+    for (; count && !STRWORD_ALIGNED (s); --count)
+        *s++ = (uint8_t) ch;
+    strword_t* w = (strword_t*) s;
+    strword_t val = STRWORD_REPEAT (ch);
+    for (; count >= STRWORD_SZ; count -= STRWORD_SZ)
+        *w++ = val;
+    s = (uint8_t*) w;
+    while (count--)
+        *s++ = (uint8_t) ch;
     return str;
 }
@@ -19,11 +19,6 @@
 
 char* strcat (char* restrict s1, const char* restrict s2)
 {
-    char* os = s1;
-    while (*s1)
-        ++s1;
-    while (*s2)
-        *s1++ = *s2++;
-    *s1 = 0;
-    return os;
+    strcpy (s1 + strlen (s1), s2);
+    return s1;
 }
@@ -0,0 +1,43 @@
+/*
+    strchr.c - contains strchr for libc
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "strword.h"
+#include <stdint.h>
+#include <string.h>
+
+char* strchr (const char* s, int ch)
+{
+    char c = (char) ch;
+    for (; !STRWORD_ALIGNED (s); ++s)
+    {
+        if (*s == c)
+            return (char*) s;
+        if (!*s)
+            return NULL;
+    }
+    // Stop at the word with either c or the terminator in it
+    const strword_t* w = (const strword_t*) s;
+    strword_t rep = STRWORD_REPEAT (c);
+    while (!STRWORD_HASZERO (*w) && !STRWORD_HASZERO (*w ^ rep))
+        ++w;
+    for (s = (const char*) w; *s != c; ++s)
+    {
+        if (!*s)
+            return NULL;
+    }
+    return (char*) s;
+}
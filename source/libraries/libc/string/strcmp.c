@@ -15,14 +15,34 @@
     limitations under the License.
 */
 
+#include "strword.h"
 #include <string.h>
 
 int strcmp (const char* s1, const char* s2)
 {
+    // Words can only be compared if both strings can be aligned at once
+    if (STRWORD_COALIGNED (s1, s2))
+    {
+        for (; !STRWORD_ALIGNED (s1); ++s1, ++s2)
+        {
+            if (*s1 != *s2 || !*s1)
+                return (unsigned char) *s1 - (unsigned char) *s2;
+        }
+        const strword_t* w1 = (const strword_t*) s1;
+        const strword_t* w2 = (const strword_t*) s2;
+        while (*w1 == *w2 && !STRWORD_HASZERO (*w1))
+        {
+            ++w1;
+            ++w2;
+        }
+        // Find where they differ or end in the last word
+        s1 = (const char*) w1;
+        s2 = (const char*) w2;
+    }
     while (*s1 == *s2 && *s1)
     {
         ++s1;
         ++s2;
     }
-    return *s1 - *s2;
+    return (unsigned char) *s1 - (unsigned char) *s2;
 }
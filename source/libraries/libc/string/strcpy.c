@@ -15,13 +15,28 @@
     limitations under the License.
 */
 
+#include "strword.h"
 #include <string.h>
 
 char* strcpy (char* restrict s1, const char* restrict s2)
 {
     char* os = s1;
-    while (*s2)
-        *s1++ = *s2++;
-    *s1 = 0;
+    if (STRWORD_COALIGNED (s1, s2))
+    {
+        for (; !STRWORD_ALIGNED (s2); ++s1, ++s2)
+        {
+            if (!(*s1 = *s2))
+                return os;
+        }
+        // Copy whole words until the one with the terminator
+        strword_t* w1 = (strword_t*) s1;
+        const strword_t* w2 = (const strword_t*) s2;
+        while (!STRWORD_HASZERO (*w2))
+            *w1++ = *w2++;
+        s1 = (char*) w1;
+        s2 = (const char*) w2;
+    }
+    while ((*s1++ = *s2++))
+        ;
     return os;
 }
@@ -15,15 +15,23 @@
     limitations under the License.
 */
 
+#include "strword.h"
 #include <string.h>
 
 size_t strlen (const char* s)
 {
-    size_t len = 0;
-    while (*s)
+    const char* start = s;
+    for (; !STRWORD_ALIGNED (s); ++s)
     {
-        ++s;
-        ++len;
+        if (!*s)
+            return s - start;
     }
-    return len;
+    const strword_t* w = (const strword_t*) s;
+    while (!STRWORD_HASZERO (*w))
+        ++w;
+    // Find the terminator in the last word
+    s = (const char*) w;
+    while (*s)
+        ++s;
+    return s - start;
 }
@@ -0,0 +1,48 @@
+/*
+    strword.h - contains word at a time helpers for string functions
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _STRWORD_H
+#define _STRWORD_H
+
+#include <stdint.h>
+
+// String functions go a word at a time where they can. An aligned word never crosses a page, so
+// reading the whole word a terminator is in is safe even if the bytes after it aren't ours
+
+// Word we work on. may_alias lets us read any object through it
+typedef uintptr_t __attribute__ ((may_alias)) strword_t;
+
+#define STRWORD_SZ   (sizeof (strword_t))
+#define STRWORD_MASK (STRWORD_SZ - 1)
+
+// 0x0101... and 0x8080...
+#define STRWORD_ONES  ((strword_t) -1 / 0xFF)
+#define STRWORD_HIGHS (STRWORD_ONES << 7)
+
+// Non-zero if a byte in w is zero
+#define STRWORD_HASZERO(w) (((w) - STRWORD_ONES) & ~(w) & STRWORD_HIGHS)
+
+// Word with every byte set to c
+#define STRWORD_REPEAT(c) (STRWORD_ONES * (uint8_t) (c))
+
+// Checks if p is word aligned
+#define STRWORD_ALIGNED(p) (!((uintptr_t) (p) & STRWORD_MASK))
+
+// Checks if p1 and p2 can be aligned together
+#define STRWORD_COALIGNED(p1, p2) (!(((uintptr_t) (p1) ^ (uintptr_t) (p2)) & STRWORD_MASK))
+
+#endif
@@ -36,7 +36,7 @@ static uint8_t idxShiftTab[] = {0, 12, 21, 30, 39, 48};
 #define PT_PG                  (1 << 1)
 #define PT_TAB                 (1 << 1)
 #define PT_RO                  (1 << 7)
-#define PT_XN                  ((1 << 54ULL) | (1 << 53ULL))
+#define PT_XN                  ((1ULL << 54) | (1ULL << 53))
 #define PT_AF                  (1 << 10)
 #define PT_ISH                 (3 << 8)
 #define PT_OSH                 (2 << 8)
@@ -161,6 +161,15 @@ bool NbCpuAsMap (uintptr_t virt, paddr_t phys, uint32_t flags)
         ptFlags &= ~(PT_RO);
     if (flags & NB_CPU_AS_WT)
         ptFlags |= (1 << 2);
+    if (flags & NB_CPU_AS_NX)
+        ptFlags |= PT_XN;
+    // Blocks stop a level early, and don't have the page bit
+    int lastLevel = 1;
+    if (flags & NB_CPU_AS_LARGE)
+    {
+        lastLevel = 2;
+        ptFlags &= ~(PT_PG);
+    }
     //  De-canonicalize the address
     pte_t* curSt = NULL;
     if (virt & (1ULL << 48))
@@ -173,13 +182,16 @@ bool NbCpuAsMap (uintptr_t virt, paddr_t phys, uint32_t flags)
         curSt = pgBase2;
     }
     // Loop through each level
-    for (int i = asMaxLevel; i > 1; --i)
+    for (int i = asMaxLevel; i > lastLevel; --i)
     {
         // Grab entry
         pte_t* ent = cpuAsGetEntry (curSt, virt, i);
         // Check if we need to map a table into it
         if (*ent)
         {
+            // Can't map a page inside a block
+            if (!(*ent & PT_TAB))
+                return false;
             // Get structure
             curSt = (pte_t*) PT_GETFRAME (*ent);
         }
@@ -191,7 +203,10 @@ bool NbCpuAsMap (uintptr_t virt, paddr_t phys, uint32_t flags)
         }
     }
     // Grab last PML entry
-    pte_t* lastEnt = cpuAsGetEntry (curSt, virt, 1);
+    pte_t* lastEnt = cpuAsGetEntry (curSt, virt, lastLevel);
+    // Don't throw away a table that's already here
+    if (lastLevel != 1 && *lastEnt)
+        return false;
     // Map it
     *lastEnt = phys | ptFlags;
     // Invalidate TLB
@@ -211,7 +226,14 @@ void NbCpuAsUnmap (uintptr_t virt)
         // Get entry
         pte_t* ent = cpuAsGetEntry (curSt, virt, i);
         if (!(*ent))
-            return;                             // Address not actually mapped
+            return;    // Address not actually mapped
+        if (!(*ent & PT_TAB))
+        {
+            // Block, take it all out
+            *ent = 0;
+            asm volatile ("dsb ishst; tlbi vaae1is, %0" : : "r"(ovirt >> 12));
+            return;
+        }
         curSt = (pte_t*) PT_GETFRAME (*ent);    // Get structure
     }
     // Grab last PML entry
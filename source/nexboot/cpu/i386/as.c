@@ -89,6 +89,9 @@ static pte_t* cpuAsAllocTab (uintptr_t virt, uint32_t flags)
 
 bool NbCpuAsMap (uintptr_t virt, paddr_t phys, uint32_t flags)
 {
+    // Large pages aren't supported here
+    if (flags & NB_CPU_AS_LARGE)
+        return false;
     // Translate flags to CPU dependent flags
     uint32_t ptFlags = PT_P;
     if (flags & NB_CPU_AS_RW)
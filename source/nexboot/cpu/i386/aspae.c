@@ -104,6 +104,9 @@ static pde_t* cpuAsAllocDir (uintptr_t virt)
 
 bool NbCpuAsMap (uintptr_t virt, paddr_t phys, uint32_t flags)
 {
+    // Large pages aren't supported here
+    if (flags & NB_CPU_AS_LARGE)
+        return false;
     // Translate flags to CPU dependent flags
     uint64_t ptFlags = PT_P;
     if (flags & NB_CPU_AS_RW)
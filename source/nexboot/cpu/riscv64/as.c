@@ -124,6 +124,9 @@ static inline pte_t* cpuAsAllocSt (pte_t* curSt, uintptr_t addr, int level)
 // Maps address into space
 bool NbCpuAsMap (uintptr_t virt, paddr_t phys, uint32_t flags)
 {
+    // Large pages aren't supported here
+    if (flags & NB_CPU_AS_LARGE)
+        return false;
     // Translate flags to CPU dependent flags
     uint64_t ptFlags = PT_P | PT_R | PT_X;
     if (flags & NB_CPU_AS_RW)
@@ -33,7 +33,9 @@ typedef uint64_t pmle_t;    // We use one type for all PMLs
 #define PT_P                   (1ULL << 0)
 #define PT_RW                  (1ULL << 1)
 #define PT_WT                  (1ULL << 3)
+#define PT_PS                  (1ULL << 7)
 #define PT_G                   (1ULL << 8)
+#define PT_NX                  (1ULL << 63)
 #define PT_FRAME               0x7FFFFFFFFFFFF000
 #define PT_GETFRAME(pt)        ((pt) & (PT_FRAME))
 #define PT_SETFRAME(pt, frame) ((pt) |= ((frame) & (PT_FRAME)))
@@ -86,6 +88,9 @@ static int asMaxLevel = 4;
 // Top level paging structure
 static pmle_t* pgBase = NULL;
 
+// NX bit, if firmware turned on EFER.NXE for us
+static pmle_t asNx = 0;
+
 void NbCpuAsInit()
 {
     // Read in CR3
@@ -106,6 +111,9 @@ void NbCpuAsInit()
     // write protect paging structures
     uint64_t cr0 = NbReadCr0();
     NbWriteCr0 (cr0 & ~(NB_CR0_WP));
+    // Without NXE the NX bit is reserved, so only use it if it's on
+    if (NbRdmsr (NB_EFER_MSR) & NB_EFER_NXE)
+        asNx = PT_NX;
 }
 
 // Gets paging entry as current level
@@ -135,36 +143,52 @@ bool NbCpuAsMap (uintptr_t virt, paddr_t phys, uint32_t flags)
         ptFlags |= PT_RW;
     if (flags & NB_CPU_AS_WT)
         ptFlags |= PT_WT;
+    // Tables never get NX, as that would apply to everything under them
+    uint64_t stFlags = ptFlags;
+    if (flags & NB_CPU_AS_NX)
+        ptFlags |= asNx;
     //  De-canonicalize the address
     virt = cpuAsDecanonical (virt);
+    // Large pages stop a level early
+    int lastLevel = (flags & NB_CPU_AS_LARGE) ? 2 : 1;
     // Loop through each level
     pmle_t* curSt = pgBase;
-    for (int i = asMaxLevel; i > 1; --i)
+    for (int i = asMaxLevel; i > lastLevel; --i)
     {
         // Grab entry
         pmle_t* ent = cpuAsGetEntry (curSt, virt, i);
         // Check if we need to map a table into it
         if (*ent)
         {
+            // Can't map a page inside a large page
+            if (*ent & PT_PS)
+                return false;
             // Check if flags need to be adjusted
-            if (((ptFlags & PT_RW) && !(*ent & PT_RW)))
+            if (((stFlags & PT_RW) && !(*ent & PT_RW)))
             {
                 // Adjust them
                 *ent &= PT_FRAME;
-                *ent |= (ptFlags & ~(PT_G) & ~(PT_WT));
+                *ent |= (stFlags & ~(PT_G) & ~(PT_WT));
             }
             // Get structure
             curSt = (pmle_t*) PT_GETFRAME (*ent);
         }
         else
         {
-            curSt = cpuAsAllocSt (curSt, virt, i, ptFlags);
+            curSt = cpuAsAllocSt (curSt, virt, i, stFlags);
             if (!curSt)
                 return false;
         }
     }
     // Grab last PML entryX
-    pmle_t* lastEnt = cpuAsGetEntry (curSt, virt, 1);
+    pmle_t* lastEnt = cpuAsGetEntry (curSt, virt, lastLevel);
+    if (lastLevel != 1)
+    {
+        // Don't throw away a table that's already here
+        if (*lastEnt)
+            return false;
+        ptFlags |= PT_PS;
+    }
     // Map it
     *lastEnt = phys | ptFlags;
     // Invalidate TLB
@@ -183,7 +207,14 @@ void NbCpuAsUnmap (uintptr_t virt)
         // Get entry
         pmle_t* ent = cpuAsGetEntry (curSt, virt, i);
         if (!(*ent))
-            return;                              // Address not actually mapped
+            return;    // Address not actually mapped
+        if (i == 2 && (*ent & PT_PS))
+        {
+            // Large page, take it all out
+            *ent = 0;
+            NbInvlpg (virt);
+            return;
+        }
         curSt = (pmle_t*) PT_GETFRAME (*ent);    // Get structure
     }
     // Grab last PML entry
@@ -108,6 +108,9 @@ typedef struct _dap
 #define BIOS_DISK_GET_TYPE   0x15
 #define BIOS_DISK_GET_PARAMS 0x08
 
+#define BIOS_DISK_MAX_LBA_COUNT 127    // Most sectors some BIOSes can read in one EDD call
+#define BIOS_DISK_RETRIES       3      // Times to try each sector before giving up
+
 // Error to string table
 const char* diskErrorStrs[] = {"No error",
                                "Invalid disk command",
@@ -159,61 +162,117 @@ static void diskReset (uint8_t disk)
     NbBiosCall (0x13, &in, &out);
 }
 
-// Reads a sector without using LBA extensions
-static uint8_t diskReadSector (uint8_t drive, NbBiosDisk_t* disk, void* buf, uint32_t sector)
+// Reads sectors without using LBA extensions
+// The sectors must all be on one track
+static uint8_t diskReadSectorsChs (NbBiosDisk_t* disk,
+                                   void* buf,
+                                   uint32_t sector,
+                                   int count,
+                                   int tries)
 {
     NbBiosRegs_t in = {0}, out = {0};
     // Convert LBA to CHS
     NbChsAddr_t chsAddr;
     lbaToChs (disk, &chsAddr, sector);
     in.ah = 0x02;
-    in.al = 1;
+    in.al = count;
     in.ch = (uint8_t) chsAddr.cylinder;
-    in.cl = chsAddr.sector | (chsAddr.cylinder & ~0x3F);
+    in.cl = chsAddr.sector | ((chsAddr.cylinder >> 2) & 0xC0);
     in.dh = chsAddr.head;
     in.dl = disk->biosNum;
-    in.es = NEXBOOT_BIOSBUF_BASE >> 4;
-    in.bx = NEXBOOT_BIOSBUF_BASE & 0xF;
-    // Try up to three times
+    in.es = NEXBOOT_BIOS_DISKBUF_BASE >> 4;
+    in.bx = NEXBOOT_BIOS_DISKBUF_BASE & 0xF;
     bool success = false;
-    for (int i = 0; i < 3; ++i)
+    for (int i = 0; i < tries; ++i)
     {
-
         NbBiosCall (0x13, &in, &out);
         if (!(out.flags & NEXBOOT_CPU_CARRY_FLAG))
         {
             success = true;
             break;
         }
+        if (i + 1 < tries)
+            diskReset (disk->biosNum);
     }
     if (!success)
         return out.ah;
     // Copy buffer
-    memcpy (buf, (void*) NEXBOOT_BIOSBUF_BASE, disk->sectorSz);
+    memcpy (buf, (void*) NEXBOOT_BIOS_DISKBUF_BASE, count * disk->sectorSz);
     return out.ah;
 }
 
-// Reads a sector using LBA extensions
-static uint8_t diskReadSectorLba (NbBiosDisk_t* disk, uint8_t biosNum, void* buf, uint32_t sector)
+// Reads sectors using LBA extensions
+static uint8_t diskReadSectorsLba (NbBiosDisk_t* disk,
+                                   uint8_t biosNum,
+                                   void* buf,
+                                   uint32_t sector,
+                                   int count,
+                                   int tries)
 {
     NbBiosRegs_t in = {0}, out = {0};
     NbBiosDap_t* dap = (NbBiosDap_t*) NEXBOOT_BIOSBUF2_BASE;
-    memset (dap, 0, sizeof (NbBiosDap_t));
-    dap->sz = 16;
-    dap->bufOffset = NEXBOOT_BIOSBUF_BASE;
-    dap->count = 1;
-    dap->sector = sector;
-    in.ah = 0x42;
-    in.dl = biosNum;
-    in.si = NEXBOOT_BIOSBUF2_BASE;
-    NbBiosCall (0x13, &in, &out);
-    if (out.flags & NEXBOOT_CPU_CARRY_FLAG)
+    bool success = false;
+    for (int i = 0; i < tries; ++i)
+    {
+        // The BIOS may have written back how many sectors it got, so fill it in every time
+        memset (dap, 0, sizeof (NbBiosDap_t));
+        dap->sz = 16;
+        dap->bufOffset = NEXBOOT_BIOS_DISKBUF_BASE & 0xF;
+        dap->bufSeg = NEXBOOT_BIOS_DISKBUF_BASE >> 4;
+        dap->count = count;
+        dap->sector = sector;
+        in.ah = 0x42;
+        in.dl = biosNum;
+        in.si = NEXBOOT_BIOSBUF2_BASE;
+        NbBiosCall (0x13, &in, &out);
+        if (!(out.flags & NEXBOOT_CPU_CARRY_FLAG))
+        {
+            success = true;
+            break;
+        }
+        if (i + 1 < tries)
+            diskReset (biosNum);
+    }
+    if (!success)
         return out.ah;
     // Copy buffer
-    memcpy (buf, (void*) NEXBOOT_BIOSBUF_BASE, disk->sectorSz);
+    memcpy (buf, (void*) NEXBOOT_BIOS_DISKBUF_BASE, count * disk->sectorSz);
     return out.ah;
 }
 
+// Reads a sector using LBA extensions
+static uint8_t diskReadSectorLba (NbBiosDisk_t* disk, uint8_t biosNum, void* buf, uint32_t sector)
+{
+    return diskReadSectorsLba (disk, biosNum, buf, sector, 1, 1);
+}
+
+// Gets how many sectors can be read in one call starting at sector
+static int diskGetRunLength (NbBiosDisk_t* disk, uint32_t sector, int left)
+{
+    int maxCount = NEXBOOT_BIOS_DISKBUF_SIZE / disk->sectorSz;
+    if (disk->flags & DISK_FLAG_LBA)
+    {
+        if (maxCount > BIOS_DISK_MAX_LBA_COUNT)
+            maxCount = BIOS_DISK_MAX_LBA_COUNT;
+    }
+    else
+    {
+        // CHS reads can't go past the end of the track
+        int trackLeft = disk->spt - (sector % disk->spt);
+        if (maxCount > trackLeft)
+            maxCount = trackLeft;
+    }
+    return (left < maxCount) ? left : maxCount;
+}
+
+// Reads a run of sectors in one call
+static uint8_t diskReadRun (NbBiosDisk_t* disk, void* buf, uint32_t sector, int count, int tries)
+{
+    if (disk->flags & DISK_FLAG_LBA)
+        return diskReadSectorsLba (disk, disk->biosNum, buf, sector, count, tries);
+    return diskReadSectorsChs (disk, buf, sector, count, tries);
+}
+
 // Checks for LBA extensions
 static bool diskCheckLba (NbBiosDisk_t* disk, uint8_t num)
 {
@@ -470,29 +529,33 @@ static bool BiosDiskReadSectors (void* obj, void* data)
     NbBiosDisk_t* biosDisk = disk->internal;
     NbReadSector_t* readInf = data;
     void* buf = readInf->buf;
-    for (int i = 0; i < readInf->count; ++i)
+    uint32_t sector = readInf->sector;
+    int left = readInf->count;
+    while (left)
     {
-        // Determine if we can use LBA
-        if (biosDisk->flags & DISK_FLAG_LBA)
-        {
-            int res = 0;
-            if ((res = diskReadSectorLba (biosDisk, biosDisk->biosNum, buf, readInf->sector)))
-            {
-                readInf->error = res;
-                return false;
-            }
-        }
-        else
+        // Read as many sectors as we can in one go. Only if that fails do we go back and retry
+        // each sector on its own, so one bad sector doesn't fail the whole run
+        int count = diskGetRunLength (biosDisk, sector, left);
+        if (diskReadRun (biosDisk, buf, sector, count, 1))
         {
-            // Use non-LBA function
-            int res = 0;
-            if ((res = diskReadSector (biosDisk->biosNum, biosDisk, buf, readInf->sector)))
+            diskReset (biosDisk->biosNum);
+            for (int i = 0; i < count; ++i)
             {
-                readInf->error = res;
-                return false;
+                int res = 0;
+                if ((res = diskReadRun (biosDisk,
+                                        buf + (i * disk->sectorSz),
+                                        sector + i,
+                                        1,
+                                        BIOS_DISK_RETRIES)))
+                {
+                    readInf->error = res;
+                    return false;
+                }
             }
         }
-        buf += disk->sectorSz;
+        buf += count * disk->sectorSz;
+        sector += count;
+        left -= count;
     }
     readInf->error = DISK_ERROR_NOERROR;
     return true;
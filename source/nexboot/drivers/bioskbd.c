@@ -77,20 +77,14 @@ static bool BiosNotify (void* objp, void* params)
 const char* keyToEscCode[] =
     {"\e[5~", "\e[6~", "\e[A", "\e[C", "\e[B", "\e[3~", "\e[H", "\e[D", "\e[F"};
 
-static bool BiosReadKey (void* objp, void* params)
+// Converts what the BIOS returned for a key
+static void biosParseKey (NbBiosRegs_t* out, NbKeyData_t* keyData)
 {
-    NbObject_t* obj = objp;
-    NbKeyData_t* keyData = params;
     keyData->isBreak = false;
     keyData->flags = 0;
-    // Call interrupt to wait for key
-    NbBiosRegs_t in = {0}, out = {0};
-    in.ah = 0;
-    NbBiosCall (0x16, &in, &out);
-    // Parse information
-    if (out.al)
+    if (out->al)
     {
-        keyData->c = out.al;
+        keyData->c = out->al;
         if (keyData->c == '\r')
             keyData->c = '\n';
     }
@@ -98,30 +92,51 @@ static bool BiosReadKey (void* objp, void* params)
     {
         keyData->isEscCode = true;
         // Parse special keys
-        if (out.ah == 0x53)
+        if (out->ah == 0x53)
             keyData->c = NB_KEY_DELETE;
-        else if (out.ah == 0x4F)
+        else if (out->ah == 0x4F)
             keyData->c = NB_KEY_END;
-        else if (out.ah == 0x4B)
+        else if (out->ah == 0x4B)
             keyData->c = NB_KEY_LEFT;
-        else if (out.ah == 0x47)
+        else if (out->ah == 0x47)
             keyData->c = NB_KEY_HOME;
-        else if (out.ah == 0x50)
+        else if (out->ah == 0x50)
             keyData->c = NB_KEY_DOWN;
-        else if (out.ah == 0x4D)
+        else if (out->ah == 0x4D)
             keyData->c = NB_KEY_RIGHT;
-        else if (out.ah == 0x48)
+        else if (out->ah == 0x48)
             keyData->c = NB_KEY_UP;
-        else if (out.ah == 0x51)
+        else if (out->ah == 0x51)
             keyData->c = NB_KEY_PGDN;
-        else if (out.ah == 0x49)
+        else if (out->ah == 0x49)
             keyData->c = NB_KEY_PGUP;
         keyData->escCode = keyToEscCode[keyData->c - 0xF1];
     }
+}
+
+static bool BiosReadKey (void* objp, void* params)
+{
+    // Call interrupt to wait for key
+    NbBiosRegs_t in = {0}, out = {0};
+    in.ah = 0;
+    NbBiosCall (0x16, &in, &out);
+    biosParseKey (&out, params);
     return true;
 }
 
-static NbObjSvc biosKbdSvcs[] = {NULL, NULL, NULL, BiosDumpData, BiosNotify, BiosReadKey};
+static bool BiosPollKey (void* objp, void* params)
+{
+    // Check for a key first, as reading it waits
+    NbBiosRegs_t in = {0}, out = {0};
+    in.ah = 1;
+    NbBiosCall (0x16, &in, &out);
+    if (out.flags & NEXBOOT_CPU_ZERO_FLAG)
+        return false;
+    return BiosReadKey (objp, params);
+}
+
+static NbObjSvc biosKbdSvcs[] =
+    {NULL, NULL, NULL, BiosDumpData, BiosNotify, BiosReadKey, NULL, NULL, BiosPollKey};
 
 NbObjSvcTab_t biosKbdSvcTab = {ARRAY_SIZE (biosKbdSvcs), biosKbdSvcs};
 
@@ -29,14 +29,56 @@
 extern NbObjSvcTab_t efiDiskSvcTab;
 extern NbDriver_t efiDiskDrv;
 
+// Block I/O 2 protocol. Not every copy of the EFI headers has it, so it's defined here
+#define NB_EFI_BLOCK_IO2_GUID                                                         \
+    {                                                                                 \
+        0xA77B2472, 0xE282, 0x4E9F, { 0xA2, 0x45, 0xC2, 0xC0, 0xE2, 0x7B, 0xBC, 0xC1 } \
+    }
+
+typedef struct _efiblockio2token
+{
+    EFI_EVENT event;           // Signaled when transfer is done
+    EFI_STATUS transStatus;    // Status of transfer
+} NbEfiBlockIo2Token_t;
+
+typedef struct _efiblockio2
+{
+    EFI_BLOCK_IO_MEDIA* Media;
+    EFI_STATUS (EFIAPI* Reset) (struct _efiblockio2* This, BOOLEAN ExtendedVerification);
+    EFI_STATUS (EFIAPI* ReadBlocksEx) (struct _efiblockio2* This,
+                                       UINT32 MediaId,
+                                       EFI_LBA Lba,
+                                       NbEfiBlockIo2Token_t* Token,
+                                       UINTN BufferSize,
+                                       VOID* Buffer);
+    void* WriteBlocksEx;
+    void* FlushBlocksEx;
+} NbEfiBlockIo2_t;
+
+// Every disk's first sectors are read when the driver starts, all queued at once on block I/O 2,
+// so that the disks work on them at the same time. Partition tables are then read out of these
+// instead of going to each disk in turn
+#define EFI_DISK_PROBE_SZ (64 * 1024)    // Bytes read from the start of each disk
+
+typedef struct _efidiskprobe
+{
+    EFI_PHYSICAL_ADDRESS buf;      // Data read, 0 if nothing was queued
+    uint64_t count;                // Sectors read
+    NbEfiBlockIo2Token_t token;    // Token of read
+    bool done;                     // Whether read was waited on
+    bool ok;                       // Whether read worked
+} NbEfiDiskProbe_t;
+
 // Disk structure
 typedef struct _efidisk
 {
     NbDiskInfo_t disk;              // General info about disk
     EFI_HANDLE diskHandle;          // Disk handle
     EFI_BLOCK_IO_PROTOCOL* prot;    // Disk protocol
+    NbEfiBlockIo2_t* prot2;         // Asynchronous disk protocol, if there is one
     EFI_DEVICE_PATH* device;        // Device path of disk device
     uint32_t mediaId;               // Media ID at detection time
+    NbEfiDiskProbe_t* probe;        // Read of start of disk, if there is one
 } NbEfiDisk_t;
 
 // List of disk handles
@@ -49,9 +91,88 @@ static int curHandle = 0;
 static int diskNum = 0;
 // Disk protocol GUID
 static EFI_GUID blockIoGuid = EFI_BLOCK_IO_PROTOCOL_GUID;
-// Temporary aligned buffer
+static EFI_GUID blockIo2Guid = NB_EFI_BLOCK_IO2_GUID;
+// Temporary aligned buffer, for callers whose buffers the controller can't read into
 static void* tempBuf = NULL;
 
+#define EFI_DISK_TEMPBUF_SZ (64 * 1024)
+
+// Large aligned reads on disks with block I/O 2 are split into requests that are all queued at
+// once, so controllers that can work on several at a time aren't left waiting on us
+#define EFI_DISK_MAX_REQS 4                // Requests queued at once
+#define EFI_DISK_REQ_SZ   (1024 * 1024)    // Most bytes in a request
+
+// Tokens of queued requests. Events are made once, NULL if they couldn't be
+static NbEfiBlockIo2Token_t reqTokens[EFI_DISK_MAX_REQS] = {0};
+static bool reqsUsable = false;
+
+// Probes of each handle, NULL if there are none
+static NbEfiDiskProbe_t* probes = NULL;
+
+// Waits for a queued request to finish
+static EFI_STATUS efiDiskWaitReq (NbEfiBlockIo2Token_t* token)
+{
+    while (BS->CheckEvent (token->event) == EFI_NOT_READY)
+        ;
+    return token->transStatus;
+}
+
+// Queues a read of the start of the disk on handle
+static void efiDiskStartProbe (NbEfiDiskProbe_t* probe, EFI_HANDLE handle)
+{
+    EFI_BLOCK_IO_PROTOCOL* prot = NbEfiOpenProtocol (handle, &blockIoGuid);
+    if (!prot || prot->Media->LogicalPartition || !prot->Media->MediaPresent ||
+        prot->Media->BlockSize > 4096)
+    {
+        return;
+    }
+    NbEfiBlockIo2_t* prot2 = NbEfiOpenProtocol (handle, &blockIo2Guid);
+    if (!prot2)
+        return;
+    uint64_t count = EFI_DISK_PROBE_SZ / prot->Media->BlockSize;
+    if (count > (prot->Media->LastBlock + 1))
+        count = prot->Media->LastBlock + 1;
+    if (BS->AllocatePages (AllocateAnyPages,
+                           EfiLoaderData,
+                           EFI_DISK_PROBE_SZ / NEXBOOT_CPU_PAGE_SIZE,
+                           &probe->buf) != EFI_SUCCESS)
+    {
+        probe->buf = 0;
+        return;
+    }
+    if (BS->CreateEvent (0, 0, NULL, NULL, &probe->token.event) != EFI_SUCCESS)
+        goto fail;
+    probe->token.transStatus = EFI_NOT_READY;
+    if (prot2->ReadBlocksEx (prot2,
+                             prot->Media->MediaId,
+                             0,
+                             &probe->token,
+                             count * prot->Media->BlockSize,
+                             (void*) (uintptr_t) probe->buf) != EFI_SUCCESS)
+    {
+        BS->CloseEvent (probe->token.event);
+        goto fail;
+    }
+    probe->count = count;
+    return;
+fail:
+    BS->FreePages (probe->buf, EFI_DISK_PROBE_SZ / NEXBOOT_CPU_PAGE_SIZE);
+    probe->buf = 0;
+}
+
+// Waits for a probe to finish and frees it
+static void efiDiskEndProbe (NbEfiDiskProbe_t* probe)
+{
+    if (!probe->buf)
+        return;
+    // The controller may still be writing to the buffer
+    if (!probe->done)
+        efiDiskWaitReq (&probe->token);
+    BS->CloseEvent (probe->token.event);
+    BS->FreePages (probe->buf, EFI_DISK_PROBE_SZ / NEXBOOT_CPU_PAGE_SIZE);
+    probe->buf = 0;
+}
+
 // Driver entry
 static bool EfiDiskEntry (int code, void* params)
 {
@@ -67,8 +188,27 @@ static bool EfiDiskEntry (int code, void* params)
             }
             else
             {
-                tempBuf = (void*) NbFwAllocPages ((64 * 1024) / NEXBOOT_CPU_PAGE_SIZE);
+                tempBuf = (void*) NbFwAllocPages (EFI_DISK_TEMPBUF_SZ / NEXBOOT_CPU_PAGE_SIZE);
                 assert (tempBuf);
+                // Create request events
+                reqsUsable = true;
+                for (int i = 0; i < EFI_DISK_MAX_REQS; ++i)
+                {
+                    if (BS->CreateEvent (0, 0, NULL, NULL, &reqTokens[i].event) != EFI_SUCCESS)
+                    {
+                        reqsUsable = false;
+                        break;
+                    }
+                }
+                // Start reading every disk
+                if (reqsUsable)
+                    probes = NbEfiAllocPool (numHandles * sizeof (NbEfiDiskProbe_t));
+                if (probes)
+                {
+                    memset (probes, 0, numHandles * sizeof (NbEfiDiskProbe_t));
+                    for (int i = 0; i < numHandles; ++i)
+                        efiDiskStartProbe (&probes[i], diskHandles[i]);
+                }
             }
             break;
         case NB_DRIVER_ENTRY_DETECTHW: {
@@ -79,6 +219,13 @@ static bool EfiDiskEntry (int code, void* params)
                 // Check if we've alread exahusted all handles
                 if (curHandle == numHandles)
                 {
+                    if (probes)
+                    {
+                        for (int i = 0; i < numHandles; ++i)
+                            efiDiskEndProbe (&probes[i]);
+                        NbEfiFreePool (probes);
+                        probes = NULL;
+                    }
                     NbEfiFreePool (diskHandles);
                     return false;
                 }
@@ -124,7 +271,13 @@ static bool EfiDiskEntry (int code, void* params)
                               diskNum);
                 return false;
             }
+            disk->prot2 = NULL;
+            if (reqsUsable)
+                disk->prot2 = NbEfiOpenProtocol (diskHandles[curHandle], &blockIo2Guid);
             disk->mediaId = disk->prot->Media->MediaId;
+            disk->probe = NULL;
+            if (probes && probes[curHandle].buf)
+                disk->probe = &probes[curHandle];
             disk->disk.sectorSz = disk->prot->Media->BlockSize;
             disk->disk.size = (disk->prot->Media->LastBlock + 1) * disk->disk.sectorSz;
             // Figure out type
@@ -190,6 +343,13 @@ static bool EfiDiskEntry (int code, void* params)
             NbDriver_t* volMgr = NbFindDriver ("VolManager");
             assert (volMgr);
             NbSendDriverCode (volMgr, VOLUME_ADD_DISK, obj);
+            // Partition table has been read, so the probe isn't needed anymore
+            NbEfiDisk_t* disk = NbObjGetData (obj);
+            if (disk->probe)
+            {
+                efiDiskEndProbe (disk->probe);
+                disk->probe = NULL;
+            }
             break;
         }
     }
@@ -235,22 +395,110 @@ static bool EfiDiskReportError (void* objp, void* params)
     return true;
 }
 
+// Reads sectors with requests queued on block I/O 2
+static bool efiDiskReadQueued (NbEfiDisk_t* disk, uint64_t sector, int count, uint8_t* buf)
+{
+    int reqCount = EFI_DISK_REQ_SZ / disk->disk.sectorSz;
+    int numReqs = 0;    // Requests that have been queued
+    int numDone = 0;    // Requests that have been waited on
+    bool res = true;
+    while (count && res)
+    {
+        // Wait for the oldest request if all the tokens are taken
+        if (numReqs - numDone == EFI_DISK_MAX_REQS)
+        {
+            if (efiDiskWaitReq (&reqTokens[numDone % EFI_DISK_MAX_REQS]) != EFI_SUCCESS)
+                res = false;
+            ++numDone;
+            continue;
+        }
+        int curCount = (count < reqCount) ? count : reqCount;
+        NbEfiBlockIo2Token_t* token = &reqTokens[numReqs % EFI_DISK_MAX_REQS];
+        token->transStatus = EFI_NOT_READY;
+        if (disk->prot2->ReadBlocksEx (disk->prot2,
+                                       disk->mediaId,
+                                       sector,
+                                       token,
+                                       curCount * disk->disk.sectorSz,
+                                       buf) != EFI_SUCCESS)
+        {
+            res = false;
+            break;
+        }
+        ++numReqs;
+        buf += curCount * disk->disk.sectorSz;
+        sector += curCount;
+        count -= curCount;
+    }
+    // Everything queued has to finish before the buffer goes back to the caller
+    while (numDone < numReqs)
+    {
+        if (efiDiskWaitReq (&reqTokens[numDone % EFI_DISK_MAX_REQS]) != EFI_SUCCESS)
+            res = false;
+        ++numDone;
+    }
+    return res;
+}
+
 static bool EfiDiskReadSectors (void* objp, void* params)
 {
     NbObject_t* obj = objp;
     NbEfiDisk_t* disk = NbObjGetData (obj);
     NbReadSector_t* sect = params;
     EFI_STATUS status;
-    if ((status = disk->prot->ReadBlocks (disk->prot,
-                                          disk->mediaId,
-                                          sect->sector,
-                                          sect->count * disk->disk.sectorSz,
-                                          tempBuf)) != EFI_SUCCESS)
+    // Reads of the start of the disk come out of the probe
+    NbEfiDiskProbe_t* probe = disk->probe;
+    if (probe && (sect->sector + sect->count) <= probe->count)
     {
-        return false;
+        if (!probe->done)
+        {
+            probe->ok = efiDiskWaitReq (&probe->token) == EFI_SUCCESS;
+            probe->done = true;
+        }
+        if (probe->ok)
+        {
+            memcpy (sect->buf,
+                    (void*) (uintptr_t) (probe->buf + (sect->sector * disk->disk.sectorSz)),
+                    sect->count * disk->disk.sectorSz);
+            return true;
+        }
+    }
+    // If the buffer meets the controller's alignment, read straight into it
+    uint32_t ioAlign = disk->prot->Media->IoAlign;
+    if (ioAlign <= 1 || !((uintptr_t) sect->buf & (ioAlign - 1)))
+    {
+        // Small reads gain nothing from being queued
+        if (disk->prot2 && sect->count * disk->disk.sectorSz > EFI_DISK_REQ_SZ)
+            return efiDiskReadQueued (disk, sect->sector, sect->count, sect->buf);
+        status = disk->prot->ReadBlocks (disk->prot,
+                                         disk->mediaId,
+                                         sect->sector,
+                                         sect->count * disk->disk.sectorSz,
+                                         sect->buf);
+        return status == EFI_SUCCESS;
+    }
+    // Otherwise go through the aligned buffer, as much as fits at a time
+    int maxCount = EFI_DISK_TEMPBUF_SZ / disk->disk.sectorSz;
+    uint8_t* buf = sect->buf;
+    uint64_t sector = sect->sector;
+    int left = sect->count;
+    while (left)
+    {
+        int count = (left < maxCount) ? left : maxCount;
+        if ((status = disk->prot->ReadBlocks (disk->prot,
+                                              disk->mediaId,
+                                              sector,
+                                              count * disk->disk.sectorSz,
+                                              tempBuf)) != EFI_SUCCESS)
+        {
+            return false;
+        }
+        // Copy data from aligned buffer to dest buffer
+        memcpy (buf, tempBuf, count * disk->disk.sectorSz);
+        buf += count * disk->disk.sectorSz;
+        sector += count;
+        left -= count;
     }
-    // Copy data from aligned buffer to dest buffer
-    memcpy (sect->buf, tempBuf, sect->count * disk->disk.sectorSz);
     return true;
 }
 
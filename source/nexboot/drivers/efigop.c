@@ -33,6 +33,7 @@ typedef struct _gopdisplay
     NbDisplayDev_t display;
     EFI_HANDLE gopHandle;
     EFI_GRAPHICS_OUTPUT_PROTOCOL* prot;
+    bool useBlt;    // Whether back buffer can be pushed with Blt
 } NbGopDisplay_t;
 
 // GOP handles list
@@ -127,6 +128,8 @@ static bool gopSetupDisplay (NbGopDisplay_t* display,
     display->display.bytesPerPx = 4;
     display->display.bytesPerLine = info->PixelsPerScanLine * display->display.bytesPerPx;
     display->display.lfbSize = display->display.bytesPerLine * display->display.height;
+    // GOP has no way to move the display start
+    display->display.hwScroll = false;
     // Set masks
     if (info->PixelFormat == PixelBitMask)
     {
@@ -168,6 +171,14 @@ static bool gopSetupDisplay (NbGopDisplay_t* display,
     display->display.backBuffer = (void*) NbFwAllocPages (
         (display->display.lfbSize + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE);
     display->display.backBufferLoc = display->display.backBuffer;
+    // Blt takes pixels as blue, green, red, reserved bytes, so it can only push the back buffer
+    // straight to the screen if the back buffer has the same layout
+    display->useBlt = display->prot->Blt && display->display.redMask.mask == 0xFF &&
+                      display->display.redMask.maskShift == 16 &&
+                      display->display.greenMask.mask == 0xFF &&
+                      display->display.greenMask.maskShift == 8 &&
+                      display->display.blueMask.mask == 0xFF &&
+                      display->display.blueMask.maskShift == 0;
     return true;
 }
 
@@ -287,10 +298,46 @@ static bool EfiGopNotify (void* objp, void* params)
     return true;
 }
 
+// Pushes a region of the back buffer to the screen with Blt
+// The back buffer is a ring starting at backBufferLoc, so this takes at most two Blts
+static bool gopBltRegion (NbGopDisplay_t* gop, NbInvalidRegion_t* region)
+{
+    NbDisplayDev_t* display = &gop->display;
+    int srcY = ((display->backBufferLoc - display->backBuffer) / display->bytesPerLine) +
+               region->startY;
+    if (srcY >= display->height)
+        srcY -= display->height;
+    int destY = region->startY;
+    int height = region->height;
+    while (height)
+    {
+        int bltHeight = height;
+        if (srcY + bltHeight > display->height)
+            bltHeight = display->height - srcY;
+        EFI_STATUS status = gop->prot->Blt (gop->prot,
+                                            display->backBuffer,
+                                            EfiBltBufferToVideo,
+                                            region->startX,
+                                            srcY,
+                                            region->startX,
+                                            destY,
+                                            region->width,
+                                            bltHeight,
+                                            display->bytesPerLine);
+        if (EFI_ERROR (status))
+            return false;
+        height -= bltHeight;
+        destY += bltHeight;
+        srcY = 0;
+    }
+    return true;
+}
+
 static bool EfiGopInvalidate (void* objp, void* params)
 {
     NbObject_t* obj = objp;
-    NbDisplayDev_t* display = NbObjGetData (obj);
+    NbGopDisplay_t* gop = NbObjGetData (obj);
+    NbDisplayDev_t* display = &gop->display;
     NbInvalidRegion_t* region = params;
     // Validate input
     // Check to ensure startX + width is not greater than line size
@@ -299,11 +346,21 @@ static bool EfiGopInvalidate (void* objp, void* params)
     // Ensure region is bounded within display
     if ((region->startY + region->height) > display->height)
         return false;
+    if (!region->width || !region->height)
+        return true;
+    // Let firmware copy it if it can, it knows the fastest way to write video memory
+    if (gop->useBlt && gopBltRegion (gop, region))
+        return true;
+    // Round out to even pixels, so lines can be copied in 8 byte stores. Copying a bit more of
+    // the back buffer doesn't hurt, and video memory is never read
+    int startX = region->startX & ~1;
+    int endX = (region->startX + region->width + 1) & ~1;
+    if (endX > display->width)
+        endX = display->width;
     // Compute initial location in region
-    size_t startLoc =
-        (region->startY * display->bytesPerLine) + (region->startX * display->bytesPerPx);
+    size_t startLoc = (region->startY * display->bytesPerLine) + (startX * display->bytesPerPx);
     int bytesPerPx = display->bytesPerPx;
-    size_t regionWidth = bytesPerPx * region->width;
+    size_t regionWidth = bytesPerPx * (endX - startX);
     size_t off = 0;
     // Compute back-buffer specific things
     void* backBufEnd = display->backBuffer + (display->height * display->bytesPerLine);
@@ -110,20 +110,10 @@ static uint8_t efiScanToKey[] = {0,
 const char* keyToEscCode[] =
     {"\e[5~", "\e[6~", "\e[A", "\e[C", "\e[B", "\e[3~", "\e[H", "\e[D", "\e[F"};
 
-static bool EfiKbdReadKey (void* objp, void* params)
+// Converts a key from firmware, returning false if it's one we don't know
+static bool efiKbdParseKey (EFI_INPUT_KEY* key, NbKeyData_t* keyData)
 {
-    NbObject_t* kbdObj = objp;
-    NbKeyData_t* keyData = params;
-    NbEfiKbdDev_t* dev = NbObjGetData (kbdObj);
-    // Wait for a key
-read:
-    UINTN idx = 0;
-    BS->WaitForEvent (1, &dev->prot->WaitForKey, &idx);
-    // Read it
-    EFI_INPUT_KEY key = {0};
-    dev->prot->ReadKeyStroke (dev->prot, &key);
-    // Put in NbKeyData
-    keyData->c = (uint8_t) key.UnicodeChar;
+    keyData->c = (uint8_t) key->UnicodeChar;
     keyData->isBreak = false;
     keyData->flags = 0;
     if (keyData->c == '\r')
@@ -132,16 +122,47 @@ read:
     if (!keyData->c)
     {
         keyData->isEscCode = true;
-        uint8_t keyScan = efiScanToKey[key.ScanCode];
+        uint8_t keyScan = efiScanToKey[key->ScanCode];
         if (!keyScan)
-            goto read;    // Re-read
+            return false;
         keyData->c = keyScan;
         keyData->escCode = keyToEscCode[keyScan - 0xF1];
     }
     return true;
 }
 
+static bool EfiKbdReadKey (void* objp, void* params)
+{
+    NbObject_t* kbdObj = objp;
+    NbEfiKbdDev_t* dev = NbObjGetData (kbdObj);
+    EFI_INPUT_KEY key = {0};
+    do
+    {
+        // Wait for a key
+        UINTN idx = 0;
+        BS->WaitForEvent (1, &dev->prot->WaitForKey, &idx);
+        // Read it
+        dev->prot->ReadKeyStroke (dev->prot, &key);
+    } while (!efiKbdParseKey (&key, params));
+    return true;
+}
+
+static bool EfiKbdPollKey (void* objp, void* params)
+{
+    NbObject_t* kbdObj = objp;
+    NbEfiKbdDev_t* dev = NbObjGetData (kbdObj);
+    // Reading a key doesn't wait, it fails if there isn't one
+    EFI_INPUT_KEY key = {0};
+    while (!EFI_ERROR (dev->prot->ReadKeyStroke (dev->prot, &key)))
+    {
+        if (efiKbdParseKey (&key, params))
+            return true;
+    }
+    return false;
+}
+
 // Data structures
-NbObjSvc efiKbdSvcs[] = {NULL, NULL, NULL, EfiKbdDumpData, EfiKbdNotify, EfiKbdReadKey};
+NbObjSvc efiKbdSvcs[] =
+    {NULL, NULL, NULL, EfiKbdDumpData, EfiKbdNotify, EfiKbdReadKey, NULL, NULL, EfiKbdPollKey};
 NbObjSvcTab_t efiKbdSvcTab = {ARRAY_SIZE (efiKbdSvcs), efiKbdSvcs};
 NbDriver_t efiKbdDrv = {"EfiKbd", EfiKbdEntry, {0}, 0, false, sizeof (NbEfiKbdDev_t)};
@@ -38,6 +38,19 @@ typedef struct _fbConsLine
     struct _fbConsLine* next;    // Pointer to next one
 } NbFbConsLine_t;
 
+// Glyph cache entry
+// Holds a glyph already drawn out in the display's pixel format and a color pair, so drawing a
+// character is just copying its rows into the back buffer
+#define FBCONS_GLYPH_CACHE_SIZE 128    // Must be a power of 2
+
+typedef struct _fbConsGlyph
+{
+    bool valid;
+    uint16_t glyphIdx;          // Glyph in font
+    uint32_t fg, bg;            // Colors in display's format
+    uint8_t rows[16][8 * 4];    // Pixel rows
+} NbFbConsGlyph_t;
+
 // fbconsole structure
 typedef struct _fbconsole
 {
@@ -57,6 +70,7 @@ typedef struct _fbconsole
     int lastCol;
     NbFbConsLine_t* lineList;    // List of line used for scrolling
     NbFbConsLine_t* lineListEnd;
+    NbFbConsGlyph_t* glyphCache;    // Cache of drawn glyphs
 } NbFbCons_t;
 
 static NbFbCons_t* consoles[32] = {0};
@@ -94,6 +108,9 @@ static bool FbConsDrvEntry (int code, void* params)
             NbFbCons_t* cons = (NbFbCons_t*) calloc (1, sizeof (NbFbCons_t));
             if (!cons || !consObj)
                 return false;
+            cons->glyphCache = calloc (FBCONS_GLYPH_CACHE_SIZE, sizeof (NbFbConsGlyph_t));
+            if (!cons->glyphCache)
+                return false;
             consoles[curCons] = cons;
             ++curCons;
             cons->display = NbObjRef (display);
@@ -138,6 +155,8 @@ static bool FbConsDrvEntry (int code, void* params)
             // Get display size
             cons->cols = displaySt->width / cons->charWidth;
             cons->rows = displaySt->height / cons->charHeight;
+            // Pixel format may have changed, so drawn glyphs are no good
+            memset (cons->glyphCache, 0, FBCONS_GLYPH_CACHE_SIZE * sizeof (NbFbConsGlyph_t));
             // Notify terminal
             NbObjNotify_t notify;
             notify.code = NB_TERMINAL_NOTIFY_RESIZE;
@@ -237,6 +256,37 @@ static void fbMoveCursor (NbFbCons_t* console, int col, int row)
     console->cursorY = cursorY;
 }
 
+// Gets glyph glyphIdx drawn in fg and bg
+static NbFbConsGlyph_t* fbGetGlyph (NbFbCons_t* console,
+                                    NbDisplayDev_t* display,
+                                    uint16_t glyphIdx,
+                                    uint32_t fg,
+                                    uint32_t bg)
+{
+    NbFbConsGlyph_t* ent =
+        &console->glyphCache[(glyphIdx + fg + bg) & (FBCONS_GLYPH_CACHE_SIZE - 1)];
+    if (ent->valid && ent->glyphIdx == glyphIdx && ent->fg == fg && ent->bg == bg)
+        return ent;
+    // Draw it out from the font
+    uint8_t* glyph = console->font + (glyphIdx * console->fontCharSz);
+    for (int y = 0; y < console->charHeight; ++y)
+    {
+        for (int x = 0; x < console->charWidth; ++x)
+        {
+            uint32_t color = (glyph[y] & (0x80 >> x)) ? fg : bg;
+            if (display->bytesPerPx == 2)
+                ((uint16_t*) ent->rows[y])[x] = color;
+            else if (display->bytesPerPx == 4)
+                ((uint32_t*) ent->rows[y])[x] = color;
+        }
+    }
+    ent->glyphIdx = glyphIdx;
+    ent->fg = fg;
+    ent->bg = bg;
+    ent->valid = true;
+    return ent;
+}
+
 static bool FbObjDumpData (void* objp, void* params)
 {
     NbObject_t* obj = objp;
@@ -288,52 +338,41 @@ static bool FbObjClearScreen (void* objp, void* params)
     return true;
 }
 
-static bool FbObjPutChar (void* objp, void* params)
+// Gets a console color in the display's pixel format
+static uint32_t fbGetPxColor (NbDisplayDev_t* display, int color)
 {
-    NbObject_t* obj = objp;
-    NbPrintChar_t* pc = params;
-    NbFbCons_t* console = NbObjGetData (obj);
-    NbDisplayDev_t* display = NbObjGetData (console->display);
-    // Get color info
-    uint32_t pxColor = 0;
+    uint8_t r = 0, g = 0, b = 0;
     if (display->bpp == 32)
     {
-        uint32_t pxColorTmp = colorTab32[console->fgColor];
-        uint8_t r, g, b;
+        uint32_t pxColorTmp = colorTab32[color];
         DISPLAY_DECOMPOSE_RGB (pxColorTmp, r, g, b);
-        pxColor = DISPLAY_COMPOSE_RGB (display, r, g, b);
     }
     else if (display->bpp == 16)
     {
-        uint16_t pxColorTmp = colorTab16[console->fgColor];
-        uint8_t r, g, b;
+        uint16_t pxColorTmp = colorTab16[color];
         DISPLAY_DECOMPOSE_RGB16 (pxColorTmp, r, g, b);
-        pxColor = DISPLAY_COMPOSE_RGB (display, r, g, b);
-    }
-    uint32_t bgPxColor = 0;
-    if (display->bpp == 32)
-    {
-        uint32_t pxColorTmp = colorTab32[console->bgColor];
-        uint8_t r, g, b;
-        DISPLAY_DECOMPOSE_RGB (pxColorTmp, r, g, b);
-        bgPxColor = DISPLAY_COMPOSE_RGB (display, r, g, b);
-    }
-    else if (display->bpp == 16)
-    {
-        uint16_t pxColorTmp = colorTab16[console->bgColor];
-        uint8_t r, g, b;
-        DISPLAY_DECOMPOSE_RGB16 (pxColorTmp, r, g, b);
-        bgPxColor = DISPLAY_COMPOSE_RGB (display, r, g, b);
     }
+    else
+        return 0;
+    return DISPLAY_COMPOSE_RGB (display, r, g, b);
+}
+
+// Draws a character into the back buffer, without invalidating it
+static void fbDrawChar (NbFbCons_t* console,
+                        NbDisplayDev_t* display,
+                        char c,
+                        int col,
+                        int row,
+                        uint32_t pxColor,
+                        uint32_t bgPxColor)
+{
     // Compute glyph
     bool found;
-    uint16_t glyphIdx = fb_font_glyph (pc->c, &found);
-    // Grab character from font table
-    uint8_t* glyph = console->font + (glyphIdx * console->fontCharSz);
-    uint32_t glyphRowSz = (console->charWidth + 7) / 8;
+    uint16_t glyphIdx = fb_font_glyph (c, &found);
+    NbFbConsGlyph_t* glyph = fbGetGlyph (console, display, glyphIdx, pxColor, bgPxColor);
     // Compute base offset to character
-    uint32_t offset = (pc->row * console->charHeight * display->bytesPerLine) +
-                      (pc->col * console->charWidth * display->bytesPerPx);
+    uint32_t offset = (row * console->charHeight * display->bytesPerLine) +
+                      (col * console->charWidth * display->bytesPerPx);
     // Get base of buffer
     void* buf = display->backBufferLoc + offset;
     void* bufEnd = display->backBuffer + display->lfbSize;
@@ -343,45 +382,33 @@ static bool FbObjPutChar (void* objp, void* params)
         uint32_t diff = buf - bufEnd;
         buf = display->backBuffer + diff;
     }
-    // Display pixels
-    uint32_t mask = 1 << console->charWidth;
+    // Copy in the rows. The back buffer only wraps between lines, so each row is contiguous
+    size_t rowSz = console->charWidth * display->bytesPerPx;
     for (int y = 0; y < console->charHeight; ++y)
     {
-        void* lineBuf = buf;
-        uint32_t omask = mask;
-        for (int x = 0; x < (console->charWidth + 1); ++x)
-        {
-            if (display->bytesPerPx == 2)
-            {
-                if ((*glyph) & omask)
-                    DISPLAY_PLOT_16BPP (display, lineBuf, pxColor, 0, 0);
-                else
-                    DISPLAY_PLOT_16BPP (display, lineBuf, bgPxColor, 0, 0);
-                lineBuf += 2;
-            }
-            else if (display->bytesPerPx == 4)
-            {
-                if ((*glyph) & omask)
-                    DISPLAY_PLOT_32BPP (display, lineBuf, pxColor, 0, 0);
-                else
-                    DISPLAY_PLOT_32BPP (display, lineBuf, bgPxColor, 0, 0);
-                lineBuf += 4;
-            }
-            omask >>= 1;    // Wrap if needed
-            if (lineBuf >= bufEnd)
-            {
-                uint32_t diff = lineBuf - bufEnd;
-                lineBuf = display->backBuffer + diff;
-            }
-        }
+        memcpy (buf, glyph->rows[y], rowSz);
         buf += display->bytesPerLine;
         if (buf >= bufEnd)
         {
             uint32_t diff = buf - bufEnd;
             buf = display->backBuffer + diff;
         }
-        glyph += glyphRowSz;
     }
+}
+
+static bool FbObjPutChar (void* objp, void* params)
+{
+    NbObject_t* obj = objp;
+    NbPrintChar_t* pc = params;
+    NbFbCons_t* console = NbObjGetData (obj);
+    NbDisplayDev_t* display = NbObjGetData (console->display);
+    fbDrawChar (console,
+                display,
+                pc->c,
+                pc->col,
+                pc->row,
+                fbGetPxColor (display, console->fgColor),
+                fbGetPxColor (display, console->bgColor));
     // Invalidate region
     NbInvalidRegion_t region;
     region.height = console->charHeight;
@@ -397,6 +424,31 @@ static bool FbObjPutChar (void* objp, void* params)
     return true;
 }
 
+// Draws a run of characters, invalidating them and moving the cursor once
+static bool FbObjPutSpan (void* objp, void* params)
+{
+    NbObject_t* obj = objp;
+    NbPrintSpan_t* span = params;
+    NbFbCons_t* console = NbObjGetData (obj);
+    NbDisplayDev_t* display = NbObjGetData (console->display);
+    if (!span->len)
+        return true;
+    uint32_t pxColor = fbGetPxColor (display, console->fgColor);
+    uint32_t bgPxColor = fbGetPxColor (display, console->bgColor);
+    for (int i = 0; i < span->len; ++i)
+        fbDrawChar (console, display, span->s[i], span->col + i, span->row, pxColor, bgPxColor);
+    NbInvalidRegion_t region;
+    region.height = console->charHeight;
+    region.width = console->charWidth * span->len;
+    region.startY = span->row * console->charHeight;
+    region.startX = span->col * console->charWidth;
+    NbObjCallSvc (console->display, NB_DISPLAY_INVALIDATE, &region);
+    fbMoveCursor (console, span->col + span->len, span->row);
+    console->lastRow = span->row;
+    console->lastCol = span->col + span->len - 1;
+    return true;
+}
+
 static bool FbObjDisableCursor (void* objp, void* params)
 {
     NbObject_t* obj = objp;
@@ -463,13 +515,16 @@ static bool FbObjScroll (void* objp, void* params)
     // Increment current back buffer base
     for (int i = 0; i < console->charHeight; ++i)
         NbObjCallSvc (console->display, NB_DISPLAY_INCRENDER, NULL);
-    // Invalidate
-    NbInvalidRegion_t scrollRegion;
-    scrollRegion.startX = 0;
-    scrollRegion.startY = 0;
-    scrollRegion.width = dev->width;
-    scrollRegion.height = (console->rows - 1) * console->charHeight;
-    NbObjCallSvc (console->display, NB_DISPLAY_INVALIDATE, &scrollRegion);
+    // Invalidate, unless the display scrolls by itself
+    if (!dev->hwScroll)
+    {
+        NbInvalidRegion_t scrollRegion;
+        scrollRegion.startX = 0;
+        scrollRegion.startY = 0;
+        scrollRegion.width = dev->width;
+        scrollRegion.height = (console->rows - 1) * console->charHeight;
+        NbObjCallSvc (console->display, NB_DISPLAY_INVALIDATE, &scrollRegion);
+    }
     // Clear last line
     NbDisplayDev_t* display = NbObjGetData (console->display);
     void* lastLineBuf = display->backBufferLoc +
@@ -481,15 +536,18 @@ static bool FbObjScroll (void* objp, void* params)
         uint32_t diff = lastLineBuf - bufEnd;
         lastLineBuf = display->backBuffer + diff;
     }
-    for (int y = 0; y < console->charHeight; ++y)
+    // Fill in the first pixel row, and copy it down to the rest
+    void* firstRow = lastLineBuf;
+    for (int x = 0; x < display->width; ++x)
+    {
+        if (display->bpp == 32)
+            DISPLAY_PLOT_32BPP (display, firstRow, colorTab32[console->bgColor], x, 0);
+        if (display->bpp == 16)
+            DISPLAY_PLOT_16BPP (display, firstRow, colorTab16[console->bgColor], x, 0);
+    }
+    size_t rowSz = display->width * display->bytesPerPx;
+    for (int y = 1; y < console->charHeight; ++y)
     {
-        for (int x = 0; x < display->width; ++x)
-        {
-            if (display->bpp == 32)
-                DISPLAY_PLOT_32BPP (display, lastLineBuf, colorTab32[console->bgColor], x, 0);
-            if (display->bpp == 16)
-                DISPLAY_PLOT_16BPP (display, lastLineBuf, colorTab16[console->bgColor], x, 0);
-        }
         lastLineBuf += display->bytesPerLine;
         // Wrap if needed
         if (lastLineBuf >= bufEnd)
@@ -497,6 +555,7 @@ static bool FbObjScroll (void* objp, void* params)
             uint32_t diff = lastLineBuf - bufEnd;
             lastLineBuf = display->backBuffer + diff;
         }
+        memcpy (lastLineBuf, firstRow, rowSz);
     }
     NbInvalidRegion_t region;
     region.startX = 0;
@@ -539,7 +598,8 @@ static NbObjSvc fbConsSvcs[] = {NULL,
                                 FbObjSetBgColor,
                                 FbObjScroll,
                                 FbObjMoveCursor,
-                                FbObjGetSize};
+                                FbObjGetSize,
+                                FbObjPutSpan};
 
 NbObjSvcTab_t fbConsSvcTab = {.numSvcs = ARRAY_SIZE (fbConsSvcs), .svcTab = fbConsSvcs};
 NbDriver_t fbConsDrv = {.deps = {0},
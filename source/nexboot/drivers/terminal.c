@@ -802,12 +802,59 @@ static bool TerminalReadChar (void* objp, void* params)
     return true;
 }
 
+// Checks if a character just gets printed, rather than moving the cursor or starting an escape
+static bool terminalIsPlain (uint8_t c)
+{
+    return c && c != '\n' && c != '\r' && c != '\t' && c != '\b' && c != '\e';
+}
+
+// Prints the run of plain characters at the start of s as one span
+// Returns number of characters printed, 0 if the console can't print spans
+static int terminalWriteSpan (NbTerminal_t* term, const char* s)
+{
+    // Spans can't wrap, so stop at the end of the row
+    int len = 0;
+    int maxLen = term->numCols - term->col;
+    while (len < maxLen && terminalIsPlain (s[len]))
+        ++len;
+    if (!len)
+        return 0;
+    NbPrintSpan_t span;
+    span.col = term->col;
+    span.row = term->row;
+    span.s = s;
+    span.len = len;
+    if (!NbObjCallSvc (term->outEnd, NB_CONSOLE_PRINTSPAN, &span))
+        return 0;
+    term->col += len;
+    if (term->col >= term->numCols)
+    {
+        // Wrap to next line
+        term->col = 0;
+        ++term->row;
+    }
+    terminalScroll (term);
+    terminalMoveCursor (term);
+    return len;
+}
+
 static bool TerminalWrite (void* objp, void* params)
 {
     NbObject_t* obj = objp;
+    NbTerminal_t* term = obj->data;
     const char* s = params;
     while (*s)
     {
+        // Print runs of plain characters as spans, so the console is called once for the run
+        if (!term->escState && term->outEnd && term->outEnd->interface == OBJ_INTERFACE_CONSOLE)
+        {
+            int len = terminalWriteSpan (term, s);
+            if (len)
+            {
+                s += len;
+                continue;
+            }
+        }
         if (!terminalWriteChar (obj, *s))
             return false;
         ++s;
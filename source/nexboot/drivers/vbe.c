@@ -123,6 +123,7 @@ typedef struct _vbeModeInfo
 #define VBE_GET_CTRL 0
 #define VBE_GET_MODE 1
 #define VBE_SET_MODE 2
+#define VBE_SET_START 7
 #define VBE_DDC_FUNC 0x15
 #define VBE_DDC_EDID 1
 
@@ -138,6 +139,12 @@ static uint16_t* modes = NULL;
 // backbuffer size
 static uint32_t backSize = 0;
 
+// Size of video memory
+static uint32_t vramSize = 0;
+
+// Scanline display currently starts on
+static int startLine = 0;
+
 // VBE BIOS helpers
 
 // Gets VBE controller information
@@ -194,6 +201,24 @@ static bool vbeSetMode (uint16_t mode)
     return true;
 }
 
+// Sets first scanline to display
+static bool vbeSetStart (int line)
+{
+    NbBiosRegs_t in = {0}, out = {0};
+    in.ah = 0x4F;
+    in.al = VBE_SET_START;
+    in.bx = 0;
+    in.cx = 0;
+    in.dx = line;
+    NbBiosCall (0x10, &in, &out);
+    if (out.al != VBE_SUPPORTED)
+        return false;
+    if (out.ah != VBE_SUCCESS)
+        return false;
+    startLine = line;
+    return true;
+}
+
 // Gets EDID info
 static bool vbeGetEdid (NbEdid_t* edid)
 {
@@ -233,11 +258,10 @@ static void vbeGetPreferredRes (int* width, int* height)
     }
 }
 
-// Maps frame buffer
-static void vbeMapBuffer (NbDisplayDev_t* display, void* buf)
+// Maps size bytes of frame buffer
+static void vbeMapBuffer (void* buf, size_t size)
 {
-    size_t lfbSize = display->bytesPerLine * display->height;
-    size_t lfbPages = (lfbSize + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
+    size_t lfbPages = (size + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
     for (int i = 0; i < lfbPages; ++i)
     {
         NbCpuAsMap ((uintptr_t) buf + (i * NEXBOOT_CPU_PAGE_SIZE),
@@ -306,21 +330,29 @@ static void vbeSetupDisplay (NbDisplayDev_t* display, VbeModeInfo_t* modeInfo, u
             display->blueMask.maskShift = 0;
         }
     }
-    // Map the framebuffer
-    vbeMapBuffer (display, display->frontBuffer);
-    // Map back buffer. We put it at the end of nexboot
-    display->backBuffer = (void*) NEXBOOT_BIOS_BACKBUF;
-    display->backBufferLoc = display->backBuffer;
-    vbeMapBuffer (display, display->backBuffer);
     // Set size
     size_t lfbSize = display->bytesPerLine * display->height;
     display->lfbSize = lfbSize;
     backSize = lfbSize;
     // Set VBE mode
     vbeSetMode (modeNum);
+    // If video memory holds the screen twice, each line of the back buffer gets drawn at both
+    // its place and a screen below it. Any screen's worth of lines starting in the first half
+    // is then the back buffer from backBufferLoc on, so scrolling just moves the display start
+    // Make sure the card takes the furthest start we'd give it
+    display->hwScroll = vramSize >= (lfbSize * 2) && vbeSetStart (display->height - 1);
+    if (display->hwScroll)
+        vbeSetStart (0);
+    size_t frontSize = (display->hwScroll) ? (lfbSize * 2) : lfbSize;
+    // Map the framebuffer
+    vbeMapBuffer (display->frontBuffer, frontSize);
+    // Map back buffer. We put it at the end of nexboot
+    display->backBuffer = (void*) NEXBOOT_BIOS_BACKBUF;
+    display->backBufferLoc = display->backBuffer;
+    vbeMapBuffer (display->backBuffer, lfbSize);
     // Clear buffers
     memset (display->backBuffer, 0, lfbSize);
-    memset (display->frontBuffer, 0, lfbSize);
+    memset (display->frontBuffer, 0, frontSize);
 }
 
 // Querys availibilty of specified mode
@@ -424,6 +456,7 @@ static bool VbeDrvEntry (int code, void* params)
                 vbeVer = 2;
             else if (block.version == VBE3_VERSION)
                 vbeVer = 3;
+            vramSize = block.numBlocks * 0x10000;
             // Copy modes array
             uint16_t* rmModes = (uint16_t*) ((block.vidModeSeg * 0x10) + block.vidModeOff);
             // Get size
@@ -523,11 +556,26 @@ static bool VbeObjInvalidate (void* objp, void* params)
             backBuf = display->backBuffer + diff;
         }
         // Copy width number of pixels
-        memcpy (front, backBuf, regionWidth);
+        if (display->hwScroll)
+        {
+            // Lines go where they are in the back buffer, and a screen below that
+            front = display->frontBuffer + (backBuf - display->backBuffer);
+            memcpy (front, backBuf, regionWidth);
+            memcpy (front + display->lfbSize, backBuf, regionWidth);
+        }
+        else
+            memcpy (front, backBuf, regionWidth);
         // Move to next line
         front += display->bytesPerLine;
         backBuf += display->bytesPerLine;
     }
+    // Catch the display start up with any scrolling
+    if (display->hwScroll)
+    {
+        int line = (display->backBufferLoc - display->backBuffer) / display->bytesPerLine;
+        if (line != startLine)
+            vbeSetStart (line);
+    }
     return true;
 }
 
@@ -543,11 +591,11 @@ static bool VbeObjSetMode (void* objp, void* params)
         return false;
     // Unmap current buffers
     size_t lfbPages = (display->lfbSize + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
-    for (int i = 0; i < lfbPages; ++i)
-    {
+    size_t frontPages = (display->hwScroll) ? (lfbPages * 2) : lfbPages;
+    for (int i = 0; i < frontPages; ++i)
         NbCpuAsUnmap ((uintptr_t) display->frontBuffer + (i * NEXBOOT_CPU_PAGE_SIZE));
+    for (int i = 0; i < lfbPages; ++i)
         NbCpuAsUnmap ((uintptr_t) display->backBuffer + (i * NEXBOOT_CPU_PAGE_SIZE));
-    }
     // Set mode
     vbeSetupDisplay (display, &modeInfo, modeNum);
     // Notify owner
@@ -574,6 +622,11 @@ static bool VbeObjSetRender (void* objp, void* params)
 
 static bool VbeObjUnmapFb (void* objp, void* params)
 {
+    NbObject_t* obj = objp;
+    NbDisplayDev_t* display = NbObjGetData (obj);
+    // Put the display start back at the front buffer's base
+    if (display->hwScroll && startLine)
+        vbeSetStart (0);
     return true;
 }
 
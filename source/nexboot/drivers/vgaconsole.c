@@ -169,6 +169,25 @@ static bool VgaPutChar (void* objp, void* data)
     return true;
 }
 
+static bool VgaPutSpan (void* objp, void* data)
+{
+    assert (data);
+    NbPrintSpan_t* span = data;
+    NbObject_t* obj = objp;
+    NbVgaConsole_t* console = obj->data;
+    for (int i = 0; i < span->len; ++i)
+    {
+        vgaWriteChar (console,
+                      span->s[i],
+                      console->bgColor,
+                      console->fgColor,
+                      span->col + i,
+                      span->row);
+    }
+    vgaMoveCursor (console, span->col + span->len, span->row);
+    return true;
+}
+
 static bool VgaDisableCursor (void* objp, void* unused)
 {
     NbOutb (VGA_CRTC_INDEX, VGA_CRTC_INDEX_CURSOR_START);
@@ -257,7 +276,8 @@ static NbObjSvc vgaServices[] = {VgaObjInit,
                                  VgaSetBgColor,
                                  VgaScrollDown,
                                  VgaMoveCursor,
-                                 VgaGetSize};
+                                 VgaGetSize,
+                                 VgaPutSpan};
 
 NbObjSvcTab_t vgaSvcTab = {ARRAY_SIZE (vgaServices), vgaServices};
 
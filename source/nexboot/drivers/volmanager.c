@@ -45,6 +45,9 @@ extern NbDriver_t volManagerDrv;
 #define MBR_FS_EXT2        0x83
 #define MBR_GPT_PART       0xEE
 
+// Biggest partition entry array we will read
+#define GPT_MAX_ARRAY_SZ (1024 * 1024)
+
 // MBR partition
 typedef struct _mbrPart
 {
@@ -115,6 +118,38 @@ static uint8_t bbpGuid[] = {0x48, 0x61, 0x68, 0x21, 0x49, 0x64, 0x6f, 0x6e,
 // ISO9660 stuff
 #define ISO9660_VOLUME_DESC_START 0x10
 
+// Block cache
+// The same metadata sectors get read over and over while the menu, config, and kernel are
+// loaded, so sectors read from disks are kept around. Entries are found by disk and sector
+// through a hash table, and the least recently used ones are thrown out once the cache is full
+// It gets a share of free memory, capped on BIOS, where the heap is small
+#define VOL_CACHE_HASH_SZ 256       // Buckets in hash table, must be a power of 2
+#define VOL_CACHE_SHARE   1024      // Cache gets a byte for this many bytes of free memory
+#define VOL_CACHE_MIN     0x8000    // Smallest cache
+#ifdef NEXNIX_FW_BIOS
+#define VOL_CACHE_MAX 0x20000
+#else
+#define VOL_CACHE_MAX 0x400000
+#endif
+
+// Cached sector
+typedef struct _volcacheent
+{
+    NbObject_t* disk;                 // Disk it's from
+    uint64_t sector;                  // Sector on disk
+    uint32_t sz;                      // Size of data
+    struct _volcacheent* hashNext;    // Next entry in bucket
+    struct _volcacheent* lruNext;     // Next less recently used entry
+    struct _volcacheent* lruPrev;     // Next more recently used entry
+    uint8_t data[];
+} volCacheEnt_t;
+
+static volCacheEnt_t* volCacheHash[VOL_CACHE_HASH_SZ] = {0};
+static volCacheEnt_t* volCacheMru = NULL;    // Most recently used entry
+static volCacheEnt_t* volCacheLru = NULL;    // Least recently used entry
+static size_t volCacheMax = 0;               // Bytes cache may use, 0 if not set up
+static size_t volCacheUsed = 0;              // Bytes cache is using
+
 static int curDisk = 0;    // Current disk being initialized
 static int curPart = 0;    // Current partition being initialized
 
@@ -162,6 +197,137 @@ static void addVolume (NbVolume_t* vol)
     }
 }
 
+// Sizes the block cache from free memory
+static void volCacheInit()
+{
+    int mapSz = 0;
+    NbMemEntry_t* memMap = NbGetMemMap (&mapSz);
+    uint64_t freeMem = 0;
+    for (int i = 0; i < mapSz; ++i)
+    {
+        if (memMap[i].type == NEXBOOT_MEM_FREE)
+            freeMem += memMap[i].sz;
+    }
+    volCacheMax = freeMem / VOL_CACHE_SHARE;
+    if (volCacheMax < VOL_CACHE_MIN)
+        volCacheMax = VOL_CACHE_MIN;
+    else if (volCacheMax > VOL_CACHE_MAX)
+        volCacheMax = VOL_CACHE_MAX;
+}
+
+// Gets bucket of sector
+static volCacheEnt_t** volCacheBucket (NbObject_t* disk, uint64_t sector)
+{
+    return &volCacheHash[(((uintptr_t) disk >> 4) ^ sector) & (VOL_CACHE_HASH_SZ - 1)];
+}
+
+// Takes entry off LRU list
+static void volCacheUnlink (volCacheEnt_t* ent)
+{
+    if (ent->lruPrev)
+        ent->lruPrev->lruNext = ent->lruNext;
+    else
+        volCacheMru = ent->lruNext;
+    if (ent->lruNext)
+        ent->lruNext->lruPrev = ent->lruPrev;
+    else
+        volCacheLru = ent->lruPrev;
+}
+
+// Puts entry at the front of LRU list
+static void volCacheLinkMru (volCacheEnt_t* ent)
+{
+    ent->lruPrev = NULL;
+    ent->lruNext = volCacheMru;
+    if (volCacheMru)
+        volCacheMru->lruPrev = ent;
+    else
+        volCacheLru = ent;
+    volCacheMru = ent;
+}
+
+// Finds a sector in the cache, marking it as just used
+static volCacheEnt_t* volCacheFind (NbObject_t* disk, uint64_t sector)
+{
+    volCacheEnt_t* ent = *volCacheBucket (disk, sector);
+    while (ent && (ent->disk != disk || ent->sector != sector))
+        ent = ent->hashNext;
+    if (ent && ent != volCacheMru)
+    {
+        volCacheUnlink (ent);
+        volCacheLinkMru (ent);
+    }
+    return ent;
+}
+
+// Throws out the least recently used entry
+static void volCacheEvict()
+{
+    volCacheEnt_t* ent = volCacheLru;
+    volCacheUnlink (ent);
+    volCacheEnt_t** prev = volCacheBucket (ent->disk, ent->sector);
+    while (*prev != ent)
+        prev = &(*prev)->hashNext;
+    *prev = ent->hashNext;
+    volCacheUsed -= ent->sz;
+    free (ent);
+}
+
+// Adds a sector to the cache
+static void volCacheInsert (NbObject_t* disk, uint64_t sector, void* data, uint32_t sz)
+{
+    if (sz > volCacheMax)
+        return;
+    while (volCacheLru && (volCacheUsed + sz) > volCacheMax)
+        volCacheEvict();
+    volCacheEnt_t* ent = malloc (sizeof (volCacheEnt_t) + sz);
+    if (!ent)
+        return;    // Caching is only an optimization
+    ent->disk = disk;
+    ent->sector = sector;
+    ent->sz = sz;
+    memcpy (ent->data, data, sz);
+    volCacheEnt_t** bucket = volCacheBucket (disk, sector);
+    ent->hashNext = *bucket;
+    *bucket = ent;
+    volCacheLinkMru (ent);
+    volCacheUsed += sz;
+}
+
+// Reads sectors from a disk through the block cache
+static bool volCacheRead (NbObject_t* diskObj, NbReadSector_t* block)
+{
+    NbDiskInfo_t* disk = NbObjGetData (diskObj);
+    if (!volCacheMax)
+        volCacheInit();
+    // Copy out everything we have up to the first sector we don't
+    uint8_t* buf = block->buf;
+    int i = 0;
+    for (; i < block->count; ++i)
+    {
+        volCacheEnt_t* ent = volCacheFind (diskObj, block->sector + i);
+        if (!ent)
+            break;
+        memcpy (buf + (i * disk->sectorSz), ent->data, disk->sectorSz);
+    }
+    block->error = 0;
+    if (i == block->count)
+        return true;
+    // Read in the rest, and cache it
+    NbReadSector_t rest;
+    rest.buf = buf + (i * disk->sectorSz);
+    rest.count = block->count - i;
+    rest.sector = block->sector + i;
+    if (!NbObjCallSvc (diskObj, NB_DISK_READ_SECTORS, &rest))
+    {
+        block->error = rest.error;
+        return false;
+    }
+    for (; i < block->count; ++i)
+        volCacheInsert (diskObj, block->sector + i, buf + (i * disk->sectorSz), disk->sectorSz);
+    return true;
+}
+
 // Converts MBR partition type to volume type
 static int mbrTypeToFs (uint8_t mbrType)
 {
@@ -217,7 +383,7 @@ void readGpt (NbObject_t* diskObj)
     sector.buf = gpt;
     sector.count = 1;
     sector.sector = 1;
-    if (!NbObjCallSvc (diskObj, NB_DISK_READ_SECTORS, &sector))
+    if (!volCacheRead (diskObj, &sector))
     {
         // Report error
         NbObjCallSvc (diskObj, NB_DISK_REPORT_ERROR, (void*) sector.error);
@@ -234,45 +400,55 @@ void readGpt (NbObject_t* diskObj)
                            diskObj->name);
         NbCrash();
     }
+    // Read the whole partition array in one go, and check it in one pass
+    if (gpt->partEntSize < sizeof (GptPart_t) ||
+        gpt->numParts > (GPT_MAX_ARRAY_SZ / gpt->partEntSize))
+    {
+        NbLogMessageEarly ("volmanager: GPT partition array corrupt on %s\r\n",
+                           NEXBOOT_LOGLEVEL_EMERGENCY,
+                           diskObj->name);
+        NbCrash();
+    }
+    uint32_t arraySz = gpt->numParts * gpt->partEntSize;
+    uint32_t arraySects = (arraySz + (disk->sectorSz - 1)) / disk->sectorSz;
+    uint8_t* parts = (uint8_t*) malloc (arraySects * disk->sectorSz);
+    assert (parts);
+    sector.buf = parts;
+    sector.count = arraySects;
+    sector.sector = gpt->partTableLba;
+    if (arraySects && !volCacheRead (diskObj, &sector))
+    {
+        // Report error
+        NbObjCallSvc (diskObj, NB_DISK_REPORT_ERROR, (void*) sector.error);
+        NbCrash();
+    }
+    if (Crc32Calc (parts, arraySz) != gpt->partEntriesCrc)
+    {
+        NbLogMessageEarly ("volmanager: GPT partition array corrupt on %s\r\n",
+                           NEXBOOT_LOGLEVEL_EMERGENCY,
+                           diskObj->name);
+        NbCrash();
+    }
     // Begin parsing the partitions
-    GptPart_t* part = (GptPart_t*) malloc (disk->sectorSz);
-    GptPart_t* opart = part;
-    assert (part);
     curPart = 0;
-    int curSector = 0;
-    do
+    for (int i = 0; i < gpt->numParts; ++i)
     {
-        // Read in the sector
-        part = opart;
-        sector.buf = part;
-        sector.count = 1;
-        sector.sector = gpt->partTableLba + curSector;
-        if (!NbObjCallSvc (diskObj, NB_DISK_READ_SECTORS, &sector))
-        {
-            // Report error
-            NbObjCallSvc (diskObj, NB_DISK_REPORT_ERROR, (void*) sector.error);
-            NbCrash();
-        }
-        // Loop through each entry
-        for (int i = 0; i < (disk->sectorSz / gpt->partEntSize); ++i, ++part)
-        {
-            if (!part->startLba)
-                break;    // End of table
-            NbVolume_t* vol = (NbVolume_t*) malloc (sizeof (NbVolume_t));
-            assert (vol);
-            // Set fields
-            vol->disk = NbObjRef (diskObj);
-            vol->isActive = gptIsActive (part->partTypeGuid);
-            vol->isPartition = true;
-            vol->volSize = part->endLba - part->startLba;
-            vol->volStart = part->startLba;
-            vol->volFileSys = gptTypeToFs (part->partTypeGuid);
-            // Add volume to object database
-            addVolume (vol);
-        }
-        ++curSector;
-    } while (part->startLba);    // Go until entry is zeroed
-    free (opart);
+        GptPart_t* part = (GptPart_t*) (parts + (i * gpt->partEntSize));
+        if (!part->startLba)
+            continue;    // Unused entry
+        NbVolume_t* vol = (NbVolume_t*) malloc (sizeof (NbVolume_t));
+        assert (vol);
+        // Set fields
+        vol->disk = NbObjRef (diskObj);
+        vol->isActive = gptIsActive (part->partTypeGuid);
+        vol->isPartition = true;
+        vol->volSize = part->endLba - part->startLba;
+        vol->volStart = part->startLba;
+        vol->volFileSys = gptTypeToFs (part->partTypeGuid);
+        // Add volume to object database
+        addVolume (vol);
+    }
+    free (parts);
     free (gpt);
 }
 
@@ -333,7 +509,7 @@ static bool readPartitionTable (NbObject_t* diskObj)
     sector.buf = sector0;
     sector.count = 1;
     sector.sector = 0;
-    if (!NbObjCallSvc (diskObj, NB_DISK_READ_SECTORS, &sector))
+    if (!volCacheRead (diskObj, &sector))
     {
         // Report error
         NbObjCallSvc (diskObj, NB_DISK_REPORT_ERROR, (void*) sector.error);
@@ -351,7 +527,7 @@ static bool readPartitionTable (NbObject_t* diskObj)
         sector.buf = sector0;
         sector.count = 1;
         sector.sector = ISO9660_VOLUME_DESC_START;
-        if (!NbObjCallSvc (diskObj, NB_DISK_READ_SECTORS, &sector))
+        if (!volCacheRead (diskObj, &sector))
         {
             // Report error
             NbObjCallSvc (diskObj, NB_DISK_REPORT_ERROR, (void*) sector.error);
@@ -428,23 +604,44 @@ static bool VolManagerNotify (void* objp, void* params)
     return true;
 }
 
-static bool VolManagerReadBlocks (void* objp, void* params)
+// Reads blocks from a volume, through the block cache if cached is true
+static bool volReadBlocks (NbObject_t* volObj, NbReadBlock_t* block, bool cached)
 {
-    NbObject_t* volObj = objp;
     NbVolume_t* vol = NbObjGetData (volObj);
-    NbReadBlock_t* block = params;
     // Determine real sector base
     block->sector += vol->volStart;
     // Do a bounds check
     if ((block->sector + block->count) > (vol->volStart + vol->volSize))
+    {
+        block->sector -= vol->volStart;
         return false;
-    bool res = NbObjCallSvc (vol->disk, NB_DISK_READ_SECTORS, block);
+    }
+    bool res = false;
+    if (cached)
+        res = volCacheRead (vol->disk, block);
+    else
+        res = NbObjCallSvc (vol->disk, NB_DISK_READ_SECTORS, block);
     block->sector -= vol->volStart;    // Undo change we made
     return res;
 }
 
-static NbObjSvc volManagerSvcs[] =
-    {NULL, NULL, NULL, VolManagerDumpData, VolManagerNotify, VolManagerReadBlocks};
+static bool VolManagerReadBlocks (void* objp, void* params)
+{
+    return volReadBlocks (objp, params, true);
+}
+
+static bool VolManagerReadDirect (void* objp, void* params)
+{
+    return volReadBlocks (objp, params, false);
+}
+
+static NbObjSvc volManagerSvcs[] = {NULL,
+                                    NULL,
+                                    NULL,
+                                    VolManagerDumpData,
+                                    VolManagerNotify,
+                                    VolManagerReadBlocks,
+                                    VolManagerReadDirect};
 
 NbObjSvcTab_t volManagerSvcTab = {ARRAY_SIZE (volManagerSvcs), volManagerSvcs};
 
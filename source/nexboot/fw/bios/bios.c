@@ -16,6 +16,7 @@
 */
 
 #include <nexboot/drivers/disk.h>
+#include <nexboot/extent.h>
 #include <nexboot/fw.h>
 #include <nexboot/nexboot.h>
 #include <nexboot/object.h>
@@ -54,58 +55,92 @@ void NbFwEarlyPrint (char c)
     // NbBiosCall (0x14, &in, &out);
 }
 
-uintptr_t curMemLocation = NEXBOOT_BIOS_MEMBASE;
+// Pages come out of fixed regions: boot pages from below the bootloader's own memory, and
+// persistent ones from above it up to the VBE back buffer
+static NbExtPool_t biosBootPool = {0};
+static NbExtPool_t biosPersistPool = {0};
+static bool biosPoolsReady = false;
 
-uintptr_t NbFwAllocPage()
+// Fills the pools on first use
+static void biosInitPools()
+{
+    if (biosPoolsReady)
+        return;
+    NbExtFree (&biosBootPool,
+               NEXBOOT_BIOS_MEMBASE,
+               (NEXBOOT_BIOS_BASE - NEXBOOT_BIOS_MEMBASE) / NEXBOOT_CPU_PAGE_SIZE);
+    NbExtFree (&biosPersistPool,
+               NEXBOOT_BIOS_END,
+               (NEXBOOT_BIOS_BACKBUF - NEXBOOT_BIOS_END) / NEXBOOT_CPU_PAGE_SIZE);
+    biosPoolsReady = true;
+}
+
+// Allocates pages from pool, crashing if they're gone
+static uintptr_t biosAllocFrom (NbExtPool_t* pool, int count)
 {
-    uintptr_t ret = curMemLocation;
-    curMemLocation += NEXBOOT_CPU_PAGE_SIZE;
-    if (curMemLocation >= NEXBOOT_BIOS_BASE)
+    biosInitPools();
+    uintptr_t ret = NbExtAlloc (pool, count, 1);
+    if (!ret)
     {
         NbLogMessage ("nexboot: out of memory", NEXBOOT_LOGLEVEL_EMERGENCY);
         NbCrash();
     }
-    memset ((void*) ret, 0, NEXBOOT_CPU_PAGE_SIZE);
     return ret;
 }
 
+uintptr_t NbFwAllocPage()
+{
+    return NbFwAllocPages (1);
+}
+
 uintptr_t NbFwAllocPages (int count)
 {
-    uintptr_t ret = curMemLocation;
-    curMemLocation += (NEXBOOT_CPU_PAGE_SIZE * count);
-    if (curMemLocation >= NEXBOOT_BIOS_BASE)
-    {
-        NbLogMessage ("nexboot: out of memory", NEXBOOT_LOGLEVEL_EMERGENCY);
-        NbCrash();
-    }
+    uintptr_t ret = biosAllocFrom (&biosBootPool, count);
     memset ((void*) ret, 0, (NEXBOOT_CPU_PAGE_SIZE * count));
     return ret;
 }
 
-static uintptr_t curOffset = 0;
-
 uintptr_t NbFwAllocPersistentPage()
 {
-    uintptr_t ret = curOffset + NEXBOOT_BIOS_END;
-    curOffset += NEXBOOT_CPU_PAGE_SIZE;
-    if (curOffset >= NEXBOOT_BIOS_BACKBUF)
-    {
-        NbLogMessage ("nexboot: out of memory", NEXBOOT_LOGLEVEL_EMERGENCY);
-        NbCrash();
-    }
-    return ret;
+    return NbFwAllocPersistentPages (1);
 }
 
 uintptr_t NbFwAllocPersistentPages (int count)
 {
-    uintptr_t ret = curOffset + NEXBOOT_BIOS_END;
-    curOffset += (count * NEXBOOT_CPU_PAGE_SIZE);
-    if (curOffset >= NEXBOOT_BIOS_BACKBUF)
+    return biosAllocFrom (&biosPersistPool, count);
+}
+
+uintptr_t NbFwAllocPersistentAligned (int count, int align)
+{
+    // The persistent area is only a few megabytes, and callers round up to the boundary, which
+    // would waste most of it
+    return 0;
+}
+
+// Reserves the parts of the persistent area that were handed out
+// The rest of it is left free for the kernel
+static void biosResvPersistent()
+{
+    biosInitPools();
+    uintptr_t base = NEXBOOT_BIOS_END;
+    for (int i = 0; i <= biosPersistPool.numExts; ++i)
     {
-        NbLogMessage ("nexboot: out of memory", NEXBOOT_LOGLEVEL_EMERGENCY);
-        NbCrash();
+        uintptr_t end = (i < biosPersistPool.numExts) ? biosPersistPool.exts[i].base
+                                                        : NEXBOOT_BIOS_BACKBUF;
+        if (end > base)
+        {
+            NbLogMessage ("nexboot: Reserving memory region from %#lX to %#lX as kernel memory\n",
+                          NEXBOOT_LOGLEVEL_DEBUG,
+                          base,
+                          end);
+            NbFwResvMem (base, end - base, NEXBOOT_MEM_RESVD);
+        }
+        if (i < biosPersistPool.numExts)
+        {
+            base = biosPersistPool.exts[i].base +
+                   (biosPersistPool.exts[i].count * NEXBOOT_CPU_PAGE_SIZE);
+        }
     }
-    return ret;
 }
 
 // Map in memory regions to address space
@@ -142,11 +177,7 @@ void NbFwMapRegions (NbMemEntry_t* memMap, size_t mapSz)
                   0x100000,
                   NEXBOOT_BIOS_END - 0x100000);
     NbFwResvMem (0x100000, NEXBOOT_BIOS_END - 0x100000, NEXBOOT_MEM_BOOT_RECLAIM);
-    NbLogMessage ("nexboot: Reserving memory region from %#lX to %#lX as kernel memory\n",
-                  NEXBOOT_LOGLEVEL_DEBUG,
-                  NEXBOOT_BIOS_END,
-                  curOffset);
-    NbFwResvMem (NEXBOOT_BIOS_END, curOffset, NEXBOOT_MEM_RESVD);
+    biosResvPersistent();
 }
 
 // Find which disk is the boot disk
@@ -16,7 +16,11 @@
     limitations under the License.
 */
 
+#ifdef NEXBOOT_DECOMP_LZ4
+#include <nexboot/lz4.h>
+#else
 #include "em_inflate.h"
+#endif
 #include <elf.h>
 #include <nexboot/detect.h>
 #include <stdint.h>
@@ -29,10 +33,62 @@
 
 #define HALT asm("cli; hlt")
 
+#ifdef NEXBOOT_DECOMP_LZ4
+// Decompresses an LZ4 frame, returning false if it's corrupt
+static bool decompLz4 (uint8_t* in, uintptr_t inSz, uint8_t* out, uint32_t outSz)
+{
+    if (inSz < NB_LZ4_HDR_MIN)
+        return false;
+    int hdrSz = NbLz4HeaderSize (in);
+    NbLz4Frame_t frame;
+    if (!hdrSz || !NbLz4ParseHeader (in, &frame))
+        return false;
+    uint8_t* inEnd = in + inSz;
+    in += hdrSz;
+    uint32_t pos = 0;
+    while (inEnd - in >= 4)
+    {
+        uint32_t blockSz = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t) in[3] << 24);
+        in += 4;
+        if (!blockSz)
+            return true;    // End mark
+        bool raw = blockSz & NB_LZ4_BLOCK_RAW;
+        blockSz &= ~NB_LZ4_BLOCK_RAW;
+        if (blockSz > inEnd - in)
+            return false;
+        if (raw)
+        {
+            if (blockSz > outSz - pos)
+                return false;
+            memcpy (out + pos, in, blockSz);
+            pos += blockSz;
+        }
+        else
+        {
+            int32_t decoded = NbLz4DecodeBlock (in, blockSz, out, pos, outSz);
+            if (decoded < 0)
+                return false;
+            pos += decoded;
+        }
+        in += blockSz;
+        if (frame.blockChecksum)
+            in += NB_LZ4_CHECKSUM_SZ;
+    }
+    return false;
+}
+#endif
+
 void NbDecompMain (NbloadDetect_t* nbDetect, uint8_t* nbBase, uintptr_t nbSize)
 {
     //  Decompress it
     uint32_t size = NEXBOOT_MAX_SIZE;
+#ifdef NEXBOOT_DECOMP_LZ4
+    if (!decompLz4 (nbBase, nbSize, (void*) NEXBOOT_BASE_ADDR, size))
+    {
+        // We can't print anything right now, just halt
+        HALT;
+    }
+#else
     size_t res = em_inflate ((void*) nbBase, nbSize, (void*) NEXBOOT_BASE_ADDR, size);
     if (res == -1)
     {
@@ -40,6 +96,7 @@ void NbDecompMain (NbloadDetect_t* nbDetect, uint8_t* nbBase, uintptr_t nbSize)
         // is extremely low
         HALT;
     }
+#endif
     // Load up ELF to 0x190000
     Elf32_Ehdr* ehdr = (Elf32_Ehdr*) NEXBOOT_BASE_ADDR;
     if (ehdr->e_ident[EI_MAG0] != ELFMAG0 || ehdr->e_ident[EI_MAG1] != ELFMAG1 ||
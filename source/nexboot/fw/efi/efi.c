@@ -19,6 +19,7 @@
 #include <nexboot/drivers/disk.h>
 #include <nexboot/drivers/display.h>
 #include <nexboot/efi/efi.h>
+#include <nexboot/extent.h>
 #include <nexboot/fw.h>
 #include <nexboot/nexboot.h>
 #include <nexboot/object.h>
@@ -33,24 +34,45 @@ void NbFwEarlyPrint (char c)
     ST->ConOut->OutputString (ST->ConOut, buf);
 }
 
-// Allocate a page of memory
-uintptr_t NbFwAllocPage()
+// Pages are carved out of big arenas we get from the firmware, so allocating doesn't go through
+// its memory map every time, and the map handed to the kernel has a few big entries instead of
+// one for every file and segment
+#define EFI_ARENA_PAGES 1024    // Pages asked for at a time
+
+static NbExtPool_t efiBootPool = {0};       // Pages freed when the kernel is done with them
+static NbExtPool_t efiPersistPool = {0};    // Pages that outlive the bootloader
+
+// Allocates pages from pool, getting another arena of type if nothing fits
+static uintptr_t efiAllocFrom (NbExtPool_t* pool, EFI_MEMORY_TYPE type, int count, int align)
 {
-    EFI_PHYSICAL_ADDRESS addr = 0;
-    if (BS->AllocatePages (AllocateAnyPages, EfiLoaderData, 1, &addr) != EFI_SUCCESS)
+    uintptr_t addr = NbExtAlloc (pool, count, align);
+    if (addr)
+        return addr;
+    UINTN need = count + ((align > 1) ? (align - 1) : 0);
+    UINTN arena = (need > EFI_ARENA_PAGES) ? need : EFI_ARENA_PAGES;
+    EFI_PHYSICAL_ADDRESS base = 0;
+    if (BS->AllocatePages (AllocateAnyPages, type, arena, &base) != EFI_SUCCESS)
     {
-        NbLogMessage ("nexboot: out of memory", NEXBOOT_LOGLEVEL_EMERGENCY);
-        NbCrash();
+        // Memory is tight, so only ask for what's needed
+        arena = need;
+        if (BS->AllocatePages (AllocateAnyPages, type, arena, &base) != EFI_SUCCESS)
+            return 0;
     }
-    memset ((void*) addr, 0, NEXBOOT_CPU_PAGE_SIZE);
-    return addr;
+    NbExtFree (pool, base, arena);
+    return NbExtAlloc (pool, count, align);
+}
+
+// Allocate a page of memory
+uintptr_t NbFwAllocPage()
+{
+    return NbFwAllocPages (1);
 }
 
 // Allocates pages of memory
 uintptr_t NbFwAllocPages (int count)
 {
-    EFI_PHYSICAL_ADDRESS addr = 0;
-    if (BS->AllocatePages (AllocateAnyPages, EfiLoaderData, count, &addr) != EFI_SUCCESS)
+    uintptr_t addr = efiAllocFrom (&efiBootPool, EfiLoaderData, count, 1);
+    if (!addr)
     {
         NbLogMessage ("nexboot: out of memory", NEXBOOT_LOGLEVEL_EMERGENCY);
         NbCrash();
@@ -58,24 +80,18 @@ uintptr_t NbFwAllocPages (int count)
     memset ((void*) addr, 0, count * NEXBOOT_CPU_PAGE_SIZE);
     return addr;
 }
+
 // Allocates a page that will persist after bootloader
 uintptr_t NbFwAllocPersistentPage()
 {
-    EFI_PHYSICAL_ADDRESS addr = 0;
-    if (BS->AllocatePages (AllocateAnyPages, EfiRuntimeServicesData, 1, &addr) != EFI_SUCCESS)
-    {
-        NbLogMessage ("nexboot: out of memory", NEXBOOT_LOGLEVEL_EMERGENCY);
-        NbCrash();
-    }
-    memset ((void*) addr, 0, NEXBOOT_CPU_PAGE_SIZE);
-    return addr;
+    return NbFwAllocPersistentPages (1);
 }
 
 // Allocates pages that will persist after bootloader
 uintptr_t NbFwAllocPersistentPages (int count)
 {
-    EFI_PHYSICAL_ADDRESS addr = 0;
-    if (BS->AllocatePages (AllocateAnyPages, EfiRuntimeServicesData, count, &addr) != EFI_SUCCESS)
+    uintptr_t addr = efiAllocFrom (&efiPersistPool, EfiRuntimeServicesData, count, 1);
+    if (!addr)
     {
         NbLogMessage ("nexboot: out of memory", NEXBOOT_LOGLEVEL_EMERGENCY);
         NbCrash();
@@ -84,6 +100,23 @@ uintptr_t NbFwAllocPersistentPages (int count)
     return addr;
 }
 
+// Allocates persistent pages starting on a boundary of align pages
+uintptr_t NbFwAllocPersistentAligned (int count, int align)
+{
+    uintptr_t addr = efiAllocFrom (&efiPersistPool, EfiRuntimeServicesData, count, align);
+    if (addr)
+        memset ((void*) addr, 0, count * NEXBOOT_CPU_PAGE_SIZE);
+    return addr;
+}
+
+// Gives persistent pages nobody took back to the firmware, so the kernel sees them as free
+static void efiTrimPersistent()
+{
+    for (int i = 0; i < efiPersistPool.numExts; ++i)
+        BS->FreePages (efiPersistPool.exts[i].base, efiPersistPool.exts[i].count);
+    efiPersistPool.numExts = 0;
+}
+
 // Allocates pool memory
 void* NbEfiAllocPool (size_t sz)
 {
@@ -254,6 +287,8 @@ bool NbEfiCompareDevicePath (EFI_DEVICE_PATH* dev1, EFI_DEVICE_PATH* dev2)
 // Map in memory regions to address space
 void NbFwMapRegions (NbMemEntry_t* memMap, size_t mapSz)
 {
+    // Nothing persistent is allocated past here, and the map gets made again after this
+    efiTrimPersistent();
     // On i386 and RISC-V paging is diabled under EFI. Ensure we map enough
     // so we don't immediatly page fault on entering MMU mode
 #if defined NEXNIX_ARCH_I386 || defined NEXNIX_ARCH_RISCV64 || defined NEXNIX_ARCH_ARMV8
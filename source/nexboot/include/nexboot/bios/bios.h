@@ -104,6 +104,11 @@ bool NbFwResvMem (uintptr_t base, size_t sz, int type);
 #define NEXBOOT_BIOSBUF_BASE  0x7000
 #define NEXBOOT_BIOSBUF2_BASE 0x8000
 
+// Bounce buffer for multi-sector disk reads
+// 64 KiB aligned, so floppy DMA never crosses a boundary
+#define NEXBOOT_BIOS_DISKBUF_BASE 0x60000
+#define NEXBOOT_BIOS_DISKBUF_SIZE 0x10000
+
 #define NEXBOOT_BIOS_MBR_BASE 0x7C00
 
 // BIOS disk info structure
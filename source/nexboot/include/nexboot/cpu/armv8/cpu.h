@@ -60,4 +60,11 @@ void NbCpuLaunchKernel (uintptr_t entry, uintptr_t bootInf);
 
 #define NbCpuWriteMsr(msr, val) asm volatile ("msr " msr ", %0" : : "r"(val));
 
+// Reads the cycle counter
+// This is the generic timer's count, which runs at a fixed rate and not at the CPU's
+static inline uint64_t NbCpuGetCycles()
+{
+    return NbCpuReadMsr ("CNTVCT_EL0");
+}
+
 #endif
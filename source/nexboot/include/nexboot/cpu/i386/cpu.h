@@ -44,6 +44,7 @@ static inline uint64_t NbPageAlignDown (uint64_t ptr)
 
 // CPU flags register
 #define NEXBOOT_CPU_CARRY_FLAG (1 << 0)
+#define NEXBOOT_CPU_ZERO_FLAG  (1 << 6)
 
 /// Halts system
 void NbCrash();
@@ -92,4 +93,12 @@ typedef uint32_t paddr_t;
 
 void NbCpuLaunchKernel (uintptr_t entry, uintptr_t bootInf);
 
+// Reads the cycle counter
+static inline uint64_t NbCpuGetCycles()
+{
+    uint32_t low, high;
+    asm volatile ("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t) high << 32) | low;
+}
+
 #endif
@@ -50,4 +50,19 @@ typedef uint32_t paddr_t;
 
 void NbCpuLaunchKernel (uintptr_t entry, uintptr_t bootInf);
 
+// Reads the cycle counter
+// This is the time CSR, which runs at a fixed rate and not at the CPU's
+static inline uint64_t NbCpuGetCycles()
+{
+    uint32_t low, high, high2;
+    // Make sure the low half didn't wrap between reading the halves
+    do
+    {
+        asm volatile ("rdtimeh %0" : "=r"(high));
+        asm volatile ("rdtime %0" : "=r"(low));
+        asm volatile ("rdtimeh %0" : "=r"(high2));
+    } while (high != high2);
+    return ((uint64_t) high << 32) | low;
+}
+
 #endif
@@ -64,4 +64,11 @@ void NbCpuLaunchKernel (uint64_t entry, uint64_t bootInf);
 // Gets SATP
 uint64_t NbCpuGetSatp();
 
+// Reads the cycle counter
+// This is the time CSR, which runs at a fixed rate and not at the CPU's
+static inline uint64_t NbCpuGetCycles()
+{
+    return NbCpuReadCsr ("time");
+}
+
 #endif
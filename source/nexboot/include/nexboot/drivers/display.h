@@ -52,6 +52,8 @@ typedef struct _nbDisplay
     void* frontBuffer;                 // Base of front buffer
     void* backBuffer;                  // Base of back buffer
     void* backBufferLoc;               // Current pointer to back buffer
+    bool hwScroll;                     // Display start follows backBufferLoc, so scrolling doesn't
+                                       // need the screen copied again
     NbInvalidRegion_t* invalidList;    // Internal. List of regions to copy on buffer
                                        // invalidate
 } NbDisplayDev_t;
@@ -115,6 +117,7 @@ typedef struct _displayMode
 
 #define NB_DISPLAY_SETMODE   6
 #define NB_DISPLAY_INCRENDER 7
+#define NB_DISPLAY_UNMAPFB   8
 
 #define NB_DISPLAY_CODE_SETMODE NB_DRIVER_USER
 
@@ -34,6 +34,7 @@
 #define NB_CONSOLE_SCROLL_DOWN    11
 #define NB_CONSOLE_MOVE_CURSOR    12
 #define NB_CONSOLE_GET_SIZE       13
+#define NB_CONSOLE_PRINTSPAN      14
 
 typedef struct _consoleSz
 {
@@ -48,6 +49,15 @@ typedef struct _consolePrint
     char c;
 } NbPrintChar_t;
 
+// Run of characters on one row, drawn in the current colors
+typedef struct _consoleSpan
+{
+    int col;
+    int row;
+    const char* s;
+    int len;
+} NbPrintSpan_t;
+
 typedef struct _consoleLoc
 {
     int col;
@@ -60,6 +70,7 @@ typedef struct _consoleLoc
 #define NB_KEYBOARD_READ_KEY 5
 #define NB_KEYBOARD_DISABLE  6
 #define NB_KEYBOARD_ENABLE   7
+#define NB_KEYBOARD_POLL_KEY 8    // Reads a key if one is waiting, failing if not
 
 // Key structure
 typedef struct _keyData
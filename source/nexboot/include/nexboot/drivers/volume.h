@@ -50,6 +50,7 @@ typedef struct _vol
 
 // Volume object services
 #define NB_VOLUME_READ_SECTORS 5
+#define NB_VOLUME_READ_DIRECT  6    // Reads around the block cache, for data only read once
 
 // Helper routine to get boot volume from disk object
 NbObject_t* NbGetBootVolume (NbObject_t* disk);
@@ -0,0 +1,49 @@
+/*
+    extent.h - contains page extent pools
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _EXTENT_H
+#define _EXTENT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Firmware page allocators carve pages out of a few big regions, keeping what's free in a pool
+// of extents sorted by base. Pools don't allocate memory themselves, so they work before malloc
+#define NB_EXT_MAX 64    // Most free extents a pool holds
+
+// A run of free pages
+typedef struct _nbextent
+{
+    uintptr_t base;    // Base of run
+    size_t count;      // Pages in run
+} NbExtent_t;
+
+typedef struct _nbextpool
+{
+    NbExtent_t exts[NB_EXT_MAX];    // Free runs, sorted by base
+    int numExts;                    // Number of runs
+} NbExtPool_t;
+
+/// Allocates count pages starting on a boundary of align pages
+/// Takes the smallest run that fits. Returns 0 if none does
+uintptr_t NbExtAlloc (NbExtPool_t* pool, size_t count, size_t align);
+
+/// Puts count pages at base in pool, joining them to the runs next to them
+void NbExtFree (NbExtPool_t* pool, uintptr_t base, size_t count);
+
+#endif
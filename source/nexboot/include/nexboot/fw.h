@@ -158,11 +158,19 @@ uintptr_t NbFwAllocPersistentPage();
 // Allocates a page that will persist after bootloader
 uintptr_t NbFwAllocPersistentPages (int count);
 
+// Allocates persistent pages starting on a boundary of align pages
+// Returns 0 if that can't be done cheaply, rather than crashing
+uintptr_t NbFwAllocPersistentAligned (int count, int align);
+
 // Flags for AS
 #define NB_CPU_AS_RW     (1 << 1)
 #define NB_CPU_AS_GLOBAL (1 << 2)
 #define NB_CPU_AS_NX     (1 << 3)
 #define NB_CPU_AS_WT     (1 << 4)
+#define NB_CPU_AS_LARGE  (1 << 5)    // Map a large page. NbCpuAsMap fails if it can't
+
+// Size of large pages
+#define NB_CPU_AS_LARGESZ 0x200000
 
 // System detection macros
 #define NB_ARCH_COMP_ACPI    0
@@ -0,0 +1,50 @@
+/*
+    lz4.h - contains LZ4 decompressor interface
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _LZ4_H
+#define _LZ4_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NB_LZ4_MAGIC       0x184D2204    // Magic number of frame
+#define NB_LZ4_HDR_MIN     7             // Smallest frame header
+#define NB_LZ4_HDR_MAX     19            // Biggest frame header
+#define NB_LZ4_BLOCK_RAW   (1U << 31)    // Block size flag for stored blocks
+#define NB_LZ4_CHECKSUM_SZ 4             // Size of block and content checksums
+
+// Frame header info
+typedef struct _lz4frame
+{
+    uint64_t contentSz;      // Size of decompressed data, 0 if not given
+    uint32_t maxBlockSz;     // Biggest a block can be
+    bool blockChecksum;      // Whether each block is followed by a checksum
+    bool contentChecksum;    // Whether the frame ends with a checksum
+} NbLz4Frame_t;
+
+/// Gets size of frame header from its first 6 bytes, or 0 if it isn't an LZ4 frame
+int NbLz4HeaderSize (const uint8_t* hdr);
+
+/// Parses a frame header
+bool NbLz4ParseHeader (const uint8_t* hdr, NbLz4Frame_t* frame);
+
+/// Decodes a block to out + pos, where out holds everything decoded from the frame so far
+/// Returns bytes decoded, or -1 if block is corrupt or doesn't fit in outSz
+int32_t NbLz4DecodeBlock (const uint8_t* in, uint32_t inSz, uint8_t* out, size_t pos, size_t outSz);
+
+#endif
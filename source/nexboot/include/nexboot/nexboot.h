@@ -47,9 +47,18 @@ void NbLogMessage (const char* fmt, int level, ...);
 /// Returns log base address
 uintptr_t NbLogGetBase();
 
+/// Records the cycle count at which a boot stage was reached
+void NbBootStamp (int stage);
+
+/// Copies boot stamps into out
+void NbGetBootStamps (uint64_t* out);
+
 /// Loads an ELF file into memory
 uintptr_t NbElfLoadFile (void* base);
 
+/// Loads an ELF file, reading its segments from file straight into place
+uintptr_t NbElfLoadStream (NbObject_t* fs, NbFile_t* file);
+
 // Prints a string using NbFwPrintEarly
 void NbPrintEarly (const char* s);
 
@@ -42,6 +42,8 @@ typedef struct _obj
     struct _obj* parent;       /// Parent object
     struct _obj* nextChild;    /// Next child object
     struct _obj* prevChild;    /// Previous child object
+    struct _obj* hashNext;     /// Next object in parent's hash bucket
+    uint32_t nameHash;         /// Hash of name
     NbDriver_t* owner;         /// Owner of this object
     NbDriver_t* manager;       /// Managing driver
 } NbObject_t;
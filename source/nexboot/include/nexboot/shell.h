@@ -58,6 +58,9 @@ bool NbShellExecute (ListHead_t* blocks);
 // Opens a file
 NbFile_t* NbShellOpenFile (NbObject_t* fs, const char* name);
 
+// Starts prefetching a file, so a later open finds it in memory
+bool NbShellPrefetchFile (NbObject_t* fs, const char* name);
+
 // Gets file info
 bool NbShellGetFileInfo (NbObject_t* fs, const char* name, NbFileInfo_t* out);
 
@@ -26,14 +26,15 @@
 
 typedef struct _file
 {
-    Object_t obj;               // Libnex object
-    int fileId;                 // ID of file
-    NbObject_t* fileSys;        // Filesystem object
-    char name[VFS_NAME_MAX];    // Name of file
-    uint32_t pos;               // Position pointer
-    uint32_t size;              // Size of file
-    void* internal;             // Internal data
-    void* blockBuf;             // Buffer for one read block
+    Object_t obj;                  // Libnex object
+    int fileId;                    // ID of file
+    NbObject_t* fileSys;           // Filesystem object
+    char name[VFS_NAME_MAX];       // Name of file
+    uint32_t pos;                  // Position pointer
+    uint32_t size;                 // Size of file
+    void* internal;                // Internal data
+    void* blockBuf;                // Buffer for one read block
+    struct _prefetch* prefetch;    // Contents read ahead of time, if any
 } NbFile_t;
 
 // File into
@@ -73,6 +74,16 @@ NbObject_t* NbVfsMountFs (NbObject_t* volume, const char* name);
 // Unmounts filesystem
 bool NbVfsUnmount (NbObject_t* fs);
 
+// Starts reading a file ahead of time, so opening it later finds the contents in memory
+bool NbVfsPrefetchFile (NbObject_t* fs, const char* name);
+
+// Reads the next chunk of prefetched files
+// Returns false once there's nothing left to read
+bool NbVfsPrefetchStep();
+
+// Stops prefetching, and forgets everything that was read
+void NbVfsDropPrefetch();
+
 // Object opertaions
 #define NB_VFS_OPEN_FILE     5
 #define NB_VFS_CLOSE_FILE    6
@@ -0,0 +1,321 @@
+/*
+    cache.c - contains binary configuration cache
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "conf.h"
+#include <libnex/crc32.h>
+#include <stdlib.h>
+#include <string.h>
+
+// nbconfc parses nexboot.cfg when the image is built, and writes the blocks it got to a cache
+// with this code. The cache records the size and CRC32 of the text it was made from, so if the
+// text has been edited since, the cache is ignored and the text is parsed instead
+// This file is also built into nbconfc, so it can't depend on anything else in nexboot
+//
+// Layout after the header, all little endian:
+//   block list  u16 count, then that many blocks
+//   block       u8 type, u16 line, then:
+//                 command     string command, u16 count, then per argument u16 line, string
+//                 set         string variable, string value
+//                 menu entry  string name, block list
+//   string      u8 type, u16 length, then that many bytes without a terminator
+
+// Writer state
+typedef struct _cachewriter
+{
+    uint8_t* buf;     // Buffer being written
+    size_t pos;       // Current position
+    size_t sz;        // Size of buffer
+    bool overflow;    // Whether buffer ran out
+} confCacheWriter_t;
+
+// Reader state
+typedef struct _cachereader
+{
+    const uint8_t* pos;    // Current position
+    const uint8_t* end;    // End of data
+    bool error;            // Whether data was bad
+} confCacheReader_t;
+
+static void cacheWrite8 (confCacheWriter_t* w, uint8_t val)
+{
+    if (w->pos + 1 > w->sz)
+    {
+        w->overflow = true;
+        return;
+    }
+    w->buf[w->pos++] = val;
+}
+
+static void cacheWrite16 (confCacheWriter_t* w, uint16_t val)
+{
+    cacheWrite8 (w, val & 0xFF);
+    cacheWrite8 (w, val >> 8);
+}
+
+// Writes a string
+static void cacheWriteStr (confCacheWriter_t* w, int type, StringRef_t* str)
+{
+    if (!str)
+    {
+        cacheWrite8 (w, 0);
+        cacheWrite16 (w, 0);
+        return;
+    }
+    const char* s = StrRefGet (str);
+    size_t len = strlen (s);
+    if (len > UINT16_MAX)
+    {
+        w->overflow = true;
+        return;
+    }
+    cacheWrite8 (w, type);
+    cacheWrite16 (w, len);
+    if (w->pos + len > w->sz)
+    {
+        w->overflow = true;
+        return;
+    }
+    memcpy (w->buf + w->pos, s, len);
+    w->pos += len;
+}
+
+// Writes a block list
+static void cacheWriteBlocks (confCacheWriter_t* w, ListHead_t* blocks)
+{
+    // Count blocks first
+    size_t count = 0;
+    for (ListEntry_t* iter = ListFront (blocks); iter; iter = ListIterate (iter))
+        ++count;
+    cacheWrite16 (w, count);
+    for (ListEntry_t* iter = ListFront (blocks); iter; iter = ListIterate (iter))
+    {
+        ConfBlock_t* block = ListEntryData (iter);
+        cacheWrite8 (w, block->type);
+        cacheWrite16 (w, block->lineNo);
+        if (block->type == CONF_BLOCK_CMD)
+        {
+            ConfBlockCmd_t* cmd = (ConfBlockCmd_t*) block;
+            cacheWriteStr (w, cmd->cmd.type, cmd->cmd.literal);
+            size_t numArgs = 0;
+            for (ListEntry_t* arg = ListFront (cmd->args); arg; arg = ListIterate (arg))
+                ++numArgs;
+            cacheWrite16 (w, numArgs);
+            for (ListEntry_t* argIter = ListFront (cmd->args); argIter;
+                 argIter = ListIterate (argIter))
+            {
+                ConfBlockCmdArg_t* arg = ListEntryData (argIter);
+                cacheWrite16 (w, arg->hdr.lineNo);
+                cacheWriteStr (w, arg->str.type, arg->str.literal);
+            }
+        }
+        else if (block->type == CONF_BLOCK_VARSET)
+        {
+            ConfBlockSet_t* set = (ConfBlockSet_t*) block;
+            cacheWriteStr (w, CONF_STRING_LITERAL, set->var);
+            cacheWriteStr (w, set->val.type, set->val.literal);
+        }
+        else if (block->type == CONF_BLOCK_MENUENTRY)
+        {
+            ConfBlockMenu_t* menu = (ConfBlockMenu_t*) block;
+            cacheWriteStr (w, CONF_STRING_LITERAL, menu->name);
+            cacheWriteBlocks (w, menu->blocks);
+        }
+    }
+}
+
+// Writes blocks parsed from src to buf
+// Returns size of cache, or 0 if it doesn't fit
+size_t NbConfWriteCache (ListHead_t* blocks,
+                         const void* src,
+                         uint32_t srcSize,
+                         void* buf,
+                         size_t bufSz)
+{
+    if (bufSz < sizeof (ConfCacheHdr_t))
+        return 0;
+    confCacheWriter_t w = {0};
+    w.buf = buf + sizeof (ConfCacheHdr_t);
+    w.sz = bufSz - sizeof (ConfCacheHdr_t);
+    cacheWriteBlocks (&w, blocks);
+    if (w.overflow)
+        return 0;
+    ConfCacheHdr_t* hdr = buf;
+    hdr->magic = CONF_CACHE_MAGIC;
+    hdr->version = CONF_CACHE_VERSION;
+    hdr->srcSize = srcSize;
+    hdr->srcCrc = Crc32Calc (src, srcSize);
+    hdr->dataSize = w.pos;
+    hdr->dataCrc = Crc32Calc (w.buf, w.pos);
+    return sizeof (ConfCacheHdr_t) + w.pos;
+}
+
+static uint8_t cacheRead8 (confCacheReader_t* r)
+{
+    if (r->pos + 1 > r->end)
+    {
+        r->error = true;
+        return 0;
+    }
+    return *r->pos++;
+}
+
+static uint16_t cacheRead16 (confCacheReader_t* r)
+{
+    uint16_t val = cacheRead8 (r);
+    return val | (cacheRead8 (r) << 8);
+}
+
+// Reads a string
+static StringRef_t* cacheReadStr (confCacheReader_t* r, int* type)
+{
+    *type = cacheRead8 (r);
+    uint16_t len = cacheRead16 (r);
+    if (r->error || len > (size_t) (r->end - r->pos))
+    {
+        r->error = true;
+        return NULL;
+    }
+    if (!*type)
+        return NULL;
+    char* s = malloc (len + 1);
+    if (!s)
+    {
+        r->error = true;
+        return NULL;
+    }
+    memcpy (s, r->pos, len);
+    s[len] = 0;
+    r->pos += len;
+    return StrRefCreate (s);
+}
+
+// Reads a block list
+static ListHead_t* cacheReadBlocks (confCacheReader_t* r, bool inMenu)
+{
+    ListHead_t* blocks = ListCreate ("ConfBlock_t", false, 0);
+    if (!blocks)
+        return NULL;
+    ListSetDestroy (blocks, confDestroyBlock);
+    uint16_t count = cacheRead16 (r);
+    for (int i = 0; i < count && !r->error; ++i)
+    {
+        int type = cacheRead8 (r);
+        int lineNo = cacheRead16 (r);
+        int strType = 0;
+        ConfBlock_t* block = NULL;
+        if (type == CONF_BLOCK_CMD)
+        {
+            ConfBlockCmd_t* cmd = calloc (1, sizeof (ConfBlockCmd_t));
+            if (!cmd)
+            {
+                r->error = true;
+                break;
+            }
+            block = &cmd->hdr;
+            cmd->hdr.type = type;
+            cmd->args = ListCreate ("ConfBlockCmdArg_t", false, 0);
+            ListSetDestroy (cmd->args, confDestroyCmdArg);
+            cmd->cmd.literal = cacheReadStr (r, &strType);
+            cmd->cmd.type = strType;
+            uint16_t numArgs = cacheRead16 (r);
+            for (int j = 0; j < numArgs && !r->error; ++j)
+            {
+                ConfBlockCmdArg_t* arg = calloc (1, sizeof (ConfBlockCmdArg_t));
+                if (!arg)
+                {
+                    r->error = true;
+                    break;
+                }
+                arg->hdr.type = CONF_BLOCK_CMDARG;
+                arg->hdr.lineNo = cacheRead16 (r);
+                arg->str.literal = cacheReadStr (r, &strType);
+                arg->str.type = strType;
+                ListAddBack (cmd->args, arg, 0);
+            }
+        }
+        else if (type == CONF_BLOCK_VARSET)
+        {
+            ConfBlockSet_t* set = calloc (1, sizeof (ConfBlockSet_t));
+            if (!set)
+            {
+                r->error = true;
+                break;
+            }
+            block = &set->hdr;
+            set->hdr.type = type;
+            set->var = cacheReadStr (r, &strType);
+            set->val.literal = cacheReadStr (r, &strType);
+            set->val.type = strType;
+        }
+        else if (type == CONF_BLOCK_MENUENTRY && !inMenu)
+        {
+            ConfBlockMenu_t* menu = calloc (1, sizeof (ConfBlockMenu_t));
+            if (!menu)
+            {
+                r->error = true;
+                break;
+            }
+            block = &menu->hdr;
+            menu->hdr.type = type;
+            menu->name = cacheReadStr (r, &strType);
+            ListHead_t* menuBlocks = cacheReadBlocks (r, true);
+            if (menuBlocks)
+                menu->blocks = (ListHead_t*) ListRef (menuBlocks);
+            else
+                r->error = true;
+        }
+        else
+        {
+            r->error = true;
+            break;
+        }
+        block->lineNo = lineNo;
+        ListAddBack (blocks, block, 0);
+    }
+    if (r->error || r->pos > r->end)
+    {
+        ListDestroy (blocks);
+        return NULL;
+    }
+    return blocks;
+}
+
+// Loads blocks from a cache made from src
+// Returns NULL if the cache is bad or was made from different text
+ListHead_t* NbConfLoadCache (const void* cache, size_t cacheSz, const void* src, uint32_t srcSize)
+{
+    const ConfCacheHdr_t* hdr = cache;
+    if (cacheSz < sizeof (ConfCacheHdr_t) || hdr->magic != CONF_CACHE_MAGIC ||
+        hdr->version != CONF_CACHE_VERSION || hdr->dataSize > cacheSz - sizeof (ConfCacheHdr_t))
+    {
+        return NULL;
+    }
+    if (hdr->srcSize != srcSize || hdr->srcCrc != Crc32Calc (src, srcSize))
+        return NULL;
+    confCacheReader_t r = {0};
+    r.pos = cache + sizeof (ConfCacheHdr_t);
+    r.end = r.pos + hdr->dataSize;
+    if (hdr->dataCrc != Crc32Calc (r.pos, hdr->dataSize))
+        return NULL;
+    ListHead_t* blocks = cacheReadBlocks (&r, false);
+    if (blocks && r.pos != r.end)
+    {
+        ListDestroy (blocks);
+        return NULL;
+    }
+    return blocks;
+}
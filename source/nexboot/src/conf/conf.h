@@ -155,4 +155,38 @@ typedef struct _blockcmd
 // Performs lexing / parsing
 ListHead_t* NbConfParse (ConfContext_t* ctx);
 
+// Destroys a parsed block
+void confDestroyBlock (const void* data);
+
+// Destroys a command argument
+void confDestroyCmdArg (const void* data);
+
+// Binary configuration cache
+#define NEXBOOT_CONF_CACHE "nexboot.cfc"
+
+#define CONF_CACHE_MAGIC   0x4343424E    // "NBCC"
+#define CONF_CACHE_VERSION 1
+
+typedef struct _confcachehdr
+{
+    uint32_t magic;       // CONF_CACHE_MAGIC
+    uint32_t version;     // CONF_CACHE_VERSION
+    uint32_t srcSize;     // Size of text cache was made from
+    uint32_t srcCrc;      // CRC32 of text
+    uint32_t dataSize;    // Bytes after header
+    uint32_t dataCrc;     // CRC32 of bytes after header
+} ConfCacheHdr_t;
+
+// Writes blocks parsed from src to buf
+// Returns size of cache, or 0 if it doesn't fit
+size_t NbConfWriteCache (ListHead_t* blocks,
+                         const void* src,
+                         uint32_t srcSize,
+                         void* buf,
+                         size_t bufSz);
+
+// Loads blocks from a cache made from src
+// Returns NULL if the cache is bad or was made from different text
+ListHead_t* NbConfLoadCache (const void* cache, size_t cacheSz, const void* src, uint32_t srcSize);
+
 #endif
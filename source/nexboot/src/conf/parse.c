@@ -68,7 +68,7 @@ static void parseError (ConfContext_t* ctx, confToken_t* tok, int err)
     NbLogMessage ("\n", NEXBOOT_LOGLEVEL_ERROR);
 }
 
-static void destroyCmdArg (const void* data)
+void confDestroyCmdArg (const void* data)
 {
     ConfBlockCmdArg_t* arg = (ConfBlockCmdArg_t*) data;
     if (arg->str.literal)
@@ -97,7 +97,7 @@ static void destroyVarSet (ConfBlockSet_t* var)
 }
 
 // Destroy a parser block
-static void destroyBlock (const void* data)
+void confDestroyBlock (const void* data)
 {
     ConfBlock_t* block = (ConfBlock_t*) data;
     if (block->type == CONF_BLOCK_CMD)
@@ -155,7 +155,7 @@ static confToken_t* parseCmd (ConfContext_t* ctx, ListHead_t* blocks, confToken_
     cmd->hdr.lineNo = tok->line;
     cmd->hdr.type = CONF_BLOCK_CMD;
     cmd->args = ListCreate ("ConfBlockCmdArg_t", false, 0);
-    ListSetDestroy (cmd->args, destroyCmdArg);
+    ListSetDestroy (cmd->args, confDestroyCmdArg);
     // Check what we need to do. If tok is ID or string, copy semVal to cmd field
     // If it starts a variable, we need to parse the variable
     if (tok->type == LEX_TOKEN_ID || tok->type == LEX_TOKEN_STR)
@@ -361,7 +361,7 @@ static ListHead_t* parseInternal (ConfContext_t* ctx,
                 return NULL;
             }
             ListHead_t* menuBlocks = ListCreate ("ConfBlock_t", false, 0);
-            ListSetDestroy (menuBlocks, destroyBlock);
+            ListSetDestroy (menuBlocks, confDestroyBlock);
             if (!menuBlocks)
             {
                 StrRefDestroy (block->name);
@@ -408,7 +408,7 @@ ListHead_t* NbConfParse (ConfContext_t* ctx)
         return NULL;
     // Initialize parser structures
     ListHead_t* blocks = ListCreate ("ConfBlock_t", false, 0);
-    ListSetDestroy (blocks, destroyBlock);
+    ListSetDestroy (blocks, confDestroyBlock);
     ctx->blocks = blocks;
     // Begin lexing
     confToken_t* tok = parseToken (ctx, NULL);
@@ -64,9 +64,136 @@ static bool elfCheckMachine (int mach)
     return true;
 }
 
-uintptr_t NbElfLoadFile (void* fileBase)
+// Where an ELF file is read from. Either the whole file is already in memory, or segments are
+// read from the file straight into their pages
+typedef struct _elfsrc
+{
+    void* base;        // Base of file in memory, if it's there
+    NbObject_t* fs;    // Filesystem of file otherwise
+    NbFile_t* file;    // File
+} NbElfSource_t;
+
+#define ELF_READ_CHUNK 0x400000    // Most bytes read from a file in one call
+
+// Pages in a large page
+#define ELF_LARGE_PAGES (NB_CPU_AS_LARGESZ / NEXBOOT_CPU_PAGE_SIZE)
+
+// Reads count bytes at offset off
+static bool elfRead (NbElfSource_t* src, uint64_t off, void* buf, uint64_t count)
+{
+    if (src->base)
+    {
+        memcpy (buf, src->base + off, count);
+        return true;
+    }
+    if (off + count > src->file->size || !NbVfsSeekFile (src->fs, src->file, off, false))
+        return false;
+    uint64_t pos = 0;
+    while (pos < count)
+    {
+        uint32_t chunk = (count - pos > ELF_READ_CHUNK) ? ELF_READ_CHUNK : count - pos;
+        int32_t bytesRead = NbVfsReadFile (src->fs, src->file, buf + pos, chunk);
+        if (bytesRead <= 0)
+            return false;
+        pos += bytesRead;
+    }
+    return true;
+}
+
+// Loads a PT_LOAD segment into its own pages and maps it
+// Segments starting on a large page boundary are put in large-page-aligned memory and mapped
+// with large pages. A tail of at least half a large page is padded out to a whole one, and a
+// shorter one gets small pages, so padding costs at most half a large page per segment
+static bool elfLoadSegment (NbElfSource_t* src,
+                            uint64_t offset,
+                            uint64_t vaddr,
+                            uint64_t fileSz,
+                            uint64_t memSz,
+                            uint32_t pflags)
+{
+    if (fileSz > memSz)
+        return false;
+    // Determine number of pages in this segment
+    uint32_t numPgs = (memSz + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
+    // Figure out how much of it goes in large pages
+    uint32_t numLarge = 0;
+    if (!(vaddr & (NB_CPU_AS_LARGESZ - 1)))
+    {
+        numLarge = numPgs / ELF_LARGE_PAGES;
+        if ((numPgs % ELF_LARGE_PAGES) >= (ELF_LARGE_PAGES / 2))
+            ++numLarge;
+    }
+    // Allocate pages
+    uint32_t allocPgs = numPgs;
+    void* filePhys = NULL;
+    if (numLarge)
+    {
+        if ((numLarge * ELF_LARGE_PAGES) > numPgs)
+            allocPgs = numLarge * ELF_LARGE_PAGES;
+        filePhys = (void*) NbFwAllocPersistentAligned (allocPgs, ELF_LARGE_PAGES);
+    }
+    if (!filePhys)
+    {
+        numLarge = 0;
+        allocPgs = numPgs;
+        filePhys = (void*) NbFwAllocPersistentPages (numPgs);
+    }
+    if (!filePhys)
+    {
+        NbShellWrite ("nexboot: out of memory");
+        NbCrash();
+    }
+    // Read file data to physical address
+    if (!elfRead (src, offset, filePhys, fileSz))
+        return false;
+    // Zero out memory and file difference, along with any padding
+    memset (filePhys + fileSz, 0, (allocPgs * NEXBOOT_CPU_PAGE_SIZE) - fileSz);
+    // Get permissions flags
+    uint32_t flags = NB_CPU_AS_GLOBAL | NB_CPU_AS_NX;
+    if (pflags & PF_X)
+        flags &= ~(NB_CPU_AS_NX);
+    if (pflags & PF_W)
+        flags |= NB_CPU_AS_RW;
+    // Map pages
+    NbLogMessage ("nexboot: mapping kernel program header from %#llX to %#llX\n",
+                  NEXBOOT_LOGLEVEL_DEBUG,
+                  vaddr,
+                  vaddr + memSz);
+    uint32_t i = 0;
+    for (; i < (numLarge * ELF_LARGE_PAGES); i += ELF_LARGE_PAGES)
+    {
+        // If this CPU can't do it, the rest gets small pages
+        if (!NbCpuAsMap (vaddr + (i * NEXBOOT_CPU_PAGE_SIZE),
+                         (paddr_t) filePhys + (i * NEXBOOT_CPU_PAGE_SIZE),
+                         flags | NB_CPU_AS_LARGE))
+        {
+            break;
+        }
+    }
+    for (; i < numPgs; ++i)
+    {
+        NbCpuAsMap (vaddr + (i * NEXBOOT_CPU_PAGE_SIZE),
+                    (paddr_t) filePhys + (i * NEXBOOT_CPU_PAGE_SIZE),
+                    flags);
+    }
+    return true;
+}
+
+// Loads an ELF file from src
+// Only headers are read on their own, segments are read straight into place
+static uintptr_t elfLoad (NbElfSource_t* src)
 {
-    Elf32_Ehdr* hdr32 = (Elf32_Ehdr*) fileBase;
+    union
+    {
+        Elf32_Ehdr hdr32;
+        Elf64_Ehdr hdr64;
+    } ehdr;
+    Elf32_Ehdr* hdr32 = &ehdr.hdr32;
+    if (!elfRead (src, 0, &ehdr, sizeof (Elf32_Ehdr)))
+    {
+        NbShellWrite ("nexboot: invalid ELF header\n");
+        return 0;
+    }
     // Verify header
     if (hdr32->e_ident[EI_MAG0] != ELFMAG0 || hdr32->e_ident[EI_MAG1] != ELFMAG1 ||
         hdr32->e_ident[EI_MAG2] != ELFMAG2 || hdr32->e_ident[EI_MAG3] != ELFMAG3)
@@ -96,43 +223,21 @@ uintptr_t NbElfLoadFile (void* fileBase)
             NbShellWrite ("nexboot: payload machine type incompatible with system\n");
             return 0;
         }
-        // Grab program headers
-        uint32_t phSize = hdr32->e_phentsize;
-        Elf32_Phdr* phdr = (Elf32_Phdr*) (fileBase + hdr32->e_phoff);
+        // Go through program headers
         for (int i = 0; i < hdr32->e_phnum; ++i)
         {
-            if (phdr->p_type == PT_LOAD)
+            Elf32_Phdr phdr;
+            if (!elfRead (src, hdr32->e_phoff + (i * hdr32->e_phentsize), &phdr, sizeof (phdr)))
+                goto error;
+            if (phdr.p_type == PT_LOAD && !elfLoadSegment (src,
+                                                           phdr.p_offset,
+                                                           phdr.p_vaddr,
+                                                           phdr.p_filesz,
+                                                           phdr.p_memsz,
+                                                           phdr.p_flags))
             {
-                // Determine number of pages in this segment
-                uint32_t numPgs =
-                    (phdr->p_memsz + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
-                // Allocate pages
-                void* filePhys = (void*) NbFwAllocPersistentPages (numPgs);
-                // Copy file data to physical address
-                void* srcBuf = fileBase + phdr->p_offset;
-                memcpy (filePhys, srcBuf, phdr->p_filesz);
-                // Zero out memory and file difference
-                memset (filePhys + phdr->p_filesz, 0, phdr->p_memsz - phdr->p_filesz);
-                // Get permissions flags
-                uint32_t flags = NB_CPU_AS_GLOBAL | NB_CPU_AS_NX;
-                if (phdr->p_flags & PF_X)
-                    flags &= ~(NB_CPU_AS_NX);
-                if (phdr->p_flags & PF_W)
-                    flags |= NB_CPU_AS_RW;
-                // Map pages
-                NbLogMessage ("nexboot: mapping kernel program header from %#lX to %#lX\n",
-                              NEXBOOT_LOGLEVEL_DEBUG,
-                              phdr->p_vaddr,
-                              phdr->p_vaddr + phdr->p_memsz);
-                for (int i = 0; i < numPgs; ++i)
-                {
-                    NbCpuAsMap (phdr->p_vaddr + (i * NEXBOOT_CPU_PAGE_SIZE),
-                                (paddr_t) filePhys + (i * NEXBOOT_CPU_PAGE_SIZE),
-                                flags);
-                }
+                goto error;
             }
-            // To next header
-            phdr = (void*) phdr + phSize;
         }
         // Return entry point
         return hdr32->e_entry;
@@ -146,7 +251,9 @@ uintptr_t NbElfLoadFile (void* fileBase)
                           "architecture\n");
             return 0;
         }
-        Elf64_Ehdr* hdr64 = (Elf64_Ehdr*) hdr32;
+        Elf64_Ehdr* hdr64 = &ehdr.hdr64;
+        if (!elfRead (src, 0, hdr64, sizeof (Elf64_Ehdr)))
+            goto error;
         // Check endianess
         if (hdr64->e_ident[EI_DATA] != ELFDATA2LSB)
         {
@@ -159,46 +266,43 @@ uintptr_t NbElfLoadFile (void* fileBase)
             NbShellWrite ("nexboot: payload machine type incompatible with system\n");
             return 0;
         }
-        // Grab program headers
-        uint32_t phSize = hdr64->e_phentsize;
-        Elf64_Phdr* phdr = (Elf64_Phdr*) (fileBase + hdr64->e_phoff);
+        // Go through program headers
         for (int i = 0; i < hdr64->e_phnum; ++i)
         {
-            if (phdr->p_type == PT_LOAD)
+            Elf64_Phdr phdr;
+            if (!elfRead (src, hdr64->e_phoff + (i * hdr64->e_phentsize), &phdr, sizeof (phdr)))
+                goto error;
+            if (phdr.p_type == PT_LOAD && !elfLoadSegment (src,
+                                                           phdr.p_offset,
+                                                           phdr.p_vaddr,
+                                                           phdr.p_filesz,
+                                                           phdr.p_memsz,
+                                                           phdr.p_flags))
             {
-                // Determine number of pages in this segment
-                uint32_t numPgs =
-                    (phdr->p_memsz + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
-                // Allocate pages
-                void* filePhys = (void*) NbFwAllocPersistentPages (numPgs);
-                // Copy file data to physical address
-                void* srcBuf = fileBase + phdr->p_offset;
-                memcpy (filePhys, srcBuf, phdr->p_filesz);
-                // Zero out memory and file difference
-                memset (filePhys + phdr->p_filesz, 0, phdr->p_memsz - phdr->p_filesz);
-                // Get permissions flags
-                uint32_t flags = NB_CPU_AS_GLOBAL | NB_CPU_AS_NX;
-                if (phdr->p_flags & PF_X)
-                    flags &= ~(NB_CPU_AS_NX);
-                if (phdr->p_flags & PF_W)
-                    flags |= NB_CPU_AS_RW;
-                // Map pages
-                NbLogMessage ("nexboot: mapping kernel program header from %lx to %lx\n",
-                              NEXBOOT_LOGLEVEL_DEBUG,
-                              phdr->p_vaddr,
-                              phdr->p_vaddr + phdr->p_memsz);
-                for (int i = 0; i < numPgs; ++i)
-                {
-                    NbCpuAsMap (phdr->p_vaddr + (i * NEXBOOT_CPU_PAGE_SIZE),
-                                (paddr_t) filePhys + (i * NEXBOOT_CPU_PAGE_SIZE),
-                                flags);
-                }
+                goto error;
             }
-            // To next header
-            phdr = (void*) phdr + phSize;
         }
         // Return entry point
         return hdr64->e_entry;
     }
-    assert (0);
+    NbShellWrite ("nexboot: invalid ELF class\n");
+    return 0;
+error:
+    NbShellWrite ("nexboot: unable to read payload\n");
+    return 0;
+}
+
+uintptr_t NbElfLoadFile (void* fileBase)
+{
+    NbElfSource_t src = {0};
+    src.base = fileBase;
+    return elfLoad (&src);
+}
+
+uintptr_t NbElfLoadStream (NbObject_t* fs, NbFile_t* file)
+{
+    NbElfSource_t src = {0};
+    src.fs = fs;
+    src.file = file;
+    return elfLoad (&src);
 }
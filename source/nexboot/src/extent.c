@@ -0,0 +1,129 @@
+/*
+    extent.c - contains page extent pools
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexboot/extent.h>
+#include <nexboot/fw.h>
+#include <string.h>
+
+// Makes room for a run at idx
+// Returns false if the pool is full
+static bool extInsert (NbExtPool_t* pool, int idx, uintptr_t base, size_t count)
+{
+    if (pool->numExts == NB_EXT_MAX)
+        return false;
+    memmove (&pool->exts[idx + 1],
+             &pool->exts[idx],
+             (pool->numExts - idx) * sizeof (NbExtent_t));
+    pool->exts[idx].base = base;
+    pool->exts[idx].count = count;
+    ++pool->numExts;
+    return true;
+}
+
+// Takes out the run at idx
+static void extRemove (NbExtPool_t* pool, int idx)
+{
+    --pool->numExts;
+    memmove (&pool->exts[idx],
+             &pool->exts[idx + 1],
+             (pool->numExts - idx) * sizeof (NbExtent_t));
+}
+
+// Allocates count pages starting on a boundary of align pages
+uintptr_t NbExtAlloc (NbExtPool_t* pool, size_t count, size_t align)
+{
+    if (!count)
+        return 0;
+    uintptr_t alignSz = (align ? align : 1) * NEXBOOT_CPU_PAGE_SIZE;
+    int best = -1;
+    uintptr_t bestBase = 0;
+    for (int i = 0; i < pool->numExts; ++i)
+    {
+        NbExtent_t* ext = &pool->exts[i];
+        uintptr_t base = (ext->base + alignSz - 1) & ~(alignSz - 1);
+        uintptr_t end = ext->base + (ext->count * NEXBOOT_CPU_PAGE_SIZE);
+        if (base < ext->base || base >= end || ((end - base) / NEXBOOT_CPU_PAGE_SIZE) < count)
+            continue;
+        if (best == -1 || ext->count < pool->exts[best].count)
+        {
+            best = i;
+            bestBase = base;
+            // Can't do better than an exact fit
+            if (ext->count == count)
+                break;
+        }
+    }
+    if (best == -1)
+        return 0;
+    // Carve it out, leaving what's before and after it in the pool
+    NbExtent_t* ext = &pool->exts[best];
+    uintptr_t end = ext->base + (ext->count * NEXBOOT_CPU_PAGE_SIZE);
+    uintptr_t allocEnd = bestBase + (count * NEXBOOT_CPU_PAGE_SIZE);
+    size_t head = (bestBase - ext->base) / NEXBOOT_CPU_PAGE_SIZE;
+    size_t tail = (end - allocEnd) / NEXBOOT_CPU_PAGE_SIZE;
+    if (head)
+    {
+        ext->count = head;
+        // Without room for the tail it's dropped. It's only lost until the bootloader is done
+        if (tail)
+            extInsert (pool, best + 1, allocEnd, tail);
+    }
+    else if (tail)
+    {
+        ext->base = allocEnd;
+        ext->count = tail;
+    }
+    else
+        extRemove (pool, best);
+    return bestBase;
+}
+
+// Puts count pages at base in pool
+void NbExtFree (NbExtPool_t* pool, uintptr_t base, size_t count)
+{
+    if (!count)
+        return;
+    // Find the first run after it
+    int lo = 0, hi = pool->numExts;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (pool->exts[mid].base < base)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    uintptr_t end = base + (count * NEXBOOT_CPU_PAGE_SIZE);
+    NbExtent_t* prev = lo ? &pool->exts[lo - 1] : NULL;
+    NbExtent_t* next = (lo < pool->numExts) ? &pool->exts[lo] : NULL;
+    bool joinPrev = prev && (prev->base + (prev->count * NEXBOOT_CPU_PAGE_SIZE)) == base;
+    bool joinNext = next && next->base == end;
+    if (joinPrev && joinNext)
+    {
+        prev->count += count + next->count;
+        extRemove (pool, lo);
+    }
+    else if (joinPrev)
+        prev->count += count;
+    else if (joinNext)
+    {
+        next->base = base;
+        next->count += count;
+    }
+    else
+        extInsert (pool, lo, base, count);
+}
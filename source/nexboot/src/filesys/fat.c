@@ -152,20 +152,27 @@ typedef struct _dirbuf
 #define FAT_DIRBUF_MAX    256
 
 // Cached FAT sector
+// Sectors are found through an open addressed hash table of entry indices, and are replaced
+// with the clock algorithm, so the sectors a long cluster chain keeps going back to stay around
 typedef struct _cacheEnt
 {
-    void* data;
+    uint8_t* data;      // Sector data, allocated the first time entry is used
     uint32_t sector;    // Sector to use as key
+    bool valid;         // Whether entry holds a sector
+    bool ref;           // Whether entry was used since the clock hand last passed it
 } FatCacheEnt_t;
 
-#define FAT_FATCACHE_MAX    64
-#define FAT_FATCACHE_GROWSZ 16
+#define FAT_FATCACHE_SZ   64     // Entries on FAT12 / FAT16, must be a power of 2
+#define FAT_FATCACHE_SZ32 256    // Entries on FAT32, whose FATs are much bigger
 
 // Filesystem mount info
 typedef struct _fatmount
 {
     FatDirEntry_t* dir;         // Directory we are working on
-    Array_t* fatCache;          // Cache of FAT structures
+    FatCacheEnt_t* fatCache;    // Cache of FAT sectors
+    uint16_t* fatCacheHash;     // Hash table of entry index plus 1, twice the size of cache
+    uint32_t fatCacheSz;        // Entries in FAT cache
+    uint32_t fatCacheHand;      // Clock hand of FAT cache
     Array_t* dirBuffer;         // Buffered directory entries
     uint64_t fatBase;           // Base of fat
     uint32_t fatSz;             // FAT size in sectors
@@ -176,12 +183,27 @@ typedef struct _fatmount
     uint16_t sectorSz;          // Sector size
 } FatMountInfo_t;
 
+// Run of clusters in a file that are next to each other on disk
+typedef struct _fatextent
+{
+    uint32_t fileCluster;    // Index of first cluster in file
+    uint32_t cluster;        // First cluster on disk
+    uint32_t count;          // Clusters in run
+} FatExtent_t;
+
+#define FAT_EXTENT_GROWSZ 8
+
 // File internal info structure
+// The cluster chain is turned into a list of extents as the file is read, so seeking is a
+// binary search instead of a walk down the chain
 typedef struct _fatfile
 {
-    uint32_t lastReadCluster;    // Last cluster in this file that was read
-    uint32_t lastReadPos;        // Last position that was read from in file
-    uint32_t startCluster;       // Start cluster in file
+    uint32_t startCluster;    // Start cluster in file
+    FatExtent_t* extents;     // Extents mapped so far, in file order
+    uint32_t numExtents;      // Extents in list
+    uint32_t maxExtents;      // Extents list has room for
+    uint32_t numMapped;       // Clusters of file covered by extents
+    bool mapDone;             // Whether the end of the chain has been reached
 } FatFile_t;
 
 // Pathname parser structure
@@ -327,54 +349,144 @@ static void _parsePath (pathPart_t* part)
         part->isLastPart = true;
 }
 
-// Caches a FAT sector
-static bool fatCacheSector (FatMountInfo_t* mountInfo, void* sector, uint32_t sectorIdx)
+// Gets home slot of sector in FAT cache hash table
+static uint32_t fatCacheSlot (FatMountInfo_t* mountInfo, uint32_t sectorIdx)
 {
-    // Get an entry from array
-    FatCacheEnt_t* cacheEnt = NULL;
-    if (mountInfo->fatCache->allocatedElems == mountInfo->fatCache->maxElems)
-        cacheEnt = ArrayGetElement (mountInfo->fatCache, 0);
-    else
-    {
-        // Allocate an element
-        size_t pos = ArrayFindFreeElement (mountInfo->fatCache);
-        if (pos == ARRAY_ERROR)
-            return false;
-        cacheEnt = ArrayGetElement (mountInfo->fatCache, pos);
-    }
-    // Cache it
-    cacheEnt->sector = sectorIdx;
-    cacheEnt->data = sector;
-    return true;
+    return (sectorIdx * 2654435761U) & ((mountInfo->fatCacheSz * 2) - 1);
 }
 
 // Finds a cached FAT sector
-static void* fatFindCache (FatMountInfo_t* mountInfo, uint32_t sectorIdx)
+static uint8_t* fatFindCache (FatMountInfo_t* mountInfo, uint32_t sectorIdx)
 {
-    ArrayIter_t iterSt = {0};
-    ArrayIter_t* iter = ArrayIterate (mountInfo->fatCache, &iterSt);
-    while (iter)
+    uint32_t mask = (mountInfo->fatCacheSz * 2) - 1;
+    uint32_t slot = fatCacheSlot (mountInfo, sectorIdx);
+    while (mountInfo->fatCacheHash[slot])
     {
-        // Check if this is a match
-        FatCacheEnt_t* cache = iter->ptr;
-        if (cache->sector == sectorIdx)
-            return cache->data;
-        iter = ArrayIterate (mountInfo->fatCache, iter);
+        FatCacheEnt_t* cacheEnt = &mountInfo->fatCache[mountInfo->fatCacheHash[slot] - 1];
+        if (cacheEnt->sector == sectorIdx)
+        {
+            cacheEnt->ref = true;
+            return cacheEnt->data;
+        }
+        slot = (slot + 1) & mask;
     }
     return NULL;
 }
 
-// Routine to read a cluster
-static bool fatReadCluster (NbFileSys_t* filesys, void* buf, uint32_t cluster)
+// Takes an entry out of FAT cache hash table
+static void fatCacheUnhash (FatMountInfo_t* mountInfo, uint32_t idx)
+{
+    uint32_t mask = (mountInfo->fatCacheSz * 2) - 1;
+    uint32_t slot = fatCacheSlot (mountInfo, mountInfo->fatCache[idx].sector);
+    while (mountInfo->fatCacheHash[slot] != idx + 1)
+        slot = (slot + 1) & mask;
+    // Shift back any entries after this one that would no longer be found
+    for (;;)
+    {
+        mountInfo->fatCacheHash[slot] = 0;
+        uint32_t next = slot;
+        for (;;)
+        {
+            next = (next + 1) & mask;
+            if (!mountInfo->fatCacheHash[next])
+                return;
+            FatCacheEnt_t* cacheEnt = &mountInfo->fatCache[mountInfo->fatCacheHash[next] - 1];
+            uint32_t home = fatCacheSlot (mountInfo, cacheEnt->sector);
+            // Move it if its home isn't between the hole and where it is now
+            if ((slot <= next) ? (home <= slot || home > next) : (home <= slot && home > next))
+                break;
+        }
+        mountInfo->fatCacheHash[slot] = mountInfo->fatCacheHash[next];
+        slot = next;
+    }
+}
+
+// Puts an entry in FAT cache hash table
+static void fatCacheHash (FatMountInfo_t* mountInfo, uint32_t idx)
+{
+    uint32_t mask = (mountInfo->fatCacheSz * 2) - 1;
+    uint32_t slot = fatCacheSlot (mountInfo, mountInfo->fatCache[idx].sector);
+    while (mountInfo->fatCacheHash[slot])
+        slot = (slot + 1) & mask;
+    mountInfo->fatCacheHash[slot] = idx + 1;
+}
+
+// Frees FAT cache
+static void fatCacheDestroy (FatMountInfo_t* mountInfo)
+{
+    for (int i = 0; i < mountInfo->fatCacheSz; ++i)
+        free (mountInfo->fatCache[i].data);
+    free (mountInfo->fatCache);
+    free (mountInfo->fatCacheHash);
+}
+
+// Gets a FAT sector, reading it in if it isn't cached
+static uint8_t* fatReadFatSector (NbFileSys_t* fs, uint32_t sectorIdx)
+{
+    FatMountInfo_t* mountInfo = fs->internal;
+    uint8_t* data = fatFindCache (mountInfo, sectorIdx);
+    if (data)
+        return data;
+    // Move the clock hand to an entry that's free or hasn't been used since it last came by
+    uint32_t idx = 0;
+    for (;;)
+    {
+        idx = mountInfo->fatCacheHand;
+        mountInfo->fatCacheHand = (idx + 1) & (mountInfo->fatCacheSz - 1);
+        FatCacheEnt_t* cacheEnt = &mountInfo->fatCache[idx];
+        if (!cacheEnt->valid)
+            break;
+        if (!cacheEnt->ref)
+        {
+            fatCacheUnhash (mountInfo, idx);
+            cacheEnt->valid = false;
+            break;
+        }
+        cacheEnt->ref = false;
+    }
+    FatCacheEnt_t* cacheEnt = &mountInfo->fatCache[idx];
+    if (!cacheEnt->data)
+    {
+        cacheEnt->data = malloc (mountInfo->sectorSz);
+        if (!cacheEnt->data)
+            return NULL;
+    }
+    NbReadSector_t sector;
+    sector.buf = cacheEnt->data;
+    sector.count = 1;
+    sector.sector = sectorIdx;
+    if (!NbObjCallSvc (fs->volume, NB_VOLUME_READ_SECTORS, &sector))
+        return NULL;
+    cacheEnt->sector = sectorIdx;
+    cacheEnt->valid = true;
+    cacheEnt->ref = true;
+    fatCacheHash (mountInfo, idx);
+    return cacheEnt->data;
+}
+
+// Routine to read a run of clusters
+// File data is only read once, so it skips the block cache unless cached is true
+static bool fatReadClusters (NbFileSys_t* filesys,
+                             void* buf,
+                             uint32_t cluster,
+                             uint32_t count,
+                             bool cached)
 {
     FatMountInfo_t* fs = filesys->internal;
     // Compute sector number from cluster
     uint32_t sectorNum = ((cluster - 2) * fs->sectPerCluster) + fs->dataBase;
     NbReadSector_t sector;
     sector.buf = buf;
-    sector.count = fs->sectPerCluster;
+    sector.count = fs->sectPerCluster * count;
     sector.sector = sectorNum;
-    return NbObjCallSvc (filesys->volume, NB_VOLUME_READ_SECTORS, &sector);
+    int svc = (cached) ? NB_VOLUME_READ_SECTORS : NB_VOLUME_READ_DIRECT;
+    return NbObjCallSvc (filesys->volume, svc, &sector);
+}
+
+// Routine to read a cluster
+static bool fatReadCluster (NbFileSys_t* filesys, void* buf, uint32_t cluster, bool cached)
+{
+    return fatReadClusters (filesys, buf, cluster, 1, cached);
 }
 
 // Reads next cluster in FAT
@@ -393,22 +505,10 @@ static uint32_t fatReadNextCluster (NbFileSys_t* fs, uint32_t cluster)
     // Compute FAT sector number and offset in sector
     uint64_t fatSector = mountInfo->fatBase + (fatTabOffset / mountInfo->sectorSz);
     uint32_t fatSectOff = fatTabOffset % mountInfo->sectorSz;
-    // Find in FAT cache
-    uint8_t* fat = fatFindCache (mountInfo, fatSector);
+    // Get the sector from FAT cache
+    uint8_t* fat = fatReadFatSector (fs, fatSector);
     if (!fat)
-    {
-        // Read sector
-        fat = (uint8_t*) malloc (mountInfo->sectorSz * 2);
-        NbReadSector_t sector;
-        sector.buf = fat;
-        sector.count = 1;
-        sector.sector = fatSector;
-        if (!NbObjCallSvc (fs->volume, NB_VOLUME_READ_SECTORS, &sector))
-            return UINT32_MAX;
-        // Cache it
-        if (!fatCacheSector (mountInfo, fat, fatSector))
-            return UINT32_MAX;
-    }
+        return UINT32_MAX;
     // Read in value
     if (fs->type == VOLUME_FS_FAT32)
     {
@@ -422,19 +522,18 @@ static uint32_t fatReadNextCluster (NbFileSys_t* fs, uint32_t cluster)
     }
     else if (fs->type == VOLUME_FS_FAT12)
     {
-        // This one is hard. Check if we need to read an additional sector in case
-        // FAT spans sector
-        // FIXME: we should reference cache here
+        // This one is hard. Check if the entry spans into the next sector
+        uint16_t fatVal = fat[fatSectOff];
         if (fatSectOff == (mountInfo->sectorSz - 1))
         {
-            NbReadSector_t sector;
-            sector.buf = fat + mountInfo->sectorSz;
-            sector.count = 1;
-            sector.sector = fatSector + 1;
-            if (!NbObjCallSvc (fs->volume, NB_VOLUME_READ_SECTORS, &sector))
+            // Getting the next sector may replace this one, so we read the low byte first
+            uint8_t* next = fatReadFatSector (fs, fatSector + 1);
+            if (!next)
                 return UINT32_MAX;
+            fatVal |= next[0] << 8;
         }
-        uint16_t fatVal = *((uint16_t*) (fat + fatSectOff));
+        else
+            fatVal |= fat[fatSectOff + 1] << 8;
         if (cluster & 1)
         {
             // Cluster is odd
@@ -471,25 +570,85 @@ static bool fatIsClusterBad (NbFileSys_t* fs, uint32_t cluster)
     assert (0);
 }
 
-// Follows cluster chain to offset in file
-static uint32_t fatFollowClusterChain (NbFileSys_t* fs, NbFile_t* file, uint32_t clusterPos)
+// Adds the next cluster of a file to its extents
+static bool fatAddExtentCluster (FatFile_t* fileInt, uint32_t cluster)
 {
-    FatFile_t* fileInt = file->internal;
-    if (!fileInt->lastReadCluster)
-        fileInt->lastReadCluster = fileInt->startCluster;
-    uint32_t curPos = fileInt->lastReadPos;
-    uint32_t cluster = fileInt->lastReadCluster;
-    while (curPos < clusterPos)
+    if (fileInt->numExtents)
     {
-        // Read next cluster
-        cluster = fatReadNextCluster (fs, cluster);
-        if (fatIsClusterBad (fs, cluster))
-            return UINT32_MAX;
-        else if (fatIsClusterEof (fs, cluster))
-            return UINT32_MAX;
-        ++curPos;
+        // Grow the last extent if this cluster comes right after it
+        FatExtent_t* last = &fileInt->extents[fileInt->numExtents - 1];
+        if ((last->cluster + last->count) == cluster)
+        {
+            ++last->count;
+            ++fileInt->numMapped;
+            return true;
+        }
     }
-    return cluster;
+    if (fileInt->numExtents == fileInt->maxExtents)
+    {
+        uint32_t maxExtents = fileInt->maxExtents + FAT_EXTENT_GROWSZ;
+        FatExtent_t* extents = malloc (maxExtents * sizeof (FatExtent_t));
+        if (!extents)
+            return false;
+        if (fileInt->extents)
+        {
+            memcpy (extents, fileInt->extents, fileInt->numExtents * sizeof (FatExtent_t));
+            free (fileInt->extents);
+        }
+        fileInt->extents = extents;
+        fileInt->maxExtents = maxExtents;
+    }
+    FatExtent_t* extent = &fileInt->extents[fileInt->numExtents++];
+    extent->fileCluster = fileInt->numMapped;
+    extent->cluster = cluster;
+    extent->count = 1;
+    ++fileInt->numMapped;
+    return true;
+}
+
+// Follows cluster chain until the extents cover fileCluster
+static bool fatMapFile (NbFileSys_t* fs, FatFile_t* fileInt, uint32_t fileCluster)
+{
+    while (fileInt->numMapped <= fileCluster)
+    {
+        if (fileInt->mapDone)
+            return false;
+        uint32_t cluster = fileInt->startCluster;
+        if (fileInt->numExtents)
+        {
+            FatExtent_t* last = &fileInt->extents[fileInt->numExtents - 1];
+            cluster = fatReadNextCluster (fs, last->cluster + last->count - 1);
+            if (cluster == UINT32_MAX)
+                return false;
+        }
+        if (cluster < 2 || fatIsClusterBad (fs, cluster) || fatIsClusterEof (fs, cluster))
+        {
+            fileInt->mapDone = true;
+            return false;
+        }
+        if (!fatAddExtentCluster (fileInt, cluster))
+            return false;
+    }
+    return true;
+}
+
+// Finds extent holding a cluster of a file
+static FatExtent_t* fatFindExtent (FatFile_t* fileInt, uint32_t fileCluster)
+{
+    uint32_t low = 0;
+    uint32_t high = fileInt->numExtents;
+    while (low < high)
+    {
+        uint32_t mid = low + ((high - low) / 2);
+        FatExtent_t* extent = &fileInt->extents[mid];
+        if (fileCluster < extent->fileCluster)
+            high = mid;
+        else if (fileCluster >= (extent->fileCluster + extent->count))
+            low = mid + 1;
+        else
+            return extent;
+    }
+    return NULL;
 }
 
 // Places directory entry in directory buffer
@@ -670,7 +829,7 @@ static FatDirEntry_t* fatFindDirCluster (NbFileSys_t* fs, uint32_t cluster, cons
     do
     {
         // Read in directory cluster
-        if (!fatReadCluster (fs, dir, cluster))
+        if (!fatReadCluster (fs, dir, cluster, true))
             return NULL;
         // Find path in read cluster
         ent = fatFindInDir (mountInfo, dir, name, ocluster, clusterSz);
@@ -823,7 +982,7 @@ static FatDirEntry_t* fatNextEntry (NbFileSys_t* fs,
                 return NULL;
             else if (fatIsClusterEof (fs, *cluster))
                 return FAT_SEARCH_FINISHED;
-            if (!fatReadCluster (fs, dir, *cluster))
+            if (!fatReadCluster (fs, dir, *cluster, true))
                 return NULL;
             offset = 0;
         }
@@ -879,7 +1038,7 @@ static FatDirEntry_t* fatStartReadDir (NbFileSys_t* fs, uint32_t* dirCluster)
         }
     }
     // Read in cluster
-    if (!fatReadCluster (fs, dir, *dirCluster))
+    if (!fatReadCluster (fs, dir, *dirCluster, true))
         return NULL;
     return dir;
 }
@@ -929,6 +1088,8 @@ bool FatOpenFile (NbObject_t* fsObj, NbFile_t* file)
 
 bool FatCloseFile (NbObject_t* fsObj, NbFile_t* file)
 {
+    FatFile_t* intFile = file->internal;
+    free (intFile->extents);
     free (file->internal);
     return true;
 }
@@ -1091,35 +1252,35 @@ bool FatReadDir (NbObject_t* fsObj, NbDirIter_t* iter)
     return true;
 }
 
-bool FatReadFileBlock (NbObject_t* fsObj, NbFile_t* file, uint32_t pos)
+uint32_t FatReadFileBlocks (NbObject_t* fsObj,
+                            NbFile_t* file,
+                            uint32_t pos,
+                            void* buf,
+                            uint32_t count)
 {
     NbFileSys_t* fs = NbObjGetData (fsObj);
-    FatMountInfo_t* mountInfo = fs->internal;
     FatFile_t* fileInt = file->internal;
     // Convert pos to a file cluster index
     uint32_t fileClusterNum = pos / fs->blockSz;
-    // Now we need to find the actual cluster number behind the relative cluster
-    // number. We could parse the FAT from the beginning, but that's REALLY slow
-    // Instead, we mantain a hint of where the last read cluster was and base it
-    // off of that
-    if (fileClusterNum == fileInt->lastReadPos && fileInt->lastReadCluster)
-    {
-        // Read in that cluster
-        return fatReadCluster (fs, file->blockBuf, fileInt->lastReadCluster);
-    }
-    else if (fileClusterNum <= fileInt->lastReadPos)
-    {
-        fileInt->lastReadPos = 0;
-        fileInt->lastReadCluster = 0;
-    }
-    // Follow cluster chain to fileClusterNum
-    uint32_t cluster = fatFollowClusterChain (fs, file, fileClusterNum);
-    if (cluster == UINT32_MAX)
-        return false;
-    fileInt->lastReadPos = fileClusterNum;    // Go to fileClusterNum
-    fileInt->lastReadCluster = cluster;
-    // Read in that cluster
-    return fatReadCluster (fs, file->blockBuf, cluster);
+    // Map as far as we're asked to read, so the extent is as long as it can be
+    // Running off the end of the chain is fine as long as the first cluster is there
+    fatMapFile (fs, fileInt, fileClusterNum + count - 1);
+    if (fileInt->numMapped <= fileClusterNum)
+        return 0;
+    FatExtent_t* extent = fatFindExtent (fileInt, fileClusterNum);
+    assert (extent);
+    uint32_t offset = fileClusterNum - extent->fileCluster;
+    if (count > (extent->count - offset))
+        count = extent->count - offset;
+    // Read in the whole run at once
+    if (!fatReadClusters (fs, buf, extent->cluster + offset, count, false))
+        return 0;
+    return count;
+}
+
+bool FatReadFileBlock (NbObject_t* fsObj, NbFile_t* file, uint32_t pos)
+{
+    return FatReadFileBlocks (fsObj, file, pos, file->blockBuf, 1) == 1;
 }
 
 bool FatMountFs (NbObject_t* fsObj)
@@ -1249,10 +1410,15 @@ bool FatMountFs (NbObject_t* fsObj)
         free (mountInfo);
         return false;
     }
-    mountInfo->fatCache =
-        ArrayCreate (FAT_FATCACHE_GROWSZ, FAT_FATCACHE_MAX, sizeof (FatCacheEnt_t));
-    if (!mountInfo->fatCache)
+    mountInfo->fatCacheSz = (fs->type == VOLUME_FS_FAT32) ? FAT_FATCACHE_SZ32 : FAT_FATCACHE_SZ;
+    mountInfo->fatCacheHand = 0;
+    mountInfo->fatCache = calloc (mountInfo->fatCacheSz, sizeof (FatCacheEnt_t));
+    mountInfo->fatCacheHash = calloc (mountInfo->fatCacheSz * 2, sizeof (uint16_t));
+    if (!mountInfo->fatCache || !mountInfo->fatCacheHash)
     {
+        free (mountInfo->fatCache);
+        free (mountInfo->fatCacheHash);
+        free (mountInfo->dir);
         free (mountInfo);
         return false;
     }
@@ -1261,8 +1427,9 @@ bool FatMountFs (NbObject_t* fsObj)
     if (!mountInfo->dirBuffer)
     {
         free (mountInfo->dir);
-        ArrayDestroy (mountInfo->fatCache);
+        fatCacheDestroy (mountInfo);
         free (mountInfo);
+        return false;
     }
     fs->internal = mountInfo;
     return true;
@@ -1273,7 +1440,7 @@ bool FatUnmountFs (NbObject_t* fsObj)
     NbFileSys_t* fs = NbObjGetData (fsObj);
     FatMountInfo_t* mountInfo = fs->internal;
     ArrayDestroy (mountInfo->dirBuffer);
-    ArrayDestroy (mountInfo->fatCache);
+    fatCacheDestroy (mountInfo);
     free (mountInfo->dir);
     free (mountInfo);
     return true;
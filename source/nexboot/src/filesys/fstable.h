@@ -34,6 +34,7 @@ typedef bool (*FsOpenFileT) (NbObject_t*, NbFile_t*);
 typedef bool (*FsCloseFileT) (NbObject_t*, NbFile_t*);
 typedef bool (*FsGetFileInfoT) (NbObject_t*, NbFileInfo_t*);
 typedef bool (*FsReadBlockT) (NbObject_t*, NbFile_t*, uint32_t);
+typedef uint32_t (*FsReadBlocksT) (NbObject_t*, NbFile_t*, uint32_t, void*, uint32_t);
 typedef bool (*FsGetDirT) (NbObject_t*, const char*, NbDirIter_t*);
 typedef bool (*FsReadDirT) (NbObject_t*, NbDirIter_t*);
 
@@ -44,6 +45,7 @@ FsOpenFileT openFileTable[] = {FatOpenFile, IsoOpenFile};
 FsCloseFileT closeFileTable[] = {FatCloseFile, IsoCloseFile};
 FsGetFileInfoT getInfoTable[] = {FatGetFileInfo, IsoGetFileInfo};
 FsReadBlockT readBlockTable[] = {FatReadFileBlock, IsoReadFileBlock};
+FsReadBlocksT readBlocksTable[] = {FatReadFileBlocks, IsoReadFileBlocks};
 FsGetDirT getDirTable[] = {FatGetDir, IsoGetDir};
 FsReadDirT readDirTable[] = {FatReadDir, IsoReadDir};
 
@@ -53,6 +55,8 @@ FsReadDirT readDirTable[] = {FatReadDir, IsoReadDir};
 #define FsCloseFile(type, fs, file)      (closeFileTable[(type)](fs, file))
 #define FsGetFileInfo(type, fs, info)    (getInfoTable[(type)](fs, info));
 #define FsReadBlock(type, fs, file, pos) (readBlockTable[(type)](fs, file, pos))
+#define FsReadBlocks(type, fs, file, pos, buf, count) \
+    (readBlocksTable[(type)](fs, file, pos, buf, count))
 #define FsGetDir(type, fs, name, iter)   (getDirTable[(type)](fs, name, iter))
 #define FsReadDir(type, fs, iter)        (readDirTable[(type)](fs, iter))
 
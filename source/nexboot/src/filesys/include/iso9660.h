@@ -26,6 +26,11 @@ bool IsoOpenFile (NbObject_t* fsObj, NbFile_t* file);
 bool IsoCloseFile (NbObject_t* fs, NbFile_t* file);
 bool IsoGetFileInfo (NbObject_t* fs, NbFileInfo_t* fileInf);
 bool IsoReadFileBlock (NbObject_t* fsObj, NbFile_t* file, uint32_t pos);
+uint32_t IsoReadFileBlocks (NbObject_t* fsObj,
+                            NbFile_t* file,
+                            uint32_t pos,
+                            void* buf,
+                            uint32_t count);
 bool IsoGetDir (NbObject_t* fsObj, const char* path, NbDirIter_t* iter);
 bool IsoReadDir (NbObject_t* fsObj, NbDirIter_t* iter);
 
@@ -90,30 +90,55 @@ typedef struct _pvd
 
 #define ISO_DESC_START 16
 
-// Directory buffer
-typedef struct _isodirbuf
+// Path lookups are cached by parent extent and name, so opening a file doesn't walk its parents
+// again. Directories that get searched are read whole and kept too, so looking up their other
+// entries doesn't go back to disk. Both are evicted least recently used first
+// Only lookups that found something are cached
+
+#define ISO_NAME_CACHE_SZ   256            // Lookups that are cached
+#define ISO_NAME_HASH_SZ    128            // Buckets in lookup cache, must be a power of 2
+#define ISO_NAME_MAX        128            // Longest name that can be cached
+#define ISO_DIR_CACHE_SZ    16             // Directories that are cached
+#define ISO_DIR_CACHE_BYTES (64 * 1024)    // Most bytes of directories cached
+
+// Cached lookup
+typedef struct _isonamecache
 {
-    IsoDirRecord_t dir;    // Buffered entry
-    uint8_t name[128];     // Name of file
-    uint32_t parentExt;    // Parent's extent
-    struct _isodirbuf* next;
-} IsoDirBuffer_t;
-
-#define ISO_BUF_NAMELEN 128
+    IsoDirRecord_t dir;                // Record that was found
+    uint32_t parentExt;                // Parent's extent
+    uint32_t hash;                     // Hash of parent and name
+    char name[ISO_NAME_MAX];           // Name that was looked up
+    struct _isonamecache* hashNext;    // Next entry in bucket
+    struct _isonamecache* lruNext;     // Next less recently used entry
+    struct _isonamecache* lruPrev;     // Next more recently used entry
+} IsoNameCache_t;
+
+// Cached directory
+typedef struct _isodircache
+{
+    uint32_t extent;     // Extent of directory, 0 if slot is free
+    uint32_t len;        // Bytes of directory read
+    uint32_t lastUse;    // Time of last use
+    uint8_t* data;       // Contents of directory
+} IsoDirCache_t;
 
 // Mount info
 typedef struct _isomount
 {
-    uint16_t sectorSz;         // Sector size of volume
-    uint16_t blockSz;          // Block size of volume
-    IsoDirRecord_t rootDir;    // Root directory
-    IsoDirRecord_t* curDir;    // Buffer for current directory
-    IsoDirBuffer_t* dirBuf;    // Directory buffer
-    uint32_t numBuffered;      // Number of buffered entries
+    uint16_t sectorSz;                             // Sector size of volume
+    uint16_t blockSz;                              // Block size of volume
+    IsoDirRecord_t rootDir;                        // Root directory
+    IsoDirRecord_t* curDir;                        // Buffer for current directory
+    IsoNameCache_t* names;                         // Lookup cache entries
+    uint32_t numNames;                             // Entries that have been used
+    IsoNameCache_t* nameHash[ISO_NAME_HASH_SZ];    // Buckets of lookup cache
+    IsoNameCache_t* nameMru;                       // Most recently used lookup
+    IsoNameCache_t* nameLru;                       // Least recently used lookup
+    IsoDirCache_t dirCache[ISO_DIR_CACHE_SZ];      // Cached directories
+    uint32_t dirBytes;                             // Bytes of directories cached
+    uint32_t dirClock;                             // Ticks on every directory use
 } IsoMountInfo_t;
 
-#define ISO_DIR_BUFFERED_MAX 256    // Max number of dir entries to be buffered at once
-
 // File internal info
 typedef struct _isofile
 {
@@ -195,78 +220,171 @@ static void isoCopyName (IsoDirRecord_t* dir, char* nameOut)
     }
 }
 
-// Reads a block from the volume
-static bool isoReadBlock (NbFileSys_t* fs, void* buf, uint32_t block)
+// Reads blocks from the volume
+// File data is only read once, so it skips the block cache unless cached is true
+static bool isoReadBlocks (NbFileSys_t* fs, void* buf, uint32_t block, uint32_t count, bool cached)
 {
     IsoMountInfo_t* mountInfo = fs->internal;
     uint16_t blockSectors = mountInfo->blockSz;
     NbReadSector_t sector;
     sector.buf = buf;
-    sector.count = blockSectors;
+    sector.count = blockSectors * count;
     sector.sector = block * blockSectors;
-    return NbObjCallSvc (fs->volume, NB_VOLUME_READ_SECTORS, &sector);
+    int svc = (cached) ? NB_VOLUME_READ_SECTORS : NB_VOLUME_READ_DIRECT;
+    return NbObjCallSvc (fs->volume, svc, &sector);
+}
+
+// Reads a block from the volume
+static bool isoReadBlock (NbFileSys_t* fs, void* buf, uint32_t block, bool cached)
+{
+    return isoReadBlocks (fs, buf, block, 1, cached);
 }
 
-// Attempts to find buffered directory entry
-IsoDirRecord_t* isoFindBuffer (IsoMountInfo_t* mountInfo, uint32_t parentExt, const char* name)
+// Hashes a lookup
+static uint32_t isoNameHash (uint32_t parentExt, const char* name)
 {
-    IsoDirBuffer_t* curBuf = mountInfo->dirBuf;
-    while (curBuf)
+    uint32_t hash = 2166136261U ^ parentExt;
+    while (*name)
     {
-        // Check parent extent and name
-        if (parentExt == curBuf->parentExt && !memcmp (curBuf->name, name, curBuf->dir.nameLen))
-        {
-            return &curBuf->dir;
-        }
-        curBuf = curBuf->next;
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619U;
     }
-    return NULL;
+    return hash;
 }
 
-// Buffers a directory entry
-static bool isoAddBuffer (IsoMountInfo_t* mountInfo, IsoDirRecord_t* entry, IsoDirRecord_t* parent)
+// Takes lookup off LRU list
+static void isoNameUnlink (IsoMountInfo_t* mountInfo, IsoNameCache_t* ent)
 {
-    IsoDirBuffer_t* buf = (IsoDirBuffer_t*) calloc (sizeof (IsoDirBuffer_t), 1);
-    if (!buf)
-        return false;
-    // Copy name, first doing bounds check
-    if (entry->nameLen > ISO_BUF_NAMELEN)
+    if (ent->lruPrev)
+        ent->lruPrev->lruNext = ent->lruNext;
+    else
+        mountInfo->nameMru = ent->lruNext;
+    if (ent->lruNext)
+        ent->lruNext->lruPrev = ent->lruPrev;
+    else
+        mountInfo->nameLru = ent->lruPrev;
+}
+
+// Puts lookup at the front of LRU list
+static void isoNameLinkMru (IsoMountInfo_t* mountInfo, IsoNameCache_t* ent)
+{
+    ent->lruPrev = NULL;
+    ent->lruNext = mountInfo->nameMru;
+    if (mountInfo->nameMru)
+        mountInfo->nameMru->lruPrev = ent;
+    else
+        mountInfo->nameLru = ent;
+    mountInfo->nameMru = ent;
+}
+
+// Finds a cached lookup, marking it as just used
+static IsoNameCache_t* isoFindName (IsoMountInfo_t* mountInfo,
+                                    uint32_t parentExt,
+                                    const char* name,
+                                    uint32_t hash)
+{
+    IsoNameCache_t* ent = mountInfo->nameHash[hash & (ISO_NAME_HASH_SZ - 1)];
+    while (ent && (ent->hash != hash || ent->parentExt != parentExt || strcmp (ent->name, name)))
+        ent = ent->hashNext;
+    if (ent && ent != mountInfo->nameMru)
     {
-        // Skip
-        free (buf);
-        return true;
+        isoNameUnlink (mountInfo, ent);
+        isoNameLinkMru (mountInfo, ent);
     }
-    memcpy (&buf->dir, entry, sizeof (IsoDirRecord_t));
-    // Name special cases: if name is '\0', actual name is '.'
-    // If name is '\1', acutal name is '..'
-    uint8_t* entryName = (uint8_t*) entry + sizeof (IsoDirRecord_t);
-    if (*entryName == 0)
+    return ent;
+}
+
+// Caches a lookup, evicting the least recently used one if the cache is full
+static void isoAddName (IsoMountInfo_t* mountInfo,
+                        uint32_t parentExt,
+                        const char* name,
+                        uint32_t hash,
+                        IsoDirRecord_t* dir)
+{
+    if (strlen (name) >= ISO_NAME_MAX)
+        return;
+    IsoNameCache_t* ent = NULL;
+    if (mountInfo->numNames < ISO_NAME_CACHE_SZ)
+        ent = &mountInfo->names[mountInfo->numNames++];
+    else
     {
-        memcpy (buf->name, ".", 1);
-        buf->dir.nameLen = 1;    // XXX, shouldn't edit directory entry
+        ent = mountInfo->nameLru;
+        isoNameUnlink (mountInfo, ent);
+        IsoNameCache_t** prev = &mountInfo->nameHash[ent->hash & (ISO_NAME_HASH_SZ - 1)];
+        while (*prev != ent)
+            prev = &(*prev)->hashNext;
+        *prev = ent->hashNext;
     }
-    else if (*entryName == 1)
+    memcpy (&ent->dir, dir, sizeof (IsoDirRecord_t));
+    ent->parentExt = parentExt;
+    ent->hash = hash;
+    strcpy (ent->name, name);
+    IsoNameCache_t** bucket = &mountInfo->nameHash[hash & (ISO_NAME_HASH_SZ - 1)];
+    ent->hashNext = *bucket;
+    *bucket = ent;
+    isoNameLinkMru (mountInfo, ent);
+}
+
+// Drops a cached directory
+static void isoFreeDir (IsoMountInfo_t* mountInfo, IsoDirCache_t* ent)
+{
+    mountInfo->dirBytes -= ent->len;
+    free (ent->data);
+    ent->data = NULL;
+    ent->extent = 0;
+}
+
+// Gets the contents of a directory, reading it whole if it isn't cached
+// Returns NULL if it can't be cached, in which case it should be read a block at a time
+static IsoDirCache_t* isoGetDir (NbFileSys_t* fs, IsoDirRecord_t* dir)
+{
+    IsoMountInfo_t* mountInfo = fs->internal;
+    ++mountInfo->dirClock;
+    IsoDirCache_t* victim = NULL;
+    for (int i = 0; i < ISO_DIR_CACHE_SZ; ++i)
     {
-        memcpy (buf->name, "..", 2);
-        buf->dir.nameLen = 2;
+        IsoDirCache_t* ent = &mountInfo->dirCache[i];
+        if (ent->extent == dir->extentL)
+        {
+            ent->lastUse = mountInfo->dirClock;
+            return ent;
+        }
+        if (!victim || !ent->extent || (victim->extent && ent->lastUse < victim->lastUse))
+            victim = ent;
     }
-    memcpy (buf->name, (uint8_t*) entryName, entry->nameLen);
-    buf->parentExt = parent->extentL;
-    // Check if something needs to be evicted
-    if (mountInfo->numBuffered == ISO_DIR_BUFFERED_MAX)
+    uint32_t numBlocks = (dir->lengthL + fs->blockSz - 1) / fs->blockSz;
+    uint32_t len = numBlocks * fs->blockSz;
+    if (len > ISO_DIR_CACHE_BYTES)
+        return NULL;
+    // Evict until there's a free slot and enough bytes
+    if (victim->extent)
+        isoFreeDir (mountInfo, victim);
+    while (mountInfo->dirBytes + len > ISO_DIR_CACHE_BYTES)
     {
-        buf->next = mountInfo->dirBuf->next;
-        free (mountInfo->dirBuf);
-        mountInfo->dirBuf = buf;
+        IsoDirCache_t* oldest = NULL;
+        for (int i = 0; i < ISO_DIR_CACHE_SZ; ++i)
+        {
+            IsoDirCache_t* ent = &mountInfo->dirCache[i];
+            if (ent->extent && (!oldest || ent->lastUse < oldest->lastUse))
+                oldest = ent;
+        }
+        isoFreeDir (mountInfo, oldest);
     }
-    else
+    victim->data = malloc (len);
+    if (!victim->data)
+        return NULL;
+    // Directories are cached here, so they skip the block cache
+    if (!isoReadBlocks (fs, victim->data, dir->extentL, numBlocks, false))
     {
-        // Add to list
-        buf->next = mountInfo->dirBuf;
-        mountInfo->dirBuf = buf;
-        ++mountInfo->numBuffered;
+        free (victim->data);
+        victim->data = NULL;
+        return NULL;
     }
-    return true;
+    victim->extent = dir->extentL;
+    victim->len = len;
+    victim->lastUse = mountInfo->dirClock;
+    mountInfo->dirBytes += len;
+    return victim;
 }
 
 // Checks if directory record is a showable file
@@ -277,65 +395,71 @@ static bool isoDirIsShowable (IsoDirRecord_t* dir)
     return true;
 }
 
-// Finds entry in directory sector
-static IsoDirRecord_t* isoFindInDir (NbFileSys_t* fs,
-                                     void* buf,
-                                     IsoDirRecord_t* parent,
-                                     const char* name)
+// Finds entry in directory data, copying it to out
+static bool isoFindInDir (NbFileSys_t* fs,
+                          uint8_t* buf,
+                          uint32_t len,
+                          const char* name,
+                          IsoDirRecord_t* out)
 {
-    IsoDirRecord_t* dir = buf;
-    size_t nameLen = strlen (name);
-    while (dir->recSize)
+    char entryName[256];
+    uint32_t offset = 0;
+    while (offset + sizeof (IsoDirRecord_t) <= len)
     {
-        // Buffer entry
-        if (!isoFindBuffer (fs->internal, parent->extentL, name))
+        IsoDirRecord_t* dir = (IsoDirRecord_t*) (buf + offset);
+        // Records don't cross blocks, the rest of a block is zeroed
+        if (!dir->recSize)
         {
-            if (!isoAddBuffer (fs->internal, dir, parent))
-                return NULL;
+            offset = ((offset / fs->blockSz) + 1) * fs->blockSz;
+            continue;
+        }
+        isoCopyName (dir, entryName);
+        if (!strcmp (entryName, name))
+        {
+            memcpy (out, dir, sizeof (IsoDirRecord_t));
+            return true;
         }
-        // Compare names, accounting for '.' and '..' cases
-        uint8_t* entryName = (uint8_t*) dir + sizeof (IsoDirRecord_t);
-        if (*entryName == 0 && !strcmp (name, "."))
-            return dir;
-        else if (*entryName == 1 && !strcmp (name, ".."))
-            return dir;
-        else if (dir->nameLen && !memcmp (entryName, name, nameLen))
-            return dir;
-        buf += dir->recSize;
-        dir = buf;
+        offset += dir->recSize;
     }
-    return NULL;
+    return false;
 }
 
-static IsoDirRecord_t* isoFindDir (NbFileSys_t* fs, IsoDirRecord_t* parent, const char* name)
+// Finds name in parent, copying its record to out
+// out may be parent
+static bool isoFindDir (NbFileSys_t* fs,
+                        IsoDirRecord_t* parent,
+                        const char* name,
+                        IsoDirRecord_t* out)
 {
-    IsoDirRecord_t* rec = NULL;
     IsoMountInfo_t* mountInfo = fs->internal;
-    // Search buffer for record first
-    rec = isoFindBuffer (mountInfo, parent->extentL, name);
-    if (rec)
-        return rec;
-    // Not in buffer, search parent's data area
-    IsoDirRecord_t* dir = mountInfo->curDir;
-    // Get size of data area
-    uint32_t dataAreaSz = parent->lengthL / mountInfo->sectorSz;
-    uint32_t block = parent->extentL;
-    while (block < (parent->extentL + dataAreaSz))
+    uint32_t parentExt = parent->extentL;
+    uint32_t hash = isoNameHash (parentExt, name);
+    // Check for an earlier lookup first
+    IsoNameCache_t* ent = isoFindName (mountInfo, parentExt, name, hash);
+    if (ent)
+    {
+        memcpy (out, &ent->dir, sizeof (IsoDirRecord_t));
+        return true;
+    }
+    // Search the whole directory if it can be cached
+    bool found = false;
+    IsoDirCache_t* dirEnt = isoGetDir (fs, parent);
+    if (dirEnt)
+        found = isoFindInDir (fs, dirEnt->data, dirEnt->len, name, out);
+    else
     {
-        // Read it in
-        if (!isoReadBlock (fs, dir, block))
+        // Search parent's data area a block at a time
+        uint32_t numBlocks = (parent->lengthL + fs->blockSz - 1) / fs->blockSz;
+        for (uint32_t i = 0; i < numBlocks && !found; ++i)
         {
-            free (dir);
-            return false;
+            if (!isoReadBlock (fs, mountInfo->curDir, parentExt + i, true))
+                return false;
+            found = isoFindInDir (fs, (uint8_t*) mountInfo->curDir, fs->blockSz, name, out);
         }
-        // Go through directory and attempt to find record
-        rec = isoFindInDir (fs, dir, parent, name);
-        if (rec)
-            return rec;
-        ++block;
     }
-    free (dir);
-    return NULL;
+    if (found)
+        isoAddName (mountInfo, parentExt, name, hash, out);
+    return found;
 }
 
 #define ISO_SEARCH_FINISHED (void*) -1
@@ -362,7 +486,7 @@ static IsoDirRecord_t* isoDirNext (NbFileSys_t* fs, IsoDirIter_t* iter, char* na
         {
             if (offset >= iter->dirLen)
                 return ISO_SEARCH_FINISHED;    // We reached end
-            if (!isoReadBlock (fs, iter->dir, ++block))
+            if (!isoReadBlock (fs, iter->dir, ++block, true))
                 return NULL;
             curDir = curDirP = iter->dir;
             offset = 0;
@@ -387,25 +511,24 @@ bool IsoOpenFile (NbObject_t* fsObj, NbFile_t* file)
     pathPart_t part = {0};
     part.oldName = file->name;
     // Make search start at root
-    IsoDirRecord_t* curDir = &mountInfo->rootDir;
+    IsoDirRecord_t curDir = mountInfo->rootDir;
     while (1)
     {
         _parsePath (&part);
         // Find this part
-        curDir = isoFindDir (fs, curDir, part.name);
-        if (!curDir)
+        if (!isoFindDir (fs, &curDir, part.name, &curDir))
             return false;
         if (part.isLastPart)
         {
             // Make sure this is a file we found
-            if (curDir->flags & ISO_DIRREC_ISDIR)
+            if (curDir.flags & ISO_DIRREC_ISDIR)
                 return false;
             break;
         }
         else
         {
             // Make sure this is a directory we found
-            if (!(curDir->flags & ISO_DIRREC_ISDIR))
+            if (!(curDir.flags & ISO_DIRREC_ISDIR))
                 return false;
         }
     }
@@ -413,9 +536,9 @@ bool IsoOpenFile (NbObject_t* fsObj, NbFile_t* file)
     IsoFile_t* intFile = (IsoFile_t*) malloc (sizeof (IsoFile_t));
     if (!intFile)
         return false;
-    intFile->startBlock = curDir->extentL;
+    intFile->startBlock = curDir.extentL;
     file->internal = intFile;
-    file->size = curDir->lengthL;
+    file->size = curDir.lengthL;
     return true;
 }
 
@@ -428,25 +551,24 @@ bool IsoGetFileInfo (NbObject_t* fsObj, NbFileInfo_t* fileInf)
     pathPart_t part = {0};
     part.oldName = fileInf->name;
     // Make search start at root
-    IsoDirRecord_t* curDir = &mountInfo->rootDir;
+    IsoDirRecord_t curDir = mountInfo->rootDir;
     while (1)
     {
         _parsePath (&part);
         // Find this part
-        curDir = isoFindDir (fs, curDir, part.name);
-        if (!curDir)
+        if (!isoFindDir (fs, &curDir, part.name, &curDir))
             return false;
         if (part.isLastPart)
             break;
         else
         {
             // Make sure this is a directory we found
-            if (!(curDir->flags & ISO_DIRREC_ISDIR))
+            if (!(curDir.flags & ISO_DIRREC_ISDIR))
                 return false;
         }
     }
-    fileInf->size = curDir->lengthL;
-    if (curDir->flags & ISO_DIRREC_ISDIR)
+    fileInf->size = curDir.lengthL;
+    if (curDir.flags & ISO_DIRREC_ISDIR)
         fileInf->type = NB_FILE_DIR;
     else
         fileInf->type = NB_FILE_FILE;
@@ -461,29 +583,28 @@ bool IsoGetDir (NbObject_t* fsObj, const char* path, NbDirIter_t* iter)
     pathPart_t part = {0};
     part.oldName = path;
     // Start at root directory
-    IsoDirRecord_t* curDir = &mountInfo->rootDir;
+    IsoDirRecord_t dir = mountInfo->rootDir;
     while (!part.isLastPart)
     {
         _parsePath (&part);
         // Find this part
-        curDir = isoFindDir (fs, curDir, part.name);
-        if (!curDir)
+        if (!isoFindDir (fs, &dir, part.name, &dir))
             return false;
         // Make sure this is a directory we found
-        if (!(curDir->flags & ISO_DIRREC_ISDIR))
+        if (!(dir.flags & ISO_DIRREC_ISDIR))
             return false;
     }
     // Initialize internal iterator
     IsoDirIter_t* iterInt = (IsoDirIter_t*) &iter->internal;
     iterInt->curPos = 0;
-    iterInt->block = curDir->extentL;
-    iterInt->dirLen = curDir->lengthL;
-    iterInt->dir = (IsoDirRecord_t*) malloc (curDir->lengthL);
+    iterInt->block = dir.extentL;
+    iterInt->dirLen = dir.lengthL;
+    iterInt->dir = (IsoDirRecord_t*) malloc (dir.lengthL);
     if (!iterInt->dir)
         return false;
-    curDir = iterInt->dir;
+    IsoDirRecord_t* curDir = iterInt->dir;
     // Start directory read
-    if (!isoReadBlock (fs, iterInt->dir, iterInt->block))
+    if (!isoReadBlock (fs, iterInt->dir, iterInt->block, true))
     {
         free (iterInt->dir);
         return false;
@@ -565,7 +686,22 @@ bool IsoReadFileBlock (NbObject_t* fsObj, NbFile_t* file, uint32_t pos)
     pos /= fs->blockSz;
     pos += intFile->startBlock;
     // Read it in
-    return isoReadBlock (fs, file->blockBuf, pos);
+    return isoReadBlock (fs, file->blockBuf, pos, false);
+}
+
+uint32_t IsoReadFileBlocks (NbObject_t* fsObj,
+                            NbFile_t* file,
+                            uint32_t pos,
+                            void* buf,
+                            uint32_t count)
+{
+    NbFileSys_t* fs = NbObjGetData (fsObj);
+    IsoFile_t* intFile = file->internal;
+    // Files are always one extent, so all of it can be read at once
+    uint32_t block = (pos / fs->blockSz) + intFile->startBlock;
+    if (!isoReadBlocks (fs, buf, block, count, false))
+        return 0;
+    return count;
 }
 
 bool IsoMountFs (NbObject_t* fsObj)
@@ -604,17 +740,20 @@ bool IsoMountFs (NbObject_t* fsObj)
         free (buf);
         return false;
     }
-    // Allocate directory buffer
-    mountInfo->curDir = malloc (disk->sectorSz);
-    if (!mountInfo->curDir)
+    memset (mountInfo, 0, sizeof (IsoMountInfo_t));
+    IsoPvd_t* pvd = buf;
+    // Allocate directory buffer and lookup cache
+    mountInfo->curDir = malloc (pvd->blockSzL);
+    mountInfo->names = malloc (ISO_NAME_CACHE_SZ * sizeof (IsoNameCache_t));
+    if (!mountInfo->curDir || !mountInfo->names)
     {
+        free (mountInfo->curDir);
+        free (mountInfo->names);
         free (buf);
         free (mountInfo);
         return false;
     }
-    mountInfo->dirBuf = NULL;
     // Set PVD fields in mount info
-    IsoPvd_t* pvd = buf;
     mountInfo->blockSz = pvd->blockSzL / disk->sectorSz;
     fs->blockSz = pvd->blockSzL;
     mountInfo->sectorSz = disk->sectorSz;
@@ -628,12 +767,9 @@ bool IsoUnmountFs (NbObject_t* fsObj)
 {
     NbFileSys_t* fs = NbObjGetData (fsObj);
     IsoMountInfo_t* mountInfo = fs->internal;
-    IsoDirBuffer_t* curBuf = mountInfo->dirBuf;
-    while (curBuf)
-    {
-        free (curBuf);
-        curBuf = curBuf->next;
-    }
+    for (int i = 0; i < ISO_DIR_CACHE_SZ; ++i)
+        free (mountInfo->dirCache[i].data);
+    free (mountInfo->names);
     free (mountInfo->curDir);
     free (mountInfo);
     return true;
@@ -0,0 +1,135 @@
+/*
+    lz4.c - contains LZ4 decompressor
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexboot/lz4.h>
+#include <string.h>
+
+// Decodes the LZ4 frame format as written by the lz4 tool
+// Blocks are decoded into one buffer that holds the whole output, so blocks that refer back to
+// earlier ones need no separate window. Dictionaries aren't supported, and checksums are skipped
+
+// Frame flags
+#define LZ4_FLG_VERSION     (3 << 6)
+#define LZ4_FLG_VERSION_1   (1 << 6)
+#define LZ4_FLG_BLOCK_CSUM  (1 << 4)
+#define LZ4_FLG_CONTENT_SZ  (1 << 3)
+#define LZ4_FLG_CONTENT_SUM (1 << 2)
+#define LZ4_FLG_DICT_ID     (1 << 0)
+
+#define LZ4_MIN_MATCH 4
+
+// Reads a little endian 32 bit value
+static uint32_t lz4Read32 (const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Gets size of frame header from its first 6 bytes, or 0 if it isn't an LZ4 frame
+int NbLz4HeaderSize (const uint8_t* hdr)
+{
+    if (lz4Read32 (hdr) != NB_LZ4_MAGIC)
+        return 0;
+    uint8_t flg = hdr[4];
+    int sz = NB_LZ4_HDR_MIN;
+    if (flg & LZ4_FLG_CONTENT_SZ)
+        sz += 8;
+    if (flg & LZ4_FLG_DICT_ID)
+        sz += 4;
+    return sz;
+}
+
+// Parses a frame header
+bool NbLz4ParseHeader (const uint8_t* hdr, NbLz4Frame_t* frame)
+{
+    uint8_t flg = hdr[4];
+    uint8_t bd = hdr[5];
+    if ((flg & LZ4_FLG_VERSION) != LZ4_FLG_VERSION_1 || (flg & LZ4_FLG_DICT_ID))
+        return false;
+    // Block max size is 64K, 256K, 1M or 4M
+    int blockId = (bd >> 4) & 7;
+    if (blockId < 4)
+        return false;
+    frame->maxBlockSz = 1U << (8 + (2 * blockId));
+    frame->blockChecksum = (flg & LZ4_FLG_BLOCK_CSUM) != 0;
+    frame->contentChecksum = (flg & LZ4_FLG_CONTENT_SUM) != 0;
+    frame->contentSz = 0;
+    if (flg & LZ4_FLG_CONTENT_SZ)
+        frame->contentSz = lz4Read32 (hdr + 6) | ((uint64_t) lz4Read32 (hdr + 10) << 32);
+    return true;
+}
+
+// Reads the extra bytes of a length
+static bool lz4ReadLen (const uint8_t** in, const uint8_t* inEnd, size_t* len)
+{
+    uint8_t b;
+    do
+    {
+        if (*in >= inEnd)
+            return false;
+        b = *(*in)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decodes a block to out + pos
+int32_t NbLz4DecodeBlock (const uint8_t* in, uint32_t inSz, uint8_t* out, size_t pos, size_t outSz)
+{
+    const uint8_t* inEnd = in + inSz;
+    uint8_t* op = out + pos;
+    uint8_t* outEnd = out + outSz;
+    while (in < inEnd)
+    {
+        uint8_t token = *in++;
+        // Copy literals
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !lz4ReadLen (&in, inEnd, &litLen))
+            return -1;
+        if (litLen > (size_t) (inEnd - in) || litLen > (size_t) (outEnd - op))
+            return -1;
+        memcpy (op, in, litLen);
+        op += litLen;
+        in += litLen;
+        // Last sequence is only literals
+        if (in == inEnd)
+            break;
+        if (inEnd - in < 2)
+            return -1;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (!offset || offset > (size_t) (op - out))
+            return -1;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !lz4ReadLen (&in, inEnd, &matchLen))
+            return -1;
+        matchLen += LZ4_MIN_MATCH;
+        if (matchLen > (size_t) (outEnd - op))
+            return -1;
+        // Copy match. Matches closer than their length repeat themselves, so they're copied in
+        // steps no bigger than the offset
+        const uint8_t* match = op - offset;
+        while (matchLen)
+        {
+            size_t step = (matchLen < offset) ? matchLen : offset;
+            memcpy (op, match, step);
+            op += step;
+            match += step;
+            matchLen -= step;
+        }
+    }
+    return op - (out + pos);
+}
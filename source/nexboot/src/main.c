@@ -23,6 +23,7 @@
 #include <nexboot/drivers/volume.h>
 #include <nexboot/fw.h>
 #include <nexboot/nexboot.h>
+#include <nexboot/nexnix.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -64,6 +65,7 @@ void nbLaunchConf()
                       NEXBOOT_LOGLEVEL_EMERGENCY);
         NbShellLaunch (NULL);
     }
+    NbBootStamp (NEXBOOT_STAMP_CONFIG);
     // Attempt to open configuration file
     NbFile_t* confFile = NbVfsOpenFile (fsObj, NEXBOOT_CONF_FILE);
     // Launch shell. Based on if parameter is NULL, it will either dump to shell
@@ -78,9 +80,23 @@ void nbLaunchConf()
 // This is needed as a global for some bits
 NbloadDetect_t* nbDetectGlobal = NULL;
 
+// Cycle counts when each boot stage was reached, passed on to the kernel
+static uint64_t nbBootStamps[NEXBOOT_STAMP_MAX] = {0};
+
+void NbBootStamp (int stage)
+{
+    nbBootStamps[stage] = NbCpuGetCycles();
+}
+
+void NbGetBootStamps (uint64_t* out)
+{
+    memcpy (out, nbBootStamps, sizeof (nbBootStamps));
+}
+
 // The main entry point into nexboot
 void NbMain (NbloadDetect_t* nbDetect)
 {
+    NbBootStamp (NEXBOOT_STAMP_ENTRY);
     nbDetectGlobal = nbDetect;
     //   So, we are loaded by nbload, and all it has given us is the nbdetect
     //   structure. It's our job to create a usable environment.
@@ -117,6 +133,7 @@ void NbMain (NbloadDetect_t* nbDetect)
                            NEXBOOT_LOGLEVEL_EMERGENCY);
         NbCrash();
     }
+    NbBootStamp (NEXBOOT_STAMP_DRIVERS);
     // Start log
     NbLogInit2 (nbDetect);
     // Find boot partition and launch configuration script
@@ -57,6 +57,38 @@ typedef struct _mempage
 
 static memPage_t* pageList = NULL;
 
+// Small allocations come from slabs, pages of same sized objects kept on a list per size class,
+// so allocating and freeing one is constant time. Objects have no header; free finds the slab
+// from the page the object is in, as the start of every heap page says what kind it is
+// Slabs that empty out are kept for their class
+
+#define MEM_SLAB_MAGIC   0x5AB1F00D
+#define MEM_SLAB_MIN     16     // Smallest size class
+#define MEM_SLAB_MAX     512    // Biggest size class
+#define MEM_SLAB_CLASSES 6
+#define MEM_SLAB_OFFSET  64     // Offset of first object in slab
+
+// Free object in a slab
+typedef struct _memslabobj
+{
+    struct _memslabobj* next;
+} memSlabObj_t;
+
+// Slab header, at the start of its page
+typedef struct _memslab
+{
+    uint32_t magic;            // MEM_SLAB_MAGIC
+    uint32_t objSz;            // Size of objects
+    uint32_t numFree;          // Objects that are free
+    memSlabObj_t* freeList;    // Free objects
+    struct _memslab* next;     // Next slab in class with free objects
+    struct _memslab* prev;
+    bool onList;               // Whether slab is on its class's list
+} memSlab_t;
+
+// Slabs with free objects, by size class
+static memSlab_t* slabLists[MEM_SLAB_CLASSES] = {0};
+
 void memBlockInit (memPage_t* page, memBlock_t* block)
 {
     block->magic = MEM_BLOCK_MAGIC;
@@ -218,6 +250,82 @@ static void* allocBlockInPage (memPage_t* pg, size_t sz)
     }
 }
 
+// Gets size class of sz
+static int memSlabClass (size_t sz)
+{
+    int cls = 0;
+    size_t clsSz = MEM_SLAB_MIN;
+    while (clsSz < sz)
+    {
+        clsSz <<= 1;
+        ++cls;
+    }
+    return cls;
+}
+
+// Allocates an object from a slab of class cls
+static void* memSlabAlloc (int cls)
+{
+    memSlab_t* slab = slabLists[cls];
+    if (!slab)
+    {
+        // Make a new slab
+        slab = (memSlab_t*) NbFwAllocPage();
+        if (!slab)
+            return NULL;
+        slab->magic = MEM_SLAB_MAGIC;
+        slab->objSz = MEM_SLAB_MIN << cls;
+        slab->numFree = 0;
+        slab->freeList = NULL;
+        for (uintptr_t obj = (uintptr_t) slab + MEM_SLAB_OFFSET;
+             obj + slab->objSz <= (uintptr_t) slab + NEXBOOT_CPU_PAGE_SIZE;
+             obj += slab->objSz)
+        {
+            memSlabObj_t* slabObj = (memSlabObj_t*) obj;
+            slabObj->next = slab->freeList;
+            slab->freeList = slabObj;
+            ++slab->numFree;
+        }
+        slab->prev = NULL;
+        slab->next = NULL;
+        slab->onList = true;
+        slabLists[cls] = slab;
+    }
+    memSlabObj_t* obj = slab->freeList;
+    slab->freeList = obj->next;
+    // Take full slabs off the list
+    if (!--slab->numFree)
+    {
+        slabLists[cls] = slab->next;
+        if (slab->next)
+            slab->next->prev = NULL;
+        slab->onList = false;
+    }
+    return obj;
+}
+
+// Frees an object to its slab
+static void memSlabFree (memSlab_t* slab, void* ptr)
+{
+    if ((((uintptr_t) ptr & (NEXBOOT_CPU_PAGE_SIZE - 1)) - MEM_SLAB_OFFSET) % slab->objSz)
+        memCorrupted (ptr);
+    memSlabObj_t* obj = ptr;
+    obj->next = slab->freeList;
+    slab->freeList = obj;
+    ++slab->numFree;
+    // Put it back on the list if it was full
+    if (!slab->onList)
+    {
+        int cls = memSlabClass (slab->objSz);
+        slab->prev = NULL;
+        slab->next = slabLists[cls];
+        if (slabLists[cls])
+            slabLists[cls]->prev = slab;
+        slabLists[cls] = slab;
+        slab->onList = true;
+    }
+}
+
 size_t alignSize (size_t sz)
 {
     // Account for block header in size, and then align to 16
@@ -236,6 +344,8 @@ void* malloc (size_t sz)
 {
     if (!sz)
         return NULL;
+    if (sz <= MEM_SLAB_MAX)
+        return memSlabAlloc (memSlabClass (sz));
     sz = alignSize (sz);
     // If size is greater than page size, allocation method is different
     if ((sz + MEM_PG_BLOCK_OFFSET) > NEXBOOT_CPU_PAGE_SIZE)
@@ -307,6 +417,13 @@ void free (void* ptr)
 {
     if (!ptr)
         return;
+    // Check if this came from a slab
+    memSlab_t* slab = (memSlab_t*) ((uintptr_t) ptr & ~(NEXBOOT_CPU_PAGE_SIZE - 1));
+    if (slab->magic == MEM_SLAB_MAGIC)
+    {
+        memSlabFree (slab, ptr);
+        return;
+    }
     void* optr = ptr;
     // Get block header from ptr
     ptr -= MEM_BLOCK_DATA_OFFSET;
@@ -449,6 +566,20 @@ void NbMmDumpData()
         pg = pg->next;
     }
     NbShellWritePaged ("Total heap free size: %u\n", NEXBOOT_LOGLEVEL_INFO, totalFreeSize);
+    for (int i = 0; i < MEM_SLAB_CLASSES; ++i)
+    {
+        uint32_t numSlabs = 0;
+        uint32_t numFree = 0;
+        for (memSlab_t* slab = slabLists[i]; slab; slab = slab->next)
+        {
+            ++numSlabs;
+            numFree += slab->numFree;
+        }
+        NbShellWritePaged ("Size class %u: %u slabs with free objects, %u free objects\n",
+                           MEM_SLAB_MIN << i,
+                           numSlabs,
+                           numFree);
+    }
 }
 
 static const char* mmapTypeTable[] = {"",
@@ -15,6 +15,7 @@
     limitations under the License.
 */
 
+#include "conf/conf.h"
 #include <assert.h>
 #include <libnex/array.h>
 #include <libnex/base.h>
@@ -52,6 +53,9 @@ static NbObject_t* keyboardObj = NULL;
 // OS info we are booting from
 static NbOsInfo_t* os = NULL;
 
+// Wheter the first entry's files are still being prefetched
+static bool menuPrefetching = false;
+
 // Adds a menu entry
 void NbMenuAddEntry (StringRef_t* name, ListHead_t* cmdLine)
 {
@@ -361,6 +365,46 @@ static bool nbMenuCreateUi (NbUi_t* ui)
     return true;
 }
 
+// Starts prefetching the payload and modules of entry
+// Only literal paths can be known before the entry runs. If the entry ends up reading something
+// else, the prefetch just goes unused
+static void nbMenuStartPrefetch (MenuEntry_t* entry)
+{
+    NbObject_t* fs = NbShellGetRootFs();
+    if (!fs)
+        return;
+    ListEntry_t* iter = ListFront (entry->cmdLine);
+    while (iter)
+    {
+        ConfBlockCmd_t* cmd = ListEntryData (iter);
+        if (cmd->hdr.type == CONF_BLOCK_CMD && cmd->cmd.type == CONF_STRING_LITERAL &&
+            (!strcmp (StrRefGet (cmd->cmd.literal), "payload") ||
+             !strcmp (StrRefGet (cmd->cmd.literal), "bootmod")))
+        {
+            ListEntry_t* argIter = ListFront (cmd->args);
+            ConfBlockCmdArg_t* arg = argIter ? ListEntryData (argIter) : NULL;
+            if (arg && arg->str.type == CONF_STRING_LITERAL &&
+                NbShellPrefetchFile (fs, StrRefGet (arg->str.literal)))
+            {
+                menuPrefetching = true;
+            }
+        }
+        iter = ListIterate (iter);
+    }
+}
+
+// Reads a key, prefetching while there isn't one
+static void nbMenuReadKey (NbKeyData_t* key)
+{
+    while (menuPrefetching)
+    {
+        if (NbObjCallSvc (keyboardObj, NB_KEYBOARD_POLL_KEY, key))
+            return;
+        menuPrefetching = NbVfsPrefetchStep();
+    }
+    NbObjCallSvc (keyboardObj, NB_KEYBOARD_READ_KEY, key);
+}
+
 // Reads from keyboard and selects an OS based on input
 static bool nbMenuSelectOs (NbUi_t* ui)
 {
@@ -373,12 +417,14 @@ static bool nbMenuSelectOs (NbUi_t* ui)
         assert (selectedEnt);
         return true;
     }
+    // Read ahead what the first entry loads while we wait
+    nbMenuStartPrefetch (ArrayGetElement (menuEntries, 0));
     // Keyboard read loop
     NbKeyData_t key = {0};
     int curOs = 0;
     while (1)
     {
-        NbObjCallSvc (keyboardObj, NB_KEYBOARD_READ_KEY, &key);
+        nbMenuReadKey (&key);
         if (key.isBreak)
             continue;
         // Determine what was pressed
@@ -398,12 +444,17 @@ static bool nbMenuSelectOs (NbUi_t* ui)
         }
         else if (key.c == '\n')
         {
-            // Return to boot
+            // What was prefetched is only of use to the first entry
+            if (curOs)
+                NbVfsDropPrefetch();
+            menuPrefetching = false;
             return true;
         }
         else if (key.c == 'c')
         {
             // Return to terminal
+            NbVfsDropPrefetch();
+            menuPrefetching = false;
             return false;
         }
     }
@@ -452,6 +503,7 @@ bool NbMenuInitUi (Array_t* args)
     // Boot the OS
     nbMenuBootOs();
     // Boot returned, go to shell
+    NbVfsDropPrefetch();
     ArrayDestroy (menuEntries);
     menuEntries = NULL;
     return false;
@@ -18,25 +18,41 @@
 #include <assert.h>
 #include <nexboot/drivers/display.h>
 #include <nexboot/fw.h>
+#include <nexboot/lz4.h>
 #include <nexboot/nexboot.h>
 #include <nexboot/nexnix.h>
 #include <nexboot/os.h>
 #include <nexboot/shell.h>
+#include <stdio.h>
 #include <string.h>
 
-// Reads in a file component
-void* osReadFile (NbObject_t* fs, bool persists, const char* name)
+#define OS_READ_CHUNK 0x400000    // Most bytes read from a file in one call
+
+// Buffer compressed blocks are read into, kept for the next file
+static uint8_t* osBlockBuf = NULL;
+static uint32_t osBlockBufSz = 0;
+
+// Reads count bytes from a file, in big chunks so the filesystem can read whole extents
+static bool osRead (NbObject_t* fs, NbFile_t* file, void* buf, uint32_t count)
 {
-    NbShellWrite ("Loading %s...\n", name);
-    // Read in file
-    NbFile_t* file = NbShellOpenFile (fs, name);
-    if (!file)
+    uint32_t pos = 0;
+    while (pos < count)
     {
-        NbShellWrite ("nexboot: unable to open file \"%s\"\n", name);
-        return NULL;
+        uint32_t chunk = count - pos;
+        if (chunk > OS_READ_CHUNK)
+            chunk = OS_READ_CHUNK;
+        int32_t bytesRead = NbVfsReadFile (fs, file, buf + pos, chunk);
+        if (bytesRead <= 0)
+            return false;
+        pos += bytesRead;
     }
-    // Allocate memory for file
-    int numPages = (file->size + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
+    return true;
+}
+
+// Allocates memory for a file component
+static void* osAllocFile (bool persists, uint64_t size)
+{
+    int numPages = (size + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
     void* fileBase = NULL;
     if (persists)
         fileBase = (void*) NbFwAllocPersistentPages (numPages);
@@ -47,23 +63,269 @@ void* osReadFile (NbObject_t* fs, bool persists, const char* name)
         NbShellWrite ("nexboot: out of memory");
         NbCrash();
     }
+    return fileBase;
+}
+
+// Reads in an LZ4 frame, decompressing each block into the file's final pages as it's read
+// hdr holds the start of the frame, hdrSz bytes of which have been read
+static void* osReadLz4 (NbObject_t* fs,
+                        NbFile_t* file,
+                        bool persists,
+                        const char* name,
+                        uint8_t* hdr,
+                        int hdrSz,
+                        uint64_t* size)
+{
+    // Read the rest of the header
+    NbLz4Frame_t frame;
+    int fullSz = NbLz4HeaderSize (hdr);
+    if (!osRead (fs, file, hdr + hdrSz, fullSz - hdrSz) || !NbLz4ParseHeader (hdr, &frame))
+    {
+        NbShellWrite ("nexboot: unsupported LZ4 frame in \"%s\"\n", name);
+        return NULL;
+    }
+    // Memory for the output has to be allocated up front
+    if (!frame.contentSz)
+    {
+        NbShellWrite ("nexboot: \"%s\" has no content size, compress it with --content-size\n",
+                      name);
+        return NULL;
+    }
+    if (osBlockBufSz < frame.maxBlockSz)
+    {
+        osBlockBuf = (uint8_t*) NbFwAllocPages (frame.maxBlockSz / NEXBOOT_CPU_PAGE_SIZE);
+        if (!osBlockBuf)
+        {
+            NbShellWrite ("nexboot: out of memory");
+            NbCrash();
+        }
+        osBlockBufSz = frame.maxBlockSz;
+    }
+    uint8_t* fileBase = osAllocFile (persists, frame.contentSz);
+    size_t pos = 0;
+    while (1)
+    {
+        uint8_t sizeBuf[4];
+        if (!osRead (fs, file, sizeBuf, 4))
+            goto error;
+        uint32_t blockSz = sizeBuf[0] | (sizeBuf[1] << 8) | (sizeBuf[2] << 16) |
+                           ((uint32_t) sizeBuf[3] << 24);
+        if (!blockSz)
+            break;    // End mark
+        bool raw = blockSz & NB_LZ4_BLOCK_RAW;
+        blockSz &= ~NB_LZ4_BLOCK_RAW;
+        if (blockSz > frame.maxBlockSz)
+            goto error;
+        if (raw)
+        {
+            // Stored blocks go straight to their place
+            if (blockSz > frame.contentSz - pos || !osRead (fs, file, fileBase + pos, blockSz))
+                goto error;
+            pos += blockSz;
+        }
+        else
+        {
+            if (!osRead (fs, file, osBlockBuf, blockSz))
+                goto error;
+            int32_t decoded =
+                NbLz4DecodeBlock (osBlockBuf, blockSz, fileBase, pos, frame.contentSz);
+            if (decoded < 0)
+                goto error;
+            pos += decoded;
+        }
+        // Checksums aren't checked
+        if (frame.blockChecksum && !osRead (fs, file, sizeBuf, NB_LZ4_CHECKSUM_SZ))
+            goto error;
+    }
+    if (pos != frame.contentSz)
+        goto error;
+    if (size)
+        *size = frame.contentSz;
+    return fileBase;
+error:
+    NbShellWrite ("nexboot: \"%s\" is corrupt\n", name);
+    return NULL;
+}
+
+// Reads in a file component, setting size to its size if it isn't NULL
+// Components compressed as LZ4 frames are decompressed as they're read
+void* osReadFile (NbObject_t* fs, bool persists, const char* name, uint64_t* size)
+{
+    NbShellWrite ("Loading %s...\n", name);
     // Read in file
-    for (int i = 0; i < numPages; ++i)
+    NbFile_t* file = NbShellOpenFile (fs, name);
+    if (!file)
     {
-        if (!NbVfsReadFile (fs,
-                            file,
-                            fileBase + (i * NEXBOOT_CPU_PAGE_SIZE),
-                            NEXBOOT_CPU_PAGE_SIZE))
+        NbShellWrite ("nexboot: unable to open file \"%s\"\n", name);
+        return NULL;
+    }
+    // Check for an LZ4 frame
+    uint8_t hdr[NB_LZ4_HDR_MAX];
+    int hdrSz = 6;
+    if (file->size >= NB_LZ4_HDR_MIN)
+    {
+        if (!osRead (fs, file, hdr, hdrSz))
         {
             NbVfsCloseFile (fs, file);
             NbShellWrite ("nexboot: unable to read file \"%s\"", name);
             return NULL;
         }
+        if (NbLz4HeaderSize (hdr))
+        {
+            void* fileBase = osReadLz4 (fs, file, persists, name, hdr, hdrSz, size);
+            NbVfsCloseFile (fs, file);
+            return fileBase;
+        }
+    }
+    else
+        hdrSz = 0;
+    // It's stored as is
+    uint8_t* fileBase = osAllocFile (persists, file->size);
+    memcpy (fileBase, hdr, hdrSz);
+    if (!osRead (fs, file, fileBase + hdrSz, file->size - hdrSz))
+    {
+        NbVfsCloseFile (fs, file);
+        NbShellWrite ("nexboot: unable to read file \"%s\"", name);
+        return NULL;
     }
+    if (size)
+        *size = file->size;
     NbVfsCloseFile (fs, file);
     return fileBase;
 }
 
+// Loads the kernel and returns its entry point
+// Segments are read straight into their pages, unless the kernel is compressed and has to be
+// read in whole first
+static uintptr_t osLoadKernel (NbObject_t* fs, const char* name)
+{
+    NbFile_t* file = NbShellOpenFile (fs, name);
+    if (!file)
+    {
+        NbShellWrite ("nexboot: unable to open file \"%s\"\n", name);
+        return 0;
+    }
+    uint8_t hdr[NB_LZ4_HDR_MIN];
+    if (file->size >= NB_LZ4_HDR_MIN && osRead (fs, file, hdr, 6) && NbLz4HeaderSize (hdr))
+    {
+        NbVfsCloseFile (fs, file);
+        void* keFileBase = osReadFile (fs, false, name, NULL);
+        if (!keFileBase)
+            return 0;
+        return NbElfLoadFile (keFileBase);
+    }
+    NbShellWrite ("Loading %s...\n", name);
+    uintptr_t entry = NbElfLoadStream (fs, file);
+    NbVfsCloseFile (fs, file);
+    return entry;
+}
+
+// Ranks memory types, so that where entries overlap the more restrictive one wins
+static int osMemTypeRank (unsigned int type)
+{
+    switch (type)
+    {
+        case NEXBOOT_MEM_FREE:
+            return 0;
+        case NEXBOOT_MEM_BOOT_RECLAIM:
+            return 1;
+        case NEXBOOT_MEM_FW_RECLAIM:
+            return 2;
+        case NEXBOOT_MEM_ACPI_RECLAIM:
+            return 3;
+        case NEXBOOT_MEM_ACPI_NVS:
+            return 4;
+        case NEXBOOT_MEM_MMIO:
+            return 5;
+        default:
+            return 6;
+    }
+}
+
+// Sorts memory map by base, clips overlaps and joins neighbours of the same type
+// so the kernel can build its zones in one pass. map has room for maxEnts entries
+// Returns new number of entries
+static int osCleanMemMap (NbMemEntry_t* map, int numEnts, int maxEnts)
+{
+    // Drop empty entries and sort the rest. Maps are short, so an insertion sort does
+    int n = 0;
+    for (int i = 0; i < numEnts; ++i)
+    {
+        if (!map[i].sz)
+            continue;
+        NbMemEntry_t ent = map[i];
+        int j = n;
+        while (j && map[j - 1].base > ent.base)
+        {
+            map[j] = map[j - 1];
+            --j;
+        }
+        map[j] = ent;
+        ++n;
+    }
+    // Only the last entry written out can overlap the one being looked at
+    int out = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        NbMemEntry_t* cur = &map[i];
+        if (!cur->sz)
+            continue;
+        if (out)
+        {
+            NbMemEntry_t* prev = &map[out - 1];
+            uint64_t prevEnd = prev->base + prev->sz;
+            uint64_t curEnd = cur->base + cur->sz;
+            if (cur->base < prevEnd)
+            {
+                if (osMemTypeRank (prev->type) >= osMemTypeRank (cur->type))
+                {
+                    // Clip the start of this entry
+                    if (curEnd <= prevEnd)
+                        continue;
+                    cur->base = prevEnd;
+                    cur->sz = curEnd - prevEnd;
+                }
+                else
+                {
+                    // Cut the last entry short. If it goes on past this one, the rest of it
+                    // is put back in sorted order. Without room for that, the rest is dropped,
+                    // which is safe as it's the less restrictive type
+                    if (prevEnd > curEnd && n < maxEnts)
+                    {
+                        int j = n;
+                        while (j > (i + 1) && map[j - 1].base > curEnd)
+                        {
+                            map[j] = map[j - 1];
+                            --j;
+                        }
+                        map[j].base = curEnd;
+                        map[j].sz = prevEnd - curEnd;
+                        map[j].type = prev->type;
+                        map[j].flags = prev->flags;
+                        ++n;
+                    }
+                    prev->sz = cur->base - prev->base;
+                    if (!prev->sz)
+                        --out;
+                }
+            }
+        }
+        // Join it to the last entry if they're the same
+        if (out)
+        {
+            NbMemEntry_t* prev = &map[out - 1];
+            if (prev->type == cur->type && prev->flags == cur->flags &&
+                (prev->base + prev->sz) == cur->base)
+            {
+                prev->sz += cur->sz;
+                continue;
+            }
+        }
+        map[out++] = *cur;
+    }
+    return out;
+}
+
 bool NbOsBootNexNix (NbOsInfo_t* info)
 {
     // Sanitize input
@@ -83,10 +345,11 @@ bool NbOsBootNexNix (NbOsInfo_t* info)
                   NEXBOOT_LOGLEVEL_DEBUG,
                   NbObjGetPath (fs, rootFsBuf, 128),
                   StrRefGet (info->payload));
-    // Read in kernel file
-    void* keFileBase = osReadFile (fs, false, StrRefGet (info->payload));
-    if (!keFileBase)
+    // Load up the kernel into memory
+    uintptr_t entry = osLoadKernel (fs, StrRefGet (info->payload));
+    if (!entry)
         return false;
+    NbBootStamp (NEXBOOT_STAMP_KERNEL);
     // Initialize boot info struct
     NexNixBoot_t* bootInfo = malloc (sizeof (NexNixBoot_t));
     memset (bootInfo, 0, sizeof (NexNixBoot_t));
@@ -126,23 +389,32 @@ bool NbOsBootNexNix (NbOsInfo_t* info)
             // Grab the module path
             StringRef_t** ref = iter->ptr;
             const char* mod = StrRefGet (*ref);
-            // Read the file
-            bootInfo->mods[bootInfo->numMods] = osReadFile (fs, true, mod);
-            if (!bootInfo->mods[bootInfo->numMods])
+            if (bootInfo->numMods == NEXBOOT_MOD_MAX)
+            {
+                NbShellWrite ("nexboot: too many modules\n");
+                return false;
+            }
+            // Read the file. Persistent pages are page aligned and nexboot maps them
+            // one to one, so the base is the physical address the kernel needs
+            NexNixMod_t* modInfo = &bootInfo->modInfo[bootInfo->numMods];
+            void* modBase = osReadFile (fs, true, mod, &modInfo->size);
+            if (!modBase)
             {
                 // Error occured
                 return false;
             }
+            bootInfo->mods[bootInfo->numMods] = modBase;
+            modInfo->base = (uintptr_t) modBase;
+            snprintf (modInfo->name, sizeof (modInfo->name), "%s", mod);
+            ++bootInfo->numMods;
             iter = ArrayIterate (info->mods, iter);
         }
     }
+    NbBootStamp (NEXBOOT_STAMP_MODS);
     // Copy arguments
     strcpy (bootInfo->args, StrRefGet (info->args));
     // We have now reached that point in loading.
-    // It's time to launch the kernel. First, however, we must map the kernel
-    // into the address space.
-    // Load up the kernel into memory
-    uintptr_t entry = NbElfLoadFile (keFileBase);
+    // It's time to launch the kernel
     // Allocate a boot stack
     int stackPages = NEXBOOT_STACK_SIZE / NEXBOOT_CPU_PAGE_SIZE;
     uintptr_t stack = NbFwAllocPersistentPages (stackPages);
@@ -161,16 +433,21 @@ bool NbOsBootNexNix (NbOsInfo_t* info)
     // are finished allocating memory. However we need to allocate memory for the map in a tricky
     // spot (at least on EFI) Here we go by the current map size but add on an additional page to
     // account for additional map entries that may be created
-    void* memMapBuf = (void*) NbFwAllocPages (
-        ((bootInfo->mapSize * sizeof (NbMemEntry_t) + (NEXBOOT_CPU_PAGE_SIZE - 1)) /
-         NEXBOOT_CPU_PAGE_SIZE) +
-        1);
+    int memMapPages = ((bootInfo->mapSize * sizeof (NbMemEntry_t) + (NEXBOOT_CPU_PAGE_SIZE - 1)) /
+                       NEXBOOT_CPU_PAGE_SIZE) +
+                      1;
+    void* memMapBuf = (void*) NbFwAllocPages (memMapPages);
     // Map in firmware-dictated memory regions
     NbFwMapRegions (bootInfo->memMap, bootInfo->mapSize);
     // Re-make memory map in case above function changed it
     void* memMap = NbGetMemMap (&bootInfo->mapSize);
     memcpy (memMapBuf, memMap, (bootInfo->mapSize * sizeof (NbMemEntry_t)));
     bootInfo->memMap = memMapBuf;
+    // Hand over a sorted map without overlaps, so the kernel doesn't have to sort it out
+    bootInfo->mapSize = osCleanMemMap (bootInfo->memMap,
+                                       bootInfo->mapSize,
+                                       (memMapPages * NEXBOOT_CPU_PAGE_SIZE) /
+                                           sizeof (NbMemEntry_t));
     // Find primary display
     NbObject_t* displayIter = NULL;
     bool foundDisplay = false;
@@ -190,6 +467,8 @@ bool NbOsBootNexNix (NbOsInfo_t* info)
                       NEXBOOT_LOGLEVEL_DEBUG,
                       NbObjGetPath (displayIter, buf, 128));
         NbDisplayDev_t* display = NbObjGetData (displayIter);
+        // Kernel expects the display to start at the front buffer's base
+        NbObjCallSvc (displayIter, NB_DISPLAY_UNMAPFB, NULL);
         // Copy fields
         bootInfo->displayDefault = false;
         bootInfo->display.width = display->width;
@@ -212,6 +491,8 @@ bool NbOsBootNexNix (NbOsInfo_t* info)
     NbFwExit();
     // Enable paging
     NbCpuEnablePaging();
+    NbBootStamp (NEXBOOT_STAMP_HANDOFF);
+    NbGetBootStamps (bootInfo->stamps);
     // Launch the kernel
     NbCpuLaunchKernel (entry, (uintptr_t) bootInfo);
     return false;
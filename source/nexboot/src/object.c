@@ -20,16 +20,37 @@
 #include <nexboot/nexboot.h>
 #include <string.h>
 
+// Directories hash their children by name, and whole paths that were found are cached, so
+// finding an object doesn't walk every directory on the way to it
+// Only paths that were found are cached, so adding an object can't make an entry wrong. Removing
+// one throws the whole cache out
+
+#define OBJDIR_HASH_SZ 16     // Buckets in a directory, must be a power of 2
+#define OBJ_PATH_CACHE 64     // Paths that are cached, must be a power of 2
+#define OBJ_PATH_MAX   128    // Longest path that can be cached
+
 // Object data structure
 typedef struct _objDir
 {
-    int childCount;           /// Number of child objects
-    NbObject_t* childList;    /// List of children
+    int childCount;                           /// Number of child objects
+    NbObject_t* childList;                    /// List of children
+    NbObject_t* childHash[OBJDIR_HASH_SZ];    /// Children by hash of name
 } objDir_t;
 
+// Cached path
+typedef struct _objpath
+{
+    uint32_t hash;              // Hash of path
+    NbObject_t* obj;            // Object at path, NULL if entry is empty
+    char path[OBJ_PATH_MAX];    // Path that was found
+} objPath_t;
+
 // Root directory pointer
 static NbObject_t* rootDir = NULL;
 
+// Path cache, indexed by hash of path
+static objPath_t objPathCache[OBJ_PATH_CACHE] = {0};
+
 extern NbObjSvcTab_t objDirSvcs;
 
 // Pathname parser
@@ -59,6 +80,18 @@ static void _parsePath (pathPart_t* part)
         part->isLastPart = true;
 }
 
+// Hashes a name or path
+static uint32_t objHashName (const char* name)
+{
+    uint32_t hash = 2166136261U;
+    while (*name)
+    {
+        hash ^= (uint8_t) *name++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
 // Gets base name of path
 static const char* _basename (const char* name)
 {
@@ -72,43 +105,23 @@ static const char* _basename (const char* name)
 // Inserts an object in the tree
 static bool nbInsertObj (const char* name, NbObject_t* obj)
 {
-    // Parse the path
-    pathPart_t part;
-    memset (&part, 0, sizeof (pathPart_t));
-    part.oldName = name;
-    bool finished = false;
-    NbObject_t* curDir = rootDir;
-    while (!finished)
-    {
-        _parsePath (&part);
-        // If this is not the last component, then find next component in directory
-        if (!part.isLastPart)
-        {
-            // Make sure this is a directory
-            if (curDir->type != OBJ_TYPE_DIR)
-            {
-                // That's an error
-                return false;
-            }
-            ObjDirOp_t op;
-            op.name = part.name;
-            bool res = NbObjCallSvc (curDir, OBJDIR_FIND_CHILD, &op);
-            if (!res)
-            {
-                // Directory part doesn't exist, that's an error
-                return false;
-            }
-            curDir = op.foundObj;
-        }
-        else
-        {
-            // Add to curDir
-            ObjDirOp_t op;
-            op.obj = obj;
-            NbObjCallSvc (curDir, OBJDIR_ADD_CHILD, &op);
-            finished = true;
-        }
-    }
+    // Find the directory it goes in
+    const char* base = _basename (name);
+    size_t dirLen = base - name;
+    char dirPath[OBJ_PATH_MAX];
+    if (dirLen >= OBJ_PATH_MAX)
+        return false;
+    memcpy (dirPath, name, dirLen);
+    // Strip trailing slash, unless it's the root
+    dirPath[(dirLen > 1) ? dirLen - 1 : dirLen] = 0;
+    NbObject_t* curDir = NbObjFind (dirPath);
+    // Make sure this is a directory
+    if (!curDir || curDir->type != OBJ_TYPE_DIR)
+        return false;
+    // Add to curDir
+    ObjDirOp_t op;
+    op.obj = obj;
+    NbObjCallSvc (curDir, OBJDIR_ADD_CHILD, &op);
     return true;
 }
 
@@ -151,6 +164,11 @@ NbObject_t* NbObjFind (const char* name)
     // Edge case: if name is "/", return rootDir
     if (!strcmp (name, "/"))
         return rootDir;
+    // Check the path cache
+    uint32_t hash = objHashName (name);
+    objPath_t* cacheEnt = &objPathCache[hash & (OBJ_PATH_CACHE - 1)];
+    if (cacheEnt->obj && cacheEnt->hash == hash && !strcmp (cacheEnt->path, name))
+        return cacheEnt->obj;
     // Parse path into components
     pathPart_t part;
     memset (&part, 0, sizeof (pathPart_t));
@@ -166,7 +184,15 @@ NbObject_t* NbObjFind (const char* name)
         if (!res)
             return NULL;    // Object doesn't exist
         if (part.isLastPart)
+        {
+            if (strlen (name) < OBJ_PATH_MAX)
+            {
+                cacheEnt->hash = hash;
+                cacheEnt->obj = op.foundObj;
+                strcpy (cacheEnt->path, name);
+            }
             return op.foundObj;
+        }
         curDir = op.foundObj;
     }
 }
@@ -199,7 +225,7 @@ void NbObjDeRef (NbObject_t* obj)
 bool NbObjCallSvc (NbObject_t* obj, int svc, void* svcArgs)
 {
     assert (obj);
-    if (svc >= obj->numSvcs)
+    if (svc >= obj->numSvcs || !obj->services[svc])
         return false;
     return obj->services[svc](obj, svcArgs);
 }
@@ -256,8 +282,7 @@ static bool nbObjDirInit (void* dirp, void* unused)
     objDir_t* dirData = (objDir_t*) malloc (sizeof (objDir_t));
     if (!dirData)
         return false;
-    dirData->childCount = 0;
-    dirData->childList = NULL;
+    memset (dirData, 0, sizeof (objDir_t));
     dir->data = dirData;
     return true;
 }
@@ -300,6 +325,11 @@ static bool nbObjAddChild (void* dirp, void* opp)
         dirData->childList->prevChild = obj;
     dirData->childList = obj;
     dirData->childCount++;
+    // Add to hash
+    obj->nameHash = objHashName (obj->name);
+    NbObject_t** bucket = &dirData->childHash[obj->nameHash & (OBJDIR_HASH_SZ - 1)];
+    obj->hashNext = *bucket;
+    *bucket = obj;
     // Set parent
     obj->parent = NbObjRef (dir);
     return true;
@@ -337,6 +367,13 @@ static bool nbObjRemoveChild (void* dirp, void* opp)
         obj->nextChild->prevChild = obj->prevChild;
     if (obj == dirData->childList)
         dirData->childList = obj->nextChild;
+    // Remove from hash
+    NbObject_t** prev = &dirData->childHash[obj->nameHash & (OBJDIR_HASH_SZ - 1)];
+    while (*prev != obj)
+        prev = &(*prev)->hashNext;
+    *prev = obj->hashNext;
+    // Paths to it or anything under it may be cached
+    memset (objPathCache, 0, sizeof (objPathCache));
     NbObjDeRef (obj->parent);
     dirData->childCount--;
     return true;
@@ -348,19 +385,20 @@ static bool nbObjFindChild (void* dirp, void* opp)
     NbObject_t* dir = dirp;
     ObjDirOp_t* op = opp;
     assert (dir && op);
-    // Get child list
+    // Get hash bucket
     objDir_t* dirData = dir->data;
-    NbObject_t* curChild = dirData->childList;
     const char* name = op->name;
+    uint32_t hash = objHashName (name);
+    NbObject_t* curChild = dirData->childHash[hash & (OBJDIR_HASH_SZ - 1)];
     while (curChild)
     {
         // Compare name
-        if (!strcmp (curChild->name, name))
+        if (curChild->nameHash == hash && !strcmp (curChild->name, name))
         {
             op->foundObj = curChild;
             return true;
         }
-        curChild = curChild->nextChild;
+        curChild = curChild->hashNext;
     }
     op->status = OBJDIR_ERR_OBJ_NOT_FOUND;
     return false;
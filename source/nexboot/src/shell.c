@@ -24,6 +24,7 @@
 #include <nexboot/nexboot.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // Terminal shell is run on
@@ -109,11 +110,11 @@ static NbObject_t* nbFindPrimaryTerm()
 // Contains printf out data
 typedef struct _printfOut
 {
-    int (*out) (struct _printfOut*, char);    // Function to be called
-    char* buf;                                // Buffer being written to
-    size_t bufSize;                           // Size of buffer
-    size_t bufPos;                            // Current position in buffer
-    int charsPrinted;                         // Number of characters printed
+    int (*out) (struct _printfOut*, const char*, size_t);    // Writes a span of characters
+    char* buf;                                               // Buffer being written to
+    size_t bufSize;                                          // Size of buffer
+    size_t bufPos;                                           // Current position in buffer
+    int charsPrinted;                                        // Number of characters printed
 } _printfOut_t;
 
 int vprintfCore (_printfOut_t* outData, const char* fmt, va_list ap);
@@ -137,17 +138,22 @@ static void nbEnableEcho()
 }
 
 // Printf out function NbShellWritePaged
-static int pagedOut (_printfOut_t* out, char c)
+static int pagedOut (_printfOut_t* out, const char* s, size_t len)
 {
-    if (shellTerm)
+    if (!shellTerm)
+        return 0;
+    for (size_t i = 0; i < len; ++i)
     {
+        char c = s[i];
         // Write it
         NbShellWriteChar (c);
         ++out->charsPrinted;
         // If we are on last row, prompt to stop
+        if (c != '\n')
+            continue;
         NbTerminal_t term;
         NbObjCallSvc (shellTerm, NB_TERMINAL_GETOPTS, &term);
-        if (term.row == (term.numRows - 1) && c == '\n')
+        if (term.row == (term.numRows - 1))
         {
             // We are on last row, prompt to continue
             NbShellWrite ("Press a key to continue...");
@@ -456,6 +462,17 @@ NbFile_t* NbShellOpenFile (NbObject_t* fs, const char* name)
     return NbVfsOpenFile (fs, path);
 }
 
+// Starts prefetching a file
+bool NbShellPrefetchFile (NbObject_t* fs, const char* name)
+{
+    if (*name == '/')
+        return NbVfsPrefetchFile (fs, name);
+    StringRef_t* path = NbShellGetFullPath (name);
+    bool res = NbVfsPrefetchFile (fs, StrRefGet (path));
+    StrRefDestroy (path);
+    return res;
+}
+
 // Gets file info
 bool NbShellGetFileInfo (NbObject_t* fs, const char* name, NbFileInfo_t* out)
 {
@@ -512,6 +529,31 @@ static void nbShellLoop()
     }
 }
 
+// Tries to load the blocks of confFile from its cache
+// Leaves confFile at the start if that doesn't work
+static ListHead_t* nbShellLoadCache (NbFile_t* confFile)
+{
+    NbObject_t* fs = confFile->fileSys;
+    NbFile_t* cacheFile = NbVfsOpenFile (fs, NEXBOOT_CONF_CACHE);
+    if (!cacheFile)
+        return NULL;
+    ListHead_t* blocks = NULL;
+    void* src = malloc (confFile->size + 1);
+    void* cache = malloc (cacheFile->size + 1);
+    if (src && cache &&
+        NbVfsReadFile (fs, confFile, src, confFile->size) == (int32_t) confFile->size &&
+        NbVfsReadFile (fs, cacheFile, cache, cacheFile->size) == (int32_t) cacheFile->size)
+    {
+        blocks = NbConfLoadCache (cache, cacheFile->size, src, confFile->size);
+    }
+    free (src);
+    free (cache);
+    NbVfsCloseFile (fs, cacheFile);
+    if (!blocks)
+        NbVfsSeekFile (fs, confFile, 0, false);
+    return blocks;
+}
+
 // Main shell routine
 bool NbShellLaunch (NbFile_t* confFile)
 {
@@ -539,11 +581,15 @@ bool NbShellLaunch (NbFile_t* confFile)
     }
     else
     {
-        // Start up parser
-        ConfContext_t ctx = {0};
-        ctx.isFile = true;
-        ctx.confFile = confFile;
-        ListHead_t* blocks = NbConfParse (&ctx);
+        // Use the cache made when the image was built if it matches, otherwise parse
+        ListHead_t* blocks = nbShellLoadCache (confFile);
+        if (!blocks)
+        {
+            ConfContext_t ctx = {0};
+            ctx.isFile = true;
+            ctx.confFile = confFile;
+            blocks = NbConfParse (&ctx);
+        }
         // Launch the shell loop if an error occured
         if (!blocks)
             nbShellLoop();
@@ -29,6 +29,75 @@ extern NbDriver_t textUiDrv;
 
 #define TEXTUI_BKGD_COLOR NB_UI_COLOR_BLACK
 
+// Drawing goes into a grid of the cells we want on screen, and each draw is flushed by
+// comparing that against a grid of what's already there. Only cells that changed are sent to
+// the console, as runs of cells in the same colors, so moving the menu highlight only redraws
+// the two entries it moved between
+
+// A cell on screen
+typedef struct _textUiCell
+{
+    char c;
+    int8_t fg;
+    int8_t bg;
+} NbTextUiCell_t;
+
+static NbTextUiCell_t* textUiCells = NULL;    // Cells we want
+static NbTextUiCell_t* textUiShown = NULL;    // Cells on screen
+static int* textUiDirtyStart = NULL;          // First changed column of each row
+static int* textUiDirtyEnd = NULL;            // Column past last changed one of each row
+static char* textUiSpanBuf = NULL;            // Characters of span being flushed
+
+// Colors cells are drawn in
+static int textUiFg = NB_UI_COLOR_WHITE;
+static int textUiBg = TEXTUI_BKGD_COLOR;
+
+// Colors set on console, -1 if unknown
+static int textUiConsFg = -1;
+static int textUiConsBg = -1;
+
+// Sets up the cell grids for a console that was just cleared
+static bool textUiInitCells (NbUi_t* ui)
+{
+    size_t numCells = ui->width * ui->height;
+    textUiCells = malloc (numCells * sizeof (NbTextUiCell_t));
+    textUiShown = malloc (numCells * sizeof (NbTextUiCell_t));
+    textUiDirtyStart = malloc (ui->height * sizeof (int));
+    textUiDirtyEnd = malloc (ui->height * sizeof (int));
+    textUiSpanBuf = malloc (ui->width);
+    if (!textUiCells || !textUiShown || !textUiDirtyStart || !textUiDirtyEnd || !textUiSpanBuf)
+        return false;
+    for (int i = 0; i < numCells; ++i)
+    {
+        textUiCells[i].c = ' ';
+        textUiCells[i].fg = NB_UI_COLOR_WHITE;
+        textUiCells[i].bg = TEXTUI_BKGD_COLOR;
+    }
+    memcpy (textUiShown, textUiCells, numCells * sizeof (NbTextUiCell_t));
+    for (int i = 0; i < ui->height; ++i)
+    {
+        textUiDirtyStart[i] = ui->width;
+        textUiDirtyEnd[i] = 0;
+    }
+    textUiConsFg = -1;
+    textUiConsBg = -1;
+    return true;
+}
+
+static void textUiFreeCells()
+{
+    free (textUiCells);
+    free (textUiShown);
+    free (textUiDirtyStart);
+    free (textUiDirtyEnd);
+    free (textUiSpanBuf);
+    textUiCells = NULL;
+    textUiShown = NULL;
+    textUiDirtyStart = NULL;
+    textUiDirtyEnd = NULL;
+    textUiSpanBuf = NULL;
+}
+
 // Text UI driver entry
 static bool TextUiEntry (int code, void* params)
 {
@@ -51,6 +120,12 @@ static bool TextUiEntry (int code, void* params)
             ui->width = consoleSz.cols;
             ui->root = NULL;
             ui->output = NbObjRef (console);
+            if (!textUiInitCells (ui))
+            {
+                textUiFreeCells();
+                free (ui);
+                return false;
+            }
             // Set owner
             NbObjNotify_t notify = {0};
             notify.code = NB_CONSOLE_NOTIFY_SETOWNER;
@@ -66,6 +141,7 @@ static bool TextUiEntry (int code, void* params)
             uiObj = NbObjCreate ("/Interfaces/TextUi", OBJ_TYPE_UI, OBJ_INTERFACE_TEXTUI);
             if (!uiObj)
             {
+                textUiFreeCells();
                 free (ui);
                 return false;
             }
@@ -83,6 +159,7 @@ static bool TextUiEntry (int code, void* params)
             NbObjCallSvc (ui->output, NB_CONSOLE_SET_BGCOLOR, (void*) NB_UI_COLOR_BLACK);
             NbObjCallSvc (ui->output, NB_CONSOLE_SET_FGCOLOR, (void*) NB_UI_COLOR_WHITE);
             ui->output = NULL;
+            textUiFreeCells();
             // Destroy object
             NbObjDeRef (uiObj);
             break;
@@ -101,22 +178,107 @@ static bool TextUiNotify (void* objp, void* params)
     return true;
 }
 
+// Checks if two cells look the same. The foreground of a space can't be seen
+static bool textUiCellsMatch (NbTextUiCell_t* a, NbTextUiCell_t* b)
+{
+    return a->c == b->c && a->bg == b->bg && (a->fg == b->fg || a->c == ' ');
+}
+
 static void textUiWriteChar (NbUi_t* ui, char c, int x, int y)
 {
-    NbPrintChar_t pc;
-    pc.c = c;
-    pc.col = x;
-    pc.row = y;
-    NbObjCallSvc (ui->output, NB_CONSOLE_PRINTCHAR, &pc);
+    if (x < 0 || y < 0 || x >= ui->width || y >= ui->height)
+        return;
+    NbTextUiCell_t* cell = &textUiCells[(y * ui->width) + x];
+    cell->c = c;
+    cell->fg = textUiFg;
+    cell->bg = textUiBg;
+    if (textUiCellsMatch (cell, &textUiShown[(y * ui->width) + x]))
+        return;
+    if (x < textUiDirtyStart[y])
+        textUiDirtyStart[y] = x;
+    if (x >= textUiDirtyEnd[y])
+        textUiDirtyEnd[y] = x + 1;
 }
 
 static void textUiSetColor (NbUi_t* ui, int fg, int bg)
 {
     if (bg != NB_UI_COLOR_TRANSPARENT)
-        NbObjCallSvc (ui->output, NB_CONSOLE_SET_BGCOLOR, (void*) bg);
+        textUiBg = bg;
     else
-        NbObjCallSvc (ui->output, NB_CONSOLE_SET_BGCOLOR, (void*) TEXTUI_BKGD_COLOR);
-    NbObjCallSvc (ui->output, NB_CONSOLE_SET_FGCOLOR, (void*) fg);
+        textUiBg = TEXTUI_BKGD_COLOR;
+    textUiFg = fg;
+}
+
+// Sends a run of cells in the same colors to the console
+static void textUiFlushSpan (NbUi_t* ui, int row, int start, int end)
+{
+    NbTextUiCell_t* cells = &textUiCells[row * ui->width];
+    if (cells[start].bg != textUiConsBg)
+    {
+        NbObjCallSvc (ui->output, NB_CONSOLE_SET_BGCOLOR, (void*) (int) cells[start].bg);
+        textUiConsBg = cells[start].bg;
+    }
+    if (cells[start].fg != textUiConsFg)
+    {
+        NbObjCallSvc (ui->output, NB_CONSOLE_SET_FGCOLOR, (void*) (int) cells[start].fg);
+        textUiConsFg = cells[start].fg;
+    }
+    for (int i = start; i < end; ++i)
+        textUiSpanBuf[i - start] = cells[i].c;
+    NbPrintSpan_t span;
+    span.col = start;
+    span.row = row;
+    span.s = textUiSpanBuf;
+    span.len = end - start;
+    if (!NbObjCallSvc (ui->output, NB_CONSOLE_PRINTSPAN, &span))
+    {
+        // Console can only print one character at a time
+        for (int i = start; i < end; ++i)
+        {
+            NbPrintChar_t pc;
+            pc.c = cells[i].c;
+            pc.col = i;
+            pc.row = row;
+            NbObjCallSvc (ui->output, NB_CONSOLE_PRINTCHAR, &pc);
+        }
+    }
+    memcpy (&textUiShown[(row * ui->width) + start],
+            &cells[start],
+            span.len * sizeof (NbTextUiCell_t));
+}
+
+// Sends changed cells to the console
+static void textUiFlush (NbUi_t* ui)
+{
+    for (int row = 0; row < ui->height; ++row)
+    {
+        NbTextUiCell_t* cells = &textUiCells[row * ui->width];
+        NbTextUiCell_t* shown = &textUiShown[row * ui->width];
+        int col = textUiDirtyStart[row];
+        int end = textUiDirtyEnd[row];
+        while (col < end)
+        {
+            // Skip cells that are already right
+            if (textUiCellsMatch (&cells[col], &shown[col]))
+            {
+                ++col;
+                continue;
+            }
+            // Find run of changed cells in the same colors. A space in the right background
+            // can go in any run, it's cheaper than starting another
+            int spanEnd = col + 1;
+            while (spanEnd < end && cells[spanEnd].bg == cells[col].bg &&
+                   (cells[spanEnd].fg == cells[col].fg || cells[spanEnd].c == ' ') &&
+                   !textUiCellsMatch (&cells[spanEnd], &shown[spanEnd]))
+            {
+                ++spanEnd;
+            }
+            textUiFlushSpan (ui, row, col, spanEnd);
+            col = spanEnd;
+        }
+        textUiDirtyStart[row] = ui->width;
+        textUiDirtyEnd[row] = 0;
+    }
 }
 
 static void textUiOverwriteElement (NbUi_t* ui, NbUiElement_t* elem)
@@ -209,6 +371,7 @@ static bool TextUiDrawElement (void* objp, void* param)
     }
     else
         return false;
+    textUiFlush (ui);
     elem->invalid = false;
     return true;
 }
@@ -219,6 +382,7 @@ static bool TextUiDestroyElement (void* objp, void* param)
     NbUi_t* ui = NbObjGetData (uiObj);
     NbUiElement_t* elem = param;
     textUiOverwriteElement (ui, elem);
+    textUiFlush (ui);
     return true;
 }
 
@@ -28,6 +28,39 @@ static int id = 0;
 
 #define BUFMAX 128
 
+// Prefetching
+// Files can be read ahead of being opened, a chunk at a time, while nexboot would otherwise sit
+// waiting. Reads of a prefetched file are served from memory as far as the prefetch got, and from
+// the disk after that. Pages can't be given back, so there's a cap on how much gets read ahead
+#define VFS_PREFETCH_MAX    16
+#define VFS_PREFETCH_CHUNK  0x10000      // Bytes read in each step
+#define VFS_PREFETCH_MAX_SZ 0x4000000    // Most bytes of pages used for prefetching
+
+typedef struct _prefetch
+{
+    NbObject_t* fs;             // Filesystem file is on
+    char name[VFS_NAME_MAX];    // Path of file
+    NbFile_t* file;             // File being read, NULL once it's all in
+    uint8_t* buf;               // Contents of file
+    uint32_t size;              // Size of file
+    uint32_t pos;               // Bytes read so far
+} NbPrefetch_t;
+
+static NbPrefetch_t vfsPrefetch[VFS_PREFETCH_MAX] = {0};
+static int vfsNumPrefetch = 0;
+static uint32_t vfsPrefetchSz = 0;    // Bytes of pages used so far
+
+// Finds what was prefetched of name on fs
+static NbPrefetch_t* vfsFindPrefetch (NbObject_t* fs, const char* name)
+{
+    for (int i = 0; i < vfsNumPrefetch; ++i)
+    {
+        if (vfsPrefetch[i].fs == fs && !strcmp (vfsPrefetch[i].name, name))
+            return &vfsPrefetch[i];
+    }
+    return NULL;
+}
+
 // Converts file system type to driver
 static int fsTypeToDriver (int type)
 {
@@ -132,6 +165,7 @@ static bool VfsFsOpenFile (void* obj, void* params)
         free (file);
         return false;
     }
+    file->prefetch = vfsFindPrefetch (fs, op->name);
     op->file = file;
     ListAddBack (filesys->files, file, file->fileId);
     return true;
@@ -191,39 +225,46 @@ static bool VfsFsReadFile (void* obj, void* params)
         op->bytesRead = 0;
         return true;
     }
-    // Get number of blocks to read
-    uint32_t numBlocks = (op->count + (fs->blockSz - 1)) / fs->blockSz;
-    for (int i = 0; i < numBlocks; ++i)
+    while (op->bytesRead < op->count && op->file->pos < op->file->size)
     {
-        // Read in block
-        if (!FsReadBlock (fs->driver, fsObj, op->file, op->file->pos))
-            return false;
-        // Figure out number of bytes to copy
+        // Figure out how much is left to read
+        uint32_t left = op->count - op->bytesRead;
+        if (left > (op->file->size - op->file->pos))
+            left = op->file->size - op->file->pos;
+        uint32_t base = op->file->pos % fs->blockSz;
         uint32_t bytesRead = 0;
-        uint32_t base = 0;
-        if ((op->file->pos + ((op->count > fs->blockSz) ? fs->blockSz : op->count)) >
-            op->file->size)
+        NbPrefetch_t* prefetch = op->file->prefetch;
+        if (prefetch && op->file->pos < prefetch->pos)
         {
-            bytesRead = op->file->size - op->file->pos;
+            // It was read ahead
+            bytesRead = prefetch->pos - op->file->pos;
+            if (bytesRead > left)
+                bytesRead = left;
+            memcpy (buf, prefetch->buf + op->file->pos, bytesRead);
+        }
+        else if (!base && left >= fs->blockSz)
+        {
+            // Whole blocks go straight into the caller's buffer, as many at once as the
+            // filesystem can find next to each other
+            uint32_t numBlocks =
+                FsReadBlocks (fs->driver, fsObj, op->file, op->file->pos, buf, left / fs->blockSz);
+            if (!numBlocks)
+                return false;
+            bytesRead = numBlocks * fs->blockSz;
         }
-        else if (fs->blockSz > op->count)
-            bytesRead = op->count;
         else
         {
-            bytesRead = fs->blockSz;
-            // Check if file position is block aligned, and correct it if not
-            if (op->file->pos % fs->blockSz)
-                bytesRead -= op->file->pos % fs->blockSz;
+            // Read in block and copy out the part we want
+            if (!FsReadBlock (fs->driver, fsObj, op->file, op->file->pos))
+                return false;
+            bytesRead = fs->blockSz - base;
+            if (bytesRead > left)
+                bytesRead = left;
+            memcpy (buf, op->file->blockBuf + base, bytesRead);
         }
-        base += op->file->pos % fs->blockSz;
-        // Copy them to buffer
-        memcpy (buf, op->file->blockBuf + base, bytesRead);
         buf += bytesRead;
         op->bytesRead += bytesRead;
         op->file->pos += bytesRead;
-        // If we didn't read in a full block, than don't go to next block
-        if (bytesRead != fs->blockSz)
-            break;
     }
     return true;
 }
@@ -232,6 +273,8 @@ static bool VfsFsReadFile (void* obj, void* params)
 bool NbVfsUnmount (NbObject_t* fsObj)
 {
     NbFileSys_t* fs = NbObjGetData (fsObj);
+    // Prefetches hold files open
+    NbVfsDropPrefetch();
     // Close all open files
     ListEntry_t* curFile = ListFront (fs->files);
     while (curFile)
@@ -364,3 +407,70 @@ bool NbVfsReadDir (NbObject_t* fs, NbDirIter_t* iter)
 {
     return NbObjCallSvc (fs, NB_VFS_READ_DIR, iter);
 }
+
+// Starts reading a file ahead of time
+bool NbVfsPrefetchFile (NbObject_t* fs, const char* name)
+{
+    if (vfsNumPrefetch == VFS_PREFETCH_MAX || vfsFindPrefetch (fs, name))
+        return false;
+    NbFile_t* file = NbVfsOpenFile (fs, name);
+    if (!file)
+        return false;
+    int numPages = (file->size + (NEXBOOT_CPU_PAGE_SIZE - 1)) / NEXBOOT_CPU_PAGE_SIZE;
+    uint32_t sz = numPages * NEXBOOT_CPU_PAGE_SIZE;
+    uint8_t* buf = NULL;
+    if (!numPages || sz > (VFS_PREFETCH_MAX_SZ - vfsPrefetchSz) ||
+        !(buf = (uint8_t*) NbFwAllocPages (numPages)))
+    {
+        NbVfsCloseFile (fs, file);
+        return false;
+    }
+    vfsPrefetchSz += sz;
+    NbPrefetch_t* prefetch = &vfsPrefetch[vfsNumPrefetch++];
+    prefetch->fs = fs;
+    strcpy (prefetch->name, name);
+    prefetch->file = file;
+    prefetch->buf = buf;
+    prefetch->size = file->size;
+    prefetch->pos = 0;
+    return true;
+}
+
+// Reads the next chunk of prefetched files
+bool NbVfsPrefetchStep()
+{
+    for (int i = 0; i < vfsNumPrefetch; ++i)
+    {
+        NbPrefetch_t* prefetch = &vfsPrefetch[i];
+        if (!prefetch->file)
+            continue;
+        uint32_t chunk = prefetch->size - prefetch->pos;
+        if (chunk > VFS_PREFETCH_CHUNK)
+            chunk = VFS_PREFETCH_CHUNK;
+        int32_t bytesRead =
+            NbVfsReadFile (prefetch->fs, prefetch->file, prefetch->buf + prefetch->pos, chunk);
+        if (bytesRead > 0)
+            prefetch->pos += bytesRead;
+        // On errors, whatever is left gets read when the file is
+        if (bytesRead <= 0 || prefetch->pos == prefetch->size)
+        {
+            NbVfsCloseFile (prefetch->fs, prefetch->file);
+            prefetch->file = NULL;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Stops prefetching
+void NbVfsDropPrefetch()
+{
+    for (int i = 0; i < vfsNumPrefetch; ++i)
+    {
+        if (vfsPrefetch[i].file)
+            NbVfsCloseFile (vfsPrefetch[i].fs, vfsPrefetch[i].file);
+    }
+    // Files that are still open fall back to the disk
+    memset (vfsPrefetch, 0, sizeof (vfsPrefetch));
+    vfsNumPrefetch = 0;
+}
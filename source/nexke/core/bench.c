@@ -0,0 +1,388 @@
+/*
+    bench.c - contains kernel microbenchmarks
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/synch.h>
+#include <nexke/task.h>
+#include <string.h>
+
+// Each benchmark fills a table of samples with the cycles a batch of operations took. Cheap
+// operations are timed in batches so reading the cycle counter doesn't swamp them, and ones
+// that involve another thread are timed one at a time
+// The cycle counter is checked against the platform clock before anything runs, so results
+// can be given in nanoseconds. Samples are sorted to get the percentiles
+//
+// Boot arguments:
+// -bench [name]  runs the named benchmark, or all of them, from the first thread
+
+#define NK_BENCH_SAMPLES 1024    // Samples each benchmark takes
+#define NK_BENCH_BATCH   16      // Operations in each sample of a cheap operation
+#define NK_BENCH_CAL_MS  10      // Milliseconds to check the cycle counter over
+
+// A benchmark
+typedef struct _nkbench
+{
+    const char* name;                 // Name to pick it with
+    const char* desc;                 // What each operation is
+    bool (*run) (uint64_t* samps);    // Fills in samples, returns false if it couldn't run
+    int ops;                          // Operations in each sample
+} nkBench_t;
+
+static uint64_t nkBenchSamps[NK_BENCH_SAMPLES];
+
+// State shared with partner threads
+static TskSemaphore_t nkBenchPing;
+static TskSemaphore_t nkBenchPong;
+static bool nkBenchStop = false;
+static uint64_t nkBenchStart = 0;    // Cycle count when work was submitted
+static uint64_t nkBenchLatency = 0;
+
+// Starts a partner thread
+static bool nkBenchStartPartner (NkThreadEntry entry, int cpuNum)
+{
+    NkThread_t* thread = TskCreateThread (entry,
+                                          NULL,
+                                          "bench partner",
+                                          TSK_POLICY_NORMAL,
+                                          TSK_PRIO_HIGH,
+                                          TSK_THREAD_SMALL_STACK);
+    if (!thread)
+        return false;
+    if (cpuNum != -1)
+        TskPinThread (thread, cpuNum);
+    TskStartThread (thread);
+    return true;
+}
+
+// Slab cache alloc and free
+static bool nkBenchSlab (uint64_t* samps)
+{
+    SlabCache_t* cache = MmCacheCreate (64, "bench", MM_TAG_CORE, 0, 0);
+    if (!cache)
+        return false;
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        uint64_t start = CpuGetCycles();
+        for (int j = 0; j < NK_BENCH_BATCH; ++j)
+            MmCacheFree (cache, MmCacheAlloc (cache));
+        samps[i] = CpuGetCycles() - start;
+    }
+    MmCacheDestroy (cache);
+    return true;
+}
+
+// Page alloc and free
+static bool nkBenchPage (uint64_t* samps)
+{
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        uint64_t start = CpuGetCycles();
+        for (int j = 0; j < NK_BENCH_BATCH; ++j)
+        {
+            MmPage_t* page = MmAllocPage();
+            if (!page)
+                return false;
+            MmFreePage (page);
+        }
+        samps[i] = CpuGetCycles() - start;
+    }
+    return true;
+}
+
+// Kernel virtual region alloc and free
+static bool nkBenchKv (uint64_t* samps)
+{
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        uint64_t start = CpuGetCycles();
+        for (int j = 0; j < NK_BENCH_BATCH; ++j)
+        {
+            void* mem = MmAllocKvRegion (1, 0);
+            if (!mem)
+                return false;
+            MmFreeKvRegion (mem);
+        }
+        samps[i] = CpuGetCycles() - start;
+    }
+    return true;
+}
+
+// Yields back and forth with us on our CPU
+static void nkBenchYieldPartner (void*)
+{
+    while (!__atomic_load_n (&nkBenchStop, __ATOMIC_RELAXED))
+        TskYield();
+    TskReleaseSemaphore (&nkBenchPong);
+    TskTerminateSelf (0);
+}
+
+// Context switch round trip
+static bool nkBenchYield (uint64_t* samps)
+{
+    NkThread_t* self = TskGetCurrentThread();
+    int prefCpu = -1;
+    long mask = TskGetThreadAffinity (self, &prefCpu);
+    int cpuNum = CpuGetCcb()->cpuNum;
+    TskPinThread (self, cpuNum);
+    nkBenchStop = false;
+    TskInitSemaphore (&nkBenchPong, 0);
+    if (!nkBenchStartPartner (nkBenchYieldPartner, cpuNum))
+    {
+        TskSetThreadAffinity (self, mask, prefCpu);
+        return false;
+    }
+    TskYield();
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        uint64_t start = CpuGetCycles();
+        for (int j = 0; j < NK_BENCH_BATCH; ++j)
+            TskYield();
+        samps[i] = CpuGetCycles() - start;
+    }
+    __atomic_store_n (&nkBenchStop, true, __ATOMIC_RELAXED);
+    TskAcquireSemaphore (&nkBenchPong);
+    TskSetThreadAffinity (self, mask, prefCpu);
+    return true;
+}
+
+// Uncontended mutex acquire and release
+static bool nkBenchMutex (uint64_t* samps)
+{
+    TskMutex_t mtx;
+    TskInitMutex (&mtx);
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        uint64_t start = CpuGetCycles();
+        for (int j = 0; j < NK_BENCH_BATCH; ++j)
+        {
+            TskAcquireMutex (&mtx);
+            TskReleaseMutex (&mtx);
+        }
+        samps[i] = CpuGetCycles() - start;
+    }
+    TskCloseMutex (&mtx);
+    return true;
+}
+
+// Hands the semaphore straight back
+static void nkBenchSemPartner (void*)
+{
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        TskAcquireSemaphore (&nkBenchPing);
+        TskReleaseSemaphore (&nkBenchPong);
+    }
+    TskTerminateSelf (0);
+}
+
+// Semaphore handoff round trip
+static bool nkBenchSem (uint64_t* samps)
+{
+    TskInitSemaphore (&nkBenchPing, 0);
+    TskInitSemaphore (&nkBenchPong, 0);
+    if (!nkBenchStartPartner (nkBenchSemPartner, -1))
+        return false;
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        uint64_t start = CpuGetCycles();
+        TskReleaseSemaphore (&nkBenchPing);
+        TskAcquireSemaphore (&nkBenchPong);
+        samps[i] = CpuGetCycles() - start;
+    }
+    return true;
+}
+
+// Never called, the event is always taken off first
+static void nkBenchTimerCb (NkTimeEvent_t*, void*)
+{
+}
+
+// Timer arm and cancel
+static bool nkBenchTimer (uint64_t* samps)
+{
+    NkTimeEvent_t* event = NkTimeNewEvent();
+    if (!event)
+        return false;
+    NkTimeSetCbEvent (event, nkBenchTimerCb, NULL);
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        uint64_t start = CpuGetCycles();
+        for (int j = 0; j < NK_BENCH_BATCH; ++j)
+        {
+            NkTimeRegEvent (event, PLT_NS_IN_SEC, 0);
+            NkTimeDeRegEvent (event);
+        }
+        samps[i] = CpuGetCycles() - start;
+    }
+    NkTimeFreeEvent (event);
+    return true;
+}
+
+// Notes how long the work took to get to us
+static void nkBenchWorkCb (NkWorkItem_t*)
+{
+    nkBenchLatency = CpuGetCycles() - nkBenchStart;
+    TskReleaseSemaphore (&nkBenchPong);
+}
+
+// Work queue submit to callback latency
+static bool nkBenchWork (uint64_t* samps)
+{
+    NkWorkQueue_t* queue = NkWorkQueueCreate (nkBenchWorkCb, NK_WORK_DEMAND, 0, TSK_PRIO_HIGH, 1);
+    if (!queue)
+        return false;
+    TskInitSemaphore (&nkBenchPong, 0);
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        nkBenchStart = CpuGetCycles();
+        if (!NkWorkQueueSubmit (queue, NULL))
+        {
+            NkWorkQueueDestroy (queue);
+            return false;
+        }
+        TskAcquireSemaphore (&nkBenchPong);
+        samps[i] = nkBenchLatency;
+    }
+    NkWorkQueueDestroy (queue);
+    return true;
+}
+
+// Demand page fault
+static bool nkBenchFault (uint64_t* samps)
+{
+    volatile char* mem = MmAllocKvRegion (NK_BENCH_SAMPLES, 0);
+    if (!mem)
+        return false;
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+    {
+        uint64_t start = CpuGetCycles();
+        mem[(size_t) i << NEXKE_CPU_PAGE_SHIFT] = 0;
+        samps[i] = CpuGetCycles() - start;
+    }
+    MmFreeKvRegion ((void*) mem);
+    return true;
+}
+
+static nkBench_t nkBenches[] = {
+    {"slab",  "cache alloc and free",         nkBenchSlab,  NK_BENCH_BATCH},
+    {"page",  "page alloc and free",          nkBenchPage,  NK_BENCH_BATCH},
+    {"kv",    "kernel region alloc and free", nkBenchKv,    NK_BENCH_BATCH},
+    {"yield", "yield round trip",             nkBenchYield, NK_BENCH_BATCH},
+    {"mutex", "mutex acquire and release",    nkBenchMutex, NK_BENCH_BATCH},
+    {"sem",   "semaphore handoff round trip", nkBenchSem,   1             },
+    {"timer", "timer arm and cancel",         nkBenchTimer, NK_BENCH_BATCH},
+    {"work",  "work submit latency",          nkBenchWork,  1             },
+    {"fault", "demand page fault",            nkBenchFault, 1             },
+};
+
+// Sorts samples
+// Shell sort, as there's no qsort in the kernel
+static void nkBenchSort (uint64_t* samps, int count)
+{
+    for (int gap = count / 2; gap > 0; gap /= 2)
+    {
+        for (int i = gap; i < count; ++i)
+        {
+            uint64_t samp = samps[i];
+            int j = i;
+            for (; j >= gap && samps[j - gap] > samp; j -= gap)
+                samps[j] = samps[j - gap];
+            samps[j] = samp;
+        }
+    }
+}
+
+// Finds how many cycles go by in a millisecond
+static uint64_t nkBenchCalibrate()
+{
+    PltHwClock_t* clock = PltGetPlatform()->clock;
+    if (!clock)
+        return 0;
+    ktime_t start = clock->getTime();
+    uint64_t startCycles = CpuGetCycles();
+    ktime_t elapsed = 0;
+    while (elapsed < (ktime_t) NK_BENCH_CAL_MS * 1000000)
+        elapsed = clock->getTime() - start;
+    return ((CpuGetCycles() - startCycles) * 1000000) / elapsed;
+}
+
+// Turns cycles for a sample into nanoseconds per operation, or cycles if the rate is unknown
+static uint64_t nkBenchPerOp (uint64_t cycles, int ops, uint64_t perMs)
+{
+    if (!perMs)
+        return cycles / ops;
+    return (cycles * 1000000) / (perMs * ops);
+}
+
+// Runs a benchmark and logs the results
+static void nkBenchRun (nkBench_t* bench, uint64_t perMs)
+{
+    if (!bench->run (nkBenchSamps))
+    {
+        NkLogWarning ("nexke: warning: benchmark %s couldn't run\n", bench->name);
+        return;
+    }
+    nkBenchSort (nkBenchSamps, NK_BENCH_SAMPLES);
+    uint64_t total = 0;
+    for (int i = 0; i < NK_BENCH_SAMPLES; ++i)
+        total += nkBenchSamps[i];
+    NkLogInfo ("nexke: bench %s: %s, %d ops\n",
+               bench->name,
+               bench->desc,
+               NK_BENCH_SAMPLES * bench->ops);
+    NkLogInfo ("  mean %llu  min %llu  p50 %llu  p90 %llu  p99 %llu  max %llu %s\n",
+               (unsigned long long) nkBenchPerOp (total / NK_BENCH_SAMPLES, bench->ops, perMs),
+               (unsigned long long) nkBenchPerOp (nkBenchSamps[0], bench->ops, perMs),
+               (unsigned long long) nkBenchPerOp (nkBenchSamps[NK_BENCH_SAMPLES / 2],
+                                                  bench->ops,
+                                                  perMs),
+               (unsigned long long) nkBenchPerOp (nkBenchSamps[(NK_BENCH_SAMPLES * 90) / 100],
+                                                  bench->ops,
+                                                  perMs),
+               (unsigned long long) nkBenchPerOp (nkBenchSamps[(NK_BENCH_SAMPLES * 99) / 100],
+                                                  bench->ops,
+                                                  perMs),
+               (unsigned long long) nkBenchPerOp (nkBenchSamps[NK_BENCH_SAMPLES - 1],
+                                                  bench->ops,
+                                                  perMs),
+               (perMs) ? "ns/op" : "cycles/op");
+}
+
+// Runs the benchmarks asked for on the command line
+void NkRunBench()
+{
+    const char* arg = NkReadArg ("-bench");
+    if (!arg)
+        return;
+    bool all = !*arg || !strcmp (arg, "all");
+    uint64_t perMs = nkBenchCalibrate();
+    bool found = false;
+    for (int i = 0; i < sizeof (nkBenches) / sizeof (nkBench_t); ++i)
+    {
+        if (!all && strcmp (arg, nkBenches[i].name) != 0)
+            continue;
+        nkBenchRun (&nkBenches[i], perMs);
+        found = true;
+    }
+    if (!found)
+        NkLogWarning ("nexke: warning: no benchmark named %s\n", arg);
+    // Let scripts watching the log know they've seen everything
+    NkLogInfo ("nexke: bench done\n");
+}
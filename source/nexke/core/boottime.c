@@ -0,0 +1,139 @@
+/*
+    boottime.c - contains boot timeline
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexboot.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+
+// Each init phase stamps the cycle count when it's done, following the stamps nexboot took of
+// its own stages. Stamping has to work before there's memory or a clock, so stamps go in a
+// fixed table, and are only turned into time when they're logged
+// The cycle counter isn't calibrated that early either. Instead, the first stamp taken once
+// there's a clock also reads the clock, and the dump compares the two against a later reading
+// Stamps count from when the counter was reset, so the first one includes firmware time
+//
+// Boot arguments:
+// -boottime  logs the boot timeline once the first thread is up
+
+#define NK_BOOT_STAMPS 32    // Stamps the kernel can take
+
+// A stamp
+typedef struct _nkbootstamp
+{
+    const char* phase;    // Phase that was done
+    uint64_t cycles;      // Cycle count when it was
+} nkBootStamp_t;
+
+static nkBootStamp_t nkBootStamps[NK_BOOT_STAMPS] = {0};
+static int nkNumBootStamps = 0;    // Slots taken, may go past the end
+
+// Cycle count and clock time read together, to find the rate of the cycle counter
+static uint64_t nkBootRefCycles = 0;
+static ktime_t nkBootRefTime = 0;
+
+// Names of nexboot's stages
+static const char* nkBootNbNames[] = {"firmware",
+                                      "nexboot drivers",
+                                      "nexboot configuration",
+                                      "nexboot kernel load",
+                                      "nexboot module load",
+                                      "nexboot handoff"};
+
+// Records that phase is done
+// Steps of the init graph stamp from whatever CPU they ran on, so slots are claimed atomically
+void NkBootStamp (const char* phase)
+{
+    uint64_t cycles = CpuGetCycles();
+    int slot = __atomic_fetch_add (&nkNumBootStamps, 1, __ATOMIC_RELAXED);
+    if (slot >= NK_BOOT_STAMPS)
+        return;
+    nkBootStamps[slot].phase = phase;
+    nkBootStamps[slot].cycles = cycles;
+    PltHwClock_t* clock = PltGetPlatform()->clock;
+    if (!nkBootRefCycles && clock)
+    {
+        nkBootRefTime = clock->getTime();
+        nkBootRefCycles = CpuGetCycles();
+    }
+}
+
+// Logs one line of the timeline
+static void nkBootLogStamp (const char* phase, uint64_t cycles, uint64_t last, uint64_t perMs)
+{
+    uint64_t delta = (cycles > last) ? cycles - last : 0;
+    if (!perMs)
+    {
+        NkLogInfo ("  %14llu  %14llu  %s\n",
+                   (unsigned long long) cycles,
+                   (unsigned long long) delta,
+                   phase);
+        return;
+    }
+    uint64_t us = (cycles * 1000) / perMs;
+    uint64_t deltaUs = (delta * 1000) / perMs;
+    NkLogInfo ("  %7llu.%03llu  +%6llu.%03llu  %s\n",
+               (unsigned long long) us / 1000,
+               (unsigned long long) us % 1000,
+               (unsigned long long) deltaUs / 1000,
+               (unsigned long long) deltaUs % 1000,
+               phase);
+}
+
+// Logs the boot timeline, if it was asked for
+void NkBootTimeDump()
+{
+    if (!NkReadArg ("-boottime"))
+        return;
+    // Find how many cycles go by in a millisecond
+    uint64_t perMs = 0;
+    PltHwClock_t* clock = PltGetPlatform()->clock;
+    if (nkBootRefCycles && clock)
+    {
+        ktime_t elapsed = clock->getTime() - nkBootRefTime;
+        uint64_t cycles = CpuGetCycles() - nkBootRefCycles;
+        if (elapsed)
+            perMs = (cycles * 1000000) / elapsed;
+    }
+    if (perMs)
+    {
+        NkLogInfo ("nexke: boot timeline, %llu cycles per ms\n", (unsigned long long) perMs);
+        NkLogInfo ("    time (ms)   phase (ms)  phase\n");
+    }
+    else
+    {
+        NkLogInfo ("nexke: boot timeline, cycle counter rate unknown\n");
+        NkLogInfo ("          cycles    phase cycles  phase\n");
+    }
+    uint64_t last = 0;
+    NexNixBoot_t* bootInfo = NkGetBootArgs();
+    for (int i = 0; i < NEXBOOT_STAMP_MAX; ++i)
+    {
+        if (!bootInfo->stamps[i])
+            continue;
+        nkBootLogStamp (nkBootNbNames[i], bootInfo->stamps[i], last, perMs);
+        last = bootInfo->stamps[i];
+    }
+    int numStamps = __atomic_load_n (&nkNumBootStamps, __ATOMIC_RELAXED);
+    if (numStamps > NK_BOOT_STAMPS)
+        numStamps = NK_BOOT_STAMPS;
+    for (int i = 0; i < numStamps; ++i)
+    {
+        nkBootLogStamp (nkBootStamps[i].phase, nkBootStamps[i].cycles, last, perMs);
+        last = nkBootStamps[i].cycles;
+    }
+}
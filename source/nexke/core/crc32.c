@@ -0,0 +1,102 @@
+/*
+    crc32.c - contains CRC32 routines
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/nexke.h>
+#include <string.h>
+
+// CRCs are worked out 8 bytes at a time with slicing tables. Table n holds the CRC of a byte
+// followed by n zero bytes, so each byte of a word is looked up on its own and the results are
+// XORed together. The CPU code swaps in versions that use its own instructions
+// Words are loaded little endian, which every CPU we run on is
+
+#define NK_CRC32_POLY  0xEDB88320    // IEEE 802.3, reflected
+#define NK_CRC32C_POLY 0x82F63B78    // Castagnoli, reflected
+#define NK_CRC_SLICES  8
+
+static uint32_t nkCrc32Tab[NK_CRC_SLICES][256];
+static uint32_t nkCrc32cTab[NK_CRC_SLICES][256];
+
+NK_STATIC_CALL_DEFINE (NkCrc32Update, NkCrcFn, NkCrc32Table);
+NK_STATIC_CALL_DEFINE (NkCrc32cUpdate, NkCrcFn, NkCrc32cTable);
+
+// Builds the slicing tables for poly
+static void nkCrcBuildTab (uint32_t tab[][256], uint32_t poly)
+{
+    for (int i = 0; i < 256; ++i)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j)
+            crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+        tab[0][i] = crc;
+    }
+    for (int i = 0; i < 256; ++i)
+    {
+        for (int j = 1; j < NK_CRC_SLICES; ++j)
+            tab[j][i] = (tab[j - 1][i] >> 8) ^ tab[0][tab[j - 1][i] & 0xFF];
+    }
+}
+
+// Updates crc with len bytes of buf using tab
+static uint32_t nkCrcSlice (uint32_t tab[][256], uint32_t crc, const uint8_t* buf, size_t len)
+{
+    while (len >= 8)
+    {
+        uint32_t lo, hi;
+        memcpy (&lo, buf, sizeof (uint32_t));
+        memcpy (&hi, buf + 4, sizeof (uint32_t));
+        lo ^= crc;
+        crc = tab[7][lo & 0xFF] ^ tab[6][(lo >> 8) & 0xFF] ^ tab[5][(lo >> 16) & 0xFF] ^
+              tab[4][lo >> 24] ^ tab[3][hi & 0xFF] ^ tab[2][(hi >> 8) & 0xFF] ^
+              tab[1][(hi >> 16) & 0xFF] ^ tab[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ tab[0][(crc ^ *buf++) & 0xFF];
+    return crc;
+}
+
+// Updates a raw IEEE CRC with tables
+uint32_t NkCrc32Table (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    return nkCrcSlice (nkCrc32Tab, crc, buf, len);
+}
+
+// Updates a raw Castagnoli CRC with tables
+uint32_t NkCrc32cTable (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    return nkCrcSlice (nkCrc32cTab, crc, buf, len);
+}
+
+// Computes the IEEE CRC32 of buf, continuing from crc
+uint32_t NkCrc32 (uint32_t crc, const void* buf, size_t len)
+{
+    return ~NK_STATIC_CALL (NkCrc32Update) (~crc, buf, len);
+}
+
+// Computes the Castagnoli CRC32 of buf, continuing from crc
+uint32_t NkCrc32c (uint32_t crc, const void* buf, size_t len)
+{
+    return ~NK_STATIC_CALL (NkCrc32cUpdate) (~crc, buf, len);
+}
+
+// Builds CRC tables
+void NkInitCrc()
+{
+    nkCrcBuildTab (nkCrc32Tab, NK_CRC32_POLY);
+    nkCrcBuildTab (nkCrc32cTab, NK_CRC32C_POLY);
+}
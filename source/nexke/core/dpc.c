@@ -0,0 +1,205 @@
+/*
+    dpc.c - contains deferred procedure calls
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/synch.h>
+#include <nexke/task.h>
+
+// DPCs are queued on the CPU that queues them, usually from an interrupt handler, and run once
+// that CPU gets back to IPL low with preemption enabled, either as the outermost interrupt returns
+// or when a thread lowers its IPL or re-enables preemption. They run with interrupts enabled and
+// preemption off, so they can't block, and anything they share with threads has to be protected
+// by raising IPL, as they never run while it's raised
+// A run only goes through so many of them. If that isn't enough, the CPU's DPC thread takes over
+// the backlog, so a flood of interrupts can't keep threads from running. Until it has caught up,
+// nothing else runs DPCs on that CPU
+
+// DPC budget
+#define NK_DPC_BUDGET 32                        // Most DPCs run at once
+#define NK_DPC_TIME   (PLT_NS_IN_SEC / 1000)    // Longest a run may go on for
+
+// DPC state of a CPU
+typedef struct _nkdpccpu
+{
+    NkDpc_t* head;              // Queued DPCs, oldest first
+    NkDpc_t* tail;              // Last queued DPC
+    bool active;                // Whether DPCs are being run on this CPU
+    bool deferred;              // Whether the thread has been left the backlog
+    NkThread_t* thread;         // Thread that takes over when there's too much to do
+    TskCondition_t cond;        // Condition the thread waits on
+    unsigned long long runs;    // Number of DPCs run
+    unsigned long long defers;  // Times work got deferred to the thread
+} __attribute__ ((aligned (64))) nkDpcCpu_t;
+
+static nkDpcCpu_t nkDpcCpus[NEXKE_MAX_CPUS] = {0};
+
+// Sets up a DPC
+void NkInitDpcObj (NkDpc_t* dpc, NkDpcCallback cb, void* arg)
+{
+    dpc->cb = cb;
+    dpc->arg = arg;
+    dpc->queued = false;
+    dpc->next = NULL;
+}
+
+// Queues a DPC on the current CPU
+bool NkQueueDpc (NkDpc_t* dpc)
+{
+    // Only this CPU touches its queue, so keeping interrupts out is enough
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    if (dpc->queued)
+    {
+        PltLowerIpl (ipl);
+        return false;
+    }
+    nkDpcCpu_t* cpu = &nkDpcCpus[CpuGetCcb()->cpuNum];
+    dpc->queued = true;
+    dpc->next = NULL;
+    if (cpu->tail)
+        cpu->tail->next = dpc;
+    else
+        cpu->head = dpc;
+    cpu->tail = dpc;
+    // If this gets us back to IPL low, it runs it
+    PltLowerIpl (ipl);
+    return true;
+}
+
+// Runs queued DPCs of cpu until the budget runs out
+// Called with preemption disabled. Returns true if some are left over
+static bool nkDpcRun (nkDpcCpu_t* cpu)
+{
+    cpu->active = true;
+    ktime_t deadline = PltGetPlatform()->clock->getTime() + NK_DPC_TIME;
+    for (int i = 0; i < NK_DPC_BUDGET; ++i)
+    {
+        CpuDisable();
+        NkDpc_t* dpc = cpu->head;
+        if (!dpc)
+        {
+            CpuEnable();
+            break;
+        }
+        cpu->head = dpc->next;
+        if (!cpu->head)
+            cpu->tail = NULL;
+        // Once it's off the queue it may be queued again, even by itself
+        dpc->queued = false;
+        CpuEnable();
+        dpc->cb (dpc, dpc->arg);
+        ++cpu->runs;
+        if (PltGetPlatform()->clock->getTime() >= deadline)
+            break;
+    }
+    cpu->active = false;
+    return __atomic_load_n (&cpu->head, __ATOMIC_RELAXED) != NULL;
+}
+
+// Runs DPCs of the current CPU if there are any
+// Called at IPL low, with nothing else held
+void NkDispatchDpcs()
+{
+    TskDisablePreempt();
+    nkDpcCpu_t* cpu = &nkDpcCpus[CpuGetCcb()->cpuNum];
+    // Interrupts that come in while we run DPCs come back here, so let them go
+    if (!__atomic_load_n (&cpu->head, __ATOMIC_RELAXED) || cpu->active || cpu->deferred)
+    {
+        TskEnablePreempt();
+        return;
+    }
+    if (nkDpcRun (cpu))
+    {
+        // Too much to do here, let the thread get to the rest
+        // If it isn't up yet, it looks at the queue as it starts
+        cpu->deferred = true;
+        ++cpu->defers;
+        if (__atomic_load_n (&cpu->thread, __ATOMIC_ACQUIRE))
+            TskBroadcastCondition (&cpu->cond);
+    }
+    TskEnablePreempt();
+}
+
+// DPC thread of a CPU
+static void nkDpcThread (void* arg)
+{
+    nkDpcCpu_t* cpu = arg;
+    for (;;)
+    {
+        // Run a budget at a time, letting everything else run in between
+        for (;;)
+        {
+            TskDisablePreempt();
+            bool left = nkDpcRun (cpu);
+            if (!left)
+            {
+                // Caught up, let DPCs run inline again
+                CpuDisable();
+                if (!cpu->head)
+                    cpu->deferred = false;
+                else
+                    left = true;
+                CpuEnable();
+            }
+            TskEnablePreempt();
+            if (!left)
+                break;
+            TskYield();
+        }
+        TskWaitCondition (&cpu->cond, NULL);
+        TskUnsetCondition (&cpu->cond);
+    }
+}
+
+// Sets up DPCs on a CPU
+void NkInitDpcCpu (NkCcb_t* ccb)
+{
+    nkDpcCpu_t* cpu = &nkDpcCpus[ccb->cpuNum];
+    TskInitCondition (&cpu->cond);
+    NkThread_t* thread = TskCreateThread (nkDpcThread,
+                                          cpu,
+                                          "NkDpcThread",
+                                          TSK_POLICY_NORMAL,
+                                          TSK_PRIO_KERNEL,
+                                          0);
+    if (!thread)
+        NkPanicOom();
+    TskPinThread (thread, ccb->cpuNum);
+    // Interrupts may already be queueing DPCs, so only let them see the thread once it's ready
+    __atomic_store_n (&cpu->thread, thread, __ATOMIC_RELEASE);
+    TskStartThread (thread);
+}
+
+// Initializes DPCs
+void NkInitDpc()
+{
+    NkInitDpcCpu (CpuGetCcb());
+}
+
+// Dumps DPC statistics
+void NkDumpDpcStats()
+{
+    NkLogDebug ("DPC statistics:\n");
+    for (int i = 0; i < NkGetNumCpus(); ++i)
+    {
+        NkLogDebug ("CPU %d: %llu DPCs run, deferred %llu times\n",
+                    i,
+                    nkDpcCpus[i].runs,
+                    nkDpcCpus[i].defers);
+    }
+}
@@ -35,6 +35,29 @@ static int rows = 0, cols = 0;
 
 static void* font = &fb_font;
 
+// Area of the screen that has changed since the framebuffer was last updated
+// Drawing only marks what it touches, and everything gets copied out at once at the end of a
+// write, since the framebuffer is slow to write to
+static int dirtyX0 = 0, dirtyY0 = 0, dirtyX1 = 0, dirtyY1 = 0;    // Empty if dirtyX1 is 0
+
+// Glyph cache
+// Each entry is a glyph already drawn out in the display's pixel format and colors, so drawing a
+// character is just copying its rows into the back buffer
+#define FB_GLYPH_CACHE_SIZE 128    // Must be a power of 2
+
+typedef struct _fbglyph
+{
+    bool valid;
+    uint16_t glyphIdx;          // Glyph in font
+    uint32_t fg, bg;            // Colors in display's format
+    uint8_t rows[16][8 * 4];    // Pixel rows
+} fbGlyph_t;
+
+static fbGlyph_t glyphCache[FB_GLYPH_CACHE_SIZE] = {0};
+
+// Foreground color in display's format
+static uint32_t fgPxColor = 0;
+
 // Color macros
 #define COLOR_BLACK   0
 #define COLOR_WHITE32 0xD3D3D3
@@ -101,6 +124,18 @@ void NkFbConsInit()
     }
     display->backBufferLoc = display->backBuffer;
     memcpy (display->frameBuffer, display->backBuffer, display->lfbSize);
+    // Get color info
+    uint8_t r, g, b;
+    if (display->bpp == 32)
+    {
+        DISPLAY_DECOMPOSE_RGB (COLOR_WHITE32, r, g, b);
+        fgPxColor = DISPLAY_COMPOSE_RGB (display, r, g, b);
+    }
+    else if (display->bpp == 16)
+    {
+        DISPLAY_DECOMPOSE_RGB16 (COLOR_WHITE16, r, g, b);
+        fgPxColor = DISPLAY_COMPOSE_RGB (display, r, g, b);
+    }
 }
 
 // Remaps framebuffer to WC
@@ -137,8 +172,20 @@ static void fbInvalidate (int x, int y, int width, int height)
         size_t diff = backBuf - backBufEnd;
         backBuf = display->backBuffer + diff;
     }
-    // Go through each line in region
     void* front = display->frameBuffer + startLoc;
+    // Whole lines are contiguous in both buffers, so they can go in one copy per side of the back
+    // buffer's wrap
+    if (x == 0 && width == display->width)
+    {
+        size_t size = height * display->bytesPerLine;
+        size_t firstSize = backBufEnd - backBuf;
+        if (firstSize > size)
+            firstSize = size;
+        memcpy (front, backBuf, firstSize);
+        memcpy (front + firstSize, display->backBuffer, size - firstSize);
+        return;
+    }
+    // Go through each line in region
     for (int i = 0; i < height; ++i)
     {
         if (backBuf >= backBufEnd)
@@ -155,6 +202,34 @@ static void fbInvalidate (int x, int y, int width, int height)
     }
 }
 
+// Marks an area as changed
+static void fbDamage (int x, int y, int width, int height)
+{
+    if (!dirtyX1)
+    {
+        dirtyX0 = x, dirtyY0 = y;
+        dirtyX1 = x + width, dirtyY1 = y + height;
+        return;
+    }
+    if (x < dirtyX0)
+        dirtyX0 = x;
+    if (y < dirtyY0)
+        dirtyY0 = y;
+    if (x + width > dirtyX1)
+        dirtyX1 = x + width;
+    if (y + height > dirtyY1)
+        dirtyY1 = y + height;
+}
+
+// Copies changed area to the framebuffer
+static void fbFlush()
+{
+    if (!dirtyX1)
+        return;
+    fbInvalidate (dirtyX0, dirtyY0, dirtyX1 - dirtyX0, dirtyY1 - dirtyY0);
+    dirtyX0 = dirtyY0 = dirtyX1 = dirtyY1 = 0;
+}
+
 static void fbIncRender()
 {
     // Update back buffer by a line
@@ -168,31 +243,38 @@ static void fbIncRender()
     }
 }
 
-static void fbConsWriteChar (char c, int col, int row)
+// Gets glyph glyphIdx drawn in fg and bg
+static fbGlyph_t* fbGetGlyph (uint16_t glyphIdx, uint32_t fg, uint32_t bg)
 {
-    // Get color info
-    uint32_t pxColor = 0;
-    if (display->bpp == 32)
-    {
-        uint32_t pxColorTmp = COLOR_WHITE32;
-        uint8_t r, g, b;
-        DISPLAY_DECOMPOSE_RGB (pxColorTmp, r, g, b);
-        pxColor = DISPLAY_COMPOSE_RGB (display, r, g, b);
-    }
-    else if (display->bpp == 16)
+    fbGlyph_t* ent = &glyphCache[(glyphIdx + fg + bg) & (FB_GLYPH_CACHE_SIZE - 1)];
+    if (ent->valid && ent->glyphIdx == glyphIdx && ent->fg == fg && ent->bg == bg)
+        return ent;
+    // Draw it out from the font
+    uint8_t* glyph = font + (glyphIdx * 16);
+    for (int y = 0; y < 16; ++y)
     {
-        uint16_t pxColorTmp = COLOR_WHITE16;
-        uint8_t r, g, b;
-        DISPLAY_DECOMPOSE_RGB16 (pxColorTmp, r, g, b);
-        pxColor = DISPLAY_COMPOSE_RGB (display, r, g, b);
+        for (int x = 0; x < 8; ++x)
+        {
+            uint32_t color = (glyph[y] & (0x80 >> x)) ? fg : bg;
+            if (display->bytesPerPx == 2)
+                ((uint16_t*) ent->rows[y])[x] = color;
+            else if (display->bytesPerPx == 4)
+                ((uint32_t*) ent->rows[y])[x] = color;
+        }
     }
-    uint32_t bgPxColor = 0;
+    ent->glyphIdx = glyphIdx;
+    ent->fg = fg;
+    ent->bg = bg;
+    ent->valid = true;
+    return ent;
+}
+
+static void fbConsWriteChar (char c, int col, int row)
+{
     // Compute glyph
     bool found;
     uint16_t glyphIdx = fb_font_glyph (c, &found);
-    // Grab character from font table
-    uint8_t* glyph = font + (glyphIdx * 16);
-    uint32_t glyphRowSz = (8 + 7) / 8;
+    fbGlyph_t* glyph = fbGetGlyph (glyphIdx, fgPxColor, 0);
     // Compute base offset to character
     uint32_t offset = (row * 16 * display->bytesPerLine) + (col * 8 * display->bytesPerPx);
     // Get base of buffer
@@ -204,46 +286,19 @@ static void fbConsWriteChar (char c, int col, int row)
         uint32_t diff = buf - bufEnd;
         buf = display->backBuffer + diff;
     }
-    // Display pixels
-    uint32_t mask = 1 << 8;
+    // Copy in the rows. The back buffer only wraps between lines, so each row is contiguous
+    size_t rowSz = 8 * display->bytesPerPx;
     for (int y = 0; y < 16; ++y)
     {
-        void* lineBuf = buf;
-        uint32_t omask = mask;
-        for (int x = 0; x < (8 + 1); ++x)
-        {
-            if (display->bytesPerPx == 2)
-            {
-                if ((*glyph) & omask)
-                    DISPLAY_PLOT_16BPP (display, lineBuf, pxColor, 0, 0);
-                else
-                    DISPLAY_PLOT_16BPP (display, lineBuf, bgPxColor, 0, 0);
-                lineBuf += 2;
-            }
-            else if (display->bytesPerPx == 4)
-            {
-                if ((*glyph) & omask)
-                    DISPLAY_PLOT_32BPP (display, lineBuf, pxColor, 0, 0);
-                else
-                    DISPLAY_PLOT_32BPP (display, lineBuf, bgPxColor, 0, 0);
-                lineBuf += 4;
-            }
-            omask >>= 1;    // Wrap if needed
-            if (lineBuf >= bufEnd)
-            {
-                uint32_t diff = lineBuf - bufEnd;
-                lineBuf = display->backBuffer + diff;
-            }
-        }
+        memcpy (buf, glyph->rows[y], rowSz);
         buf += display->bytesPerLine;
         if (buf >= bufEnd)
         {
             uint32_t diff = buf - bufEnd;
             buf = display->backBuffer + diff;
         }
-        glyph += glyphRowSz;
     }
-    fbInvalidate (col * 8, row * 16, 8, 16);
+    fbDamage (col * 8, row * 16, 8, 16);
 }
 
 static bool fbScroll()
@@ -251,8 +306,8 @@ static bool fbScroll()
     // Increment current back buffer base
     for (int i = 0; i < 16; ++i)
         fbIncRender();
-    // Invalidate
-    fbInvalidate (0, 0, display->width, (rows - 1) * 16);
+    // Everything moved up a line
+    fbDamage (0, 0, display->width, rows * 16);
     // Clear last line
     void* lastLineBuf = display->backBufferLoc + (display->bytesPerLine * ((rows - 1) * 16));
     void* bufEnd = display->backBuffer + display->lfbSize;
@@ -262,15 +317,10 @@ static bool fbScroll()
         uint32_t diff = lastLineBuf - bufEnd;
         lastLineBuf = display->backBuffer + diff;
     }
+    // The background is black, which is all zeroes in any format
     for (int y = 0; y < 16; ++y)
     {
-        for (int x = 0; x < display->width; ++x)
-        {
-            if (display->bpp == 32)
-                DISPLAY_PLOT_32BPP (display, lastLineBuf, 0, x, 0);
-            if (display->bpp == 16)
-                DISPLAY_PLOT_16BPP (display, lastLineBuf, 0, x, 0);
-        }
+        memset (lastLineBuf, 0, display->width * display->bytesPerPx);
         lastLineBuf += display->bytesPerLine;
         // Wrap if needed
         if (lastLineBuf >= bufEnd)
@@ -279,7 +329,6 @@ static bool fbScroll()
             lastLineBuf = display->backBuffer + diff;
         }
     }
-    fbInvalidate (0, (rows - 1) * 16, display->width, 16);
     return true;
 }
 
@@ -332,6 +381,7 @@ static void fbConsWrite (const char* s)
         fbConsPrintChar (*s);
         ++s;
     }
+    fbFlush();
 }
 
 static bool fbConsRead (char* c)
@@ -0,0 +1,92 @@
+/*
+    initgraph.c - contains boot init graph
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/nexke.h>
+#include <nexke/synch.h>
+#include <nexke/task.h>
+
+// Each step of a graph gets its own thread as soon as the steps it depends on are done, so
+// steps that don't depend on each other get spread over whatever CPUs are idle
+// The thread that finishes a step is the one that starts the steps that were waiting on it
+
+// Graph being run
+static const NkInitNode_t* nkInitNodes = NULL;
+static int nkInitNumNodes = 0;
+static uint32_t nkInitStarted = 0;    // Steps that have a thread
+static uint32_t nkInitDone = 0;       // Steps that are done
+static TskMutex_t nkInitLock;         // Protects the masks
+static TskCondition_t nkInitCond;     // Broadcast once every step is done
+
+static void nkInitNodeThread (void* arg);
+
+// Starts every step that's ready to go
+// Called with the lock held
+static void nkInitStartReady()
+{
+    for (int i = 0; i < nkInitNumNodes; ++i)
+    {
+        const NkInitNode_t* node = &nkInitNodes[i];
+        if ((nkInitStarted & (1U << i)) || (node->deps & ~nkInitDone))
+            continue;
+        nkInitStarted |= 1U << i;
+        NkThread_t* thread = TskCreateThread (nkInitNodeThread,
+                                              (void*) (uintptr_t) i,
+                                              node->name,
+                                              TSK_POLICY_NORMAL,
+                                              TSK_PRIO_KERNEL,
+                                              0);
+        if (!thread)
+            NkPanicOom();
+        TskStartThread (thread);
+    }
+}
+
+// Runs a step
+static void nkInitNodeThread (void* arg)
+{
+    int i = (int) (uintptr_t) arg;
+    nkInitNodes[i].init();
+    NkBootStamp (nkInitNodes[i].name);
+    TskAcquireMutex (&nkInitLock);
+    nkInitDone |= 1U << i;
+    if (nkInitDone == (1U << nkInitNumNodes) - 1)
+        TskBroadcastCondition (&nkInitCond);
+    else
+        nkInitStartReady();
+    TskReleaseMutex (&nkInitLock);
+    TskTerminateSelf (0);
+}
+
+// Runs a graph of init steps and waits for them
+void NkRunInitGraph (const NkInitNode_t* nodes, int numNodes)
+{
+    assert (numNodes > 0 && numNodes <= NK_INIT_MAX_NODES);
+    nkInitNodes = nodes;
+    nkInitNumNodes = numNodes;
+    nkInitStarted = 0;
+    nkInitDone = 0;
+    TskInitMutex (&nkInitLock);
+    TskInitCondition (&nkInitCond);
+    // A step that depends on one that isn't in the graph would never start
+    for (int i = 0; i < numNodes; ++i)
+        assert (!(nodes[i].deps >> numNodes) && !(nodes[i].deps & (1U << i)));
+    TskAcquireMutex (&nkInitLock);
+    nkInitStartReady();
+    TskReleaseMutex (&nkInitLock);
+    TskWaitCondition (&nkInitCond, NULL);
+}
@@ -0,0 +1,192 @@
+/*
+    ipc.c - contains IPC ports
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/ipc.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/wait.h>
+#include <string.h>
+
+// The ring's pages are fixed, so the kernel mapping of them never faults, and the wait words keep
+// the same kernel address for address waits to hash
+// Waits follow the same pattern on both sides. The waiter sets its wait word and then looks at
+// the counter again, and the other side moves the counter and then looks at the wait word. Both
+// are sequentially consistent, so one of them sees the other
+
+// Creates a port
+NkIpcPort_t* NkIpcCreatePort (size_t msgSize, size_t numSlots)
+{
+    assert (msgSize && numSlots);
+    NkIpcPort_t* port = kmalloc (sizeof (NkIpcPort_t), MM_TAG_MM);
+    if (!port)
+        return NULL;
+    size_t slots = 1;
+    while (slots < numSlots)
+        slots <<= 1;
+    port->msgSize = msgSize;
+    port->numSlots = slots;
+    port->numPages = CpuPageAlignUp (sizeof (NkIpcRing_t) + (slots * msgSize)) / NEXKE_CPU_PAGESZ;
+    port->ring = MmAllocKvRegion (port->numPages, 0);
+    if (!port->ring)
+    {
+        kfree (port, sizeof (NkIpcPort_t), MM_TAG_MM);
+        return NULL;
+    }
+    port->obj = MmCreateObject (port->numPages, MM_BACKEND_ANON, MUL_PAGE_R | MUL_PAGE_RW);
+    // Bring in every page now, and map them into the kernel too
+    for (size_t i = 0; i < port->numPages; ++i)
+    {
+        MmPage_t* page = MmAllocZeroedPage();
+        if (!page)
+            NkPanicOom();
+        MmLockPage (page);
+        MmFixPage (page);
+        MmAddPage (port->obj, i * NEXKE_CPU_PAGESZ, page);
+        MmBackendPageIn (port->obj, i * NEXKE_CPU_PAGESZ, page);
+        MmUnlockPage (page);
+        MmMulMapPage (MmGetKernelSpace(),
+                      (uintptr_t) port->ring + (i * NEXKE_CPU_PAGESZ),
+                      page,
+                      MUL_PAGE_KE | MUL_PAGE_RW | MUL_PAGE_R);
+    }
+    port->slots = (char*) port->ring + sizeof (NkIpcRing_t);
+    port->ring->msgSize = msgSize;
+    port->ring->numSlots = slots;
+    return port;
+}
+
+// Destroys a port
+void NkIpcDestroyPort (NkIpcPort_t* port)
+{
+    // The pages aren't in the kernel object, so this only unmaps them
+    MmFreeKvRegion (port->ring);
+    // Let the pages be paged out if anyone still has them mapped
+    for (size_t i = 0; i < port->numPages; ++i)
+    {
+        MmPage_t* page = MmLookupPage (port->obj, i * NEXKE_CPU_PAGESZ);
+        MmLockPage (page);
+        MmUnfixPage (page);
+        MmUnlockPage (page);
+    }
+    MmDeRefObject (port->obj);
+    kfree (port, sizeof (NkIpcPort_t), MM_TAG_MM);
+}
+
+// Maps port's ring into space
+MmSpaceEntry_t* NkIpcMapPort (NkIpcPort_t* port, MmSpace_t* space)
+{
+    MmRefObject (port->obj);
+    MmSpaceEntry_t* entry = MmAllocSpace (space, port->obj, 0, port->numPages);
+    if (!entry)
+        MmDeRefObject (port->obj);
+    return entry;
+}
+
+// Waits for the other side to move counter past seen
+static void nkIpcWait (atomic_t* waitWord, atomic_t* counter, atomic_t seen)
+{
+    NkAtomicStore (waitWord, 1);
+    if (NkAtomicLoad (counter) != seen)
+        return;
+    // If the counter moves after this, we don't block
+    TskWaitAddress (counter, seen, TSK_TIMEOUT_NONE);
+}
+
+// Wakes the other side if it's waiting on counter
+static FORCEINLINE void nkIpcWake (atomic_t* waitWord, atomic_t* counter)
+{
+    if (NkAtomicLoad (waitWord))
+    {
+        NkAtomicStore (waitWord, 0);
+        TskWakeAddress (counter, 1);
+    }
+}
+
+// Copies count messages between buf and the ring, starting at message number pos
+static void nkIpcCopy (NkIpcPort_t* port, atomic_t pos, void* buf, size_t count, bool in)
+{
+    size_t idx = pos & (port->numSlots - 1);
+    // The run might wrap around the end of the ring
+    size_t first = port->numSlots - idx;
+    if (first > count)
+        first = count;
+    char* slot = port->slots + (idx * port->msgSize);
+    size_t firstSz = first * port->msgSize;
+    size_t restSz = (count - first) * port->msgSize;
+    if (in)
+    {
+        memcpy (slot, buf, firstSz);
+        memcpy (port->slots, buf + firstSz, restSz);
+    }
+    else
+    {
+        memcpy (buf, slot, firstSz);
+        memcpy (buf + firstSz, port->slots, restSz);
+    }
+}
+
+// Sends messages on a port
+size_t NkIpcSend (NkIpcPort_t* port, const void* msgs, size_t count, int flags)
+{
+    NkIpcRing_t* ring = port->ring;
+    // Only we write head
+    atomic_t head = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        atomic_t tail = NkAtomicLoad (&ring->tail);
+        size_t room = port->numSlots - (head - tail);
+        if (room)
+        {
+            if (room > count)
+                room = count;
+            nkIpcCopy (port, head, (void*) msgs, room, true);
+            // Everything goes out in one go, so the consumer gets woken at most once
+            NkAtomicStore (&ring->head, head + room);
+            nkIpcWake (&ring->consWait, &ring->head);
+            return room;
+        }
+        if (flags & NK_IPC_NOWAIT)
+            return 0;
+        nkIpcWait (&ring->prodWait, &ring->tail, tail);
+    }
+}
+
+// Receives messages from a port
+size_t NkIpcRecv (NkIpcPort_t* port, void* msgs, size_t count, int flags)
+{
+    NkIpcRing_t* ring = port->ring;
+    // Only we write tail
+    atomic_t tail = __atomic_load_n (&ring->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        atomic_t head = NkAtomicLoad (&ring->head);
+        size_t avail = head - tail;
+        if (avail)
+        {
+            if (avail > count)
+                avail = count;
+            nkIpcCopy (port, tail, msgs, avail, false);
+            NkAtomicStore (&ring->tail, tail + avail);
+            nkIpcWake (&ring->prodWait, &ring->tail);
+            return avail;
+        }
+        if (flags & NK_IPC_NOWAIT)
+            return 0;
+        nkIpcWait (&ring->consWait, &ring->head, head);
+    }
+}
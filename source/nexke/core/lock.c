@@ -0,0 +1,281 @@
+/*
+    lock.c - contains queued lock slow path and lock statistics
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/nexke.h>
+
+// Queue nodes of each CPU
+// A CPU waits on at most one lock per interrupt level, so it needs a few of these
+// Each CPU's go on their own cache line, as waiters spin on them
+typedef struct _nkmcsnodes
+{
+    NkMcsNode_t nodes[NK_MCS_NESTING];
+} __attribute__ ((aligned (64))) nkMcsNodes_t;
+
+static nkMcsNodes_t nkMcsNodes[NEXKE_MAX_CPUS] = {0};
+
+// Tails are the CPU number plus one, so 0 means an empty queue, and the node index
+#define NK_MCS_TAIL(cpu, idx) ((((uint32_t) (cpu) + 1) << 2) | (idx))
+#define NK_MCS_TAIL_CPU(tail) (((tail) >> 2) - 1)
+#define NK_MCS_TAIL_IDX(tail) ((tail) & 3)
+
+// Gets node of tail
+static FORCEINLINE NkMcsNode_t* nkMcsGetNode (uint32_t tail)
+{
+    return &nkMcsNodes[NK_MCS_TAIL_CPU (tail)].nodes[NK_MCS_TAIL_IDX (tail)];
+}
+
+// Spins on lock itself until we can set the locked bit
+// Only used when a CPU is nested too deep to have a node, so it doesn't have to be fair
+static unsigned long nkMcsSpin (mcslock_t* lock)
+{
+    unsigned long spins = 0;
+    for (;;)
+    {
+        uint32_t val = __atomic_load_n (lock, __ATOMIC_RELAXED);
+        if (!(val & NK_MCS_LOCKED) && __atomic_compare_exchange_n (lock,
+                                                                   &val,
+                                                                   val | NK_MCS_LOCKED,
+                                                                   false,
+                                                                   __ATOMIC_ACQUIRE,
+                                                                   __ATOMIC_RELAXED))
+        {
+            return spins;
+        }
+        CpuSpin();
+        ++spins;
+    }
+}
+
+// Waits on a contended queued lock
+// Returns number of times we spun
+unsigned long NkMcsAcquireSlow (mcslock_t* lock)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    // Grab a node. Interrupts that come in while we wait use the ones after it,
+    // and are done with them before we get to run again
+    int idx = ccb->mcsDepth++;
+    if (idx >= NK_MCS_NESTING)
+    {
+        unsigned long spins = nkMcsSpin (lock);
+        --ccb->mcsDepth;
+        return spins;
+    }
+    NkMcsNode_t* node = &nkMcsNodes[ccb->cpuNum].nodes[idx];
+    node->next = NULL;
+    node->head = 0;
+    uint32_t tail = NK_MCS_TAIL (ccb->cpuNum, idx);
+    unsigned long spins = 0;
+    // Put ourselves at the tail of the queue, or take the lock if it came free
+    uint32_t val = __atomic_load_n (lock, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        uint32_t newVal = NK_MCS_LOCKED;
+        if (val)
+            newVal = (val & NK_MCS_LOCKED) | (tail << NK_MCS_TAIL_SHIFT);
+        if (__atomic_compare_exchange_n (lock,
+                                         &val,
+                                         newVal,
+                                         false,
+                                         __ATOMIC_ACQ_REL,
+                                         __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    if (!val)
+    {
+        --ccb->mcsDepth;
+        return spins;    // Got it
+    }
+    // Link us behind the old tail, and wait for it to make us the head
+    uint32_t prevTail = val >> NK_MCS_TAIL_SHIFT;
+    if (prevTail)
+    {
+        NkMcsNode_t* prev = nkMcsGetNode (prevTail);
+        __atomic_store_n (&prev->next, node, __ATOMIC_RELEASE);
+        while (!__atomic_load_n (&node->head, __ATOMIC_ACQUIRE))
+        {
+            CpuSpin();
+            ++spins;
+        }
+    }
+    // Now we're at the head, wait for the holder to let go
+    // If we are the last waiter, empty the queue as we take it
+    for (;;)
+    {
+        val = __atomic_load_n (lock, __ATOMIC_RELAXED);
+        if (val & NK_MCS_LOCKED)
+        {
+            CpuSpin();
+            ++spins;
+            continue;
+        }
+        uint32_t newVal =
+            ((val >> NK_MCS_TAIL_SHIFT) == tail) ? NK_MCS_LOCKED : (val | NK_MCS_LOCKED);
+        if (__atomic_compare_exchange_n (lock,
+                                         &val,
+                                         newVal,
+                                         false,
+                                         __ATOMIC_ACQUIRE,
+                                         __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+    // Hand the head to whoever is behind us. They may still be linking themselves in
+    if ((val >> NK_MCS_TAIL_SHIFT) != tail)
+    {
+        NkMcsNode_t* next = NULL;
+        while (!(next = __atomic_load_n (&node->next, __ATOMIC_ACQUIRE)))
+            CpuSpin();
+        __atomic_store_n (&next->head, 1, __ATOMIC_RELEASE);
+    }
+    --ccb->mcsDepth;
+    return spins;
+}
+
+#ifdef NEXKE_LOCK_STATS
+
+// Lock sites that have been used
+static NkLockSite_t* nkLockSites = NULL;
+
+// Locks held by each CPU, with when they were taken
+#define NK_LOCK_STAT_DEPTH 16
+
+typedef struct _nkheldlock
+{
+    void* lock;
+    NkLockSite_t* site;
+    uint64_t start;
+} nkHeldLock_t;
+
+typedef struct _nkheldlocks
+{
+    nkHeldLock_t locks[NK_LOCK_STAT_DEPTH];
+    int depth;
+} nkHeldLocks_t;
+
+static nkHeldLocks_t nkHeldLocks[NEXKE_MAX_CPUS] = {0};
+
+// Records that lock got taken at site after spinning spins times
+void NkLockStatAcquire (void* lock, NkLockSite_t* site, unsigned long spins)
+{
+    // Put the site on the list the first time it's used
+    int unused = 0;
+    if (__atomic_compare_exchange_n (&site->registered,
+                                     &unused,
+                                     1,
+                                     false,
+                                     __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED))
+    {
+        NkLockSite_t* head = __atomic_load_n (&nkLockSites, __ATOMIC_RELAXED);
+        do
+        {
+            site->next = head;
+        } while (!__atomic_compare_exchange_n (&nkLockSites,
+                                               &head,
+                                               site,
+                                               false,
+                                               __ATOMIC_RELEASE,
+                                               __ATOMIC_RELAXED));
+    }
+    // Sites are shared between CPUs
+    __atomic_fetch_add (&site->acquires, 1, __ATOMIC_RELAXED);
+    if (spins)
+    {
+        __atomic_fetch_add (&site->contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add (&site->spins, spins, __ATOMIC_RELAXED);
+    }
+    // Remember when we took it. The slot is claimed before it's filled in, so interrupts that
+    // take locks while we do this use the slots after it
+    nkHeldLocks_t* held = &nkHeldLocks[CpuGetCcb()->cpuNum];
+    int idx = held->depth++;
+    if (idx >= NK_LOCK_STAT_DEPTH)
+    {
+        --held->depth;
+        return;    // Too many held to time this one
+    }
+    held->locks[idx].lock = lock;
+    held->locks[idx].site = site;
+    held->locks[idx].start = CpuGetCycles();
+}
+
+// Records that lock got released
+void NkLockStatRelease (void* lock)
+{
+    uint64_t end = CpuGetCycles();
+    nkHeldLocks_t* held = &nkHeldLocks[CpuGetCcb()->cpuNum];
+    // Locks needn't be released in order, so look for it from the top
+    for (int i = held->depth - 1; i >= 0; --i)
+    {
+        if (held->locks[i].lock != lock)
+            continue;
+        NkLockSite_t* site = held->locks[i].site;
+        uint64_t time = end - held->locks[i].start;
+        __atomic_fetch_add (&site->holdTime, time, __ATOMIC_RELAXED);
+        uint64_t maxHold = __atomic_load_n (&site->maxHold, __ATOMIC_RELAXED);
+        while (time > maxHold)
+        {
+            if (__atomic_compare_exchange_n (&site->maxHold,
+                                             &maxHold,
+                                             time,
+                                             false,
+                                             __ATOMIC_RELAXED,
+                                             __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        // Close the gap, and only then give up the top slot
+        for (int j = i; j < held->depth - 1; ++j)
+            held->locks[j] = held->locks[j + 1];
+        --held->depth;
+        return;
+    }
+}
+
+// Dumps lock statistics
+void NkDumpLockStats()
+{
+    NkLockSite_t* site = __atomic_load_n (&nkLockSites, __ATOMIC_ACQUIRE);
+    NkLogDebug ("Lock statistics:\n");
+    while (site)
+    {
+        uint64_t avgHold = (site->acquires) ? (site->holdTime / site->acquires) : 0;
+        NkLogDebug ("%s:%d: taken %llu times, contended %llu times, spun %llu times\n",
+                    site->file,
+                    site->line,
+                    (unsigned long long) site->acquires,
+                    (unsigned long long) site->contended,
+                    (unsigned long long) site->spins);
+        NkLogDebug ("    held for %llu cycles on average, %llu at most\n",
+                    (unsigned long long) avgHold,
+                    (unsigned long long) site->maxHold);
+        site = site->next;
+    }
+}
+
+#else
+
+// Dumps lock statistics
+void NkDumpLockStats()
+{
+    NkLogDebug ("Lock statistics aren't enabled in this build\n");
+}
+
+#endif
@@ -21,24 +21,57 @@
 #include <nexke/platform.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <nexke/synch.h>
+#include <nexke/task.h>
 #include <stdlib.h>
+#include <string.h>
 
-// Log entry structure
-typedef struct _logentry
+// Messages are formatted straight into a ring owned by the CPU logging them, and written out to
+// the consoles later by the log thread, so whoever logs never waits on the framebuffer or UART.
+// Slots are claimed by bumping the ring's head, so interrupts can log in the middle of a message
+// from a thread on the same CPU. Each record is stamped with its sequence number last, so the
+// flusher can tell finished records from ones still being written
+// Every message also takes a number from a global counter, which the flusher uses to put messages
+// from different CPUs back in order
+// Until the log thread is up, and once we panic, whoever logs flushes right away instead
+
+#define NK_LOG_RECORDS 128    // Records in a ring, must be a power of 2
+#define NK_LOG_MSG_MAX 256    // Longest message
+
+// Log record
+typedef struct _logrec
+{
+    uint32_t seq;                // Sequence number in ring plus 1, 0 while being written
+    int logLevel;                // Loglevel of message
+    unsigned long order;         // Global order of message
+    char msg[NK_LOG_MSG_MAX];    // Message buffer
+} nkLogRec_t;
+
+// Per-CPU log ring
+typedef struct _logring
 {
-    char msg[256];    // Message buffer
-    int logLevel;     // Loglevel of message
-    NkLink_t link;    // Link to next entry
-} NkLogEntry_t;
+    uint32_t head;    // Next sequence number to claim
+    uint32_t tail;    // Next sequence number to flush, owned by the flusher
+    nkLogRec_t recs[NK_LOG_RECORDS];
+} nkLogRing_t;
 
 // Minimum printable loglevel
 static int loglevel;
 
-// Cache
-static SlabCache_t* logCache = NULL;
+// Rings of each CPU. The BSP's is here from the start
+static nkLogRing_t nkLogBootRing = {0};
+static nkLogRing_t* nkLogRings[NEXKE_MAX_CPUS] = {&nkLogBootRing};
 
-// List of entries
-static NkList_t entryList = {0};
+static unsigned long nkLogOrder = 0;      // Next global message number
+static bool nkLogFlushing = false;        // Whether someone is flushing
+static bool nkLogPending = false;         // Whether messages came in since the last flush started
+static bool nkLogPanicked = false;        // Whether we have panicked
+static unsigned long nkLogDropped = 0;    // Messages written over before being flushed
+
+// Log thread state
+static NkThread_t* nkLogThread = NULL;
+static TskCondition_t nkLogCond = {0};
+static NkDpc_t nkLogDpcs[NEXKE_MAX_CPUS] = {0};
 
 // Assert implementation
 void __attribute__ ((noreturn)) __assert_failed (const char* expr,
@@ -49,29 +82,9 @@ void __attribute__ ((noreturn)) __assert_failed (const char* expr,
     NkPanic ("Assertion '%s' failed: file %s, line %d, functions %s", expr, file, line, func);
 }
 
-// Logs a message
-void NkLogMessage (const char* fmt, int level, va_list ap)
+// Writes a message to the consoles
+static void nkLogWrite (const char* msg, int level)
 {
-    // If we're in an interrupt handler, we can't allocate memory
-    // Don't write to log in that case
-    char* msg = NULL;
-    if (!CPU_IS_INT())
-    {
-        NkLogEntry_t* newEntry = MmCacheAlloc (logCache);
-        if (!newEntry)
-            NkPanicOom();
-        newEntry->logLevel = level;
-        vsprintf (newEntry->msg, fmt, ap);
-        // Add to list
-        NkListAddBack (&entryList, &newEntry->link);
-        msg = newEntry->msg;
-    }
-    else
-    {
-        char buf[256];
-        vsprintf (buf, fmt, ap);
-        msg = buf;
-    }
     // Decide where to print it
     if (level <= loglevel)
         PltGetPrimaryCons()->write (msg);
@@ -80,26 +93,173 @@ void NkLogMessage (const char* fmt, int level, va_list ap)
         PltGetSecondaryCons()->write (msg);
 }
 
+// Makes consoles write synchronously from now on
+static void nkLogSyncCons()
+{
+    NkConsole_t* primary = PltGetPrimaryCons();
+    NkConsole_t* secondary = PltGetSecondaryCons();
+    if (primary && primary->sync)
+        primary->sync();
+    if (secondary && secondary != primary && secondary->sync)
+        secondary->sync();
+}
+
+// Gets the next finished record of ring, skipping past anything that got written over
+static nkLogRec_t* nkLogPeek (nkLogRing_t* ring)
+{
+    uint32_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+    if (head - ring->tail > NK_LOG_RECORDS)
+    {
+        nkLogDropped += head - NK_LOG_RECORDS - ring->tail;
+        ring->tail = head - NK_LOG_RECORDS;
+    }
+    if (ring->tail == head)
+        return NULL;
+    nkLogRec_t* rec = &ring->recs[ring->tail & (NK_LOG_RECORDS - 1)];
+    if (__atomic_load_n (&rec->seq, __ATOMIC_ACQUIRE) != ring->tail + 1)
+        return NULL;    // Still being written, the writer will flush again
+    return rec;
+}
+
+// Writes out every finished record, oldest first
+static void nkLogDrain()
+{
+    for (;;)
+    {
+        // Find the oldest message at the tail of a ring
+        nkLogRing_t* oldest = NULL;
+        nkLogRec_t* oldestRec = NULL;
+        for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+        {
+            nkLogRing_t* ring = __atomic_load_n (&nkLogRings[i], __ATOMIC_ACQUIRE);
+            if (!ring)
+                continue;
+            nkLogRec_t* rec = nkLogPeek (ring);
+            if (rec && (!oldestRec || (long) (rec->order - oldestRec->order) < 0))
+            {
+                oldest = ring;
+                oldestRec = rec;
+            }
+        }
+        if (!oldest)
+            break;
+        if (nkLogDropped)
+        {
+            char buf[64];
+            snprintf (buf, sizeof (buf), "nexke: %lu log messages dropped\n", nkLogDropped);
+            nkLogWrite (buf, NK_LOGLEVEL_WARNING);
+            nkLogDropped = 0;
+        }
+        nkLogWrite (oldestRec->msg, oldestRec->logLevel);
+        ++oldest->tail;
+    }
+}
+
+// Flushes the rings to the consoles
+// If someone else is flushing, they pick up our messages before they stop
+static void nkLogFlush()
+{
+    __atomic_store_n (&nkLogPending, true, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n (&nkLogPending, __ATOMIC_SEQ_CST) &&
+           !__atomic_exchange_n (&nkLogFlushing, true, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n (&nkLogPending, false, __ATOMIC_SEQ_CST);
+        nkLogDrain();
+        __atomic_store_n (&nkLogFlushing, false, __ATOMIC_SEQ_CST);
+    }
+}
+
+// Wakes the log thread
+static void nkLogWake (NkDpc_t*, void*)
+{
+    TskBroadcastCondition (&nkLogCond);
+}
+
+// Log thread
+static void nkLogThreadMain (void*)
+{
+    for (;;)
+    {
+        TskWaitCondition (&nkLogCond, NULL);
+        TskUnsetCondition (&nkLogCond);
+        nkLogFlush();
+    }
+}
+
+// Logs a message
+void NkLogMessage (const char* fmt, int level, va_list ap)
+{
+    int cpuNum = CpuGetCcb()->cpuNum;
+    nkLogRing_t* ring = nkLogRings[cpuNum];
+    if (!ring)
+        ring = &nkLogBootRing;    // Shouldn't happen, but claiming slots is safe from anywhere
+    // If we get moved while in here, the message just goes in the other CPU's ring
+    uint32_t seq = __atomic_fetch_add (&ring->head, 1, __ATOMIC_RELAXED);
+    nkLogRec_t* rec = &ring->recs[seq & (NK_LOG_RECORDS - 1)];
+    __atomic_store_n (&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_signal_fence (__ATOMIC_SEQ_CST);
+    rec->order = __atomic_fetch_add (&nkLogOrder, 1, __ATOMIC_RELAXED);
+    rec->logLevel = level;
+    vsnprintf (rec->msg, NK_LOG_MSG_MAX, fmt, ap);
+    __atomic_store_n (&rec->seq, seq + 1, __ATOMIC_RELEASE);
+    // Get it written out
+    if (level == NK_LOGLEVEL_EMERGENCY)
+    {
+        // Nobody else may ever flush again, so get everything out now, even if someone is in the
+        // middle of a flush
+        __atomic_store_n (&nkLogPanicked, true, __ATOMIC_RELAXED);
+        nkLogSyncCons();
+        nkLogDrain();
+    }
+    else if (!__atomic_load_n (&nkLogThread, __ATOMIC_ACQUIRE) ||
+             __atomic_load_n (&nkLogPanicked, __ATOMIC_RELAXED))
+        nkLogFlush();
+    else
+        NkQueueDpc (&nkLogDpcs[cpuNum]);
+}
+
+// Sets up the log ring of a CPU that's being started
+void NkLogInitCpu (NkCcb_t* ccb)
+{
+    nkLogRing_t* ring = kmalloc (sizeof (nkLogRing_t), MM_TAG_CORE);
+    if (!ring)
+        return;    // It can share the BSP's
+    memset (ring, 0, sizeof (nkLogRing_t));
+    __atomic_store_n (&nkLogRings[ccb->cpuNum], ring, __ATOMIC_RELEASE);
+}
+
+// Starts writing the log out from its own thread
+void NkInitLogThread()
+{
+    TskInitCondition (&nkLogCond);
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+        NkInitDpcObj (&nkLogDpcs[i], nkLogWake, NULL);
+    NkThread_t* thread =
+        TskCreateThread (nkLogThreadMain, NULL, "NkLogThread", TSK_POLICY_NORMAL, TSK_PRIO_USER, 0);
+    if (!thread)
+        NkPanicOom();
+    TskStartThread (thread);
+    __atomic_store_n (&nkLogThread, thread, __ATOMIC_RELEASE);
+}
+
 // Initializes kernel log
 void NkLogInit()
 {
-    NkListInit (&entryList);
     // Ensure we have a console
     if (!PltGetPrimaryCons())
         CpuCrash();    // Just halt
     // Set loglevel
     const char* logLevelStr = NkReadArg ("-loglevel");
     if (!logLevelStr)
-        loglevel = NK_LOGLEVEL_ERROR;
+        loglevel = 1;
     else if (!(*logLevelStr))
     {
         // Print out a warning
         PltGetPrimaryCons()->write ("nexke: argument \"-loglevel\" invalid, ignoring\n");
-        loglevel = NK_LOGLEVEL_ERROR;
+        loglevel = 1;
     }
-    loglevel = atoi (logLevelStr);
-    // Create a log entry cache
-    logCache = MmCacheCreate (sizeof (NkLogEntry_t), "NkLogEntry_t", 0, 0);
+    else
+        loglevel = atoi (logLevelStr);
     // Validate loglevel
     if (loglevel == 0)
     {
@@ -113,7 +273,7 @@ void NkLogInit()
     }
     // Convert to actual loglevel
     if (loglevel == 1)
-        loglevel = NK_LOGLEVEL_ERROR;
+        loglevel = 1;
     else if (loglevel == 2)
         loglevel = NK_LOGLEVEL_WARNING;
     else if (loglevel == 3)
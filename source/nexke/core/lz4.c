@@ -0,0 +1,199 @@
+/*
+    lz4.c - contains LZ4 block compression
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/nexke.h>
+#include <string.h>
+
+// Only raw LZ4 blocks are handled, as the kernel always knows how big its data is
+// The compressor is greedy and finds matches through a hash table of where each 4 byte sequence
+// was last seen. The table isn't cleared between calls; entries that are out of range are
+// ignored, and candidates are compared byte for byte anyway, so stale ones just miss
+
+#define LZ4_MIN_MATCH     4        // Shortest match
+#define LZ4_LAST_LITERALS 5        // Last bytes of a block are always literals
+#define LZ4_MF_LIMIT      12       // Last match has to start this far from the end
+#define LZ4_MAX_OFFSET    65535    // Furthest back a match can be
+
+// Reads 32 bits at p
+static FORCEINLINE uint32_t lz4Read32 (const uint8_t* p)
+{
+    uint32_t val;
+    memcpy (&val, p, sizeof (uint32_t));
+    return val;
+}
+
+// Hashes a 4 byte sequence
+static FORCEINLINE uint32_t lz4Hash (uint32_t seq)
+{
+    return (seq * 2654435761U) >> (32 - NK_LZ4_HASH_BITS);
+}
+
+// Writes the extra bytes of a length
+static uint8_t* lz4WriteLen (uint8_t* op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+// Writes out a sequence of literals, followed by a match if matchLen isn't 0
+// Returns NULL if it doesn't fit before outEnd
+static uint8_t* lz4WriteSeq (uint8_t* op,
+                             uint8_t* outEnd,
+                             const uint8_t* lit,
+                             size_t litLen,
+                             size_t offset,
+                             size_t matchLen)
+{
+    size_t need = 1 + (litLen / 255) + 1 + litLen;
+    if (matchLen)
+        need += 2 + ((matchLen - LZ4_MIN_MATCH) / 255) + 1;
+    if (need > (size_t) (outEnd - op))
+        return NULL;
+    uint8_t* token = op++;
+    *token = (litLen < 15) ? (litLen << 4) : (15 << 4);
+    if (litLen >= 15)
+        op = lz4WriteLen (op, litLen - 15);
+    memcpy (op, lit, litLen);
+    op += litLen;
+    if (!matchLen)
+        return op;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    matchLen -= LZ4_MIN_MATCH;
+    *token |= (matchLen < 15) ? matchLen : 15;
+    if (matchLen >= 15)
+        op = lz4WriteLen (op, matchLen - 15);
+    return op;
+}
+
+// Compresses a block
+size_t NkLz4Compress (const void* src, size_t srcSz, void* dest, size_t destSz, uint32_t* table)
+{
+    const uint8_t* in = src;
+    const uint8_t* ip = in;
+    const uint8_t* anchor = in;
+    const uint8_t* end = in + srcSz;
+    uint8_t* op = dest;
+    uint8_t* outEnd = op + destSz;
+    if (srcSz > LZ4_MF_LIMIT)
+    {
+        const uint8_t* mfLimit = end - LZ4_MF_LIMIT;
+        const uint8_t* matchLimit = end - LZ4_LAST_LITERALS;
+        while (ip < mfLimit)
+        {
+            uint32_t seq = lz4Read32 (ip);
+            uint32_t* slot = &table[lz4Hash (seq)];
+            size_t pos = ip - in;
+            size_t ref = *slot;
+            *slot = pos;
+            if (ref >= pos || (pos - ref) > LZ4_MAX_OFFSET || lz4Read32 (in + ref) != seq)
+            {
+                ++ip;
+                continue;
+            }
+            // Extend the match both ways
+            const uint8_t* match = in + ref;
+            while (ip > anchor && match > in && ip[-1] == match[-1])
+            {
+                --ip;
+                --match;
+            }
+            size_t matchLen = LZ4_MIN_MATCH;
+            while ((ip + matchLen) < matchLimit && ip[matchLen] == match[matchLen])
+                ++matchLen;
+            op = lz4WriteSeq (op, outEnd, anchor, ip - anchor, ip - match, matchLen);
+            if (!op)
+                return 0;
+            ip += matchLen;
+            anchor = ip;
+        }
+    }
+    // Whatever is left goes out as literals
+    op = lz4WriteSeq (op, outEnd, anchor, end - anchor, 0, 0);
+    if (!op)
+        return 0;
+    return op - (uint8_t*) dest;
+}
+
+// Reads the extra bytes of a length
+static bool lz4ReadLen (const uint8_t** in, const uint8_t* inEnd, size_t* len)
+{
+    uint8_t b;
+    do
+    {
+        if (*in >= inEnd)
+            return false;
+        b = *(*in)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompresses a block
+int32_t NkLz4Decompress (const void* src, size_t srcSz, void* dest, size_t destSz)
+{
+    const uint8_t* in = src;
+    const uint8_t* inEnd = in + srcSz;
+    uint8_t* out = dest;
+    uint8_t* op = out;
+    uint8_t* outEnd = out + destSz;
+    while (in < inEnd)
+    {
+        uint8_t token = *in++;
+        // Copy literals
+        size_t litLen = token >> 4;
+        if (litLen == 15 && !lz4ReadLen (&in, inEnd, &litLen))
+            return -1;
+        if (litLen > (size_t) (inEnd - in) || litLen > (size_t) (outEnd - op))
+            return -1;
+        memcpy (op, in, litLen);
+        op += litLen;
+        in += litLen;
+        // Last sequence is only literals
+        if (in == inEnd)
+            break;
+        if (inEnd - in < 2)
+            return -1;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (!offset || offset > (size_t) (op - out))
+            return -1;
+        size_t matchLen = token & 15;
+        if (matchLen == 15 && !lz4ReadLen (&in, inEnd, &matchLen))
+            return -1;
+        matchLen += LZ4_MIN_MATCH;
+        if (matchLen > (size_t) (outEnd - op))
+            return -1;
+        // Matches closer than their length repeat themselves, so copy in steps no bigger than
+        // the offset
+        const uint8_t* match = op - offset;
+        while (matchLen)
+        {
+            size_t step = (matchLen < offset) ? matchLen : offset;
+            memcpy (op, match, step);
+            op += step;
+            match += step;
+            matchLen -= step;
+        }
+    }
+    return op - out;
+}
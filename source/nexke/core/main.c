@@ -16,10 +16,12 @@
 */
 
 #include <nexke/cpu.h>
+#include <nexke/io.h>
 #include <nexke/mm.h>
 #include <nexke/nexboot.h>
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
+#include <nexke/platform/pci.h>
 #include <nexke/synch.h>
 #include <nexke/task.h>
 #include <stdlib.h>
@@ -63,7 +65,7 @@ const char* NkReadArg (const char* arg)
             while (*iter != ' ' && *iter)
                 tmp[i] = *iter, ++i, ++iter;
             // kmalloc it
-            char* buf = kmalloc (i);
+            char* buf = kmalloc (i, MM_TAG_CORE);
             strcpy (buf, tmp);
             return (const char*) buf;
         }
@@ -73,40 +75,78 @@ const char* NkReadArg (const char* arg)
     return NULL;
 }
 
+// Byte lanes of a word, for adding up checksums
+#define NK_CSUM_LANES 0x00FF00FF00FF00FFULL
+// Words that can be added up before a lane could overflow
+#define NK_CSUM_WORDS 128
+
 // Helper function to compute checksums
+// Words are added up 8 bytes at a time, with each pair of bytes going in its own 16 bit lane
 bool NkVerifyChecksum (uint8_t* buf, size_t len)
 {
     uint8_t sum = 0;
-    for (int i = 0; i < len; ++i)
-        sum += buf[i];
+    while (len >= sizeof (uint64_t))
+    {
+        size_t words = len / sizeof (uint64_t);
+        if (words > NK_CSUM_WORDS)
+            words = NK_CSUM_WORDS;
+        uint64_t lanes = 0;
+        for (size_t i = 0; i < words; ++i)
+        {
+            uint64_t word;
+            memcpy (&word, buf, sizeof (uint64_t));
+            lanes += (word & NK_CSUM_LANES) + ((word >> 8) & NK_CSUM_LANES);
+            buf += sizeof (uint64_t);
+        }
+        len -= words * sizeof (uint64_t);
+        sum += (uint8_t) (lanes + (lanes >> 16) + (lanes >> 32) + (lanes >> 48));
+    }
+    while (len--)
+        sum += *buf++;
     return !sum;
 }
 
 static void NkInitialThread (void*);
 
+// Init steps that run once the other CPUs are up
+// Steps that don't depend on each other can run on different CPUs at the same time
+static const NkInitNode_t nkLateInit[] = {
+    {.name = "pageout",            .init = MmInitPageout,       .deps = 0},
+    {.name = "page merging",       .init = MmInitPageMerge,     .deps = 0},
+    {.name = "huge pages",         .init = MmInitThp,           .deps = 0},
+    {.name = "interrupt balancer", .init = PltStartIntBalancer, .deps = 0},
+    {.name = "PCI devices",        .init = PltInitPci,          .deps = 0},
+};
+
 void NkMain (NexNixBoot_t* bootinf)
 {
+    NkBootStamp ("kernel entry");
     // Set bootinfo
     bootInfo = bootinf;
     // Initialize MM phase 1
     MmInitPhase1();
+    NkBootStamp ("MM phase 1");
     // Copy bootinfo into cache
-    bootInfCache = MmCacheCreate (sizeof (NexNixBoot_t), "NexNixBoot_t", 0, 0);
+    bootInfCache = MmCacheCreate (sizeof (NexNixBoot_t), "NexNixBoot_t", MM_TAG_CORE, 0, 0);
     NexNixBoot_t* bootInf = MmCacheAlloc (bootInfCache);
     memcpy (bootInf, bootInfo, sizeof (NexNixBoot_t));
     bootInfo = bootInf;
     // Move boot arguments into better spot
     size_t argLen = strlen (bootInfo->args);
-    cmdLine = kmalloc (argLen + 1);
+    cmdLine = kmalloc (argLen + 1, MM_TAG_CORE);
     strcpy (cmdLine, bootInfo->args);
     // Initialize boot drivers
     PltInitDrvs();
+    NkBootStamp ("boot drivers");
     // Initialize log
     NkLogInit();
     // Initialize resource manager
     NkInitResource();
+    NkBootStamp ("resources");
     // Initialize CCB
     CpuInitCcb();
+    NkInitCrc();
+    NkBootStamp ("CPU");
     // Print banner
     NkLogInfo ("\
 NexNix version %s\n\
@@ -116,16 +156,40 @@ Copyright (C) 2023 - 2024 The Nexware Project\n",
     CpuPrintFeatures();
     // Initialize phase 2 of platform
     PltInitPhase2();
+    NkBootStamp ("platform phase 2");
     // Initialize MM phase 2
     MmInitPhase2();
+    NkBootStamp ("MM phase 2");
     // Initialize phase 3 of platform
     PltInitPhase3();
+    NkBootStamp ("platform phase 3");
+    // Copy ACPI tables out of firmware memory and hand it to the page allocator
+    PltAcpiCacheTables();
+    MmReclaimFwMem();
+    NkBootStamp ("firmware memory reclaim");
     // Initialize timing subsystem
     NkInitTime();
+    NkBootStamp ("time");
     // Initialize work queue system
     NkInitWorkQueue();
+    NkBootStamp ("work queues");
     // Initialize multitasking
     TskInitSys();
+    NkBootStamp ("multitasking");
+    // Start running RCU callbacks
+    NkInitRcu();
+    // Start running DPCs
+    NkInitDpc();
+    // Finish block requests and IRPs in DPCs
+    IoInitBlock();
+    IoInitIrps();
+    NkBootStamp ("RCU and DPCs");
+    // Hand console output off to the log thread
+    NkInitLogThread();
+    // Start profiling and tracing if we're asked to
+    NkInitProf();
+    NkInitTrace();
+    NkBootStamp ("log thread and tracing");
     // Create initial thread
     NkThread_t* initThread = TskCreateThread (NkInitialThread,
                                               NULL,
@@ -159,6 +223,18 @@ static void NkInitialThread (void*)
 {
     // Start interrupts now
     CpuUnholdInts();
+    NkBootStamp ("first thread");
+    // Bring up the other CPUs
+    NkStartCpus();
+    NkBootStamp ("other CPUs");
+    // Finish setting up page structures while the rest of boot goes on
+    MmStartPageInit();
+    // Start the pageout daemon, and spread interrupts out over the CPUs
+    NkRunInitGraph (nkLateInit, sizeof (nkLateInit) / sizeof (NkInitNode_t));
+    // Log how long it took to get here
+    NkBootTimeDump();
+    // Run any benchmarks that were asked for
+    NkRunBench();
     TskInitWaitQueue (&queue, TSK_WAITOBJ_QUEUE);
     NkThread_t* thread = TskCreateThread (t1, NULL, "t1", TSK_POLICY_NORMAL, TSK_PRIO_KERNEL, 0);
     TskStartThread (thread);
@@ -0,0 +1,260 @@
+/*
+    prof.c - contains sampling profiler
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/task.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The CPU layer has the performance counters interrupt every so many cycles, and hands us the
+// code that was interrupted. Each sample goes in this CPU's buffer along with the thread that was
+// running and the top of its stack. Samples may be taken from an NMI, so nothing on that path
+// can take a lock or fault
+// Once the profile time is up, the buffers are folded into a flat profile by PC and logged
+// There's no symbol table at runtime, so PCs are printed as is, to be looked up against the
+// kernel image with addr2line or nm
+//
+// Boot arguments:
+// -prof [period]   profiles, taking a sample every period cycles
+// -proftime [sec]  how long to profile for
+// -profraw         logs every sample, and not just the profile
+
+#define NK_PROF_SAMPLES 8192    // Samples each CPU can hold
+#define NK_PROF_STACK   4       // Words of stack kept with each sample
+#define NK_PROF_TOP     40      // Number of PCs in the profile
+
+#define NK_PROF_PERIOD 1000000    // Default cycles between samples
+#define NK_PROF_TIME   10         // Default seconds to profile for
+
+// A sample
+typedef struct _nkprofsample
+{
+    uintptr_t pc;                      // Interrupted PC
+    id_t tid;                          // Thread that was running, -1 if none
+    uintptr_t stack[NK_PROF_STACK];    // Top of the interrupted stack
+} nkProfSample_t;
+
+// Per-CPU sample buffer
+typedef struct _nkprofbuf
+{
+    size_t count;    // Samples taken
+    nkProfSample_t samples[NK_PROF_SAMPLES];
+} nkProfBuf_t;
+
+// Profile entry
+typedef struct _nkprofent
+{
+    uintptr_t pc;
+    size_t count;    // 0 if entry is free
+} nkProfEntry_t;
+
+static bool nkProfOn = false;     // Whether samples are being taken
+static bool nkProfRaw = false;    // Whether every sample gets logged
+
+// Work queue that stops profiling
+static NkWorkQueue_t* nkProfQueue = NULL;
+
+// This CPU's sample buffer
+static NK_PERCPU nkProfBuf_t* nkProfBuf;
+
+// Records a sample
+bool NkProfSample (uintptr_t pc, uintptr_t sp, bool user)
+{
+    nkProfBuf_t* buf = NK_PERCPU_READ (nkProfBuf);
+    if (!buf || !__atomic_load_n (&nkProfOn, __ATOMIC_RELAXED))
+        return false;
+    size_t count = buf->count;
+    if (count == NK_PROF_SAMPLES)
+        return false;
+    nkProfSample_t* sample = &buf->samples[count];
+    sample->pc = pc;
+    NkThread_t* thread = CpuGetCcb()->curThread;
+    sample->tid = (thread) ? thread->tid : -1;
+    // Only the page sp is in is known to be there, so don't read past it
+    // User stacks may not be there at all
+    int words = 0;
+    if (!user)
+    {
+        words = (int) ((NEXKE_CPU_PAGESZ - (sp & (NEXKE_CPU_PAGESZ - 1))) / sizeof (uintptr_t));
+        if (words > NK_PROF_STACK)
+            words = NK_PROF_STACK;
+    }
+    for (int i = 0; i < NK_PROF_STACK; ++i)
+        sample->stack[i] = (i < words) ? ((uintptr_t*) sp)[i] : 0;
+    __atomic_store_n (&buf->count, count + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Gets ccb's buffer
+static inline nkProfBuf_t* nkProfGetBuf (NkCcb_t* ccb)
+{
+    return *NK_PERCPU_PTR_CPU (nkProfBuf, ccb);
+}
+
+// Hashes a PC into a table of size entries
+static inline size_t nkProfHash (uintptr_t pc, size_t size)
+{
+    return (size_t) (((uint64_t) pc * 0x9E3779B97F4A7C15ULL) >> 32) & (size - 1);
+}
+
+// Prints profile of samples taken so far
+void NkProfDump()
+{
+    size_t total = 0;
+    for (int i = 0; i < NkGetNumCpus(); ++i)
+    {
+        nkProfBuf_t* buf = nkProfGetBuf (NkGetCcb (i));
+        if (buf)
+            total += __atomic_load_n (&buf->count, __ATOMIC_ACQUIRE);
+    }
+    if (!total)
+    {
+        NkLogInfo ("nexke: no profile samples taken\n");
+        return;
+    }
+    // Fold samples with the same PC together, in a hash table that's at most half full
+    size_t size = 1;
+    while (size < total * 2)
+        size <<= 1;
+    size_t tabSz = size * sizeof (nkProfEntry_t);
+    nkProfEntry_t* tab =
+        MmAllocKvRegion (CpuPageAlignUp (tabSz) >> NEXKE_CPU_PAGE_SHIFT, MM_KV_NO_DEMAND);
+    if (!tab)
+    {
+        NkLogWarning ("nexke: warning: out of memory for profile\n");
+        return;
+    }
+    memset (tab, 0, tabSz);
+    for (int i = 0; i < NkGetNumCpus(); ++i)
+    {
+        nkProfBuf_t* buf = nkProfGetBuf (NkGetCcb (i));
+        if (!buf)
+            continue;
+        size_t count = __atomic_load_n (&buf->count, __ATOMIC_ACQUIRE);
+        for (size_t j = 0; j < count; ++j)
+        {
+            nkProfSample_t* sample = &buf->samples[j];
+            if (nkProfRaw)
+            {
+                NkLogInfo ("prof: CPU %d, thread %d, PC %p, stack %p %p %p %p\n",
+                           i,
+                           (int) sample->tid,
+                           (void*) sample->pc,
+                           (void*) sample->stack[0],
+                           (void*) sample->stack[1],
+                           (void*) sample->stack[2],
+                           (void*) sample->stack[3]);
+            }
+            size_t slot = nkProfHash (sample->pc, size);
+            while (tab[slot].count && tab[slot].pc != sample->pc)
+                slot = (slot + 1) & (size - 1);
+            tab[slot].pc = sample->pc;
+            ++tab[slot].count;
+        }
+    }
+    // Print the hottest PCs, taking the biggest entry out each time
+    NkLogInfo ("nexke: profile of %llu samples\n", (unsigned long long) total);
+    NkLogInfo ("  samples  percent  PC\n");
+    for (int i = 0; i < NK_PROF_TOP; ++i)
+    {
+        nkProfEntry_t* best = NULL;
+        for (size_t j = 0; j < size; ++j)
+        {
+            if (tab[j].count && (!best || tab[j].count > best->count))
+                best = &tab[j];
+        }
+        if (!best)
+            break;
+        unsigned long long permille = (unsigned long long) best->count * 1000 / total;
+        NkLogInfo ("  %7llu  %3llu.%llu%%  %p\n",
+                   (unsigned long long) best->count,
+                   permille / 10,
+                   permille % 10,
+                   (void*) best->pc);
+        best->count = 0;
+    }
+    MmFreeKvRegion (tab);
+}
+
+// Stops profiling and prints the profile
+static void nkProfStop (NkWorkItem_t*)
+{
+    // Each CPU stops its counters at its next sample
+    __atomic_store_n (&nkProfOn, false, __ATOMIC_RELAXED);
+    NkProfDump();
+}
+
+// Sets up profiling on a CPU that's being started
+void NkProfInitCpu (NkCcb_t* ccb)
+{
+    if (!nkProfOn)
+        return;
+    size_t pages = CpuPageAlignUp (sizeof (nkProfBuf_t)) >> NEXKE_CPU_PAGE_SHIFT;
+    nkProfBuf_t* buf = MmAllocKvRegion (pages, MM_KV_NO_DEMAND);
+    if (!buf)
+    {
+        NkLogWarning ("nexke: warning: can't profile CPU %d\n", ccb->cpuNum);
+        return;
+    }
+    buf->count = 0;
+    *NK_PERCPU_PTR_CPU (nkProfBuf, ccb) = buf;
+}
+
+// Starts taking samples on this CPU
+void NkProfStartCpu()
+{
+    if (nkProfOn && NK_PERCPU_READ (nkProfBuf))
+        CpuStartPmu();
+}
+
+// Sets up the profiler
+void NkInitProf()
+{
+    const char* arg = NkReadArg ("-prof");
+    if (!arg)
+        return;
+    uint64_t period = NK_PROF_PERIOD;
+    if (*arg && atoi (arg) > 0)
+        period = atoi (arg);
+    if (!CpuInitPmu (period))
+    {
+        NkLogWarning ("nexke: warning: no performance counters to profile with\n");
+        return;
+    }
+    int secs = NK_PROF_TIME;
+    const char* timeArg = NkReadArg ("-proftime");
+    if (timeArg && atoi (timeArg) > 0)
+        secs = atoi (timeArg);
+    nkProfRaw = NkReadArg ("-profraw") != NULL;
+    nkProfQueue = NkWorkQueueCreate (nkProfStop,
+                                     NK_WORK_TIMED,
+                                     NK_WORK_ONESHOT | NK_WORK_POLL,
+                                     TSK_PRIO_KERNEL,
+                                     0);
+    if (!nkProfQueue)
+        NkPanicOom();
+    nkProfOn = true;
+    NkProfInitCpu (CpuGetCcb());
+    NkWorkQueueArmTimer (nkProfQueue, (ktime_t) secs * PLT_NS_IN_SEC);
+    NkLogInfo ("nexke: profiling every %llu cycles for %d seconds\n",
+               (unsigned long long) period,
+               secs);
+    NkProfStartCpu();
+}
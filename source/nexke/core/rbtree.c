@@ -0,0 +1,224 @@
+/*
+    rbtree.c - contains red-black tree implementation
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/nexke.h>
+
+// Missing children count as black
+#define RB_IS_RED(node) ((node) && (node)->red)
+
+// Puts new in the place old has under its parent
+static FORCEINLINE void rbReplace (NkRbTree_t* tree, NkRbNode_t* old, NkRbNode_t* new)
+{
+    NkRbNode_t* parent = old->parent;
+    if (!parent)
+        tree->root = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+    if (new)
+        new->parent = parent;
+}
+
+// Rotates node down to the left, bringing its right child up
+static void rbRotateLeft (NkRbTree_t* tree, NkRbNode_t* node)
+{
+    NkRbNode_t* child = node->right;
+    node->right = child->left;
+    if (child->left)
+        child->left->parent = node;
+    rbReplace (tree, node, child);
+    child->left = node;
+    node->parent = child;
+}
+
+// Rotates node down to the right, bringing its left child up
+static void rbRotateRight (NkRbTree_t* tree, NkRbNode_t* node)
+{
+    NkRbNode_t* child = node->left;
+    node->left = child->right;
+    if (child->right)
+        child->right->parent = node;
+    rbReplace (tree, node, child);
+    child->right = node;
+    node->parent = child;
+}
+
+// Rebalances tree after node got linked in
+void NkRbInsert (NkRbTree_t* tree, NkRbNode_t* node, bool leftmost)
+{
+    if (leftmost)
+        tree->first = node;
+    // Node is red, so the only thing that can be wrong is a red parent
+    while (RB_IS_RED (node->parent))
+    {
+        NkRbNode_t* parent = node->parent;
+        // The root is black, so a red parent always has a parent of its own
+        NkRbNode_t* grand = parent->parent;
+        bool left = (parent == grand->left);
+        NkRbNode_t* uncle = (left) ? grand->right : grand->left;
+        if (RB_IS_RED (uncle))
+        {
+            // Push the red up to grand and check again from there
+            parent->red = uncle->red = false;
+            grand->red = true;
+            node = grand;
+            continue;
+        }
+        // Get node on the outside, then rotate grand towards the uncle
+        if (left)
+        {
+            if (node == parent->right)
+            {
+                rbRotateLeft (tree, parent);
+                parent = node;
+            }
+            rbRotateRight (tree, grand);
+        }
+        else
+        {
+            if (node == parent->left)
+            {
+                rbRotateRight (tree, parent);
+                parent = node;
+            }
+            rbRotateLeft (tree, grand);
+        }
+        parent->red = false;
+        grand->red = true;
+        break;
+    }
+    tree->root->red = false;
+}
+
+// Fixes up a path that's one black short after a removal
+// node may be NULL, which is why its parent is passed in
+static void rbRemoveFixup (NkRbTree_t* tree, NkRbNode_t* node, NkRbNode_t* parent)
+{
+    while (node != tree->root && !RB_IS_RED (node))
+    {
+        // The path through node is short, so its sibling can't be missing
+        bool left = (node == parent->left);
+        NkRbNode_t* sibling = (left) ? parent->right : parent->left;
+        if (sibling->red)
+        {
+            // Rotate so the sibling is black
+            sibling->red = false;
+            parent->red = true;
+            if (left)
+                rbRotateLeft (tree, parent);
+            else
+                rbRotateRight (tree, parent);
+            sibling = (left) ? parent->right : parent->left;
+        }
+        NkRbNode_t* inner = (left) ? sibling->left : sibling->right;
+        NkRbNode_t* outer = (left) ? sibling->right : sibling->left;
+        if (!RB_IS_RED (inner) && !RB_IS_RED (outer))
+        {
+            // Make the sibling's side short also, and push the problem up
+            sibling->red = true;
+            node = parent;
+            parent = node->parent;
+            continue;
+        }
+        if (!RB_IS_RED (outer))
+        {
+            // Get the red child on the outside
+            inner->red = false;
+            sibling->red = true;
+            if (left)
+                rbRotateRight (tree, sibling);
+            else
+                rbRotateLeft (tree, sibling);
+            outer = sibling;
+            sibling = inner;
+        }
+        // Rotating parent towards node gives its side the black it's missing
+        sibling->red = parent->red;
+        parent->red = false;
+        outer->red = false;
+        if (left)
+            rbRotateLeft (tree, parent);
+        else
+            rbRotateRight (tree, parent);
+        node = tree->root;
+        break;
+    }
+    if (node)
+        node->red = false;
+}
+
+// Removes node from tree
+void NkRbRemove (NkRbTree_t* tree, NkRbNode_t* node)
+{
+    if (tree->first == node)
+        tree->first = NkRbNext (node);
+    NkRbNode_t* child = NULL;
+    NkRbNode_t* parent = NULL;
+    bool wasRed = false;
+    if (!node->left || !node->right)
+    {
+        // Splice it out, its child takes its place
+        child = (node->left) ? node->left : node->right;
+        parent = node->parent;
+        wasRed = node->red;
+        rbReplace (tree, node, child);
+    }
+    else
+    {
+        // Take out its successor instead, and move that into its place
+        NkRbNode_t* next = node->right;
+        while (next->left)
+            next = next->left;
+        child = next->right;
+        wasRed = next->red;
+        if (next->parent == node)
+            parent = next;
+        else
+        {
+            parent = next->parent;
+            parent->left = child;
+            if (child)
+                child->parent = parent;
+            next->right = node->right;
+            node->right->parent = next;
+        }
+        rbReplace (tree, node, next);
+        next->left = node->left;
+        node->left->parent = next;
+        next->red = node->red;
+    }
+    // Taking out a black node leaves its path short
+    if (!wasRed)
+        rbRemoveFixup (tree, child, parent);
+}
+
+// Gets node after node
+NkRbNode_t* NkRbNext (NkRbNode_t* node)
+{
+    if (node->right)
+    {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return node;
+    }
+    // Go up until we come from the left
+    while (node->parent && node == node->parent->right)
+        node = node->parent;
+    return node->parent;
+}
@@ -0,0 +1,211 @@
+/*
+    rcu.c - contains read-copy-update implementation
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/rcu.h>
+#include <nexke/synch.h>
+#include <nexke/task.h>
+
+// Grace periods are numbered. nkRcuCurGp is the last one started, and nkRcuDoneGp the last one
+// that ended, so one is running when they differ. When one starts, every CPU that is up gets a
+// bit in nkRcuPending and clears it the first time it passes through a quiescent state, and the
+// CPU that clears the last bit ends it
+// Ending a grace period happens in the scheduler, which can't run callbacks, so a work queue
+// runs them and starts the next grace period. The time slice handler of the CPU that last queued
+// a callback wakes it when there's something for it to do
+// CPUs stop ticking when they have nothing else to run, so they get told to tick again until
+// they've passed through a quiescent state
+static atomic_t nkRcuCurGp = 0;
+static atomic_t nkRcuDoneGp = 0;
+static atomic_t nkRcuPending = 0;
+static int nkRcuDriver = 0;
+
+// Callbacks, in the order of the grace period they wait on
+static NkList_t nkRcuCbs = {&nkRcuCbs, &nkRcuCbs};
+static size_t nkRcuNumCbs = 0;
+static spinlock_t nkRcuLock = 0;
+
+// Work queue that runs callbacks
+static NkWorkQueue_t* nkRcuQueue = NULL;
+
+// Checks if grace period gp1 comes after gp2
+static FORCEINLINE bool nkRcuGpAfter (atomic_t gp1, atomic_t gp2)
+{
+    return (long) ((unsigned long) gp1 - (unsigned long) gp2) > 0;
+}
+
+// Starts a grace period if none is running
+// Callback lock must be held
+static void nkRcuStartGp()
+{
+    if (NkAtomicLoad (&nkRcuCurGp) != NkAtomicLoad (&nkRcuDoneGp))
+        return;
+    // CPUs only look at the mask once they see the new number
+    atomic_t mask = NkGetCpuMask();
+    NkAtomicStore (&nkRcuPending, mask);
+    NkAtomicAdd (&nkRcuCurGp, 1);
+    // Get CPUs that stopped ticking going again. If one stops after this, it sees the new grace
+    // period before it does
+    int numCpus = NkGetNumCpus();
+    for (int i = 0; i < numCpus; ++i)
+    {
+        if (mask & (1L << i))
+            TskWantTick (NkGetCcb (i));
+    }
+}
+
+// Notes that this CPU is in a quiescent state
+void NkRcuQuiescent()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    atomic_t gp = NkAtomicLoad (&nkRcuCurGp);
+    if (ccb->rcuGp == gp)
+        return;    // Already counted
+    ccb->rcuGp = gp;
+    atomic_t self = 1L << ccb->cpuNum;
+    if (gp == NkAtomicLoad (&nkRcuDoneGp) || !(NkAtomicLoad (&nkRcuPending) & self))
+        return;
+    // No grace period can start until the running one ends, so if we were the last CPU,
+    // the current one is the one that's done
+    if (!NkAtomicAnd (&nkRcuPending, ~self))
+        NkAtomicStore (&nkRcuDoneGp, NkAtomicLoad (&nkRcuCurGp));
+}
+
+// Checks if the running grace period is waiting on this CPU
+bool NkRcuNeedsQuiescent()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    atomic_t gp = NkAtomicLoad (&nkRcuCurGp);
+    if (gp == NkAtomicLoad (&nkRcuDoneGp) || ccb->rcuGp == gp)
+        return false;
+    return (NkAtomicLoad (&nkRcuPending) & (1L << ccb->cpuNum)) != 0;
+}
+
+// Checks if this CPU has to keep ticking for RCU
+bool NkRcuNeedsTick()
+{
+    if (NkRcuNeedsQuiescent())
+        return true;
+    return nkRcuNumCbs && CpuGetCcb()->cpuNum == nkRcuDriver;
+}
+
+// Checks if callbacks need to be processed
+void NkRcuTick()
+{
+    if (!nkRcuQueue || !nkRcuNumCbs || CpuGetCcb()->cpuNum != nkRcuDriver)
+        return;
+    // If nothing's running, callbacks are either ready or need a new grace period
+    if (NkAtomicLoad (&nkRcuCurGp) == NkAtomicLoad (&nkRcuDoneGp))
+        NkWorkQueueWake (nkRcuQueue);
+}
+
+// Runs callbacks whose grace period is done
+static void nkRcuWork (NkWorkItem_t* item)
+{
+    // Take everyone that's ready off the list
+    NkList_t ready;
+    NkListInit (&ready);
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&nkRcuLock);
+    atomic_t done = NkAtomicLoad (&nkRcuDoneGp);
+    NkLink_t* iter = NkListFront (&nkRcuCbs);
+    while (iter)
+    {
+        NkRcuHead_t* head = LINK_CONTAINER (iter, NkRcuHead_t, link);
+        if (nkRcuGpAfter (head->gp, done))
+            break;
+        NkListRemove (&nkRcuCbs, iter);
+        NkListAddBack (&ready, iter);
+        --nkRcuNumCbs;
+        iter = NkListFront (&nkRcuCbs);
+    }
+    // Get the rest going
+    if (nkRcuNumCbs)
+        nkRcuStartGp();
+    NkSpinUnlock (&nkRcuLock);
+    PltLowerIpl (ipl);
+    // Now call them. They may free their link, so move on first
+    iter = NkListFront (&ready);
+    while (iter)
+    {
+        NkRcuHead_t* head = LINK_CONTAINER (iter, NkRcuHead_t, link);
+        iter = NkListIterate (&ready, iter);
+        head->func (head);
+    }
+}
+
+// Calls func on head after a grace period
+void NkRcuCall (NkRcuHead_t* head, NkRcuCallback func)
+{
+    head->func = func;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&nkRcuLock);
+    // Readers that can still see what's being freed may have started after a running grace
+    // period did, so in that case wait for the one after it
+    if (NkAtomicLoad (&nkRcuCurGp) != NkAtomicLoad (&nkRcuDoneGp))
+        head->gp = NkAtomicLoad (&nkRcuCurGp) + 1;
+    else
+    {
+        nkRcuStartGp();
+        head->gp = NkAtomicLoad (&nkRcuCurGp);
+    }
+    NkListAddBack (&nkRcuCbs, &head->link);
+    ++nkRcuNumCbs;
+    // Our tick keeps callbacks going from now on
+    nkRcuDriver = CpuGetCcb()->cpuNum;
+    TskWantTick (CpuGetCcb());
+    NkSpinUnlock (&nkRcuLock);
+    PltLowerIpl (ipl);
+}
+
+// Synchronous wait state
+typedef struct _rcusync
+{
+    NkRcuHead_t head;
+    TskSemaphore_t sem;
+} nkRcuSync_t;
+
+// Wakes up a synchronous waiter
+static void nkRcuWakeSync (NkRcuHead_t* head)
+{
+    nkRcuSync_t* sync = LINK_CONTAINER (head, nkRcuSync_t, head);
+    TskReleaseSemaphore (&sync->sem);
+}
+
+// Waits for a grace period to pass
+void NkRcuSynchronize()
+{
+    CPU_ASSERT_NOT_INT();
+    // Readers can't be preempted, so if we're the only CPU nobody can be reading right now
+    if (NkGetCpuMask() == (1L << CpuGetCcb()->cpuNum))
+        return;
+    nkRcuSync_t sync;
+    TskInitSemaphore (&sync.sem, 0);
+    NkRcuCall (&sync.head, nkRcuWakeSync);
+    TskAcquireSemaphore (&sync.sem);
+}
+
+// Initializes RCU
+void NkInitRcu()
+{
+    // Callbacks queued before now just wait for this
+    nkRcuQueue = NkWorkQueueCreate (nkRcuWork, NK_WORK_DEMAND, NK_WORK_POLL, TSK_PRIO_KERNEL, 0);
+    if (!nkRcuQueue)
+        NkPanicOom();
+}
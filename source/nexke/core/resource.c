@@ -17,45 +17,37 @@
 
 #include <assert.h>
 #include <nexke/nexke.h>
+#include <nexke/task.h>
 #include <string.h>
 
 // nexke's resource allocator is very simple in design
 // It allocates out integer IDs used to identify resources
 // Basically we have multiple arenas, each arena is for a different resource type
-// Each arena is split into chunks, and chunks are sorted by the number of free resources
-// in them. Each chunk contains a 64-bit bitmap specifying which resource IDs in said chunk are free
-// or allocated, but also caches up to 6 IDs in an array for instant access
+// IDs that have never been handed out are taken off the top of the arena's free range. Freed IDs
+// go into chunks, each of which has a 64-bit bitmap of which of 64 IDs are free, and chunks that
+// have free IDs are kept on a list. Bitmaps are searched a word at a time, by counting the
+// trailing bits that are set
+// In front of all of that, each CPU caches a few free IDs, which get refilled and drained a batch
+// at a time. That way threads don't all fight over the arena lock
 // That's the gist of how this works
 
 // Chunk structure
-
-#define NK_CHUNK_MAX_FREE_CACHE 6    // Chunk free cache size
-
 typedef struct _reschunk
 {
-    // Base info
-    size_t numFree;    // Number of free IDs
-    int type;          // Either ranged or mapped
-                       // If ranged, map is ignored and this specifies a range of free IDs
-    // Mapping info
-    uint64_t allocMap;    // Map of free entries in this chunk
+    size_t numFree;       // Number of free IDs
+    uint64_t allocMap;    // Map of allocated entries in this chunk
     id_t baseId;          // First ID in chunk
-    size_t lastId;        // Last ID in chunk
-    // Free cache info
-    id_t freeCache[NK_CHUNK_MAX_FREE_CACHE];    // Cache of free IDs, in relative ID
-    size_t curCacheId;                          // Current cache index
-    spinlock_t chunkLock;                       // Chunk lock
-    NkLink_t link;                              // Link to next chunk
-    NkLink_t hashLink;                          // Hash table link
+    bool onList;          // Whether chunk is on the free list
+    NkLink_t link;        // Link to next chunk with free IDs
+    NkLink_t hashLink;    // Hash table link
 } NkResChunk_t;
 
-// Chunk types
-#define NK_CHUNK_RANGED 0
-#define NK_CHUNK_MAPPED 1
-
 // ID multiple
 #define NK_ID_MULTIPLE 64
 
+// Number of IDs moved between CPU caches and arena at once
+#define NK_RES_BATCH (NK_RES_CACHE_SIZE / 2)
+
 // Cache of arenas
 static SlabCache_t* arenaCache = NULL;
 
@@ -83,224 +75,238 @@ static FORCEINLINE id_t nkAlignIdDown (id_t id, size_t align)
     return id;
 }
 
-// Adds to chunk hash table
-static FORCEINLINE void nkHashChunk (NkResArena_t* arena, NkResChunk_t* chunk, id_t baseId)
+// Finds first free entry in bitmap. Returns -1 if it's full
+static FORCEINLINE int nkSearchMap (uint64_t map)
+{
+    if (map == UINT64_MAX)
+        return -1;
+    return __builtin_ctzll (~map);
+}
+
+// Finds first run of count free entries in bitmap. Returns -1 if there isn't one
+static FORCEINLINE int nkSearchRun (uint64_t map, size_t count)
 {
-    size_t idx = baseId % NK_NUM_CHUNK_HASH;
-    NkSpinLock (&arena->hashLock);
-    NkListAddFront (&arena->chunkHash[idx], &chunk->link);
-    NkSpinUnlock (&arena->hashLock);
+    assert (count && count <= NK_ID_MULTIPLE);
+    // Each bit stays set only if the count bits starting at it are all free
+    // Every step doubles the length of the runs we've checked for
+    uint64_t free = ~map;
+    size_t len = 1;
+    while (len < count && free)
+    {
+        size_t shift = (len < count - len) ? len : count - len;
+        free &= free >> shift;
+        len += shift;
+    }
+    if (!free)
+        return -1;
+    return __builtin_ctzll (free);
 }
 
 // Gets a hashed chunk
-// Returns chunk locked
+// Arena lock must be held
 static FORCEINLINE NkResChunk_t* nkGetChunk (NkResArena_t* arena, id_t baseId)
 {
-    size_t idx = baseId % NK_NUM_CHUNK_HASH;
-    NkList_t* list = &arena->chunkHash[idx];
+    NkList_t* list = &arena->chunkHash[baseId % NK_NUM_CHUNK_HASH];
     NkLink_t* iter = NkListFront (list);
-    NkResChunk_t* chunk = NULL;
-    NkSpinLock (&arena->hashLock);
     while (iter)
     {
-        chunk = LINK_CONTAINER (iter, NkResChunk_t, link);
+        NkResChunk_t* chunk = LINK_CONTAINER (iter, NkResChunk_t, hashLink);
         if (chunk->baseId == baseId)
-        {
-            NkSpinLock (&chunk->chunkLock);
-            break;
-        }
+            return chunk;
         iter = NkListIterate (list, iter);
     }
-    NkSpinUnlock (&arena->hashLock);
-    return chunk;
+    return NULL;
 }
 
-#define CHUNK_MAYBE_LOCK(chunk) \
-    if (iter)                   \
-        NkSpinLock (&(chunk)->chunkLock);
-#define CHUNK_MAYBE_UNLOCK(chunk) \
-    if (iter)                     \
-        NkSpinUnlock (&(chunk)->chunkLock);
+// Gets the chunk that res belongs to, creating it if needed
+// Arena lock must be held, and is dropped to allocate a chunk. Left over chunks are put in spare
+static NkResChunk_t* nkGetChunkFor (NkResArena_t* arena, id_t res, NkResChunk_t** spare)
+{
+    id_t baseId = nkAlignIdDown (res, NK_ID_MULTIPLE);
+    NkResChunk_t* chunk = nkGetChunk (arena, baseId);
+    if (chunk)
+        return chunk;
+    if (!*spare)
+    {
+        NkSpinUnlock (&arena->lock);
+        *spare = MmCacheAlloc (chunkCache);
+        if (!*spare)
+            NkPanicOom();
+        NkSpinLock (&arena->lock);
+        // Somebody may have made it while we didn't hold the lock
+        chunk = nkGetChunk (arena, baseId);
+        if (chunk)
+            return chunk;
+    }
+    chunk = *spare;
+    *spare = NULL;
+    memset (chunk, 0, sizeof (NkResChunk_t));
+    // Set map to all ones since we don't know what's free and what's not
+    // IDs in it that haven't been handed out yet will still come off the free range
+    chunk->allocMap = UINT64_MAX;
+    chunk->baseId = baseId;
+    NkListAddFront (&arena->chunkHash[baseId % NK_NUM_CHUNK_HASH], &chunk->hashLink);
+    ++arena->numChunks;
+    return chunk;
+}
 
-// Sorts a chunk to it's appropriate spot
-// Called with chunk and list locked
-static FORCEINLINE void nkSortChunk (NkResArena_t* arena, NkResChunk_t* chunk)
+// Takes IDs of chunk that were allocated
+// Arena lock must be held
+static FORCEINLINE void nkTakeFromChunk (NkResArena_t* arena,
+                                         NkResChunk_t* chunk,
+                                         uint64_t mask,
+                                         size_t count)
 {
-    // Find where this chunk should go
-    // To do this, we go into a loop and check the left and right chunk
-    // We keep doing this until we find our spot
-    NkList_t* chunkList = &arena->chunks;
-    NkLink_t* iter = (chunk->link.prev == chunkList) ? NULL : chunk->link.prev;
-    while (1)
+    assert (!(chunk->allocMap & mask));
+    chunk->allocMap |= mask;
+    chunk->numFree -= count;
+    if (!chunk->numFree)
     {
-        // Get the chunk
-        NkResChunk_t* leftChunk = LINK_CONTAINER (iter, NkResChunk_t, link);
-        CHUNK_MAYBE_LOCK (leftChunk);
-        // If we've reached the end or the left has more free than us place us here
-        if (!iter || leftChunk->numFree >= chunk->numFree)
-        {
-            // Found spot, check if we need to move it
-            if (chunk->link.prev == iter)
-            {
-                CHUNK_MAYBE_UNLOCK (leftChunk);
-                break;    // Nothing to move
-            }
-            // Move it to this spot
-            NkListRemove (chunkList, &chunk->link);
-            if (!iter)
-                NkListAddFront (chunkList, &chunk->link);
-            else
-                NkListAddBefore (chunkList, iter, &chunk->link);
-            CHUNK_MAYBE_UNLOCK (leftChunk);
-            break;
-        }
-        CHUNK_MAYBE_UNLOCK (leftChunk);
-        iter = (iter->prev == chunkList) ? NULL : iter->prev;
+        NkListRemove (&arena->chunks, &chunk->link);
+        chunk->onList = false;
     }
-    // Now move to right
-    iter = (chunk->link.next == chunkList) ? NULL : chunk->link.next;
-    while (1)
+}
+
+// Allocates up to count IDs into ids
+// Arena lock must be held. Returns number of IDs allocated
+static size_t nkAllocIds (NkResArena_t* arena, id_t* ids, size_t count)
+{
+    size_t num = 0;
+    // Hand out fresh IDs first, so that IDs don't get reused until we run out of them
+    while (num < count && arena->nextId <= arena->maxId)
+        ids[num++] = arena->nextId++;
+    // Now go to the chunks
+    while (num < count)
     {
-        // Get the chunk
-        NkResChunk_t* rightChunk = LINK_CONTAINER (iter, NkResChunk_t, link);
-        CHUNK_MAYBE_LOCK (rightChunk);
-        // If we've reached the end or the left has more free than us place us here
-        if (!iter || rightChunk->numFree <= chunk->numFree)
-        {
-            // Found spot, check if we need to move it
-            if (chunk->link.next == iter)
-            {
-                CHUNK_MAYBE_UNLOCK (rightChunk);
-                break;    // Nothing to move
-            }
-            // Move it to this spot
-            NkListRemove (&arena->chunks, &chunk->link);
-            if (!iter)
-                NkListAddBack (&arena->chunks, &chunk->link);
-            else
-                NkListAdd (&arena->chunks, iter, &chunk->link);
-            CHUNK_MAYBE_UNLOCK (rightChunk);
-            break;
-        }
-        CHUNK_MAYBE_UNLOCK (rightChunk);
-        iter = NkListIterate (chunkList, iter);
+        NkLink_t* link = NkListFront (&arena->chunks);
+        if (!link)
+            break;    // Out of IDs
+        NkResChunk_t* chunk = LINK_CONTAINER (link, NkResChunk_t, link);
+        int idx = nkSearchMap (chunk->allocMap);
+        assert (idx != -1);
+        nkTakeFromChunk (arena, chunk, 1ULL << idx, 1);
+        ids[num++] = chunk->baseId + idx;
     }
+    return num;
 }
 
-// Allocates from bitmap
-static FORCEINLINE id_t nkSearchMap (NkResChunk_t* chunk)
+// Frees count IDs into the arena
+// If ids is NULL, frees count IDs starting at first
+// Arena lock must be held
+static void nkFreeIds (NkResArena_t* arena, id_t* ids, id_t first, size_t count)
 {
-    for (int i = 0; i < 64; ++i)
+    NkResChunk_t* spare = NULL;
+    for (size_t i = 0; i < count; ++i)
     {
-        if (!(chunk->allocMap & (1 << i)))
+        id_t res = (ids) ? ids[i] : first + (id_t) i;
+        assert (res >= arena->minId && res < arena->nextId);
+        NkResChunk_t* chunk = nkGetChunkFor (arena, res, &spare);
+        uint64_t bit = 1ULL << (res - chunk->baseId);
+        assert (chunk->allocMap & bit);
+        chunk->allocMap &= ~bit;
+        ++chunk->numFree;
+        if (!chunk->onList)
         {
-            chunk->allocMap |= (1 << i);
-            return i;
+            NkListAddFront (&arena->chunks, &chunk->link);
+            chunk->onList = true;
         }
     }
-    return -1;
+    if (spare)
+    {
+        NkSpinUnlock (&arena->lock);
+        MmCacheFree (chunkCache, spare);
+        NkSpinLock (&arena->lock);
+    }
 }
 
 // Allocates a resource
 id_t NkAllocResource (NkResArena_t* arena)
 {
-    // Grab the first chunk
-    NkLink_t* link = NkListFront (&arena->chunks);
-    if (!link)
-        return -1;    // No free IDs
-    NkResChunk_t* chunk = LINK_CONTAINER (link, NkResChunk_t, link);
-    NkSpinLock (&chunk->chunkLock);
-    if (chunk->numFree == 0)
-        return -1;
-    // Check if this is ranged or mapped
-    id_t id = -1;
-    if (chunk->type == NK_CHUNK_RANGED)
+    TskDisablePreempt();
+    NkResCpuCache_t* cache = &arena->cpuCaches[CpuGetCcb()->cpuNum];
+    if (!cache->numIds)
     {
-        // Grab an id
-        // We don't split it to another chunk until we free it
-        // As this is the performance hot spot, so we try to minimize the work done here
-        id = chunk->baseId;
-        ++chunk->baseId;
-        if (chunk->baseId >= chunk->lastId)
+        // Refill the cache. IDs are handed out from the back, so keep them in reverse
+        id_t ids[NK_RES_BATCH];
+        NkSpinLock (&arena->lock);
+        size_t num = nkAllocIds (arena, ids, NK_RES_BATCH);
+        NkSpinUnlock (&arena->lock);
+        if (!num)
         {
-            NkSpinLock (&arena->listLock);
-            NkListRemove (&arena->chunks, &chunk->link);    // Remove chunk from list, list is empty
-            NkSpinUnlock (&arena->listLock);
+            TskEnablePreempt();
+            return -1;    // No free IDs
         }
+        for (size_t i = 0; i < num; ++i)
+            cache->ids[num - i - 1] = ids[i];
+        cache->numIds = (int) num;
     }
-    else
-    {
-        // First check free list, and if we can't check bitmap
-        if (chunk->curCacheId < NK_CHUNK_MAX_FREE_CACHE)
-        {
-            id = chunk->freeCache[chunk->curCacheId] + chunk->baseId;    // Get it
-            if (id != -1)
-                ++chunk->curCacheId;    // Increment it
-        }
-        if (id != -1)    // Check if that worked
-        {
-            // Get our ID
-            id = nkSearchMap (chunk) + chunk->baseId;
-            assert (id != -1);
-            // Fill up free cache from bitmap
-            for (int i = 0; i < NK_CHUNK_MAX_FREE_CACHE; ++i)
-            {
-                chunk->freeCache[i] = nkSearchMap (chunk);    // Grab the ID
-                if (chunk->freeCache[i] == -1)
-                    break;    // Out of IDs
-                chunk->curCacheId = 0;
-            }
-        }
-    }
-    --chunk->numFree;
-    // Sort this chunk
-    NkSpinLock (&arena->listLock);
-    nkSortChunk (arena, chunk);
-    NkSpinUnlock (&arena->listLock);
-    NkSpinUnlock (&chunk->chunkLock);
+    id_t id = cache->ids[--cache->numIds];
+    TskEnablePreempt();
     return id;
 }
 
 // Frees a resource
 void NkFreeResource (NkResArena_t* arena, id_t res)
 {
-    // First grab the chunk, if there is one
-    id_t baseId = nkAlignIdDown (res, 64);
-    NkResChunk_t* chunk = nkGetChunk (arena, baseId);
-    if (!chunk)
+    TskDisablePreempt();
+    NkResCpuCache_t* cache = &arena->cpuCaches[CpuGetCcb()->cpuNum];
+    if (cache->numIds == NK_RES_CACHE_SIZE)
     {
-        // Create a new one for this ID
-        chunk = MmCacheAlloc (chunkCache);
-        if (!chunk)
-            NkPanicOom();
-        memset (chunk, 0, sizeof (NkResChunk_t));
-        // Set map to all ones since we don't know what's free and what's not
-        chunk->allocMap = (uint64_t) UINT64_MAX;
-        chunk->baseId = baseId;
-        chunk->lastId = baseId + 63;
-        // Free what we know is free
-        chunk->numFree = 1;
-        chunk->allocMap &= ~(1 << (res - baseId));
-        // Setup free cache
-        chunk->freeCache[0] = -1;
-        chunk->curCacheId = NK_CHUNK_MAX_FREE_CACHE;
-        // Add to lists
-        NkSpinLock (&chunk->chunkLock);
-        NkSpinLock (&arena->listLock);
-        NkListAddFront (&arena->chunks, &chunk->link);
-        nkSortChunk (arena, chunk);
-        NkSpinUnlock (&arena->listLock);
-        nkHashChunk (arena, chunk, baseId);
+        // Give the oldest half back to the arena, keeping the ones most recently freed
+        NkSpinLock (&arena->lock);
+        nkFreeIds (arena, cache->ids, 0, NK_RES_BATCH);
+        NkSpinUnlock (&arena->lock);
+        cache->numIds -= NK_RES_BATCH;
+        for (int i = 0; i < cache->numIds; ++i)
+            cache->ids[i] = cache->ids[i + NK_RES_BATCH];
+    }
+    cache->ids[cache->numIds++] = res;
+    TskEnablePreempt();
+}
+
+// Allocates count contiguous resources. Returns the first one
+id_t NkAllocResourceRange (NkResArena_t* arena, size_t count)
+{
+    if (!count)
+        return -1;
+    NkSpinLock (&arena->lock);
+    // Runs that fit in a chunk may come from freed IDs
+    if (count <= NK_ID_MULTIPLE)
+    {
+        NkLink_t* iter = NkListFront (&arena->chunks);
+        while (iter)
+        {
+            NkResChunk_t* chunk = LINK_CONTAINER (iter, NkResChunk_t, link);
+            iter = NkListIterate (&arena->chunks, iter);
+            if (chunk->numFree < count)
+                continue;
+            int idx = nkSearchRun (chunk->allocMap, count);
+            if (idx == -1)
+                continue;
+            uint64_t mask = (count == NK_ID_MULTIPLE) ? UINT64_MAX : ((1ULL << count) - 1) << idx;
+            nkTakeFromChunk (arena, chunk, mask, count);
+            NkSpinUnlock (&arena->lock);
+            return chunk->baseId + idx;
+        }
     }
-    else
+    // Otherwise take them from the free range
+    id_t id = -1;
+    if (arena->nextId <= arena->maxId && (size_t) (arena->maxId - arena->nextId) + 1 >= count)
     {
-        // Unset the bit
-        size_t idx = res - baseId;
-        chunk->allocMap &= ~(1 << idx);
-        ++chunk->numFree;
-        // TODO: add ID to free list if beneficial
+        id = arena->nextId;
+        arena->nextId += (id_t) count;
     }
-    NkSpinUnlock (&chunk->chunkLock);
+    NkSpinUnlock (&arena->lock);
+    return id;
+}
+
+// Frees count contiguous resources starting at res
+void NkFreeResourceRange (NkResArena_t* arena, id_t res, size_t count)
+{
+    // Ranges skip the CPU caches, so they can be found again as ranges
+    NkSpinLock (&arena->lock);
+    nkFreeIds (arena, NULL, res, count);
+    NkSpinUnlock (&arena->lock);
 }
 
 // Creates a resource arena
@@ -312,23 +318,14 @@ NkResArena_t* NkCreateResource (const char* name, id_t minId, id_t maxId)
         return NULL;
     memset (arena, 0, sizeof (NkResArena_t));
     arena->name = name;
-    arena->numChunks = 1;    // One chunk to start
     // Round max ID to multiple of 64
     maxId = nkAlignId (maxId + 1, NK_ID_MULTIPLE) - 1;
     arena->minId = minId;
     arena->maxId = maxId;
+    arena->nextId = minId;
     NkListInit (&arena->chunks);
-    // Create first chunk
-    NkResChunk_t* chunk = MmCacheAlloc (chunkCache);
-    if (!chunk)
-        return NULL;
-    memset (chunk, 0, sizeof (NkResChunk_t));
-    chunk->numFree = maxId + 1;
-    chunk->type = NK_CHUNK_RANGED;
-    chunk->baseId = arena->minId;
-    chunk->lastId = chunk->numFree - 1;
-    // Add chunk
-    NkListAddFront (&arena->chunks, &chunk->link);
+    for (int i = 0; i < NK_NUM_CHUNK_HASH; ++i)
+        NkListInit (&arena->chunkHash[i]);
     // Add arena
     NkSpinLock (&arenasLock);
     NkListAddFront (&arenas, &arena->link);
@@ -340,12 +337,15 @@ NkResArena_t* NkCreateResource (const char* name, id_t minId, id_t maxId)
 void NkDestroyResource (NkResArena_t* arena)
 {
     // Go through every chunk
-    NkLink_t* iter = NkListFront (&arena->chunks);
-    while (iter)
+    for (int i = 0; i < NK_NUM_CHUNK_HASH; ++i)
     {
-        NkResChunk_t* chunk = LINK_CONTAINER (iter, NkResChunk_t, link);
-        MmCacheFree (chunkCache, chunk);
-        iter = NkListIterate (&arena->chunks, iter);
+        NkLink_t* iter = NkListFront (&arena->chunkHash[i]);
+        while (iter)
+        {
+            NkResChunk_t* chunk = LINK_CONTAINER (iter, NkResChunk_t, hashLink);
+            iter = NkListIterate (&arena->chunkHash[i], iter);
+            MmCacheFree (chunkCache, chunk);
+        }
     }
     // Remove from list
     NkSpinLock (&arenasLock);
@@ -359,6 +359,6 @@ void NkInitResource()
 {
     NkListInit (&arenas);
     // Create caches
-    arenaCache = MmCacheCreate (sizeof (NkResArena_t), "NkResArena_t", 0, 0);
-    chunkCache = MmCacheCreate (sizeof (NkResChunk_t), "NkResChunk_t", 0, 0);
+    arenaCache = MmCacheCreate (sizeof (NkResArena_t), "NkResArena_t", MM_TAG_CORE, 0, 0);
+    chunkCache = MmCacheCreate (sizeof (NkResChunk_t), "NkResChunk_t", MM_TAG_CORE, 0, 0);
 }
@@ -0,0 +1,212 @@
+/*
+    smp.c - contains multiprocessor startup
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/task.h>
+#include <string.h>
+
+// APs are started one at a time. The BSP sets up everything the AP needs, including its CCB and
+// idle thread, starts it, and waits for it to check in before going on to the next one
+// Once it's checked in, an AP runs its own scheduler off of its own ready queues and timer
+
+// How long we wait for an AP to check in
+#define NK_AP_TIMEOUT (PLT_NS_IN_SEC / 10)
+
+// Results of starting a CPU
+#define NK_AP_STARTED 0    // CPU is running
+#define NK_AP_SKIPPED 1    // CPU couldn't be started, others still may be
+#define NK_AP_HUNG    2    // CPU was sent off but didn't check in
+
+// CPUs that have checked in
+static atomic_t nkCpusUp = 1;    // The BSP always is
+static atomic_t nkNumCpus = 1;
+
+// CCBs of running CPUs
+static NkCcb_t* nkCcbs[NEXKE_MAX_CPUS] = {0};
+
+// Gives ccb a zeroed copy of the per-CPU variables
+static bool nkAllocPerCpu (NkCcb_t* ccb)
+{
+    size_t size = NkPerCpuEnd - NkPerCpuStart;
+    if (!size)
+        return true;
+    void* copy = MmAllocKvRegion (CpuPageAlignUp (size) >> NEXKE_CPU_PAGE_SHIFT, MM_KV_NO_DEMAND);
+    if (!copy)
+        return false;
+    memset (copy, 0, size);
+    ccb->perCpuOff = (uintptr_t) copy - (uintptr_t) NkPerCpuStart;
+    return true;
+}
+
+// Sets up state of CPU cpuNum, returning its CCB and entry point
+static NkCcb_t* nkPrepareCpu (PltCpu_t* cpu, int cpuNum, paddr_t* entry)
+{
+    NkCcb_t* ccb = CpuAllocCcb (cpuNum);
+    if (!ccb || !nkAllocPerCpu (ccb))
+        return NULL;
+    NkLogInitCpu (ccb);
+    CpuInitTopology (ccb, cpu);
+    // Set up per-CPU state of each subsystem before anything runs on it
+    MmInitCpu (ccb);
+    MmSetCpuNode (ccb, cpu->node);
+    NkInitTimeCpu (ccb);
+    NkProfInitCpu (ccb);
+    NkTraceInitCpu (ccb);
+    if (!TskInitSchedCpu (ccb))
+        return NULL;
+    *entry = CpuPrepareAp (ccb);
+    if (!*entry)
+        return NULL;
+    return ccb;
+}
+
+// Adds ccb to the topology masks of the running CPUs it shares groups with, and them to its
+// Only the BSP changes masks, as it starts CPUs
+static void nkAddCpuTopology (NkCcb_t* ccb)
+{
+    for (int level = 0; level < NK_TOPO_LEVELS; ++level)
+        ccb->topoMask[level] = 1L << ccb->cpuNum;
+    int numCpus = NkGetNumCpus();
+    for (int i = 0; i < numCpus; ++i)
+    {
+        NkCcb_t* cur = NkGetCcb (i);
+        if (cur == ccb)
+            continue;
+        for (int level = 0; level < NK_TOPO_LEVELS; ++level)
+        {
+            if (cur->topoId[level] != ccb->topoId[level])
+                continue;
+            cur->topoMask[level] |= 1L << ccb->cpuNum;
+            ccb->topoMask[level] |= 1L << cur->cpuNum;
+        }
+    }
+}
+
+// Starts CPU as logical CPU cpuNum and waits for it
+static int nkStartCpu (PltCpu_t* cpu, int cpuNum)
+{
+    // The CPU's CCB, stacks and run queues are hot, so put them in its own node
+    paddr_t entry = 0;
+    int oldNode = MmSetAllocNode (cpu->node);
+    NkCcb_t* ccb = nkPrepareCpu (cpu, cpuNum, &entry);
+    MmSetAllocNode (oldNode);
+    if (!ccb)
+        return NK_AP_SKIPPED;
+    NkPlatform_t* plt = PltGetPlatform();
+    plt->cpuMap[cpuNum] = cpu;
+    if (!PltStartCpu (cpu, entry))
+    {
+        plt->cpuMap[cpuNum] = NULL;
+        return NK_AP_SKIPPED;
+    }
+    // Wait for it to check in
+    // If it doesn't, it may still come up later, so nothing it uses can be freed
+    ktime_t deadline = plt->clock->getTime() + NK_AP_TIMEOUT;
+    while (!(NkAtomicLoad (&nkCpusUp) & (1L << cpuNum)))
+    {
+        if (plt->clock->getTime() >= deadline)
+        {
+            plt->cpuMap[cpuNum] = NULL;
+            return NK_AP_HUNG;
+        }
+        CpuSpin();
+    }
+    // Make sure its clock agrees with ours before anything gets to run on it
+    PltSyncClock (ccb);
+    // Let everyone else see it. The scheduler can place threads on it from here on
+    nkAddCpuTopology (ccb);
+    nkCcbs[cpuNum] = ccb;
+    NkAtomicStore (&nkNumCpus, cpuNum + 1);
+    NkInitDpcCpu (ccb);
+    return NK_AP_STARTED;
+}
+
+// Starts every other CPU in the system
+void NkStartCpus()
+{
+    if (NkReadArg ("-nosmp") || !PltCanStartCpus())
+    {
+        nkAddCpuTopology (CpuGetCcb());
+        return;
+    }
+    NkPlatform_t* plt = PltGetPlatform();
+    CpuInitTopology (CpuGetCcb(), plt->bsp);
+    nkAddCpuTopology (CpuGetCcb());
+    int cpuNum = 1;
+    int maxCpus = PltGetMaxCpus();
+    NkLink_t* iter = NkListFront (&plt->cpus);
+    while (iter && cpuNum < maxCpus)
+    {
+        PltCpu_t* cpu = LINK_CONTAINER (iter, PltCpu_t, link);
+        iter = NkListIterate (&plt->cpus, iter);
+        if (cpu == plt->bsp)
+            continue;
+        int res = nkStartCpu (cpu, cpuNum);
+        if (res == NK_AP_STARTED)
+            ++cpuNum;
+        else if (res == NK_AP_SKIPPED)
+            NkLogWarning ("nexke: warning: can't start CPU %d\n", cpu->id);
+        else
+        {
+            // A CPU that still might run the trampoline can't have it changed under it,
+            // so stop here
+            NkLogWarning ("nexke: warning: CPU %d didn't start\n", cpu->id);
+            break;
+        }
+    }
+    NkLogInfo ("nexke: %d CPUs online\n", cpuNum);
+}
+
+// Entry point of CPUs other than the BSP, after the CPU layer has set them up
+void __attribute__ ((noreturn)) NkApMain (NkCcb_t* ccb)
+{
+    // Get onto the kernel's tables, and start taking part in shootdowns
+    MmSwitchSpace (MmGetKernelSpace());
+    MmTlbCpuOnline();
+    // Set up interrupt controller and timer
+    PltInitCpu();
+    NkProfStartCpu();
+    // Check in with the BSP and start scheduling
+    NkAtomicOr (&nkCpusUp, 1L << ccb->cpuNum);
+    PltSyncClock (ccb);
+    TskStartCpu();
+}
+
+// Gets number of CPUs that are running
+int NkGetNumCpus()
+{
+    return (int) NkAtomicLoad (&nkNumCpus);
+}
+
+// Gets mask of CPUs that have checked in
+atomic_t NkGetCpuMask()
+{
+    return NkAtomicLoad (&nkCpusUp);
+}
+
+// Gets CCB of logical CPU
+NkCcb_t* NkGetCcb (int cpuNum)
+{
+    assert (cpuNum < NkGetNumCpus());
+    // The BSP's CCB is there from the start
+    if (!cpuNum)
+        return CpuRealCcb();
+    return nkCcbs[cpuNum];
+}
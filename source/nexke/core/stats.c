@@ -0,0 +1,88 @@
+/*
+    stats.c - contains statistics registry
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <string.h>
+
+// Per-CPU values of stats
+NK_PERCPU long nkStatValues[NK_STAT_MAX];
+
+// Registered stats, in the order they were registered
+static NkStat_t* nkStatHead = NULL;
+static NkStat_t* nkStatTail = NULL;
+static int nkStatNext = 1;    // Next free slot, slot 0 is for unregistered stats
+static spinlock_t nkStatLock = 0;
+
+// Registers a stat, giving it a slot
+void NkStatRegister (NkStat_t* stat)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&nkStatLock);
+    // Stats that are read from their subsystem don't need a slot
+    if (!stat->read)
+    {
+        if (nkStatNext == NK_STAT_MAX)
+            NkPanic ("nexke: out of stat slots registering %s\n", stat->name);
+        stat->idx = nkStatNext++;
+    }
+    stat->next = NULL;
+    if (nkStatTail)
+        nkStatTail->next = stat;
+    else
+        nkStatHead = stat;
+    nkStatTail = stat;
+    NkSpinUnlock (&nkStatLock);
+    PltLowerIpl (ipl);
+}
+
+// Gets the value of a stat over all CPUs
+long long NkStatRead (NkStat_t* stat)
+{
+    if (stat->read)
+        return stat->read();
+    // Copies may change while they're added up, so this is only a snapshot
+    long long val = 0;
+    int numCpus = NkGetNumCpus();
+    for (int i = 0; i < numCpus; ++i)
+        val += *(volatile long*) NK_PERCPU_PTR_CPU (nkStatValues[stat->idx], NkGetCcb (i));
+    return val;
+}
+
+// Finds a stat by name
+NkStat_t* NkStatFind (const char* name)
+{
+    // Stats are never unregistered, so the list can be walked without the lock
+    NkStat_t* stat = nkStatHead;
+    while (stat && strcmp (stat->name, name) != 0)
+        stat = stat->next;
+    return stat;
+}
+
+// Logs every stat
+void NkStatDump()
+{
+    NkLogInfo ("nexke: stats:\n");
+    for (NkStat_t* stat = nkStatHead; stat; stat = stat->next)
+    {
+        NkLogInfo ("  %-24s  %s  %lld\n",
+                   stat->name,
+                   (stat->type == NK_STAT_COUNTER) ? "counter" : "gauge  ",
+                   NkStatRead (stat));
+    }
+}
@@ -28,6 +28,107 @@ static PltHwTimer_t* nkTimer = NULL;
 // Clock pointer
 static PltHwClock_t* nkClock = NULL;
 
+// Hooks the clock and timer static calls go to until they're picked
+static ktime_t nkNoGetTime()
+{
+    return 0;
+}
+
+static void nkNoArmTimer (ktime_t delta)
+{
+}
+
+NK_STATIC_CALL_DEFINE (PltGetTime, PltHwGetTime, nkNoGetTime);
+NK_STATIC_CALL_DEFINE (PltArmTimer, PltHwArmTimer, nkNoArmTimer);
+
+// Timekeeper
+// Every timer interrupt stores the time it ran at, so the coarse clock can be read without going
+// to the hardware. A periodic event makes sure that happens even when nothing else is queued
+typedef struct _nktimekeeper
+{
+    seqlock_t seq;           // Sequence lock on the times
+    ktime_t last;            // Monotonic time of last update
+    ktime_t realOffset;      // Real time minus monotonic time
+    spinlock_t lock;         // Serializes updates
+    NkTimeEvent_t* event;    // Periodic update event
+} nkTimekeeper_t;
+
+static nkTimekeeper_t nkTimekeeper = {0};
+
+// Brings the timekeeper up to now
+// Called at IPL high
+static void nkTimekeeperUpdate (ktime_t now)
+{
+    // Whoever has it is updating it to about the same time
+    if (!NkSpinTryLock (&nkTimekeeper.lock))
+        return;
+    // Clocks of different CPUs can be a bit apart, so don't let it go backwards
+    if (now > nkTimekeeper.last)
+    {
+        NkSeqWriteBegin (&nkTimekeeper.seq);
+        nkTimekeeper.last = now;
+        NkSeqWriteEnd (&nkTimekeeper.seq);
+    }
+    NkSpinUnlock (&nkTimekeeper.lock);
+}
+
+// Periodic timekeeper event
+static void nkTimekeeperTick (NkTimeEvent_t* event, void* arg)
+{
+    // NkTimeHandler updates the timekeeper before running us, so there's nothing left to do
+}
+
+// Gets monotonic time, reading the clock
+ktime_t NkGetMonotonic()
+{
+    return NK_STATIC_CALL (PltGetTime)();
+}
+
+// Gets monotonic time as of the last timer interrupt
+ktime_t NkGetMonotonicCoarse()
+{
+    ktime_t time = 0;
+    uint32_t seq = 0;
+    do
+    {
+        seq = NkSeqReadBegin (&nkTimekeeper.seq);
+        time = nkTimekeeper.last;
+    } while (NkSeqReadRetry (&nkTimekeeper.seq, seq));
+    return time;
+}
+
+// Gets real time
+ktime_t NkGetRealtime()
+{
+    ktime_t offset = 0;
+    uint32_t seq = 0;
+    do
+    {
+        seq = NkSeqReadBegin (&nkTimekeeper.seq);
+        offset = nkTimekeeper.realOffset;
+    } while (NkSeqReadRetry (&nkTimekeeper.seq, seq));
+    return NK_STATIC_CALL (PltGetTime)() + offset;
+}
+
+// Sets real time
+void NkSetRealtime (ktime_t time)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&nkTimekeeper.lock);
+    NkSeqWriteBegin (&nkTimekeeper.seq);
+    nkTimekeeper.realOffset = time - NK_STATIC_CALL (PltGetTime)();
+    NkSeqWriteEnd (&nkTimekeeper.seq);
+    NkSpinUnlock (&nkTimekeeper.lock);
+    PltLowerIpl (ipl);
+}
+
+// Constructs a timer event
+static void nkTimeEventCtor (void* obj)
+{
+    // This ensures events always start out unregistered
+    memset (obj, 0, sizeof (NkTimeEvent_t));
+}
+
 // Allocates a timer event
 NkTimeEvent_t* NkTimeNewEvent()
 {
@@ -45,7 +146,7 @@ void NkTimeFreeEvent (NkTimeEvent_t* event)
 static FORCEINLINE ktime_t NkTimeDeltaToDeadline (ktime_t* delta)
 {
     // Get ref tick
-    ktime_t refTick = nkClock->getTime();
+    ktime_t refTick = NK_STATIC_CALL (PltGetTime)();
     ktime_t deadline = refTick + *delta;
     // Round to next multiple of timer precision
     deadline += nkTimer->precision;
@@ -59,84 +160,252 @@ static FORCEINLINE ktime_t NkTimeDeltaToDeadline (ktime_t* delta)
     return deadline;
 }
 
-// Admits event into queue
-static FORCEINLINE void nkTimeEvtAdmit (NkCcb_t* ccb, NkTimeEvent_t* event, ktime_t delta)
+// Time wheel
+
+// Gets wheel tick of a time
+#define NK_WHEEL_TICK(time) ((time) >> NK_TIME_WHEEL_TICK_SHIFT)
+
+// Gets position of a tick on a level of the wheel, and the slot of a position
+#define NK_WHEEL_POS(tick, level) ((tick) >> ((level) * NK_TIME_WHEEL_SLOT_SHIFT))
+#define NK_WHEEL_SLOT(pos)        ((int) ((pos) & (NK_TIME_WHEEL_SLOTS - 1)))
+
+// Puts event on the due list, keeping it sorted
+static void nkTimeWheelAddDue (NkTimeWheel_t* wheel, NkTimeEvent_t* event)
 {
-    // Grab list
-    NkList_t* list = &ccb->timeEvents;
-    NkLink_t* iter = NkListFront (list);
-    // Find where in list to add
-    // Basically the list is sorted by when event deadline is. Earliest deadline is first
-    if (!iter)
+    // Look from the back, as events mostly get added in deadline order
+    NkLink_t* iter = wheel->due.prev;
+    while (iter != &wheel->due &&
+           LINK_CONTAINER (iter, NkTimeEvent_t, link)->deadline > event->deadline)
+    {
+        iter = iter->prev;
+    }
+    NkListAdd (&wheel->due, iter, &event->link);
+    event->slot = -1;
+}
+
+// Puts event in the wheel
+static void nkTimeWheelAdd (NkTimeWheel_t* wheel, NkTimeEvent_t* event)
+{
+    ktime_t tick = NK_WHEEL_TICK (event->deadline);
+    if (tick < wheel->tick)
     {
-        // List is empty, add to front
-        NkListAddFront (list, &event->link);
+        nkTimeWheelAddDue (wheel, event);
+        return;
     }
-    else
+    // Find the lowest level that reaches it
+    int level = 0;
+    while (level < (NK_TIME_WHEEL_LEVELS - 1) &&
+           (NK_WHEEL_POS (tick, level) - NK_WHEEL_POS (wheel->tick, level)) >= NK_TIME_WHEEL_SLOTS)
     {
-        // Loop through list to find spot
-        while (iter)
+        ++level;
+    }
+    // Events further out than the top level reaches go in its last slot, and get put back in
+    // when it's cascaded
+    ktime_t pos = NK_WHEEL_POS (tick, level);
+    ktime_t lastPos = NK_WHEEL_POS (wheel->tick, level) + NK_TIME_WHEEL_SLOTS - 1;
+    if (pos > lastPos)
+        pos = lastPos;
+    int slot = NK_WHEEL_SLOT (pos);
+    NkListAddBack (&wheel->slots[level][slot], &event->link);
+    wheel->slotMask[level] |= (1ULL << slot);
+    event->slot = (level * NK_TIME_WHEEL_SLOTS) + slot;
+}
+
+// Takes event out of the wheel
+static void nkTimeWheelRemove (NkTimeWheel_t* wheel, NkTimeEvent_t* event)
+{
+    if (event->slot < 0)
+    {
+        NkListRemove (&wheel->due, &event->link);
+        return;
+    }
+    int level = event->slot / NK_TIME_WHEEL_SLOTS;
+    int slot = event->slot % NK_TIME_WHEEL_SLOTS;
+    NkListRemove (&wheel->slots[level][slot], &event->link);
+    if (!NkListFront (&wheel->slots[level][slot]))
+        wheel->slotMask[level] &= ~(1ULL << slot);
+}
+
+// Gets mask of used slots of level, rotated so the slot we are at is the lowest bit
+// Sets pos to our position on the level
+static FORCEINLINE uint64_t nkTimeWheelMask (NkTimeWheel_t* wheel, int level, ktime_t* pos)
+{
+    uint64_t mask = wheel->slotMask[level];
+    *pos = NK_WHEEL_POS (wheel->tick, level);
+    int cur = NK_WHEEL_SLOT (*pos);
+    if (cur)
+        mask = (mask >> cur) | (mask << (NK_TIME_WHEEL_SLOTS - cur));
+    return mask;
+}
+
+// Gets the next tick the wheel has to do something at, and the level of it
+// Returns UINT64_MAX if the wheel is empty
+static ktime_t nkTimeWheelNext (NkTimeWheel_t* wheel, int* nextLevel)
+{
+    ktime_t next = UINT64_MAX;
+    for (int level = 0; level < NK_TIME_WHEEL_LEVELS; ++level)
+    {
+        ktime_t pos = 0;
+        uint64_t mask = nkTimeWheelMask (wheel, level, &pos);
+        if (!mask)
+            continue;
+        ktime_t tick = (pos + __builtin_ctzll (mask)) << (level * NK_TIME_WHEEL_SLOT_SHIFT);
+        // A slot of an upper level that we're in has to be cascaded right away
+        if (tick < wheel->tick)
+            tick = wheel->tick;
+        // Ties go to upper levels, as their events may be earlier in the tick
+        if (tick <= next)
         {
-            NkTimeEvent_t* cur = LINK_CONTAINER (iter, NkTimeEvent_t, link);
-            // If it meets the deadline or if this is the last entry, add here
-            if (event->deadline < cur->deadline)
-            {
-                // Found spot, add it here
-                NkListAddBefore (list, iter, &event->link);
-                break;    // Exit loop
-            }
-            else if (iter->next == list)
-            {
-                // Add after
-                NkListAdd (list, iter, &event->link);
-                break;
-            }
-            iter = NkListIterate (list, iter);    // To next spot
+            next = tick;
+            *nextLevel = level;
         }
     }
-    // If this event is in the front, then we need to arm the timer
-    // NOTE: this is only true if we are not using a software timer.
-    // In that case, we have no need to arm anything
-    if (&event->link == NkListFront (&ccb->timeEvents))
+    return next;
+}
+
+// Moves every event in slot of level down the wheel
+static void nkTimeWheelCascade (NkTimeWheel_t* wheel, int level, int slot)
+{
+    NkList_t* list = &wheel->slots[level][slot];
+    wheel->slotMask[level] &= ~(1ULL << slot);
+    NkLink_t* iter = NkListFront (list);
+    while (iter)
     {
-        // Arm timer if needed
-        if (nkTimer->type != PLT_TIMER_SOFT)
+        NkListRemove (list, iter);
+        NkTimeEvent_t* event = LINK_CONTAINER (iter, NkTimeEvent_t, link);
+        if (level)
+            nkTimeWheelAdd (wheel, event);
+        else
+            nkTimeWheelAddDue (wheel, event);
+        iter = NkListFront (list);
+    }
+}
+
+// Moves the wheel up to time, making events in every tick reached due
+static void nkTimeWheelAdvance (NkTimeWheel_t* wheel, ktime_t time)
+{
+    ktime_t target = NK_WHEEL_TICK (time);
+    while (wheel->tick <= target)
+    {
+        // Skip straight to the next tick that has something to do
+        int level = 0;
+        ktime_t next = nkTimeWheelNext (wheel, &level);
+        if (next > target)
+        {
+            wheel->tick = target + 1;
+            break;
+        }
+        wheel->tick = next;
+        // Cascade from the top down, so events that fall in this tick get expired with it
+        for (level = NK_TIME_WHEEL_LEVELS - 1; level >= 0; --level)
         {
-            // Arm timer
-            nkTimer->armTimer (delta);
-            ccb->nextDeadline = event->deadline;
+            int slot = NK_WHEEL_SLOT (NK_WHEEL_POS (next, level));
+            if (wheel->slotMask[level] & (1ULL << slot))
+                nkTimeWheelCascade (wheel, level, slot);
         }
+        wheel->tick = next + 1;
     }
 }
 
-// Removes event from queue
-static FORCEINLINE void nkTimeEvtRemove (NkCcb_t* ccb, NkTimeEvent_t* event)
+// Gets the time the timer should go off at next, or 0 if nothing is queued
+// Events may go off as late as their slack lets them, so this is the earliest time any event has
+// to go off by. Everything that's due by then goes off in the same interrupt
+static ktime_t nkTimeWheelDeadline (NkTimeWheel_t* wheel)
 {
-    NkList_t* list = &ccb->timeEvents;
-    // Figure out if this is the head
-    bool isHead = false;
-    if (&event->link == NkListFront (list))
-        isHead = true;
-    // Remove this event from list
-    NkListRemove (list, &event->link);
-    event->inUse = false;
-    // Set head if needed
-    if (isHead)
+    ktime_t latest = UINT64_MAX;
+    // Due events are before anything in the wheel, and are sorted, so stop at the first one
+    // that starts after the best we have
+    NkLink_t* iter = NkListFront (&wheel->due);
+    while (iter)
+    {
+        NkTimeEvent_t* event = LINK_CONTAINER (iter, NkTimeEvent_t, link);
+        if (event->deadline >= latest)
+            break;
+        if ((event->deadline + event->slack) < latest)
+            latest = event->deadline + event->slack;
+        iter = NkListIterate (&wheel->due, iter);
+    }
+    // Now look at slots of the bottom level in order, until they start after it also
+    ktime_t pos = 0;
+    uint64_t mask = nkTimeWheelMask (wheel, 0, &pos);
+    while (mask)
     {
-        // Now we need to re-arm the timer
-        if (nkTimer->type != PLT_TIMER_SOFT)
+        ktime_t tick = pos + __builtin_ctzll (mask);
+        if ((tick << NK_TIME_WHEEL_TICK_SHIFT) >= latest)
+            break;
+        NkList_t* list = &wheel->slots[0][NK_WHEEL_SLOT (tick)];
+        iter = NkListFront (list);
+        while (iter)
         {
-            ktime_t deadline = event->deadline;
-            int64_t delta = deadline - nkClock->getTime();
-            if (delta < 0)
-            {
-                // TODO: is there a better way of handling this?
-                delta = 0;
-            }
-            nkTimer->armTimer (delta);
-            ccb->nextDeadline = event->deadline;
+            NkTimeEvent_t* event = LINK_CONTAINER (iter, NkTimeEvent_t, link);
+            if ((event->deadline + event->slack) < latest)
+                latest = event->deadline + event->slack;
+            iter = NkListIterate (list, iter);
         }
+        mask &= mask - 1;
+    }
+    // Upper levels have to be cascaded as soon as we reach their next slot
+    for (int level = 1; level < NK_TIME_WHEEL_LEVELS; ++level)
+    {
+        mask = nkTimeWheelMask (wheel, level, &pos);
+        if (!mask)
+            continue;
+        ktime_t tick = (pos + __builtin_ctzll (mask)) << (level * NK_TIME_WHEEL_SLOT_SHIFT);
+        if (tick < wheel->tick)
+            tick = wheel->tick;
+        if ((tick << NK_TIME_WHEEL_TICK_SHIFT) < latest)
+            latest = tick << NK_TIME_WHEEL_TICK_SHIFT;
+    }
+    return (latest == UINT64_MAX) ? 0 : latest;
+}
+
+// Arms the timer of ccb for its next event
+// Must be called on ccb
+static void nkTimeArm (NkCcb_t* ccb)
+{
+    // Software timers check on every tick anyway
+    if (nkTimer->type == PLT_TIMER_SOFT)
+        return;
+    ktime_t deadline = nkTimeWheelDeadline (&ccb->timeWheel);
+    ccb->nextDeadline = deadline;
+    // If nothing is queued, there's no way to disarm the timer, so it just goes off once for
+    // nothing
+    if (!deadline)
+        return;
+    int64_t delta = (int64_t) (deadline - NK_STATIC_CALL (PltGetTime)());
+    if (delta < 0)
+    {
+        // TODO: is there a better way of handling this?
+        delta = 0;
     }
+    NK_STATIC_CALL (PltArmTimer) (delta);
+}
+
+// Admits event into queue
+static FORCEINLINE void nkTimeEvtAdmit (NkCcb_t* ccb, NkTimeEvent_t* event)
+{
+    NkTimeWheel_t* wheel = &ccb->timeWheel;
+    // The wheel only moves when the timer goes off, so bring it up to now first, in case the
+    // CPU has been idle for a while
+    nkTimeWheelAdvance (wheel, NK_STATIC_CALL (PltGetTime)());
+    nkTimeWheelAdd (wheel, event);
+    event->ccb = ccb;
+    event->inUse = true;
+    // Only re-arm if this event can't wait for what the timer is already armed for
+    if (!ccb->nextDeadline || (event->deadline + event->slack) < ccb->nextDeadline)
+        nkTimeArm (ccb);
+}
+
+// Removes event from queue
+static FORCEINLINE void nkTimeEvtRemove (NkCcb_t* ccb, NkTimeEvent_t* event)
+{
+    nkTimeWheelRemove (&ccb->timeWheel, event);
+    event->inUse = false;
+    // If the timer was armed for this event, re-arm it for whatever is next
+    // We can only arm our own timer. If the event was on another CPU, its timer just goes
+    // off early and re-arms itself
+    if ((event->deadline + event->slack) == ccb->nextDeadline && ccb == CpuGetCcb())
+        nkTimeArm (ccb);
     event->link.next = event->link.prev = NULL;
 }
 
@@ -163,40 +432,85 @@ void NkTimeSetWakeEvent (NkTimeEvent_t* event, TskWaitObj_t* waiter)
     PltLowerIpl (ipl);
 }
 
+// Sets how long after its deadline event may go off
+// Slack lets the event share a timer interrupt with others around the same time
+// It takes effect the next time the event is registered
+void NkTimeSetSlack (NkTimeEvent_t* event, ktime_t slack)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&event->lock);
+    event->slack = slack;
+    NkSpinUnlock (&event->lock);
+    PltLowerIpl (ipl);
+}
+
+// Locks event along with the queue it is on
+// Events that aren't registered go on the current CPU's queue
+// IPL must be high
+static NkCcb_t* nkTimeLockEvent (NkTimeEvent_t* event)
+{
+    for (;;)
+    {
+        NkCcb_t* ccb = (event->inUse) ? event->ccb : CpuGetCcb();
+        NkSpinLock (&ccb->timeLock);
+        NkSpinLock (&event->lock);
+        // Make sure it didn't move while we were locking the queue
+        NkCcb_t* owner = (event->inUse) ? event->ccb : CpuGetCcb();
+        if (owner == ccb)
+            return ccb;
+        NkSpinUnlock (&event->lock);
+        NkSpinUnlock (&ccb->timeLock);
+    }
+}
+
+// Unlocks event and its queue
+static void nkTimeUnlockEvent (NkCcb_t* ccb, NkTimeEvent_t* event)
+{
+    NkSpinUnlock (&event->lock);
+    NkSpinUnlock (&ccb->timeLock);
+}
+
 // Registers a time event
 void NkTimeRegEvent (NkTimeEvent_t* event, ktime_t delta, int flags)
 {
     // Raise IPL to protect event list
-    NkCcb_t* ccb = CpuGetCcb();
     ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
-    NkSpinLock (&ccb->timeLock);
-    NkSpinLock (&event->lock);
+    NkCcb_t* ccb = nkTimeLockEvent (event);
     if (event->inUse)
     {
         // Check if we are allowed to de register
-        if (flags & NK_TIME_REG_DEREG)
-            nkTimeEvtRemove (ccb, event);
-        else
+        if (!(flags & NK_TIME_REG_DEREG))
         {
-            NkSpinUnlock (&event->lock);
-            NkSpinUnlock (&ccb->timeLock);
+            nkTimeUnlockEvent (ccb, event);
             PltLowerIpl (ipl);
             return;    // Event expired, do nothing
         }
+        nkTimeEvtRemove (ccb, event);
+        // Events are always queued on the CPU that registers them, so move it over to us
+        if (ccb != CpuGetCcb())
+        {
+            nkTimeUnlockEvent (ccb, event);
+            ccb = nkTimeLockEvent (event);
+            if (event->inUse)
+            {
+                // Somebody else registered it in the meantime
+                nkTimeUnlockEvent (ccb, event);
+                PltLowerIpl (ipl);
+                return;
+            }
+        }
     }
     // Get deadline and convert delta to timer format
     event->deadline = NkTimeDeltaToDeadline (&delta);
     event->delta = delta;
     event->expired = false;
     // Check if this is a periodic register
-    if (flags & NK_TIME_REG_PERIODIC)
-        event->periodic = true;
+    event->periodic = (flags & NK_TIME_REG_PERIODIC) != 0;
+    event->pinned = (flags & NK_TIME_REG_PINNED) != 0;
     // Admit into queue
-    nkTimeEvtAdmit (ccb, event, delta);
+    nkTimeEvtAdmit (ccb, event);
     // Return
-    event->inUse = true;
-    NkSpinUnlock (&event->lock);
-    NkSpinUnlock (&ccb->timeLock);
+    nkTimeUnlockEvent (ccb, event);
     PltLowerIpl (ipl);
 }
 
@@ -204,40 +518,111 @@ void NkTimeRegEvent (NkTimeEvent_t* event, ktime_t delta, int flags)
 void NkTimeDeRegEvent (NkTimeEvent_t* event)
 {
     // Raise IPL to protect event list
-    NkCcb_t* ccb = CpuGetCcb();
+    // The event may be on another CPU's queue, e.g., when a thread's timeout is cancelled from
+    // the CPU that woke it
     ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
-    NkSpinLock (&ccb->timeLock);
-    NkSpinLock (&event->lock);
+    NkCcb_t* ccb = nkTimeLockEvent (event);
     if (event->expired || !event->inUse)
     {
-        NkSpinUnlock (&event->lock);
-        NkSpinUnlock (&ccb->timeLock);
+        nkTimeUnlockEvent (ccb, event);
         PltLowerIpl (ipl);
         return;    // Event expired, do nothing
     }
     // Remove it
     nkTimeEvtRemove (ccb, event);
     // Unlock and return
-    NkSpinUnlock (&event->lock);
+    nkTimeUnlockEvent (ccb, event);
+    PltLowerIpl (ipl);
+}
+
+// Keeps a periodic event from being registered again after it goes off
+// Only callable from the event's own callback, which runs with the event locked
+void NkTimeStopPeriodic (NkTimeEvent_t* event)
+{
+    event->periodic = false;
+}
+
+// Moves events of list on ccb's wheel that can wait until armed to target
+static int nkTimeMoveList (NkCcb_t* ccb, NkCcb_t* target, NkList_t* list, ktime_t armed)
+{
+    int moved = 0;
+    NkLink_t* iter = NkListFront (list);
+    while (iter)
+    {
+        NkTimeEvent_t* event = LINK_CONTAINER (iter, NkTimeEvent_t, link);
+        iter = NkListIterate (list, iter);
+        if (event->pinned || (event->deadline + event->slack) < armed)
+            continue;
+        NkSpinLock (&event->lock);
+        nkTimeWheelRemove (&ccb->timeWheel, event);
+        nkTimeWheelAdd (&target->timeWheel, event);
+        event->ccb = target;
+        NkSpinUnlock (&event->lock);
+        ++moved;
+    }
+    return moved;
+}
+
+// Moves events that aren't pinned from the current CPU to target
+// We can't arm the timer of another CPU, so only events that can wait for what target's timer is
+// already armed for get moved. Once it goes off, it re-arms itself for them
+int NkTimeMigrate (NkCcb_t* target)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    if (target == ccb)
+        return 0;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&ccb->timeLock);
+    // Target may be moving events to us at the same time, so only try its lock
+    if (!ccb->nextDeadline || !NkSpinTryLock (&target->timeLock))
+    {
+        NkSpinUnlock (&ccb->timeLock);
+        PltLowerIpl (ipl);
+        return 0;
+    }
+    int moved = 0;
+    ktime_t armed = target->nextDeadline;
+    if (armed)
+    {
+        NkTimeWheel_t* wheel = &ccb->timeWheel;
+        nkTimeWheelAdvance (&target->timeWheel, NK_STATIC_CALL (PltGetTime)());
+        moved += nkTimeMoveList (ccb, target, &wheel->due, armed);
+        for (int level = 0; level < NK_TIME_WHEEL_LEVELS; ++level)
+        {
+            uint64_t mask = wheel->slotMask[level];
+            while (mask)
+            {
+                int slot = __builtin_ctzll (mask);
+                moved += nkTimeMoveList (ccb, target, &wheel->slots[level][slot], armed);
+                mask &= mask - 1;
+            }
+        }
+    }
+    NkSpinUnlock (&target->timeLock);
+    // Our timer only has to go off for what's left now
+    if (moved)
+        nkTimeArm (ccb);
     NkSpinUnlock (&ccb->timeLock);
     PltLowerIpl (ipl);
+    return moved;
 }
 
-// Drains timer queue
-static FORCEINLINE void nkDrainTimeQueue (NkCcb_t* ccb, NkList_t* list, NkLink_t* iter)
+// Drains events that are due by now
+static FORCEINLINE void nkDrainTimeQueue (NkCcb_t* ccb, ktime_t now)
 {
-    // We know a timer (or multiple) has/have expired, execute each cb
-    NkTimeEvent_t* event = LINK_CONTAINER (iter, NkTimeEvent_t, link);
-    ktime_t tick = ccb->nextDeadline;
-    while (iter && tick == event->deadline)
+    NkList_t* list = &ccb->timeWheel.due;
+    NkLink_t* iter = NkListFront (list);
+    while (iter)
     {
+        NkTimeEvent_t* event = LINK_CONTAINER (iter, NkTimeEvent_t, link);
+        if (event->deadline > now)
+            break;    // Everything after this is later also
         NkSpinLock (&event->lock);
         // Event has expired, remove from list and call handler
         event->inUse = false;
-        NkLink_t* oldIter = iter;             // Save this iterator
-        iter = NkListIterate (list, iter);    // To next one
-        NkListRemove (list, oldIter);
+        NkListRemove (list, iter);
         event->expired = true;    // Set expiry flag
+        NK_TRACE (NK_TRACE_TIMER, event, event->deadline);
         // Call the event handler
         if (event->type == NEXKE_EVENT_CB)
             event->callback (event, event->arg);
@@ -255,11 +640,11 @@ static FORCEINLINE void nkDrainTimeQueue (NkCcb_t* ccb, NkList_t* list, NkLink_t
             event->deadline = NkTimeDeltaToDeadline (&event->delta);
             event->expired = false;
             // Admit the new event
-            nkTimeEvtAdmit (ccb, event, event->delta);
+            nkTimeEvtAdmit (ccb, event);
         }
         // Unlock and go to next event
         NkSpinUnlock (&event->lock);
-        event = LINK_CONTAINER (iter, NkTimeEvent_t, link);    // To next one
+        iter = NkListFront (list);
     }
 }
 
@@ -269,42 +654,14 @@ void NkTimeHandler()
     NkCcb_t* ccb = CpuGetCcb();
     ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
     NkSpinLock (&ccb->timeLock);
-    NkList_t* list = &ccb->timeEvents;
-    NkLink_t* iter = NkListFront (list);
-    // If this is a software timer, we need to tick through the event until it expires
-    // Otherwise, then an event has occured and we just need to execute each handler for this
-    // deadline
-    if (nkTimer->type == PLT_TIMER_SOFT)
-    {
-        // Check if timers have expired
-        NkTimeEvent_t* event = LINK_CONTAINER (iter, NkTimeEvent_t, link);
-        // Set deadline in CCB
-        ccb->nextDeadline = event->deadline;
-        if (event->deadline == nkClock->getTime())
-            nkDrainTimeQueue (ccb, list, iter);
-    }
-    else
-    {
-        if (!iter)
-            return;    // Return. no timer expired. Or assert maybe?
-        nkDrainTimeQueue (ccb, list, iter);
-        // Arm the next event
-        NkLink_t* front = NkListFront (&ccb->timeEvents);
-        if (front)
-        {
-            NkTimeEvent_t* event = LINK_CONTAINER (front, NkTimeEvent_t, link);
-            NkSpinLock (&event->lock);
-            int64_t delta = event->deadline - nkClock->getTime();
-            if (delta < 0)
-            {
-                // TODO: is there a better way of handling this?
-                delta = 0;
-            }
-            nkTimer->armTimer (delta);
-            ccb->nextDeadline = event->deadline;
-            NkSpinUnlock (&event->lock);
-        }
-    }
+    // Software timers call us on every tick, and hardware timers may go off early, e.g., for an
+    // event that got removed, so only run what's actually due
+    ktime_t now = NK_STATIC_CALL (PltGetTime)();
+    nkTimekeeperUpdate (now);
+    nkTimeWheelAdvance (&ccb->timeWheel, now);
+    nkDrainTimeQueue (ccb, now);
+    // Arm the next event
+    nkTimeArm (ccb);
     NkSpinUnlock (&ccb->timeLock);
     PltLowerIpl (ipl);
 }
@@ -317,13 +674,57 @@ void NkPoll (ktime_t time)
     PltLowerIpl (ipl);
 }
 
+// Delays for ns
+void NkDelayNs (ktime_t ns)
+{
+    // Clocks may go by a counter of this CPU, so stay on it, but leave interrupts alone
+    TskDisablePreempt();
+    nkClock->poll (ns);
+    TskEnablePreempt();
+}
+
+// Delays for us
+void NkDelayUs (ktime_t us)
+{
+    NkDelayNs (us * 1000);
+}
+
 // Initializes timing subsystem
 void NkInitTime()
 {
     NkLogDebug ("nexke: intializing timer\n");
     nkClock = PltGetPlatform()->clock;
     nkTimer = PltGetPlatform()->timer;
-    NkListInit (&CpuGetCcb()->timeEvents);    // Initialize list
-    nkEventCache = MmCacheCreate (sizeof (NkTimeEvent_t), "NkTimeEvent_t", 0, 0);
+    NkInitTimeCpu (CpuGetCcb());
+    nkEventCache = MmCacheCreateCtor (sizeof (NkTimeEvent_t),
+                                      "NkTimeEvent_t",
+                                      MM_TAG_CORE,
+                                      0,
+                                      0,
+                                      nkTimeEventCtor,
+                                      NULL);
     assert (nkTimer && nkClock);
+    // Start the timekeeper
+    nkTimekeeper.last = NK_STATIC_CALL (PltGetTime)();
+    nkTimekeeper.event = NkTimeNewEvent();
+    if (!nkTimekeeper.event)
+        NkPanicOom();
+    NkTimeSetCbEvent (nkTimekeeper.event, nkTimekeeperTick, NULL);
+    // It doesn't matter when exactly it goes off, so let it share interrupts with other events
+    NkTimeSetSlack (nkTimekeeper.event, NK_TIMEKEEPER_TICK / 2);
+    NkTimeRegEvent (nkTimekeeper.event, NK_TIMEKEEPER_TICK / 2, NK_TIME_REG_PERIODIC);
+}
+
+// Initializes timing state of a CPU
+void NkInitTimeCpu (NkCcb_t* ccb)
+{
+    NkTimeWheel_t* wheel = &ccb->timeWheel;
+    for (int level = 0; level < NK_TIME_WHEEL_LEVELS; ++level)
+    {
+        for (int slot = 0; slot < NK_TIME_WHEEL_SLOTS; ++slot)
+            NkListInit (&wheel->slots[level][slot]);
+        wheel->slotMask[level] = 0;
+    }
+    NkListInit (&wheel->due);
+    wheel->tick = NK_WHEEL_TICK (NK_STATIC_CALL (PltGetTime)());
 }
@@ -0,0 +1,172 @@
+/*
+    trace.c - contains event tracing
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/task.h>
+#include <stdlib.h>
+
+// Tracepoints write fixed size records into a ring owned by the CPU they run on. Slots are
+// claimed by bumping the ring's head, so a tracepoint in an interrupt can land in the middle of
+// one in a thread without either losing its record. Once the ring is full, the oldest records
+// get written over
+// Each record is stamped with its sequence number last, so the dump can tell a record that was
+// being written when it looked apart from one that was finished
+//
+// Boot arguments:
+// -trace [sec]  traces for sec seconds, and then logs what was recorded
+
+#define NK_TRACE_RECORDS 4096    // Records in each ring, must be a power of 2
+#define NK_TRACE_TIME    5       // Default seconds to trace for
+
+// Trace record
+typedef struct _nktracerec
+{
+    uint64_t time;      // Cycle count when recorded
+    uint32_t seq;       // Sequence number plus 1, 0 while being written
+    int32_t tid;        // Running thread, -1 if none
+    uint16_t event;     // Event type
+    uintptr_t arg1;     // Event arguments
+    uintptr_t arg2;
+} nkTraceRec_t;
+
+// Per-CPU ring
+typedef struct _nktracering
+{
+    uint32_t head;    // Next sequence number
+    nkTraceRec_t recs[NK_TRACE_RECORDS];
+} nkTraceRing_t;
+
+// Event names, indexed by event
+static const char* nkTraceNames[] = {NULL,
+                                     "switch",
+                                     "fault",
+                                     "int enter",
+                                     "int exit",
+                                     "timer",
+                                     "slab grow"};
+
+bool nkTraceOn = false;    // Whether records are being taken
+
+// Work queue that stops tracing
+static NkWorkQueue_t* nkTraceQueue = NULL;
+
+// This CPU's ring
+static NK_PERCPU nkTraceRing_t* nkTraceRing;
+
+// Records an event
+void NkTraceRecord (int event, uintptr_t arg1, uintptr_t arg2)
+{
+    nkTraceRing_t* ring = NK_PERCPU_READ (nkTraceRing);
+    if (!ring || !__atomic_load_n (&nkTraceOn, __ATOMIC_RELAXED))
+        return;
+    // If we get moved while in here, this record just ends up in the other CPU's ring
+    uint32_t seq = __atomic_fetch_add (&ring->head, 1, __ATOMIC_RELAXED);
+    nkTraceRec_t* rec = &ring->recs[seq & (NK_TRACE_RECORDS - 1)];
+    __atomic_store_n (&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_signal_fence (__ATOMIC_SEQ_CST);
+    rec->time = CpuGetCycles();
+    NkThread_t* thread = CpuGetCcb()->curThread;
+    rec->tid = (thread) ? (int32_t) thread->tid : -1;
+    rec->event = event;
+    rec->arg1 = arg1;
+    rec->arg2 = arg2;
+    __atomic_store_n (&rec->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Logs what's in the rings
+void NkTraceDump()
+{
+    for (int i = 0; i < NkGetNumCpus(); ++i)
+    {
+        nkTraceRing_t* ring = *NK_PERCPU_PTR_CPU (nkTraceRing, NkGetCcb (i));
+        if (!ring)
+            continue;
+        uint32_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+        uint32_t first = (head > NK_TRACE_RECORDS) ? head - NK_TRACE_RECORDS : 0;
+        NkLogInfo ("nexke: trace of CPU %d, %u events, %u dropped\n", i, head - first, first);
+        uint64_t last = 0;
+        for (uint32_t seq = first; seq < head; ++seq)
+        {
+            nkTraceRec_t* rec = &ring->recs[seq & (NK_TRACE_RECORDS - 1)];
+            // Skip records that are being written, or have been written over since
+            if (__atomic_load_n (&rec->seq, __ATOMIC_ACQUIRE) != seq + 1)
+                continue;
+            const char* name = "unknown";
+            if (rec->event < (sizeof (nkTraceNames) / sizeof (const char*)) &&
+                nkTraceNames[rec->event])
+                name = nkTraceNames[rec->event];
+            NkLogInfo ("  %llu (+%llu): %s, thread %d, %#llX %#llX\n",
+                       (unsigned long long) rec->time,
+                       (unsigned long long) ((last) ? rec->time - last : 0),
+                       name,
+                       (int) rec->tid,
+                       (unsigned long long) rec->arg1,
+                       (unsigned long long) rec->arg2);
+            last = rec->time;
+        }
+    }
+}
+
+// Stops tracing and logs the trace
+static void nkTraceStop (NkWorkItem_t*)
+{
+    __atomic_store_n (&nkTraceOn, false, __ATOMIC_RELAXED);
+    NkTraceDump();
+}
+
+// Sets up tracing on a CPU that's being started
+void NkTraceInitCpu (NkCcb_t* ccb)
+{
+    if (!nkTraceOn)
+        return;
+    size_t pages = CpuPageAlignUp (sizeof (nkTraceRing_t)) >> NEXKE_CPU_PAGE_SHIFT;
+    nkTraceRing_t* ring = MmAllocKvRegion (pages, MM_KV_NO_DEMAND);
+    if (!ring)
+    {
+        NkLogWarning ("nexke: warning: can't trace CPU %d\n", ccb->cpuNum);
+        return;
+    }
+    ring->head = 0;
+    for (int i = 0; i < NK_TRACE_RECORDS; ++i)
+        ring->recs[i].seq = 0;
+    *NK_PERCPU_PTR_CPU (nkTraceRing, ccb) = ring;
+}
+
+// Sets up tracing
+void NkInitTrace()
+{
+    const char* arg = NkReadArg ("-trace");
+    if (!arg)
+        return;
+    int secs = NK_TRACE_TIME;
+    if (*arg && atoi (arg) > 0)
+        secs = atoi (arg);
+    nkTraceQueue = NkWorkQueueCreate (nkTraceStop,
+                                      NK_WORK_TIMED,
+                                      NK_WORK_ONESHOT | NK_WORK_POLL,
+                                      TSK_PRIO_KERNEL,
+                                      0);
+    if (!nkTraceQueue)
+        NkPanicOom();
+    nkTraceOn = true;
+    NkTraceInitCpu (CpuGetCcb());
+    NkWorkQueueArmTimer (nkTraceQueue, (ktime_t) secs * PLT_NS_IN_SEC);
+    NkLogInfo ("nexke: tracing for %d seconds\n", secs);
+}
@@ -28,12 +28,146 @@ static SlabCache_t* nkWqCache = NULL;
 // Work item cache
 static SlabCache_t* nkItemCache = NULL;
 
+// Managed queues
+// A managed queue has a pool of workers for each CPU work is submitted on, bound to that CPU.
+// A pool tries to keep one worker running at a time. When the running one blocks in the middle
+// of work, an idle one takes over, and a worker that leaves the pool without idle workers starts
+// another, so there's always one to hand off to. Ordered queues have a single unbound pool with
+// one worker, so items run one after another in the order they came in
+
+// Work tunables
+#define NK_WORK_BATCH        16                        // Items taken off a queue at once
+#define NK_WORK_MAX_WORKERS  16                        // Most workers a pool can have
+#define NK_WORK_IDLE_TIMEOUT (PLT_NS_IN_SEC * 5ULL)    // Time extra workers can sit idle for
+
+// Worker pool
+typedef struct _workpool
+{
+    NkWorkCallback cb;       // Callback of queue
+    int cpuNum;              // CPU workers are bound to, -1 if they aren't
+    int prio;                // Priority of workers
+    int maxWorkers;          // Most workers this pool can have
+    spinlock_t lock;         // Protects everything below, taken at high IPL
+    NkList_t items;          // Work to be done
+    size_t numItems;         // Number of pending work items
+    NkWorkItem_t* posted;    // Work posted without the lock, newest first
+    NkList_t idle;           // Workers waiting for work
+    int numIdle;             // Number of idle workers
+    int numWorkers;          // Number of workers
+    int running;             // Workers that are neither idle nor blocked
+    bool dying;              // Whether queue is being destroyed
+} nkWorkPool_t;
+
+// Worker of a pool
+typedef struct _worker
+{
+    nkWorkPool_t* pool;    // Pool we work for
+    NkThread_t* thread;    // Thread of worker
+    bool idle;             // Whether we're on the idle list
+    bool sleeping;         // Whether we're blocked in the middle of work
+    NkLink_t link;         // Link in idle list
+} nkWorker_t;
+
+// Pool and worker caches
+static SlabCache_t* nkPoolCache = NULL;
+static SlabCache_t* nkWorkerCache = NULL;
+
+// Constructs a work queue
+static void nkWorkQueueCtor (void* obj)
+{
+    NkWorkQueue_t* queue = obj;
+    memset (queue, 0, sizeof (NkWorkQueue_t));
+    NkListInit (&queue->items);
+}
+
 // Initializes worker system
 void NkInitWorkQueue()
 {
-    nkWqCache = MmCacheCreate (sizeof (NkWorkQueue_t), "NkWorkQueue_t", 0, 0);
-    nkItemCache = MmCacheCreate (sizeof (NkWorkItem_t), "NkWorkItem_t", 0, 0);
-    assert (nkWqCache && nkItemCache);
+    nkWqCache = MmCacheCreateCtor (sizeof (NkWorkQueue_t),
+                                   "NkWorkQueue_t",
+                                   MM_TAG_CORE,
+                                   0,
+                                   0,
+                                   nkWorkQueueCtor,
+                                   NULL);
+    nkItemCache = MmCacheCreate (sizeof (NkWorkItem_t), "NkWorkItem_t", MM_TAG_CORE, 0, 0);
+    nkPoolCache = MmCacheCreate (sizeof (nkWorkPool_t), "nkWorkPool_t", MM_TAG_CORE, 0, 0);
+    nkWorkerCache = MmCacheCreate (sizeof (nkWorker_t), "nkWorker_t", MM_TAG_CORE, 0, 0);
+    assert (nkWqCache && nkItemCache && nkPoolCache && nkWorkerCache);
+}
+
+// Takes up to a batch of items off of a list
+static void nkWorkTakeBatch (NkList_t* items, size_t* numItems, NkList_t* batch)
+{
+    NkListInit (batch);
+    for (int i = 0; i < NK_WORK_BATCH && *numItems; ++i)
+    {
+        NkLink_t* link = NkListFront (items);
+        NkWorkItem_t* item = LINK_CONTAINER (link, NkWorkItem_t, link);
+        NkListRemove (items, link);
+        --(*numItems);
+        // It's ours now, so it can't be cancelled anymore, but it can be posted again
+        __atomic_store_n (&item->queued, false, __ATOMIC_RELEASE);
+        NkListAddBack (batch, link);
+    }
+}
+
+// Runs and frees a batch of items
+static void nkWorkRunBatch (NkWorkCallback cb, NkList_t* batch)
+{
+    NkLink_t* link = NULL;
+    while ((link = NkListFront (batch)))
+    {
+        NkListRemove (batch, link);
+        NkWorkItem_t* item = LINK_CONTAINER (link, NkWorkItem_t, link);
+        // Embedded items may be gone once their callback returns
+        bool embedded = item->embedded;
+        cb (item);    // Call item
+        if (!embedded)
+            MmCacheFree (nkItemCache, item);
+    }
+}
+
+// Posted work
+// Posting pushes items on a lock-free stack, which consumers take all at once with an exchange,
+// so there's no ABA problem no matter how many take from it. Only the post that finds the stack
+// empty has to wake anyone, as whoever takes the stack takes everything after it too
+
+// Pushes item on a post stack, returning true if it was empty
+static FORCEINLINE bool nkWorkPush (NkWorkItem_t** stack, NkWorkItem_t* item)
+{
+    NkWorkItem_t* head = __atomic_load_n (stack, __ATOMIC_RELAXED);
+    do
+    {
+        item->postNext = head;
+    } while (!__atomic_compare_exchange_n (stack,
+                                           &head,
+                                           item,
+                                           false,
+                                           __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED));
+    return head == NULL;
+}
+
+// Moves everything on a post stack to the back of an item list
+static void nkWorkSplice (NkWorkItem_t** stack, NkList_t* items, size_t* numItems)
+{
+    NkWorkItem_t* item = __atomic_exchange_n (stack, NULL, __ATOMIC_ACQUIRE);
+    // The stack is newest first, so turn it around first
+    NkWorkItem_t* prev = NULL;
+    while (item)
+    {
+        NkWorkItem_t* next = item->postNext;
+        item->postNext = prev;
+        prev = item;
+        item = next;
+    }
+    while (prev)
+    {
+        NkListAddBack (items, &prev->link);
+        ++(*numItems);
+        prev = prev->postNext;
+    }
 }
 
 // Work scheduler function
@@ -45,20 +179,262 @@ static void NkWorkScheduler (void* arg)
     {
         TskWaitCondition (&queue->condition, &queue->lock);
         TskUnsetCondition (&queue->condition);
-        TskAcquireMutex (&queue->lock);
-        // Work needs to occur now, drain queue
+        // Polled queues keep track of their own work
+        if (queue->flags & NK_WORK_POLL)
+        {
+            TskReleaseMutex (&queue->lock);
+            queue->cb (NULL);
+            TskAcquireMutex (&queue->lock);
+        }
+        nkWorkSplice (&queue->posted, &queue->items, &queue->numItems);
+        // Work needs to occur now, drain queue a batch at a time
+        // The lock is dropped while a batch runs, so submitters don't have to wait on it
         while (queue->numItems)
         {
-            NkLink_t* link = NkListFront (&queue->items);
-            NkWorkItem_t* item = LINK_CONTAINER (link, NkWorkItem_t, link);
-            queue->cb (item);    // Call item
-            --queue->numItems;
-            NkListRemove (&queue->items, link);
-            MmCacheFree (nkItemCache, item);
+            NkList_t batch;
+            nkWorkTakeBatch (&queue->items, &queue->numItems, &batch);
+            TskReleaseMutex (&queue->lock);
+            nkWorkRunBatch (queue->cb, &batch);
+            TskAcquireMutex (&queue->lock);
+            nkWorkSplice (&queue->posted, &queue->items, &queue->numItems);
         }
     }
 }
 
+// Wakes an idle worker of pool
+// Pool must be locked at high IPL, so the worker can't get going before it's woken
+// If its wait timed out instead, it sees it's off the list and goes to work anyway
+static bool nkWorkWakeIdle (nkWorkPool_t* pool)
+{
+    NkLink_t* link = NkListFront (&pool->idle);
+    if (!link)
+        return false;
+    nkWorker_t* worker = LINK_CONTAINER (link, nkWorker_t, link);
+    NkListRemove (&pool->idle, link);
+    --pool->numIdle;
+    worker->idle = false;
+    ++pool->running;
+    TskWaitObj_t* waitObj = &worker->thread->wait;
+    if (TskClearWait (waitObj, TSK_WAITOBJ_SUCCESS))
+        TskWakeObj (waitObj);
+    return true;
+}
+
+static void nkWorkerThread (void* arg);
+
+// Starts a new worker in pool
+// The pool must have already counted it as a running worker
+static bool nkWorkStartWorker (nkWorkPool_t* pool)
+{
+    nkWorker_t* worker = MmCacheAlloc (nkWorkerCache);
+    if (!worker)
+        return false;
+    worker->pool = pool;
+    worker->idle = false;
+    worker->sleeping = false;
+    worker->thread = TskCreateThread (nkWorkerThread,
+                                      worker,
+                                      "NkWorker",
+                                      TSK_POLICY_NORMAL,
+                                      pool->prio,
+                                      TSK_THREAD_WORKER);
+    if (!worker->thread)
+    {
+        MmCacheFree (nkWorkerCache, worker);
+        return false;
+    }
+    if (pool->cpuNum != -1)
+        TskPinThread (worker->thread, pool->cpuNum);
+    TskStartThread (worker->thread);
+    return true;
+}
+
+// Waits for work to come in on pool
+// Pool must be locked at high IPL. Returns false if the worker should exit
+static bool nkWorkWaitIdle (nkWorker_t* worker)
+{
+    nkWorkPool_t* pool = worker->pool;
+    nkWorkSplice (&pool->posted, &pool->items, &pool->numItems);
+    while (!pool->numItems)
+    {
+        if (pool->dying)
+            return false;
+        // Go on the idle list and wait for somebody to take us off
+        worker->idle = true;
+        NkListAddBack (&pool->idle, &worker->link);
+        ++pool->numIdle;
+        --pool->running;
+        TskWaitObj_t* waitObj = TskAssertWait (NK_WORK_IDLE_TIMEOUT, pool, TSK_WAITOBJ_WORK);
+        NkSpinUnlock (&pool->lock);
+        TskWaitOnObj (waitObj, 0);
+        NkSpinLock (&pool->lock);
+        nkWorkSplice (&pool->posted, &pool->items, &pool->numItems);
+        if (worker->idle)
+        {
+            // Nobody woke us, so we timed out
+            // Extra workers go away, as long as another idle one is left to take over
+            NkListRemove (&pool->idle, &worker->link);
+            --pool->numIdle;
+            worker->idle = false;
+            ++pool->running;
+            if (pool->numIdle)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Worker thread of managed queues
+static void nkWorkerThread (void* arg)
+{
+    nkWorker_t* worker = arg;
+    nkWorkPool_t* pool = worker->pool;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&pool->lock);
+    while (nkWorkWaitIdle (worker))
+    {
+        NkList_t batch;
+        nkWorkTakeBatch (&pool->items, &pool->numItems, &batch);
+        // If there's nobody left to hand off to when we block, start somebody
+        bool grow = !pool->numIdle && pool->numWorkers < pool->maxWorkers && !pool->dying;
+        if (grow)
+        {
+            ++pool->numWorkers;
+            ++pool->running;
+        }
+        NkSpinUnlock (&pool->lock);
+        PltLowerIpl (ipl);
+        if (grow && !nkWorkStartWorker (pool))
+        {
+            ipl = PltRaiseIpl (PLT_IPL_HIGH);
+            NkSpinLock (&pool->lock);
+            --pool->numWorkers;
+            --pool->running;
+            NkSpinUnlock (&pool->lock);
+            PltLowerIpl (ipl);
+        }
+        nkWorkRunBatch (pool->cb, &batch);
+        ipl = PltRaiseIpl (PLT_IPL_HIGH);
+        NkSpinLock (&pool->lock);
+    }
+    // Leave the pool. The last one out cleans up after a destroyed queue
+    --pool->numWorkers;
+    --pool->running;
+    bool last = pool->dying && !pool->numWorkers;
+    NkSpinUnlock (&pool->lock);
+    PltLowerIpl (ipl);
+    MmCacheFree (nkWorkerCache, worker);
+    if (last)
+        MmCacheFree (nkPoolCache, pool);
+    TskTerminateSelf (0);
+}
+
+// Called by a worker right before it blocks
+// IPL is high, and no locks are held
+void NkWorkSleeping (NkThread_t* thread)
+{
+    // Waiting for work isn't blocking in the middle of it
+    if (thread->wait.type == TSK_WAITOBJ_WORK)
+        return;
+    nkWorker_t* worker = TskGetThreadArg (thread);
+    nkWorkPool_t* pool = worker->pool;
+    NkSpinLock (&pool->lock);
+    worker->sleeping = true;
+    // If we were the last one running, hand what's left to an idle worker
+    bool pending = pool->numItems || __atomic_load_n (&pool->posted, __ATOMIC_RELAXED);
+    if (!--pool->running && pending)
+        nkWorkWakeIdle (pool);
+    NkSpinUnlock (&pool->lock);
+}
+
+// Called by a worker right after it gets going again
+void NkWorkRunning (NkThread_t* thread)
+{
+    nkWorker_t* worker = TskGetThreadArg (thread);
+    if (!worker->sleeping)
+        return;
+    nkWorkPool_t* pool = worker->pool;
+    NkSpinLock (&pool->lock);
+    worker->sleeping = false;
+    ++pool->running;
+    NkSpinUnlock (&pool->lock);
+}
+
+// Creates a pool for queue, bound to cpuNum if it isn't -1
+static nkWorkPool_t* nkWorkCreatePool (NkWorkQueue_t* queue, int cpuNum)
+{
+    nkWorkPool_t* pool = MmCacheAlloc (nkPoolCache);
+    if (!pool)
+        return NULL;
+    memset (pool, 0, sizeof (nkWorkPool_t));
+    NkListInit (&pool->items);
+    NkListInit (&pool->idle);
+    pool->cb = queue->cb;
+    pool->cpuNum = cpuNum;
+    pool->prio = queue->prio;
+    pool->maxWorkers = (queue->flags & NK_WORK_ORDERED) ? 1 : NK_WORK_MAX_WORKERS;
+    // Start the first worker, which goes idle until work comes in
+    pool->numWorkers = 1;
+    pool->running = 1;
+    if (!nkWorkStartWorker (pool))
+    {
+        MmCacheFree (nkPoolCache, pool);
+        return NULL;
+    }
+    return pool;
+}
+
+// Gets the pool work submitted now should go on
+static nkWorkPool_t* nkWorkGetPool (NkWorkQueue_t* queue)
+{
+    int cpuNum = (queue->flags & NK_WORK_ORDERED) ? 0 : CpuGetCcb()->cpuNum;
+    nkWorkPool_t* pool = __atomic_load_n (&queue->pools[cpuNum], __ATOMIC_ACQUIRE);
+    if (pool)
+        return pool;
+    // Pools can only be made where we can block, anywhere else the first pool takes the work
+    if (PltGetIpl() != PLT_IPL_LOW || TskAcquireMutex (&queue->lock) != EOK)
+        return queue->pools[0];
+    pool = queue->pools[cpuNum];
+    if (!pool)
+    {
+        pool = nkWorkCreatePool (queue, cpuNum);
+        if (pool)
+            __atomic_store_n (&queue->pools[cpuNum], pool, __ATOMIC_RELEASE);
+        else
+            pool = queue->pools[0];
+    }
+    TskReleaseMutex (&queue->lock);
+    return pool;
+}
+
+// Submits item to a managed queue
+// Safe at any IPL, as long as the pool is already there
+static void nkWorkSubmitManaged (nkWorkPool_t* pool, NkWorkItem_t* item)
+{
+    item->pool = pool;
+    if (!nkWorkPush (&pool->posted, item))
+        return;    // Whoever takes the items before us takes this one too
+    // Only start an idle worker if nobody else is getting through the work
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&pool->lock);
+    if (!pool->running)
+        nkWorkWakeIdle (pool);
+    NkSpinUnlock (&pool->lock);
+    PltLowerIpl (ipl);
+}
+
+// Tells the workers of a pool to exit once its work is done
+static void nkWorkKillPool (nkWorkPool_t* pool)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&pool->lock);
+    pool->dying = true;
+    while (nkWorkWakeIdle (pool))
+        ;
+    NkSpinUnlock (&pool->lock);
+    PltLowerIpl (ipl);
+}
+
 // Timer handler
 static void NkWorkTimer (NkTimeEvent_t* event, void* arg)
 {
@@ -66,19 +442,57 @@ static void NkWorkTimer (NkTimeEvent_t* event, void* arg)
     TskSignalCondition (&queue->condition);
 }
 
+// Sets up a managed queue
+static NkWorkQueue_t* nkWorkCreateManaged (NkWorkQueue_t* queue)
+{
+    // Managed queues only run on demand
+    if (queue->type != NK_WORK_DEMAND || queue->flags & NK_WORK_POLL)
+    {
+        MmCacheFree (nkWqCache, queue);
+        return NULL;
+    }
+    queue->pools = kmalloc (NEXKE_MAX_CPUS * sizeof (nkWorkPool_t*), MM_TAG_CORE);
+    if (!queue->pools)
+    {
+        MmCacheFree (nkWqCache, queue);
+        return NULL;
+    }
+    memset (queue->pools, 0, NEXKE_MAX_CPUS * sizeof (nkWorkPool_t*));
+    TskInitCondition (&queue->condition);
+    TskInitMutex (&queue->lock);
+    // The first pool is there from the start, so work always has somewhere to go
+    // Other CPUs get theirs the first time work is submitted on them
+    queue->pools[0] = nkWorkCreatePool (queue, (queue->flags & NK_WORK_ORDERED) ? -1 : 0);
+    if (!queue->pools[0])
+    {
+        kfree (queue->pools, NEXKE_MAX_CPUS * sizeof (nkWorkPool_t*), MM_TAG_CORE);
+        MmCacheFree (nkWqCache, queue);
+        return NULL;
+    }
+    return queue;
+}
+
 // Creates a new work queue
 NkWorkQueue_t* NkWorkQueueCreate (NkWorkCallback cb, int type, int flags, int prio, int threshold)
 {
     NkWorkQueue_t* queue = MmCacheAlloc (nkWqCache);
     if (!queue)
         NkPanicOom();
-    memset (queue, 0, sizeof (NkWorkQueue_t));
-    // Initialize basic fields
+    // Initialize basic fields. Item list is already constructed
+    if (flags & NK_WORK_ORDERED)
+        flags |= NK_WORK_MANAGED;
     queue->cb = cb;
     queue->flags = flags;
     queue->type = type;
     queue->threshold = threshold;
-    NkListInit (&queue->items);
+    queue->prio = prio;
+    queue->numItems = 0;
+    queue->timer = NULL;
+    queue->thread = NULL;
+    queue->pools = NULL;
+    queue->posted = NULL;
+    if (flags & NK_WORK_MANAGED)
+        return nkWorkCreateManaged (queue);
     // Setup timer stuff
     if (type == NK_WORK_TIMED)
     {
@@ -109,6 +523,20 @@ void NkWorkQueueDestroy (NkWorkQueue_t* queue)
 {
     if (TskAcquireMutex (&queue->lock) != EOK)
         return;
+    // Workers of managed queues finish what's queued, and the last one frees its pool
+    if (queue->flags & NK_WORK_MANAGED)
+    {
+        for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+        {
+            if (queue->pools[i])
+                nkWorkKillPool (queue->pools[i]);
+        }
+        TskCloseCondition (&queue->condition);
+        TskCloseMutex (&queue->lock);
+        kfree (queue->pools, NEXKE_MAX_CPUS * sizeof (nkWorkPool_t*), MM_TAG_CORE);
+        MmCacheFree (nkWqCache, queue);
+        return;
+    }
     // Deregister any pending timer events
     if (queue->timer)
         NkTimeDeRegEvent (queue->timer);
@@ -139,12 +567,28 @@ bool NkWorkQueueArmTimer (NkWorkQueue_t* queue, ktime_t delta)
 // Submits work to queue
 NkWorkItem_t* NkWorkQueueSubmit (NkWorkQueue_t* queue, void* data)
 {
+    if (queue->flags & NK_WORK_MANAGED)
+    {
+        NkWorkItem_t* item = MmCacheAlloc (nkItemCache);
+        if (!item)
+            return NULL;
+        item->queue = queue;
+        item->data = data;
+        item->queued = true;
+        item->embedded = false;
+        nkWorkSubmitManaged (nkWorkGetPool (queue), item);
+        return item;
+    }
     if (TskAcquireMutex (&queue->lock) != EOK)
         return NULL;
     NkWorkItem_t* item = MmCacheAlloc (nkItemCache);
     item->queue = queue;
+    item->pool = NULL;
     item->data = data;
-    // Enqueue the work
+    item->queued = true;
+    item->embedded = false;
+    // Enqueue the work after anything posted before it
+    nkWorkSplice (&queue->posted, &queue->items, &queue->numItems);
     NkListAddBack (&queue->items, &item->link);
     ++queue->numItems;
     // Determine if we need to do work now
@@ -154,16 +598,91 @@ NkWorkItem_t* NkWorkQueueSubmit (NkWorkQueue_t* queue, void* data)
     return item;
 }
 
+// Sets up a work item embedded in another object
+void NkWorkInitItem (NkWorkItem_t* item, void* data)
+{
+    memset (item, 0, sizeof (NkWorkItem_t));
+    item->data = data;
+    item->embedded = true;
+}
+
+// Posts an embedded work item to queue
+bool NkWorkQueuePost (NkWorkQueue_t* queue, NkWorkItem_t* item)
+{
+    assert (item->embedded);
+    // An item only goes on once, until a worker takes it off
+    if (__atomic_exchange_n (&item->queued, true, __ATOMIC_ACQUIRE))
+        return false;
+    item->queue = queue;
+    if (queue->flags & NK_WORK_MANAGED)
+    {
+        // Making pools can block, so if this CPU doesn't have one the first pool takes the work
+        int cpuNum = (queue->flags & NK_WORK_ORDERED) ? 0 : CpuGetCcb()->cpuNum;
+        nkWorkPool_t* pool = __atomic_load_n (&queue->pools[cpuNum], __ATOMIC_ACQUIRE);
+        nkWorkSubmitManaged (pool ? pool : queue->pools[0], item);
+        return true;
+    }
+    // Timed queues get to their work when their timer says so
+    if (nkWorkPush (&queue->posted, item) && queue->type == NK_WORK_DEMAND)
+        TskBroadcastCondition (&queue->condition);
+    return true;
+}
+
 // Removes work from queue
+// Fails if a worker already took the item. Mustn't race with a post of the same item
 bool NkWorkQueueCancel (NkWorkQueue_t* queue, NkWorkItem_t* item)
 {
+    if (queue->flags & NK_WORK_MANAGED)
+    {
+        nkWorkPool_t* pool = item->pool;
+        ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+        NkSpinLock (&pool->lock);
+        // It may still be on the post stack, which can't have items taken out of the middle
+        nkWorkSplice (&pool->posted, &pool->items, &pool->numItems);
+        bool queued = item->queued;
+        if (queued)
+        {
+            NkListRemove (&pool->items, &item->link);
+            --pool->numItems;
+            item->queued = false;
+        }
+        NkSpinUnlock (&pool->lock);
+        PltLowerIpl (ipl);
+        if (queued && !item->embedded)
+            MmCacheFree (nkItemCache, item);
+        return queued;
+    }
     if (TskAcquireMutex (&queue->lock) != EOK)
         return NULL;
+    nkWorkSplice (&queue->posted, &queue->items, &queue->numItems);
+    if (!item->queued)
+    {
+        TskReleaseMutex (&queue->lock);
+        return false;
+    }
     // Remove item from queue
     NkListRemove (&queue->items, &item->link);
     --queue->numItems;
     // Free it
-    MmCacheFree (nkItemCache, item);
+    item->queued = false;
+    if (!item->embedded)
+        MmCacheFree (nkItemCache, item);
     TskReleaseMutex (&queue->lock);
     return true;
 }
+
+// Wakes a work queue's thread
+void NkWorkQueueWake (NkWorkQueue_t* queue)
+{
+    if (queue->flags & NK_WORK_MANAGED)
+        return;
+    TskBroadcastCondition (&queue->condition);
+}
+
+// Pins a work queue's thread to a CPU
+bool NkWorkQueuePin (NkWorkQueue_t* queue, int cpuNum)
+{
+    if (queue->flags & NK_WORK_MANAGED)
+        return false;
+    return TskPinThread (queue->thread, cpuNum);
+}
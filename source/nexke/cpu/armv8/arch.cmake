@@ -28,4 +28,8 @@ list(APPEND NEXKE_SOURCES
     cpu/armv8/mul.c
     cpu/armv8/exec.c
     cpu/armv8/trap.S
+    cpu/armv8/timer.c
+    cpu/armv8/pmu.c
+    cpu/armv8/string.c
+    cpu/armv8/crc32.c
     mm/ptab.c)
@@ -18,6 +18,7 @@
 #include <nexke/cpu.h>
 #include <nexke/nexboot.h>
 #include <nexke/nexke.h>
+#include <nexke/platform.h>
 #include <string.h>
 
 // Globals
@@ -26,8 +27,14 @@
 // deepest bowels
 static NkCcb_t ccb = {0, .preemptDisable = 1};    // The CCB
 
+NkCcb_t* CpuCurCcb NK_PERCPU = NULL;    // Each CPU's own CCB
+
 bool ccbInit = false;
 
+// MPIDR_EL1 fields
+#define CPU_MPIDR_AFF_MASK 0xFFFFFF     // Affinity levels 0 to 2
+#define CPU_MPIDR_MT       (1 << 24)    // Level 0 is threads of a core
+
 // Checks a feature
 #define CPU_CHECK_FEATURE(reg, shift, val, feature)    \
     if ((((reg) >> (shift)) & CPU_FEAT_MASK) == (val)) \
@@ -40,6 +47,7 @@ void CpuInitCcb()
     NexNixBoot_t* bootInfo = NkGetBootArgs();
     // Set up basic fields
     ccb.self = &ccb;
+    ccb.cpuNum = 0;    // BSP is always CPU 0
     ccb.cpuArch = NEXKE_CPU_ARMV8;
     ccb.cpuFamily = NEXKE_CPU_FAMILY_ARM;
 #ifdef NEXNIX_BOARD_GENERIC
@@ -57,6 +65,7 @@ void CpuInitCcb()
     CPU_CHECK_FEATURE (isar0, CPU_ISAR0_ATOMIC, 2, CPU_FEATURE_ATOMIC);
     CPU_CHECK_FEATURE (isar0, CPU_ISAR0_ATOMIC, 3, CPU_FEATURE_ATOMIC);
     CPU_CHECK_FEATURE (isar0, CPU_ISAR0_CRC32, 1, CPU_FEATURE_CRC32);
+    CPU_CHECK_FEATURE (isar0, CPU_ISAR0_TLB, 2, CPU_FEATURE_TLB_RANGE);
     uint64_t isar1 = CpuReadSpr ("ID_AA64ISAR1_EL1");
     CPU_CHECK_FEATURE (isar1, CPU_ISAR1_XS, 1, CPU_FEATURE_XS);
     uint64_t mmfr0 = CpuReadSpr ("ID_AA64MMFR0_EL1");
@@ -97,6 +106,8 @@ void CpuInitCcb()
     uint64_t mmfr2 = CpuReadSpr ("ID_AA64MMFR2_EL1");
     CPU_CHECK_FEATURE (mmfr2, CPU_MMFR2_E0PD, 1, CPU_FEATURE_E0PD);
     CPU_CHECK_FEATURE (mmfr2, CPU_MMFR2_CNP, 1, CPU_FEATURE_CNP);
+    // Level 2 lets a block be replaced by a table without breaking it first
+    CPU_CHECK_FEATURE (mmfr2, CPU_MMFR2_BBM, 2, CPU_FEATURE_BBM);
     // Get supported VA bits
     int vaBits = (mmfr2 >> CPU_MMFR2_VABITS) & CPU_FEAT_MASK;
     if (vaBits == 0)
@@ -122,11 +133,14 @@ void CpuInitCcb()
     if (CpuGetFeatures() & CPU_FEATURE_NMI)
         sctlr |= (uint64_t) CPU_SCTLR_NMI;
     CpuWriteSpr ("SCTLR_EL1", sctlr);
+    CpuInitString();
+    CpuInitCrc();
     // Setup interrupts
     CpuDisable();
     CpuWriteSpr ("VBAR_EL1", CpuVectorTable);
-    // Save CCB to TPIDR
-    CpuWriteSpr ("TPIDR_EL1", (uint64_t) &ccb);
+    // TPIDR holds the per-CPU offset, which is 0 as the BSP's per-CPU variables are the image's
+    CpuCurCcb = &ccb;
+    CpuWriteSpr ("TPIDR_EL1", 0UL);
     ccbInit = true;
 }
 
@@ -158,7 +172,9 @@ static const char* cpuFeatures[] = {"RNG",
                                     "GIC3_4",
                                     "GIC4.1",
                                     "EL0_AA32",
-                                    "NMI"};
+                                    "NMI",
+                                    "TLB_RANGE",
+                                    "BBM"};
 
 // Print CPU features
 void CpuPrintFeatures()
@@ -174,11 +190,67 @@ void CpuPrintFeatures()
 }
 
 // Allocates a CPU context and intializes it
-CpuContext_t* CpuAllocContext (uintptr_t entry)
+CpuContext_t* CpuAllocContext (uintptr_t entry, int stackClass)
 {
 }
 
 // Destroys a context
-void CpuDestroyContext (CpuContext_t* context)
+void CpuDestroyContext (CpuContext_t* context, int stackClass)
+{
+}
+
+// Gets the most of the stack of context that has ever been used
+size_t CpuGetStackPeak (CpuContext_t* context, int stackClass)
+{
+    return 0;
+}
+
+// Gets the size of stacks of stackClass
+size_t CpuGetStackSize (int stackClass)
+{
+    return 0;
+}
+
+// The kernel doesn't use FP or SIMD registers, so there is no other thread state
+void CpuInitThread (NkThread_t* thread)
+{
+}
+
+void CpuDestroyThread (NkThread_t* thread)
+{
+}
+
+void CpuSwitchState (NkThread_t* oldThread, NkThread_t* newThread)
+{
+}
+
+// Allocates CCB for another CPU
+// APs aren't supported yet, as threads can't be switched to
+NkCcb_t* CpuAllocCcb (int cpuNum)
+{
+    return NULL;
+}
+
+// Prepares a CPU to be started with CCB
+paddr_t CpuPrepareAp (NkCcb_t* ccb)
+{
+    return 0;
+}
+
+// Sets topology IDs of CCB from the PPTT, or MPIDR if there isn't one
+void CpuInitTopology (NkCcb_t* ccb, PltCpu_t* cpu)
 {
+    if (cpu->type == PLT_CPU_GIC && PltAcpiGetCpuTopology (cpu->acpiUid, ccb->topoId))
+        return;
+    // Affinity levels in MPIDR only say which CPUs are close, not what they share. Go by the
+    // usual layout, where the lowest level is threads if the MT bit is set and cores otherwise,
+    // the one above it is clusters sharing the last level cache, and the rest is the package
+    uint64_t mpidr = cpu->affinity;
+    uint32_t aff = (mpidr & CPU_MPIDR_AFF_MASK) | ((mpidr >> 8) & 0xFF000000);
+    if (mpidr & CPU_MPIDR_MT)
+        aff >>= 8;
+    ccb->topoId[NK_TOPO_CORE] = aff;
+    ccb->topoId[NK_TOPO_L2] = aff;
+    ccb->topoId[NK_TOPO_LLC] = aff >> 8;
+    ccb->topoId[NK_TOPO_PKG] = aff >> 16;
 }
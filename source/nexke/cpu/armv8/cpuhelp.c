@@ -60,6 +60,25 @@ void CpuHalt()
     asm ("wfi");
 }
 
+// Deeper states go through PSCI's CPU_SUSPEND, which we don't have a conduit for yet,
+// so WFI is the only one
+int CpuInitIdle (CpuIdleState_t* states)
+{
+    states[0] = (CpuIdleState_t) {"WFI", 1000, 1000, 0, false};
+    return 1;
+}
+
+void CpuIdle (const CpuIdleState_t* state, long* wake)
+{
+    // WFI wakes up on pending interrupts even when they're masked
+    asm volatile ("dsb sy; wfi" : : : "memory");
+}
+
+uint64_t CpuGetCycles()
+{
+    return CpuReadSpr ("CNTVCT_EL0");
+}
+
 void CpuPrintDebug (CpuIntContext_t* context)
 {
     // Basically we just dump all the registers
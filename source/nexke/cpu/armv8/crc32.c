@@ -0,0 +1,84 @@
+/*
+    crc32.c - contains ARMv8 CRC32 routines
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <stdint.h>
+#include <string.h>
+
+// The CRC32 extension has instructions for both polynomials, which work on general purpose
+// registers. PMULL folding would be faster on long buffers, but nothing saves the FP / SIMD
+// registers on a context switch, so it can't be used here
+// The kernel isn't built for the extension, so the assembler is told about it in each block
+
+// IEEE CRC with the CRC32 instructions
+static uint32_t cpuCrc32Insn (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy (&word, buf, sizeof (uint64_t));
+        asm (".arch_extension crc\n\t"
+             "crc32x %w[crc], %w[crc], %x[word]"
+             : [crc] "+r"(crc)
+             : [word] "r"(word));
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        asm (".arch_extension crc\n\t"
+             "crc32b %w[crc], %w[crc], %w[byte]"
+             : [crc] "+r"(crc)
+             : [byte] "r"((uint32_t) *buf++));
+    }
+    return crc;
+}
+
+// Castagnoli CRC with the CRC32 instructions
+static uint32_t cpuCrc32cInsn (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy (&word, buf, sizeof (uint64_t));
+        asm (".arch_extension crc\n\t"
+             "crc32cx %w[crc], %w[crc], %x[word]"
+             : [crc] "+r"(crc)
+             : [word] "r"(word));
+        buf += 8;
+        len -= 8;
+    }
+    while (len--)
+    {
+        asm (".arch_extension crc\n\t"
+             "crc32cb %w[crc], %w[crc], %w[byte]"
+             : [crc] "+r"(crc)
+             : [byte] "r"((uint32_t) *buf++));
+    }
+    return crc;
+}
+
+// Picks CRC routines for this CPU's features
+void CpuInitCrc()
+{
+    if (CpuGetFeatures() & CPU_FEATURE_CRC32)
+    {
+        NK_STATIC_CALL_UPDATE (NkCrc32Update, cpuCrc32Insn);
+        NK_STATIC_CALL_UPDATE (NkCrc32cUpdate, cpuCrc32cInsn);
+    }
+}
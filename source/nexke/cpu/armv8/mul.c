@@ -23,9 +23,6 @@
 // Global representing max page level
 static int mulMaxLevel = 4;
 
-// Page mapping cache
-static SlabCache_t* mulMapCache = NULL;
-
 // Basic helpers
 static inline uintptr_t mulMakeCanonical (uintptr_t addr)
 {
@@ -61,7 +58,7 @@ void MmMulInit()
     // Allocate cache
     MmPage_t* cachePgCtrl = MmAllocFixedPage();
     MmFixPage (cachePgCtrl);
-    paddr_t cachePage = cachePgCtrl->pfn * NEXKE_CPU_PAGESZ;
+    paddr_t cachePage = MmGetPagePhys (cachePgCtrl);
     // Map it
     MmMulMapEarly (MUL_PTCACHE_ENTRY_BASE, cachePage, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
     // Map dummy page at base so we have the structure created
@@ -92,8 +89,6 @@ void MmMulInit()
     NkListAddFront (&mulSpace->pageList, &cachePgCtrl->link);
     // Prepare page table cache
     MmPtabInitCache (MmGetKernelSpace());
-    mulMapCache = MmCacheCreate (sizeof (MmPageMap_t), "MmPageMap_t", 0, 0);
-    assert (mulMapCache);
     // Set up MAIR
     uint64_t mair = (MUL_MAIR_NORMAL << MUL_MAIR0) | (MUL_MAIR_DEVICE << MUL_MAIR1) |
                     (MUL_MAIR_WT << MUL_MAIR2) | (MUL_MAIR_NON_CACHE << MUL_MAIR3) |
@@ -125,6 +120,10 @@ void MmMulInit()
     if (tg0 != 0 || tg1 != 2)
         NkPanic ("nexke: invalid MMU setup detected");
     CpuWriteSpr ("TCR_EL1", tcr);
+    // Hand out ASIDs to address spaces
+    MmPtabInitTags ((1 << CpuGetCcb()->archCcb.asidBits) - 1);
+    // Map physical memory so we can stop going through the PT cache
+    MmPtabInitDirect();
 }
 
 // Allocates page table into ent
@@ -133,16 +132,19 @@ paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t*
     // Unlock address space quickly
     MM_MUL_UNLOCK (space);
     // Allocate the table
-    MmPage_t* pg = MmAllocFixedPage();
+    MmPage_t* pg = MmAllocPtPage();
     MmFixPage (pg);
-    paddr_t tab = pg->pfn * NEXKE_CPU_PAGESZ;
-    // Zero it
-    MmMulZeroPage (pg);
+    paddr_t tab = MmGetPagePhys (pg);
     // Re-lock
     MM_MUL_LOCK (space);
     // Make sure a table wasn't already map while we were unlock
     if (*ent)
+    {
         tab = *ent & PT_FRAME;
+        // Ours is still empty, so keep it for the next table
+        MmUnfixPage (pg);
+        MmFreePtPage (pg);
+    }
     else
     {
         // Add to page list
@@ -166,6 +168,18 @@ void MmMulCreateSpace (MmSpace_t* space)
 {
 }
 
+// Switches CPU to address space
+void MmMulSwitchSpace (MmSpace_t* space)
+{
+    int asid = 0;
+    bool trusted = MmPtabGetTag (space, &asid);
+    CpuWriteSpr ("TTBR0_EL1", space->mulSpace.base | ((uint64_t) asid << MUL_TTBR_ASID_SHIFT));
+    asm volatile ("isb");
+    // Get rid of out of date entries
+    if (!trusted)
+        MmMulFlushAsid (asid);
+}
+
 // References an address space
 void MmMulRefSpace (MmSpace_t* space)
 {
@@ -202,6 +216,70 @@ static inline void MmMulFlushAddr (MmSpace_t* space, uintptr_t addr)
 {
     if (space == MmGetCurrentSpace() || space == MmGetKernelSpace())
         MmMulFlush (addr);
+    // Make sure the space's ASID gets flushed before it runs again
+    else
+        MmPtabStaleTag (space);
+    MmTlbShootdown (space, addr, addr + NEXKE_CPU_PAGESZ, false);
+}
+
+// Invalidates range of pages with range TLBIs
+static void mulFlushRange (uintptr_t start, size_t pages)
+{
+    asm volatile ("dsb ishst");
+    int scale = 0;
+    while (pages)
+    {
+        // Range operations cover an even number of pages, so take care of an odd one first
+        if (pages & 1)
+        {
+            asm volatile ("tlbi vaae1is, %0" : : "r"(start >> NEXKE_CPU_PAGE_SHIFT));
+            start += NEXKE_CPU_PAGESZ;
+            --pages;
+            continue;
+        }
+        // Each scale covers the next 5 bits of the page count
+        int num = ((pages >> ((5 * scale) + 1)) & 0x1F) - 1;
+        if (num >= 0)
+        {
+            uint64_t op = (MUL_TLBI_TG_4K << MUL_TLBI_TG) | ((uint64_t) scale << MUL_TLBI_SCALE) |
+                          ((uint64_t) num << MUL_TLBI_NUM) |
+                          ((start >> NEXKE_CPU_PAGE_SHIFT) & MUL_TLBI_ADDR);
+            asm volatile ("sys #0, c8, c2, #3, %0" : : "r"(op));    // TLBI RVAAE1IS
+            size_t done = (size_t) (num + 1) << ((5 * scale) + 1);
+            start += done * NEXKE_CPU_PAGESZ;
+            pages -= done;
+        }
+        ++scale;
+    }
+    asm volatile ("dsb ish; isb");
+}
+
+// Invalidates TLB entries gathered in gather
+void MmMulFlushGather (MmTlbGather_t* gather)
+{
+    MmSpace_t* space = gather->space;
+    if (space != MmGetCurrentSpace() && space != MmGetKernelSpace())
+    {
+        MmPtabStaleTag (space);
+        return;
+    }
+    size_t pages = (gather->end - gather->start) >> NEXKE_CPU_PAGE_SHIFT;
+    if ((CpuGetFeatures() & CPU_FEATURE_TLB_RANGE) && pages < MUL_TLBI_RANGE_PAGES)
+        mulFlushRange (gather->start, pages);
+    else if (gather->flushAll || gather->count > MM_GATHER_FLUSH_MAX)
+    {
+        // Past the ceiling it's cheaper to flush everything than to flush each page
+        if (space == MmGetKernelSpace())
+            MmMulFlushTlb();
+        else
+            MmMulFlushAsid (CpuReadSpr ("TTBR0_EL1") >> MUL_TTBR_ASID_SHIFT);
+    }
+    else
+    {
+        for (int i = 0; i < gather->count; ++i)
+            MmMulFlush (gather->entries[i].addr);
+        asm volatile ("dsb ish; isb");
+    }
 }
 
 // Translates permissions to table flags
@@ -218,6 +296,9 @@ static inline pte_t mmMulGetProt (int flags)
         pgFlags &= ~(PF_EL0);
         pgFlags |= PF_UXN;
     }
+    // User mappings are tagged with the ASID of their space
+    else
+        pgFlags |= PF_NG;
     if (flags & MUL_PAGE_DEV)
         pgFlags |= PF_MAIR_DEV;
     else if (flags & MUL_PAGE_CD)
@@ -229,9 +310,198 @@ static inline pte_t mmMulGetProt (int flags)
     return pgFlags;
 }
 
+// Adds a mapping to page's mapping list
+static void mulAddMapping (MmSpace_t* space, uintptr_t virt, MmPage_t* page, paddr_t table)
+{
+    if (!(page->flags & MM_PAGE_FIXED) && !(page->flags & MM_PAGE_UNUSABLE))
+        MmAddPageMap (page, space, virt, table);
+    // Update stats
+    ++space->stats.numMaps;
+}
+
+// Converts page flags into block flags
+// Blocks only hold fixed memory, so they're never aged and start out accessed
+static inline pte_t mulToLargeFlags (pte_t flags)
+{
+    return (flags & ~(PF_PG)) | PF_AF;
+}
+
+// Converts block flags into page flags
+static inline pte_t mulFromLargeFlags (pte_t flags)
+{
+    return flags | PF_PG;
+}
+
+// Invalidates a translation that was just broken, so that it can be remade
+// The new entry can't be written until every CPU has dropped the old one
+static void mulFlushBreak (MmSpace_t* space, uintptr_t addr, size_t size)
+{
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
+    MmPtabGather (&gather, addr, size, NULL);
+    MmPtabFlushGather (&gather);
+    asm volatile ("dsb ish; isb");
+}
+
+// Splits block mapped by ent into a page table
+paddr_t MmMulSplitLarge (MmSpace_t* space, uintptr_t addr, pte_t* ent)
+{
+    // Unlock for below
+    MM_MUL_UNLOCK (space);
+    MmPage_t* pg = MmAllocFixedPage();
+    if (!pg)
+        NkPanicOom();
+    paddr_t tab = MmGetPagePhys (pg);
+    MM_MUL_LOCK (space);
+    // Check if this was split while we were unlocked
+    if (*ent && !PT_ISLARGE (*ent))
+    {
+        MmLockPage (pg);
+        MmUnfixPage (pg);
+        MmUnlockPage (pg);
+        MmFreePage (pg);
+        return *ent & PT_FRAME;
+    }
+    // Fill in the new table with the translations of the block
+    // Every aligned group in a block is contiguous, so the pages keep sharing TLB entries
+    pte_t large = *ent;
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (tab, MM_PTAB_UNCACHED);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    if (large)
+    {
+        pte_t flags = mulFromLargeFlags (large & ~(PT_LARGEFRAME)) | PF_CONT;
+        paddr_t frame = large & PT_LARGEFRAME;
+        for (int i = 0; i < MUL_LARGE_PAGES; ++i)
+            table[i] = flags | (frame + (i * NEXKE_CPU_PAGESZ));
+    }
+    else
+        memset (table, 0, NEXKE_CPU_PAGESZ);
+    MmPtabFreeToCache (cacheEnt);
+    // Add to page list
+    NkListAddFront (&space->mulSpace.pageList, &pg->link);
+    // Make sure the table is written before the walker can see it
+    asm volatile ("dsb ishst");
+    // Replacing a block with a table has to go through an invalid entry, unless the CPU can
+    // cope with both being in the TLB at once
+    uintptr_t base = mulMakeCanonical (addr & ~(MUL_LARGE_PAGESZ - 1));
+    bool bbm = !!(CpuGetFeatures() & CPU_FEATURE_BBM);
+    if (large && !bbm)
+    {
+        *ent = 0;
+        mulFlushBreak (space, base, MUL_LARGE_PAGESZ);
+    }
+    *ent = tab | PF_V | PF_TAB;
+    // Get rid of the block's TLB entry
+    if (large && bbm)
+        MmMulFlushAddr (space, base);
+    return tab;
+}
+
+// Gets the entry of the block mapping virt
+// Returns NULL if virt isn't mapped by a block
+static pte_t* mulGetLarge (MmSpace_t* space, uintptr_t virt, MmPtCacheEnt_t** cacheEnt)
+{
+    uintptr_t addr = mulDecanonical (virt);
+    *cacheEnt =
+        MmPtabLookup (space, mmMulGetTtbr (&space->mulSpace, virt), addr, MUL_LARGE_LEVEL);
+    if (!*cacheEnt)
+        return NULL;
+    pte_t* table = (pte_t*) (*cacheEnt)->addr;
+    pte_t* ent = &table[MUL_IDX_LEVEL (addr, MUL_LARGE_LEVEL)];
+    if (*ent && PT_ISLARGE (*ent))
+        return ent;
+    MmPtabReturnCache (*cacheEnt);
+    return NULL;
+}
+
+// Drops cached tables in iterator after the caller skipped over a block
+static void mulResetIter (MmPtIter_t* iter)
+{
+    MmPtabEndIterate (iter);
+    memset (iter->ptIters, 0, sizeof (iter->ptIters));
+}
+
+// Maps a block into address space
+// Returns false if a block can't be used here
+static bool mulMapLarge (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
+{
+    paddr_t phys = MmGetPagePhys (page);
+    // Only fixed, huge and unusable pages can be mapped as blocks, as they don't track their
+    // mappings
+    if (!(page->flags & (MM_PAGE_FIXED | MM_PAGE_HUGE | MM_PAGE_UNUSABLE)) ||
+        (virt & (MUL_LARGE_PAGESZ - 1)) || (phys & (MUL_LARGE_PAGESZ - 1)))
+        return false;
+    pte_t newEnt = mulToLargeFlags (mmMulGetProt (perm)) | phys;
+    if (page->flags & MM_PAGE_FIXED)
+        newEnt |= PF_F;
+    MM_MUL_LOCK (space);
+    uint64_t ttbr = mmMulGetTtbr (&space->mulSpace, virt);
+    uintptr_t addr = mulDecanonical (virt);
+    MmPtCacheEnt_t* cacheEnt =
+        MmPtabWalkAndMapLevel (space, ttbr, addr, newEnt, MUL_LARGE_LEVEL);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    pte_t* ent = &table[MUL_IDX_LEVEL (addr, MUL_LARGE_LEVEL)];
+    // If a page table with something in it is already here, leave it be and let the caller use
+    // small pages. An empty one stays on the space's page list until the space goes away
+    if (*ent && !PT_ISLARGE (*ent) && !MmPtabIsEmpty (*ent & PT_FRAME))
+    {
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (space);
+        return false;
+    }
+    if (*ent & PF_F)
+        NkPanic ("nexke: attempt to unmap fixed mapping");
+    // Whatever was here has to be gone from every TLB before the block goes in
+    bool replaced = *ent && PT_ISLARGE (*ent);
+    if (*ent)
+    {
+        *ent = 0;
+        mulFlushBreak (space, virt, MUL_LARGE_PAGESZ);
+    }
+    *ent = newEnt;
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (space);
+    // Update stats
+    if (newEnt & PF_F)
+        space->stats.numFixed += MUL_LARGE_PAGES;
+    if (!replaced)
+        space->stats.numMaps += MUL_LARGE_PAGES;
+    return true;
+}
+
+// Takes the contiguous hint off of the group pte is in, so that pte can be changed
+// The group has to be broken and flushed before it's remade without the hint
+static void mulBreakCont (MmSpace_t* space, pte_t* pte, uintptr_t virt)
+{
+    pte_t* group = pte - (MUL_IDX_LEVEL (mulDecanonical (virt), 1) & (MUL_CONT_PAGES - 1));
+    pte_t saved[MUL_CONT_PAGES];
+    for (int i = 0; i < MUL_CONT_PAGES; ++i)
+    {
+        saved[i] = group[i];
+        group[i] = 0;
+    }
+    mulFlushBreak (space, virt & ~(MUL_CONT_SIZE - 1), MUL_CONT_SIZE);
+    for (int i = 0; i < MUL_CONT_PAGES; ++i)
+        group[i] = saved[i] & ~(PF_CONT);
+}
+
+// Maps the block starting at page into address space, without falling back to small pages
+bool MmMulMapLarge (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
+{
+    return mulMapLarge (space, virt, page, perm);
+}
+
 // Maps page into address space
 void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
 {
+    if (perm & MUL_PAGE_LARGE)
+    {
+        if (mulMapLarge (space, virt, page, perm))
+            return;
+        // Fall back to small pages
+        MmMulMapContig (space, virt, page, MUL_LARGE_PAGES, perm & ~(MUL_PAGE_LARGE));
+        return;
+    }
     MM_MUL_LOCK (space);
     MmMulSpace_t* mulSpace = &space->mulSpace;
     // Translate flags
@@ -240,7 +510,7 @@ void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
     if (page->flags & MM_PAGE_FIXED)
         pgFlags |= PF_F;
     // Create PTE
-    pte_t newPte = pgFlags | (page->pfn * NEXKE_CPU_PAGESZ);
+    pte_t newPte = pgFlags | (MmGetPagePhys (page));
     // Grab page table of last entry
     uint64_t ttbr = mmMulGetTtbr (mulSpace, virt);
     uint64_t canonVirt = virt;
@@ -254,9 +524,19 @@ void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
     // Check if the PTE already contains a translation
     if (*pte)
     {
+        // A fault on a fixed mapping can happen while a split has it broken, in which case
+        // there's nothing left to do
+        if ((*pte & PF_F) && !((*pte ^ newPte) & ~(PF_AF | PF_CONT)))
+        {
+            MmPtabReturnCache (cacheEnt);
+            MM_MUL_UNLOCK (space);
+            return;
+        }
         // Make sure current mapping isn't fixed
         if (*pte & PF_F)
             NkPanic ("nexke: attempt to unmap fixed mapping");
+        if (*pte & PF_CONT)
+            mulBreakCont (space, pte, canonVirt);
         // Check if the fixed state is changing
         if ((*pte & PF_F) != (newPte & PF_F))
         {
@@ -289,55 +569,133 @@ void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
         *pte = newPte;
     }
     // Return it
+    paddr_t tabPhys = cacheEnt->ptab;
     MmPtabReturnCache (cacheEnt);
     MM_MUL_UNLOCK (space);
     // Check if we have a mapping to remove
     if (oldPage)
     {
-        // Find this mapping
-        NkSpinLock (&oldPage->lock);
-        MmPageMap_t* map = oldPage->maps;
-        MmPageMap_t* prev = NULL;
-        while (map)
+        MmLockPage (oldPage);
+        if (MmRemovePageMap (oldPage, space, canonVirt))
+            --space->stats.numMaps;
+        MmUnlockPage (oldPage);
+    }
+    mulAddMapping (space, canonVirt, page, tabPhys);
+}
+
+// Checks if the pages starting at i can be mapped at addr with the contiguous hint
+static bool mulCanCont (pte_t* table,
+                        uintptr_t addr,
+                        MmPage_t** pages,
+                        MmPage_t* contig,
+                        size_t i,
+                        size_t count)
+{
+    if ((addr & (MUL_CONT_SIZE - 1)) || (count - i) < MUL_CONT_PAGES)
+        return false;
+    paddr_t phys = MmGetPagePhys ((pages) ? pages[i] : &contig[i]);
+    if (phys & (MUL_CONT_SIZE - 1))
+        return false;
+    pte_t* group = &table[MUL_IDX_LEVEL (addr, 1)];
+    for (int j = 0; j < MUL_CONT_PAGES; ++j)
+    {
+        MmPage_t* page = (pages) ? pages[i + j] : &contig[i + j];
+        // Pages with tracked mappings can be changed one at a time, which would break the group
+        if (!(page->flags & (MM_PAGE_FIXED | MM_PAGE_UNUSABLE)) || group[j] ||
+            MmGetPagePhys (page) != (phys + (j * NEXKE_CPU_PAGESZ)))
+            return false;
+    }
+    return true;
+}
+
+// Maps count pages starting at virt, walking to each page table only once
+// Page i is pages[i], or contig[i] if pages is NULL
+// Aligned runs of fixed, physically contiguous pages get the contiguous hint
+static void mulMapRange (MmSpace_t* space,
+                         uintptr_t virt,
+                         MmPage_t** pages,
+                         MmPage_t* contig,
+                         size_t count,
+                         int perm)
+{
+    // Translate flags
+    pte_t pgFlags = mmMulGetProt (perm);
+    size_t i = 0;
+    while (i < count)
+    {
+        MM_MUL_LOCK (space);
+        uintptr_t cur = virt + (i * NEXKE_CPU_PAGESZ);
+        uintptr_t addr = mulDecanonical (cur);
+        uint64_t ttbr = mmMulGetTtbr (&space->mulSpace, cur);
+        MmPtCacheEnt_t* cacheEnt = MmPtabWalkAndMap (space, ttbr, addr, pgFlags);
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        // Fill in PTEs until the end of this table, or until one that is already mapped
+        size_t first = i;
+        bool mapped = false;
+        int contLeft = 0;
+        do
         {
-            if (map->addr == virt && map->space == space)
+            MmPage_t* page = (pages) ? pages[i] : &contig[i];
+            pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+            if (*pte)
             {
-                // Remove it and break
-                --space->stats.numMaps;
-                if (prev)
-                    prev->next = map->next;
-                else
-                    oldPage->maps = map->next;
+                mapped = true;
                 break;
             }
-            prev = map;
-            map = map->next;
+            if (!contLeft && mulCanCont (table, addr, pages, contig, i, count))
+                contLeft = MUL_CONT_PAGES;
+            pte_t newPte = pgFlags | (MmGetPagePhys (page));
+            if (page->flags & MM_PAGE_FIXED)
+            {
+                newPte |= PF_F;
+                ++space->stats.numFixed;
+            }
+            // Entries in a group have to agree, so they can't wait for an access flag fault
+            if (contLeft)
+            {
+                newPte |= PF_CONT | PF_AF;
+                --contLeft;
+            }
+            *pte = newPte;
+            ++i;
+            addr += NEXKE_CPU_PAGESZ;
+        } while (i < count && MUL_IDX_LEVEL (addr, 1));
+        paddr_t tabPhys = cacheEnt->ptab;
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (space);
+        for (size_t j = first; j < i; ++j)
+        {
+            MmPage_t* page = (pages) ? pages[j] : &contig[j];
+            mulAddMapping (space, virt + (j * NEXKE_CPU_PAGESZ), page, tabPhys);
+        }
+        // Replacing a mapping is left to MmMulMapPage
+        if (mapped)
+        {
+            MmPage_t* page = (pages) ? pages[i] : &contig[i];
+            MmMulMapPage (space, virt + (i * NEXKE_CPU_PAGESZ), page, perm);
+            ++i;
         }
-        NkSpinUnlock (&oldPage->lock);
-    }
-    if (!(page->flags & MM_PAGE_FIXED) && !(page->flags & MM_PAGE_UNUSABLE))
-    {
-        // Add this mapping
-        MmPageMap_t* map = (MmPageMap_t*) MmCacheAlloc (mulMapCache);
-        if (!map)
-            NkPanicOom();
-        map->addr = canonVirt;
-        map->space = space;
-        map->next = NULL;
-        // Link it
-        NkSpinLock (&page->lock);
-        map->next = page->maps;
-        page->maps = map;
-        NkSpinUnlock (&page->lock);
     }
-    // Update stats
-    ++space->stats.numMaps;
+}
+
+// Maps an array of pages into address space
+void MmMulMapRange (MmSpace_t* space, uintptr_t virt, MmPage_t** pages, size_t count, int perm)
+{
+    mulMapRange (space, virt, pages, NULL, count, perm);
+}
+
+// Maps physically contigous pages into address space
+void MmMulMapContig (MmSpace_t* space, uintptr_t virt, MmPage_t* pages, size_t count, int perm)
+{
+    mulMapRange (space, virt, NULL, pages, count, perm);
 }
 
 // Unmaps a range out of an address space
 void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
 {
     MM_MUL_LOCK (space);
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
     // Set up iterator
     MmPtIter_t iter = {0};
     iter.asPhys = mmMulGetTtbr (&space->mulSpace, base);
@@ -346,6 +704,27 @@ void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
     for (int i = 0; i < count; ++i)
     {
         uintptr_t addr = iter.addr;
+        // Remove blocks in one go if the range covers all of it
+        // Otherwise the iterator splits it for us
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (count - i) >= MUL_LARGE_PAGES)
+        {
+            MmPtCacheEnt_t* largeEnt = NULL;
+            pte_t* ent = mulGetLarge (space, mulMakeCanonical (addr), &largeEnt);
+            if (ent)
+            {
+                // Make sure block isn't fixed
+                if (*ent & PF_F)
+                    NkPanic ("nexke: can't remove fixed mapping");
+                *ent = 0;
+                MmPtabGather (&gather, mulMakeCanonical (addr), MUL_LARGE_PAGESZ, NULL);
+                MmPtabReturnCache (largeEnt);
+                space->stats.numMaps -= MUL_LARGE_PAGES;
+                mulResetIter (&iter);
+                iter.addr += MUL_LARGE_PAGESZ;
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
         // Get cache entry for table containing PTE
         MmPtCacheEnt_t* cacheEnt = MmPtabIterate (&iter);
         // If there is no cache entry, move to next address
@@ -359,40 +738,19 @@ void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
                 // Make sure PTE isn't fixed
                 if (*pte & PF_F)
                     NkPanic ("nexke: can't remove fixed mapping");
+                if (*pte & PF_CONT)
+                    mulBreakCont (space, pte, mulMakeCanonical (addr));
                 // Get page of PTE
                 MmPage_t* page = MmFindPagePfn ((*pte & PT_FRAME) >> NEXKE_CPU_PAGE_SHIFT);
                 *pte = 0;
-                MmMulFlushAddr (space, mulMakeCanonical (addr));
-                // Now remove mapping, first we need to unlock the address space
-                // as we can't lock the page while holding the address space lock
-                // as that would violate lock ordering
-                // I don't think this will cause any problems, but I could be wrong
-                MM_MUL_UNLOCK (space);
-                NkSpinLock (&page->lock);
-                // Find the mapping
-                MmPageMap_t* map = page->maps;
-                MmPageMap_t* prev = NULL;
-                while (map)
-                {
-                    if (map->addr == mulMakeCanonical (addr) && map->space == space)
-                    {
-                        // Remove it and break
-                        --space->stats.numMaps;
-                        if (prev)
-                            prev->next = map->next;
-                        else
-                            page->maps = map->next;
-                        break;
-                    }
-                    prev = map;
-                    map = map->next;
-                }
-                NkSpinUnlock (&page->lock);
-                MM_MUL_LOCK (space);
+                // The mapping is removed once the TLB has been flushed
+                MmPtabGather (&gather, mulMakeCanonical (addr), NEXKE_CPU_PAGESZ, page);
             }
         }
     }
     MmPtabEndIterate (&iter);
+    MmPtabReclaim (&gather, iter.asPhys, mulDecanonical (base), base, count);
+    MmPtabFlushGather (&gather);
     MM_MUL_UNLOCK (space);
 }
 
@@ -402,6 +760,8 @@ void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm
     MM_MUL_LOCK (space);
     // Get right flags
     pte_t flags = mmMulGetProt (perm);
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
     // Set up iterator
     MmPtIter_t iter = {0};
     iter.asPhys = mmMulGetTtbr (&space->mulSpace, base);
@@ -410,6 +770,23 @@ void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm
     for (int i = 0; i < count; ++i)
     {
         uintptr_t addr = iter.addr;
+        // Change blocks in one go if the range covers all of it
+        // Permissions can change without breaking the entry
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (count - i) >= MUL_LARGE_PAGES)
+        {
+            MmPtCacheEnt_t* largeEnt = NULL;
+            pte_t* ent = mulGetLarge (space, mulMakeCanonical (addr), &largeEnt);
+            if (ent)
+            {
+                *ent = (*ent & PT_LARGEFRAME) | mulToLargeFlags (flags) | (*ent & PF_F);
+                MmPtabGather (&gather, mulMakeCanonical (addr), MUL_LARGE_PAGESZ, NULL);
+                MmPtabReturnCache (largeEnt);
+                mulResetIter (&iter);
+                iter.addr += MUL_LARGE_PAGESZ;
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
         // Get cache entry for table containing PTE
         MmPtCacheEnt_t* cacheEnt = MmPtabIterate (&iter);
         // If there is no cache entry, move to next address
@@ -421,11 +798,15 @@ void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm
             // Set protection if PTE is valid
             if (*pte & PF_V)
             {
+                // The group would disagree on permissions
+                if (*pte & PF_CONT)
+                    mulBreakCont (space, pte, mulMakeCanonical (addr));
                 *pte = (*pte & PT_FRAME) | flags | (*pte & PF_F);
-                MmMulFlushAddr (space, mulMakeCanonical (addr));
+                MmPtabGather (&gather, mulMakeCanonical (addr), NEXKE_CPU_PAGESZ, NULL);
             }
         }
     }
+    MmPtabFlushGather (&gather);
     MmPtabEndIterate (&iter);
     MM_MUL_UNLOCK (space);
 }
@@ -439,31 +820,30 @@ void MmMulUnmapPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
         uint64_t addr = mulDecanonical (map->addr);
-        // Get cache entry
-        MmPtCacheEnt_t* cacheEnt =
-            MmPtabWalk (map->space, mmMulGetTtbr (mulSpace, map->addr), addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
         // Make sure it isn't fixed
         if (*pte & PF_F)
             NkPanic ("nexke: can't unmap fixed mapping");
+        // Don't lose track of writes through this mapping
+        // Without a dirty bit, any writable mapping may have been written to
+        if (!(*pte & PF_RO))
+            page->flags |= MM_PAGE_DIRTY;
         // Clear it
         *pte = 0;
         --map->space->stats.numMaps;
         // Flush TLB if needed
         MmMulFlushAddr (map->space, map->addr);
-    next:
         // Return and unlock
         MmPtabReturnCache (cacheEnt);
         MM_MUL_UNLOCK (map->space);
         map = map->next;
     }
-    page->maps = NULL;
+    MmClearPageMaps (page);
 }
 
 // Changes protection on a page
@@ -477,13 +857,9 @@ void MmMulProtectPage (MmPage_t* page, int perm)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
         uint64_t addr = mulDecanonical (map->addr);
-        // Get cache entry
-        MmPtCacheEnt_t* cacheEnt =
-            MmPtabWalk (map->space, mmMulGetTtbr (mulSpace, map->addr), addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
@@ -491,7 +867,6 @@ void MmMulProtectPage (MmPage_t* page, int perm)
         *pte = (*pte & PT_FRAME) | flags | (*pte & PF_F);
         // Flush TLB if needed
         MmMulFlushAddr (map->space, map->addr);
-    next:
         // Return and unlock
         MmPtabReturnCache (cacheEnt);
         MM_MUL_UNLOCK (map->space);
@@ -509,13 +884,9 @@ void MmMulFixPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
         uint64_t addr = mulDecanonical (map->addr);
-        // Get cache entry
-        MmPtCacheEnt_t* cacheEnt =
-            MmPtabWalk (map->space, mmMulGetTtbr (mulSpace, map->addr), addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
@@ -543,13 +914,9 @@ void MmMulUnfixPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
         uint64_t addr = mulDecanonical (map->addr);
-        // Get cache entry
-        MmPtCacheEnt_t* cacheEnt =
-            MmPtabWalk (map->space, mmMulGetTtbr (mulSpace, map->addr), addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
@@ -572,6 +939,16 @@ void MmMulUnfixPage (MmPage_t* page)
 MmPage_t* MmMulGetMapping (MmSpace_t* space, uintptr_t virt)
 {
     MM_MUL_LOCK (space);
+    // Check for a block first so we don't split it
+    MmPtCacheEnt_t* largeEnt = NULL;
+    pte_t* ent = mulGetLarge (space, virt, &largeEnt);
+    if (ent)
+    {
+        paddr_t addr = (*ent & PT_LARGEFRAME) + (virt & (MUL_LARGE_PAGESZ - 1));
+        MmPtabReturnCache (largeEnt);
+        MM_MUL_UNLOCK (space);
+        return MmFindPagePfn (addr / NEXKE_CPU_PAGESZ);
+    }
     MmPtCacheEnt_t* cacheEnt =
         MmPtabWalk (space, mmMulGetTtbr (&space->mulSpace, virt), mulDecanonical (virt));
     assert (cacheEnt);
@@ -618,6 +995,58 @@ bool MmMulGetAttr (MmSpace_t* space, uintptr_t virt, int attr)
     return attrVal;
 }
 
+// Tests attribute of every mapping of page, and sets or clears it if update is set
+// Returns whether any mapping had the attribute set
+// We don't use hardware dirty bit management, so every writable mapping counts as dirty, and
+// the dirty attribute can't be changed
+static bool mulUpdateAttrPage (MmPage_t* page, int attr, bool update, bool val)
+{
+    bool res = false;
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        MM_MUL_LOCK (map->space);
+        uint64_t addr = mulDecanonical (map->addr);
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+        if (attr == MUL_ATTR_DIRTY)
+            res |= !(*pte & PF_RO);
+        else if (*pte & PF_AF)
+        {
+            res = true;
+            if (update && !val)
+            {
+                // Next access takes an access flag fault, which sets it again
+                *pte &= ~(PF_AF);
+                MmMulFlushAddr (map->space, map->addr);
+            }
+        }
+        else if (update && val)
+            *pte |= PF_AF;
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (map->space);
+        // If we're only looking, one set attribute is enough
+        if (res && (!update || attr == MUL_ATTR_DIRTY))
+            break;
+        map = map->next;
+    }
+    return res;
+}
+
+// Gets attributes of page
+bool MmMulGetAttrPage (MmPage_t* page, int attr)
+{
+    return mulUpdateAttrPage (page, attr, false, false);
+}
+
+// Sets attribute to value of page
+bool MmMulSetAttrPage (MmPage_t* page, int attr, bool val)
+{
+    return mulUpdateAttrPage (page, attr, true, val);
+}
+
 // Early MUL
 
 // Gets physical address of virtual address early in boot process
@@ -637,6 +1066,12 @@ uintptr_t MmMulGetPhysEarly (uintptr_t virt)
         pte_t* ent = &curSt[MUL_IDX_LEVEL (pgAddr, i)];
         if (!(*ent))
             NkPanic ("cannot get physical address of non-existant page");
+        // Blocks end the walk early
+        if (!(*ent & PF_TAB))
+        {
+            uintptr_t blockSz = 1ULL << idxShiftTab[i];
+            return PT_GETFRAME (*ent) + CpuPageAlignDown (pgAddr & (blockSz - 1));
+        }
         // Get physical address
         curSt = (pte_t*) PT_GETFRAME (*ent);
     }
@@ -667,8 +1102,15 @@ void MmMulMapEarly (uintptr_t virt, paddr_t phys, int flags)
         ttbr = CpuReadSpr ("TTBR1_EL1") & ~(1 << 0);
     else
         ttbr = CpuReadSpr ("TTBR0_EL1") & ~(1 << 0);
+    // Large and huge pages are mapped as blocks one or two levels early
+    int lastLevel = 1;
+    if (flags & (MUL_PAGE_LARGE | MUL_PAGE_HUGE))
+    {
+        lastLevel = (flags & MUL_PAGE_HUGE) ? MUL_HUGE_LEVEL : MUL_LARGE_LEVEL;
+        pgFlags &= ~(PF_PG);
+    }
     pte_t* curSt = (pte_t*) ttbr;
-    for (int i = mulMaxLevel; i > 1; --i)
+    for (int i = mulMaxLevel; i > lastLevel; --i)
     {
         // Get entry for this level
         pte_t* ent = &curSt[MUL_IDX_LEVEL (pgAddr, i)];
@@ -694,7 +1136,7 @@ void MmMulMapEarly (uintptr_t virt, paddr_t phys, int flags)
         }
     }
     // Map the last entry
-    pte_t* lastEnt = &curSt[MUL_IDX_LEVEL (pgAddr, 1)];
+    pte_t* lastEnt = &curSt[MUL_IDX_LEVEL (pgAddr, lastLevel)];
     if (*lastEnt)
         NkPanic ("nexke: cannot map already mapped page");
     *lastEnt = pgFlags | phys;
@@ -0,0 +1,144 @@
+/*
+    pmu.c - contains performance counter driver
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/platform/acpi.h>
+#include <nexke/platform/generic.h>
+
+// This drives the PMUv3 cycle counter. It's put in 64 bit mode and started at -period, so it
+// overflows after period cycles and raises the PMU's PPI
+
+// ID_AA64DFR0_EL1 PMUVer field
+#define CPU_DFR0_PMUVER_SHIFT  8
+#define CPU_DFR0_PMUVER_MASK   0xF
+#define CPU_DFR0_PMUVER_IMPDEF 0xF
+
+// PMCR_EL0 bits
+#define CPU_PMCR_E  (1 << 0)
+#define CPU_PMCR_LC (1 << 6)
+
+// Cycle counter's bit in the enable, interrupt enable and overflow registers
+#define CPU_PMU_CYCLES (1ULL << 31)
+
+// PPI of the PMU if firmware doesn't tell us
+#define CPU_PMU_PPI 23
+
+// SPSR mode field
+#define CPU_SPSR_MODE_MASK 0xF
+#define CPU_SPSR_MODE_EL0  0x0
+#define CPU_SPSR_MODE_EL1T 0x4
+
+static bool pmuFound = false;
+static uint64_t pmuPeriod = 0;    // Cycles between samples
+
+// PMU interrupt
+static NkHwInterrupt_t pmuInt = {0};
+static int pmuPpi = CPU_PMU_PPI;
+
+// Starts counter over
+static inline void cpuPmuReload()
+{
+    CpuWriteSpr ("PMCCNTR_EL0", -pmuPeriod);
+}
+
+// PMU interrupt handler
+static bool cpuPmuHandler (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    if (intObj->vector != CPU_BASE_HWINT + pmuPpi)
+        return false;
+    if (!(CpuReadSpr ("PMOVSCLR_EL0") & CPU_PMU_CYCLES))
+        return false;
+    // The interrupt is a level that stays up until the overflow is cleared
+    CpuWriteSpr ("PMOVSCLR_EL0", CPU_PMU_CYCLES);
+    // Find the stack that was interrupted. Code at EL1 may have been on either stack pointer,
+    // and if it was on SP_EL1, the trap frame was pushed right below it
+    uint64_t mode = ctx->spsr & CPU_SPSR_MODE_MASK;
+    uintptr_t sp = ctx->spEl0;
+    if (mode != CPU_SPSR_MODE_EL0 && mode != CPU_SPSR_MODE_EL1T)
+        sp = (uintptr_t) (ctx + 1);
+    if (NkProfSample (ctx->elr, sp, mode == CPU_SPSR_MODE_EL0))
+        cpuPmuReload();
+    else
+        CpuStopPmu();
+    asm volatile ("isb" ::: "memory");
+    return true;
+}
+
+// Sets up performance counters
+bool CpuInitPmu (uint64_t period)
+{
+    uint64_t ver = (CpuReadSpr ("ID_AA64DFR0_EL1") >> CPU_DFR0_PMUVER_SHIFT) & CPU_DFR0_PMUVER_MASK;
+    if (!ver || ver == CPU_DFR0_PMUVER_IMPDEF)
+        return false;
+    // Every CPU's PMU uses the same PPI, so take the first one the MADT gives
+    AcpiMadt_t* madt = (AcpiMadt_t*) PltAcpiFindTable ("APIC");
+    if (madt)
+    {
+        AcpiMadtEntry_t* cur = (AcpiMadtEntry_t*) (madt + 1);
+        AcpiMadtEntry_t* end = (void*) madt + madt->sdt.length;
+        while (cur < end)
+        {
+            if (cur->type == ACPI_MADT_GICC && ((AcpiGicc_t*) cur)->perfGsivv)
+            {
+                pmuPpi = ((AcpiGicc_t*) cur)->perfGsivv;
+                break;
+            }
+            cur = (void*) cur + cur->length;
+        }
+    }
+    pmuPeriod = period;
+    pmuFound = true;
+    PltInitInternalInt (&pmuInt,
+                        cpuPmuHandler,
+                        CPU_BASE_HWINT + pmuPpi,
+                        PLT_IPL_TIMER,
+                        PLT_MODE_LEVEL,
+                        0);
+    PltConnectInterrupt (&pmuInt);
+    NkLogDebug ("nexke: using PMUv3, PPI %d\n", pmuPpi);
+    return true;
+}
+
+// Starts performance counters of this CPU
+// The PPI and counters are banked, so each CPU has to do this for itself
+void CpuStartPmu()
+{
+    if (!pmuFound)
+        return;
+    PltGicEnablePpi (pmuPpi, PLT_IPL_TIMER);
+    // Count at EL0 and EL1
+    CpuWriteSpr ("PMCCFILTR_EL0", (uint64_t) 0);
+    cpuPmuReload();
+    CpuWriteSpr ("PMOVSCLR_EL0", CPU_PMU_CYCLES);
+    CpuWriteSpr ("PMINTENSET_EL1", CPU_PMU_CYCLES);
+    CpuWriteSpr ("PMCNTENSET_EL0", CPU_PMU_CYCLES);
+    CpuWriteSpr ("PMCR_EL0", CpuReadSpr ("PMCR_EL0") | CPU_PMCR_E | CPU_PMCR_LC);
+    asm volatile ("isb" ::: "memory");
+}
+
+// Stops performance counters of this CPU
+void CpuStopPmu()
+{
+    if (!pmuFound)
+        return;
+    CpuWriteSpr ("PMCNTENCLR_EL0", CPU_PMU_CYCLES);
+    CpuWriteSpr ("PMINTENCLR_EL1", CPU_PMU_CYCLES);
+    CpuWriteSpr ("PMOVSCLR_EL0", CPU_PMU_CYCLES);
+    asm volatile ("isb" ::: "memory");
+}
@@ -0,0 +1,200 @@
+/*
+    string.c - contains ARMv8 memory copy routines
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <stdint.h>
+#include <string.h>
+
+// These take the place of libk's generic versions
+// Nothing saves the FP / SIMD registers on a context switch, so these stick to pairs of general
+// purpose registers, which is as wide as a load or store gets without NEON anyway
+// The loops are all written in assembly, so the compiler can't turn them back into calls to
+// the functions they are in
+
+// Bytes moved by one iteration of the block loops
+#define CPU_STRING_BLOCK 64
+
+// Fills of zero at least this big use DC ZVA
+#define CPU_STRING_ZVA_MIN 256
+
+// DCZID_EL0 fields
+#define CPU_DCZID_BS  0xF
+#define CPU_DCZID_DZP (1 << 4)
+
+static size_t cpuZvaSz = 0;    // Size of block DC ZVA clears, 0 if it can't be used
+
+// Copies bytes one at a time
+static FORCEINLINE void cpuCopyBytes (uint8_t** d, const uint8_t** s, size_t n)
+{
+    if (!n)
+        return;
+    uint64_t tmp;
+    asm volatile ("1:\n"
+                  "ldrb %w[tmp], [%[s]], #1\n"
+                  "strb %w[tmp], [%[d]], #1\n"
+                  "subs %[n], %[n], #1\n"
+                  "b.ne 1b"
+                  : [d] "+r"(*d), [s] "+r"(*s), [n] "+r"(n), [tmp] "=&r"(tmp)
+                  :
+                  : "memory", "cc");
+}
+
+// Fills bytes one at a time
+static FORCEINLINE void cpuFillBytes (uint8_t** d, uint64_t val, size_t n)
+{
+    if (!n)
+        return;
+    asm volatile ("1:\n"
+                  "strb %w[val], [%[d]], #1\n"
+                  "subs %[n], %[n], #1\n"
+                  "b.ne 1b"
+                  : [d] "+r"(*d), [n] "+r"(n)
+                  : [val] "r"(val)
+                  : "memory", "cc");
+}
+
+void* memcpy (void* restrict dest, const void* restrict src, size_t n)
+{
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    // Device memory faults on unaligned accesses, so only copy wide if both can be aligned
+    if (((uintptr_t) d ^ (uintptr_t) s) & 7 || n < CPU_STRING_BLOCK)
+    {
+        cpuCopyBytes (&d, &s, n);
+        return dest;
+    }
+    size_t head = -(uintptr_t) d & 7;
+    cpuCopyBytes (&d, &s, head);
+    n -= head;
+    size_t blocks = n / CPU_STRING_BLOCK;
+    uint64_t t0, t1, t2, t3, t4, t5, t6, t7;
+    if (blocks)
+    {
+        asm volatile ("1:\n"
+                      "ldp %[t0], %[t1], [%[s]]\n"
+                      "ldp %[t2], %[t3], [%[s], #16]\n"
+                      "ldp %[t4], %[t5], [%[s], #32]\n"
+                      "ldp %[t6], %[t7], [%[s], #48]\n"
+                      "add %[s], %[s], #64\n"
+                      "stp %[t0], %[t1], [%[d]]\n"
+                      "stp %[t2], %[t3], [%[d], #16]\n"
+                      "stp %[t4], %[t5], [%[d], #32]\n"
+                      "stp %[t6], %[t7], [%[d], #48]\n"
+                      "add %[d], %[d], #64\n"
+                      "subs %[cnt], %[cnt], #1\n"
+                      "b.ne 1b"
+                      : [d] "+r"(d),
+                        [s] "+r"(s),
+                        [cnt] "+r"(blocks),
+                        [t0] "=&r"(t0),
+                        [t1] "=&r"(t1),
+                        [t2] "=&r"(t2),
+                        [t3] "=&r"(t3),
+                        [t4] "=&r"(t4),
+                        [t5] "=&r"(t5),
+                        [t6] "=&r"(t6),
+                        [t7] "=&r"(t7)
+                      :
+                      : "memory", "cc");
+    }
+    cpuCopyBytes (&d, &s, n % CPU_STRING_BLOCK);
+    return dest;
+}
+
+// Fills with pairs of registers
+static void cpuFill (uint8_t* d, uint64_t val, size_t n)
+{
+    if (n < CPU_STRING_BLOCK)
+    {
+        cpuFillBytes (&d, val, n);
+        return;
+    }
+    size_t head = -(uintptr_t) d & 7;
+    cpuFillBytes (&d, val, head);
+    n -= head;
+    size_t blocks = n / CPU_STRING_BLOCK;
+    if (blocks)
+    {
+        asm volatile ("1:\n"
+                      "stp %[val], %[val], [%[d]]\n"
+                      "stp %[val], %[val], [%[d], #16]\n"
+                      "stp %[val], %[val], [%[d], #32]\n"
+                      "stp %[val], %[val], [%[d], #48]\n"
+                      "add %[d], %[d], #64\n"
+                      "subs %[cnt], %[cnt], #1\n"
+                      "b.ne 1b"
+                      : [d] "+r"(d), [cnt] "+r"(blocks)
+                      : [val] "r"(val)
+                      : "memory", "cc");
+    }
+    cpuFillBytes (&d, val, n % CPU_STRING_BLOCK);
+}
+
+void* memset (void* str, int ch, size_t n)
+{
+    uint8_t* d = str;
+    uint64_t val = 0x0101010101010101ULL * (uint8_t) ch;
+    // Big fills of zero clear a whole block at once with DC ZVA
+    // That only works on normal memory, which is all memset should be used on
+    if (!ch && cpuZvaSz && n >= CPU_STRING_ZVA_MIN && n >= 2 * cpuZvaSz)
+    {
+        size_t head = -(uintptr_t) d & (cpuZvaSz - 1);
+        cpuFill (d, 0, head);
+        d += head, n -= head;
+        size_t blocks = n / cpuZvaSz;
+        for (size_t i = 0; i < blocks; ++i)
+        {
+            asm volatile ("dc zva, %0" : : "r"(d) : "memory");
+            d += cpuZvaSz;
+        }
+        cpuFill (d, 0, n % cpuZvaSz);
+        return str;
+    }
+    cpuFill (d, val, n);
+    return str;
+}
+
+void* memmove (void* dest, const void* src, size_t n)
+{
+    // A forward copy is fine unless the destination overlaps the end of the source
+    if ((uintptr_t) dest - (uintptr_t) src >= n)
+        return memcpy (dest, src, n);
+    if (!n)
+        return dest;
+    uint8_t* d = (uint8_t*) dest + n;
+    const uint8_t* s = (const uint8_t*) src + n;
+    uint64_t tmp;
+    asm volatile ("1:\n"
+                  "ldrb %w[tmp], [%[s], #-1]!\n"
+                  "strb %w[tmp], [%[d], #-1]!\n"
+                  "subs %[n], %[n], #1\n"
+                  "b.ne 1b"
+                  : [d] "+r"(d), [s] "+r"(s), [n] "+r"(n), [tmp] "=&r"(tmp)
+                  :
+                  : "memory", "cc");
+    return dest;
+}
+
+// Picks memory copy routines for this CPU's features
+void CpuInitString()
+{
+    uint64_t dczid = CpuReadSpr ("DCZID_EL0");
+    if (!(dczid & CPU_DCZID_DZP))
+        cpuZvaSz = 4UL << (dczid & CPU_DCZID_BS);
+    NkLogDebug ("nexke: DC ZVA block size %lu\n", cpuZvaSz);
+}
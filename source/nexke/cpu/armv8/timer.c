@@ -18,37 +18,190 @@
 #include <nexke/cpu.h>
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
+#include <nexke/platform/acpi.h>
 #include <nexke/platform/generic.h>
 
+// The generic timer is a system wide counter every CPU sees the same value of, with a comparator
+// on each CPU. We use the virtual counter and timer, which are the ones EL1 is meant to use,
+// and are the same as the physical ones when there's no hypervisor
+
+// CNTV_CTL_EL0 bits
+#define CPU_GT_CTL_ENABLE  (1 << 0)
+#define CPU_GT_CTL_IMASK   (1 << 1)
+#define CPU_GT_CTL_ISTATUS (1 << 2)
+
+// CNTKCTL_EL1 bits
+#define CPU_GT_KCTL_EVNTEN     (1 << 2)
+#define CPU_GT_KCTL_EVNTDIR    (1 << 3)
+#define CPU_GT_KCTL_EVNTI(bit) ((bit) << 4)
+#define CPU_GT_KCTL_EVNTI_MASK (0xF << 4)
+
+// How often the event stream should wake up WFE
+#define CPU_GT_EVENT_TIME 10000    // 10 us
+
+// PPI of the virtual timer if firmware doesn't tell us
+#define CPU_GT_VIRT_PPI 27
+
+// GTDT timer flags
+#define CPU_GT_FLAG_EDGE       (1 << 0)
+#define CPU_GT_FLAG_ACTIVE_LOW (1 << 1)
+
 extern PltHwClock_t gtClock;
 extern PltHwTimer_t gtTimer;
 
+// Conversion factors, counts to ns and back
+static uint32_t gtMult = 0;
+static int gtShift = 0;
+static uint32_t gtInvMult = 0;
+static int gtInvShift = 0;
+
+// Counter bit the event stream goes off on, and the counts between events
+static int gtEventBit = 0;
+static uint64_t gtEventPeriod = 0;
+
+// Timer interrupt
+static NkHwInterrupt_t gtInt = {0};
+static int gtPpi = CPU_GT_VIRT_PPI;
+
+// Reads the counter
+// The ISB keeps the read from being done ahead of the code before it
+static inline uint64_t cpuGtRead()
+{
+    asm volatile ("isb" ::: "memory");
+    return CpuReadSpr ("CNTVCT_EL0");
+}
+
+// Multiplies val by mult / 2^shift
+static inline ktime_t cpuGtScale (ktime_t val, uint32_t mult, int shift)
+{
+    // Split the multiply so it can't overflow
+    ktime_t high = ((val >> 32) * mult) << (32 - shift);
+    ktime_t low = ((val & 0xFFFFFFFF) * mult) >> shift;
+    return high + low;
+}
+
+// Finds a 32 bit fixed point factor for multiplying by num / denom
+static void cpuGtGetFactor (ktime_t num, ktime_t denom, uint32_t* mult, int* shift)
+{
+    // Take the biggest shift that keeps the multiplier in 32 bits, without overflowing num
+    int s = 32;
+    while (s && ((num >> (64 - s)) || ((num << s) / denom) > UINT32_MAX))
+        --s;
+    *mult = (num << s) / denom;
+    *shift = s;
+}
+
 // Gets time on clock
 static ktime_t CpuGtGetTime()
 {
+    return cpuGtScale (cpuGtRead(), gtMult, gtShift);
 }
 
 // Polls for specified NS
+// Long waits are done in WFE, which the event stream wakes us from every period. The last period
+// is spun out so we don't overshoot
 static void CpuGtPoll (ktime_t delta)
 {
+    uint64_t target = cpuGtRead() + cpuGtScale (delta, gtInvMult, gtInvShift);
+    // Without the event stream nothing may ever wake up WFE
+    bool events = CpuReadSpr ("CNTKCTL_EL1") & CPU_GT_KCTL_EVNTEN;
+    uint64_t now;
+    while ((now = cpuGtRead()) < target)
+    {
+        if (events && (target - now) > gtEventPeriod)
+            asm volatile ("wfe" ::: "memory");
+        else
+            CpuSpin();
+    }
 }
 
 // Arms timer to specified delta
 static void CpuGtArmTimer (ktime_t delta)
 {
+    // The comparator is absolute, so this can't race with the counter moving on
+    uint64_t cval = cpuGtRead() + cpuGtScale (delta, gtInvMult, gtInvShift);
+    CpuWriteSpr ("CNTV_CVAL_EL0", cval);
+    CpuWriteSpr ("CNTV_CTL_EL0", (uint64_t) CPU_GT_CTL_ENABLE);
+    asm volatile ("isb" ::: "memory");
+}
+
+// Timer interrupt handler
+static bool cpuGtHandler (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    if (intObj->vector != CPU_BASE_HWINT + gtPpi)
+        return false;
+    // The interrupt is a level that stays up as long as the counter is past the comparator,
+    // so turn the timer off until the next arm
+    CpuWriteSpr ("CNTV_CTL_EL0", (uint64_t) 0);
+    asm volatile ("isb" ::: "memory");
+    NkTimeHandler();
+    return true;
+}
+
+// Sets up timer of a newly started CPU
+// The PPI and comparator are banked, so each CPU has to do this for itself
+static void cpuGtInitCpu (NkCcb_t* ccb)
+{
+    CpuWriteSpr ("CNTV_CTL_EL0", (uint64_t) 0);
+    // Turn on the event stream for CpuGtPoll
+    uint64_t kctl = CpuReadSpr ("CNTKCTL_EL1");
+    kctl &= ~(uint64_t) (CPU_GT_KCTL_EVNTI_MASK | CPU_GT_KCTL_EVNTDIR);
+    kctl |= CPU_GT_KCTL_EVNTEN | CPU_GT_KCTL_EVNTI (gtEventBit);
+    CpuWriteSpr ("CNTKCTL_EL1", kctl);
+    asm volatile ("isb" ::: "memory");
+    PltGicEnablePpi (gtPpi, PLT_IPL_TIMER);
 }
 
 PltHwClock_t gtClock = {.type = PLT_CLOCK_GENERIC, .getTime = CpuGtGetTime, .poll = CpuGtPoll};
-PltHwTimer_t gtTimer = {.type = PLT_TIMER_GENERIC, .armTimer = CpuGtArmTimer};
+PltHwTimer_t gtTimer = {.type = PLT_TIMER_GENERIC,
+                        .armTimer = CpuGtArmTimer,
+                        .initCpu = cpuGtInitCpu};
 
 // Initializes generic timer clock
 PltHwClock_t* CpuInitGtClock()
 {
+    // Firmware puts the counter frequency in CNTFRQ
+    uint64_t freq = CpuReadSpr ("CNTFRQ_EL0") & 0xFFFFFFFF;
+    if (!freq)
+        NkPanic ("nexke: generic timer frequency not set\n");
+    cpuGtGetFactor (PLT_NS_IN_SEC, freq, &gtMult, &gtShift);
+    cpuGtGetFactor (freq, PLT_NS_IN_SEC, &gtInvMult, &gtInvShift);
+    // Events go off when the chosen bit flips to 1, so every 2^(bit + 1) counts. Take the
+    // longest period that is no more than CPU_GT_EVENT_TIME
+    uint64_t eventCounts = (freq * CPU_GT_EVENT_TIME) / PLT_NS_IN_SEC;
+    while (gtEventBit < 15 && (2ULL << (gtEventBit + 1)) <= eventCounts)
+        ++gtEventBit;
+    gtEventPeriod = 2ULL << gtEventBit;
+    int precision = PLT_NS_IN_SEC / freq;
+    if (!precision)
+        ++precision;
+    gtClock.precision = precision;
+    NkLogDebug ("nexke: using generic timer as clock, frequency %llu Hz\n",
+                (unsigned long long) freq);
     return &gtClock;
 }
 
 // Initializes generic timer timer
 PltHwTimer_t* CpuInitGtTimer()
 {
+    // Get the PPI of the virtual timer from the GTDT
+    int flags = 0;
+    AcpiGtdt_t* gtdt = (AcpiGtdt_t*) PltAcpiFindTable ("GTDT");
+    if (gtdt && gtdt->virtGsi)
+    {
+        gtPpi = gtdt->virtGsi;
+        flags = gtdt->virtFlags;
+    }
+    gtTimer.precision = gtClock.precision;
+    gtTimer.maxInterval = INT64_MAX;
+    PltInitInternalInt (&gtInt,
+                        cpuGtHandler,
+                        CPU_BASE_HWINT + gtPpi,
+                        PLT_IPL_TIMER,
+                        (flags & CPU_GT_FLAG_EDGE) ? PLT_MODE_EDGE : PLT_MODE_LEVEL,
+                        (flags & CPU_GT_FLAG_ACTIVE_LOW) ? PLT_HWINT_ACTIVE_LOW : 0);
+    PltConnectInterrupt (&gtInt);
+    cpuGtInitCpu (CpuGetCcb());
+    NkLogDebug ("nexke: using generic timer as timer, PPI %d\n", gtPpi);
     return &gtTimer;
 }
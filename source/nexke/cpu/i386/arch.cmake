@@ -31,8 +31,16 @@ list(APPEND NEXKE_SOURCES
     cpu/i386/cpuhelp.c
     cpu/i386/cpu.asm
     cpu/i386/trap.asm
+    cpu/i386/trampoline.asm
+    cpu/x86/alt.c
     cpu/x86/cpuid.c
+    cpu/x86/crc32.c
     cpu/x86/exec.c
+    cpu/x86/fpu.c
+    cpu/x86/idle.c
+    cpu/x86/kstack.c
+    cpu/x86/pmu.c
+    cpu/x86/string.c
     cpu/x86/tsc.c
     mm/ptab.c)
 
@@ -38,6 +38,26 @@ CpuFlushGdt:
     pop ebp
     ret
 
+; Loads GS with a segment
+global CpuLoadGs
+CpuLoadGs:
+    push ebp
+    mov ebp, esp
+    mov eax, [ebp+8]
+    mov gs, ax
+    pop ebp
+    ret
+
+; Loads FS with a segment
+global CpuLoadFs
+CpuLoadFs:
+    push ebp
+    mov ebp, esp
+    mov eax, [ebp+8]
+    mov fs, ax
+    pop ebp
+    ret
+
 ; Flushes the IDT
 global CpuInstallIdt
 CpuInstallIdt:
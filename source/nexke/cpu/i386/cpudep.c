@@ -17,6 +17,7 @@
 
 #include <assert.h>
 #include <nexke/cpu.h>
+#include <nexke/cpu/ptab.h>
 #include <nexke/mm.h>
 #include <nexke/nexboot.h>
 #include <nexke/nexke.h>
@@ -40,6 +41,35 @@ static CpuTss_t cpuDfaultTss = {0};
 // Segment resource
 static NkResArena_t* cpuSegs = NULL;
 
+// CCB segments of each CPU
+static int cpuCcbSegs[NEXKE_MAX_CPUS] = {CPU_CCB_SEG / 8};
+
+// Per-CPU variable segments of each CPU
+// The BSP's per-CPU variables are the ones in the image, so it uses the flat kernel data segment
+static int cpuPerCpuSegs[NEXKE_MAX_CPUS] = {CPU_SEG_KDATA / 8};
+
+// AP trampoline, see trampoline.asm
+extern uint8_t CpuTrampoline[];
+extern uint8_t CpuTrampData[];
+extern uint8_t CpuTrampolineEnd[];
+
+// Trampoline data block
+typedef struct _cputrampdata
+{
+    uint64_t efer;     // EFER to set before paging, 0 if it shouldn't be set
+    uint32_t cr3;      // Trampoline page tables
+    uint32_t cr4;      // CR4 to enable paging with, 0 if there isn't a CR4
+    uint32_t cr0;      // CR0 to enable paging with
+    uint32_t stack;    // Stack to start kernel on
+    uint32_t ccb;      // CCB of AP
+    uint32_t entry;    // Kernel entry point
+} __attribute__ ((packed)) cpuTrampData_t;
+
+static paddr_t cpuTrampPhys = 0;                        // Physical address of trampoline
+static uint8_t* cpuTramp = NULL;                        // Trampoline mapping
+static volatile cpuTrampData_t* cpuTrampData = NULL;    // Data block of trampoline
+static uint64_t cpuApPat = 0;                           // PAT APs end up with
+
 // Sets up a GDT gate
 static void cpuSetGdtGate (CpuSegDesc_t* desc,
                            uint32_t base,
@@ -174,6 +204,7 @@ void CpuInitCcb()
     NexNixBoot_t* bootInfo = NkGetBootArgs();
     // Set up basic fields
     ccb.self = &ccb;
+    ccb.cpuNum = 0;    // BSP is always CPU 0
     ccb.cpuArch = NEXKE_CPU_I386;
     ccb.cpuFamily = NEXKE_CPU_FAMILY_X86;
 #ifdef NEXNIX_BOARD_PC
@@ -208,6 +239,8 @@ void CpuInitCcb()
         CpuDetectCpuid (&ccb);
         ccb.archCcb.features |= CPU_FEATURE_INVLPG | CPU_FEATURE_AC;
     }
+    // Now that we know if we have PAT, set it up
+    MmMulInitPat();
     // Initialize GDT
     cpuInitGdt();
     // Initialize IDT
@@ -253,6 +286,11 @@ void CpuInitCcb()
             cr4 |= CPU_CR4_SMEP;
         CpuWriteCr4 (cr4);
     }
+    CpuInitFpu();
+    CpuInitString();
+    CpuInitCrc();
+    CpuInitKstack();
+    CpuApplyAlternatives();
     // Set EFER
     if (CpuGetFeatures() & CPU_FEATURE_MSR)
     {
@@ -279,40 +317,16 @@ NkCcb_t* CpuRealCcb()
     return &ccb;
 }
 
-// Allocates a kernel stack
-static void* cpuAllocKstack()
-{
-    // Allocate it
-    void* stack = MmAllocKvRegion ((CPU_KSTACK_SZ >> NEXKE_CPU_PAGE_SHIFT) + 2, 0);
-    // Create two guard pages
-    MmPage_t* guard1 = MmAllocGuardPage();
-    MmPage_t* guard2 = MmAllocGuardPage();
-    if (!guard1 || !guard2 || !stack)
-        return NULL;
-    // Add them
-    MmObject_t* kobj = MmGetKernelObject();
-    MmAddPage (kobj, (size_t) stack - MmGetKernelSpace()->startAddr, guard1);
-    uintptr_t stackEnd = (CPU_KSTACK_SZ + NEXKE_CPU_PAGESZ) + (uintptr_t) stack;
-    MmAddPage (kobj, stackEnd - MmGetKernelSpace()->startAddr, guard2);
-    return stack + NEXKE_CPU_PAGESZ;    // Return non-guard page
-}
-
-// Destroys kernel stack
-static void cpuDestroyKstack (void* stack)
-{
-    // Free region taking into account guard page
-    MmFreeKvRegion (stack - NEXKE_CPU_PAGESZ);
-}
-
 // Allocates a CPU context and intializes it
 // On i386, a CPU's context is it's kernel stack
-CpuContext_t* CpuAllocContext (uintptr_t entry)
+CpuContext_t* CpuAllocContext (uintptr_t entry, int stackClass)
 {
     // Allocate a stack
-    void* stack = cpuAllocKstack();
+    void* stack = CpuAllocKstack (stackClass);
     if (!stack)
         return NULL;
-    CpuContext_t* context = (CpuContext_t*) (stack + CPU_KSTACK_SZ - sizeof (CpuContext_t));
+    size_t stackSz = CpuGetStackSize (stackClass);
+    CpuContext_t* context = (CpuContext_t*) (stack + stackSz - sizeof (CpuContext_t));
     // Initialize it
     context->ebx = 0;
     context->edi = 0;
@@ -322,10 +336,161 @@ CpuContext_t* CpuAllocContext (uintptr_t entry)
     return context;
 }
 
+// Gets the stack a context is on
+static inline void* cpuContextStack (CpuContext_t* context, int stackClass)
+{
+    return (void*) (CpuPageAlignUp ((uintptr_t) context)) - CpuGetStackSize (stackClass);
+}
+
 // Destroys a context
-void CpuDestroyContext (CpuContext_t* context)
+void CpuDestroyContext (CpuContext_t* context, int stackClass)
+{
+    CpuFreeKstack (cpuContextStack (context, stackClass), stackClass);
+}
+
+// Gets the most of the stack of context that has ever been used
+size_t CpuGetStackPeak (CpuContext_t* context, int stackClass)
 {
-    // Get stack
-    void* stack = (void*) (CpuPageAlignUp ((uintptr_t) context)) - CPU_KSTACK_SZ;
-    cpuDestroyKstack (stack);
+    return CpuGetKstackPeak (cpuContextStack (context, stackClass), stackClass);
+}
+
+// Allocates CCB for another CPU, based on the BSP's
+NkCcb_t* CpuAllocCcb (int cpuNum)
+{
+    // NkCcb_t is laid out in cache lines, so it has to start on one
+    size_t numPages = CpuPageAlignUp (sizeof (NkCcb_t)) >> NEXKE_CPU_PAGE_SHIFT;
+    NkCcb_t* newCcb = MmAllocKvRegion (numPages, MM_KV_NO_DEMAND);
+    if (!newCcb)
+        return NULL;
+    memset (newCcb, 0, sizeof (NkCcb_t));
+    newCcb->self = newCcb;
+    newCcb->cpuNum = cpuNum;
+    newCcb->cpuArch = ccb.cpuArch;
+    newCcb->cpuFamily = ccb.cpuFamily;
+    newCcb->sysBoard = ccb.sysBoard;
+    strcpy (newCcb->sysName, ccb.sysName);
+    // We assume every CPU has the same features as the BSP
+    // This also gives it the GDT and IDT, which all CPUs share
+    newCcb->archCcb = ccb.archCcb;
+    newCcb->archCcb.intsHeld = true;
+    newCcb->archCcb.intRequested = true;
+    memset (newCcb->archCcb.kstackCache, 0, sizeof (newCcb->archCcb.kstackCache));
+    memset (newCcb->archCcb.kstackCount, 0, sizeof (newCcb->archCcb.kstackCount));
+    newCcb->preemptDisable = 1;
+    // Every CPU reaches its CCB through a GS segment of its own
+    cpuCcbSegs[cpuNum] = CpuAllocSeg ((uintptr_t) newCcb, sizeof (NkCcb_t), CPU_DPL_KERNEL);
+    return newCcb;
+}
+
+// Kernel entry point of APs
+static void __attribute__ ((noreturn)) cpuApEntry (NkCcb_t* apCcb)
+{
+    // Load kernel GDT and IDT
+    // Note that loading the GDT sets GS to the BSP's CCB, so we need to load ours after
+    CpuTabPtr_t gdtr = {.base = (uint32_t) cpuGdt, .limit = NEXKE_CPU_PAGESZ - 1};
+    CpuFlushGdt (&gdtr);
+    CpuLoadGs (cpuCcbSegs[apCcb->cpuNum] * 8);
+    CpuLoadFs (cpuPerCpuSegs[apCcb->cpuNum] * 8);
+    CpuTabPtr_t idtPtr = {.base = (uintptr_t) cpuIdt, .limit = (CPU_IDT_MAX * 8) - 1};
+    CpuInstallIdt (&idtPtr);
+    if (CpuGetFeatures() & CPU_FEATURE_PAT)
+        CpuWrmsr (MUL_PAT_MSR, cpuApPat);
+    CpuInitFpu();
+    NkApMain (apCcb);
+}
+
+// Sets up trampoline for APs
+// It gets one page for code, and one for each level of trampoline page tables
+static bool cpuInitTrampoline()
+{
+#ifdef NEXNIX_I386_PAE
+    size_t numPages = 4;
+#else
+    size_t numPages = 3;
+#endif
+    // Startup IPIs can only go to the first 1 MiB
+    MmPage_t* pages = MmAllocPagesAt (numPages, 0x100000, NEXKE_CPU_PAGESZ);
+    if (!pages)
+        return false;
+    paddr_t phys = MmGetPagePhys (pages);
+    cpuTramp = MmAllocKvMmio (phys, numPages, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
+    if (!cpuTramp)
+    {
+        MmFreePages (pages, numPages);
+        return false;
+    }
+    memset (cpuTramp, 0, numPages * NEXKE_CPU_PAGESZ);
+    // Copy in the code
+    size_t codeSz = CpuTrampolineEnd - CpuTrampoline;
+    assert (codeSz <= NEXKE_CPU_PAGESZ);
+    memcpy (cpuTramp, CpuTrampoline, codeSz);
+    cpuTrampData = (volatile cpuTrampData_t*) (cpuTramp + (CpuTrampData - CpuTrampoline));
+    // Identity map the trampoline, so it keeps running once paging is on
+    pte_t* tab = (pte_t*) (cpuTramp + ((numPages - 1) * NEXKE_CPU_PAGESZ));
+    tab[MUL_IDX_LEVEL (phys, 1)] = phys | PF_P | PF_RW;
+#ifdef NEXNIX_I386_PAE
+    pdpte_t* pdpt = (pdpte_t*) (cpuTramp + NEXKE_CPU_PAGESZ);
+    pte_t* dir = (pte_t*) (cpuTramp + (2 * NEXKE_CPU_PAGESZ));
+    pdpt[PG_ADDR_PDPT (phys)] = (phys + (2 * NEXKE_CPU_PAGESZ)) | PF_P;
+#else
+    pte_t* dir = (pte_t*) (cpuTramp + NEXKE_CPU_PAGESZ);
+#endif
+    dir[PG_ADDR_DIR (phys)] = (phys + ((numPages - 1) * NEXKE_CPU_PAGESZ)) | PF_P | PF_RW;
+    cpuTrampPhys = phys;
+    return true;
+}
+
+// Prepares a CPU to be started with CCB
+paddr_t CpuPrepareAp (NkCcb_t* apCcb)
+{
+    // Trampoline is set up the first time around, and kept for every AP after
+    if (!cpuTrampPhys && !cpuInitTrampoline())
+        return 0;
+    // Per-CPU variables are reached through FS, which is a flat segment offset to this CPU's copy
+    int perCpuSeg = NkAllocResource (cpuSegs);
+    if (perCpuSeg == -1)
+        return 0;
+    cpuSetGdtGate (&cpuGdt[perCpuSeg],
+                   apCcb->perCpuOff,
+                   0xFFFFFFFF,
+                   CPU_SEG_DB | CPU_SEG_GRAN | CPU_SEG_WRITABLE | CPU_SEG_NON_SYS,
+                   CPU_DPL_KERNEL,
+                   0);
+    cpuPerCpuSegs[apCcb->cpuNum] = perCpuSeg;
+    void* stack = CpuAllocKstack (CPU_KSTACK_NORMAL);
+    if (!stack)
+        return 0;
+    uintptr_t stackTop = (uintptr_t) stack + CPU_KSTACK_SZ;
+    // The AP can't take page faults until it has an IDT, but kernel stacks come pre-faulted
+    // Kernel part of the trampoline's tables comes from the kernel space, so the AP can reach the
+    // kernel after paging is on. Copy it each time, as it may have changed
+    MmSpace_t* kernSpace = MmGetKernelSpace();
+    MM_MUL_LOCK (kernSpace);
+#ifdef NEXNIX_I386_PAE
+    pdpte_t* pdpt = (pdpte_t*) (cpuTramp + NEXKE_CPU_PAGESZ);
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (kernSpace->mulSpace.base, 3);
+    pdpte_t* kernPdpt = (pdpte_t*) cacheEnt->addr;
+    pdpt[PG_ADDR_PDPT (NEXKE_KERNEL_BASE)] = kernPdpt[PG_ADDR_PDPT (NEXKE_KERNEL_BASE)];
+#else
+    pte_t* dir = (pte_t*) (cpuTramp + NEXKE_CPU_PAGESZ);
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (kernSpace->mulSpace.base, MM_PTAB_UNCACHED);
+    pte_t* kernDir = (pte_t*) cacheEnt->addr;
+    memcpy (&dir[MUL_KERNEL_START],
+            &kernDir[MUL_KERNEL_START],
+            (MUL_KERNEL_MAX - MUL_KERNEL_START + 1) * sizeof (pte_t));
+#endif
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (kernSpace);
+    if (CpuGetFeatures() & CPU_FEATURE_PAT)
+        cpuApPat = CpuRdmsr (MUL_PAT_MSR);
+    cpuTrampData->efer = 0;
+    if (CpuGetFeatures() & CPU_FEATURE_MSR && CpuGetFeatures() & CPU_FEATURE_XD)
+        cpuTrampData->efer = CpuRdmsr (CPU_EFER_MSR);
+    cpuTrampData->cr3 = cpuTrampPhys + NEXKE_CPU_PAGESZ;
+    cpuTrampData->cr4 = (ccb.archCcb.family > 4) ? CpuReadCr4() : 0;
+    cpuTrampData->cr0 = CpuReadCr0();
+    cpuTrampData->stack = stackTop;
+    cpuTrampData->ccb = (uintptr_t) apCcb;
+    cpuTrampData->entry = (uintptr_t) cpuApEntry;
+    return cpuTrampPhys;
 }
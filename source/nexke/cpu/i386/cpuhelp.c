@@ -124,6 +124,11 @@ uint64_t CpuRdtsc (void)
     return ((uint64_t) high << 32) | low;
 }
 
+uint64_t CpuGetCycles()
+{
+    return CpuRdtsc();
+}
+
 void CpuDisable()
 {
     asm ("cli");
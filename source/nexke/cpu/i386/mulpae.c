@@ -23,13 +23,46 @@
 // Kernel page directory template
 static pte_t* mulKePgDir = NULL;
 
-// Page mapping cache
-static SlabCache_t* mulMapCache = NULL;
-
 // Flushes whole TLB
 void MmMulFlushTlb()
 {
+    // Writing CR3 reloads the PDPTEs, but leaves global entries alone. Toggling PGE flushes
+    // those too
     CpuWriteCr3 (CpuReadCr3());
+    if (CpuHasFeature (CPU_FEATURE_PGE))
+    {
+        uint32_t cr4 = CpuReadCr4();
+        CpuWriteCr4 (cr4 & ~(CPU_CR4_PGE));
+        CpuWriteCr4 (cr4);
+    }
+}
+
+// Marks every kernel mapping global
+// Mappings made before CPUID was read, including the kernel image, don't have the bit yet
+static void mulSetGlobal (pdpte_t* pdpt)
+{
+    for (int i = PG_ADDR_PDPT (NEXKE_KERNEL_BASE); i < 4; ++i)
+    {
+        if (!(pdpt[i] & PF_P))
+            continue;
+        pde_t* dir = (pde_t*) PT_GETFRAME (pdpt[i]);
+        for (int j = 0; j < 512; ++j)
+        {
+            if (!(dir[j] & PF_P))
+                continue;
+            if (PT_ISLARGE (dir[j]))
+            {
+                dir[j] |= PF_G;
+                continue;
+            }
+            pte_t* tab = (pte_t*) PT_GETFRAME (dir[j]);
+            for (int k = 0; k < 512; ++k)
+            {
+                if (tab[k] & PF_P)
+                    tab[k] |= PF_G;
+            }
+        }
+    }
 }
 
 // Initializes MUL
@@ -45,13 +78,16 @@ void MmMulInit()
     // So allocate cache entry page
     MmPage_t* cachePgCtrl = MmAllocFixedPage();
     MmFixPage (cachePgCtrl);
-    paddr_t cachePage = cachePgCtrl->pfn * NEXKE_CPU_PAGESZ;
+    paddr_t cachePage = MmGetPagePhys (cachePgCtrl);
     // Map it
     MmMulMapEarly (MUL_PTCACHE_ENTRY_BASE, cachePage, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
     // Map the page table for the table cache
     pte_t* dir = (pte_t*) (pdpt[PG_ADDR_PDPT (MUL_PTCACHE_ENTRY_BASE)] & PT_FRAME);
     paddr_t cacheTab = dir[PG_ADDR_DIR (MUL_PTCACHE_TABLE_BASE)] & PT_FRAME;
     MmMulMapEarly (MUL_PTCACHE_TABLE_BASE, cacheTab, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
+    // Keep kernel translations across address space switches
+    if (CpuHasFeature (CPU_FEATURE_PGE))
+        mulSetGlobal (pdpt);
     // Clear out all user PDPTEs
     pdpt[0] = 0;
     pdpt[1] = 0;
@@ -66,17 +102,20 @@ void MmMulInit()
     NkListAddFront (&mulSpace->pageList, &cachePgCtrl->link);
     // Prepare page table cache
     MmPtabInitCache (MmGetKernelSpace());
-    mulMapCache = MmCacheCreate (sizeof (MmPageMap_t), "MmPageMap_t", 0, 0);
-    assert (mulMapCache);
-    // Set up PAT if we have it
-    if (CpuGetFeatures() & CPU_FEATURE_PAT)
-    {
-        // Setup our PAT
-        uint64_t pat = (MUL_PAT_WB << MUL_PAT0) | (MUL_PAT_WT << MUL_PAT1) |
-                       (MUL_PAT_UCMINUS << MUL_PAT2) | (MUL_PAT_UC << MUL_PAT3) |
-                       ((uint64_t) MUL_PAT_WC << MUL_PAT4);
-        CpuWrmsr (MUL_PAT_MSR, pat);
-    }
+}
+
+// Sets up PAT if we have it
+// This has to wait for CPUID to be read, which happens after MmMulInit. Entries 0-3 match what
+// the CPU resets them to, and nothing has used entry 4 yet, so no cache flush is needed
+void MmMulInitPat()
+{
+    if (!(CpuGetFeatures() & CPU_FEATURE_PAT))
+        return;
+    // Setup our PAT
+    uint64_t pat = (MUL_PAT_WB << MUL_PAT0) | (MUL_PAT_WT << MUL_PAT1) |
+                   (MUL_PAT_UCMINUS << MUL_PAT2) | (MUL_PAT_UC << MUL_PAT3) |
+                   ((uint64_t) MUL_PAT_WC << MUL_PAT4);
+    CpuWrmsr (MUL_PAT_MSR, pat);
 }
 
 // Verifies mappability of pte2 into pte1
@@ -98,15 +137,18 @@ paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t*
         isKernel = false;
     MM_MUL_UNLOCK (space);
     // Allocate the table
-    MmPage_t* pg = MmAllocFixedPage();
+    MmPage_t* pg = MmAllocPtPage();
     MmFixPage (pg);
-    paddr_t tab = pg->pfn * NEXKE_CPU_PAGESZ;
-    // Zero it
-    MmMulZeroPage (pg);
+    paddr_t tab = MmGetPagePhys (pg);
     MM_MUL_LOCK (space);
     // Check if a table was mapped while we were unlocked
     if (*ent)
+    {
         tab = *ent & PT_FRAME;
+        // Ours is still empty, so keep it for the next table
+        MmUnfixPage (pg);
+        MmFreePtPage (pg);
+    }
     else
     {
         // Add to page list
@@ -125,11 +167,9 @@ paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t*
 static paddr_t mulAllocDir (MmSpace_t* space, pdpte_t* ent)
 {
     MM_MUL_UNLOCK (space);
-    MmPage_t* pg = MmAllocFixedPage();
+    MmPage_t* pg = MmAllocZeroedPage();
     MmFixPage (pg);
-    paddr_t tab = pg->pfn * NEXKE_CPU_PAGESZ;
-    // Zero it
-    MmMulZeroPage (pg);
+    paddr_t tab = MmGetPagePhys (pg);
     MM_MUL_LOCK (space);
     if (*ent)
         tab = *ent & ~(PF_P);
@@ -150,6 +190,12 @@ void MmMulCreateSpace (MmSpace_t* space)
 {
 }
 
+// Switches CPU to address space
+void MmMulSwitchSpace (MmSpace_t* space)
+{
+    CpuWriteCr3 ((uint32_t) space->mulSpace.base);
+}
+
 // References an address space
 void MmMulRefSpace (MmSpace_t* space)
 {
@@ -212,11 +258,190 @@ static inline void MmMulFlushAddr (MmSpace_t* space, uintptr_t addr)
 {
     if (space == MmGetCurrentSpace() || space == MmGetKernelSpace())
         MmMulFlush (addr);
+    MmTlbShootdown (space, addr, addr + NEXKE_CPU_PAGESZ, false);
+}
+
+// Invalidates TLB entries gathered in gather
+void MmMulFlushGather (MmTlbGather_t* gather)
+{
+    MmSpace_t* space = gather->space;
+    if (space != MmGetCurrentSpace() && space != MmGetKernelSpace())
+        return;
+    // Past the ceiling it's cheaper to flush everything than to invlpg each page
+    if (gather->flushAll || gather->count > MM_GATHER_FLUSH_MAX)
+        MmMulFlushTlb();
+    else
+    {
+        for (int i = 0; i < gather->count; ++i)
+            MmMulFlush (gather->entries[i].addr);
+    }
+}
+
+// Adds a mapping to page's mapping list
+static void mulAddMapping (MmSpace_t* space, uintptr_t virt, MmPage_t* page, paddr_t table)
+{
+    if (!(page->flags & MM_PAGE_FIXED) && !(page->flags & MM_PAGE_UNUSABLE))
+        MmAddPageMap (page, space, virt, table);
+    // Update stats
+    ++space->stats.numMaps;
+}
+
+// Gets page directory of address, allocating it if it doesn't exist
+static paddr_t mulGetDir (MmSpace_t* space, uintptr_t virt)
+{
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (space->mulSpace.base, 3);
+    pdpte_t* pdpt = (pdpte_t*) cacheEnt->addr;
+    paddr_t pdir = 0;
+    if (!(pdpt[PG_ADDR_PDPT (virt)] & PF_P))
+        pdir = mulAllocDir (space, &pdpt[PG_ADDR_PDPT (virt)]);
+    else
+        pdir = pdpt[PG_ADDR_PDPT (virt)] & PT_FRAME;
+    MmPtabReturnCache (cacheEnt);
+    return pdir;
+}
+
+// Converts small page flags into large page flags
+static inline pte_t mulToLargeFlags (pte_t flags)
+{
+    // PAT bit moves when PS is set
+    if (flags & PF_WC)
+    {
+        flags &= ~(PF_WC);
+        flags |= PF_PSWC;
+    }
+    return flags | PF_PS;
+}
+
+// Converts large page flags into small page flags
+static inline pte_t mulFromLargeFlags (pte_t flags)
+{
+    flags &= ~(PF_PS);
+    if (flags & PF_PSWC)
+    {
+        flags &= ~(PF_PSWC);
+        flags |= PF_WC;
+    }
+    return flags;
+}
+
+// Splits large page mapped by ent into a page table
+paddr_t MmMulSplitLarge (MmSpace_t* space, uintptr_t addr, pte_t* ent)
+{
+    // Unlock for below
+    MM_MUL_UNLOCK (space);
+    MmPage_t* pg = MmAllocFixedPage();
+    if (!pg)
+        NkPanicOom();
+    paddr_t tab = MmGetPagePhys (pg);
+    MM_MUL_LOCK (space);
+    // Check if this was split while we were unlocked
+    if (*ent && !PT_ISLARGE (*ent))
+    {
+        MmLockPage (pg);
+        MmUnfixPage (pg);
+        MmUnlockPage (pg);
+        MmFreePage (pg);
+        return *ent & PT_FRAME;
+    }
+    // Fill in the new table with the translations of the large page
+    pte_t large = *ent;
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (tab, MM_PTAB_UNCACHED);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    if (large)
+    {
+        pte_t flags = mulFromLargeFlags (large & ~(PT_LARGEFRAME));
+        paddr_t frame = large & PT_LARGEFRAME;
+        for (int i = 0; i < MUL_LARGE_PAGES; ++i)
+            table[i] = flags | (frame + (i * NEXKE_CPU_PAGESZ));
+    }
+    else
+        memset (table, 0, NEXKE_CPU_PAGESZ);
+    MmPtabFreeToCache (cacheEnt);
+    // Add to page list
+    NkListAddFront (&space->mulSpace.pageList, &pg->link);
+    // Table permissions have to be as loose as the pages in it
+    pte_t flags = PF_P | PF_RW;
+    if (large & PF_US)
+        flags |= PF_US;
+    *ent = tab | flags;
+    // Get rid of the large TLB entry
+    MmMulFlushAddr (space, addr & ~(MUL_LARGE_PAGESZ - 1));
+    return tab;
+}
+
+// Gets the PDE in dir of the large page mapping addr
+// Returns NULL if addr isn't mapped by a large page
+static pte_t* mulGetLarge (MmSpace_t* space,
+                           paddr_t dir,
+                           uintptr_t addr,
+                           MmPtCacheEnt_t** cacheEnt)
+{
+    *cacheEnt = MmPtabLookup (space, dir, addr, MUL_LARGE_LEVEL);
+    if (!*cacheEnt)
+        return NULL;
+    pte_t* table = (pte_t*) (*cacheEnt)->addr;
+    pte_t* pde = &table[MUL_IDX_LEVEL (addr, MUL_LARGE_LEVEL)];
+    if (PT_ISLARGE (*pde))
+        return pde;
+    MmPtabReturnCache (*cacheEnt);
+    return NULL;
+}
+
+// Drops cached tables in iterator after the caller skipped over a large page
+static void mulResetIter (MmPtIter_t* iter)
+{
+    MmPtabEndIterate (iter);
+    memset (iter->ptIters, 0, sizeof (iter->ptIters));
+}
+
+// Maps a large page into address space
+// Returns false if a large page can't be used here
+static bool mulMapLarge (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
+{
+    paddr_t phys = MmGetPagePhys (page);
+    // Only fixed pages can be mapped large, as they don't track their mappings
+    if (!(page->flags & MM_PAGE_FIXED) || (virt & (MUL_LARGE_PAGESZ - 1)) ||
+        (phys & (MUL_LARGE_PAGESZ - 1)))
+        return false;
+    pte_t pgFlags = mulToLargeFlags (mmMulGetProt (perm)) | PF_F;
+    if (CpuHasFeature (CPU_FEATURE_PGE) && MmMulIsKernel (virt))
+        pgFlags |= PF_G;
+    pte_t newPde = pgFlags | phys;
+    MM_MUL_LOCK (space);
+    paddr_t pdir = mulGetDir (space, virt);
+    MmPtCacheEnt_t* cacheEnt = MmPtabWalkAndMapLevel (space, pdir, virt, newPde, MUL_LARGE_LEVEL);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    pte_t* pde = &table[MUL_IDX_LEVEL (virt, MUL_LARGE_LEVEL)];
+    // If a page table is already here, leave it be and let the caller use small pages
+    if (*pde && !PT_ISLARGE (*pde))
+    {
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (space);
+        return false;
+    }
+    if (*pde & PF_F)
+        NkPanic ("nexke: attempt to unmap fixed mapping");
+    *pde = newPde;
+    MmMulFlushAddr (space, virt);
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (space);
+    // Update stats
+    space->stats.numFixed += MUL_LARGE_PAGES;
+    space->stats.numMaps += MUL_LARGE_PAGES;
+    return true;
 }
 
 // Maps page into address space
 void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
 {
+    if (perm & MUL_PAGE_LARGE)
+    {
+        if (mulMapLarge (space, virt, page, perm))
+            return;
+        // Fall back to small pages
+        MmMulMapContig (space, virt, page, MUL_LARGE_PAGES, perm & ~(MUL_PAGE_LARGE));
+        return;
+    }
     MM_MUL_LOCK (space);
     MmMulSpace_t* mulSpace = &space->mulSpace;
     // Translate flags
@@ -225,24 +450,12 @@ void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
     if (page->flags & MM_PAGE_FIXED)
         pgFlags |= PF_F;
     // If this is a kernel page and global pages exist, make it global
-    if (CpuGetFeatures() & CPU_FEATURE_PGE && MmMulIsKernel (virt))
+    if (CpuHasFeature (CPU_FEATURE_PGE) && MmMulIsKernel (virt))
         pgFlags |= PF_G;
-    pte_t newPte = pgFlags | (page->pfn * NEXKE_CPU_PAGESZ);
+    pte_t newPte = pgFlags | (MmGetPagePhys (page));
     // Check if we need a new page directory
-    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (mulSpace->base, 3);
-    pdpte_t* pdpt = (pdpte_t*) cacheEnt->addr;
-    paddr_t pdir = 0;
-    if (!(pdpt[PG_ADDR_PDPT (virt)] & PF_P))
-    {
-        // We need to allocate a page directory
-        pdir = mulAllocDir (space, &pdpt[PG_ADDR_PDPT (virt)]);
-    }
-    else
-    {
-        pdir = pdpt[PG_ADDR_PDPT (virt)] & PT_FRAME;
-    }
-    MmPtabReturnCache (cacheEnt);
-    cacheEnt = MmPtabWalkAndMap (space, pdir, virt, newPte);
+    paddr_t pdir = mulGetDir (space, virt);
+    MmPtCacheEnt_t* cacheEnt = MmPtabWalkAndMap (space, pdir, virt, newPte);
     // Get table and PTE
     pte_t* table = (pte_t*) cacheEnt->addr;
     pte_t* pte = &table[MUL_IDX_LEVEL (virt, 1)];
@@ -284,6 +497,7 @@ void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
         *pte = newPte;
     }
     // Return it
+    paddr_t tabPhys = cacheEnt->ptab;
     MmPtabReturnCache (cacheEnt);
     // Flush it
     MmMulFlushAddr (space, virt);
@@ -291,49 +505,95 @@ void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
     // Check if we have a mapping to remove
     if (oldPage)
     {
-        // Find this mapping
-        NkSpinLock (&oldPage->lock);
-        MmPageMap_t* map = oldPage->maps;
-        MmPageMap_t* prev = NULL;
-        while (map)
+        MmLockPage (oldPage);
+        if (MmRemovePageMap (oldPage, space, virt))
+            --space->stats.numMaps;
+        MmUnlockPage (oldPage);
+    }
+    mulAddMapping (space, virt, page, tabPhys);
+}
+
+// Maps count pages starting at virt, walking to each page table only once
+// Page i is pages[i], or contig[i] if pages is NULL
+static void mulMapRange (MmSpace_t* space,
+                         uintptr_t virt,
+                         MmPage_t** pages,
+                         MmPage_t* contig,
+                         size_t count,
+                         int perm)
+{
+    // Translate flags
+    pte_t pgFlags = mmMulGetProt (perm);
+    // If this is a kernel page and global pages exist, make it global
+    if (CpuHasFeature (CPU_FEATURE_PGE) && MmMulIsKernel (virt))
+        pgFlags |= PF_G;
+    size_t i = 0;
+    while (i < count)
+    {
+        MM_MUL_LOCK (space);
+        uintptr_t cur = virt + (i * NEXKE_CPU_PAGESZ);
+        uintptr_t addr = cur;
+        MmPtCacheEnt_t* cacheEnt = MmPtabWalkAndMap (space, mulGetDir (space, cur), addr, pgFlags);
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        // Fill in PTEs until the end of this table, or until one that is already mapped
+        size_t first = i;
+        bool mapped = false;
+        do
         {
-            if (map->addr == virt && map->space == space)
+            MmPage_t* page = (pages) ? pages[i] : &contig[i];
+            pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+            if (*pte)
             {
-                // Remove it and break
-                --space->stats.numMaps;
-                if (prev)
-                    prev->next = map->next;
-                else
-                    oldPage->maps = map->next;
+                mapped = true;
                 break;
             }
-            prev = map;
-            map = map->next;
+            pte_t newPte = pgFlags | (MmGetPagePhys (page));
+            if (page->flags & MM_PAGE_FIXED)
+            {
+                newPte |= PF_F;
+                ++space->stats.numFixed;
+            }
+            *pte = newPte;
+            ++i;
+            addr += NEXKE_CPU_PAGESZ;
+        } while (i < count && MUL_IDX_LEVEL (addr, 1));
+        paddr_t tabPhys = cacheEnt->ptab;
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (space);
+        for (size_t j = first; j < i; ++j)
+        {
+            MmPage_t* page = (pages) ? pages[j] : &contig[j];
+            mulAddMapping (space, virt + (j * NEXKE_CPU_PAGESZ), page, tabPhys);
+        }
+        // Replacing a mapping is left to MmMulMapPage
+        if (mapped)
+        {
+            MmPage_t* page = (pages) ? pages[i] : &contig[i];
+            MmMulMapPage (space, virt + (i * NEXKE_CPU_PAGESZ), page, perm);
+            ++i;
         }
-        NkSpinUnlock (&oldPage->lock);
-    }
-    if (!(page->flags & MM_PAGE_FIXED) && !(page->flags & MM_PAGE_UNUSABLE))
-    {
-        // Add this mapping
-        MmPageMap_t* map = (MmPageMap_t*) MmCacheAlloc (mulMapCache);
-        if (!map)
-            NkPanicOom();
-        map->addr = virt;
-        map->space = space;
-        map->next = NULL;
-        // Link it
-        NkSpinLock (&page->lock);
-        map->next = page->maps;
-        page->maps = map;
-        NkSpinUnlock (&page->lock);
     }
-    // Update stats
-    ++space->stats.numMaps;
+}
+
+// Maps an array of pages into address space
+void MmMulMapRange (MmSpace_t* space, uintptr_t virt, MmPage_t** pages, size_t count, int perm)
+{
+    mulMapRange (space, virt, pages, NULL, count, perm);
+}
+
+// Maps physically contigous pages into address space
+void MmMulMapContig (MmSpace_t* space, uintptr_t virt, MmPage_t* pages, size_t count, int perm)
+{
+    mulMapRange (space, virt, NULL, pages, count, perm);
 }
 
 // Unmaps range of address space from a page directory
-static inline void mmMulUnmapPdir (MmSpace_t* space, paddr_t dir, uintptr_t base, size_t count)
+static inline void mmMulUnmapPdir (MmTlbGather_t* gather,
+                                   paddr_t dir,
+                                   uintptr_t base,
+                                   size_t count)
 {
+    MmSpace_t* space = gather->space;
     // Set up iterator
     MmPtIter_t iter = {0};
     iter.addr = base;
@@ -342,6 +602,27 @@ static inline void mmMulUnmapPdir (MmSpace_t* space, paddr_t dir, uintptr_t base
     for (int i = 0; i < count; ++i)
     {
         uintptr_t addr = iter.addr;
+        // Remove large pages in one go if the range covers all of it
+        // Otherwise the iterator splits it for us
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (count - i) >= MUL_LARGE_PAGES)
+        {
+            MmPtCacheEnt_t* largeEnt = NULL;
+            pte_t* pde = mulGetLarge (space, dir, addr, &largeEnt);
+            if (pde)
+            {
+                // Make sure PDE isn't fixed
+                if (*pde & PF_F)
+                    NkPanic ("nexke: can't remove fixed mapping");
+                *pde = 0;
+                MmPtabGather (gather, addr, MUL_LARGE_PAGESZ, NULL);
+                MmPtabReturnCache (largeEnt);
+                space->stats.numMaps -= MUL_LARGE_PAGES;
+                mulResetIter (&iter);
+                iter.addr += MUL_LARGE_PAGESZ;
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
         // Get cache entry for table containing PTE
         MmPtCacheEnt_t* cacheEnt = MmPtabIterate (&iter);
         // If there is no cache entry, move to next address
@@ -358,46 +639,23 @@ static inline void mmMulUnmapPdir (MmSpace_t* space, paddr_t dir, uintptr_t base
                 // Get page of PTE
                 MmPage_t* page = MmFindPagePfn ((*pte & PT_FRAME) >> NEXKE_CPU_PAGE_SHIFT);
                 *pte = 0;
-                MmMulFlushAddr (space, addr);
-                // Now remove mapping, first we need to unlock the address space
-                // as we can't lock the page while holding the address space lock
-                // as that would violate lock ordering
-                // I don't think this will cause any problems, but I could be wrong
-                MM_MUL_UNLOCK (space);
-                NkSpinLock (&page->lock);
-                // Find the mapping
-                MmPageMap_t* map = page->maps;
-                MmPageMap_t* prev = NULL;
-                while (map)
-                {
-                    if (map->addr == addr && map->space == space)
-                    {
-                        // Remove it and break
-                        --space->stats.numMaps;
-                        if (prev)
-                            prev->next = map->next;
-                        else
-                            page->maps = map->next;
-                        break;
-                    }
-                    prev = map;
-                    map = map->next;
-                }
-                NkSpinUnlock (&page->lock);
-                MM_MUL_LOCK (space);
+                // The mapping is removed once the TLB has been flushed
+                MmPtabGather (gather, addr, NEXKE_CPU_PAGESZ, page);
             }
         }
     }
     MmPtabEndIterate (&iter);
+    MmPtabReclaim (gather, dir, base, base, count);
 }
 
 // Protects a range in page directory
-static inline void mmMulProtectPdir (MmSpace_t* space,
+static inline void mmMulProtectPdir (MmTlbGather_t* gather,
                                      paddr_t dir,
                                      uintptr_t base,
                                      size_t count,
                                      int perm)
 {
+    MmSpace_t* space = gather->space;
     // Get right flags
     pte_t flags = mmMulGetProt (perm);
     // Set up iterator
@@ -408,6 +666,22 @@ static inline void mmMulProtectPdir (MmSpace_t* space,
     for (int i = 0; i < count; ++i)
     {
         uintptr_t addr = iter.addr;
+        // Change large pages in one go if the range covers all of it
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (count - i) >= MUL_LARGE_PAGES)
+        {
+            MmPtCacheEnt_t* largeEnt = NULL;
+            pte_t* pde = mulGetLarge (space, dir, addr, &largeEnt);
+            if (pde)
+            {
+                *pde = (*pde & PT_LARGEFRAME) | mulToLargeFlags (flags) | (*pde & (PF_F | PF_G));
+                MmPtabGather (gather, addr, MUL_LARGE_PAGESZ, NULL);
+                MmPtabReturnCache (largeEnt);
+                mulResetIter (&iter);
+                iter.addr += MUL_LARGE_PAGESZ;
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
         // Get cache entry for table containing PTE
         MmPtCacheEnt_t* cacheEnt = MmPtabIterate (&iter);
         // If there is no cache entry, move to next address
@@ -419,8 +693,8 @@ static inline void mmMulProtectPdir (MmSpace_t* space,
             // Set protection if PTE is valid
             if (*pte & PF_P)
             {
-                *pte = (*pte & PT_FRAME) | flags | (*pte & PF_F);
-                MmMulFlushAddr (space, addr);
+                *pte = (*pte & PT_FRAME) | flags | (*pte & (PF_F | PF_G));
+                MmPtabGather (gather, addr, NEXKE_CPU_PAGESZ, NULL);
             }
         }
     }
@@ -431,6 +705,8 @@ static inline void mmMulProtectPdir (MmSpace_t* space,
 void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
 {
     MM_MUL_LOCK (space);
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
     // Get PDPT
     MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (space->mulSpace.base, 3);
     pdpte_t* pdpt = (pdpte_t*) cacheEnt->addr;
@@ -453,10 +729,11 @@ void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
         else
             top = maxTop;
         // Unmap this range
-        mmMulUnmapPdir (space, pdirAddr, cur, CpuPageAlignUp (top - cur) / NEXKE_CPU_PAGESZ);
+        mmMulUnmapPdir (&gather, pdirAddr, cur, CpuPageAlignUp (top - cur) / NEXKE_CPU_PAGESZ);
         // To next part
         cur = top;
     }
+    MmPtabFlushGather (&gather);
     MmPtabReturnCache (cacheEnt);
     MM_MUL_UNLOCK (space);
 }
@@ -465,6 +742,8 @@ void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
 void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm)
 {
     MM_MUL_LOCK (space);
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
     // Get PDPT
     MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (space->mulSpace.base, 3);
     pdpte_t* pdpt = (pdpte_t*) cacheEnt->addr;
@@ -487,7 +766,7 @@ void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm
         else
             top = maxTop;
         // Unmap this range
-        mmMulProtectPdir (space,
+        mmMulProtectPdir (&gather,
                           pdirAddr,
                           cur,
                           CpuPageAlignUp (top - cur) / NEXKE_CPU_PAGESZ,
@@ -495,6 +774,7 @@ void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm
         // To next part
         cur = top;
     }
+    MmPtabFlushGather (&gather);
     MmPtabReturnCache (cacheEnt);
     MM_MUL_UNLOCK (space);
 }
@@ -508,37 +788,28 @@ void MmMulUnmapPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
-        // Get page directory
-        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (mulSpace->base, 3);
-        pdpte_t* pdpt = (pdpte_t*) cacheEnt->addr;
-        paddr_t pdir = 0;
-        pdir = pdpt[PG_ADDR_PDPT (map->addr)] & PT_FRAME;
-        if (!pdir)
-            goto next;
-        MmPtabReturnCache (cacheEnt);
-        // Get page table
-        cacheEnt = MmPtabWalk (map->space, pdir, map->addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (map->addr, 1)];
         // Make sure it isn't fixed
         if (*pte & PF_F)
             NkPanic ("nexke: can't unmap fixed mapping");
+        // Don't lose track of writes through this mapping
+        if (*pte & PF_D)
+            page->flags |= MM_PAGE_DIRTY;
         // Clear it
         *pte = 0;
         --map->space->stats.numMaps;
         // Flush TLB if needed
         MmMulFlushAddr (map->space, map->addr);
-    next:
         // Return and unlock
         MmPtabReturnCache (cacheEnt);
         MM_MUL_UNLOCK (map->space);
         map = map->next;
     }
-    page->maps = NULL;
+    MmClearPageMaps (page);
 }
 
 // Changes protection on a page
@@ -552,27 +823,15 @@ void MmMulProtectPage (MmPage_t* page, int perm)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
-        // Get page directory
-        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (mulSpace->base, 3);
-        pdpte_t* pdpt = (pdpte_t*) cacheEnt->addr;
-        paddr_t pdir = 0;
-        pdir = pdpt[PG_ADDR_PDPT (map->addr)] & PT_FRAME;
-        if (!pdir)
-            goto next;
-        MmPtabReturnCache (cacheEnt);
-        // Get page table
-        cacheEnt = MmPtabWalk (map->space, pdir, map->addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (map->addr, 1)];
         // Set flags
-        *pte = (*pte & PT_FRAME) | flags | (*pte & PF_F);
+        *pte = (*pte & PT_FRAME) | flags | (*pte & (PF_F | PF_G));
         // Flush TLB if needed
         MmMulFlushAddr (map->space, map->addr);
-    next:
         // Return and unlock
         MmPtabReturnCache (cacheEnt);
         MM_MUL_UNLOCK (map->space);
@@ -590,19 +849,8 @@ void MmMulFixPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
-        // Get page directory
-        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (mulSpace->base, 3);
-        pdpte_t* pdpt = (pdpte_t*) cacheEnt->addr;
-        paddr_t pdir = 0;
-        pdir = pdpt[PG_ADDR_PDPT (map->addr)] & PT_FRAME;
-        if (!pdir)
-            goto next;
-        MmPtabReturnCache (cacheEnt);
-        // Get page table
-        cacheEnt = MmPtabWalk (map->space, pdir, map->addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (map->addr, 1)];
@@ -630,19 +878,8 @@ void MmMulUnfixPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
-        // Get page directory
-        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (mulSpace->base, 3);
-        pdpte_t* pdpt = (pdpte_t*) cacheEnt->addr;
-        paddr_t pdir = 0;
-        pdir = pdpt[PG_ADDR_PDPT (map->addr)] & PT_FRAME;
-        if (!pdir)
-            goto next;
-        MmPtabReturnCache (cacheEnt);
-        // Get page table
-        cacheEnt = MmPtabWalk (map->space, pdir, map->addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (map->addr, 1)];
@@ -673,6 +910,16 @@ MmPage_t* MmMulGetMapping (MmSpace_t* space, uintptr_t virt)
         NkPanic ("nexke: cannot unmap invalid address");
     paddr_t pdirAddr = pdpt[PG_ADDR_PDPT (virt)] & PT_FRAME;
     MmPtabReturnCache (cacheEnt);
+    // Check for a large page first so we don't split it
+    MmPtCacheEnt_t* largeEnt = NULL;
+    pte_t* pde = mulGetLarge (space, pdirAddr, virt, &largeEnt);
+    if (pde)
+    {
+        paddr_t addr = (*pde & PT_LARGEFRAME) + (virt & (MUL_LARGE_PAGESZ - 1));
+        MmPtabReturnCache (largeEnt);
+        MM_MUL_UNLOCK (space);
+        return MmFindPagePfn (addr / NEXKE_CPU_PAGESZ);
+    }
     // Grab PTE
     cacheEnt = MmPtabWalk (space, pdirAddr, virt);
     assert (cacheEnt);
@@ -685,6 +932,60 @@ MmPage_t* MmMulGetMapping (MmSpace_t* space, uintptr_t virt)
     return MmFindPagePfn (addr / NEXKE_CPU_PAGESZ);
 }
 
+// Tests attribute bit in every mapping of page, and sets or clears it if update is set
+// Returns whether any mapping had the bit set
+static bool mulUpdateAttrPage (MmPage_t* page, pte_t bit, bool update, bool val)
+{
+    bool res = false;
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        MM_MUL_LOCK (map->space);
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        pte_t* pte = &table[MUL_IDX_LEVEL (map->addr, 1)];
+        if (*pte & bit)
+        {
+            res = true;
+            if (update && !val)
+            {
+                // The CPU only sets the bit again if it walks the tables, so flush the TLB
+                *pte &= ~(bit);
+                MmMulFlushAddr (map->space, map->addr);
+            }
+        }
+        else if (update && val)
+            *pte |= bit;
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (map->space);
+        // If we're only looking, one set bit is enough
+        if (res && !update)
+            break;
+        map = map->next;
+    }
+    return res;
+}
+
+// Gets bit for attribute
+static inline pte_t mulAttrToPte (int attr)
+{
+    if (attr == MUL_ATTR_ACCESS)
+        return PF_A;
+    return PF_D;
+}
+
+// Gets attributes of page
+bool MmMulGetAttrPage (MmPage_t* page, int attr)
+{
+    return mulUpdateAttrPage (page, mulAttrToPte (attr), false, false);
+}
+
+// Sets attribute to value of page
+bool MmMulSetAttrPage (MmPage_t* page, int attr, bool val)
+{
+    return mulUpdateAttrPage (page, mulAttrToPte (attr), true, val);
+}
+
 // MUL early
 
 static pte_t* mulAllocTabEarly (pde_t* pdir, uintptr_t virt, int flags)
@@ -728,6 +1029,8 @@ void MmMulMapEarly (uintptr_t virt, paddr_t phys, int flags)
         pgFlags |= PF_WT;
     if (flags & MUL_PAGE_DEV)
         pgFlags |= PF_CD;
+    if ((flags & MUL_PAGE_KE) && CpuHasFeature (CPU_FEATURE_PGE))
+        pgFlags |= PF_G;
     // Get indices
     uint32_t pdptIdx = PG_ADDR_PDPT (virt);
     uint32_t dirIdx = PG_ADDR_DIR (virt);
@@ -747,6 +1050,14 @@ void MmMulMapEarly (uintptr_t virt, paddr_t phys, int flags)
         pdir = mulAllocDirEarly (pdpt, virt);
     }
     pde_t* pde = &pdir[dirIdx];
+    if (flags & MUL_PAGE_LARGE)
+    {
+        if (*pde)
+            NkPanic ("nexke: error: cannot map mapped address");
+        *pde = mulToLargeFlags (pgFlags) | phys;
+        MmMulFlush (virt);
+        return;
+    }
     // Check if a table is mapped
     pte_t* pgTab = NULL;
     if (*pde)
@@ -788,6 +1099,9 @@ uintptr_t MmMulGetPhysEarly (uintptr_t virt)
     pte_t* pgTab = NULL;
     if (*pde)
     {
+        // Check for large page
+        if (PT_ISLARGE (*pde))
+            return (*pde & PT_LARGEFRAME) + CpuPageAlignDown (virt & (MUL_LARGE_PAGESZ - 1));
         // Get from PDE
         pgTab = (pte_t*) PT_GETFRAME (*pde);
     }
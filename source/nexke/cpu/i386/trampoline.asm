@@ -0,0 +1,107 @@
+; trampoline.asm - contains AP startup trampoline
+; Copyright 2024 The NexNix Project
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+
+; The trampoline gets copied to a page under 1 MiB, which APs start at in real mode
+; It can end up anywhere, so every address is worked out from CS at run time
+; The data block at the end is filled in by CpuPrepareAp, and must match cpuTrampData_t
+
+section .text
+
+; Offset of symbol in trampoline
+%define TRAMP_OFF(sym) ((sym) - CpuTrampoline)
+
+align 16
+global CpuTrampoline
+CpuTrampoline:
+bits 16
+    cli
+    cld
+    ; Get the physical base of the trampoline
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4
+    ; Fix up the GDT pointer and jump target
+    lea eax, [ebx + TRAMP_OFF (trampGdt)]
+    mov [TRAMP_OFF (trampGdtr) + 2], eax
+    lea eax, [ebx + TRAMP_OFF (trampPm32)]
+    mov [TRAMP_OFF (trampPm32Ptr)], eax
+    ; Enter protected mode
+    o32 lgdt [TRAMP_OFF (trampGdtr)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    o32 jmp far [TRAMP_OFF (trampPm32Ptr)]
+bits 32
+trampPm32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    ; Set CR4 first, as PAE has to be on before paging
+    mov eax, [ebx + TRAMP_OFF (trampCr4)]
+    test eax, eax
+    jz .noCr4
+    mov cr4, eax
+.noCr4:
+    mov eax, [ebx + TRAMP_OFF (trampCr3)]
+    mov cr3, eax
+    ; Set EFER if the BSP uses it, so NX bits in kernel mappings are valid
+    mov eax, [ebx + TRAMP_OFF (trampEfer)]
+    mov edx, [ebx + TRAMP_OFF (trampEfer) + 4]
+    mov ecx, eax
+    or ecx, edx
+    jz .noEfer
+    mov ecx, 0xC0000080
+    wrmsr
+.noEfer:
+    ; Turn on paging
+    mov eax, [ebx + TRAMP_OFF (trampCr0)]
+    mov cr0, eax
+    ; Get onto the stack and into the kernel
+    mov esp, [ebx + TRAMP_OFF (trampStack)]
+    mov eax, [ebx + TRAMP_OFF (trampEntry)]
+    push dword [ebx + TRAMP_OFF (trampCcb)]
+    push 0          ; Entry never returns
+    jmp eax
+
+; Trampoline GDT
+align 8
+trampGdt:
+    dq 0
+    dq 0x00CF9A000000FFFF       ; Code
+    dq 0x00CF92000000FFFF       ; Data
+trampGdtr:
+    dw 23
+    dd 0
+; Far pointer to protected mode
+trampPm32Ptr:
+    dd 0
+    dw 0x08
+
+; Data block
+align 8
+global CpuTrampData
+CpuTrampData:
+trampEfer: dq 0
+trampCr3: dd 0
+trampCr4: dd 0
+trampCr0: dd 0
+trampStack: dd 0
+trampCcb: dd 0
+trampEntry: dd 0
+global CpuTrampolineEnd
+CpuTrampolineEnd:
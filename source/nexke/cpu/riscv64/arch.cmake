@@ -23,4 +23,6 @@ set(NEXKE_LINKER_SCRIPT "${CMAKE_SOURCE_DIR}/cpu/riscv64/link.ld")
 
 list(APPEND NEXKE_SOURCES
     cpu/riscv64/cpudep.c
-    cpu/riscv64/mul.c)
+    cpu/riscv64/mul.c
+    cpu/riscv64/timer.c
+    mm/ptab.c)
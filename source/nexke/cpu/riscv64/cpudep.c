@@ -17,6 +17,9 @@
 
 #include <nexke/cpu.h>
 #include <nexke/nexboot.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/platform/acpi.h>
 #include <string.h>
 
 // Globals
@@ -25,11 +28,66 @@
 // deepest bowels
 static NkCcb_t ccb = {0};    // The CCB
 
+// Extensions we look for in the ISA string
+static const char* cpuFeatures[] = {"sstc", "svpbmt", "svinval", "SBI_TIME"};
+
+// Sets features from an ISA string, as found in the RHCT or device tree
+// Multi-letter extensions come after the single letter ones, each starting with an underscore
+void CpuSetIsaFeatures (NkCcb_t* ccb, const char* isa)
+{
+    const char* ext = strchr (isa, '_');
+    while (ext)
+    {
+        ++ext;
+        const char* end = strchr (ext, '_');
+        size_t len = (end) ? (size_t) (end - ext) : strlen (ext);
+        // The time feature comes from SBI, not the ISA string
+        for (int i = 0; i < CPU_NUM_FEATURES - 1; ++i)
+        {
+            if (strlen (cpuFeatures[i]) == len && !memcmp (ext, cpuFeatures[i], len))
+                ccb->archCcb.features |= (1ULL << i);
+        }
+        ext = end;
+    }
+}
+
 // Prepares CCB data structure. This is the first thing called during boot
 void CpuInitCcb()
 {
     // Grab boot info
     NexNixBoot_t* bootInfo = NkGetBootArgs();
+    // Set up basic fields
+    ccb.self = &ccb;
+    ccb.cpuNum = 0;    // BSP is always CPU 0
+    ccb.cpuArch = NEXKE_CPU_RISCV64;
+    ccb.cpuFamily = NEXKE_CPU_FAMILY_RISCV;
+#ifdef NEXNIX_BOARD_GENERIC
+    ccb.sysBoard = NEXKE_BOARD_GENERIC;
+#else
+#error Unrecognized board
+#endif
+    strcpy (ccb.sysName, bootInfo->sysName);
+    // The RHCT has the ISA string and the frequency of the time CSR
+    // Every hart is assumed to have the same extensions as the first one listed
+    AcpiRhct_t* rhct = (AcpiRhct_t*) PltAcpiFindTableEarly ("RHCT");
+    if (rhct)
+    {
+        ccb.archCcb.timebase = rhct->timebase;
+        AcpiRhctNode_t* node = (void*) rhct + rhct->nodeOff;
+        for (int i = 0; i < rhct->numNodes; ++i)
+        {
+            if (node->type == ACPI_RHCT_ISA)
+            {
+                CpuSetIsaFeatures (&ccb, ((AcpiRhctIsa_t*) node)->isa);
+                break;
+            }
+            node = (void*) node + node->length;
+        }
+    }
+    // Check for the SBI time extension, otherwise we fall back to the legacy timer call
+    CpuSbiRet_t ret = CpuSbiCall (CPU_SBI_EXT_BASE, CPU_SBI_BASE_PROBE, CPU_SBI_EXT_TIME);
+    if (!ret.error && ret.value)
+        ccb.archCcb.features |= CPU_FEATURE_SBI_TIME;
 }
 
 // Returns CCB to caller
@@ -37,3 +95,22 @@ NkCcb_t* CpuGetCcb()
 {
     return &ccb;
 }
+
+// Gets feature flags
+uint64_t CpuGetFeatures()
+{
+    return ccb.archCcb.features;
+}
+
+// Print CPU features
+void CpuPrintFeatures()
+{
+    // Log out supported features
+    NkLogInfo ("nexke: detected CPU features: ");
+    for (int i = 0; i < CPU_NUM_FEATURES; ++i)
+    {
+        if (CpuGetCcb()->archCcb.features & (1ULL << i))
+            NkLogInfo ("%s ", cpuFeatures[i]);
+    }
+    NkLogInfo ("\n");
+}
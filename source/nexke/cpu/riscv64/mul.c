@@ -15,6 +15,1031 @@
     limitations under the License.
 */
 
+#include <assert.h>
 #include <nexke/cpu.h>
 #include <nexke/mm.h>
-#include <nexke/nexke.h>
\ No newline at end of file
+#include <nexke/nexke.h>
+#include <string.h>
+
+// Global representing max page level
+// This comes from the paging mode nexboot put in satp
+static int mulMaxLevel = 0;
+
+// Mask of valid virtual address bits for the paging mode
+static uintptr_t mulVaMask = 0;
+
+// Whether ASIDs are in use
+static bool mulAsid = false;
+
+// Number of user entries in the top table
+#define MUL_MAX_USER_TOP 256
+
+// Reads paging mode out of satp
+static void mulInitMode()
+{
+    uint64_t mode = (CpuReadCsr ("satp") >> MUL_SATP_MODE_SHIFT) & MUL_SATP_MODE_MASK;
+    if (mode < MUL_SATP_MODE_SV39 || mode > MUL_SATP_MODE_SV57)
+        NkPanic ("nexke: invalid MMU setup detected");
+    mulMaxLevel = (mode - MUL_SATP_MODE_SV39) + 3;
+    mulVaMask = (1ULL << idxShiftTab[mulMaxLevel + 1]) - 1;
+}
+
+// Canonicalizing helpers
+static inline uintptr_t mulMakeCanonical (uintptr_t addr)
+{
+    // Check if top bit is set
+    if (addr & ((mulVaMask >> 1) + 1))
+        return addr | ~(mulVaMask);    // Set top bits
+    return addr;                       // Address already is canonical
+}
+
+static inline uintptr_t mulDecanonical (uintptr_t addr)
+{
+    // Clear top bits
+    return addr & mulVaMask;
+}
+
+// Gets top table out of satp
+static inline pte_t* mulReadSatp()
+{
+    return (pte_t*) ((CpuReadCsr ("satp") & MUL_SATP_PPN_MASK) << NEXKE_CPU_PAGE_SHIFT);
+}
+
+// Gets ASID out of satp
+static inline int mulReadAsid()
+{
+    return (CpuReadCsr ("satp") >> MUL_SATP_ASID_SHIFT) & MUL_SATP_ASID_MASK;
+}
+
+// Initializes MUL
+void MmMulInit()
+{
+    NkLogDebug ("nexke: intializing MUL\n");
+    if (!mulMaxLevel)
+        mulInitMode();
+    MmPtabInit (mulMaxLevel);
+    // Grab top table
+    pte_t* top = mulReadSatp();
+    // Allocate cache
+    MmPage_t* cachePgCtrl = MmAllocFixedPage();
+    MmFixPage (cachePgCtrl);
+    paddr_t cachePage = MmGetPagePhys (cachePgCtrl);
+    // Map it
+    MmMulMapEarly (MUL_PTCACHE_ENTRY_BASE, cachePage, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
+    // Map dummy page at base so we have the structure created
+    MmMulMapEarly (MUL_PTCACHE_BASE, 0, MUL_PAGE_R | MUL_PAGE_KE | MUL_PAGE_RW);
+    // Find table for table cache
+    paddr_t cacheTab = 0;
+    uintptr_t cacheBase = mulDecanonical (MUL_PTCACHE_BASE);
+    pte_t* curSt = top;
+    for (int i = mulMaxLevel; i > 2; --i)
+    {
+        curSt = (pte_t*) PT_GETFRAME (curSt[MUL_IDX_LEVEL (cacheBase, i)]);
+        assert (curSt);
+    }
+    cacheTab = PT_GETFRAME (curSt[MUL_IDX_LEVEL (cacheBase, 2)]);
+#define MUL_PTCACHE_TOP_STAGE 0xFFFFFFFF7FFDC000
+    MmMulMapEarly (MUL_PTCACHE_TOP_STAGE, (paddr_t) top, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
+    MmMulMapEarly (MUL_PTCACHE_TABLE_BASE, cacheTab, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
+    memset ((void*) MUL_PTCACHE_TOP_STAGE, 0, (MUL_MAX_USER_TOP * sizeof (pte_t)));
+    // Flush out TLB
+    MmMulFlushTlb();
+    // Setup MUL
+    MmMulSpace_t* mulSpace = &MmGetKernelSpace()->mulSpace;
+    memset (mulSpace, 0, sizeof (MmMulSpace_t));
+    mulSpace->base = (paddr_t) top;
+    mulSpace->refCount = 1;
+    NkListInit (&mulSpace->pageList);
+    NkListAddFront (&mulSpace->pageList, &cachePgCtrl->link);
+    // Prepare page table cache
+    MmPtabInitCache (MmGetKernelSpace());
+    // Find out how many ASID bits there are, as only the implemented ones stick when written
+    uint64_t satp = CpuReadCsr ("satp");
+    CpuWriteCsr ("satp", satp | (MUL_SATP_ASID_MASK << MUL_SATP_ASID_SHIFT));
+    uint64_t asidMask = (CpuReadCsr ("satp") >> MUL_SATP_ASID_SHIFT) & MUL_SATP_ASID_MASK;
+    CpuWriteCsr ("satp", satp);
+    MmMulFlushTlb();
+    int asidBits = 0;
+    while (asidMask & (1ULL << asidBits))
+        ++asidBits;
+    CpuGetCcb()->archCcb.asidBits = asidBits;
+    CpuGetCcb()->archCcb.vaBits = idxShiftTab[mulMaxLevel + 1];
+    // Hand out ASIDs to address spaces if the CPU implements any
+    // Kernel mappings are global, so they live through ASID switches
+    if (asidBits)
+    {
+        MmPtabInitTags ((1 << asidBits) - 1);
+        mulAsid = true;
+    }
+    // Map physical memory so we can stop going through the PT cache
+    MmPtabInitDirect();
+}
+
+// Invalidates TLB entries of address in every ASID
+void MmMulFlush (uintptr_t vaddr)
+{
+    asm volatile ("sfence.vma %0, zero" : : "r"(vaddr) : "memory");
+}
+
+// Flushes whole TLB
+void MmMulFlushTlb()
+{
+    asm volatile ("sfence.vma" : : : "memory");
+}
+
+// Flushes all entries of ASID
+// Global entries are left alone
+void MmMulFlushAsid (int asid)
+{
+    asm volatile ("sfence.vma zero, %0" : : "r"(asid) : "memory");
+}
+
+// Switches CPU to address space
+void MmMulSwitchSpace (MmSpace_t* space)
+{
+    int asid = 0;
+    bool trusted = MmPtabGetTag (space, &asid);
+    uint64_t satp = CpuReadCsr ("satp") & (MUL_SATP_MODE_MASK << MUL_SATP_MODE_SHIFT);
+    satp |= (uint64_t) asid << MUL_SATP_ASID_SHIFT;
+    satp |= space->mulSpace.base >> NEXKE_CPU_PAGE_SHIFT;
+    CpuWriteCsr ("satp", satp);
+    // Get rid of out of date entries
+    // Without ASIDs every space shares ASID 0, so its entries are never good
+    if (!trusted || !mulAsid)
+        MmMulFlushAsid (asid);
+}
+
+// Allocates page table into ent
+paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t* ent)
+{
+    // Unlock for below
+    MM_MUL_UNLOCK (space);
+    // Allocate the table
+    MmPage_t* pg = MmAllocPtPage();
+    MmFixPage (pg);
+    paddr_t tab = MmGetPagePhys (pg);
+    MM_MUL_LOCK (space);
+    // Check if a table was mapped while we were unlocked
+    if (*ent)
+    {
+        tab = PT_GETFRAME (*ent);
+        // Ours is still empty, so keep it for the next table
+        MmUnfixPage (pg);
+        MmFreePtPage (pg);
+    }
+    else
+    {
+        // Add to page list
+        NkListAddFront (&space->mulSpace.pageList, &pg->link);
+        // Map it
+        // Tables have no permissions of their own, the leaf decides everything
+        *ent = PT_MKFRAME (tab) | PF_V;
+    }
+    return tab;
+}
+
+// Verifies mappability of pte2 into pte1
+// No-op on riscv64, as tables have no user bit to check
+void MmMulVerify (pte_t pte1, pte_t pte2)
+{
+}
+
+// Creates an MUL address space
+void MmMulCreateSpace (MmSpace_t* space)
+{
+}
+
+// References an address space
+void MmMulRefSpace (MmSpace_t* space)
+{
+    MM_MUL_LOCK (space);
+    MmMulSpace_t* mulSpace = &space->mulSpace;
+    ++mulSpace->refCount;
+    MM_MUL_UNLOCK (space);
+}
+
+// Destroys an MUL address space
+void MmMulDeRefSpace (MmSpace_t* space)
+{
+    if (space == MmGetKernelSpace())
+        NkPanic ("nexke: can't destroy kernel space");
+    MM_MUL_LOCK (space);
+    MmMulSpace_t* mulSpace = &space->mulSpace;
+    if (--mulSpace->refCount == 0)
+    {
+    }
+    else
+        MM_MUL_UNLOCK (space);
+}
+
+// Translates a set of flags
+static inline pte_t mmMulGetProt (int perm)
+{
+    // Translate flags
+    pte_t pgFlags = PF_V | PF_R | PF_U;
+    // We don't rely on the CPU managing the dirty bit, so writable pages start out dirty
+    if (perm & MUL_PAGE_RW)
+        pgFlags |= PF_W | PF_D;
+    if (perm & MUL_PAGE_X)
+        pgFlags |= PF_X;
+    // Kernel mappings are the same in every space, so they don't need to be tagged with an ASID
+    if (perm & MUL_PAGE_KE)
+    {
+        pgFlags &= ~(PF_U);
+        pgFlags |= PF_G;
+    }
+    // Without Svpbmt everything is cacheable, and devices rely on the platform's PMAs
+    if (CpuGetFeatures() & CPU_FEATURE_SVPBMT)
+    {
+        if (perm & MUL_PAGE_DEV)
+            pgFlags |= PF_PBMT_IO;
+        else if (perm & (MUL_PAGE_CD | MUL_PAGE_WT | MUL_PAGE_WC))
+            pgFlags |= PF_PBMT_NC;
+    }
+    return pgFlags;
+}
+
+// Invalidates TLB
+static inline void MmMulFlushAddr (MmSpace_t* space, uintptr_t addr)
+{
+    if (space == MmGetCurrentSpace() || space == MmGetKernelSpace())
+        MmMulFlush (addr);
+    // The space's entries stay around in its ASID, so make sure they get flushed before the space
+    // runs again
+    else if (mulAsid)
+        MmPtabStaleTag (space);
+    MmTlbShootdown (space, addr, addr + NEXKE_CPU_PAGESZ, false);
+}
+
+// Invalidates gathered pages with Svinval
+// The invalidations are only ordered against the table writes at the start and end, so they
+// can be done back to back instead of each one waiting like sfence.vma does
+static void mulFlushInval (MmTlbGather_t* gather, uint64_t asid)
+{
+    asm volatile (".insn r 0x73, 0, 0x0C, x0, x0, x0" : : : "memory");    // sfence.w.inval
+    for (int i = 0; i < gather->count; ++i)
+    {
+        // sinval.vma
+        asm volatile (".insn r 0x73, 0, 0x0B, x0, %0, %1"
+                      :
+                      : "r"(gather->entries[i].addr), "r"(asid)
+                      : "memory");
+    }
+    asm volatile (".insn r 0x73, 0, 0x0C, x0, x0, x1" : : : "memory");    // sfence.inval.ir
+}
+
+// Invalidates TLB entries gathered in gather
+void MmMulFlushGather (MmTlbGather_t* gather)
+{
+    MmSpace_t* space = gather->space;
+    if (space != MmGetCurrentSpace() && space != MmGetKernelSpace())
+    {
+        if (mulAsid)
+            MmPtabStaleTag (space);
+        return;
+    }
+    bool kernel = space == MmGetKernelSpace();
+    // Past the ceiling it's cheaper to flush everything than to flush each page
+    if (gather->flushAll || gather->count > MM_GATHER_FLUSH_MAX)
+    {
+        // Kernel mappings are global, so they need a full flush
+        // User mappings are all in the current ASID
+        if (kernel)
+            MmMulFlushTlb();
+        else
+            MmMulFlushAsid (mulReadAsid());
+    }
+    else if (kernel)
+    {
+        for (int i = 0; i < gather->count; ++i)
+            MmMulFlush (gather->entries[i].addr);
+    }
+    // User mappings only need to go from the current ASID, leaving other spaces and the kernel's
+    // global entries alone
+    else if (CpuGetFeatures() & CPU_FEATURE_SVINVAL)
+        mulFlushInval (gather, mulReadAsid());
+    else
+    {
+        uint64_t asid = mulReadAsid();
+        for (int i = 0; i < gather->count; ++i)
+        {
+            asm volatile ("sfence.vma %0, %1"
+                          :
+                          : "r"(gather->entries[i].addr), "r"(asid)
+                          : "memory");
+        }
+    }
+}
+
+// Converts small page flags into mega-page flags
+// Mega-pages only hold fixed memory, so they're never aged and start out accessed
+static inline pte_t mulToLargeFlags (pte_t flags)
+{
+    return flags | PF_A;
+}
+
+// Splits mega-page mapped by ent into a page table
+paddr_t MmMulSplitLarge (MmSpace_t* space, uintptr_t addr, pte_t* ent)
+{
+    // Unlock for below
+    MM_MUL_UNLOCK (space);
+    MmPage_t* pg = MmAllocFixedPage();
+    if (!pg)
+        NkPanicOom();
+    paddr_t tab = MmGetPagePhys (pg);
+    MM_MUL_LOCK (space);
+    // Check if this was split while we were unlocked
+    if (*ent && !PT_ISLARGE (*ent))
+    {
+        MmLockPage (pg);
+        MmUnfixPage (pg);
+        MmUnlockPage (pg);
+        MmFreePage (pg);
+        return PT_GETFRAME (*ent);
+    }
+    // Fill in the new table with the translations of the mega-page
+    // Leaves look the same at every level, so the flags carry over as they are
+    pte_t large = *ent;
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (tab, MM_PTAB_UNCACHED);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    if (large)
+    {
+        pte_t flags = large & ~(PT_PPN);
+        paddr_t frame = PT_GETFRAME (large);
+        for (int i = 0; i < MUL_LARGE_PAGES; ++i)
+            table[i] = flags | PT_MKFRAME (frame + (i * NEXKE_CPU_PAGESZ));
+    }
+    else
+        memset (table, 0, NEXKE_CPU_PAGESZ);
+    MmPtabFreeToCache (cacheEnt);
+    // Add to page list
+    NkListAddFront (&space->mulSpace.pageList, &pg->link);
+    *ent = PT_MKFRAME (tab) | PF_V;
+    // Get rid of the mega-page's TLB entry
+    MmMulFlushAddr (space, mulMakeCanonical (addr & ~(MUL_LARGE_PAGESZ - 1)));
+    return tab;
+}
+
+// Gets the entry of the mega-page mapping addr
+// Returns NULL if addr isn't mapped by a mega-page
+static pte_t* mulGetLarge (MmSpace_t* space, uintptr_t addr, MmPtCacheEnt_t** cacheEnt)
+{
+    *cacheEnt = MmPtabLookup (space, space->mulSpace.base, addr, MUL_LARGE_LEVEL);
+    if (!*cacheEnt)
+        return NULL;
+    pte_t* table = (pte_t*) (*cacheEnt)->addr;
+    pte_t* ent = &table[MUL_IDX_LEVEL (addr, MUL_LARGE_LEVEL)];
+    if (PT_ISLARGE (*ent))
+        return ent;
+    MmPtabReturnCache (*cacheEnt);
+    return NULL;
+}
+
+// Drops cached tables in iterator after the caller skipped over a mega-page
+static void mulResetIter (MmPtIter_t* iter)
+{
+    MmPtabEndIterate (iter);
+    memset (iter->ptIters, 0, sizeof (iter->ptIters));
+}
+
+// Maps a mega-page into address space
+// Returns false if a mega-page can't be used here
+static bool mulMapLarge (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
+{
+    paddr_t phys = MmGetPagePhys (page);
+    // Only fixed, huge and unusable pages can be mapped large, as they don't track their mappings
+    if (!(page->flags & (MM_PAGE_FIXED | MM_PAGE_HUGE | MM_PAGE_UNUSABLE)) ||
+        (virt & (MUL_LARGE_PAGESZ - 1)) || (phys & (MUL_LARGE_PAGESZ - 1)))
+        return false;
+    pte_t newEnt = mulToLargeFlags (mmMulGetProt (perm)) | PT_MKFRAME (phys);
+    if (page->flags & MM_PAGE_FIXED)
+        newEnt |= PF_F;
+    MM_MUL_LOCK (space);
+    virt = mulDecanonical (virt);
+    MmPtCacheEnt_t* cacheEnt =
+        MmPtabWalkAndMapLevel (space, space->mulSpace.base, virt, newEnt, MUL_LARGE_LEVEL);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    pte_t* ent = &table[MUL_IDX_LEVEL (virt, MUL_LARGE_LEVEL)];
+    // If a page table with something in it is already here, leave it be and let the caller use
+    // small pages. An empty one stays on the space's page list until the space goes away
+    if (*ent && !PT_ISLARGE (*ent) && !MmPtabIsEmpty (PT_GETFRAME (*ent)))
+    {
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (space);
+        return false;
+    }
+    if (*ent & PF_F)
+        NkPanic ("nexke: attempt to unmap fixed mapping");
+    bool replaced = PT_ISLARGE (*ent);
+    *ent = newEnt;
+    MmMulFlushAddr (space, mulMakeCanonical (virt));
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (space);
+    // Update stats
+    if (newEnt & PF_F)
+        space->stats.numFixed += MUL_LARGE_PAGES;
+    if (!replaced)
+        space->stats.numMaps += MUL_LARGE_PAGES;
+    return true;
+}
+
+// Adds a mapping to page's mapping list
+static void mulAddMapping (MmSpace_t* space, uintptr_t virt, MmPage_t* page, paddr_t table)
+{
+    if (!(page->flags & MM_PAGE_FIXED) && !(page->flags & MM_PAGE_UNUSABLE))
+        MmAddPageMap (page, space, virt, table);
+    // Update stats
+    ++space->stats.numMaps;
+}
+
+// Maps the mega-page starting at page into address space, without falling back to small pages
+bool MmMulMapLarge (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
+{
+    return mulMapLarge (space, virt, page, perm);
+}
+
+// Maps page into address space
+void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
+{
+    if (perm & MUL_PAGE_LARGE)
+    {
+        if (mulMapLarge (space, virt, page, perm))
+            return;
+        // Fall back to small pages
+        MmMulMapContig (space, virt, page, MUL_LARGE_PAGES, perm & ~(MUL_PAGE_LARGE));
+        return;
+    }
+    MM_MUL_LOCK (space);
+    MmMulSpace_t* mulSpace = &space->mulSpace;
+    // Translate flags
+    pte_t pgFlags = mmMulGetProt (perm);
+    // Set fixed flag if needed
+    if (page->flags & MM_PAGE_FIXED)
+        pgFlags |= PF_F;
+    // Create PTE
+    pte_t newPte = pgFlags | PT_MKFRAME (MmGetPagePhys (page));
+    // Grab page table of last entry
+    uintptr_t canonVirt = virt;
+    virt = mulDecanonical (virt);
+    MmPtCacheEnt_t* cacheEnt = MmPtabWalkAndMap (space, mulSpace->base, virt, newPte);
+    // Get table and PTE
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    pte_t* pte = &table[MUL_IDX_LEVEL (virt, 1)];
+    MmPage_t* oldPage = NULL;    // Set to the page we need to remove a mapping from
+                                 // if the current PTE has a mapping in it
+    // Check if the PTE already contains a translation
+    if (*pte)
+    {
+        // Make sure current mapping isn't fixed
+        if (*pte & PF_F)
+            NkPanic ("nexke: attempt to unmap fixed mapping");
+        // Check if the fixed state is changing
+        if ((*pte & PF_F) != (newPte & PF_F))
+        {
+            // Keep stats accurate
+            if (newPte & PF_F)
+                ++space->stats.numFixed;
+            else if (*pte & PF_F)
+                --space->stats.numFixed;
+        }
+        // Check if we need to remove a mapping
+        if ((*pte & PT_PPN) != (newPte & PT_PPN))
+        {
+            // We need to remove the old mapping
+            // We can't do this until the address space is unlocked however
+            // so just keep note of that
+            oldPage = MmFindPagePfn (PT_GETFRAME (*pte) >> NEXKE_CPU_PAGE_SHIFT);
+            assert (oldPage);
+        }
+        // Set the PTE
+        *pte = newPte;
+        // Flush it
+        MmMulFlushAddr (space, canonVirt);
+    }
+    else
+    {
+        // Check if this is fixed
+        if (newPte & PF_F)
+            ++space->stats.numFixed;
+        // Set it
+        *pte = newPte;
+    }
+    // Return it
+    paddr_t tabPhys = cacheEnt->ptab;
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (space);
+    // Check if we have a mapping to remove
+    if (oldPage)
+    {
+        MmLockPage (oldPage);
+        if (MmRemovePageMap (oldPage, space, canonVirt))
+            --space->stats.numMaps;
+        MmUnlockPage (oldPage);
+    }
+    mulAddMapping (space, canonVirt, page, tabPhys);
+}
+
+// Maps count pages starting at virt, walking to each page table only once
+// Page i is pages[i], or contig[i] if pages is NULL
+static void mulMapRange (MmSpace_t* space,
+                         uintptr_t virt,
+                         MmPage_t** pages,
+                         MmPage_t* contig,
+                         size_t count,
+                         int perm)
+{
+    // Translate flags
+    pte_t pgFlags = mmMulGetProt (perm);
+    size_t i = 0;
+    while (i < count)
+    {
+        MM_MUL_LOCK (space);
+        uintptr_t cur = virt + (i * NEXKE_CPU_PAGESZ);
+        uintptr_t addr = mulDecanonical (cur);
+        MmPtCacheEnt_t* cacheEnt = MmPtabWalkAndMap (space, space->mulSpace.base, addr, pgFlags);
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        // Fill in PTEs until the end of this table, or until one that is already mapped
+        size_t first = i;
+        bool mapped = false;
+        do
+        {
+            MmPage_t* page = (pages) ? pages[i] : &contig[i];
+            pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+            if (*pte)
+            {
+                mapped = true;
+                break;
+            }
+            pte_t newPte = pgFlags | PT_MKFRAME (MmGetPagePhys (page));
+            if (page->flags & MM_PAGE_FIXED)
+            {
+                newPte |= PF_F;
+                ++space->stats.numFixed;
+            }
+            *pte = newPte;
+            ++i;
+            addr += NEXKE_CPU_PAGESZ;
+        } while (i < count && MUL_IDX_LEVEL (addr, 1));
+        paddr_t tabPhys = cacheEnt->ptab;
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (space);
+        for (size_t j = first; j < i; ++j)
+        {
+            MmPage_t* page = (pages) ? pages[j] : &contig[j];
+            mulAddMapping (space, virt + (j * NEXKE_CPU_PAGESZ), page, tabPhys);
+        }
+        // Replacing a mapping is left to MmMulMapPage
+        if (mapped)
+        {
+            MmPage_t* page = (pages) ? pages[i] : &contig[i];
+            MmMulMapPage (space, virt + (i * NEXKE_CPU_PAGESZ), page, perm);
+            ++i;
+        }
+    }
+}
+
+// Maps an array of pages into address space
+void MmMulMapRange (MmSpace_t* space, uintptr_t virt, MmPage_t** pages, size_t count, int perm)
+{
+    mulMapRange (space, virt, pages, NULL, count, perm);
+}
+
+// Maps physically contigous pages into address space
+void MmMulMapContig (MmSpace_t* space, uintptr_t virt, MmPage_t* pages, size_t count, int perm)
+{
+    mulMapRange (space, virt, NULL, pages, count, perm);
+}
+
+// Unmaps a range out of an address space
+void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
+{
+    MM_MUL_LOCK (space);
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
+    // Set up iterator
+    MmPtIter_t iter = {0};
+    iter.addr = mulDecanonical (base);
+    iter.space = space;
+    iter.asPhys = space->mulSpace.base;
+    for (int i = 0; i < count; ++i)
+    {
+        uintptr_t addr = iter.addr;
+        // Remove mega-pages in one go if the range covers all of it
+        // Otherwise the iterator splits it for us
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (count - i) >= MUL_LARGE_PAGES)
+        {
+            MmPtCacheEnt_t* largeEnt = NULL;
+            pte_t* ent = mulGetLarge (space, addr, &largeEnt);
+            if (ent)
+            {
+                // Make sure it isn't fixed
+                if (*ent & PF_F)
+                    NkPanic ("nexke: can't remove fixed mapping");
+                *ent = 0;
+                MmPtabGather (&gather, mulMakeCanonical (addr), MUL_LARGE_PAGESZ, NULL);
+                MmPtabReturnCache (largeEnt);
+                space->stats.numMaps -= MUL_LARGE_PAGES;
+                mulResetIter (&iter);
+                iter.addr += MUL_LARGE_PAGESZ;
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
+        // Get cache entry for table containing PTE
+        MmPtCacheEnt_t* cacheEnt = MmPtabIterate (&iter);
+        // If there is no cache entry, move to next address
+        if (cacheEnt)
+        {
+            // Get page table
+            pte_t* table = (pte_t*) cacheEnt->addr;
+            pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+            if (*pte)
+            {
+                // Make sure PTE isn't fixed
+                if (*pte & PF_F)
+                    NkPanic ("nexke: can't remove fixed mapping");
+                // Get page of PTE
+                MmPage_t* page = MmFindPagePfn (PT_GETFRAME (*pte) >> NEXKE_CPU_PAGE_SHIFT);
+                *pte = 0;
+                // The mapping is removed once the TLB has been flushed
+                MmPtabGather (&gather, mulMakeCanonical (addr), NEXKE_CPU_PAGESZ, page);
+            }
+        }
+    }
+    MmPtabEndIterate (&iter);
+    MmPtabReclaim (&gather, iter.asPhys, mulDecanonical (base), base, count);
+    MmPtabFlushGather (&gather);
+    MM_MUL_UNLOCK (space);
+}
+
+// Changes protection on range of address space
+void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm)
+{
+    MM_MUL_LOCK (space);
+    // Get right flags
+    pte_t flags = mmMulGetProt (perm);
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
+    // Set up iterator
+    MmPtIter_t iter = {0};
+    iter.addr = mulDecanonical (base);
+    iter.space = space;
+    iter.asPhys = space->mulSpace.base;
+    for (int i = 0; i < count; ++i)
+    {
+        uintptr_t addr = iter.addr;
+        // Change mega-pages in one go if the range covers all of it
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (count - i) >= MUL_LARGE_PAGES)
+        {
+            MmPtCacheEnt_t* largeEnt = NULL;
+            pte_t* ent = mulGetLarge (space, addr, &largeEnt);
+            if (ent)
+            {
+                *ent = (*ent & PT_PPN) | mulToLargeFlags (flags) | (*ent & PF_F);
+                MmPtabGather (&gather, mulMakeCanonical (addr), MUL_LARGE_PAGESZ, NULL);
+                MmPtabReturnCache (largeEnt);
+                mulResetIter (&iter);
+                iter.addr += MUL_LARGE_PAGESZ;
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
+        // Get cache entry for table containing PTE
+        MmPtCacheEnt_t* cacheEnt = MmPtabIterate (&iter);
+        // If there is no cache entry, move to next address
+        if (cacheEnt)
+        {
+            // Get page table
+            pte_t* table = (pte_t*) cacheEnt->addr;
+            pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+            // Set protection if PTE is valid
+            if (*pte & PF_V)
+            {
+                *pte = (*pte & (PT_PPN | PF_A | PF_F)) | flags;
+                MmPtabGather (&gather, mulMakeCanonical (addr), NEXKE_CPU_PAGESZ, NULL);
+            }
+        }
+    }
+    MmPtabFlushGather (&gather);
+    MmPtabEndIterate (&iter);
+    MM_MUL_UNLOCK (space);
+}
+
+// Unmaps a page and removes all its mappings
+void MmMulUnmapPage (MmPage_t* page)
+{
+    // Loop through every mapping
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        // Lock MUL
+        MM_MUL_LOCK (map->space);
+        uint64_t addr = mulDecanonical (map->addr);
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
+        // Get PTE
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+        // Make sure it isn't fixed
+        if (*pte & PF_F)
+            NkPanic ("nexke: can't unmap fixed mapping");
+        // Don't lose track of writes through this mapping
+        if (*pte & PF_D)
+            page->flags |= MM_PAGE_DIRTY;
+        // Clear it
+        *pte = 0;
+        --map->space->stats.numMaps;
+        // Flush TLB if needed
+        MmMulFlushAddr (map->space, map->addr);
+        // Return and unlock
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (map->space);
+        map = map->next;
+    }
+    MmClearPageMaps (page);
+}
+
+// Changes protection on a page
+void MmMulProtectPage (MmPage_t* page, int perm)
+{
+    // Get right flags
+    pte_t flags = mmMulGetProt (perm);
+    // Loop through every mapping
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        // Lock MUL
+        MM_MUL_LOCK (map->space);
+        uint64_t addr = mulDecanonical (map->addr);
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
+        // Get PTE
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+        // Set flags
+        *pte = (*pte & (PT_PPN | PF_A | PF_F)) | flags;
+        // Flush TLB if needed
+        MmMulFlushAddr (map->space, map->addr);
+        // Return and unlock
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (map->space);
+        map = map->next;
+    }
+}
+
+// Fixes a page in an address space
+void MmMulFixPage (MmPage_t* page)
+{
+    assert (page->fixCount);
+    // Loop through every mapping
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        // Lock MUL
+        MM_MUL_LOCK (map->space);
+        uint64_t addr = mulDecanonical (map->addr);
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
+        // Get PTE
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+        if (*pte == 0)
+            goto next;
+        // Check if this is actually changing the attribute
+        if ((*pte & PF_F) == 0)
+            ++map->space->stats.numFixed;
+        // Set the attribute
+        *pte |= PF_F;
+    next:
+        // Return and unlock
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (map->space);
+        map = map->next;
+    }
+}
+
+// Unfixes a page
+void MmMulUnfixPage (MmPage_t* page)
+{
+    // Loop through every mapping
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        // Lock MUL
+        MM_MUL_LOCK (map->space);
+        uint64_t addr = mulDecanonical (map->addr);
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
+        // Get PTE
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+        if (*pte == 0)
+            goto next;
+        // Check if this is actually changing the attribute
+        if (*pte & PF_F)
+            --map->space->stats.numFixed;
+        // Set the attribute
+        *pte &= ~(PF_F);
+    next:
+        // Return and unlock
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (map->space);
+        map = map->next;
+    }
+}
+
+// Gets mapping for specified virtual address
+MmPage_t* MmMulGetMapping (MmSpace_t* space, uintptr_t virt)
+{
+    MM_MUL_LOCK (space);
+    // Check for a mega-page first so we don't split it
+    MmPtCacheEnt_t* largeEnt = NULL;
+    pte_t* ent = mulGetLarge (space, mulDecanonical (virt), &largeEnt);
+    if (ent)
+    {
+        paddr_t addr = PT_GETFRAME (*ent) + (virt & (MUL_LARGE_PAGESZ - 1));
+        MmPtabReturnCache (largeEnt);
+        MM_MUL_UNLOCK (space);
+        return MmFindPagePfn (addr / NEXKE_CPU_PAGESZ);
+    }
+    MmPtCacheEnt_t* cacheEnt = MmPtabWalk (space, space->mulSpace.base, mulDecanonical (virt));
+    assert (cacheEnt);
+    // Get PTE
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    pte_t* pte = &table[MUL_IDX_LEVEL (mulDecanonical (virt), 1)];
+    paddr_t addr = PT_GETFRAME (*pte);
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (space);
+    return MmFindPagePfn (addr / NEXKE_CPU_PAGESZ);
+}
+
+// Sets attribute of address
+void MmMulSetAttr (MmSpace_t* space, uintptr_t virt, int attr, bool val)
+{
+    MM_MUL_LOCK (space);
+    MmPtCacheEnt_t* cacheEnt = MmPtabWalk (space, space->mulSpace.base, mulDecanonical (virt));
+    assert (cacheEnt);
+    // Get PTE
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    pte_t* pte = &table[MUL_IDX_LEVEL (mulDecanonical (virt), 1)];
+    if (attr == MUL_ATTR_ACCESS)
+        *pte |= PF_A;
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (space);
+}
+
+// Gets attribute of address
+bool MmMulGetAttr (MmSpace_t* space, uintptr_t virt, int attr)
+{
+    MM_MUL_LOCK (space);
+    MmPtCacheEnt_t* cacheEnt = MmPtabWalk (space, space->mulSpace.base, mulDecanonical (virt));
+    assert (cacheEnt);
+    // Get PTE
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    pte_t* pte = &table[MUL_IDX_LEVEL (mulDecanonical (virt), 1)];
+    bool attrVal = false;
+    if (attr == MUL_ATTR_ACCESS)
+        attrVal = !!(*pte & PF_A);
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (space);
+    return attrVal;
+}
+
+// Tests attribute of every mapping of page, and sets or clears it if update is set
+// Returns whether any mapping had the attribute set
+// Dirty bits are set up front on writable mappings, so every writable mapping counts as dirty,
+// and the dirty attribute can't be changed
+static bool mulUpdateAttrPage (MmPage_t* page, int attr, bool update, bool val)
+{
+    bool res = false;
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        MM_MUL_LOCK (map->space);
+        uint64_t addr = mulDecanonical (map->addr);
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+        if (attr == MUL_ATTR_DIRTY)
+            res |= !!(*pte & PF_W);
+        else if (*pte & PF_A)
+        {
+            res = true;
+            if (update && !val)
+            {
+                // Next access either has the CPU set it again, or faults so we can set it
+                *pte &= ~(PF_A);
+                MmMulFlushAddr (map->space, map->addr);
+            }
+        }
+        else if (update && val)
+            *pte |= PF_A;
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (map->space);
+        // If we're only looking, one set attribute is enough
+        if (res && (!update || attr == MUL_ATTR_DIRTY))
+            break;
+        map = map->next;
+    }
+    return res;
+}
+
+// Gets attributes of page
+bool MmMulGetAttrPage (MmPage_t* page, int attr)
+{
+    return mulUpdateAttrPage (page, attr, false, false);
+}
+
+// Sets attribute to value of page
+bool MmMulSetAttrPage (MmPage_t* page, int attr, bool val)
+{
+    return mulUpdateAttrPage (page, attr, true, val);
+}
+
+// Early MUL functions
+
+// Gets physical address of virtual address early in boot process
+uintptr_t MmMulGetPhysEarly (uintptr_t virt)
+{
+    // Set max page level if it hasn't been set
+    if (!mulMaxLevel)
+        mulInitMode();
+    uintptr_t pgAddr = mulDecanonical (virt);
+    pte_t* curSt = mulReadSatp();
+    for (int i = mulMaxLevel; i > 1; --i)
+    {
+        // Get entry for this level
+        pte_t* ent = &curSt[MUL_IDX_LEVEL (pgAddr, i)];
+        if (!(*ent))
+            NkPanic ("cannot get physical address of non-existant page");
+        // Leaves can be at any level
+        if (PT_ISLARGE (*ent))
+        {
+            uintptr_t leafSz = 1ULL << idxShiftTab[i];
+            return PT_GETFRAME (*ent) + CpuPageAlignDown (pgAddr & (leafSz - 1));
+        }
+        // Get physical address
+        curSt = (pte_t*) PT_GETFRAME (*ent);
+    }
+    return PT_GETFRAME (curSt[MUL_IDX_LEVEL (pgAddr, 1)]);
+}
+
+// Maps a page early in the boot process
+// This functions takes many shortcuts and makes many assumptions that are only
+// valid during early boot
+void MmMulMapEarly (uintptr_t virt, paddr_t phys, int flags)
+{
+    // Set max page level if it hasn't been set
+    if (!mulMaxLevel)
+        mulInitMode();
+    // Decanonicalize address
+    uintptr_t pgAddr = mulDecanonical (virt);
+    // Translate flags
+    // Features haven't been detected yet, so memory types are left to the PMAs
+    uint64_t pgFlags = PF_V | PF_R | PF_A | PF_U;
+    if (flags & MUL_PAGE_RW)
+        pgFlags |= PF_W | PF_D;
+    if (flags & MUL_PAGE_X)
+        pgFlags |= PF_X;
+    if (flags & MUL_PAGE_KE)
+    {
+        pgFlags &= ~(PF_U);
+        pgFlags |= PF_G;
+    }
+    // Mega-pages and giga-pages stop one or two levels early
+    int lastLevel = 1;
+    if (flags & MUL_PAGE_HUGE)
+        lastLevel = MUL_HUGE_LEVEL;
+    else if (flags & MUL_PAGE_LARGE)
+        lastLevel = MUL_LARGE_LEVEL;
+    pte_t* curSt = mulReadSatp();
+    for (int i = mulMaxLevel; i > lastLevel; --i)
+    {
+        // Get entry for this level
+        pte_t* ent = &curSt[MUL_IDX_LEVEL (pgAddr, i)];
+        // Is it mapped?
+        if (*ent)
+        {
+            // Grab the structure and move to next level
+            curSt = (pte_t*) (PT_GETFRAME (*ent));
+        }
+        else
+        {
+            // Allocate a new table
+            void* newPage = MmAllocKvPage();
+            memset (newPage, 0, NEXKE_CPU_PAGESZ);
+            pte_t* newSt = (pte_t*) MmMulGetPhysEarly ((uintptr_t) newPage);
+            // Map it
+            curSt[MUL_IDX_LEVEL (pgAddr, i)] = PT_MKFRAME ((paddr_t) newSt) | PF_V;
+            curSt = newSt;
+        }
+    }
+    // Map the last entry
+    pte_t* lastEnt = &curSt[MUL_IDX_LEVEL (pgAddr, lastLevel)];
+    if (*lastEnt)
+        NkPanic ("nexke: cannot map already mapped page");
+    *lastEnt = pgFlags | PT_MKFRAME (phys);
+    // Invalidate TLB
+    MmMulFlush (virt);
+}
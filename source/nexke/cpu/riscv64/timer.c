@@ -0,0 +1,154 @@
+/*
+    timer.c - contains RISC-V time CSR and timer driver
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/platform/generic.h>
+
+// The time CSR is a system wide counter every hart sees the same value of. Each hart has its own
+// comparator, which is either the stimecmp CSR with Sstc, or one the SBI keeps in M-mode for us
+
+// sie bit for the supervisor timer interrupt
+#define CPU_SIE_STIE (1 << 5)
+
+// stimecmp CSR, written by number so older assemblers take it
+#define CPU_CSR_STIMECMP "0x14D"
+
+extern PltHwClock_t timeClock;
+extern PltHwTimer_t timeTimer;
+
+// Conversion factors, counts to ns and back
+static uint32_t timeMult = 0;
+static int timeShift = 0;
+static uint32_t timeInvMult = 0;
+static int timeInvShift = 0;
+
+// Reads the counter
+static inline uint64_t cpuTimeRead()
+{
+    uint64_t val = 0;
+    asm volatile ("rdtime %0" : "=r"(val) : : "memory");
+    return val;
+}
+
+// Multiplies val by mult / 2^shift
+static inline ktime_t cpuTimeScale (ktime_t val, uint32_t mult, int shift)
+{
+    // Split the multiply so it can't overflow
+    ktime_t high = ((val >> 32) * mult) << (32 - shift);
+    ktime_t low = ((val & 0xFFFFFFFF) * mult) >> shift;
+    return high + low;
+}
+
+// Finds a 32 bit fixed point factor for multiplying by num / denom
+static void cpuTimeGetFactor (ktime_t num, ktime_t denom, uint32_t* mult, int* shift)
+{
+    // Take the biggest shift that keeps the multiplier in 32 bits, without overflowing num
+    int s = 32;
+    while (s && ((num >> (64 - s)) || ((num << s) / denom) > UINT32_MAX))
+        --s;
+    *mult = (num << s) / denom;
+    *shift = s;
+}
+
+// Sets comparator of this hart
+// The interrupt stays pending until the comparator is moved past the counter
+static void cpuTimeSetCmp (uint64_t val)
+{
+    if (CpuGetFeatures() & CPU_FEATURE_SSTC)
+        CpuWriteCsr (CPU_CSR_STIMECMP, val);
+    else if (CpuGetFeatures() & CPU_FEATURE_SBI_TIME)
+        CpuSbiCall (CPU_SBI_EXT_TIME, CPU_SBI_TIME_SET, val);
+    else
+        CpuSbiCall (CPU_SBI_EXT_LEGACY_TIMER, 0, val);
+}
+
+// Gets time on clock
+static ktime_t CpuTimeGetTime()
+{
+    return cpuTimeScale (cpuTimeRead(), timeMult, timeShift);
+}
+
+// Polls for specified NS
+static void CpuTimePoll (ktime_t delta)
+{
+    uint64_t target = cpuTimeRead() + cpuTimeScale (delta, timeInvMult, timeInvShift);
+    while (cpuTimeRead() < target)
+        CpuSpin();
+}
+
+// Arms timer to specified delta
+static void CpuTimeArmTimer (ktime_t delta)
+{
+    // The comparator is absolute, so this can't race with the counter moving on
+    cpuTimeSetCmp (cpuTimeRead() + cpuTimeScale (delta, timeInvMult, timeInvShift));
+}
+
+// Handles supervisor timer interrupt
+void CpuTimeInterrupt()
+{
+    // Push the comparator out of reach until the next arm
+    cpuTimeSetCmp (UINT64_MAX);
+    NkTimeHandler();
+}
+
+// Sets up timer of a newly started hart
+// The comparator and interrupt enable are per hart, so each hart has to do this for itself
+static void cpuTimeInitCpu (NkCcb_t* ccb)
+{
+    cpuTimeSetCmp (UINT64_MAX);
+    asm volatile ("csrs sie, %0" : : "r"(CPU_SIE_STIE));
+}
+
+PltHwClock_t timeClock = {.type = PLT_CLOCK_RISCV,
+                          .getTime = CpuTimeGetTime,
+                          .poll = CpuTimePoll};
+PltHwTimer_t timeTimer = {.type = PLT_TIMER_RISCV,
+                          .armTimer = CpuTimeArmTimer,
+                          .initCpu = cpuTimeInitCpu};
+
+// Initializes time CSR clock
+PltHwClock_t* CpuInitTimeClock()
+{
+    // The frequency comes from the RHCT
+    uint64_t freq = CpuGetCcb()->archCcb.timebase;
+    if (!freq)
+        NkPanic ("nexke: time CSR frequency not set\n");
+    cpuTimeGetFactor (PLT_NS_IN_SEC, freq, &timeMult, &timeShift);
+    cpuTimeGetFactor (freq, PLT_NS_IN_SEC, &timeInvMult, &timeInvShift);
+    int precision = PLT_NS_IN_SEC / freq;
+    if (!precision)
+        ++precision;
+    timeClock.precision = precision;
+    NkLogDebug ("nexke: using time CSR as clock, frequency %llu Hz\n",
+                (unsigned long long) freq);
+    return &timeClock;
+}
+
+// Initializes hart timer
+PltHwTimer_t* CpuInitTimeTimer()
+{
+    timeTimer.precision = timeClock.precision;
+    timeTimer.maxInterval = INT64_MAX;
+    cpuTimeInitCpu (CpuGetCcb());
+    if (CpuGetFeatures() & CPU_FEATURE_SSTC)
+        NkLogDebug ("nexke: using stimecmp as timer\n");
+    else
+        NkLogDebug ("nexke: using SBI as timer\n");
+    return &timeTimer;
+}
@@ -0,0 +1,107 @@
+/*
+    alt.c - contains alternative instruction patching
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <stdint.h>
+
+// Alternatives table, from linker script
+extern CpuAlternative_t CpuAltStart[];
+extern CpuAlternative_t CpuAltEnd[];
+
+// Longest NOP we use
+#define CPU_NOP_MAX 8
+
+#ifdef __x86_64__
+// Recommended multi-byte NOPs, indexed by length
+// These don't exist before the P6, but every x86_64 CPU has them
+static const uint8_t cpuNops[CPU_NOP_MAX + 1][CPU_NOP_MAX] = {
+    {0},
+    {0x90},
+    {0x66, 0x90},
+    {0x0F, 0x1F, 0x00},
+    {0x0F, 0x1F, 0x40, 0x00},
+    {0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x66, 0x0F, 0x1F, 0x44, 0x00, 0x00},
+    {0x0F, 0x1F, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0F, 0x1F, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+#endif
+
+// Fills buf with NOPs
+static void cpuFillNops (uint8_t* buf, size_t len)
+{
+    while (len)
+    {
+#ifdef __x86_64__
+        size_t nopLen = (len > CPU_NOP_MAX) ? CPU_NOP_MAX : len;
+        for (size_t i = 0; i < nopLen; ++i)
+            buf[i] = cpuNops[nopLen][i];
+#else
+        size_t nopLen = 1;
+        *buf = 0x90;
+#endif
+        buf += nopLen;
+        len -= nopLen;
+    }
+}
+
+// Patches alternative sites for the features of this CPU
+// This runs on the BSP before other CPUs start, so nothing else can be running the code
+void CpuApplyAlternatives()
+{
+    uint64_t features = CpuGetFeatures();
+    if (!NkReadArg ("-trace"))
+        features |= CPU_FEATURE_NOTRACE;
+    int numPatched = 0;
+    // Kernel text may be mapped read-only, so let supervisor writes through while we patch
+    uintptr_t cr0 = CpuReadCr0();
+    CpuWriteCr0 (cr0 & ~(CPU_CR0_WP));
+    for (CpuAlternative_t* alt = CpuAltStart; alt < CpuAltEnd; ++alt)
+    {
+        if (!(features & (1ULL << alt->feature)))
+            continue;
+        uint8_t* site = (uint8_t*) &alt->site + alt->site;
+        const uint8_t* repl = (const uint8_t*) &alt->repl + alt->repl;
+        assert (alt->replLen <= alt->siteLen);
+        for (int i = 0; i < alt->replLen; ++i)
+            site[i] = repl[i];
+        cpuFillNops (site + alt->replLen, alt->siteLen - alt->replLen);
+        ++numPatched;
+    }
+    // Writing CR0 serializes, so nothing stale is left in the pipeline after this
+    CpuWriteCr0 (cr0);
+    NkLogDebug ("nexke: patched %d of %d alternative sites\n",
+                numPatched,
+                (int) (CpuAltEnd - CpuAltStart));
+}
+
+// Points the static call trampoline tramp at func
+// Only the jump's offset changes, and that's one store, so a CPU running the trampoline sees
+// either the old function or the new one
+void CpuPatchStaticCall (void* tramp, void* func)
+{
+    uint8_t* site = tramp;
+    assert (site[0] == 0xE9);
+    int32_t rel = (int32_t) ((uintptr_t) func - ((uintptr_t) site + 5));
+    uintptr_t cr0 = CpuReadCr0();
+    CpuWriteCr0 (cr0 & ~(CPU_CR0_WP));
+    *(volatile int32_t*) (site + 1) = rel;
+    // Writing CR0 serializes, so this CPU doesn't run the old jump
+    CpuWriteCr0 (cr0);
+}
@@ -18,17 +18,10 @@
 #include <nexke/cpu.h>
 #include <nexke/nexboot.h>
 #include <nexke/nexke.h>
+#include <nexke/platform.h>
 #include <stdint.h>
 #include <string.h>
 
-typedef struct _cpuidInfo
-{
-    uint32_t eax;
-    uint32_t ebx;
-    uint32_t ecx;
-    uint32_t edx;
-} CpuCpuid_t;
-
 // Raw feature bits
 // 01h EDX
 #define CPUID_FEATURE_FPU       (1 << 0)
@@ -57,6 +50,7 @@ typedef struct _cpuidInfo
 
 // 01h ECX
 #define CPUID_FEATURE_SSE3         (1 << 0)
+#define CPUID_FEATURE_PCLMUL       (1 << 1)
 #define CPUID_FEATURE_MONITOR      (1 << 3)
 #define CPUID_FEATURE_VMX          (1 << 5)
 #define CPUID_FEATURE_SSSE3        (1 << 9)
@@ -77,14 +71,24 @@ typedef struct _cpuidInfo
 
 // 07h EBX
 #define CPUID_FEATURE_FSGSBASE (1 << 0)
+#define CPUID_FEATURE_AVX2     (1 << 5)
 #define CPUID_FEATURE_SMEP     (1 << 7)
+#define CPUID_FEATURE_ERMS     (1 << 9)
 #define CPUID_FEATURE_INVPCID  (1 << 10)
 
+// 07h ECX
+#define CPUID_FEATURE_WAITPKG (1 << 5)
+
+// 0Dh.1 EAX
+#define CPUID_FEATURE_XSAVEOPT (1 << 0)
+#define CPUID_FEATURE_XSAVES   (1 << 3)
+
 // 80000001h ECX
-#define CPUID_FEATURE_LAHF  (1 << 0)
-#define CPUID_FEATURE_SVM   (1 << 2)
-#define CPUID_FEATURE_SSE4A (1 << 6)
-#define CPUID_FEATURE_SSE5  (1 << 11)
+#define CPUID_FEATURE_LAHF    (1 << 0)
+#define CPUID_FEATURE_SVM     (1 << 2)
+#define CPUID_FEATURE_SSE4A   (1 << 6)
+#define CPUID_FEATURE_SSE5    (1 << 11)
+#define CPUID_FEATURE_TOPOEXT (1 << 22)
 
 // 80000001h EDX
 #define CPUID_FEATURE_SYSCALL (1 << 11)
@@ -100,8 +104,25 @@ typedef struct _cpuidInfo
 static size_t maxEax = 0;
 static size_t maxExtEax = 0;
 
+// Topology info
+// APIC IDs are made of fields for the thread in the core, the core in the package, and the
+// package. Shifting an APIC ID right by the shift of a topology level gets its group there
+static int cpuTopoShift[NK_TOPO_LEVELS] = {0};
+
+// Extended topology (0Bh and 1Fh) level types
+#define CPUID_TOPO_LEVEL_SMT  1
+#define CPUID_TOPO_LEVEL_CORE 2
+
+// Deterministic cache parameters (04h and 8000001Dh) EAX fields
+#define CPUID_CACHE_TYPE(eax)    ((eax) & 0x1F)
+#define CPUID_CACHE_LEVEL(eax)   (((eax) >> 5) & 0x7)
+#define CPUID_CACHE_SHARING(eax) ((((eax) >> 14) & 0xFFF) + 1)    // Logical CPUs sharing it
+
+#define CPUID_CACHE_NONE 0
+#define CPUID_CACHE_INSN 2
+
 // Executes cpuid instruction
-static void cpuCpuid (uint32_t code, uint32_t extCode, CpuCpuid_t* cpuid)
+void CpuCpuid (uint32_t code, uint32_t extCode, CpuCpuid_t* cpuid)
 {
     asm volatile ("cpuid"
                   : "=a"(cpuid->eax), "=b"(cpuid->ebx), "=c"(cpuid->ecx), "=d"(cpuid->edx)
@@ -111,7 +132,7 @@ static void cpuCpuid (uint32_t code, uint32_t extCode, CpuCpuid_t* cpuid)
 static void cpuidSetType (NkCcb_t* ccb)
 {
     CpuCpuid_t cpuid;
-    cpuCpuid (1, 0, &cpuid);
+    CpuCpuid (1, 0, &cpuid);
     ccb->archCcb.stepping = cpuid.eax & 0xF;
     // Set family
     ccb->archCcb.family = ((cpuid.eax >> 8) & 0xF) + ((cpuid.eax >> 20) & 0xFF);
@@ -123,7 +144,7 @@ static void cpuidSetFeatures (NkCcb_t* ccb)
 {
     // Call 01h
     CpuCpuid_t cpuid;
-    cpuCpuid (1, 0, &cpuid);
+    CpuCpuid (1, 0, &cpuid);
     uint32_t edx = cpuid.edx;
     // Set features
     NkArchCcb_t* archCcb = &ccb->archCcb;
@@ -178,6 +199,8 @@ static void cpuidSetFeatures (NkCcb_t* ccb)
     uint32_t ecx = cpuid.ecx;
     if (ecx & CPUID_FEATURE_SSE3)
         archCcb->features |= CPU_FEATURE_SSE3;
+    if (ecx & CPUID_FEATURE_PCLMUL)
+        archCcb->features |= CPU_FEATURE_PCLMUL;
     if (ecx & CPUID_FEATURE_MONITOR)
         archCcb->features |= CPU_FEATURE_MONITOR;
     if (ecx & CPUID_FEATURE_VMX)
@@ -209,14 +232,14 @@ static void cpuidSetFeatures (NkCcb_t* ccb)
     // Call 06H
     if (maxEax >= 6)
     {
-        cpuCpuid (6, 0, &cpuid);
+        CpuCpuid (6, 0, &cpuid);
         if (cpuid.eax & CPUID_FEATURE_ARAT)
             archCcb->features |= CPU_FEATURE_ARAT;
     }
     // Call 07h
     if (maxEax >= 7)
     {
-        cpuCpuid (7, 0, &cpuid);
+        CpuCpuid (7, 0, &cpuid);
         uint32_t ebx = cpuid.ebx;
         if (ebx & CPUID_FEATURE_FSGSBASE)
             archCcb->features |= CPU_FEATURE_FSGSBASE;
@@ -224,11 +247,26 @@ static void cpuidSetFeatures (NkCcb_t* ccb)
             archCcb->features |= CPU_FEATURE_SMEP;
         if (ebx & CPUID_FEATURE_INVPCID)
             archCcb->features |= CPU_FEATURE_INVPCID;
+        if (ebx & CPUID_FEATURE_ERMS)
+            archCcb->features |= CPU_FEATURE_ERMS;
+        if (ebx & CPUID_FEATURE_AVX2)
+            archCcb->features |= CPU_FEATURE_AVX2;
+        if (cpuid.ecx & CPUID_FEATURE_WAITPKG)
+            archCcb->features |= CPU_FEATURE_WAITPKG;
+    }
+    // Call 0Dh, subleaf 1
+    if (maxEax >= 0xD && (archCcb->features & CPU_FEATURE_XSAVE))
+    {
+        CpuCpuid (0xD, 1, &cpuid);
+        if (cpuid.eax & CPUID_FEATURE_XSAVEOPT)
+            archCcb->features |= CPU_FEATURE_XSAVEOPT;
+        if (cpuid.eax & CPUID_FEATURE_XSAVES)
+            archCcb->features |= CPU_FEATURE_XSAVES;
     }
     // Call 80000001h
     if (maxExtEax >= 0x80000001)
     {
-        cpuCpuid (0x80000001, 0, &cpuid);
+        CpuCpuid (0x80000001, 0, &cpuid);
         uint32_t ecx = cpuid.ecx;
         if (ecx & CPUID_FEATURE_LAHF)
             archCcb->features |= CPU_FEATURE_LAHF;
@@ -253,7 +291,7 @@ static void cpuidSetFeatures (NkCcb_t* ccb)
     // Call 80000007h
     if (maxExtEax >= 0x80000007)
     {
-        cpuCpuid (0x80000007, 0, &cpuid);
+        CpuCpuid (0x80000007, 0, &cpuid);
         uint32_t edx = cpuid.edx;
         if (edx & CPUID_FEATURE_INVARIANT_TSC)
             archCcb->features |= CPU_FEATURE_INVARIANT_TSC;
@@ -266,7 +304,7 @@ static void cpuidSetAddrSz (NkCcb_t* ccb)
     CpuCpuid_t cpuid;
     if (maxExtEax >= 0x80000008)
     {
-        cpuCpuid (0x80000008, 0, &cpuid);
+        CpuCpuid (0x80000008, 0, &cpuid);
         ccb->archCcb.physAddrBits = cpuid.eax & 0xFF;
         ccb->archCcb.virtAddrBits = (cpuid.eax >> 8) & 0xFF;
     }
@@ -277,22 +315,144 @@ static void cpuidSetAddrSz (NkCcb_t* ccb)
     }
 }
 
+// Gets number of bits needed to hold count IDs
+static int cpuidIdBits (uint32_t count)
+{
+    int bits = 0;
+    while ((1U << bits) < count)
+        ++bits;
+    return bits;
+}
+
+// Finds where the core and package fields of APIC IDs are
+static void cpuidSetPkgTopology (NkCcb_t* ccb)
+{
+    CpuCpuid_t cpuid;
+    // Use extended topology if we have it. 1Fh knows about more levels than 0Bh, but the package
+    // is still the last one
+    uint32_t leaf = 0;
+    if (maxEax >= 0x1F)
+    {
+        CpuCpuid (0x1F, 0, &cpuid);
+        if (cpuid.ebx)
+            leaf = 0x1F;
+    }
+    if (!leaf && maxEax >= 0xB)
+    {
+        CpuCpuid (0xB, 0, &cpuid);
+        if (cpuid.ebx)
+            leaf = 0xB;
+    }
+    if (leaf)
+    {
+        for (int i = 0; i < 8; ++i)
+        {
+            CpuCpuid (leaf, i, &cpuid);
+            int type = (cpuid.ecx >> 8) & 0xFF;
+            if (!type)
+                break;
+            if (type == CPUID_TOPO_LEVEL_SMT)
+                cpuTopoShift[NK_TOPO_CORE] = cpuid.eax & 0x1F;
+            cpuTopoShift[NK_TOPO_PKG] = cpuid.eax & 0x1F;    // The last level gets us there
+        }
+        return;
+    }
+    // Otherwise go by the number of logical CPUs in a package
+    if (!(ccb->archCcb.features & CPU_FEATURE_HT))
+        return;    // One CPU per package
+    CpuCpuid (1, 0, &cpuid);
+    uint32_t logical = (cpuid.ebx >> 16) & 0xFF;
+    cpuTopoShift[NK_TOPO_PKG] = cpuidIdBits (logical);
+    // Intel tells us the number of cores too, so we can find SMT threads
+    if (ccb->archCcb.vendor == CPU_VENDOR_INTEL && maxEax >= 4)
+    {
+        CpuCpuid (4, 0, &cpuid);
+        uint32_t cores = ((cpuid.eax >> 26) & 0x3F) + 1;
+        if (logical > cores)
+            cpuTopoShift[NK_TOPO_CORE] = cpuidIdBits (logical / cores);
+    }
+}
+
+// Finds which APIC IDs share the L2 and last level caches
+static void cpuidSetCacheTopology (NkCcb_t* ccb)
+{
+    CpuCpuid_t cpuid;
+    // Without cache info, take L2s to be per core and the last level cache to be per package
+    cpuTopoShift[NK_TOPO_L2] = cpuTopoShift[NK_TOPO_CORE];
+    cpuTopoShift[NK_TOPO_LLC] = cpuTopoShift[NK_TOPO_PKG];
+    // Intel has cache parameters in 04h, and AMD has the same thing in 8000001Dh
+    uint32_t leaf = 0;
+    if (ccb->archCcb.vendor == CPU_VENDOR_INTEL && maxEax >= 4)
+        leaf = 4;
+    else if (maxExtEax >= 0x8000001D)
+    {
+        CpuCpuid (0x80000001, 0, &cpuid);
+        if (cpuid.ecx & CPUID_FEATURE_TOPOEXT)
+            leaf = 0x8000001D;
+    }
+    if (!leaf)
+        return;
+    int llcLevel = 0;
+    for (int i = 0; i < 16; ++i)
+    {
+        CpuCpuid (leaf, i, &cpuid);
+        int type = CPUID_CACHE_TYPE (cpuid.eax);
+        if (type == CPUID_CACHE_NONE)
+            break;
+        if (type == CPUID_CACHE_INSN)
+            continue;
+        int level = CPUID_CACHE_LEVEL (cpuid.eax);
+        int shift = cpuidIdBits (CPUID_CACHE_SHARING (cpuid.eax));
+        if (level == 2)
+            cpuTopoShift[NK_TOPO_L2] = shift;
+        if (level > llcLevel)
+        {
+            llcLevel = level;
+            cpuTopoShift[NK_TOPO_LLC] = shift;
+        }
+    }
+}
+
+// Determine how APIC IDs are split up
+// Every CPU is assumed to be laid out like the BSP
+static void cpuidSetTopology (NkCcb_t* ccb)
+{
+    for (int i = 0; i < NK_TOPO_LEVELS; ++i)
+        cpuTopoShift[i] = 0;
+    cpuidSetPkgTopology (ccb);
+    cpuidSetCacheTopology (ccb);
+    // Keep every level inside the next one, whatever the CPU told us
+    for (int i = 1; i < NK_TOPO_LEVELS; ++i)
+    {
+        if (cpuTopoShift[i] < cpuTopoShift[i - 1])
+            cpuTopoShift[i] = cpuTopoShift[i - 1];
+    }
+}
+
+// Sets topology IDs of CCB from the CPU's APIC ID
+void CpuInitTopology (NkCcb_t* ccb, PltCpu_t* cpu)
+{
+    for (int i = 0; i < NK_TOPO_LEVELS; ++i)
+        ccb->topoId[i] = (uint32_t) cpu->id >> cpuTopoShift[i];
+}
+
 // Feature string table
 static const char* cpuFeatureStrings[] = {
-    "FPU",          "VME",       "DE",      "PSE",      "TSC",    "MSR",        "PAE",
-    "MCE",          "CMPXCHG8B", "APIC",    "SYSENTER", "MTRR",   "PGE",        "MCA",
-    "CMOV",         "PAT",       "PSE36",   "CLFLUSH",  "MMX",    "FXSR",       "SSE",
-    "SSE2",         "HT",        "SSE3",    "MONITOR",  "SSSE3",  "CMPXCHG16B", "SSE41",
-    "POPCNT",       "LAHF",      "SYSCALL", "XD",       "1GB",    "RDTSCP",     "LM",
-    "FSGSBASE",     "SMEP",      "INVPCID", "VMX",      "PCID",   "SSE42",      "X2APIC",
-    "TSC_DEADLINE", "XSAVE",     "OSXSAVE", "AVX",      "RDRAND", "SYSENTER64", "SYSCALL64",
-    "SVM",          "SSE4A",     "SSE5",    "INVLPG",   "AC",     "ARAT",       "TSC_INVARIANT"};
+    "FPU",          "VME",       "DE",      "PSE",      "TSC",     "MSR",        "PAE",
+    "MCE",          "CMPXCHG8B", "APIC",    "SYSENTER", "MTRR",    "PGE",        "MCA",
+    "CMOV",         "PAT",       "PSE36",   "CLFLUSH",  "MMX",     "FXSR",       "SSE",
+    "SSE2",         "HT",        "SSE3",    "MONITOR",  "SSSE3",   "CMPXCHG16B", "SSE41",
+    "POPCNT",       "LAHF",      "SYSCALL", "XD",       "1GB",     "RDTSCP",     "LM",
+    "FSGSBASE",     "SMEP",      "INVPCID", "VMX",      "PCID",    "SSE42",      "X2APIC",
+    "TSC_DEADLINE", "XSAVE",     "OSXSAVE", "AVX",      "RDRAND",  "SYSENTER64", "SYSCALL64",
+    "SVM",          "SSE4A",     "SSE5",    "INVLPG",   "AC",      "ARAT",       "TSC_INVARIANT",
+    "XSAVEOPT",     "XSAVES",    "ERMS",    "AVX2",     "WAITPKG", "PCLMUL"};
 
 void CpuDetectCpuid (NkCcb_t* ccb)
 {
     CpuCpuid_t cpuid;
     // Determine vendor and max function
-    cpuCpuid (0, 0, &cpuid);
+    CpuCpuid (0, 0, &cpuid);
     maxEax = cpuid.eax;
     char vendor[13] = {0};
     // Copy vendor string
@@ -304,7 +464,7 @@ void CpuDetectCpuid (NkCcb_t* ccb)
         ccb->archCcb.vendor = CPU_VENDOR_INTEL;
     else if (!strcmp (vendor, "AuthenticAMD"))
         ccb->archCcb.vendor = CPU_VENDOR_AMD;
-    cpuCpuid (0x80000000, 0, &cpuid);
+    CpuCpuid (0x80000000, 0, &cpuid);
     maxExtEax = cpuid.eax;
     // Check if they are supported
     if (!(maxExtEax & (1 << 31)))
@@ -315,6 +475,8 @@ void CpuDetectCpuid (NkCcb_t* ccb)
     cpuidSetType (ccb);
     // Set address sizes
     cpuidSetAddrSz (ccb);
+    // Figure out topology
+    cpuidSetTopology (ccb);
 }
 
 // Print CPU features
@@ -0,0 +1,170 @@
+/*
+    crc32.c - contains x86 CRC32 routines
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <stdint.h>
+#include <string.h>
+
+// SSE4.2's CRC32 instruction computes the Castagnoli CRC in general purpose registers, so it
+// can be used anywhere. The IEEE CRC is folded 64 bytes at a time with PCLMULQDQ, as in Intel's
+// "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ" paper, and then brought down to
+// 32 bits with a Barrett reduction. That needs a SIMD region, so short buffers use the tables
+
+// Shortest buffer that gets folded
+#define CPU_CRC_FOLD_MIN 256
+
+// Folding constants, low quadword first
+static const uint64_t cpuCrcK1K2[2] __attribute__ ((aligned (16))) = {0x154442BD4, 0x1C6E41596};
+static const uint64_t cpuCrcK3K4[2] __attribute__ ((aligned (16))) = {0x1751997D0, 0x0CCAA009E};
+static const uint64_t cpuCrcK5[2] __attribute__ ((aligned (16))) = {0x163CD6124, 0};
+static const uint64_t cpuCrcPoly[2] __attribute__ ((aligned (16))) = {0x1DB710641, 0x1F7011641};
+static const uint64_t cpuCrcMask[2] __attribute__ ((aligned (16))) = {0xFFFFFFFF, 0};
+
+// Folds xmm1 by the constants in xmm0
+#define CPU_CRC_FOLD                     \
+    "movdqa %%xmm1, %%xmm5\n\t"          \
+    "pclmulqdq $0x00, %%xmm0, %%xmm1\n\t" \
+    "pclmulqdq $0x11, %%xmm0, %%xmm5\n\t" \
+    "pxor %%xmm5, %%xmm1\n\t"
+
+// Folds 4 lanes at once
+#define CPU_CRC_FOLD_LANE(reg, off)          \
+    "movdqa %%" reg ", %%xmm5\n\t"           \
+    "pclmulqdq $0x00, %%xmm0, %%" reg "\n\t" \
+    "pclmulqdq $0x11, %%xmm0, %%xmm5\n\t"    \
+    "pxor %%xmm5, %%" reg "\n\t"             \
+    "pxor " off "(%[buf]), %%" reg "\n\t"
+
+// Castagnoli CRC with the CRC32 instruction
+static uint32_t cpuCrc32cSse42 (uint32_t crc, const uint8_t* buf, size_t len)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t word;
+        memcpy (&word, buf, sizeof (uint64_t));
+        asm ("crc32q %1, %0" : "+r"(crc64) : "rm"(word));
+        buf += 8;
+        len -= 8;
+    }
+    crc = crc64;
+#endif
+    while (len >= 4)
+    {
+        uint32_t word;
+        memcpy (&word, buf, sizeof (uint32_t));
+        asm ("crc32l %1, %0" : "+r"(crc) : "rm"(word));
+        buf += 4;
+        len -= 4;
+    }
+    while (len--)
+        asm ("crc32b %1, %0" : "+r"(crc) : "rm"(*buf++));
+    return crc;
+}
+
+// Folds len bytes of buf into crc
+// buf has to be 16 byte aligned, and len a multiple of 16 that's at least 64
+static uint32_t cpuCrc32Fold (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    asm volatile ("movd %[crc], %%xmm0\n\t"
+                  "movdqa (%[buf]), %%xmm1\n\t"
+                  "movdqa 16(%[buf]), %%xmm2\n\t"
+                  "movdqa 32(%[buf]), %%xmm3\n\t"
+                  "movdqa 48(%[buf]), %%xmm4\n\t"
+                  "pxor %%xmm0, %%xmm1\n\t"
+                  "add $64, %[buf]\n\t"
+                  "sub $64, %[len]\n\t"
+                  "movdqa %[k1k2], %%xmm0\n\t"
+                  "cmp $64, %[len]\n\t"
+                  "jb 2f\n"
+                  // Fold 64 bytes at a time
+                  "1:\n\t" CPU_CRC_FOLD_LANE ("xmm1", "0") CPU_CRC_FOLD_LANE ("xmm2", "16")
+                      CPU_CRC_FOLD_LANE ("xmm3", "32") CPU_CRC_FOLD_LANE ("xmm4", "48")
+                  "add $64, %[buf]\n\t"
+                  "sub $64, %[len]\n\t"
+                  "cmp $64, %[len]\n\t"
+                  "jae 1b\n"
+                  // Fold the lanes into one
+                  "2:\n\t"
+                  "movdqa %[k3k4], %%xmm0\n\t" CPU_CRC_FOLD "pxor %%xmm2, %%xmm1\n\t" CPU_CRC_FOLD
+                  "pxor %%xmm3, %%xmm1\n\t" CPU_CRC_FOLD "pxor %%xmm4, %%xmm1\n\t"
+                  "cmp $16, %[len]\n\t"
+                  "jb 4f\n"
+                  // Fold what's left 16 bytes at a time
+                  "3:\n\t" CPU_CRC_FOLD "pxor (%[buf]), %%xmm1\n\t"
+                  "add $16, %[buf]\n\t"
+                  "sub $16, %[len]\n\t"
+                  "cmp $16, %[len]\n\t"
+                  "jae 3b\n"
+                  // Fold down to 64 bits, and then 32
+                  "4:\n\t"
+                  "pclmulqdq $0x01, %%xmm1, %%xmm0\n\t"
+                  "psrldq $8, %%xmm1\n\t"
+                  "pxor %%xmm0, %%xmm1\n\t"
+                  "movdqa %%xmm1, %%xmm2\n\t"
+                  "movdqa %[k5], %%xmm0\n\t"
+                  "movdqa %[mask], %%xmm3\n\t"
+                  "psrldq $4, %%xmm2\n\t"
+                  "pand %%xmm3, %%xmm1\n\t"
+                  "pclmulqdq $0x00, %%xmm0, %%xmm1\n\t"
+                  "pxor %%xmm2, %%xmm1\n\t"
+                  // Barrett reduction
+                  "movdqa %[poly], %%xmm0\n\t"
+                  "movdqa %%xmm1, %%xmm2\n\t"
+                  "pand %%xmm3, %%xmm1\n\t"
+                  "pclmulqdq $0x10, %%xmm0, %%xmm1\n\t"
+                  "pand %%xmm3, %%xmm1\n\t"
+                  "pclmulqdq $0x00, %%xmm0, %%xmm1\n\t"
+                  "pxor %%xmm2, %%xmm1\n\t"
+                  "pextrd $1, %%xmm1, %[crc]"
+                  : [buf] "+r"(buf), [len] "+r"(len), [crc] "+r"(crc)
+                  : [k1k2] "m"(cpuCrcK1K2), [k3k4] "m"(cpuCrcK3K4), [k5] "m"(cpuCrcK5),
+                    [poly] "m"(cpuCrcPoly), [mask] "m"(cpuCrcMask)
+                  : "memory", "cc");
+    return crc;
+}
+
+// IEEE CRC with PCLMULQDQ
+static uint32_t cpuCrc32Clmul (uint32_t crc, const uint8_t* buf, size_t len)
+{
+    if (len < CPU_CRC_FOLD_MIN)
+        return NkCrc32Table (crc, buf, len);
+    // Loads have to be aligned
+    size_t head = -(uintptr_t) buf & 15;
+    crc = NkCrc32Table (crc, buf, head);
+    buf += head;
+    len -= head;
+    if (!CpuBeginSimd())
+        return NkCrc32Table (crc, buf, len);
+    size_t body = len & ~(size_t) 15;
+    crc = cpuCrc32Fold (crc, buf, body);
+    CpuEndSimd();
+    return NkCrc32Table (crc, buf + body, len - body);
+}
+
+// Picks CRC routines for this CPU's features
+void CpuInitCrc()
+{
+    uint64_t features = CpuGetFeatures();
+    if (features & CPU_FEATURE_SSE42)
+        NK_STATIC_CALL_UPDATE (NkCrc32cUpdate, cpuCrc32cSse42);
+    // PEXTRD comes from SSE4.1
+    if ((features & CPU_FEATURE_PCLMUL) && (features & CPU_FEATURE_SSE41))
+        NK_STATIC_CALL_UPDATE (NkCrc32Update, cpuCrc32Clmul);
+}
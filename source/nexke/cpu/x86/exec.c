@@ -52,6 +52,12 @@ static const char* cpuExecNameTab[] = {"division by zero",
 #define CPU_PF_RESVD (1 << 3)
 #define CPU_PF_IF    (1 << 4)
 
+// #NM handler, see fpu.c
+bool CpuFpuTrap (NkInterrupt_t* intObj, CpuIntContext_t* ctx);
+
+// NMI handler, see pmu.c
+bool CpuPmuNmi (NkInterrupt_t* intObj, CpuIntContext_t* ctx);
+
 // System page fault handler
 static bool CpuPageFault (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
 {
@@ -87,6 +93,10 @@ void CpuRegisterExecs()
         // Install special handlers
         if (i == CPU_EXEC_PF)
             PltInstallExec (i, CpuPageFault);
+        else if (i == CPU_EXEC_NM)
+            PltInstallExec (i, CpuFpuTrap);
+        else if (i == CPU_EXEC_NMI)
+            PltInstallExec (i, CpuPmuNmi);
         else
             PltInstallExec (i, NULL);
     }
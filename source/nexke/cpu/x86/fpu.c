@@ -0,0 +1,305 @@
+/*
+    fpu.c - contains FPU and SIMD state management
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/cpu.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/task.h>
+#include <string.h>
+
+// The kernel is built to only use general purpose registers, so the only code that touches the
+// FPU and SIMD registers is inside a CpuBeginSimd / CpuEndSimd region
+// When a thread in a region is switched out, its registers are saved to its state area. They are
+// loaded again either when it is switched back in (eager), or on the first FPU instruction it
+// runs, by setting CR0.TS and catching #NM (lazy). If the registers still hold its state from the
+// last time it ran on this CPU, nothing needs to be loaded at all
+
+// Ways of saving state
+#define CPU_FPU_NONE     0    // No FXSR, so no SIMD regions
+#define CPU_FPU_FXSAVE   1
+#define CPU_FPU_XSAVE    2
+#define CPU_FPU_XSAVEOPT 3
+#define CPU_FPU_XSAVES   4
+
+static int cpuFpuMode = CPU_FPU_NONE;
+static bool cpuFpuLazy = false;            // Wheter to load state on first use
+static uint64_t cpuFpuMask = 0;            // State components that get saved
+static size_t cpuFpuSz = 0;                // Size of a state area
+static SlabCache_t* cpuFpuCache = NULL;    // Cache of state areas
+
+// State area layout
+#define CPU_FPU_LEGACY_SZ     512    // x87 and SSE part, which is all FXSAVE has
+#define CPU_FPU_HEADER_SZ     64     // XSAVE header
+#define CPU_FPU_ALIGN         64
+#define CPU_FPU_FCW_OFF       0
+#define CPU_FPU_MXCSR_OFF     24
+#define CPU_FPU_XCOMP_OFF     (CPU_FPU_LEGACY_SZ + 8)
+#define CPU_FPU_XCOMP_COMPACT (1ULL << 63)
+
+// Initial control words
+#define CPU_FPU_FCW_INIT   0x37F
+#define CPU_FPU_MXCSR_INIT 0x1F80
+
+// XCR0 state components
+#define CPU_XCR0_X87       (1 << 0)
+#define CPU_XCR0_SSE       (1 << 1)
+#define CPU_XCR0_AVX       (1 << 2)
+#define CPU_XCR0_OPMASK    (1 << 5)
+#define CPU_XCR0_ZMM_HI256 (1 << 6)
+#define CPU_XCR0_HI16_ZMM  (1 << 7)
+
+// Components we know how to deal with
+#define CPU_XCR0_KNOWN                                                                   \
+    (CPU_XCR0_X87 | CPU_XCR0_SSE | CPU_XCR0_AVX | CPU_XCR0_OPMASK | CPU_XCR0_ZMM_HI256 | \
+     CPU_XCR0_HI16_ZMM)
+
+#define CPU_XSS_MSR 0xDA0
+
+// State every region starts out with
+// With XSAVE, a clear XSTATE_BV puts every component in its initial state
+static uint8_t cpuFpuInitArea[CPU_FPU_LEGACY_SZ + CPU_FPU_HEADER_SZ]
+    __attribute__ ((aligned (CPU_FPU_ALIGN))) = {0};
+
+// 64 bit saves include the full FPU instruction and data pointers
+#ifdef __x86_64__
+#define CPU_FPU_INSN(insn) insn "64"
+#else
+#define CPU_FPU_INSN(insn) insn
+#endif
+
+// Sets XCR0
+static FORCEINLINE void cpuWriteXcr0 (uint64_t val)
+{
+    asm volatile ("xsetbv" : : "c"(0), "a"((uint32_t) val), "d"((uint32_t) (val >> 32)));
+}
+
+// Lets FPU instructions run
+static FORCEINLINE void cpuFpuEnable()
+{
+    asm volatile ("clts");
+}
+
+// Makes the next FPU instruction trap
+static FORCEINLINE void cpuFpuDisable()
+{
+    CpuWriteCr0 (CpuReadCr0() | CPU_CR0_TS);
+}
+
+// Saves FPU state to area
+static FORCEINLINE void cpuFpuSave (void* area)
+{
+    uint32_t low = (uint32_t) cpuFpuMask;
+    uint32_t high = (uint32_t) (cpuFpuMask >> 32);
+    if (cpuFpuMode == CPU_FPU_XSAVES)
+        asm volatile (CPU_FPU_INSN ("xsaves") " (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+    else if (cpuFpuMode == CPU_FPU_XSAVEOPT)
+        asm volatile (CPU_FPU_INSN ("xsaveopt") " (%0)"
+                      :
+                      : "r"(area), "a"(low), "d"(high)
+                      : "memory");
+    else if (cpuFpuMode == CPU_FPU_XSAVE)
+        asm volatile (CPU_FPU_INSN ("xsave") " (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+    else
+        asm volatile (CPU_FPU_INSN ("fxsave") " (%0)" : : "r"(area) : "memory");
+}
+
+// Loads FPU state from area
+static FORCEINLINE void cpuFpuRestore (void* area)
+{
+    uint32_t low = (uint32_t) cpuFpuMask;
+    uint32_t high = (uint32_t) (cpuFpuMask >> 32);
+    if (cpuFpuMode == CPU_FPU_XSAVES)
+        asm volatile (CPU_FPU_INSN ("xrstors") " (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+    else if (cpuFpuMode >= CPU_FPU_XSAVE)
+        asm volatile (CPU_FPU_INSN ("xrstor") " (%0)" : : "r"(area), "a"(low), "d"(high) : "memory");
+    else
+        asm volatile (CPU_FPU_INSN ("fxrstor") " (%0)" : : "r"(area) : "memory");
+}
+
+// Loads thread's state into the registers of this CPU
+static FORCEINLINE void cpuFpuLoad (NkCcb_t* ccb, NkThread_t* thread)
+{
+    cpuFpuEnable();
+    cpuFpuRestore (thread->cpuThread.fpuArea);
+    ccb->archCcb.fpuOwner = thread;
+    thread->cpuThread.fpuCpu = ccb;
+}
+
+// Picks how state gets saved and sets up the initial state
+static void cpuFpuSetup()
+{
+    uint64_t features = CpuGetFeatures();
+    CpuCpuid_t cpuid;
+    if (features & CPU_FEATURE_XSAVE)
+    {
+        // Size of the standard format is reported for what's in XCR0, which is set by now
+        CpuCpuid (0xD, 0, &cpuid);
+        cpuFpuSz = cpuid.ebx;
+        cpuFpuMode = CPU_FPU_XSAVE;
+        if (features & CPU_FEATURE_XSAVEOPT)
+            cpuFpuMode = CPU_FPU_XSAVEOPT;
+        if (features & CPU_FEATURE_XSAVES)
+        {
+            // The compacted format leaves out gaps for components we don't use
+            CpuCpuid (0xD, 1, &cpuid);
+            cpuFpuSz = cpuid.ebx;
+            cpuFpuMode = CPU_FPU_XSAVES;
+            uint64_t xcomp = CPU_FPU_XCOMP_COMPACT | cpuFpuMask;
+            memcpy (cpuFpuInitArea + CPU_FPU_XCOMP_OFF, &xcomp, sizeof (uint64_t));
+        }
+    }
+    else
+    {
+        cpuFpuSz = CPU_FPU_LEGACY_SZ;
+        cpuFpuMode = CPU_FPU_FXSAVE;
+    }
+    uint16_t fcw = CPU_FPU_FCW_INIT;
+    uint32_t mxcsr = CPU_FPU_MXCSR_INIT;
+    memcpy (cpuFpuInitArea + CPU_FPU_FCW_OFF, &fcw, sizeof (uint16_t));
+    memcpy (cpuFpuInitArea + CPU_FPU_MXCSR_OFF, &mxcsr, sizeof (uint32_t));
+    cpuFpuLazy = NkReadArg ("-fpulazy") != NULL;
+    cpuFpuCache = MmCacheCreate (cpuFpuSz, "CpuFpuArea", MM_TAG_CPU, CPU_FPU_ALIGN, 0);
+    assert (cpuFpuCache);
+    NkLogDebug ("nexke: FPU state is %lu bytes, components %#llX, %s restore\n",
+                (unsigned long) cpuFpuSz,
+                (unsigned long long) cpuFpuMask,
+                (cpuFpuLazy) ? "lazy" : "eager");
+}
+
+// Sets up the FPU and SIMD state of this CPU
+void CpuInitFpu()
+{
+    CpuGetCcb()->archCcb.fpuOwner = NULL;
+    uint64_t features = CpuGetFeatures();
+    if (!(features & CPU_FEATURE_FXSR))
+        return;
+    // Report FPU errors through exceptions, and let FPU instructions run
+    uintptr_t cr0 = CpuReadCr0();
+    cr0 |= (CPU_CR0_MP | CPU_CR0_NE);
+    cr0 &= ~(CPU_CR0_EM | CPU_CR0_TS);
+    CpuWriteCr0 (cr0);
+    if (features & CPU_FEATURE_XSAVE)
+    {
+        CpuWriteCr4 (CpuReadCr4() | CPU_CR4_OSXSAVE);
+        if (!cpuFpuMask)
+        {
+            CpuCpuid_t cpuid;
+            CpuCpuid (0xD, 0, &cpuid);
+            cpuFpuMask = (((uint64_t) cpuid.edx << 32) | cpuid.eax) & CPU_XCR0_KNOWN;
+        }
+        cpuWriteXcr0 (cpuFpuMask);
+        // No supervisor components are used
+        if (features & CPU_FEATURE_XSAVES)
+            CpuWrmsr (CPU_XSS_MSR, 0);
+    }
+    // Every CPU is like the BSP, so only it needs to figure out the rest
+    if (!cpuFpuCache)
+        cpuFpuSetup();
+}
+
+// Starts a region of kernel code that uses FPU or SIMD registers
+bool CpuBeginSimd()
+{
+    if (cpuFpuMode == CPU_FPU_NONE || CPU_IS_INT())
+        return false;
+    NkThread_t* thread = CpuGetCcb()->curThread;
+    if (!thread)
+        return false;
+    CpuThread_t* cpuThread = &thread->cpuThread;
+    if (cpuThread->simdDepth)
+    {
+        ++cpuThread->simdDepth;
+        return true;
+    }
+    if (!cpuThread->fpuArea)
+    {
+        cpuThread->fpuArea = MmCacheAlloc (cpuFpuCache);
+        if (!cpuThread->fpuArea)
+            return false;
+        // XRSTOR faults on a header with junk in it
+        memset (cpuThread->fpuArea, 0, cpuFpuSz);
+    }
+    // Whoever had the registers before saved them when they were switched out, so we can
+    // start from a clean state
+    TskDisablePreempt();
+    NkCcb_t* ccb = CpuGetCcb();
+    cpuFpuEnable();
+    cpuFpuRestore (cpuFpuInitArea);
+    ccb->archCcb.fpuOwner = thread;
+    cpuThread->fpuCpu = ccb;
+    cpuThread->simdDepth = 1;
+    TskEnablePreempt();
+    return true;
+}
+
+// Ends a SIMD region
+void CpuEndSimd()
+{
+    CpuThread_t* cpuThread = &CpuGetCcb()->curThread->cpuThread;
+    assert (cpuThread->simdDepth);
+    --cpuThread->simdDepth;
+}
+
+// Saves or hands off CPU state that isn't part of the context, before switching threads
+void CpuSwitchState (NkThread_t* oldThread, NkThread_t* newThread)
+{
+    if (cpuFpuMode == CPU_FPU_NONE)
+        return;
+    NkCcb_t* ccb = CpuGetCcb();
+    // Save the registers if they hold the state of a region the old thread is in
+    if (oldThread->cpuThread.simdDepth && ccb->archCcb.fpuOwner == oldThread)
+        cpuFpuSave (oldThread->cpuThread.fpuArea);
+    CpuThread_t* newCpuThread = &newThread->cpuThread;
+    if (!newCpuThread->simdDepth)
+        return;
+    if (ccb->archCcb.fpuOwner == newThread && newCpuThread->fpuCpu == ccb)
+        cpuFpuEnable();    // Nobody has touched the registers since it last ran here
+    else if (cpuFpuLazy)
+        cpuFpuDisable();    // The #NM handler loads them if it actually uses them
+    else
+        cpuFpuLoad (ccb, newThread);
+}
+
+// #NM handler, which loads the state of a thread in a SIMD region
+bool CpuFpuTrap (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    NkThread_t* thread = ccb->curThread;
+    // Anything else using the FPU is a bug
+    if (cpuFpuMode == CPU_FPU_NONE || !thread || !thread->cpuThread.simdDepth)
+        return false;
+    cpuFpuLoad (ccb, thread);
+    return true;
+}
+
+// Sets up CPU specific part of a thread
+void CpuInitThread (NkThread_t* thread)
+{
+    thread->cpuThread.fpuArea = NULL;
+    thread->cpuThread.simdDepth = 0;
+    thread->cpuThread.fpuCpu = NULL;
+}
+
+// Destroys CPU specific part of a thread
+void CpuDestroyThread (NkThread_t* thread)
+{
+    if (thread->cpuThread.fpuArea)
+        MmCacheFree (cpuFpuCache, thread->cpuThread.fpuArea);
+    thread->cpuThread.fpuArea = NULL;
+}
@@ -0,0 +1,94 @@
+/*
+    idle.c - contains x86 idle states
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+
+// MWAIT takes a hint of the C-state to enter, made of the C-state minus one and a sub-state
+// CPUID leaf 5 says how many sub-states each C-state has, but not how long they take to get out
+// of. That's in ACPI's _CST, which needs an AML interpreter to read, so these are conservative
+// numbers for each C-state instead
+// Without MONITOR, HLT is all we get
+
+// 05h ECX
+#define CPUID_MWAIT_EXT      (1 << 0)    // Sub-states are enumerated in EDX
+#define CPUID_MWAIT_INTBREAK (1 << 1)    // Interrupts break MWAIT while disabled
+
+// MWAIT ECX
+#define CPU_MWAIT_INTBREAK (1 << 0)
+
+// Hint meaning HLT
+#define CPU_IDLE_HLT 0xFFFFFFFF
+
+// Deepest C-state CPUID describes
+#define CPU_CSTATE_MAX 7
+
+static const CpuIdleState_t cpuCStates[CPU_CSTATE_MAX] = {
+    {"C1", 2000, 2000, 0x00, true},
+    {"C2", 20000, 80000, 0x10, true},
+    {"C3", 80000, 200000, 0x20, true},
+    {"C4", 100000, 400000, 0x30, true},
+    {"C5", 120000, 500000, 0x40, true},
+    {"C6", 150000, 600000, 0x50, true},
+    {"C7", 200000, 800000, 0x60, true},
+};
+
+// Gets the idle states of this CPU
+int CpuInitIdle (CpuIdleState_t* states)
+{
+    uint64_t features = CpuGetFeatures();
+    CpuCpuid_t cpuid;
+    CpuCpuid (0, 0, &cpuid);
+    if (!(features & CPU_FEATURE_MONITOR) || cpuid.eax < 5 || NkReadArg ("-nomwait"))
+        goto hlt;
+    CpuCpuid (5, 0, &cpuid);
+    // We idle with interrupts disabled so that a wakeup can't slip in before MWAIT
+    if (!(cpuid.ecx & CPUID_MWAIT_EXT) || !(cpuid.ecx & CPUID_MWAIT_INTBREAK))
+        goto hlt;
+    int numStates = 0;
+    states[numStates++] = cpuCStates[0];
+    // The local APIC timer stops in deeper states unless it's always running
+    if (!(features & CPU_FEATURE_ARAT) && PltGetPlatform()->timer->type == PLT_TIMER_APIC)
+        return numStates;
+    for (int i = 1; i < CPU_CSTATE_MAX && numStates < CPU_IDLE_MAX; ++i)
+    {
+        // EDX has 4 bits for each C-state, starting at C0
+        if ((cpuid.edx >> ((i + 1) * 4)) & 0xF)
+            states[numStates++] = cpuCStates[i];
+    }
+    return numStates;
+hlt:
+    states[0] = (CpuIdleState_t) {"HLT", 2000, 2000, CPU_IDLE_HLT, false};
+    return 1;
+}
+
+// Idles in state
+void CpuIdle (const CpuIdleState_t* state, long* wake)
+{
+    if (state->hint == CPU_IDLE_HLT)
+    {
+        // STI holds off interrupts until after the next instruction, so one can't come in first
+        asm volatile ("sti; hlt; cli" : : : "memory");
+        return;
+    }
+    asm volatile ("monitor" : : "a"(wake), "c"(0), "d"(0) : "memory");
+    // We might have been woken before the monitor was armed
+    if (!*(volatile long*) wake)
+        return;
+    asm volatile ("mwait" : : "a"(state->hint), "c"(CPU_MWAIT_INTBREAK) : "memory");
+}
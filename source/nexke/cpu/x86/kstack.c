@@ -0,0 +1,174 @@
+/*
+    kstack.c - contains kernel stack allocator
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/cpu.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/task.h>
+
+// Kernel stacks are a KV region with a guard page on either side
+// Setting one up means allocating KVA, adding the guards, and faulting in the stack, and tearing
+// it down means unmapping it all again. So freed stacks go in a cache in the CCB, and are handed
+// back out as is. Each cached stack holds the link to the next one in its first word
+// Stacks are filled with a poison word when they're made, so how deep a thread went can be found
+// by looking for the first word that isn't poison. Freeing a stack poisons what was used again,
+// so the watermark starts over with the next thread
+
+#define CPU_KSTACK_POISON ((uintptr_t) 0x57AC57AC57AC57ACULL)
+
+// Sizes of each class of stack, not including guards
+static const size_t cpuKstackSizes[] = {CPU_KSTACK_SZ, CPU_KSTACK_SMALL_SZ};
+
+// Fills sz bytes of a stack at mem with poison
+static void cpuPoisonKstack (void* mem, size_t sz)
+{
+    uintptr_t* word = mem;
+    for (size_t i = 0; i < (sz / sizeof (uintptr_t)); ++i)
+        word[i] = CPU_KSTACK_POISON;
+}
+
+// Creates a new kernel stack
+static void* cpuCreateKstack (int stackClass)
+{
+    size_t numPages = cpuKstackSizes[stackClass] >> NEXKE_CPU_PAGE_SHIFT;
+    // Allocate it
+    void* stack = MmAllocKvRegion (numPages + 2, 0);
+    if (!stack)
+        return NULL;
+    // Create two guard pages
+    MmPage_t* guard1 = MmAllocGuardPage();
+    MmPage_t* guard2 = MmAllocGuardPage();
+    if (!guard1 || !guard2)
+    {
+        if (guard1)
+            MmFreePage (guard1);
+        if (guard2)
+            MmFreePage (guard2);
+        MmFreeKvRegion (stack);
+        return NULL;
+    }
+    // Add them
+    MmObject_t* kobj = MmGetKernelObject();
+    MmAddPage (kobj, (size_t) stack - MmGetKernelSpace()->startAddr, guard1);
+    uintptr_t stackEnd = (cpuKstackSizes[stackClass] + NEXKE_CPU_PAGESZ) + (uintptr_t) stack;
+    MmAddPage (kobj, stackEnd - MmGetKernelSpace()->startAddr, guard2);
+    stack += NEXKE_CPU_PAGESZ;    // Skip to non-guard page
+    // Poisoning it faults it in now, so new threads don't start off taking faults on it
+    cpuPoisonKstack (stack, cpuKstackSizes[stackClass]);
+    return stack;
+}
+
+// Destroys a kernel stack
+static void cpuDestroyKstack (void* stack)
+{
+    // Free region taking into account guard page
+    MmFreeKvRegion (stack - NEXKE_CPU_PAGESZ);
+}
+
+// Allocates a kernel stack
+void* CpuAllocKstack (int stackClass)
+{
+    assert (stackClass < CPU_KSTACK_CLASSES);
+    TskDisablePreempt();
+    NkCcb_t* ccb = CpuGetCcb();
+    void* stack = ccb->archCcb.kstackCache[stackClass];
+    if (stack)
+    {
+        ccb->archCcb.kstackCache[stackClass] = *((void**) stack);
+        --ccb->archCcb.kstackCount[stackClass];
+        TskEnablePreempt();
+        // Put back the word the link was in
+        *((uintptr_t*) stack) = CPU_KSTACK_POISON;
+        return stack;
+    }
+    TskEnablePreempt();
+    return cpuCreateKstack (stackClass);
+}
+
+// Frees a kernel stack
+void CpuFreeKstack (void* stack, int stackClass)
+{
+    // Poison what the last thread used
+    size_t sz = cpuKstackSizes[stackClass];
+    size_t used = CpuGetKstackPeak (stack, stackClass);
+    cpuPoisonKstack (stack + (sz - used), used);
+    TskDisablePreempt();
+    NkCcb_t* ccb = CpuGetCcb();
+    if (ccb->archCcb.kstackCount[stackClass] < CPU_KSTACK_CACHE_MAX)
+    {
+        *((void**) stack) = ccb->archCcb.kstackCache[stackClass];
+        ccb->archCcb.kstackCache[stackClass] = stack;
+        ++ccb->archCcb.kstackCount[stackClass];
+        TskEnablePreempt();
+        return;
+    }
+    TskEnablePreempt();
+    cpuDestroyKstack (stack);
+}
+
+// Gets how much of a kernel stack has been used since it was allocated
+size_t CpuGetKstackPeak (void* stack, int stackClass)
+{
+    // Stacks grow down, so the deepest point is the lowest word that isn't poison
+    size_t sz = cpuKstackSizes[stackClass];
+    uintptr_t* word = stack;
+    size_t i = 0;
+    while (i < (sz / sizeof (uintptr_t)) && word[i] == CPU_KSTACK_POISON)
+        ++i;
+    return sz - (i * sizeof (uintptr_t));
+}
+
+// Gets the size of stacks of stackClass
+size_t CpuGetStackSize (int stackClass)
+{
+    return cpuKstackSizes[stackClass];
+}
+
+// Destroys this CPU's cached stacks
+static size_t cpuKstackShrink (size_t target)
+{
+    size_t freed = 0;
+    for (int i = 0; i < CPU_KSTACK_CLASSES && freed < target; ++i)
+    {
+        while (freed < target)
+        {
+            TskDisablePreempt();
+            NkCcb_t* ccb = CpuGetCcb();
+            void* stack = ccb->archCcb.kstackCache[i];
+            if (!stack)
+            {
+                TskEnablePreempt();
+                break;
+            }
+            ccb->archCcb.kstackCache[i] = *((void**) stack);
+            --ccb->archCcb.kstackCount[i];
+            TskEnablePreempt();
+            cpuDestroyKstack (stack);
+            freed += cpuKstackSizes[i] >> NEXKE_CPU_PAGE_SHIFT;
+        }
+    }
+    return freed;
+}
+
+static MmShrinker_t cpuKstackShrinker = {.name = "kernel stack cache", .shrink = cpuKstackShrink};
+
+// Sets up kernel stack cache
+void CpuInitKstack()
+{
+    MmRegisterShrinker (&cpuKstackShrinker);
+}
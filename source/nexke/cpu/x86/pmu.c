@@ -0,0 +1,143 @@
+/*
+    pmu.c - contains performance counter driver
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/platform/pc.h>
+
+// This drives the architectural performance counters that CPUID leaf 0xA describes
+// General purpose counter 0 counts unhalted core cycles, starting at -period so that it overflows
+// after period of them. The LAPIC delivers the overflow as an NMI, so that code running with
+// interrupts disabled gets sampled too
+
+#define CPU_PMU_LEAF 0xA
+
+// MSRs
+#define CPU_MSR_PMC0          0xC1
+#define CPU_MSR_PERFEVTSEL0   0x186
+#define CPU_MSR_GLOBAL_STATUS 0x38E
+#define CPU_MSR_GLOBAL_CTRL   0x38F
+#define CPU_MSR_GLOBAL_OVF    0x390
+
+// PERFEVTSEL bits
+#define CPU_EVTSEL_USR (1 << 16)
+#define CPU_EVTSEL_OS  (1 << 17)
+#define CPU_EVTSEL_INT (1 << 20)
+#define CPU_EVTSEL_EN  (1 << 22)
+
+// Unhalted core cycles event
+#define CPU_EVT_CYCLES 0x3C
+
+// PMC0's bit in the global registers
+#define CPU_PMU_PMC0 (1 << 0)
+
+// Writes to PMC0 are sign extended from bit 31
+#define CPU_PMU_MAX_PERIOD INT32_MAX
+
+static int pmuVersion = 0;        // Architectural PMU version, 0 if there's none
+static int pmuWidth = 0;          // Bits in a counter
+static uint64_t pmuPeriod = 0;    // Cycles between samples
+
+// Starts counter over
+static inline void cpuPmuReload()
+{
+    CpuWrmsr (CPU_MSR_PMC0, (uint32_t) -pmuPeriod);
+}
+
+// Checks if PMC0 overflowed
+static inline bool cpuPmuOverflowed()
+{
+    if (pmuVersion >= 2)
+        return CpuRdmsr (CPU_MSR_GLOBAL_STATUS) & CPU_PMU_PMC0;
+    // Without a status register, a counter that's wrapped has its top bit clear
+    return !(CpuRdmsr (CPU_MSR_PMC0) & (1ULL << (pmuWidth - 1)));
+}
+
+// NMI handler
+bool CpuPmuNmi (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    if (!pmuVersion || !cpuPmuOverflowed())
+        return false;
+#ifdef __x86_64__
+    bool sampling = NkProfSample (ctx->rip, ctx->rsp, ctx->cs & 3);
+#else
+    // ESP only gets pushed when coming from user mode
+    bool user = ctx->cs & 3;
+    uintptr_t sp = (user) ? ctx->esp : (uintptr_t) &ctx->esp;
+    bool sampling = NkProfSample (ctx->eip, sp, user);
+#endif
+    if (!sampling)
+    {
+        CpuStopPmu();
+        return true;
+    }
+    cpuPmuReload();
+    if (pmuVersion >= 2)
+        CpuWrmsr (CPU_MSR_GLOBAL_OVF, CPU_PMU_PMC0);
+    PltApicArmPmi();
+    return true;
+}
+
+// Sets up performance counters
+bool CpuInitPmu (uint64_t period)
+{
+    CpuCpuid_t cpuid = {0};
+    CpuCpuid (0, 0, &cpuid);
+    if (cpuid.eax < CPU_PMU_LEAF)
+        return false;
+    CpuCpuid (CPU_PMU_LEAF, 0, &cpuid);
+    int version = cpuid.eax & 0xFF;
+    int numCounters = (cpuid.eax >> 8) & 0xFF;
+    int numEvents = (cpuid.eax >> 24) & 0xFF;
+    // A set bit in EBX means that event isn't there
+    if (!version || !numCounters || !numEvents || (cpuid.ebx & 1))
+        return false;
+    if (!PltApicArmPmi())
+        return false;
+    pmuWidth = (cpuid.eax >> 16) & 0xFF;
+    pmuPeriod = (period > CPU_PMU_MAX_PERIOD) ? CPU_PMU_MAX_PERIOD : period;
+    pmuVersion = version;
+    NkLogDebug ("nexke: using architectural PMU version %d, %d counters\n", version, numCounters);
+    return true;
+}
+
+// Starts performance counters of this CPU
+void CpuStartPmu()
+{
+    if (!pmuVersion || !PltApicArmPmi())
+        return;
+    CpuWrmsr (CPU_MSR_PERFEVTSEL0, 0);
+    cpuPmuReload();
+    if (pmuVersion >= 2)
+    {
+        CpuWrmsr (CPU_MSR_GLOBAL_OVF, CPU_PMU_PMC0);
+        CpuWrmsr (CPU_MSR_GLOBAL_CTRL, CpuRdmsr (CPU_MSR_GLOBAL_CTRL) | CPU_PMU_PMC0);
+    }
+    CpuWrmsr (CPU_MSR_PERFEVTSEL0,
+              CPU_EVT_CYCLES | CPU_EVTSEL_USR | CPU_EVTSEL_OS | CPU_EVTSEL_INT | CPU_EVTSEL_EN);
+}
+
+// Stops performance counters of this CPU
+void CpuStopPmu()
+{
+    if (!pmuVersion)
+        return;
+    CpuWrmsr (CPU_MSR_PERFEVTSEL0, 0);
+    if (pmuVersion >= 2)
+        CpuWrmsr (CPU_MSR_GLOBAL_OVF, CPU_PMU_PMC0);
+}
@@ -0,0 +1,212 @@
+/*
+    string.c - contains x86 memory copy routines
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <stdint.h>
+#include <string.h>
+
+// These take the place of libk's generic versions
+// CPUs with ERMS get REP MOVSB / STOSB patched in at boot. Until then, and on other CPUs, word
+// sized string instructions are used, which work on anything
+
+// Word sized string instructions
+#ifdef __x86_64__
+#define CPU_STRING_MOVS  "movsq"
+#define CPU_STRING_STOS  "stosq"
+#define CPU_STRING_SHIFT "3"
+#define CPU_STRING_MASK  "7"
+#else
+#define CPU_STRING_MOVS  "movsl"
+#define CPU_STRING_STOS  "stosl"
+#define CPU_STRING_SHIFT "2"
+#define CPU_STRING_MASK  "3"
+#endif
+
+#define CPU_STRING_WORD sizeof (uintptr_t)
+
+// Copies at least this big bypass the cache
+// Anything smaller is likely to be used soon, and fits in the cache anyway
+#define CPU_STRING_NT_MIN 0x10000
+
+// Width of one iteration of the AVX2 copy loop
+#define CPU_STRING_AVX_BLOCK 128
+#define CPU_STRING_AVX_ALIGN 32
+
+static bool cpuStringAvx2 = false;    // Whether big copies use AVX2
+
+// Copies with string instructions
+static FORCEINLINE void* cpuMemcpyRep (void* dest, const void* src, size_t n)
+{
+    void* d = dest;
+    size_t tmp;
+    asm volatile (CPU_ALTERNATIVE ("mov %[n], %[tmp]\n\t"
+                                   "shr $" CPU_STRING_SHIFT ", %[n]\n\t"
+                                   "rep " CPU_STRING_MOVS "\n\t"
+                                   "mov %[tmp], %[n]\n\t"
+                                   "and $" CPU_STRING_MASK ", %[n]\n\t"
+                                   "rep movsb",
+                                   "rep movsb")
+                  : "+D"(d), "+S"(src), [n] "+c"(n), [tmp] "=&r"(tmp)
+                  : CPU_ALT_FEATURE (CPU_FEATURE_ERMS)
+                  : "memory", "cc");
+    return dest;
+}
+
+#ifdef __x86_64__
+// Copies big buffers with AVX2 and non-temporal stores, so they don't flush out the cache
+static void* cpuMemcpyAvx2 (void* dest, const void* src, size_t n)
+{
+    if (!CpuBeginSimd())
+        return cpuMemcpyRep (dest, src, n);
+    uint8_t* d = dest;
+    const uint8_t* s = src;
+    // Stores have to be aligned
+    size_t head = -(uintptr_t) d & (CPU_STRING_AVX_ALIGN - 1);
+    cpuMemcpyRep (d, s, head);
+    d += head, s += head, n -= head;
+    size_t blocks = n / CPU_STRING_AVX_BLOCK;
+    asm volatile ("1:\n"
+                  "vmovdqu (%[s]), %%ymm0\n"
+                  "vmovdqu 32(%[s]), %%ymm1\n"
+                  "vmovdqu 64(%[s]), %%ymm2\n"
+                  "vmovdqu 96(%[s]), %%ymm3\n"
+                  "vmovntdq %%ymm0, (%[d])\n"
+                  "vmovntdq %%ymm1, 32(%[d])\n"
+                  "vmovntdq %%ymm2, 64(%[d])\n"
+                  "vmovntdq %%ymm3, 96(%[d])\n"
+                  "add $128, %[s]\n"
+                  "add $128, %[d]\n"
+                  "dec %[cnt]\n"
+                  "jnz 1b\n"
+                  "sfence\n"
+                  "vzeroupper"
+                  : [d] "+r"(d), [s] "+r"(s), [cnt] "+r"(blocks)
+                  :
+                  : "memory", "cc");
+    CpuEndSimd();
+    cpuMemcpyRep (d, s, n % CPU_STRING_AVX_BLOCK);
+    return dest;
+}
+#endif
+
+// Fills with string instructions
+static FORCEINLINE void* cpuMemsetRep (void* str, int ch, size_t n)
+{
+    void* s = str;
+    uintptr_t val = ((uintptr_t) -1 / 0xFF) * (uint8_t) ch;
+    size_t tmp;
+    asm volatile (CPU_ALTERNATIVE ("mov %[n], %[tmp]\n\t"
+                                   "shr $" CPU_STRING_SHIFT ", %[n]\n\t"
+                                   "rep " CPU_STRING_STOS "\n\t"
+                                   "mov %[tmp], %[n]\n\t"
+                                   "and $" CPU_STRING_MASK ", %[n]\n\t"
+                                   "rep stosb",
+                                   "rep stosb")
+                  : "+D"(s), [n] "+c"(n), [tmp] "=&r"(tmp)
+                  : "a"(val), CPU_ALT_FEATURE (CPU_FEATURE_ERMS)
+                  : "memory", "cc");
+    return str;
+}
+
+#ifdef __x86_64__
+// Fills big buffers with non-temporal stores
+// MOVNTI works on general purpose registers, so no SIMD region is needed, which matters since
+// this gets called by the page allocator
+static void* cpuMemsetNt (void* str, int ch, size_t n)
+{
+    uint8_t* s = str;
+    uint64_t val = 0x0101010101010101ULL * (uint8_t) ch;
+    size_t head = -(uintptr_t) s & (CPU_STRING_WORD - 1);
+    cpuMemsetRep (s, ch, head);
+    s += head, n -= head;
+    size_t words = n / CPU_STRING_WORD;
+    asm volatile ("1:\n"
+                  "movnti %[val], (%[s])\n"
+                  "add $8, %[s]\n"
+                  "dec %[cnt]\n"
+                  "jnz 1b\n"
+                  "sfence"
+                  : [s] "+r"(s), [cnt] "+r"(words)
+                  : [val] "r"(val)
+                  : "memory", "cc");
+    cpuMemsetRep (s, ch, n % CPU_STRING_WORD);
+    return str;
+}
+#endif
+
+void* memcpy (void* restrict dest, const void* restrict src, size_t n)
+{
+#ifdef __x86_64__
+    if (n >= CPU_STRING_NT_MIN && cpuStringAvx2)
+        return cpuMemcpyAvx2 (dest, src, n);
+#endif
+    return cpuMemcpyRep (dest, src, n);
+}
+
+void* memset (void* str, int ch, size_t n)
+{
+#ifdef __x86_64__
+    if (n >= CPU_STRING_NT_MIN)
+        return cpuMemsetNt (str, ch, n);
+#endif
+    return cpuMemsetRep (str, ch, n);
+}
+
+void* memmove (void* dest, const void* src, size_t n)
+{
+    // A forward copy is fine unless the destination overlaps the end of the source
+    if ((uintptr_t) dest - (uintptr_t) src >= n)
+        return cpuMemcpyRep (dest, src, n);
+    // Copy backwards, the end bytes first and then the words
+    uint8_t* d = (uint8_t*) dest + n - 1;
+    const uint8_t* s = (const uint8_t*) src + n - 1;
+    size_t words = n / CPU_STRING_WORD;
+    size_t rem = n % CPU_STRING_WORD;
+    asm volatile ("std\n"
+                  "rep movsb\n"
+                  "sub %[adj], %[d]\n"
+                  "sub %[adj], %[s]\n"
+                  "mov %[words], %[cnt]\n"
+                  "rep " CPU_STRING_MOVS "\n"
+                  "cld"
+                  : [d] "+D"(d), [s] "+S"(s), [cnt] "+c"(rem)
+                  : [words] "r"(words), [adj] "i"(CPU_STRING_WORD - 1)
+                  : "memory", "cc");
+    return dest;
+}
+
+// Picks memory copy routines for this CPU's features
+void CpuInitString()
+{
+#ifdef __x86_64__
+    // CpuInitFpu has set up XCR0 by now, so this tells us if AVX state is enabled
+    uint64_t features = CpuGetFeatures();
+    if ((features & CPU_FEATURE_AVX2) && (features & CPU_FEATURE_XSAVE) &&
+        (CpuReadCr4() & CPU_CR4_OSXSAVE))
+    {
+        uint32_t low, high;
+        asm volatile ("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+        // SSE and AVX state both have to be on
+        if ((low & 6) == 6)
+            cpuStringAvx2 = true;
+    }
+#endif
+    NkLogDebug ("nexke: using %s memcpy%s\n",
+                (CpuGetFeatures() & CPU_FEATURE_ERMS) ? "ERMS" : "word",
+                (cpuStringAvx2) ? " with AVX2 for big copies" : "");
+}
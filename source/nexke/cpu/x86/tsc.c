@@ -22,7 +22,30 @@
 
 extern PltHwClock_t tscClock;
 
-int tscDivisor = 0;    // Value to divide/multply by for beyond nanosec precision
+// TSC count is turned into ns as (count * tscMult) >> tscShift, so reading the clock doesn't need
+// a divide
+static uint32_t tscMult = 0;
+static int tscShift = 0;
+
+// Same for going from ns to a TSC count
+static uint32_t tscInvMult = 0;
+static int tscInvShift = 0;
+
+// How long each calibration run takes, and how many we do
+#define CPU_TSC_CAL_TIME (PLT_NS_IN_SEC / 100)    // 10 ms
+#define CPU_TSC_CAL_RUNS 3
+
+// Number of round trips used to compare TSCs of two CPUs
+#define CPU_TSC_SYNC_ROUNDS 64
+
+// State of TSC sync between a starting CPU and the one starting it
+static volatile int tscSyncStep = 0;
+static volatile ktime_t tscSyncVal = 0;
+
+// Offsets that have to be added to TSCs of CPUs to match the BSP
+// Only used if firmware didn't get them in sync
+static int64_t tscOffsets[NEXKE_MAX_CPUS] = {0};
+static bool tscHasOffsets = false;
 
 // Reads TSC
 static inline ktime_t cpuTscRead()
@@ -32,37 +55,147 @@ static inline ktime_t cpuTscRead()
     return ((ktime_t) high << 32) | low;
 }
 
+// Multiplies val by a 32 bit fixed point number
+static inline ktime_t cpuTscScale (ktime_t val, uint32_t mult, int shift)
+{
+    // Split the multiply so it can't overflow
+    ktime_t high = ((val >> 32) * mult) << (32 - shift);
+    ktime_t low = ((val & 0xFFFFFFFF) * mult) >> shift;
+    return high + low;
+}
+
 // Converts from timestamp to ns
 static inline ktime_t cpuFromTsc (ktime_t time)
 {
-    if (tscClock.precision == 1)
-        return time / tscDivisor;
-    return time * tscClock.precision;
+    return cpuTscScale (time, tscMult, tscShift);
 }
 
-// Converts ns to timestamp
-static inline ktime_t cpuToTsc (ktime_t time)
+// Gets the TSC count delta ns from now on this CPU
+ktime_t CpuTscDeadline (ktime_t delta)
 {
-    if (tscClock.precision == 1)
-        return time * tscDivisor;
-    return time / tscClock.precision;
+    return cpuTscRead() + cpuTscScale (delta, tscInvMult, tscInvShift);
+}
+
+// Finds a 32 bit fixed point factor for multiplying by num / denom
+static void cpuTscGetFactor (ktime_t num, ktime_t denom, uint32_t* mult, int* shift)
+{
+    // Take the biggest shift that keeps the multiplier in 32 bits, without overflowing num
+    int s = 32;
+    while (s && ((num >> (64 - s)) || ((num << s) / denom) > UINT32_MAX))
+        --s;
+    *mult = (num << s) / denom;
+    *shift = s;
 }
 
 // Gets time on clock
 static ktime_t CpuTscGetTime()
 {
-    return cpuFromTsc (cpuTscRead());
+    ktime_t tsc = cpuTscRead();
+    if (tscHasOffsets)
+        tsc += tscOffsets[CpuGetCcb()->cpuNum];
+    return cpuFromTsc (tsc);
+}
+
+// Waits in C0.1 until the TSC reaches deadline, or something wakes us up before
+// TPAUSE is encoded by hand, as older assemblers don't know it
+static inline void cpuTscPause (ktime_t deadline)
+{
+    asm volatile (".byte 0x66, 0x0f, 0xae, 0xf1"    // tpause %ecx
+                  :
+                  : "c"(1), "a"((uint32_t) deadline), "d"((uint32_t) (deadline >> 32))
+                  : "cc", "memory");
 }
 
 // Poll for number of ns
+// This goes by the raw TSC of this CPU, so the caller has to keep us from migrating
 static void CpuTscPoll (ktime_t time)
 {
-    ktime_t target = time + cpuFromTsc (cpuTscRead());
-    while (target > cpuFromTsc (cpuTscRead()))
-        ;
+    ktime_t target = CpuTscDeadline (time);
+    bool waitPkg = CpuGetCcb()->archCcb.features & CPU_FEATURE_WAITPKG;
+    while (cpuTscRead() < target)
+    {
+        // TPAUSE gives up early if it hits the limit the OS set in IA32_UMWAIT_CONTROL, or on
+        // interrupts, so check again either way
+        if (waitPkg)
+            cpuTscPause (target);
+        else
+            CpuSpin();
+    }
+}
+
+// Compares TSC of a starting CPU with ours
+// The starting CPU reads its TSC, asks us for ours, and reads its own again when it gets it back.
+// Ours was read somewhere between the two, so the round trip that took the shortest gives the
+// best guess of how far off it is
+static void CpuTscSyncCpu (NkCcb_t* ccb)
+{
+    if (ccb != CpuGetCcb())
+    {
+        // We're the one starting it, just answer
+        for (int i = 0; i < CPU_TSC_SYNC_ROUNDS; ++i)
+        {
+            while (__atomic_load_n (&tscSyncStep, __ATOMIC_ACQUIRE) != (i * 2) + 1)
+                CpuSpin();
+            tscSyncVal = cpuTscRead();
+            __atomic_store_n (&tscSyncStep, (i * 2) + 2, __ATOMIC_RELEASE);
+        }
+        // Wait for it to be done, so the next CPU starts from the beginning
+        while (__atomic_load_n (&tscSyncStep, __ATOMIC_ACQUIRE))
+            CpuSpin();
+        return;
+    }
+    ktime_t bestRtt = UINT64_MAX;
+    int64_t offset = 0;
+    for (int i = 0; i < CPU_TSC_SYNC_ROUNDS; ++i)
+    {
+        ktime_t start = cpuTscRead();
+        __atomic_store_n (&tscSyncStep, (i * 2) + 1, __ATOMIC_RELEASE);
+        while (__atomic_load_n (&tscSyncStep, __ATOMIC_ACQUIRE) != (i * 2) + 2)
+            CpuSpin();
+        ktime_t end = cpuTscRead();
+        ktime_t rtt = end - start;
+        if (rtt < bestRtt)
+        {
+            bestRtt = rtt;
+            offset = (int64_t) (tscSyncVal - (start + (rtt / 2)));
+        }
+    }
+    __atomic_store_n (&tscSyncStep, 0, __ATOMIC_RELEASE);
+    // Anything within the round trip could just be noise
+    if ((offset < 0 ? -offset : offset) <= (int64_t) bestRtt)
+        return;
+    NkLogWarning ("nexke: warning: TSC of CPU %d is off by %lld cycles, compensating\n",
+                  ccb->cpuNum,
+                  (long long) offset);
+    tscOffsets[ccb->cpuNum] = offset;
+    __atomic_store_n (&tscHasOffsets, true, __ATOMIC_RELEASE);
 }
 
-PltHwClock_t tscClock = {.type = PLT_CLOCK_TSC, .getTime = CpuTscGetTime, .poll = CpuTscPoll};
+PltHwClock_t tscClock = {.type = PLT_CLOCK_TSC,
+                         .getTime = CpuTscGetTime,
+                         .poll = CpuTscPoll,
+                         .syncCpu = CpuTscSyncCpu};
+
+// Measures TSC frequency against refClock, or the PIT if there is no clock
+static ktime_t cpuTscMeasure (PltHwClock_t* refClock)
+{
+    ktime_t start = 0, end = 0, elapsed = CPU_TSC_CAL_TIME;
+    if (refClock)
+    {
+        ktime_t refStart = refClock->getTime();
+        start = cpuTscRead();
+        refClock->poll (CPU_TSC_CAL_TIME);
+        end = cpuTscRead();
+        elapsed = refClock->getTime() - refStart;
+    }
+    else
+    {
+        start = cpuTscRead();
+        PltPitWait (CPU_TSC_CAL_TIME);
+        end = cpuTscRead();
+    }
+    return ((end - start) * PLT_NS_IN_SEC) / elapsed;
+}
 
 // Initialize TSC clock
 PltHwClock_t* CpuInitTscClock()
@@ -74,23 +207,28 @@ PltHwClock_t* CpuInitTscClock()
         return NULL;    // TSC is unsuitable for our use
     }
     // In order to set up the TSC, we need another clock source to get precision
-    // We'll use HPET, any system with an invariant TSC will basically always have an HPET
+    // Any system with an invariant TSC will basically always have an HPET, but fall back to
+    // the PIT if it doesn't
     PltHwClock_t* refClock = PltHpetInitClock();
-    // Sample TSC once
-    ktime_t start = cpuTscRead();
-    refClock->poll (PLT_NS_IN_SEC / 100);    // 10 ms
-    ktime_t end = cpuTscRead();
-    ktime_t timeHz = (end - start) * 100;
+    // Take the median of a few runs, in case one got disturbed by SMIs or the like
+    ktime_t runs[CPU_TSC_CAL_RUNS];
+    for (int i = 0; i < CPU_TSC_CAL_RUNS; ++i)
+    {
+        ktime_t hz = cpuTscMeasure (refClock);
+        int j = i;
+        for (; j > 0 && runs[j - 1] > hz; --j)
+            runs[j] = runs[j - 1];
+        runs[j] = hz;
+    }
+    ktime_t timeHz = runs[CPU_TSC_CAL_RUNS / 2];
+    if (!timeHz)
+        return NULL;
+    cpuTscGetFactor (PLT_NS_IN_SEC, timeHz, &tscMult, &tscShift);
+    cpuTscGetFactor (timeHz, PLT_NS_IN_SEC, &tscInvMult, &tscInvShift);
     int precision = PLT_NS_IN_SEC / timeHz;
     if (!precision)
         ++precision;
-    tscDivisor = timeHz / PLT_NS_IN_SEC;    // For beyond nanosec precision
-    // Compensate for some rounding loss
-    if ((timeHz % PLT_NS_IN_SEC) >= (PLT_NS_IN_SEC / 2))
-        ++tscDivisor;    // Round up then
-    if (!tscDivisor)
-        ++tscDivisor;
     tscClock.precision = precision;
-    NkLogDebug ("nexke: using TSC as clock, precision %ldns\n", tscClock.precision);
+    NkLogDebug ("nexke: using TSC as clock, frequency %llu Hz\n", (unsigned long long) timeHz);
     return &tscClock;
 }
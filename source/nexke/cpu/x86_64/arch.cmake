@@ -32,7 +32,15 @@ list(APPEND NEXKE_SOURCES
     cpu/x86_64/mul.c
     cpu/x86_64/cpu.asm
     cpu/x86_64/trap.asm
+    cpu/x86_64/trampoline.asm
+    cpu/x86/alt.c
     cpu/x86/cpuid.c
+    cpu/x86/crc32.c
     cpu/x86/exec.c
+    cpu/x86/fpu.c
+    cpu/x86/idle.c
+    cpu/x86/kstack.c
+    cpu/x86/pmu.c
+    cpu/x86/string.c
     cpu/x86/tsc.c
     mm/ptab.c)
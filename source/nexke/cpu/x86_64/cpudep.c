@@ -17,6 +17,7 @@
 
 #include <assert.h>
 #include <nexke/cpu.h>
+#include <nexke/cpu/ptab.h>
 #include <nexke/mm.h>
 #include <nexke/nexboot.h>
 #include <nexke/nexke.h>
@@ -28,6 +29,8 @@
 // deepest bowels
 static NkCcb_t ccb = {0, .preemptDisable = 1};    // The CCB
 
+NkCcb_t* CpuCurCcb NK_PERCPU = NULL;    // Each CPU's own CCB
+
 bool ccbInit = false;
 
 // The GDT
@@ -38,6 +41,29 @@ static CpuIdtEntry_t cpuIdt[CPU_IDT_MAX] = {0};
 // Segment resource
 static NkResArena_t* cpuSegs = NULL;
 
+// AP trampoline, see trampoline.asm
+extern uint8_t CpuTrampoline[];
+extern uint8_t CpuTrampData[];
+extern uint8_t CpuTrampolineEnd[];
+
+// Trampoline data block
+typedef struct _cputrampdata
+{
+    uint64_t cr3;      // Trampoline page tables
+    uint64_t cr4;      // CR4 to use while getting to long mode
+    uint64_t efer;     // EFER to enable long mode with
+    uint64_t cr0;      // CR0 to enable paging with
+    uint64_t stack;    // Stack to start kernel on
+    uint64_t ccb;      // CCB of AP
+    uint64_t entry;    // Kernel entry point
+} __attribute__ ((packed)) cpuTrampData_t;
+
+static paddr_t cpuTrampPhys = 0;                        // Physical address of trampoline
+static uint8_t* cpuTramp = NULL;                        // Trampoline mapping
+static volatile cpuTrampData_t* cpuTrampData = NULL;    // Data block of trampoline
+static uint64_t cpuApCr4 = 0;                           // CR4 APs end up with
+static uint64_t cpuApPat = 0;                           // PAT APs end up with
+
 // Sets up a GDT gate
 static void cpuSetGdtGate (CpuSegDesc_t* desc,
                            uint32_t base,
@@ -107,8 +133,9 @@ static void cpuInitGdt()
     // Load new GDT into CPU
     CpuTabPtr_t gdtr = {.base = (uintptr_t) cpuGdt, .limit = (CPU_GDT_MAX * 8) - 1};
     CpuFlushGdt (&gdtr);
-    // Set GS.base to CCB
-    CpuSetGs ((uintptr_t) &ccb);
+    // The BSP's per-CPU variables are the ones in the image, so GS.base is 0
+    CpuCurCcb = &ccb;
+    CpuSetGs (0);
 }
 
 // Sets up IDT gate
@@ -162,6 +189,7 @@ void CpuInitCcb()
     NexNixBoot_t* bootInfo = NkGetBootArgs();
     // Set up basic fields
     ccb.self = &ccb;
+    ccb.cpuNum = 0;    // BSP is always CPU 0
     ccb.cpuArch = NEXKE_CPU_X86_64;
     ccb.cpuFamily = NEXKE_CPU_FAMILY_X86;
 #ifdef NEXNIX_BOARD_PC
@@ -174,6 +202,8 @@ void CpuInitCcb()
     strcpy (ccb.sysName, bootInfo->sysName);
     // Detect CPUID features
     CpuDetectCpuid (&ccb);
+    // Now that we know if we have PAT, set it up
+    MmMulInitPat();
     // Initialize GDT
     cpuInitGdt();
     // Initialize IDT
@@ -201,6 +231,11 @@ void CpuInitCcb()
     if (CpuGetFeatures() & CPU_FEATURE_SMEP)
         cr4 |= CPU_CR4_SMEP;
     CpuWriteCr4 (cr4);
+    CpuInitFpu();
+    CpuInitString();
+    CpuInitCrc();
+    CpuInitKstack();
+    CpuApplyAlternatives();
     // Set EFER
     if (CpuGetFeatures() & CPU_FEATURE_MSR)
     {
@@ -227,40 +262,16 @@ NkCcb_t* CpuRealCcb()
     return &ccb;
 }
 
-// Allocates a kernel stack
-static void* cpuAllocKstack()
-{
-    // Allocate it
-    void* stack = MmAllocKvRegion ((CPU_KSTACK_SZ >> NEXKE_CPU_PAGE_SHIFT) + 2, 0);
-    // Create two guard pages
-    MmPage_t* guard1 = MmAllocGuardPage();
-    MmPage_t* guard2 = MmAllocGuardPage();
-    if (!guard1 || !guard2 || !stack)
-        return NULL;
-    // Add them
-    MmObject_t* kobj = MmGetKernelObject();
-    MmAddPage (kobj, (size_t) stack - MmGetKernelSpace()->startAddr, guard1);
-    uintptr_t stackEnd = (CPU_KSTACK_SZ + NEXKE_CPU_PAGESZ) + (uintptr_t) stack;
-    MmAddPage (kobj, stackEnd - MmGetKernelSpace()->startAddr, guard2);
-    return stack + NEXKE_CPU_PAGESZ;    // Return non-guard page
-}
-
-// Destroys kernel stack
-static void cpuDestroyKstack (void* stack)
-{
-    // Free region taking into account guard page
-    MmFreeKvRegion (stack - NEXKE_CPU_PAGESZ);
-}
-
 // Allocates a CPU context and intializes it
 // On x86_64, a CPU's context is it's kernel stack
-CpuContext_t* CpuAllocContext (uintptr_t entry)
+CpuContext_t* CpuAllocContext (uintptr_t entry, int stackClass)
 {
     // Allocate a stack
-    void* stack = cpuAllocKstack();
+    void* stack = CpuAllocKstack (stackClass);
     if (!stack)
         return NULL;
-    CpuContext_t* context = (CpuContext_t*) (stack + CPU_KSTACK_SZ - sizeof (CpuContext_t));
+    size_t stackSz = CpuGetStackSize (stackClass);
+    CpuContext_t* context = (CpuContext_t*) (stack + stackSz - sizeof (CpuContext_t));
     // Initialize it
     context->rbx = 0;
     context->rbp = 0;
@@ -272,10 +283,141 @@ CpuContext_t* CpuAllocContext (uintptr_t entry)
     return context;
 }
 
+// Gets the stack a context is on
+static inline void* cpuContextStack (CpuContext_t* context, int stackClass)
+{
+    return (void*) (CpuPageAlignUp ((uintptr_t) context)) - CpuGetStackSize (stackClass);
+}
+
 // Destroys a context
-void CpuDestroyContext (CpuContext_t* context)
+void CpuDestroyContext (CpuContext_t* context, int stackClass)
+{
+    CpuFreeKstack (cpuContextStack (context, stackClass), stackClass);
+}
+
+// Gets the most of the stack of context that has ever been used
+size_t CpuGetStackPeak (CpuContext_t* context, int stackClass)
+{
+    return CpuGetKstackPeak (cpuContextStack (context, stackClass), stackClass);
+}
+
+// Allocates CCB for another CPU, based on the BSP's
+NkCcb_t* CpuAllocCcb (int cpuNum)
 {
-    // Get stack
-    void* stack = (void*) (CpuPageAlignUp ((uintptr_t) context)) - CPU_KSTACK_SZ;
-    cpuDestroyKstack (stack);
+    // NkCcb_t is laid out in cache lines, so it has to start on one
+    size_t numPages = CpuPageAlignUp (sizeof (NkCcb_t)) >> NEXKE_CPU_PAGE_SHIFT;
+    NkCcb_t* newCcb = MmAllocKvRegion (numPages, MM_KV_NO_DEMAND);
+    if (!newCcb)
+        return NULL;
+    memset (newCcb, 0, sizeof (NkCcb_t));
+    newCcb->self = newCcb;
+    newCcb->cpuNum = cpuNum;
+    newCcb->cpuArch = ccb.cpuArch;
+    newCcb->cpuFamily = ccb.cpuFamily;
+    newCcb->sysBoard = ccb.sysBoard;
+    strcpy (newCcb->sysName, ccb.sysName);
+    // We assume every CPU has the same features as the BSP
+    // This also gives it the GDT and IDT, which all CPUs share
+    newCcb->archCcb = ccb.archCcb;
+    newCcb->archCcb.intsHeld = true;
+    newCcb->archCcb.intRequested = true;
+    memset (newCcb->archCcb.kstackCache, 0, sizeof (newCcb->archCcb.kstackCache));
+    memset (newCcb->archCcb.kstackCount, 0, sizeof (newCcb->archCcb.kstackCount));
+    newCcb->preemptDisable = 1;
+    return newCcb;
+}
+
+// Kernel entry point of APs
+static void __attribute__ ((noreturn)) cpuApEntry (NkCcb_t* apCcb)
+{
+    // Load kernel GDT and IDT
+    CpuTabPtr_t gdtr = {.base = (uintptr_t) cpuGdt, .limit = (CPU_GDT_MAX * 8) - 1};
+    CpuFlushGdt (&gdtr);
+    *NK_PERCPU_PTR_CPU (CpuCurCcb, apCcb) = apCcb;
+    CpuSetGs (apCcb->perCpuOff);
+    CpuTabPtr_t idtPtr = {.base = (uintptr_t) cpuIdt, .limit = (CPU_IDT_MAX * 16) - 1};
+    CpuInstallIdt (&idtPtr);
+    // Now that we are in long mode we can set the rest of CR4
+    CpuWriteCr4 (cpuApCr4);
+    if (CpuGetFeatures() & CPU_FEATURE_PAT)
+        CpuWrmsr (MUL_PAT_MSR, cpuApPat);
+    CpuInitFpu();
+    NkApMain (apCcb);
+}
+
+// Sets up trampoline for APs
+// It gets one page for code, and one for each level of trampoline page tables, except the last,
+// which uses large pages
+static bool cpuInitTrampoline()
+{
+#ifdef NEXNIX_X86_64_LA57
+    int levels = 5;
+#else
+    int levels = 4;
+#endif
+    size_t numPages = levels;
+    // Startup IPIs can only go to the first 1 MiB
+    MmPage_t* pages = MmAllocPagesAt (numPages, 0x100000, NEXKE_CPU_PAGESZ);
+    if (!pages)
+        return false;
+    paddr_t phys = MmGetPagePhys (pages);
+    cpuTramp = MmAllocKvMmio (phys, numPages, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
+    if (!cpuTramp)
+    {
+        MmFreePages (pages, numPages);
+        return false;
+    }
+    memset (cpuTramp, 0, numPages * NEXKE_CPU_PAGESZ);
+    // Copy in the code
+    size_t codeSz = CpuTrampolineEnd - CpuTrampoline;
+    assert (codeSz <= NEXKE_CPU_PAGESZ);
+    memcpy (cpuTramp, CpuTrampoline, codeSz);
+    cpuTrampData = (volatile cpuTrampData_t*) (cpuTramp + (CpuTrampData - CpuTrampoline));
+    // Identity map the first 2 MiB, so the trampoline keeps running once paging is on
+    for (int i = 1; i < levels - 1; ++i)
+    {
+        pte_t* tab = (pte_t*) (cpuTramp + (i * NEXKE_CPU_PAGESZ));
+        tab[0] = (phys + ((i + 1) * NEXKE_CPU_PAGESZ)) | PF_P | PF_RW;
+    }
+    pte_t* dir = (pte_t*) (cpuTramp + ((levels - 1) * NEXKE_CPU_PAGESZ));
+    dir[0] = PF_P | PF_RW | PF_PS;
+    cpuTrampPhys = phys;
+    return true;
+}
+
+// Prepares a CPU to be started with CCB
+paddr_t CpuPrepareAp (NkCcb_t* apCcb)
+{
+    // Trampoline is set up the first time around, and kept for every AP after
+    if (!cpuTrampPhys && !cpuInitTrampoline())
+        return 0;
+    void* stack = CpuAllocKstack (CPU_KSTACK_NORMAL);
+    if (!stack)
+        return 0;
+    uintptr_t stackTop = (uintptr_t) stack + CPU_KSTACK_SZ;
+    // The AP can't take page faults until it has an IDT, but kernel stacks come pre-faulted
+    // Kernel half of the trampoline's top table comes from the kernel space, so the AP can reach
+    // the kernel after it gets to long mode. Copy it each time, as it may have changed
+    pte_t* top = (pte_t*) (cpuTramp + NEXKE_CPU_PAGESZ);
+    MmSpace_t* kernSpace = MmGetKernelSpace();
+    MM_MUL_LOCK (kernSpace);
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (kernSpace->mulSpace.base, MM_PTAB_UNCACHED);
+    pte_t* kernTop = (pte_t*) cacheEnt->addr;
+    memcpy (&top[MUL_MAX_USER_PMLTOP],
+            &kernTop[MUL_MAX_USER_PMLTOP],
+            (512 - MUL_MAX_USER_PMLTOP) * sizeof (pte_t));
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (kernSpace);
+    // PCIDs can't be enabled until we're in long mode
+    cpuApCr4 = CpuReadCr4();
+    if (CpuGetFeatures() & CPU_FEATURE_PAT)
+        cpuApPat = CpuRdmsr (MUL_PAT_MSR);
+    cpuTrampData->cr3 = cpuTrampPhys + NEXKE_CPU_PAGESZ;
+    cpuTrampData->cr4 = cpuApCr4 & ~(CPU_CR4_PCIDE);
+    cpuTrampData->efer = CpuRdmsr (CPU_EFER_MSR) & ~(CPU_EFER_LMA);
+    cpuTrampData->cr0 = CpuReadCr0();
+    cpuTrampData->stack = stackTop;
+    cpuTrampData->ccb = (uintptr_t) apCcb;
+    cpuTrampData->entry = (uintptr_t) cpuApEntry;
+    return cpuTrampPhys;
 }
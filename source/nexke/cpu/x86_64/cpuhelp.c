@@ -122,6 +122,11 @@ uint64_t CpuRdtsc (void)
     return ((uint64_t) high << 32) | low;
 }
 
+uint64_t CpuGetCycles()
+{
+    return CpuRdtsc();
+}
+
 void CpuInvlpg (uintptr_t addr)
 {
     asm volatile ("invlpg (%0)" : : "r"(addr) : "memory");
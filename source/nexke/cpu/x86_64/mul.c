@@ -21,8 +21,25 @@
 #include <nexke/nexke.h>
 #include <string.h>
 
-// Page mapping cache
-static SlabCache_t* mulMapCache = NULL;
+// Whether PCIDs are in use
+static bool mulPcid = false;
+
+// INVPCID types
+#define MUL_INVPCID_ADDR       0
+#define MUL_INVPCID_SINGLE     1
+#define MUL_INVPCID_ALL_GLOBAL 2
+#define MUL_INVPCID_ALL        3
+
+// Invalidates TLB entries with INVPCID
+static inline void mulInvpcid (uint64_t type, uint64_t pcid, uintptr_t addr)
+{
+    struct
+    {
+        uint64_t pcid;
+        uint64_t addr;
+    } desc = {pcid, addr};
+    asm volatile ("invpcid %0, %1" : : "m"(desc), "r"(type) : "memory");
+}
 
 // Canocicalizing helpers
 static inline uintptr_t mulMakeCanonical (uintptr_t addr)
@@ -54,7 +71,7 @@ void MmMulInit()
     // Allocate cache
     MmPage_t* cachePgCtrl = MmAllocFixedPage();
     MmFixPage (cachePgCtrl);
-    paddr_t cachePage = cachePgCtrl->pfn * NEXKE_CPU_PAGESZ;
+    paddr_t cachePage = MmGetPagePhys (cachePgCtrl);
     // Map it
     MmMulMapEarly (MUL_PTCACHE_ENTRY_BASE, cachePage, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
     // Map dummy page at base so we have the structure created
@@ -86,17 +103,65 @@ void MmMulInit()
     NkListAddFront (&mulSpace->pageList, &cachePgCtrl->link);
     // Prepare page table cache
     MmPtabInitCache (MmGetKernelSpace());
-    mulMapCache = MmCacheCreate (sizeof (MmPageMap_t), "MmPageMap_t", 0, 0);
-    assert (mulMapCache);
-    // Set up PAT if we have it
-    if (CpuGetFeatures() & CPU_FEATURE_PAT)
+    // Use PCIDs if we have them. Kernel mappings must be global for this to work,
+    // so we need PGE too
+    if (CpuGetFeatures() & CPU_FEATURE_PCID && CpuGetFeatures() & CPU_FEATURE_PGE)
+    {
+        CpuWriteCr4 (CpuReadCr4() | CPU_CR4_PCIDE);
+        MmPtabInitTags (MUL_MAX_PCID);
+        mulPcid = true;
+    }
+    // Map physical memory so we can stop going through the PT cache
+    MmPtabInitDirect();
+}
+
+// Sets up PAT if we have it
+// This has to wait for CPUID to be read, which happens after MmMulInit. Entries 0-3 match what
+// the CPU resets them to, and nothing has used entry 4 yet, so no cache flush is needed
+void MmMulInitPat()
+{
+    if (!(CpuGetFeatures() & CPU_FEATURE_PAT))
+        return;
+    // Setup our PAT
+    uint64_t pat = (MUL_PAT_WB << MUL_PAT0) | (MUL_PAT_WT << MUL_PAT1) |
+                   (MUL_PAT_UCMINUS << MUL_PAT2) | (MUL_PAT_UC << MUL_PAT3) |
+                   ((uint64_t) MUL_PAT_WC << MUL_PAT4);
+    CpuWrmsr (MUL_PAT_MSR, pat);
+}
+
+// Flushes whole TLB
+void MmMulFlushTlb()
+{
+    // INVPCID can flush every PCID, global entries included, in one go
+    if (CpuHasFeature (CPU_FEATURE_INVPCID))
+    {
+        mulInvpcid (MUL_INVPCID_ALL_GLOBAL, 0, 0);
+        return;
+    }
+    // With PCIDs, writing CR3 only flushes the current PCID, but toggling PGE flushes everything
+    uint64_t cr4 = CpuReadCr4();
+    if (cr4 & CPU_CR4_PGE)
     {
-        // Setup our PAT
-        uint64_t pat = (MUL_PAT_WB << MUL_PAT0) | (MUL_PAT_WT << MUL_PAT1) |
-                       (MUL_PAT_UCMINUS << MUL_PAT2) | (MUL_PAT_UC << MUL_PAT3) |
-                       ((uint64_t) MUL_PAT_WC << MUL_PAT4);
-        CpuWrmsr (MUL_PAT_MSR, pat);
+        CpuWriteCr4 (cr4 & ~(CPU_CR4_PGE));
+        CpuWriteCr4 (cr4);
     }
+    else
+        CpuWriteCr3 (CpuReadCr3());
+}
+
+// Switches CPU to address space
+void MmMulSwitchSpace (MmSpace_t* space)
+{
+    uint64_t cr3 = space->mulSpace.base;
+    if (mulPcid)
+    {
+        int tag = 0;
+        // Keep the TLB entries of the space if they're still good
+        if (MmPtabGetTag (space, &tag))
+            cr3 |= MUL_CR3_NOFLUSH;
+        cr3 |= tag;
+    }
+    CpuWriteCr3 (cr3);
 }
 
 // Allocates page table into ent
@@ -105,15 +170,18 @@ paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t*
     // Unlock for below
     MM_MUL_UNLOCK (space);
     // Allocate the table
-    MmPage_t* pg = MmAllocFixedPage();
+    MmPage_t* pg = MmAllocPtPage();
     MmFixPage (pg);
-    paddr_t tab = pg->pfn * NEXKE_CPU_PAGESZ;
-    // Zero it
-    MmMulZeroPage (pg);
+    paddr_t tab = MmGetPagePhys (pg);
     MM_MUL_LOCK (space);
     // Check if a table was mapped while we were unlocked
     if (*ent)
+    {
         tab = *ent & PT_FRAME;
+        // Ours is still empty, so keep it for the next table
+        MmUnfixPage (pg);
+        MmFreePtPage (pg);
+    }
     else
     {
         // Add to page list
@@ -204,11 +272,200 @@ static inline void MmMulFlushAddr (MmSpace_t* space, uintptr_t addr)
 {
     if (space == MmGetCurrentSpace() || space == MmGetKernelSpace())
         MmMulFlush (addr);
+    // The space's entries stay around in its PCID, so make sure they get flushed before the space
+    // runs again
+    else if (mulPcid)
+        MmPtabStaleTag (space);
+    MmTlbShootdown (space, addr, addr + NEXKE_CPU_PAGESZ, false);
+}
+
+// Invalidates TLB entries gathered in gather
+void MmMulFlushGather (MmTlbGather_t* gather)
+{
+    MmSpace_t* space = gather->space;
+    if (space == MmGetCurrentSpace() || space == MmGetKernelSpace())
+    {
+        // Past the ceiling it's cheaper to flush everything than to invlpg each page
+        if (gather->flushAll || gather->count > MM_GATHER_FLUSH_MAX)
+        {
+            // Kernel mappings are global, so they need a full flush
+            // User mappings go away by reloading CR3
+            if (space == MmGetKernelSpace())
+                MmMulFlushTlb();
+            else
+                CpuWriteCr3 (CpuReadCr3() & ~(MUL_CR3_NOFLUSH));
+        }
+        else
+        {
+            for (int i = 0; i < gather->count; ++i)
+                MmMulFlush (gather->entries[i].addr);
+        }
+    }
+    else if (mulPcid)
+        MmPtabStaleTag (space);
+}
+
+// Converts small page flags into large page flags
+static inline pte_t mulToLargeFlags (pte_t flags)
+{
+    // PAT bit moves when PS is set
+    if (flags & PF_WC)
+    {
+        flags &= ~(PF_WC);
+        flags |= PF_PSWC;
+    }
+    return flags | PF_PS;
+}
+
+// Converts large page flags into small page flags
+static inline pte_t mulFromLargeFlags (pte_t flags)
+{
+    flags &= ~(PF_PS);
+    if (flags & PF_PSWC)
+    {
+        flags &= ~(PF_PSWC);
+        flags |= PF_WC;
+    }
+    return flags;
+}
+
+// Splits large page mapped by ent into a page table
+paddr_t MmMulSplitLarge (MmSpace_t* space, uintptr_t addr, pte_t* ent)
+{
+    // Unlock for below
+    MM_MUL_UNLOCK (space);
+    MmPage_t* pg = MmAllocFixedPage();
+    if (!pg)
+        NkPanicOom();
+    paddr_t tab = MmGetPagePhys (pg);
+    MM_MUL_LOCK (space);
+    // Check if this was split while we were unlocked
+    if (*ent && !PT_ISLARGE (*ent))
+    {
+        MmLockPage (pg);
+        MmUnfixPage (pg);
+        MmUnlockPage (pg);
+        MmFreePage (pg);
+        return *ent & PT_FRAME;
+    }
+    // Fill in the new table with the translations of the large page
+    pte_t large = *ent;
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (tab, MM_PTAB_UNCACHED);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    if (large)
+    {
+        pte_t flags = mulFromLargeFlags (large & ~(PT_LARGEFRAME));
+        paddr_t frame = large & PT_LARGEFRAME;
+        for (int i = 0; i < MUL_LARGE_PAGES; ++i)
+            table[i] = flags | (frame + (i * NEXKE_CPU_PAGESZ));
+    }
+    else
+        memset (table, 0, NEXKE_CPU_PAGESZ);
+    MmPtabFreeToCache (cacheEnt);
+    // Add to page list
+    NkListAddFront (&space->mulSpace.pageList, &pg->link);
+    // Table permissions have to be as loose as the pages in it
+    pte_t flags = PF_P | PF_RW;
+    if (large & PF_US)
+        flags |= PF_US;
+    *ent = tab | flags;
+    // Get rid of the large TLB entry
+    MmMulFlushAddr (space, mulMakeCanonical (addr & ~(MUL_LARGE_PAGESZ - 1)));
+    return tab;
+}
+
+// Gets the PDE of the large page mapping addr
+// Returns NULL if addr isn't mapped by a large page
+static pte_t* mulGetLarge (MmSpace_t* space, uintptr_t addr, MmPtCacheEnt_t** cacheEnt)
+{
+    *cacheEnt = MmPtabLookup (space, space->mulSpace.base, addr, MUL_LARGE_LEVEL);
+    if (!*cacheEnt)
+        return NULL;
+    pte_t* table = (pte_t*) (*cacheEnt)->addr;
+    pte_t* pde = &table[MUL_IDX_LEVEL (addr, MUL_LARGE_LEVEL)];
+    if (PT_ISLARGE (*pde))
+        return pde;
+    MmPtabReturnCache (*cacheEnt);
+    return NULL;
+}
+
+// Drops cached tables in iterator after the caller skipped over a large page
+static void mulResetIter (MmPtIter_t* iter)
+{
+    MmPtabEndIterate (iter);
+    memset (iter->ptIters, 0, sizeof (iter->ptIters));
+}
+
+// Maps a large page into address space
+// Returns false if a large page can't be used here
+static bool mulMapLarge (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
+{
+    paddr_t phys = MmGetPagePhys (page);
+    // Only fixed, huge and unusable pages can be mapped large, as they don't track their mappings
+    if (!(page->flags & (MM_PAGE_FIXED | MM_PAGE_HUGE | MM_PAGE_UNUSABLE)) ||
+        (virt & (MUL_LARGE_PAGESZ - 1)) || (phys & (MUL_LARGE_PAGESZ - 1)))
+        return false;
+    pte_t pgFlags = mulToLargeFlags (mmMulGetProt (perm));
+    if (page->flags & MM_PAGE_FIXED)
+        pgFlags |= PF_F;
+    if (CpuHasFeature (CPU_FEATURE_PGE) && MmMulIsKernel (virt))
+        pgFlags |= PF_G;
+    pte_t newPde = pgFlags | phys;
+    MM_MUL_LOCK (space);
+    virt = mulDecanonical (virt);
+    MmPtCacheEnt_t* cacheEnt =
+        MmPtabWalkAndMapLevel (space, space->mulSpace.base, virt, newPde, MUL_LARGE_LEVEL);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    pte_t* pde = &table[MUL_IDX_LEVEL (virt, MUL_LARGE_LEVEL)];
+    // If a page table with something in it is already here, leave it be and let the caller use
+    // small pages. An empty one stays on the space's page list until the space goes away
+    if (*pde && !PT_ISLARGE (*pde) && !MmPtabIsEmpty (*pde & PT_FRAME))
+    {
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (space);
+        return false;
+    }
+    if (*pde & PF_F)
+        NkPanic ("nexke: attempt to unmap fixed mapping");
+    bool replaced = PT_ISLARGE (*pde);
+    *pde = newPde;
+    MmMulFlushAddr (space, mulMakeCanonical (virt));
+    MmPtabReturnCache (cacheEnt);
+    MM_MUL_UNLOCK (space);
+    // Update stats
+    if (newPde & PF_F)
+        space->stats.numFixed += MUL_LARGE_PAGES;
+    if (!replaced)
+        space->stats.numMaps += MUL_LARGE_PAGES;
+    return true;
+}
+
+// Adds a mapping to page's mapping list
+static void mulAddMapping (MmSpace_t* space, uintptr_t virt, MmPage_t* page, paddr_t table)
+{
+    if (!(page->flags & MM_PAGE_FIXED) && !(page->flags & MM_PAGE_UNUSABLE))
+        MmAddPageMap (page, space, virt, table);
+    // Update stats
+    ++space->stats.numMaps;
+}
+
+// Maps the large page starting at page into address space, without falling back to small pages
+bool MmMulMapLarge (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
+{
+    return mulMapLarge (space, virt, page, perm);
 }
 
 // Maps page into address space
 void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
 {
+    if (perm & MUL_PAGE_LARGE)
+    {
+        if (mulMapLarge (space, virt, page, perm))
+            return;
+        // Fall back to small pages
+        MmMulMapContig (space, virt, page, MUL_LARGE_PAGES, perm & ~(MUL_PAGE_LARGE));
+        return;
+    }
     MM_MUL_LOCK (space);
     MmMulSpace_t* mulSpace = &space->mulSpace;
     // Translate flags
@@ -217,10 +474,10 @@ void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
     if (page->flags & MM_PAGE_FIXED)
         pgFlags |= PF_F;
     // If this is a kernel page and global pages exist, make it global
-    if (CpuGetFeatures() & CPU_FEATURE_PGE && MmMulIsKernel (virt))
+    if (CpuHasFeature (CPU_FEATURE_PGE) && MmMulIsKernel (virt))
         pgFlags |= PF_G;
     // Create PTE
-    pte_t newPte = pgFlags | (page->pfn * NEXKE_CPU_PAGESZ);
+    pte_t newPte = pgFlags | (MmGetPagePhys (page));
     // Grab page table of last entry
     uintptr_t canonVirt = virt;
     virt = mulDecanonical (virt);
@@ -268,55 +525,100 @@ void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm)
         *pte = newPte;
     }
     // Return it
+    paddr_t tabPhys = cacheEnt->ptab;
     MmPtabReturnCache (cacheEnt);
     MM_MUL_UNLOCK (space);
     // Check if we have a mapping to remove
     if (oldPage)
     {
-        // Find this mapping
-        NkSpinLock (&oldPage->lock);
-        MmPageMap_t* map = oldPage->maps;
-        MmPageMap_t* prev = NULL;
-        while (map)
+        MmLockPage (oldPage);
+        if (MmRemovePageMap (oldPage, space, canonVirt))
+            --space->stats.numMaps;
+        MmUnlockPage (oldPage);
+    }
+    mulAddMapping (space, canonVirt, page, tabPhys);
+}
+
+// Maps count pages starting at virt, walking to each page table only once
+// Page i is pages[i], or contig[i] if pages is NULL
+static void mulMapRange (MmSpace_t* space,
+                         uintptr_t virt,
+                         MmPage_t** pages,
+                         MmPage_t* contig,
+                         size_t count,
+                         int perm)
+{
+    // Translate flags
+    pte_t pgFlags = mmMulGetProt (perm);
+    // If this is a kernel page and global pages exist, make it global
+    if (CpuHasFeature (CPU_FEATURE_PGE) && MmMulIsKernel (virt))
+        pgFlags |= PF_G;
+    size_t i = 0;
+    while (i < count)
+    {
+        MM_MUL_LOCK (space);
+        uintptr_t cur = virt + (i * NEXKE_CPU_PAGESZ);
+        uintptr_t addr = mulDecanonical (cur);
+        MmPtCacheEnt_t* cacheEnt = MmPtabWalkAndMap (space, space->mulSpace.base, addr, pgFlags);
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        // Fill in PTEs until the end of this table, or until one that is already mapped
+        size_t first = i;
+        bool mapped = false;
+        do
         {
-            if (map->addr == virt && map->space == space)
+            MmPage_t* page = (pages) ? pages[i] : &contig[i];
+            pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+            if (*pte)
             {
-                // Remove it and break
-                --space->stats.numMaps;
-                if (prev)
-                    prev->next = map->next;
-                else
-                    oldPage->maps = map->next;
+                mapped = true;
                 break;
             }
-            prev = map;
-            map = map->next;
+            pte_t newPte = pgFlags | (MmGetPagePhys (page));
+            if (page->flags & MM_PAGE_FIXED)
+            {
+                newPte |= PF_F;
+                ++space->stats.numFixed;
+            }
+            *pte = newPte;
+            ++i;
+            addr += NEXKE_CPU_PAGESZ;
+        } while (i < count && MUL_IDX_LEVEL (addr, 1));
+        paddr_t tabPhys = cacheEnt->ptab;
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (space);
+        for (size_t j = first; j < i; ++j)
+        {
+            MmPage_t* page = (pages) ? pages[j] : &contig[j];
+            mulAddMapping (space, virt + (j * NEXKE_CPU_PAGESZ), page, tabPhys);
+        }
+        // Replacing a mapping is left to MmMulMapPage
+        if (mapped)
+        {
+            MmPage_t* page = (pages) ? pages[i] : &contig[i];
+            MmMulMapPage (space, virt + (i * NEXKE_CPU_PAGESZ), page, perm);
+            ++i;
         }
-        NkSpinUnlock (&oldPage->lock);
-    }
-    if (!(page->flags & MM_PAGE_FIXED) && !(page->flags & MM_PAGE_UNUSABLE))
-    {
-        // Add this mapping
-        MmPageMap_t* map = (MmPageMap_t*) MmCacheAlloc (mulMapCache);
-        if (!map)
-            NkPanicOom();
-        map->addr = canonVirt;
-        map->space = space;
-        map->next = NULL;
-        // Link it
-        NkSpinLock (&page->lock);
-        map->next = page->maps;
-        page->maps = map;
-        NkSpinUnlock (&page->lock);
     }
-    // Update stats
-    ++space->stats.numMaps;
+}
+
+// Maps an array of pages into address space
+void MmMulMapRange (MmSpace_t* space, uintptr_t virt, MmPage_t** pages, size_t count, int perm)
+{
+    mulMapRange (space, virt, pages, NULL, count, perm);
+}
+
+// Maps physically contigous pages into address space
+void MmMulMapContig (MmSpace_t* space, uintptr_t virt, MmPage_t* pages, size_t count, int perm)
+{
+    mulMapRange (space, virt, NULL, pages, count, perm);
 }
 
 // Unmaps a range out of an address space
 void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
 {
     MM_MUL_LOCK (space);
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
     // Set up iterator
     MmPtIter_t iter = {0};
     iter.addr = mulDecanonical (base);
@@ -325,6 +627,27 @@ void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
     for (int i = 0; i < count; ++i)
     {
         uintptr_t addr = iter.addr;
+        // Remove large pages in one go if the range covers all of it
+        // Otherwise the iterator splits it for us
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (count - i) >= MUL_LARGE_PAGES)
+        {
+            MmPtCacheEnt_t* largeEnt = NULL;
+            pte_t* pde = mulGetLarge (space, addr, &largeEnt);
+            if (pde)
+            {
+                // Make sure PDE isn't fixed
+                if (*pde & PF_F)
+                    NkPanic ("nexke: can't remove fixed mapping");
+                *pde = 0;
+                MmPtabGather (&gather, mulMakeCanonical (addr), MUL_LARGE_PAGESZ, NULL);
+                MmPtabReturnCache (largeEnt);
+                space->stats.numMaps -= MUL_LARGE_PAGES;
+                mulResetIter (&iter);
+                iter.addr += MUL_LARGE_PAGESZ;
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
         // Get cache entry for table containing PTE
         MmPtCacheEnt_t* cacheEnt = MmPtabIterate (&iter);
         // If there is no cache entry, move to next address
@@ -341,37 +664,14 @@ void MmMulUnmapRange (MmSpace_t* space, uintptr_t base, size_t count)
                 // Get page of PTE
                 MmPage_t* page = MmFindPagePfn ((*pte & PT_FRAME) >> NEXKE_CPU_PAGE_SHIFT);
                 *pte = 0;
-                MmMulFlushAddr (space, mulMakeCanonical (addr));
-                // Now remove mapping, first we need to unlock the address space
-                // as we can't lock the page while holding the address space lock
-                // as that would violate lock ordering
-                // I don't think this will cause any problems, but I could be wrong
-                MM_MUL_UNLOCK (space);
-                NkSpinLock (&page->lock);
-                // Find the mapping
-                MmPageMap_t* map = page->maps;
-                MmPageMap_t* prev = NULL;
-                while (map)
-                {
-                    if (map->addr == mulMakeCanonical (addr) && map->space == space)
-                    {
-                        // Remove it and break
-                        --space->stats.numMaps;
-                        if (prev)
-                            prev->next = map->next;
-                        else
-                            page->maps = map->next;
-                        break;
-                    }
-                    prev = map;
-                    map = map->next;
-                }
-                NkSpinUnlock (&page->lock);
-                MM_MUL_LOCK (space);
+                // The mapping is removed once the TLB has been flushed
+                MmPtabGather (&gather, mulMakeCanonical (addr), NEXKE_CPU_PAGESZ, page);
             }
         }
     }
     MmPtabEndIterate (&iter);
+    MmPtabReclaim (&gather, iter.asPhys, mulDecanonical (base), base, count);
+    MmPtabFlushGather (&gather);
     MM_MUL_UNLOCK (space);
 }
 
@@ -381,6 +681,8 @@ void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm
     MM_MUL_LOCK (space);
     // Get right flags
     pte_t flags = mmMulGetProt (perm);
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
     // Set up iterator
     MmPtIter_t iter = {0};
     iter.addr = mulDecanonical (base);
@@ -389,6 +691,22 @@ void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm
     for (int i = 0; i < count; ++i)
     {
         uintptr_t addr = iter.addr;
+        // Change large pages in one go if the range covers all of it
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (count - i) >= MUL_LARGE_PAGES)
+        {
+            MmPtCacheEnt_t* largeEnt = NULL;
+            pte_t* pde = mulGetLarge (space, addr, &largeEnt);
+            if (pde)
+            {
+                *pde = (*pde & PT_LARGEFRAME) | mulToLargeFlags (flags) | (*pde & PF_F);
+                MmPtabGather (&gather, mulMakeCanonical (addr), MUL_LARGE_PAGESZ, NULL);
+                MmPtabReturnCache (largeEnt);
+                mulResetIter (&iter);
+                iter.addr += MUL_LARGE_PAGESZ;
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
         // Get cache entry for table containing PTE
         MmPtCacheEnt_t* cacheEnt = MmPtabIterate (&iter);
         // If there is no cache entry, move to next address
@@ -401,10 +719,11 @@ void MmMulProtectRange (MmSpace_t* space, uintptr_t base, size_t count, int perm
             if (*pte & PF_P)
             {
                 *pte = (*pte & PT_FRAME) | flags | (*pte & PF_F);
-                MmMulFlushAddr (space, mulMakeCanonical (addr));
+                MmPtabGather (&gather, mulMakeCanonical (addr), NEXKE_CPU_PAGESZ, NULL);
             }
         }
     }
+    MmPtabFlushGather (&gather);
     MmPtabEndIterate (&iter);
     MM_MUL_UNLOCK (space);
 }
@@ -418,30 +737,29 @@ void MmMulUnmapPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
         uint64_t addr = mulDecanonical (map->addr);
-        // Get cache entry
-        MmPtCacheEnt_t* cacheEnt = MmPtabWalk (map->space, mulSpace->base, addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
         // Make sure it isn't fixed
         if (*pte & PF_F)
             NkPanic ("nexke: can't unmap fixed mapping");
+        // Don't lose track of writes through this mapping
+        if (*pte & PF_D)
+            page->flags |= MM_PAGE_DIRTY;
         // Clear it
         *pte = 0;
         --map->space->stats.numMaps;
         // Flush TLB if needed
         MmMulFlushAddr (map->space, map->addr);
-    next:
         // Return and unlock
         MmPtabReturnCache (cacheEnt);
         MM_MUL_UNLOCK (map->space);
         map = map->next;
     }
-    page->maps = NULL;
+    MmClearPageMaps (page);
 }
 
 // Changes protection on a page
@@ -455,12 +773,9 @@ void MmMulProtectPage (MmPage_t* page, int perm)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
         uint64_t addr = mulDecanonical (map->addr);
-        // Get cache entry
-        MmPtCacheEnt_t* cacheEnt = MmPtabWalk (map->space, mulSpace->base, addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
@@ -468,7 +783,6 @@ void MmMulProtectPage (MmPage_t* page, int perm)
         *pte = (*pte & PT_FRAME) | flags | (*pte & PF_F);
         // Flush TLB if needed
         MmMulFlushAddr (map->space, map->addr);
-    next:
         // Return and unlock
         MmPtabReturnCache (cacheEnt);
         MM_MUL_UNLOCK (map->space);
@@ -486,12 +800,9 @@ void MmMulFixPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
         uint64_t addr = mulDecanonical (map->addr);
-        // Get cache entry
-        MmPtCacheEnt_t* cacheEnt = MmPtabWalk (map->space, mulSpace->base, addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
@@ -519,12 +830,9 @@ void MmMulUnfixPage (MmPage_t* page)
     {
         // Lock MUL
         MM_MUL_LOCK (map->space);
-        MmMulSpace_t* mulSpace = &map->space->mulSpace;
         uint64_t addr = mulDecanonical (map->addr);
-        // Get cache entry
-        MmPtCacheEnt_t* cacheEnt = MmPtabWalk (map->space, mulSpace->base, addr);
-        if (!cacheEnt)
-            goto next;
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
         // Get PTE
         pte_t* table = (pte_t*) cacheEnt->addr;
         pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
@@ -547,6 +855,16 @@ void MmMulUnfixPage (MmPage_t* page)
 MmPage_t* MmMulGetMapping (MmSpace_t* space, uintptr_t virt)
 {
     MM_MUL_LOCK (space);
+    // Check for a large page first so we don't split it
+    MmPtCacheEnt_t* largeEnt = NULL;
+    pte_t* pde = mulGetLarge (space, mulDecanonical (virt), &largeEnt);
+    if (pde)
+    {
+        paddr_t addr = (*pde & PT_LARGEFRAME) + (virt & (MUL_LARGE_PAGESZ - 1));
+        MmPtabReturnCache (largeEnt);
+        MM_MUL_UNLOCK (space);
+        return MmFindPagePfn (addr / NEXKE_CPU_PAGESZ);
+    }
     MmPtCacheEnt_t* cacheEnt = MmPtabWalk (space, space->mulSpace.base, mulDecanonical (virt));
     assert (cacheEnt);
     // Get PTE
@@ -558,6 +876,62 @@ MmPage_t* MmMulGetMapping (MmSpace_t* space, uintptr_t virt)
     return MmFindPagePfn (addr / NEXKE_CPU_PAGESZ);
 }
 
+// Tests attribute bit in every mapping of page, and sets or clears it if update is set
+// Returns whether any mapping had the bit set
+static bool mulUpdateAttrPage (MmPage_t* page, pte_t bit, bool update, bool val)
+{
+    bool res = false;
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        MM_MUL_LOCK (map->space);
+        uint64_t addr = mulDecanonical (map->addr);
+        // Get cache entry of the table the mapping is in
+        MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (map->table, 1);
+        pte_t* table = (pte_t*) cacheEnt->addr;
+        pte_t* pte = &table[MUL_IDX_LEVEL (addr, 1)];
+        if (*pte & bit)
+        {
+            res = true;
+            if (update && !val)
+            {
+                // The CPU only sets the bit again if it walks the tables, so flush the TLB
+                *pte &= ~(bit);
+                MmMulFlushAddr (map->space, map->addr);
+            }
+        }
+        else if (update && val)
+            *pte |= bit;
+        MmPtabReturnCache (cacheEnt);
+        MM_MUL_UNLOCK (map->space);
+        // If we're only looking, one set bit is enough
+        if (res && !update)
+            break;
+        map = map->next;
+    }
+    return res;
+}
+
+// Gets bit for attribute
+static inline pte_t mulAttrToPte (int attr)
+{
+    if (attr == MUL_ATTR_ACCESS)
+        return PF_A;
+    return PF_D;
+}
+
+// Gets attributes of page
+bool MmMulGetAttrPage (MmPage_t* page, int attr)
+{
+    return mulUpdateAttrPage (page, mulAttrToPte (attr), false, false);
+}
+
+// Sets attribute to value of page
+bool MmMulSetAttrPage (MmPage_t* page, int attr, bool val)
+{
+    return mulUpdateAttrPage (page, mulAttrToPte (attr), true, val);
+}
+
 // Early MUL functions
 
 // Global representing max page level
@@ -577,13 +951,16 @@ uintptr_t MmMulGetPhysEarly (uintptr_t virt)
     }
     uintptr_t pgAddr = mulDecanonical (virt);
     // Grab CR3
-    pte_t* curSt = (pte_t*) CpuReadCr3();
+    pte_t* curSt = (pte_t*) (CpuReadCr3() & PT_FRAME);
     for (int i = mulMaxLevel; i > 1; --i)
     {
         // Get entry for this level
         pte_t* ent = &curSt[MUL_IDX_LEVEL (pgAddr, i)];
         if (!(*ent))
             NkPanic ("cannot get physical address of non-existant page");
+        // Check for large page
+        if (i == MUL_LARGE_LEVEL && PT_ISLARGE (*ent))
+            return (*ent & PT_LARGEFRAME) + CpuPageAlignDown (pgAddr & (MUL_LARGE_PAGESZ - 1));
         // Get physical address
         curSt = (pte_t*) PT_GETFRAME (*ent);
     }
@@ -618,9 +995,16 @@ void MmMulMapEarly (uintptr_t virt, paddr_t phys, int flags)
         pgFlags |= PF_WT;
     if (flags & MUL_PAGE_DEV)
         pgFlags |= PF_CD;
+    // Large pages stop one level early
+    int lastLevel = 1;
+    if (flags & MUL_PAGE_LARGE)
+    {
+        lastLevel = MUL_LARGE_LEVEL;
+        pgFlags = mulToLargeFlags (pgFlags);
+    }
     // Grab CR3
-    pte_t* curSt = (pte_t*) CpuReadCr3();
-    for (int i = mulMaxLevel; i > 1; --i)
+    pte_t* curSt = (pte_t*) (CpuReadCr3() & PT_FRAME);
+    for (int i = mulMaxLevel; i > lastLevel; --i)
     {
         // Get entry for this level
         pte_t* ent = &curSt[MUL_IDX_LEVEL (pgAddr, i)];
@@ -645,7 +1029,7 @@ void MmMulMapEarly (uintptr_t virt, paddr_t phys, int flags)
         }
     }
     // Map the last entry
-    pte_t* lastEnt = &curSt[MUL_IDX_LEVEL (pgAddr, 1)];
+    pte_t* lastEnt = &curSt[MUL_IDX_LEVEL (pgAddr, lastLevel)];
     if (*lastEnt)
         NkPanic ("nexke: cannot map already mapped page");
     *lastEnt = pgFlags | phys;
@@ -0,0 +1,115 @@
+; trampoline.asm - contains AP startup trampoline
+; Copyright 2024 The NexNix Project
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;     http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+
+; The trampoline gets copied to a page under 1 MiB, which APs start at in real mode
+; It can end up anywhere, so every address is worked out from CS at run time
+; The data block at the end is filled in by CpuPrepareAp, and must match cpuTrampData_t
+
+section .text
+
+; Offset of symbol in trampoline
+%define TRAMP_OFF(sym) ((sym) - CpuTrampoline)
+
+align 16
+global CpuTrampoline
+CpuTrampoline:
+bits 16
+    cli
+    cld
+    ; Get the physical base of the trampoline
+    mov ax, cs
+    mov ds, ax
+    xor ebx, ebx
+    mov bx, ax
+    shl ebx, 4
+    ; Fix up the GDT pointer and jump targets
+    lea eax, [ebx + TRAMP_OFF (trampGdt)]
+    mov [TRAMP_OFF (trampGdtr) + 2], eax
+    lea eax, [ebx + TRAMP_OFF (trampPm32)]
+    mov [TRAMP_OFF (trampPm32Ptr)], eax
+    lea eax, [ebx + TRAMP_OFF (trampLm64)]
+    mov [TRAMP_OFF (trampLm64Ptr)], eax
+    ; Enter protected mode
+    o32 lgdt [TRAMP_OFF (trampGdtr)]
+    mov eax, cr0
+    or eax, 1
+    mov cr0, eax
+    o32 jmp far [TRAMP_OFF (trampPm32Ptr)]
+bits 32
+trampPm32:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    ; Turn on PAE and load the trampoline's page tables
+    mov eax, [ebx + TRAMP_OFF (trampCr4)]
+    mov cr4, eax
+    mov eax, [ebx + TRAMP_OFF (trampCr3)]
+    mov cr3, eax
+    ; Set EFER.LME
+    mov ecx, 0xC0000080
+    mov eax, [ebx + TRAMP_OFF (trampEfer)]
+    mov edx, [ebx + TRAMP_OFF (trampEfer) + 4]
+    wrmsr
+    ; Turn on paging, which activates long mode
+    mov eax, [ebx + TRAMP_OFF (trampCr0)]
+    mov cr0, eax
+    jmp far [ebx + TRAMP_OFF (trampLm64Ptr)]
+bits 64
+trampLm64:
+    ; Top half of RBX is undefined
+    mov ebx, ebx
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    ; Get onto the stack and into the kernel
+    mov rsp, [rbx + TRAMP_OFF (trampStack)]
+    mov rdi, [rbx + TRAMP_OFF (trampCcb)]
+    mov rax, [rbx + TRAMP_OFF (trampEntry)]
+    push 0          ; Entry never returns
+    jmp rax
+
+; Trampoline GDT
+align 8
+trampGdt:
+    dq 0
+    dq 0x00CF9A000000FFFF       ; 32-bit code
+    dq 0x00CF92000000FFFF       ; Data
+    dq 0x00AF9A000000FFFF       ; 64-bit code
+trampGdtr:
+    dw 31
+    dd 0
+; Far pointers to later stages
+trampPm32Ptr:
+    dd 0
+    dw 0x08
+trampLm64Ptr:
+    dd 0
+    dw 0x18
+
+; Data block
+align 8
+global CpuTrampData
+CpuTrampData:
+trampCr3: dq 0
+trampCr4: dq 0
+trampEfer: dq 0
+trampCr0: dq 0
+trampStack: dq 0
+trampCcb: dq 0
+trampEntry: dq 0
+global CpuTrampolineEnd
+CpuTrampolineEnd:
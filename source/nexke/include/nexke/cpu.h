@@ -18,45 +18,194 @@
 #ifndef _CPU_H
 #define _CPU_H
 
+// Kernel stack classes
+// Threads that never go deep can ask for a small stack. Sizes are up to the architecture, whose
+// header needs these first
+#define CPU_KSTACK_NORMAL  0
+#define CPU_KSTACK_SMALL   1
+#define CPU_KSTACK_CLASSES 2
+
 // Include arch header. This makes use of computed includes
 #include NEXKE_ARCH_HEADER
 #include <nexke/list.h>
+#include <nexke/rbtree.h>
 #include <nexke/types.h>
+#include <stddef.h>
 
 #define NEXKE_MAX_PRIO 64
 
+// Max number of CPUs supported
+#ifdef NEXKE_UP
+#define NEXKE_MAX_CPUS 1
+#else
+#define NEXKE_MAX_CPUS 32
+#endif
+
+// Max number of NUMA nodes supported
+#define NEXKE_MAX_NODES 8
+
+// Size of a cache line, and the alignment that keeps data of different CPUs from sharing one
+#define NEXKE_CACHELINE 64
+
+// CPU topology
+// CPUs are grouped at each level by what they share. Every group is inside a group of the next
+// level up, so the levels make a tree from hardware threads up to packages. A CPU's ID at a
+// level names its group, and is only the same as another CPU's if they're in the same group
+// NUMA nodes are kept apart from this, as a package can be split over nodes
+#define NK_TOPO_CORE   0    // Hardware threads of a core
+#define NK_TOPO_L2     1    // Cores sharing an L2 cache
+#define NK_TOPO_LLC    2    // Cores sharing the last level cache
+#define NK_TOPO_PKG    3    // Cores in a package
+#define NK_TOPO_LEVELS 4
+
+// Time event wheel
+// Events are hashed by deadline into slots of a hierarchical wheel. Each level has slots that
+// are NK_TIME_WHEEL_SLOTS times as long as the level below, and slots of higher levels get
+// cascaded into lower ones as time reaches them. Events in ticks that have been reached sit on
+// a sorted list, so the timer can still be armed for their exact deadline
+#define NK_TIME_WHEEL_LEVELS     4
+#define NK_TIME_WHEEL_SLOT_SHIFT 6
+#define NK_TIME_WHEEL_SLOTS      (1 << NK_TIME_WHEEL_SLOT_SHIFT)
+#define NK_TIME_WHEEL_TICK_SHIFT 20    // Wheel ticks are about a millisecond
+
+typedef struct _nktimewheel
+{
+    NkList_t slots[NK_TIME_WHEEL_LEVELS][NK_TIME_WHEEL_SLOTS];    // Events in each slot
+    uint64_t slotMask[NK_TIME_WHEEL_LEVELS];                      // Slots that have events
+    ktime_t tick;                                                 // First tick not reached yet
+    NkList_t due;    // Events in reached ticks, earliest deadline first
+} NkTimeWheel_t;
+
 // CCB structure (aka CPU control block)
 // This is the core data structure for the CPU, and hence, the kernel
+// It's laid out in cache lines. State only this CPU writes comes first, then the ready queues and
+// time events, which other CPUs lock to wake threads and queue events here, each starting on a
+// line of their own so those CPUs don't keep taking away lines we're using. Information that
+// hardly ever changes comes last
 typedef struct _nkccb
 {
-    struct _nkccb* self;    // Self pointer
+    struct _nkccb* self;       // Self pointer
+    uintptr_t perCpuOff;       // Offset from the image's per-CPU variables to this CPU's copy
+    NkThread_t* curThread;     // Currently executing thread
+    NkThread_t* idleThread;    // Thread to execute when readyQueue is empty
+    NkThread_t* prevThread;    // Thread being switched away from
+    MmSpace_t* curSpace;       // Address space this CPU is running in
+    int cpuNum;                // Logical number of this CPU, used to index per-CPU data
+    int curPriority;           // Current priority
+    int preemptDisable;        // If preemption is presently allowed
+    bool preemptReq;           // If preemption has been requested
+    bool intActive;            // Wheter an interrupt is active on this CPU
+                               // This flags is only set during hardware interrupt processing
+    ipl_t curIpl;              // IPL system is running at
+    ipl_t hwIpl;               // IPL interrupt controller is blocking
+    int mcsDepth;              // Number of queued lock nodes in use
+    long rcuGp;                // Last grace period this CPU passed through
+    uint64_t tlbGen;           // TLB tag generation this CPU's TLB was last flushed for
+    long long intCount;        // Interrupt count
+    int spuriousInts;          // Number of spurious interrupts to occur
+    NkArchCcb_t archCcb;       // Architecture dependent part of CCB
+    // Page allocator info
+    NkList_t pageCache;       // Per-CPU cache of free pages, hot pages are at the front
+    int pageCacheCount;       // Number of pages in page cache
+    int pageCacheHigh;        // Watermark at which page cache gets drained
+    int pageCacheBatch;       // Number of pages moved to or from zones at once
+    NkList_t ptReserve;       // Zeroed pages for page tables, refilled by the idle thread
+    int ptReserveCount;       // Number of pages in page table reserve
+    int ptReserveTarget;      // Size the reserve gets refilled to
+    int ptReserveTaken;       // Pages taken since the reserve was last resized
+    ktime_t ptReserveTime;    // When the reserve was last resized
+    // Scheduler info, under the ready queue lock
+    mcslock_t rqLock __attribute__ ((aligned (NEXKE_CACHELINE)));
+    uint64_t readyMask;                      // Mask of ready priorities
+    int readyCount;                          // Number of threads on ready queues
+    long idleState;                          // What the idle thread is doing, for wakeups
+    NkThread_t* migrateThread;               // Thread to be readied on another CPU
+    NkRbTree_t fairTree;                     // Ready fair share threads, by virtual runtime
+    ktime_t fairMinVrt;                      // Virtual runtime fair share threads start from
+    NkRbTree_t dlTree;                       // Ready deadline threads, earliest deadline first
+    NkList_t dlThrottled;                    // Deadline threads out of runtime
+    NkTimeEvent_t* dlEvent;                  // Deadline runtime and replenishment event
+    bool dlArmed;                            // If deadline event is registered
+    bool tickReq;                            // If the time slice event should be restarted
+    NkTimeEvent_t* tickEvent;                // Time slice event
+    long tickStopped;                        // If the time slice event is stopped
+    int balanceTicks;                        // Time slice ticks since last load balance
+    int balancePasses;                       // Number of load balancing passes done
+    NkList_t readyQueues[NEXKE_MAX_PRIO];    // Scheduler's ready queues
+    // Timer related data, under the time events lock
+    spinlock_t timeLock __attribute__ ((aligned (NEXKE_CACHELINE)));
+    ktime_t nextDeadline;       // Next armed deadline, 0 if none
+    NkTimeWheel_t timeWheel;    // Time events waiting to occur
+    // Topology info. topoId is the group this CPU is in at each topology level
+    int topoId[NK_TOPO_LEVELS] __attribute__ ((aligned (NEXKE_CACHELINE)));
+    long topoMask[NK_TOPO_LEVELS];    // Running CPUs in each of those groups, us included
+    int node;                         // NUMA node this CPU is in
     // General CPU info
     int cpuArch;      // CPU architecture
     int cpuFamily;    // Architecture family
     int sysBoard;     // System hardware / SOC type
     char sysName[64];
-    NkArchCcb_t archCcb;    // Architecture dependent part of CCB
-    // Interrupt handling data
-    ipl_t curIpl;          // IPL system is running at
-    int spuriousInts;      // Number of spurious interrupts to occur
-    long long intCount;    // Interrupt count
-    bool intActive;        // Wheter an interrupt is active on this CPU
-                           // This flags is only set during hardware interrupt processing
-    // Timer related data
-    NkList_t timeEvents;     // Linked list of time events waiting to occur
-    ktime_t nextDeadline;    // Next armed deadline
-    spinlock_t timeLock;     // Time events lock
-    // Scheduler info
-    NkList_t readyQueues[NEXKE_MAX_PRIO];    // Scheduler's ready queues
-    uint64_t readyMask;                      // Mask of ready priorities
-    spinlock_t rqLock;                       // Lock for ready queues
-    NkThread_t* curThread;                   // Currently executing thread
-    int curPriority;                         // Current priority
-    NkThread_t* idleThread;                  // Thread to execute when readyQueue is empty
-    int preemptDisable;                      // If preemption is presently allowed
-    bool preemptReq;                         // If preemption has been requested
 } NkCcb_t;
 
+// Keep the layout from rotting
+_Static_assert (offsetof (NkCcb_t, self) == 0, "CCB has to start with its self pointer");
+_Static_assert (offsetof (NkCcb_t, archCcb) <= 2 * NEXKE_CACHELINE,
+                "state of the running thread has to fit in two cache lines");
+_Static_assert (offsetof (NkCcb_t, rqLock) % NEXKE_CACHELINE == 0 &&
+                    offsetof (NkCcb_t, timeLock) % NEXKE_CACHELINE == 0 &&
+                    offsetof (NkCcb_t, topoId) % NEXKE_CACHELINE == 0,
+                "state other CPUs lock has to be on lines of its own");
+
+// Per-CPU variables
+// Variables declared with NK_PERCPU go in a section of their own. The copy in the kernel image
+// belongs to the BSP, and every other CPU gets a copy of the section when it is started, found at
+// perCpuOff from the image's. That offset is kept in a register, so that this CPU's copy of a
+// variable is a single load or store away
+// APs' copies start out zeroed, so per-CPU variables should be set up by the per-CPU init
+// routine of their subsystem rather than by an initializer
+#define NK_PERCPU __attribute__ ((section (".percpu")))
+
+// Per-CPU section bounds, from linker script
+extern uint8_t NkPerCpuStart[];
+extern uint8_t NkPerCpuEnd[];
+
+// Gets a pointer to ccb's copy of var
+#define NK_PERCPU_PTR_CPU(var, ccb) \
+    ((__typeof__ (&(var))) ((uintptr_t) &(var) + (ccb)->perCpuOff))
+
+// Gets a pointer to this CPU's copy of var
+// Preemption must be disabled for as long as the pointer is used
+#define NK_PERCPU_PTR(var) NK_PERCPU_PTR_CPU (var, CpuGetCcb())
+
+// Reads and writes this CPU's copy of a scalar var
+// Unless the architecture can do it in one instruction, preemption must be disabled to be
+// sure which CPU's copy is used
+#ifdef CpuPerCpuRead
+#define NK_PERCPU_READ(var)       CpuPerCpuRead (var)
+#define NK_PERCPU_WRITE(var, val) CpuPerCpuWrite (var, val)
+#else
+#define NK_PERCPU_READ(var)       (*NK_PERCPU_PTR (var))
+#define NK_PERCPU_WRITE(var, val) (*NK_PERCPU_PTR (var) = (val))
+#endif
+
+// Static calls
+// A static call is called like a function, and is pointed at a function once that's picked,
+// which is how hot platform hooks are called. If the architecture can patch code, calls are
+// direct calls to a trampoline that jumps to the function, so there's no indirect branch to pay
+// for. Otherwise they're calls through a pointer
+// Updates have to be done before other CPUs are started
+#ifdef CpuStaticCall
+#define NK_STATIC_CALL_DECLARE(name, type)      CpuStaticCallDeclare (name, type)
+#define NK_STATIC_CALL_DEFINE(name, type, func) CpuStaticCallDefine (name, type, func)
+#define NK_STATIC_CALL(name)                    CpuStaticCall (name)
+#define NK_STATIC_CALL_UPDATE(name, func)       CpuStaticCallUpdate (name, func)
+#else
+#define NK_STATIC_CALL_DECLARE(name, type)      extern type nkStaticCall_##name
+#define NK_STATIC_CALL_DEFINE(name, type, func) type nkStaticCall_##name = (func)
+#define NK_STATIC_CALL(name)                    (nkStaticCall_##name)
+#define NK_STATIC_CALL_UPDATE(name, func)       (nkStaticCall_##name = (func))
+#endif
+
 // Scans a bit set for highest set bit
 int CpuScanPriority (uint64_t mask);
 
@@ -78,6 +227,16 @@ int CpuScanPriority (uint64_t mask);
 // Initializes CPU control block
 void CpuInitCcb();
 
+// Allocates CCB for another CPU, based on the BSP's
+NkCcb_t* CpuAllocCcb (int cpuNum);
+
+// Prepares a CPU to be started with CCB
+// Returns physical address it should start executing at, 0 if it can't be started
+paddr_t CpuPrepareAp (NkCcb_t* ccb);
+
+// Sets topology IDs of CCB from what the CPU layer and firmware tell us about cpu
+void CpuInitTopology (NkCcb_t* ccb, PltCpu_t* cpu);
+
 // Registers exception handlers
 void CpuRegisterExecs();
 
@@ -108,28 +267,80 @@ void CpuEnable();
 // Halts CPU until interrupt comes
 void CpuHalt();
 
+// Idle state of a CPU
+typedef struct _cpuidlestate
+{
+    const char* name;     // Name of state
+    ktime_t latency;      // Time it takes to get going again once woken, in ns
+    ktime_t residency;    // Time it has to stay idle for to be worth entering, in ns
+    uint32_t hint;        // CPU specific value of state
+    bool monitor;         // Whether clearing the wake word ends it without an interrupt
+} CpuIdleState_t;
+
+#define CPU_IDLE_MAX 8
+
+// Gets the idle states of this CPU, from shallowest to deepest
+// Returns how many there are, which is always at least one
+int CpuInitIdle (CpuIdleState_t* states);
+
+// Idles in state until an interrupt is pending, or, if it monitors, until wake is cleared
+// Called with interrupts disabled, and returns with them still disabled
+void CpuIdle (const CpuIdleState_t* state, long* wake);
+
+// Orders stores to memory before a store to a device register, so a device that's told to look
+// at something sees it
+#ifndef CpuIoBarrier
+#define CpuIoBarrier() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+#endif
+
+// Reads a free running cycle counter, for profiling
+uint64_t CpuGetCycles();
+
+// Sets up the performance counters to interrupt every period cycles and call NkProfSample
+// Returns false if there aren't any we can use
+bool CpuInitPmu (uint64_t period);
+
+// Starts and stops the performance counters of this CPU
+void CpuStartPmu();
+void CpuStopPmu();
+
 // Performs a context switch
 void CpuSwitchContext (CpuContext_t* newCtx, CpuContext_t** oldCtx);
 
 // Gets real CCB, i.e., not CCB in special register
 NkCcb_t* CpuRealCcb();
 
-// Allocates a CPU context and intializes it
-CpuContext_t* CpuAllocContext (uintptr_t entry);
+// Allocates a CPU context and intializes it, on a stack of stackClass
+CpuContext_t* CpuAllocContext (uintptr_t entry, int stackClass);
 
 // Destroys a context
-void CpuDestroyContext (CpuContext_t* context);
+void CpuDestroyContext (CpuContext_t* context, int stackClass);
+
+// Gets the most of the stack of context that has ever been used
+size_t CpuGetStackPeak (CpuContext_t* context, int stackClass);
+
+// Gets the size of stacks of stackClass
+size_t CpuGetStackSize (int stackClass);
+
+// Sets up CPU specific part of a thread
+void CpuInitThread (NkThread_t* thread);
+
+// Destroys CPU specific part of a thread
+void CpuDestroyThread (NkThread_t* thread);
+
+// Saves or hands off CPU state that isn't part of the context, before switching threads
+void CpuSwitchState (NkThread_t* oldThread, NkThread_t* newThread);
 
 // Asserts that we are not in an interrupt
 #ifndef NDEBUG
-#define CPU_ASSERT_NOT_INT()     \
-    if (CpuRealCcb()->intActive) \
+#define CPU_ASSERT_NOT_INT()    \
+    if (CpuGetCcb()->intActive) \
         NkPanic ("nexke: interrupt check failed\n");
 #else
 #define CPU_ASSERT_NOT_INT()
 #endif
 
-#define CPU_IS_INT() (CpuRealCcb()->intActive)
+#define CPU_IS_INT() (CpuGetCcb()->intActive)
 
 // CPU exception info
 typedef struct _execinf
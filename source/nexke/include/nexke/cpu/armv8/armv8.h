@@ -64,13 +64,16 @@ typedef struct _nkarchccb
 #define CPU_FEATURE_GIC41          (1 << 14)
 #define CPU_FEATURE_EL0_AA32       (1 << 15)
 #define CPU_FEATURE_NMI            (1 << 16)
-#define CPU_NUM_FEATURES           17
+#define CPU_FEATURE_TLB_RANGE      (1 << 17)
+#define CPU_FEATURE_BBM            (1 << 18)
+#define CPU_NUM_FEATURES           19
 
 // ID register bits
 #define CPU_FEAT_MASK       0xF
 #define CPU_ISAR0_RNDR      60ULL
 #define CPU_ISAR0_ATOMIC    20
 #define CPU_ISAR0_CRC32     16
+#define CPU_ISAR0_TLB       56ULL
 #define CPU_ISAR1_XS        56ULL
 #define CPU_MMFR0_EXS       44ULL
 #define CPU_MMFR0_TGRAN4    28
@@ -84,6 +87,7 @@ typedef struct _nkarchccb
 #define CPU_MMFR2_E0PD      60ULL
 #define CPU_MMFR2_CNP       0
 #define CPU_MMFR2_VABITS    16
+#define CPU_MMFR2_BBM       52ULL
 #define CPU_PFR0_GIC        24
 #define CPU_PFR0_EL0_AA32   0
 #define CPU_PFR1_NMI        36ULL
@@ -115,12 +119,23 @@ NkCcb_t* CpuRealCcb();
 
 extern bool ccbInit;
 
+// Per-CPU variables
+// TPIDR_EL1 holds this CPU's perCpuOff, which gets added to the address of a variable in the image
+#define CpuPerCpuRead(var) \
+    (*(volatile __typeof__ (var)*) ((uintptr_t) &(var) + CpuReadSpr ("TPIDR_EL1")))
+
+#define CpuPerCpuWrite(var, val) \
+    (*(volatile __typeof__ (var)*) ((uintptr_t) &(var) + CpuReadSpr ("TPIDR_EL1")) = (val))
+
+// This CPU's CCB
+extern NkCcb_t* CpuCurCcb;
+
 // Gets the current CCB
 static inline NkCcb_t* CpuGetCcb()
 {
     if (ccbInit)
     {
-        return (NkCcb_t*) CpuReadSpr ("TPIDR_EL1");
+        return CpuPerCpuRead (CpuCurCcb);
     }
     else
         return CpuRealCcb();
@@ -128,6 +143,12 @@ static inline NkCcb_t* CpuGetCcb()
 
 void __attribute__ ((noreturn)) CpuCrash();
 
+// Picks memory copy routines for this CPU's features
+void CpuInitString();
+
+// Picks CRC routines for this CPU's features
+void CpuInitCrc();
+
 // CPU page size
 #define NEXKE_CPU_PAGESZ     0x1000
 #define NEXKE_CPU_PAGE_SHIFT 12
@@ -157,6 +178,9 @@ void __attribute__ ((noreturn)) CpuCrash();
 
 #define CpuSpin() asm volatile ("yield")
 
+// Orders stores to memory before a store to a device register
+#define CpuIoBarrier() asm volatile ("dsb st" ::: "memory")
+
 // Gets current exception level
 int CpuGetEl();
 
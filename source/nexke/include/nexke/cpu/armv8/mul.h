@@ -51,11 +51,31 @@ static uint8_t idxShiftTab[] = {0, 12, 21, 30, 39, 48};
 #define PF_ISH                 (3 << 8)
 #define PF_OSH                 (2 << 8)
 #define PF_NSH                 (0 << 8)
+#define PF_NG                  (1ULL << 11)
 #define PF_F                   (1ULL << 55)
+#define PF_CONT                (1ULL << 52)
 #define PT_FRAME               0xFFFFFFFFF000
 #define PT_GETFRAME(pt)        ((pt) & (PT_FRAME))
 #define PF_SETFRAME(pt, frame) ((pt) |= ((frame) & (PT_FRAME)))
 
+// Block support
+// 2 MiB blocks are used like large pages on other MULs. 1 GiB blocks are only used by the direct
+// map, which never gets split
+#define MUL_LARGE_PAGESZ (1ULL << 21)
+#define MUL_LARGE_PAGES  (MUL_LARGE_PAGESZ / NEXKE_CPU_PAGESZ)
+#define MUL_LARGE_LEVEL  2
+#define MUL_HUGE_PAGESZ  (1ULL << 30)
+#define MUL_HUGE_LEVEL   3
+#define PT_LARGEFRAME    0xFFFFFFE00000
+#define PT_ISLARGE(pt)   (((pt) & (PF_V | PF_TAB)) == PF_V)
+
+// Contiguous hint
+// 16 aligned PTEs mapping physically contiguous memory with the same attributes can share one
+// TLB entry. We only set it on pages whose mappings aren't tracked, so it never has to be
+// changed through a page's mapping list
+#define MUL_CONT_PAGES 16
+#define MUL_CONT_SIZE  (MUL_CONT_PAGES * NEXKE_CPU_PAGESZ)
+
 // Value to mask with to get non-canonical address
 #define MUL_CANONICAL_MASK 0x0000FFFFFFFFFFFF
 #define MUL_TOP_ADDR_BIT   (1ULL << 47)
@@ -73,6 +93,15 @@ static uint8_t idxShiftTab[] = {0, 12, 21, 30, 39, 48};
 #define MUL_PTCACHE_TABLE_BASE 0xFFFF00001000
 #define MUL_PTCACHE_ENTRY_BASE 0xFFFF00000000
 
+// Direct map defines
+// Physical memory is mapped here so page tables can be reached without the PT cache
+// The direct map is mapped with level 3 or level 2 blocks where possible
+#define MUL_DIRECT_MAP
+#define MUL_DIRECT_BASE    0xFFFF800000000000
+#define MUL_DIRECT_MAX     0x400000000000    // 64 TiB
+#define MUL_DIRECT_LARGESZ MUL_LARGE_PAGESZ
+#define MUL_DIRECT_HUGESZ  MUL_HUGE_PAGESZ
+
 // Obtains PTE address of specified PT cache entry
 static inline pte_t* MmMulGetCacheAddr (uintptr_t addr)
 {
@@ -95,12 +124,30 @@ typedef struct _memspace MmSpace_t;
 // Allocates page table into ent
 paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t* ent);
 
+// Splits block mapped by ent into a page table
+paddr_t MmMulSplitLarge (MmSpace_t* space, uintptr_t addr, pte_t* ent);
+
 // Checks if address is a kernel address
 #define MmMulIsKernel(addr) ((addr) >= NEXKE_KERNEL_BASE)
 
 // Flushes whole TLB
 void MmMulFlushTlb();
 
+// Flushes all entries of ASID
+void MmMulFlushAsid (int asid);
+
+// ASID support
+#define MUL_TLB_TAGS
+#define MUL_TTBR_ASID_SHIFT 48
+
+// Range TLBI operand
+#define MUL_TLBI_TG          46
+#define MUL_TLBI_SCALE       44
+#define MUL_TLBI_NUM         39
+#define MUL_TLBI_ADDR        0x1FFFFFFFFFULL
+#define MUL_TLBI_TG_4K       1ULL
+#define MUL_TLBI_RANGE_PAGES (32ULL << 16)    // Max pages one range operation can cover
+
 // MAIR defines
 #define MUL_MAIR0 0
 #define MUL_MAIR1 8
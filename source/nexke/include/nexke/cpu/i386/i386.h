@@ -73,6 +73,12 @@ typedef struct _x86idtent
 
 // CCB segment
 #define CPU_CCB_SEG 0x28
+
+// Loads GS with segment selector. Used by APs, which each have their own CCB segment
+void CpuLoadGs (uint16_t seg);
+
+// Loads FS with segment selector. Used by APs, which each have their own per-CPU variable segment
+void CpuLoadFs (uint16_t seg);
 // Double fault TSS segment
 #define CPU_DFAULT_TSS 0x30
 
@@ -66,6 +66,14 @@ static bool idxPrioTab[] = {false, false, true};
 #define MUL_IDX_LEVEL(addr, level) (((addr) >> idxShiftTab[(level)]) & (MUL_IDX_MASK))
 #define MUL_IDX_PRIO(level)        (idxPrioTab[level])
 
+// Large page support
+// PAE page directories can always hold 2 MiB pages
+#define MUL_LARGE_PAGESZ (1UL << 21)
+#define MUL_LARGE_PAGES  (MUL_LARGE_PAGESZ / NEXKE_CPU_PAGESZ)
+#define MUL_LARGE_LEVEL  2
+#define PT_LARGEFRAME    0x7FFFFFFFFFE00000ULL
+#define PT_ISLARGE(pt)   ((pt) & PF_PS)
+
 #define MmMulFlushCacheEntry MmMulFlush
 
 #else
@@ -105,6 +113,14 @@ static uint8_t idxShiftTab[] = {0, 12, 22};
 #define MUL_IDX_MASK               0x3FF
 #define MUL_IDX_LEVEL(addr, level) (((addr) >> idxShiftTab[(level)]) & (MUL_IDX_MASK))
 
+// Large page support
+// 4 MiB pages need PSE, so they're only used when the CPU has it
+#define MUL_LARGE_PAGESZ (1UL << 22)
+#define MUL_LARGE_PAGES  (MUL_LARGE_PAGESZ / NEXKE_CPU_PAGESZ)
+#define MUL_LARGE_LEVEL  2
+#define PT_LARGEFRAME    0xFFC00000
+#define PT_ISLARGE(pt)   ((pt) & PF_PS)
+
 // Max user directory entry
 #define MUL_MAX_USER               767
 #define MUL_KERNEL_START           768
@@ -158,6 +174,9 @@ static inline void MmMulChangePte (pte_t* pte, int perm)
     *pte |= perm;
 }
 
+// Programs PAT with our memory types
+void MmMulInitPat();
+
 // Validates that we can map pte2 to pte1
 void MmMulVerify (pte_t pte1, pte_t pte2);
 
@@ -166,7 +185,13 @@ typedef struct _memspace MmSpace_t;
 // Allocates page table into ent
 paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t* ent);
 
+// Splits large page mapped by ent into a page table
+paddr_t MmMulSplitLarge (MmSpace_t* space, uintptr_t addr, pte_t* ent);
+
 // Checks if address is a kernel address
 #define MmMulIsKernel(addr) ((addr) >= NEXKE_KERNEL_BASE)
 
+// Flushes whole TLB
+void MmMulFlushTlb();
+
 #endif
@@ -30,6 +30,7 @@ typedef struct _ptcache
     pte_t* pte;               // PTE we should use to map this to a physical address
     int level;                // Level of this cache entry
     bool inUse;               // If this entry is in use
+    bool direct;              // If addr points into the direct map instead of the cache
     struct _ptcache* next;    // Next entry in list
     struct _ptcache* prev;
 } MmPtCacheEnt_t;
@@ -52,6 +53,28 @@ typedef struct _pteiter
 
 #define MM_PTAB_UNCACHED 0
 
+// TLB gather, batches up invalidations of a range operation
+#define MM_GATHER_MAX       64    // Max entries in a gather
+#define MM_GATHER_FLUSH_MAX 32    // Past this many addresses a full flush is cheaper
+
+typedef struct _mmgatherent
+{
+    uintptr_t addr;    // Address to invalidate
+    MmPage_t* page;    // Page whose mapping is removed after invalidating, or NULL
+} MmGatherEnt_t;
+
+typedef struct _mmtlbgather
+{
+    MmSpace_t* space;                        // Space being changed
+    uintptr_t start;                         // Lowest address gathered
+    uintptr_t end;                           // End of highest address gathered
+    int count;                               // Number of entries
+    int numPages;                            // Number of entries with a page
+    bool flushAll;                           // Too many addresses to track, flush everything
+    NkList_t tabList;                        // Page tables freed once the TLB has been flushed
+    MmGatherEnt_t entries[MM_GATHER_MAX];    // Gathered entries
+} MmTlbGather_t;
+
 typedef struct _mmspace
 {
     paddr_t base;                                         // Physical base of top level table
@@ -69,6 +92,10 @@ typedef struct _mmspace
 #ifdef NEXNIX_ARCH_I386
     int keVersion;    // Kernel page table version
 #endif
+#ifdef MUL_TLB_TAGS
+    uint64_t tlbTag;    // TLB tag of this space, with the tag's generation in the upper bits
+    int tlbCpu;         // CPU whose TLB entries for this tag are up to date, -1 if none are
+#endif
 } MmMulSpace_t;
 
 #define MM_MUL_LOCK(space)                                   \
@@ -84,9 +111,23 @@ void MmPtabInit (int numLevels);
 // Walks to a page table entry and maps specfied value into it
 MmPtCacheEnt_t* MmPtabWalkAndMap (MmSpace_t* space, paddr_t as, uintptr_t vaddr, pte_t pte);
 
+// Walks to the table at specified level, creating tables as needed
+MmPtCacheEnt_t* MmPtabWalkAndMapLevel (MmSpace_t* space,
+                                       paddr_t as,
+                                       uintptr_t vaddr,
+                                       pte_t pte,
+                                       int level);
+
 // Walks to a pte and returns a cache entry
 MmPtCacheEnt_t* MmPtabWalk (MmSpace_t* space, paddr_t as, uintptr_t vaddr);
 
+// Walks to the table at specified level without changing anything
+// Returns NULL if a table on the way doesn't exist or is a large page
+MmPtCacheEnt_t* MmPtabLookup (MmSpace_t* space, paddr_t as, uintptr_t vaddr, int level);
+
+// Checks if the table at tab has nothing mapped in it
+bool MmPtabIsEmpty (paddr_t tab);
+
 // Iterates over PTEs in address space
 MmPtCacheEnt_t* MmPtabIterate (MmPtIter_t* iter);
 
@@ -96,6 +137,50 @@ void MmPtabEndIterate (MmPtIter_t* iter);
 // Initializes PT cache in specified space
 void MmPtabInitCache (MmSpace_t* space);
 
+// Starts a TLB gather on space
+void MmPtabInitGather (MmTlbGather_t* gather, MmSpace_t* space);
+
+// Adds size bytes at addr to gather
+// If page is set, its mapping at addr gets removed once the TLB has been flushed
+// Space must be locked, and is unlocked while flushing a full gather
+void MmPtabGather (MmTlbGather_t* gather, uintptr_t addr, size_t size, MmPage_t* page);
+
+// Flushes gathered invalidations, removes gathered mappings and frees gathered tables
+// Space must be locked, and is unlocked while removing mappings
+void MmPtabFlushGather (MmTlbGather_t* gather);
+
+// Unhooks tables in the walked range left empty by an unmap, freeing them through gather
+// walkBase is base as the MUL walks it, base is what gets gathered
+// Tables right under the top level table of the kernel space are kept, as other spaces use them
+// Space must be locked
+void MmPtabReclaim (MmTlbGather_t* gather,
+                    paddr_t as,
+                    uintptr_t walkBase,
+                    uintptr_t base,
+                    size_t count);
+
+#ifdef MUL_TLB_TAGS
+// Enables TLB tags, with tags from 1 to maxTag being handed out to spaces
+void MmPtabInitTags (int maxTag);
+
+// Gets TLB tag of space for use on this CPU
+// Returns false if this CPU's TLB entries for the tag must be flushed before using it
+// Preemption must be disabled
+bool MmPtabGetTag (MmSpace_t* space, int* tag);
+
+// Marks TLB entries of space as out of date on every CPU
+void MmPtabStaleTag (MmSpace_t* space);
+#endif
+
+#ifdef MUL_DIRECT_MAP
+// Maps all usable physical memory at MUL_DIRECT_BASE
+// After this, tables in the direct map are reached through it instead of the cache
+void MmPtabInitDirect();
+
+// Gets direct mapped address of physical address, or NULL if it isn't direct mapped
+void* MmPtabGetDirect (paddr_t phys);
+#endif
+
 // Grabs cache entry for table
 MmPtCacheEnt_t* MmPtabGetCache (paddr_t ptab, int level);
 
@@ -111,4 +196,7 @@ MmPtCacheEnt_t* MmPtabSwapCache (paddr_t ptab, MmPtCacheEnt_t* cacheEnt, int lev
 // Flushes a single TLB entry
 void MmMulFlush (uintptr_t vaddr);
 
+// Invalidates TLB entries gathered in gather
+void MmMulFlushGather (MmTlbGather_t* gather);
+
 #endif
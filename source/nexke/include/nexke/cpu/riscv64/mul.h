@@ -0,0 +1,132 @@
+/*
+    mul.h - contains MUL header
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _MUL_H
+#define _MUL_H
+
+#include <stdint.h>
+
+// General PTE type
+typedef uint64_t pte_t;
+
+// Paging modes
+// We take whichever mode nexboot set up. Sv39 has 3 levels, and every mode after it adds one
+#define MUL_SATP_MODE_SV39  8ULL
+#define MUL_SATP_MODE_SV48  9ULL
+#define MUL_SATP_MODE_SV57  10ULL
+#define MUL_SATP_MODE_SHIFT 60
+#define MUL_SATP_MODE_MASK  0xFULL
+#define MUL_SATP_ASID_SHIFT 44
+#define MUL_SATP_ASID_MASK  0xFFFFULL
+#define MUL_SATP_PPN_MASK   0xFFFFFFFFFFFULL
+
+// Virtual address manipulating macros
+// Shift table for each level, with the end of the address space after the top level
+static uint8_t idxShiftTab[] = {0, 12, 21, 30, 39, 48, 57};
+
+// Macro to get level
+#define MUL_IDX_MASK               0x1FF
+#define MUL_IDX_LEVEL(addr, level) (((addr) >> idxShiftTab[(level)]) & (MUL_IDX_MASK))
+
+// Page entry flags
+// An entry with none of R, W and X set points to the next table, anything else is a leaf
+#define PF_V       (1ULL << 0)
+#define PF_R       (1ULL << 1)
+#define PF_W       (1ULL << 2)
+#define PF_X       (1ULL << 3)
+#define PF_U       (1ULL << 4)
+#define PF_G       (1ULL << 5)
+#define PF_A       (1ULL << 6)
+#define PF_D       (1ULL << 7)
+#define PF_F       (1ULL << 8)     // Indicates that a page is fixed, in a bit left for software
+#define PF_PBMT_NC (1ULL << 61)    // Non-cacheable, with Svpbmt
+#define PF_PBMT_IO (2ULL << 61)    // Strongly ordered I/O, with Svpbmt
+#define PF_LEAF    (PF_R | PF_W | PF_X)
+
+// PTEs hold the PPN at bit 10 instead of the physical address
+#define PT_PPN            0x003FFFFFFFFFFC00
+#define PT_GETFRAME(pt)   (((pt) & (PT_PPN)) << 2)
+#define PT_MKFRAME(frame) (((frame) >> 2) & (PT_PPN))
+
+// Mega-page support
+// 2 MiB mega-pages are used like large pages on other MULs. 1 GiB giga-pages are only used by
+// the direct map, which never gets split
+#define MUL_LARGE_PAGESZ (1ULL << 21)
+#define MUL_LARGE_PAGES  (MUL_LARGE_PAGESZ / NEXKE_CPU_PAGESZ)
+#define MUL_LARGE_LEVEL  2
+#define MUL_HUGE_PAGESZ  (1ULL << 30)
+#define MUL_HUGE_LEVEL   3
+#define PT_ISLARGE(pt)   (((pt) & PF_LEAF) != 0)
+
+// Max level of page tables, which Sv57 needs
+#define MM_PTAB_MAX_LEVEL 5
+
+// PT cache defines
+#define MUL_MAX_PTCACHE        85
+#define MUL_PTCACHE_BASE       0xFFFFFFFF00200000
+#define MUL_PTCACHE_TABLE_BASE 0xFFFFFFFF00001000
+#define MUL_PTCACHE_ENTRY_BASE 0xFFFFFFFF00000000
+
+// Direct map defines
+// Physical memory is mapped here so page tables can be reached without the PT cache
+// The direct map is mapped with giga-pages or mega-pages where possible. It has to fit in the
+// kernel half of Sv39, which starts at 0xFFFFFFC000000000
+#define MUL_DIRECT_MAP
+#define MUL_DIRECT_BASE    0xFFFFFFC000000000
+#define MUL_DIRECT_MAX     0x2000000000    // 128 GiB
+#define MUL_DIRECT_LARGESZ MUL_LARGE_PAGESZ
+#define MUL_DIRECT_HUGESZ  MUL_HUGE_PAGESZ
+
+// Obtains PTE address of specified PT cache entry
+static inline pte_t* MmMulGetCacheAddr (uintptr_t addr)
+{
+    return (pte_t*) ((MUL_IDX_LEVEL (addr, 1) * sizeof (pte_t)) + MUL_PTCACHE_TABLE_BASE);
+}
+
+// Maps a cache entry
+// Make it global so flushing it works no matter which ASID is active
+static inline void MmMulMapCacheEntry (pte_t* pte, paddr_t tab)
+{
+    *pte = PT_MKFRAME (tab) | PF_V | PF_R | PF_W | PF_A | PF_D | PF_G;
+}
+
+#define MmMulFlushCacheEntry MmMulFlush
+
+// Validates that we can map pte2 to pte1
+void MmMulVerify (pte_t pte1, pte_t pte2);
+
+typedef struct _memspace MmSpace_t;
+
+// Allocates page table into ent
+paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t* ent);
+
+// Splits mega-page mapped by ent into a page table
+paddr_t MmMulSplitLarge (MmSpace_t* space, uintptr_t addr, pte_t* ent);
+
+// Checks if address is a kernel address
+#define MmMulIsKernel(addr) ((addr) >= NEXKE_KERNEL_BASE)
+
+// Flushes whole TLB
+void MmMulFlushTlb();
+
+// Flushes all entries of ASID
+void MmMulFlushAsid (int asid);
+
+// ASID support
+#define MUL_TLB_TAGS
+
+#endif
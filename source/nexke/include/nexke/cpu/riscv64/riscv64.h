@@ -18,12 +18,96 @@
 #ifndef _RISCV64_H
 #define _RISCV64_H
 
+#define MM_PAGE_TABLES
+
+#include <nexke/types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint64_t paddr_t;
+
+// CSR functions
+#define CpuReadCsr(csr)                               \
+    ({                                                \
+        uint64_t __tmp = 0;                           \
+        asm volatile ("csrr %0, " csr : "=r"(__tmp)); \
+        __tmp;                                        \
+    })
+
+#define CpuWriteCsr(csr, val) asm volatile ("csrw " csr ", %0" : : "r"(val))
+
+typedef struct _nkarchccb
+{
+    uint64_t features;    // CPU feature flags
+    int asidBits;         // Number of ASID bits
+    int vaBits;           // Virtual address bits of the paging mode
+    uint64_t timebase;    // Frequency of the time CSR
+} NkArchCcb_t;
+
+// Defined CPU features
+#define CPU_FEATURE_SSTC     (1 << 0)    // stimecmp CSR
+#define CPU_FEATURE_SVPBMT   (1 << 1)    // Page based memory types
+#define CPU_FEATURE_SVINVAL  (1 << 2)    // Split sfence.vma
+#define CPU_FEATURE_SBI_TIME (1 << 3)    // SBI time extension
+#define CPU_NUM_FEATURES     4
+
+// Sets features from an ISA string, as found in the RHCT or device tree
+void CpuSetIsaFeatures (NkCcb_t* ccb, const char* isa);
+
+// SBI calls
+#define CPU_SBI_EXT_BASE         0x10
+#define CPU_SBI_EXT_TIME         0x54494D45
+#define CPU_SBI_EXT_LEGACY_TIMER 0
+
+#define CPU_SBI_BASE_PROBE 3
+#define CPU_SBI_TIME_SET   0
+
+typedef struct _cpusbiret
+{
+    long error;
+    long value;
+} CpuSbiRet_t;
+
+// Calls into the SBI implementation
+static inline CpuSbiRet_t CpuSbiCall (long ext, long func, long arg0)
+{
+    register long a0 asm ("a0") = arg0;
+    register long a1 asm ("a1") = 0;
+    register long a6 asm ("a6") = func;
+    register long a7 asm ("a7") = ext;
+    asm volatile ("ecall" : "+r"(a0), "+r"(a1) : "r"(a6), "r"(a7) : "memory");
+    CpuSbiRet_t ret = {a0, a1};
+    return ret;
+}
+
+NkCcb_t* CpuGetCcb();
+
+// Handles supervisor timer interrupt
+void CpuTimeInterrupt();
+
 // CPU page size
 #define NEXKE_CPU_PAGESZ     0x1000
 #define NEXKE_CPU_PAGE_SHIFT 12
 
+// User addresses end where the lower half of Sv39 does, so they're valid in every paging mode
+#define NEXKE_USER_ADDR_END 0x3FFFFFFFFF
+
+#define NEXKE_KERNEL_BASE 0xFFFFFFFF80000000
+
+// Kernel general allocation start
+#define NEXKE_KERNEL_ADDR_START 0xFFFFFFFFC0000000
+#define NEXKE_KERNEL_ADDR_END   0xFFFFFFFFDFFFFFFF
+
 // PFN map base
-#define NEXKE_PFNMAP_BASE 0xFFFFFFFD00000000
-#define NEXKE_PFNMAP_MAX  0xF6FFFFFF0
+#define NEXKE_PFNMAP_BASE 0xFFFFFFF000000000
+#define NEXKE_PFNMAP_MAX  (0xE80000000 - 0x10)
+
+// This is pause, which is a hint that runs as a fence on CPUs without Zihintpause
+#define CpuSpin() asm volatile (".4byte 0x0100000F")
+
+// Orders stores to memory before a store to a device register
+#define CpuIoBarrier() asm volatile ("fence w, o" ::: "memory")
+
+#include <nexke/cpu/riscv64/mul.h>
 
 #endif
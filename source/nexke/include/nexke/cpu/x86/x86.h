@@ -83,6 +83,118 @@
 #define CPU_FEATURE_AC            (1ULL << 53)
 #define CPU_FEATURE_ARAT          (1ULL << 54)
 #define CPU_FEATURE_INVARIANT_TSC (1ULL << 55)
+#define CPU_FEATURE_XSAVEOPT      (1ULL << 56)
+#define CPU_FEATURE_XSAVES        (1ULL << 57)
+#define CPU_FEATURE_ERMS          (1ULL << 58)
+#define CPU_FEATURE_AVX2          (1ULL << 59)
+#define CPU_FEATURE_WAITPKG       (1ULL << 60)
+#define CPU_FEATURE_PCLMUL        (1ULL << 61)
+
+// Software flags, set for patching code and not by CPUID
+#define CPU_FEATURE_NOTRACE (1ULL << 63)    // Tracepoints are disabled
+
+// CPUID result
+typedef struct _cpuidInfo
+{
+    uint32_t eax;
+    uint32_t ebx;
+    uint32_t ecx;
+    uint32_t edx;
+} CpuCpuid_t;
+
+// Executes CPUID
+void CpuCpuid (uint32_t code, uint32_t extCode, CpuCpuid_t* cpuid);
+
+// Alternative instructions
+// A site holds the default instructions, padded out to the length of the replacement. If the CPU
+// has the feature, CpuApplyAlternatives copies the replacement over the site at boot
+// Replacements run from a different address than they're assembled at, so they can't contain
+// relative jumps or calls
+typedef struct _cpualt
+{
+    int32_t site;       // Offset from this field to the site
+    int32_t repl;       // Offset from this field to the replacement
+    uint8_t siteLen;    // Length of site, including padding
+    uint8_t replLen;    // Length of replacement
+    uint8_t feature;    // Bit number of CPU_FEATURE_*
+} __attribute__ ((packed)) CpuAlternative_t;
+
+// Makes an asm template for an alternative site
+// Feature is the name of the operand that CPU_ALT_FEATURE sets up
+#define CPU_ALTERNATIVE(oldInsn, newInsn)                                                      \
+    "661:\n\t" oldInsn "\n662:\n\t"                                                           \
+    ".skip -(((664f - 663f) - (662b - 661b)) > 0) * ((664f - 663f) - (662b - 661b)), 0x90\n" \
+    "665:\n\t"                                                                                \
+    ".pushsection .altinstructions, \"a\"\n\t"                                                \
+    ".long 661b - .\n\t"                                                                      \
+    ".long 663f - .\n\t"                                                                      \
+    ".byte 665b - 661b\n\t"                                                                   \
+    ".byte 664f - 663f\n\t"                                                                   \
+    ".byte %c[altFeature]\n\t"                                                                \
+    ".popsection\n\t"                                                                         \
+    ".pushsection .altinstr_replacement, \"ax\"\n"                                            \
+    "663:\n\t" newInsn "\n664:\n\t"                                                           \
+    ".popsection\n"
+
+// Input operand for the feature of an alternative
+#define CPU_ALT_FEATURE(feature) [altFeature] "i"(__builtin_ctzll (feature))
+
+// Checks for a feature without reading the feature flags
+// The site jumps to the false path until it is patched out on CPUs with the feature, so this
+// is always false before CpuApplyAlternatives runs
+#define CpuHasFeature(feature)                                                     \
+    ({                                                                             \
+        __label__ cpuNoFeature;                                                    \
+        bool cpuHas = true;                                                        \
+        asm goto (CPU_ALTERNATIVE ("jmp %l[cpuNoFeature]", "")                     \
+                  :                                                                \
+                  : CPU_ALT_FEATURE (feature)                                      \
+                  :                                                                \
+                  : cpuNoFeature);                                                 \
+        if (0)                                                                     \
+        {                                                                          \
+        cpuNoFeature:                                                              \
+            cpuHas = false;                                                        \
+        }                                                                          \
+        cpuHas;                                                                    \
+    })
+
+// Checks if tracepoints are on
+// Tracepoints jump to their record path until they are patched to NOPs at boot, which is done
+// unless tracing is asked for
+#define CpuTraceOn() (!CpuHasFeature (CPU_FEATURE_NOTRACE))
+
+// Patches alternative sites for the features of this CPU
+void CpuApplyAlternatives();
+
+// Static calls
+// Calls are direct calls to a trampoline, which is a jump to the function that gets rewritten
+// when the call is updated. The trampoline is 8 byte aligned, so the jump's offset doesn't cross
+// a cache line and is rewritten in one store
+// func has to be a plain function name, as the trampoline is made by the assembler
+#define CpuStaticCallDeclare(name, type) extern __typeof__ (*(type) 0) cpuScTramp_##name
+#define CpuStaticCallDefine(name, type, func)      \
+    asm (".pushsection .text, \"ax\"\n\t"          \
+         ".balign 8\n\t"                           \
+         ".globl cpuScTramp_" #name "\n\t"         \
+         ".type cpuScTramp_" #name ", @function\n" \
+         "cpuScTramp_" #name ":\n\t"               \
+         ".byte 0xE9\n\t"                          \
+         ".long " #func " - (. + 4)\n\t"           \
+         ".byte 0xCC, 0xCC, 0xCC\n\t"              \
+         ".size cpuScTramp_" #name ", 8\n\t"       \
+         ".popsection");                           \
+    static type cpuScDefault_##name __attribute__ ((used)) = (func)
+#define CpuStaticCall(name) cpuScTramp_##name
+#define CpuStaticCallUpdate(name, func)                                    \
+    do                                                                     \
+    {                                                                      \
+        __typeof__ (&cpuScTramp_##name) cpuScFunc = (func);                \
+        CpuPatchStaticCall ((void*) cpuScTramp_##name, (void*) cpuScFunc); \
+    } while (0)
+
+// Points the static call trampoline tramp at func
+void CpuPatchStaticCall (void* tramp, void* func);
 
 // Waits for IO completion
 void CpuIoWait();
@@ -124,8 +236,12 @@ void __attribute__ ((noreturn)) CpuCrash();
 #define NEXKE_CPU_PAGESZ     0x1000
 #define NEXKE_CPU_PAGE_SHIFT 12
 
-// Kernel stack size
-#define CPU_KSTACK_SZ 8192
+// Kernel stack sizes
+#define CPU_KSTACK_SZ       8192
+#define CPU_KSTACK_SMALL_SZ 4096
+
+// Number of freed kernel stacks each CPU keeps for reuse
+#define CPU_KSTACK_CACHE_MAX 8
 
 // Data structures
 
@@ -222,13 +338,16 @@ typedef struct _nkarchccb
     int stepping;    // CPU specifier
     int model;
     int family;
-    int physAddrBits;      // Number of bits in a physical address
-    int virtAddrBits;      // Number of bits in virtual address
-    bool intsHeld;         // If interrupts are being held
-    bool intRequested;     // If unhold should enable interrupts
-    uint64_t features;     // CPU feature flags
-    CpuSegDesc_t* gdt;     // GDT pointer
-    CpuIdtEntry_t* idt;    // IDT pointer
+    int physAddrBits;                         // Number of bits in a physical address
+    int virtAddrBits;                         // Number of bits in virtual address
+    bool intsHeld;                            // If interrupts are being held
+    bool intRequested;                        // If unhold should enable interrupts
+    uint64_t features;                        // CPU feature flags
+    CpuSegDesc_t* gdt;                        // GDT pointer
+    CpuIdtEntry_t* idt;                       // IDT pointer
+    struct _thread* fpuOwner;                 // Thread whose FPU state was last loaded here
+    void* kstackCache[CPU_KSTACK_CLASSES];    // Freed kernel stacks kept for reuse
+    int kstackCount[CPU_KSTACK_CLASSES];      // Number of stacks in kstackCache
 } NkArchCcb_t;
 
 // Fills CCB with CPUID flags
@@ -246,24 +365,88 @@ extern uint8_t CpuTrapTable[];
 // CPU-specific thread structure
 typedef struct _cputhread
 {
-    // Nothing for now
+    void* fpuArea;      // Saved FPU and SIMD state, allocated on first use
+    int simdDepth;      // Nesting depth of SIMD regions
+    NkCcb_t* fpuCpu;    // CPU this thread's FPU state was last loaded on
 } CpuThread_t;
 
+// Sets up the FPU and SIMD state of this CPU
+void CpuInitFpu();
+
+// Starts a region of kernel code that uses FPU or SIMD registers
+// Returns false if they can't be used here, in which case CpuEndSimd must not be called
+// Regions can nest, and may be preempted or block. Interrupt handlers can't use them
+bool CpuBeginSimd();
+
+// Ends a SIMD region
+void CpuEndSimd();
+
+// Picks memory copy routines for this CPU's features
+void CpuInitString();
+
+// Picks CRC routines for this CPU's features
+void CpuInitCrc();
+
+// Sets up kernel stack cache
+void CpuInitKstack();
+
+// Allocates a kernel stack of stackClass, returning the bottom of it
+void* CpuAllocKstack (int stackClass);
+
+// Frees a kernel stack
+void CpuFreeKstack (void* stack, int stackClass);
+
+// Gets how much of a kernel stack has been used since it was allocated
+size_t CpuGetKstackPeak (void* stack, int stackClass);
+
 // Segment reg helpers
 #define CpuReadGs(val) asm volatile ("mov %%gs:0,%0" : "=r"((val)) :);
 
+// Per-CPU variables
+// The base of the per-CPU segment is this CPU's perCpuOff, so adding it to the address of a
+// variable in the image gets to this CPU's copy. However the compiler addresses the variable,
+// the access is a single segment relative instruction
+#ifdef __x86_64__
+#define CPU_PERCPU_SEG "gs"
+#else
+#define CPU_PERCPU_SEG "fs"
+#endif
+
+#define CpuPerCpuRead(var)                                                         \
+    ({                                                                             \
+        __typeof__ (var) __val;                                                    \
+        asm volatile ("mov %%" CPU_PERCPU_SEG ":%1, %0" : "=q"(__val) : "m"(var)); \
+        __val;                                                                     \
+    })
+
+#define CpuPerCpuWrite(var, val) \
+    asm volatile ("mov %1, %%" CPU_PERCPU_SEG ":%0" : "=m"(var) : "q"((__typeof__ (var)) (val)))
+
+// Adds to this CPU's copy of a scalar var, in one instruction so interrupts can't get in between
+#define CpuPerCpuAdd(var, val) \
+    asm volatile ("add %1, %%" CPU_PERCPU_SEG ":%0" : "+m"(var) : "r"((__typeof__ (var)) (val)))
+
 extern bool ccbInit;
 
 NkCcb_t* CpuRealCcb();
 
+#ifdef __x86_64__
+// This CPU's CCB
+extern NkCcb_t* CpuCurCcb;
+#endif
+
 // Gets the current CCB
 static FORCEINLINE NkCcb_t* CpuGetCcb()
 {
     if (ccbInit)
     {
+#ifdef __x86_64__
+        return CpuPerCpuRead (CpuCurCcb);
+#else
         uintptr_t ccb = 0;
         CpuReadGs (ccb);
         return (NkCcb_t*) ccb;
+#endif
     }
     else
         return CpuRealCcb();
@@ -271,8 +454,19 @@ static FORCEINLINE NkCcb_t* CpuGetCcb()
 
 #define CpuSpin() asm ("pause")
 
+// Orders every load and store before it with every one after it
+#define CpuMfence() asm volatile ("mfence" ::: "memory")
+
+// Orders stores to memory before a store to a device register
+// Uncached stores already stay behind earlier stores on x86, so only the compiler has to be held
+#define CpuIoBarrier() asm volatile ("" ::: "memory")
+
 // Control register bits
 #define CPU_CR0_PE (1 << 0)
+#define CPU_CR0_MP (1 << 1)
+#define CPU_CR0_EM (1 << 2)
+#define CPU_CR0_TS (1 << 3)
+#define CPU_CR0_NE (1 << 5)
 #define CPU_CR0_WP (1 << 16)
 #define CPU_CR0_AM (1 << 18)
 #define CPU_CR0_PG (1 << 31)
@@ -284,11 +478,14 @@ static FORCEINLINE NkCcb_t* CpuGetCcb()
 #define CPU_CR4_OSFXSR     (1 << 9)
 #define CPU_CR4_OSXMMEXCPT (1 << 10)
 #define CPU_CR4_UMIP       (1 << 11)
+#define CPU_CR4_PCIDE      (1 << 17)
 #define CPU_CR4_OSXSAVE    (1 << 18)
 #define CPU_CR4_SMEP       (1 << 20)
 #define CPU_CR4_SMAP       (1 << 21)
 
 #define CPU_EFER_SCE (1 << 0)
+#define CPU_EFER_LME (1 << 8)
+#define CPU_EFER_LMA (1 << 10)
 #define CPU_EFER_NXE (1 << 11)
 #define CPU_EFER_MSR 0xC0000080
 
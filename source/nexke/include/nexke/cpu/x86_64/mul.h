@@ -42,6 +42,19 @@ typedef uint64_t pte_t;
 #define PT_GETFRAME(pt)        ((pt) & (PT_FRAME))
 #define PT_SETFRAME(pt, frame) ((pt) |= ((frame) & (PT_FRAME)))
 
+// Large page support
+// We only use 2 MiB pages for now
+#define MUL_LARGE_PAGESZ (1ULL << 21)
+#define MUL_LARGE_PAGES  (MUL_LARGE_PAGESZ / NEXKE_CPU_PAGESZ)
+#define MUL_LARGE_LEVEL  2
+#define PT_LARGEFRAME    0x7FFFFFFFFFE00000
+#define PT_ISLARGE(pt)   ((pt) & PF_PS)
+
+// PCID support
+#define MUL_TLB_TAGS
+#define MUL_MAX_PCID    4095
+#define MUL_CR3_NOFLUSH (1ULL << 63)
+
 // PAT stuff
 #define MUL_PAT_MSR 0x277
 
@@ -92,6 +105,13 @@ static bool idxPrioTable[] = {false, false, false, true, true, true};
 #define MUL_PTCACHE_TABLE_BASE 0xFFFFFFFF00001000
 #define MUL_PTCACHE_ENTRY_BASE 0xFFFFFFFF00000000
 
+// Direct map defines
+// Physical memory is mapped here so page tables can be reached without the PT cache
+#define MUL_DIRECT_MAP
+#define MUL_DIRECT_BASE    0xFFFF800000000000
+#define MUL_DIRECT_MAX     0x400000000000    // 64 TiB
+#define MUL_DIRECT_LARGESZ MUL_LARGE_PAGESZ
+
 #ifdef NEXNIX_X86_64_LA57
 #define MUL_MAX_USER_PMLTOP 511
 #else
@@ -107,7 +127,9 @@ static inline pte_t* MmMulGetCacheAddr (uintptr_t addr)
 // Maps a cache entry
 static inline void MmMulMapCacheEntry (pte_t* pte, paddr_t tab)
 {
-    *pte = tab | PF_P | PF_RW;
+    // Make it global so flushing it works no matter which PCID is active
+    // PF_G is ignored when PGE is off
+    *pte = tab | PF_P | PF_RW | PF_G;
 }
 
 // Changes flags of entry
@@ -119,6 +141,12 @@ static inline void MmMulChangePte (pte_t* pte, int perm)
 
 #define MmMulFlushCacheEntry MmMulFlush
 
+// Flushes whole TLB
+void MmMulFlushTlb();
+
+// Programs PAT with our memory types
+void MmMulInitPat();
+
 // Validates that we can map pte2 to pte1
 void MmMulVerify (pte_t pte1, pte_t pte2);
 
@@ -127,6 +155,9 @@ typedef struct _memspace MmSpace_t;
 // Allocates page table into ent
 paddr_t MmMulAllocTable (MmSpace_t* space, uintptr_t addr, pte_t* stBase, pte_t* ent);
 
+// Splits large page mapped by ent into a page table
+paddr_t MmMulSplitLarge (MmSpace_t* space, uintptr_t addr, pte_t* ent);
+
 // Checks if address is a kernel address
 #define MmMulIsKernel(addr) ((addr) >= NEXKE_KERNEL_BASE)
 
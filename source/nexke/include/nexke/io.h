@@ -0,0 +1,277 @@
+/*
+    io.h - contains I/O subsystem interface
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _IO_H
+#define _IO_H
+
+#include <nexke/list.h>
+#include <nexke/mm.h>
+#include <nexke/platform/pci.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Asynchronous I/O
+
+// An I/O request packet stands for one operation that's in flight. Whoever does it finishes it
+// with IoCompleteIrp, from anywhere, which puts it on a list of the current CPU for a DPC to
+// deliver. That either calls its done callback, or posts it to its completion port. Nothing gets
+// allocated on the way, as the IRP itself is what's queued
+// Completion ports are queues of finished IRPs. Threads wait on them and take off as many as are
+// there, up to however many they can handle, so one thread can keep lots of operations going and
+// deal with them in batches as they finish
+
+typedef struct _ioirp IoIrp_t;
+
+typedef struct _ioport IoPort_t;
+
+// Called when an IRP finishes, from a DPC
+typedef void (*IoIrpDone) (IoIrp_t* irp);
+
+// I/O request packet
+typedef struct _ioirp
+{
+    int status;             // Status once it's done
+    size_t count;           // How much got done
+    IoIrpDone done;         // Called when it's done, or NULL to post it to port
+    IoPort_t* port;         // Port it gets posted to
+    void* key;              // Submitter's data, handed back with it
+    void* drvData;          // Data of whoever does it
+    struct _ioirp* next;    // Next IRP on a completion list
+} IoIrp_t;
+
+// Completion port
+typedef struct _ioport
+{
+    IoIrp_t* head;     // IRPs that are done
+    IoIrp_t* tail;
+    atomic_t count;    // Number of IRPs on the port
+    spinlock_t lock;
+} IoPort_t;
+
+// Sets up IRPs
+void IoInitIrps();
+
+// Sets up irp to call done or be posted to port when it finishes
+void IoInitIrp (IoIrp_t* irp, IoIrpDone done, IoPort_t* port, void* key);
+
+// Finishes irp with status, count being how much got done
+// Safe at any IPL
+void IoCompleteIrp (IoIrp_t* irp, int status, size_t count);
+
+// Sets up a completion port
+void IoInitPort (IoPort_t* port);
+
+// Posts irp to port straight away, without it being finished
+// Lets waiters be handed things that aren't I/O
+void IoPortPost (IoPort_t* port, IoIrp_t* irp);
+
+// Waits for IRPs on port, and takes up to max of them into irps
+// Returns how many it took, or 0 if timeout went by first
+int IoPortWait (IoPort_t* port, IoIrp_t** irps, int max, ktime_t timeout);
+
+// Block devices
+
+// Block devices have one or more hardware queues. Each CPU submits to the queue it maps to, so
+// CPUs don't fight over a queue when there are enough to go around
+// Requests go through the block layer on their way to the driver. Submitters can plug a device
+// while they queue a batch, so requests that follow on from each other get merged into one large
+// request before anything goes out. Unplugging hands the batch to the device's scheduler, which is
+// either none, where each CPU has a software queue that's drained into its hardware queue in
+// order, or deadline, which sends requests out in sector order, but never lets one wait past its
+// deadline. -iosched picks one for every device, otherwise single queue devices get deadline
+// Drivers take requests in two steps: submit puts one on a queue without telling the device, and
+// commit tells the device about everything submitted since the last commit. So a batch only costs
+// one doorbell write. When a queue is full, what's left waits in the block layer until something
+// on that queue finishes
+// Drivers finish requests from interrupts, and the block layer finishes them for the submitter
+// from a DPC
+// Queues after the first numQueues are polled. They don't interrupt, and their requests skip the
+// block layer and are finished by the submitter spinning on poll, which is quicker when the device
+// is fast enough
+
+// Operations
+#define IO_BLOCK_READ  0
+#define IO_BLOCK_WRITE 1
+#define IO_BLOCK_FLUSH 2
+
+// Request flags
+#define IO_BLOCK_POLL (1 << 0)    // Use a polled queue if there is one
+
+// Request status
+#define IO_STATUS_PENDING 0
+#define IO_STATUS_OK      1
+#define IO_STATUS_ERROR   2
+
+typedef struct _ioblockreq IoBlockReq_t;
+
+typedef struct _ioblockdev IoBlockDev_t;
+
+// Called when a request finishes, from a DPC, or by the poller for polled requests
+typedef void (*IoBlockDone) (IoBlockReq_t* req);
+
+// Block request
+typedef struct _ioblockreq
+{
+    int op;                // Operation
+    int flags;             // Request flags
+    uint64_t sector;       // First sector
+    size_t count;          // Number of sectors
+    MmPage_t** pages;      // Pages data goes to or comes from, which must stay put until it's done
+    size_t offset;         // Where data starts in first page
+    atomic_t status;       // Status of request
+    IoBlockDone done;      // Called when it's done, NULL to wake threads waiting on status
+    IoIrp_t* irp;          // Finished with the request's status instead of done, if set
+    void* priv;            // Submitter's data
+    // Block layer's data
+    IoBlockDev_t* dev;      // Device it went to
+    int queue;              // Hardware queue it went to
+    int result;             // Status until the submitter is told
+    ktime_t deadline;       // When the deadline scheduler stops letting others go first
+    NkLink_t schedLink;     // Link in the deadline scheduler's FIFO
+    NkLink_t link;          // Used by whoever has the request
+} IoBlockReq_t;
+
+// Block device
+typedef struct _ioblockdev
+{
+    char name[32];           // Name of device
+    size_t sectorSize;       // Size of a sector
+    uint64_t numSectors;     // Sectors on device
+    size_t maxSectors;       // Most sectors a request can have
+    int numQueues;           // Queues that interrupt
+    int numPollQueues;       // Queues that get polled, after the others
+    // Puts req on queue without telling the device. Returns false if the queue is full
+    bool (*submit) (IoBlockDev_t* dev, int queue, IoBlockReq_t* req);
+    // Tells the device about requests submitted to queue
+    void (*commit) (IoBlockDev_t* dev, int queue);
+    // Finishes requests the device is done with on queue. Returns how many it finished
+    int (*poll) (IoBlockDev_t* dev, int queue);
+    void* drvData;      // Driver's data
+    void* layerData;    // Block layer's data
+    NkLink_t link;
+} IoBlockDev_t;
+
+// Plug, which holds requests to a device back so they can be merged and sent together
+typedef struct _ioblockplug
+{
+    IoBlockDev_t* dev;    // Device that's plugged
+    NkList_t reqs;        // Requests held back
+    int count;            // Number of requests held back
+} IoBlockPlug_t;
+
+// Sets up the block layer
+void IoInitBlock();
+
+// Registers a block device
+void IoRegisterBlockDev (IoBlockDev_t* dev);
+
+// Finds a block device by name
+IoBlockDev_t* IoFindBlockDev (const char* name);
+
+// Plugs dev
+void IoBlockStartPlug (IoBlockPlug_t* plug, IoBlockDev_t* dev);
+
+// Queues req on plug, merging it with the request before it if it follows on from it
+// Requests can't ask to be polled. The plug is flushed if it holds too many requests
+void IoBlockQueue (IoBlockPlug_t* plug, IoBlockReq_t* req);
+
+// Unplugs, sending what plug held out
+void IoBlockFinishPlug (IoBlockPlug_t* plug);
+
+// Submits count requests to dev, plugged so they're sent together
+void IoBlockSubmit (IoBlockDev_t* dev, IoBlockReq_t** reqs, int count);
+
+// Waits for a request that was submitted, returning its status
+int IoBlockWait (IoBlockReq_t* req);
+
+// Finishes a request. Called by drivers, usually from interrupts
+void IoBlockComplete (IoBlockReq_t* req, int status);
+
+// Does a request and waits for it, returning its status
+int IoBlockRw (IoBlockDev_t* dev,
+               int op,
+               uint64_t sector,
+               size_t count,
+               MmPage_t** pages,
+               size_t offset,
+               int flags);
+
+// Makes file a range of numSectors sectors starting at sector on dev, so its page cache is read
+// and written through the block layer. Sectors have to be no bigger than pages
+bool IoInitBlockFile (MmFile_t* file,
+                      IoBlockDev_t* dev,
+                      uint64_t sector,
+                      uint64_t numSectors,
+                      int perm);
+
+// Network devices
+
+// Network devices have a pair of queues for each CPU, or as many as they can. Frames to send are
+// queued with xmit and sent with flush, like block requests. Frames that come in are handed to
+// recv as they're taken off the device, and the buffer goes back to the device once it returns
+
+typedef struct _ionetbuf IoNetBuf_t;
+
+// Frame to send
+typedef struct _ionetbuf
+{
+    void* data;                        // Frame
+    paddr_t phys;                      // Physical address of frame, which has to be contiguous
+    size_t len;                        // Length of frame
+    void (*done) (IoNetBuf_t* buf);    // Called once it's sent, possibly from an interrupt
+    void* priv;                        // Sender's data
+} IoNetBuf_t;
+
+typedef struct _ionetdev IoNetDev_t;
+
+// Network device
+typedef struct _ionetdev
+{
+    char name[32];       // Name of device
+    uint8_t mac[6];      // MAC address
+    size_t mtu;          // Largest frame payload
+    int numQueues;       // Number of queue pairs
+    // Puts buf on send queue without telling the device. Returns false if the queue is full
+    bool (*xmit) (IoNetDev_t* dev, int queue, IoNetBuf_t* buf);
+    // Tells the device about frames put on send queue
+    void (*flush) (IoNetDev_t* dev, int queue);
+    // Called with each frame that comes in, possibly from an interrupt. Set by whoever takes
+    // frames, which are dropped until it is. data is only good until it returns
+    void (*recv) (IoNetDev_t* dev, const void* data, size_t len);
+    void* drvData;    // Driver's data
+    NkLink_t link;
+} IoNetDev_t;
+
+// Registers a network device
+void IoRegisterNetDev (IoNetDev_t* dev);
+
+// Finds a network device by name
+IoNetDev_t* IoFindNetDev (const char* name);
+
+// Sends count frames on this CPU's queue, telling the device once
+// Returns how many were queued, which is less than count if the queue filled up
+int IoNetSend (IoNetDev_t* dev, IoNetBuf_t** bufs, int count);
+
+// Drivers
+
+// Probes an AHCI controller
+bool IoAhciProbe (PltPciDev_t* dev);
+
+// Probes an NVMe controller
+bool IoNvmeProbe (PltPciDev_t* dev);
+
+#endif
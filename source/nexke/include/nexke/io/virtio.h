@@ -0,0 +1,171 @@
+/*
+    virtio.h - contains virtio transport interface
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _VIRTIO_H
+#define _VIRTIO_H
+
+#include <nexke/io.h>
+#include <nexke/lock.h>
+#include <nexke/platform.h>
+#include <nexke/platform/pci.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Feature bits
+#define IO_VIRT_F_INDIRECT  28
+#define IO_VIRT_F_EVENT_IDX 29
+#define IO_VIRT_F_VERSION_1 32
+
+#define IO_VIRT_FEATURE(bit) (1ULL << (bit))
+
+// Descriptor flags
+#define IO_VIRT_DESC_NEXT     (1 << 0)
+#define IO_VIRT_DESC_WRITE    (1 << 1)    // Device writes to buffer
+#define IO_VIRT_DESC_INDIRECT (1 << 2)    // Buffer is a table of descriptors
+
+// Split ring descriptor
+typedef struct _iovirtdesc
+{
+    uint64_t addr;     // Physical address of buffer
+    uint32_t len;      // Length of buffer
+    uint16_t flags;    // Descriptor flags
+    uint16_t next;     // Next descriptor in chain
+} __attribute__ ((packed)) IoVirtDesc_t;
+
+// Split ring available ring
+// used_event follows the ring
+typedef struct _iovirtavail
+{
+    uint16_t flags;
+    uint16_t idx;       // Where we'll put the next entry
+    uint16_t ring[];    // Heads of descriptor chains
+} IoVirtAvail_t;
+
+#define IO_VIRT_AVAIL_NO_INTERRUPT (1 << 0)
+
+// Split ring used element
+typedef struct _iovirtusedelem
+{
+    uint32_t id;     // Head of descriptor chain
+    uint32_t len;    // Bytes written into it
+} __attribute__ ((packed)) IoVirtUsedElem_t;
+
+// Split ring used ring
+// avail_event follows the ring
+typedef struct _iovirtused
+{
+    uint16_t flags;
+    uint16_t idx;                  // Where the device will put the next entry
+    IoVirtUsedElem_t ring[];       // Buffers it's done with
+} __attribute__ ((packed)) IoVirtUsed_t;
+
+#define IO_VIRT_USED_NO_NOTIFY (1 << 0)
+
+typedef struct _iovirtdev IoVirtDev_t;
+typedef struct _iovirtqueue IoVirtQueue_t;
+
+// Called for each buffer the device is done with, unlocked
+typedef void (*IoVirtDone) (IoVirtQueue_t* q, void* token, uint32_t len);
+
+// Virtqueue
+typedef struct _iovirtqueue
+{
+    IoVirtDev_t* dev;             // Device queue is on
+    int idx;                      // Queue index
+    uint16_t size;                // Entries in queue
+    bool polled;                  // Queue doesn't interrupt
+    bool lazy;                    // Only interrupt when most of what's out has been used
+    IoVirtDesc_t* desc;           // Descriptor table
+    IoVirtAvail_t* avail;         // Available ring
+    IoVirtUsed_t* used;           // Used ring
+    volatile uint16_t* usedEvent;     // Used index we want an interrupt at
+    volatile uint16_t* availEvent;    // Available index the device wants a kick at
+    volatile uint16_t* notify;    // Where kicks go
+    uint16_t availIdx;            // Available index, not yet published past the last kick
+    uint16_t kickedIdx;           // Available index at last kick
+    uint16_t lastUsed;            // Used index we've reaped up to
+    uint16_t* freeDescs;          // Stack of free descriptors
+    int numFree;                  // Number of free descriptors
+    void** tokens;                // Token of each descriptor
+    IoVirtDone done;              // Called for used buffers
+    void* priv;                   // Driver's data
+    spinlock_t lock;
+    NkHwInterrupt_t hwInt;        // Interrupt of queue
+    PltPoll_t poll;               // Reaps the queue for its interrupt
+    int vec;                      // MSI-X entry of queue
+} IoVirtQueue_t;
+
+// Virtio device
+typedef struct _iovirtdev
+{
+    PltPciDev_t* pci;              // PCI function
+    volatile uint8_t* common;      // Common config
+    volatile uint8_t* notify;      // Notify area
+    uint32_t notifyMul;            // Multiplier of queue notify offsets
+    volatile uint8_t* devCfg;      // Device config
+    uint64_t features;             // Negotiated features
+    int numVecs;                   // MSI-X entries
+} IoVirtDev_t;
+
+// Finds dev's config, resets it, and negotiates features out of wanted
+// VERSION_1 is always asked for. Returns false if it isn't a modern device
+bool IoVirtInit (IoVirtDev_t* dev, PltPciDev_t* pci, uint64_t wanted);
+
+// Tells whether feature bit was negotiated
+static inline bool IoVirtHasFeature (IoVirtDev_t* dev, int bit)
+{
+    return (dev->features & IO_VIRT_FEATURE (bit)) != 0;
+}
+
+// Reads len bytes of device config at off, consistently
+void IoVirtReadCfg (IoVirtDev_t* dev, int off, void* buf, size_t len);
+
+// Sets up queue idx, which interrupts cpuNum through MSI-X entry vec, or is polled if cpuNum is
+// -1. done is called for buffers the device uses. Returns NULL if it can't be set up
+IoVirtQueue_t* IoVirtSetupQueue (IoVirtDev_t* dev, int idx, int cpuNum, int vec, IoVirtDone done);
+
+// Lets the device start
+void IoVirtReady (IoVirtDev_t* dev);
+
+// Marks the device as failed
+void IoVirtFail (IoVirtDev_t* dev);
+
+// Gets a free descriptor, or -1 if there are none
+int IoVirtGetDesc (IoVirtQueue_t* q);
+
+// Gives back a descriptor that wasn't submitted
+void IoVirtPutDesc (IoVirtQueue_t* q, int desc);
+
+// Fills descriptor desc and makes it available, without telling the device
+void IoVirtSubmit (IoVirtQueue_t* q,
+                   int desc,
+                   paddr_t addr,
+                   uint32_t len,
+                   uint16_t flags,
+                   void* token);
+
+// Tells the device about buffers submitted since the last kick, if it wants to know
+void IoVirtKick (IoVirtQueue_t* q);
+
+// Reaps used buffers, returning how many there were
+int IoVirtReap (IoVirtQueue_t* q);
+
+// Drivers
+bool IoVirtBlkProbe (PltPciDev_t* dev);
+bool IoVirtNetProbe (PltPciDev_t* dev);
+
+#endif
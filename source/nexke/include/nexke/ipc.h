@@ -0,0 +1,82 @@
+/*
+    ipc.h - contains IPC port interface
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _IPC_H
+#define _IPC_H
+
+#include <nexke/lock.h>
+#include <nexke/mm.h>
+
+// A port is a ring of fixed size messages with one producer and one consumer. The ring lives in
+// pages of an anonymous object, which are mapped into the kernel and can be mapped into any
+// address space, so both sides work on the same memory and messages are only copied in and out
+// of it once
+// head and tail count messages sent and received, and only their own side writes them. A side
+// that has to wait sets its wait word first, and the other side only goes into the kernel to wake
+// it when that is set, so a busy pair never has to
+
+#define NK_IPC_CACHELINE 64
+
+// Ring header, at the start of the shared pages
+// Slots follow it
+typedef struct _nkipcring
+{
+    atomic_t head __attribute__ ((aligned (NK_IPC_CACHELINE)));    // Messages sent
+    atomic_t consWait;                                             // Consumer waits on head
+    atomic_t tail __attribute__ ((aligned (NK_IPC_CACHELINE)));    // Messages received
+    atomic_t prodWait;                                             // Producer waits on tail
+    size_t msgSize __attribute__ ((aligned (NK_IPC_CACHELINE)));   // Size of a message
+    size_t numSlots;                                               // Slots in ring
+} NkIpcRing_t;
+
+// Port
+typedef struct _nkipcport
+{
+    MmObject_t* obj;       // Object ring lives in
+    NkIpcRing_t* ring;     // Kernel mapping of ring
+    char* slots;           // Kernel mapping of slots
+    size_t msgSize;        // Size of a message
+    size_t numSlots;       // Slots in ring, a power of two
+    size_t numPages;       // Pages ring takes up
+} NkIpcPort_t;
+
+// Flags
+#define NK_IPC_NOWAIT (1 << 0)    // Don't block if nothing can be sent or received
+
+// Creates a port of numSlots messages of msgSize bytes
+// numSlots is rounded up to a power of two
+NkIpcPort_t* NkIpcCreatePort (size_t msgSize, size_t numSlots);
+
+// Destroys a port
+// Nobody may be waiting on it. Address spaces it was mapped into keep their mappings
+void NkIpcDestroyPort (NkIpcPort_t* port);
+
+// Maps port's ring into space
+// The entry holds a reference on the ring, and is freed with MmFreeSpace
+MmSpaceEntry_t* NkIpcMapPort (NkIpcPort_t* port, MmSpace_t* space);
+
+// Sends up to count messages, blocking until at least one fits unless NK_IPC_NOWAIT is given
+// Only one thread may send on a port at a time
+// Returns the number of messages sent
+size_t NkIpcSend (NkIpcPort_t* port, const void* msgs, size_t count, int flags);
+
+// Receives up to count messages, blocking until at least one is there unless NK_IPC_NOWAIT is
+// given. Only one thread may receive on a port at a time
+// Returns the number of messages received
+size_t NkIpcRecv (NkIpcPort_t* port, void* msgs, size_t count, int flags);
+
+#endif
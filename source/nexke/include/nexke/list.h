@@ -94,6 +94,12 @@ static FORCEINLINE NkLink_t* NkListFront (NkList_t* list)
     return (list->next == list) ? NULL : list->next;
 }
 
+// Gets last item in list
+static FORCEINLINE NkLink_t* NkListBack (NkList_t* list)
+{
+    return (list->prev == list) ? NULL : list->prev;
+}
+
 // Iterates to next item in list
 static FORCEINLINE NkLink_t* NkListIterate (NkList_t* list, NkLink_t* link)
 {
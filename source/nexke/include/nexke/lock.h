@@ -23,29 +23,395 @@
 static inline void TskDisablePreempt();
 static inline void TskEnablePreempt();
 
+// Lock statistics
+// When built with NEXKE_LOCK_STATS, every place a lock is taken at gets a site that counts how
+// often the lock was taken there, how long it was waited on, and how long it was held for
+// The site is made by the lock macros at the call, so they're only declared here
+typedef struct _nklocksite NkLockSite_t;
+
+#ifdef NEXKE_LOCK_STATS
+typedef struct _nklocksite
+{
+    const char* file;            // File lock is taken in
+    int line;                    // Line lock is taken on
+    int registered;              // Wheter site is on site list
+    uintmax_t acquires;          // Number of times lock was taken
+    uintmax_t contended;         // Number of times we had to wait
+    uintmax_t spins;             // Number of times we spun waiting
+    uint64_t holdTime;           // Total time held, in CPU cycles
+    uint64_t maxHold;            // Longest time held
+    struct _nklocksite* next;    // Next site on list
+} NkLockSite_t;
+
+// Gets the lock site of the caller
+#define NK_LOCK_SITE()                                                          \
+    ({                                                                          \
+        static NkLockSite_t _nkLockSite = {.file = __FILE__, .line = __LINE__}; \
+        &_nkLockSite;                                                           \
+    })
+
+// Records that lock got taken at site after spinning spins times
+void NkLockStatAcquire (void* lock, NkLockSite_t* site, unsigned long spins);
+
+// Records that lock got released
+void NkLockStatRelease (void* lock);
+
+#define NK_LOCK_STAT_ACQUIRE(lock, site, spins) NkLockStatAcquire ((void*) (lock), site, spins)
+#define NK_LOCK_STAT_RELEASE(lock)              NkLockStatRelease ((void*) (lock))
+#else
+#define NK_LOCK_SITE()                          NULL
+#define NK_LOCK_STAT_ACQUIRE(lock, site, spins) (void) (site)
+#define NK_LOCK_STAT_RELEASE(lock)
+#endif
+
+// Dumps lock statistics
+void NkDumpLockStats();
+
+// Ticket locks
+// spinlock_t is a ticket lock. The low half is the ticket being served, and the high half is the
+// next ticket to hand out. Lockers take a ticket and wait for it to come up, so the lock goes out
+// in FIFO order and waiters only read the lock while they spin
+// These are used for most locks, as they are as small and cheap as a test-and-set lock
+#define NK_TICKET_SHIFT 16
+#define NK_TICKET_MASK  0xFFFF
+
+// Takes a ticket and waits for it to be served
+// Returns number of times we spun
+static FORCEINLINE unsigned long NkTicketAcquire (spinlock_t* lock)
+{
+    uint32_t val = __atomic_fetch_add (lock, 1 << NK_TICKET_SHIFT, __ATOMIC_ACQUIRE);
+    uint32_t ticket = val >> NK_TICKET_SHIFT;
+    unsigned long spins = 0;
+    while ((val & NK_TICKET_MASK) != ticket)
+    {
+        CpuSpin();
+        ++spins;
+        val = __atomic_load_n (lock, __ATOMIC_ACQUIRE);
+    }
+    return spins;
+}
+
+// Takes a ticket if it would be served right away
+static FORCEINLINE bool NkTicketTryAcquire (spinlock_t* lock)
+{
+    uint32_t val = __atomic_load_n (lock, __ATOMIC_RELAXED);
+    if ((val >> NK_TICKET_SHIFT) != (val & NK_TICKET_MASK))
+        return false;
+    return __atomic_compare_exchange_n (lock,
+                                        &val,
+                                        val + (1 << NK_TICKET_SHIFT),
+                                        false,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED);
+}
+
+// Serves the next ticket
+static FORCEINLINE void NkTicketRelease (spinlock_t* lock)
+{
+    // Lockers may be taking tickets at the same time, and a plain add could carry into their half
+    uint32_t val = __atomic_load_n (lock, __ATOMIC_RELAXED);
+    assert ((val >> NK_TICKET_SHIFT) != (val & NK_TICKET_MASK));
+    uint32_t newVal = 0;
+    do
+    {
+        newVal = (val & ~NK_TICKET_MASK) | ((val + 1) & NK_TICKET_MASK);
+    } while (
+        !__atomic_compare_exchange_n (lock, &val, newVal, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// Queued locks
+// mcslock_t is an MCS lock packed into 32 bits, used for hot locks. The low byte is set while the
+// lock is held, and the high half is the tail of the queue of waiting CPUs. Each waiter spins on a
+// node of its own, and gets handed the head of the queue by the waiter before it, so only the
+// head ever looks at the lock. That keeps the lock's cache line from bouncing between every
+// waiting CPU. Nodes are per-CPU and are only used while waiting, so the holder doesn't need one
+#define NK_MCS_LOCKED     (1 << 0)
+#define NK_MCS_TAIL_SHIFT 16
+#define NK_MCS_NESTING    4    // Max number of nested waits on a CPU, one per interrupt level
+
+// MCS queue node
+typedef struct _nkmcsnode
+{
+    struct _nkmcsnode* volatile next;    // Next waiter in queue
+    volatile int head;                   // Set when we are at the head of the queue
+} NkMcsNode_t;
+
+// Waits on a contended queued lock
+// Returns number of times we spun
+unsigned long NkMcsAcquireSlow (mcslock_t* lock);
+
+// Takes a queued lock
+// Returns number of times we spun
+static FORCEINLINE unsigned long NkMcsAcquire (mcslock_t* lock)
+{
+    uint32_t val = 0;
+    if (__atomic_compare_exchange_n (lock,
+                                     &val,
+                                     NK_MCS_LOCKED,
+                                     false,
+                                     __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED))
+    {
+        return 0;
+    }
+    return NkMcsAcquireSlow (lock);
+}
+
+// Takes a queued lock if nobody has it or is waiting for it
+static FORCEINLINE bool NkMcsTryAcquire (mcslock_t* lock)
+{
+    uint32_t val = 0;
+    return __atomic_compare_exchange_n (lock,
+                                        &val,
+                                        NK_MCS_LOCKED,
+                                        false,
+                                        __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED);
+}
+
+// Releases a queued lock
+static FORCEINLINE void NkMcsRelease (mcslock_t* lock)
+{
+    assert (*lock & NK_MCS_LOCKED);
+    __atomic_and_fetch (lock, ~NK_MCS_LOCKED, __ATOMIC_RELEASE);
+}
+
+// Reader-writer spinlocks
+// Any number of readers may hold the lock at once, or one writer. The low bits count readers,
+// and the top bits say whether a writer has it or is waiting on it. By default readers only wait
+// for a writer that has the lock, so a steady stream of them can starve writers. Locks
+// initialized with NK_RW_PREFER_WRITER make new readers hold off while a writer waits
+#define NK_RW_WRITER        (1U << 31)    // Held by a writer
+#define NK_RW_WRITE_WAIT    (1U << 30)    // A writer is waiting
+#define NK_RW_PREFER_WRITER (1U << 29)    // Readers hold off for waiting writers
+#define NK_RW_READERS       (NK_RW_PREFER_WRITER - 1)
+
+// Initializes a reader-writer lock
+#define NkRwInit(lock, flags) (*(lock) = ((flags) & NK_RW_PREFER_WRITER))
+
+// Takes a reader-writer lock for reading
+// Returns number of times we spun
+static FORCEINLINE unsigned long NkRwAcquireRead (rwlock_t* lock)
+{
+    unsigned long spins = 0;
+    for (;;)
+    {
+        uint32_t val = __atomic_load_n (lock, __ATOMIC_RELAXED);
+        bool blocked = (val & NK_RW_WRITER) ||
+                       ((val & NK_RW_PREFER_WRITER) && (val & NK_RW_WRITE_WAIT));
+        if (!blocked && __atomic_compare_exchange_n (lock,
+                                                     &val,
+                                                     val + 1,
+                                                     false,
+                                                     __ATOMIC_ACQUIRE,
+                                                     __ATOMIC_RELAXED))
+        {
+            return spins;
+        }
+        CpuSpin();
+        ++spins;
+    }
+}
+
+// Takes a reader-writer lock for writing
+// Returns number of times we spun
+static FORCEINLINE unsigned long NkRwAcquireWrite (rwlock_t* lock)
+{
+    unsigned long spins = 0;
+    for (;;)
+    {
+        uint32_t val = __atomic_load_n (lock, __ATOMIC_RELAXED);
+        if (!(val & (NK_RW_WRITER | NK_RW_READERS)))
+        {
+            // Other waiting writers set the wait bit again on their next go
+            if (__atomic_compare_exchange_n (lock,
+                                             &val,
+                                             (val & NK_RW_PREFER_WRITER) | NK_RW_WRITER,
+                                             false,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED))
+            {
+                return spins;
+            }
+            continue;
+        }
+        if (!(val & NK_RW_WRITE_WAIT))
+            __atomic_or_fetch (lock, NK_RW_WRITE_WAIT, __ATOMIC_RELAXED);
+        CpuSpin();
+        ++spins;
+    }
+}
+
+// Releases a reader-writer lock held for reading
+static FORCEINLINE void NkRwReleaseRead (rwlock_t* lock)
+{
+    assert (*lock & NK_RW_READERS);
+    __atomic_sub_fetch (lock, 1, __ATOMIC_RELEASE);
+}
+
+// Releases a reader-writer lock held for writing
+static FORCEINLINE void NkRwReleaseWrite (rwlock_t* lock)
+{
+    assert (*lock & NK_RW_WRITER);
+    __atomic_and_fetch (lock, ~NK_RW_WRITER, __ATOMIC_RELEASE);
+}
+
+// Sequence locks
+// seqlock_t counts writes to what it protects, and is odd while one is going on. Readers never
+// write to it, they just start over if the count changed under them, so data that is read a lot
+// and written rarely can be read from every CPU without its cache line bouncing around
+// Writers have to be serialized some other way
+
+// Starts a read, returning the count to check it against
+static FORCEINLINE uint32_t NkSeqReadBegin (seqlock_t* seq)
+{
+    uint32_t val = 0;
+    while ((val = __atomic_load_n (seq, __ATOMIC_ACQUIRE)) & 1)
+        CpuSpin();
+    return val;
+}
+
+// Checks if a read that started at val has to start over
+static FORCEINLINE bool NkSeqReadRetry (seqlock_t* seq, uint32_t val)
+{
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    return __atomic_load_n (seq, __ATOMIC_RELAXED) != val;
+}
+
+// Starts a write
+static FORCEINLINE void NkSeqWriteBegin (seqlock_t* seq)
+{
+    __atomic_store_n (seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+// Finishes a write
+static FORCEINLINE void NkSeqWriteEnd (seqlock_t* seq)
+{
+    __atomic_store_n (seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
 // Locks a spinlock
 // On UP, disables preemption
-static FORCEINLINE void NkSpinLock (spinlock_t* lock)
+static FORCEINLINE void nkSpinLock (spinlock_t* lock, NkLockSite_t* site)
 {
     // Disable preemption first
     TskDisablePreempt();
 #ifndef NEXKE_UP
-    while (__sync_lock_test_and_set (lock, 1))
-        while (*lock)
-            CpuSpin();
+    unsigned long spins = NkTicketAcquire (lock);
+    NK_LOCK_STAT_ACQUIRE (lock, site, spins);
 #endif
 }
 
+// Attempts to lock a spinlock
+// Returns false without waiting if the lock is held
+static FORCEINLINE bool nkSpinTryLock (spinlock_t* lock, NkLockSite_t* site)
+{
+    TskDisablePreempt();
+#ifndef NEXKE_UP
+    if (!NkTicketTryAcquire (lock))
+    {
+        TskEnablePreempt();
+        return false;
+    }
+    NK_LOCK_STAT_ACQUIRE (lock, site, 0);
+#endif
+    return true;
+}
+
 // Unlocks a spinlock
 static FORCEINLINE void NkSpinUnlock (spinlock_t* lock)
 {
 #ifndef NEXKE_UP
-    assert (*lock == 1);
-    __sync_lock_release (lock);    // Unlock it
+    NK_LOCK_STAT_RELEASE (lock);
+    NkTicketRelease (lock);
 #endif
     TskEnablePreempt();    // Re-enable preemption
 }
 
+// Locks a queued lock
+static FORCEINLINE void nkMcsLock (mcslock_t* lock, NkLockSite_t* site)
+{
+    TskDisablePreempt();
+#ifndef NEXKE_UP
+    unsigned long spins = NkMcsAcquire (lock);
+    NK_LOCK_STAT_ACQUIRE (lock, site, spins);
+#endif
+}
+
+// Attempts to lock a queued lock
+static FORCEINLINE bool nkMcsTryLock (mcslock_t* lock, NkLockSite_t* site)
+{
+    TskDisablePreempt();
+#ifndef NEXKE_UP
+    if (!NkMcsTryAcquire (lock))
+    {
+        TskEnablePreempt();
+        return false;
+    }
+    NK_LOCK_STAT_ACQUIRE (lock, site, 0);
+#endif
+    return true;
+}
+
+// Unlocks a queued lock
+static FORCEINLINE void NkMcsUnlock (mcslock_t* lock)
+{
+#ifndef NEXKE_UP
+    NK_LOCK_STAT_RELEASE (lock);
+    NkMcsRelease (lock);
+#endif
+    TskEnablePreempt();
+}
+
+// Locks a reader-writer lock for reading
+static FORCEINLINE void nkRwReadLock (rwlock_t* lock, NkLockSite_t* site)
+{
+    TskDisablePreempt();
+#ifndef NEXKE_UP
+    unsigned long spins = NkRwAcquireRead (lock);
+    NK_LOCK_STAT_ACQUIRE (lock, site, spins);
+#endif
+}
+
+// Unlocks a reader-writer lock held for reading
+static FORCEINLINE void NkRwReadUnlock (rwlock_t* lock)
+{
+#ifndef NEXKE_UP
+    NK_LOCK_STAT_RELEASE (lock);
+    NkRwReleaseRead (lock);
+#endif
+    TskEnablePreempt();
+}
+
+// Locks a reader-writer lock for writing
+static FORCEINLINE void nkRwWriteLock (rwlock_t* lock, NkLockSite_t* site)
+{
+    TskDisablePreempt();
+#ifndef NEXKE_UP
+    unsigned long spins = NkRwAcquireWrite (lock);
+    NK_LOCK_STAT_ACQUIRE (lock, site, spins);
+#endif
+}
+
+// Unlocks a reader-writer lock held for writing
+static FORCEINLINE void NkRwWriteUnlock (rwlock_t* lock)
+{
+#ifndef NEXKE_UP
+    NK_LOCK_STAT_RELEASE (lock);
+    NkRwReleaseWrite (lock);
+#endif
+    TskEnablePreempt();
+}
+
+// Locking interface. These are macros so lock statistics know where the lock got taken
+#define NkSpinLock(lock)    nkSpinLock (lock, NK_LOCK_SITE())
+#define NkSpinTryLock(lock) nkSpinTryLock (lock, NK_LOCK_SITE())
+#define NkMcsLock(lock)     nkMcsLock (lock, NK_LOCK_SITE())
+#define NkMcsTryLock(lock)  nkMcsTryLock (lock, NK_LOCK_SITE())
+#define NkRwReadLock(lock)  nkRwReadLock (lock, NK_LOCK_SITE())
+#define NkRwWriteLock(lock) nkRwWriteLock (lock, NK_LOCK_SITE())
+
 typedef long atomic_t;    // Speical atomic type
 
 // Loads a value atomically
@@ -90,4 +456,48 @@ static FORCEINLINE atomic_t NkAtomicSub (atomic_t* ptr, atomic_t val)
 #endif
 }
 
+// Ors in bits atomically
+static FORCEINLINE atomic_t NkAtomicOr (atomic_t* ptr, atomic_t val)
+{
+#ifndef NEXKE_UP
+    return __atomic_or_fetch (ptr, val, __ATOMIC_SEQ_CST);
+#else
+    *ptr |= val;
+    return *ptr;
+#endif
+}
+
+// Ands in bits atomically
+static FORCEINLINE atomic_t NkAtomicAnd (atomic_t* ptr, atomic_t val)
+{
+#ifndef NEXKE_UP
+    return __atomic_and_fetch (ptr, val, __ATOMIC_SEQ_CST);
+#else
+    *ptr &= val;
+    return *ptr;
+#endif
+}
+
+// Sets ptr to val if it contains expected
+// On failure, expected gets what ptr contained
+static FORCEINLINE bool NkAtomicCmpXchg (atomic_t* ptr, atomic_t* expected, atomic_t val)
+{
+#ifndef NEXKE_UP
+    return __atomic_compare_exchange_n (ptr,
+                                        expected,
+                                        val,
+                                        false,
+                                        __ATOMIC_SEQ_CST,
+                                        __ATOMIC_SEQ_CST);
+#else
+    if (*ptr != *expected)
+    {
+        *expected = *ptr;
+        return false;
+    }
+    *ptr = val;
+    return true;
+#endif
+}
+
 #endif
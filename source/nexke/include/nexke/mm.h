@@ -36,12 +36,70 @@ void MmSlabBootstrap();
 // Initializes general purpose memory allocator
 void MmMallocInit();
 
-// Returns cache of given pointer
+// Returns cache of given pointer, or NULL if it isn't in a slab
+// For caches merged with others, this is the shared cache
+// ptr must be from a slab cache or kmalloc
 SlabCache_t* MmGetCacheFromPtr (void* ptr);
 
+// Sets up memory tag accounting
+void MmInitTags();
+
+// Per-CPU counts of each tag
+extern MmTagCount_t mmTagCounts[NEXKE_MAX_CPUS][MM_TAG_MAX];
+
+// Whether live allocations are tracked
+extern bool mmLeakOn;
+
+// Tracks a live allocation made by site, or stops tracking one
+void MmLeakTrack (int tag, void* ptr, size_t sz, uintptr_t site);
+void MmLeakUntrack (void* ptr);
+
+// Charges an allocation to tag
+static FORCEINLINE void MmTagCharge (int tag, void* ptr, size_t sz, uintptr_t site)
+{
+    if (tag == MM_TAG_NONE)
+        return;
+    TskDisablePreempt();
+    MmTagCount_t* count = &mmTagCounts[CpuGetCcb()->cpuNum][tag];
+    count->bytes += sz;
+    ++count->objs;
+    TskEnablePreempt();
+    if (__builtin_expect (mmLeakOn, 0))
+        MmLeakTrack (tag, ptr, sz, site);
+}
+
+// Takes a freed allocation off of tag
+static FORCEINLINE void MmTagUncharge (int tag, void* ptr, size_t sz)
+{
+    if (tag == MM_TAG_NONE)
+        return;
+    TskDisablePreempt();
+    MmTagCount_t* count = &mmTagCounts[CpuGetCcb()->cpuNum][tag];
+    count->bytes -= sz;
+    --count->objs;
+    TskEnablePreempt();
+    if (__builtin_expect (mmLeakOn, 0))
+        MmLeakUntrack (ptr);
+}
+
 // Initialize page layer
 void MmInitPage();
 
+// Starts setting up the rest of the page structures in the background
+void MmStartPageInit();
+
+// Gives firmware memory that was only needed during boot to the page allocator
+void MmReclaimFwMem();
+
+// Sets up page allocator state of a CPU
+void MmInitCpu (NkCcb_t* ccb);
+
+// Sets NUMA node of a CPU, draining its page cache if the node changed
+void MmSetCpuNode (NkCcb_t* ccb, int node);
+
+// Initializes memory reclaim
+void MmInitReclaim();
+
 // Kernel memory management
 
 // Allocates a region of memory in pages
@@ -52,6 +110,16 @@ void* MmAllocKvRegion (size_t numPages, int flags);
 // Frees a region of memory
 void MmFreeKvRegion (void* mem);
 
+// Gets size in pages of the region starting at mem
+size_t MmGetKvRegionPages (void* mem);
+
+// Sets owner of the region starting at mem, so it can be found from any address in the region
+// Owners aren't cleared when regions are freed, so whoever cares about them must set them
+void MmSetKvOwner (void* mem, void* owner);
+
+// Gets owner of the region ptr is in
+void* MmGetKvOwner (void* ptr);
+
 // Allocates a memory page for kernel
 void* MmAllocKvPage();
 
@@ -59,26 +127,68 @@ void* MmAllocKvPage();
 void MmFreeKvPage (void* page);
 
 // Maps in MMIO / FW memory
+// Mappings with the same perm that cover the range are shared, and ranges with whole large pages
+// outside of the PFN map in them get mapped with large pages
 void* MmAllocKvMmio (paddr_t phys, int numPages, int perm);
 
-// Unmaps MMIO / FW memory
+// Unmaps MMIO / FW memory, once everyone sharing the mapping is done with it
 void MmFreeKvMmio (void* virt);
 
+// Maps count physically contiguous pages, as from MmAllocPagesAt, into kernel space
+// perm is added to the normal kernel protection, for caching flags. The region owns the pages
+// afterwards, and they're freed along with it by MmFreeKvRegion
+void* MmMapKvContig (MmPage_t* pages, size_t count, int perm);
+
+// DMA pools
+// Pools hand out fixed size, aligned chunks of physically contiguous memory that a device can
+// reach, along with their physical addresses. Chunks are carved out of blocks of pages, which
+// stay with the pool until it's destroyed, so allocating and freeing just pops and pushes a
+// free list
+
+typedef struct _mmdmapool MmDmaPool_t;
+
+// Pool flags
+#define MM_DMA_WC       (1 << 0)    // Map write-combined, for buffers the CPU only writes
+#define MM_DMA_UNCACHED (1 << 1)    // Map uncached, for devices that don't snoop caches
+
+// Creates a pool of chunks of size bytes, aligned to align, which must be a power of two
+// Chunks are kept at or under the physical address mask
+MmDmaPool_t* MmCreateDmaPool (const char* name, size_t size, size_t align, paddr_t mask, int flags);
+
+// Destroys a pool. All its chunks must have been freed
+void MmDestroyDmaPool (MmDmaPool_t* pool);
+
+// Allocates a chunk from pool, and sets phys to its physical address
+// Returns NULL if out of memory
+void* MmDmaAlloc (MmDmaPool_t* pool, paddr_t* phys);
+
+// Frees a chunk back to pool
+void MmDmaFree (MmDmaPool_t* pool, void* chunk);
+
+// Maps boot module idx read-only into kernel space, where nexboot put it
+// Returns NULL if there is no such module. size is set to the module's size
+void* MmMapBootModule (int idx, size_t* size);
+
 // Page management
 
 typedef paddr_t pfn_t;
 
+// Number of buddy orders in a zone
+#define MM_ZONE_MAX_ORDER 11
+
 // Page zone data structure
 typedef struct _zone
 {
-    pfn_t pfn;               // Base frame of zone
-    int zoneIdx;             // Zone index
-    size_t numPages;         // Number of pages in zone
-    int freeCount;           // Number of free pages
-    int flags;               // Flags specifying type of memory in this zone
-    struct _page* pfnMap;    // Table of PFNs in this zone
-    NkList_t freeList;       // Free list of pages in this zone
-    spinlock_t lock;         // Lock on zone
+    pfn_t pfn;                                // Base frame of zone
+    int zoneIdx;                              // Zone index
+    size_t numPages;                          // Number of pages in zone
+    size_t initPages;                         // Pages at start of zone that are set up
+    int freeCount;                            // Number of free pages
+    int flags;                                // Flags specifying type of memory in this zone
+    int node;                                 // NUMA node this zone's memory is in
+    struct _page* pfnMap;                     // Table of PFNs in this zone
+    NkList_t freeAreas[MM_ZONE_MAX_ORDER];    // Buddy free lists, indexed by order
+    mcslock_t lock;                           // Lock on zone
 } MmZone_t;
 
 // Zone flags
@@ -88,31 +198,121 @@ typedef struct _zone
 #define MM_ZONE_RECLAIM     (1 << 3)
 #define MM_ZONE_ALLOCATABLE (1 << 4)
 #define MM_ZONE_NO_GENERIC  (1 << 5)    // Generic memory allocations are not allowed
+#define MM_ZONE_CMA         (1 << 6)    // Contiguous reserve, only lent out for movable pages
+
+typedef struct _memspace MmSpace_t;
 
 // Page back mapping
-typedef struct _mmpgmap MmPageMap_t;
+typedef struct _mmpgmap
+{
+    MmSpace_t* space;         // Address space this mapping resides in, NULL if slot is unused
+    uintptr_t addr;           // Address of mapping in address space
+    paddr_t table;            // Leaf page table the PTE is in, so it can be reached without a walk
+    struct _mmpgmap* next;    // Link
+} MmPageMap_t;
 
 // Page data structure
+// There is one of these for every page of memory, so it's kept small. The PFN comes from where
+// the page is in the PFN map, and the lock is a bit in the flags
 typedef struct _page
 {
-    pfn_t pfn;            // PFN of this page
-    MmZone_t* zone;       // Zone this page resides in
-    int flags;            // Flags of this page
-    int fixCount;         // Number of maps that have fixed this page
-    MmObject_t* obj;      // Object that owns this page
-    size_t offset;        // Offset in object. Used for page lookup
+    uint16_t flags;      // Flags of this page
+    uint16_t zoneIdx;    // Index of zone this page resides in
+    int fixCount;        // Number of maps that have fixed this page
+    union
+    {
+        struct
+        {
+            MmObject_t* obj;    // Object that owns this page
+            size_t offset;      // Offset in object. Used for page lookup
+        };
+        int order;    // Buddy order of block, if this page heads a free block
+    };
     MmPageMap_t* maps;    // Mappings on this page
-    NkLink_t link;        // Link to track this page on free list/hash table
-    NkLink_t objLink;     // Link to track this page in object
-    spinlock_t lock;      // Lock on page structure
+    MmPageMap_t map;      // First mapping, kept here so most pages don't need an allocated one
+    NkLink_t link;        // Link to track this page on free list, page cache or reclaim queue
 } MmPage_t;
 
-#define MM_PAGE_FREE      (1 << 0)    // Page is not in use
-#define MM_PAGE_IN_OBJECT (1 << 1)    // Page is currently in object
-#define MM_PAGE_UNUSABLE  (1 << 2)    // Page is not usable
-#define MM_PAGE_ALLOCED   (1 << 3)    // Page is allocated but not in object
-#define MM_PAGE_GUARD     (1 << 4)    // Page is a guard page
-#define MM_PAGE_FIXED     (1 << 5)    // Page is fixed in it's mapping and in memory
+// Page that isn't in the PFN map, e.g., a guard page or MMIO
+typedef struct _fakepage
+{
+    MmPage_t page;
+    pfn_t pfn;    // PFN of this page
+} MmFakePage_t;
+
+#define MM_PAGE_FREE      (1 << 0)     // Page is not in use
+#define MM_PAGE_IN_OBJECT (1 << 1)     // Page is currently in object
+#define MM_PAGE_UNUSABLE  (1 << 2)     // Page is not usable
+#define MM_PAGE_ALLOCED   (1 << 3)     // Page is allocated but not in object
+#define MM_PAGE_GUARD     (1 << 4)     // Page is a guard page
+#define MM_PAGE_FIXED     (1 << 5)     // Page is fixed in it's mapping and in memory
+#define MM_PAGE_BUDDY     (1 << 6)     // Page heads a free buddy block
+#define MM_PAGE_ZEROED    (1 << 7)     // Page is known to be filled with zeroes
+#define MM_PAGE_DIRTY     (1 << 8)     // Page was written through a mapping that is now gone
+#define MM_PAGE_ACTIVE    (1 << 9)     // Page is on the active queue
+#define MM_PAGE_INACTIVE  (1 << 10)    // Page is on the inactive queue
+#define MM_PAGE_FAKE      (1 << 11)    // Page isn't in the PFN map
+#define MM_PAGE_HUGE      (1 << 12)    // Page is part of a transparent huge page
+#define MM_PAGE_LOCKED    (1 << 15)    // Page is locked
+
+// PFN map. Page structures are at the index of their PFN, and only memory that exists is backed
+#define MM_PFNMAP ((MmPage_t*) NEXKE_PFNMAP_BASE)
+
+// Gets PFN of page
+static FORCEINLINE pfn_t MmGetPagePfn (MmPage_t* page)
+{
+    if (page->flags & MM_PAGE_FAKE)
+        return ((MmFakePage_t*) page)->pfn;
+    return page - MM_PFNMAP;
+}
+
+// Gets physical address of page
+static FORCEINLINE paddr_t MmGetPagePhys (MmPage_t* page)
+{
+    return MmGetPagePfn (page) * NEXKE_CPU_PAGESZ;
+}
+
+// Page locks
+// The lock is a bit in the flags, so flags may only be changed with the page locked, or while
+// nobody else can reach the page, e.g., while it is free or just allocated
+
+// Locks a page
+static FORCEINLINE void MmLockPage (MmPage_t* page)
+{
+    TskDisablePreempt();
+#ifndef NEXKE_UP
+    while (__atomic_fetch_or (&page->flags, MM_PAGE_LOCKED, __ATOMIC_ACQUIRE) & MM_PAGE_LOCKED)
+    {
+        while (__atomic_load_n (&page->flags, __ATOMIC_RELAXED) & MM_PAGE_LOCKED)
+            CpuSpin();
+    }
+#endif
+}
+
+// Attempts to lock a page
+// Returns false without waiting if the page is locked
+static FORCEINLINE bool MmTryLockPage (MmPage_t* page)
+{
+    TskDisablePreempt();
+#ifndef NEXKE_UP
+    if (__atomic_fetch_or (&page->flags, MM_PAGE_LOCKED, __ATOMIC_ACQUIRE) & MM_PAGE_LOCKED)
+    {
+        TskEnablePreempt();
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Unlocks a page
+static FORCEINLINE void MmUnlockPage (MmPage_t* page)
+{
+#ifndef NEXKE_UP
+    assert (page->flags & MM_PAGE_LOCKED);
+    __atomic_fetch_and (&page->flags, ~MM_PAGE_LOCKED, __ATOMIC_RELEASE);
+#endif
+    TskEnablePreempt();
+}
 
 // Page interface
 
@@ -120,15 +320,61 @@ typedef struct _page
 // Returns NULL if physical memory is exhausted
 MmPage_t* MmAllocPage();
 
+// NUMA node allocations should come from
+#define MM_NODE_LOCAL -1    // Node of the CPU we're running on
+
+// Sets node this thread allocates memory from, returning the old node
+// Falling back to other nodes is still allowed
+int MmSetAllocNode (int node);
+
+// Gets node this thread allocates memory from
+int MmGetAllocNode();
+
 // Allocates a fixed page
 MmPage_t* MmAllocFixedPage();
 
+// Allocates a page that is filled with zeroes
+// Takes pages from the zeroed page pool; if that is empty, zeroes the page synchronously
+MmPage_t* MmAllocZeroedPage();
+
+// Allocates a zeroed page for a page table
+// Takes pages from this CPU's page table reserve; if that is empty, uses MmAllocZeroedPage
+MmPage_t* MmAllocPtPage();
+
+// Frees a page table that is known to be empty
+// It goes back to this CPU's page table reserve if there's room, else to the zeroed page pool
+void MmFreePtPage (MmPage_t* page);
+
+// Frees a page that is known to be filled with zeroes
+// It goes to the zeroed page pool if there's room, so it can be handed out again without zeroing
+void MmFreeZeroedPage (MmPage_t* page);
+
+// Sets up the shared zero page. The MUL must be up
+void MmInitZeroPage();
+
+// Gets the shared zero page
+// It is read only, never freed, and isn't in any object. Anonymous memory that hasn't been
+// written yet is mapped to it on reads
+MmPage_t* MmGetZeroPage();
+
+// Adds one page to the zeroed page pool
+// Returns false if the pool is full or memory is exhausted. Called from the idle thread
+bool MmFillZeroPool();
+
+// Adds one page to this CPU's page table reserve
+// Returns false if the reserve is full or memory is exhausted. Called from the idle thread
+bool MmFillPtReserve();
+
 // Finds page at specified PFN, and removes it from free list
 // If PFN is non-existant, or if PFN is in reserved memory region, returns PFN
 // in state STATE_UNUSABLE
 // Technically the page is usable, but only in certain situations (e.g., MMIO)
 MmPage_t* MmFindPagePfn (pfn_t pfn);
 
+// Checks if any of count pages starting at pfn are in the PFN map
+// Pages that aren't get forged by MmFindPagePfn, and nothing keeps track of them
+bool MmPfnRangeInMap (pfn_t pfn, size_t count);
+
 // Frees a page
 void MmFreePage (MmPage_t* page);
 
@@ -138,61 +384,197 @@ void MmFixPage (MmPage_t* page);
 // Un-fixes a page from memory
 void MmUnfixPage (MmPage_t* page);
 
+// Adds a mapping of page at addr in space, whose PTE is in the leaf table at table
+// The first mapping is kept in the page itself. Takes the page lock
+void MmAddPageMap (MmPage_t* page, MmSpace_t* space, uintptr_t addr, paddr_t table);
+
+// Removes the mapping of page at addr in space, returning false if there isn't one
+// Page must be locked
+bool MmRemovePageMap (MmPage_t* page, MmSpace_t* space, uintptr_t addr);
+
+// Removes every mapping of page, once the MUL has unmapped them
+// Page must be locked
+void MmClearPageMaps (MmPage_t* page);
+
 // Allocate a guard page
 // Guard pages have no PFN, they are fake pages that indicate to
 // never map a page to a specified object,offset
 MmPage_t* MmAllocGuardPage();
 
 // Allocates a contigious range of PFNs with specified at limit, beneath specified base adress
-// NOTE: use with care, this function is poorly efficient
-// Normally you don't need contigious PFNs
+// Align must be a power of two. Counts above 1 << (MM_ZONE_MAX_ORDER - 1) can only come from the
+// contiguous reserve, which is sized with -cma
 // Returns array of PFNs allocated
 MmPage_t* MmAllocPagesAt (size_t count, paddr_t maxAddr, paddr_t align);
 
 // Frees pages allocated with AllocPageAt
 void MmFreePages (MmPage_t* pages, size_t count);
 
-// Page hash management interface
+// Allocates a page for anonymous memory, which may be lent from the contiguous reserve
+// The page must only ever be in an anonymous object, so it can be moved when the reserve wants it
+MmPage_t* MmAllocMovablePage (bool zero);
+
+// Object page management interface
 
-// Adds a page to a page hash list
-// Page and object must be locked
+// Initializes the page tree of an object
+void MmInitPageTree (MmObject_t* obj);
+
+// Adds a page to an object
+// Page must be locked
 void MmAddPage (MmObject_t* obj, size_t off, MmPage_t* page);
 
-// Looks up page in page list, returning NULL if none is found
-// Object should be locked
+// Looks up page in object, returning NULL if none is found
+// This doesn't take any locks
 MmPage_t* MmLookupPage (MmObject_t* obj, size_t off);
 
-// Removes a page from the hash list
+// Finds first page at or after offset in object, and updates offset to the page's offset
+// Returns NULL if there are no more pages
+MmPage_t* MmLookupPageNext (MmObject_t* obj, size_t* off);
+
+// Removes a page from its object
 // Page must be locked
 void MmRemovePage (MmPage_t* page);
 
+// Frees all pages in an object, along with its page tree
+// Nobody may be looking up pages in the object
+void MmFreeObjectPages (MmObject_t* obj);
+
+// Compressed page pool
+// Evicted anonymous pages are kept here compressed. Pages of an object are only stored or
+// removed with the object locked
+
+// Sets up the compressed page pool
+void MmInitZpool();
+
+// Compresses page and stores it as obj/off
+// Returns false if it doesn't compress well enough, or memory ran out
+bool MmZpoolStore (MmObject_t* obj, size_t off, MmPage_t* page);
+
+// Restores obj/off into page, and drops it from the pool
+// Returns false if obj/off isn't in the pool
+bool MmZpoolLoad (MmObject_t* obj, size_t off, MmPage_t* page);
+
+// Checks if obj/off is in the pool
+bool MmZpoolHas (MmObject_t* obj, size_t off);
+
+// Moves pages of parent that obj can see into obj, when parent is collapsed into obj
+// Both must be locked
+void MmZpoolCollapse (MmObject_t* obj, MmObject_t* parent);
+
+// Frees every page obj has in the pool
+void MmZpoolFreeObject (MmObject_t* obj);
+
+// Dumps the state of the pool
+void MmZpoolDump();
+
 // Misc. page functions
 
 // Dumps out page debugging info
 void MmDumpPageInfo();
 
+// Gets number of pages that need to be reclaimed to get free memory back to the high watermark
+// Returns 0 if free memory is not low
+size_t MmGetPageShortage();
+
+// Gets zone at index, or NULL if there is none
+// Zones are sorted by address
+MmZone_t* MmGetZone (int idx);
+
+// Memory reclaim
+
+// Shrinker callback
+// Releases up to target pages, and returns the number of pages actually released
+typedef size_t (*MmShrinkCb) (size_t target);
+
+// Shrinker. Subsystems that keep memory cached register one of these so the memory can be
+// taken back under pressure
+typedef struct _mmshrinker
+{
+    const char* name;     // Name of shrinker
+    MmShrinkCb shrink;    // Callback to release memory
+    NkLink_t link;        // Link in shrinker list
+} MmShrinker_t;
+
+// Registers a shrinker
+void MmRegisterShrinker (MmShrinker_t* shrinker);
+
+// Unregisters a shrinker
+void MmUnregisterShrinker (MmShrinker_t* shrinker);
+
+// Reaps slab caches and then calls shrinkers until target pages have been released
+// Returns number of pages released
+size_t MmReclaim (size_t target);
+
+// Reclaims memory if free memory is below the low watermark
+// Returns true if anything was released
+bool MmReclaimIfLow();
+
+// Puts page of a pageable object on the page queues, so it gets aged
+// Page must be locked
+void MmQueuePage (MmPage_t* page);
+
+// Takes page off the page queues
+// Page must be locked
+void MmDequeuePage (MmPage_t* page);
+
+// Starts the pageout daemon
+void MmInitPageout();
+
+// Starts the page merging daemon, if -pagemerge [pages a second] was given
+// It folds anonymous pages that are all zeroes into the zero page
+void MmInitPageMerge();
+
+// Gets number of pages merged into the zero page
+size_t MmGetMergedPages();
+
+// Wakes the pageout daemon
+// Safe to call from anywhere, does nothing before the daemon is started
+void MmWakePageout();
+
+// Waits a little for the pageout daemon to free memory
+// Returns false if there's no daemon to wait for
+bool MmWaitPageout();
+
 // Memory object types
 
+// Page tree of an object
+// This is a radix tree indexed by page number in the object
+#define MM_RADIX_SHIFT 6
+#define MM_RADIX_SLOTS (1 << MM_RADIX_SHIFT)
+
+typedef struct _mmradixnode MmRadixNode_t;
+
+typedef struct _mmpagetree
+{
+    MmRadixNode_t* root;    // Root node
+    spinlock_t lock;        // Serializes writers. Readers don't lock
+} MmPageTree_t;
+
 typedef struct _memobject
 {
-    size_t count;         // Count of pages in this object
-    size_t resident;      // Number of pages resident in object
-    int refCount;         // Reference count on object
-    int backend;          // Memory backend type represented by this object
-    int perm;             // Memory permissions specified in MUL flags
-    int inheritFlags;     // How this page is inherited by child processes
-    bool pageable;        // Is object pageable
-    NkList_t pageList;    // List of pages allocated to this object
-    size_t numPages;      // Number of pages in object
-    void** backendTab;    // Table of backend functions
-    void* backendData;    // Data used by backend in this object
-    spinlock_t lock;      // Lock on object
+    size_t count;             // Count of pages in this object
+    size_t resident;          // Number of pages resident in object
+    int refCount;             // Reference count on object
+    int backend;              // Memory backend type represented by this object
+    int perm;                 // Memory permissions specified in MUL flags
+    int inheritFlags;         // How this page is inherited by child processes
+    bool pageable;            // Is object pageable
+    MmPageTree_t pageTree;    // Pages allocated to this object
+    size_t numPages;          // Number of pages in object
+    void** backendTab;        // Table of backend functions
+    void* backendData;        // Data used by backend in this object
+    spinlock_t lock;          // Lock on object
+    // Copy-on-write support
+    struct _memobject* parent;    // Object this object shadows, pages not in this object come
+                                  // from there
+    size_t parentOff;             // Offset of this object in parent
 } MmObject_t;
 
 // Memory object backends
 #define MM_BACKEND_ANON   0
 #define MM_BACKEND_KERNEL 1
-#define MM_BACKEND_MAX    2
+#define MM_BACKEND_FILE   2
+#define MM_BACKEND_MAX    3
 
 // Backend functions
 #define MM_BACKEND_PAGEIN      0
@@ -201,15 +583,15 @@ typedef struct _memobject
 #define MM_BACKEND_DESTROY_OBJ 3
 
 typedef bool (*MmPageIn) (MmObject_t*, size_t, MmPage_t*);
-typedef bool (*MmPageOut) (MmObject_t*, size_t);
+typedef bool (*MmPageOut) (MmObject_t*, size_t, MmPage_t*);
 typedef bool (*MmBackendInit) (MmObject_t*);
 typedef bool (*MmBackendDestroy) (MmObject_t*);
 
 // Functions to call backend
 #define MmBackendPageIn(object, offset, page) \
     (((MmPageIn) (object)->backendTab[MM_BACKEND_PAGEIN]) ((object), (offset), (page)))
-#define MmBackendPageOut(object, offset) \
-    (((MmPageOut) (object)->backendTab[MM_BACKEND_PAGEOUT]) ((object), (offset)))
+#define MmBackendPageOut(object, offset, page) \
+    (((MmPageOut) (object)->backendTab[MM_BACKEND_PAGEOUT]) ((object), (offset), (page)))
 #define MmBackendInit(object) \
     (((MmBackendInit) (object)->backendTab[MM_BACKEND_INIT_OBJ]) ((object)))
 #define MmBackendDestroy(object) \
@@ -229,9 +611,50 @@ void MmDeRefObject (MmObject_t* object);
 // Applies new permissions to object
 void MmProtectObject (MmObject_t* object, int newPerm);
 
+// Creates a copy-on-write shadow of parent
+// The shadow starts out with all of parent's data from offset on, and only gets its own copy of
+// a page once it is written to
+MmObject_t* MmCreateShadow (MmObject_t* parent, size_t offset, size_t pages);
+
+// Merges parents that only obj references into obj
+// Object must be locked
+void MmCollapseObject (MmObject_t* obj);
+
 // Initializes object system
 void MmInitObject();
 
+// File backend
+// A file is a range of a block device. The pages of a file are cached in one object, which every
+// mapping of the file shares, so the data is only read once no matter how often it's mapped
+typedef struct _mmfile MmFile_t;
+
+// Reads count pages starting at byte offset of file into pages
+// Bytes past the end of the file must be zero filled
+typedef bool (*MmFileRead) (MmFile_t*, uint64_t, MmPage_t**, size_t);
+// Writes count pages starting at byte offset of file from pages
+typedef bool (*MmFileWrite) (MmFile_t*, uint64_t, MmPage_t**, size_t);
+
+typedef struct _mmfile
+{
+    uint64_t size;        // Size of file in bytes
+    MmFileRead read;      // Function to read from device
+    MmFileWrite write;    // Function to write to device, NULL if read only
+    void* devData;        // Data used by device
+    int perm;             // Permissions of mappings of the file
+    MmObject_t* cache;    // Page cache object of this file
+    size_t raNext;        // Offset a sequential reader would read next
+    size_t raWindow;      // Current readahead window in pages
+    spinlock_t lock;      // Lock on file
+} MmFile_t;
+
+// Gets page cache object of file, creating it if needed
+// The object is returned referenced, and can be mapped like any other object
+MmObject_t* MmGetFileObject (MmFile_t* file);
+
+// Drops file's reference on its page cache
+// Cached pages go away once the last mapping of the file does
+void MmReleaseFile (MmFile_t* file);
+
 #ifdef MM_PAGE_TABLES
 #include <nexke/cpu/ptab.h>
 #endif
@@ -244,8 +667,20 @@ typedef struct _mementry
     MmObject_t* obj;           // Object represented by address space entry
     struct _mementry* next;    // Next entry
     struct _mementry* prev;    // Last entry
+    // Entry tree links
+    struct _mementry* left;
+    struct _mementry* right;
+    struct _mementry* parent;
+    int height;            // Height of subtree rooted here
+    uintptr_t gap;         // Free space between this entry and the next one
+    uintptr_t maxGap;      // Largest gap in subtree rooted here
+    size_t faultAround;    // Size of window of pages mapped on a fault, 0 to disable
+    bool faultAlloc;       // Whether missing anonymous pages in the window get allocated too
 } MmSpaceEntry_t;
 
+// Default fault around window
+#define MM_FAULT_AROUND_DEFAULT 16
+
 // MUL stats
 typedef struct _mmmulstats
 {
@@ -253,16 +688,45 @@ typedef struct _mmmulstats
     int numFixed;
 } MmMulStats_t;
 
+// Kinds of page faults
+#define MM_FAULT_MINOR  0    // Page was already resident
+#define MM_FAULT_MAJOR  1    // Page was brought in by the backend
+#define MM_FAULT_ZERO   2    // Page was zero filled, or the zero page was mapped
+#define MM_FAULT_COW    3    // Page was copied out of a parent object
+#define MM_FAULT_AROUND 4    // Pages were mapped around another fault
+#define MM_FAULT_FAILED 5    // Fault couldn't be resolved
+#define MM_FAULT_KINDS  6
+
+#ifdef NEXKE_FAULT_STATS
+// Fault statistics
+// Latencies are kept in log2 histograms, where bucket n counts faults that took 2^n ns up to
+// 2^(n+1) ns. Fault-around counts pages, but its latency is of each pass over a window
+#define MM_FAULT_BUCKETS 32
+
+typedef struct _mmfaultstats
+{
+    uint64_t counts[MM_FAULT_KINDS];                       // Faults of each kind
+    uint64_t totalTime[MM_FAULT_KINDS];                    // Time spent on each kind
+    uint64_t latency[MM_FAULT_KINDS][MM_FAULT_BUCKETS];    // Latency histogram of each kind
+} MmFaultStats_t;
+#endif
+
 typedef struct _memspace
 {
     uintptr_t startAddr;          // Address the address space starts at
     uintptr_t endAddr;            // End address
     size_t numEntries;            // Number of entries
     MmSpaceEntry_t* entryList;    // List of address space entries
+    MmSpaceEntry_t* entryTree;    // AVL tree of address space entries, sorted by address
     MmSpaceEntry_t* faultHint;    // Last faulting area
     MmMulSpace_t mulSpace;        // MUL address space
     MmMulStats_t stats;           // MUL stats
-    spinlock_t lock;              // Lock on address space
+#ifdef NEXKE_FAULT_STATS
+    MmFaultStats_t faultStats;    // Fault stats
+#endif
+    atomic_t activeCpus;          // Mask of CPUs running in this space
+    rwlock_t lock;                // Lock on address space
+    NkLink_t link;                // Link in list of user spaces
 } MmSpace_t;
 
 // Creates a new empty address space
@@ -283,6 +747,29 @@ void MmFreeSpace (MmSpace_t* space, MmSpaceEntry_t* entry);
 // Finds address space entry for given address, or immediatley preceding entry
 MmSpaceEntry_t* MmFindSpaceEntry (MmSpace_t* space, uintptr_t addr);
 
+// Makes a copy-on-write copy of entry in destSpace
+// Both entries end up shadowing the entry's original object
+MmSpaceEntry_t* MmCopySpaceEntry (MmSpace_t* space, MmSpaceEntry_t* entry, MmSpace_t* destSpace);
+
+// Moves count pages at srcAddr in src to destAddr in dest, without copying them
+// Both ranges must be in anonymous entries, and the pages are mapped in dest right away. The
+// source range afterwards reads as it did before it was written. On failure, the pages before
+// the one that failed have been moved
+bool MmTransferPages (MmSpace_t* src,
+                      uintptr_t srcAddr,
+                      MmSpace_t* dest,
+                      uintptr_t destAddr,
+                      size_t count);
+
+// Lends count pages at srcAddr in src to dest, returning the entry they are mapped at in dest
+// The range is mapped read only on both sides, and whichever side writes to a page gets its own
+// copy. The loan ends by freeing the entry with MmFreeSpace
+MmSpaceEntry_t* MmLoanPages (MmSpace_t* src, uintptr_t srcAddr, MmSpace_t* dest, size_t count);
+
+// Sets fault around window of entry
+// If alloc is set, missing pages of anonymous objects are allocated in the window as well
+void MmSetFaultAround (MmSpace_t* space, MmSpaceEntry_t* entry, size_t numPages, bool alloc);
+
 // Finds faulting entry
 // Called with address space locked
 MmSpaceEntry_t* MmFindFaultEntry (MmSpace_t* space, uintptr_t addr);
@@ -290,6 +777,18 @@ MmSpaceEntry_t* MmFindFaultEntry (MmSpace_t* space, uintptr_t addr);
 // Dumps address space
 void MmDumpSpace (MmSpace_t* as);
 
+// Calls func on every user space
+// Spaces can't be destroyed while func is running
+void MmForEachSpace (void (*func) (MmSpace_t*, void*), void* arg);
+
+// Switches to address space
+// Preemption must be disabled
+void MmSwitchSpace (MmSpace_t* space);
+
+// Switches to address space of a thread that's about to run
+// Kernel threads pass NULL, and borrow whatever space is loaded
+void MmSwitchThreadSpace (MmSpace_t* space);
+
 // Initializes boot pool
 void MmInitKvm1();
 
@@ -311,8 +810,56 @@ MmObject_t* MmGetKernelObject();
 // Fault entry point
 bool MmPageFault (uintptr_t vaddr, int prot);
 
+// Sets up fault handling
+void MmInitFault();
+
 // Faults a page in
-bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** page);
+// kind gets set to the MM_FAULT_* kind of fault this was
+bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** page, int* kind);
+
+// Transparent huge pages
+// Writes to anonymous memory bring in a large page at once where one fits, and a daemon collapses
+// ranges that got filled with small pages. Only does anything if the MUL has large pages
+
+// Tries to fault in a large page around vaddr, in the entry at base that has count pages
+// Object must be locked. Returns false if a small page has to be used
+bool MmThpFault (MmSpace_t* space,
+                 MmObject_t* obj,
+                 uintptr_t base,
+                 size_t count,
+                 uintptr_t vaddr,
+                 int prot);
+
+// Starts using huge pages, unless -nothp was given
+void MmInitThp();
+
+// TLB shootdown interfaces
+
+// Invalidates [start, end) of space on every other CPU using it
+// If flushAll is set, it's fine to flush more than the range
+void MmTlbShootdown (MmSpace_t* space, uintptr_t start, uintptr_t end, bool flushAll);
+
+// Defers an invalidation of kernel space until CPUs next switch spaces
+// Returns the generation to wait for with MmTlbSyncKernel
+atomic_t MmTlbDeferKernel();
+
+// Makes sure every CPU has flushed kernel invalidations deferred up to gen
+void MmTlbSyncKernel (atomic_t gen);
+
+// Catches this CPU up on invalidations it has missed
+void MmTlbSync();
+
+// Sets whether this CPU is lazy
+// Lazy CPUs aren't using user mappings, so they don't get IPIs for user spaces,
+// and catch up once they stop being lazy
+// Kernel threads run lazily, as they only borrow the space of the thread before them
+void MmTlbSetLazy (bool lazy);
+
+// Lets this CPU take part in shootdowns
+void MmTlbCpuOnline();
+
+// Handles shootdown IPI
+void MmTlbIpi();
 
 // MUL basic interfaces
 
@@ -327,6 +874,15 @@ bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** page);
 #define MUL_PAGE_WC  (1 << 7)
 #define MUL_PAGE_DEV (1 << 8)
 
+// Large page hint. Only valid when the MUL defines MUL_LARGE_PAGESZ
+// The page passed must be the first of MUL_LARGE_PAGES physically contiguous pages, all fixed
+// or huge pages, and both the virtual and physical address must be aligned to MUL_LARGE_PAGESZ
+#define MUL_PAGE_LARGE (1 << 9)
+
+// Huge page hint, like MUL_PAGE_LARGE but for MUL_HUGE_PAGESZ
+// Only valid for MmMulMapEarly, as huge pages are never split
+#define MUL_PAGE_HUGE (1 << 10)
+
 // Initializes MUL
 void MmMulInit();
 
@@ -339,6 +895,21 @@ uintptr_t MmMulGetPhysEarly (uintptr_t virt);
 // Maps page into address space
 void MmMulMapPage (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm);
 
+#ifdef MUL_LARGE_PAGESZ
+// Maps a large page starting at page into address space
+// Unlike MmMulMapPage, this doesn't fall back to small pages, so page doesn't have to be the
+// start of an array. Returns false if a large page can't be used here
+bool MmMulMapLarge (MmSpace_t* space, uintptr_t virt, MmPage_t* page, int perm);
+#endif
+
+// Maps count pages into address space, starting at virt
+// Page tables are only walked once per table, so this is cheaper than mapping each page
+// perm can't have MUL_PAGE_LARGE
+void MmMulMapRange (MmSpace_t* space, uintptr_t virt, MmPage_t** pages, size_t count, int perm);
+
+// Maps count physically contigous pages, as from MmAllocPagesAt, into address space
+void MmMulMapContig (MmSpace_t* space, uintptr_t virt, MmPage_t* pages, size_t count, int perm);
+
 // Unmaps a page and removes all its mappings
 void MmMulUnmapPage (MmPage_t* page);
 
@@ -365,6 +936,13 @@ MmPage_t* MmMulGetMapping (MmSpace_t* space, uintptr_t virt);
 // Zeroes a page with the MUL
 void MmMulZeroPage (MmPage_t* page);
 
+// Maps a page into the kernel long enough to call func on its contents, with arg
+// func can't take the page table cache lock, so it mustn't map anything itself
+void MmMulAccessPage (MmPage_t* page, void (*func) (void*, void*), void* arg);
+
+// Copies src to dest with the MUL
+void MmMulCopyPage (MmPage_t* dest, MmPage_t* src);
+
 // Page attributes
 #define MUL_ATTR_ACCESS 0
 #define MUL_ATTR_DIRTY  1
@@ -373,6 +951,7 @@ void MmMulZeroPage (MmPage_t* page);
 bool MmMulGetAttrPage (MmPage_t* page, int attr);
 
 // Sets attribute to value of page
+// Returns whether any mapping had the attribute set before
 bool MmMulSetAttrPage (MmPage_t* page, int attr, bool val);
 
 // Gets attribute of address
@@ -390,12 +969,8 @@ void MmMulRefSpace (MmSpace_t* space);
 // Destroys an MUL address space reference
 void MmMulDeRefSpace (MmSpace_t* space);
 
-// Page mapping management
-typedef struct _mmpgmap
-{
-    MmSpace_t* space;         // Address space this mapping resides in
-    uintptr_t addr;           // Address of mapping in address space
-    struct _mmpgmap* next;    // Link
-} MmPageMap_t;
+// Switches CPU to address space
+// Preemption must be disabled
+void MmMulSwitchSpace (MmSpace_t* space);
 
 #endif
@@ -31,6 +31,15 @@
 #define NEXBOOT_MEMPOOL_BASE 0xFFFFFFFF88000000
 #endif
 
+// Boot stages nexboot stamps
+#define NEXBOOT_STAMP_ENTRY   0    // nexboot got control
+#define NEXBOOT_STAMP_DRIVERS 1    // Drivers started and hardware detected
+#define NEXBOOT_STAMP_CONFIG  2    // Boot volume mounted and configuration about to run
+#define NEXBOOT_STAMP_KERNEL  3    // Kernel read in
+#define NEXBOOT_STAMP_MODS    4    // Modules read in
+#define NEXBOOT_STAMP_HANDOFF 5    // About to jump to kernel
+#define NEXBOOT_STAMP_MAX     6
+
 // Firmware types
 #define NB_FW_TYPE_BIOS 1
 
@@ -89,6 +98,16 @@ typedef struct _nndisplay
     void* backBufferLoc;
 } NexNixDisplay_t;
 
+// Module loaded for the kernel
+// Modules are page aligned and physically contiguous, in memory nexboot leaves alone, so the
+// kernel can map their pages where they are
+typedef struct _nnmod
+{
+    uint64_t base;    // Physical base of module
+    uint64_t size;    // Size of module in bytes
+    char name[64];    // Path module was loaded from
+} NexNixMod_t;
+
 typedef struct _nnboot
 {
     // System hardware info
@@ -114,6 +133,10 @@ typedef struct _nnboot
     // Display info
     bool displayDefault;        // If true, display is in same state firmware left it in
     NexNixDisplay_t display;    // Display info
+    // Boot timeline
+    uint64_t stamps[NEXBOOT_STAMP_MAX];    // Cycle count when each stage was reached, 0 if not
+    // Module descriptions, indexed like mods
+    NexNixMod_t modInfo[NEXBOOT_MOD_MAX];
 } NexNixBoot_t;
 
 // Returns boot arguments
@@ -21,6 +21,7 @@
 #include <nexke/cpu.h>
 #include <nexke/list.h>
 #include <nexke/lock.h>
+#include <nexke/rcu.h>
 #include <nexke/synch.h>
 #include <nexke/types.h>
 #include <stdarg.h>
@@ -45,6 +46,39 @@ const char* NkReadArg (const char* arg);
 // Helper function to compute checksums
 bool NkVerifyChecksum (uint8_t* buf, size_t len);
 
+// LZ4 block compression
+// The compressor needs a hash table of NK_LZ4_TABLE_SZ entries to work in. It doesn't have to be
+// cleared, but callers that compress at once need their own
+#define NK_LZ4_HASH_BITS 12
+#define NK_LZ4_TABLE_SZ  (1 << NK_LZ4_HASH_BITS)
+
+// Compresses srcSz bytes at src into dest
+// Returns size of compressed block, or 0 if it doesn't fit in destSz
+size_t NkLz4Compress (const void* src, size_t srcSz, void* dest, size_t destSz, uint32_t* table);
+
+// Decompresses a block into dest
+// Returns bytes decompressed, or -1 if the block is corrupt or doesn't fit in destSz
+int32_t NkLz4Decompress (const void* src, size_t srcSz, void* dest, size_t destSz);
+
+// CRC32
+// Update functions work on the raw CRC register, without the inversion on the way in and out
+typedef uint32_t (*NkCrcFn) (uint32_t crc, const uint8_t* buf, size_t len);
+
+NK_STATIC_CALL_DECLARE (NkCrc32Update, NkCrcFn);
+NK_STATIC_CALL_DECLARE (NkCrc32cUpdate, NkCrcFn);
+
+// Builds CRC tables. CRCs can't be computed before this
+void NkInitCrc();
+
+// Updates raw CRCs with tables, for CPU code to fall back on
+uint32_t NkCrc32Table (uint32_t crc, const uint8_t* buf, size_t len);
+uint32_t NkCrc32cTable (uint32_t crc, const uint8_t* buf, size_t len);
+
+// Computes the IEEE and Castagnoli CRC32 of buf, continuing from crc
+// Start with crc as 0
+uint32_t NkCrc32 (uint32_t crc, const void* buf, size_t len);
+uint32_t NkCrc32c (uint32_t crc, const void* buf, size_t len);
+
 // Log functions
 
 // Loglevels
@@ -59,6 +93,13 @@ bool NkVerifyChecksum (uint8_t* buf, size_t len);
 // Initializes log
 void NkLogInit();
 
+// Sets up the log ring of a CPU that's being started
+void NkLogInitCpu (NkCcb_t* ccb);
+
+// Starts writing the log out from its own thread
+// Until then, messages are written out as they are logged
+void NkInitLogThread();
+
 // Logging functions
 void NkLogInfo (const char* fmt, ...);
 void NkLogDebug (const char* fmt, ...);
@@ -73,6 +114,37 @@ void NkLogMessage (const char* fmt, int level, va_list ap);
 // Slab related structures / functions
 
 typedef struct _slab Slab_t;
+typedef struct _slabmag SlabMagazine_t;
+
+// Object constructor / destructor
+// Constructors run when a slab is populated, destructors when it is released. Freed objects
+// must be returned to the cache in their constructed state
+typedef void (*SlabObjCtor) (void* obj);
+typedef void (*SlabObjDtor) (void* obj);
+
+// Per-CPU magazine state of a cache
+// Aliases don't have magazines, so they use the counts for every allocation and free made through
+// them instead
+typedef struct _slabcpu
+{
+    SlabMagazine_t* loaded;    // Magazine we are currently allocating from
+    SlabMagazine_t* prev;      // Previously loaded magazine
+    uintmax_t magAllocs;       // Allocations satisfied by magazines on this CPU
+    uintmax_t magFrees;        // Frees satisfied by magazines on this CPU
+} SlabCpuCache_t;
+
+// Slab cache statistics
+typedef struct _slabstats
+{
+    uintmax_t allocs;       // Number of objects allocated
+    uintmax_t frees;        // Number of objects freed
+    uintmax_t magAllocs;    // Number of allocations satisfied by magazines
+    uintmax_t magFrees;     // Number of frees satisfied by magazines
+    uintmax_t slabGrows;    // Number of slabs allocated
+    uintmax_t slabFrees;    // Number of slabs freed
+    uintmax_t lockSpins;    // Number of times we spun waiting on cache lock
+    int peakObjs;           // Most objects ever allocated from slabs at once
+} SlabCacheStats_t;
 
 // Slab cache
 typedef struct _slabcache
@@ -80,7 +152,7 @@ typedef struct _slabcache
     // General info
     const char* name;    // Name of this cache
     int flags;           // Cache flags
-    spinlock_t lock;     // Cache lock
+    mcslock_t lock;      // Cache lock
     // Slab pointers
     NkList_t emptySlabs;      // Pointer to empty slabs
     NkList_t partialSlabs;    // Pointer to partial slabs
@@ -90,24 +162,64 @@ typedef struct _slabcache
     int numPartial;    // Number of partial slabs
     int numEmpty;      // Number of empty slabs. Used to know when to free a slab to the PMM
     int numObjs;       // Number of currently allocated objects in this cache
+    // Empty slab retention
+    int emptyMax;       // Number of empty slabs to keep around
+    int emptyReused;    // Number of times an empty slab was reused since last reap
+    int numTrimmed;     // Number of slabs freed for being over emptyMax since the cache last grew
     // Typing info
     size_t objSz;     // Size of an object, aligned to an 8 byte boundary
     size_t align;     // Alignment of each object. Defaults to 8
     size_t maxObj;    // Max object in one slab
+    size_t bufOff;    // Offset of free list buffer in internal objects
+    // Object state
+    SlabObjCtor ctor;    // Object constructor
+    SlabObjDtor dtor;    // Object destructor
     // Slab sizing
     size_t slabSz;    // The size of one slab in pages
     // Coloring info
     size_t numColors;    // The total number of colors
     size_t colorAdj;     // Equals alignment
     size_t curColor;     // Current color
-    NkLink_t link;       // Link in cache list
+    // Magazine layer
+    SlabCpuCache_t cpuCaches[NEXKE_MAX_CPUS];    // Per-CPU magazines
+    NkList_t fullMags;                           // Depot of full magazines
+    NkList_t emptyMags;                          // Depot of empty magazines
+    int numFullMags;                             // Number of full magazines in depot
+    int numEmptyMags;                            // Number of empty magazines in depot
+    // Statistics. Magazine counts live in the per-CPU caches, so these only count the slab layer
+    SlabCacheStats_t stats;
+    NkLink_t link;                               // Link in cache list
+    NkRcuHead_t rcu;                             // Frees cache after it's destroyed
+    int tag;                                     // Memory tag objects are charged to
+    // Merging
+    struct _slabcache* merged;    // Shared cache this cache is an alias of
+    int numAliases;               // Number of aliases of a shared cache
 } SlabCache_t;
 
 #define SLAB_CACHE_EXT_SLAB    (1 << 0)
 #define SLAB_CACHE_DEMAND_PAGE (1 << 1)
-
-// Creates a new slab cache
-SlabCache_t* MmCacheCreate (size_t objSz, const char* name, size_t align, int flags);
+#define SLAB_CACHE_NO_MAG      (1 << 2)    // Bypass the per-CPU magazine layer
+#define SLAB_CACHE_TYPESAFE    (1 << 3)    // Never give slabs back, so freed objects stay readable
+#define SLAB_CACHE_NO_MERGE    (1 << 4)    // Never share slabs with other caches
+#define SLAB_CACHE_SHARED      (1 << 5)    // Holds the slabs of merged caches. Set internally
+
+// Caches without a constructor or destructor are merged with others of the same object size,
+// alignment and flags, unless they are type safe or ask not to be
+// A merged cache is an alias that allocates from a shared cache, with its own tag and counts of
+// allocations and frees
+
+// Creates a new slab cache, charging its objects to tag
+SlabCache_t* MmCacheCreate (size_t objSz, const char* name, int tag, size_t align, int flags);
+
+// Creates a new slab cache with an object constructor and destructor
+// Either may be NULL. They are called with the cache locked, so they must not allocate from it
+SlabCache_t* MmCacheCreateCtor (size_t objSz,
+                                const char* name,
+                                int tag,
+                                size_t align,
+                                int flags,
+                                SlabObjCtor ctor,
+                                SlabObjDtor dtor);
 
 // Destroys a slab cache
 void MmCacheDestroy (SlabCache_t* cache);
@@ -118,13 +230,128 @@ void* MmCacheAlloc (SlabCache_t* cache);
 // Frees an object back to slab cache
 void MmCacheFree (SlabCache_t* cache, void* obj);
 
+// Allocates count objects from a slab cache into objs, taking the cache lock at most once
+// Returns number of objects allocated, which is less than count if memory ran out
+int MmCacheAllocBulk (SlabCache_t* cache, int count, void** objs);
+
+// Frees count objects in objs back to a slab cache, taking the cache lock at most once
+void MmCacheFreeBulk (SlabCache_t* cache, int count, void** objs);
+
+// Releases empty slabs and depot magazines of a cache
+// Returns number of pages released
+size_t MmCacheReap (SlabCache_t* cache);
+
+// Reaps all slab caches
+// Returns number of pages released
+size_t MmSlabReap();
+
+// Gets statistics of a slab cache
+// Allocations and frees of an alias are its own, the rest are of the shared cache
+void MmCacheGetStats (SlabCache_t* cache, SlabCacheStats_t* stats);
+
 // Dumps the state of the slab allocator
 void MmSlabDump();
 
+// Memory tags
+// Every allocation is charged to the subsystem that made it, so whoever is growing the heap
+// can be found. Slab caches are charged to the tag they were created with
+#define MM_TAG_NONE     (-1)    // Not charged, for caches that kmalloc charges itself
+#define MM_TAG_MM       0       // Memory manager
+#define MM_TAG_TASK     1       // Threads and scheduling
+#define MM_TAG_PLATFORM 2       // Platform drivers and firmware tables
+#define MM_TAG_CPU      3       // CPU layer
+#define MM_TAG_CORE     4       // Kernel services, such as the log, timers and work queues
+#define MM_TAG_IO       5       // Device drivers and I/O requests
+#define MM_TAG_MAX      6
+
+// Memory charged to a tag
+typedef struct _mmtagcount
+{
+    intmax_t bytes;    // Bytes allocated less bytes freed
+    intmax_t objs;     // Objects allocated less objects freed
+} MmTagCount_t;
+
+// Gets the memory charged to a tag over all CPUs
+void MmGetTagCount (int tag, MmTagCount_t* count);
+
+// Logs the memory charged to each tag, and live allocations by site if they're tracked
+void MmTagDump();
+
 // Malloc/free
-void* kmalloc (size_t sz);
+// Frees have to give the tag the memory was allocated with. kfree also takes the size, which
+// saves looking it up
+void* kmalloc (size_t sz, int tag);
+
+void kfree (void* ptr, size_t sz, int tag);
+
+// Frees memory from kmalloc without its size, which is found from the memory itself
+void kfreePtr (void* ptr, int tag);
+
+// Statistics registry
+// Stats are named values that subsystems define statically and register when they start. Each
+// one has a slot in a per-CPU array, so updating it is a plain add to this CPU's copy, and reading
+// it sums the copies of every CPU. Updates aren't atomic, only cheap, so an update from an
+// interrupt can lose one made by the code it interrupted, unless the architecture adds in one
+// instruction
+// Counters only go up. Gauges go both ways, and the CPU that takes something away may not be the
+// one that added it, so only the sum means anything. Gauges whose value is kept elsewhere can
+// give a read function instead of being updated
+// Stats updated before they're registered go in slot 0, which is never read
+#define NK_STAT_COUNTER 0
+#define NK_STAT_GAUGE   1
+
+#define NK_STAT_MAX 256    // Slots in the registry
+
+// A stat
+typedef struct _nkstat
+{
+    const char* name;            // Name, as subsystem.stat
+    int type;                    // Counter or gauge
+    int idx;                     // Slot of per-CPU values
+    long long (*read) (void);    // Gets value if it's kept by the subsystem, or NULL
+    struct _nkstat* next;        // Next registered stat
+} NkStat_t;
+
+// Per-CPU values of stats
+extern NK_PERCPU long nkStatValues[NK_STAT_MAX];
+
+// Adds val to this CPU's value of stat
+static FORCEINLINE void NkStatAdd (NkStat_t* stat, long val)
+{
+#ifdef CpuPerCpuAdd
+    if (ccbInit)
+    {
+        CpuPerCpuAdd (nkStatValues[stat->idx], val);
+        return;
+    }
+#endif
+    TskDisablePreempt();
+    *NK_PERCPU_PTR (nkStatValues[stat->idx]) += val;
+    TskEnablePreempt();
+}
 
-void kfree (void* ptr, size_t sz);
+static FORCEINLINE void NkStatInc (NkStat_t* stat)
+{
+    NkStatAdd (stat, 1);
+}
+
+static FORCEINLINE void NkStatDec (NkStat_t* stat)
+{
+    NkStatAdd (stat, -1);
+}
+
+// Registers a stat, giving it a slot
+void NkStatRegister (NkStat_t* stat);
+
+// Gets the value of a stat over all CPUs
+long long NkStatRead (NkStat_t* stat);
+
+// Finds a stat by name
+// Returns NULL if there isn't one
+NkStat_t* NkStatFind (const char* name);
+
+// Logs every stat
+void NkStatDump();
 
 // Timer interface
 
@@ -136,6 +363,7 @@ typedef struct _timeevt
 {
     ktime_t deadline;    // Deadline for this event
     ktime_t delta;       // Delta of event in ns
+    ktime_t slack;       // How long after deadline event may go off
     int type;            // Type of event
     union
     {
@@ -149,6 +377,9 @@ typedef struct _timeevt
     bool inUse;       // Event current registered
     bool expired;     // Has the event expired?
     bool periodic;    // Is the event periodic?
+    bool pinned;      // Does the event have to go off on the CPU it was registered on?
+    NkCcb_t* ccb;     // CPU whose queue the event is on
+    int slot;         // Wheel slot event is in, or -1 if it's due
     spinlock_t lock;
     NkLink_t link;
 } NkTimeEvent_t;
@@ -158,22 +389,38 @@ typedef struct _timeevt
 
 #define NK_TIME_REG_PERIODIC (1 << 0)
 #define NK_TIME_REG_DEREG    (1 << 1)
+#define NK_TIME_REG_PINNED   (1 << 2)
 
 // Initializes timing subsystem
 void NkInitTime();
 
+// Initializes timing state of a CPU
+void NkInitTimeCpu (NkCcb_t* ccb);
+
 // Sets up a wakeup event
 void NkTimeSetCbEvent (NkTimeEvent_t* event, NkTimeCallback cb, void* arg);
 
 // Sets up a wakeup event
 void NkTimeSetWakeEvent (NkTimeEvent_t* event, TskWaitObj_t* waiter);
 
+// Sets how long after its deadline an event may go off
+// Events with overlapping windows go off in the same timer interrupt
+void NkTimeSetSlack (NkTimeEvent_t* event, ktime_t slack);
+
 // Registers a time event
 void NkTimeRegEvent (NkTimeEvent_t*, ktime_t delta, int flags);
 
 // Deregisters a time event
 void NkTimeDeRegEvent (NkTimeEvent_t* event);
 
+// Keeps a periodic event from being registered again after it goes off
+// Only callable from the event's own callback
+void NkTimeStopPeriodic (NkTimeEvent_t* event);
+
+// Moves events that aren't pinned from the current CPU to target, so our timer can stay quiet
+// Returns number of events moved
+int NkTimeMigrate (NkCcb_t* target);
+
 // Allocates a timer event
 NkTimeEvent_t* NkTimeNewEvent();
 
@@ -183,22 +430,85 @@ void NkTimeFreeEvent (NkTimeEvent_t* event);
 // Handles time events
 void NkTimeHandler();
 
+// Timekeeping
+// Clocks are in nanoseconds. The monotonic clock counts from when the system clock started, and
+// the real time clock is it plus an offset, which starts out at 0 until someone sets it
+
+#define NK_TIMEKEEPER_TICK 10000000ULL    // Longest the coarse clock goes without an update
+
+// Gets monotonic time, reading the clock
+ktime_t NkGetMonotonic();
+
+// Gets monotonic time as of the last timer interrupt, without touching the clock
+// It's at most NK_TIMEKEEPER_TICK behind, which is plenty for timeouts and timestamps
+ktime_t NkGetMonotonicCoarse();
+
+// Gets real time
+ktime_t NkGetRealtime();
+
+// Sets real time to time
+void NkSetRealtime (ktime_t time);
+
+// Delays
+// These spin on the clock without touching the timer, so they work with interrupts off and
+// before the timer is up. The CPU is kept busy the whole time, so anything longer than a few
+// ms should sleep instead
+
+// Polls for time ns at timer IPL
+void NkPoll (ktime_t time);
+
+// Delays for at least ns
+void NkDelayNs (ktime_t ns);
+
+// Delays for at least us
+void NkDelayUs (ktime_t us);
+
+// SMP interface
+
+// Starts every other CPU in the system
+void NkStartCpus();
+
+// Entry point of CPUs other than the BSP, after the CPU layer has set them up
+void __attribute__ ((noreturn)) NkApMain (NkCcb_t* ccb);
+
+// Gets number of CPUs that are running
+// Running CPUs are always numbered 0 to NkGetNumCpus() - 1
+int NkGetNumCpus();
+
+// Gets mask of CPUs that have checked in
+// CPUs are in it from before they first schedule
+atomic_t NkGetCpuMask();
+
+// Gets CCB of logical CPU
+NkCcb_t* NkGetCcb (int cpuNum);
+
 // Resource interface
 
 // Hash table of chunks size
 #define NK_NUM_CHUNK_HASH 256
 
+// Size of per-CPU ID caches
+#define NK_RES_CACHE_SIZE 16
+
+// Per-CPU cache of free IDs
+typedef struct _rescpu
+{
+    id_t ids[NK_RES_CACHE_SIZE];    // Cached IDs, next one to hand out last
+    int numIds;                     // Number of cached IDs
+} NkResCpuCache_t;
+
 typedef struct _resarena
 {
-    const char* name;                         // Name of arena
-    NkList_t chunks;                          // List of chunks in this arena
-    spinlock_t listLock;                      // Lock for chunk list
-    size_t numChunks;                         // Number of chunks
-    id_t minId;                               // Minimum ID
-    id_t maxId;                               // The max resource ID that can come out of here
-    NkList_t chunkHash[NK_NUM_CHUNK_HASH];    // hash table of chunks
-    spinlock_t hashLock;                      // Hash table lock
-    NkLink_t link;                            // Link in arena list
+    const char* name;                             // Name of arena
+    spinlock_t lock;                              // Lock for everything but the CPU caches
+    NkList_t chunks;                              // Chunks that have free IDs
+    size_t numChunks;                             // Number of chunks
+    id_t minId;                                   // Minimum ID
+    id_t maxId;                                   // The max resource ID that can come out of here
+    id_t nextId;                                  // First ID that has never been handed out
+    NkList_t chunkHash[NK_NUM_CHUNK_HASH];        // hash table of chunks
+    NkResCpuCache_t cpuCaches[NEXKE_MAX_CPUS];    // Per-CPU ID caches
+    NkLink_t link;                                // Link in arena list
 } NkResArena_t;
 
 // Creates a resource arena
@@ -213,6 +523,12 @@ id_t NkAllocResource (NkResArena_t* arena);
 // Frees a resource
 void NkFreeResource (NkResArena_t* arena, id_t res);
 
+// Allocates count contiguous resources. Returns the first one
+id_t NkAllocResourceRange (NkResArena_t* arena, size_t count);
+
+// Frees count contiguous resources starting at res
+void NkFreeResourceRange (NkResArena_t* arena, id_t res, size_t count);
+
 // Initializes resource system
 void NkInitResource();
 
@@ -235,6 +551,9 @@ typedef struct _workq
     int threshold;               // Number of items that need to be in list before work occurs
     ktime_t delta;               // The timeout for this work queue to be rescheduled
     TskMutex_t lock;             // Lock to protect work queue
+    int prio;                    // Priority of work threads
+    struct _workpool** pools;    // Per-CPU worker pools of managed queues
+    NkWorkItem_t* posted;        // Items posted without the lock, newest first
 } NkWorkQueue_t;
 
 // Types
@@ -243,12 +562,19 @@ typedef struct _workq
 
 // Flags
 #define NK_WORK_ONESHOT (1 << 0)
+#define NK_WORK_POLL    (1 << 1)    // Call back with a NULL item every time the queue wakes
+#define NK_WORK_MANAGED (1 << 2)    // Run work on per-CPU pools that grow as workers block
+#define NK_WORK_ORDERED (1 << 3)    // Managed, but items run one at a time in submission order
 
 // Work item
 typedef struct _work
 {
-    NkWorkQueue_t* queue;    // Queue item is on
-    void* data;              // Unspecified argument used for work
+    NkWorkQueue_t* queue;      // Queue item is on
+    struct _workpool* pool;    // Pool item is on, for managed queues
+    void* data;                // Unspecified argument used for work
+    bool queued;               // Whether item is still waiting to run
+    bool embedded;             // Whether item is part of the caller's object, and isn't freed
+    struct _work* postNext;    // Item posted before this one
     NkLink_t link;
 } NkWorkItem_t;
 
@@ -264,12 +590,152 @@ bool NkWorkQueueArmTimer (NkWorkQueue_t* queue, ktime_t delta);
 // Submits work to queue
 NkWorkItem_t* NkWorkQueueSubmit (NkWorkQueue_t* queue, void* data);
 
+// Sets up a work item embedded in another object
+void NkWorkInitItem (NkWorkItem_t* item, void* data);
+
+// Posts an embedded work item to queue
+// This neither allocates nor takes the queue lock, so it's safe at any IPL
+// Returns false if the item is still pending from an earlier post
+bool NkWorkQueuePost (NkWorkQueue_t* queue, NkWorkItem_t* item);
+
 // Removes work from queue
+// Fails if a worker already took the item
 bool NkWorkQueueCancel (NkWorkQueue_t* queue, NkWorkItem_t* item);
 
+// Wakes a work queue's thread
+// Unlike submitting, this is safe from interrupts. Managed queues have nothing to wake
+void NkWorkQueueWake (NkWorkQueue_t* queue);
+
+// Pins a work queue's thread to a CPU, so its work stays cache hot there
+// Managed queues already keep work on the CPU it was submitted on, so this fails on them
+bool NkWorkQueuePin (NkWorkQueue_t* queue, int cpuNum);
+
 // Initializes worker system
 void NkInitWorkQueue();
 
+// Scheduler hooks for workers of managed queues
+// Called by a worker right before it blocks, and right after it gets going again
+void NkWorkSleeping (NkThread_t* thread);
+void NkWorkRunning (NkThread_t* thread);
+
+// Deferred procedure call interface
+
+// DPC callback type
+typedef void (*NkDpcCallback) (NkDpc_t*, void*);
+
+// Deferred procedure call
+typedef struct _dpc
+{
+    NkDpcCallback cb;     // Function to call
+    void* arg;            // Argument to pass it
+    bool queued;          // Whether DPC is waiting to run
+    struct _dpc* next;    // Next DPC on CPU's queue
+} NkDpc_t;
+
+// Sets up a DPC
+void NkInitDpcObj (NkDpc_t* dpc, NkDpcCallback cb, void* arg);
+
+// Queues a DPC on the current CPU, to run once it gets back to IPL low
+// Safe at any IPL. Returns false if it's already queued
+bool NkQueueDpc (NkDpc_t* dpc);
+
+// Runs DPCs of the current CPU
+// Called by the platform layer when it gets back to IPL low with preemption enabled
+void NkDispatchDpcs();
+
+// Initializes DPCs on the BSP, and on another CPU once it's up
+void NkInitDpc();
+void NkInitDpcCpu (NkCcb_t* ccb);
+
+// Dumps DPC statistics
+void NkDumpDpcStats();
+
+// Sampling profiler interface
+
+// Sets up the profiler, if it was asked for on the command line
+void NkInitProf();
+
+// Sets up profiling on a CPU that's being started, and starts it once it's running there
+void NkProfInitCpu (NkCcb_t* ccb);
+void NkProfStartCpu();
+
+// Records a sample of the code interrupted at pc, with its stack at sp
+// Called by the CPU layer when a counter overflows, possibly from an NMI
+// Returns false if this CPU should stop taking samples
+bool NkProfSample (uintptr_t pc, uintptr_t sp, bool user);
+
+// Prints profile of samples taken so far
+void NkProfDump();
+
+// Event tracing interface
+
+// Trace events
+#define NK_TRACE_SWITCH    1    // Context switch, old thread and new thread
+#define NK_TRACE_FAULT     2    // Page fault, address and access
+#define NK_TRACE_INT_ENTER 3    // Hardware interrupt came in, vector
+#define NK_TRACE_INT_EXIT  4    // Hardware interrupt is done, vector and if it was claimed
+#define NK_TRACE_TIMER     5    // Time event expired, event and deadline
+#define NK_TRACE_SLAB_GROW 6    // Slab cache grew, cache and object size
+
+extern bool nkTraceOn;
+
+// Checks if tracepoints are on
+// CPUs that can patch code define CpuTraceOn, so that tracepoints are NOPs unless tracing
+#ifndef CpuTraceOn
+#define CpuTraceOn() __builtin_expect (nkTraceOn, 0)
+#endif
+
+// Tracepoint
+#define NK_TRACE(event, arg1, arg2)                                          \
+    do                                                                       \
+    {                                                                        \
+        if (CpuTraceOn())                                                    \
+            NkTraceRecord ((event), (uintptr_t) (arg1), (uintptr_t) (arg2)); \
+    } while (0)
+
+// Records an event in this CPU's trace ring
+// Safe from any context, including NMIs
+void NkTraceRecord (int event, uintptr_t arg1, uintptr_t arg2);
+
+// Sets up tracing, if it was asked for on the command line
+void NkInitTrace();
+
+// Sets up tracing on a CPU that's being started
+void NkTraceInitCpu (NkCcb_t* ccb);
+
+// Logs what's in the trace rings
+void NkTraceDump();
+
+// Boot timeline interface
+
+// Records that an init phase is done
+// Safe from the very start of boot; phase must be a string that stays around
+void NkBootStamp (const char* phase);
+
+// Logs the boot timeline, if it was asked for on the command line
+void NkBootTimeDump();
+
+// Benchmark interface
+
+// Runs the microbenchmarks asked for on the command line, and logs the results
+void NkRunBench();
+
+// Boot init graph interface
+
+#define NK_INIT_MAX_NODES 31    // Most steps a graph can have
+
+// Init step
+typedef struct _nkinitnode
+{
+    const char* name;    // Name of step, also used for its thread
+    void (*init)();      // Does the step
+    uint32_t deps;       // Mask of steps in the same graph that have to be done first
+} NkInitNode_t;
+
+// Runs a graph of init steps, each on its own thread once the steps it depends on are done
+// Waits for all of them to be done. Dependencies must not have cycles
+void NkRunInitGraph (const NkInitNode_t* nodes, int numNodes);
+
 // Aligning inlines
 static inline uintptr_t NkAlignUp (uintptr_t ptr, uintptr_t align)
 {
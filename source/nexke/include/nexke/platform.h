@@ -20,6 +20,7 @@
 
 #include <nexke/cpu.h>
 #include <nexke/platform/acpi.h>
+#include <nexke/rcu.h>
 #include <nexke/types.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -38,6 +39,7 @@ typedef struct _nkcons
 {
     bool (*read) (char*);           // Reads a character from the console
     void (*write) (const char*);    // Writes a string to the console
+    void (*sync)();                 // Writes out anything buffered, and stops buffering. Optional
 } NkConsole_t;
 
 // Gets primary console
@@ -54,6 +56,8 @@ NkConsole_t* PltGetSecondaryCons();
 #define PLT_IPL_HIGH     33
 #define PLT_IPL_NUM_PRIO 32
 
+typedef struct _msimsg PltMsiMsg_t;
+
 // Function pointer types for below
 typedef bool (*PltHwBeginInterrupt) (NkCcb_t*, CpuIntContext_t*);
 typedef void (*PltHwEndInterrupt) (NkCcb_t*, CpuIntContext_t*);
@@ -63,6 +67,12 @@ typedef void (*PltHwSetIpl) (NkCcb_t*, ipl_t);
 typedef int (*PltHwConnectInterrupt) (NkCcb_t*, NkHwInterrupt_t*);
 typedef void (*PltHwDisconnectInterrupt) (NkCcb_t*, NkHwInterrupt_t*);
 typedef int (*PltHwGetVector) (NkCcb_t*, CpuIntContext_t*);
+typedef void (*PltHwSendIpi) (NkCcb_t*, PltCpu_t*, int);
+typedef bool (*PltHwStartCpu) (NkCcb_t*, PltCpu_t*, paddr_t);
+typedef void (*PltHwInitCpu) (NkCcb_t*);
+typedef int (*PltHwAllocMsi) (NkCcb_t*, NkHwInterrupt_t*, int, PltCpu_t*, PltMsiMsg_t*);
+typedef void (*PltHwFreeMsi) (NkCcb_t*, NkHwInterrupt_t*, int);
+typedef bool (*PltHwSetAffinity) (NkCcb_t*, NkHwInterrupt_t*, PltCpu_t*);
 
 // Interupt chain structure
 typedef struct _intchain
@@ -87,29 +97,74 @@ typedef struct _hwintctrl
     PltHwConnectInterrupt connectInterrupt;
     PltHwDisconnectInterrupt disconnectInterrupt;
     PltHwGetVector getVector;
+    PltHwSendIpi sendIpi;            // NULL if controller can't send IPIs
+    PltHwStartCpu startCpu;          // NULL if controller can't start CPUs
+    PltHwInitCpu initCpu;            // Sets up controller on a newly started CPU
+    PltHwAllocMsi allocMsi;          // NULL if controller can't take message signalled interrupts
+    PltHwFreeMsi freeMsi;            // Frees vectors of message signalled interrupts
+    PltHwSetAffinity setAffinity;    // NULL if lines can only go to one CPU
 } PltHwIntCtrl_t;
 
 // Valid controller types
 #define PLT_HWINT_8259A 1
 #define PLT_HWINT_APIC  2
 #define PLT_HWINT_GIC   3
+#define PLT_HWINT_GICV3 4
 
 // Initializes system inerrupt controller
 PltHwIntCtrl_t* PltInitHwInts();
 
+// Static calls to the interrupt controller's hot hooks, updated once it's picked
+NK_STATIC_CALL_DECLARE (PltBeginInt, PltHwBeginInterrupt);
+NK_STATIC_CALL_DECLARE (PltEndInt, PltHwEndInterrupt);
+NK_STATIC_CALL_DECLARE (PltSetHwIpl, PltHwSetIpl);
+
+// Points the static calls above at ctrl's hooks
+void PltUpdateIntCalls (PltHwIntCtrl_t* ctrl);
+
 // Interrupt function type
 typedef bool (*PltIntHandler) (NkInterrupt_t* intObj, CpuIntContext_t* ctx);
 
+#ifdef NEXKE_INT_STATS
+// Interrupt statistics
+// Times are in CPU cycles, and leave out interrupts that nested on top. Latency is how long it
+// took from the trap coming in to the handler getting called
+typedef struct _intstats
+{
+    uint64_t calls;         // Times handler got called
+    uint64_t unclaimed;     // Times nobody claimed the interrupt
+    uint64_t cycles;        // Cycles spent handling
+    uint64_t maxCycles;     // Longest time spent handling once
+    uint64_t latency;       // Sum of all latencies
+    uint64_t maxLatency;    // Longest latency
+} PltIntStats_t;
+#endif
+
+// Where threaded interrupts do the bulk of their work
+typedef void (*PltIntThreadFn) (NkHwInterrupt_t* hwInt);
+
+typedef struct _intthread PltIntThread_t;
+
+typedef struct _pltpoll PltPoll_t;
+
 // Hardware interrupt
 typedef struct _hwint
 {
-    uint32_t gsi;             // GSI number
-    int flags;                // Interrupt flags
-    int mode;                 // Level or edge
-    ipl_t ipl;                // IPL value
-    int vector;               // Vector we're connected to
-    PltIntHandler handler;    // Handler for this interrupt
+    uint32_t gsi;               // GSI number
+    int flags;                  // Interrupt flags
+    int mode;                   // Level or edge
+    ipl_t ipl;                  // IPL value
+    int vector;                 // Vector we're connected to
+    int cpuNum;                 // Logical CPU interrupt is delivered to
+    PltIntHandler handler;      // Handler for this interrupt
+    PltIntThreadFn threadFn;    // Work function of threaded interrupt
+    int threadPrio;             // Priority its thread runs at
+    PltIntThread_t* thread;     // Thread it runs in
+    PltPoll_t* poll;            // Poll that can stand in for it
     NkLink_t link;
+#ifdef NEXKE_INT_STATS
+    PltIntStats_t stats;    // Statistics of this handler
+#endif
 } NkHwInterrupt_t;
 
 #define PLT_MODE_EDGE  0
@@ -120,13 +175,24 @@ typedef struct _hwint
 #define PLT_HWINT_NON_CHAINABLE (1 << 3)
 #define PLT_HWINT_CHAINED       (1 << 4)
 #define PLT_HWINT_FORCE_IPL     (1 << 5)
+#define PLT_HWINT_MSI           (1 << 6)
+#define PLT_HWINT_THREADED      (1 << 7)
 
 #define PLT_GSI_INTERNAL 0xFFFFFFFF
+#define PLT_GSI_MSI      0xFFFFFFFE
+
+// Message a device sends to raise a message signalled interrupt
+typedef struct _msimsg
+{
+    uint64_t addr;    // Address to write to
+    uint32_t data;    // Value to write
+} PltMsiMsg_t;
 
 // Interrupt object
 typedef struct _int
 {
     int vector;             // Interrupt vector number
+    int cpuNum;             // CPU whose vector it is, or PLT_INT_ALL_CPUS
     int type;               // Is this an exception, a service, or an external interrupt?
     long long callCount;    // Number of times this interrupt has been called
     union
@@ -135,12 +201,19 @@ typedef struct _int
         PltHwIntChain_t* intChain;    // Interrupt chain
     };
     spinlock_t lock;
+    NkRcuHead_t rcu;               // Frees object after it's uninstalled
+    NkHwInterrupt_t* lastClaim;    // Handler that claimed the last interrupt, tried first
+#ifdef NEXKE_INT_STATS
+    PltIntStats_t stats;    // Statistics of the whole chain
+#endif
 } NkInterrupt_t;
 
 #define PLT_INT_EXEC  0
 #define PLT_INT_SVC   1
 #define PLT_INT_HWINT 2
 
+#define PLT_INT_ALL_CPUS (-1)    // Interrupt is on its vector on every CPU
+
 // Called when a trap goes bad
 void PltBadTrap (CpuIntContext_t* context, const char* msg, ...);
 
@@ -190,12 +263,98 @@ NkInterrupt_t* PltConnectInterrupt (NkHwInterrupt_t* hwInt);
 // Disconnects interrupt from hardware controller
 void PltDisconnectInterrupt (NkHwInterrupt_t* hwInt);
 
+// Initializes a message signalled interrupt
+void PltInitMsi (NkHwInterrupt_t* hwInt, PltIntHandler handler, ipl_t ipl, int flags);
+
+// Connects count message signalled interrupts to consecutive vectors, delivered to logical CPU
+// cpuNum, which has to be running or be the CPU that's starting. They don't go through any line,
+// so they are never shared. Their vectors only mean them on cpuNum, and can be other
+// interrupts on other CPUs
+// count must be a power of two. msg gets the address and data to program into the device, and
+// interrupt i is raised by writing data + i. IPLs may be changed to what the vectors run at
+// Returns false if the controller can't do it
+bool PltConnectMsi (NkHwInterrupt_t* hwInts, int count, int cpuNum, PltMsiMsg_t* msg);
+
+// Disconnects message signalled interrupts that were connected together
+void PltDisconnectMsi (NkHwInterrupt_t* hwInts, int count);
+
+// Gets the message signalled interrupt intObj was connected for, from its handler
+// They're never shared, so it's the only one on the chain
+static inline NkHwInterrupt_t* PltGetMsiHwInt (NkInterrupt_t* intObj)
+{
+    return LINK_CONTAINER (NkListFront (&intObj->intChain->list), NkHwInterrupt_t, link);
+}
+
 // Enables an interrupt
 void PltEnableInterrupt (NkHwInterrupt_t* hwInt);
 
 // Disables an interrupt
 void PltDisableInterrupt (NkHwInterrupt_t* hwInt);
 
+// Sends an interrupt to logical CPU cpuNum
+// Everything chained on its line moves with it. Message signalled interrupts have to be
+// connected again instead. Returns false if it can't be moved
+bool PltSetIntAffinity (NkHwInterrupt_t* hwInt, int cpuNum);
+
+// Starts spreading busy interrupts out over CPUs, and watching for interrupt storms
+void PltStartIntBalancer();
+
+// Makes hwInt a threaded interrupt, before it gets connected
+// Its handler then only has to quiet the device down. Once it claims an interrupt, fn gets
+// called in a thread of its own at priority prio to do the rest
+void PltSetIntThread (NkHwInterrupt_t* hwInt, PltIntThreadFn fn, int prio);
+
+// Polled interrupts
+// A device that has more coming in than is worth an interrupt each can hand off to a poll routine
+// from its handler. PltSchedulePoll masks the interrupt and runs the routine from a DPC on this
+// CPU, a weight's worth at a time, until it comes back with less than that. Then the interrupt
+// gets unmasked again
+// Interrupts that storm are left masked and polled from a timer instead, until the device goes
+// quiet, as long as everything on them has a poll
+
+// Does up to budget units of work, returning how many got done
+typedef int (*PltPollFn) (PltPoll_t* poll, int budget);
+
+// Masks or unmasks the interrupt of a poll
+typedef void (*PltPollMask) (PltPoll_t* poll, bool mask);
+
+typedef struct _pltpoll
+{
+    NkHwInterrupt_t* hwInt;    // Interrupt it stands in for
+    PltPollFn fn;              // Poll routine
+    PltPollMask mask;          // Masks the interrupt in the device, or NULL to use the controller
+    int weight;                // Most work done each time round
+    int state;                 // What the poll is doing
+    bool stormReq;             // Set when the interrupt is found to be storming
+    int idleTicks;             // Storm ticks in a row that found nothing to do
+    NkTimeEvent_t* timer;      // Polls during storms
+    spinlock_t lock;
+    struct _pltpoll* next;     // Next poll waiting on CPU
+} PltPoll_t;
+
+#define PLT_POLL_SCHED   (1 << 0)    // Waiting to run, or running
+#define PLT_POLL_STORM   (1 << 1)    // Polled from timer
+#define PLT_POLL_TIMER   (1 << 2)    // Timer is registered
+#define PLT_POLL_STOPPED (1 << 3)    // Not to be run again
+
+// Sets up poll for hwInt, once hwInt is set up but before it gets connected
+// Message signalled interrupts have to have mask. weight is 0 for the default
+void PltInitPoll (PltPoll_t* poll,
+                  NkHwInterrupt_t* hwInt,
+                  PltPollFn fn,
+                  PltPollMask mask,
+                  int weight);
+
+// Masks the interrupt of poll and runs it from a DPC, unless it already is
+// Called from the interrupt's handler
+void PltSchedulePoll (PltPoll_t* poll);
+
+// Stops poll for good, once its interrupt is disconnected
+void PltStopPoll (PltPoll_t* poll);
+
+// Dumps interrupt statistics
+void PltDumpIntStats();
+
 // Remaps hardware interrupts on specified object to a new vector and IPL
 // Requires input to be a hardware interrupt object, and returns the new interrupt
 // Called with interrupts disabled
@@ -207,9 +366,36 @@ NkHwInterrupt_t* PltAllocHwInterrupt();
 // Checks if two hardware interrupts are compatible
 bool PltAreIntsCompatible (NkHwInterrupt_t* int1, NkHwInterrupt_t* int2);
 
-// Retrieves interrupt obejct from table
+// Retrieves interrupt obejct vector is on this CPU
 NkInterrupt_t* PltGetInterrupt (int vector);
 
+// Retrieves interrupt object vector is on CPU cpuNum
+// With PLT_INT_ALL_CPUS, only finds ones every CPU has
+NkInterrupt_t* PltGetCpuInterrupt (int cpuNum, int vector);
+
+// IPI types
+#define PLT_IPI_TLB     0    // TLB shootdown
+#define PLT_IPI_RESCHED 1    // Check for preemption
+
+// Sends an IPI to logical CPU
+void PltSendIpi (int cpuNum, int ipi);
+
+// Checks if other CPUs can be started and run on their own
+bool PltCanStartCpus();
+
+// Gets the most CPUs that can run at once, counting this one
+int PltGetMaxCpus();
+
+// Starts CPU executing at physical address entry
+bool PltStartCpu (PltCpu_t* cpu, paddr_t entry);
+
+// Sets up interrupt controller and timer of the current CPU, after it has been started
+void PltInitCpu();
+
+// Checks clock of a CPU that's being started against ours
+// Called by both the CPU starting it and the new CPU, at the same time
+void PltSyncClock (NkCcb_t* ccb);
+
 // Clock system
 
 typedef ktime_t (*PltHwGetTime)();
@@ -224,6 +410,7 @@ typedef struct _hwclock
     PltHwPoll poll;           // Polls for a amount of time;
     ktime_t internalCount;    // Used for software clocking on some systems
     uintptr_t private;
+    PltHwInitCpu syncCpu;     // Syncs clock of a starting CPU with ours, NULL if clock is global
 } PltHwClock_t;
 
 #define PLT_CLOCK_PIT     1
@@ -231,10 +418,14 @@ typedef struct _hwclock
 #define PLT_CLOCK_HPET    3
 #define PLT_CLOCK_TSC     4
 #define PLT_CLOCK_GENERIC 5
+#define PLT_CLOCK_RISCV   6
 
 // Initializes clock system
 PltHwClock_t* PltInitClock();
 
+// Static call to the clock's getTime, updated once it's picked
+NK_STATIC_CALL_DECLARE (PltGetTime, PltHwGetTime);
+
 // Timer system
 
 typedef void (*PltHwSetTimerCallback) (void (*)());
@@ -250,6 +441,8 @@ typedef struct _hwtimer
     uintptr_t private;
     // Function interface
     PltHwArmTimer armTimer;
+    PltHwInitCpu initCpu;    // Sets up timer on a newly started CPU, NULL if timer is global
+    int maxCpus;             // Most CPUs timer can serve, 0 if there's no limit
 } PltHwTimer_t;
 
 #define PLT_TIMER_PIT     1
@@ -258,10 +451,14 @@ typedef struct _hwtimer
 #define PLT_TIMER_HPET    4
 #define PLT_TIMER_TSC     5
 #define PLT_TIMER_GENERIC 6
+#define PLT_TIMER_RISCV   7
 
 // Initializes system timer
 PltHwTimer_t* PltInitTimer();
 
+// Static call to the timer's armTimer, updated once it's picked
+NK_STATIC_CALL_DECLARE (PltArmTimer, PltHwArmTimer);
+
 // Nanoseconds in a second
 #define PLT_NS_IN_SEC 1000000000
 
@@ -271,7 +468,10 @@ typedef struct _hwcpu
 {
     int id;           // ID according to platform
     int type;         // CPU interrupt controller type
-    uint64_t addr;    // Address of interrupt controller
+    uint64_t addr;        // Address of interrupt controller
+    uint64_t affinity;    // MPIDR affinity fields, used to route interrupts on GICv3
+    uint32_t acpiUid;     // ACPI processor UID of GIC CPUs, used to find them in the PPTT
+    int node;             // NUMA node CPU is in
     NkLink_t link;
 } PltCpu_t;
 
@@ -306,14 +506,42 @@ typedef struct _hwintctl
     int id;              // ID of this controller
     uint64_t addr;       // ADdress of it
     uint32_t gsiBase;    // Base interrupt number
+    int version;         // Version of controller, 0 if unknown
+    size_t len;          // Length of register range, 0 if it holds one register frame
     NkLink_t link;
 } PltIntCtrl_t;
 
-static const char* pltIntCtrlTypes[] = {"IOAPIC", "8259A", "GIC"};
+static const char* pltIntCtrlTypes[] = {"IOAPIC", "8259A", "GIC", "GICR"};
 
 #define PLT_INTCTRL_IOAPIC 0
 #define PLT_INTCTRL_8259A  1
 #define PLT_INTCTRL_GIC    2
+#define PLT_INTCTRL_GICR   3    // GICv3 redistributor range
+
+// NUMA topology
+// Nodes are numbered densely in the order firmware lists them. Systems without a topology
+// have one node that everything is in
+#define PLT_MAX_MEM_RANGES 32
+
+// Memory range in a node
+typedef struct _pltmemrange
+{
+    paddr_t base;    // Base address
+    paddr_t end;     // End address
+    int node;        // Node range is in
+} PltMemRange_t;
+
+typedef struct _pltnuma
+{
+    int numNodes;                                      // Number of nodes, 0 if no topology
+    uint32_t domains[NEXKE_MAX_NODES];                 // Firmware domain of each node
+    int numRanges;                                     // Number of memory ranges
+    PltMemRange_t ranges[PLT_MAX_MEM_RANGES];          // Memory ranges, sorted by address
+    uint8_t dist[NEXKE_MAX_NODES][NEXKE_MAX_NODES];    // Relative distance between nodes
+} PltNuma_t;
+
+#define PLT_NODE_LOCAL_DIST  10    // Distance of a node to itself
+#define PLT_NODE_REMOTE_DIST 20    // Distance used for nodes firmware gives no distance for
 
 // Platform structure
 typedef struct _nkplt
@@ -322,20 +550,22 @@ typedef struct _nkplt
     int subType;
     NkConsole_t* primaryCons;    // Consoles
     NkConsole_t* secondaryCons;
-    PltHwClock_t* clock;        // System clock
-    PltHwTimer_t* timer;        // System timer
-    PltHwIntCtrl_t* intCtrl;    // Interrupt controller
-    NkList_t cpus;              // List of CPUs
-    PltCpu_t* bsp;              // BSP CPU
-    NkList_t ints;              // List of interrupt sources
-    NkList_t intCtrls;          // List of interrupt controllers
+    PltHwClock_t* clock;                 // System clock
+    PltHwTimer_t* timer;                 // System timer
+    PltHwIntCtrl_t* intCtrl;             // Interrupt controller
+    NkList_t cpus;                       // List of CPUs
+    PltCpu_t* bsp;                       // BSP CPU
+    PltCpu_t* cpuMap[NEXKE_MAX_CPUS];    // Online CPUs by logical number
+    NkList_t ints;                       // List of interrupt sources
+    NkList_t intCtrls;                   // List of interrupt controllers
     int numCpus;
     int numIntCtrls;
+    PltNuma_t numa;    // NUMA topology
     // ACPI related things
     int acpiVer;                   // ACPI version
     AcpiRsdp_t rsdp;               // Copy of RSDP
-    AcpiCacheEnt_t* tableCache;    // ACPI table cache
-    spinlock_t acpiCacheLock;
+    AcpiTableDir_t* tableDir;    // ACPI table directory
+    spinlock_t acpiDirLock;
 } NkPlatform_t;
 
 #define PLT_TYPE_PC      1
@@ -363,4 +593,13 @@ uint32_t PltGetGsi (int bus, int line);
 // Gets an interrupt override based on the GSI
 PltIntOverride_t* PltGetOverride (uint32_t gsi);
 
+// Gets number of NUMA nodes
+int PltGetNumNodes();
+
+// Gets node addr is in. If end isn't NULL, it gets the address the next range starts at
+int PltGetMemNode (paddr_t addr, paddr_t* end);
+
+// Gets relative distance between two nodes
+int PltGetNodeDist (int from, int to);
+
 #endif
@@ -161,6 +161,7 @@ typedef struct _madt
 #define ACPI_MADT_X2APIC    9
 #define ACPI_MADT_GICC      0xB
 #define ACPI_MADT_GICD      0xC
+#define ACPI_MADT_GICR      0xE
 #define ACPI_MADT_MP_WAKEUP 0x10
 
 typedef struct _madtgen
@@ -260,6 +261,136 @@ typedef struct _madtgicd
     uint8_t version;
 } __attribute__ ((packed)) AcpiGicd_t;
 
+#define ACPI_GICD_VER_DETECT 0    // Version has to be read from hardware
+#define ACPI_GICD_VER_V3     3
+
+// GIC redistributor discovery range
+typedef struct _madtgicr
+{
+    uint8_t type;    // 0xE
+    uint8_t length;
+    uint16_t resvd;
+    uint64_t addr;    // Base of discovery range
+    uint32_t len;     // Length of discovery range
+} __attribute__ ((packed)) AcpiGicr_t;
+
+// SRAT
+typedef struct _srat
+{
+    AcpiSdt_t sdt;
+    uint32_t resvd1;
+    uint64_t resvd2;
+} __attribute__ ((packed)) AcpiSrat_t;
+
+#define ACPI_SRAT_LAPIC  0
+#define ACPI_SRAT_MEM    1
+#define ACPI_SRAT_X2APIC 2
+#define ACPI_SRAT_GICC   3
+
+// Local APIC affinity
+typedef struct _sratlapic
+{
+    uint8_t type;      // 0
+    uint8_t length;    // 16
+    uint8_t domainLow;
+    uint8_t apicId;
+    uint32_t flags;
+    uint8_t sapicEid;
+    uint8_t domainHigh[3];
+    uint32_t clockDomain;
+} __attribute__ ((packed)) AcpiSratLapic_t;
+
+// Memory affinity
+typedef struct _sratmem
+{
+    uint8_t type;      // 1
+    uint8_t length;    // 40
+    uint32_t domain;
+    uint16_t resvd;
+    uint64_t base;
+    uint64_t len;
+    uint32_t resvd1;
+    uint32_t flags;
+    uint64_t resvd2;
+} __attribute__ ((packed)) AcpiSratMem_t;
+
+// x2APIC affinity
+typedef struct _sratx2apic
+{
+    uint8_t type;      // 2
+    uint8_t length;    // 24
+    uint16_t resvd;
+    uint32_t domain;
+    uint32_t x2apicId;
+    uint32_t flags;
+    uint32_t clockDomain;
+    uint32_t resvd1;
+} __attribute__ ((packed)) AcpiSratX2Apic_t;
+
+// GICC affinity
+typedef struct _sratgicc
+{
+    uint8_t type;      // 3
+    uint8_t length;    // 18
+    uint32_t domain;
+    uint32_t acpiUid;
+    uint32_t flags;
+    uint32_t clockDomain;
+} __attribute__ ((packed)) AcpiSratGicc_t;
+
+#define ACPI_SRAT_ENABLED (1 << 0)
+
+// SLIT
+typedef struct _slit
+{
+    AcpiSdt_t sdt;
+    uint64_t numLocalities;
+    uint8_t dist[];    // Distance from locality i to j is at i * numLocalities + j
+} __attribute__ ((packed)) AcpiSlit_t;
+
+#define ACPI_SLIT_LOCAL 10    // Distance of a locality to itself
+
+// PPTT
+// Structures refer to each other by offset from the start of the table
+#define ACPI_PPTT_PROC  0
+#define ACPI_PPTT_CACHE 1
+
+// Processor hierarchy node
+typedef struct _ppttproc
+{
+    uint8_t type;    // 0
+    uint8_t length;
+    uint16_t resvd;
+    uint32_t flags;
+    uint32_t parent;         // Parent node, 0 if this is a root
+    uint32_t acpiUid;        // ACPI processor UID, if flags say it's valid
+    uint32_t numPrivate;     // Number of private resources
+    uint32_t resources[];    // Private resources, such as caches
+} __attribute__ ((packed)) AcpiPpttProc_t;
+
+#define ACPI_PPTT_PACKAGE   (1 << 0)
+#define ACPI_PPTT_UID_VALID (1 << 1)
+#define ACPI_PPTT_THREAD    (1 << 2)
+#define ACPI_PPTT_LEAF      (1 << 3)
+
+// Cache type structure
+typedef struct _ppttcache
+{
+    uint8_t type;    // 1
+    uint8_t length;
+    uint16_t resvd;
+    uint32_t flags;
+    uint32_t nextLevel;    // Next level of cache private to the same node, 0 if none
+    uint32_t size;
+    uint32_t numSets;
+    uint8_t assoc;
+    uint8_t attr;
+    uint16_t lineSize;
+} __attribute__ ((packed)) AcpiPpttCache_t;
+
+#define ACPI_PPTT_CACHE_TYPE(attr) (((attr) >> 2) & 3)
+#define ACPI_PPTT_CACHE_INSN       1
+
 // MP Wakeup
 typedef struct _madtmpwakeup
 {
@@ -333,12 +464,88 @@ typedef struct _spcr
     uint32_t preciseBaud;
 } __attribute__ ((packed)) AcpiSpcr_t;
 
-// ACPI table cache entry
-typedef struct _acpicache
+// GTDT table
+typedef struct _gtdt
+{
+    AcpiSdt_t sdt;
+    uint64_t cntCtrlBase;    // Physical address of CNTControlBase
+    uint32_t resvd;
+    uint32_t secureGsi;      // Secure EL1 timer GSI
+    uint32_t secureFlags;
+    uint32_t physGsi;        // Non-secure EL1 timer GSI
+    uint32_t physFlags;
+    uint32_t virtGsi;        // Virtual timer GSI
+    uint32_t virtFlags;
+    uint32_t el2Gsi;         // EL2 timer GSI
+    uint32_t el2Flags;
+    uint64_t cntReadBase;    // Physical address of CNTReadBase
+    uint32_t numPltTimers;
+    uint32_t pltTimerOff;
+} __attribute__ ((packed)) AcpiGtdt_t;
+
+// RHCT table, RISC-V hart capabilities
+// Nodes are found by offset from the start of the table
+typedef struct _rhct
+{
+    AcpiSdt_t sdt;
+    uint32_t flags;
+    uint64_t timebase;    // Frequency of the time CSR
+    uint32_t numNodes;
+    uint32_t nodeOff;     // Offset of first node
+} __attribute__ ((packed)) AcpiRhct_t;
+
+typedef struct _rhctnode
 {
-    struct _acpicache* next;    // Forward pointer
-    AcpiSdt_t* table;           // Actual table data, which is after this struct
-} AcpiCacheEnt_t;
+    uint16_t type;
+    uint16_t length;
+    uint16_t rev;
+} __attribute__ ((packed)) AcpiRhctNode_t;
+
+#define ACPI_RHCT_ISA 0
+
+// ISA string node
+typedef struct _rhctisa
+{
+    AcpiRhctNode_t node;
+    uint16_t isaLen;
+    char isa[];    // ISA string, such as rv64imafdc_sstc_svpbmt
+} __attribute__ ((packed)) AcpiRhctIsa_t;
+
+// MCFG table
+typedef struct _mcfg
+{
+    AcpiSdt_t sdt;
+    uint64_t resvd;
+} __attribute__ ((packed)) AcpiMcfg_t;
+
+// Memory mapped configuration space of a range of buses
+typedef struct _mcfgent
+{
+    uint64_t base;        // Physical address of bus 0 of segment, even if it isn't in range
+    uint16_t seg;         // PCI segment
+    uint8_t startBus;     // First bus in range
+    uint8_t endBus;       // Last bus in range
+    uint32_t resvd;
+} __attribute__ ((packed)) AcpiMcfgEnt_t;
+
+// ACPI table directory entry
+typedef struct _acpidirent
+{
+    uint32_t sig;        // Signature of table, read as an integer
+    uint32_t len;        // Length of table
+    paddr_t phys;        // Physical address of table
+    AcpiSdt_t* table;    // Mapped table, NULL until it is first looked up
+    bool bad;            // Table failed its checksum
+} AcpiDirEnt_t;
+
+// ACPI table directory
+// Entries are sorted by signature, with instances of the same signature in firmware order
+typedef struct _acpidir
+{
+    int numEnts;            // Number of entries
+    size_t sz;              // Size of directory
+    AcpiDirEnt_t ents[];    // Entries
+} AcpiTableDir_t;
 
 // Initalizes ACPI
 bool PltAcpiInit();
@@ -346,13 +553,26 @@ bool PltAcpiInit();
 // Finds an ACPI table
 AcpiSdt_t* PltAcpiFindTable (const char* sig);
 
+// Finds instance inst of an ACPI table, for tables that can appear more than once, like SSDTs
+AcpiSdt_t* PltAcpiFindTableInst (const char* sig, int inst);
+
 // Finds an ACPI table early in the boot process, pre-MM
 AcpiSdt_t* PltAcpiFindTableEarly (const char* sig);
 
+// Copies all tables out of firmware memory, so it can be reclaimed
+void PltAcpiCacheTables();
+
+// Gets topology IDs of the CPU with ACPI processor UID uid from the PPTT
+// Returns false if there's no PPTT or the CPU isn't in it
+bool PltAcpiGetCpuTopology (uint32_t uid, int* ids);
+
 // Initializes ACPI PM timer
 PltHwClock_t* PltAcpiInitClock();
 
 // Detects all CPUs attached to the platform
 bool PltAcpiDetectCpus();
 
+// Reads NUMA topology from SRAT and SLIT
+bool PltAcpiDetectNuma();
+
 #endif
@@ -22,6 +22,22 @@
 #include <nexke/platform/acpi.h>
 
 bool PltPL011Init (AcpiGas_t* gas);
+void PltPL011InitInt();
 PltHwIntCtrl_t* PltGicInit();
 
+// Enables a PPI on the current CPU
+void PltGicEnablePpi (int ppi, ipl_t ipl);
+
+// GICv3 driver, used by the functions above when the hardware has it
+PltHwIntCtrl_t* PltGicV3Init (PltIntCtrl_t* gicd);
+void PltGicV3EnablePpi (int ppi, ipl_t ipl);
+
+#ifdef NEXNIX_BASEARCH_ARM
+PltHwClock_t* CpuInitGtClock();
+PltHwTimer_t* CpuInitGtTimer();
+#elif defined(NEXNIX_BASEARCH_RISCV)
+PltHwClock_t* CpuInitTimeClock();
+PltHwTimer_t* CpuInitTimeTimer();
+#endif
+
 #endif
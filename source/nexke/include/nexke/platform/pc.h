@@ -29,6 +29,9 @@ void PltVgaInit();
 // Initializes UART 16550 driver
 bool PltUartInit();
 
+// Starts draining UART output from its interrupt
+void PltUartInitInt();
+
 // Initializes 8259A PIC
 PltHwIntCtrl_t* PltPicInit();
 
@@ -44,6 +47,10 @@ PltHwClock_t* PltPitInitClk();
 // Initializes PIT timer part
 PltHwTimer_t* PltPitInitTimer();
 
+// Busy waits for ns on PIT channel 2, without using interrupts
+// ns must be less than about 54 ms
+void PltPitWait (ktime_t ns);
+
 // Enable ACPI
 void PltAcpiPcEnable();
 
@@ -57,15 +64,24 @@ PltHwTimer_t* PltApicInitTimer();
 PltHwClock_t* PltHpetInitClock();
 
 // HPET timer intialization function
-PltHwTimer_t* PltHpetInitTimer();
+// If perCpu is set, only comparators that can be given to each CPU will do
+PltHwTimer_t* PltHpetInitTimer (bool perCpu);
 
 // Helper function to get number of redirection entries for specified IOAPIC
 // Used by MP detection code
 int PltApicGetRedirs (paddr_t base);
 
+// Routes performance counter overflows on this CPU to an NMI
+// Returns false if there's no LAPIC to route them through
+bool PltApicArmPmi();
+
 // There in a weird spot, but this header is the only place that works for these functions
 
 // Initialize TSC clock
 PltHwClock_t* CpuInitTscClock();
 
+// Gets the TSC count delta ns from now on this CPU
+// Only valid once the TSC is the clock
+ktime_t CpuTscDeadline (ktime_t delta);
+
 #endif
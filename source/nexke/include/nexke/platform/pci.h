@@ -0,0 +1,161 @@
+/*
+    pci.h - contains PCI bus interface
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _PCI_H
+#define _PCI_H
+
+#include <nexke/list.h>
+#include <nexke/platform.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Config space registers
+#define PLT_PCI_VENDOR  0x00
+#define PLT_PCI_DEVICE  0x02
+#define PLT_PCI_COMMAND 0x04
+#define PLT_PCI_STATUS  0x06
+#define PLT_PCI_PROGIF  0x09
+#define PLT_PCI_SUBCLS  0x0A
+#define PLT_PCI_CLASS   0x0B
+#define PLT_PCI_HDRTYPE 0x0E
+#define PLT_PCI_BAR0    0x10
+#define PLT_PCI_SECBUS  0x19    // Bus behind a bridge
+#define PLT_PCI_CAPPTR  0x34
+
+#define PLT_PCI_CMD_IO     (1 << 0)
+#define PLT_PCI_CMD_MEM    (1 << 1)
+#define PLT_PCI_CMD_MASTER (1 << 2)
+#define PLT_PCI_CMD_NOINTX (1 << 10)
+
+#define PLT_PCI_STATUS_CAPS (1 << 4)
+
+#define PLT_PCI_HDR_TYPE   0x7F
+#define PLT_PCI_HDR_MF     0x80
+#define PLT_PCI_HDR_BRIDGE 1
+
+#define PLT_PCI_BAR_IO   (1 << 0)
+#define PLT_PCI_BAR_TYPE (3 << 1)
+#define PLT_PCI_BAR_64   (2 << 1)
+
+#define PLT_PCI_MAX_BARS 6
+
+// Capabilities
+#define PLT_PCI_CAP_MSI    0x05
+#define PLT_PCI_CAP_VENDOR 0x09
+#define PLT_PCI_CAP_MSIX   0x11
+
+// MSI capability
+#define PLT_PCI_MSI_CTRL    2
+#define PLT_PCI_MSI_ADDR_LO 4
+#define PLT_PCI_MSI_ADDR_HI 8     // Only if it's 64 bit
+#define PLT_PCI_MSI_DATA32  8
+#define PLT_PCI_MSI_DATA64  12
+#define PLT_PCI_MSI_ENABLE  (1 << 0)
+#define PLT_PCI_MSI_MME     (7 << 4)
+#define PLT_PCI_MSI_64      (1 << 7)
+
+// MSI-X capability
+#define PLT_PCI_MSIX_CTRL    2
+#define PLT_PCI_MSIX_TABLE   4
+#define PLT_PCI_MSIX_SIZE    0x7FF
+#define PLT_PCI_MSIX_MASKALL (1 << 14)
+#define PLT_PCI_MSIX_ENABLE  (1 << 15)
+#define PLT_PCI_MSIX_BIR     7
+
+// MSI-X table entry, in dwords
+#define PLT_PCI_MSIX_ADDR_LO 0
+#define PLT_PCI_MSIX_ADDR_HI 1
+#define PLT_PCI_MSIX_DATA    2
+#define PLT_PCI_MSIX_VECCTL  3
+#define PLT_PCI_MSIX_ENT_SZ  4
+
+#define PLT_PCI_MSIX_MASKED (1 << 0)
+
+// PCI function
+typedef struct _pltpcidev
+{
+    uint16_t seg;                        // Segment it's on
+    uint8_t bus;                         // Bus it's on
+    uint8_t dev;                         // Device number
+    uint8_t func;                        // Function number
+    uint16_t vendor;                     // Vendor ID
+    uint16_t device;                     // Device ID
+    uint8_t classCode;                   // Class code
+    uint8_t subclass;                    // Subclass
+    uint8_t progIf;                      // Programming interface
+    volatile uint8_t* cfg;               // Mapped config space, NULL if it's reached by ports
+    void* bars[PLT_PCI_MAX_BARS];        // BARs that have been mapped
+    volatile uint32_t* msixTable;        // MSI-X table, NULL until it's enabled
+    int numMsix;                         // Entries in MSI-X table
+    void* drvData;                       // Driver's data
+    NkLink_t link;
+} PltPciDev_t;
+
+// Driver, matched on vendor and device ID if vendor is set, and on class codes otherwise
+typedef struct _pltpcidrv
+{
+    const char* name;                 // Name of driver
+    uint16_t vendor;                  // Vendor ID
+    uint16_t device;                  // Device ID
+    uint8_t classCode;                // Class code
+    uint8_t subclass;                 // Subclass
+    uint8_t progIf;                   // Programming interface
+    bool (*probe) (PltPciDev_t*);     // Takes a function, returns false if it can't
+} PltPciDriver_t;
+
+// Reads config space of dev
+uint32_t PltPciRead32 (PltPciDev_t* dev, int reg);
+uint16_t PltPciRead16 (PltPciDev_t* dev, int reg);
+uint8_t PltPciRead8 (PltPciDev_t* dev, int reg);
+
+// Writes config space of dev
+void PltPciWrite32 (PltPciDev_t* dev, int reg, uint32_t val);
+void PltPciWrite16 (PltPciDev_t* dev, int reg, uint16_t val);
+
+// Finds capability id of dev, returning its offset, or 0 if it doesn't have it
+int PltPciFindCap (PltPciDev_t* dev, int id);
+
+// Finds the next capability id of dev after the one at prev, for capabilities that can be there
+// more than once
+int PltPciFindNextCap (PltPciDev_t* dev, int id, int prev);
+
+// Sets bits in the command register of dev
+void PltPciEnable (PltPciDev_t* dev, uint16_t bits);
+
+// Maps memory BAR bar of dev, returning NULL if it isn't a memory BAR
+// size gets the size of the BAR if it isn't NULL. BARs are only mapped once
+void* PltPciMapBar (PltPciDev_t* dev, int bar, size_t* size);
+
+// Enables MSI-X on dev with every entry masked, and turns INTx off
+// Returns the number of entries, or 0 if dev doesn't do MSI-X
+int PltPciEnableMsix (PltPciDev_t* dev);
+
+// Points MSI-X entry idx of dev at msg and unmasks it
+void PltPciSetMsix (PltPciDev_t* dev, int idx, PltMsiMsg_t* msg);
+
+// Enables MSI on dev with one message, msg, and turns INTx off
+// Returns false if dev doesn't do MSI, or msg is above 4 GiB and dev can only take 32 bit addresses
+bool PltPciEnableMsi (PltPciDev_t* dev, PltMsiMsg_t* msg);
+
+// Masks or unmasks MSI-X entry idx of dev
+void PltPciMaskMsix (PltPciDev_t* dev, int idx, bool mask);
+
+// Finds PCI functions and gives them to drivers
+void PltInitPci();
+
+#endif
@@ -0,0 +1,78 @@
+/*
+    rbtree.h - contains red-black tree implementation
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _NK_RBTREE_H
+#define _NK_RBTREE_H
+
+#include <nexke/types.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Nodes are embedded in whatever is kept in the tree, and LINK_CONTAINER gets back to it
+// The tree doesn't know how nodes are ordered. Callers walk down from the root themselves to find
+// where a node goes, link it there, and then let the tree rebalance
+// The leftmost node is cached, so trees used as queues get their first node right away
+
+// Tree node
+typedef struct _nkrbnode
+{
+    struct _nkrbnode* parent;
+    struct _nkrbnode* left;
+    struct _nkrbnode* right;
+    bool red;
+} NkRbNode_t;
+
+// Tree
+typedef struct _nkrbtree
+{
+    NkRbNode_t* root;     // Root node
+    NkRbNode_t* first;    // Leftmost node
+} NkRbTree_t;
+
+// Initializes a tree
+static FORCEINLINE void NkRbInit (NkRbTree_t* tree)
+{
+    tree->root = NULL;
+    tree->first = NULL;
+}
+
+// Gets first node of tree
+static FORCEINLINE NkRbNode_t* NkRbFirst (NkRbTree_t* tree)
+{
+    return tree->first;
+}
+
+// Links node in at link, which is a child pointer of parent, or the root if parent is NULL
+static FORCEINLINE void NkRbLink (NkRbNode_t* node, NkRbNode_t* parent, NkRbNode_t** link)
+{
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    *link = node;
+}
+
+// Rebalances tree after node got linked in
+// leftmost is whether it only went left on the way down, making it the new first node
+void NkRbInsert (NkRbTree_t* tree, NkRbNode_t* node, bool leftmost);
+
+// Removes node from tree
+void NkRbRemove (NkRbTree_t* tree, NkRbNode_t* node);
+
+// Gets node after node, or NULL if it's the last one
+NkRbNode_t* NkRbNext (NkRbNode_t* node);
+
+#endif
@@ -0,0 +1,128 @@
+/*
+    rcu.h - contains read-copy-update interface
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#ifndef _RCU_H
+#define _RCU_H
+
+#include <nexke/list.h>
+#include <nexke/lock.h>
+#include <nexke/task.h>
+
+// RCU lets readers look at shared data without taking locks or doing atomic operations
+// A read section only disables preemption, so it must not block. Writers still serialize among
+// themselves with a lock, publish changes with NkRcuAssign, and hand anything readers might still
+// see to NkRcuCall, which calls back once every CPU has been through a quiescent state
+// (a trip through the scheduler or the idle loop), after which no reader can still hold it
+
+// Deferred callback
+// Embedded in the object to free
+typedef struct _rcuhead
+{
+    NkLink_t link;                      // Link in callback list
+    void (*func) (struct _rcuhead*);    // Function to call
+    atomic_t gp;                        // Grace period that has to end first
+} NkRcuHead_t;
+
+typedef void (*NkRcuCallback) (NkRcuHead_t*);
+
+// Starts a read section
+static FORCEINLINE void NkRcuReadLock()
+{
+    TskDisablePreempt();
+}
+
+// Ends a read section
+static FORCEINLINE void NkRcuReadUnlock()
+{
+    TskEnablePreempt();
+}
+
+// Reads an RCU protected pointer
+#define NkRcuDeref(ptr) __atomic_load_n (&(ptr), __ATOMIC_CONSUME)
+
+// Publishes an RCU protected pointer. Whatever val points to must be set up first
+#define NkRcuAssign(ptr, val) __atomic_store_n (&(ptr), (val), __ATOMIC_RELEASE)
+
+// RCU lists
+// Writers must still hold a lock. Removal leaves the removed link's next pointer alone, so readers
+// that are on it can go on, and the link can't be reused until a grace period has passed
+
+// Adds item to front of list
+static FORCEINLINE void NkRcuListAddFront (NkList_t* list, NkLink_t* item)
+{
+    NkLink_t* oldHead = list->next;
+    item->next = oldHead;
+    item->prev = list;
+    oldHead->prev = item;
+    NkRcuAssign (list->next, item);
+}
+
+// Adds item to back of list
+static FORCEINLINE void NkRcuListAddBack (NkList_t* list, NkLink_t* item)
+{
+    NkLink_t* oldTail = list->prev;
+    item->next = list;
+    item->prev = oldTail;
+    list->prev = item;
+    NkRcuAssign (oldTail->next, item);
+}
+
+// Removes item from list
+static FORCEINLINE void NkRcuListRemove (NkList_t* list, NkLink_t* item)
+{
+    NkListRemove (list, item);
+}
+
+// Gets first item in list
+static FORCEINLINE NkLink_t* NkRcuListFront (NkList_t* list)
+{
+    NkLink_t* next = NkRcuDeref (list->next);
+    return (next == list) ? NULL : next;
+}
+
+// Iterates to next item in list
+static FORCEINLINE NkLink_t* NkRcuListIterate (NkList_t* list, NkLink_t* link)
+{
+    NkLink_t* next = NkRcuDeref (link->next);
+    return (next == list) ? NULL : next;
+}
+
+// Calls func on head after a grace period
+// Safe to call from any context, including read sections
+void NkRcuCall (NkRcuHead_t* head, NkRcuCallback func);
+
+// Waits for a grace period to pass
+void NkRcuSynchronize();
+
+// Notes that this CPU is in a quiescent state
+// Called by the scheduler
+void NkRcuQuiescent();
+
+// Checks if the running grace period is waiting on this CPU
+bool NkRcuNeedsQuiescent();
+
+// Checks if this CPU has to keep ticking for RCU
+bool NkRcuNeedsTick();
+
+// Checks if callbacks need to be processed
+// Called by the time slice handler
+void NkRcuTick();
+
+// Initializes RCU
+void NkInitRcu();
+
+#endif
@@ -21,13 +21,35 @@
 #include <nexke/task.h>
 #include <stdbool.h>
 
+// Sleeping lock statistics
+// When built with NEXKE_SYNCH_STATS, mutexes, semaphores and conditions are sorted into classes
+// by the site that first acquired or waited on them, so all objects used by the same code share
+// one. Classes count how often threads blocked on them and for how long, how long mutexes were
+// held, and which sites did the most waiting. Times are in CPU cycles, like lock statistics
+typedef struct _tsksynchclass TskSynchClass_t;
+
+// Dumps sleeping lock statistics
+void TskDumpSynchStats();
+
 // Semaphores
+// The count and a waiters bit share one word, so acquiring with the count above zero, and
+// releasing with nobody asleep, is a single compare and swap. Only when the count runs out do
+// threads go to the queue, and the waiters bit they set sends releases there to wake them
 typedef struct _semaphore
 {
     TskWaitQueue_t queue;    // Semaphore wait queue
-    int count;               // Count of semaphore
+    atomic_t state;          // Count of semaphore shifted left by one, and waiters bit
+#ifdef NEXKE_SYNCH_STATS
+    TskSynchClass_t* synchClass;    // Class of semaphore
+#endif
 } TskSemaphore_t;
 
+#define TSK_SEM_WAITERS (1 << 0)    // Threads are sleeping on the queue
+#define TSK_SEM_ONE     (1 << 1)    // One count in state
+
+// Gets count of a semaphore state
+#define TSK_SEM_COUNT(state) (((state) & ~(atomic_t) TSK_SEM_WAITERS) / TSK_SEM_ONE)
+
 // Initializes a semaphore
 void TskInitSemaphore (TskSemaphore_t* sem, int count);
 
@@ -44,12 +66,27 @@ errno_t TskTryAcquireSemaphore (TskSemaphore_t* sem);
 errno_t TskCloseSemaphore (TskSemaphore_t* sem);
 
 // Mutex
+// Mutexes are adaptive. The owner field holds the owning thread, or 0 if the mutex is free, so
+// taking and releasing a free mutex is a single compare and swap. Contended acquires spin for as
+// long as the owner is running, as it will likely let go before we could block, and otherwise
+// sleep on the queue. The low bit of owner tells the owner to wake someone on release
+// Sleepers lend their priority to the owner, and on down the chain of mutexes it is blocked on,
+// so a low priority owner can't hold up a high priority waiter behind medium priority threads
 typedef struct _mutex
 {
     TskWaitQueue_t queue;    // Queue of threads waiting on mutex
-    bool state;              // State of mutex
+    atomic_t owner;          // Owning thread and waiters bit
+    NkList_t piWaiters;      // Threads blocked on mutex
+    NkLink_t piLink;         // Link in piMutexes of piOwner
+    NkThread_t* piOwner;     // Owner that waiters lend priority to, or NULL
+#ifdef NEXKE_SYNCH_STATS
+    TskSynchClass_t* synchClass;    // Class of mutex
+    uint64_t holdStart;             // When owner took it
+#endif
 } TskMutex_t;
 
+#define TSK_MUTEX_WAITERS (1 << 0)    // Threads are sleeping on the queue
+
 // Initializes a mutex
 void TskInitMutex (TskMutex_t* mtx);
 
@@ -65,18 +102,57 @@ errno_t TskTryAcquireMutex (TskMutex_t* mtx);
 // Closes a mutex
 errno_t TskCloseMutex (TskMutex_t* mtx);
 
+// Reader-writer lock
+// Sleeping counterpart of rwlock_t, for read-mostly data that is held across blocking
+typedef struct _rwlock
+{
+    TskWaitQueue_t queue;    // Queue of readers and writers waiting on lock
+    int readers;             // Number of readers holding lock
+    int writersWaiting;      // Number of writers waiting on lock
+    bool writer;             // Whether a writer holds lock
+    int flags;               // Lock flags
+} TskRwLock_t;
+
+#define TSK_RWLOCK_PREFER_WRITER (1 << 0)    // New readers wait while a writer is waiting
+
+// Initializes a reader-writer lock
+void TskInitRwLock (TskRwLock_t* rw, int flags);
+
+// Acquires a reader-writer lock for reading
+errno_t TskAcquireRead (TskRwLock_t* rw);
+
+// Acquires a reader-writer lock for writing
+errno_t TskAcquireWrite (TskRwLock_t* rw);
+
+// Releases a reader-writer lock held for reading
+errno_t TskReleaseRead (TskRwLock_t* rw);
+
+// Releases a reader-writer lock held for writing
+errno_t TskReleaseWrite (TskRwLock_t* rw);
+
+// Closes a reader-writer lock
+errno_t TskCloseRwLock (TskRwLock_t* rw);
+
 // Condition
+// Waiting with a mutex releases it while blocked, and takes it back before returning. Signals
+// and broadcasts made while holding that mutex move waiters straight onto the mutex's queue
+// instead of waking them, as they would only block on it again until the signaller lets go
+// Once set, state stays set until unset, and waits don't block while it is
 typedef struct _cond
 {
     TskWaitQueue_t queue;    // Queue of threads waiting on condtion
     bool state;              // State of condition
+    TskMutex_t* mtx;         // Mutex waiters released, or NULL if they didn't give one
+#ifdef NEXKE_SYNCH_STATS
+    TskSynchClass_t* synchClass;    // Class of condition
+#endif
 } TskCondition_t;
 
 // Initializes a condition
 void TskInitCondition (TskCondition_t* cond);
 
 // Waits on a condition, taking a mutex to unlock before blocking
-// to prevent lost-wakeup
+// to prevent lost-wakeup. The mutex is held again on return
 errno_t TskWaitCondition (TskCondition_t* cond, TskMutex_t* mtx);
 
 // Signals a thread to wake up on condition
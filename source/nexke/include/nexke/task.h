@@ -24,6 +24,7 @@
 #include <nexke/types.h>
 #include <nexke/wait.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 // Thread entry type
 typedef void (*NkThreadEntry) (void*);
@@ -39,6 +40,7 @@ typedef struct _waitobj
     ktime_t timeout;       // Timeout of this object
     void* obj;             // Pointer to object being waited on
     int result;            // Result of wait
+    bool exclusive;        // Whether waiter is woken alone on a wait queue
     NkLink_t ownerLink;    // Link on list of owned wait objects
 } TskWaitObj_t;
 
@@ -50,62 +52,121 @@ typedef struct _waitobj
 #define TSK_WAITOBJ_CONDITION 3
 #define TSK_WAITOBJ_MUTEX     4
 #define TSK_WAITOBJ_QUEUE     5
+#define TSK_WAITOBJ_RWLOCK    6
+#define TSK_WAITOBJ_WORK      7
+#define TSK_WAITOBJ_ADDRESS   8
 
 #define TSK_WAITOBJ_IN_PROG 0
 #define TSK_WAITOBJ_SUCCESS 1
 #define TSK_WAITOBJ_TIMEOUT 2
 
 // Thread structure
+#ifdef NEXKE_SCHED_STATS
+// Scheduler statistics
+// Run delays are how long a thread sat on a ready queue before it got to run. They're kept in a
+// log2 histogram, where bucket n counts delays of 2^n ns up to 2^(n+1) ns
+#define TSK_DELAY_BUCKETS 32
+
+typedef struct _tskstats
+{
+    uint64_t delays[TSK_DELAY_BUCKETS];    // Run delay histogram
+    uint64_t totalDelay;                   // Sum of all run delays
+    uint64_t maxDelay;                     // Longest run delay
+    uint64_t volSwitches;                  // Times the CPU was given up by blocking
+    uint64_t involSwitches;                // Times the CPU was taken away
+} TskSchedStats_t;
+#endif
+
 typedef struct _thread
 {
-    NkLink_t link;      // Link in ready queue / wait lists
-                        // At head so we don't have to use LINK_CONTAINER
-    spinlock_t lock;    // Lock for this thread
+    // Scheduling state, touched on every switch and wakeup
+    // Thread objects start on a cache line, so this only takes up the first two of them
+    NkLink_t link;                // Link in ready queue / wait lists
+                                  // At head so we don't have to use LINK_CONTAINER
+    spinlock_t lock;              // Lock for this thread
+    int priority;                 // Priority of this thread
+    int policy;                   // Scheduling policy of thread
+    int state;                    // State of this thread
+    int flags;                    // Flags for this thread
+    int quantaLeft;               // Quantum ticks left
+    int quantum;                  // Quantum assigned to thread
+    volatile int onCpu;           // Wheter a CPU is still running on this thread's stack
+    volatile int waitAsserted;    // Wheter a wait is asserted on this thread
+    bool preempted;               // Wheter this thread has been preempted
+    bool timeoutPending;          // Wheter a timeout is pending
+    CpuContext_t* context;        // Context of this thread
+    NkCcb_t* ccb;                 // CPU this thread is queued on or last ran on
+    MmSpace_t* space;             // Address space of thread, NULL for kernel threads
+    ktime_t lastSchedule;         // Last time thread was scheduled
+    ktime_t runTime;              // Time thread has run for
+    CpuThread_t cpuThread;        // More CPU info
+    NkTimeEvent_t* timeout;       // Wait queue timeout
+    // Placement info
+    long affinity;       // Mask of CPUs this thread may run on
+    int prefCpu;         // CPU this thread would rather run on, -1 if none
+    int memNode;         // Node memory is allocated from, MM_NODE_LOCAL for CPU's own
+    ktime_t lastStop;    // Last time thread stopped running
+    int refCount;        // Things referencing this thread
+    // Fair share info
+    NkRbNode_t fairNode;    // Node in fair share timeline of CPU
+    ktime_t vruntime;       // Run time scaled by weight
+    int nice;               // Nice value of thread
+    int weight;             // Share of CPU nice value gives
+    // Deadline info
+    NkRbNode_t dlNode;        // Node in deadline tree of CPU
+    ktime_t dlRuntime;        // Runtime it gets each period
+    ktime_t dlDeadline;       // Time from start of period runtime is due by
+    ktime_t dlPeriod;         // Length of period
+    ktime_t dlAbsDeadline;    // Deadline of current period
+    int64_t dlBudget;         // Runtime left in current period
+    uint64_t dlBw;            // Share of a CPU it reserved
+    // Wait info
+    TskWaitObj_t wait;     // Object we are waiting on
+    TskWaitObj_t timer;    // Timer we are waiting on
+    // Priority inheritance info, protected by the PI lock
+    int basePrio;             // Priority set on thread, without any lent to it
+    NkList_t piMutexes;       // Mutexes we own that have waiters lending us their priority
+    NkLink_t piLink;          // Link in waiters of piWait
+    struct _mutex* piWait;    // Mutex we are blocked on
+    // Everything from here on is only looked at when the thread is made, exits or gets joined
     // Thread identity info
     id_t tid;            // Thread ID
     const char* name;    // Name of thread
-    int priority;        // Priority of this thread
-    int policy;          // Scheduling policy of thread
-    int state;           // State of this thread
-    int flags;           // Flags for this thread
-    int refCount;        // Things referencing this thread
-    // Quantum info
-    int quantaLeft;    // Quantum ticks left
-    int quantum;       // Quantum assigned to thread
-    // CPU specific thread info
-    CpuContext_t* context;    // Context of this thread
-    CpuThread_t cpuThread;    // More CPU info
-    // Time info
-    ktime_t lastSchedule;    // Last time thread was scheduled
-    ktime_t runTime;         // Time thread has run for
     // Entry point
     NkThreadEntry entry;
     void* arg;
-    int exitCode;    // Code thread exited with
-    // Wait info
-    TskWaitObj_t wait;           // Object we are waiting on
-    TskWaitObj_t timer;          // Timer we are waiting on
+    int exitCode;                // Code thread exited with
     NkList_t ownedWaits;         // Wait objects we own
                                  // This list is only over manipulated by this thread
                                  // so we can access it locklessly
     TskWaitQueue_t joinQueue;    // Threads joined to this thread
-    // Thread flags
-    bool preempted;               // Wheter this thread has been preempted
-    bool timeoutPending;          // Wheter a timeout is pending
-    volatile int waitAsserted;    // Wheter a wait is asserted on this thread
-    NkTimeEvent_t* timeout;       // Wait queue timeout
+    // Stack info
+    CpuContext_t* baseContext;    // Context thread started with, at the top of its stack
+    int stackClass;               // Class of kernel stack
+    size_t stackPeak;             // Most of kernel stack used, found when thread terminates
+#ifdef NEXKE_SCHED_STATS
+    ktime_t readyTime;            // When this thread was last readied
+    TskSchedStats_t stats;        // Scheduler statistics of this thread
+#endif
 } NkThread_t;
 
+// Keep the scheduling state where the layout above says it is
+_Static_assert (offsetof (NkThread_t, link) == 0, "ready queues find threads from their link");
+_Static_assert (offsetof (NkThread_t, affinity) <= 2 * NEXKE_CACHELINE,
+                "scheduling state of a thread has to fit in two cache lines");
+
 #define TskLockThread(thread)   NkSpinLock (&(thread)->lock)
 #define TskUnlockThread(thread) NkSpinUnlock (&(thread)->lock)
 
-#define TskLockRq(ccb)   NkSpinLock (&(ccb)->rqLock)
-#define TskUnlockRq(ccb) NkSpinUnlock (&(ccb)->rqLock)
+#define TskLockRq(ccb)   NkMcsLock (&(ccb)->rqLock)
+#define TskUnlockRq(ccb) NkMcsUnlock (&(ccb)->rqLock)
 
 // Thread flags
-#define TSK_THREAD_IDLE       (1 << 0)
-#define TSK_THREAD_FIXED_PRIO (1 << 1)
-#define TSK_THREAD_FIFO       (1 << 2)
+#define TSK_THREAD_IDLE        (1 << 0)
+#define TSK_THREAD_FIXED_PRIO  (1 << 1)
+#define TSK_THREAD_FIFO        (1 << 2)
+#define TSK_THREAD_WORKER      (1 << 3)    // Worker of a managed work queue
+#define TSK_THREAD_SMALL_STACK (1 << 4)    // Thread doesn't go deep, and can use a small stack
 
 // Helpers for wait assertion
 static FORCEINLINE void TskThreadSetAssert (NkThread_t* thread, int val)
@@ -121,6 +182,20 @@ static FORCEINLINE void TskThreadCheckAssert (NkThread_t* thread)
     } while (val);
 }
 
+// Helpers for tracking if a thread is on a CPU
+static FORCEINLINE void TskThreadSetOnCpu (NkThread_t* thread, int val)
+{
+    __atomic_store_n (&(thread)->onCpu, (val), __ATOMIC_RELEASE);
+}
+static FORCEINLINE void TskThreadWaitOffCpu (NkThread_t* thread)
+{
+    int val = 0;
+    do
+    {
+        __atomic_load (&(thread)->onCpu, &val, __ATOMIC_ACQUIRE);
+    } while (val);
+}
+
 // Thread states
 #define TSK_THREAD_READY       0
 #define TSK_THREAD_RUNNING     1
@@ -129,9 +204,11 @@ static FORCEINLINE void TskThreadCheckAssert (NkThread_t* thread)
 #define TSK_THREAD_TERMINATING 4
 
 // Scheduling policies
-#define TSK_POLICY_NORMAL 0
-#define TSK_POLICY_FIFO   1
-#define TSK_POLICY_RR     2
+#define TSK_POLICY_NORMAL   0
+#define TSK_POLICY_FIFO     1
+#define TSK_POLICY_RR       2
+#define TSK_POLICY_FAIR     3
+#define TSK_POLICY_DEADLINE 4
 
 // Scheduling priority bases
 #define TSK_PRIO_HIGH   0
@@ -139,6 +216,18 @@ static FORCEINLINE void TskThreadCheckAssert (NkThread_t* thread)
 #define TSK_PRIO_USER   30
 #define TSK_PRIO_WORKER 63
 
+// Priorities at or below this are batch work, whose timeouts can go off later
+#define TSK_PRIO_BATCH 48
+
+// Priority of fair share threads
+// They all share this level, and get the CPU in proportion to their weight
+#define TSK_PRIO_FAIR 40
+
+// Nice values of fair share threads, and the weight of nice 0
+#define TSK_NICE_MIN      -20
+#define TSK_NICE_MAX      19
+#define TSK_FAIR_WEIGHT0  1024
+
 // Maybe this should be bigger
 #define NEXKE_MAX_THREAD 8192
 
@@ -148,6 +237,12 @@ void TskInitSys();
 // Initializes scheduler
 void TskInitSched();
 
+// Sets up scheduler state of a CPU
+bool TskInitSchedCpu (NkCcb_t* ccb);
+
+// Starts scheduling on the current CPU, which must not be the BSP
+void __attribute__ ((noreturn)) TskStartCpu();
+
 // Creates a new thread object
 NkThread_t* TskCreateThread (NkThreadEntry entry,
                              void* arg,
@@ -175,6 +270,27 @@ void TskReadyThread (NkThread_t* thread);
 // Runs the main scheduler
 void TskSchedule();
 
+// Finishes a context switch, called by the thread switched to
+void TskFinishSwitch();
+
+// Handles a reschedule IPI
+void TskReschedIpi();
+
+// Sets up idle governor
+void TskInitIdle();
+
+// Idles the current CPU until something happens, in the deepest state that pays off
+void TskIdle();
+
+// Wakes ccb's idle thread without an interrupt
+// Returns false if it isn't in a state that can be woken like that, in which case an IPI is needed
+bool TskIdleKick (NkCcb_t* ccb);
+
+// Makes sure the time slice tick of ccb is running
+// CPUs stop ticking when they have nothing else to run, this is for anyone who needs them to
+// come through the scheduler anyway
+void TskWantTick (NkCcb_t* ccb);
+
 // Asserts and sets up a wait
 // IPL must be raised and object must be locked
 TskWaitObj_t* TskAssertWait (ktime_t timeout, void* obj, int type);
@@ -192,6 +308,10 @@ bool TskClearWait (TskWaitObj_t* waitObj, int result);
 // Wakes up a wait object
 void TskWakeObj (TskWaitObj_t* obj);
 
+// Wakes up every wait object on a list, with one preemption check per CPU
+// The list can't be used afterwards
+void TskWakeObjList (NkList_t* objs);
+
 // IPL safe functions
 
 // Enables preemption (only used by TskEnablePreempt)
@@ -211,12 +331,16 @@ static FORCEINLINE void TskEnablePreempt()
         TskEnablePreemptUnsafe();
 }
 
+// Gets the most of its kernel stack thread has used
+// Caller must hold a reference to thread
+size_t TskGetStackPeak (NkThread_t* thread);
+
 // Refs a thread
 static inline void TskRefThread (NkThread_t* thread)
 {
     NkSpinLock (&thread->lock);
     ++thread->refCount;
-    NkSpinUnlock (&thread->refCount);
+    NkSpinUnlock (&thread->lock);
 }
 
 // Gets current thread
@@ -245,13 +369,65 @@ errno_t TskJoinThread (NkThread_t* thread);
 errno_t TskJoinThreadTimeout (NkThread_t* thread, ktime_t timeout);
 
 // Sets the priority of a thread
+// Mutex waiters may lend it a better one until it releases their mutexes
+// Fair share threads stay at TSK_PRIO_FAIR, their nice value sets their share instead, and
+// deadline threads are scheduled by deadline
 void TskSetThreadPrio (NkThread_t* thread, int newPrio);
 
+// Changes the priority a thread runs at, leaving its base priority alone
+void TskChangeThreadPrio (NkThread_t* thread, int newPrio);
+
+// Makes a thread that hasn't been started a deadline thread
+// It gets runtime ns of CPU time within deadline ns of the start of every period ns, ahead of
+// every other thread. Threads that overrun that get held back until their next period
+// Returns EBUSY if that would reserve more of the CPUs than deadline threads may have
+errno_t TskSetThreadDeadline (NkThread_t* thread,
+                              ktime_t runtime,
+                              ktime_t deadline,
+                              ktime_t period);
+
+// Gives back the CPU time a deadline thread reserved, called when it terminates
+void TskReleaseDeadline (NkThread_t* thread);
+
+// Sets the nice value of a fair share thread
+// Each step is worth about 10% of CPU time against a thread of the next value
+bool TskSetThreadNice (NkThread_t* thread, int nice);
+
+// Dumps scheduler statistics of every priority
+void TskDumpSchedStats();
+
+// Dumps scheduler statistics of a thread
+void TskDumpThreadStats (NkThread_t* thread);
+
+// Thread affinity
+// The mask is hard, a thread never runs on a CPU outside of it. The preferred CPU is a hint,
+// it's picked when it's free, and load balancing leaves the thread alone while it's there
+#define TSK_AFFINITY_ALL         (-1L)
+#define TSK_AFFINITY_CPU(cpuNum) (1L << (cpuNum))
+
+// Sets the CPUs a thread may run on, and the one it prefers, or -1 for none
+// If it's running or queued elsewhere, it gets moved
+bool TskSetThreadAffinity (NkThread_t* thread, long mask, int prefCpu);
+
+// Gets the CPUs a thread may run on, and the one it prefers if prefCpu isn't NULL
+long TskGetThreadAffinity (NkThread_t* thread, int* prefCpu);
+
+// Pins a thread to one CPU
+static FORCEINLINE bool TskPinThread (NkThread_t* thread, int cpuNum)
+{
+    return TskSetThreadAffinity (thread, TSK_AFFINITY_CPU (cpuNum), cpuNum);
+}
+
 // Quantum stuff
 
 // Time slicer operating delta (in ns)
 #define TSK_TIMESLICE_DELTA 10000000
 
+// Timer slack of thread timeouts (in ns)
+// Timeouts may go off this late, so they can share timer interrupts
+#define TSK_SLACK_DEFAULT 50000      // 50 us
+#define TSK_SLACK_BATCH   5000000    // 5 ms
+
 // Default time slice length (in time slicer ticks)
 #define TSK_TIMESLICE_LEN 6    // equals 60 ms
 
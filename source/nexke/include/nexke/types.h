@@ -26,18 +26,23 @@ typedef struct _int NkInterrupt_t;
 typedef struct _hwint NkHwInterrupt_t;
 typedef struct _timeevt NkTimeEvent_t;
 typedef struct _hwclock PltHwClock_t;
+typedef struct _hwcpu PltCpu_t;
 typedef struct _mmspace MmMulSpace_t;
 typedef struct _page MmPage_t;
 typedef struct _memspace MmSpace_t;
 typedef struct _memobject MmObject_t;
 typedef struct _thread NkThread_t;
 typedef struct _work NkWorkItem_t;
+typedef struct _dpc NkDpc_t;
 typedef struct _nkccb NkCcb_t;
 
 typedef int ipl_t;
 typedef int id_t;
 typedef uint64_t ktime_t;
-typedef volatile int spinlock_t;
+typedef volatile uint32_t spinlock_t;    // Ticket lock
+typedef volatile uint32_t mcslock_t;     // Queued lock
+typedef volatile uint32_t rwlock_t;      // Reader-writer spinlock
+typedef volatile uint32_t seqlock_t;     // Sequence lock
 typedef int errno_t;
 
 #define FORCEINLINE inline __attribute__ ((always_inline))
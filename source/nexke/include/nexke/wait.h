@@ -33,10 +33,11 @@ void TskInitWaitQueue (TskWaitQueue_t* queue, int object);
 // Closes a wait queue and broadcasts the closing
 errno_t TskCloseWaitQueue (TskWaitQueue_t* queue, int flags);
 
-// Broadcasts wakeup to all threads on the queue
+// Broadcasts wakeup to all threads on the queue, except exclusive waiters after the first
 errno_t TskBroadcastWaitQueue (TskWaitQueue_t* queue, int flags);
 
 // Wakes one thread on the queue
+// If the first waiter has already timed out, the wakeup goes to the next one
 errno_t TskWakeWaitQueue (TskWaitQueue_t* queue, int flags);
 
 // Waits on the specified wait queue
@@ -55,6 +56,22 @@ ipl_t TskAssertWaitQueue (TskWaitQueue_t* queue);
 // Deasserts a wait
 void TskDeAssertWaitQueue (TskWaitQueue_t* queue, ipl_t ipl);
 
+// Address waits
+// These let any word be blocked on without it carrying a wait queue. The word must only be
+// changed with the NkAtomic functions, so that a change before a wake can't be missed by a
+// waiter about to block
+
+// Waits on addr as long as it contains expected
+// Returns EAGAIN if addr didn't contain expected, or ETIMEDOUT if the timeout expired
+errno_t TskWaitAddress (atomic_t* addr, atomic_t expected, ktime_t timeout);
+
+// Wakes up to count threads waiting on addr
+// Returns the number of threads woken
+int TskWakeAddress (atomic_t* addr, int count);
+
+// Sets up address wait buckets
+void TskInitWaitAddress();
+
 #define TSK_TIMEOUT_NONE 0
 
 // Wait flags
@@ -63,5 +80,7 @@ void TskDeAssertWaitQueue (TskWaitQueue_t* queue, ipl_t ipl);
                 // Use with care
 #define TSK_WAIT_NOT_OWNER \
     (1 << 1)    // Specifies that when wait is over we will not own the object
+#define TSK_WAIT_EXCLUSIVE \
+    (1 << 2)    // Specifies that broadcasts wake only one exclusive waiter at a time
 
 #endif
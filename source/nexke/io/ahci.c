@@ -0,0 +1,772 @@
+/*
+    ahci.c - contains AHCI SATA driver
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/platform/pci.h>
+#include <nexke/task.h>
+#include <stdio.h>
+#include <string.h>
+
+// Each port with a disk is a block device with one queue. Disks that can do NCQ get a tagged
+// command in every slot the HBA and disk both have, up to 32, and the disk picks the order
+// Commands are built in their slot's command table by submit, and commit sets PxSACT and PxCI
+// once for all of them. A command's PRDT points straight at the request's pages, with pages that
+// are physically next to each other sharing an entry
+// Flushes can't be queued, and queued and unqueued commands can't be out together. So a request
+// that can't go out alongside what's out waits on the port, along with everything after it, and
+// goes out when what's in the way finishes
+// If the HBA can coalesce completions, ports only interrupt for errors, and completions come in
+// with the coalescing interrupt once enough finish or a timer runs out. -ahcinoccc turns this off
+// When a port hits an error, everything it had out fails and the port is restarted
+
+// HBA registers
+#define IO_AHCI_CAP       0x00
+#define IO_AHCI_GHC       0x04
+#define IO_AHCI_IS        0x08
+#define IO_AHCI_PI        0x0C
+#define IO_AHCI_VS        0x10
+#define IO_AHCI_CCC_CTL   0x14
+#define IO_AHCI_CCC_PORTS 0x18
+#define IO_AHCI_CAP2      0x24
+#define IO_AHCI_BOHC      0x28
+#define IO_AHCI_PORTS     0x100
+#define IO_AHCI_PORT_SZ   0x80
+
+// CAP
+#define IO_AHCI_CAP_NP(cap)  (((cap) & 0x1F) + 1)
+#define IO_AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+#define IO_AHCI_CAP_CCCS     (1 << 7)
+#define IO_AHCI_CAP_SSS      (1 << 27)
+#define IO_AHCI_CAP_SNCQ     (1 << 30)
+#define IO_AHCI_CAP_S64A     (1U << 31)
+
+#define IO_AHCI_CAP2_BOH (1 << 0)
+
+// GHC
+#define IO_AHCI_GHC_IE (1 << 1)
+#define IO_AHCI_GHC_AE (1U << 31)
+
+// BOHC
+#define IO_AHCI_BOHC_BOS (1 << 0)
+#define IO_AHCI_BOHC_OOS (1 << 1)
+
+// CCC_CTL
+#define IO_AHCI_CCC_EN          (1 << 0)
+#define IO_AHCI_CCC_INT(ctl)    (((ctl) >> 3) & 0x1F)
+#define IO_AHCI_CCC_CC_SHIFT    8
+#define IO_AHCI_CCC_TV_SHIFT    16
+#define IO_AHCI_CCC_COMPLETIONS 8    // Completions before an interrupt
+#define IO_AHCI_CCC_TIMEOUT     1    // Milliseconds before an interrupt
+
+// Port registers
+#define IO_AHCI_PxCLB  0x00
+#define IO_AHCI_PxCLBU 0x04
+#define IO_AHCI_PxFB   0x08
+#define IO_AHCI_PxFBU  0x0C
+#define IO_AHCI_PxIS   0x10
+#define IO_AHCI_PxIE   0x14
+#define IO_AHCI_PxCMD  0x18
+#define IO_AHCI_PxTFD  0x20
+#define IO_AHCI_PxSIG  0x24
+#define IO_AHCI_PxSSTS 0x28
+#define IO_AHCI_PxSERR 0x30
+#define IO_AHCI_PxSACT 0x34
+#define IO_AHCI_PxCI   0x38
+
+// PxIS and PxIE
+#define IO_AHCI_PxIS_DHRS (1 << 0)
+#define IO_AHCI_PxIS_SDBS (1 << 3)
+#define IO_AHCI_PxIS_IFS  (1 << 27)
+#define IO_AHCI_PxIS_HBDS (1 << 28)
+#define IO_AHCI_PxIS_HBFS (1 << 29)
+#define IO_AHCI_PxIS_TFES (1 << 30)
+#define IO_AHCI_PxIS_ERR \
+    (IO_AHCI_PxIS_IFS | IO_AHCI_PxIS_HBDS | IO_AHCI_PxIS_HBFS | IO_AHCI_PxIS_TFES)
+
+// PxCMD
+#define IO_AHCI_PxCMD_ST  (1 << 0)
+#define IO_AHCI_PxCMD_SUD (1 << 1)
+#define IO_AHCI_PxCMD_POD (1 << 2)
+#define IO_AHCI_PxCMD_FRE (1 << 4)
+#define IO_AHCI_PxCMD_FR  (1 << 14)
+#define IO_AHCI_PxCMD_CR  (1 << 15)
+
+// PxTFD
+#define IO_AHCI_TFD_ERR (1 << 0)
+#define IO_AHCI_TFD_DRQ (1 << 3)
+#define IO_AHCI_TFD_BSY (1 << 7)
+
+#define IO_AHCI_SSTS_DET    0xF
+#define IO_AHCI_DET_PRESENT 3
+
+#define IO_AHCI_SIG_ATA 0x00000101
+
+// ATA commands
+#define IO_ATA_READ_DMA_EXT    0x25
+#define IO_ATA_WRITE_DMA_EXT   0x35
+#define IO_ATA_READ_FPDMA      0x60
+#define IO_ATA_WRITE_FPDMA     0x61
+#define IO_ATA_FLUSH_CACHE_EXT 0xEA
+#define IO_ATA_IDENTIFY        0xEC
+
+#define IO_ATA_DEV_LBA (1 << 6)
+
+// IDENTIFY words
+#define IO_ATA_ID_QDEPTH    75
+#define IO_ATA_ID_SATACAP   76
+#define IO_ATA_ID_CMDSET2   83
+#define IO_ATA_ID_LBA48     100
+#define IO_ATA_ID_SECTSZ    106
+#define IO_ATA_ID_LSECTSZ   117
+#define IO_ATA_ID_SATA_NCQ  (1 << 8)
+#define IO_ATA_ID_CMD_LBA48 (1 << 10)
+
+#define IO_AHCI_FIS_H2D   0x27
+#define IO_AHCI_FIS_CMD   0x80    // Command, rather than control
+#define IO_AHCI_H2D_DW    5       // Dwords in a host to device FIS
+#define IO_AHCI_HDR_WRITE (1 << 6)
+
+#define IO_AHCI_MAX_SLOTS 32
+#define IO_AHCI_MAX_PRDS  64          // Keeps command tables 128 byte aligned
+#define IO_AHCI_PRD_MAX   0x400000    // Most bytes in a PRD
+#define IO_AHCI_CL_SZ     1024        // Command list
+#define IO_AHCI_FIS_SZ    256         // Received FISes
+#define IO_AHCI_ID_SZ     512         // IDENTIFY data
+#define IO_AHCI_IPL       16          // Devices interrupt below the timer
+
+#define IO_AHCI_STOP_WAIT  (PLT_NS_IN_SEC / 2)
+#define IO_AHCI_READY_WAIT PLT_NS_IN_SEC
+#define IO_AHCI_BOH_WAIT   (2 * PLT_NS_IN_SEC)
+#define IO_AHCI_DET_WAIT   (PLT_NS_IN_SEC / 100)
+
+// Command header
+typedef struct _ioahcicmdhdr
+{
+    uint16_t flags;      // FIS length and direction
+    uint16_t prdtl;      // Entries in PRDT
+    uint32_t prdbc;      // Bytes transferred
+    uint64_t ctba;       // Command table
+    uint32_t resvd[4];
+} __attribute__ ((packed)) ioAhciCmdHdr_t;
+
+// Physical region descriptor
+typedef struct _ioahciprd
+{
+    uint64_t dba;      // Data address
+    uint32_t resvd;
+    uint32_t dbc;      // Bytes minus one
+} __attribute__ ((packed)) ioAhciPrd_t;
+
+// Command table
+typedef struct _ioahcicmdtab
+{
+    uint8_t cfis[64];                      // Command FIS
+    uint8_t acmd[16];                      // ATAPI command
+    uint8_t resvd[48];
+    ioAhciPrd_t prdt[IO_AHCI_MAX_PRDS];    // PRDT
+} __attribute__ ((packed)) ioAhciCmdTab_t;
+
+typedef struct _ioahcictrl ioAhciCtrl_t;
+
+// Port with a disk
+typedef struct _ioahciport
+{
+    IoBlockDev_t blk;                            // Block device of disk
+    ioAhciCtrl_t* ctrl;                          // HBA port is on
+    int num;                                     // Port number
+    volatile uint8_t* regs;                      // Port registers
+    ioAhciCmdHdr_t* cmdList;                     // Command list
+    ioAhciCmdTab_t* tables;                      // Command tables
+    uint16_t* ident;                             // IDENTIFY data
+    paddr_t identPhys;                           // Physical address of IDENTIFY data
+    bool ncq;                                    // Disk does NCQ
+    uint32_t free;                               // Free slots
+    uint32_t built;                              // Slots with commands commit hasn't issued
+    uint32_t active;                             // Slots with issued commands
+    uint32_t queued;                             // Slots with NCQ commands
+    IoBlockReq_t* reqs[IO_AHCI_MAX_SLOTS];       // Request in each slot
+    NkList_t held;                               // Requests that can't go out yet
+    spinlock_t lock;
+} ioAhciPort_t;
+
+// HBA
+typedef struct _ioahcictrl
+{
+    PltPciDev_t* pci;                             // PCI function
+    int id;                                       // HBA number
+    volatile uint8_t* regs;                       // Registers
+    uint32_t cap;                                 // Capabilities
+    int numSlots;                                 // Command slots in each port
+    uint32_t cccPorts;                            // Ports that coalesce
+    int cccInt;                                   // Bit of IS coalescing uses
+    ioAhciPort_t* ports[IO_AHCI_MAX_SLOTS];       // Ports with disks
+    NkHwInterrupt_t hwInt;                        // Interrupt of HBA
+} ioAhciCtrl_t;
+
+static int ioAhciNumCtrls = 0;
+
+// Register access
+static FORCEINLINE uint32_t ioAhciRead (ioAhciCtrl_t* ctrl, int reg)
+{
+    return *(volatile uint32_t*) (ctrl->regs + reg);
+}
+
+static FORCEINLINE void ioAhciWrite (ioAhciCtrl_t* ctrl, int reg, uint32_t val)
+{
+    *(volatile uint32_t*) (ctrl->regs + reg) = val;
+}
+
+static FORCEINLINE uint32_t ioAhciPortRead (ioAhciPort_t* port, int reg)
+{
+    return *(volatile uint32_t*) (port->regs + reg);
+}
+
+static FORCEINLINE void ioAhciPortWrite (ioAhciPort_t* port, int reg, uint32_t val)
+{
+    *(volatile uint32_t*) (port->regs + reg) = val;
+}
+
+// Locks a port. Ports are reaped from the HBA's interrupt, so IPL has to go up to it
+static FORCEINLINE ipl_t ioAhciLock (ioAhciPort_t* port)
+{
+    ipl_t ipl = PltRaiseIpl (port->ctrl->hwInt.ipl);
+    NkSpinLock (&port->lock);
+    return ipl;
+}
+
+static FORCEINLINE void ioAhciUnlock (ioAhciPort_t* port, ipl_t ipl)
+{
+    NkSpinUnlock (&port->lock);
+    PltLowerIpl (ipl);
+}
+
+// Waits for bits in mask of reg to become val. This spins, since it's used from the interrupt
+static bool ioAhciWait (volatile uint8_t* regs, int reg, uint32_t mask, uint32_t val, ktime_t wait)
+{
+    ktime_t deadline = NK_STATIC_CALL (PltGetTime)() + wait;
+    while ((*(volatile uint32_t*) (regs + reg) & mask) != val)
+    {
+        if (NK_STATIC_CALL (PltGetTime)() > deadline)
+            return false;
+        CpuSpin();
+    }
+    return true;
+}
+
+// Allocates physically contiguous, mapped, zeroed memory the HBA can reach
+static void* ioAhciAlloc (ioAhciCtrl_t* ctrl, size_t sz, paddr_t* phys)
+{
+    size_t numPages = CpuPageAlignUp (sz) / NEXKE_CPU_PAGESZ;
+    paddr_t maxAddr = (ctrl->cap & IO_AHCI_CAP_S64A) ? 0 : 0xFFFFFFFF;
+    MmPage_t* pages = MmAllocPagesAt (numPages, maxAddr, NEXKE_CPU_PAGESZ);
+    if (!pages)
+        return NULL;
+    void* virt = MmMapKvContig (pages, numPages, 0);
+    if (!virt)
+    {
+        MmFreePages (pages, numPages);
+        return NULL;
+    }
+    memset (virt, 0, numPages * NEXKE_CPU_PAGESZ);
+    *phys = MmGetPagePhys (pages);
+    return virt;
+}
+
+// Stops a port's command and FIS engines
+static bool ioAhciStopPort (ioAhciPort_t* port)
+{
+    uint32_t cmd = ioAhciPortRead (port, IO_AHCI_PxCMD);
+    ioAhciPortWrite (port, IO_AHCI_PxCMD, cmd & ~IO_AHCI_PxCMD_ST);
+    if (!ioAhciWait (port->regs, IO_AHCI_PxCMD, IO_AHCI_PxCMD_CR, 0, IO_AHCI_STOP_WAIT))
+        return false;
+    cmd = ioAhciPortRead (port, IO_AHCI_PxCMD);
+    ioAhciPortWrite (port, IO_AHCI_PxCMD, cmd & ~IO_AHCI_PxCMD_FRE);
+    return ioAhciWait (port->regs, IO_AHCI_PxCMD, IO_AHCI_PxCMD_FR, 0, IO_AHCI_STOP_WAIT);
+}
+
+// Starts a port's FIS and command engines once the disk isn't busy
+static bool ioAhciStartPort (ioAhciPort_t* port)
+{
+    ioAhciPortWrite (port, IO_AHCI_PxSERR, 0xFFFFFFFF);
+    ioAhciPortWrite (port, IO_AHCI_PxIS, 0xFFFFFFFF);
+    uint32_t cmd = ioAhciPortRead (port, IO_AHCI_PxCMD);
+    ioAhciPortWrite (port, IO_AHCI_PxCMD, cmd | IO_AHCI_PxCMD_FRE);
+    if (!ioAhciWait (port->regs,
+                     IO_AHCI_PxTFD,
+                     IO_AHCI_TFD_BSY | IO_AHCI_TFD_DRQ,
+                     0,
+                     IO_AHCI_READY_WAIT))
+        return false;
+    cmd = ioAhciPortRead (port, IO_AHCI_PxCMD);
+    ioAhciPortWrite (port, IO_AHCI_PxCMD, cmd | IO_AHCI_PxCMD_ST);
+    return true;
+}
+
+// Builds a command in slot
+static void ioAhciBuild (ioAhciPort_t* port,
+                         int slot,
+                         uint8_t ataCmd,
+                         uint64_t lba,
+                         uint16_t count,
+                         MmPage_t** pages,
+                         size_t offset,
+                         size_t len,
+                         bool write)
+{
+    ioAhciCmdTab_t* tab = &port->tables[slot];
+    uint8_t* fis = tab->cfis;
+    memset (fis, 0, IO_AHCI_H2D_DW * sizeof (uint32_t));
+    fis[0] = IO_AHCI_FIS_H2D;
+    fis[1] = IO_AHCI_FIS_CMD;
+    fis[2] = ataCmd;
+    fis[4] = (uint8_t) lba;
+    fis[5] = (uint8_t) (lba >> 8);
+    fis[6] = (uint8_t) (lba >> 16);
+    fis[8] = (uint8_t) (lba >> 24);
+    fis[9] = (uint8_t) (lba >> 32);
+    fis[10] = (uint8_t) (lba >> 40);
+    if (ataCmd == IO_ATA_READ_FPDMA || ataCmd == IO_ATA_WRITE_FPDMA)
+    {
+        // Count goes in features, and the tag in count
+        fis[3] = (uint8_t) count;
+        fis[11] = (uint8_t) (count >> 8);
+        fis[12] = slot << 3;
+        fis[7] = IO_ATA_DEV_LBA;
+    }
+    else if (ataCmd != IO_ATA_FLUSH_CACHE_EXT && ataCmd != IO_ATA_IDENTIFY)
+    {
+        fis[12] = (uint8_t) count;
+        fis[13] = (uint8_t) (count >> 8);
+        fis[7] = IO_ATA_DEV_LBA;
+    }
+    // Pages that are next to each other share a PRD
+    int numPrds = 0;
+    for (int i = 0; len; ++i)
+    {
+        paddr_t addr = MmGetPagePhys (pages[i]) + offset;
+        size_t segLen = NEXKE_CPU_PAGESZ - offset;
+        if (segLen > len)
+            segLen = len;
+        ioAhciPrd_t* prev = numPrds ? &tab->prdt[numPrds - 1] : NULL;
+        if (prev && (prev->dba + prev->dbc + 1) == addr &&
+            ((prev->dbc + 1) + segLen) <= IO_AHCI_PRD_MAX)
+            prev->dbc += segLen;
+        else
+        {
+            assert (numPrds < IO_AHCI_MAX_PRDS);
+            tab->prdt[numPrds].dba = addr;
+            tab->prdt[numPrds].resvd = 0;
+            tab->prdt[numPrds].dbc = segLen - 1;
+            ++numPrds;
+        }
+        len -= segLen;
+        offset = 0;
+    }
+    ioAhciCmdHdr_t* hdr = &port->cmdList[slot];
+    hdr->flags = IO_AHCI_H2D_DW | (write ? IO_AHCI_HDR_WRITE : 0);
+    hdr->prdtl = numPrds;
+    hdr->prdbc = 0;
+}
+
+// Checks if req can go out alongside what the port has out. Port lock must be held
+static bool ioAhciCanIssue (ioAhciPort_t* port, IoBlockReq_t* req)
+{
+    uint32_t busy = port->active | port->built;
+    if (port->ncq && req->op != IO_BLOCK_FLUSH)
+        return !(busy & ~port->queued);
+    return !(busy & port->queued);
+}
+
+// Builds req in a free slot. Port lock must be held
+static void ioAhciBuildReq (ioAhciPort_t* port, IoBlockReq_t* req)
+{
+    assert (port->free);
+    int slot = __builtin_ctz (port->free);
+    port->free &= ~(1U << slot);
+    if (req->op == IO_BLOCK_FLUSH)
+        ioAhciBuild (port, slot, IO_ATA_FLUSH_CACHE_EXT, 0, 0, NULL, 0, 0, false);
+    else
+    {
+        bool write = req->op == IO_BLOCK_WRITE;
+        uint8_t ataCmd = 0;
+        if (port->ncq)
+        {
+            ataCmd = write ? IO_ATA_WRITE_FPDMA : IO_ATA_READ_FPDMA;
+            port->queued |= (1U << slot);
+        }
+        else
+            ataCmd = write ? IO_ATA_WRITE_DMA_EXT : IO_ATA_READ_DMA_EXT;
+        ioAhciBuild (port,
+                     slot,
+                     ataCmd,
+                     req->sector,
+                     req->count,
+                     req->pages,
+                     req->offset,
+                     req->count * port->blk.sectorSize,
+                     write);
+    }
+    port->reqs[slot] = req;
+    port->built |= (1U << slot);
+}
+
+// Issues built commands. Port lock must be held
+static void ioAhciIssue (ioAhciPort_t* port)
+{
+    if (!port->built)
+        return;
+    CpuIoBarrier();
+    // Tags have to be in PxSACT before their commands are in PxCI
+    if (port->built & port->queued)
+        ioAhciPortWrite (port, IO_AHCI_PxSACT, port->built & port->queued);
+    ioAhciPortWrite (port, IO_AHCI_PxCI, port->built);
+    port->active |= port->built;
+    port->built = 0;
+}
+
+// Reaps finished commands from port. If error is set, the port hit an error, and what's still out
+// fails
+static int ioAhciReap (ioAhciPort_t* port, bool error)
+{
+    IoBlockReq_t* done[IO_AHCI_MAX_SLOTS];
+    int status[IO_AHCI_MAX_SLOTS];
+    int numDone = 0;
+    ipl_t ipl = ioAhciLock (port);
+    // NCQ commands leave PxCI once they're sent and PxSACT once they're done, other commands
+    // leave PxCI once they're done
+    uint32_t out = ioAhciPortRead (port, IO_AHCI_PxCI) | ioAhciPortRead (port, IO_AHCI_PxSACT);
+    uint32_t finished = port->active & ~out;
+    uint32_t failed = error ? (port->active & out) : 0;
+    uint32_t mask = finished | failed;
+    while (mask)
+    {
+        int slot = __builtin_ctz (mask);
+        mask &= ~(1U << slot);
+        done[numDone] = port->reqs[slot];
+        status[numDone] = (failed & (1U << slot)) ? IO_STATUS_ERROR : IO_STATUS_OK;
+        ++numDone;
+        port->reqs[slot] = NULL;
+        port->free |= (1U << slot);
+    }
+    port->active &= ~(finished | failed);
+    port->queued &= ~(finished | failed);
+    if (error)
+    {
+        // The port stops on errors, so it has to be restarted before anything else goes out
+        ioAhciStopPort (port);
+        if (!ioAhciStartPort (port))
+            NkLogWarning ("nexke: AHCI port %s didn't come back after an error\n", port->blk.name);
+    }
+    // Send out whatever was waiting on what just finished
+    NkLink_t* iter = NkListFront (&port->held);
+    while (iter && port->free)
+    {
+        IoBlockReq_t* req = LINK_CONTAINER (iter, IoBlockReq_t, link);
+        if (!ioAhciCanIssue (port, req))
+            break;
+        NkListRemove (&port->held, iter);
+        ioAhciBuildReq (port, req);
+        iter = NkListFront (&port->held);
+    }
+    ioAhciIssue (port);
+    ioAhciUnlock (port, ipl);
+    // Requests are finished unlocked, so their callbacks can submit more
+    for (int i = 0; i < numDone; ++i)
+        IoBlockComplete (done[i], status[i]);
+    return numDone;
+}
+
+// Interrupt of HBA
+static bool ioAhciInterrupt (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    ioAhciCtrl_t* ctrl = LINK_CONTAINER (PltGetMsiHwInt (intObj), ioAhciCtrl_t, hwInt);
+    uint32_t is = ioAhciRead (ctrl, IO_AHCI_IS);
+    uint32_t reap = 0;
+    uint32_t errors = 0;
+    // Ports that coalesce still raise their own bit for errors. PxIS has to be cleared before IS
+    for (uint32_t mask = is; mask; mask &= mask - 1)
+    {
+        int num = __builtin_ctz (mask);
+        ioAhciPort_t* port = ctrl->ports[num];
+        if (!port)
+            continue;
+        uint32_t pis = ioAhciPortRead (port, IO_AHCI_PxIS);
+        ioAhciPortWrite (port, IO_AHCI_PxIS, pis);
+        reap |= (1U << num);
+        if (pis & IO_AHCI_PxIS_ERR)
+            errors |= (1U << num);
+    }
+    if (ctrl->cccPorts && (is & (1U << ctrl->cccInt)))
+        reap |= ctrl->cccPorts;
+    ioAhciWrite (ctrl, IO_AHCI_IS, is);
+    for (; reap; reap &= reap - 1)
+    {
+        int num = __builtin_ctz (reap);
+        ioAhciReap (ctrl->ports[num], errors & (1U << num));
+    }
+    return true;
+}
+
+// Puts a request on a port
+static bool ioAhciSubmit (IoBlockDev_t* blk, int queue, IoBlockReq_t* req)
+{
+    ioAhciPort_t* port = blk->drvData;
+    if (req->op != IO_BLOCK_FLUSH)
+    {
+        assert (req->count && !(req->offset & 1));
+        // HBAs without 64 bit addressing can't reach pages above 4 GiB
+        if (!(port->ctrl->cap & IO_AHCI_CAP_S64A))
+        {
+            size_t numPages = CpuPageAlignUp (req->offset + (req->count * blk->sectorSize)) /
+                              NEXKE_CPU_PAGESZ;
+            for (size_t i = 0; i < numPages; ++i)
+            {
+                if ((MmGetPagePhys (req->pages[i]) + NEXKE_CPU_PAGESZ - 1) > 0xFFFFFFFF)
+                {
+                    IoBlockComplete (req, IO_STATUS_ERROR);
+                    return true;
+                }
+            }
+        }
+    }
+    ipl_t ipl = ioAhciLock (port);
+    if (!port->free)
+    {
+        ioAhciUnlock (port, ipl);
+        return false;
+    }
+    // Held requests go first, so nothing overtakes a flush
+    if (NkListFront (&port->held) || !ioAhciCanIssue (port, req))
+        NkListAddBack (&port->held, &req->link);
+    else
+        ioAhciBuildReq (port, req);
+    ioAhciUnlock (port, ipl);
+    return true;
+}
+
+// Tells the HBA about submitted commands
+static void ioAhciCommit (IoBlockDev_t* blk, int queue)
+{
+    ioAhciPort_t* port = blk->drvData;
+    ipl_t ipl = ioAhciLock (port);
+    ioAhciIssue (port);
+    ioAhciUnlock (port, ipl);
+}
+
+// Polls a port
+static int ioAhciPoll (IoBlockDev_t* blk, int queue)
+{
+    return ioAhciReap (blk->drvData, false);
+}
+
+// Runs IDENTIFY on a port that isn't taking requests yet, polling for it
+static bool ioAhciIdentify (ioAhciPort_t* port)
+{
+    MmPage_t* page = MmFindPagePfn (port->identPhys / NEXKE_CPU_PAGESZ);
+    ioAhciBuild (port,
+                 0,
+                 IO_ATA_IDENTIFY,
+                 0,
+                 0,
+                 &page,
+                 port->identPhys % NEXKE_CPU_PAGESZ,
+                 IO_AHCI_ID_SZ,
+                 false);
+    CpuIoBarrier();
+    ioAhciPortWrite (port, IO_AHCI_PxCI, 1);
+    if (!ioAhciWait (port->regs, IO_AHCI_PxCI, 1, 0, IO_AHCI_READY_WAIT))
+        return false;
+    return !(ioAhciPortRead (port, IO_AHCI_PxTFD) & IO_AHCI_TFD_ERR);
+}
+
+// Sets up a port, returning NULL if it doesn't have a disk we can drive
+static ioAhciPort_t* ioAhciInitPort (ioAhciCtrl_t* ctrl, int num, bool coalesced)
+{
+    ioAhciPort_t* port = kmalloc (sizeof (ioAhciPort_t), MM_TAG_IO);
+    if (!port)
+        return NULL;
+    memset (port, 0, sizeof (ioAhciPort_t));
+    NkListInit (&port->held);
+    port->ctrl = ctrl;
+    port->num = num;
+    port->regs = ctrl->regs + IO_AHCI_PORTS + (num * IO_AHCI_PORT_SZ);
+    if (!ioAhciStopPort (port))
+        goto fail;
+    if (ctrl->cap & IO_AHCI_CAP_SSS)
+    {
+        uint32_t cmd = ioAhciPortRead (port, IO_AHCI_PxCMD);
+        ioAhciPortWrite (port, IO_AHCI_PxCMD, cmd | IO_AHCI_PxCMD_SUD | IO_AHCI_PxCMD_POD);
+    }
+    if (!ioAhciWait (port->regs,
+                     IO_AHCI_PxSSTS,
+                     IO_AHCI_SSTS_DET,
+                     IO_AHCI_DET_PRESENT,
+                     IO_AHCI_DET_WAIT))
+        goto fail;
+    // Command list, received FISes, and IDENTIFY data share a page
+    paddr_t basePhys = 0, tabPhys = 0;
+    uint8_t* base = ioAhciAlloc (ctrl, IO_AHCI_CL_SZ + IO_AHCI_FIS_SZ + IO_AHCI_ID_SZ, &basePhys);
+    port->tables = ioAhciAlloc (ctrl, ctrl->numSlots * sizeof (ioAhciCmdTab_t), &tabPhys);
+    if (!base || !port->tables)
+        goto fail;
+    port->cmdList = (ioAhciCmdHdr_t*) base;
+    port->ident = (uint16_t*) (base + IO_AHCI_CL_SZ + IO_AHCI_FIS_SZ);
+    port->identPhys = basePhys + IO_AHCI_CL_SZ + IO_AHCI_FIS_SZ;
+    for (int i = 0; i < ctrl->numSlots; ++i)
+        port->cmdList[i].ctba = tabPhys + (i * sizeof (ioAhciCmdTab_t));
+    ioAhciPortWrite (port, IO_AHCI_PxCLB, (uint32_t) basePhys);
+    ioAhciPortWrite (port, IO_AHCI_PxCLBU, (uint32_t) ((uint64_t) basePhys >> 32));
+    ioAhciPortWrite (port, IO_AHCI_PxFB, (uint32_t) (basePhys + IO_AHCI_CL_SZ));
+    ioAhciPortWrite (port, IO_AHCI_PxFBU, (uint32_t) ((uint64_t) basePhys >> 32));
+    if (!ioAhciStartPort (port))
+        goto fail;
+    // The signature is good once the disk's first FIS is in
+    if (ioAhciPortRead (port, IO_AHCI_PxSIG) != IO_AHCI_SIG_ATA || !ioAhciIdentify (port))
+        goto stop;
+    uint16_t* id = port->ident;
+    if (!(id[IO_ATA_ID_CMDSET2] & IO_ATA_ID_CMD_LBA48))
+    {
+        NkLogWarning ("nexke: AHCI disk without 48 bit LBAs isn't supported\n");
+        goto stop;
+    }
+    IoBlockDev_t* blk = &port->blk;
+    blk->sectorSize = 512;
+    uint16_t sectSz = id[IO_ATA_ID_SECTSZ];
+    if ((sectSz & 0xC000) == 0x4000 && (sectSz & (1 << 12)))
+    {
+        // Given in words
+        uint32_t words = id[IO_ATA_ID_LSECTSZ] | ((uint32_t) id[IO_ATA_ID_LSECTSZ + 1] << 16);
+        blk->sectorSize = words * 2;
+    }
+    blk->numSectors = 0;
+    for (int i = 3; i >= 0; --i)
+        blk->numSectors = (blk->numSectors << 16) | id[IO_ATA_ID_LBA48 + i];
+    // Tags have to fit in both the HBA's slots and the disk's queue
+    int numSlots = ctrl->numSlots;
+    if ((ctrl->cap & IO_AHCI_CAP_SNCQ) && (id[IO_ATA_ID_SATACAP] & IO_ATA_ID_SATA_NCQ))
+    {
+        port->ncq = true;
+        int depth = (id[IO_ATA_ID_QDEPTH] & 0x1F) + 1;
+        if (depth < numSlots)
+            numSlots = depth;
+    }
+    port->free = (numSlots == 32) ? 0xFFFFFFFF : ((1U << numSlots) - 1);
+    uint32_t ie = IO_AHCI_PxIS_ERR;
+    if (!coalesced)
+        ie |= IO_AHCI_PxIS_DHRS | IO_AHCI_PxIS_SDBS;
+    ioAhciPortWrite (port, IO_AHCI_PxIS, 0xFFFFFFFF);
+    ioAhciPortWrite (port, IO_AHCI_PxIE, ie);
+    sprintf (blk->name, "ahci%dp%d", ctrl->id, num);
+    // A request is cut into pages, and the first one can start part way in
+    blk->maxSectors = ((IO_AHCI_MAX_PRDS - 1) * NEXKE_CPU_PAGESZ) / blk->sectorSize;
+    if (blk->maxSectors > 0xFFFF)
+        blk->maxSectors = 0xFFFF;
+    blk->numQueues = 1;
+    blk->submit = ioAhciSubmit;
+    blk->commit = ioAhciCommit;
+    blk->poll = ioAhciPoll;
+    blk->drvData = port;
+    return port;
+stop:
+    ioAhciStopPort (port);
+fail:
+    return NULL;
+}
+
+// Probes an AHCI controller
+bool IoAhciProbe (PltPciDev_t* dev)
+{
+    ioAhciCtrl_t* ctrl = kmalloc (sizeof (ioAhciCtrl_t), MM_TAG_IO);
+    if (!ctrl)
+        return false;
+    memset (ctrl, 0, sizeof (ioAhciCtrl_t));
+    ctrl->pci = dev;
+    ctrl->regs = PltPciMapBar (dev, 5, NULL);
+    if (!ctrl->regs)
+        goto fail;
+    PltPciEnable (dev, PLT_PCI_CMD_MEM | PLT_PCI_CMD_MASTER);
+    // Take the HBA from firmware if it has it
+    if (ioAhciRead (ctrl, IO_AHCI_CAP2) & IO_AHCI_CAP2_BOH)
+    {
+        ioAhciWrite (ctrl, IO_AHCI_BOHC, ioAhciRead (ctrl, IO_AHCI_BOHC) | IO_AHCI_BOHC_OOS);
+        if (!ioAhciWait (ctrl->regs, IO_AHCI_BOHC, IO_AHCI_BOHC_BOS, 0, IO_AHCI_BOH_WAIT))
+            goto fail;
+    }
+    ioAhciWrite (ctrl, IO_AHCI_GHC, ioAhciRead (ctrl, IO_AHCI_GHC) | IO_AHCI_GHC_AE);
+    ctrl->cap = ioAhciRead (ctrl, IO_AHCI_CAP);
+    ctrl->numSlots = IO_AHCI_CAP_NCS (ctrl->cap);
+    // The HBA has one interrupt, which goes through MSI-X if it has it and MSI otherwise
+    PltMsiMsg_t msg = {0};
+    PltInitMsi (&ctrl->hwInt, ioAhciInterrupt, IO_AHCI_IPL, 0);
+    if (!PltConnectMsi (&ctrl->hwInt, 1, 0, &msg))
+        goto fail;
+    if (PltPciEnableMsix (dev))
+        PltPciSetMsix (dev, 0, &msg);
+    else if (!PltPciEnableMsi (dev, &msg))
+    {
+        NkLogWarning ("nexke: AHCI controller without MSI isn't supported\n");
+        PltDisconnectMsi (&ctrl->hwInt, 1);
+        goto fail;
+    }
+    ctrl->id = ioAhciNumCtrls++;
+    // Coalescing has to be set up while it's off
+    bool coalesce = (ctrl->cap & IO_AHCI_CAP_CCCS) && !NkReadArg ("-ahcinoccc");
+    uint32_t pi = ioAhciRead (ctrl, IO_AHCI_PI);
+    if (coalesce)
+    {
+        uint32_t ccc = ioAhciRead (ctrl, IO_AHCI_CCC_CTL) & ~IO_AHCI_CCC_EN;
+        ioAhciWrite (ctrl, IO_AHCI_CCC_CTL, ccc);
+        ctrl->cccInt = IO_AHCI_CCC_INT (ccc);
+        pi &= ~(1U << ctrl->cccInt);
+    }
+    uint32_t drives = 0;
+    for (uint32_t mask = pi; mask; mask &= mask - 1)
+    {
+        int num = __builtin_ctz (mask);
+        ctrl->ports[num] = ioAhciInitPort (ctrl, num, coalesce);
+        if (ctrl->ports[num])
+            drives |= (1U << num);
+    }
+    if (coalesce && drives)
+    {
+        ioAhciWrite (ctrl, IO_AHCI_CCC_PORTS, drives);
+        ioAhciWrite (ctrl,
+                     IO_AHCI_CCC_CTL,
+                     (IO_AHCI_CCC_TIMEOUT << IO_AHCI_CCC_TV_SHIFT) |
+                         (IO_AHCI_CCC_COMPLETIONS << IO_AHCI_CCC_CC_SHIFT) | IO_AHCI_CCC_EN);
+        ctrl->cccPorts = drives;
+    }
+    ioAhciWrite (ctrl, IO_AHCI_IS, 0xFFFFFFFF);
+    ioAhciWrite (ctrl, IO_AHCI_GHC, ioAhciRead (ctrl, IO_AHCI_GHC) | IO_AHCI_GHC_IE);
+    NkLogInfo ("nexke: AHCI controller %d, version %#x, %d ports, %d slots%s%s\n",
+               ctrl->id,
+               ioAhciRead (ctrl, IO_AHCI_VS),
+               IO_AHCI_CAP_NP (ctrl->cap),
+               ctrl->numSlots,
+               (ctrl->cap & IO_AHCI_CAP_SNCQ) ? ", NCQ" : "",
+               ctrl->cccPorts ? ", coalescing" : "");
+    for (uint32_t mask = drives; mask; mask &= mask - 1)
+        IoRegisterBlockDev (&ctrl->ports[__builtin_ctz (mask)]->blk);
+    return true;
+fail:
+    NkLogWarning ("nexke: unable to set up AHCI controller\n");
+    return false;
+}
@@ -0,0 +1,744 @@
+/*
+    block.c - contains block device layer
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io.h>
+#include <nexke/nexke.h>
+#include <nexke/task.h>
+#include <nexke/wait.h>
+#include <string.h>
+
+// Merging
+// A request is merged onto the end of the one before it if it picks up at the sector and page the
+// other one stops at. The first merge swaps the request before it for a merged request, which has
+// the page arrays of both strung together and keeps the requests it's made of, and later merges
+// add on to it. The device only ever sees the merged request, and finishing it finishes each part
+// Completion
+// Drivers finish requests on the CPU that took the interrupt. The requests are put on that CPU's
+// list, and its DPC hands them to their submitters, then sends out whatever was waiting for room
+// on the hardware queue they came from
+
+// How long to back off when a polled queue is full
+#define IO_BLOCK_FULL_WAIT (PLT_NS_IN_SEC / 10000)
+
+#define IO_BLOCK_MERGED   (1 << 16)    // Request is a merged request
+#define IO_BLOCK_PLUG_MAX 32           // Most requests a plug holds back
+
+// Deadline scheduler
+#define IO_BLOCK_READ_DEADLINE  (PLT_NS_IN_SEC / 2)
+#define IO_BLOCK_WRITE_DEADLINE (5ULL * PLT_NS_IN_SEC)
+#define IO_BLOCK_BATCH          16    // Requests sent in sector order before looking at deadlines
+#define IO_BLOCK_WRITE_STARVE   2     // Read batches that can go before a waiting write batch
+
+typedef struct _ioblockqueue ioBlockQueue_t;
+
+// Merged request
+typedef struct _ioblockmerge
+{
+    IoBlockReq_t req;       // Request the device sees
+    NkList_t parts;         // Requests merged into it
+    MmPage_t* pages[];      // Pages of every part
+} ioBlockMerge_t;
+
+// Software queue of a CPU
+typedef struct _ioblocksw
+{
+    NkList_t reqs;    // Requests waiting to go to the hardware queue
+    spinlock_t lock;
+} ioBlockSw_t;
+
+// Hardware queue
+typedef struct _ioblockhw
+{
+    NkList_t ready;    // Requests to send before asking the scheduler, oldest first
+    int nextCpu;       // Software queue to take from next
+    spinlock_t lock;   // Serializes sending requests to the queue
+} ioBlockHw_t;
+
+// Deadline scheduler state
+typedef struct _ioblockdl
+{
+    NkList_t sorted[2];     // Reads and writes in sector order
+    NkList_t fifo[2];       // Reads and writes in order they came in
+    uint64_t nextSector;    // Sector after the last request sent
+    int dir;                // Direction of current batch
+    int batch;              // Requests left in current batch
+    int starved;            // Read batches that went while writes waited
+    spinlock_t lock;
+} ioBlockDl_t;
+
+// Scheduler
+typedef struct _ioblocksched
+{
+    const char* name;
+    // Takes a request from a submitter
+    void (*insert) (ioBlockQueue_t* q, IoBlockReq_t* req);
+    // Gets the next request to send to hardware queue hwq, or NULL if there isn't one
+    IoBlockReq_t* (*next) (ioBlockQueue_t* q, int hwq);
+} ioBlockSched_t;
+
+// Block layer's data about a device
+typedef struct _ioblockqueue
+{
+    IoBlockDev_t* dev;              // Device
+    const ioBlockSched_t* sched;    // Scheduler of device
+    ioBlockHw_t* hw;                // Hardware queues that interrupt
+    ioBlockSw_t* sw;                // Software queue of each CPU
+    int numCpus;                    // Number of software queues
+    ioBlockDl_t dl;                 // Deadline scheduler state
+    SlabCache_t* mergeCache;        // Cache of merged requests
+    size_t maxPages;                // Most pages in a request
+} ioBlockQueue_t;
+
+// Finished requests of a CPU
+typedef struct _ioblockcpu
+{
+    IoBlockReq_t* head;    // Requests, linked through link.next
+    IoBlockReq_t* tail;
+    NkDpc_t dpc;           // DPC that finishes them
+} ioBlockCpu_t;
+
+static NkList_t ioBlockDevs = {&ioBlockDevs, &ioBlockDevs};
+static spinlock_t ioBlockLock = 0;
+
+static ioBlockCpu_t ioBlockCpus[NEXKE_MAX_CPUS] = {0};
+
+// Gets the hardware queue of this CPU
+static FORCEINLINE int ioBlockGetHwq (IoBlockDev_t* dev)
+{
+    return CpuGetCcb()->cpuNum % dev->numQueues;
+}
+
+// Puts newItem where item is in whatever list item is on
+static FORCEINLINE void ioBlockReplaceLink (NkLink_t* item, NkLink_t* newItem)
+{
+    NkListAdd (NULL, item, newItem);
+    NkListRemove (NULL, item);
+}
+
+// Merges req onto the end of prev, returning the merged request, or NULL if they can't be merged
+// sched is set if prev is in the deadline scheduler's FIFO
+static IoBlockReq_t* ioBlockMerge (ioBlockQueue_t* q,
+                                   IoBlockReq_t* prev,
+                                   IoBlockReq_t* req,
+                                   bool sched)
+{
+    IoBlockDev_t* dev = q->dev;
+    if (prev->op != req->op || req->op == IO_BLOCK_FLUSH)
+        return NULL;
+    if ((prev->sector + prev->count) != req->sector ||
+        (prev->count + req->count) > dev->maxSectors)
+        return NULL;
+    // The pages have to line up, so the page arrays can just be put together
+    size_t prevEnd = prev->offset + (prev->count * dev->sectorSize);
+    if ((prevEnd % NEXKE_CPU_PAGESZ) || req->offset)
+        return NULL;
+    size_t prevPages = prevEnd / NEXKE_CPU_PAGESZ;
+    size_t reqPages = CpuPageAlignUp (req->count * dev->sectorSize) / NEXKE_CPU_PAGESZ;
+    if ((prevPages + reqPages) > q->maxPages)
+        return NULL;
+    ioBlockMerge_t* merge = NULL;
+    if (prev->flags & IO_BLOCK_MERGED)
+        merge = LINK_CONTAINER (prev, ioBlockMerge_t, req);
+    else
+    {
+        merge = MmCacheAlloc (q->mergeCache);
+        if (!merge)
+            return NULL;    // Merging is only an optimization
+        memset (&merge->req, 0, sizeof (IoBlockReq_t));
+        merge->req.op = prev->op;
+        merge->req.flags = prev->flags | IO_BLOCK_MERGED;
+        merge->req.sector = prev->sector;
+        merge->req.count = prev->count;
+        merge->req.pages = merge->pages;
+        merge->req.offset = prev->offset;
+        merge->req.dev = dev;
+        merge->req.deadline = prev->deadline;
+        memcpy (merge->pages, prev->pages, prevPages * sizeof (MmPage_t*));
+        ioBlockReplaceLink (&prev->link, &merge->req.link);
+        if (sched)
+            ioBlockReplaceLink (&prev->schedLink, &merge->req.schedLink);
+        NkListInit (&merge->parts);
+        NkListAddBack (&merge->parts, &prev->link);
+    }
+    memcpy (&merge->pages[prevPages], req->pages, reqPages * sizeof (MmPage_t*));
+    merge->req.count += req->count;
+    NkListAddBack (&merge->parts, &req->link);
+    return &merge->req;
+}
+
+// None scheduler
+
+static void ioBlockNoneInsert (ioBlockQueue_t* q, IoBlockReq_t* req)
+{
+    ioBlockSw_t* sw = &q->sw[CpuGetCcb()->cpuNum];
+    NkSpinLock (&sw->lock);
+    NkLink_t* tail = NkListBack (&sw->reqs);
+    if (!tail || !ioBlockMerge (q, LINK_CONTAINER (tail, IoBlockReq_t, link), req, false))
+        NkListAddBack (&sw->reqs, &req->link);
+    NkSpinUnlock (&sw->lock);
+}
+
+static IoBlockReq_t* ioBlockNoneNext (ioBlockQueue_t* q, int hwq)
+{
+    // Take from the CPUs on this queue in turn, so none of them hog it
+    ioBlockHw_t* hw = &q->hw[hwq];
+    int numQueues = q->dev->numQueues;
+    if (hwq >= q->numCpus)
+        return NULL;    // No CPU maps to it
+    int cpu = hw->nextCpu;
+    do
+    {
+        ioBlockSw_t* sw = &q->sw[cpu];
+        cpu += numQueues;
+        if (cpu >= q->numCpus)
+            cpu = hwq;
+        NkSpinLock (&sw->lock);
+        NkLink_t* link = NkListFront (&sw->reqs);
+        if (link)
+            NkListRemove (&sw->reqs, link);
+        NkSpinUnlock (&sw->lock);
+        if (link)
+        {
+            hw->nextCpu = cpu;
+            return LINK_CONTAINER (link, IoBlockReq_t, link);
+        }
+    } while (cpu != hw->nextCpu);
+    return NULL;
+}
+
+// Deadline scheduler
+
+static void ioBlockDlInsert (ioBlockQueue_t* q, IoBlockReq_t* req)
+{
+    ioBlockDl_t* dl = &q->dl;
+    int dir = req->op == IO_BLOCK_WRITE;
+    req->deadline = NkGetMonotonicCoarse() +
+                    (dir ? IO_BLOCK_WRITE_DEADLINE : IO_BLOCK_READ_DEADLINE);
+    NkSpinLock (&dl->lock);
+    // Find the last request that starts before this one, from the back since streams are more
+    // likely to be added to
+    NkLink_t* iter = NkListBack (&dl->sorted[dir]);
+    while (iter && LINK_CONTAINER (iter, IoBlockReq_t, link)->sector > req->sector)
+        iter = (iter->prev == &dl->sorted[dir]) ? NULL : iter->prev;
+    if (iter && ioBlockMerge (q, LINK_CONTAINER (iter, IoBlockReq_t, link), req, true))
+    {
+        NkSpinUnlock (&dl->lock);
+        return;
+    }
+    if (iter)
+        NkListAdd (&dl->sorted[dir], iter, &req->link);
+    else
+        NkListAddFront (&dl->sorted[dir], &req->link);
+    NkListAddBack (&dl->fifo[dir], &req->schedLink);
+    NkSpinUnlock (&dl->lock);
+}
+
+// Finds the first request in dir at or after the last one sent
+static IoBlockReq_t* ioBlockDlFind (ioBlockDl_t* dl, int dir)
+{
+    NkLink_t* iter = NkListFront (&dl->sorted[dir]);
+    while (iter)
+    {
+        IoBlockReq_t* req = LINK_CONTAINER (iter, IoBlockReq_t, link);
+        if (req->sector >= dl->nextSector)
+            return req;
+        iter = NkListIterate (&dl->sorted[dir], iter);
+    }
+    return NULL;
+}
+
+static IoBlockReq_t* ioBlockDlNext (ioBlockQueue_t* q, int hwq)
+{
+    ioBlockDl_t* dl = &q->dl;
+    NkSpinLock (&dl->lock);
+    IoBlockReq_t* req = NULL;
+    if (dl->batch)
+        req = ioBlockDlFind (dl, dl->dir);
+    if (!req)
+    {
+        // Start a new batch. Reads go first, unless writes have waited too long
+        bool reads = NkListFront (&dl->sorted[0]) != NULL;
+        bool writes = NkListFront (&dl->sorted[1]) != NULL;
+        if (!reads && !writes)
+        {
+            NkSpinUnlock (&dl->lock);
+            return NULL;
+        }
+        if (reads && (!writes || dl->starved < IO_BLOCK_WRITE_STARVE))
+        {
+            dl->dir = 0;
+            if (writes)
+                ++dl->starved;
+        }
+        else
+        {
+            dl->dir = 1;
+            dl->starved = 0;
+        }
+        dl->batch = IO_BLOCK_BATCH;
+        // Start with the oldest request if it's past its deadline, otherwise keep going up
+        IoBlockReq_t* oldest =
+            LINK_CONTAINER (NkListFront (&dl->fifo[dl->dir]), IoBlockReq_t, schedLink);
+        if (oldest->deadline <= NkGetMonotonicCoarse())
+            req = oldest;
+        else if (!(req = ioBlockDlFind (dl, dl->dir)))
+            req = LINK_CONTAINER (NkListFront (&dl->sorted[dl->dir]), IoBlockReq_t, link);
+    }
+    NkListRemove (&dl->sorted[dl->dir], &req->link);
+    NkListRemove (&dl->fifo[dl->dir], &req->schedLink);
+    dl->nextSector = req->sector + req->count;
+    --dl->batch;
+    NkSpinUnlock (&dl->lock);
+    return req;
+}
+
+static const ioBlockSched_t ioBlockScheds[] = {
+    {.name = "none",     .insert = ioBlockNoneInsert, .next = ioBlockNoneNext},
+    {.name = "deadline", .insert = ioBlockDlInsert,   .next = ioBlockDlNext  },
+};
+
+// Sends requests to hardware queue hwq until it's full or there's nothing left
+static void ioBlockRun (ioBlockQueue_t* q, int hwq)
+{
+    IoBlockDev_t* dev = q->dev;
+    ioBlockHw_t* hw = &q->hw[hwq];
+    int sent = 0;
+    NkSpinLock (&hw->lock);
+    for (;;)
+    {
+        IoBlockReq_t* req = NULL;
+        NkLink_t* link = NkListFront (&hw->ready);
+        if (link)
+        {
+            NkListRemove (&hw->ready, link);
+            req = LINK_CONTAINER (link, IoBlockReq_t, link);
+        }
+        else if (!(req = q->sched->next (q, hwq)))
+            break;
+        req->queue = hwq;
+        if (!dev->submit (dev, hwq, req))
+        {
+            // Full, it goes first once something finishes
+            NkListAddFront (&hw->ready, &req->link);
+            break;
+        }
+        ++sent;
+    }
+    if (sent)
+        dev->commit (dev, hwq);
+    NkSpinUnlock (&hw->lock);
+}
+
+// Hands a finished request to its submitter
+static void ioBlockFinish (IoBlockReq_t* req, int status)
+{
+    if (req->irp)
+    {
+        NkAtomicStore (&req->status, status);
+        IoCompleteIrp (req->irp, status, req->count);
+        return;
+    }
+    if (req->done)
+    {
+        NkAtomicStore (&req->status, status);
+        req->done (req);
+        return;
+    }
+    // The waiter may be gone as soon as status changes. Waking only hashes the address, so that's
+    // fine
+    NkAtomicStore (&req->status, status);
+    TskWakeAddress (&req->status, 1);
+}
+
+// Finishes requests that came in on this CPU
+static void ioBlockDpc (NkDpc_t* dpc, void* arg)
+{
+    ioBlockCpu_t* cpu = arg;
+    IoBlockDev_t* lastDev = NULL;
+    int lastQueue = 0;
+    for (;;)
+    {
+        ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+        IoBlockReq_t* req = cpu->head;
+        cpu->head = cpu->tail = NULL;
+        PltLowerIpl (ipl);
+        if (!req)
+            break;
+        while (req)
+        {
+            IoBlockReq_t* next =
+                req->link.next ? LINK_CONTAINER (req->link.next, IoBlockReq_t, link) : NULL;
+            IoBlockDev_t* dev = req->dev;
+            int queue = req->queue;
+            if (req->flags & IO_BLOCK_MERGED)
+            {
+                ioBlockMerge_t* merge = LINK_CONTAINER (req, ioBlockMerge_t, req);
+                NkLink_t* iter = NkListFront (&merge->parts);
+                while (iter)
+                {
+                    NkLink_t* nextPart = NkListIterate (&merge->parts, iter);
+                    ioBlockFinish (LINK_CONTAINER (iter, IoBlockReq_t, link), req->result);
+                    iter = nextPart;
+                }
+                MmCacheFree (((ioBlockQueue_t*) dev->layerData)->mergeCache, merge);
+            }
+            else
+                ioBlockFinish (req, req->result);
+            // Room was made on the queue, so fill it back up once this device's requests are done
+            if (lastDev && (dev != lastDev || queue != lastQueue))
+                ioBlockRun (lastDev->layerData, lastQueue);
+            lastDev = dev;
+            lastQueue = queue;
+            req = next;
+        }
+    }
+    if (lastDev)
+        ioBlockRun (lastDev->layerData, lastQueue);
+}
+
+// Sets up the block layer
+void IoInitBlock()
+{
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+        NkInitDpcObj (&ioBlockCpus[i].dpc, ioBlockDpc, &ioBlockCpus[i]);
+}
+
+// Registers a block device
+void IoRegisterBlockDev (IoBlockDev_t* dev)
+{
+    assert (dev->numQueues || dev->numPollQueues);
+    ioBlockQueue_t* q = kmalloc (sizeof (ioBlockQueue_t), MM_TAG_IO);
+    if (!q)
+        NkPanicOom();
+    memset (q, 0, sizeof (ioBlockQueue_t));
+    q->dev = dev;
+    q->numCpus = NkGetNumCpus();
+    // Single queue devices are the ones that care about order, so they get deadline
+    const char* schedArg = NkReadArg ("-iosched");
+    q->sched = &ioBlockScheds[(dev->numQueues == 1) ? 1 : 0];
+    for (int i = 0; schedArg && i < sizeof (ioBlockScheds) / sizeof (ioBlockSched_t); ++i)
+    {
+        if (!strcmp (schedArg, ioBlockScheds[i].name))
+            q->sched = &ioBlockScheds[i];
+    }
+    q->hw = kmalloc (dev->numQueues * sizeof (ioBlockHw_t), MM_TAG_IO);
+    q->sw = kmalloc (q->numCpus * sizeof (ioBlockSw_t), MM_TAG_IO);
+    q->maxPages = (CpuPageAlignUp (dev->maxSectors * dev->sectorSize) / NEXKE_CPU_PAGESZ) + 1;
+    q->mergeCache = MmCacheCreate (sizeof (ioBlockMerge_t) + (q->maxPages * sizeof (MmPage_t*)),
+                                   dev->name,
+                                   MM_TAG_IO,
+                                   0,
+                                   0);
+    if ((dev->numQueues && !q->hw) || !q->sw || !q->mergeCache)
+        NkPanicOom();
+    for (int i = 0; i < dev->numQueues; ++i)
+    {
+        NkListInit (&q->hw[i].ready);
+        q->hw[i].nextCpu = i;
+        q->hw[i].lock = 0;
+    }
+    for (int i = 0; i < q->numCpus; ++i)
+    {
+        NkListInit (&q->sw[i].reqs);
+        q->sw[i].lock = 0;
+    }
+    for (int i = 0; i < 2; ++i)
+    {
+        NkListInit (&q->dl.sorted[i]);
+        NkListInit (&q->dl.fifo[i]);
+    }
+    dev->layerData = q;
+    NkSpinLock (&ioBlockLock);
+    NkListAddBack (&ioBlockDevs, &dev->link);
+    NkSpinUnlock (&ioBlockLock);
+    NkLogInfo ("nexke: block device %s, %llu sectors of %zu bytes, %d queues, %d polled, %s\n",
+               dev->name,
+               (unsigned long long) dev->numSectors,
+               dev->sectorSize,
+               dev->numQueues,
+               dev->numPollQueues,
+               q->sched->name);
+}
+
+// Finds a block device
+IoBlockDev_t* IoFindBlockDev (const char* name)
+{
+    IoBlockDev_t* found = NULL;
+    NkSpinLock (&ioBlockLock);
+    NkLink_t* iter = NkListFront (&ioBlockDevs);
+    while (iter)
+    {
+        IoBlockDev_t* dev = LINK_CONTAINER (iter, IoBlockDev_t, link);
+        if (!strcmp (dev->name, name))
+        {
+            found = dev;
+            break;
+        }
+        iter = NkListIterate (&ioBlockDevs, iter);
+    }
+    NkSpinUnlock (&ioBlockLock);
+    return found;
+}
+
+// Plugs dev
+void IoBlockStartPlug (IoBlockPlug_t* plug, IoBlockDev_t* dev)
+{
+    assert (dev->numQueues);
+    plug->dev = dev;
+    plug->count = 0;
+    NkListInit (&plug->reqs);
+}
+
+// Hands what a plug holds to the scheduler and sends it out
+static void ioBlockFlushPlug (IoBlockPlug_t* plug)
+{
+    IoBlockDev_t* dev = plug->dev;
+    ioBlockQueue_t* q = dev->layerData;
+    if (!plug->count)
+        return;
+    int hwq = ioBlockGetHwq (dev);
+    NkLink_t* link = NkListFront (&plug->reqs);
+    while (link)
+    {
+        NkLink_t* next = NkListIterate (&plug->reqs, link);
+        NkListRemove (&plug->reqs, link);
+        IoBlockReq_t* req = LINK_CONTAINER (link, IoBlockReq_t, link);
+        if (req->op == IO_BLOCK_FLUSH)
+        {
+            // Nothing to schedule, so it goes straight to the queue
+            ioBlockHw_t* hw = &q->hw[hwq];
+            NkSpinLock (&hw->lock);
+            NkListAddBack (&hw->ready, link);
+            NkSpinUnlock (&hw->lock);
+        }
+        else
+            q->sched->insert (q, req);
+        link = next;
+    }
+    plug->count = 0;
+    ioBlockRun (q, hwq);
+}
+
+// Queues a request on a plug
+void IoBlockQueue (IoBlockPlug_t* plug, IoBlockReq_t* req)
+{
+    IoBlockDev_t* dev = plug->dev;
+    assert (req->count <= dev->maxSectors && !(req->flags & IO_BLOCK_POLL));
+    NkAtomicStore (&req->status, IO_STATUS_PENDING);
+    req->flags &= ~IO_BLOCK_MERGED;
+    req->dev = dev;
+    NkLink_t* tail = NkListBack (&plug->reqs);
+    if (tail && ioBlockMerge (dev->layerData,
+                              LINK_CONTAINER (tail, IoBlockReq_t, link),
+                              req,
+                              false))
+        return;
+    NkListAddBack (&plug->reqs, &req->link);
+    if (++plug->count >= IO_BLOCK_PLUG_MAX)
+        ioBlockFlushPlug (plug);
+}
+
+// Unplugs
+void IoBlockFinishPlug (IoBlockPlug_t* plug)
+{
+    ioBlockFlushPlug (plug);
+}
+
+// Submits a batch of requests
+void IoBlockSubmit (IoBlockDev_t* dev, IoBlockReq_t** reqs, int count)
+{
+    IoBlockPlug_t plug;
+    IoBlockStartPlug (&plug, dev);
+    for (int i = 0; i < count; ++i)
+        IoBlockQueue (&plug, reqs[i]);
+    IoBlockFinishPlug (&plug);
+}
+
+// Waits for a request
+int IoBlockWait (IoBlockReq_t* req)
+{
+    atomic_t status;
+    while ((status = NkAtomicLoad (&req->status)) == IO_STATUS_PENDING)
+        TskWaitAddress (&req->status, IO_STATUS_PENDING, TSK_TIMEOUT_NONE);
+    return status;
+}
+
+// Finishes a request
+void IoBlockComplete (IoBlockReq_t* req, int status)
+{
+    // Polled requests are finished by the poller
+    if (req->queue >= req->dev->numQueues)
+    {
+        ioBlockFinish (req, status);
+        return;
+    }
+    req->result = status;
+    req->link.next = NULL;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    ioBlockCpu_t* cpu = &ioBlockCpus[CpuGetCcb()->cpuNum];
+    if (cpu->tail)
+        cpu->tail->link.next = &req->link;
+    else
+        cpu->head = req;
+    cpu->tail = req;
+    NkQueueDpc (&cpu->dpc);
+    PltLowerIpl (ipl);
+}
+
+// Does a request on a polled queue and spins until it's done
+static int ioBlockRwPolled (IoBlockDev_t* dev, IoBlockReq_t* req)
+{
+    int queue = dev->numQueues + (CpuGetCcb()->cpuNum % dev->numPollQueues);
+    NkAtomicStore (&req->status, IO_STATUS_PENDING);
+    req->dev = dev;
+    req->queue = queue;
+    // Make room ourselves if it's full
+    while (!dev->submit (dev, queue, req))
+    {
+        if (!dev->poll (dev, queue))
+            TskSleepThread (IO_BLOCK_FULL_WAIT);
+    }
+    dev->commit (dev, queue);
+    atomic_t status;
+    while ((status = NkAtomicLoad (&req->status)) == IO_STATUS_PENDING)
+    {
+        if (!dev->poll (dev, queue))
+            CpuSpin();
+    }
+    return status;
+}
+
+// Does a request and waits for it
+int IoBlockRw (IoBlockDev_t* dev,
+               int op,
+               uint64_t sector,
+               size_t count,
+               MmPage_t** pages,
+               size_t offset,
+               int flags)
+{
+    assert (count <= dev->maxSectors);
+    IoBlockReq_t req = {0};
+    req.op = op;
+    req.flags = flags;
+    req.sector = sector;
+    req.count = count;
+    req.pages = pages;
+    req.offset = offset;
+    if ((flags & IO_BLOCK_POLL && dev->numPollQueues) || !dev->numQueues)
+        return ioBlockRwPolled (dev, &req);
+    req.flags &= ~IO_BLOCK_POLL;
+    IoBlockReq_t* reqs = &req;
+    IoBlockSubmit (dev, &reqs, 1);
+    return IoBlockWait (&req);
+}
+
+// File backend
+// Files are read and written in requests as large as the device takes, all sent under one plug
+
+// File on a block device
+typedef struct _ioblockfile
+{
+    IoBlockDev_t* dev;    // Device file is on
+    uint64_t start;       // First sector of file
+} ioBlockFile_t;
+
+// Reads or writes count pages at offset of file
+static bool ioBlockFileRw (MmFile_t* file, uint64_t offset, MmPage_t** pages, size_t count, int op)
+{
+    ioBlockFile_t* blkFile = file->devData;
+    IoBlockDev_t* dev = blkFile->dev;
+    size_t len = count * NEXKE_CPU_PAGESZ;
+    if (offset >= file->size)
+        len = 0;
+    else if ((offset + len) > file->size)
+        len = file->size - offset;
+    // Whatever is past the end reads as zeroes
+    if (op == IO_BLOCK_READ)
+    {
+        for (size_t i = len / NEXKE_CPU_PAGESZ; i < count; ++i)
+            MmMulZeroPage (pages[i]);
+    }
+    if (!len)
+        return true;
+    // Requests are whole pages, so each one picks up at a page
+    size_t reqPages = (dev->maxSectors * dev->sectorSize) / NEXKE_CPU_PAGESZ;
+    size_t numReqs = (CpuPageAlignUp (len) / NEXKE_CPU_PAGESZ + reqPages - 1) / reqPages;
+    IoBlockReq_t* reqs = kmalloc (numReqs * sizeof (IoBlockReq_t), MM_TAG_IO);
+    if (!reqs)
+        return false;
+    memset (reqs, 0, numReqs * sizeof (IoBlockReq_t));
+    uint64_t sector = blkFile->start + (offset / dev->sectorSize);
+    size_t sectorsPerPage = NEXKE_CPU_PAGESZ / dev->sectorSize;
+    size_t left = len / dev->sectorSize;
+    IoBlockPlug_t plug;
+    IoBlockStartPlug (&plug, dev);
+    for (size_t i = 0; i < numReqs; ++i)
+    {
+        IoBlockReq_t* req = &reqs[i];
+        req->op = op;
+        req->sector = sector;
+        req->count = (left < (reqPages * sectorsPerPage)) ? left : (reqPages * sectorsPerPage);
+        req->pages = &pages[i * reqPages];
+        sector += req->count;
+        left -= req->count;
+        IoBlockQueue (&plug, req);
+    }
+    IoBlockFinishPlug (&plug);
+    bool res = true;
+    for (size_t i = 0; i < numReqs; ++i)
+    {
+        if (IoBlockWait (&reqs[i]) != IO_STATUS_OK)
+            res = false;
+    }
+    kfree (reqs, numReqs * sizeof (IoBlockReq_t), MM_TAG_IO);
+    return res;
+}
+
+static bool ioBlockFileRead (MmFile_t* file, uint64_t offset, MmPage_t** pages, size_t count)
+{
+    return ioBlockFileRw (file, offset, pages, count, IO_BLOCK_READ);
+}
+
+static bool ioBlockFileWrite (MmFile_t* file, uint64_t offset, MmPage_t** pages, size_t count)
+{
+    return ioBlockFileRw (file, offset, pages, count, IO_BLOCK_WRITE);
+}
+
+// Makes a file out of a range of a block device
+bool IoInitBlockFile (MmFile_t* file,
+                      IoBlockDev_t* dev,
+                      uint64_t sector,
+                      uint64_t numSectors,
+                      int perm)
+{
+    assert (!(NEXKE_CPU_PAGESZ % dev->sectorSize) && dev->numQueues);
+    assert ((dev->maxSectors * dev->sectorSize) >= NEXKE_CPU_PAGESZ);
+    ioBlockFile_t* blkFile = kmalloc (sizeof (ioBlockFile_t), MM_TAG_IO);
+    if (!blkFile)
+        return false;
+    blkFile->dev = dev;
+    blkFile->start = sector;
+    memset (file, 0, sizeof (MmFile_t));
+    file->size = numSectors * dev->sectorSize;
+    file->read = ioBlockFileRead;
+    file->write = ioBlockFileWrite;
+    file->devData = blkFile;
+    file->perm = perm;
+    return true;
+}
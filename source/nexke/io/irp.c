@@ -0,0 +1,175 @@
+/*
+    irp.c - contains I/O request packets and completion ports
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/wait.h>
+#include <string.h>
+
+// IRPs that finished on each CPU, waiting for its DPC
+typedef struct _irpcpu
+{
+    NkDpc_t dpc;      // Delivers completions
+    IoIrp_t* head;    // IRPs that finished
+    IoIrp_t* tail;
+} ioIrpCpu_t;
+
+static ioIrpCpu_t ioIrpCpus[NEXKE_MAX_CPUS] = {0};
+
+// Locks a port
+static inline ipl_t ioLockPort (IoPort_t* port)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&port->lock);
+    return ipl;
+}
+
+// Unlocks a port
+static inline void ioUnlockPort (IoPort_t* port, ipl_t ipl)
+{
+    NkSpinUnlock (&port->lock);
+    PltLowerIpl (ipl);
+}
+
+// Puts the chain of count IRPs from head to tail on port, waking a waiter for each
+static void ioPortPostChain (IoPort_t* port, IoIrp_t* head, IoIrp_t* tail, int count)
+{
+    tail->next = NULL;
+    ipl_t ipl = ioLockPort (port);
+    if (port->tail)
+        port->tail->next = head;
+    else
+        port->head = head;
+    port->tail = tail;
+    NkAtomicAdd (&port->count, count);
+    ioUnlockPort (port, ipl);
+    TskWakeAddress (&port->count, count);
+}
+
+// Delivers completions of IRPs that finished on this CPU
+// Runs of IRPs going to the same port are posted together, so a port only gets locked once a batch
+static void ioIrpDpc (NkDpc_t* dpc, void* arg)
+{
+    ioIrpCpu_t* cpu = arg;
+    for (;;)
+    {
+        ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+        IoIrp_t* irp = cpu->head;
+        cpu->head = cpu->tail = NULL;
+        PltLowerIpl (ipl);
+        if (!irp)
+            break;
+        while (irp)
+        {
+            IoIrp_t* next = irp->next;
+            if (irp->done)
+            {
+                irp->done (irp);
+                irp = next;
+                continue;
+            }
+            // Gather everything after it going to the same port
+            IoIrp_t* tail = irp;
+            int count = 1;
+            while (next && !next->done && next->port == irp->port)
+            {
+                tail = next;
+                next = next->next;
+                ++count;
+            }
+            ioPortPostChain (irp->port, irp, tail, count);
+            irp = next;
+        }
+    }
+}
+
+// Sets up IRPs
+void IoInitIrps()
+{
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+        NkInitDpcObj (&ioIrpCpus[i].dpc, ioIrpDpc, &ioIrpCpus[i]);
+}
+
+// Sets up an IRP
+void IoInitIrp (IoIrp_t* irp, IoIrpDone done, IoPort_t* port, void* key)
+{
+    assert (done || port);
+    memset (irp, 0, sizeof (IoIrp_t));
+    irp->done = done;
+    irp->port = port;
+    irp->key = key;
+}
+
+// Finishes an IRP
+void IoCompleteIrp (IoIrp_t* irp, int status, size_t count)
+{
+    irp->status = status;
+    irp->count = count;
+    irp->next = NULL;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    ioIrpCpu_t* cpu = &ioIrpCpus[CpuGetCcb()->cpuNum];
+    if (cpu->tail)
+        cpu->tail->next = irp;
+    else
+        cpu->head = irp;
+    cpu->tail = irp;
+    NkQueueDpc (&cpu->dpc);
+    PltLowerIpl (ipl);
+}
+
+// Sets up a completion port
+void IoInitPort (IoPort_t* port)
+{
+    memset (port, 0, sizeof (IoPort_t));
+}
+
+// Posts an IRP to a port
+void IoPortPost (IoPort_t* port, IoIrp_t* irp)
+{
+    ioPortPostChain (port, irp, irp, 1);
+}
+
+// Takes IRPs off a port
+int IoPortWait (IoPort_t* port, IoIrp_t** irps, int max, ktime_t timeout)
+{
+    assert (max > 0);
+    for (;;)
+    {
+        int count = 0;
+        if (NkAtomicLoad (&port->count))
+        {
+            ipl_t ipl = ioLockPort (port);
+            while (port->head && count < max)
+            {
+                irps[count++] = port->head;
+                port->head = port->head->next;
+            }
+            if (!port->head)
+                port->tail = NULL;
+            if (count)
+                NkAtomicSub (&port->count, count);
+            ioUnlockPort (port, ipl);
+        }
+        // Another waiter can get in between the count going up and us locking
+        if (count)
+            return count;
+        if (TskWaitAddress (&port->count, 0, timeout) == ETIMEDOUT)
+            return 0;
+    }
+}
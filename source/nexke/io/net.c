@@ -0,0 +1,77 @@
+/*
+    net.c - contains network device layer
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io.h>
+#include <nexke/nexke.h>
+#include <string.h>
+
+static NkList_t ioNetDevs = {&ioNetDevs, &ioNetDevs};
+static spinlock_t ioNetLock = 0;
+
+// Registers a network device
+void IoRegisterNetDev (IoNetDev_t* dev)
+{
+    assert (dev->numQueues);
+    NkSpinLock (&ioNetLock);
+    NkListAddBack (&ioNetDevs, &dev->link);
+    NkSpinUnlock (&ioNetLock);
+    NkLogInfo ("nexke: network device %s, MAC %02x:%02x:%02x:%02x:%02x:%02x, %d queues\n",
+               dev->name,
+               dev->mac[0],
+               dev->mac[1],
+               dev->mac[2],
+               dev->mac[3],
+               dev->mac[4],
+               dev->mac[5],
+               dev->numQueues);
+}
+
+// Finds a network device
+IoNetDev_t* IoFindNetDev (const char* name)
+{
+    IoNetDev_t* found = NULL;
+    NkSpinLock (&ioNetLock);
+    NkLink_t* iter = NkListFront (&ioNetDevs);
+    while (iter)
+    {
+        IoNetDev_t* dev = LINK_CONTAINER (iter, IoNetDev_t, link);
+        if (!strcmp (dev->name, name))
+        {
+            found = dev;
+            break;
+        }
+        iter = NkListIterate (&ioNetDevs, iter);
+    }
+    NkSpinUnlock (&ioNetLock);
+    return found;
+}
+
+// Sends frames
+int IoNetSend (IoNetDev_t* dev, IoNetBuf_t** bufs, int count)
+{
+    int queue = CpuGetCcb()->cpuNum % dev->numQueues;
+    int i = 0;
+    for (; i < count; ++i)
+    {
+        if (!dev->xmit (dev, queue, bufs[i]))
+            break;
+    }
+    if (i)
+        dev->flush (dev, queue);
+    return i;
+}
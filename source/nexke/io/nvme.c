@@ -0,0 +1,646 @@
+/*
+    nvme.c - contains NVMe driver
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/platform/pci.h>
+#include <nexke/task.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each CPU gets its own pair of submission and completion queues, with its own MSI-X vector
+// delivered to that CPU, so submitting and completing never bounces a queue between caches
+// -nvmepoll adds that many queues without interrupts after them, for requests that ask to be
+// polled. The admin queue is only used while probing, so it's polled too
+// Commands are written to the submission queue by submit, and commit writes the tail doorbell
+// once for all of them. Completions are reaped in batches, and the head doorbell is written once
+// for each batch
+// Data is described with PRPs straight from the request's pages. Transfers that span more than
+// two pages need a PRP list, and each command slot keeps the list page it first got, since it
+// can't go back to the pool from an interrupt. Transfers are capped so one list page is enough
+// Commands IDs are slots, and there's one less slot than queue entries. So neither queue can
+// ever fill up, and the submission queue head in completions doesn't have to be looked at
+
+// Registers
+#define IO_NVME_CAP  0x00
+#define IO_NVME_VS   0x08
+#define IO_NVME_CC   0x14
+#define IO_NVME_CSTS 0x1C
+#define IO_NVME_AQA  0x24
+#define IO_NVME_ASQ  0x28
+#define IO_NVME_ACQ  0x30
+#define IO_NVME_DB   0x1000
+
+// CAP
+#define IO_NVME_CAP_MQES(cap)   ((cap) & 0xFFFF)
+#define IO_NVME_CAP_TO(cap)     (((cap) >> 24) & 0xFF)    // In 500 ms units
+#define IO_NVME_CAP_DSTRD(cap)  (((cap) >> 32) & 0xF)
+#define IO_NVME_CAP_MPSMIN(cap) (((cap) >> 48) & 0xF)
+
+// CC
+#define IO_NVME_CC_EN         (1 << 0)
+#define IO_NVME_CC_MPS_SHIFT  7
+#define IO_NVME_CC_IOSQES     (6 << 16)    // 64 byte commands
+#define IO_NVME_CC_IOCQES     (4 << 20)    // 16 byte completions
+
+// CSTS
+#define IO_NVME_CSTS_RDY (1 << 0)
+#define IO_NVME_CSTS_CFS (1 << 1)
+
+// Admin opcodes
+#define IO_NVME_ADM_CREATE_SQ 0x01
+#define IO_NVME_ADM_CREATE_CQ 0x05
+#define IO_NVME_ADM_IDENTIFY  0x06
+#define IO_NVME_ADM_SET_FEAT  0x09
+
+// I/O opcodes
+#define IO_NVME_CMD_FLUSH 0x00
+#define IO_NVME_CMD_WRITE 0x01
+#define IO_NVME_CMD_READ  0x02
+
+// Identify CNS
+#define IO_NVME_ID_NS   0
+#define IO_NVME_ID_CTRL 1
+
+// Identify fields
+#define IO_NVME_ID_MDTS   77
+#define IO_NVME_ID_NN     516
+#define IO_NVME_ID_NSZE   0
+#define IO_NVME_ID_FLBAS  26
+#define IO_NVME_ID_LBAF   128
+
+// Features
+#define IO_NVME_FEAT_NUM_QUEUES 0x07
+
+// Queue creation flags
+#define IO_NVME_Q_CONTIG (1 << 0)
+#define IO_NVME_Q_IEN    (1 << 1)
+
+#define IO_NVME_ADMIN_DEPTH 32
+#define IO_NVME_MAX_DEPTH   256
+#define IO_NVME_REAP_BATCH  16
+#define IO_NVME_IPL         16    // Devices interrupt below the timer
+
+// Submission queue entry
+typedef struct _ionvmecmd
+{
+    uint8_t opc;       // Opcode
+    uint8_t flags;     // Fused operation and PRP or SGL
+    uint16_t cid;      // Command ID
+    uint32_t nsid;     // Namespace ID
+    uint64_t resvd;
+    uint64_t mptr;     // Metadata pointer
+    uint64_t prp1;     // First data page
+    uint64_t prp2;     // Second data page, or PRP list
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__ ((packed)) ioNvmeCmd_t;
+
+// Completion queue entry
+typedef struct _ionvmecqe
+{
+    uint32_t dw0;        // Command specific
+    uint32_t resvd;
+    uint16_t sqHead;     // Where the controller is in the submission queue
+    uint16_t sqId;       // Queue command came from
+    uint16_t cid;        // Command ID
+    uint16_t status;     // Phase in bit 0, status above it
+} __attribute__ ((packed)) ioNvmeCqe_t;
+
+// Command slot
+typedef struct _ionvmeslot
+{
+    IoBlockReq_t* req;    // Request in this slot
+    uint64_t* prpList;    // PRP list, NULL until a command in this slot needs one
+    paddr_t prpPhys;      // Physical address of PRP list
+} ioNvmeSlot_t;
+
+typedef struct _ionvmectrl ioNvmeCtrl_t;
+
+// Queue pair
+typedef struct _ionvmequeue
+{
+    ioNvmeCtrl_t* ctrl;         // Controller queue is on
+    int qid;                    // Queue ID
+    int depth;                  // Entries in each queue
+    bool polled;                // Queue doesn't interrupt
+    ioNvmeCmd_t* sq;            // Submission queue
+    volatile ioNvmeCqe_t* cq;   // Completion queue
+    volatile uint32_t* sqDb;    // Submission queue tail doorbell
+    volatile uint32_t* cqDb;    // Completion queue head doorbell
+    uint16_t sqTail;            // Where the next command goes
+    uint16_t sqRung;            // Tail the controller was last told about
+    uint16_t cqHead;            // Next completion to look at
+    uint16_t phase;             // Phase of new completions
+    uint16_t* freeCids;         // Stack of free slots
+    int numFree;                // Number of free slots
+    ioNvmeSlot_t* slots;        // Command slots
+    spinlock_t lock;
+    NkHwInterrupt_t hwInt;      // Interrupt of queue
+} ioNvmeQueue_t;
+
+// Controller
+typedef struct _ionvmectrl
+{
+    PltPciDev_t* pci;           // PCI function
+    int id;                     // Controller number
+    volatile uint8_t* regs;     // Registers
+    int dbStride;               // Doorbell stride in bytes
+    int maxDepth;               // Most entries a queue can have
+    size_t maxXfer;             // Most bytes in a command
+    int numQueues;              // Queues that interrupt
+    int numPoll;                // Polled queues
+    ioNvmeQueue_t admin;        // Admin queue
+    ioNvmeQueue_t** queues;     // I/O queues
+    MmDmaPool_t* prpPool;       // Pool of PRP lists, also used for identify data
+} ioNvmeCtrl_t;
+
+// Namespace
+typedef struct _ionvmens
+{
+    IoBlockDev_t blk;       // Block device of namespace
+    ioNvmeCtrl_t* ctrl;     // Controller it's on
+    uint32_t nsid;          // Namespace ID
+} ioNvmeNs_t;
+
+// Finished request
+typedef struct _ionvmedone
+{
+    IoBlockReq_t* req;
+    int status;
+} ioNvmeDone_t;
+
+static int ioNvmeNumCtrls = 0;
+
+// Register access. 64 bit registers are done as two halves, low first, since not everything can
+// take 64 bit accesses
+static FORCEINLINE uint32_t ioNvmeRead32 (ioNvmeCtrl_t* ctrl, int reg)
+{
+    return *(volatile uint32_t*) (ctrl->regs + reg);
+}
+
+static FORCEINLINE void ioNvmeWrite32 (ioNvmeCtrl_t* ctrl, int reg, uint32_t val)
+{
+    *(volatile uint32_t*) (ctrl->regs + reg) = val;
+}
+
+static FORCEINLINE uint64_t ioNvmeRead64 (ioNvmeCtrl_t* ctrl, int reg)
+{
+    uint64_t low = ioNvmeRead32 (ctrl, reg);
+    return low | ((uint64_t) ioNvmeRead32 (ctrl, reg + 4) << 32);
+}
+
+static FORCEINLINE void ioNvmeWrite64 (ioNvmeCtrl_t* ctrl, int reg, uint64_t val)
+{
+    ioNvmeWrite32 (ctrl, reg, (uint32_t) val);
+    ioNvmeWrite32 (ctrl, reg + 4, (uint32_t) (val >> 32));
+}
+
+// Locks a queue. Interrupt queues are reaped from their interrupt, so IPL has to go up to it
+static FORCEINLINE ipl_t ioNvmeLock (ioNvmeQueue_t* q)
+{
+    ipl_t ipl = PltRaiseIpl (q->polled ? PltGetIpl() : q->hwInt.ipl);
+    NkSpinLock (&q->lock);
+    return ipl;
+}
+
+static FORCEINLINE void ioNvmeUnlock (ioNvmeQueue_t* q, ipl_t ipl)
+{
+    NkSpinUnlock (&q->lock);
+    PltLowerIpl (ipl);
+}
+
+// Allocates physically contiguous, mapped, zeroed memory for a queue
+static void* ioNvmeAllocRing (size_t sz, paddr_t* phys)
+{
+    size_t numPages = CpuPageAlignUp (sz) / NEXKE_CPU_PAGESZ;
+    MmPage_t* pages = MmAllocPagesAt (numPages, 0, NEXKE_CPU_PAGESZ);
+    if (!pages)
+        return NULL;
+    void* virt = MmMapKvContig (pages, numPages, 0);
+    if (!virt)
+    {
+        MmFreePages (pages, numPages);
+        return NULL;
+    }
+    memset (virt, 0, numPages * NEXKE_CPU_PAGESZ);
+    *phys = MmGetPagePhys (pages);
+    return virt;
+}
+
+// Sets up a queue pair's memory and doorbells
+static bool ioNvmeInitQueue (ioNvmeCtrl_t* ctrl,
+                             ioNvmeQueue_t* q,
+                             int qid,
+                             int depth,
+                             paddr_t* sqPhys,
+                             paddr_t* cqPhys)
+{
+    memset (q, 0, sizeof (ioNvmeQueue_t));
+    q->ctrl = ctrl;
+    q->qid = qid;
+    q->depth = depth;
+    q->phase = 1;
+    q->sq = ioNvmeAllocRing (depth * sizeof (ioNvmeCmd_t), sqPhys);
+    q->cq = ioNvmeAllocRing (depth * sizeof (ioNvmeCqe_t), cqPhys);
+    q->freeCids = kmalloc ((depth - 1) * sizeof (uint16_t), MM_TAG_IO);
+    q->slots = kmalloc ((depth - 1) * sizeof (ioNvmeSlot_t), MM_TAG_IO);
+    if (!q->sq || !q->cq || !q->freeCids || !q->slots)
+        return false;
+    memset (q->slots, 0, (depth - 1) * sizeof (ioNvmeSlot_t));
+    for (int i = 0; i < (depth - 1); ++i)
+        q->freeCids[i] = (depth - 2) - i;
+    q->numFree = depth - 1;
+    q->sqDb = (volatile uint32_t*) (ctrl->regs + IO_NVME_DB + ((2 * qid) * ctrl->dbStride));
+    q->cqDb = (volatile uint32_t*) (ctrl->regs + IO_NVME_DB + ((2 * qid + 1) * ctrl->dbStride));
+    return true;
+}
+
+// Runs an admin command and polls for it, returning its status
+// Only used while probing, so nothing else is on the admin queue
+static int ioNvmeAdmin (ioNvmeCtrl_t* ctrl, ioNvmeCmd_t* cmd, uint32_t* result)
+{
+    ioNvmeQueue_t* q = &ctrl->admin;
+    cmd->cid = q->sqTail;
+    q->sq[q->sqTail] = *cmd;
+    q->sqTail = (q->sqTail + 1) % q->depth;
+    CpuIoBarrier();
+    *q->sqDb = q->sqTail;
+    volatile ioNvmeCqe_t* cqe = &q->cq[q->cqHead];
+    while ((__atomic_load_n (&cqe->status, __ATOMIC_ACQUIRE) & 1) != q->phase)
+        CpuSpin();
+    if (result)
+        *result = cqe->dw0;
+    int status = cqe->status >> 1;
+    if (++q->cqHead == q->depth)
+    {
+        q->cqHead = 0;
+        q->phase ^= 1;
+    }
+    *q->cqDb = q->cqHead;
+    return status;
+}
+
+// Waits for CSTS.RDY to become ready
+static bool ioNvmeWaitReady (ioNvmeCtrl_t* ctrl, uint64_t cap, bool ready)
+{
+    ktime_t deadline = NK_STATIC_CALL (PltGetTime)() +
+                       ((IO_NVME_CAP_TO (cap) + 1) * (PLT_NS_IN_SEC / 2));
+    for (;;)
+    {
+        uint32_t csts = ioNvmeRead32 (ctrl, IO_NVME_CSTS);
+        if (csts == 0xFFFFFFFF || (ready && csts & IO_NVME_CSTS_CFS))
+            return false;
+        if (!!(csts & IO_NVME_CSTS_RDY) == ready)
+            return true;
+        if (NK_STATIC_CALL (PltGetTime)() > deadline)
+            return false;
+        TskSleepThread (PLT_NS_IN_SEC / 1000);
+    }
+}
+
+// Reaps completions from q
+static int ioNvmeReap (ioNvmeQueue_t* q)
+{
+    int total = 0;
+    for (;;)
+    {
+        ioNvmeDone_t done[IO_NVME_REAP_BATCH];
+        int numDone = 0;
+        ipl_t ipl = ioNvmeLock (q);
+        while (numDone < IO_NVME_REAP_BATCH)
+        {
+            volatile ioNvmeCqe_t* cqe = &q->cq[q->cqHead];
+            uint16_t status = __atomic_load_n (&cqe->status, __ATOMIC_ACQUIRE);
+            if ((status & 1) != q->phase)
+                break;
+            uint16_t cid = cqe->cid;
+            assert (cid < (q->depth - 1) && q->slots[cid].req);
+            done[numDone].req = q->slots[cid].req;
+            done[numDone].status = (status >> 1) ? IO_STATUS_ERROR : IO_STATUS_OK;
+            ++numDone;
+            q->slots[cid].req = NULL;
+            q->freeCids[q->numFree++] = cid;
+            if (++q->cqHead == q->depth)
+            {
+                q->cqHead = 0;
+                q->phase ^= 1;
+            }
+        }
+        if (numDone)
+            *q->cqDb = q->cqHead;
+        ioNvmeUnlock (q, ipl);
+        // Requests are finished unlocked, so their callbacks can submit more
+        for (int i = 0; i < numDone; ++i)
+            IoBlockComplete (done[i].req, done[i].status);
+        total += numDone;
+        if (numDone < IO_NVME_REAP_BATCH)
+            return total;
+    }
+}
+
+// Interrupt of an I/O queue
+static bool ioNvmeInterrupt (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    ioNvmeQueue_t* q = LINK_CONTAINER (PltGetMsiHwInt (intObj), ioNvmeQueue_t, hwInt);
+    ioNvmeReap (q);
+    return true;
+}
+
+// Puts a request on a queue
+static bool ioNvmeSubmit (IoBlockDev_t* blk, int queue, IoBlockReq_t* req)
+{
+    ioNvmeNs_t* ns = blk->drvData;
+    ioNvmeQueue_t* q = ns->ctrl->queues[queue];
+    ioNvmeCmd_t cmd = {0};
+    cmd.nsid = ns->nsid;
+    size_t numPages = 0;
+    if (req->op == IO_BLOCK_FLUSH)
+        cmd.opc = IO_NVME_CMD_FLUSH;
+    else
+    {
+        assert (req->count && !(req->offset & 3));
+        cmd.opc = (req->op == IO_BLOCK_WRITE) ? IO_NVME_CMD_WRITE : IO_NVME_CMD_READ;
+        cmd.cdw10 = (uint32_t) req->sector;
+        cmd.cdw11 = (uint32_t) (req->sector >> 32);
+        cmd.cdw12 = req->count - 1;
+        numPages = CpuPageAlignUp (req->offset + (req->count * blk->sectorSize)) /
+                   NEXKE_CPU_PAGESZ;
+    }
+    ipl_t ipl = ioNvmeLock (q);
+    if (!q->numFree)
+    {
+        ioNvmeUnlock (q, ipl);
+        return false;
+    }
+    uint16_t cid = q->freeCids[--q->numFree];
+    ioNvmeUnlock (q, ipl);
+    // The slot is ours now, so its PRP list can be set up unlocked
+    ioNvmeSlot_t* slot = &q->slots[cid];
+    if (numPages > 2 && !slot->prpList)
+        slot->prpList = MmDmaAlloc (ns->ctrl->prpPool, &slot->prpPhys);
+    if (numPages > 2 && !slot->prpList)
+    {
+        ipl = ioNvmeLock (q);
+        q->freeCids[q->numFree++] = cid;
+        ioNvmeUnlock (q, ipl);
+        return false;
+    }
+    if (numPages)
+        cmd.prp1 = MmGetPagePhys (req->pages[0]) + req->offset;
+    if (numPages == 2)
+        cmd.prp2 = MmGetPagePhys (req->pages[1]);
+    else if (numPages > 2)
+    {
+        for (size_t i = 1; i < numPages; ++i)
+            slot->prpList[i - 1] = MmGetPagePhys (req->pages[i]);
+        cmd.prp2 = slot->prpPhys;
+    }
+    cmd.cid = cid;
+    ipl = ioNvmeLock (q);
+    slot->req = req;
+    q->sq[q->sqTail] = cmd;
+    q->sqTail = (q->sqTail + 1) % q->depth;
+    ioNvmeUnlock (q, ipl);
+    return true;
+}
+
+// Tells the controller about submitted commands
+static void ioNvmeCommit (IoBlockDev_t* blk, int queue)
+{
+    ioNvmeNs_t* ns = blk->drvData;
+    ioNvmeQueue_t* q = ns->ctrl->queues[queue];
+    ipl_t ipl = ioNvmeLock (q);
+    if (q->sqTail != q->sqRung)
+    {
+        CpuIoBarrier();
+        *q->sqDb = q->sqTail;
+        q->sqRung = q->sqTail;
+    }
+    ioNvmeUnlock (q, ipl);
+}
+
+// Polls a queue
+static int ioNvmePoll (IoBlockDev_t* blk, int queue)
+{
+    ioNvmeNs_t* ns = blk->drvData;
+    return ioNvmeReap (ns->ctrl->queues[queue]);
+}
+
+// Creates I/O queue pair qid, connecting it to cpuNum if it isn't polled
+static bool ioNvmeCreateQueue (ioNvmeCtrl_t* ctrl, int qid, int cpuNum)
+{
+    ioNvmeQueue_t* q = kmalloc (sizeof (ioNvmeQueue_t), MM_TAG_IO);
+    if (!q)
+        return false;
+    paddr_t sqPhys = 0, cqPhys = 0;
+    int depth = (ctrl->maxDepth < IO_NVME_MAX_DEPTH) ? ctrl->maxDepth : IO_NVME_MAX_DEPTH;
+    if (!ioNvmeInitQueue (ctrl, q, qid, depth, &sqPhys, &cqPhys))
+        return false;
+    q->polled = cpuNum < 0;
+    uint32_t cqFlags = IO_NVME_Q_CONTIG;
+    if (!q->polled)
+    {
+        // Vector 0 belongs to the admin queue, so queue qid gets vector qid
+        PltMsiMsg_t msg = {0};
+        PltInitMsi (&q->hwInt, ioNvmeInterrupt, IO_NVME_IPL, 0);
+        if (!PltConnectMsi (&q->hwInt, 1, cpuNum, &msg))
+            return false;
+        PltPciSetMsix (ctrl->pci, qid, &msg);
+        cqFlags |= IO_NVME_Q_IEN | (qid << 16);
+    }
+    ioNvmeCmd_t cmd = {0};
+    cmd.opc = IO_NVME_ADM_CREATE_CQ;
+    cmd.prp1 = cqPhys;
+    cmd.cdw10 = ((depth - 1) << 16) | qid;
+    cmd.cdw11 = cqFlags;
+    if (ioNvmeAdmin (ctrl, &cmd, NULL))
+        return false;
+    memset (&cmd, 0, sizeof (ioNvmeCmd_t));
+    cmd.opc = IO_NVME_ADM_CREATE_SQ;
+    cmd.prp1 = sqPhys;
+    cmd.cdw10 = ((depth - 1) << 16) | qid;
+    cmd.cdw11 = (qid << 16) | IO_NVME_Q_CONTIG;
+    if (ioNvmeAdmin (ctrl, &cmd, NULL))
+        return false;
+    ctrl->queues[qid - 1] = q;
+    return true;
+}
+
+// Runs identify, with data going to buf
+static bool ioNvmeIdentify (ioNvmeCtrl_t* ctrl, int cns, uint32_t nsid, paddr_t buf)
+{
+    ioNvmeCmd_t cmd = {0};
+    cmd.opc = IO_NVME_ADM_IDENTIFY;
+    cmd.nsid = nsid;
+    cmd.prp1 = buf;
+    cmd.cdw10 = cns;
+    return !ioNvmeAdmin (ctrl, &cmd, NULL);
+}
+
+// Registers a namespace
+static void ioNvmeAddNs (ioNvmeCtrl_t* ctrl, uint32_t nsid, uint8_t* id)
+{
+    uint64_t numSectors = *(uint64_t*) (id + IO_NVME_ID_NSZE);
+    if (!numSectors)
+        return;    // Not active
+    int fmt = id[IO_NVME_ID_FLBAS] & 0xF;
+    uint32_t lbaf = *(uint32_t*) (id + IO_NVME_ID_LBAF + (fmt * 4));
+    ioNvmeNs_t* ns = kmalloc (sizeof (ioNvmeNs_t), MM_TAG_IO);
+    if (!ns)
+        return;
+    memset (ns, 0, sizeof (ioNvmeNs_t));
+    ns->ctrl = ctrl;
+    ns->nsid = nsid;
+    IoBlockDev_t* blk = &ns->blk;
+    sprintf (blk->name, "nvme%dn%u", ctrl->id, nsid);
+    blk->sectorSize = 1 << ((lbaf >> 16) & 0xFF);
+    blk->numSectors = numSectors;
+    blk->maxSectors = ctrl->maxXfer / blk->sectorSize;
+    blk->numQueues = ctrl->numQueues;
+    blk->numPollQueues = ctrl->numPoll;
+    blk->submit = ioNvmeSubmit;
+    blk->commit = ioNvmeCommit;
+    blk->poll = ioNvmePoll;
+    blk->drvData = ns;
+    IoRegisterBlockDev (blk);
+}
+
+// Probes an NVMe controller
+bool IoNvmeProbe (PltPciDev_t* dev)
+{
+    ioNvmeCtrl_t* ctrl = kmalloc (sizeof (ioNvmeCtrl_t), MM_TAG_IO);
+    if (!ctrl)
+        return false;
+    memset (ctrl, 0, sizeof (ioNvmeCtrl_t));
+    ctrl->pci = dev;
+    ctrl->regs = PltPciMapBar (dev, 0, NULL);
+    if (!ctrl->regs)
+        goto fail;
+    PltPciEnable (dev, PLT_PCI_CMD_MEM | PLT_PCI_CMD_MASTER);
+    int numVecs = PltPciEnableMsix (dev);
+    if (numVecs < 2)
+    {
+        NkLogWarning ("nexke: NVMe controller without MSI-X isn't supported\n");
+        goto fail;
+    }
+    uint64_t cap = ioNvmeRead64 (ctrl, IO_NVME_CAP);
+    ctrl->dbStride = 4 << IO_NVME_CAP_DSTRD (cap);
+    ctrl->maxDepth = IO_NVME_CAP_MQES (cap) + 1;
+    int pageShift = __builtin_ctz (NEXKE_CPU_PAGESZ);
+    if (IO_NVME_CAP_MPSMIN (cap) + 12 > pageShift)
+        goto fail;
+    // Reset it
+    ioNvmeWrite32 (ctrl, IO_NVME_CC, 0);
+    if (!ioNvmeWaitReady (ctrl, cap, false))
+        goto fail;
+    // Set up admin queue
+    paddr_t asq = 0, acq = 0;
+    int adminDepth = (ctrl->maxDepth < IO_NVME_ADMIN_DEPTH) ? ctrl->maxDepth : IO_NVME_ADMIN_DEPTH;
+    if (!ioNvmeInitQueue (ctrl, &ctrl->admin, 0, adminDepth, &asq, &acq))
+        goto fail;
+    ctrl->admin.polled = true;
+    ioNvmeWrite32 (ctrl, IO_NVME_AQA, ((adminDepth - 1) << 16) | (adminDepth - 1));
+    ioNvmeWrite64 (ctrl, IO_NVME_ASQ, asq);
+    ioNvmeWrite64 (ctrl, IO_NVME_ACQ, acq);
+    ioNvmeWrite32 (ctrl,
+                   IO_NVME_CC,
+                   IO_NVME_CC_IOSQES | IO_NVME_CC_IOCQES |
+                       ((pageShift - 12) << IO_NVME_CC_MPS_SHIFT) | IO_NVME_CC_EN);
+    if (!ioNvmeWaitReady (ctrl, cap, true))
+        goto fail;
+    // Identify controller
+    ctrl->prpPool = MmCreateDmaPool ("nvme", NEXKE_CPU_PAGESZ, NEXKE_CPU_PAGESZ, (paddr_t) -1, 0);
+    paddr_t idPhys = 0;
+    uint8_t* id = ctrl->prpPool ? MmDmaAlloc (ctrl->prpPool, &idPhys) : NULL;
+    if (!id || !ioNvmeIdentify (ctrl, IO_NVME_ID_CTRL, 0, idPhys))
+        goto fail;
+    // Transfers are limited by MDTS, and by what one PRP list can hold
+    ctrl->maxXfer = (NEXKE_CPU_PAGESZ / sizeof (uint64_t)) * NEXKE_CPU_PAGESZ;
+    int mdts = id[IO_NVME_ID_MDTS];
+    if (mdts)
+    {
+        size_t mdtsXfer = (size_t) 1 << (mdts + 12 + IO_NVME_CAP_MPSMIN (cap));
+        if (mdtsXfer < ctrl->maxXfer)
+            ctrl->maxXfer = mdtsXfer;
+    }
+    uint32_t numNs = *(uint32_t*) (id + IO_NVME_ID_NN);
+    // Ask for a queue for each CPU, and the polled queues
+    const char* pollArg = NkReadArg ("-nvmepoll");
+    int numPoll = (pollArg && *pollArg) ? atoi (pollArg) : 0;
+    int numQueues = NkGetNumCpus();
+    if (numQueues > (numVecs - 1))
+        numQueues = numVecs - 1;
+    ioNvmeCmd_t cmd = {0};
+    cmd.opc = IO_NVME_ADM_SET_FEAT;
+    cmd.cdw10 = IO_NVME_FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((numQueues + numPoll - 1) << 16) | (numQueues + numPoll - 1);
+    uint32_t granted = 0;
+    if (ioNvmeAdmin (ctrl, &cmd, &granted))
+        goto fail;
+    // Interrupt queues come first, polled ones get what's left
+    int maxQueues = (granted & 0xFFFF) + 1;
+    if (((granted >> 16) + 1) < maxQueues)
+        maxQueues = (granted >> 16) + 1;
+    if (numQueues > maxQueues)
+        numQueues = maxQueues;
+    if (numPoll > (maxQueues - numQueues))
+        numPoll = maxQueues - numQueues;
+    ctrl->queues = kmalloc ((numQueues + numPoll) * sizeof (ioNvmeQueue_t*), MM_TAG_IO);
+    if (!ctrl->queues)
+        goto fail;
+    for (int i = 0; i < numQueues; ++i)
+    {
+        if (!ioNvmeCreateQueue (ctrl, i + 1, i))
+            goto fail;
+    }
+    for (int i = 0; i < numPoll; ++i)
+    {
+        if (!ioNvmeCreateQueue (ctrl, numQueues + i + 1, -1))
+            goto fail;
+    }
+    ctrl->numQueues = numQueues;
+    ctrl->numPoll = numPoll;
+    ctrl->id = ioNvmeNumCtrls++;
+    NkLogInfo ("nexke: NVMe controller %d, version %#x, %d queues, %d polled, %zu byte transfers\n",
+               ctrl->id,
+               ioNvmeRead32 (ctrl, IO_NVME_VS),
+               numQueues,
+               numPoll,
+               ctrl->maxXfer);
+    for (uint32_t nsid = 1; nsid <= numNs; ++nsid)
+    {
+        if (ioNvmeIdentify (ctrl, IO_NVME_ID_NS, nsid, idPhys))
+            ioNvmeAddNs (ctrl, nsid, id);
+    }
+    MmDmaFree (ctrl->prpPool, id);
+    return true;
+fail:
+    // Whatever was set up stays, but the controller is left disabled
+    if (ctrl->regs)
+        ioNvmeWrite32 (ctrl, IO_NVME_CC, 0);
+    NkLogWarning ("nexke: unable to set up NVMe controller\n");
+    return false;
+}
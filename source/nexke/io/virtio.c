@@ -0,0 +1,459 @@
+/*
+    virtio.c - contains virtio PCI transport
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io/virtio.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <string.h>
+
+// Under a hypervisor, every kick and every interrupt is an exit, which costs far more than the
+// I/O it's about. So kicks and interrupts are kept to as few as possible
+// Submitting only fills in the available ring, and the index the device looks at is moved once
+// per batch by a kick. With EVENT_IDX, the device says which index it wants to be kicked at, and
+// we only notify it when a batch goes past that, so a device that's still busy with a queue
+// doesn't get told about it again. The other way around, we say which used index we want an
+// interrupt at. That's the next one normally, and for lazy queues, like ones that send, it's
+// when most of what's outstanding is done, as nobody is waiting on those
+// Requests each take one descriptor in the ring, pointing to an indirect table, so the ring holds
+// as many requests as it has entries no matter how scattered they are
+// Queue interrupts only mask their MSI-X entry and leave the reaping to a poll, so a busy queue
+// gets drained in batches without an interrupt for each
+
+// Vendor capability
+#define IO_VIRT_CAP_TYPE       3
+#define IO_VIRT_CAP_BAR        4
+#define IO_VIRT_CAP_OFFSET     8
+#define IO_VIRT_CAP_NOTIFY_MUL 16
+
+#define IO_VIRT_CAP_COMMON 1
+#define IO_VIRT_CAP_NOTIFY 2
+#define IO_VIRT_CAP_DEVICE 4
+
+// Common config
+#define IO_VIRT_DEV_FEAT_SEL 0
+#define IO_VIRT_DEV_FEAT     4
+#define IO_VIRT_DRV_FEAT_SEL 8
+#define IO_VIRT_DRV_FEAT     12
+#define IO_VIRT_MSIX_CONFIG  16
+#define IO_VIRT_STATUS       20
+#define IO_VIRT_CFG_GEN      21
+#define IO_VIRT_Q_SELECT     22
+#define IO_VIRT_Q_SIZE       24
+#define IO_VIRT_Q_MSIX       26
+#define IO_VIRT_Q_ENABLE     28
+#define IO_VIRT_Q_NOTIFY_OFF 30
+#define IO_VIRT_Q_DESC       32
+#define IO_VIRT_Q_DRIVER     40
+#define IO_VIRT_Q_DEVICE     48
+
+#define IO_VIRT_NO_VECTOR 0xFFFF
+
+// Device status
+#define IO_VIRT_STATUS_ACK         (1 << 0)
+#define IO_VIRT_STATUS_DRIVER      (1 << 1)
+#define IO_VIRT_STATUS_DRIVER_OK   (1 << 2)
+#define IO_VIRT_STATUS_FEATURES_OK (1 << 3)
+#define IO_VIRT_STATUS_FAILED      (1 << 7)
+
+#define IO_VIRT_MAX_SIZE   256
+#define IO_VIRT_REAP_BATCH 16
+#define IO_VIRT_IPL        16
+
+// Used buffer
+typedef struct _iovirtdone
+{
+    void* token;
+    uint32_t len;
+} ioVirtDone_t;
+
+// Common config access
+static FORCEINLINE uint8_t ioVirtRead8 (IoVirtDev_t* dev, int reg)
+{
+    return dev->common[reg];
+}
+
+static FORCEINLINE uint16_t ioVirtRead16 (IoVirtDev_t* dev, int reg)
+{
+    return *(volatile uint16_t*) (dev->common + reg);
+}
+
+static FORCEINLINE uint32_t ioVirtRead32 (IoVirtDev_t* dev, int reg)
+{
+    return *(volatile uint32_t*) (dev->common + reg);
+}
+
+static FORCEINLINE void ioVirtWrite8 (IoVirtDev_t* dev, int reg, uint8_t val)
+{
+    dev->common[reg] = val;
+}
+
+static FORCEINLINE void ioVirtWrite16 (IoVirtDev_t* dev, int reg, uint16_t val)
+{
+    *(volatile uint16_t*) (dev->common + reg) = val;
+}
+
+static FORCEINLINE void ioVirtWrite32 (IoVirtDev_t* dev, int reg, uint32_t val)
+{
+    *(volatile uint32_t*) (dev->common + reg) = val;
+}
+
+static FORCEINLINE void ioVirtWrite64 (IoVirtDev_t* dev, int reg, uint64_t val)
+{
+    ioVirtWrite32 (dev, reg, (uint32_t) val);
+    ioVirtWrite32 (dev, reg + 4, (uint32_t) (val >> 32));
+}
+
+// Locks a queue. Interrupt queues are reaped from their interrupt, so IPL has to go up to it
+static FORCEINLINE ipl_t ioVirtLock (IoVirtQueue_t* q)
+{
+    ipl_t ipl = PltRaiseIpl (q->polled ? PltGetIpl() : q->hwInt.ipl);
+    NkSpinLock (&q->lock);
+    return ipl;
+}
+
+static FORCEINLINE void ioVirtUnlock (IoVirtQueue_t* q, ipl_t ipl)
+{
+    NkSpinUnlock (&q->lock);
+    PltLowerIpl (ipl);
+}
+
+// Maps the structure a vendor capability points to
+static volatile uint8_t* ioVirtMapCap (PltPciDev_t* pci, int cap)
+{
+    int bar = PltPciRead8 (pci, cap + IO_VIRT_CAP_BAR);
+    uint32_t off = PltPciRead32 (pci, cap + IO_VIRT_CAP_OFFSET);
+    if (bar >= PLT_PCI_MAX_BARS)
+        return NULL;
+    volatile uint8_t* base = PltPciMapBar (pci, bar, NULL);
+    return base ? base + off : NULL;
+}
+
+// Sets bits in device status
+static void ioVirtSetStatus (IoVirtDev_t* dev, uint8_t bits)
+{
+    ioVirtWrite8 (dev, IO_VIRT_STATUS, ioVirtRead8 (dev, IO_VIRT_STATUS) | bits);
+}
+
+// Sets up a device
+bool IoVirtInit (IoVirtDev_t* dev, PltPciDev_t* pci, uint64_t wanted)
+{
+    memset (dev, 0, sizeof (IoVirtDev_t));
+    dev->pci = pci;
+    int cap = 0;
+    while ((cap = PltPciFindNextCap (pci, PLT_PCI_CAP_VENDOR, cap)))
+    {
+        int type = PltPciRead8 (pci, cap + IO_VIRT_CAP_TYPE);
+        // The first of each type is the one to use
+        if (type == IO_VIRT_CAP_COMMON && !dev->common)
+            dev->common = ioVirtMapCap (pci, cap);
+        else if (type == IO_VIRT_CAP_NOTIFY && !dev->notify)
+        {
+            dev->notify = ioVirtMapCap (pci, cap);
+            dev->notifyMul = PltPciRead32 (pci, cap + IO_VIRT_CAP_NOTIFY_MUL);
+        }
+        else if (type == IO_VIRT_CAP_DEVICE && !dev->devCfg)
+            dev->devCfg = ioVirtMapCap (pci, cap);
+    }
+    if (!dev->common || !dev->notify)
+        return false;
+    PltPciEnable (pci, PLT_PCI_CMD_MEM | PLT_PCI_CMD_MASTER);
+    dev->numVecs = PltPciEnableMsix (pci);
+    // Reset it, and wait for it to finish
+    ioVirtWrite8 (dev, IO_VIRT_STATUS, 0);
+    while (ioVirtRead8 (dev, IO_VIRT_STATUS))
+        CpuSpin();
+    ioVirtSetStatus (dev, IO_VIRT_STATUS_ACK | IO_VIRT_STATUS_DRIVER);
+    ioVirtWrite32 (dev, IO_VIRT_DEV_FEAT_SEL, 0);
+    uint64_t features = ioVirtRead32 (dev, IO_VIRT_DEV_FEAT);
+    ioVirtWrite32 (dev, IO_VIRT_DEV_FEAT_SEL, 1);
+    features |= (uint64_t) ioVirtRead32 (dev, IO_VIRT_DEV_FEAT) << 32;
+    dev->features = features & (wanted | IO_VIRT_FEATURE (IO_VIRT_F_VERSION_1));
+    if (!IoVirtHasFeature (dev, IO_VIRT_F_VERSION_1))
+        goto fail;
+    ioVirtWrite32 (dev, IO_VIRT_DRV_FEAT_SEL, 0);
+    ioVirtWrite32 (dev, IO_VIRT_DRV_FEAT, (uint32_t) dev->features);
+    ioVirtWrite32 (dev, IO_VIRT_DRV_FEAT_SEL, 1);
+    ioVirtWrite32 (dev, IO_VIRT_DRV_FEAT, (uint32_t) (dev->features >> 32));
+    ioVirtSetStatus (dev, IO_VIRT_STATUS_FEATURES_OK);
+    if (!(ioVirtRead8 (dev, IO_VIRT_STATUS) & IO_VIRT_STATUS_FEATURES_OK))
+        goto fail;
+    // We don't want to hear about config changes
+    ioVirtWrite16 (dev, IO_VIRT_MSIX_CONFIG, IO_VIRT_NO_VECTOR);
+    return true;
+fail:
+    IoVirtFail (dev);
+    return false;
+}
+
+// Reads device config
+void IoVirtReadCfg (IoVirtDev_t* dev, int off, void* buf, size_t len)
+{
+    // Fields have to be read with accesses as wide as they are, and 64 bit ones as two halves
+    // The generation changes if the device changed them while we were reading
+    uint8_t gen;
+    do
+    {
+        gen = ioVirtRead8 (dev, IO_VIRT_CFG_GEN);
+        volatile uint8_t* cfg = dev->devCfg + off;
+        if (len == 2)
+            *(uint16_t*) buf = *(volatile uint16_t*) cfg;
+        else if (len == 4 || len == 8)
+        {
+            for (size_t i = 0; i < len; i += 4)
+                ((uint32_t*) buf)[i / 4] = *(volatile uint32_t*) (cfg + i);
+        }
+        else
+        {
+            for (size_t i = 0; i < len; ++i)
+                ((uint8_t*) buf)[i] = cfg[i];
+        }
+    } while (gen != ioVirtRead8 (dev, IO_VIRT_CFG_GEN));
+}
+
+// Lets device start
+void IoVirtReady (IoVirtDev_t* dev)
+{
+    ioVirtSetStatus (dev, IO_VIRT_STATUS_DRIVER_OK);
+}
+
+// Marks device as failed
+void IoVirtFail (IoVirtDev_t* dev)
+{
+    ioVirtSetStatus (dev, IO_VIRT_STATUS_FAILED);
+}
+
+static int ioVirtReap (IoVirtQueue_t* q, int budget);
+
+// Interrupt of a queue
+static bool ioVirtInterrupt (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    PltSchedulePoll (PltGetMsiHwInt (intObj)->poll);
+    return true;
+}
+
+// Polls a queue
+static int ioVirtPoll (PltPoll_t* poll, int budget)
+{
+    return ioVirtReap (LINK_CONTAINER (poll, IoVirtQueue_t, poll), budget);
+}
+
+// Masks the interrupt of a queue
+static void ioVirtMask (PltPoll_t* poll, bool mask)
+{
+    IoVirtQueue_t* q = LINK_CONTAINER (poll, IoVirtQueue_t, poll);
+    PltPciMaskMsix (q->dev->pci, q->vec, mask);
+}
+
+// Sets up a queue
+IoVirtQueue_t* IoVirtSetupQueue (IoVirtDev_t* dev, int idx, int cpuNum, int vec, IoVirtDone done)
+{
+    ioVirtWrite16 (dev, IO_VIRT_Q_SELECT, idx);
+    uint16_t size = ioVirtRead16 (dev, IO_VIRT_Q_SIZE);
+    if (!size)
+        return NULL;
+    if (size > IO_VIRT_MAX_SIZE)
+    {
+        size = IO_VIRT_MAX_SIZE;
+        ioVirtWrite16 (dev, IO_VIRT_Q_SIZE, size);
+    }
+    IoVirtQueue_t* q = kmalloc (sizeof (IoVirtQueue_t), MM_TAG_IO);
+    if (!q)
+        return NULL;
+    memset (q, 0, sizeof (IoVirtQueue_t));
+    q->dev = dev;
+    q->idx = idx;
+    q->size = size;
+    q->done = done;
+    q->polled = cpuNum < 0;
+    // Everything goes in one contiguous run of pages, with the used ring on a page of its own so
+    // the device's writes to it don't share cache lines with ours
+    size_t availOff = size * sizeof (IoVirtDesc_t);
+    size_t usedOff = CpuPageAlignUp (availOff + sizeof (IoVirtAvail_t) + ((size + 1) * 2));
+    size_t numPages =
+        CpuPageAlignUp (usedOff + sizeof (IoVirtUsed_t) + (size * sizeof (IoVirtUsedElem_t)) + 2) /
+        NEXKE_CPU_PAGESZ;
+    MmPage_t* pages = MmAllocPagesAt (numPages, 0, NEXKE_CPU_PAGESZ);
+    void* ring = pages ? MmMapKvContig (pages, numPages, 0) : NULL;
+    q->freeDescs = kmalloc (size * sizeof (uint16_t), MM_TAG_IO);
+    q->tokens = kmalloc (size * sizeof (void*), MM_TAG_IO);
+    if (!ring || !q->freeDescs || !q->tokens)
+        return NULL;
+    memset (ring, 0, numPages * NEXKE_CPU_PAGESZ);
+    paddr_t phys = MmGetPagePhys (pages);
+    q->desc = ring;
+    q->avail = ring + availOff;
+    q->used = ring + usedOff;
+    q->usedEvent = &q->avail->ring[size];
+    q->availEvent = (volatile uint16_t*) &q->used->ring[size];
+    for (int i = 0; i < size; ++i)
+        q->freeDescs[i] = (size - 1) - i;
+    q->numFree = size;
+    uint16_t msixVec = IO_VIRT_NO_VECTOR;
+    if (!q->polled)
+    {
+        PltMsiMsg_t msg = {0};
+        PltInitMsi (&q->hwInt, ioVirtInterrupt, IO_VIRT_IPL, 0);
+        PltInitPoll (&q->poll, &q->hwInt, ioVirtPoll, ioVirtMask, 0);
+        if (!PltConnectMsi (&q->hwInt, 1, cpuNum, &msg))
+            return NULL;
+        PltPciSetMsix (dev->pci, vec, &msg);
+        msixVec = vec;
+        q->vec = vec;
+    }
+    else
+        q->avail->flags = IO_VIRT_AVAIL_NO_INTERRUPT;
+    ioVirtWrite16 (dev, IO_VIRT_Q_MSIX, msixVec);
+    if (ioVirtRead16 (dev, IO_VIRT_Q_MSIX) != msixVec)
+        return NULL;
+    ioVirtWrite64 (dev, IO_VIRT_Q_DESC, phys);
+    ioVirtWrite64 (dev, IO_VIRT_Q_DRIVER, phys + availOff);
+    ioVirtWrite64 (dev, IO_VIRT_Q_DEVICE, phys + usedOff);
+    q->notify = (volatile uint16_t*) (dev->notify +
+                                      (ioVirtRead16 (dev, IO_VIRT_Q_NOTIFY_OFF) * dev->notifyMul));
+    ioVirtWrite16 (dev, IO_VIRT_Q_ENABLE, 1);
+    return q;
+}
+
+// Gets a free descriptor
+int IoVirtGetDesc (IoVirtQueue_t* q)
+{
+    int desc = -1;
+    ipl_t ipl = ioVirtLock (q);
+    if (q->numFree)
+        desc = q->freeDescs[--q->numFree];
+    ioVirtUnlock (q, ipl);
+    return desc;
+}
+
+// Gives back a descriptor
+void IoVirtPutDesc (IoVirtQueue_t* q, int desc)
+{
+    ipl_t ipl = ioVirtLock (q);
+    q->freeDescs[q->numFree++] = desc;
+    ioVirtUnlock (q, ipl);
+}
+
+// Makes a descriptor available
+void IoVirtSubmit (IoVirtQueue_t* q,
+                   int desc,
+                   paddr_t addr,
+                   uint32_t len,
+                   uint16_t flags,
+                   void* token)
+{
+    assert (desc < q->size);
+    ipl_t ipl = ioVirtLock (q);
+    q->desc[desc].addr = addr;
+    q->desc[desc].len = len;
+    q->desc[desc].flags = flags;
+    q->desc[desc].next = 0;
+    q->tokens[desc] = token;
+    q->avail->ring[q->availIdx % q->size] = desc;
+    ++q->availIdx;
+    ioVirtUnlock (q, ipl);
+}
+
+// Kicks the device
+void IoVirtKick (IoVirtQueue_t* q)
+{
+    ipl_t ipl = ioVirtLock (q);
+    uint16_t newIdx = q->availIdx;
+    uint16_t oldIdx = q->kickedIdx;
+    if (newIdx == oldIdx)
+    {
+        ioVirtUnlock (q, ipl);
+        return;
+    }
+    // The entries have to be there before the index says so, and the index has to be out before
+    // we look at whether the device wants to hear about it
+    __atomic_store_n (&q->avail->idx, newIdx, __ATOMIC_RELEASE);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    bool kick;
+    if (IoVirtHasFeature (q->dev, IO_VIRT_F_EVENT_IDX))
+        kick = (uint16_t) (newIdx - *q->availEvent - 1) < (uint16_t) (newIdx - oldIdx);
+    else
+        kick = !(__atomic_load_n (&q->used->flags, __ATOMIC_RELAXED) & IO_VIRT_USED_NO_NOTIFY);
+    q->kickedIdx = newIdx;
+    ioVirtUnlock (q, ipl);
+    if (kick)
+    {
+        CpuIoBarrier();
+        *q->notify = q->idx;
+    }
+}
+
+// Says which used index we want an interrupt at
+static FORCEINLINE void ioVirtSetUsedEvent (IoVirtQueue_t* q)
+{
+    uint16_t event = q->lastUsed;
+    if (q->lazy)
+        event += ((q->size - q->numFree) * 3) / 4;
+    *q->usedEvent = event;
+}
+
+// Reaps up to budget used buffers
+static int ioVirtReap (IoVirtQueue_t* q, int budget)
+{
+    bool eventIdx = IoVirtHasFeature (q->dev, IO_VIRT_F_EVENT_IDX);
+    int total = 0;
+    while (total < budget)
+    {
+        ioVirtDone_t done[IO_VIRT_REAP_BATCH];
+        int numDone = 0;
+        int batch = ((budget - total) < IO_VIRT_REAP_BATCH) ? (budget - total) : IO_VIRT_REAP_BATCH;
+        ipl_t ipl = ioVirtLock (q);
+        for (;;)
+        {
+            uint16_t usedIdx = __atomic_load_n (&q->used->idx, __ATOMIC_ACQUIRE);
+            while (q->lastUsed != usedIdx && numDone < batch)
+            {
+                IoVirtUsedElem_t* elem = &q->used->ring[q->lastUsed % q->size];
+                uint16_t desc = elem->id;
+                assert (desc < q->size);
+                done[numDone].token = q->tokens[desc];
+                done[numDone].len = elem->len;
+                ++numDone;
+                q->freeDescs[q->numFree++] = desc;
+                ++q->lastUsed;
+            }
+            if (numDone == batch || q->polled || !eventIdx)
+                break;
+            // Ask for the next interrupt, and look again, in case the device used something
+            // before it could see that
+            ioVirtSetUsedEvent (q);
+            __atomic_thread_fence (__ATOMIC_SEQ_CST);
+            if (__atomic_load_n (&q->used->idx, __ATOMIC_ACQUIRE) == q->lastUsed)
+                break;
+        }
+        ioVirtUnlock (q, ipl);
+        for (int i = 0; i < numDone; ++i)
+            q->done (q, done[i].token, done[i].len);
+        total += numDone;
+        if (numDone < batch)
+            break;
+    }
+    // Anything the callbacks put back goes out in one kick
+    IoVirtKick (q);
+    return total;
+}
+
+// Reaps used buffers
+int IoVirtReap (IoVirtQueue_t* q)
+{
+    return ioVirtReap (q, INT32_MAX);
+}
@@ -0,0 +1,247 @@
+/*
+    virtioblk.c - contains virtio block driver
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io/virtio.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <stdio.h>
+#include <string.h>
+
+// Each CPU gets a request queue with its own vector, as far as the device has queues
+// A request is a header, the data a page at a time, and a status byte, all in an indirect table
+// Each descriptor keeps a slot with its table, header and status once it first gets one
+
+// Features
+#define IO_VBLK_F_SEG_MAX  2
+#define IO_VBLK_F_BLK_SIZE 6
+#define IO_VBLK_F_FLUSH    9
+#define IO_VBLK_F_MQ       12
+
+// Config
+#define IO_VBLK_CFG_CAPACITY   0
+#define IO_VBLK_CFG_SEG_MAX    12
+#define IO_VBLK_CFG_BLK_SIZE   20
+#define IO_VBLK_CFG_NUM_QUEUES 34
+
+// Request types
+#define IO_VBLK_T_IN    0
+#define IO_VBLK_T_OUT   1
+#define IO_VBLK_T_FLUSH 4
+
+#define IO_VBLK_S_OK 0
+
+#define IO_VBLK_SECTOR   512    // Sectors in requests are always this big
+#define IO_VBLK_MAX_SEGS 128
+
+// Request header
+typedef struct _iovblkhdr
+{
+    uint32_t type;      // Request type
+    uint32_t resvd;
+    uint64_t sector;    // First sector, in 512 byte units
+} __attribute__ ((packed)) ioVBlkHdr_t;
+
+// Slot of a descriptor
+typedef struct _iovblkslot
+{
+    IoVirtDesc_t table[IO_VBLK_MAX_SEGS + 2];    // Indirect table
+    ioVBlkHdr_t hdr;                             // Header of request
+    uint8_t status;                              // Status the device writes
+    IoBlockReq_t* req;                           // Request in slot
+    paddr_t phys;                                // Physical address of slot
+} ioVBlkSlot_t;
+
+// Device
+typedef struct _iovblk
+{
+    IoBlockDev_t blk;          // Block device
+    IoVirtDev_t vdev;          // Virtio device
+    IoVirtQueue_t** queues;    // Request queues
+    MmDmaPool_t* pool;         // Pool of slots
+    int maxSegs;               // Most data segments in a request
+} ioVBlk_t;
+
+static int ioVBlkNumDevs = 0;
+
+// Finishes a request
+static void ioVBlkDone (IoVirtQueue_t* q, void* token, uint32_t len)
+{
+    ioVBlkSlot_t* slot = token;
+    IoBlockReq_t* req = slot->req;
+    slot->req = NULL;
+    IoBlockComplete (req, (slot->status == IO_VBLK_S_OK) ? IO_STATUS_OK : IO_STATUS_ERROR);
+}
+
+// Puts a request on a queue
+static bool ioVBlkSubmit (IoBlockDev_t* blk, int queue, IoBlockReq_t* req)
+{
+    ioVBlk_t* vblk = blk->drvData;
+    IoVirtQueue_t* q = vblk->queues[queue];
+    int desc = IoVirtGetDesc (q);
+    if (desc < 0)
+        return false;
+    // Only the descriptor's owner touches its slot, so this is safe unlocked
+    ioVBlkSlot_t** slots = q->priv;
+    ioVBlkSlot_t* slot = slots[desc];
+    if (!slot)
+    {
+        paddr_t phys = 0;
+        slot = MmDmaAlloc (vblk->pool, &phys);
+        if (!slot)
+        {
+            IoVirtPutDesc (q, desc);
+            return false;
+        }
+        slot->phys = phys;
+        slots[desc] = slot;
+    }
+    int n = 0;
+    slot->hdr.resvd = 0;
+    slot->hdr.sector = req->sector * (blk->sectorSize / IO_VBLK_SECTOR);
+    slot->table[n++] = (IoVirtDesc_t) {slot->phys + offsetof (ioVBlkSlot_t, hdr),
+                                       sizeof (ioVBlkHdr_t),
+                                       0,
+                                       0};
+    if (req->op == IO_BLOCK_FLUSH)
+        slot->hdr.type = IO_VBLK_T_FLUSH;
+    else
+    {
+        slot->hdr.type = (req->op == IO_BLOCK_WRITE) ? IO_VBLK_T_OUT : IO_VBLK_T_IN;
+        uint16_t flags = (req->op == IO_BLOCK_WRITE) ? 0 : IO_VIRT_DESC_WRITE;
+        size_t left = req->count * blk->sectorSize;
+        size_t off = req->offset;
+        for (int i = 0; left; ++i)
+        {
+            assert (n <= vblk->maxSegs);
+            size_t len = NEXKE_CPU_PAGESZ - off;
+            if (len > left)
+                len = left;
+            slot->table[n++] =
+                (IoVirtDesc_t) {MmGetPagePhys (req->pages[i]) + off, len, flags, 0};
+            left -= len;
+            off = 0;
+        }
+    }
+    slot->table[n++] = (IoVirtDesc_t) {slot->phys + offsetof (ioVBlkSlot_t, status),
+                                       1,
+                                       IO_VIRT_DESC_WRITE,
+                                       0};
+    for (int i = 0; i < (n - 1); ++i)
+    {
+        slot->table[i].flags |= IO_VIRT_DESC_NEXT;
+        slot->table[i].next = i + 1;
+    }
+    slot->req = req;
+    IoVirtSubmit (q, desc, slot->phys, n * sizeof (IoVirtDesc_t), IO_VIRT_DESC_INDIRECT, slot);
+    return true;
+}
+
+// Kicks a queue
+static void ioVBlkCommit (IoBlockDev_t* blk, int queue)
+{
+    ioVBlk_t* vblk = blk->drvData;
+    IoVirtKick (vblk->queues[queue]);
+}
+
+// Polls a queue
+static int ioVBlkPoll (IoBlockDev_t* blk, int queue)
+{
+    ioVBlk_t* vblk = blk->drvData;
+    return IoVirtReap (vblk->queues[queue]);
+}
+
+// Probes a virtio block device
+bool IoVirtBlkProbe (PltPciDev_t* dev)
+{
+    ioVBlk_t* vblk = kmalloc (sizeof (ioVBlk_t), MM_TAG_IO);
+    if (!vblk)
+        return false;
+    memset (vblk, 0, sizeof (ioVBlk_t));
+    IoVirtDev_t* vdev = &vblk->vdev;
+    uint64_t wanted = IO_VIRT_FEATURE (IO_VIRT_F_INDIRECT) | IO_VIRT_FEATURE (IO_VIRT_F_EVENT_IDX) |
+                      IO_VIRT_FEATURE (IO_VBLK_F_SEG_MAX) | IO_VIRT_FEATURE (IO_VBLK_F_BLK_SIZE) |
+                      IO_VIRT_FEATURE (IO_VBLK_F_FLUSH) | IO_VIRT_FEATURE (IO_VBLK_F_MQ);
+    if (!IoVirtInit (vdev, dev, wanted))
+        return false;
+    // Requests don't fit in the ring without indirect tables, and we need vectors to spread
+    if (!IoVirtHasFeature (vdev, IO_VIRT_F_INDIRECT) || !vdev->numVecs || !vdev->devCfg)
+    {
+        NkLogWarning ("nexke: virtio-blk without indirect descriptors or MSI-X isn't supported\n");
+        goto fail;
+    }
+    IoBlockDev_t* blk = &vblk->blk;
+    blk->sectorSize = IO_VBLK_SECTOR;
+    if (IoVirtHasFeature (vdev, IO_VBLK_F_BLK_SIZE))
+    {
+        uint32_t blkSize = 0;
+        IoVirtReadCfg (vdev, IO_VBLK_CFG_BLK_SIZE, &blkSize, sizeof (uint32_t));
+        if (blkSize >= IO_VBLK_SECTOR && !(blkSize & (blkSize - 1)))
+            blk->sectorSize = blkSize;
+    }
+    uint64_t capacity = 0;
+    IoVirtReadCfg (vdev, IO_VBLK_CFG_CAPACITY, &capacity, sizeof (uint64_t));
+    blk->numSectors = capacity / (blk->sectorSize / IO_VBLK_SECTOR);
+    vblk->maxSegs = IO_VBLK_MAX_SEGS;
+    if (IoVirtHasFeature (vdev, IO_VBLK_F_SEG_MAX))
+    {
+        uint32_t segMax = 0;
+        IoVirtReadCfg (vdev, IO_VBLK_CFG_SEG_MAX, &segMax, sizeof (uint32_t));
+        if (segMax && segMax < vblk->maxSegs)
+            vblk->maxSegs = segMax;
+    }
+    uint16_t devQueues = 1;
+    if (IoVirtHasFeature (vdev, IO_VBLK_F_MQ))
+        IoVirtReadCfg (vdev, IO_VBLK_CFG_NUM_QUEUES, &devQueues, sizeof (uint16_t));
+    int numQueues = NkGetNumCpus();
+    if (numQueues > devQueues)
+        numQueues = devQueues;
+    if (numQueues > vdev->numVecs)
+        numQueues = vdev->numVecs;
+    vblk->pool = MmCreateDmaPool ("virtio-blk", sizeof (ioVBlkSlot_t), 16, (paddr_t) -1, 0);
+    vblk->queues = kmalloc (numQueues * sizeof (IoVirtQueue_t*), MM_TAG_IO);
+    if (!vblk->pool || !vblk->queues)
+        goto fail;
+    for (int i = 0; i < numQueues; ++i)
+    {
+        IoVirtQueue_t* q = IoVirtSetupQueue (vdev, i, i, i, ioVBlkDone);
+        if (!q)
+            goto fail;
+        q->priv = kmalloc (q->size * sizeof (ioVBlkSlot_t*), MM_TAG_IO);
+        if (!q->priv)
+            goto fail;
+        memset (q->priv, 0, q->size * sizeof (ioVBlkSlot_t*));
+        // A chain can't be longer than the queue
+        if (vblk->maxSegs > (q->size - 2))
+            vblk->maxSegs = q->size - 2;
+        vblk->queues[i] = q;
+    }
+    IoVirtReady (vdev);
+    // A request is cut into pages, and the first one can start part way in
+    sprintf (blk->name, "vblk%d", ioVBlkNumDevs++);
+    blk->maxSectors = ((vblk->maxSegs - 1) * NEXKE_CPU_PAGESZ) / blk->sectorSize;
+    blk->numQueues = numQueues;
+    blk->submit = ioVBlkSubmit;
+    blk->commit = ioVBlkCommit;
+    blk->poll = ioVBlkPoll;
+    blk->drvData = vblk;
+    IoRegisterBlockDev (blk);
+    return true;
+fail:
+    IoVirtFail (vdev);
+    return false;
+}
@@ -0,0 +1,319 @@
+/*
+    virtionet.c - contains virtio network driver
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io/virtio.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <stdio.h>
+#include <string.h>
+
+// Each CPU gets a receive and a send queue, each with its own vector, as far as the device has
+// queue pairs. Using more than one pair has to be turned on through the control queue
+// Receive buffers are posted once and go straight back to the device after recv is done with
+// them, with one kick for everything that came in with an interrupt
+// Send queues are lazy, as nobody waits for a frame to be sent. Sent frames are mostly reaped
+// when the queue runs out of room, and the device only interrupts when most of what's out has
+// been sent. A frame goes out as the header and the frame in an indirect table, so it's never
+// copied
+
+// Features
+#define IO_VNET_F_MTU     3
+#define IO_VNET_F_MAC     5
+#define IO_VNET_F_CTRL_VQ 17
+#define IO_VNET_F_MQ      22
+
+// Config
+#define IO_VNET_CFG_MAC       0
+#define IO_VNET_CFG_MAX_PAIRS 8
+#define IO_VNET_CFG_MTU       10
+
+// Control commands
+#define IO_VNET_CTRL_MQ           4
+#define IO_VNET_CTRL_MQ_PAIRS_SET 0
+#define IO_VNET_OK                0
+
+#define IO_VNET_HDR_SZ  12      // Header in front of every frame
+#define IO_VNET_BUF_SZ  2048    // Size of receive buffers
+#define IO_VNET_RX_BUFS 128     // Most receive buffers per queue
+#define IO_VNET_MTU     1500
+
+// Slot of a send descriptor
+typedef struct _iovnettx
+{
+    IoVirtDesc_t table[2];           // Indirect table
+    uint8_t hdr[IO_VNET_HDR_SZ];     // Header of frame, all zeroes
+    IoNetBuf_t* buf;                 // Frame in slot
+    paddr_t phys;                    // Physical address of slot
+} ioVNetTx_t;
+
+// Receive buffer
+typedef struct _iovnetrx
+{
+    uint8_t* data;    // Buffer
+    paddr_t phys;     // Physical address of buffer
+} ioVNetRx_t;
+
+// Control command
+typedef struct _iovnetctrl
+{
+    IoVirtDesc_t table[2];    // Indirect table
+    uint8_t class;            // Command class
+    uint8_t cmd;              // Command
+    uint16_t arg;             // Argument
+    uint8_t ack;              // Status the device writes
+} __attribute__ ((packed)) ioVNetCtrl_t;
+
+typedef struct _iovnet ioVNet_t;
+
+// Queue's data
+typedef struct _iovnetqueue
+{
+    ioVNet_t* vnet;        // Device queue is on
+    ioVNetTx_t** tx;       // Send slots by descriptor
+    ioVNetRx_t* rx;        // Receive buffers
+} ioVNetQueue_t;
+
+// Device
+typedef struct _iovnet
+{
+    IoNetDev_t net;            // Network device
+    IoVirtDev_t vdev;          // Virtio device
+    IoVirtQueue_t** rxq;       // Receive queues
+    IoVirtQueue_t** txq;       // Send queues
+    MmDmaPool_t* bufPool;      // Pool of receive buffers
+    MmDmaPool_t* txPool;       // Pool of send slots
+} ioVNet_t;
+
+static int ioVNetNumDevs = 0;
+
+// Hands a received frame up and gives the buffer back
+static void ioVNetRxDone (IoVirtQueue_t* q, void* token, uint32_t len)
+{
+    ioVNetQueue_t* vq = q->priv;
+    ioVNetRx_t* rx = token;
+    IoNetDev_t* net = &vq->vnet->net;
+    void (*recv) (IoNetDev_t*, const void*, size_t) = net->recv;
+    if (recv && len > IO_VNET_HDR_SZ)
+        recv (net, rx->data + IO_VNET_HDR_SZ, len - IO_VNET_HDR_SZ);
+    // The descriptor it came in on was just freed, so there's one to put it back on
+    int desc = IoVirtGetDesc (q);
+    assert (desc >= 0);
+    IoVirtSubmit (q, desc, rx->phys, IO_VNET_BUF_SZ, IO_VIRT_DESC_WRITE, rx);
+}
+
+// Finishes a sent frame
+static void ioVNetTxDone (IoVirtQueue_t* q, void* token, uint32_t len)
+{
+    ioVNetTx_t* slot = token;
+    IoNetBuf_t* buf = slot->buf;
+    slot->buf = NULL;
+    if (buf->done)
+        buf->done (buf);
+}
+
+// Puts a frame on a send queue
+static bool ioVNetXmit (IoNetDev_t* net, int queue, IoNetBuf_t* buf)
+{
+    ioVNet_t* vnet = net->drvData;
+    IoVirtQueue_t* q = vnet->txq[queue];
+    ioVNetQueue_t* vq = q->priv;
+    int desc = IoVirtGetDesc (q);
+    if (desc < 0)
+    {
+        // Sent frames are only reaped when we have to
+        IoVirtReap (q);
+        if ((desc = IoVirtGetDesc (q)) < 0)
+            return false;
+    }
+    ioVNetTx_t* slot = vq->tx[desc];
+    if (!slot)
+    {
+        paddr_t phys = 0;
+        slot = MmDmaAlloc (vnet->txPool, &phys);
+        if (!slot)
+        {
+            IoVirtPutDesc (q, desc);
+            return false;
+        }
+        memset (slot, 0, sizeof (ioVNetTx_t));
+        slot->phys = phys;
+        vq->tx[desc] = slot;
+    }
+    slot->table[0] = (IoVirtDesc_t) {slot->phys + offsetof (ioVNetTx_t, hdr),
+                                     IO_VNET_HDR_SZ,
+                                     IO_VIRT_DESC_NEXT,
+                                     1};
+    slot->table[1] = (IoVirtDesc_t) {buf->phys, buf->len, 0, 0};
+    slot->buf = buf;
+    IoVirtSubmit (q, desc, slot->phys, sizeof (slot->table), IO_VIRT_DESC_INDIRECT, slot);
+    return true;
+}
+
+// Kicks a send queue
+static void ioVNetFlush (IoNetDev_t* net, int queue)
+{
+    ioVNet_t* vnet = net->drvData;
+    IoVirtKick (vnet->txq[queue]);
+}
+
+// Allocates a queue's data
+static ioVNetQueue_t* ioVNetInitQueue (ioVNet_t* vnet, IoVirtQueue_t* q, bool rx)
+{
+    ioVNetQueue_t* vq = kmalloc (sizeof (ioVNetQueue_t), MM_TAG_IO);
+    if (!vq)
+        return NULL;
+    memset (vq, 0, sizeof (ioVNetQueue_t));
+    vq->vnet = vnet;
+    q->priv = vq;
+    if (!rx)
+    {
+        vq->tx = kmalloc (q->size * sizeof (ioVNetTx_t*), MM_TAG_IO);
+        if (!vq->tx)
+            return NULL;
+        memset (vq->tx, 0, q->size * sizeof (ioVNetTx_t*));
+        q->lazy = true;
+        return vq;
+    }
+    // Fill the queue with receive buffers
+    int numBufs = (q->size < IO_VNET_RX_BUFS) ? q->size : IO_VNET_RX_BUFS;
+    vq->rx = kmalloc (numBufs * sizeof (ioVNetRx_t), MM_TAG_IO);
+    if (!vq->rx)
+        return NULL;
+    for (int i = 0; i < numBufs; ++i)
+    {
+        vq->rx[i].data = MmDmaAlloc (vnet->bufPool, &vq->rx[i].phys);
+        if (!vq->rx[i].data)
+            return NULL;
+        IoVirtSubmit (q, IoVirtGetDesc (q), vq->rx[i].phys, IO_VNET_BUF_SZ, IO_VIRT_DESC_WRITE,
+                      &vq->rx[i]);
+    }
+    return vq;
+}
+
+// Tells the device how many queue pairs we use
+static bool ioVNetSetPairs (ioVNet_t* vnet, IoVirtQueue_t* ctrlq, int pairs)
+{
+    paddr_t phys = 0;
+    ioVNetCtrl_t* ctrl = MmDmaAlloc (vnet->bufPool, &phys);
+    if (!ctrl)
+        return false;
+    ctrl->class = IO_VNET_CTRL_MQ;
+    ctrl->cmd = IO_VNET_CTRL_MQ_PAIRS_SET;
+    ctrl->arg = pairs;
+    ctrl->ack = 0xFF;
+    ctrl->table[0] =
+        (IoVirtDesc_t) {phys + offsetof (ioVNetCtrl_t, class), 4, IO_VIRT_DESC_NEXT, 1};
+    ctrl->table[1] =
+        (IoVirtDesc_t) {phys + offsetof (ioVNetCtrl_t, ack), 1, IO_VIRT_DESC_WRITE, 0};
+    IoVirtSubmit (ctrlq, IoVirtGetDesc (ctrlq), phys, sizeof (ctrl->table), IO_VIRT_DESC_INDIRECT,
+                  ctrl);
+    IoVirtKick (ctrlq);
+    while (!IoVirtReap (ctrlq))
+        CpuSpin();
+    bool ok = ctrl->ack == IO_VNET_OK;
+    MmDmaFree (vnet->bufPool, ctrl);
+    return ok;
+}
+
+// Control queue completions are waited for by polling
+static void ioVNetCtrlDone (IoVirtQueue_t* q, void* token, uint32_t len)
+{
+}
+
+// Probes a virtio network device
+bool IoVirtNetProbe (PltPciDev_t* dev)
+{
+    ioVNet_t* vnet = kmalloc (sizeof (ioVNet_t), MM_TAG_IO);
+    if (!vnet)
+        return false;
+    memset (vnet, 0, sizeof (ioVNet_t));
+    IoVirtDev_t* vdev = &vnet->vdev;
+    uint64_t wanted = IO_VIRT_FEATURE (IO_VIRT_F_INDIRECT) | IO_VIRT_FEATURE (IO_VIRT_F_EVENT_IDX) |
+                      IO_VIRT_FEATURE (IO_VNET_F_MTU) | IO_VIRT_FEATURE (IO_VNET_F_MAC) |
+                      IO_VIRT_FEATURE (IO_VNET_F_CTRL_VQ) | IO_VIRT_FEATURE (IO_VNET_F_MQ);
+    if (!IoVirtInit (vdev, dev, wanted))
+        return false;
+    if (!IoVirtHasFeature (vdev, IO_VIRT_F_INDIRECT) || vdev->numVecs < 2 || !vdev->devCfg)
+    {
+        NkLogWarning ("nexke: virtio-net without indirect descriptors or MSI-X isn't supported\n");
+        goto fail;
+    }
+    IoNetDev_t* net = &vnet->net;
+    if (IoVirtHasFeature (vdev, IO_VNET_F_MAC))
+        IoVirtReadCfg (vdev, IO_VNET_CFG_MAC, net->mac, sizeof (net->mac));
+    net->mtu = IO_VNET_MTU;
+    if (IoVirtHasFeature (vdev, IO_VNET_F_MTU))
+    {
+        uint16_t mtu = 0;
+        IoVirtReadCfg (vdev, IO_VNET_CFG_MTU, &mtu, sizeof (uint16_t));
+        // Receive buffers only hold so much
+        if (mtu && mtu < net->mtu)
+            net->mtu = mtu;
+    }
+    uint16_t maxPairs = 1;
+    bool mq = IoVirtHasFeature (vdev, IO_VNET_F_MQ) && IoVirtHasFeature (vdev, IO_VNET_F_CTRL_VQ);
+    if (mq)
+        IoVirtReadCfg (vdev, IO_VNET_CFG_MAX_PAIRS, &maxPairs, sizeof (uint16_t));
+    int pairs = NkGetNumCpus();
+    if (pairs > maxPairs)
+        pairs = maxPairs;
+    if (pairs > (vdev->numVecs / 2))
+        pairs = vdev->numVecs / 2;
+    vnet->bufPool = MmCreateDmaPool ("virtio-net", IO_VNET_BUF_SZ, 64, (paddr_t) -1, 0);
+    vnet->txPool = MmCreateDmaPool ("virtio-net tx", sizeof (ioVNetTx_t), 16, (paddr_t) -1, 0);
+    vnet->rxq = kmalloc (pairs * sizeof (IoVirtQueue_t*), MM_TAG_IO);
+    vnet->txq = kmalloc (pairs * sizeof (IoVirtQueue_t*), MM_TAG_IO);
+    if (!vnet->bufPool || !vnet->txPool || !vnet->rxq || !vnet->txq)
+        goto fail;
+    // Pair i is queues 2i and 2i + 1, on CPU i
+    for (int i = 0; i < pairs; ++i)
+    {
+        vnet->rxq[i] = IoVirtSetupQueue (vdev, 2 * i, i, 2 * i, ioVNetRxDone);
+        vnet->txq[i] = IoVirtSetupQueue (vdev, (2 * i) + 1, i, (2 * i) + 1, ioVNetTxDone);
+        if (!vnet->rxq[i] || !vnet->txq[i] || !ioVNetInitQueue (vnet, vnet->rxq[i], true) ||
+            !ioVNetInitQueue (vnet, vnet->txq[i], false))
+            goto fail;
+    }
+    // The control queue comes after every pair the device has
+    IoVirtQueue_t* ctrlq = NULL;
+    if (mq && pairs > 1)
+    {
+        ctrlq = IoVirtSetupQueue (vdev, 2 * maxPairs, -1, 0, ioVNetCtrlDone);
+        if (!ctrlq)
+            goto fail;
+    }
+    IoVirtReady (vdev);
+    if (ctrlq && !ioVNetSetPairs (vnet, ctrlq, pairs))
+    {
+        NkLogWarning ("nexke: virtio-net couldn't use %d queue pairs\n", pairs);
+        pairs = 1;
+    }
+    // Receive buffers go out now that the device is running
+    for (int i = 0; i < pairs; ++i)
+        IoVirtKick (vnet->rxq[i]);
+    sprintf (net->name, "vnet%d", ioVNetNumDevs++);
+    net->numQueues = pairs;
+    net->xmit = ioVNetXmit;
+    net->flush = ioVNetFlush;
+    net->drvData = vnet;
+    IoRegisterNetDev (net);
+    return true;
+fail:
+    IoVirtFail (vdev);
+    return false;
+}
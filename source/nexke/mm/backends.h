@@ -25,10 +25,25 @@
 bool KvmInitObj (MmObject_t* obj);
 bool KvmDestroyObj (MmObject_t* obj);
 bool KvmPageIn (MmObject_t* obj, size_t offset, MmPage_t* page);
-bool KvmPageOut (MmObject_t* obj, size_t offset);
+bool KvmPageOut (MmObject_t* obj, size_t offset, MmPage_t* page);
+
+// Anonymous backend functions
+bool AnonInitObj (MmObject_t* obj);
+bool AnonDestroyObj (MmObject_t* obj);
+bool AnonPageIn (MmObject_t* obj, size_t offset, MmPage_t* page);
+bool AnonPageOut (MmObject_t* obj, size_t offset, MmPage_t* page);
+
+// File backend functions
+bool FileInitObj (MmObject_t* obj);
+bool FileDestroyObj (MmObject_t* obj);
+bool FilePageIn (MmObject_t* obj, size_t offset, MmPage_t* page);
+bool FilePageOut (MmObject_t* obj, size_t offset, MmPage_t* page);
 
 static void* kvmBackend[] = {KvmPageIn, KvmPageOut, KvmInitObj, KvmDestroyObj};
+static void* anonBackend[] = {AnonPageIn, AnonPageOut, AnonInitObj, AnonDestroyObj};
+
+static void* fileBackend[] = {FilePageIn, FilePageOut, FileInitObj, FileDestroyObj};
 
-static void* backends[] = {NULL, kvmBackend};
+static void* backends[] = {anonBackend, kvmBackend, fileBackend};
 
 #endif
@@ -0,0 +1,180 @@
+/*
+    dma.c - contains DMA buffer pools
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <string.h>
+
+// Drivers want lots of small buffers for descriptors and command lists, and getting each of them
+// from MmAllocPagesAt would waste most of a page and scan the zones every time. So a pool gets
+// blocks of contiguous pages under its mask, maps them how it was asked to, and cuts them into
+// chunks
+// Each block is its own kernel region, with the block set as the region's owner, so a chunk's
+// block and physical address are found without searching. Free chunks are linked through
+// themselves
+
+// Block of chunks
+typedef struct _mmdmablock
+{
+    struct _mmdmablock* next;    // Next block in pool
+    void* virt;                  // Where block is mapped
+    paddr_t phys;                // Physical address of block
+} MmDmaBlock_t;
+
+// Free chunk
+typedef struct _mmdmachunk
+{
+    struct _mmdmachunk* next;
+} MmDmaChunk_t;
+
+typedef struct _mmdmapool
+{
+    const char* name;         // Name of pool
+    size_t size;              // Size of chunks, rounded up to alignment
+    size_t align;             // Alignment of chunks
+    paddr_t maxAddr;          // Address blocks have to be under, 0 if there's no limit
+    int perm;                 // Caching flags blocks are mapped with
+    size_t blockPages;        // Pages in a block
+    size_t perBlock;          // Chunks in a block
+    MmDmaChunk_t* freeList;   // Free chunks
+    MmDmaBlock_t* blocks;     // Blocks of pool
+    size_t numBlocks;         // Number of blocks
+    size_t numFree;           // Number of free chunks
+    spinlock_t lock;
+} MmDmaPool_t;
+
+// Creates a pool
+MmDmaPool_t* MmCreateDmaPool (const char* name, size_t size, size_t align, paddr_t mask, int flags)
+{
+    assert (size && align && !(align & (align - 1)));
+    // Free chunks have to hold a link
+    if (align < sizeof (MmDmaChunk_t))
+        align = sizeof (MmDmaChunk_t);
+    MmDmaPool_t* pool = kmalloc (sizeof (MmDmaPool_t), MM_TAG_MM);
+    if (!pool)
+        return NULL;
+    memset (pool, 0, sizeof (MmDmaPool_t));
+    pool->name = name;
+    pool->align = align;
+    pool->size = (size + align - 1) & ~(align - 1);
+    // A mask of all ones wraps around to no limit
+    pool->maxAddr = mask + 1;
+    if (flags & MM_DMA_WC)
+        pool->perm = MUL_PAGE_WC;
+    else if (flags & MM_DMA_UNCACHED)
+        pool->perm = MUL_PAGE_CD;
+    // Blocks are at least a page, and big enough for one chunk
+    pool->blockPages = CpuPageAlignUp (pool->size) / NEXKE_CPU_PAGESZ;
+    pool->perBlock = (pool->blockPages * NEXKE_CPU_PAGESZ) / pool->size;
+    NkLogDebug ("nexke: created DMA pool %s, %zu byte chunks, %zu per block\n",
+                name,
+                pool->size,
+                pool->perBlock);
+    return pool;
+}
+
+// Destroys a pool
+void MmDestroyDmaPool (MmDmaPool_t* pool)
+{
+    if (pool->numFree != (pool->numBlocks * pool->perBlock))
+        NkPanic ("nexke: destroying DMA pool %s with chunks in use\n", pool->name);
+    MmDmaBlock_t* block = pool->blocks;
+    while (block)
+    {
+        MmDmaBlock_t* next = block->next;
+        // Freeing the region gives its pages back
+        MmFreeKvRegion (block->virt);
+        kfree (block, sizeof (MmDmaBlock_t), MM_TAG_MM);
+        block = next;
+    }
+    kfree (pool, sizeof (MmDmaPool_t), MM_TAG_MM);
+}
+
+// Adds a block to pool
+static bool mmDmaGrow (MmDmaPool_t* pool)
+{
+    MmDmaBlock_t* block = kmalloc (sizeof (MmDmaBlock_t), MM_TAG_MM);
+    if (!block)
+        return false;
+    size_t align = (pool->align > NEXKE_CPU_PAGESZ) ? pool->align : NEXKE_CPU_PAGESZ;
+    MmPage_t* pages = MmAllocPagesAt (pool->blockPages, pool->maxAddr, align);
+    if (!pages)
+        goto fail;
+    block->phys = MmGetPagePfn (pages) * NEXKE_CPU_PAGESZ;
+    block->virt = MmMapKvContig (pages, pool->blockPages, pool->perm);
+    if (!block->virt)
+    {
+        MmFreePages (pages, pool->blockPages);
+        goto fail;
+    }
+    MmSetKvOwner (block->virt, block);
+    memset (block->virt, 0, pool->blockPages * NEXKE_CPU_PAGESZ);
+    // Link up the chunks before taking the lock
+    MmDmaChunk_t* first = block->virt;
+    MmDmaChunk_t* last = first;
+    for (size_t i = 1; i < pool->perBlock; ++i)
+    {
+        last->next = block->virt + (i * pool->size);
+        last = last->next;
+    }
+    NkSpinLock (&pool->lock);
+    last->next = pool->freeList;
+    pool->freeList = first;
+    pool->numFree += pool->perBlock;
+    block->next = pool->blocks;
+    pool->blocks = block;
+    ++pool->numBlocks;
+    NkSpinUnlock (&pool->lock);
+    return true;
+fail:
+    kfree (block, sizeof (MmDmaBlock_t), MM_TAG_MM);
+    return false;
+}
+
+// Allocates a chunk from pool
+void* MmDmaAlloc (MmDmaPool_t* pool, paddr_t* phys)
+{
+    NkSpinLock (&pool->lock);
+    while (!pool->freeList)
+    {
+        // Blocks are set up unlocked, as that allocates memory
+        NkSpinUnlock (&pool->lock);
+        if (!mmDmaGrow (pool))
+            return NULL;
+        NkSpinLock (&pool->lock);
+    }
+    MmDmaChunk_t* chunk = pool->freeList;
+    pool->freeList = chunk->next;
+    --pool->numFree;
+    NkSpinUnlock (&pool->lock);
+    MmDmaBlock_t* block = MmGetKvOwner (chunk);
+    *phys = block->phys + ((uintptr_t) chunk - (uintptr_t) block->virt);
+    return chunk;
+}
+
+// Frees a chunk back to pool
+void MmDmaFree (MmDmaPool_t* pool, void* chunk)
+{
+    assert (!((uintptr_t) chunk & (pool->align - 1)));
+    MmDmaChunk_t* free = chunk;
+    NkSpinLock (&pool->lock);
+    free->next = pool->freeList;
+    pool->freeList = free;
+    ++pool->numFree;
+    NkSpinUnlock (&pool->lock);
+}
@@ -18,10 +18,172 @@
 #include <assert.h>
 #include <nexke/mm.h>
 #include <nexke/nexke.h>
+#include <nexke/platform.h>
+
+// Checks if page is mapped at addr in space
+// Page must be locked
+static bool mmIsPageMapped (MmPage_t* page, MmSpace_t* space, uintptr_t addr)
+{
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        if (map->space == space && map->addr == addr)
+            return true;
+        map = map->next;
+    }
+    return false;
+}
+
+static NkStat_t mmStatFaults = {.name = "mm.faults", .type = NK_STAT_COUNTER};
+
+#ifdef NEXKE_FAULT_STATS
+// Gets the time to measure fault latency from
+static FORCEINLINE ktime_t mmFaultTime()
+{
+    // Faults can come in before there is a clock
+    PltHwClock_t* clock = PltGetPlatform()->clock;
+    return (clock) ? clock->getTime() : 0;
+}
+
+// Records count faults of kind, which took from start until now
+// Faults in the same space can happen at once, so counters are updated atomically
+static void mmFaultStat (MmSpace_t* space, int kind, ktime_t start, uint64_t count)
+{
+    MmFaultStats_t* stats = &space->faultStats;
+    uint64_t time = mmFaultTime() - start;
+    int bucket = (time) ? (63 - __builtin_clzll (time)) : 0;
+    if (bucket >= MM_FAULT_BUCKETS)
+        bucket = MM_FAULT_BUCKETS - 1;
+    __atomic_fetch_add (&stats->counts[kind], count, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&stats->totalTime[kind], time, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&stats->latency[kind][bucket], 1, __ATOMIC_RELAXED);
+}
+#else
+static FORCEINLINE ktime_t mmFaultTime()
+{
+    return 0;
+}
+
+static FORCEINLINE void mmFaultStat (MmSpace_t* space, int kind, ktime_t start, uint64_t count)
+{
+}
+#endif
+
+// Fault-around maps runs of pages in batches, so page tables are walked once per batch
+#define MM_FAULT_BATCH 16
+
+typedef struct _mmfaultbatch
+{
+    uintptr_t addr;                     // Address of first page
+    int prot;                           // Protection of pages
+    int count;                          // Number of pages in batch
+    MmPage_t* pages[MM_FAULT_BATCH];    // Pages to map
+} MmFaultBatch_t;
+
+// Maps the pages in a batch
+static void mmFaultBatchFlush (MmSpace_t* space, MmFaultBatch_t* batch)
+{
+    if (batch->count)
+        MmMulMapRange (space, batch->addr, batch->pages, batch->count, batch->prot);
+    batch->count = 0;
+}
+
+// Adds a page to a batch, mapping the batch first if the page doesn't follow it
+static void mmFaultBatchAdd (MmSpace_t* space,
+                             MmFaultBatch_t* batch,
+                             uintptr_t addr,
+                             MmPage_t* page,
+                             int prot)
+{
+    if (batch->count && (batch->count == MM_FAULT_BATCH || prot != batch->prot ||
+                         addr != (batch->addr + (batch->count * NEXKE_CPU_PAGESZ))))
+    {
+        mmFaultBatchFlush (space, batch);
+    }
+    if (!batch->count)
+    {
+        batch->addr = addr;
+        batch->prot = prot;
+    }
+    batch->pages[batch->count++] = page;
+}
+
+// Maps pages surrounding a faulting page
+// Object must be locked. Returns number of pages mapped
+static size_t mmFaultAround (MmSpace_t* space,
+                           MmObject_t* obj,
+                           uintptr_t base,
+                           size_t count,
+                           size_t faultOff,
+                           size_t window,
+                           bool alloc,
+                           int prot)
+{
+    // Figure out the window, aligned to its size and clipped to the entry
+    size_t winSz = window * NEXKE_CPU_PAGESZ;
+    size_t start = (faultOff / winSz) * winSz;
+    size_t end = start + winSz;
+    size_t limit = ((count < obj->count) ? count : obj->count) * NEXKE_CPU_PAGESZ;
+    if (end > limit)
+        end = limit;
+    // Only allocate new pages for anonymous memory and when we have memory to spare
+    // Reads would only map the zero page, which isn't resident in the object and would be mapped
+    // again on every fault in the window, so leave those to their own faults
+    if (obj->backend != MM_BACKEND_ANON || MmGetPageShortage() || !(prot & MUL_PAGE_RW))
+        alloc = false;
+    MmFaultBatch_t batch;
+    batch.count = 0;
+    size_t mapped = 0;
+    size_t off = start;
+    while (off < end)
+    {
+        // Find next resident page
+        size_t pageOff = off;
+        MmPage_t* page = MmLookupPageNext (obj, &pageOff);
+        if (!page || pageOff >= end)
+            pageOff = end;
+        // Allocate the ones missing before it
+        for (; alloc && off < pageOff; off += NEXKE_CPU_PAGESZ)
+        {
+            if (off == faultOff)
+                continue;
+            int pageProt = prot;
+            int kind = 0;
+            MmPage_t* newPage = NULL;
+            if (!MmPageFaultIn (obj, off, &pageProt, &newPage, &kind))
+            {
+                mmFaultBatchFlush (space, &batch);
+                return mapped;
+            }
+            mmFaultBatchAdd (space, &batch, base + off, newPage, pageProt);
+            ++mapped;
+        }
+        if (pageOff == end)
+            break;
+        off = pageOff + NEXKE_CPU_PAGESZ;
+        if (pageOff == faultOff)
+            continue;
+        // Make sure this page can be mapped and hasn't been already
+        MmLockPage (page);
+        bool skip = (page->flags & MM_PAGE_GUARD) || (page->flags & MM_PAGE_FIXED) ||
+                    mmIsPageMapped (page, space, base + pageOff);
+        MmUnlockPage (page);
+        if (!skip)
+        {
+            mmFaultBatchAdd (space, &batch, base + pageOff, page, obj->perm);
+            ++mapped;
+        }
+    }
+    mmFaultBatchFlush (space, &batch);
+    return mapped;
+}
 
 // Fault entry point
 bool MmPageFault (uintptr_t vaddr, int prot)
 {
+    NK_TRACE (NK_TRACE_FAULT, vaddr, prot);
+    NkStatInc (&mmStatFaults);
+    ktime_t start = mmFaultTime();
     // Get the address page aligned
     vaddr = CpuPageAlignDown (vaddr);
     // Get the address space
@@ -30,33 +192,177 @@ bool MmPageFault (uintptr_t vaddr, int prot)
     if (prot & MUL_PAGE_KE)
         space = MmGetKernelSpace();
     // Find the address space entry for this address
-    NkSpinLock (&space->lock);
+    // Faults only look at the entry, so they can all go at once
+    NkRwReadLock (&space->lock);
     MmSpaceEntry_t* entry = MmFindFaultEntry (space, vaddr);
     if (!entry)
     {
-        NkSpinUnlock (&space->lock);
+        NkRwReadUnlock (&space->lock);
+        mmFaultStat (space, MM_FAULT_FAILED, start, 1);
         return false;    // Page just doesn't exist
     }
     assert (entry->obj);
     MmPage_t* outPage = NULL;
     MmObject_t* obj = entry->obj;
-    NkSpinUnlock (&space->lock);
+    uintptr_t base = entry->vaddr;
+    size_t count = entry->count;
+    size_t window = entry->faultAround;
+    bool alloc = entry->faultAlloc;
+    int faultProt = prot;
+    NkRwReadUnlock (&space->lock);
     NkSpinLock (&obj->lock);    // Lock the object
-    bool res = MmPageFaultIn (entry->obj, vaddr - entry->vaddr, &prot, &outPage);
+    // Writes to empty anonymous memory might get a whole large page
+    if (MmThpFault (space, obj, base, count, vaddr, faultProt))
+    {
+        NkSpinUnlock (&obj->lock);
+        mmFaultStat (space, MM_FAULT_ZERO, start, 1);
+        return true;
+    }
+    int kind = MM_FAULT_FAILED;
+    bool res = MmPageFaultIn (obj, vaddr - base, &prot, &outPage, &kind);
     if (!res)
     {
-        NkSpinUnlock (&outPage->lock);
         NkSpinUnlock (&obj->lock);
+        mmFaultStat (space, MM_FAULT_FAILED, start, 1);
         return false;    // Page could not be faulted in
     }
     // Add this page to MUL
     MmMulMapPage (space, vaddr, outPage, prot);
+    mmFaultStat (space, kind, start, 1);
+    // Map in its neighbours too so streaming accesses don't fault on every page
+    if (window > 1)
+    {
+        ktime_t aroundStart = mmFaultTime();
+        size_t mapped =
+            mmFaultAround (space, obj, base, count, vaddr - base, window, alloc, faultProt);
+        if (mapped)
+            mmFaultStat (space, MM_FAULT_AROUND, aroundStart, mapped);
+    }
     NkSpinUnlock (&obj->lock);
     return true;
 }
 
+// Checks if a page found in a parent object can be used
+static bool mmCheckGuard (MmPage_t* page)
+{
+    if (page->flags & MM_PAGE_GUARD)
+    {
+        NkLogDebug ("nexke: guard page access caught\n");
+        return false;
+    }
+    return true;
+}
+
+// Looks for the page at off down the shadow chain of obj
+// Returns the object the page or its compressed copy was found in, or the bottom object if it
+// wasn't found, with off made relative to it. If locked is set, each object is locked while it's
+// looked at, as pages only go in and out of the compressed pool with their object locked
+static MmObject_t* mmShadowLookup (MmObject_t* obj,
+                                   size_t* off,
+                                   MmPage_t** page,
+                                   bool* stored,
+                                   bool locked)
+{
+    MmObject_t* cur = obj;
+    while (cur->parent)
+    {
+        *off += cur->parentOff;
+        cur = cur->parent;
+        if (locked)
+            NkSpinLock (&cur->lock);
+        *page = MmLookupPage (cur, *off);
+        *stored = !*page && MmZpoolHas (cur, *off);
+        if (locked)
+            NkSpinUnlock (&cur->lock);
+        if (*page || *stored)
+            break;
+    }
+    return cur;
+}
+
+// Handles a fault on a page that isn't in a shadow object
+static bool mmShadowFault (MmObject_t* obj,
+                           size_t offset,
+                           int* prot,
+                           MmPage_t** outPage,
+                           int* kind)
+{
+    int err = *prot;
+    // Protection faults only make sense if this a write to a page mapped from a parent
+    if (!(err & MUL_PAGE_P) && !(err & MUL_PAGE_RW))
+        return false;
+    // Look for the page down the shadow chain
+    size_t curOff = offset;
+    MmPage_t* page = NULL;
+    bool stored = false;
+    MmObject_t* cur = mmShadowLookup (obj, &curOff, &page, &stored, false);
+    // Not finding it anywhere means it gets zero filled. A page could have been going in or out
+    // of the compressed pool while we looked though, so make sure with each object locked
+    if (!page && !stored && cur->backend == MM_BACKEND_ANON)
+    {
+        curOff = offset;
+        cur = mmShadowLookup (obj, &curOff, &page, &stored, true);
+    }
+    *kind = MM_FAULT_MINOR;
+    // If nobody has it and the bottom object isn't anonymous, it has to bring the data in
+    // The same goes for an object that has it compressed
+    if (!page && (cur->backend != MM_BACKEND_ANON || stored))
+    {
+        NkSpinLock (&cur->lock);
+        int bottomProt = MUL_PAGE_P;
+        bool res = MmPageFaultIn (cur, curOff, &bottomProt, &page, kind);
+        NkSpinUnlock (&cur->lock);
+        if (!res)
+            return false;
+    }
+    // Anonymous memory nobody has written yet reads as the zero page
+    if (!page && !(err & MUL_PAGE_RW))
+    {
+        page = MmGetZeroPage();
+        *kind = MM_FAULT_ZERO;
+    }
+    if (page && !(err & MUL_PAGE_RW))
+    {
+        // Reads can share the parent's page, as long as it isn't written through
+        MmLockPage (page);
+        bool res = mmCheckGuard (page);
+        *prot = obj->perm & ~(MUL_PAGE_RW);
+        *outPage = page;
+        MmUnlockPage (page);
+        return res;
+    }
+    // This object needs its own copy of the page
+    MmPage_t* newPage = MmAllocMovablePage (!page);
+    if (!newPage)
+        NkPanicOom();
+    if (page)
+    {
+        MmLockPage (page);
+        if (!mmCheckGuard (page))
+        {
+            MmUnlockPage (page);
+            MmFreePage (newPage);
+            return false;
+        }
+        MmMulCopyPage (newPage, page);
+        MmUnlockPage (page);
+    }
+    // Copying a page the bottom object just brought in still counts as a major fault
+    if (*kind == MM_FAULT_MINOR)
+        *kind = (page) ? MM_FAULT_COW : MM_FAULT_ZERO;
+    MmLockPage (newPage);
+    MmAddPage (obj, offset, newPage);
+    // If there was nothing to copy, zero fill it
+    if (!page && !MmBackendPageIn (obj, offset, newPage))
+        NkPanic ("nexke: page in error\n");
+    *prot = obj->perm;
+    *outPage = newPage;
+    MmUnlockPage (newPage);
+    return true;
+}
+
 // Brings a page into memory during a page fault
-bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** outPage)
+bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** outPage, int* kind)
 {
     // So this is basically the heart of the memory manager. We split this up into a couple phases
     // First, we find the page that is supposed to back this object/offset.
@@ -64,15 +370,52 @@ bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** outPag
     // If it is a protection violation, we will attempt to fix it or fail
     // If it is a access violation, we will bring the page into memory
     MmPage_t* page = NULL;    // The page itself
+    // Fold in parents that nobody else can see anymore to keep shadow chains short
+    if (obj->parent)
+        MmCollapseObject (obj);
     // Attempt to lookup the page in the object
     page = MmLookupPage (obj, offset);
+    // Pages that were compressed are still this object's own
+    bool stored = !page && MmZpoolHas (obj, offset);
+    // Pages not in a shadow object come from its parents
+    if (!page && !stored && obj->parent)
+        return mmShadowFault (obj, offset, prot, outPage, kind);
+    // Reads of anonymous memory nobody has written yet all share the zero page. It isn't added to
+    // the object, so the first write faults again and gets a page of its own
+    if (!page && !stored && obj->backend == MM_BACKEND_ANON && !(*prot & MUL_PAGE_RW))
+    {
+        *prot = obj->perm & ~(MUL_PAGE_RW);
+        *outPage = MmGetZeroPage();
+        *kind = MM_FAULT_ZERO;
+        return true;
+    }
     if (!page)
     {
         // This page is not resident in memory, allocate a page and do a page in
-        page = MmAllocPage();
+        // Kernel and anonymous memory is zero filled, so try to get a pre-zeroed page
+        if (stored)
+        {
+            page = MmAllocPage();
+            *kind = MM_FAULT_MAJOR;
+        }
+        else if (obj->backend == MM_BACKEND_ANON)
+        {
+            page = MmAllocMovablePage (true);
+            *kind = MM_FAULT_ZERO;
+        }
+        else if (obj->backend == MM_BACKEND_KERNEL)
+        {
+            page = MmAllocZeroedPage();
+            *kind = MM_FAULT_ZERO;
+        }
+        else
+        {
+            page = MmAllocPage();
+            *kind = MM_FAULT_MAJOR;
+        }
         if (!page)
             NkPanicOom();
-        NkSpinLock (&page->lock);
+        MmLockPage (page);
         // Check if this page should be fixed
         if (obj->backend == MM_BACKEND_KERNEL)
             MmFixPage (page);
@@ -82,7 +425,8 @@ bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** outPag
     }
     else
     {
-        NkSpinLock (&page->lock);
+        MmLockPage (page);
+        *kind = MM_FAULT_MINOR;
         // There is a page at the object,offset, but we need to make sure
         // we can actually do this
         // If this is a guard page, fail, guard pages indicate that a address
@@ -90,7 +434,7 @@ bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** outPag
         if (page->flags & MM_PAGE_GUARD)
         {
             NkLogDebug ("nexke: guard page access caught\n");
-            NkSpinUnlock (&page->lock);
+            MmUnlockPage (page);
             return false;
         }
     }
@@ -102,10 +446,25 @@ bool MmPageFaultIn (MmObject_t* obj, size_t offset, int* prot, MmPage_t** outPag
         // Set flags and page and return because we were successful
         *prot = obj->perm;
         *outPage = page;
-        NkSpinUnlock (&page->lock);
+        MmUnlockPage (page);
+        return true;
+    }
+    // Writes to a page that got mapped read only while it was still in a parent just need to
+    // be mapped writable
+    if ((err & MUL_PAGE_RW) && (obj->perm & MUL_PAGE_RW))
+    {
+        *prot = obj->perm;
+        *outPage = page;
+        MmUnlockPage (page);
         return true;
     }
     if (page)
-        NkSpinUnlock (&page->lock);
+        MmUnlockPage (page);
     return false;
 }
+
+// Sets up fault handling
+void MmInitFault()
+{
+    NkStatRegister (&mmStatFaults);
+}
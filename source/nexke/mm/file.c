@@ -0,0 +1,151 @@
+/*
+    file.c - contains file backend and page cache
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include "backends.h"
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+
+// Readahead
+// Reads that continue where the last one stopped double the window, up to a max, so streaming
+// through a file turns into a few large reads. Anything else is taken as random access and
+// starts over at one page, so random readers don't pay for data they won't use
+// The readahead state is protected by the object lock, which every page in holds
+#define MM_FILE_RA_INIT 4     // Window of the first read at the start of a file
+#define MM_FILE_RA_MAX  32    // Largest window in pages
+
+// Gets page cache object of file, creating it if needed
+MmObject_t* MmGetFileObject (MmFile_t* file)
+{
+    NkSpinLock (&file->lock);
+    if (!file->cache)
+    {
+        size_t pages = (file->size + NEXKE_CPU_PAGESZ - 1) >> NEXKE_CPU_PAGE_SHIFT;
+        MmObject_t* obj = MmCreateObject (pages, MM_BACKEND_FILE, file->perm);
+        if (!obj)
+        {
+            NkSpinUnlock (&file->lock);
+            return NULL;
+        }
+        obj->backendData = file;
+        file->raNext = 0;
+        file->raWindow = 0;
+        file->cache = obj;    // This is the file's own reference
+    }
+    MmObject_t* obj = file->cache;
+    MmRefObject (obj);
+    NkSpinUnlock (&file->lock);
+    return obj;
+}
+
+// Drops file's reference on its page cache
+void MmReleaseFile (MmFile_t* file)
+{
+    NkSpinLock (&file->lock);
+    MmObject_t* obj = file->cache;
+    file->cache = NULL;
+    NkSpinUnlock (&file->lock);
+    if (obj)
+        MmDeRefObject (obj);
+}
+
+// Figures out readahead window for a page in at offset
+static size_t mmFileRaWindow (MmFile_t* file, size_t offset)
+{
+    size_t window = 1;
+    if (file->raWindow && offset == file->raNext)
+    {
+        // Sequential, read further ahead
+        window = file->raWindow * 2;
+        if (window > MM_FILE_RA_MAX)
+            window = MM_FILE_RA_MAX;
+    }
+    else if (!offset)
+        window = MM_FILE_RA_INIT;    // Files are usually read from the start
+    // Don't take memory for readahead when we are running low
+    if (MmGetPageShortage())
+        window = 1;
+    return window;
+}
+
+// File backend
+
+bool FileInitObj (MmObject_t* obj)
+{
+    // Cached pages can always be read back, so they can be paged out
+    obj->pageable = true;
+    obj->backendData = NULL;
+    return true;
+}
+
+bool FileDestroyObj (MmObject_t* obj)
+{
+    return true;
+}
+
+bool FilePageIn (MmObject_t* obj, size_t offset, MmPage_t* page)
+{
+    MmFile_t* file = obj->backendData;
+    assert (file);
+    size_t window = mmFileRaWindow (file, offset);
+    // Add pages after this one that aren't cached yet, so they all come in with one read
+    // The read has to be contiguous, so stop at the first page we already have
+    MmPage_t* pages[MM_FILE_RA_MAX];
+    pages[0] = page;
+    size_t count = 1;
+    size_t off = offset + NEXKE_CPU_PAGESZ;
+    size_t end = obj->count * NEXKE_CPU_PAGESZ;
+    while (count < window && off < end && !MmLookupPage (obj, off))
+    {
+        MmPage_t* raPage = MmAllocPage();
+        if (!raPage)
+            break;    // Readahead is only a hint
+        // Keep it locked until the read is done, so faults on it wait for the data
+        MmLockPage (raPage);
+        MmAddPage (obj, off, raPage);
+        pages[count++] = raPage;
+        off += NEXKE_CPU_PAGESZ;
+    }
+    bool res = file->read (file, offset, pages, count);
+    // Readahead pages are done now
+    for (size_t i = 1; i < count; ++i)
+    {
+        MmPage_t* raPage = pages[i];
+        if (!res)
+        {
+            // Don't leave pages without data in the cache
+            MmRemovePage (raPage);
+            MmFreePage (raPage);
+        }
+        MmUnlockPage (raPage);
+    }
+    // Remember where a sequential reader would fault next
+    file->raWindow = count;
+    file->raNext = offset + (count * NEXKE_CPU_PAGESZ);
+    return res;
+}
+
+bool FilePageOut (MmObject_t* obj, size_t offset, MmPage_t* page)
+{
+    MmFile_t* file = obj->backendData;
+    assert (file);
+    // Clean pages can just be read back in
+    if (!(page->flags & MM_PAGE_DIRTY))
+        return true;
+    if (!file->write)
+        return false;
+    return file->write (file, offset, &page, 1);
+}
@@ -22,10 +22,16 @@
 #include <nexke/nexke.h>
 #include <string.h>
 
-#define MM_KV_MAX_FREELIST 12
-#define MM_KV_REFILL_VAL   8
-#define MM_KV_REFILL_MIN   4
-#define MM_KV_MAX_BUCKETS  5
+#define MM_KV_MAX_BUCKETS 5
+
+// Quantum cache tunables
+#define MM_KV_QCACHE_MAX 4     // Biggest region in pages that has a quantum cache
+#define MM_KV_QMAG_SZ    8     // Number of regions each CPU keeps per size
+#define MM_KV_QBATCH     4     // Number of regions moved to or from the depot at once
+#define MM_KV_QDEPOT_MAX 32    // Number of regions a depot holds before giving them back
+
+#define MM_KV_MAP_BATCH 32    // Pages mapped at once when memory is brought in
+#define MM_KV_PERM      (MUL_PAGE_KE | MUL_PAGE_RW | MUL_PAGE_R)    // Protection of kernel memory
 
 // Kernel virtual region structure
 typedef struct _kvregion
@@ -35,6 +41,7 @@ typedef struct _kvregion
     bool isFree;        // Is this region free?
     spinlock_t lock;
     NkLink_t link;
+    void* owner;    // Owner of the allocated region this page is in. Set in every page's entry
 } MmKvRegion_t;
 
 // Kernel virtual region footer
@@ -44,6 +51,24 @@ typedef struct _kvfooter
     size_t regionSz;    // Size of this region
 } MmKvFooter_t;
 
+// Per-CPU quantum magazine
+typedef struct _kvqmag
+{
+    int rounds;                              // Number of regions in magazine
+    MmKvRegion_t* regions[MM_KV_QMAG_SZ];    // Region stack, hot regions are at the top
+} MmKvQmag_t;
+
+// Quantum cache
+// Keeps allocated regions of one size around so small allocations don't have to split and join
+// regions in the buckets
+typedef struct _kvqcache
+{
+    MmKvQmag_t cpus[NEXKE_MAX_CPUS];    // Magazine of each CPU
+    NkList_t depot;                     // Regions shared between CPUs
+    size_t depotSz;                     // Number of regions in depot
+    spinlock_t lock;                    // Lock on depot
+} MmKvQcache_t;
+
 // Kernel memory bucket
 typedef struct _kvbucket
 {
@@ -60,9 +85,7 @@ typedef struct _kvarena
     size_t numFreePages;
     bool needsMap;    // Whether this arena is pre-mapped
 
-    NkList_t freeList;      // Free list of pages
-    size_t freeListSz;      // Number of pages in free list currently
-    spinlock_t listLock;    // Lock on free list
+    MmKvQcache_t qcaches[MM_KV_QCACHE_MAX];    // Quantum caches, indexed by size - 1
 
     uintptr_t resvdStart;    // Start of reserved area
     size_t resvdSz;          // Size of reserved area in pages
@@ -75,6 +98,20 @@ typedef struct _kvarena
 
 #define MM_KV_FOOTER_MAGIC 0xDEADBEEF
 
+// MMIO mapping
+// Firmware tables and device registers tend to get mapped over and over, so a mapping is shared
+// by everyone mapping part of its range with the same protection
+typedef struct _kvmmio
+{
+    paddr_t phys;       // Page aligned physical base
+    size_t numPages;    // Number of pages mapped
+    int perm;           // Protection they're mapped with
+    void* region;       // Region the mapping is in
+    uintptr_t virt;     // Where phys is mapped in the region
+    int refCount;       // Number of users of mapping
+    NkLink_t link;
+} mmKvMmio_t;
+
 typedef struct _kvregion MmKvPage_t;
 
 // Bucket sizes
@@ -84,6 +121,10 @@ typedef struct _kvregion MmKvPage_t;
 #define MM_BUCKET_17TO32 3
 #define MM_BUCKET_32PLUS 4
 
+// Smallest region in each bucket
+// Any region in a bucket whose smallest region is big enough fits, that's what instant fit uses
+static const size_t mmKvBucketMin[] = {1, 5, 9, 17, 33};
+
 // Arena
 static MmKvArena_t* mmArenas = NULL;
 
@@ -96,6 +137,10 @@ static uintptr_t bootPoolEnd = 0;
 static size_t bootPoolSz = NEXBOOT_MEMPOOL_SZ;
 static bool mmInit = false;    // Wheter normal MM is up yet
 
+// MMIO mappings. There's only ever a handful, so they're kept on a list
+static NkList_t mmKvMmioList = {0};
+static spinlock_t mmKvMmioLock = 0;
+
 // Adds arena to list
 static void mmKvAddArena (MmKvArena_t* arena)
 {
@@ -183,13 +228,14 @@ void MmInitKvm1()
     arena->end = bootPoolEnd;
     arena->numPages = (bootInfo->memPoolSize / NEXKE_CPU_PAGESZ) - arena->resvdSz;
     arena->numFreePages = arena->numPages;
-    NkListInit (&arena->freeList);
     // Initialize buckets
     for (int i = 0; i < MM_KV_MAX_BUCKETS; ++i)
     {
         NkListInit (&arena->buckets[i].regionList);
         arena->buckets[i].bucketNum = i;
     }
+    for (int i = 0; i < MM_KV_QCACHE_MAX; ++i)
+        NkListInit (&arena->qcaches[i].depot);
     // Create a region for the entire arena
     MmKvRegion_t* firstRegion =
         mmKvGetRegion (arena, arena->start + (arena->resvdSz * NEXKE_CPU_PAGESZ));
@@ -235,13 +281,14 @@ void MmInitKvm2()
     arena->numPages =
         ((kmemSpace.endAddr - kmemSpace.startAddr) >> NEXKE_CPU_PAGE_SHIFT) - arena->resvdSz;
     arena->numFreePages = arena->numPages;
-    NkListInit (&arena->freeList);
     // Initialize buckets
     for (int i = 0; i < MM_KV_MAX_BUCKETS; ++i)
     {
         NkListInit (&arena->buckets[i].regionList);
         arena->buckets[i].bucketNum = i;
     }
+    for (int i = 0; i < MM_KV_QCACHE_MAX; ++i)
+        NkListInit (&arena->qcaches[i].depot);
     // Create a region for the entire arena
     MmKvRegion_t* firstRegion =
         mmKvGetRegion (arena, kmemSpace.startAddr + (arena->resvdSz * NEXKE_CPU_PAGESZ));
@@ -258,6 +305,7 @@ void MmInitKvm2()
     // Add to bucket
     NkListAddFront (&arena->buckets[MM_BUCKET_32PLUS].regionList, &firstRegion->link);
     mmKvAddArena (arena);
+    NkListInit (&mmKvMmioList);
 }
 
 // Prepares a found region for use
@@ -326,41 +374,43 @@ static MmKvRegion_t* mmAllocKvInArena (MmKvArena_t* arena, size_t numPages)
 {
     // Figure out which bucket we should look in
     int bucketIdx = mmKvGetBucket (numPages);
-    MmKvBucket_t* bucket = &arena->buckets[bucketIdx];
-    MmKvRegion_t* foundRegion = NULL;
-    NkLink_t* iter = NkListFront (&bucket->regionList);
-    // Find a region
-    while (!foundRegion)
+    // Instant fit: if every region in a bucket is big enough, just take the first one
+    for (int i = bucketIdx; i < MM_KV_MAX_BUCKETS; ++i)
     {
+        if (mmKvBucketMin[i] < numPages)
+            continue;
+        MmKvBucket_t* bucket = &arena->buckets[i];
         NkSpinLock (&bucket->lock);
-        while (iter)
+        NkLink_t* link = NkListFront (&bucket->regionList);
+        if (link)
         {
-            MmKvRegion_t* curRegion = LINK_CONTAINER (iter, MmKvRegion_t, link);
-            NkSpinLock (&curRegion->lock);
-            if (curRegion->numPages >= numPages)
-            {
-                foundRegion = curRegion;
-                break;
-            }
-            NkSpinUnlock (&curRegion->lock);
-            iter = NkListIterate (&bucket->regionList, iter);
+            MmKvRegion_t* region = LINK_CONTAINER (link, MmKvRegion_t, link);
+            NkSpinLock (&region->lock);
+            mmKvPrepareRegion (arena, bucket, region, numPages);
+            return region;
         }
-        // Did we find a region
-        if (foundRegion)
-            break;
         NkSpinUnlock (&bucket->lock);
-        // Move to another bucket
-        // Check if we have any more buckets to check
-        if (bucketIdx == MM_BUCKET_32PLUS)
-            return NULL;
-        bucket = &arena->buckets[++bucketIdx];
-        iter = NkListFront (&bucket->regionList);
     }
-    assert (foundRegion);
-    // We have now found a memory region
-    // Prepare it
-    mmKvPrepareRegion (arena, bucket, foundRegion, numPages);
-    return foundRegion;
+    // Nothing bigger, look for a region that fits in our own bucket
+    MmKvBucket_t* bucket = &arena->buckets[bucketIdx];
+    NkSpinLock (&bucket->lock);
+    NkLink_t* iter = NkListFront (&bucket->regionList);
+    while (iter)
+    {
+        MmKvRegion_t* curRegion = LINK_CONTAINER (iter, MmKvRegion_t, link);
+        NkSpinLock (&curRegion->lock);
+        if (curRegion->numPages >= numPages)
+        {
+            // We have now found a memory region
+            // Prepare it
+            mmKvPrepareRegion (arena, bucket, curRegion, numPages);
+            return curRegion;
+        }
+        NkSpinUnlock (&curRegion->lock);
+        iter = NkListIterate (&bucket->regionList, iter);
+    }
+    NkSpinUnlock (&bucket->lock);
+    return NULL;
 }
 
 // Joins regions for a free
@@ -411,43 +461,140 @@ static inline MmKvRegion_t* mmKvJoinRegions (MmKvArena_t* arena, MmKvRegion_t* r
     return region;
 }
 
-// Allocates a single page region
-static void* mmKvAllocFreeList (MmKvArena_t* arena)
+// Gives a region back to the arena
+static void mmKvFreeToArena (MmKvArena_t* arena, MmKvRegion_t* region)
 {
-    void* p = NULL;
-    if (arena->freeListSz)
+    region->isFree = true;
+    NkSpinLock (&arena->lock);
+    arena->numFreePages += region->numPages;
+    NkSpinUnlock (&arena->lock);
+    // Join joinable regions
+    region = mmKvJoinRegions (arena, region);
+    // Add region to appropriate bucket
+    MmKvBucket_t* bucket = &arena->buckets[mmKvGetBucket (region->numPages)];
+    NkSpinLock (&bucket->lock);
+    NkListAddFront (&bucket->regionList, &region->link);
+    NkSpinUnlock (&bucket->lock);
+}
+
+// Quantum caches
+// Regions of up to MM_KV_QCACHE_MAX pages are cached per size once they are freed. Each CPU
+// has a magazine of them that it uses without locks, and a batch of regions is moved to or from
+// the depot of the cache when a magazine runs empty or full. Regions in a quantum cache stay
+// allocated as far as the arena is concerned, so they never get joined
+
+// Refills magazine from the depot, or failing that, from the arena
+// Preemption must be disabled
+static void mmKvQcacheRefill (MmKvArena_t* arena,
+                              MmKvQcache_t* qcache,
+                              MmKvQmag_t* mag,
+                              size_t numPages)
+{
+    NkSpinLock (&qcache->lock);
+    while (qcache->depotSz && mag->rounds < MM_KV_QBATCH)
     {
-        // Get link of first entry
-        NkLink_t* link = NkListFront (&arena->freeList);
-        NkListRemove (&arena->freeList, link);
-        MmKvRegion_t* region = LINK_CONTAINER (link, MmKvRegion_t, link);
-        region->isFree = false;
-        --arena->freeListSz;
-        p = (void*) region->vaddr;
+        NkLink_t* link = NkListFront (&qcache->depot);
+        NkListRemove (&qcache->depot, link);
+        --qcache->depotSz;
+        mag->regions[mag->rounds++] = LINK_CONTAINER (link, MmKvRegion_t, link);
     }
-    // Refill list
-    if (arena->freeListSz <= MM_KV_REFILL_MIN)
+    NkSpinUnlock (&qcache->lock);
+    while (mag->rounds < MM_KV_QBATCH)
     {
-        // Refill free list
-        for (int i = arena->freeListSz; i < MM_KV_REFILL_VAL; ++i)
-        {
-            MmKvRegion_t* newRegion = mmAllocKvInArena (arena, 1);
-            if (!newRegion)
-                break;    // Break on OOM
-            NkListAddFront (&arena->freeList, &newRegion->link);
-            ++arena->freeListSz;
-        }
+        MmKvRegion_t* region = mmAllocKvInArena (arena, numPages);
+        if (!region)
+            break;    // Break on OOM
+        mag->regions[mag->rounds++] = region;
     }
-    return p;
 }
 
-// Free a single page region
-static void mmKvFreeToList (MmKvArena_t* arena, MmKvRegion_t* region)
+// Moves the coldest regions in magazine to the depot
+// Preemption must be disabled
+static void mmKvQcacheFlush (MmKvArena_t* arena, MmKvQcache_t* qcache, MmKvQmag_t* mag)
 {
-    NkListAddFront (&arena->freeList, &region->link);
-    ++arena->freeListSz;
-    region->isFree = true;
+    NkSpinLock (&qcache->lock);
+    for (int i = 0; i < MM_KV_QBATCH; ++i)
+    {
+        NkListAddFront (&qcache->depot, &mag->regions[i]->link);
+        ++qcache->depotSz;
+    }
+    // Take what the depot can't hold
+    NkList_t excess;
+    NkListInit (&excess);
+    while (qcache->depotSz > MM_KV_QDEPOT_MAX)
+    {
+        NkLink_t* link = NkListBack (&qcache->depot);
+        NkListRemove (&qcache->depot, link);
+        --qcache->depotSz;
+        NkListAddFront (&excess, link);
+    }
+    NkSpinUnlock (&qcache->lock);
+    // Move the rest down
+    mag->rounds -= MM_KV_QBATCH;
+    for (int i = 0; i < mag->rounds; ++i)
+        mag->regions[i] = mag->regions[i + MM_KV_QBATCH];
+    // Give excess back to the arena
+    NkLink_t* iter = NkListFront (&excess);
+    while (iter)
+    {
+        NkListRemove (&excess, iter);
+        mmKvFreeToArena (arena, LINK_CONTAINER (iter, MmKvRegion_t, link));
+        iter = NkListFront (&excess);
+    }
+}
+
+// Allocates a region from a quantum cache
+static void* mmKvQcacheAlloc (MmKvArena_t* arena, size_t numPages)
+{
+    MmKvQcache_t* qcache = &arena->qcaches[numPages - 1];
+    MmKvRegion_t* region = NULL;
+    TskDisablePreempt();
+    MmKvQmag_t* mag = &qcache->cpus[CpuGetCcb()->cpuNum];
+    if (!mag->rounds)
+        mmKvQcacheRefill (arena, qcache, mag, numPages);
+    if (mag->rounds)
+        region = mag->regions[--mag->rounds];
+    TskEnablePreempt();
+    return region ? (void*) region->vaddr : NULL;
+}
+
+// Frees a region to its quantum cache
+static void mmKvQcacheFree (MmKvArena_t* arena, MmKvRegion_t* region)
+{
+    MmKvQcache_t* qcache = &arena->qcaches[region->numPages - 1];
+    TskDisablePreempt();
+    MmKvQmag_t* mag = &qcache->cpus[CpuGetCcb()->cpuNum];
+    if (mag->rounds == MM_KV_QMAG_SZ)
+        mmKvQcacheFlush (arena, qcache, mag);
+    mag->regions[mag->rounds++] = region;
+    TskEnablePreempt();
+}
+
+#ifdef MUL_LARGE_PAGESZ
+// Brings in a large page worth of memory at once
+static bool mmKvGetLarge (MmObject_t* kmemObj, uintptr_t addr, size_t offset)
+{
+    // Don't break up large blocks when memory is tight
+    if (MmGetPageShortage())
+        return false;
+    MmPage_t* pages = MmAllocPagesAt (MUL_LARGE_PAGES, 0, MUL_LARGE_PAGESZ);
+    if (!pages)
+        return false;
+    for (int i = 0; i < MUL_LARGE_PAGES; ++i)
+    {
+        MmPage_t* page = &pages[i];
+        MmMulZeroPage (page);
+        MmLockPage (page);
+        // Fix this page in memory
+        MmFixPage (page);
+        MmAddPage (kmemObj, offset + (i * NEXKE_CPU_PAGESZ), page);
+        MmBackendPageIn (kmemObj, offset + (i * NEXKE_CPU_PAGESZ), page);
+        MmUnlockPage (page);
+    }
+    MmMulMapPage (&kmemSpace, addr, pages, MM_KV_PERM | MUL_PAGE_LARGE);
+    return true;
 }
+#endif
 
 // Brings memory in for region
 static void mmKvGetMemory (void* p, size_t numPages)
@@ -455,22 +602,47 @@ static void mmKvGetMemory (void* p, size_t numPages)
     // Get base offset
     uintptr_t offset = (uintptr_t) p - kmemSpace.startAddr;
     MmObject_t* kmemObj = kmemSpace.entryList->obj;
+    // Pages are mapped in batches, so page tables are walked once per batch
+    MmPage_t* batch[MM_KV_MAP_BATCH];
+    int batchSz = 0;
+    uintptr_t batchAddr = (uintptr_t) p;
     for (int i = 0; i < numPages; ++i)
     {
-        MmPage_t* page = MmAllocPage();
+        uintptr_t addr = (uintptr_t) p + (i * NEXKE_CPU_PAGESZ);
+#ifdef MUL_LARGE_PAGESZ
+        // Use a large page for aligned runs that are big enough
+        if (!(addr & (MUL_LARGE_PAGESZ - 1)) && (numPages - i) >= MUL_LARGE_PAGES)
+        {
+            if (batchSz)
+                MmMulMapRange (&kmemSpace, batchAddr, batch, batchSz, MM_KV_PERM);
+            batchSz = 0;
+            if (mmKvGetLarge (kmemObj, addr, offset + (i * NEXKE_CPU_PAGESZ)))
+            {
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
+#endif
+        MmPage_t* page = MmAllocZeroedPage();
         if (!page)
             NkPanicOom();
-        NkSpinLock (&page->lock);
+        MmLockPage (page);
         // Fix this page in memory
         MmFixPage (page);
         MmAddPage (kmemObj, offset + (i * NEXKE_CPU_PAGESZ), page);
-        MmMulMapPage (&kmemSpace,
-                      (uintptr_t) p + (i * NEXKE_CPU_PAGESZ),
-                      page,
-                      MUL_PAGE_KE | MUL_PAGE_RW | MUL_PAGE_R);
         MmBackendPageIn (kmemObj, offset + (i * NEXKE_CPU_PAGESZ), page);
-        NkSpinUnlock (&page->lock);
+        MmUnlockPage (page);
+        if (!batchSz)
+            batchAddr = addr;
+        batch[batchSz++] = page;
+        if (batchSz == MM_KV_MAP_BATCH)
+        {
+            MmMulMapRange (&kmemSpace, batchAddr, batch, batchSz, MM_KV_PERM);
+            batchSz = 0;
+        }
     }
+    if (batchSz)
+        MmMulMapRange (&kmemSpace, batchAddr, batch, batchSz, MM_KV_PERM);
 }
 
 // Frees memory for page
@@ -484,12 +656,12 @@ static void mmKvFreeMemory (void* p, size_t numPages)
         MmPage_t* page = MmLookupPage (kmemObj, offset);
         if (page)
         {
-            NkSpinLock (&page->lock);
+            MmLockPage (page);
             // Free it
             MmUnfixPage (page);
             MmRemovePage (page);
             MmFreePage (page);
-            NkSpinUnlock (&page->lock);
+            MmUnlockPage (page);
         }
         offset += NEXKE_CPU_PAGESZ;
     }
@@ -502,30 +674,30 @@ void* MmAllocKvRegion (size_t numPages, int flags)
 {
     // Find arena that has enough free pages
     MmKvArena_t* arena = mmArenas;
-    while (arena)
+    for (; arena; arena = arena->next)
     {
-        if (arena->numFreePages >= numPages)
+        // Check if compatible
+        if (!(flags & MM_KV_NO_DEMAND) && !arena->needsMap)
+            continue;
+        // Small regions come from quantum caches
+        void* p = NULL;
+        if (numPages <= MM_KV_QCACHE_MAX)
+            p = mmKvQcacheAlloc (arena, numPages);
+        if (!p && arena->numFreePages >= numPages)
         {
-            // Also check if compatible
-            if (!(flags & MM_KV_NO_DEMAND) && !arena->needsMap)
-                continue;
-            // If this is a single page allocation attempt to pull from free list
-            void* p = NULL;
-            if (numPages == 1)
-                p = mmKvAllocFreeList (arena);
-            if (!p)
-                p = (void*) mmAllocKvInArena (arena, numPages)->vaddr;
-            if (p)
+            MmKvRegion_t* region = mmAllocKvInArena (arena, numPages);
+            if (region)
+                p = (void*) region->vaddr;
+        }
+        if (p)
+        {
+            if (flags & MM_KV_NO_DEMAND && arena->needsMap)
             {
-                if (flags & MM_KV_NO_DEMAND && arena->needsMap)
-                {
-                    // Go ahead and bring in pages for this memory region
-                    mmKvGetMemory (p, numPages);
-                }
-                return p;
+                // Go ahead and bring in pages for this memory region
+                mmKvGetMemory (p, numPages);
             }
+            return p;
         }
-        arena = arena->next;
     }
     return NULL;
 }
@@ -538,23 +710,34 @@ void MmFreeKvRegion (void* mem)
     // Get region header
     MmKvRegion_t* region = mmKvGetRegion (arena, (uintptr_t) mem);
     size_t numPages = region->numPages;
-    region->isFree = true;
-    arena->numFreePages += region->numPages;
-    if (numPages == 1 && arena->freeListSz <= MM_KV_MAX_FREELIST)
-        mmKvFreeToList (arena, region);
-    else
-    {
-        // Join joinable regions
-        region = mmKvJoinRegions (arena, region);
-        // Add region to appropriate bucket
-        MmKvBucket_t* bucket = &arena->buckets[mmKvGetBucket (region->numPages)];
-        NkSpinLock (&bucket->lock);
-        NkListAddFront (&bucket->regionList, &region->link);
-        NkSpinUnlock (&bucket->lock);
-    }
-    // Unmap and free memory
+    // Unmap and free memory before anyone else can get the region
     if (arena->needsMap)
         mmKvFreeMemory (mem, numPages);
+    if (numPages <= MM_KV_QCACHE_MAX)
+        mmKvQcacheFree (arena, region);
+    else
+        mmKvFreeToArena (arena, region);
+}
+
+// Gets size of a region in pages
+size_t MmGetKvRegionPages (void* mem)
+{
+    return mmKvGetRegion (mmKvGetArena (mem), (uintptr_t) mem)->numPages;
+}
+
+// Sets owner of a region
+void MmSetKvOwner (void* mem, void* owner)
+{
+    MmKvRegion_t* region = mmKvGetRegion (mmKvGetArena (mem), (uintptr_t) mem);
+    // Entries of pages are next to each other, and the footer doesn't reach the owner
+    for (size_t i = 0; i < region->numPages; ++i)
+        region[i].owner = owner;
+}
+
+// Gets owner of the region an address is in
+void* MmGetKvOwner (void* ptr)
+{
+    return mmKvGetRegion (mmKvGetArena (ptr), (uintptr_t) ptr)->owner;
 }
 
 // Allocates a memory page for kernel
@@ -581,34 +764,184 @@ MmObject_t* MmGetKernelObject()
     return kmemSpace.entryList->obj;
 }
 
+// Finds a mapping with perm that has numPages at phys in it
+// MMIO lock must be held
+static mmKvMmio_t* mmKvFindMmio (paddr_t phys, size_t numPages, int perm)
+{
+    paddr_t end = phys + (numPages * NEXKE_CPU_PAGESZ);
+    NkLink_t* iter = NkListFront (&mmKvMmioList);
+    while (iter)
+    {
+        mmKvMmio_t* mmio = LINK_CONTAINER (iter, mmKvMmio_t, link);
+        if (mmio->perm == perm && mmio->phys <= phys &&
+            end <= (mmio->phys + (mmio->numPages * NEXKE_CPU_PAGESZ)))
+        {
+            return mmio;
+        }
+        iter = NkListIterate (&mmKvMmioList, iter);
+    }
+    return NULL;
+}
+
+#ifdef MUL_LARGE_PAGESZ
+// Maps a large page of MMIO at pfn to addr, if it can be
+static bool mmKvMapMmioLarge (uintptr_t addr, pfn_t pfn, int perm)
+{
+    // Pages in the PFN map have to be put in the kernel object, so only memory outside of it
+    // qualifies. Pages there are forged, and large mappings don't keep track of their pages, so
+    // the forged page can go once it's mapped
+    if ((pfn & (MUL_LARGE_PAGES - 1)) || MmPfnRangeInMap (pfn, MUL_LARGE_PAGES))
+        return false;
+    MmPage_t* page = MmFindPagePfn (pfn);
+    bool mapped = MmMulMapLarge (&kmemSpace, addr, page, perm);
+    MmFreePage (page);
+    return mapped;
+}
+#endif
+
+// Maps numPages of MMIO at phys for mmio
+static void mmKvMapMmio (mmKvMmio_t* mmio, paddr_t phys, size_t numPages, int perm)
+{
+    size_t regionPages = numPages;
+#ifdef MUL_LARGE_PAGESZ
+    // If a whole large page fits in the range, make room to line the mapping up with it. That
+    // costs up to a large page of address space, which doesn't matter for ranges that big
+    paddr_t firstLarge = (phys + (MUL_LARGE_PAGESZ - 1)) & ~((paddr_t) MUL_LARGE_PAGESZ - 1);
+    bool large = (firstLarge + MUL_LARGE_PAGESZ) <= (phys + (numPages * NEXKE_CPU_PAGESZ));
+    if (large)
+        regionPages += MUL_LARGE_PAGES - 1;
+#endif
+    void* region = MmAllocKvRegion (regionPages, 0);
+    if (!region)
+        NkPanicOom();
+    uintptr_t virt = (uintptr_t) region;
+#ifdef MUL_LARGE_PAGESZ
+    if (large)
+        virt += ((uintptr_t) phys - virt) & (MUL_LARGE_PAGESZ - 1);
+#endif
+    uintptr_t off = virt - kmemSpace.startAddr;
+    // Loop through every page and add it, mapping them in batches
+    pfn_t basePfn = (pfn_t) (phys / NEXKE_CPU_PAGESZ);
+    MmPage_t* batch[MM_KV_MAP_BATCH];
+    int batchSz = 0;
+    uintptr_t batchAddr = virt;
+    for (size_t i = 0; i < numPages; ++i)
+    {
+        uintptr_t addr = virt + (i * NEXKE_CPU_PAGESZ);
+#ifdef MUL_LARGE_PAGESZ
+        if (large && !(addr & (MUL_LARGE_PAGESZ - 1)) && (numPages - i) >= MUL_LARGE_PAGES)
+        {
+            if (batchSz)
+                MmMulMapRange (&kmemSpace, batchAddr, batch, batchSz, perm);
+            batchSz = 0;
+            if (mmKvMapMmioLarge (addr, basePfn + i, perm))
+            {
+                i += MUL_LARGE_PAGES - 1;
+                continue;
+            }
+        }
+#endif
+        MmPage_t* page = MmFindPagePfn (basePfn + i);
+        assert (page);
+        MmLockPage (page);
+        MmAddPage (kmemSpace.entryList->obj, off + (i * NEXKE_CPU_PAGESZ), page);
+        MmUnlockPage (page);
+        if (!batchSz)
+            batchAddr = addr;
+        batch[batchSz++] = page;
+        if (batchSz == MM_KV_MAP_BATCH)
+        {
+            MmMulMapRange (&kmemSpace, batchAddr, batch, batchSz, perm);
+            batchSz = 0;
+        }
+    }
+    if (batchSz)
+        MmMulMapRange (&kmemSpace, batchAddr, batch, batchSz, perm);
+    mmio->phys = phys;
+    mmio->numPages = numPages;
+    mmio->perm = perm;
+    mmio->region = region;
+    mmio->virt = virt;
+    mmio->refCount = 1;
+    MmSetKvOwner (region, mmio);
+}
+
 // Maps in MMIO / FW memory
 void* MmAllocKvMmio (paddr_t phys, int numPages, int perm)
 {
-    // Allocate number of virtual pages for this memory
-    void* virt = MmAllocKvRegion (numPages, 0);
-    if (!virt)
+    paddr_t base = phys - (phys % NEXKE_CPU_PAGESZ);
+    // Share a mapping that has the range in it if there is one
+    NkSpinLock (&mmKvMmioLock);
+    mmKvMmio_t* mmio = mmKvFindMmio (base, numPages, perm);
+    if (mmio)
+        ++mmio->refCount;
+    NkSpinUnlock (&mmKvMmioLock);
+    if (mmio)
+        return (void*) (mmio->virt + (uintptr_t) (phys - mmio->phys));
+    // Map it ourselves. Someone else might map the same range in the meantime, but then there's
+    // just two mappings of it
+    mmio = kmalloc (sizeof (mmKvMmio_t), MM_TAG_MM);
+    if (!mmio)
         NkPanicOom();
+    mmKvMapMmio (mmio, base, numPages, perm);
+    NkSpinLock (&mmKvMmioLock);
+    NkListAddFront (&mmKvMmioList, &mmio->link);
+    NkSpinUnlock (&mmKvMmioLock);
+    return (void*) (mmio->virt + (uintptr_t) (phys - base));
+}
+
+// Maps count physically contiguous pages into kernel space
+void* MmMapKvContig (MmPage_t* pages, size_t count, int perm)
+{
+    void* virt = MmAllocKvRegion (count, 0);
+    if (!virt)
+        return NULL;
     uintptr_t off = (uintptr_t) virt - kmemSpace.startAddr;
-    // Loop through every page and map and add it
-    pfn_t curPfn = (pfn_t) (phys / NEXKE_CPU_PAGESZ);
-    for (int i = 0; i < numPages; ++i)
+    MmObject_t* kmemObj = kmemSpace.entryList->obj;
+    for (size_t i = 0; i < count; ++i)
     {
-        MmPage_t* page = MmFindPagePfn (curPfn);
-        assert (page);
-        NkSpinLock (&page->lock);
-        MmAddPage (kmemSpace.entryList->obj, off + i * (NEXKE_CPU_PAGESZ), page);
-        MmMulMapPage (&kmemSpace, (uintptr_t) virt + (i * NEXKE_CPU_PAGESZ), page, perm);
-        NkSpinUnlock (&page->lock);
+        MmPage_t* page = &pages[i];
+        MmLockPage (page);
+        // Fix this page in memory
+        MmFixPage (page);
+        MmAddPage (kmemObj, off + (i * NEXKE_CPU_PAGESZ), page);
+        MmBackendPageIn (kmemObj, off + (i * NEXKE_CPU_PAGESZ), page);
+        MmUnlockPage (page);
     }
-    // Get address right
-    virt += (uintptr_t) phys % NEXKE_CPU_PAGESZ;
+    MmMulMapContig (&kmemSpace, (uintptr_t) virt, pages, count, MM_KV_PERM | perm);
     return virt;
 }
 
 // Unmaps MMIO / FW memory
 void MmFreeKvMmio (void* virt)
 {
-    MmFreeKvRegion ((void*) CpuPageAlignDown ((uintptr_t) virt));
+    mmKvMmio_t* mmio = MmGetKvOwner (virt);
+    assert (mmio);
+    // The mapping goes away with its last user
+    NkSpinLock (&mmKvMmioLock);
+    bool last = !--mmio->refCount;
+    if (last)
+        NkListRemove (&mmKvMmioList, &mmio->link);
+    NkSpinUnlock (&mmKvMmioLock);
+    if (!last)
+        return;
+    MmFreeKvRegion (mmio->region);
+    kfree (mmio, sizeof (mmKvMmio_t), MM_TAG_MM);
+}
+
+// Maps boot module idx read-only into kernel space, where nexboot put it
+void* MmMapBootModule (int idx, size_t* size)
+{
+    NexNixBoot_t* boot = NkGetBootArgs();
+    if (idx < 0 || idx >= boot->numMods)
+        return NULL;
+    NexNixMod_t* mod = &boot->modInfo[idx];
+    // The module's pages are added to the kernel object in place, so nothing gets copied
+    size_t numPages = CpuPageAlignUp (mod->size) / NEXKE_CPU_PAGESZ;
+    if (!numPages)
+        return NULL;
+    *size = mod->size;
+    return MmAllocKvMmio (mod->base, numPages, MUL_PAGE_R | MUL_PAGE_KE);
 }
 
 // Kernel backend functions
@@ -625,12 +958,14 @@ bool KvmDestroyObj (MmObject_t* obj)
 
 bool KvmPageIn (MmObject_t* obj, size_t offset, MmPage_t* page)
 {
-    // Zero this page
-    MmMulZeroPage (page);
+    // Zero this page, unless it came from the zeroed pool
+    if (!(page->flags & MM_PAGE_ZEROED))
+        MmMulZeroPage (page);
+    page->flags &= ~(MM_PAGE_ZEROED);
     return true;
 }
 
-bool KvmPageOut (MmObject_t* obj, size_t offset)
+bool KvmPageOut (MmObject_t* obj, size_t offset, MmPage_t* page)
 {
     return false;
 }
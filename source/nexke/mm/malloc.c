@@ -19,76 +19,112 @@
 #include <nexke/nexke.h>
 #include <stdlib.h>
 
-// This is basically a power-of-two allocator
-// It has a slab cache for powers of two from 16 - 8192
-// Even though power-of-two allocators aren't that great, they are simple
-// and this allocator isn't going to be used very much
-
-#define NUM_POWERS 10
-
-#define CACHE_SZ16   0
-#define CACHE_SZ32   1
-#define CACHE_SZ64   2
-#define CACHE_SZ128  3
-#define CACHE_SZ256  4
-#define CACHE_SZ512  5
-#define CACHE_SZ1024 6
-#define CACHE_SZ2048 7
-#define CACHE_SZ4096 8
-#define CACHE_SZ8192 9
+// This is a size class allocator
+// Each power of two from 16 - 8192 is split into 4 classes, giving roughly 1.25x
+// steps between sizes, and each class is backed by a slab cache
+// The class for a size is found in O(1) with a lookup table indexed on (sz - 1) >> shift
+// Anything bigger than the largest class is sent straight to the KV allocator
+
+#define MALLOC_NUM_CLASSES 32
+
+// Size class table
+static size_t classSizes[MALLOC_NUM_CLASSES] = {
+    16,   32,   48,   64,   80,   96,   112,  128,  160,  192,  224,  256,  320,  384,  448,  512,
+    640,  768,  896,  1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192};
+
+// Lookup tables. Small sizes are indexed with 16 byte granularity, large ones with 128
+#define MALLOC_SMALL_MAX   1024
+#define MALLOC_SMALL_SHIFT 4
+#define MALLOC_LARGE_MAX   8192
+#define MALLOC_LARGE_SHIFT 7
+
+static uint8_t smallLookup[MALLOC_SMALL_MAX >> MALLOC_SMALL_SHIFT] = {0};
+static uint8_t largeLookup[MALLOC_LARGE_MAX >> MALLOC_LARGE_SHIFT] = {0};
 
 // Array of slab caches
-static SlabCache_t* caches[NUM_POWERS] = {NULL};
+static SlabCache_t* caches[MALLOC_NUM_CLASSES] = {NULL};
 
 // Initializes general purpose memory allocator
 void MmMallocInit()
 {
-    int curNum = 16;
-    for (int i = 0; i < NUM_POWERS; ++i)
+    for (int i = 0; i < MALLOC_NUM_CLASSES; ++i)
+        caches[i] = MmCacheCreate (classSizes[i], "malloc bucket", MM_TAG_NONE, 0, 0);
+    // Build lookup tables. Each slot maps to the smallest class that fits the top of the slot
+    int class = 0;
+    for (int i = 0; i < (MALLOC_SMALL_MAX >> MALLOC_SMALL_SHIFT); ++i)
     {
-        caches[i] = MmCacheCreate (curNum, "malloc bucket", 0, 0);
-        curNum *= 2;
+        size_t sz = (i + 1) << MALLOC_SMALL_SHIFT;
+        while (classSizes[class] < sz)
+            ++class;
+        smallLookup[i] = class;
+    }
+    class = 0;
+    for (int i = 0; i < (MALLOC_LARGE_MAX >> MALLOC_LARGE_SHIFT); ++i)
+    {
+        size_t sz = (i + 1) << MALLOC_LARGE_SHIFT;
+        while (classSizes[class] < sz)
+            ++class;
+        largeLookup[i] = class;
     }
 }
 
-static inline SlabCache_t* mallocGetCache (size_t sz)
+// Gets the cache for a size, or NULL if it is a large allocation
+static FORCEINLINE SlabCache_t* mallocGetCache (size_t sz)
 {
-    SlabCache_t* cache = NULL;
-    if (sz <= 16)
-        cache = caches[CACHE_SZ16];
-    else if (sz <= 32)
-        cache = caches[CACHE_SZ32];
-    else if (sz <= 64)
-        cache = caches[CACHE_SZ64];
-    else if (sz <= 128)
-        cache = caches[CACHE_SZ128];
-    else if (sz <= 256)
-        cache = caches[CACHE_SZ256];
-    else if (sz <= 512)
-        cache = caches[CACHE_SZ512];
-    else if (sz <= 1024)
-        cache = caches[CACHE_SZ1024];
-    else if (sz <= 2048)
-        cache = caches[CACHE_SZ2048];
-    else if (sz <= 4096)
-        cache = caches[CACHE_SZ4096];
-    else if (sz <= 8192)
-        cache = caches[CACHE_SZ8192];
-    else
-        NkPanic ("nexke: invalid size of %u to malloc", sz);
-    return cache;
+    if (!sz)
+        sz = 1;
+    if (sz <= MALLOC_SMALL_MAX)
+        return caches[smallLookup[(sz - 1) >> MALLOC_SMALL_SHIFT]];
+    else if (sz <= MALLOC_LARGE_MAX)
+        return caches[largeLookup[(sz - 1) >> MALLOC_LARGE_SHIFT]];
+    return NULL;
+}
+
+// Gets the size of memory that's actually used for an allocation of sz
+static FORCEINLINE size_t mallocGetRealSz (SlabCache_t* cache, size_t sz)
+{
+    return (cache) ? cache->objSz : CpuPageAlignUp (sz);
 }
 
-void* kmalloc (size_t sz)
+void* kmalloc (size_t sz, int tag)
 {
-    // Figure out power of two we should use
+    // Figure out size class we should use
     SlabCache_t* cache = mallocGetCache (sz);
-    return MmCacheAlloc (cache);
+    void* ptr = NULL;
+    if (!cache)
+    {
+        // Large allocation, get it from the KV allocator
+        // The region may have been a slab before, so make sure it isn't mistaken for one
+        ptr = MmAllocKvRegion (CpuPageAlignUp (sz) >> NEXKE_CPU_PAGE_SHIFT, MM_KV_NO_DEMAND);
+        if (ptr)
+            MmSetKvOwner (ptr, NULL);
+    }
+    else
+        ptr = MmCacheAlloc (cache);
+    // The bucket caches aren't charged, so that the memory goes to the caller's tag
+    uintptr_t site = (uintptr_t) __builtin_return_address (0);
+    if (ptr)
+        MmTagCharge (tag, ptr, mallocGetRealSz (cache, sz), site);
+    return ptr;
 }
 
-void kfree (void* ptr, size_t sz)
+void kfree (void* ptr, size_t sz, int tag)
 {
-    // Figure out power of two we should use
+    // Figure out size class we should use
     SlabCache_t* cache = mallocGetCache (sz);
-    return MmCacheFree (cache, ptr);
+    MmTagUncharge (tag, ptr, mallocGetRealSz (cache, sz));
+    if (!cache)
+    {
+        MmFreeKvRegion (ptr);
+        return;
+    }
+    MmCacheFree (cache, ptr);
+}
+
+void kfreePtr (void* ptr, int tag)
+{
+    // Slab memory knows its cache, anything else is a large allocation. Buckets may be merged
+    // into a shared cache, so go back through the size to free to the right bucket
+    SlabCache_t* cache = MmGetCacheFromPtr (ptr);
+    kfree (ptr, (cache) ? cache->objSz : MmGetKvRegionPages (ptr) << NEXKE_CPU_PAGE_SHIFT, tag);
 }
@@ -25,7 +25,7 @@ static SlabCache_t* mmObjCache = NULL;    // Contains object slab cache
 // Initializes object system
 void MmInitObject()
 {
-    mmObjCache = MmCacheCreate (sizeof (MmObject_t), "MmObject_t", 0, 0);
+    mmObjCache = MmCacheCreate (sizeof (MmObject_t), "MmObject_t", MM_TAG_MM, 0, 0);
     if (!mmObjCache)
         NkPanicOom();
 }
@@ -39,9 +39,11 @@ MmObject_t* MmCreateObject (size_t pages, int backend, int perm)
     obj->backend = backend;
     obj->perm = perm;
     obj->count = pages;
-    NkListInit (&obj->pageList);
+    MmInitPageTree (obj);
     obj->refCount = 1;
-    if (backend > MM_BACKEND_MAX)
+    obj->parent = NULL;
+    obj->parentOff = 0;
+    if (backend >= MM_BACKEND_MAX)
     {
         MmCacheFree (mmObjCache, obj);
         return NULL;
@@ -63,28 +65,115 @@ void MmRefObject (MmObject_t* object)
 // Dereferences a memory object
 void MmDeRefObject (MmObject_t* object)
 {
-    NkSpinLock (&object->lock);
-    --object->refCount;
-    if (!object->refCount)
+    while (object)
     {
-        // Destroy all pages in object
-        NkLink_t* iter = NkListFront (&object->pageList);
-        while (iter)
+        NkSpinLock (&object->lock);
+        --object->refCount;
+        if (object->refCount)
         {
-            MmPage_t* page = LINK_CONTAINER (iter, MmPage_t, objLink);
-            NkSpinLock (&page->lock);
-            MmRemovePage (page);
-            // Free it
-            MmFreePage (page);
-            iter = NkListIterate (&object->pageList, iter);
-            NkSpinUnlock (&page->lock);
+            NkSpinUnlock (&object->lock);
+            return;
         }
+        // Destroy all pages in object
+        MmObject_t* parent = object->parent;
+        MmFreeObjectPages (object);
         MmBackendDestroy (object);
+        NkSpinUnlock (&object->lock);
+        MmCacheFree (mmObjCache, object);
+        // Drop the reference we had on our parent
+        object = parent;
     }
-    NkSpinUnlock (&object->lock);
 }
 
 // Applies new permissions to object
 void MmProtectObject (MmObject_t* object, int newPerm)
 {
 }
+
+// Creates a copy-on-write shadow of parent
+MmObject_t* MmCreateShadow (MmObject_t* parent, size_t offset, size_t pages)
+{
+    MmObject_t* obj = MmCreateObject (pages, MM_BACKEND_ANON, parent->perm);
+    if (!obj)
+        return NULL;
+    MmRefObject (parent);
+    obj->parent = parent;
+    obj->parentOff = offset;
+    return obj;
+}
+
+// Merges parents that only obj references into obj
+void MmCollapseObject (MmObject_t* obj)
+{
+    while (obj->parent)
+    {
+        MmObject_t* parent = obj->parent;
+        // Only anonymous parents can be merged, others have to keep their pages
+        if (parent->backend != MM_BACKEND_ANON)
+            return;
+        NkSpinLock (&parent->lock);
+        // If anyone else can see parent, leave it alone
+        if (parent->refCount != 1)
+        {
+            NkSpinUnlock (&parent->lock);
+            return;
+        }
+        // Move over pages we can see but don't have a copy of yet
+        size_t off = obj->parentOff;
+        size_t end = obj->parentOff + (obj->count * NEXKE_CPU_PAGESZ);
+        MmPage_t* page = NULL;
+        while ((page = MmLookupPageNext (parent, &off)) && off < end)
+        {
+            size_t childOff = off - obj->parentOff;
+            if (!MmLookupPage (obj, childOff) && !MmZpoolHas (obj, childOff))
+            {
+                MmLockPage (page);
+                MmRemovePage (page);
+                MmAddPage (obj, childOff, page);
+                MmUnlockPage (page);
+            }
+            off += NEXKE_CPU_PAGESZ;
+        }
+        // Same goes for pages that were compressed
+        MmZpoolCollapse (obj, parent);
+        // Take over parent's place in the chain
+        obj->parent = parent->parent;
+        obj->parentOff += parent->parentOff;
+        // Now destroy parent, getting rid of the pages that aren't visible anymore
+        MmFreeObjectPages (parent);
+        MmBackendDestroy (parent);
+        NkSpinUnlock (&parent->lock);
+        MmCacheFree (mmObjCache, parent);
+    }
+}
+
+// Anonymous backend
+
+// Evicted pages are kept compressed in memory, and backend data points to the object's first one
+
+bool AnonInitObj (MmObject_t* obj)
+{
+    obj->pageable = true;
+    obj->backendData = NULL;
+    return true;
+}
+
+bool AnonDestroyObj (MmObject_t* obj)
+{
+    MmZpoolFreeObject (obj);
+    return true;
+}
+
+bool AnonPageIn (MmObject_t* obj, size_t offset, MmPage_t* page)
+{
+    // Anonymous memory starts out zeroed, unless it was compressed
+    if (!MmZpoolLoad (obj, offset, page) && !(page->flags & MM_PAGE_ZEROED))
+        MmMulZeroPage (page);
+    page->flags &= ~(MM_PAGE_ZEROED);
+    return true;
+}
+
+bool AnonPageOut (MmObject_t* obj, size_t offset, MmPage_t* page)
+{
+    return MmZpoolStore (obj, offset, page);
+}
@@ -19,6 +19,8 @@
 #include <nexke/mm.h>
 #include <nexke/nexboot.h>
 #include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/task.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -28,40 +30,291 @@ static MmZone_t* mmZones[MAX_ZONES] = {0};    // Array of zones
 static size_t mmNumZones = 0;                 // Number of zones
 static SlabCache_t* mmZoneCache = NULL;       // Slab cache of zones
 
-static void* pfnMapMark = (void*) NEXKE_PFNMAP_BASE;    // Next place to put zone's PFN map at
-
 static SlabCache_t* mmFakePageCache = NULL;    // Fake page cache
 
-static MmZone_t* freeHint = NULL;    // Free zone hint
+static MmPage_t* mmZeroPage = NULL;    // Page of zeroes shared by anonymous read faults
+
+static MmZone_t* mmCmaZone = NULL;    // Contiguous reserve
+
+static MmZone_t* freeHint[NEXKE_MAX_NODES] = {0};    // Free zone hint of each node
+
+// NUMA nodes
+static int mmNumNodes = 1;
+static int mmNodeOrder[NEXKE_MAX_NODES][NEXKE_MAX_NODES];    // Nodes nearest first, by node
 
 static SlabCache_t* mmPageMapCache = NULL;    // Cache for page maps
 
-// Page hash table
-typedef struct _pagebucket
-{
-    NkList_t list;
-    spinlock_t lock;
-} MmPageBucket_t;
+// Per-CPU page cache defaults
+#define MM_PCP_HIGH  64
+#define MM_PCP_BATCH 16
+
+static int mmPcpHigh = MM_PCP_HIGH;    // Page cache tunables every CPU starts out with
+static int mmPcpBatch = MM_PCP_BATCH;
+
+// Zeroed page pool
+#define MM_ZERO_POOL_MAX 32
+
+static NkList_t mmZeroPool = {0};
+static int mmZeroPoolCount = 0;
+static spinlock_t mmZeroPoolLock = 0;
 
-static MmPageBucket_t* mmPageHash = NULL;
-static size_t mmNumBuckets = 0;    // Number of page buckets
+// Page table reserves
+// Each CPU keeps zeroed pages for page tables, so mapping doesn't have to allocate and zero one
+// The idle thread refills it up to a target that is resized every period to the number of
+// tables made during it, so CPUs that map in bursts keep more at hand
+#define MM_PT_RESERVE_MIN    4
+#define MM_PT_RESERVE_MAX    64
+#define MM_PT_RESERVE_PERIOD (PLT_NS_IN_SEC / 10)
 
 // Informational variables
 static uintmax_t mmNumPages = 0;      // Number of pages in system
 static uintmax_t mmFreePages = 0;     // Number of free pages in system
 static uintmax_t mmFixedPages = 0;    // Number of fixed pages
 
+static long long mmStatReadTotal()
+{
+    return (long long) mmNumPages;
+}
+
+static long long mmStatReadFree()
+{
+    return (long long) mmFreePages;
+}
+
+static NkStat_t mmStatAllocs = {.name = "mm.page_allocs", .type = NK_STAT_COUNTER};
+static NkStat_t mmStatFrees = {.name = "mm.page_frees", .type = NK_STAT_COUNTER};
+static NkStat_t mmStatMigrations = {.name = "mm.cma_migrations", .type = NK_STAT_COUNTER};
+static NkStat_t mmStatTotal = {.name = "mm.pages",
+                               .type = NK_STAT_GAUGE,
+                               .read = mmStatReadTotal};
+static NkStat_t mmStatFree = {.name = "mm.free_pages",
+                              .type = NK_STAT_GAUGE,
+                              .read = mmStatReadFree};
+
+// Reclaim watermarks
+// When free pages fall below the low watermark, we reclaim until we reach the high one
+#define MM_LOW_WATER_DIV 64
+#define MM_LOW_WATER_MIN 64
+
+// Number of times an allocation waits for the pageout daemon before giving up
+#define MM_OOM_RETRIES 4
+
+static uintmax_t mmLowPages = 0;     // Low watermark
+static uintmax_t mmHighPages = 0;    // High watermark
+
+// Sets reclaim watermarks from the amount of memory
+static void mmSetWatermarks()
+{
+    mmLowPages = mmNumPages / MM_LOW_WATER_DIV;
+    if (mmLowPages < MM_LOW_WATER_MIN)
+        mmLowPages = MM_LOW_WATER_MIN;
+    mmHighPages = mmLowPages * 2;
+}
+
 // Initializes an MmPage
-static void mmInitPage (MmPage_t* page, pfn_t pfn, MmZone_t* zone)
+static void mmInitPage (MmPage_t* page, MmZone_t* zone)
 {
-    page->zone = zone;
-    page->pfn = pfn;
-    page->lock = 0;
     page->flags = MM_PAGE_FREE;
+    page->zoneIdx = zone->zoneIdx;
     page->link.prev = NULL, page->link.next = NULL;
-    NkListAddFront (&zone->freeList, &page->link);
     page->maps = NULL;
+    page->map.space = NULL;
     page->fixCount = 0;
+    page->order = 0;
+}
+
+// Gets zone of page
+static FORCEINLINE MmZone_t* mmPageGetZone (MmPage_t* page)
+{
+    return mmZones[page->zoneIdx];
+}
+
+// Buddy allocator
+// Each zone keeps a free list per order. A block of order N is 1 << N pages,
+// and is always aligned to 1 << N in PFN space, so the buddy of a block is
+// found by flipping bit N of its PFN. Only the first page of a free block is
+// on a free list; it is marked with MM_PAGE_BUDDY and records the order
+
+// Gets the order needed to hold count pages
+static FORCEINLINE int mmBuddyOrder (size_t count)
+{
+    int order = 0;
+    while ((1ULL << order) < count)
+        ++order;
+    return order;
+}
+
+// Gets page structure of PFN in zone, or NULL if it is outside of the zone or isn't set up yet
+static FORCEINLINE MmPage_t* mmZoneGetPage (MmZone_t* zone, pfn_t pfn)
+{
+    if (pfn < zone->pfn || pfn >= (zone->pfn + zone->initPages))
+        return NULL;
+    return &zone->pfnMap[pfn - zone->pfn];
+}
+
+// Adds a free block to zone
+static FORCEINLINE void mmBuddyAddBlock (MmZone_t* zone, MmPage_t* page, int order)
+{
+    page->flags = MM_PAGE_FREE | MM_PAGE_BUDDY;
+    page->order = order;
+    NkListAddFront (&zone->freeAreas[order], &page->link);
+}
+
+// Removes a free block from zone
+static FORCEINLINE void mmBuddyRemoveBlock (MmZone_t* zone, MmPage_t* page)
+{
+    assert (page->flags & MM_PAGE_BUDDY);
+    NkListRemove (&zone->freeAreas[page->order], &page->link);
+    page->flags &= ~(MM_PAGE_BUDDY);
+}
+
+// Checks if zone has a free block of at least the specified order
+static FORCEINLINE bool mmBuddyHasBlock (MmZone_t* zone, int order)
+{
+    for (int i = order; i < MM_ZONE_MAX_ORDER; ++i)
+    {
+        if (NkListFront (&zone->freeAreas[i]))
+            return true;
+    }
+    return false;
+}
+
+// Allocates a block of specified order from zone
+// Zone must be locked
+static MmPage_t* mmBuddyAlloc (MmZone_t* zone, int order)
+{
+    // Find smallest order with a free block
+    int curOrder = order;
+    while (curOrder < MM_ZONE_MAX_ORDER && !NkListFront (&zone->freeAreas[curOrder]))
+        ++curOrder;
+    if (curOrder == MM_ZONE_MAX_ORDER)
+        return NULL;
+    MmPage_t* page = LINK_CONTAINER (NkListFront (&zone->freeAreas[curOrder]), MmPage_t, link);
+    mmBuddyRemoveBlock (zone, page);
+    // Split the block down to the order we want, giving the upper halves back
+    while (curOrder > order)
+    {
+        --curOrder;
+        mmBuddyAddBlock (zone, page + (1ULL << curOrder), curOrder);
+    }
+    // Mark pages as allocated
+    size_t count = 1ULL << order;
+    for (int i = 0; i < count; ++i)
+        page[i].flags = MM_PAGE_ALLOCED;
+    zone->freeCount -= count;
+    mmFreePages -= count;
+    return page;
+}
+
+// Frees a block of specified order to zone, coalescing with it's buddies
+// Zone must be locked
+static void mmBuddyFree (MmZone_t* zone, MmPage_t* page, int order)
+{
+    size_t count = 1ULL << order;
+    for (int i = 0; i < count; ++i)
+        page[i].flags = MM_PAGE_FREE;
+    zone->freeCount += count;
+    mmFreePages += count;
+    pfn_t pfn = MmGetPagePfn (page);
+    while (order < (MM_ZONE_MAX_ORDER - 1))
+    {
+        // Check if buddy is a free block of the same order
+        MmPage_t* buddy = mmZoneGetPage (zone, pfn ^ (1ULL << order));
+        if (!buddy || !(buddy->flags & MM_PAGE_BUDDY) || buddy->order != order)
+            break;
+        // Merge them
+        mmBuddyRemoveBlock (zone, buddy);
+        pfn &= ~(1ULL << order);
+        ++order;
+    }
+    mmBuddyAddBlock (zone, mmZoneGetPage (zone, pfn), order);
+}
+
+// Frees an arbitrary range of pages to zone
+// Zone must be locked
+static void mmBuddyFreeRange (MmZone_t* zone, pfn_t pfn, size_t count)
+{
+    pfn_t end = pfn + count;
+    while (pfn < end)
+    {
+        // Find biggest aligned block that fits
+        int order = MM_ZONE_MAX_ORDER - 1;
+        while (order && ((pfn & ((1ULL << order) - 1)) || (pfn + (1ULL << order)) > end))
+            --order;
+        mmBuddyFree (zone, mmZoneGetPage (zone, pfn), order);
+        pfn += (1ULL << order);
+    }
+}
+
+// Deferred page structure setup
+// Page structures are set up a chunk at a time. Boot only sets up the first chunk of each zone,
+// and a background thread does the rest, so big machines don't wait on the whole PFN map.
+// Pages that aren't set up yet still count as free. A zone that runs out sets up another
+// chunk on the spot, as does looking up a page that isn't set up
+// Chunks end on a PFN aligned to the chunk size, so they free as whole max order blocks
+#define MM_INIT_CHUNK 32768
+
+// Sets up the next chunk of zone's page structures, and frees it to the buddy lists
+// Zone must be locked. Returns false if the zone was already all set up
+static bool mmZoneInitChunk (MmZone_t* zone)
+{
+    if (zone->initPages == zone->numPages)
+        return false;
+    pfn_t start = zone->pfn + zone->initPages;
+    pfn_t end = (start + MM_INIT_CHUNK) & ~((pfn_t) MM_INIT_CHUNK - 1);
+    if (end > (zone->pfn + zone->numPages))
+        end = zone->pfn + zone->numPages;
+    for (pfn_t pfn = start; pfn < end; ++pfn)
+        mmInitPage (&zone->pfnMap[pfn - zone->pfn], zone);
+    __atomic_store_n (&zone->initPages, end - zone->pfn, __ATOMIC_RELEASE);
+    // These were already counted as free
+    mmFreePages -= end - start;
+    mmBuddyFreeRange (zone, start, end - start);
+    return true;
+}
+
+// Sets up the buddy free lists of zone with its first chunk
+static void mmBuddyInitZone (MmZone_t* zone)
+{
+    // Free count will be rebuilt as chunks are freed
+    zone->freeCount = 0;
+    zone->initPages = 0;
+    mmZoneInitChunk (zone);
+}
+
+// Sets up the rest of the page structures
+static void mmPageInitThread (void*)
+{
+    for (int i = 0; i < mmNumZones; ++i)
+    {
+        MmZone_t* zone = mmZones[i];
+        if (!(zone->flags & MM_ZONE_ALLOCATABLE))
+            continue;
+        // Drop the lock between chunks, so allocations don't wait on the whole zone
+        bool more = true;
+        while (more)
+        {
+            NkMcsLock (&zone->lock);
+            more = mmZoneInitChunk (zone);
+            NkMcsUnlock (&zone->lock);
+        }
+    }
+    NkLogDebug ("nexke: all page structures set up\n");
+    TskTerminateSelf (0);
+}
+
+// Starts setting up the rest of the page structures in the background
+void MmStartPageInit()
+{
+    NkThread_t* thread = TskCreateThread (mmPageInitThread,
+                                          NULL,
+                                          "MmPageInit",
+                                          TSK_POLICY_NORMAL,
+                                          TSK_PRIO_USER,
+                                          0);
+    if (!thread)
+        NkPanicOom();
+    TskStartThread (thread);
 }
 
 // Checks for overlap between two zones
@@ -84,9 +337,16 @@ static inline bool mmZoneInsert (MmZone_t* zone)
         NkLogWarning ("nexke: ignoring zones past limit MAX_ZONES\n");
         return false;
     }
+    // nexboot hands over a sorted map, so zones almost always go on the end
+    size_t zoneIdx = 0;
+    MmZone_t* last = mmNumZones ? mmZones[mmNumZones - 1] : NULL;
+    if (!last || zone->pfn >= (last->pfn + last->numPages))
+    {
+        zoneIdx = mmNumZones;
+        goto insert;
+    }
     // We do a sorted insert, so that all zones are contiguous
     // Loop through each zone and find appropriate point to insert at
-    size_t zoneIdx = 0;
     for (int i = 0; i < mmNumZones; ++i)
     {
         if (mmZonesOverlap (mmZones[i], zone))
@@ -115,6 +375,7 @@ static inline bool mmZoneInsert (MmZone_t* zone)
         else
             zoneIdx = i + 1;
     }
+insert:
     mmZones[zoneIdx] = zone;    // Insert it
     zone->zoneIdx = zoneIdx;
     ++mmNumZones;
@@ -141,10 +402,13 @@ static inline void mmZoneRemove (MmZone_t* zone)
 static bool mmZoneMerge (MmZone_t* z1, MmZone_t* z2)
 {
     // Ensure z1 and z2 are mergeable
-    if (((z1->pfn + z1->numPages) == z2->pfn) && (z1->flags == z2->flags))
+    // PFN maps are indexed by PFN, so they are contigous if the zones are
+    if (((z1->pfn + z1->numPages) == z2->pfn) && (z1->flags == z2->flags) &&
+        (z1->node == z2->node))
     {
-        if (z1->flags & MM_ZONE_ALLOCATABLE)
-            assert (z1->freeCount == z1->numPages && z2->freeCount == z2->numPages);
+        // Page structures aren't set up yet, so nothing points at z2
+        assert (!(z1->flags & MM_ZONE_ALLOCATABLE) ||
+                (z1->freeCount == z1->numPages && z2->freeCount == z2->numPages));
         z1->numPages += z2->numPages;
         z1->freeCount += z2->freeCount;
         // Remove the zones
@@ -154,42 +418,48 @@ static bool mmZoneMerge (MmZone_t* z1, MmZone_t* z2)
     return false;
 }
 
-// Splits zone into 2 zones at specified point
+// Splits zone into 2 zones at specified PFN
+// The part beneath the split point gets newFlags, the part above keeps the old flags
+// NOTE: this can only be called during initialization
 static void mmZoneSplit (MmZone_t* zone, pfn_t splitPoint, int newFlags)
 {
     assert (zone->freeCount == zone->numPages);
-    assert ((splitPoint - zone->pfn) <= zone->numPages);
+    assert (splitPoint > zone->pfn && (splitPoint - zone->pfn) < zone->numPages);
     MmZone_t* newZone = (MmZone_t*) MmCacheAlloc (mmZoneCache);
     assert (newZone);
-    newZone->flags = newFlags;
+    memset (newZone, 0, sizeof (MmZone_t));
+    newZone->flags = zone->flags;
+    newZone->node = zone->node;
+    zone->flags = newFlags;
     // Split the zones
-    newZone->pfn = zone->pfn + splitPoint;
+    newZone->pfn = splitPoint;
     newZone->numPages = (zone->pfn + zone->numPages) - splitPoint;
     zone->numPages -= newZone->numPages;
+    newZone->freeCount = newZone->numPages;
+    zone->freeCount = zone->numPages;
+    newZone->pfnMap = zone->pfnMap + zone->numPages;
     // Insert the new zone into the list
-    mmZoneInsert (zone);
+    mmZoneInsert (newZone);
 }
 
 // Creates a zone
-static void mmZoneCreate (pfn_t startPfn, size_t numPfns, int flags)
+static void mmZoneCreate (pfn_t startPfn, size_t numPfns, int flags, int node)
 {
     // Create zone
     MmZone_t* zone = (MmZone_t*) MmCacheAlloc (mmZoneCache);
     assert (zone);
     // Initialize zone
     zone->flags = flags;
+    zone->node = node;
     zone->numPages = numPfns;
     zone->pfn = startPfn;
-    NkListInit (&zone->freeList);
+    zone->lock = 0;
+    for (int i = 0; i < MM_ZONE_MAX_ORDER; ++i)
+        NkListInit (&zone->freeAreas[i]);
     if (zone->flags & MM_ZONE_ALLOCATABLE)
     {
-        // Compute PFN map location
-        zone->pfnMap = (MmPage_t*) pfnMapMark;
-        // Move marker up
-        pfnMapMark += zone->numPages * sizeof (MmPage_t);
-        // Initialize PFN structs
-        for (int i = 0; i < zone->numPages; ++i)
-            mmInitPage (&zone->pfnMap[i], startPfn + i, zone);
+        // PFN structs are set up once zones are final
+        zone->pfnMap = &MM_PFNMAP[startPfn];
         zone->freeCount = zone->numPages;
         // Update state variables
         mmNumPages += zone->numPages;
@@ -206,7 +476,7 @@ static void mmZoneCreate (pfn_t startPfn, size_t numPfns, int flags)
 }
 
 // Checks if zone will work for allocation
-static bool mmZoneWillWork (MmZone_t* zone, pfn_t maxAddr, size_t needed, int bannedFlags)
+static bool mmZoneWillWork (MmZone_t* zone, pfn_t maxAddr, int order, int bannedFlags)
 {
     // Check flags and address
     if (zone->flags & bannedFlags || !(zone->flags & MM_ZONE_ALLOCATABLE))
@@ -214,33 +484,56 @@ static bool mmZoneWillWork (MmZone_t* zone, pfn_t maxAddr, size_t needed, int ba
     // Check if zone spans above max address
     if ((zone->pfn + zone->numPages) > maxAddr)
         return false;
-    // Ensure zone has free memory
-    if (zone->freeCount < needed)
-        return false;
+    // Ensure zone has a big enough block, setting up more of it if need be
+    while (zone->freeCount < (1ULL << order) || !mmBuddyHasBlock (zone, order))
+    {
+        if (!mmZoneInitChunk (zone))
+            return false;
+    }
     return true;
 }
 
 // Finds best zone for allocation, given a set of requirements
+// Nodes are tried nearest to node first
 // Returns locked zone
-static MmZone_t* mmZoneFindBest (pfn_t maxAddr, size_t count, int bannedFlags)
+static MmZone_t* mmZoneFindBest (pfn_t maxAddr, int order, int bannedFlags, int node)
 {
     if (!maxAddr)
         maxAddr = -1;
-    NkSpinLock (&freeHint->lock);
-    if (mmZoneWillWork (freeHint, maxAddr, count, bannedFlags))
-        return freeHint;
-    NkSpinUnlock (&freeHint->lock);
-    // Before iterating through zones, try checking zone hint
-    for (int i = 0; i < mmNumZones; ++i)
+    for (int i = 0; i < mmNumNodes; ++i)
     {
-        NkSpinLock (&mmZones[i]->lock);
-        if (mmZoneWillWork (mmZones[i], maxAddr, count, bannedFlags))
-            return mmZones[i];
-        NkSpinUnlock (&mmZones[i]->lock);
+        int curNode = mmNodeOrder[node][i];
+        // Before iterating through zones, try checking zone hint
+        MmZone_t* hint = freeHint[curNode];
+        if (hint)
+        {
+            NkMcsLock (&hint->lock);
+            if (mmZoneWillWork (hint, maxAddr, order, bannedFlags))
+                return hint;
+            NkMcsUnlock (&hint->lock);
+        }
+        for (int j = 0; j < mmNumZones; ++j)
+        {
+            if (mmZones[j]->node != curNode || mmZones[j] == hint)
+                continue;
+            NkMcsLock (&mmZones[j]->lock);
+            if (mmZoneWillWork (mmZones[j], maxAddr, order, bannedFlags))
+                return mmZones[j];
+            NkMcsUnlock (&mmZones[j]->lock);
+        }
     }
     return NULL;    // No zone found
 }
 
+// Gets node the running thread allocates from
+static FORCEINLINE int mmAllocNode (NkCcb_t* ccb)
+{
+    NkThread_t* thread = ccb->curThread;
+    if (thread && thread->memNode != MM_NODE_LOCAL)
+        return thread->memNode;
+    return ccb->node;
+}
+
 // Finds zone that contains specified PFN
 static MmZone_t* mmZoneFindByPfn (pfn_t pfn)
 {
@@ -252,62 +545,429 @@ static MmZone_t* mmZoneFindByPfn (pfn_t pfn)
     return NULL;
 }
 
+// Per-CPU page caches
+// Single page allocations and frees go to a list in the CCB, so that the zone lock
+// is only taken to move a batch of pages at a time. Freed pages are added to the front
+// as they are likely still in the CPU cache, and drains take from the back
+// Only pages from the CPU's own node are cached
+
+// Refills this CPU's page cache from the zones
+// Preemption must be disabled
+static void mmPcpRefill (NkCcb_t* ccb)
+{
+    MmZone_t* zone = mmZoneFindBest (0, 0, MM_ZONE_NO_GENERIC, ccb->node);
+    if (!zone)
+        return;
+    for (int i = 0; i < ccb->pageCacheBatch; ++i)
+    {
+        MmPage_t* page = mmBuddyAlloc (zone, 0);
+        if (!page)
+            break;
+        page->flags = MM_PAGE_FREE;
+        NkListAddBack (&ccb->pageCache, &page->link);
+        ++ccb->pageCacheCount;
+    }
+    NkMcsUnlock (&zone->lock);
+}
+
+// Drains cold pages from this CPU's page cache back to the zones
+// Preemption must be disabled
+static void mmPcpDrain (NkCcb_t* ccb, int count)
+{
+    MmZone_t* zone = NULL;
+    while (count-- && ccb->pageCacheCount)
+    {
+        MmPage_t* page = LINK_CONTAINER (NkListBack (&ccb->pageCache), MmPage_t, link);
+        NkListRemove (&ccb->pageCache, &page->link);
+        --ccb->pageCacheCount;
+        // Keep zone locked as long as pages come from it
+        if (mmPageGetZone (page) != zone)
+        {
+            if (zone)
+                NkMcsUnlock (&zone->lock);
+            zone = mmPageGetZone (page);
+            NkMcsLock (&zone->lock);
+        }
+        mmBuddyFree (zone, page, 0);
+    }
+    if (zone)
+        NkMcsUnlock (&zone->lock);
+}
+
 // Frees an MmPage
 void MmFreePage (MmPage_t* page)
 {
     if (page->fixCount)
         NkPanic ("nexke: can't free fixed page\n");
     // Don't free an unusable page
-    if (page->flags & MM_PAGE_UNUSABLE && !page->zone)
+    if (page->flags & MM_PAGE_FAKE)
+    {
         MmCacheFree (mmFakePageCache, page);
-    else
+        return;
+    }
+    NkStatInc (&mmStatFrees);
+    MmZone_t* zone = mmPageGetZone (page);
+    if (!(zone->flags & MM_ZONE_NO_GENERIC))
     {
-        MmZone_t* zone = page->zone;
-        NkSpinLock (&zone->lock);
-        // Add to free list
-        NkListAddFront (&zone->freeList, &page->link);
-        // Update stats
-        ++zone->freeCount;
-        ++mmFreePages;
-        page->flags = MM_PAGE_FREE;
-        NkSpinUnlock (&zone->lock);
+        // Put it in this CPU's page cache if it's from our node
+        TskDisablePreempt();
+        NkCcb_t* ccb = CpuGetCcb();
+        if (zone->node == ccb->node)
+        {
+            page->flags = MM_PAGE_FREE;
+            NkListAddFront (&ccb->pageCache, &page->link);
+            ++ccb->pageCacheCount;
+            if (ccb->pageCacheCount > ccb->pageCacheHigh)
+                mmPcpDrain (ccb, ccb->pageCacheBatch);
+            TskEnablePreempt();
+            return;
+        }
+        TskEnablePreempt();
+    }
+    NkMcsLock (&zone->lock);
+    // Give it back to the buddy allocator
+    mmBuddyFree (zone, page, 0);
+    NkMcsUnlock (&zone->lock);
+}
+
+// Allocates a page straight from the zones, nearest to node first
+static MmPage_t* mmNodeAlloc (int node)
+{
+    MmZone_t* zone = mmZoneFindBest (0, 0, MM_ZONE_NO_GENERIC, node);
+    if (!zone)
+        return NULL;
+    MmPage_t* page = mmBuddyAlloc (zone, 0);
+    NkMcsUnlock (&zone->lock);
+    return page;
+}
+
+// Takes the hottest page from this CPU's page cache
+// If the thread wants memory from another node, the page comes from that node's zones instead
+static MmPage_t* mmPcpAlloc()
+{
+    TskDisablePreempt();
+    NkCcb_t* ccb = CpuGetCcb();
+    int node = mmAllocNode (ccb);
+    if (node != ccb->node)
+    {
+        TskEnablePreempt();
+        return mmNodeAlloc (node);
+    }
+    // Refill page cache from generic memory zones if needed
+    if (!ccb->pageCacheCount)
+        mmPcpRefill (ccb);
+    NkLink_t* link = NkListFront (&ccb->pageCache);
+    if (!link)
+    {
+        TskEnablePreempt();
+        return NULL;
     }
+    NkListRemove (&ccb->pageCache, link);
+    --ccb->pageCacheCount;
+    TskEnablePreempt();
+    return LINK_CONTAINER (link, MmPage_t, link);
+}
+
+// Checks if the caller may reclaim memory itself
+// Reclaim takes cache and zone locks, so the caller must not hold any spinlocks
+static FORCEINLINE bool mmCanReclaim()
+{
+    return !CpuGetCcb()->preemptDisable && !CPU_IS_INT();
 }
 
 // Allocates an MmPage, with specified characteristics
 // Returns NULL if physical memory is exhausted
 MmPage_t* MmAllocPage()
 {
-    // Ensure we allocate from generic memory zone
-    MmZone_t* zone = mmZoneFindBest (0, 1, MM_ZONE_NO_GENERIC);
-    if (!zone)
+    MmPage_t* page = mmPcpAlloc();
+    // Reclaim if memory is running low. If we can't do it now, the idle thread will
+    if (mmFreePages < mmLowPages)
+    {
+        MmWakePageout();
+        if (mmCanReclaim())
+        {
+            MmReclaimIfLow();
+            if (!page)
+                page = mmPcpAlloc();
+        }
+    }
+    // If we're out of memory and can block, give the pageout daemon a chance to find some
+    for (int i = 0; !page && i < MM_OOM_RETRIES && mmCanReclaim() && MmWaitPageout(); ++i)
+        page = mmPcpAlloc();
+    if (!page)
     {
         NkLogDebug ("nexke: warning: potential OOM detected\n");
         return NULL;    // Uh oh
     }
-    // Grab a page from the free list
-    NkLink_t* link = NkListFront (&zone->freeList);
-    NkListRemove (&zone->freeList, link);
-    assert (link);
-    MmPage_t* page = LINK_CONTAINER (link, MmPage_t, link);
-    // Update state fields
-    --zone->freeCount;
-    --mmFreePages;
     page->flags = MM_PAGE_ALLOCED;
-    NkSpinUnlock (&zone->lock);
+    NkStatInc (&mmStatAllocs);
     return page;    // Return this page
 }
 
+// Sets node this thread allocates memory from
+int MmSetAllocNode (int node)
+{
+    NkThread_t* thread = CpuGetCcb()->curThread;
+    if (!thread)
+        return MM_NODE_LOCAL;
+    if (node >= mmNumNodes)
+        node = MM_NODE_LOCAL;
+    int oldNode = thread->memNode;
+    thread->memNode = node;
+    return oldNode;
+}
+
+// Gets node this thread allocates memory from
+int MmGetAllocNode()
+{
+    TskDisablePreempt();
+    int node = mmAllocNode (CpuGetCcb());
+    TskEnablePreempt();
+    return node;
+}
+
+// Gets number of pages needed to get back to the high watermark
+size_t MmGetPageShortage()
+{
+    uintmax_t freePages = mmFreePages;
+    if (freePages >= mmLowPages)
+        return 0;
+    return mmHighPages - freePages;
+}
+
+// Gets zone at index, or NULL if there is none
+MmZone_t* MmGetZone (int idx)
+{
+    if (idx >= mmNumZones)
+        return NULL;
+    return mmZones[idx];
+}
+
 // Allocates a fixed page
 MmPage_t* MmAllocFixedPage()
 {
     MmPage_t* pg = MmAllocPage();
-    NkSpinLock (&pg->lock);
+    MmLockPage (pg);
     MmFixPage (pg);
-    NkSpinUnlock (&pg->lock);
+    MmUnlockPage (pg);
     return pg;
 }
 
+// Allocates a page that is filled with zeroes
+MmPage_t* MmAllocZeroedPage()
+{
+    // Try the pool first
+    NkSpinLock (&mmZeroPoolLock);
+    NkLink_t* link = NkListFront (&mmZeroPool);
+    if (link)
+    {
+        NkListRemove (&mmZeroPool, link);
+        --mmZeroPoolCount;
+        NkSpinUnlock (&mmZeroPoolLock);
+        MmPage_t* page = LINK_CONTAINER (link, MmPage_t, link);
+        page->flags = MM_PAGE_ALLOCED | MM_PAGE_ZEROED;
+        return page;
+    }
+    NkSpinUnlock (&mmZeroPoolLock);
+    // Pool is empty, zero it ourselves
+    MmPage_t* page = MmAllocPage();
+    if (!page)
+        return NULL;
+    MmMulZeroPage (page);
+    page->flags |= MM_PAGE_ZEROED;
+    return page;
+}
+
+// Frees a page that is known to be filled with zeroes
+void MmFreeZeroedPage (MmPage_t* page)
+{
+    NkSpinLock (&mmZeroPoolLock);
+    if (mmZeroPoolCount >= MM_ZERO_POOL_MAX || mmFreePages < mmLowPages)
+    {
+        NkSpinUnlock (&mmZeroPoolLock);
+        MmFreePage (page);
+        return;
+    }
+    NkListAddFront (&mmZeroPool, &page->link);
+    ++mmZeroPoolCount;
+    NkSpinUnlock (&mmZeroPoolLock);
+}
+
+// Sets up the shared zero page
+void MmInitZeroPage()
+{
+    mmZeroPage = MmAllocZeroedPage();
+    if (!mmZeroPage)
+        NkPanicOom();
+    // Unusable pages are never fixed and don't track their mappings, so it can be mapped anywhere
+    // without taking its lock
+    mmZeroPage->flags |= MM_PAGE_UNUSABLE;
+}
+
+// Gets the shared zero page
+MmPage_t* MmGetZeroPage()
+{
+    return mmZeroPage;
+}
+
+// Adds one page to the zeroed page pool
+bool MmFillZeroPool()
+{
+    // Check without lock first, it doesn't matter if we race
+    // Don't eat into free memory if we're low on it
+    if (mmZeroPoolCount >= MM_ZERO_POOL_MAX || mmFreePages < mmLowPages)
+        return false;
+    MmPage_t* page = MmAllocPage();
+    if (!page)
+        return false;
+    MmMulZeroPage (page);
+    NkSpinLock (&mmZeroPoolLock);
+    if (mmZeroPoolCount >= MM_ZERO_POOL_MAX)
+    {
+        // Someone else filled it
+        NkSpinUnlock (&mmZeroPoolLock);
+        MmFreePage (page);
+        return false;
+    }
+    NkListAddFront (&mmZeroPool, &page->link);
+    ++mmZeroPoolCount;
+    NkSpinUnlock (&mmZeroPoolLock);
+    return true;
+}
+
+// Allocates a zeroed page for a page table
+MmPage_t* MmAllocPtPage()
+{
+    TskDisablePreempt();
+    NkCcb_t* ccb = CpuGetCcb();
+    ++ccb->ptReserveTaken;
+    NkLink_t* link = NkListFront (&ccb->ptReserve);
+    if (link)
+    {
+        NkListRemove (&ccb->ptReserve, link);
+        --ccb->ptReserveCount;
+        TskEnablePreempt();
+        return LINK_CONTAINER (link, MmPage_t, link);
+    }
+    TskEnablePreempt();
+    return MmAllocZeroedPage();
+}
+
+// Frees a page table that is known to be empty
+void MmFreePtPage (MmPage_t* page)
+{
+    TskDisablePreempt();
+    NkCcb_t* ccb = CpuGetCcb();
+    if (ccb->ptReserveCount < ccb->ptReserveTarget)
+    {
+        NkListAddFront (&ccb->ptReserve, &page->link);
+        ++ccb->ptReserveCount;
+        TskEnablePreempt();
+        return;
+    }
+    TskEnablePreempt();
+    MmFreeZeroedPage (page);
+}
+
+// Adds one page to this CPU's page table reserve
+bool MmFillPtReserve()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    // Resize the reserve to what was taken last period. It grows right away, but only shrinks
+    // by half each period, so a quiet moment in a burst doesn't throw it all away
+    ktime_t now = NkGetMonotonicCoarse();
+    if ((now - ccb->ptReserveTime) >= MM_PT_RESERVE_PERIOD)
+    {
+        int taken = ccb->ptReserveTaken;
+        int target = ccb->ptReserveTarget;
+        target = (taken >= target) ? taken : (target + taken) / 2;
+        if (target < MM_PT_RESERVE_MIN)
+            target = MM_PT_RESERVE_MIN;
+        if (target > MM_PT_RESERVE_MAX)
+            target = MM_PT_RESERVE_MAX;
+        ccb->ptReserveTarget = target;
+        ccb->ptReserveTaken = 0;
+        ccb->ptReserveTime = now;
+    }
+    // Don't eat into free memory if we're low on it
+    if (ccb->ptReserveCount >= ccb->ptReserveTarget || mmFreePages < mmLowPages)
+        return false;
+    // Zeroing happens here if the zeroed page pool is empty, and the pool gets refilled later
+    MmPage_t* page = MmAllocZeroedPage();
+    if (!page)
+        return false;
+    TskDisablePreempt();
+    NkListAddFront (&ccb->ptReserve, &page->link);
+    ++ccb->ptReserveCount;
+    TskEnablePreempt();
+    return true;
+}
+
+// Shrinks this CPU's page table reserve
+static size_t mmPtReserveShrink (size_t target)
+{
+    size_t freed = 0;
+    while (freed < target)
+    {
+        TskDisablePreempt();
+        NkCcb_t* ccb = CpuGetCcb();
+        NkLink_t* link = NkListBack (&ccb->ptReserve);
+        if (!link)
+        {
+            TskEnablePreempt();
+            break;
+        }
+        NkListRemove (&ccb->ptReserve, link);
+        --ccb->ptReserveCount;
+        TskEnablePreempt();
+        MmFreePage (LINK_CONTAINER (link, MmPage_t, link));
+        ++freed;
+    }
+    return freed;
+}
+
+// Shrinks the zeroed page pool
+static size_t mmZeroPoolShrink (size_t target)
+{
+    size_t freed = 0;
+    while (freed < target)
+    {
+        NkSpinLock (&mmZeroPoolLock);
+        NkLink_t* link = NkListFront (&mmZeroPool);
+        if (!link)
+        {
+            NkSpinUnlock (&mmZeroPoolLock);
+            break;
+        }
+        NkListRemove (&mmZeroPool, link);
+        --mmZeroPoolCount;
+        NkSpinUnlock (&mmZeroPoolLock);
+        MmFreePage (LINK_CONTAINER (link, MmPage_t, link));
+        ++freed;
+    }
+    return freed;
+}
+
+// Drains this CPU's page cache back to the zones
+static size_t mmPcpShrink (size_t target)
+{
+    TskDisablePreempt();
+    NkCcb_t* ccb = CpuGetCcb();
+    size_t count = ccb->pageCacheCount;
+    if (count > target)
+        count = target;
+    mmPcpDrain (ccb, count);
+    TskEnablePreempt();
+    return count;
+}
+
+// Page allocator shrinkers
+// The zeroed pool is drained first, as its pages end up in the page cache
+static MmShrinker_t mmZeroPoolShrinker = {.name = "zeroed page pool", .shrink = mmZeroPoolShrink};
+static MmShrinker_t mmPcpShrinker = {.name = "CPU page cache", .shrink = mmPcpShrink};
+static MmShrinker_t mmPtReserveShrinker = {.name = "CPU page table reserve",
+                                           .shrink = mmPtReserveShrink};
+
 // Finds/creates page structure at specified PFN
 MmPage_t* MmFindPagePfn (pfn_t pfn)
 {
@@ -315,69 +975,261 @@ MmPage_t* MmFindPagePfn (pfn_t pfn)
     MmZone_t* zone = mmZoneFindByPfn (pfn);
     if (zone && zone->flags & MM_ZONE_ALLOCATABLE)
     {
+        // Set up the page structure if the background thread hasn't gotten to it yet
+        if ((pfn - zone->pfn) >= __atomic_load_n (&zone->initPages, __ATOMIC_ACQUIRE))
+        {
+            NkMcsLock (&zone->lock);
+            while ((pfn - zone->pfn) >= zone->initPages)
+                mmZoneInitChunk (zone);
+            NkMcsUnlock (&zone->lock);
+        }
         // Grab from PFN map
         MmPage_t* map = zone->pfnMap;
         // Convert PFN into a PFN relative to base of zone map
         MmPage_t* page = map + (pfn - zone->pfn);
-        assert (page->pfn == pfn);
+        assert (MmGetPagePfn (page) == pfn);
         return page;
     }
     // Else, we need to just forge a fake page
-    MmPage_t* page = MmCacheAlloc (mmFakePageCache);
+    MmFakePage_t* page = MmCacheAlloc (mmFakePageCache);
     if (!page)
         NkPanic ("nexke: out of memory\n");
-    memset (page, 0, sizeof (MmPage_t));
-    page->flags = MM_PAGE_UNUSABLE;
+    memset (page, 0, sizeof (MmFakePage_t));
+    page->page.flags = MM_PAGE_UNUSABLE | MM_PAGE_FAKE;
     page->pfn = pfn;
-    return page;
+    return &page->page;
 }
 
-// Allocates a contigious range of PFNs with specified at limit, beneath specified base adress
-MmPage_t* MmAllocPagesAt (size_t count, paddr_t maxAddr, paddr_t align)
+// Checks if any of count pages starting at pfn are in the PFN map
+bool MmPfnRangeInMap (pfn_t pfn, size_t count)
 {
-    // Find zone
-    MmZone_t* zone = mmZoneFindBest (maxAddr / NEXKE_CPU_PAGESZ, count, 0);
-    if (!zone)
-        return NULL;    // Couldn't find page
-    // First get to start align
-    MmPage_t* pfnMap = zone->pfnMap;
-    size_t pfnAlign = align / NEXKE_CPU_PAGESZ;
-    while (pfnMap->pfn % pfnAlign)
-        ++pfnMap;
-    // Attempt to find contigous range of PFNs
-    for (int i = 0; i < zone->numPages; i += pfnAlign)
+    for (int i = 0; i < mmNumZones; ++i)
     {
-        if (pfnMap[i].flags & MM_PAGE_FREE)
+        MmZone_t* zone = mmZones[i];
+        if ((zone->flags & MM_ZONE_ALLOCATABLE) && zone->pfn < (pfn + count) &&
+            (zone->pfn + zone->numPages) > pfn)
         {
-            MmPage_t* firstPage = &pfnMap[i];
-            // Find count more
-            for (int j = 0; j < count; ++j, ++i)
+            return true;
+        }
+    }
+    return false;
+}
+
+// Contiguous reserve
+// Big contiguous allocations can't be found once memory is fragmented, so a reserve is set aside
+// at boot for them. Instead of sitting idle, it's lent out for anonymous pages once the rest of
+// memory is getting used up, as those can be moved. When a contiguous allocation wants a range,
+// the anonymous pages in it are copied elsewhere and their mappings torn down, so touching them
+// again faults in the copy
+
+// Checks if page can be moved out of the way
+// This doesn't take any locks, migrating checks again
+static FORCEINLINE bool mmCmaCanMove (MmPage_t* page)
+{
+    if (page->flags & MM_PAGE_FREE)
+        return true;
+    MmObject_t* obj = page->obj;
+    return (page->flags & MM_PAGE_IN_OBJECT) && !(page->flags & MM_PAGE_HUGE) &&
+           !page->fixCount && obj && obj->backend == MM_BACKEND_ANON;
+}
+
+// Moves page's contents into a page outside the reserve
+static bool mmCmaMigratePage (MmPage_t* page)
+{
+    MmPage_t* newPage = MmAllocPage();
+    if (!newPage)
+        return false;
+    MmLockPage (page);
+    // It might have been freed while we were getting here
+    if (page->flags & MM_PAGE_FREE)
+    {
+        MmUnlockPage (page);
+        MmFreePage (newPage);
+        return true;
+    }
+    // Faults look pages up with the object locked, so holding it keeps them from finding the page
+    // while it's moving. We take it out of order, so give up on the page if the object is busy
+    MmObject_t* obj = page->obj;
+    if (!mmCmaCanMove (page) || !NkSpinTryLock (&obj->lock))
+    {
+        MmUnlockPage (page);
+        MmFreePage (newPage);
+        return false;
+    }
+    // Take the page out of every address space, so nobody writes to it while it's copied
+    // This moves dirty bits from the mappings to the page
+    MmMulUnmapPage (page);
+    MmMulCopyPage (newPage, page);
+    newPage->flags |= page->flags & MM_PAGE_DIRTY;
+    size_t off = page->offset;
+    MmRemovePage (page);
+    MmLockPage (newPage);
+    MmAddPage (obj, off, newPage);
+    MmUnlockPage (newPage);
+    NkSpinUnlock (&obj->lock);
+    MmFreePage (page);
+    NkStatInc (&mmStatMigrations);
+    return true;
+}
+
+// Takes a range of free pages out of zone's buddy lists
+// Zone must be locked, and every page in the range must be free
+static void mmCmaTakeRange (MmZone_t* zone, pfn_t pfn, size_t count)
+{
+    pfn_t end = pfn + count;
+    while (pfn < end)
+    {
+        // Find the block this page is in
+        // Blocks are aligned to their size, so its head is this PFN rounded down to its order
+        int order = 0;
+        MmPage_t* head = NULL;
+        for (; order < MM_ZONE_MAX_ORDER; ++order)
+        {
+            head = mmZoneGetPage (zone, pfn & ~((1ULL << order) - 1));
+            if (head && (head->flags & MM_PAGE_BUDDY) && head->order == order)
+                break;
+        }
+        assert (order < MM_ZONE_MAX_ORDER);
+        pfn_t headPfn = MmGetPagePfn (head);
+        pfn_t blockEnd = headPfn + (1ULL << order);
+        mmBuddyRemoveBlock (zone, head);
+        for (size_t i = 0; i < (1ULL << order); ++i)
+            head[i].flags = MM_PAGE_ALLOCED;
+        zone->freeCount -= 1ULL << order;
+        mmFreePages -= 1ULL << order;
+        // Give back the parts of the block outside the range
+        if (headPfn < pfn)
+            mmBuddyFreeRange (zone, headPfn, pfn - headPfn);
+        if (blockEnd > end)
+            mmBuddyFreeRange (zone, end, blockEnd - end);
+        pfn = blockEnd;
+    }
+}
+
+// Allocates a contiguous range from the reserve, moving pages out of the way
+static MmPage_t* mmCmaAlloc (size_t count, pfn_t maxPfn, size_t pfnAlign)
+{
+    MmZone_t* zone = mmCmaZone;
+    if (!zone || count > zone->numPages)
+        return NULL;
+    if (!pfnAlign)
+        pfnAlign = 1;
+    if (!maxPfn)
+        maxPfn = -1;
+    // Page structures have to be set up to look at them
+    NkMcsLock (&zone->lock);
+    while (mmZoneInitChunk (zone))
+        ;
+    NkMcsUnlock (&zone->lock);
+    pfn_t zoneEnd = zone->pfn + zone->numPages;
+    pfn_t start = (zone->pfn + pfnAlign - 1) & ~((pfn_t) pfnAlign - 1);
+    while ((start + count) <= zoneEnd && (start + count) <= maxPfn)
+    {
+        // Make sure everything in the range can be moved before moving any of it
+        pfn_t bad = start;
+        while (bad < (start + count) && mmCmaCanMove (mmZoneGetPage (zone, bad)))
+            ++bad;
+        bool moved = (bad == (start + count));
+        for (pfn_t pfn = start; moved && pfn < (start + count); ++pfn)
+        {
+            MmPage_t* page = mmZoneGetPage (zone, pfn);
+            if (!(page->flags & MM_PAGE_FREE) && !mmCmaMigratePage (page))
             {
-                if (!(pfnMap[i].flags & MM_PAGE_FREE))
-                    break;    // Not a contigous run
+                bad = pfn;
+                moved = false;
             }
-            // Found run, remove from list
-            for (int j = 0; j < count; ++j)
+        }
+        if (moved)
+        {
+            // Pages may have been lent out again while we were moving the rest
+            NkMcsLock (&zone->lock);
+            pfn_t pfn = start;
+            while (pfn < (start + count) && (mmZoneGetPage (zone, pfn)->flags & MM_PAGE_FREE))
+                ++pfn;
+            if (pfn == (start + count))
             {
-                MmPage_t* page = &firstPage[j];
-                NkListRemove (&zone->freeList, &page->link);
-                page->flags = MM_PAGE_ALLOCED;
+                mmCmaTakeRange (zone, start, count);
+                NkMcsUnlock (&zone->lock);
+                return mmZoneGetPage (zone, start);
             }
-            // Update stats
-            zone->freeCount -= count;
-            mmFreePages -= count;
-            NkSpinUnlock (&zone->lock);
-            return firstPage;
+            NkMcsUnlock (&zone->lock);
+            bad = pfn;
         }
+        // Try the next range past whatever got in the way
+        start = (bad + pfnAlign) & ~((pfn_t) pfnAlign - 1);
     }
-    return NULL;    // Shouldn't happen, maybe we should panic
+    return NULL;
+}
+
+// Allocates a page for anonymous memory, which may be lent from the contiguous reserve
+MmPage_t* MmAllocMovablePage (bool zero)
+{
+    // The reserve is only lent out once it makes up most of free memory, so that contiguous
+    // allocations don't have to move pages unless memory is tight
+    // Check without the lock first, it doesn't matter if we race
+    MmZone_t* zone = mmCmaZone;
+    if (!zone || zone->freeCount <= (mmFreePages / 2))
+        return (zero) ? MmAllocZeroedPage() : MmAllocPage();
+    NkMcsLock (&zone->lock);
+    MmPage_t* page = NULL;
+    if (mmZoneWillWork (zone, -1, 0, 0))
+        page = mmBuddyAlloc (zone, 0);
+    NkMcsUnlock (&zone->lock);
+    if (!page)
+        return (zero) ? MmAllocZeroedPage() : MmAllocPage();
+    NkStatInc (&mmStatAllocs);
+    if (zero)
+    {
+        MmMulZeroPage (page);
+        page->flags |= MM_PAGE_ZEROED;
+    }
+    return page;
+}
+
+// Allocates a contigious range of PFNs with specified at limit, beneath specified base adress
+MmPage_t* MmAllocPagesAt (size_t count, paddr_t maxAddr, paddr_t align)
+{
+    // Figure out order we need. The block must be big enough for both the count and the alignment,
+    // since blocks are naturally aligned to their size
+    size_t pfnAlign = align / NEXKE_CPU_PAGESZ;
+    assert (!pfnAlign || !(pfnAlign & (pfnAlign - 1)));
+    int order = mmBuddyOrder (count);
+    int alignOrder = mmBuddyOrder (pfnAlign);
+    if (alignOrder > order)
+        order = alignOrder;
+    if (!count)
+        return NULL;
+    // Anything too big for the buddy allocator, or that it can't find, comes from the reserve
+    if (order >= MM_ZONE_MAX_ORDER)
+        return mmCmaAlloc (count, maxAddr / NEXKE_CPU_PAGESZ, pfnAlign);
+    // Find zone
+    MmZone_t* zone =
+        mmZoneFindBest (maxAddr / NEXKE_CPU_PAGESZ, order, MM_ZONE_CMA, MmGetAllocNode());
+    if (!zone)
+        return mmCmaAlloc (count, maxAddr / NEXKE_CPU_PAGESZ, pfnAlign);
+    MmPage_t* pages = mmBuddyAlloc (zone, order);
+    assert (pages);
+    // Give back the part of the block we don't need
+    size_t blockSz = 1ULL << order;
+    if (blockSz > count)
+        mmBuddyFreeRange (zone, MmGetPagePfn (pages) + count, blockSz - count);
+    NkMcsUnlock (&zone->lock);
+    return pages;
 }
 
 // Frees pages allocated with AllocPageAt
 void MmFreePages (MmPage_t* pages, size_t count)
 {
+    assert (!(pages->flags & MM_PAGE_FAKE));
+    MmZone_t* zone = mmPageGetZone (pages);
     for (int i = 0; i < count; ++i)
-        MmFreePage (&pages[i]);
+    {
+        if (pages[i].fixCount)
+            NkPanic ("nexke: can't free fixed page\n");
+    }
+    NkMcsLock (&zone->lock);
+    mmBuddyFreeRange (zone, MmGetPagePfn (pages), count);
+    NkMcsUnlock (&zone->lock);
 }
 
 // Allocate a guard page
@@ -385,78 +1237,307 @@ void MmFreePages (MmPage_t* pages, size_t count)
 // never map a page to a specified object,offset
 MmPage_t* MmAllocGuardPage()
 {
-    MmPage_t* page = MmCacheAlloc (mmFakePageCache);
+    MmFakePage_t* page = MmCacheAlloc (mmFakePageCache);
     if (!page)
         return NULL;
-    memset (page, 0, sizeof (MmPage_t));
-    page->flags = MM_PAGE_UNUSABLE | MM_PAGE_GUARD;
-    return page;
+    memset (page, 0, sizeof (MmFakePage_t));
+    page->page.flags = MM_PAGE_UNUSABLE | MM_PAGE_GUARD | MM_PAGE_FAKE;
+    return &page->page;
 }
 
-#define MM_GET_BUCKET(obj, off) ((CpuPageAlignDown ((uintptr_t) obj) + off) % mmNumBuckets)
+// Page trees
+// Every object keeps its pages in a radix tree indexed by page number. Each node
+// knows its own level, so lookups can run without any locks as long as nodes are
+// never freed. We guarantee that by only freeing nodes when the object is destroyed.
+// Writers are serialized by the tree lock, and publish nodes with release stores.
+//
+// Nodes can't be allocated with the tree lock held, as growing the node cache can
+// add pages to the kernel object. Instead, inserters fill a reserve of nodes before
+// taking the lock, and only take nodes from the reserve while holding it
+
+// Node structure
+typedef struct _mmradixnode
+{
+    void* slots[MM_RADIX_SLOTS];    // Child nodes, or pages on leaf nodes
+    int level;                      // Level of node. 0 is a leaf
+    int count;                      // Number of slots in use
+} MmRadixNode_t;
+
+// Max height of a tree
+#define MM_RADIX_MAX_HEIGHT                                                       \
+    ((((sizeof (size_t) * 8) - NEXKE_CPU_PAGE_SHIFT) + (MM_RADIX_SHIFT - 1)) / \
+     MM_RADIX_SHIFT)
 
-// Adds a page to a page hash list
+// Size of node reserve
+#define MM_RADIX_RESERVE (MM_RADIX_MAX_HEIGHT * 2)
+
+static SlabCache_t* mmRadixCache = NULL;
+
+// Node reserve
+static MmRadixNode_t* mmRadixReserve[MM_RADIX_RESERVE] = {0};
+static int mmRadixReserveCount = 0;
+static spinlock_t mmRadixReserveLock = 0;
+static int mmRadixRefillCpu = -1;    // CPU currently refilling the reserve
+
+// Gets index of slot in node
+static FORCEINLINE size_t mmRadixSlot (MmRadixNode_t* node, size_t idx)
+{
+    return (idx >> (node->level * MM_RADIX_SHIFT)) & (MM_RADIX_SLOTS - 1);
+}
+
+// Gets the max index a node can hold
+static FORCEINLINE size_t mmRadixMaxIdx (MmRadixNode_t* node)
+{
+    int shift = (node->level + 1) * MM_RADIX_SHIFT;
+    if (shift >= (sizeof (size_t) * 8))
+        return (size_t) -1;
+    return ((size_t) 1 << shift) - 1;
+}
+
+// Fills the node reserve
+// Must be called without any locks held
+static void mmRadixPreload()
+{
+    TskDisablePreempt();
+    int cpuNum = CpuGetCcb()->cpuNum;
+    NkSpinLock (&mmRadixReserveLock);
+    // If we are being called from inside a refill on this CPU, the reserve has to do
+    if (mmRadixRefillCpu == cpuNum)
+    {
+        NkSpinUnlock (&mmRadixReserveLock);
+        TskEnablePreempt();
+        return;
+    }
+    int oldCpu = mmRadixRefillCpu;
+    mmRadixRefillCpu = cpuNum;
+    while (mmRadixReserveCount < MM_RADIX_RESERVE)
+    {
+        NkSpinUnlock (&mmRadixReserveLock);
+        MmRadixNode_t* node = MmCacheAlloc (mmRadixCache);
+        if (!node)
+            NkPanicOom();
+        NkSpinLock (&mmRadixReserveLock);
+        if (mmRadixReserveCount < MM_RADIX_RESERVE)
+            mmRadixReserve[mmRadixReserveCount++] = node;
+        else
+            MmCacheFree (mmRadixCache, node);
+    }
+    mmRadixRefillCpu = oldCpu;
+    NkSpinUnlock (&mmRadixReserveLock);
+    TskEnablePreempt();
+}
+
+// Takes a node from the reserve
+static MmRadixNode_t* mmRadixNewNode (int level)
+{
+    NkSpinLock (&mmRadixReserveLock);
+    if (!mmRadixReserveCount)
+    {
+        NkSpinUnlock (&mmRadixReserveLock);
+        return NULL;
+    }
+    MmRadixNode_t* node = mmRadixReserve[--mmRadixReserveCount];
+    NkSpinUnlock (&mmRadixReserveLock);
+    memset (node, 0, sizeof (MmRadixNode_t));
+    node->level = level;
+    return node;
+}
+
+// Inserts a page into a tree
+// Tree lock must be held. Returns false if the node reserve ran out
+static bool mmRadixInsert (MmPageTree_t* tree, size_t idx, MmPage_t* page)
+{
+    // Create root if needed
+    if (!tree->root)
+    {
+        MmRadixNode_t* root = mmRadixNewNode (0);
+        if (!root)
+            return false;
+        __atomic_store_n (&tree->root, root, __ATOMIC_RELEASE);
+    }
+    // Grow tree until index fits
+    while (idx > mmRadixMaxIdx (tree->root))
+    {
+        MmRadixNode_t* root = mmRadixNewNode (tree->root->level + 1);
+        if (!root)
+            return false;
+        root->slots[0] = tree->root;
+        root->count = 1;
+        __atomic_store_n (&tree->root, root, __ATOMIC_RELEASE);
+    }
+    // Walk down to the leaf, creating nodes as we go
+    MmRadixNode_t* node = tree->root;
+    while (node->level)
+    {
+        size_t slot = mmRadixSlot (node, idx);
+        MmRadixNode_t* child = node->slots[slot];
+        if (!child)
+        {
+            child = mmRadixNewNode (node->level - 1);
+            if (!child)
+                return false;
+            __atomic_store_n (&node->slots[slot], child, __ATOMIC_RELEASE);
+            ++node->count;
+        }
+        node = child;
+    }
+    size_t slot = mmRadixSlot (node, idx);
+    assert (!node->slots[slot]);
+    __atomic_store_n (&node->slots[slot], page, __ATOMIC_RELEASE);
+    ++node->count;
+    return true;
+}
+
+// Finds first page at or after index in a node
+static MmPage_t* mmRadixFindNext (MmRadixNode_t* node, size_t* idx)
+{
+    size_t slotSpan = (size_t) 1 << (node->level * MM_RADIX_SHIFT);
+    for (size_t slot = mmRadixSlot (node, *idx); slot < MM_RADIX_SLOTS; ++slot)
+    {
+        size_t slotStart = *idx & ~(slotSpan - 1);
+        void* ent = __atomic_load_n (&node->slots[slot], __ATOMIC_ACQUIRE);
+        if (ent)
+        {
+            if (!node->level)
+                return ent;
+            MmPage_t* page = mmRadixFindNext (ent, idx);
+            if (page)
+                return page;
+        }
+        // Move to start of next slot
+        size_t next = slotStart + slotSpan;
+        if (next < slotStart)
+            return NULL;    // Wrapped around
+        *idx = next;
+    }
+    return NULL;
+}
+
+// Frees all nodes in a tree, calling back on each page
+static void mmRadixDestroy (MmRadixNode_t* node, void (*cb) (MmPage_t*))
+{
+    for (int i = 0; i < MM_RADIX_SLOTS; ++i)
+    {
+        if (!node->slots[i])
+            continue;
+        if (node->level)
+            mmRadixDestroy (node->slots[i], cb);
+        else
+            cb (node->slots[i]);
+    }
+    MmCacheFree (mmRadixCache, node);
+}
+
+// Initializes the page tree of an object
+void MmInitPageTree (MmObject_t* obj)
+{
+    obj->pageTree.root = NULL;
+    obj->pageTree.lock = 0;
+}
+
+// Adds a page to an object
 void MmAddPage (MmObject_t* obj, size_t off, MmPage_t* page)
 {
     assert (!(page->flags & MM_PAGE_IN_OBJECT));
-    // Find bucket
-    size_t bucketIdx = MM_GET_BUCKET (obj, off);
-    MmPageBucket_t* bucket = &mmPageHash[bucketIdx];
-    NkSpinLock (&bucket->lock);
-    // Add to it
-    NkListAddFront (&bucket->list, &page->link);
-    NkSpinUnlock (&bucket->lock);
-    // Set object/offset
+    // Set object/offset before the page becomes visible
     page->offset = off;
     page->obj = obj;
     page->flags |= MM_PAGE_IN_OBJECT;
-    // Add to object
-    NkListAddFront (&obj->pageList, &page->objLink);
+    size_t idx = off >> NEXKE_CPU_PAGE_SHIFT;
+    MmPageTree_t* tree = &obj->pageTree;
+    for (;;)
+    {
+        mmRadixPreload();
+        NkSpinLock (&tree->lock);
+        bool res = mmRadixInsert (tree, idx, page);
+        NkSpinUnlock (&tree->lock);
+        if (res)
+            break;
+        // Someone emptied the reserve on us, go fill it again
+    }
+    // Pages that can be paged out get aged. Huge pages stay put, as a large mapping of them doesn't
+    // show up in their mapping lists
+    if (obj->pageable && !(page->flags & (MM_PAGE_GUARD | MM_PAGE_HUGE)))
+        MmQueuePage (page);
 }
 
-// Looks up page in page list, returning NULL if none is found
+// Looks up page in object, returning NULL if none is found
 MmPage_t* MmLookupPage (MmObject_t* obj, size_t off)
 {
-    // Find bucket
-    size_t bucketIdx = MM_GET_BUCKET (obj, off);
-    MmPageBucket_t* bucket = &mmPageHash[bucketIdx];
-    NkSpinLock (&bucket->lock);
-    // Find in bucket
-    NkLink_t* iter = NkListFront (&bucket->list);
-    while (iter)
+    size_t idx = off >> NEXKE_CPU_PAGE_SHIFT;
+    MmRadixNode_t* node = __atomic_load_n (&obj->pageTree.root, __ATOMIC_ACQUIRE);
+    if (!node || idx > mmRadixMaxIdx (node))
+        return NULL;
+    while (node->level)
     {
-        MmPage_t* curPage = LINK_CONTAINER (iter, MmPage_t, link);
-        if (curPage->offset == off && curPage->obj == obj)
-        {
-            NkSpinUnlock (&bucket->lock);
-            return curPage;
-        }
-        iter = NkListIterate (&bucket->list, iter);
+        node = __atomic_load_n (&node->slots[mmRadixSlot (node, idx)], __ATOMIC_ACQUIRE);
+        if (!node)
+            return NULL;
     }
-    NkSpinUnlock (&bucket->lock);
-    return NULL;
+    return __atomic_load_n (&node->slots[mmRadixSlot (node, idx)], __ATOMIC_ACQUIRE);
+}
+
+// Finds first page at or after offset in object
+MmPage_t* MmLookupPageNext (MmObject_t* obj, size_t* off)
+{
+    size_t idx = *off >> NEXKE_CPU_PAGE_SHIFT;
+    MmRadixNode_t* root = __atomic_load_n (&obj->pageTree.root, __ATOMIC_ACQUIRE);
+    if (!root || idx > mmRadixMaxIdx (root))
+        return NULL;
+    MmPage_t* page = mmRadixFindNext (root, &idx);
+    if (page)
+        *off = page->offset;
+    return page;
 }
 
-// Removes a page from the specified hash list
+// Removes a page from its object
 void MmRemovePage (MmPage_t* page)
 {
     // Make sure page is in object
     assert (page->flags & MM_PAGE_IN_OBJECT);
-    // Find bucket
-    size_t bucketIdx = MM_GET_BUCKET (page->obj, page->offset);
-    MmPageBucket_t* bucket = &mmPageHash[bucketIdx];
-    NkSpinLock (&bucket->lock);
-    // Remove from bucket
-    NkListRemove (&bucket->list, &page->link);
-    NkSpinUnlock (&bucket->lock);
-    // Remove from object
-    NkListRemove (&page->obj->pageList, &page->objLink);
+    MmDequeuePage (page);
+    MmPageTree_t* tree = &page->obj->pageTree;
+    size_t idx = page->offset >> NEXKE_CPU_PAGE_SHIFT;
+    NkSpinLock (&tree->lock);
+    // Find leaf. Empty nodes are left in place to keep lookups lockless
+    MmRadixNode_t* node = tree->root;
+    while (node && node->level)
+        node = node->slots[mmRadixSlot (node, idx)];
+    assert (node && node->slots[mmRadixSlot (node, idx)] == page);
+    __atomic_store_n (&node->slots[mmRadixSlot (node, idx)], NULL, __ATOMIC_RELEASE);
+    --node->count;
+    NkSpinUnlock (&tree->lock);
     page->offset = 0;    // For error checking
     page->obj = NULL;
     page->flags |= MM_PAGE_ALLOCED;    // Page is no longer in object but not free
     page->flags &= ~(MM_PAGE_IN_OBJECT);
 }
 
+// Frees a page that is in an object being destroyed
+static void mmFreeObjPage (MmPage_t* page)
+{
+    MmLockPage (page);
+    MmDequeuePage (page);
+    page->offset = 0;
+    page->obj = NULL;
+    page->flags |= MM_PAGE_ALLOCED;
+    page->flags &= ~(MM_PAGE_IN_OBJECT);
+    MmFreePage (page);
+    MmUnlockPage (page);
+}
+
+// Frees all pages in an object, along with its page tree
+void MmFreeObjectPages (MmObject_t* obj)
+{
+    MmPageTree_t* tree = &obj->pageTree;
+    NkSpinLock (&tree->lock);
+    MmRadixNode_t* root = tree->root;
+    tree->root = NULL;
+    NkSpinUnlock (&tree->lock);
+    if (root)
+        mmRadixDestroy (root, mmFreeObjPage);
+}
+
 // Fixes a page in memory
 void MmFixPage (MmPage_t* page)
 {
@@ -491,11 +1572,85 @@ void MmUnfixPage (MmPage_t* page)
     }
 }
 
+// Frees a mapping that has been taken off its page
+static FORCEINLINE void mmFreePageMap (MmPage_t* page, MmPageMap_t* map)
+{
+    if (map == &page->map)
+        map->space = NULL;
+    else
+        MmCacheFree (mmPageMapCache, map);
+}
+
+// Adds a mapping to page
+void MmAddPageMap (MmPage_t* page, MmSpace_t* space, uintptr_t addr, paddr_t table)
+{
+    MmPageMap_t* spare = NULL;
+    for (;;)
+    {
+        MmLockPage (page);
+        MmPageMap_t* map = (page->map.space) ? spare : &page->map;
+        if (map)
+        {
+            map->space = space;
+            map->addr = addr;
+            map->table = table;
+            map->next = page->maps;
+            page->maps = map;
+            MmUnlockPage (page);
+            // Someone freed the inline one while we were allocating
+            if (spare && map != spare)
+                MmCacheFree (mmPageMapCache, spare);
+            return;
+        }
+        // Inline mapping is taken, so allocate one without holding the lock
+        MmUnlockPage (page);
+        spare = MmCacheAlloc (mmPageMapCache);
+        if (!spare)
+            NkPanicOom();
+    }
+}
+
+// Removes a mapping from page
+bool MmRemovePageMap (MmPage_t* page, MmSpace_t* space, uintptr_t addr)
+{
+    MmPageMap_t* map = page->maps;
+    MmPageMap_t* prev = NULL;
+    while (map)
+    {
+        if (map->addr == addr && map->space == space)
+        {
+            if (prev)
+                prev->next = map->next;
+            else
+                page->maps = map->next;
+            mmFreePageMap (page, map);
+            return true;
+        }
+        prev = map;
+        map = map->next;
+    }
+    return false;
+}
+
+// Removes every mapping from page
+void MmClearPageMaps (MmPage_t* page)
+{
+    MmPageMap_t* map = page->maps;
+    while (map)
+    {
+        MmPageMap_t* next = map->next;
+        mmFreePageMap (page, map);
+        map = next;
+    }
+    page->maps = NULL;
+}
+
 static char* zonesFlags[] = {"MM_ZONE_KERNEL ",
                              "MM_ZONE_MMIO ",
                              "MM_ZONE_RESVD ",
                              "MM_ZONE_RECLAIM ",
-                             "MM_ZONE_ALLOCATABLE "};
+                             "MM_ZONE_ALLOCATABLE ",
+                             "MM_ZONE_CMA "};
 
 static inline size_t appendFlag (char* s, const char* flg)
 {
@@ -504,101 +1659,170 @@ static inline size_t appendFlag (char* s, const char* flg)
     return flgLen;
 }
 
+// Checks if memory map entry is memory we can use
+static FORCEINLINE bool mmIsMemUsable (NbMemEntry_t* ent)
+{
+    return ent->type == NEXBOOT_MEM_FREE || ent->type == NEXBOOT_MEM_FW_RECLAIM ||
+           ent->type == NEXBOOT_MEM_BOOT_RECLAIM;
+}
+
+// Checks if memory map entry needs page structures
+// ACPI reclaim memory becomes usable once the tables are copied out
+static FORCEINLINE bool mmIsMemPaged (NbMemEntry_t* ent)
+{
+    return mmIsMemUsable (ent) || ent->type == NEXBOOT_MEM_ACPI_RECLAIM;
+}
+
+// Gets the part of the PFN map that describes memory map entry
+static void mmPfnMapGetRange (NbMemEntry_t* ent, uintptr_t* start, uintptr_t* end)
+{
+    *start = (uintptr_t) &MM_PFNMAP[ent->base / NEXKE_CPU_PAGESZ];
+    *end = (uintptr_t) &MM_PFNMAP[(ent->base + ent->sz + NEXKE_CPU_PAGESZ - 1) / NEXKE_CPU_PAGESZ];
+}
+
+// Checks if page of the PFN map at virt is backed for an entry before idx
+// Page structures of neighboring entries can share a page at the ends of their parts
+static bool mmPfnMapIsBacked (NbMemEntry_t* memMap, int idx, uintptr_t virt)
+{
+    for (int i = 0; i < idx; ++i)
+    {
+        if (!memMap[i].sz || !mmIsMemPaged (&memMap[i]))
+            continue;
+        uintptr_t start = 0, end = 0;
+        mmPfnMapGetRange (&memMap[i], &start, &end);
+        if (virt < end && (virt + NEXKE_CPU_PAGESZ) > start)
+            return true;
+    }
+    return false;
+}
+
+// Backs the part of the PFN map that describes memory map entry idx
+// The middle of the part is mapped with large pages where it can be, and the ends with small
+// pages, so holes in the physical address space don't cost any memory. Physical memory is
+// taken from largePhys and smallPhys, which are moved past what was used. If map is false,
+// nothing is mapped and only the amount of memory is figured out
+static void mmPfnMapBack (NbMemEntry_t* memMap,
+                          int idx,
+                          paddr_t* largePhys,
+                          paddr_t* smallPhys,
+                          bool map)
+{
+    if (!memMap[idx].sz || !mmIsMemPaged (&memMap[idx]))
+        return;
+    int flags = MUL_PAGE_RW | MUL_PAGE_R | MUL_PAGE_KE;
+    uintptr_t start = 0, end = 0;
+    mmPfnMapGetRange (&memMap[idx], &start, &end);
+    uintptr_t largeStart = 0, largeEnd = 0;
+#ifdef MUL_LARGE_PAGESZ
+    // Large pages can't be shared with other entries, so they have to be inside of the part
+    largeStart = (start + (MUL_LARGE_PAGESZ - 1)) & ~(MUL_LARGE_PAGESZ - 1);
+    largeEnd = end & ~(MUL_LARGE_PAGESZ - 1);
+    if (largeStart >= largeEnd)
+        largeStart = 0, largeEnd = 0;
+    for (uintptr_t virt = largeStart; virt < largeEnd; virt += MUL_LARGE_PAGESZ)
+    {
+        if (map)
+            MmMulMapEarly (virt, *largePhys, flags | MUL_PAGE_LARGE);
+        *largePhys += MUL_LARGE_PAGESZ;
+    }
+#endif
+    for (uintptr_t virt = CpuPageAlignDown (start); virt < end; virt += NEXKE_CPU_PAGESZ)
+    {
+        if (virt >= largeStart && virt < largeEnd)
+            continue;
+        if (mmPfnMapIsBacked (memMap, idx, virt))
+            continue;
+        if (map)
+            MmMulMapEarly (virt, *smallPhys, flags);
+        *smallPhys += NEXKE_CPU_PAGESZ;
+    }
+}
+
 // Initialize page layer
 void MmInitPage()
 {
     // Grab bootinfo so we can read memory map
     NexNixBoot_t* boot = NkGetBootArgs();
-    // Step 1: go through memory map and figure out
-    // 1: the number of zones we need, and 2: the number of PFNs that
-    // must be represented
+    // Step 1: go through memory map and cut off memory the PFN map can't describe
+    // Page structures are at the index of their PFN, so that's memory above the top of the map
     NbMemEntry_t* memMap = boot->memMap;
     size_t mapSize = boot->mapSize;
     size_t numPfns = 0;
     size_t lastMapEnt = mapSize - 1;
+    paddr_t maxAddr = (paddr_t) (NEXKE_PFNMAP_MAX / sizeof (MmPage_t)) * NEXKE_CPU_PAGESZ;
     for (int i = 0; i < mapSize; ++i)
     {
         // Don't include reserved regions
-        if (!memMap[i].sz ||
-            !(memMap[i].type == NEXBOOT_MEM_FREE || memMap[i].type == NEXBOOT_MEM_FW_RECLAIM ||
-              memMap[i].type == NEXBOOT_MEM_BOOT_RECLAIM))
+        if (!memMap[i].sz || !mmIsMemPaged (&memMap[i]))
+            continue;
+        if (memMap[i].base >= maxAddr)
         {
+            memMap[i].sz = 0;
             continue;
         }
+        if ((memMap[i].base + memMap[i].sz) > maxAddr)
+            memMap[i].sz = maxAddr - memMap[i].base;
         // Figure out number of PFNs to represent
         numPfns += (memMap[i].sz + (NEXKE_CPU_PAGESZ - 1)) / NEXKE_CPU_PAGESZ;
-        // Figure out we exceeded max supported PFNs
-        if (numPfns >= (NEXKE_PFNMAP_MAX / sizeof (MmPage_t)))
-        {
-            numPfns = NEXKE_PFNMAP_MAX / sizeof (MmPage_t);
-            lastMapEnt = i;
-            break;
-        }
         // Ensure we don't go over max memory
 #ifdef NEXKE_MAX_PAGES
         if (numPfns >= NEXKE_MAX_PAGES)
         {
-            numPfns = NEXKE_PFNMAP_MAX / sizeof (MmPage_t);
             lastMapEnt = i;
             break;
         }
 #endif
     }
-    // Step 2: figure out the size of page hash map
-    // We set it equal to the power of two greater than half the number of pages in the system
-    mmNumBuckets = 1;
-    while (mmNumBuckets < (numPfns / 2))
-        mmNumBuckets <<= 1;
-    // Step 3: allocate space for PFN map and page hash map
+    // Step 2: back the PFN map
     // We will allocate the zone structures from the slab, however, since
     // the amount of memory the slab has to work with is limited right now,
     // we will grab memory for the page structures straight from the memory map
-    void* pageMap = NULL;
-    // Figure out the size of memory that we need
-    size_t pageMapSz = (numPfns * sizeof (MmPage_t)) + (mmNumBuckets * sizeof (MmPageBucket_t));
+    // First find out how much memory backing the map takes
+    paddr_t largeSz = 0, smallSz = 0;
+    for (int i = 0; i < lastMapEnt; ++i)
+        mmPfnMapBack (memMap, i, &largeSz, &smallSz, false);
+    paddr_t mapSz = largeSz + smallSz;
+    paddr_t mapAlign = NEXKE_CPU_PAGESZ;
+#ifdef MUL_LARGE_PAGESZ
+    if (largeSz)
+        mapAlign = MUL_LARGE_PAGESZ;
+#endif
     // Find a contigous region of memory for PFN map
+    bool mapped = false;
     for (int i = 0; i < lastMapEnt; ++i)
     {
-        if (memMap[i].type == NEXBOOT_MEM_FREE || memMap[i].type == NEXBOOT_MEM_FW_RECLAIM ||
-            memMap[i].type == NEXBOOT_MEM_BOOT_RECLAIM)
+        if (mmIsMemUsable (&memMap[i]))
         {
+            // Determine our base address
+            paddr_t mapEnd = memMap[i].base + memMap[i].sz;
+            paddr_t mapPhys = (mapEnd - mapSz) & ~(mapAlign - 1);
             // Determine if there is enough space
-            if (memMap[i].sz > pageMapSz)
+            if (memMap[i].sz > mapSz && mapPhys >= memMap[i].base)
             {
                 // Decrease available space
-                memMap[i].sz -= CpuPageAlignUp (pageMapSz);
-                // Determine our base address
-                paddr_t mapPhys = memMap[i].base + memMap[i].sz;
-                // Map it
-                size_t numMapPages = CpuPageAlignUp (pageMapSz) / NEXKE_CPU_PAGESZ;
-                // Figure out size of PFN map without hash map
-                size_t pfnMapSz = numPfns * sizeof (MmPage_t);
-                for (int i = 0; i < numMapPages; ++i)
-                {
-                    MmMulMapEarly (NEXKE_PFNMAP_BASE + (i * NEXKE_CPU_PAGESZ),
-                                   mapPhys + (i * NEXKE_CPU_PAGESZ),
-                                   MUL_PAGE_RW | MUL_PAGE_R | MUL_PAGE_KE);
-                }
+                memMap[i].sz = mapPhys - memMap[i].base;
+                // That can shrink the part of the map this entry needs, so figure out how much
+                // of the map is large pages again
+                paddr_t largePhys = 0, smallPhys = 0;
+                for (int j = 0; j < lastMapEnt; ++j)
+                    mmPfnMapBack (memMap, j, &largePhys, &smallPhys, false);
+                // Map it. Large pages go first, as they need the alignment
+                smallPhys = mapPhys + largePhys;
+                largePhys = mapPhys;
+                for (int j = 0; j < lastMapEnt; ++j)
+                    mmPfnMapBack (memMap, j, &largePhys, &smallPhys, true);
                 NkLogDebug ("nexke: Allocated PFN map from %#llX to %#llX\n",
                             (uint64_t) mapPhys,
-                            (uint64_t) mapPhys + pfnMapSz);
-                NkLogDebug ("nexke: Allocated page hash map from %#llX to %#llX\n",
-                            (uint64_t) mapPhys + pfnMapSz,
-                            (uint64_t) mapPhys + (numMapPages * NEXKE_CPU_PAGESZ));
-                // Set page hash map base
-                mmPageHash = (MmPageBucket_t*) (NEXKE_PFNMAP_BASE + pfnMapSz);
-                // Initialize page hash
-                for (int i = 0; i < mmNumBuckets; ++i)
-                {
-                    NkListInit (&mmPageHash[i].list);
-                    mmPageHash[i].lock = 0;
-                }
+                            (uint64_t) mapPhys + mapSz);
+                mapped = true;
                 break;
             }
         }
     }
-    // Step 4: initialize the zones
-    mmZoneCache = MmCacheCreate (sizeof (MmZone_t), "MmZone_t", 0, 0);
+    if (!mapped)
+        NkPanic ("nexke: unable to allocate PFN map\n");
+    // Step 3: initialize the zones
+    mmZoneCache = MmCacheCreate (sizeof (MmZone_t), "MmZone_t", MM_TAG_MM, 0, 0);
     for (int i = 0; i < lastMapEnt; ++i)
     {
         if (!memMap[i].sz)
@@ -615,8 +1839,24 @@ void MmInitPage()
             flags |= MM_ZONE_RECLAIM;
         else
             flags |= MM_ZONE_ALLOCATABLE;
-        // Create zone
-        mmZoneCreate (memMap[i].base / NEXKE_CPU_PAGESZ, memMap[i].sz / NEXKE_CPU_PAGESZ, flags);
+        // Create a zone for each node this entry spans
+        paddr_t base = memMap[i].base;
+        paddr_t end = memMap[i].base + memMap[i].sz;
+        while (base < end)
+        {
+            paddr_t nodeEnd = 0;
+            int node = PltGetMemNode (base, &nodeEnd);
+            // Always move forward at least a page, even if the firmware's ranges aren't aligned
+            nodeEnd &= ~(paddr_t) (NEXKE_CPU_PAGESZ - 1);
+            if (nodeEnd <= base)
+                nodeEnd = base + NEXKE_CPU_PAGESZ;
+            if (nodeEnd > end)
+                nodeEnd = end;
+            size_t numPfns = (nodeEnd - base) / NEXKE_CPU_PAGESZ;
+            if (numPfns)
+                mmZoneCreate (base / NEXKE_CPU_PAGESZ, numPfns, flags, node);
+            base = nodeEnd;
+        }
     }
     // Merge all mergable zones
     size_t curZone = 1;
@@ -660,25 +1900,64 @@ void MmInitPage()
             ((mmZones[i]->pfn + mmZones[i]->numPages) * NEXKE_CPU_PAGESZ) > MM_4G_END &&
             (mmZones[i]->flags & MM_ZONE_ALLOCATABLE))
         {
-            // Zone starts beneath 16M but juts into 16+, split it
-            mmZoneSplit (mmZones[i],
-                         (MM_4G_END / NEXKE_CPU_PAGESZ),
-                         mmZones[i]->flags | MM_ZONE_NO_GENERIC);
+            // Zone starts beneath 4G but juts into 4G+, split it
+            // General allocations are still allowed here, we only need the zone boundary
+            mmZoneSplit (mmZones[i], (MM_4G_END / NEXKE_CPU_PAGESZ), mmZones[i]->flags);
             break;
         }
     }
 #endif
+    // Carve out the contiguous reserve from the first general purpose zone that can spare it
+    const char* cmaArg = NkReadArg ("-cma");
+    size_t cmaPages = 0;
+    if (cmaArg && *cmaArg)
+        cmaPages = ((size_t) atoi (cmaArg) * 1024 * 1024) / NEXKE_CPU_PAGESZ;
+    for (int i = 0; cmaPages && i < mmNumZones; ++i)
+    {
+        // Leave at least as much as we take
+        MmZone_t* zone = mmZones[i];
+        if ((zone->flags & MM_ZONE_ALLOCATABLE) && !(zone->flags & MM_ZONE_NO_GENERIC) &&
+            zone->numPages > (cmaPages * 2))
+        {
+            // Generic allocations stay out of it, only movable pages get lent the reserve
+            int cmaFlags = zone->flags | MM_ZONE_CMA | MM_ZONE_NO_GENERIC;
+            mmZoneSplit (zone, zone->pfn + cmaPages, cmaFlags);
+            mmCmaZone = zone;
+            NkLogInfo ("nexke: reserved %zuM for contiguous allocations\n",
+                       (cmaPages * NEXKE_CPU_PAGESZ) / 1024 / 1024);
+            break;
+        }
+    }
+    if (cmaPages && !mmCmaZone)
+        NkLogWarning ("nexke: warning: no room for contiguous reserve\n");
     NkLogInfo ("nexke: found %lluM of free memory\n",
                (mmNumPages * NEXKE_CPU_PAGESZ) / 1024 / 1024);
-    // Log zones and set free hint
-    MmZone_t* curBest = NULL;
+    // Order nodes by distance from each node, so allocations fall back to the nearest memory
+    mmNumNodes = PltGetNumNodes();
+    for (int i = 0; i < mmNumNodes; ++i)
+    {
+        int* order = mmNodeOrder[i];
+        for (int j = 0; j < mmNumNodes; ++j)
+        {
+            // Insertion sort, there are only a few nodes
+            int k = j;
+            while (k && PltGetNodeDist (i, order[k - 1]) > PltGetNodeDist (i, j))
+            {
+                order[k] = order[k - 1];
+                --k;
+            }
+            order[k] = j;
+        }
+    }
+    // Log zones and set free hints
     for (int i = 0; i < mmNumZones; ++i)
     {
-        // Check if this zone is an ideal free zone
-        if (!curBest || (mmZones[i]->freeCount > curBest->freeCount &&
-                         !(mmZones[i]->flags & MM_ZONE_NO_GENERIC)))
+        // Check if this zone is an ideal free zone of its node
+        MmZone_t** curBest = &freeHint[mmZones[i]->node];
+        if (!*curBest || (mmZones[i]->freeCount > (*curBest)->freeCount &&
+                          !(mmZones[i]->flags & MM_ZONE_NO_GENERIC)))
         {
-            curBest = mmZones[i];
+            *curBest = mmZones[i];
         }
         char typeS[256] = {0};
         char* s = typeS;
@@ -707,18 +1986,119 @@ void MmInitPage()
             char* flg = zonesFlags[0];
             s += appendFlag (s, flg);
         }
-        NkLogDebug ("nexke: Found memory region from %#llX to %#llX, flags %s\n",
+        if (mmZones[i]->flags & MM_ZONE_CMA)
+        {
+            char* flg = zonesFlags[5];
+            s += appendFlag (s, flg);
+        }
+        NkLogDebug ("nexke: Found memory region from %#llX to %#llX, node %d, flags %s\n",
                     (uintmax_t) mmZones[i]->pfn * NEXKE_CPU_PAGESZ,
                     (uintmax_t) (mmZones[i]->pfn + mmZones[i]->numPages) * NEXKE_CPU_PAGESZ,
+                    mmZones[i]->node,
                     typeS);
     }
-    freeHint = curBest;
+    // Now that zones are final, build buddy free lists
+    for (int i = 0; i < mmNumZones; ++i)
+    {
+        if (mmZones[i]->flags & MM_ZONE_ALLOCATABLE)
+            mmBuddyInitZone (mmZones[i]);
+    }
+    // Set up zeroed page pool. The idle thread fills it
+    NkListInit (&mmZeroPool);
+    // Set up this CPU's page cache
+    const char* pcpArg = NkReadArg ("-pcphigh");
+    if (pcpArg && *pcpArg)
+        mmPcpHigh = atoi (pcpArg);
+    pcpArg = NkReadArg ("-pcpbatch");
+    if (pcpArg && *pcpArg)
+        mmPcpBatch = atoi (pcpArg);
+    // Batch must be non-zero and beneath high watermark
+    if (mmPcpBatch <= 0)
+        mmPcpBatch = 1;
+    if (mmPcpHigh < mmPcpBatch)
+        mmPcpHigh = mmPcpBatch;
+    MmInitCpu (CpuGetCcb());
+    mmSetWatermarks();
+    MmRegisterShrinker (&mmZeroPoolShrinker);
+    MmRegisterShrinker (&mmPcpShrinker);
+    MmRegisterShrinker (&mmPtReserveShrinker);
+    NkStatRegister (&mmStatAllocs);
+    NkStatRegister (&mmStatFrees);
+    NkStatRegister (&mmStatMigrations);
+    NkStatRegister (&mmStatTotal);
+    NkStatRegister (&mmStatFree);
     // Create fake page cache
-    mmFakePageCache = MmCacheCreate (sizeof (MmPage_t), "MmPage_t", 0, 0);
+    mmFakePageCache = MmCacheCreate (sizeof (MmFakePage_t), "MmFakePage_t", MM_TAG_MM, 0, 0);
     assert (mmFakePageCache);
     // Create page map cache
-    mmPageMapCache = MmCacheCreate (sizeof (MmPageMap_t), "MmPageMap_t", 0, 0);
+    mmPageMapCache = MmCacheCreate (sizeof (MmPageMap_t), "MmPageMap_t", MM_TAG_MM, 0, 0);
     assert (mmPageMapCache);
+    // Create page tree node cache
+    mmRadixCache = MmCacheCreate (sizeof (MmRadixNode_t), "MmRadixNode_t", MM_TAG_MM, 0, 0);
+    assert (mmRadixCache);
+}
+
+// Gives firmware memory that was only needed during boot to the page allocator
+// Boot and firmware reclaim memory is allocatable from the start, this is for ACPI reclaim
+// memory, so ACPI tables must have been copied out first. Only runs before other CPUs start
+void MmReclaimFwMem()
+{
+    uintmax_t numReclaimed = 0;
+    for (int i = 0; i < mmNumZones; ++i)
+    {
+        MmZone_t* zone = mmZones[i];
+        if (!(zone->flags & MM_ZONE_RECLAIM))
+            continue;
+        NkMcsLock (&zone->lock);
+        zone->flags &= ~MM_ZONE_RECLAIM;
+        zone->flags |= MM_ZONE_ALLOCATABLE;
+#ifdef NEXNIX_BOARD_PC
+        // Keep ISA DMA memory out of general purpose allocations
+        if (((zone->pfn + zone->numPages) * NEXKE_CPU_PAGESZ) <= MM_16M_END)
+            zone->flags |= MM_ZONE_NO_GENERIC;
+#endif
+        zone->pfnMap = &MM_PFNMAP[zone->pfn];
+        // Pages count as free until their chunk is set up, like at boot
+        mmNumPages += zone->numPages;
+        mmFreePages += zone->numPages;
+        mmBuddyInitZone (zone);
+        NkMcsUnlock (&zone->lock);
+        numReclaimed += zone->numPages;
+    }
+    if (!numReclaimed)
+        return;
+    mmSetWatermarks();
+    NkLogInfo ("nexke: reclaimed %lluK of firmware memory\n",
+               (numReclaimed * NEXKE_CPU_PAGESZ) / 1024);
+}
+
+// Sets up page allocator state of a CPU
+void MmInitCpu (NkCcb_t* ccb)
+{
+    NkListInit (&ccb->pageCache);
+    ccb->pageCacheCount = 0;
+    ccb->pageCacheHigh = mmPcpHigh;
+    ccb->pageCacheBatch = mmPcpBatch;
+    NkListInit (&ccb->ptReserve);
+    ccb->ptReserveCount = 0;
+    ccb->ptReserveTarget = MM_PT_RESERVE_MIN;
+    ccb->ptReserveTaken = 0;
+    ccb->ptReserveTime = 0;
+}
+
+// Sets NUMA node of a CPU
+// Must be called on the CPU itself, or before it starts
+void MmSetCpuNode (NkCcb_t* ccb, int node)
+{
+    if (node < 0 || node >= mmNumNodes)
+        node = 0;
+    if (ccb->node == node)
+        return;
+    // Cached pages came from the old node
+    TskDisablePreempt();
+    mmPcpDrain (ccb, ccb->pageCacheCount);
+    ccb->node = node;
+    TskEnablePreempt();
 }
 
 // Dumps out page debugging info
@@ -755,6 +2135,11 @@ void MmDumpPageInfo()
             char* flg = zonesFlags[0];
             s += appendFlag (s, flg);
         }
+        if (mmZones[i]->flags & MM_ZONE_CMA)
+        {
+            char* flg = zonesFlags[5];
+            s += appendFlag (s, flg);
+        }
         NkLogDebug ("Zone %d: physical base = %p, end = %p, free page count = %u, flags %s, is "
                     "free hint = %s\n",
                     mmZones[i]->zoneIdx,
@@ -762,9 +2147,16 @@ void MmDumpPageInfo()
                     (mmZones[i]->pfn + mmZones[i]->numPages) * NEXKE_CPU_PAGESZ,
                     mmZones[i]->freeCount,
                     typeS,
-                    mmZones[i] == freeHint ? "true" : "false");
+                    mmZones[i] == freeHint[mmZones[i]->node] ? "true" : "false");
     }
     // Dump variables
     NkLogDebug ("Total number of pages: %llu\n", mmNumPages);
     NkLogDebug ("Total number of free pages: %llu\n", mmFreePages);
+    NkLogDebug ("Reclaim low watermark: %llu, high watermark: %llu\n", mmLowPages, mmHighPages);
+    NkLogDebug ("Pages in zeroed page pool: %d\n", mmZeroPoolCount);
+    NkLogDebug ("Pages in CPU page cache: %d, high watermark: %d, batch: %d\n",
+                CpuGetCcb()->pageCacheCount,
+                CpuGetCcb()->pageCacheHigh,
+                CpuGetCcb()->pageCacheBatch);
+    MmZpoolDump();
 }
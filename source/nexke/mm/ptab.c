@@ -36,17 +36,32 @@ void MmPtabInit (int numLevels)
     mmNumLevels = numLevels;
 }
 
-// Walks to a page table entry and creates page tables for ita
-MmPtCacheEnt_t* MmPtabWalkAndMap (MmSpace_t* space, paddr_t as, uintptr_t vaddr, pte_t pte)
+// Splits a large page we walked into if needed
+static FORCEINLINE void mmPtabSplit (MmSpace_t* space, uintptr_t vaddr, pte_t* ent, int level)
+{
+#ifdef MUL_LARGE_PAGESZ
+    if (level == MUL_LARGE_LEVEL && PT_ISLARGE (*ent))
+        MmMulSplitLarge (space, vaddr, ent);
+#endif
+}
+
+// Walks to the table at specified level, creating tables as needed
+MmPtCacheEnt_t* MmPtabWalkAndMapLevel (MmSpace_t* space,
+                                       paddr_t as,
+                                       uintptr_t vaddr,
+                                       pte_t pte,
+                                       int level)
 {
     // Grab base and cache it
     MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (as, mmNumLevels);
-    for (int i = mmNumLevels; i > 1; --i)
+    for (int i = mmNumLevels; i > level; --i)
     {
         pte_t* curSt = (pte_t*) cacheEnt->addr;
         pte_t* ent = &curSt[MUL_IDX_LEVEL (vaddr, i)];
         if (*ent)
         {
+            // We need a table, not a large page
+            mmPtabSplit (space, vaddr, ent, i);
             // Verify validity of this table for mapping this page
             // Failure results in panic
             MmMulVerify (*ent, pte);
@@ -65,6 +80,12 @@ MmPtCacheEnt_t* MmPtabWalkAndMap (MmSpace_t* space, paddr_t as, uintptr_t vaddr,
     return cacheEnt;
 }
 
+// Walks to a page table entry and creates page tables for it
+MmPtCacheEnt_t* MmPtabWalkAndMap (MmSpace_t* space, paddr_t as, uintptr_t vaddr, pte_t pte)
+{
+    return MmPtabWalkAndMapLevel (space, as, vaddr, pte, 1);
+}
+
 // Walks to a pte and returns a cache entry
 MmPtCacheEnt_t* MmPtabWalk (MmSpace_t* space, paddr_t as, uintptr_t vaddr)
 {
@@ -76,6 +97,7 @@ MmPtCacheEnt_t* MmPtabWalk (MmSpace_t* space, paddr_t as, uintptr_t vaddr)
         pte_t* ent = &curSt[MUL_IDX_LEVEL (vaddr, i)];
         if (*ent)
         {
+            mmPtabSplit (space, vaddr, ent, i);
             // Grab cache entry
             cacheEnt = MmPtabSwapCache (PT_GETFRAME (*ent), cacheEnt, i - 1);
         }
@@ -88,6 +110,40 @@ MmPtCacheEnt_t* MmPtabWalk (MmSpace_t* space, paddr_t as, uintptr_t vaddr)
     return cacheEnt;
 }
 
+// Walks to the table at specified level without changing anything
+MmPtCacheEnt_t* MmPtabLookup (MmSpace_t* space, paddr_t as, uintptr_t vaddr, int level)
+{
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (as, mmNumLevels);
+    for (int i = mmNumLevels; i > level; --i)
+    {
+        pte_t* curSt = (pte_t*) cacheEnt->addr;
+        pte_t ent = curSt[MUL_IDX_LEVEL (vaddr, i)];
+#ifdef MUL_LARGE_PAGESZ
+        if (i == MUL_LARGE_LEVEL && PT_ISLARGE (ent))
+            ent = 0;
+#endif
+        if (!ent)
+        {
+            MmPtabReturnCache (cacheEnt);
+            return NULL;
+        }
+        cacheEnt = MmPtabSwapCache (PT_GETFRAME (ent), cacheEnt, i - 1);
+    }
+    return cacheEnt;
+}
+
+// Checks if the table at tab has nothing mapped in it
+bool MmPtabIsEmpty (paddr_t tab)
+{
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (tab, MM_PTAB_UNCACHED);
+    pte_t* table = (pte_t*) cacheEnt->addr;
+    bool empty = true;
+    for (int i = 0; empty && i < (NEXKE_CPU_PAGESZ / sizeof (pte_t)); ++i)
+        empty = !table[i];
+    MmPtabFreeToCache (cacheEnt);
+    return empty;
+}
+
 // Iterates over PTEs in address space
 MmPtCacheEnt_t* MmPtabIterate (MmPtIter_t* iter)
 {
@@ -120,6 +176,7 @@ MmPtCacheEnt_t* MmPtabIterate (MmPtIter_t* iter)
                 iter->addr += NEXKE_CPU_PAGESZ;
                 return NULL;
             }
+            mmPtabSplit (iter->space, addr, ent, i);
             // Cache it
             table->cacheEnt = MmPtabGetCache (PT_GETFRAME (*ent), i - 1);
         }
@@ -141,14 +198,171 @@ void MmPtabEndIterate (MmPtIter_t* iter)
     }
 }
 
+// Starts a TLB gather on space
+void MmPtabInitGather (MmTlbGather_t* gather, MmSpace_t* space)
+{
+    gather->space = space;
+    gather->start = (uintptr_t) -1;
+    gather->end = 0;
+    gather->count = 0;
+    gather->numPages = 0;
+    gather->flushAll = false;
+    NkListInit (&gather->tabList);
+}
+
+// Adds size bytes at addr to gather
+void MmPtabGather (MmTlbGather_t* gather, uintptr_t addr, size_t size, MmPage_t* page)
+{
+    if (gather->count == MM_GATHER_MAX)
+    {
+        // Mappings can't be removed until the TLB is flushed, so if we are holding on to pages
+        // we have to flush now. Otherwise just give up on tracking addresses
+        if (gather->numPages || page)
+            MmPtabFlushGather (gather);
+        else
+            gather->flushAll = true;
+    }
+    // Grow range
+    if (addr < gather->start)
+        gather->start = addr;
+    if ((addr + size) > gather->end)
+        gather->end = addr + size;
+    if (gather->count < MM_GATHER_MAX)
+    {
+        MmGatherEnt_t* ent = &gather->entries[gather->count++];
+        ent->addr = addr;
+        ent->page = page;
+        if (page)
+            ++gather->numPages;
+    }
+}
+
+// Flushes gathered invalidations and removes gathered mappings
+void MmPtabFlushGather (MmTlbGather_t* gather)
+{
+    MmSpace_t* space = gather->space;
+    if (gather->count)
+    {
+        MmMulFlushGather (gather);
+        MmTlbShootdown (space, gather->start, gather->end, gather->flushAll);
+    }
+    if (gather->numPages || NkListFront (&gather->tabList))
+    {
+        // We can't lock pages while holding the address space lock
+        // as that would violate lock ordering
+        MM_MUL_UNLOCK (space);
+        for (int i = 0; gather->numPages && i < gather->count; ++i)
+        {
+            MmPage_t* page = gather->entries[i].page;
+            if (!page)
+                continue;
+            MmLockPage (page);
+            if (MmRemovePageMap (page, space, gather->entries[i].addr))
+                --space->stats.numMaps;
+            MmUnlockPage (page);
+        }
+        // No CPU can walk gathered tables anymore, and they're still all zeroes
+        NkLink_t* link = NULL;
+        while ((link = NkListFront (&gather->tabList)))
+        {
+            NkListRemove (&gather->tabList, link);
+            MmPage_t* page = LINK_CONTAINER (link, MmPage_t, link);
+            MmLockPage (page);
+            MmUnfixPage (page);
+            MmUnlockPage (page);
+            MmFreePtPage (page);
+        }
+        MM_MUL_LOCK (space);
+    }
+    MmPtabInitGather (gather, space);
+}
+
+// Drops the cache entry of a table that is going away, so it goes back to the free list
+static void mmPtabDropCache (paddr_t tab, int level)
+{
+    MmPtCacheEnt_t* ent = MmGetCurrentSpace()->mulSpace.ptLists[level];
+    while (ent)
+    {
+        if (ent->ptab == tab)
+        {
+            if (!ent->inUse)
+                MmPtabFreeToCache (ent);
+            return;
+        }
+        ent = ent->next;
+    }
+}
+
+// Unhooks empty tables in the walked range
+void MmPtabReclaim (MmTlbGather_t* gather,
+                    paddr_t as,
+                    uintptr_t walkBase,
+                    uintptr_t base,
+                    size_t count)
+{
+    if (!count)
+        return;
+    MmSpace_t* space = gather->space;
+    uintptr_t walkLast = walkBase + (count * NEXKE_CPU_PAGESZ) - 1;
+    int maxLevel = mmNumLevels - 1;
+    if (space == MmGetKernelSpace())
+        --maxLevel;
+    // Go bottom up, so tables emptied by freeing the ones below them get freed too
+    for (int level = 1; level <= maxLevel; ++level)
+    {
+        uintptr_t span = 1ULL << idxShiftTab[level + 1];
+        uintptr_t first = walkBase & ~(span - 1);
+        size_t numTabs = ((walkLast - first) / span) + 1;
+        for (size_t i = 0; i < numTabs; ++i)
+        {
+            uintptr_t addr = first + (i * span);
+            MmPtCacheEnt_t* cacheEnt = MmPtabLookup (space, as, addr, level + 1);
+            if (!cacheEnt)
+                continue;
+            pte_t* ent = &((pte_t*) cacheEnt->addr)[MUL_IDX_LEVEL (addr, level + 1)];
+            bool isTable = *ent != 0;
+#ifdef MUL_LARGE_PAGESZ
+            if ((level + 1) == MUL_LARGE_LEVEL && PT_ISLARGE (*ent))
+                isTable = false;
+#endif
+            if (isTable && MmPtabIsEmpty (PT_GETFRAME (*ent)))
+            {
+                paddr_t tab = PT_GETFRAME (*ent);
+                // Tables the loader built aren't ours to free
+                MmPage_t* page = MmFindPagePfn (tab >> NEXKE_CPU_PAGE_SHIFT);
+                if ((page->flags & (MM_PAGE_FIXED | MM_PAGE_UNUSABLE)) == MM_PAGE_FIXED)
+                {
+                    *ent = 0;
+                    NkListRemove (&space->mulSpace.pageList, &page->link);
+                    mmPtabDropCache (tab, level);
+                    // Walks through the table have to be flushed before it can be reused
+                    MmPtabGather (gather, base + (addr - walkBase), NEXKE_CPU_PAGESZ, NULL);
+                    NkListAddBack (&gather->tabList, &page->link);
+                }
+                else if (page->flags & MM_PAGE_FAKE)
+                    MmFreePage (page);
+            }
+            MmPtabReturnCache (cacheEnt);
+        }
+    }
+}
+
 // Zeroes a page with the MUL
 // This function is the same across MULs so it is implemented in the architecture independent
 // module
 void MmMulZeroPage (MmPage_t* page)
 {
-    NkSpinLock (&MmGetCurrentSpace()->mulSpace.ptCacheLock);
     // Get physical address
-    paddr_t addr = page->pfn * NEXKE_CPU_PAGESZ;
+    paddr_t addr = MmGetPagePhys (page);
+#ifdef MUL_DIRECT_MAP
+    void* direct = MmPtabGetDirect (addr);
+    if (direct)
+    {
+        memset (direct, 0, NEXKE_CPU_PAGESZ);
+        return;
+    }
+#endif
+    NkSpinLock (&MmGetCurrentSpace()->mulSpace.ptCacheLock);
     MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (addr, MM_PTAB_UNCACHED);
     memset ((void*) cacheEnt->addr, 0, NEXKE_CPU_PAGESZ);
     // Free the cache entry
@@ -156,6 +370,119 @@ void MmMulZeroPage (MmPage_t* page)
     NkSpinUnlock (&MmGetCurrentSpace()->mulSpace.ptCacheLock);
 }
 
+// Copies a page with the MUL
+void MmMulCopyPage (MmPage_t* dest, MmPage_t* src)
+{
+#ifdef MUL_DIRECT_MAP
+    void* destDirect = MmPtabGetDirect (MmGetPagePhys (dest));
+    void* srcDirect = MmPtabGetDirect (MmGetPagePhys (src));
+    if (destDirect && srcDirect)
+    {
+        memcpy (destDirect, srcDirect, NEXKE_CPU_PAGESZ);
+        return;
+    }
+#endif
+    NkSpinLock (&MmGetCurrentSpace()->mulSpace.ptCacheLock);
+    // Map both pages
+    MmPtCacheEnt_t* destEnt = MmPtabGetCache (MmGetPagePhys (dest), MM_PTAB_UNCACHED);
+    MmPtCacheEnt_t* srcEnt = MmPtabGetCache (MmGetPagePhys (src), MM_PTAB_UNCACHED);
+    memcpy ((void*) destEnt->addr, (void*) srcEnt->addr, NEXKE_CPU_PAGESZ);
+    // Free the cache entries
+    MmPtabFreeToCache (srcEnt);
+    MmPtabFreeToCache (destEnt);
+    NkSpinUnlock (&MmGetCurrentSpace()->mulSpace.ptCacheLock);
+}
+
+// Maps a page into the kernel long enough to call func on its contents
+void MmMulAccessPage (MmPage_t* page, void (*func) (void*, void*), void* arg)
+{
+#ifdef MUL_DIRECT_MAP
+    void* direct = MmPtabGetDirect (MmGetPagePhys (page));
+    if (direct)
+    {
+        func (direct, arg);
+        return;
+    }
+#endif
+    NkSpinLock (&MmGetCurrentSpace()->mulSpace.ptCacheLock);
+    MmPtCacheEnt_t* cacheEnt = MmPtabGetCache (MmGetPagePhys (page), MM_PTAB_UNCACHED);
+    func ((void*) cacheEnt->addr, arg);
+    MmPtabFreeToCache (cacheEnt);
+    NkSpinUnlock (&MmGetCurrentSpace()->mulSpace.ptCacheLock);
+}
+
+#ifdef MUL_TLB_TAGS
+// TLB tag allocation
+// Tags are handed out in generations. When a generation runs out of tags a new one is started,
+// and each CPU flushes its whole TLB the first time it gets a tag in the new generation.
+// That way we never have to track down spaces to take their tags away
+#define MM_TAG_SHIFT 16
+#define MM_TAG_MASK  ((1ULL << MM_TAG_SHIFT) - 1)
+
+static int mmMaxTag = 0;          // Highest tag, 0 if tags aren't in use
+static uint64_t mmTagGen = 0;     // Current generation
+static int mmNextTag = 1;         // Next tag to hand out, tag 0 belongs to the kernel space
+static spinlock_t mmTagLock = 0;
+
+// Enables TLB tags
+void MmPtabInitTags (int maxTag)
+{
+    assert (maxTag <= MM_TAG_MASK);
+    mmMaxTag = maxTag;
+    // Start at generation 1, so spaces with a zeroed tag never look current
+    mmTagGen = 1ULL << MM_TAG_SHIFT;
+}
+
+// Gets TLB tag of space for use on this CPU
+bool MmPtabGetTag (MmSpace_t* space, int* tag)
+{
+    // Kernel space always uses tag 0
+    if (!mmMaxTag || space == MmGetKernelSpace())
+    {
+        *tag = 0;
+        return true;
+    }
+    MmMulSpace_t* mulSpace = &space->mulSpace;
+    NkCcb_t* ccb = CpuGetCcb();
+    bool trusted = true;
+    NkSpinLock (&mmTagLock);
+    // If the tag is from an old generation, get a new one
+    if ((mulSpace->tlbTag & ~MM_TAG_MASK) != mmTagGen)
+    {
+        if (mmNextTag > mmMaxTag)
+        {
+            // Out of tags, start a new generation
+            mmTagGen += 1ULL << MM_TAG_SHIFT;
+            mmNextTag = 1;
+        }
+        mulSpace->tlbTag = mmTagGen | mmNextTag++;
+        // Nobody has entries for a fresh tag
+        mulSpace->tlbCpu = ccb->cpuNum;
+    }
+    // Get rid of entries from old generations on this CPU
+    if (ccb->tlbGen != mmTagGen)
+    {
+        MmMulFlushTlb();
+        ccb->tlbGen = mmTagGen;
+    }
+    // If another CPU used this tag last, our entries for it may be out of date
+    if (mulSpace->tlbCpu != ccb->cpuNum)
+    {
+        trusted = false;
+        mulSpace->tlbCpu = ccb->cpuNum;
+    }
+    *tag = mulSpace->tlbTag & MM_TAG_MASK;
+    NkSpinUnlock (&mmTagLock);
+    return trusted;
+}
+
+// Marks TLB entries of space as out of date on every CPU
+void MmPtabStaleTag (MmSpace_t* space)
+{
+    space->mulSpace.tlbCpu = -1;
+}
+#endif
+
 // Initializes PT cache in specified space
 void MmPtabInitCache (MmSpace_t* space)
 {
@@ -164,6 +491,7 @@ void MmPtabInitCache (MmSpace_t* space)
     for (int i = 0; i < MUL_MAX_PTCACHE; ++i)
     {
         entries[i].addr = MUL_PTCACHE_BASE + (i * NEXKE_CPU_PAGESZ);
+        entries[i].direct = false;
         // Grab address of PTE for this address
         entries[i].pte = MmMulGetCacheAddr (entries[i].addr);
         // Check if this is the end
@@ -253,6 +581,126 @@ static void mmPtabSetupEntry (MmPtCacheEnt_t* ent, paddr_t ptab, int level)
     MmMulFlushCacheEntry (ent->addr);
 }
 
+// Frees unused cache entries until the free list reaches target
+static void mmPtabTrim (MmSpace_t* space)
+{
+    MmMulSpace_t* mulSpace = &space->mulSpace;
+    // Go through every list and find entries to free
+    // We go from the tail of each list as older entries are less likely to be used
+    // according to the principle of LRU
+    for (int i = 0; i <= mmNumLevels; ++i)
+    {
+        MmPtCacheEnt_t* ent = mulSpace->ptListsEnd[i];
+        while (ent)
+        {
+            MmPtCacheEnt_t* prev = ent->prev;
+            if (!ent->inUse)
+            {
+                // Free this entry
+                mmPtabRemoveEntry (space, ent);
+                mmPtabFreeEntry (space, ent);
+                // Check if we've reached target
+                if (mulSpace->freeCount >= MM_PTAB_FREETARGET)
+                    return;
+            }
+            ent = prev;
+        }
+    }
+}
+
+#ifdef MUL_DIRECT_MAP
+// Direct map
+// 64-bit MULs map all usable memory at MUL_DIRECT_BASE, so tables can be reached without
+// remapping a cache slot and flushing its TLB entry. Direct entries are still handed out as
+// cache entries, so callers don't care which one they get, but they only borrow a free slot
+// for its bookkeeping and never sit on the used lists
+// Page tables always come from usable memory, so being beneath the end is good enough
+static paddr_t mmDirectEnd = 0;    // End of direct mapped memory, 0 if there's no direct map
+
+// Maps all usable physical memory at MUL_DIRECT_BASE
+void MmPtabInitDirect()
+{
+    paddr_t end = 0;
+    MmZone_t* zone = NULL;
+    for (int i = 0; (zone = MmGetZone (i)); ++i)
+    {
+        // Only map RAM, so that we never have a cacheable mapping of device memory
+        if (!(zone->flags & (MM_ZONE_ALLOCATABLE | MM_ZONE_RECLAIM)))
+            continue;
+        paddr_t addr = zone->pfn * NEXKE_CPU_PAGESZ;
+        paddr_t zoneEnd = addr + (zone->numPages * NEXKE_CPU_PAGESZ);
+        if (zoneEnd > MUL_DIRECT_MAX)
+            zoneEnd = MUL_DIRECT_MAX;
+        while (addr < zoneEnd)
+        {
+#ifdef MUL_DIRECT_HUGESZ
+            if (!(addr & (MUL_DIRECT_HUGESZ - 1)) && (addr + MUL_DIRECT_HUGESZ) <= zoneEnd)
+            {
+                MmMulMapEarly (MUL_DIRECT_BASE + addr,
+                               addr,
+                               MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW | MUL_PAGE_HUGE);
+                addr += MUL_DIRECT_HUGESZ;
+                continue;
+            }
+#endif
+            // Use large pages where the zone is big enough
+            if (!(addr & (MUL_DIRECT_LARGESZ - 1)) && (addr + MUL_DIRECT_LARGESZ) <= zoneEnd)
+            {
+                MmMulMapEarly (MUL_DIRECT_BASE + addr,
+                               addr,
+                               MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW | MUL_PAGE_LARGE);
+                addr += MUL_DIRECT_LARGESZ;
+            }
+            else
+            {
+                MmMulMapEarly (MUL_DIRECT_BASE + addr, addr, MUL_PAGE_KE | MUL_PAGE_R | MUL_PAGE_RW);
+                addr += NEXKE_CPU_PAGESZ;
+            }
+        }
+        if (zoneEnd > end)
+            end = zoneEnd;
+    }
+    NkLogDebug ("nexke: direct mapped physical memory up to %#llX at %p\n",
+                (uint64_t) end,
+                MUL_DIRECT_BASE);
+    mmDirectEnd = end;
+}
+
+// Gets direct mapped address of physical address
+void* MmPtabGetDirect (paddr_t phys)
+{
+    if (phys >= mmDirectEnd)
+        return NULL;
+    return (void*) (MUL_DIRECT_BASE + phys);
+}
+
+// Gets a direct cache entry for table
+static MmPtCacheEnt_t* mmPtabGetDirect (MmSpace_t* space, paddr_t ptab, int level)
+{
+    // Make sure there's something on the free list
+    if (!space->mulSpace.freeCount)
+        mmPtabTrim (space);
+    MmPtCacheEnt_t* ent = mmPtabGetFree (space);
+    ent->inUse = true;
+    ent->direct = true;
+    ent->ptab = ptab;
+    ent->level = level;
+    ent->addr = MUL_DIRECT_BASE + ptab;
+    return ent;
+}
+
+// Puts direct cache entry back on free list
+static void mmPtabPutDirect (MmSpace_t* space, MmPtCacheEnt_t* ent)
+{
+    // Point it back at its cache slot
+    MmPtCacheEnt_t* entries = (MmPtCacheEnt_t*) MUL_PTCACHE_ENTRY_BASE;
+    ent->addr = MUL_PTCACHE_BASE + ((ent - entries) * NEXKE_CPU_PAGESZ);
+    ent->inUse = false;
+    ent->direct = false;
+    mmPtabFreeEntry (space, ent);
+}
+#endif
+
 // Returns entry and gets new entry
 MmPtCacheEnt_t* MmPtabSwapCache (paddr_t ptab, MmPtCacheEnt_t* cacheEnt, int level)
 {
@@ -264,6 +712,10 @@ MmPtCacheEnt_t* MmPtabSwapCache (paddr_t ptab, MmPtCacheEnt_t* cacheEnt, int lev
 MmPtCacheEnt_t* MmPtabGetCache (paddr_t ptab, int level)
 {
     MmSpace_t* space = MmGetCurrentSpace();
+#ifdef MUL_DIRECT_MAP
+    if (ptab < mmDirectEnd)
+        return mmPtabGetDirect (space, ptab, level);
+#endif
     // Find entry on cache
     MmPtCacheEnt_t* ent = space->mulSpace.ptLists[level];
     while (ent)
@@ -314,45 +766,30 @@ MmPtCacheEnt_t* MmPtabGetCache (paddr_t ptab, int level)
 void MmPtabReturnCache (MmPtCacheEnt_t* cacheEnt)
 {
     MmSpace_t* space = MmGetCurrentSpace();
-    cacheEnt->inUse = false;
-    // Check if we need to free any entries
-    MmMulSpace_t* mulSpace = &space->mulSpace;
-    if (mulSpace->freeCount < MM_PTAB_MINFREE)
+#ifdef MUL_DIRECT_MAP
+    if (cacheEnt->direct)
     {
-        // Go through every list and find entries to free
-        // We go from the tail of each list as older entries are less likely to be used
-        // according to the principle of LRU
-        bool done = false;
-        for (int i = 0; i <= mmNumLevels; ++i)
-        {
-            MmPtCacheEnt_t* ent = mulSpace->ptListsEnd[i];
-            while (ent)
-            {
-                if (!ent->inUse)
-                {
-                    // Free this entry
-                    mmPtabRemoveEntry (space, ent);
-                    mmPtabFreeEntry (space, ent);
-                    // Check if we've reached target
-                    if (mulSpace->freeCount >= MM_PTAB_FREETARGET)
-                    {
-                        done = true;
-                        break;
-                    }
-                }
-                ent = ent->prev;
-            }
-            // If done, break
-            if (done)
-                break;
-        }
+        mmPtabPutDirect (space, cacheEnt);
+        return;
     }
+#endif
+    cacheEnt->inUse = false;
+    // Check if we need to free any entries
+    if (space->mulSpace.freeCount < MM_PTAB_MINFREE)
+        mmPtabTrim (space);
 }
 
 // Frees cache entry to free list
 void MmPtabFreeToCache (MmPtCacheEnt_t* cacheEnt)
 {
     MmSpace_t* space = MmGetCurrentSpace();
+#ifdef MUL_DIRECT_MAP
+    if (cacheEnt->direct)
+    {
+        mmPtabPutDirect (space, cacheEnt);
+        return;
+    }
+#endif
     cacheEnt->inUse = false;
     mmPtabRemoveEntry (space, cacheEnt);
     mmPtabFreeEntry (space, cacheEnt);
@@ -0,0 +1,435 @@
+/*
+    reclaim.c - contains memory reclaim
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/synch.h>
+#include <nexke/task.h>
+#include <stdlib.h>
+
+// Registered shrinkers
+static NkList_t mmShrinkers = {0};
+static spinlock_t mmShrinkerLock = 0;
+
+// Number of threads currently reclaiming
+// Only one reclaimer may run at a time, anyone else just gives up
+static atomic_t mmReclaimers = 0;
+
+// Page queues
+// Pages of pageable objects are aged with a two-handed clock, split into an active and an
+// inactive queue. The front hand goes over the active queue, clearing access bits and moving pages
+// that weren't touched since its last pass to the inactive queue. The back hand follows on the
+// inactive queue, and evicts pages that still haven't been touched. How far the back hand lags
+// behind is the size of the inactive queue
+static NkList_t mmActiveQueue = {0};
+static NkList_t mmInactiveQueue = {0};
+static size_t mmNumActive = 0;
+static size_t mmNumInactive = 0;
+static spinlock_t mmQueueLock = 0;
+
+// Pageout tunables
+#define MM_PAGEOUT_SCAN     64                       // Max pages a hand looks at in one pass
+#define MM_INACTIVE_RATIO   4                        // Inactive queue is kept at 1/ratio of pages
+#define MM_PAGEOUT_BACKOFF  (PLT_NS_IN_SEC / 10)     // Time to wait when nothing can be freed
+#define MM_PAGEOUT_WAIT     (PLT_NS_IN_SEC / 100)    // Time allocators wait for the daemon
+
+// Pageout daemon
+static NkThread_t* mmPageoutThread = NULL;
+static TskCondition_t mmPageoutCond;
+
+// Page merging
+// Anonymous pages that hold nothing but zeroes are merged into the shared zero page, which frees
+// them until they get written again. Only the inactive queue is scanned, as pages nobody touched
+// since the front hand went by are the ones likely to stay as they are
+// Merging is optional, and scans at most the given number of pages a second so what it costs is
+// known up front
+#define MM_MERGE_RATE     320                      // Default pages scanned a second
+#define MM_MERGE_INTERVAL (PLT_NS_IN_SEC / 10)    // Time between scans
+
+static size_t mmMergeScan = 0;      // Pages looked at each scan
+static size_t mmMergedPages = 0;    // Pages merged so far
+
+// Initializes reclaim
+void MmInitReclaim()
+{
+    NkListInit (&mmShrinkers);
+    NkListInit (&mmActiveQueue);
+    NkListInit (&mmInactiveQueue);
+}
+
+// Registers a shrinker
+void MmRegisterShrinker (MmShrinker_t* shrinker)
+{
+    NkSpinLock (&mmShrinkerLock);
+    NkListAddBack (&mmShrinkers, &shrinker->link);
+    NkSpinUnlock (&mmShrinkerLock);
+}
+
+// Unregisters a shrinker
+void MmUnregisterShrinker (MmShrinker_t* shrinker)
+{
+    NkSpinLock (&mmShrinkerLock);
+    NkListRemove (&mmShrinkers, &shrinker->link);
+    NkSpinUnlock (&mmShrinkerLock);
+}
+
+// Reclaims memory from slab caches and shrinkers
+size_t MmReclaim (size_t target)
+{
+    CPU_ASSERT_NOT_INT();
+    if (NkAtomicAdd (&mmReclaimers, 1) != 1)
+    {
+        NkAtomicSub (&mmReclaimers, 1);
+        return 0;
+    }
+    // Slab caches go first, as empty slabs are cheapest to get rid of
+    size_t freed = MmSlabReap();
+    // Now ask shrinkers for whatever is left
+    NkSpinLock (&mmShrinkerLock);
+    NkLink_t* iter = NkListFront (&mmShrinkers);
+    while (iter && freed < target)
+    {
+        MmShrinker_t* shrinker = LINK_CONTAINER (iter, MmShrinker_t, link);
+        freed += shrinker->shrink (target - freed);
+        iter = NkListIterate (&mmShrinkers, iter);
+    }
+    NkSpinUnlock (&mmShrinkerLock);
+    NkAtomicSub (&mmReclaimers, 1);
+    return freed;
+}
+
+// Reclaims memory if free memory is low
+bool MmReclaimIfLow()
+{
+    size_t lack = MmGetPageShortage();
+    if (!lack)
+        return false;
+    return MmReclaim (lack) != 0;
+}
+
+// Puts page on the page queues
+void MmQueuePage (MmPage_t* page)
+{
+    NkSpinLock (&mmQueueLock);
+    // New pages start out active, so they get a full pass before they can be evicted
+    page->flags |= MM_PAGE_ACTIVE;
+    NkListAddBack (&mmActiveQueue, &page->link);
+    ++mmNumActive;
+    NkSpinUnlock (&mmQueueLock);
+}
+
+// Takes page off the queue it's on
+// Queue lock must be held
+static void mmDequeuePageLocked (MmPage_t* page)
+{
+    if (page->flags & MM_PAGE_ACTIVE)
+    {
+        NkListRemove (&mmActiveQueue, &page->link);
+        --mmNumActive;
+    }
+    else if (page->flags & MM_PAGE_INACTIVE)
+    {
+        NkListRemove (&mmInactiveQueue, &page->link);
+        --mmNumInactive;
+    }
+    page->flags &= ~(MM_PAGE_ACTIVE | MM_PAGE_INACTIVE);
+}
+
+// Takes page off the page queues
+void MmDequeuePage (MmPage_t* page)
+{
+    if (!(page->flags & (MM_PAGE_ACTIVE | MM_PAGE_INACTIVE)))
+        return;
+    NkSpinLock (&mmQueueLock);
+    mmDequeuePageLocked (page);
+    NkSpinUnlock (&mmQueueLock);
+}
+
+// Moves page to back of queue
+// Page must be locked and off the queues
+static void mmRequeuePage (MmPage_t* page, bool active)
+{
+    NkSpinLock (&mmQueueLock);
+    if (active)
+    {
+        page->flags |= MM_PAGE_ACTIVE;
+        NkListAddBack (&mmActiveQueue, &page->link);
+        ++mmNumActive;
+    }
+    else
+    {
+        page->flags |= MM_PAGE_INACTIVE;
+        NkListAddBack (&mmInactiveQueue, &page->link);
+        ++mmNumInactive;
+    }
+    NkSpinUnlock (&mmQueueLock);
+}
+
+// Takes page at the hand of a queue and locks it
+// Pages somebody else has locked are skipped over, as we take the locks backwards
+static MmPage_t* mmTakeHand (NkList_t* queue)
+{
+    NkSpinLock (&mmQueueLock);
+    NkLink_t* iter = NkListFront (queue);
+    while (iter)
+    {
+        MmPage_t* page = LINK_CONTAINER (iter, MmPage_t, link);
+        if (MmTryLockPage (page))
+        {
+            mmDequeuePageLocked (page);
+            NkSpinUnlock (&mmQueueLock);
+            return page;
+        }
+        iter = NkListIterate (queue, iter);
+    }
+    NkSpinUnlock (&mmQueueLock);
+    return NULL;
+}
+
+// Runs the front hand over count pages
+static void mmPageoutDeactivate (size_t count)
+{
+    while (count--)
+    {
+        MmPage_t* page = mmTakeHand (&mmActiveQueue);
+        if (!page)
+            break;
+        // Fixed pages and pages used since the last pass stay active
+        bool active = page->fixCount || MmMulSetAttrPage (page, MUL_ATTR_ACCESS, false);
+        mmRequeuePage (page, active);
+        MmUnlockPage (page);
+    }
+}
+
+// Tries to evict page
+// Page must be locked and unused since the front hand passed it
+static bool mmPageoutEvict (MmPage_t* page)
+{
+    MmObject_t* obj = page->obj;
+    // Faults look pages up with the object locked, so holding it keeps them from finding a page
+    // we're about to free. We take it out of order, so just skip the page if the object is busy
+    if (!NkSpinTryLock (&obj->lock))
+        return false;
+    // Take the page out of every address space, so nobody can write to it behind our back
+    // This moves dirty bits from the mappings to the page
+    MmMulUnmapPage (page);
+    // Let the backend write it out. If it can't get it back later, the page has to stay
+    // Unmapped pages are still in the object, so touching it again just maps it back in
+    if (!MmBackendPageOut (obj, page->offset, page))
+    {
+        NkSpinUnlock (&obj->lock);
+        return false;
+    }
+    page->flags &= ~(MM_PAGE_DIRTY);
+    MmRemovePage (page);
+    MmFreePage (page);
+    NkSpinUnlock (&obj->lock);
+    return true;
+}
+
+// Checks if a page is all zeroes
+static void mmMergeCheckZero (void* data, void* arg)
+{
+    uintptr_t* words = data;
+    bool* zero = arg;
+    *zero = true;
+    for (size_t i = 0; i < (NEXKE_CPU_PAGESZ / sizeof (uintptr_t)); ++i)
+    {
+        if (words[i])
+        {
+            *zero = false;
+            return;
+        }
+    }
+}
+
+// Tries to merge page into the zero page
+// Page must be locked and unused since the front hand passed it
+static bool mmMergePage (MmPage_t* page)
+{
+    MmObject_t* obj = page->obj;
+    // Removing a page from a shadow object would uncover its parent's page
+    if (obj->backend != MM_BACKEND_ANON || obj->parent || page->fixCount)
+        return false;
+    // Look first, so pages that aren't zero don't lose their mappings
+    bool zero = false;
+    MmMulAccessPage (page, mmMergeCheckZero, &zero);
+    if (!zero || !NkSpinTryLock (&obj->lock))
+        return false;
+    // Now make sure nobody can write to it and look again
+    MmMulUnmapPage (page);
+    MmMulAccessPage (page, mmMergeCheckZero, &zero);
+    if (!zero)
+    {
+        NkSpinUnlock (&obj->lock);
+        return false;
+    }
+    // Reads will see the zero page from now on, and writes get a page of their own
+    MmRemovePage (page);
+    MmFreePage (page);
+    NkSpinUnlock (&obj->lock);
+    return true;
+}
+
+// Scans count pages of the inactive queue for ones to merge
+static void mmMergeScanPages (size_t count)
+{
+    // Each page we keep goes to the back, so we don't look at it again until the rest were
+    while (count--)
+    {
+        MmPage_t* page = mmTakeHand (&mmInactiveQueue);
+        if (!page)
+            break;
+        if (page->fixCount || MmMulSetAttrPage (page, MUL_ATTR_ACCESS, false))
+            mmRequeuePage (page, true);
+        else if (mmMergePage (page))
+            ++mmMergedPages;
+        else
+            mmRequeuePage (page, false);
+        MmUnlockPage (page);
+    }
+}
+
+// Page merging daemon
+static void mmMergeDaemon (void*)
+{
+    for (;;)
+    {
+        TskSleepThread (MM_MERGE_INTERVAL);
+        mmMergeScanPages (mmMergeScan);
+    }
+}
+
+// Runs the back hand over count pages, stopping after freeing target
+static size_t mmPageoutScan (size_t count, size_t target)
+{
+    size_t freed = 0;
+    while (count-- && freed < target)
+    {
+        MmPage_t* page = mmTakeHand (&mmInactiveQueue);
+        if (!page)
+            break;
+        // If it was used after all, give it another round
+        if (page->fixCount || MmMulSetAttrPage (page, MUL_ATTR_ACCESS, false))
+            mmRequeuePage (page, true);
+        else if (mmPageoutEvict (page))
+            ++freed;
+        else
+            mmRequeuePage (page, true);    // Backend can't take it, don't look at it again soon
+        MmUnlockPage (page);
+    }
+    return freed;
+}
+
+// Ages pages and evicts up to target of them
+static size_t mmPageout (size_t target)
+{
+    // Keep the inactive queue filled so the back hand has something to look at
+    size_t inactiveTarget = (mmNumActive + mmNumInactive) / MM_INACTIVE_RATIO;
+    if (inactiveTarget < target)
+        inactiveTarget = target;
+    if (mmNumInactive < inactiveTarget)
+    {
+        size_t lack = inactiveTarget - mmNumInactive;
+        mmPageoutDeactivate ((lack < MM_PAGEOUT_SCAN) ? lack : MM_PAGEOUT_SCAN);
+    }
+    return mmPageoutScan (MM_PAGEOUT_SCAN, target);
+}
+
+// Pageout daemon
+static void mmPageoutDaemon (void*)
+{
+    for (;;)
+    {
+        size_t lack = MmGetPageShortage();
+        if (!lack)
+        {
+            // Sleep until someone runs low
+            TskWaitCondition (&mmPageoutCond, NULL);
+            continue;
+        }
+        // Caches are cheaper to take memory from than pages that are in use
+        size_t freed = MmReclaim (lack);
+        if (freed < lack)
+            freed += mmPageout (lack - freed);
+        // Don't spin if nothing can be freed right now
+        if (!freed)
+            TskSleepThread (MM_PAGEOUT_BACKOFF);
+    }
+}
+
+// Starts the pageout daemon
+void MmInitPageout()
+{
+    TskInitCondition (&mmPageoutCond);
+    NkThread_t* thread = TskCreateThread (mmPageoutDaemon,
+                                          NULL,
+                                          "MmPageoutDaemon",
+                                          TSK_POLICY_NORMAL,
+                                          TSK_PRIO_KERNEL,
+                                          0);
+    if (!thread)
+        NkPanicOom();
+    mmPageoutThread = thread;
+    TskStartThread (thread);
+}
+
+// Starts merging pages if asked to
+void MmInitPageMerge()
+{
+    const char* mergeArg = NkReadArg ("-pagemerge");
+    if (!mergeArg)
+        return;
+    size_t rate = (*mergeArg) ? atoi (mergeArg) : MM_MERGE_RATE;
+    mmMergeScan = (rate * MM_MERGE_INTERVAL) / PLT_NS_IN_SEC;
+    if (!mmMergeScan)
+        mmMergeScan = 1;
+    NkThread_t* thread = TskCreateThread (mmMergeDaemon,
+                                          NULL,
+                                          "MmMergeDaemon",
+                                          TSK_POLICY_NORMAL,
+                                          TSK_PRIO_WORKER,
+                                          0);
+    if (!thread)
+        NkPanicOom();
+    TskStartThread (thread);
+}
+
+// Gets number of pages merged into the zero page
+size_t MmGetMergedPages()
+{
+    return mmMergedPages;
+}
+
+// Wakes the pageout daemon
+void MmWakePageout()
+{
+    if (mmPageoutThread)
+        TskSignalCondition (&mmPageoutCond);
+}
+
+// Waits a little for the pageout daemon to free memory
+bool MmWaitPageout()
+{
+    // The daemon can't wait on itself
+    if (!mmPageoutThread || TskGetCurrentThread() == mmPageoutThread)
+        return false;
+    MmWakePageout();
+    TskSleepThread (MM_PAGEOUT_WAIT);
+    return true;
+}
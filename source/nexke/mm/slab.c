@@ -27,8 +27,8 @@ static SlabCache_t caches = {0};
 // Cache of external slabs
 static SlabCache_t extSlabCache = {0};
 
-// Cache of external buffers
-static SlabCache_t extBufCache = {0};
+// Cache of magazines
+static SlabCache_t magCache = {0};
 
 // List of caches
 static NkList_t cacheList = {0};
@@ -36,23 +36,45 @@ static NkList_t cacheList = {0};
 // Minimum object size
 static size_t minObjSz = 0;
 
-// Hash table of external buffers
-#define SLAB_EXT_HASH_SZ 64
-static NkList_t extBufHash[SLAB_EXT_HASH_SZ] = {0};
-static spinlock_t bufHashLock = 0;
+// Lock on cache list
+static spinlock_t cacheListLock = 0;
+
+// Lock on merging caches, and on shared caches' alias counts. Taken before the cache list lock
+static spinlock_t mergeLock = 0;
 
 // Alignment value
 #define SLAB_ALIGN 8
 
-// Min for ext slabs
-#define SLAB_EXT_MIN 1024
-
 // Min number of objects to fit in a slab
 #define SLAB_OBJ_MIN 6
 
-// Max number of empty slabs
-// TODO: this should be based on object size
-#define SLAB_EMPTY_MAX 3
+// Max number of objects in an external slab
+// Slabs only go external when SLAB_OBJ_MIN objects take more than a page, so an external slab
+// has less than one page's worth of objects beyond SLAB_OBJ_MIN, which is less than SLAB_OBJ_MIN
+#define SLAB_EXT_OBJ_MAX (SLAB_OBJ_MIN * 2)
+
+// Empty slab retention
+// Caches start out keeping SLAB_EMPTY_INIT empty slabs. Each time a cache has to grow after
+// freeing slabs for being over its limit, the limit goes up, until SLAB_EMPTY_MAX.
+// Reaping lowers it back to the number of times empty slabs were actually reused
+#define SLAB_EMPTY_INIT 2
+#define SLAB_EMPTY_MAX  16
+
+// Number of slabs looked at when searching for one in the allocating node
+#define SLAB_NODE_SCAN 4
+
+// Number of objects in one magazine
+#define SLAB_MAG_SZ 15
+
+// Magazine structure
+// A magazine is a small stack of objects owned by a CPU, so that the common
+// case of allocating and freeing doesn't need to touch the cache lock
+typedef struct _slabmag
+{
+    int rounds;                 // Number of objects currently in magazine
+    void* objs[SLAB_MAG_SZ];    // Object stack
+    NkLink_t link;              // Link in depot
+} SlabMagazine_t;
 
 // Slab buffer
 typedef struct _slabbuf
@@ -69,12 +91,32 @@ typedef struct _slab
     SlabCache_t* cache;
     uintptr_t base;    // Base address
     size_t numAvail;
+    int node;    // NUMA node slab was allocated in
     // Buffering info
     NkList_t freeList;    // Pointer to first free object
     NkLink_t link;
-    NkLink_t hashLink;
 } Slab_t;
 
+// External slab structure
+// Objects of external slabs don't have room for their buffers, so they are kept here, one for
+// each object, and found by the object's index in the slab
+typedef struct _slabext
+{
+    Slab_t slab;
+    SlabBuf_t bufs[SLAB_EXT_OBJ_MAX];
+} SlabExt_t;
+
+// Locks a cache, keeping track of how long we spun on it
+static FORCEINLINE void slabLockCache (SlabCache_t* cache)
+{
+    TskDisablePreempt();
+#ifndef NEXKE_UP
+    unsigned long spins = NkMcsAcquire (&cache->lock);
+    NK_LOCK_STAT_ACQUIRE (&cache->lock, NK_LOCK_SITE(), spins);
+    cache->stats.lockSpins += spins;
+#endif
+}
+
 // Aligns a size
 static FORCEINLINE size_t slabAlignSz (size_t sz, size_t align)
 {
@@ -90,59 +132,18 @@ static FORCEINLINE uintptr_t slabAlignDown (uintptr_t ptr, size_t align)
     return ptr & ~(align - 1);
 }
 
-// Gets a buffer from the hash table
-static FORCEINLINE SlabBuf_t* slabGetHashedBuf (void* base)
-{
-    // Get has table index
-    // All bases are 8-byte aligned (generally) removes those bits for uniqueness
-    size_t hashIdx = ((uintptr_t) base >> 3) % SLAB_EXT_HASH_SZ;
-    NkSpinLock (&bufHashLock);
-    NkLink_t* iter = NkListFront (&extBufHash[hashIdx]);
-    SlabBuf_t* buf = NULL;
-    while (iter)
-    {
-        buf = LINK_CONTAINER (iter, SlabBuf_t, link);
-        if (buf->obj == base)
-            break;
-        iter = NkListIterate (&extBufHash[hashIdx], iter);
-    }
-    NkSpinUnlock (&bufHashLock);
-    return NULL;
-}
-
-// Adds a slab to the hash table
-static FORCEINLINE void slabHashBuf (SlabBuf_t* buf)
-{
-    size_t hashIdx = ((uintptr_t) buf->obj >> 3) % SLAB_EXT_HASH_SZ;
-    NkSpinLock (&bufHashLock);
-    NkListAddFront (&extBufHash[hashIdx], &buf->link);
-    NkSpinUnlock (&bufHashLock);
-}
-
-// Removes a slab from the hash table
-static FORCEINLINE void slabRemoveBuf (SlabBuf_t* buf)
-{
-    size_t hashIdx = ((uintptr_t) buf->obj >> 3) % SLAB_EXT_HASH_SZ;
-    NkSpinLock (&bufHashLock);
-    NkListRemove (&extBufHash[hashIdx], &buf->link);
-    NkSpinUnlock (&bufHashLock);
-}
-
 // Converts object to slab
 // This takes advantage of the fact that an object is always inside a slab,
 // and a slab is always page aligned, so if we page align down, then we
 // end up with the slab structure
-// For external slabs we reference the hash table
+// External slabs are found through the owner of the KV region the object is in
 static FORCEINLINE Slab_t* slabGetObjSlab (SlabCache_t* cache, void* obj)
 {
     Slab_t* slab = NULL;
     if (cache->flags & SLAB_CACHE_EXT_SLAB)
     {
-        // Convert object into buffer
-        SlabBuf_t* buf = slabGetHashedBuf (obj);
-        assert (buf);
-        assert (buf->obj == obj);
-        slab = buf->slab;
+        slab = MmGetKvOwner (obj);
+        assert (slab && slab->cache == cache);
     }
     else
     {
@@ -167,18 +168,22 @@ static Slab_t* slabAllocSlab (SlabCache_t* cache)
     // Find slab structure. For internal caches, this is at the end of the slab.
     // Otherwise we have to allocate it
     Slab_t* slab = NULL;
+    SlabExt_t* ext = NULL;
     if (cache->flags & SLAB_CACHE_EXT_SLAB)
     {
         // Get control structure from cache
-        slab = MmCacheAlloc (&extSlabCache);
-        if (!slab)
+        ext = MmCacheAlloc (&extSlabCache);
+        if (!ext)
         {
             MmFreeKvRegion (ptr);
             return NULL;
         }
+        slab = &ext->slab;
     }
     else
         slab = (Slab_t*) (ptr + (cache->slabSz << NEXKE_CPU_PAGE_SHIFT) - sizeof (Slab_t));
+    // Let objects find their slab, and pointers find their cache
+    MmSetKvOwner (ptr, slab);
     // Color the slab
     ptr += cache->curColor;
     // Adjust the color
@@ -190,15 +195,19 @@ static Slab_t* slabAllocSlab (SlabCache_t* cache)
     slab->numAvail = cache->maxObj;
     slab->base = (uintptr_t) ptr;
     slab->cache = cache;
+    slab->node = MmGetAllocNode();
     // Set up list of free objects
     for (int i = 0; i < slab->numAvail; ++i)
     {
         SlabBuf_t* cur = NULL;
         void* curObj = ptr + (cache->objSz * i);
         if (cache->flags & SLAB_CACHE_EXT_SLAB)
-            cur = MmCacheAlloc (&extBufCache);
+            cur = &ext->bufs[i];
         else
-            cur = curObj;    // Buffers are stored with objects
+            cur = curObj + cache->bufOff;    // Buffers are stored with objects
+        // Construct the object
+        if (cache->ctor)
+            cache->ctor (curObj);
         cur->obj = curObj;
         cur->slab = slab;
         cur->link.next = NULL, cur->link.prev = NULL;
@@ -207,6 +216,8 @@ static Slab_t* slabAllocSlab (SlabCache_t* cache)
     // Add to list
     NkListAddFront (&cache->partialSlabs, &slab->link);
     ++cache->numPartial;
+    ++cache->stats.slabGrows;
+    NK_TRACE (NK_TRACE_SLAB_GROW, cache, cache->objSz);
     return slab;
 }
 
@@ -217,8 +228,22 @@ static void slabFreeSlab (SlabCache_t* cache, Slab_t* slab)
     assert (slab->numAvail == cache->maxObj);
     NkListRemove (&cache->emptySlabs, &slab->link);
     --cache->numEmpty;
+    ++cache->stats.slabFrees;
+    // Destroy objects
+    if (cache->dtor)
+    {
+        NkLink_t* iter = NkListFront (&slab->freeList);
+        while (iter)
+        {
+            SlabBuf_t* buf = LINK_CONTAINER (iter, SlabBuf_t, link);
+            iter = NkListIterate (&slab->freeList, iter);
+            cache->dtor (buf->obj);
+        }
+    }
     // Free frame
     MmFreeKvRegion ((void*) slab->base);
+    if (cache->flags & SLAB_CACHE_EXT_SLAB)
+        MmCacheFree (&extSlabCache, slab);
 }
 
 // Allocates object in specified slab
@@ -229,26 +254,19 @@ static FORCEINLINE void* slabAllocInSlab (SlabCache_t* cache, Slab_t* slab)
     NkLink_t* link = NkListFront (&slab->freeList);
     NkListRemove (&slab->freeList, link);
     SlabBuf_t* buf = LINK_CONTAINER (link, SlabBuf_t, link);
-    void* obj = buf->obj;
     --slab->numAvail;
-    // Determine if we need to hash it
-    if (cache->flags & SLAB_CACHE_EXT_SLAB)
-        slabHashBuf (buf);
-    return obj;
+    return buf->obj;
 }
 
 // Frees object to slab
 static FORCEINLINE void slabFreeToSlab (SlabCache_t* cache, Slab_t* slab, void* obj)
 {
-    // Create new buffer
+    // Find object's buffer
     SlabBuf_t* buf = NULL;
     if (cache->flags & SLAB_CACHE_EXT_SLAB)
-    {
-        buf = slabGetHashedBuf (obj);
-        slabRemoveBuf (buf);
-    }
+        buf = &((SlabExt_t*) slab)->bufs[((uintptr_t) obj - slab->base) / cache->objSz];
     else
-        buf = (SlabBuf_t*) obj;
+        buf = (SlabBuf_t*) (obj + cache->bufOff);
     buf->obj = obj;
     buf->slab = slab;
     NkListAddFront (&slab->freeList, &buf->link);
@@ -259,15 +277,21 @@ static FORCEINLINE void slabFreeToSlab (SlabCache_t* cache, Slab_t* slab, void*
 static FORCEINLINE void slabCacheCreate (SlabCache_t* cache,
                                          size_t objSz,
                                          const char* name,
+                                         int tag,
                                          size_t align,
-                                         int flags)
+                                         int flags,
+                                         SlabObjCtor ctor,
+                                         SlabObjDtor dtor)
 {
     cache->name = name;
+    cache->tag = tag;
+    cache->ctor = ctor;
+    cache->dtor = dtor;
     cache->align = (align) ? align : SLAB_ALIGN;
     size_t sz = (objSz < minObjSz) ? minObjSz : objSz;
     cache->objSz = slabAlignSz (sz, cache->align);
     // Unset private flags
-    flags &= ~(SLAB_CACHE_EXT_SLAB);
+    flags &= ~(SLAB_CACHE_EXT_SLAB | SLAB_CACHE_SHARED);
     cache->flags = flags;
     // Determine size of one slab in pages
     cache->slabSz = CpuPageAlignUp (objSz * SLAB_OBJ_MIN) >> NEXKE_CPU_PAGE_SHIFT;
@@ -275,16 +299,31 @@ static FORCEINLINE void slabCacheCreate (SlabCache_t* cache,
     // For one page slabs, internal, anything more, external
     if (cache->slabSz > 1)
         cache->flags |= SLAB_CACHE_EXT_SLAB;
+    // Constructed objects must keep their state while free, so internal slabs
+    // keep the free list buffer after the object instead of inside of it
+    cache->bufOff = 0;
+    if (ctor && !(cache->flags & SLAB_CACHE_EXT_SLAB))
+    {
+        cache->bufOff = cache->objSz;
+        cache->objSz = slabAlignSz (cache->objSz + sizeof (SlabBuf_t), cache->align);
+    }
     // Set up lists
     NkListInit (&cache->partialSlabs);
     NkListInit (&cache->fullSlabs);
     NkListInit (&cache->emptySlabs);
+    NkListInit (&cache->fullMags);
+    NkListInit (&cache->emptyMags);
+    cache->numFullMags = 0, cache->numEmptyMags = 0;
     // Initialize stats
     cache->numEmpty = 0, cache->numFull = 0, cache->numPartial = 0;
     cache->numObjs = 0;
+    cache->emptyMax = SLAB_EMPTY_INIT, cache->emptyReused = 0, cache->numTrimmed = 0;
     // Determine max number of objects
     if (cache->flags & SLAB_CACHE_EXT_SLAB)
+    {
         cache->maxObj = (cache->slabSz << NEXKE_CPU_PAGE_SHIFT) / cache->objSz;
+        assert (cache->maxObj <= SLAB_EXT_OBJ_MAX);
+    }
     else
         cache->maxObj = ((cache->slabSz << NEXKE_CPU_PAGE_SHIFT) - sizeof (Slab_t)) / cache->objSz;
     // Figure out coloring info
@@ -296,31 +335,69 @@ static FORCEINLINE void slabCacheCreate (SlabCache_t* cache,
     cache->curColor = 0;
     cache->colorAdj = cache->align;
     cache->numColors = slabAlignDown (waste, cache->align);
-    // Add to list
-    NkListAddBack (&cacheList, &cache->link);
+    // Add to list. The list is walked under RCU, so this has to be last
+    NkSpinLock (&cacheListLock);
+    NkRcuListAddBack (&cacheList, &cache->link);
+    NkSpinUnlock (&cacheListLock);
 }
 
-// Allocates an object from a cache
-void* MmCacheAlloc (SlabCache_t* cache)
+// Finds slab to allocate from in list, preferring one in node
+// Only the first few slabs are looked at, if none are in node the first one is used
+static FORCEINLINE Slab_t* slabFindNodeSlab (NkList_t* list, int node)
+{
+    NkLink_t* iter = NkListFront (list);
+    if (!iter)
+        return NULL;
+    Slab_t* first = LINK_CONTAINER (iter, Slab_t, link);
+    for (int i = 0; iter && i < SLAB_NODE_SCAN; ++i)
+    {
+        Slab_t* slab = LINK_CONTAINER (iter, Slab_t, link);
+        if (slab->node == node)
+            return slab;
+        iter = NkListIterate (list, iter);
+    }
+    return first;
+}
+
+// Grows a cache by a slab, which is put on the partial list
+// Cache lock must be held
+static Slab_t* slabCacheGrow (SlabCache_t* cache)
+{
+    Slab_t* newSlab = slabAllocSlab (cache);
+    if (!newSlab)
+        return NULL;    // OOM
+    // If we trimmed slabs before having to grow, we are keeping too few around
+    if (cache->numTrimmed)
+    {
+        if (cache->emptyMax < SLAB_EMPTY_MAX)
+            ++cache->emptyMax;
+        cache->numTrimmed = 0;
+    }
+    return newSlab;
+}
+
+// Allocates an object from the slab lists
+// Cache lock must be held
+static void* slabCacheAllocLocked (SlabCache_t* cache)
 {
-    CPU_ASSERT_NOT_INT();
-    NkSpinLock (&cache->lock);
     // Attempt to grab object from empty list
     void* ret = NULL;
+    int node = MmGetAllocNode();
     if (NkListFront (&cache->emptySlabs))
     {
-        Slab_t* emptySlab = LINK_CONTAINER (NkListFront (&cache->emptySlabs), Slab_t, link);
+        Slab_t* emptySlab = slabFindNodeSlab (&cache->emptySlabs, node);
         ret = slabAllocInSlab (cache, emptySlab);
         // Slab is no longer empty, move to partial list
         NkListRemove (&cache->emptySlabs, &emptySlab->link);
         --cache->numEmpty;
+        ++cache->emptyReused;
         NkListAddFront (&cache->partialSlabs, &emptySlab->link);
         ++cache->numPartial;
     }
     // Now try partial slab
     else if (NkListFront (&cache->partialSlabs))
     {
-        Slab_t* slab = LINK_CONTAINER (NkListFront (&cache->partialSlabs), Slab_t, link);
+        Slab_t* slab = slabFindNodeSlab (&cache->partialSlabs, node);
         ret = slabAllocInSlab (cache, slab);
         // If slab is full, move to full list
         if (slab->numAvail == 0)
@@ -334,7 +411,7 @@ void* MmCacheAlloc (SlabCache_t* cache)
     else
     {
         // No memory is available in cache, get more
-        Slab_t* newSlab = slabAllocSlab (cache);
+        Slab_t* newSlab = slabCacheGrow (cache);
         if (!newSlab)
             return NULL;    // OOM
         // Slab is already in partial state and ready to go, allocate an obejct
@@ -342,15 +419,59 @@ void* MmCacheAlloc (SlabCache_t* cache)
     }
     // Update stats
     ++cache->numObjs;
-    NkSpinUnlock (&cache->lock);
+    if (cache->numObjs > cache->stats.peakObjs)
+        cache->stats.peakObjs = cache->numObjs;
     return ret;    // We are done!
 }
 
-// Frees an object back to slab cache
-void MmCacheFree (SlabCache_t* cache, void* obj)
+// Allocates up to count objects from the slab lists
+// Each slab is taken off its list once and drained as far as needed, so objects come out next to
+// each other in memory. Partial slabs are filled before empty ones are broken into
+// Cache lock must be held
+static int slabCacheAllocBulkLocked (SlabCache_t* cache, int count, void** objs)
+{
+    int node = MmGetAllocNode();
+    int num = 0;
+    while (num < count)
+    {
+        Slab_t* slab = slabFindNodeSlab (&cache->partialSlabs, node);
+        if (!slab)
+        {
+            slab = slabFindNodeSlab (&cache->emptySlabs, node);
+            if (slab)
+            {
+                // Move it to the partial list, so there is only one list to take it from
+                NkListRemove (&cache->emptySlabs, &slab->link);
+                --cache->numEmpty;
+                ++cache->emptyReused;
+                NkListAddFront (&cache->partialSlabs, &slab->link);
+                ++cache->numPartial;
+            }
+            else if (!(slab = slabCacheGrow (cache)))
+                break;    // OOM
+        }
+        while (num < count && slab->numAvail)
+            objs[num++] = slabAllocInSlab (cache, slab);
+        // If slab is full, move to full list
+        if (!slab->numAvail)
+        {
+            NkListRemove (&cache->partialSlabs, &slab->link);
+            --cache->numPartial;
+            NkListAddFront (&cache->fullSlabs, &slab->link);
+            ++cache->numFull;
+        }
+    }
+    // Update stats
+    cache->numObjs += num;
+    if (cache->numObjs > cache->stats.peakObjs)
+        cache->stats.peakObjs = cache->numObjs;
+    return num;
+}
+
+// Frees an object back to the slab lists
+// Cache lock must be held
+static void slabCacheFreeLocked (SlabCache_t* cache, void* obj)
 {
-    CPU_ASSERT_NOT_INT();
-    NkSpinLock (&cache->lock);
     // Put object back in parent slab
     Slab_t* slab = slabGetObjSlab (cache, obj);
     slabFreeToSlab (cache, slab, obj);
@@ -363,6 +484,7 @@ void MmCacheFree (SlabCache_t* cache, void* obj)
         // Which could ultimatly cause thrashing if we continually allocate and free
         // the same object
         NkListAddBack (&cache->partialSlabs, &slab->link);
+        ++cache->numPartial;
     }
     // Check if slab is now empty
     else if (slab->numAvail == cache->maxObj)
@@ -371,15 +493,404 @@ void MmCacheFree (SlabCache_t* cache, void* obj)
         --cache->numPartial;
         NkListAddFront (&cache->emptySlabs, &slab->link);
         ++cache->numEmpty;
-        if (cache->numEmpty >= SLAB_EMPTY_MAX)
+        if (cache->numEmpty > cache->emptyMax && !(cache->flags & SLAB_CACHE_TYPESAFE))
+        {
             slabFreeSlab (cache, slab);    // Free this slab
+            ++cache->numTrimmed;
+        }
     }
     --cache->numObjs;
-    NkSpinUnlock (&cache->lock);
 }
 
-// Creates a slab cache
-SlabCache_t* MmCacheCreate (size_t objSz, const char* name, size_t align, int flags)
+// Gets this CPU's magazines in a cache
+// Preemption must be disabled
+static FORCEINLINE SlabCpuCache_t* slabGetCpuCache (SlabCache_t* cache)
+{
+    return &cache->cpuCaches[CpuGetCcb()->cpuNum];
+}
+
+// Gets the cache that holds the slabs of a cache
+static FORCEINLINE SlabCache_t* slabGetRealCache (SlabCache_t* cache)
+{
+    return (cache->merged) ? cache->merged : cache;
+}
+
+// Counts allocations and frees made through an alias
+static FORCEINLINE void slabCountAlias (SlabCache_t* cache, int allocs, int frees)
+{
+    TskDisablePreempt();
+    SlabCpuCache_t* cpu = slabGetCpuCache (cache);
+    cpu->magAllocs += allocs;
+    cpu->magFrees += frees;
+    TskEnablePreempt();
+}
+
+// Swaps the loaded and previous magazines
+static FORCEINLINE void slabMagSwap (SlabCpuCache_t* cpu)
+{
+    SlabMagazine_t* tmp = cpu->loaded;
+    cpu->loaded = cpu->prev;
+    cpu->prev = tmp;
+}
+
+// Attempts to allocate an object from the magazine layer
+// Preemption must be disabled
+static FORCEINLINE void* slabMagAlloc (SlabCache_t* cache, SlabCpuCache_t* cpu)
+{
+    // Fast path: pop from the loaded magazine
+    if (cpu->loaded && cpu->loaded->rounds)
+    {
+        ++cpu->magAllocs;
+        return cpu->loaded->objs[--cpu->loaded->rounds];
+    }
+    // Try previous magazine
+    if (cpu->prev && cpu->prev->rounds)
+    {
+        slabMagSwap (cpu);
+        ++cpu->magAllocs;
+        return cpu->loaded->objs[--cpu->loaded->rounds];
+    }
+    // Both are empty, exchange with a full one from the depot
+    slabLockCache (cache);
+    NkLink_t* link = NkListFront (&cache->fullMags);
+    if (!link)
+    {
+        NkMcsUnlock (&cache->lock);
+        return NULL;    // Go to slab layer
+    }
+    NkListRemove (&cache->fullMags, link);
+    --cache->numFullMags;
+    // Return empty previous magazine to the depot
+    if (cpu->prev)
+    {
+        NkListAddFront (&cache->emptyMags, &cpu->prev->link);
+        ++cache->numEmptyMags;
+    }
+    NkMcsUnlock (&cache->lock);
+    cpu->prev = cpu->loaded;
+    cpu->loaded = LINK_CONTAINER (link, SlabMagazine_t, link);
+    ++cpu->magAllocs;
+    return cpu->loaded->objs[--cpu->loaded->rounds];
+}
+
+// Attempts to free an object to the magazine layer
+// Preemption must be disabled
+static FORCEINLINE bool slabMagFree (SlabCache_t* cache, SlabCpuCache_t* cpu, void* obj)
+{
+    // Fast path: push on the loaded magazine
+    if (cpu->loaded && cpu->loaded->rounds < SLAB_MAG_SZ)
+    {
+        ++cpu->magFrees;
+        cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+        return true;
+    }
+    // Try previous magazine
+    if (cpu->prev && cpu->prev->rounds < SLAB_MAG_SZ)
+    {
+        slabMagSwap (cpu);
+        ++cpu->magFrees;
+        cpu->loaded->objs[cpu->loaded->rounds++] = obj;
+        return true;
+    }
+    // Both are full, exchange with an empty one from the depot
+    slabLockCache (cache);
+    SlabMagazine_t* mag = NULL;
+    NkLink_t* link = NkListFront (&cache->emptyMags);
+    if (link)
+    {
+        NkListRemove (&cache->emptyMags, link);
+        --cache->numEmptyMags;
+        mag = LINK_CONTAINER (link, SlabMagazine_t, link);
+    }
+    NkMcsUnlock (&cache->lock);
+    if (!mag)
+    {
+        // Allocate a new one
+        mag = MmCacheAlloc (&magCache);
+        if (!mag)
+            return false;    // Go to slab layer
+        mag->rounds = 0;
+    }
+    // Return full previous magazine to the depot
+    if (cpu->prev)
+    {
+        slabLockCache (cache);
+        NkListAddFront (&cache->fullMags, &cpu->prev->link);
+        ++cache->numFullMags;
+        NkMcsUnlock (&cache->lock);
+    }
+    cpu->prev = cpu->loaded;
+    cpu->loaded = mag;
+    ++cpu->magFrees;
+    mag->objs[mag->rounds++] = obj;
+    return true;
+}
+
+// Takes up to count objects from this CPU's loaded and previous magazines
+// The depot isn't touched, whatever is left comes from the slab layer
+// Preemption must be disabled
+static FORCEINLINE int slabMagAllocBulk (SlabCpuCache_t* cpu, int count, void** objs)
+{
+    int num = 0;
+    SlabMagazine_t* mags[] = {cpu->loaded, cpu->prev};
+    for (int i = 0; i < 2; ++i)
+    {
+        while (mags[i] && mags[i]->rounds && num < count)
+            objs[num++] = mags[i]->objs[--mags[i]->rounds];
+    }
+    cpu->magAllocs += num;
+    return num;
+}
+
+// Puts up to count objects in this CPU's loaded and previous magazines
+// Preemption must be disabled
+static FORCEINLINE int slabMagFreeBulk (SlabCpuCache_t* cpu, int count, void** objs)
+{
+    int num = 0;
+    SlabMagazine_t* mags[] = {cpu->loaded, cpu->prev};
+    for (int i = 0; i < 2; ++i)
+    {
+        while (mags[i] && mags[i]->rounds < SLAB_MAG_SZ && num < count)
+            mags[i]->objs[mags[i]->rounds++] = objs[num++];
+    }
+    cpu->magFrees += num;
+    return num;
+}
+
+// Returns a magazine's objects to the slab lists and frees it
+// Cache lock must be held
+static void slabMagDestroy (SlabCache_t* cache, SlabMagazine_t* mag)
+{
+    for (int i = 0; i < mag->rounds; ++i)
+        slabCacheFreeLocked (cache, mag->objs[i]);
+    MmCacheFree (&magCache, mag);
+}
+
+// Flushes magazines in the depot of a cache back to the slab layer
+// Cache lock must be held
+static void slabCacheFlushDepot (SlabCache_t* cache)
+{
+    NkLink_t* iter = NkListFront (&cache->fullMags);
+    while (iter)
+    {
+        NkListRemove (&cache->fullMags, iter);
+        slabMagDestroy (cache, LINK_CONTAINER (iter, SlabMagazine_t, link));
+        iter = NkListFront (&cache->fullMags);
+    }
+    iter = NkListFront (&cache->emptyMags);
+    while (iter)
+    {
+        NkListRemove (&cache->emptyMags, iter);
+        slabMagDestroy (cache, LINK_CONTAINER (iter, SlabMagazine_t, link));
+        iter = NkListFront (&cache->emptyMags);
+    }
+    cache->numFullMags = 0, cache->numEmptyMags = 0;
+}
+
+// Flushes all magazines of cache back to the slab layer
+// Cache lock must be held
+static void slabCacheFlushMags (SlabCache_t* cache)
+{
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+    {
+        SlabCpuCache_t* cpu = &cache->cpuCaches[i];
+        if (cpu->loaded)
+            slabMagDestroy (cache, cpu->loaded);
+        if (cpu->prev)
+            slabMagDestroy (cache, cpu->prev);
+        cpu->loaded = NULL, cpu->prev = NULL;
+    }
+    slabCacheFlushDepot (cache);
+}
+
+// Allocates an object from a cache
+void* MmCacheAlloc (SlabCache_t* cache)
+{
+    CPU_ASSERT_NOT_INT();
+    // Aliases allocate from their shared cache, but charge their own tag
+    SlabCache_t* owner = cache;
+    cache = slabGetRealCache (cache);
+    void* ret = NULL;
+    // Try the magazine layer first
+    if (!(cache->flags & SLAB_CACHE_NO_MAG))
+    {
+        TskDisablePreempt();
+        ret = slabMagAlloc (cache, slabGetCpuCache (cache));
+        TskEnablePreempt();
+    }
+    if (!ret)
+    {
+        slabLockCache (cache);
+        ret = slabCacheAllocLocked (cache);
+        if (ret)
+            ++cache->stats.allocs;
+        NkMcsUnlock (&cache->lock);
+    }
+    if (ret)
+    {
+        if (owner != cache)
+            slabCountAlias (owner, 1, 0);
+        MmTagCharge (owner->tag, ret, cache->objSz, (uintptr_t) __builtin_return_address (0));
+    }
+    return ret;
+}
+
+// Frees an object back to slab cache
+void MmCacheFree (SlabCache_t* cache, void* obj)
+{
+    CPU_ASSERT_NOT_INT();
+    MmTagUncharge (cache->tag, obj, cache->objSz);
+    if (cache->merged)
+    {
+        slabCountAlias (cache, 0, 1);
+        cache = cache->merged;
+    }
+    // Try the magazine layer first
+    if (!(cache->flags & SLAB_CACHE_NO_MAG))
+    {
+        TskDisablePreempt();
+        bool res = slabMagFree (cache, slabGetCpuCache (cache), obj);
+        TskEnablePreempt();
+        if (res)
+            return;
+    }
+    slabLockCache (cache);
+    slabCacheFreeLocked (cache, obj);
+    ++cache->stats.frees;
+    NkMcsUnlock (&cache->lock);
+}
+
+// Allocates count objects from a cache
+int MmCacheAllocBulk (SlabCache_t* cache, int count, void** objs)
+{
+    CPU_ASSERT_NOT_INT();
+    SlabCache_t* owner = cache;
+    cache = slabGetRealCache (cache);
+    int num = 0;
+    // Take what this CPU's magazines have, then carve the rest from slabs under one lock
+    if (!(cache->flags & SLAB_CACHE_NO_MAG))
+    {
+        TskDisablePreempt();
+        num = slabMagAllocBulk (slabGetCpuCache (cache), count, objs);
+        TskEnablePreempt();
+    }
+    if (num < count)
+    {
+        slabLockCache (cache);
+        int slabNum = slabCacheAllocBulkLocked (cache, count - num, objs + num);
+        cache->stats.allocs += slabNum;
+        NkMcsUnlock (&cache->lock);
+        num += slabNum;
+    }
+    if (owner != cache)
+        slabCountAlias (owner, num, 0);
+    uintptr_t site = (uintptr_t) __builtin_return_address (0);
+    for (int i = 0; i < num; ++i)
+        MmTagCharge (owner->tag, objs[i], cache->objSz, site);
+    return num;
+}
+
+// Frees count objects back to a cache
+void MmCacheFreeBulk (SlabCache_t* cache, int count, void** objs)
+{
+    CPU_ASSERT_NOT_INT();
+    for (int i = 0; i < count; ++i)
+        MmTagUncharge (cache->tag, objs[i], cache->objSz);
+    if (cache->merged)
+    {
+        slabCountAlias (cache, 0, count);
+        cache = cache->merged;
+    }
+    int num = 0;
+    if (!(cache->flags & SLAB_CACHE_NO_MAG))
+    {
+        TskDisablePreempt();
+        num = slabMagFreeBulk (slabGetCpuCache (cache), count, objs);
+        TskEnablePreempt();
+    }
+    if (num == count)
+        return;
+    slabLockCache (cache);
+    for (int i = num; i < count; ++i)
+        slabCacheFreeLocked (cache, objs[i]);
+    cache->stats.frees += count - num;
+    NkMcsUnlock (&cache->lock);
+}
+
+// Finds a shared cache to merge a cache with
+// Merge lock must be held
+static SlabCache_t* slabFindShared (size_t objSz, size_t align, int flags)
+{
+    SlabCache_t* found = NULL;
+    NkSpinLock (&cacheListLock);
+    NkLink_t* iter = NkRcuListFront (&cacheList);
+    while (iter)
+    {
+        SlabCache_t* cur = LINK_CONTAINER (iter, SlabCache_t, link);
+        if (cur->flags & SLAB_CACHE_SHARED && cur->objSz == objSz && cur->align == align &&
+            (cur->flags & ~(SLAB_CACHE_EXT_SLAB | SLAB_CACHE_SHARED)) == flags)
+        {
+            found = cur;
+            break;
+        }
+        iter = NkRcuListIterate (&cacheList, iter);
+    }
+    NkSpinUnlock (&cacheListLock);
+    return found;
+}
+
+// Makes a cache an alias of the shared cache with its geometry, creating the shared cache if
+// there isn't one yet
+static bool slabCacheMerge (SlabCache_t* cache,
+                            size_t objSz,
+                            const char* name,
+                            int tag,
+                            size_t align,
+                            int flags)
+{
+    // Work out the geometry the cache would have on its own
+    align = (align) ? align : SLAB_ALIGN;
+    objSz = slabAlignSz ((objSz < minObjSz) ? minObjSz : objSz, align);
+    flags &= ~(SLAB_CACHE_EXT_SLAB | SLAB_CACHE_SHARED);
+    // Allocate a shared cache up front, as we can't allocate with the merge lock held
+    SlabCache_t* newShared = MmCacheAlloc (&caches);
+    if (!newShared)
+        return false;
+    memset (newShared, 0, sizeof (SlabCache_t));
+    NkSpinLock (&mergeLock);
+    SlabCache_t* shared = slabFindShared (objSz, align, flags);
+    if (!shared)
+    {
+        shared = newShared;
+        newShared = NULL;
+        slabCacheCreate (shared, objSz, "shared cache", MM_TAG_NONE, align, flags, NULL, NULL);
+        shared->flags |= SLAB_CACHE_SHARED;
+    }
+    ++shared->numAliases;
+    // Set up the alias. It's on the cache list so it can be dumped, but only has statistics
+    cache->name = name;
+    cache->tag = tag;
+    cache->objSz = shared->objSz;
+    cache->align = shared->align;
+    cache->flags = flags;
+    cache->merged = shared;
+    NkSpinLock (&cacheListLock);
+    NkRcuListAddBack (&cacheList, &cache->link);
+    NkSpinUnlock (&cacheListLock);
+    NkSpinUnlock (&mergeLock);
+    if (newShared)
+        MmCacheFree (&caches, newShared);
+    return true;
+}
+
+// Creates a slab cache with an object constructor and destructor
+SlabCache_t* MmCacheCreateCtor (size_t objSz,
+                                const char* name,
+                                int tag,
+                                size_t align,
+                                int flags,
+                                SlabObjCtor ctor,
+                                SlabObjDtor dtor)
 {
     CPU_ASSERT_NOT_INT();
     // Allocate cache from cache of caches
@@ -387,15 +898,67 @@ SlabCache_t* MmCacheCreate (size_t objSz, const char* name, size_t align, int fl
     if (!newCache)
         return NULL;
     memset (newCache, 0, sizeof (SlabCache_t));
-    slabCacheCreate (newCache, objSz, name, align, flags);
+    // Constructed objects have state only their own cache knows about, and type safe objects
+    // have to stay the same type, so those caches get slabs of their own
+    if (ctor || dtor || flags & (SLAB_CACHE_NO_MERGE | SLAB_CACHE_TYPESAFE))
+    {
+        slabCacheCreate (newCache, objSz, name, tag, align, flags, ctor, dtor);
+        return newCache;
+    }
+    if (!slabCacheMerge (newCache, objSz, name, tag, align, flags))
+    {
+        MmCacheFree (&caches, newCache);
+        return NULL;
+    }
     return newCache;
 }
 
+// Creates a slab cache
+SlabCache_t* MmCacheCreate (size_t objSz, const char* name, int tag, size_t align, int flags)
+{
+    return MmCacheCreateCtor (objSz, name, tag, align, flags, NULL, NULL);
+}
+
+// Frees a destroyed cache once nobody walking the cache list can see it
+static void slabFreeCache (NkRcuHead_t* head)
+{
+    MmCacheFree (&caches, LINK_CONTAINER (head, SlabCache_t, rcu));
+}
+
+// Takes an alias off its shared cache, destroying the shared cache after its last alias
+static void slabCacheUnmerge (SlabCache_t* cache)
+{
+    SlabCacheStats_t stats;
+    MmCacheGetStats (cache, &stats);
+    if (stats.allocs != stats.frees)
+        NkPanic ("nexke: panic: attempt to destroy non-empty cache\n");
+    SlabCache_t* shared = cache->merged;
+    NkSpinLock (&mergeLock);
+    NkSpinLock (&cacheListLock);
+    NkRcuListRemove (&cacheList, &cache->link);
+    NkSpinUnlock (&cacheListLock);
+    // Once it isn't marked shared, nobody can merge with it
+    bool last = !--shared->numAliases;
+    if (last)
+        shared->flags &= ~SLAB_CACHE_SHARED;
+    NkSpinUnlock (&mergeLock);
+    NkRcuCall (&cache->rcu, slabFreeCache);
+    if (last)
+        MmCacheDestroy (shared);
+}
+
 // Destroys a slab cache
 void MmCacheDestroy (SlabCache_t* cache)
 {
     CPU_ASSERT_NOT_INT();
-    NkSpinLock (&cache->lock);
+    if (cache->merged)
+    {
+        slabCacheUnmerge (cache);
+        return;
+    }
+    slabLockCache (cache);
+    // Return everything sitting in magazines to the slabs
+    slabCacheFlushMags (cache);
     // Ensure cache is empty
     if (cache->numObjs)
         NkPanic ("nexke: panic: attempt to destroy non-empty cache\n");
@@ -414,18 +977,99 @@ void MmCacheDestroy (SlabCache_t* cache)
         slabFreeSlab (cache, slab);
         iter = NkListIterate (&cache->partialSlabs, iter);
     }
+    // slabFreeSlab removes the slab from the list, so always take the front
     iter = NkListFront (&cache->emptySlabs);
     while (iter)
     {
         Slab_t* slab = LINK_CONTAINER (iter, Slab_t, link);
         slabFreeSlab (cache, slab);
-        iter = NkListIterate (&cache->emptySlabs, iter);
+        iter = NkListFront (&cache->emptySlabs);
     }
+    NkMcsUnlock (&cache->lock);
     // Remove from list
-    NkListRemove (&cacheList, &cache->link);
-    NkSpinUnlock (&cache->lock);
-    // Free it from cache of caches
-    MmCacheFree (&caches, cache);
+    NkSpinLock (&cacheListLock);
+    NkRcuListRemove (&cacheList, &cache->link);
+    NkSpinUnlock (&cacheListLock);
+    // Free it from cache of caches, once reapers are done with it. Until then it's just an empty
+    // cache to them
+    NkRcuCall (&cache->rcu, slabFreeCache);
+}
+
+// Releases empty slabs and depot magazines of a cache
+size_t MmCacheReap (SlabCache_t* cache)
+{
+    CPU_ASSERT_NOT_INT();
+    cache = slabGetRealCache (cache);
+    slabLockCache (cache);
+    // Objects in the depot aren't being used by any CPU, so give them back to their slabs
+    slabCacheFlushDepot (cache);
+    // If empty slabs weren't reused since the last reap, we are keeping more than the
+    // working set needs
+    if (cache->emptyReused < cache->emptyMax)
+        cache->emptyMax = (cache->emptyReused > 1) ? cache->emptyReused : 1;
+    cache->emptyReused = 0;
+    cache->numTrimmed = 0;
+    // Release every empty slab. We are in need of memory
+    // Type safe caches keep theirs, as stale pointers to their objects may still be read
+    size_t freed = 0;
+    NkLink_t* iter = NkListFront (&cache->emptySlabs);
+    while (iter && !(cache->flags & SLAB_CACHE_TYPESAFE))
+    {
+        slabFreeSlab (cache, LINK_CONTAINER (iter, Slab_t, link));
+        freed += cache->slabSz;
+        iter = NkListFront (&cache->emptySlabs);
+    }
+    NkMcsUnlock (&cache->lock);
+    return freed;
+}
+
+// Reaps all slab caches
+size_t MmSlabReap()
+{
+    size_t freed = 0;
+    NkRcuReadLock();
+    NkLink_t* iter = NkRcuListFront (&cacheList);
+    while (iter)
+    {
+        SlabCache_t* cache = LINK_CONTAINER (iter, SlabCache_t, link);
+        // Skip internal caches, as reaping other caches frees into them
+        // Aliases are reaped through their shared cache
+        if (cache != &magCache && cache != &extSlabCache && !cache->merged)
+            freed += MmCacheReap (cache);
+        iter = NkRcuListIterate (&cacheList, iter);
+    }
+    NkRcuReadUnlock();
+    // Now reap internal caches, in order of dependency
+    freed += MmCacheReap (&magCache);
+    freed += MmCacheReap (&extSlabCache);
+    return freed;
+}
+
+// Gets statistics of a slab cache
+void MmCacheGetStats (SlabCache_t* cache, SlabCacheStats_t* stats)
+{
+    SlabCache_t* alias = cache;
+    cache = slabGetRealCache (cache);
+    slabLockCache (cache);
+    *stats = cache->stats;
+    NkMcsUnlock (&cache->lock);
+    // Add in magazine counts. These aren't locked, so they may be slightly off
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+    {
+        stats->magAllocs += cache->cpuCaches[i].magAllocs;
+        stats->magFrees += cache->cpuCaches[i].magFrees;
+    }
+    stats->allocs += stats->magAllocs;
+    stats->frees += stats->magFrees;
+    if (alias != cache)
+    {
+        stats->allocs = 0, stats->frees = 0;
+        for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+        {
+            stats->allocs += alias->cpuCaches[i].magAllocs;
+            stats->frees += alias->cpuCaches[i].magFrees;
+        }
+    }
 }
 
 // Bootstraps the slab allocator
@@ -435,24 +1079,47 @@ void MmSlabBootstrap()
     minObjSz = sizeof (SlabBuf_t);
     NkListInit (&cacheList);
     // Initialize cache of caches
-    slabCacheCreate (&caches, sizeof (SlabCache_t), "SlabCache_t", 0, 0);
+    slabCacheCreate (&caches, sizeof (SlabCache_t), "SlabCache_t", MM_TAG_MM, 0, 0, NULL, NULL);
     // Initialize cache of slabs
-    slabCacheCreate (&extSlabCache, sizeof (Slab_t), "Slab_t", 0, 0);
-    // Initialize caches of buffers
-    slabCacheCreate (&extBufCache, sizeof (SlabBuf_t), "SlabBuf_t", 0, 0);
-    // Initialize external slab hash table
-    for (int i = 0; i < SLAB_EXT_HASH_SZ; ++i)
-        NkListInit (&extBufHash[i]);
+    slabCacheCreate (&extSlabCache, sizeof (SlabExt_t), "SlabExt_t", MM_TAG_MM, 0, 0, NULL, NULL);
+    // Initialize cache of magazines. This obviously can't have magazines itself
+    slabCacheCreate (&magCache,
+                     sizeof (SlabMagazine_t),
+                     "SlabMagazine_t",
+                     MM_TAG_MM,
+                     0,
+                     SLAB_CACHE_NO_MAG,
+                     NULL,
+                     NULL);
+}
+
+// Returns cache of given pointer
+SlabCache_t* MmGetCacheFromPtr (void* ptr)
+{
+    Slab_t* slab = MmGetKvOwner (ptr);
+    return (slab) ? slab->cache : NULL;
 }
 
 // Dumps the state of the slab allocator
 void MmSlabDump()
 {
-    NkLink_t* cacheIter = NkListFront (&cacheList);
+    NkRcuReadLock();
+    NkLink_t* cacheIter = NkRcuListFront (&cacheList);
     while (cacheIter)
     {
         SlabCache_t* cache = LINK_CONTAINER (cacheIter, SlabCache_t, link);
-        NkSpinLock (&cache->lock);
+        SlabCacheStats_t stats;
+        if (cache->merged)
+        {
+            MmCacheGetStats (cache, &stats);
+            NkLogDebug ("cache name: %s, merged into shared cache of object size %lu\n",
+                        cache->name,
+                        cache->objSz);
+            NkLogDebug ("Allocations: %llu, frees: %llu\n\n", stats.allocs, stats.frees);
+            cacheIter = NkRcuListIterate (&cacheList, cacheIter);
+            continue;
+        }
+        slabLockCache (cache);
         NkLogDebug ("cache name: %s, cache object size: %lu, cache aligment: %lu, max number of "
                     "objects to a slab: %lu\n",
                     cache->name,
@@ -466,11 +1133,34 @@ void MmSlabDump()
                     cache->numPartial,
                     cache->numObjs,
                     cache->slabSz);
-        NkLogDebug ("Number of colors: %lu, current color: %lu, color adjust: %lu\n\n",
+        NkLogDebug ("Number of colors: %lu, current color: %lu, color adjust: %lu\n",
                     cache->numColors,
                     cache->curColor,
                     cache->colorAdj);
-        NkSpinUnlock (&cache->lock);
-        cacheIter = NkListIterate (&cacheList, cacheIter);
+        NkLogDebug ("Number of full magazines: %d, number of empty magazines: %d\n",
+                    cache->numFullMags,
+                    cache->numEmptyMags);
+        NkLogDebug ("Empty slab limit: %d, empty slab reuses since reap: %d\n",
+                    cache->emptyMax,
+                    cache->emptyReused);
+        if (cache->flags & SLAB_CACHE_SHARED)
+            NkLogDebug ("Caches merged into this one: %d\n", cache->numAliases);
+        NkMcsUnlock (&cache->lock);
+        // Dump statistics
+        MmCacheGetStats (cache, &stats);
+        uintmax_t ops = stats.allocs + stats.frees;
+        uintmax_t hitRate = (ops) ? ((stats.magAllocs + stats.magFrees) * 100) / ops : 0;
+        NkLogDebug ("Allocations: %llu, frees: %llu, peak objects: %d, magazine hit rate: "
+                    "%llu%%\n",
+                    stats.allocs,
+                    stats.frees,
+                    stats.peakObjs,
+                    hitRate);
+        NkLogDebug ("Slabs grown: %llu, slabs freed: %llu, lock spins: %llu\n\n",
+                    stats.slabGrows,
+                    stats.slabFrees,
+                    stats.lockSpins);
+        cacheIter = NkRcuListIterate (&cacheList, cacheIter);
     }
+    NkRcuReadUnlock();
 }
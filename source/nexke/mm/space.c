@@ -28,8 +28,9 @@
 static SlabCache_t* mmSpaceCache = NULL;
 static SlabCache_t* mmEntryCache = NULL;
 
-// Currently active address space
-static MmSpace_t* mmCurSpace = NULL;
+// User spaces, for daemons that walk all of them
+static NkList_t mmSpaceList = {&mmSpaceList, &mmSpaceList};
+static TskMutex_t mmSpaceListLock;
 
 // Gets end of entry
 static inline uintptr_t mmEntryEnd (MmSpaceEntry_t* entry)
@@ -37,6 +38,203 @@ static inline uintptr_t mmEntryEnd (MmSpaceEntry_t* entry)
     return entry->vaddr + (entry->count * NEXKE_CPU_PAGESZ);
 }
 
+// Entry tree management
+// Entries are kept in an AVL tree alongside the list. Each node tracks the largest free gap
+// in its subtree, which lets us find free space without walking the whole list
+
+// Gets height of subtree
+static inline int mmTreeHeight (MmSpaceEntry_t* node)
+{
+    return node ? node->height : 0;
+}
+
+// Recomputes height and largest gap of node from its children
+static void mmTreeUpdate (MmSpaceEntry_t* node)
+{
+    int leftHeight = mmTreeHeight (node->left);
+    int rightHeight = mmTreeHeight (node->right);
+    node->height = ((leftHeight > rightHeight) ? leftHeight : rightHeight) + 1;
+    node->maxGap = node->gap;
+    if (node->left && node->left->maxGap > node->maxGap)
+        node->maxGap = node->left->maxGap;
+    if (node->right && node->right->maxGap > node->maxGap)
+        node->maxGap = node->right->maxGap;
+}
+
+// Recomputes gap after entry
+static inline void mmTreeSetGap (MmSpaceEntry_t* entry)
+{
+    entry->gap = (entry->next) ? entry->next->vaddr - mmEntryEnd (entry) : 0;
+}
+
+// Puts new in place of old in old's parent
+static void mmTreeReplace (MmSpace_t* space, MmSpaceEntry_t* old, MmSpaceEntry_t* new)
+{
+    MmSpaceEntry_t* parent = old->parent;
+    if (new)
+        new->parent = parent;
+    if (!parent)
+        space->entryTree = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+}
+
+// Rotates subtree left, returning new subtree root
+static MmSpaceEntry_t* mmTreeRotateLeft (MmSpace_t* space, MmSpaceEntry_t* node)
+{
+    MmSpaceEntry_t* pivot = node->right;
+    node->right = pivot->left;
+    if (pivot->left)
+        pivot->left->parent = node;
+    mmTreeReplace (space, node, pivot);
+    pivot->left = node;
+    node->parent = pivot;
+    mmTreeUpdate (node);
+    mmTreeUpdate (pivot);
+    return pivot;
+}
+
+// Rotates subtree right, returning new subtree root
+static MmSpaceEntry_t* mmTreeRotateRight (MmSpace_t* space, MmSpaceEntry_t* node)
+{
+    MmSpaceEntry_t* pivot = node->left;
+    node->left = pivot->right;
+    if (pivot->right)
+        pivot->right->parent = node;
+    mmTreeReplace (space, node, pivot);
+    pivot->right = node;
+    node->parent = pivot;
+    mmTreeUpdate (node);
+    mmTreeUpdate (pivot);
+    return pivot;
+}
+
+// Updates and rebalances every node from node up to the root
+static void mmTreeFixup (MmSpace_t* space, MmSpaceEntry_t* node)
+{
+    while (node)
+    {
+        mmTreeUpdate (node);
+        int balance = mmTreeHeight (node->left) - mmTreeHeight (node->right);
+        if (balance > 1)
+        {
+            if (mmTreeHeight (node->left->left) < mmTreeHeight (node->left->right))
+                mmTreeRotateLeft (space, node->left);
+            node = mmTreeRotateRight (space, node);
+        }
+        else if (balance < -1)
+        {
+            if (mmTreeHeight (node->right->right) < mmTreeHeight (node->right->left))
+                mmTreeRotateRight (space, node->right);
+            node = mmTreeRotateLeft (space, node);
+        }
+        node = node->parent;
+    }
+}
+
+// Inserts entry into tree right after prec
+// If prec is NULL, entry becomes the root
+static void mmTreeInsert (MmSpace_t* space, MmSpaceEntry_t* prec, MmSpaceEntry_t* entry)
+{
+    entry->left = entry->right = NULL;
+    entry->height = 1;
+    mmTreeSetGap (entry);
+    entry->maxGap = entry->gap;
+    if (!prec)
+    {
+        entry->parent = NULL;
+        space->entryTree = entry;
+        return;
+    }
+    // Entry goes to the right of prec, or to the left of prec's successor
+    if (!prec->right)
+    {
+        prec->right = entry;
+        entry->parent = prec;
+    }
+    else
+    {
+        MmSpaceEntry_t* succ = prec->right;
+        while (succ->left)
+            succ = succ->left;
+        succ->left = entry;
+        entry->parent = succ;
+    }
+    // Prec's gap shrunk, which the fixup picks up as prec is an ancestor of entry
+    mmTreeSetGap (prec);
+    mmTreeFixup (space, entry->parent);
+}
+
+// Removes entry from tree
+// The entry must already be unlinked from the list
+static void mmTreeRemove (MmSpace_t* space, MmSpaceEntry_t* entry)
+{
+    MmSpaceEntry_t* fix = NULL;
+    if (entry->left && entry->right)
+    {
+        // Put successor in place of entry
+        MmSpaceEntry_t* succ = entry->right;
+        while (succ->left)
+            succ = succ->left;
+        if (succ->parent != entry)
+        {
+            fix = succ->parent;
+            mmTreeReplace (space, succ, succ->right);
+            succ->right = entry->right;
+            succ->right->parent = succ;
+        }
+        else
+            fix = succ;
+        succ->left = entry->left;
+        succ->left->parent = succ;
+        mmTreeReplace (space, entry, succ);
+    }
+    else
+    {
+        fix = entry->parent;
+        mmTreeReplace (space, entry, (entry->left) ? entry->left : entry->right);
+    }
+    mmTreeFixup (space, fix);
+}
+
+// Finds the last entry starting at or below addr
+static MmSpaceEntry_t* mmTreeFloor (MmSpace_t* space, uintptr_t addr)
+{
+    MmSpaceEntry_t* cur = space->entryTree;
+    MmSpaceEntry_t* best = NULL;
+    while (cur)
+    {
+        if (cur->vaddr <= addr)
+        {
+            best = cur;
+            cur = cur->right;
+        }
+        else
+            cur = cur->left;
+    }
+    return best;
+}
+
+// Finds first entry at or above start that has at least size bytes free after it
+static MmSpaceEntry_t* mmTreeFindGap (MmSpaceEntry_t* node, uintptr_t start, uintptr_t size)
+{
+    // Skip subtrees without a large enough gap
+    if (!node || node->maxGap < size)
+        return NULL;
+    if (node->vaddr >= start)
+    {
+        // Lower entries go first
+        MmSpaceEntry_t* res = mmTreeFindGap (node->left, start, size);
+        if (res)
+            return res;
+        if (node->gap >= size)
+            return node;
+    }
+    return mmTreeFindGap (node->right, start, size);
+}
+
 // Creates a new empty address space
 MmSpace_t* MmCreateSpace()
 {
@@ -44,6 +242,8 @@ MmSpace_t* MmCreateSpace()
     memset (newSpace, 0, sizeof (MmSpace_t));
     if (!newSpace)
         NkPanic ("nexke: out of memory");
+    // Don't let a storm of faults hold off mapping changes
+    NkRwInit (&newSpace->lock, NK_RW_PREFER_WRITER);
     newSpace->startAddr = MM_SPACE_USER_START;
     newSpace->endAddr = NEXKE_USER_ADDR_END;
     // Create a fake entry
@@ -61,6 +261,12 @@ MmSpace_t* MmCreateSpace()
     fakeEnd->vaddr = newSpace->endAddr;
     fakeEnd->prev = fake;
     fake->next = fakeEnd;
+    // Put both in the tree
+    mmTreeInsert (newSpace, NULL, fake);
+    mmTreeInsert (newSpace, fake, fakeEnd);
+    TskAcquireMutex (&mmSpaceListLock);
+    NkListAddBack (&mmSpaceList, &newSpace->link);
+    TskReleaseMutex (&mmSpaceListLock);
     return newSpace;
 }
 
@@ -68,12 +274,17 @@ MmSpace_t* MmCreateSpace()
 void MmDestroySpace (MmSpace_t* space)
 {
     assert (space != MmGetKernelSpace());    // Can't operate on kernel space
+    // Wait for anyone walking the list to be done with it
+    TskAcquireMutex (&mmSpaceListLock);
+    NkListRemove (&mmSpaceList, &space->link);
+    TskReleaseMutex (&mmSpaceListLock);
     // Free every allocated space entry
-    MmSpaceEntry_t* curEntry = space->entryList;
+    MmSpaceEntry_t* curEntry = space->entryList->next;
     while (curEntry->vaddr != space->endAddr)
     {
+        MmSpaceEntry_t* next = curEntry->next;
         MmFreeSpace (space, curEntry);
-        curEntry = curEntry->next;
+        curEntry = next;
     }
     // Free both fake entries
     MmCacheFree (mmEntryCache, space->entryList->next);
@@ -88,36 +299,32 @@ static void mmAddEntry (MmSpace_t* space, MmSpaceEntry_t* prec, MmSpaceEntry_t*
     new->prev = prec;
     new->next->prev = new;
     new->prev->next = new;
+    mmTreeInsert (space, prec, new);
     ++space->numEntries;
 }
 
 // Removes entry
 static void mmRemoveEntry (MmSpace_t* space, MmSpaceEntry_t* entry)
 {
+    MmSpaceEntry_t* prev = entry->prev;
     entry->next->prev = entry->prev;
     entry->prev->next = entry->next;
+    mmTreeRemove (space, entry);
+    // Previous entry's gap grew
+    mmTreeSetGap (prev);
+    mmTreeFixup (space, prev);
+    if (space->faultHint == entry)
+        space->faultHint = NULL;
     --space->numEntries;
 }
 
+// Finds entry containing addr, or the entry preceding addr if it is free
 static MmSpaceEntry_t* mmFindEntryUnlocked (MmSpace_t* space, uintptr_t addr)
 {
-    MmSpaceEntry_t* cur = space->entryList;
-    while (cur->vaddr != space->endAddr)
-    {
-        // CHeck if we are inside this entry
-        uintptr_t curEnd = mmEntryEnd (cur);
-        if (cur->vaddr <= addr && curEnd >= addr)
-            return cur;    // We have a match
-        // Now check if this address is free and this entry precedes said free area
-        uintptr_t upperBound = cur->next->vaddr;
-        if (addr > curEnd && addr < upperBound)
-            return cur;    // Found preceding entry
-        // Check if we are done
-        if (upperBound > addr)
-            break;    // Nothing left to do
-        cur = cur->next;
-    }
-    return NULL;
+    MmSpaceEntry_t* cur = mmTreeFloor (space, addr);
+    if (!cur || cur->vaddr == space->endAddr)
+        return NULL;
+    return cur;
 }
 
 // Finds free address based on hint. Returns preceding entry
@@ -132,20 +339,14 @@ static MmSpaceEntry_t* mmFindFree (MmSpace_t* space, uintptr_t* addr, size_t num
         cur = space->entryList;
     else
         cur = mmFindEntryUnlocked (space, hint);
-    while (cur->vaddr != space->endAddr)
-    {
-        // See if there is enough free space after this entry
-        MmSpaceEntry_t* next = cur->next;
-        if (next->vaddr - mmEntryEnd (cur) >= (numPages * NEXKE_CPU_PAGESZ))
-        {
-            // If there was numPages between next entry start and current entry end and next entry
-            // start, use this hole
-            *addr = mmEntryEnd (cur);
-            return cur;
-        }
-        cur = next;
-    }
-    return NULL;
+    if (!cur)
+        return NULL;
+    // Find first hole after that entry big enough for numPages
+    cur = mmTreeFindGap (space->entryTree, cur->vaddr, numPages * NEXKE_CPU_PAGESZ);
+    if (!cur)
+        return NULL;
+    *addr = mmEntryEnd (cur);
+    return cur;
 }
 
 // Allocates an address space entry for object
@@ -157,7 +358,7 @@ MmSpaceEntry_t* MmAllocSpace (MmSpace_t* space,
     assert (space != MmGetKernelSpace());    // Can't operate on kernel space
     // Get free space
     uintptr_t addr = hintAddr;
-    NkSpinLock (&space->lock);
+    NkRwWriteLock (&space->lock);
     MmSpaceEntry_t* prevEntry = mmFindFree (space, &addr, numPages);
     if (!prevEntry)
     {
@@ -166,7 +367,7 @@ MmSpaceEntry_t* MmAllocSpace (MmSpace_t* space,
         prevEntry = mmFindFree (space, &addr, numPages);
         if (!prevEntry)
         {
-            NkSpinUnlock (&space->lock);
+            NkRwWriteUnlock (&space->lock);
             return NULL;    // Not enough space
         }
     }
@@ -177,56 +378,310 @@ MmSpaceEntry_t* MmAllocSpace (MmSpace_t* space,
     newEntry->count = numPages;
     newEntry->vaddr = addr;
     newEntry->obj = obj;
+    newEntry->faultAround = MM_FAULT_AROUND_DEFAULT;
+    newEntry->faultAlloc = false;
     mmAddEntry (space, prevEntry, newEntry);
-    NkSpinUnlock (&space->lock);
+    NkRwWriteUnlock (&space->lock);
     return newEntry;
 }
 
 // Frees an address space entry
 void MmFreeSpace (MmSpace_t* space, MmSpaceEntry_t* entry)
 {
-    NkSpinLock (&space->lock);
+    NkRwWriteLock (&space->lock);
     assert (space != MmGetKernelSpace());    // Can't operate on kernel space
     mmRemoveEntry (space, entry);
     MmDeRefObject (entry->obj);
     MmCacheFree (mmEntryCache, entry);
-    NkSpinUnlock (&space->lock);
+    NkRwWriteUnlock (&space->lock);
 }
 
 // Finds address space entry for given address
 MmSpaceEntry_t* MmFindSpaceEntry (MmSpace_t* space, uintptr_t addr)
 {
-    NkSpinLock (&space->lock);
+    NkRwReadLock (&space->lock);
     MmSpaceEntry_t* entry = mmFindEntryUnlocked (space, addr);
-    NkSpinUnlock (&space->lock);
+    NkRwReadUnlock (&space->lock);
     return entry;
 }
 
+// Makes a copy-on-write copy of entry in destSpace
+MmSpaceEntry_t* MmCopySpaceEntry (MmSpace_t* space, MmSpaceEntry_t* entry, MmSpace_t* destSpace)
+{
+    assert (space != MmGetKernelSpace() && destSpace != MmGetKernelSpace());
+    NkRwWriteLock (&space->lock);
+    MmObject_t* obj = entry->obj;
+    // Both sides get a shadow so neither sees the other's writes
+    MmObject_t* srcShadow = MmCreateShadow (obj, 0, entry->count);
+    MmObject_t* destShadow = MmCreateShadow (obj, 0, entry->count);
+    if (!srcShadow || !destShadow)
+        NkPanicOom();
+    entry->obj = srcShadow;
+    // Write protect the source so that writes fault and get their own copy
+    MmMulProtectRange (space, entry->vaddr, entry->count, obj->perm & ~(MUL_PAGE_RW));
+    uintptr_t vaddr = entry->vaddr;
+    size_t count = entry->count;
+    NkRwWriteUnlock (&space->lock);
+    // The shadows hold references on obj now
+    MmDeRefObject (obj);
+    MmSpaceEntry_t* newEntry = MmAllocSpace (destSpace, destShadow, vaddr, count);
+    if (!newEntry)
+        MmDeRefObject (destShadow);
+    return newEntry;
+}
+
+// Page transfer and loan
+// Both move a range of pages to another address space without copying them. A transfer takes
+// the pages out of the source's object and puts them in the destination's, while a loan gives the
+// destination a shadow of the source's object, the same as MmCopySpaceEntry does for whole
+// entries. Either way, the source range is unmapped or write protected with one range
+// invalidation, instead of a TLB shootdown per page
+// Pages are moved and mapped in batches, so page tables are walked once per batch
+
+#define MM_MOVE_BATCH 16
+
+// Maps runs of the pages in batch that are next to each other
+// Object pages are in must be locked
+static void mmMapBatch (MmSpace_t* space, uintptr_t base, MmPage_t** pages, int count, int perm)
+{
+    int start = 0;
+    for (int i = 0; i <= count; ++i)
+    {
+        if (i < count && pages[i])
+            continue;
+        if (i > start)
+        {
+            uintptr_t addr = base + (start * NEXKE_CPU_PAGESZ);
+            MmMulMapRange (space, addr, &pages[start], i - start, perm);
+        }
+        start = i + 1;
+    }
+}
+
+// Checks that count pages at addr are inside one entry of space, and returns it
+static MmSpaceEntry_t* mmGetRangeEntry (MmSpace_t* space, uintptr_t addr, size_t count)
+{
+    MmSpaceEntry_t* entry = MmFindSpaceEntry (space, addr);
+    if (!entry || addr < entry->vaddr || (addr + (count * NEXKE_CPU_PAGESZ)) > mmEntryEnd (entry))
+        return NULL;
+    return entry;
+}
+
+// Takes up to count pages out of obj for a transfer
+// Returns how many were taken, which is less than count if one couldn't be brought in
+static int mmTakePages (MmObject_t* obj, size_t off, MmPage_t** pages, int count)
+{
+    NkSpinLock (&obj->lock);
+    int i = 0;
+    for (; i < count; ++i, off += NEXKE_CPU_PAGESZ)
+    {
+        // Bring the page in as if it was written, so we get this object's own copy of it
+        int prot = MUL_PAGE_RW;
+        int kind = 0;
+        MmPage_t* page = NULL;
+        if (!MmPageFaultIn (obj, off, &prot, &page, &kind))
+            break;
+        MmLockPage (page);
+        if (page->fixCount || (page->flags & MM_PAGE_HUGE))
+        {
+            // Fixed and huge pages have to stay where they are, so give the destination a copy
+            MmPage_t* copy = MmAllocMovablePage (false);
+            if (!copy)
+                NkPanicOom();
+            MmMulCopyPage (copy, page);
+            MmUnlockPage (page);
+            pages[i] = copy;
+            continue;
+        }
+        // Catch mappings in other address spaces
+        MmMulUnmapPage (page);
+        MmRemovePage (page);
+        MmUnlockPage (page);
+        pages[i] = page;
+    }
+    NkSpinUnlock (&obj->lock);
+    return i;
+}
+
+// Puts count pages into obj for a transfer, mapping them at base in space
+static void mmGivePages (MmSpace_t* space,
+                         uintptr_t base,
+                         MmObject_t* obj,
+                         size_t off,
+                         MmPage_t** pages,
+                         int count)
+{
+    NkSpinLock (&obj->lock);
+    for (int i = 0; i < count; ++i)
+    {
+        size_t pageOff = off + (i * NEXKE_CPU_PAGESZ);
+        MmPage_t* old = MmLookupPage (obj, pageOff);
+        if (old)
+        {
+            MmLockPage (old);
+            if (old->fixCount || (old->flags & (MM_PAGE_GUARD | MM_PAGE_HUGE)))
+            {
+                // The page has to stay, so it takes the data instead
+                if (!(old->flags & MM_PAGE_GUARD))
+                    MmMulCopyPage (old, pages[i]);
+                MmUnlockPage (old);
+                MmFreePage (pages[i]);
+                pages[i] = NULL;
+                continue;
+            }
+            MmMulUnmapPage (old);
+            MmRemovePage (old);
+            MmFreePage (old);
+        }
+        MmLockPage (pages[i]);
+        MmAddPage (obj, pageOff, pages[i]);
+        MmUnlockPage (pages[i]);
+    }
+    // Map them while they can't be paged out
+    mmMapBatch (space, base, pages, count, obj->perm);
+    NkSpinUnlock (&obj->lock);
+}
+
+// Moves count pages at srcAddr in src to destAddr in dest
+bool MmTransferPages (MmSpace_t* src,
+                      uintptr_t srcAddr,
+                      MmSpace_t* dest,
+                      uintptr_t destAddr,
+                      size_t count)
+{
+    assert (src != MmGetKernelSpace() && dest != MmGetKernelSpace());
+    MmSpaceEntry_t* srcEntry = mmGetRangeEntry (src, srcAddr, count);
+    MmSpaceEntry_t* destEntry = mmGetRangeEntry (dest, destAddr, count);
+    if (!srcEntry || !destEntry)
+        return false;
+    MmObject_t* srcObj = srcEntry->obj;
+    MmObject_t* destObj = destEntry->obj;
+    // Only anonymous pages can change objects
+    if (srcObj == destObj || srcObj->backend != MM_BACKEND_ANON ||
+        destObj->backend != MM_BACKEND_ANON)
+    {
+        return false;
+    }
+    size_t srcOff = srcAddr - srcEntry->vaddr;
+    size_t destOff = destAddr - destEntry->vaddr;
+    // Tear down both ranges at once. Pages that get faulted back in before we take them are
+    // unmapped one at a time
+    MmMulUnmapRange (src, srcAddr, count);
+    MmMulUnmapRange (dest, destAddr, count);
+    MmPage_t* pages[MM_MOVE_BATCH];
+    for (size_t done = 0; done < count;)
+    {
+        int want = ((count - done) > MM_MOVE_BATCH) ? MM_MOVE_BATCH : (count - done);
+        size_t off = done * NEXKE_CPU_PAGESZ;
+        int got = mmTakePages (srcObj, srcOff + off, pages, want);
+        mmGivePages (dest, destAddr + off, destObj, destOff + off, pages, got);
+        if (got != want)
+            return false;
+        done += got;
+    }
+    return true;
+}
+
+// Lends count pages at srcAddr in src to dest
+MmSpaceEntry_t* MmLoanPages (MmSpace_t* src, uintptr_t srcAddr, MmSpace_t* dest, size_t count)
+{
+    assert (src != MmGetKernelSpace() && dest != MmGetKernelSpace());
+    NkRwWriteLock (&src->lock);
+    MmSpaceEntry_t* entry = mmFindEntryUnlocked (src, srcAddr);
+    if (!entry || srcAddr < entry->vaddr ||
+        (srcAddr + (count * NEXKE_CPU_PAGESZ)) > mmEntryEnd (entry))
+    {
+        NkRwWriteUnlock (&src->lock);
+        return NULL;
+    }
+    MmObject_t* obj = entry->obj;
+    size_t off = srcAddr - entry->vaddr;
+    // The lender keeps writing to a shadow, and the borrower only sees the range it was lent
+    MmObject_t* srcShadow = MmCreateShadow (obj, 0, entry->count);
+    MmObject_t* destShadow = MmCreateShadow (obj, off, count);
+    if (!srcShadow || !destShadow)
+        NkPanicOom();
+    entry->obj = srcShadow;
+    // Only the lent range has to be write protected, as the borrower can't see the rest of obj
+    MmMulProtectRange (src, srcAddr, count, obj->perm & ~(MUL_PAGE_RW));
+    NkRwWriteUnlock (&src->lock);
+    // The shadows hold references on obj now
+    MmDeRefObject (obj);
+    MmSpaceEntry_t* newEntry = MmAllocSpace (dest, destShadow, srcAddr, count);
+    if (!newEntry)
+    {
+        MmDeRefObject (destShadow);
+        return NULL;
+    }
+    // Map what's resident up front, read only so that writes get their own copy
+    MmPage_t* pages[MM_MOVE_BATCH];
+    NkSpinLock (&obj->lock);
+    for (size_t done = 0; done < count; done += MM_MOVE_BATCH)
+    {
+        int num = ((count - done) > MM_MOVE_BATCH) ? MM_MOVE_BATCH : (count - done);
+        for (int i = 0; i < num; ++i)
+        {
+            MmPage_t* page = MmLookupPage (obj, off + ((done + i) * NEXKE_CPU_PAGESZ));
+            if (page && (page->flags & (MM_PAGE_GUARD | MM_PAGE_FIXED)))
+                page = NULL;
+            pages[i] = page;
+        }
+        mmMapBatch (dest,
+                    newEntry->vaddr + (done * NEXKE_CPU_PAGESZ),
+                    pages,
+                    num,
+                    obj->perm & ~(MUL_PAGE_RW));
+    }
+    NkSpinUnlock (&obj->lock);
+    return newEntry;
+}
+
+// Sets fault around window of entry
+void MmSetFaultAround (MmSpace_t* space, MmSpaceEntry_t* entry, size_t numPages, bool alloc)
+{
+    NkRwWriteLock (&space->lock);
+    entry->faultAround = numPages;
+    entry->faultAlloc = alloc;
+    NkRwWriteUnlock (&space->lock);
+}
+
 // Finds faulting entry
-// Called with address space locked
+// Called with address space locked, at least for reading
 MmSpaceEntry_t* MmFindFaultEntry (MmSpace_t* space, uintptr_t addr)
 {
     // Check hint
-    if (space->faultHint)
+    MmSpaceEntry_t* hint = __atomic_load_n (&space->faultHint, __ATOMIC_RELAXED);
+    if (hint)
     {
-        if (space->faultHint->vaddr <= addr && mmEntryEnd (space->faultHint) >= addr)
-            return space->faultHint;
+        if (hint->vaddr <= addr && mmEntryEnd (hint) >= addr)
+            return hint;
     }
     // Find it
-    MmSpaceEntry_t* cur = space->entryList;
-    while (cur && cur->vaddr != space->endAddr)
+    MmSpaceEntry_t* cur = mmTreeFloor (space, addr);
+    if (cur && cur->vaddr != space->endAddr && mmEntryEnd (cur) >= addr)
     {
-        // CHeck if we are inside this entry
-        if (cur->vaddr <= addr && mmEntryEnd (cur) >= addr)
-        {
-            space->faultHint = cur;
-            return cur;    // We have a match
-        }
-        cur = cur->next;
+        // Faults only hold the lock for reading, so others may be setting the hint too
+        // Any of them is fine, entries can't go away until a writer has the lock
+        __atomic_store_n (&space->faultHint, cur, __ATOMIC_RELAXED);
+        return cur;    // We have a match
     }
     return NULL;
 }
 
+// Calls func on every user space
+// Spaces can't be destroyed while func is running
+void MmForEachSpace (void (*func) (MmSpace_t*, void*), void* arg)
+{
+    TskAcquireMutex (&mmSpaceListLock);
+    NkLink_t* iter = NkListFront (&mmSpaceList);
+    while (iter)
+    {
+        func (LINK_CONTAINER (iter, MmSpace_t, link), arg);
+        iter = NkListIterate (&mmSpaceList, iter);
+    }
+    TskReleaseMutex (&mmSpaceListLock);
+}
+
 // Creates kernel space
 void MmCreateKernelSpace (MmObject_t* kernelObj)
 {
@@ -236,6 +691,7 @@ void MmCreateKernelSpace (MmObject_t* kernelObj)
     space->startAddr = NEXKE_KERNEL_ADDR_START;
     space->faultHint = NULL;
     space->numEntries = 0;
+    NkRwInit (&space->lock, NK_RW_PREFER_WRITER);
     // Create entry covering whole address space
     MmSpaceEntry_t* entry = MmCacheAlloc (mmEntryCache);
     entry->count = kernelObj->count;
@@ -243,19 +699,95 @@ void MmCreateKernelSpace (MmObject_t* kernelObj)
     entry->vaddr = space->startAddr;
     entry->next = NULL;
     entry->prev = NULL;
+    // Kernel memory is fixed and mapped when it is allocated, so don't bother with fault around
+    entry->faultAround = 0;
+    entry->faultAlloc = false;
     space->entryList = entry;
+    mmTreeInsert (space, NULL, entry);
 }
 
 // Gets active address space
 MmSpace_t* MmGetCurrentSpace()
 {
-    return mmCurSpace;
+    return CpuGetCcb()->curSpace;
+}
+
+// Switches to address space
+void MmSwitchSpace (MmSpace_t* space)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    MmSpace_t* oldSpace = ccb->curSpace;
+    atomic_t self = 1L << ccb->cpuNum;
+    // A CPU keeps the space loaded after its thread leaves it, so hold it until we move off
+    if (space != MmGetKernelSpace())
+        MmMulRefSpace (space);
+    // Move ourselves over so shootdowns on space get sent to us
+    if (oldSpace)
+        NkAtomicAnd (&oldSpace->activeCpus, ~self);
+    NkAtomicOr (&space->activeCpus, self);
+    ccb->curSpace = space;
+    MmMulSwitchSpace (space);
+    // Catch up on anything we missed
+    MmTlbSync();
+    if (oldSpace && oldSpace != MmGetKernelSpace())
+        MmMulDeRefSpace (oldSpace);
+}
+
+// Switches to address space of a thread that's about to run
+void MmSwitchThreadSpace (MmSpace_t* space)
+{
+    // Kernel threads never touch user mappings, so whatever space is loaded works for them
+    // Keep running in it, and let shootdowns of it skip us until a user thread runs again
+    if (!space)
+    {
+        MmTlbSetLazy (true);
+        return;
+    }
+    MmTlbSetLazy (false);
+    if (space != CpuGetCcb()->curSpace)
+        MmSwitchSpace (space);
+}
+
+#ifdef NEXKE_FAULT_STATS
+static const char* mmFaultKinds[] = {"minor", "major", "zero fill", "copy on write",
+                                     "fault-around", "failed"};
+
+// Dumps fault statistics of a space
+static void mmDumpFaultStats (MmSpace_t* as)
+{
+    MmFaultStats_t* stats = &as->faultStats;
+    for (int i = 0; i < MM_FAULT_KINDS; ++i)
+    {
+        uint64_t count = __atomic_load_n (&stats->counts[i], __ATOMIC_RELAXED);
+        if (!count)
+            continue;
+        // Fault-around counts pages, so average over how many times it ran
+        uint64_t passes = 0;
+        for (int j = 0; j < MM_FAULT_BUCKETS; ++j)
+            passes += __atomic_load_n (&stats->latency[i][j], __ATOMIC_RELAXED);
+        uint64_t time = __atomic_load_n (&stats->totalTime[i], __ATOMIC_RELAXED);
+        NkLogDebug ("%s faults: %llu, %llu ns on average\n",
+                    mmFaultKinds[i],
+                    (unsigned long long) count,
+                    (unsigned long long) ((passes) ? (time / passes) : 0));
+        for (int j = 0; j < MM_FAULT_BUCKETS; ++j)
+        {
+            uint64_t hits = __atomic_load_n (&stats->latency[i][j], __ATOMIC_RELAXED);
+            if (!hits)
+                continue;
+            NkLogDebug ("    %llu - %llu ns: %llu\n",
+                        (j) ? (1ULL << j) : 0ULL,
+                        (2ULL << j) - 1,
+                        (unsigned long long) hits);
+        }
+    }
 }
+#endif
 
 // Dumps address space
 void MmDumpSpace (MmSpace_t* as)
 {
-    NkSpinLock (&as->lock);
+    NkRwReadLock (&as->lock);
     MmSpaceEntry_t* entry = as->entryList;
     while (entry)
     {
@@ -264,7 +796,10 @@ void MmDumpSpace (MmSpace_t* as)
                     entry->count);
         entry = entry->next;
     }
-    NkSpinUnlock (&as->lock);
+    NkRwReadUnlock (&as->lock);
+#ifdef NEXKE_FAULT_STATS
+    mmDumpFaultStats (as);
+#endif
 }
 
 // Initialization routines
@@ -277,6 +812,8 @@ void MmInitPhase1()
     MmInitKvm1();
     // Bootstrap slab allocator
     MmSlabBootstrap();
+    // Initialize reclaim
+    MmInitReclaim();
     // Initialize malloc
     MmMallocInit();
 }
@@ -288,14 +825,22 @@ void MmInitPhase2()
     MmInitPage();
     // Initialize object management
     MmInitObject();
+    MmInitZpool();
+    MmInitFault();
     // Set up caches
-    mmSpaceCache = MmCacheCreate (sizeof (MmSpace_t), "MmSpace_t", 0, 0);
-    mmEntryCache = MmCacheCreate (sizeof (MmSpaceEntry_t), "MmSpaceEntry_t", 0, 0);
+    mmSpaceCache = MmCacheCreate (sizeof (MmSpace_t), "MmSpace_t", MM_TAG_MM, 0, 0);
+    mmEntryCache = MmCacheCreate (sizeof (MmSpaceEntry_t), "MmSpaceEntry_t", MM_TAG_MM, 0, 0);
     if (!mmSpaceCache || !mmEntryCache)
         NkPanicOom();
-    mmCurSpace = MmGetKernelSpace();
+    TskInitMutex (&mmSpaceListLock);
+    CpuGetCcb()->curSpace = MmGetKernelSpace();
+    MmGetKernelSpace()->activeCpus = 1L << CpuGetCcb()->cpuNum;
     // Set up MUL
     MmMulInit();
+    // Create the zero page now that pages can be zeroed
+    MmInitZeroPage();
     // Second phase of KVM
     MmInitKvm2();
+    // Start tracking allocations if we're asked to
+    MmInitTags();
 }
@@ -0,0 +1,254 @@
+/*
+    tag.c - contains memory tag accounting
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <string.h>
+
+// Each CPU keeps its own counts of every tag, so charging an allocation never touches a shared
+// line. A CPU that frees something another one allocated goes negative, so only the sum over
+// all CPUs means anything
+// In leak tracking mode, every live allocation is also kept in a hash table along with the
+// code that made it. The table is fixed size, so allocations made while it's full aren't
+// tracked, and neither are ones made before it was set up
+//
+// Boot arguments:
+// -memleak  tracks live allocations, so the dump can say who made them
+
+#define MM_LEAK_ENTRIES 32768    // Allocations that can be tracked at once
+#define MM_LEAK_HASH_SZ 4096     // Buckets in leak table, must be a power of 2
+#define MM_LEAK_SITES   64       // Allocation sites the dump can tell apart
+#define MM_LEAK_TOP     20       // Sites the dump prints
+
+// Counts of each tag on each CPU
+MmTagCount_t mmTagCounts[NEXKE_MAX_CPUS][MM_TAG_MAX] = {0};
+
+bool mmLeakOn = false;    // Whether live allocations are tracked
+
+// Names of tags, indexed by tag
+static const char* mmTagNames[] = {"mm", "task", "platform", "cpu", "core", "io"};
+
+// A tracked allocation
+typedef struct _mmleak
+{
+    void* ptr;               // Allocation
+    uintptr_t site;          // Code that made it
+    size_t sz;               // Size of it
+    int tag;                 // Tag it's charged to
+    struct _mmleak* next;    // Next in bucket or free list
+} mmLeak_t;
+
+// Allocation site in dump
+typedef struct _mmleaksite
+{
+    uintptr_t site;
+    int tag;
+    size_t bytes;
+    size_t count;
+} mmLeakSite_t;
+
+// Leak table
+static mmLeak_t** mmLeakHash = NULL;
+static mmLeak_t* mmLeakFree = NULL;
+static spinlock_t mmLeakLock = 0;
+static size_t mmLeakDropped = 0;    // Allocations that couldn't be tracked
+
+// Sites being dumped
+static mmLeakSite_t mmLeakSites[MM_LEAK_SITES];
+
+// Gets bucket of ptr
+static FORCEINLINE mmLeak_t** mmLeakBucket (void* ptr)
+{
+    return &mmLeakHash[((uintptr_t) ptr >> 4) & (MM_LEAK_HASH_SZ - 1)];
+}
+
+// Tracks an allocation
+void MmLeakTrack (int tag, void* ptr, size_t sz, uintptr_t site)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&mmLeakLock);
+    mmLeak_t* leak = mmLeakFree;
+    if (leak)
+    {
+        mmLeakFree = leak->next;
+        leak->ptr = ptr;
+        leak->site = site;
+        leak->sz = sz;
+        leak->tag = tag;
+        mmLeak_t** bucket = mmLeakBucket (ptr);
+        leak->next = *bucket;
+        *bucket = leak;
+    }
+    else
+        ++mmLeakDropped;
+    NkSpinUnlock (&mmLeakLock);
+    PltLowerIpl (ipl);
+}
+
+// Stops tracking an allocation
+void MmLeakUntrack (void* ptr)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&mmLeakLock);
+    mmLeak_t** prev = mmLeakBucket (ptr);
+    mmLeak_t* leak = *prev;
+    while (leak && leak->ptr != ptr)
+    {
+        prev = &leak->next;
+        leak = leak->next;
+    }
+    // It may have been made before tracking started
+    if (leak)
+    {
+        *prev = leak->next;
+        leak->next = mmLeakFree;
+        mmLeakFree = leak;
+    }
+    NkSpinUnlock (&mmLeakLock);
+    PltLowerIpl (ipl);
+}
+
+// Sets up tag accounting
+void MmInitTags()
+{
+    if (!NkReadArg ("-memleak"))
+        return;
+    size_t hashSz = MM_LEAK_HASH_SZ * sizeof (mmLeak_t*);
+    size_t tabSz = MM_LEAK_ENTRIES * sizeof (mmLeak_t);
+    void* mem = MmAllocKvRegion (CpuPageAlignUp (hashSz + tabSz) >> NEXKE_CPU_PAGE_SHIFT,
+                                 MM_KV_NO_DEMAND);
+    if (!mem)
+    {
+        NkLogWarning ("nexke: warning: out of memory for leak tracking\n");
+        return;
+    }
+    mmLeakHash = mem;
+    memset (mmLeakHash, 0, hashSz);
+    mmLeak_t* leaks = mem + hashSz;
+    for (int i = 0; i < MM_LEAK_ENTRIES; ++i)
+    {
+        leaks[i].next = mmLeakFree;
+        mmLeakFree = &leaks[i];
+    }
+    __atomic_store_n (&mmLeakOn, true, __ATOMIC_RELEASE);
+    NkLogInfo ("nexke: tracking up to %d live allocations\n", MM_LEAK_ENTRIES);
+}
+
+// Adds up the sites of tracked allocations
+// Returns number of sites found, with anything that didn't fit added to other
+static int mmLeakGetSites (mmLeakSite_t* other)
+{
+    int numSites = 0;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&mmLeakLock);
+    for (int i = 0; i < MM_LEAK_HASH_SZ; ++i)
+    {
+        for (mmLeak_t* leak = mmLeakHash[i]; leak; leak = leak->next)
+        {
+            mmLeakSite_t* site = NULL;
+            for (int j = 0; j < numSites; ++j)
+            {
+                if (mmLeakSites[j].site == leak->site && mmLeakSites[j].tag == leak->tag)
+                {
+                    site = &mmLeakSites[j];
+                    break;
+                }
+            }
+            if (!site && numSites < MM_LEAK_SITES)
+            {
+                site = &mmLeakSites[numSites++];
+                site->site = leak->site;
+                site->tag = leak->tag;
+                site->bytes = 0;
+                site->count = 0;
+            }
+            if (!site)
+                site = other;
+            site->bytes += leak->sz;
+            ++site->count;
+        }
+    }
+    NkSpinUnlock (&mmLeakLock);
+    PltLowerIpl (ipl);
+    return numSites;
+}
+
+// Logs live allocations by the site that made them, biggest first
+static void mmLeakDump()
+{
+    mmLeakSite_t other = {0};
+    int numSites = mmLeakGetSites (&other);
+    NkLogInfo ("nexke: live allocations by site, %llu untracked\n",
+               (unsigned long long) mmLeakDropped);
+    NkLogInfo ("           bytes  objects  tag       site\n");
+    for (int i = 0; i < MM_LEAK_TOP; ++i)
+    {
+        mmLeakSite_t* best = NULL;
+        for (int j = 0; j < numSites; ++j)
+        {
+            if (mmLeakSites[j].count && (!best || mmLeakSites[j].bytes > best->bytes))
+                best = &mmLeakSites[j];
+        }
+        if (!best)
+            break;
+        NkLogInfo ("  %14llu  %7llu  %-8s  %p\n",
+                   (unsigned long long) best->bytes,
+                   (unsigned long long) best->count,
+                   mmTagNames[best->tag],
+                   (void*) best->site);
+        best->count = 0;
+    }
+    if (other.count)
+    {
+        NkLogInfo ("  %14llu  %7llu  other sites\n",
+                   (unsigned long long) other.bytes,
+                   (unsigned long long) other.count);
+    }
+}
+
+// Gets the counts of a tag over all CPUs
+void MmGetTagCount (int tag, MmTagCount_t* count)
+{
+    assert (tag >= 0 && tag < MM_TAG_MAX);
+    count->bytes = 0;
+    count->objs = 0;
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+    {
+        count->bytes += __atomic_load_n (&mmTagCounts[i][tag].bytes, __ATOMIC_RELAXED);
+        count->objs += __atomic_load_n (&mmTagCounts[i][tag].objs, __ATOMIC_RELAXED);
+    }
+}
+
+// Logs how much memory each tag has
+void MmTagDump()
+{
+    NkLogInfo ("nexke: memory by tag\n");
+    NkLogInfo ("  tag                bytes  objects\n");
+    for (int i = 0; i < MM_TAG_MAX; ++i)
+    {
+        MmTagCount_t count;
+        MmGetTagCount (i, &count);
+        NkLogInfo ("  %-8s  %14lld  %7lld\n",
+                   mmTagNames[i],
+                   (long long) count.bytes,
+                   (long long) count.objs);
+    }
+    if (__atomic_load_n (&mmLeakOn, __ATOMIC_ACQUIRE))
+        mmLeakDump();
+}
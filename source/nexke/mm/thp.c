@@ -0,0 +1,251 @@
+/*
+    thp.c - contains transparent huge pages
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/task.h>
+
+#ifdef MUL_LARGE_PAGESZ
+// Anonymous memory is backed by large pages where it can be. A write fault in an aligned range
+// that has nothing in it yet brings in a whole large page, and a daemon goes looking for ranges
+// that got filled one page at a time, copying them into a large page
+// Huge pages are kept resident, as the MUL doesn't track large mappings in mapping lists, so
+// there would be no way to unmap them to page them out
+
+#define MM_THP_INTERVAL  (PLT_NS_IN_SEC)            // Time between collapse passes
+#define MM_THP_COLLAPSES 8                          // Most ranges collapsed in a pass
+#define MM_THP_SCAN      (MUL_LARGE_PAGES * 512)    // Most pages looked at in a pass
+
+static bool mmThpEnabled = false;
+
+// What's left of this pass
+static int mmThpCollapses = 0;
+static long mmThpScan = 0;
+
+static NkStat_t mmStatThpFaults = {.name = "mm.thp_faults", .type = NK_STAT_COUNTER};
+static NkStat_t mmStatThpCollapses = {.name = "mm.thp_collapses", .type = NK_STAT_COUNTER};
+
+// Checks if obj can have huge pages
+static inline bool mmThpObjOk (MmObject_t* obj)
+{
+    // Shadows see pages of their parents, and compressed pages would have to come back first
+    return obj->backend == MM_BACKEND_ANON && !obj->parent && !obj->backendData &&
+           (obj->perm & MUL_PAGE_RW);
+}
+
+// Gets how many bytes of obj an entry of count pages can use
+static inline size_t mmThpLimit (MmObject_t* obj, size_t count)
+{
+    return ((count < obj->count) ? count : obj->count) * NEXKE_CPU_PAGESZ;
+}
+
+// Tries to fault in a large page around vaddr
+bool MmThpFault (MmSpace_t* space,
+                 MmObject_t* obj,
+                 uintptr_t base,
+                 size_t count,
+                 uintptr_t vaddr,
+                 int prot)
+{
+    uintptr_t start = vaddr & ~(MUL_LARGE_PAGESZ - 1);
+    size_t off = start - base;
+    // Reads are served by the zero page, so only writes that find nothing mapped qualify
+    if (!mmThpEnabled || space == MmGetKernelSpace() || !(prot & MUL_PAGE_RW) ||
+        (prot & MUL_PAGE_P) || start < base || (off + MUL_LARGE_PAGESZ) > mmThpLimit (obj, count) ||
+        !mmThpObjOk (obj))
+    {
+        return false;
+    }
+    // Make sure there's nothing in the range already
+    size_t pageOff = off;
+    if (MmLookupPageNext (obj, &pageOff) && pageOff < (off + MUL_LARGE_PAGESZ))
+        return false;
+    // Don't break up large blocks when memory is tight
+    if (MmGetPageShortage())
+        return false;
+    MmPage_t* pages = MmAllocPagesAt (MUL_LARGE_PAGES, 0, MUL_LARGE_PAGESZ);
+    if (!pages)
+        return false;
+    for (int i = 0; i < MUL_LARGE_PAGES; ++i)
+    {
+        MmPage_t* page = &pages[i];
+        MmLockPage (page);
+        page->flags |= MM_PAGE_HUGE;
+        MmAddPage (obj, off + (i * NEXKE_CPU_PAGESZ), page);
+        MmBackendPageIn (obj, off + (i * NEXKE_CPU_PAGESZ), page);
+        MmUnlockPage (page);
+    }
+    MmMulMapPage (space, start, pages, obj->perm | MUL_PAGE_LARGE);
+    NkStatInc (&mmStatThpFaults);
+    return true;
+}
+
+// Checks if every page of the range at off in obj is resident and can be moved
+// Object must be locked
+static bool mmThpCanCollapse (MmObject_t* obj, size_t off)
+{
+    for (int i = 0; i < MUL_LARGE_PAGES; ++i)
+    {
+        MmPage_t* page = MmLookupPage (obj, off + (i * NEXKE_CPU_PAGESZ));
+        if (!page || page->fixCount ||
+            (page->flags & (MM_PAGE_GUARD | MM_PAGE_FIXED | MM_PAGE_HUGE)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies the range at off in obj into a large page, and maps it at start
+// Space must be locked for reading
+static bool mmThpCollapse (MmSpace_t* space, MmObject_t* obj, uintptr_t start, size_t off)
+{
+    NkSpinLock (&obj->lock);
+    bool ok = mmThpCanCollapse (obj, off);
+    NkSpinUnlock (&obj->lock);
+    if (!ok || MmGetPageShortage())
+        return false;
+    // Don't hold up faults on obj while allocating
+    MmPage_t* pages = MmAllocPagesAt (MUL_LARGE_PAGES, 0, MUL_LARGE_PAGESZ);
+    if (!pages)
+        return false;
+    NkSpinLock (&obj->lock);
+    if (!mmThpCanCollapse (obj, off))
+    {
+        NkSpinUnlock (&obj->lock);
+        MmFreePages (pages, MUL_LARGE_PAGES);
+        return false;
+    }
+    // Nobody else has obj, so this takes the pages out of every space at once
+    // Faults in the range wait on the object until the new pages are in
+    MmMulUnmapRange (space, start, MUL_LARGE_PAGES);
+    for (int i = 0; i < MUL_LARGE_PAGES; ++i)
+    {
+        size_t pageOff = off + (i * NEXKE_CPU_PAGESZ);
+        MmPage_t* page = MmLookupPage (obj, pageOff);
+        MmLockPage (page);
+        // If a page got fixed since we looked, leave the rest be. Pages already moved just get
+        // faulted back in as small pages
+        if (page->fixCount)
+        {
+            MmUnlockPage (page);
+            NkSpinUnlock (&obj->lock);
+            for (; i < MUL_LARGE_PAGES; ++i)
+                MmFreePage (&pages[i]);
+            return false;
+        }
+        MmMulCopyPage (&pages[i], page);
+        MmRemovePage (page);
+        MmUnlockPage (page);
+        MmFreePage (page);
+        MmLockPage (&pages[i]);
+        pages[i].flags |= MM_PAGE_HUGE;
+        MmAddPage (obj, pageOff, &pages[i]);
+        MmUnlockPage (&pages[i]);
+    }
+    MmMulMapPage (space, start, pages, obj->perm | MUL_PAGE_LARGE);
+    NkSpinUnlock (&obj->lock);
+    NkStatInc (&mmStatThpCollapses);
+    return true;
+}
+
+// Collapses ranges of entry that were filled with small pages
+// Space must be locked for reading
+static void mmThpScanEntry (MmSpace_t* space, MmSpaceEntry_t* entry)
+{
+    MmObject_t* obj = entry->obj;
+    // Pages of objects that are shared could be mapped in other spaces as well
+    if (!mmThpObjOk (obj) || obj->refCount != 1)
+        return;
+    size_t limit = mmThpLimit (obj, entry->count);
+    // Ranges have to be aligned in the address space, not the object
+    uintptr_t first = (entry->vaddr + (MUL_LARGE_PAGESZ - 1)) & ~(MUL_LARGE_PAGESZ - 1);
+    size_t off = first - entry->vaddr;
+    while ((off + MUL_LARGE_PAGESZ) <= limit && mmThpCollapses > 0 && mmThpScan > 0)
+    {
+        // Skip ranges that have nothing in them
+        size_t pageOff = off;
+        if (!MmLookupPageNext (obj, &pageOff))
+            return;
+        if (pageOff >= (off + MUL_LARGE_PAGESZ))
+        {
+            off += ((pageOff - off) / MUL_LARGE_PAGESZ) * MUL_LARGE_PAGESZ;
+            continue;
+        }
+        mmThpScan -= MUL_LARGE_PAGES;
+        if (mmThpCollapse (space, obj, entry->vaddr + off, off))
+            --mmThpCollapses;
+        off += MUL_LARGE_PAGESZ;
+    }
+}
+
+// Collapses ranges in space
+static void mmThpScanSpace (MmSpace_t* space, void*)
+{
+    NkRwReadLock (&space->lock);
+    MmSpaceEntry_t* entry = space->entryList->next;
+    while (entry->vaddr != space->endAddr && mmThpCollapses > 0 && mmThpScan > 0)
+    {
+        mmThpScanEntry (space, entry);
+        entry = entry->next;
+    }
+    NkRwReadUnlock (&space->lock);
+}
+
+// Collapse daemon
+static void mmThpDaemon (void*)
+{
+    for (;;)
+    {
+        TskSleepThread (MM_THP_INTERVAL);
+        mmThpCollapses = MM_THP_COLLAPSES;
+        mmThpScan = MM_THP_SCAN;
+        MmForEachSpace (mmThpScanSpace, NULL);
+    }
+}
+
+// Starts using huge pages
+void MmInitThp()
+{
+    if (NkReadArg ("-nothp"))
+        return;
+    NkStatRegister (&mmStatThpFaults);
+    NkStatRegister (&mmStatThpCollapses);
+    mmThpEnabled = true;
+    NkThread_t* thread =
+        TskCreateThread (mmThpDaemon, NULL, "MmThpDaemon", TSK_POLICY_NORMAL, TSK_PRIO_WORKER, 0);
+    if (!thread)
+        NkPanicOom();
+    TskStartThread (thread);
+}
+#else
+// Without large pages there's nothing to do
+bool MmThpFault (MmSpace_t* space,
+                 MmObject_t* obj,
+                 uintptr_t base,
+                 size_t count,
+                 uintptr_t vaddr,
+                 int prot)
+{
+    return false;
+}
+
+void MmInitThp()
+{
+}
+#endif
@@ -0,0 +1,251 @@
+/*
+    tlb.c - contains TLB shootdown
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu/ptab.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+
+// Shootdown protocol
+// Every CPU has a mailbox other CPUs post invalidations into. Posting merges with whatever is
+// already pending, so a CPU that's slow to respond ends up doing one wider flush instead of
+// getting an IPI for every request. The initiator batches a whole gather into one request, sends
+// one IPI to each CPU using the space, and waits for them to finish
+// Lazy CPUs (idle, or otherwise not using user mappings) get the request posted without an IPI,
+// and drain their mailbox before they use user mappings again
+// Kernel space invalidations may also be deferred. A deferred invalidation just bumps a
+// generation, and each CPU flushes everything once it sees a new generation when it switches
+// spaces
+
+// Shootdown mailbox
+typedef struct _mmtlbmail
+{
+    MmSpace_t* space;    // Space with pending invalidations, NULL if there are none
+    uintptr_t start;     // Range to invalidate
+    uintptr_t end;
+    bool flushAll;       // If more than the range may be flushed
+    atomic_t reqGen;     // Number of requests posted
+    atomic_t doneGen;    // Number of requests completed
+    spinlock_t lock;     // Lock on mailbox
+} mmTlbMail_t;
+
+static mmTlbMail_t mmTlbMail[NEXKE_MAX_CPUS] = {0};
+
+// CPU masks
+static atomic_t mmOnlineCpus = 1;    // CPUs taking part in shootdowns, the BSP always is
+static atomic_t mmLazyCpus = 0;      // CPUs that are lazy
+
+// Kernel space deferral generations
+static atomic_t mmKernelGen = 0;                       // Latest deferred generation
+static atomic_t mmKernelSeen[NEXKE_MAX_CPUS] = {0};    // Generation each CPU has flushed
+
+// Flushes range of space on this CPU
+static void mmTlbFlushLocal (MmSpace_t* space, uintptr_t start, uintptr_t end, bool flushAll)
+{
+    MmTlbGather_t gather;
+    MmPtabInitGather (&gather, space);
+    gather.start = start;
+    gather.end = end;
+    size_t pages = (end - start) >> NEXKE_CPU_PAGE_SHIFT;
+    if (flushAll || pages > MM_GATHER_FLUSH_MAX)
+        gather.flushAll = true;
+    else
+    {
+        for (uintptr_t addr = start; addr < end; addr += NEXKE_CPU_PAGESZ)
+        {
+            gather.entries[gather.count].addr = addr;
+            gather.entries[gather.count].page = NULL;
+            ++gather.count;
+        }
+    }
+    MmMulFlushGather (&gather);
+}
+
+// Posts request to CPU's mailbox, returns generation to wait for
+static atomic_t mmTlbPost (int cpu,
+                           MmSpace_t* space,
+                           uintptr_t start,
+                           uintptr_t end,
+                           bool flushAll)
+{
+    mmTlbMail_t* mail = &mmTlbMail[cpu];
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&mail->lock);
+    if (!mail->space)
+    {
+        mail->space = space;
+        mail->start = start;
+        mail->end = end;
+        mail->flushAll = flushAll;
+    }
+    else if (mail->space == space)
+    {
+        // Widen pending request
+        if (start < mail->start)
+            mail->start = start;
+        if (end > mail->end)
+            mail->end = end;
+        mail->flushAll |= flushAll;
+    }
+    else
+    {
+        // Requests for two spaces are pending, just flush everything
+        mail->space = MmGetKernelSpace();
+        mail->start = 0;
+        mail->end = (uintptr_t) -1;
+        mail->flushAll = true;
+    }
+    atomic_t gen = NkAtomicAdd (&mail->reqGen, 1);
+    NkSpinUnlock (&mail->lock);
+    PltLowerIpl (ipl);
+    return gen;
+}
+
+// Services requests posted to this CPU
+static void mmTlbDrain (NkCcb_t* ccb)
+{
+    mmTlbMail_t* mail = &mmTlbMail[ccb->cpuNum];
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&mail->lock);
+    MmSpace_t* space = mail->space;
+    uintptr_t start = mail->start;
+    uintptr_t end = mail->end;
+    bool flushAll = mail->flushAll;
+    atomic_t gen = NkAtomicLoad (&mail->reqGen);
+    mail->space = NULL;
+    NkSpinUnlock (&mail->lock);
+    if (space)
+        mmTlbFlushLocal (space, start, end, flushAll);
+    NkAtomicStore (&mail->doneGen, gen);
+    PltLowerIpl (ipl);
+}
+
+// Invalidates [start, end) of space on every other CPU using it
+void MmTlbShootdown (MmSpace_t* space, uintptr_t start, uintptr_t end, bool flushAll)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    bool isKernel = (space == MmGetKernelSpace());
+    // Kernel mappings are visible to every online CPU
+    atomic_t targets = 0;
+    if (isKernel)
+        targets = NkAtomicLoad (&mmOnlineCpus);
+    else
+        targets = NkAtomicLoad (&space->activeCpus);
+    targets &= ~(1L << ccb->cpuNum);
+    if (!targets)
+        return;    // Nobody else to tell, the usual case
+    // Post requests first, and then IPI everybody who needs it
+    // Lazy CPUs have to check their mailbox before using user mappings, so they can wait
+    // Note that a CPU ending laziness clears its bit before draining, so it can't miss a request
+    atomic_t gens[NEXKE_MAX_CPUS];
+    atomic_t waitCpus = 0;
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+    {
+        if (!(targets & (1L << i)))
+            continue;
+        gens[i] = mmTlbPost (i, space, start, end, flushAll);
+        if (!isKernel && (NkAtomicLoad (&mmLazyCpus) & (1L << i)))
+            continue;
+        PltSendIpi (i, PLT_IPI_TLB);
+        waitCpus |= 1L << i;
+    }
+    // Wait for them to finish
+    // Keep servicing our own mailbox while we wait, so that two CPUs shooting each other down
+    // don't deadlock
+    while (waitCpus)
+    {
+        for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+        {
+            if ((waitCpus & (1L << i)) && NkAtomicLoad (&mmTlbMail[i].doneGen) >= gens[i])
+                waitCpus &= ~(1L << i);
+        }
+        mmTlbDrain (ccb);
+        CpuSpin();
+    }
+}
+
+// Defers an invalidation of kernel space
+atomic_t MmTlbDeferKernel()
+{
+    return NkAtomicAdd (&mmKernelGen, 1);
+}
+
+// Makes sure every CPU has flushed kernel invalidations deferred up to gen
+void MmTlbSyncKernel (atomic_t gen)
+{
+    MmTlbSync();
+    // Check if anyone is behind
+    atomic_t online = NkAtomicLoad (&mmOnlineCpus);
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+    {
+        if ((online & (1L << i)) && NkAtomicLoad (&mmKernelSeen[i]) < gen)
+        {
+            // Force stragglers to flush now
+            MmTlbShootdown (MmGetKernelSpace(), 0, (uintptr_t) -1, true);
+            return;
+        }
+    }
+}
+
+// Catches this CPU up on invalidations it has missed
+void MmTlbSync()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    // Flush everything if kernel invalidations were deferred
+    atomic_t gen = NkAtomicLoad (&mmKernelGen);
+    if (NkAtomicLoad (&mmKernelSeen[ccb->cpuNum]) != gen)
+    {
+        MmMulFlushTlb();
+        NkAtomicStore (&mmKernelSeen[ccb->cpuNum], gen);
+    }
+    mmTlbDrain (ccb);
+}
+
+// Sets whether this CPU is lazy
+void MmTlbSetLazy (bool lazy)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    atomic_t self = 1L << ccb->cpuNum;
+    // This gets called on every switch, so skip the atomics if nothing changes
+    if (!!(NkAtomicLoad (&mmLazyCpus) & self) == lazy)
+        return;
+    if (lazy)
+        NkAtomicOr (&mmLazyCpus, self);
+    else
+    {
+        // Clear our bit first so every request after this gets an IPI, then catch up
+        NkAtomicAnd (&mmLazyCpus, ~self);
+        mmTlbDrain (ccb);
+    }
+}
+
+// Lets this CPU take part in shootdowns
+void MmTlbCpuOnline()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    // Shootdowns from before we were online went past us, so flush everything once we are
+    NkAtomicOr (&mmOnlineCpus, 1L << ccb->cpuNum);
+    atomic_t gen = NkAtomicLoad (&mmKernelGen);
+    MmMulFlushTlb();
+    NkAtomicStore (&mmKernelSeen[ccb->cpuNum], gen);
+}
+
+// Handles shootdown IPI
+void MmTlbIpi()
+{
+    mmTlbDrain (CpuGetCcb());
+}
@@ -0,0 +1,305 @@
+/*
+    zpool.c - contains compressed page pool
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <string.h>
+
+// Anonymous memory has no swap device to be paged out to, so evicted pages are compressed with
+// LZ4 and kept in memory instead. Compressed pages go in slab caches of a few sizes, and pages
+// that are one value repeated only keep that value. Pages that don't shrink by at least a quarter
+// aren't worth it, and stay resident
+// Entries are found by object and offset through a hash table. Each object's entries are also
+// linked off of its backend data, so they can be found when it goes away. Entries of an object
+// are only added or removed with the object locked
+
+#define MM_ZPOOL_CLASSES 24    // Size classes of compressed pages
+#define MM_ZPOOL_HASH    1024  // Buckets in hash table
+
+// Size difference between classes, and biggest a compressed page can be
+#define MM_ZPOOL_STEP ((NEXKE_CPU_PAGESZ * 3) / (4 * MM_ZPOOL_CLASSES))
+#define MM_ZPOOL_MAX  (MM_ZPOOL_STEP * MM_ZPOOL_CLASSES)
+
+typedef struct _mmzentry
+{
+    struct _mmzentry* next;       // Next entry in hash bucket
+    struct _mmzentry* objNext;    // Next entry of object
+    struct _mmzentry* objPrev;    // Previous entry of object
+    MmObject_t* obj;              // Object page belongs to
+    size_t offset;                // Offset of page in object
+    uintptr_t fill;               // Value page is filled with, if size is 0
+    uint32_t size;                // Size of compressed data
+    int cls;                      // Size class entry came from
+    uint8_t data[];               // Compressed data
+} MmZEntry_t;
+
+typedef struct _mmzbucket
+{
+    MmZEntry_t* head;
+    spinlock_t lock;
+} MmZBucket_t;
+
+// Where pages are compressed
+typedef struct _mmzwork
+{
+    uint32_t table[NK_LZ4_TABLE_SZ];    // LZ4 hash table
+    uint8_t out[MM_ZPOOL_MAX];          // Compressed data
+    size_t size;                        // Size of compressed data, 0 if it didn't fit
+    uintptr_t fill;                     // Fill value if page is one value
+    bool same;                          // Whether page is one value
+} MmZWork_t;
+
+// Class 0 is for entries without data
+static SlabCache_t* mmZpoolCaches[MM_ZPOOL_CLASSES + 1] = {0};
+static MmZBucket_t mmZpoolHash[MM_ZPOOL_HASH] = {0};
+
+// Only the pageout daemon compresses, so one work area is enough
+static MmZWork_t mmZpoolWork = {0};
+static spinlock_t mmZpoolWorkLock = 0;
+
+// Stats
+static size_t mmZpoolPages = 0;    // Pages stored
+static size_t mmZpoolSame = 0;     // Pages stored as a fill value
+static size_t mmZpoolBytes = 0;    // Bytes of compressed data
+
+// Gets bucket of object/offset
+static FORCEINLINE MmZBucket_t* mmZpoolBucket (MmObject_t* obj, size_t off)
+{
+    size_t key = ((uintptr_t) obj >> 6) + (off >> NEXKE_CPU_PAGE_SHIFT);
+    return &mmZpoolHash[key % MM_ZPOOL_HASH];
+}
+
+// Finds entry of object/offset
+// Bucket must be locked
+static MmZEntry_t* mmZpoolFind (MmZBucket_t* bucket, MmObject_t* obj, size_t off)
+{
+    MmZEntry_t* ent = bucket->head;
+    while (ent && !(ent->obj == obj && ent->offset == off))
+        ent = ent->next;
+    return ent;
+}
+
+// Adds entry to the hash table and its object
+static void mmZpoolInsert (MmZEntry_t* ent)
+{
+    MmZBucket_t* bucket = mmZpoolBucket (ent->obj, ent->offset);
+    NkSpinLock (&bucket->lock);
+    ent->next = bucket->head;
+    bucket->head = ent;
+    NkSpinUnlock (&bucket->lock);
+    MmZEntry_t* head = ent->obj->backendData;
+    ent->objPrev = NULL;
+    ent->objNext = head;
+    if (head)
+        head->objPrev = ent;
+    ent->obj->backendData = ent;
+}
+
+// Takes entry out of the hash table and its object
+static void mmZpoolUnlink (MmZEntry_t* ent)
+{
+    MmZBucket_t* bucket = mmZpoolBucket (ent->obj, ent->offset);
+    NkSpinLock (&bucket->lock);
+    MmZEntry_t** link = &bucket->head;
+    while (*link != ent)
+        link = &(*link)->next;
+    *link = ent->next;
+    NkSpinUnlock (&bucket->lock);
+    if (ent->objPrev)
+        ent->objPrev->objNext = ent->objNext;
+    else
+        ent->obj->backendData = ent->objNext;
+    if (ent->objNext)
+        ent->objNext->objPrev = ent->objPrev;
+}
+
+// Frees an entry that has been unlinked
+static void mmZpoolFree (MmZEntry_t* ent)
+{
+    NkSpinLock (&mmZpoolWorkLock);
+    --mmZpoolPages;
+    if (!ent->size)
+        --mmZpoolSame;
+    mmZpoolBytes -= ent->size;
+    NkSpinUnlock (&mmZpoolWorkLock);
+    MmCacheFree (mmZpoolCaches[ent->cls], ent);
+}
+
+// Compresses a page into the work area
+static void mmZpoolCompress (void* data, void* arg)
+{
+    MmZWork_t* work = arg;
+    // Pages of one value repeated don't need compressing
+    uintptr_t* words = data;
+    size_t i = 1;
+    while (i < (NEXKE_CPU_PAGESZ / sizeof (uintptr_t)) && words[i] == words[0])
+        ++i;
+    work->same = (i == (NEXKE_CPU_PAGESZ / sizeof (uintptr_t)));
+    if (work->same)
+    {
+        work->fill = words[0];
+        work->size = 0;
+        return;
+    }
+    work->size = NkLz4Compress (data, NEXKE_CPU_PAGESZ, work->out, MM_ZPOOL_MAX, work->table);
+}
+
+// Restores a page from its entry
+static void mmZpoolDecompress (void* data, void* arg)
+{
+    MmZEntry_t* ent = arg;
+    if (!ent->size)
+    {
+        uintptr_t* words = data;
+        for (size_t i = 0; i < (NEXKE_CPU_PAGESZ / sizeof (uintptr_t)); ++i)
+            words[i] = ent->fill;
+        return;
+    }
+    if (NkLz4Decompress (ent->data, ent->size, data, NEXKE_CPU_PAGESZ) != NEXKE_CPU_PAGESZ)
+        NkPanic ("nexke: compressed page is corrupt\n");
+}
+
+// Sets up the compressed page pool
+void MmInitZpool()
+{
+    for (int i = 0; i <= MM_ZPOOL_CLASSES; ++i)
+    {
+        mmZpoolCaches[i] = MmCacheCreate (sizeof (MmZEntry_t) + (i * MM_ZPOOL_STEP),
+                                          "MmZEntry_t",
+                                          MM_TAG_MM,
+                                          0,
+                                          0);
+        if (!mmZpoolCaches[i])
+            NkPanicOom();
+    }
+}
+
+// Compresses page and stores it as obj/off
+bool MmZpoolStore (MmObject_t* obj, size_t off, MmPage_t* page)
+{
+    assert (obj->backend == MM_BACKEND_ANON);
+    NkSpinLock (&mmZpoolWorkLock);
+    MmMulAccessPage (page, mmZpoolCompress, &mmZpoolWork);
+    if (!mmZpoolWork.same && !mmZpoolWork.size)
+    {
+        NkSpinUnlock (&mmZpoolWorkLock);
+        return false;    // Not worth keeping compressed
+    }
+    int cls = (mmZpoolWork.size + MM_ZPOOL_STEP - 1) / MM_ZPOOL_STEP;
+    MmZEntry_t* ent = MmCacheAlloc (mmZpoolCaches[cls]);
+    if (!ent)
+    {
+        NkSpinUnlock (&mmZpoolWorkLock);
+        return false;
+    }
+    ent->obj = obj;
+    ent->offset = off;
+    ent->fill = mmZpoolWork.fill;
+    ent->size = mmZpoolWork.size;
+    ent->cls = cls;
+    memcpy (ent->data, mmZpoolWork.out, ent->size);
+    ++mmZpoolPages;
+    if (!ent->size)
+        ++mmZpoolSame;
+    mmZpoolBytes += ent->size;
+    NkSpinUnlock (&mmZpoolWorkLock);
+    mmZpoolInsert (ent);
+    return true;
+}
+
+// Restores obj/off into page, and drops it from the pool
+bool MmZpoolLoad (MmObject_t* obj, size_t off, MmPage_t* page)
+{
+    if (obj->backend != MM_BACKEND_ANON || !obj->backendData)
+        return false;
+    MmZBucket_t* bucket = mmZpoolBucket (obj, off);
+    NkSpinLock (&bucket->lock);
+    MmZEntry_t* ent = mmZpoolFind (bucket, obj, off);
+    NkSpinUnlock (&bucket->lock);
+    if (!ent)
+        return false;
+    MmMulAccessPage (page, mmZpoolDecompress, ent);
+    mmZpoolUnlink (ent);
+    mmZpoolFree (ent);
+    return true;
+}
+
+// Checks if obj/off is in the pool
+bool MmZpoolHas (MmObject_t* obj, size_t off)
+{
+    // Most objects never get anything compressed, so check that first
+    if (obj->backend != MM_BACKEND_ANON || !obj->backendData)
+        return false;
+    MmZBucket_t* bucket = mmZpoolBucket (obj, off);
+    NkSpinLock (&bucket->lock);
+    bool res = mmZpoolFind (bucket, obj, off) != NULL;
+    NkSpinUnlock (&bucket->lock);
+    return res;
+}
+
+// Moves pages of parent that obj can see into obj
+void MmZpoolCollapse (MmObject_t* obj, MmObject_t* parent)
+{
+    size_t end = obj->parentOff + (obj->count * NEXKE_CPU_PAGESZ);
+    MmZEntry_t* ent = (parent->backend == MM_BACKEND_ANON) ? parent->backendData : NULL;
+    while (ent)
+    {
+        MmZEntry_t* next = ent->objNext;
+        if (ent->offset >= obj->parentOff && ent->offset < end)
+        {
+            // Pages obj already has a copy of can't be seen through it, and go with parent
+            size_t childOff = ent->offset - obj->parentOff;
+            if (!MmLookupPage (obj, childOff) && !MmZpoolHas (obj, childOff))
+            {
+                mmZpoolUnlink (ent);
+                ent->obj = obj;
+                ent->offset = childOff;
+                mmZpoolInsert (ent);
+            }
+        }
+        ent = next;
+    }
+}
+
+// Frees every page obj has in the pool
+void MmZpoolFreeObject (MmObject_t* obj)
+{
+    assert (obj->backend == MM_BACKEND_ANON);
+    while (obj->backendData)
+    {
+        MmZEntry_t* ent = obj->backendData;
+        mmZpoolUnlink (ent);
+        mmZpoolFree (ent);
+    }
+}
+
+// Dumps the state of the pool
+void MmZpoolDump()
+{
+    NkSpinLock (&mmZpoolWorkLock);
+    size_t pages = mmZpoolPages;
+    size_t same = mmZpoolSame;
+    size_t bytes = mmZpoolBytes;
+    NkSpinUnlock (&mmZpoolWorkLock);
+    NkLogDebug ("Pages in compressed pool: %llu, filled with one value: %llu\n",
+                (unsigned long long) pages,
+                (unsigned long long) same);
+    NkLogDebug ("Compressed data: %llu KiB, holding %llu KiB\n",
+                (unsigned long long) (bytes / 1024),
+                (unsigned long long) (((pages - same) * NEXKE_CPU_PAGESZ) / 1024));
+}
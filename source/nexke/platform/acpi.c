@@ -22,7 +22,6 @@
 #include <nexke/platform.h>
 #include <string.h>
 
-static SlabCache_t* acpiCache = NULL;
 static SlabCache_t* cpuCache = NULL;
 static SlabCache_t* intCache = NULL;
 static SlabCache_t* intCtrlCache = NULL;
@@ -48,6 +47,9 @@ static uint32_t overFlowRead = 0;
 // Is counter 32 bit?
 static bool is32Bit = false;
 
+// Have tables been copied out of firmware memory?
+static bool tablesCached = false;
+
 #define ACPI_PM_FREQ 3579545
 
 // Initializes ACPI
@@ -77,160 +79,204 @@ bool PltAcpiInit()
     memcpy (&PltGetPlatform()->rsdp, rsdp, sizeof (AcpiRsdp_t));
     // Say we are ACPI
     PltGetPlatform()->subType = PLT_PC_SUBTYPE_ACPI;
-    // Setup cache
-    acpiCache = MmCacheCreate (sizeof (AcpiCacheEnt_t), "AcpiCacheEnt_t", 0, 0);
-    assert (acpiCache);
+    // Pages can't be mapped yet, so the table directory gets built on the first lookup
     return true;
 }
 
-// Finds entry in table cache
-static AcpiCacheEnt_t* pltAcpiFindCache (const char* sig)
+// Maps len bytes of firmware memory at phys
+static void* pltAcpiMap (paddr_t phys, size_t len)
 {
-    AcpiCacheEnt_t* curEnt = PltGetPlatform()->tableCache;
-    NkSpinLock (&PltGetPlatform()->acpiCacheLock);
-    while (curEnt)
-    {
-        if (!memcmp (curEnt->table->sig, sig, 4))    // Check signature
-        {
-            NkSpinUnlock (&PltGetPlatform()->acpiCacheLock);
-            return curEnt;
-        }
-        curEnt = curEnt->next;
-    }
-    NkSpinUnlock (&PltGetPlatform()->acpiCacheLock);
-    return NULL;    // Table not cached
+    size_t numPages = CpuPageAlignUp ((phys % NEXKE_CPU_PAGESZ) + len) / NEXKE_CPU_PAGESZ;
+    void* virt = MmAllocKvMmio (phys, numPages, MUL_PAGE_KE | MUL_PAGE_R);
+    if (!virt)
+        NkPanicOom();
+    return virt;
 }
 
-// Caches ACPI table
-static void pltAcpiCacheTable (AcpiSdt_t* sdt)
+// Adds table at phys to directory
+static void pltAcpiAddDirEnt (AcpiTableDir_t* dir, paddr_t phys)
 {
-    // Create cache entry
-    AcpiCacheEnt_t* cacheEnt = MmCacheAlloc (acpiCache);
-    if (!cacheEnt)
-        NkPanicOom();
-    cacheEnt->table = sdt;
-    NkSpinLock (&PltGetPlatform()->acpiCacheLock);
-    cacheEnt->next = PltGetPlatform()->tableCache;
-    PltGetPlatform()->tableCache = cacheEnt;
-    NkSpinUnlock (&PltGetPlatform()->acpiCacheLock);
+    AcpiSdt_t* sdt = pltAcpiMap (phys, sizeof (AcpiSdt_t));
+    AcpiDirEnt_t* ent = &dir->ents[dir->numEnts++];
+    memcpy (&ent->sig, sdt->sig, 4);
+    ent->len = sdt->length;
+    ent->phys = phys;
+    ent->table = NULL;
+    ent->bad = false;
+    MmFreeKvMmio (sdt);
 }
 
-// Gets table from firmware
-static paddr_t pltAcpiFindTableFw (const char* sig, uint32_t* len)
+// Builds the table directory from the XSDT or RSDT
+// Only table headers are read, bodies are mapped when they are first looked up
+static AcpiTableDir_t* pltAcpiBuildDir()
 {
-    // Special case for RSDT or XSDT
-    if (!strcmp (sig, "XSDT"))
+    AcpiRsdp_t* rsdp = &PltGetPlatform()->rsdp;
+    bool isXsdt = rsdp->rev >= 2 && rsdp->xsdtAddr;
+    paddr_t rootPhys = (isXsdt) ? (paddr_t) rsdp->xsdtAddr : (paddr_t) rsdp->rsdtAddr;
+    AcpiSdt_t* root = pltAcpiMap (rootPhys, sizeof (AcpiSdt_t));
+    uint32_t rootLen = root->length;
+    MmFreeKvMmio (root);
+    root = pltAcpiMap (rootPhys, rootLen);
+    if (!NkVerifyChecksum ((uint8_t*) root, rootLen))
     {
-        // Get from RSDP
-        AcpiRsdp_t* rsdp = &PltGetPlatform()->rsdp;
-        if (rsdp->rev < 2)
-            return 0;
-        // Map it so we have the length
-        AcpiSdt_t* sdt = MmAllocKvMmio (rsdp->xsdtAddr, 1, MUL_PAGE_KE | MUL_PAGE_R);
-        if (!sdt)
-            NkPanicOom();
-        *len = sdt->length;
-        MmFreeKvMmio (sdt);
-        return (paddr_t) rsdp->xsdtAddr;
+        MmFreeKvMmio (root);
+        return NULL;
     }
-    else if (!strcmp (sig, "RSDT"))
+    size_t entSz = (isXsdt) ? sizeof (uint64_t) : sizeof (uint32_t);
+    size_t numTables = (rootLen - sizeof (AcpiSdt_t)) / entSz;
+    // Allocate directory, with room for the root table itself
+    size_t dirSz = sizeof (AcpiTableDir_t) + (numTables + 1) * sizeof (AcpiDirEnt_t);
+    AcpiTableDir_t* dir = kmalloc (dirSz, MM_TAG_PLATFORM);
+    if (!dir)
+        NkPanicOom();
+    dir->numEnts = 0;
+    dir->sz = dirSz;
+    // The root table is already mapped, so keep it
+    AcpiDirEnt_t* rootEnt = &dir->ents[dir->numEnts++];
+    memcpy (&rootEnt->sig, root->sig, 4);
+    rootEnt->len = rootLen;
+    rootEnt->phys = rootPhys;
+    rootEnt->table = root;
+    rootEnt->bad = false;
+    for (int i = 0; i < numTables; ++i)
     {
-        // Map it so we have the length
-        AcpiSdt_t* sdt =
-            MmAllocKvMmio (PltGetPlatform()->rsdp.rsdtAddr, 1, MUL_PAGE_KE | MUL_PAGE_R);
-        if (!sdt)
-            NkPanicOom();
-        *len = sdt->length;
-        MmFreeKvMmio (sdt);
-        return PltGetPlatform()->rsdp.rsdtAddr;
+        paddr_t table = 0;
+        if (isXsdt)
+            table = (paddr_t) ((uint64_t*) (root + 1))[i];
+        else
+            table = (paddr_t) ((uint32_t*) (root + 1))[i];
+        if (table)
+            pltAcpiAddDirEnt (dir, table);
     }
-    // Otherwise get the RSDT or XSDT and search it
-    AcpiSdt_t* xsdt = PltAcpiFindTable ("XSDT");
-    if (xsdt)
+    // Sort by signature. Insertion sort is stable, so instances stay in firmware order
+    for (int i = 1; i < dir->numEnts; ++i)
     {
-        // Get number of entries
-        size_t numEntries = (xsdt->length - sizeof (AcpiSdt_t)) / sizeof (uint64_t);
-        uint64_t* tables =
-            (uint64_t*) ((uintptr_t) xsdt + sizeof (AcpiSdt_t));    // Get pointer to table array
-        for (int i = 0; i < numEntries; ++i)
+        AcpiDirEnt_t ent = dir->ents[i];
+        int j = i;
+        while (j && dir->ents[j - 1].sig > ent.sig)
         {
-            paddr_t table = (paddr_t) tables[i];
-            // Map this table
-            AcpiSdt_t* sdt = (AcpiSdt_t*) MmAllocKvMmio (table, 1, MUL_PAGE_KE | MUL_PAGE_R);
-            if (!sdt)
-                NkPanicOom();
-            if (!memcmp (sdt->sig, sig, 4))
-            {
-                // Unmap and return, and set length
-                *len = sdt->length;
-                MmFreeKvMmio (sdt);
-                return table;
-            }
+            dir->ents[j] = dir->ents[j - 1];
+            --j;
         }
+        dir->ents[j] = ent;
+    }
+    NkLogDebug ("nexke: found %d ACPI tables\n", dir->numEnts);
+    return dir;
+}
+
+// Gets the table directory, building it on first use
+static AcpiTableDir_t* pltAcpiGetDir()
+{
+    NkPlatform_t* plt = PltGetPlatform();
+    AcpiTableDir_t* dir = NkRcuDeref (plt->tableDir);
+    // Once firmware memory is reclaimed, the root table is gone
+    if (dir || tablesCached)
+        return dir;
+    NkSpinLock (&plt->acpiDirLock);
+    dir = plt->tableDir;
+    if (!dir)
+    {
+        dir = pltAcpiBuildDir();
+        NkRcuAssign (plt->tableDir, dir);
+    }
+    NkSpinUnlock (&plt->acpiDirLock);
+    return dir;
+}
+
+// Maps the table of a directory entry if it isn't already
+static AcpiSdt_t* pltAcpiMapDirEnt (AcpiDirEnt_t* ent)
+{
+    // Entries are only ever filled in once, so a mapped table can be used straight away
+    AcpiSdt_t* table = NkRcuDeref (ent->table);
+    if (table || ent->bad)
+        return table;
+    table = pltAcpiMap (ent->phys, ent->len);
+    bool bad = !NkVerifyChecksum ((uint8_t*) table, ent->len);
+    NkPlatform_t* plt = PltGetPlatform();
+    NkSpinLock (&plt->acpiDirLock);
+    if (ent->table || ent->bad)
+    {
+        // Someone else beat us to it
+        NkSpinUnlock (&plt->acpiDirLock);
+        MmFreeKvMmio (table);
+        return ent->table;
     }
+    if (bad)
+        ent->bad = true;
     else
+        NkRcuAssign (ent->table, table);
+    NkSpinUnlock (&plt->acpiDirLock);
+    if (bad)
     {
-        AcpiSdt_t* rsdt = PltAcpiFindTable ("RSDT");
-        assert (rsdt);
-        // Get number of entries
-        size_t numEntries = (rsdt->length - sizeof (AcpiSdt_t)) / sizeof (uint32_t);
-        uint32_t* tables =
-            (uint32_t*) ((uintptr_t) rsdt + sizeof (AcpiSdt_t));    // Get pointer to table array
-        for (int i = 0; i < numEntries; ++i)
-        {
-            paddr_t table = (paddr_t) tables[i];
-            // Map this table
-            AcpiSdt_t* sdt = (AcpiSdt_t*) MmAllocKvMmio (table, 1, MUL_PAGE_KE | MUL_PAGE_R);
-            if (!sdt)
-                NkPanicOom();
-            if (!memcmp (sdt->sig, sig, 4))
-            {
-                // Unmap and return
-                *len = sdt->length;
-                MmFreeKvMmio (sdt);
-                return table;
-            }
-        }
+        MmFreeKvMmio (table);
+        return NULL;
     }
-    return 0;
+    return table;
 }
 
-// Finds an ACPI table
-AcpiSdt_t* PltAcpiFindTable (const char* sig)
+// Finds instance inst of an ACPI table
+AcpiSdt_t* PltAcpiFindTableInst (const char* sig, int inst)
 {
     assert (strlen (sig) == 4);
     // Check if this is an ACPI system
     if (PltGetPlatform()->subType != PLT_PC_SUBTYPE_ACPI)
         return NULL;
-    // First we need to check the cache for an entry
-    AcpiCacheEnt_t* ent = pltAcpiFindCache (sig);
-    if (ent)
-        return ent->table;    // We're done
-    // Table not cached, we first need to get the table from the FW
-    // and map, and then add it to the cache
-    uint32_t len = 0;
-    paddr_t tablePhys = pltAcpiFindTableFw (sig, &len);
-    if (!tablePhys)
+    AcpiTableDir_t* dir = pltAcpiGetDir();
+    if (!dir)
         return NULL;
-    // Map it and then copy it
-    AcpiSdt_t* fwTable = MmAllocKvMmio (tablePhys,
-                                        CpuPageAlignUp (len) / NEXKE_CPU_PAGESZ,
-                                        MUL_PAGE_KE | MUL_PAGE_R);
-    if (!fwTable)
-        NkPanicOom();
-    // Check checksum
-    if (!NkVerifyChecksum ((uint8_t*) fwTable, fwTable->length))
+    uint32_t key = 0;
+    memcpy (&key, sig, 4);
+    // Find first entry with this signature
+    int low = 0, high = dir->numEnts;
+    while (low < high)
     {
-        MmFreeKvMmio (fwTable);
+        int mid = (low + high) / 2;
+        if (dir->ents[mid].sig < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    int idx = low + inst;
+    if (inst < 0 || idx >= dir->numEnts || dir->ents[idx].sig != key)
         return NULL;
+    return pltAcpiMapDirEnt (&dir->ents[idx]);
+}
+
+// Finds an ACPI table
+AcpiSdt_t* PltAcpiFindTable (const char* sig)
+{
+    return PltAcpiFindTableInst (sig, 0);
+}
+
+// Copies all tables out of firmware memory, so it can be reclaimed
+// This runs before other CPUs are started, so no one else is looking at the tables
+void PltAcpiCacheTables()
+{
+    if (PltGetPlatform()->subType != PLT_PC_SUBTYPE_ACPI)
+        return;
+    AcpiTableDir_t* dir = pltAcpiGetDir();
+    tablesCached = true;
+    if (!dir)
+        return;
+    size_t cacheSz = 0;
+    for (int i = 0; i < dir->numEnts; ++i)
+    {
+        AcpiDirEnt_t* ent = &dir->ents[i];
+        AcpiSdt_t* table = pltAcpiMapDirEnt (ent);
+        if (!table)
+            continue;
+        AcpiSdt_t* copy = kmalloc (ent->len, MM_TAG_PLATFORM);
+        if (!copy)
+            NkPanicOom();
+        memcpy (copy, table, ent->len);
+        NkRcuAssign (ent->table, copy);
+        MmFreeKvMmio (table);
+        cacheSz += ent->len;
     }
-    AcpiSdt_t* res = MmAllocKvRegion (CpuPageAlignUp (len) / NEXKE_CPU_PAGESZ, MM_KV_NO_DEMAND);
-    if (!res)
-        NkPanicOom();
-    memcpy (res, fwTable, len);
-    MmFreeKvMmio (fwTable);
-    pltAcpiCacheTable (res);
-    return res;
+    // The FADT pointer would still be into the old mapping
+    if (fadt)
+        fadt = (AcpiFadt_t*) PltAcpiFindTable ("FACP");
+    NkLogDebug ("nexke: cached %zu bytes of ACPI tables\n", cacheSz);
 }
 
 // Finds an ACPI table early in the boot process, pre-MM
@@ -276,21 +322,347 @@ AcpiSdt_t* PltAcpiFindTableEarly (const char* sig)
     return NULL;
 }
 
+// Gets node of firmware proximity domain, adding it if it's new
+// Returns -1 if there are too many nodes
+static int pltAcpiAddNode (PltNuma_t* numa, uint32_t domain)
+{
+    for (int i = 0; i < numa->numNodes; ++i)
+    {
+        if (numa->domains[i] == domain)
+            return i;
+    }
+    if (numa->numNodes == NEXKE_MAX_NODES)
+        return -1;
+    numa->domains[numa->numNodes] = domain;
+    return numa->numNodes++;
+}
+
+// Gets node of firmware proximity domain, or 0 if it isn't known
+static int pltAcpiGetNode (uint32_t domain)
+{
+    PltNuma_t* numa = &PltGetPlatform()->numa;
+    for (int i = 0; i < numa->numNodes; ++i)
+    {
+        if (numa->domains[i] == domain)
+            return i;
+    }
+    return 0;
+}
+
+// Gets proximity domain of an SRAT entry, or returns false if it isn't for an enabled CPU or
+// memory range
+static bool pltAcpiGetSratDomain (AcpiMadtEntry_t* ent, uint32_t* domain)
+{
+    if (ent->type == ACPI_SRAT_LAPIC)
+    {
+        AcpiSratLapic_t* lapic = (AcpiSratLapic_t*) ent;
+        *domain = lapic->domainLow | (lapic->domainHigh[0] << 8) | (lapic->domainHigh[1] << 16) |
+                  (lapic->domainHigh[2] << 24);
+        return (lapic->flags & ACPI_SRAT_ENABLED) != 0;
+    }
+    else if (ent->type == ACPI_SRAT_MEM)
+    {
+        AcpiSratMem_t* mem = (AcpiSratMem_t*) ent;
+        *domain = mem->domain;
+        return (mem->flags & ACPI_SRAT_ENABLED) && mem->len;
+    }
+    else if (ent->type == ACPI_SRAT_X2APIC)
+    {
+        AcpiSratX2Apic_t* x2apic = (AcpiSratX2Apic_t*) ent;
+        *domain = x2apic->domain;
+        return (x2apic->flags & ACPI_SRAT_ENABLED) != 0;
+    }
+    else if (ent->type == ACPI_SRAT_GICC)
+    {
+        AcpiSratGicc_t* gicc = (AcpiSratGicc_t*) ent;
+        *domain = gicc->domain;
+        return (gicc->flags & ACPI_SRAT_ENABLED) != 0;
+    }
+    return false;
+}
+
+// Adds memory range to NUMA topology, keeping them sorted
+static void pltAcpiAddMemRange (PltNuma_t* numa, paddr_t base, paddr_t end, int node)
+{
+    if (numa->numRanges == PLT_MAX_MEM_RANGES)
+    {
+        NkLogWarning ("nexke: ignoring memory ranges past limit PLT_MAX_MEM_RANGES\n");
+        return;
+    }
+    int idx = numa->numRanges;
+    while (idx && numa->ranges[idx - 1].base > base)
+    {
+        numa->ranges[idx] = numa->ranges[idx - 1];
+        --idx;
+    }
+    numa->ranges[idx].base = base;
+    numa->ranges[idx].end = end;
+    numa->ranges[idx].node = node;
+    ++numa->numRanges;
+}
+
+// Reads NUMA topology from SRAT and SLIT
+// This runs before the MM is up, so tables are reached through the firmware's mappings
+bool PltAcpiDetectNuma()
+{
+    AcpiSrat_t* srat = (AcpiSrat_t*) PltAcpiFindTableEarly ("SRAT");
+    if (!srat)
+        return false;
+    PltNuma_t* numa = &PltGetPlatform()->numa;
+    // Number nodes and gather memory ranges
+    AcpiMadtEntry_t* cur = (AcpiMadtEntry_t*) (srat + 1);
+    AcpiMadtEntry_t* end = (void*) srat + srat->sdt.length;
+    while (cur < end && cur->length)
+    {
+        uint32_t domain = 0;
+        if (pltAcpiGetSratDomain (cur, &domain))
+        {
+            int node = pltAcpiAddNode (numa, domain);
+            if (node == -1)
+                NkLogWarning ("nexke: ignoring NUMA nodes past limit NEXKE_MAX_NODES\n");
+            else if (cur->type == ACPI_SRAT_MEM)
+            {
+                AcpiSratMem_t* mem = (AcpiSratMem_t*) cur;
+                pltAcpiAddMemRange (numa, mem->base, mem->base + mem->len, node);
+            }
+        }
+        cur = (void*) cur + cur->length;
+    }
+    if (!numa->numNodes)
+        return false;
+    // Get distances between them. Without a SLIT, we only know that other nodes are further
+    AcpiSlit_t* slit = (AcpiSlit_t*) PltAcpiFindTableEarly ("SLIT");
+    for (int i = 0; i < numa->numNodes; ++i)
+    {
+        for (int j = 0; j < numa->numNodes; ++j)
+        {
+            if (i == j)
+                numa->dist[i][j] = PLT_NODE_LOCAL_DIST;
+            else if (slit && numa->domains[i] < slit->numLocalities &&
+                     numa->domains[j] < slit->numLocalities)
+            {
+                numa->dist[i][j] =
+                    slit->dist[(numa->domains[i] * slit->numLocalities) + numa->domains[j]];
+            }
+            else
+                numa->dist[i][j] = PLT_NODE_REMOTE_DIST;
+        }
+    }
+    for (int i = 0; i < numa->numRanges; ++i)
+    {
+        NkLogDebug ("nexke: found memory from %#llX to %#llX in node %d\n",
+                    (uint64_t) numa->ranges[i].base,
+                    (uint64_t) numa->ranges[i].end,
+                    numa->ranges[i].node);
+    }
+    NkLogInfo ("nexke: found %d NUMA nodes\n", numa->numNodes);
+    return true;
+}
+
+// Gets node of CPU from the SRAT
+// APIC CPUs are found by APIC ID, GIC ones by ACPI UID
+static int pltAcpiGetCpuNode (AcpiSrat_t* srat, bool isGic, uint32_t id)
+{
+    if (!srat)
+        return 0;
+    AcpiMadtEntry_t* cur = (AcpiMadtEntry_t*) (srat + 1);
+    AcpiMadtEntry_t* end = (void*) srat + srat->sdt.length;
+    while (cur < end && cur->length)
+    {
+        uint32_t domain = 0;
+        bool match = false;
+        if (!isGic && cur->type == ACPI_SRAT_LAPIC)
+            match = ((AcpiSratLapic_t*) cur)->apicId == id;
+        else if (!isGic && cur->type == ACPI_SRAT_X2APIC)
+            match = ((AcpiSratX2Apic_t*) cur)->x2apicId == id;
+        else if (isGic && cur->type == ACPI_SRAT_GICC)
+            match = ((AcpiSratGicc_t*) cur)->acpiUid == id;
+        if (match && pltAcpiGetSratDomain (cur, &domain))
+            return pltAcpiGetNode (domain);
+        cur = (void*) cur + cur->length;
+    }
+    return 0;
+}
+
+// Gets PPTT structure at off, NULL if it's not in the table
+static void* pltAcpiPpttGet (AcpiSdt_t* pptt, uint32_t off, int type)
+{
+    if (off < sizeof (AcpiSdt_t) || (off + sizeof (AcpiMadtEntry_t)) > pptt->length)
+        return NULL;
+    AcpiMadtEntry_t* ent = (void*) pptt + off;
+    if (ent->type != type || (off + ent->length) > pptt->length)
+        return NULL;
+    // Make sure private resources are in the node
+    if (type == ACPI_PPTT_PROC &&
+        (sizeof (AcpiPpttProc_t) + (((AcpiPpttProc_t*) ent)->numPrivate * sizeof (uint32_t))) >
+            ent->length)
+    {
+        return NULL;
+    }
+    return ent;
+}
+
+// Checks if node is a leaf, i.e., a CPU and not a group of them
+static bool pltAcpiPpttIsLeaf (AcpiSdt_t* pptt, AcpiPpttProc_t* node)
+{
+    // Older tables don't have the flag, so look for children then
+    if (node->flags & ACPI_PPTT_LEAF)
+        return true;
+    uint32_t off = (void*) node - (void*) pptt;
+    AcpiMadtEntry_t* cur = (void*) pptt + sizeof (AcpiSdt_t);
+    AcpiMadtEntry_t* end = (void*) pptt + pptt->length;
+    while (cur < end && cur->length)
+    {
+        if (cur->type == ACPI_PPTT_PROC && ((AcpiPpttProc_t*) cur)->parent == off)
+            return false;
+        cur = (void*) cur + cur->length;
+    }
+    return true;
+}
+
+// Gets topology IDs of the CPU with ACPI processor UID uid from the PPTT
+// IDs are offsets of nodes in the table, so they're unique at each level. Caches are grouped by
+// the node that has them, and their level is how many caches come before them on the way up
+bool PltAcpiGetCpuTopology (uint32_t uid, int* ids)
+{
+    AcpiSdt_t* pptt = PltAcpiFindTable ("PPTT");
+    if (!pptt)
+        return false;
+    // Find the CPU's node
+    AcpiPpttProc_t* leaf = NULL;
+    AcpiMadtEntry_t* cur = (void*) pptt + sizeof (AcpiSdt_t);
+    AcpiMadtEntry_t* end = (void*) pptt + pptt->length;
+    while (cur < end && cur->length)
+    {
+        AcpiPpttProc_t* node = pltAcpiPpttGet (pptt, (void*) cur - (void*) pptt, ACPI_PPTT_PROC);
+        if (node && (node->flags & ACPI_PPTT_UID_VALID) && node->acpiUid == uid &&
+            pltAcpiPpttIsLeaf (pptt, node))
+        {
+            leaf = node;
+            break;
+        }
+        cur = (void*) cur + cur->length;
+    }
+    if (!leaf)
+        return false;
+    // Hardware threads are grouped under their core
+    AcpiPpttProc_t* core = leaf;
+    if (leaf->flags & ACPI_PPTT_THREAD)
+    {
+        AcpiPpttProc_t* parent = pltAcpiPpttGet (pptt, leaf->parent, ACPI_PPTT_PROC);
+        if (parent)
+            core = parent;
+    }
+    ids[NK_TOPO_CORE] = (void*) core - (void*) pptt;
+    ids[NK_TOPO_L2] = -1;
+    ids[NK_TOPO_LLC] = -1;
+    // Walk up to the package, looking at the caches of each node
+    AcpiPpttProc_t* node = leaf;
+    int baseLevel = 0, llcLevel = 0;
+    for (int depth = 0; depth < 16; ++depth)
+    {
+        AcpiPpttProc_t* owner = (node == leaf) ? core : node;
+        int topLevel = baseLevel;
+        for (uint32_t i = 0; i < node->numPrivate; ++i)
+        {
+            int level = baseLevel;
+            AcpiPpttCache_t* cache = pltAcpiPpttGet (pptt, node->resources[i], ACPI_PPTT_CACHE);
+            while (cache && level < 8)
+            {
+                ++level;
+                if (ACPI_PPTT_CACHE_TYPE (cache->attr) != ACPI_PPTT_CACHE_INSN)
+                {
+                    if (level == 2 && ids[NK_TOPO_L2] < 0)
+                        ids[NK_TOPO_L2] = (void*) owner - (void*) pptt;
+                    if (level > llcLevel)
+                    {
+                        llcLevel = level;
+                        ids[NK_TOPO_LLC] = (void*) owner - (void*) pptt;
+                    }
+                }
+                cache = pltAcpiPpttGet (pptt, cache->nextLevel, ACPI_PPTT_CACHE);
+            }
+            if (level > topLevel)
+                topLevel = level;
+        }
+        baseLevel = topLevel;
+        if (node->flags & ACPI_PPTT_PACKAGE)
+            break;
+        AcpiPpttProc_t* parent = pltAcpiPpttGet (pptt, node->parent, ACPI_PPTT_PROC);
+        if (!parent)
+            break;    // The root is as good as a package
+        node = parent;
+    }
+    ids[NK_TOPO_PKG] = (void*) node - (void*) pptt;
+    // Caches the table doesn't tell us about are taken to be per core and per package
+    if (ids[NK_TOPO_L2] < 0)
+        ids[NK_TOPO_L2] = ids[NK_TOPO_CORE];
+    if (ids[NK_TOPO_LLC] < 0)
+        ids[NK_TOPO_LLC] = ids[NK_TOPO_PKG];
+    return true;
+}
+
+// Gets number of NUMA nodes
+int PltGetNumNodes()
+{
+    int numNodes = PltGetPlatform()->numa.numNodes;
+    return (numNodes) ? numNodes : 1;
+}
+
+// Gets node addr is in. If end isn't NULL, it gets the address the next range starts at
+int PltGetMemNode (paddr_t addr, paddr_t* end)
+{
+    PltNuma_t* numa = &PltGetPlatform()->numa;
+    for (int i = 0; i < numa->numRanges; ++i)
+    {
+        PltMemRange_t* range = &numa->ranges[i];
+        if (addr < range->base)
+        {
+            // In a hole, which we put in node 0
+            if (end)
+                *end = range->base;
+            return 0;
+        }
+        if (addr < range->end)
+        {
+            if (end)
+                *end = range->end;
+            return range->node;
+        }
+    }
+    if (end)
+        *end = (paddr_t) -1;
+    return 0;
+}
+
+// Gets relative distance between two nodes
+int PltGetNodeDist (int from, int to)
+{
+    PltNuma_t* numa = &PltGetPlatform()->numa;
+    if (!numa->numNodes)
+        return (from == to) ? PLT_NODE_LOCAL_DIST : PLT_NODE_REMOTE_DIST;
+    assert (from < numa->numNodes && to < numa->numNodes);
+    return numa->dist[from][to];
+}
+
 // Detects all CPUs attached to the platform
 bool PltAcpiDetectCpus()
 {
     if (PltGetPlatform()->subType != PLT_PC_SUBTYPE_ACPI)
         return false;
     // Create slab cache for CPUs
-    cpuCache = MmCacheCreate (sizeof (PltCpu_t), "PltCpu_t", 0, 0);
-    intCache = MmCacheCreate (sizeof (PltIntOverride_t), "PltIntOverride_t", 0, 0);
-    intCtrlCache = MmCacheCreate (sizeof (PltIntCtrl_t), "PltIntCtrl_t", 0, 0);
+    cpuCache = MmCacheCreate (sizeof (PltCpu_t), "PltCpu_t", MM_TAG_PLATFORM, 0, 0);
+    intCache = MmCacheCreate (sizeof (PltIntOverride_t), "PltIntOverride_t", MM_TAG_PLATFORM, 0, 0);
+    intCtrlCache = MmCacheCreate (sizeof (PltIntCtrl_t), "PltIntCtrl_t", MM_TAG_PLATFORM, 0, 0);
     // Get the MADT
     AcpiMadt_t* madt = (AcpiMadt_t*) PltAcpiFindTable ("APIC");
     if (!madt)
         return false;
     uint32_t len = madt->sdt.length - sizeof (AcpiMadt_t);
     AcpiMadtEntry_t* cur = (AcpiMadtEntry_t*) (madt + 1);
+    AcpiSrat_t* srat = NULL;
+    if (PltGetPlatform()->numa.numNodes)
+        srat = (AcpiSrat_t*) PltAcpiFindTable ("SRAT");
     uintptr_t intCtrlBase = 0;    // To make sure all interrupt controllers are at the same base
     for (int i = 0; i < len;)
     {
@@ -305,6 +677,7 @@ bool PltAcpiDetectCpus()
                 cpu->id = lapic->id;
                 cpu->type = PLT_CPU_APIC;
                 cpu->addr = (uintptr_t) madt->localBase;
+                cpu->node = pltAcpiGetCpuNode (srat, false, cpu->id);
                 PltAddCpu (cpu);
             }
         }
@@ -318,6 +691,7 @@ bool PltAcpiDetectCpus()
                 cpu->id = lapic->id;
                 cpu->type = PLT_CPU_X2APIC;
                 cpu->addr = (uintptr_t) madt->localBase;
+                cpu->node = pltAcpiGetCpuNode (srat, false, cpu->id);
                 PltAddCpu (cpu);
             }
         }
@@ -373,20 +747,35 @@ bool PltAcpiDetectCpus()
             PltCpu_t* cpu = MmCacheAlloc (cpuCache);
             cpu->id = gicc->cpuNum;
             cpu->type = PLT_CPU_GIC;
+            cpu->affinity = gicc->mpidr;
+            cpu->acpiUid = gicc->acpiUid;
+            cpu->node = pltAcpiGetCpuNode (srat, true, gicc->acpiUid);
+            // GICv3 CPU interfaces may only be reachable through system registers, in which case
+            // there is no base to check
             if (gicc->physBase)
                 cpu->addr = gicc->physBase;
-            else if (madt->localBase)
-                cpu->addr = (uint32_t) madt->localBase;
-            else
-                continue;
-            if (!intCtrlBase)
-                intCtrlBase = cpu->addr;
             else
+                cpu->addr = (uint32_t) madt->localBase;
+            if (cpu->addr)
             {
-                if (intCtrlBase != cpu->addr)
+                if (!intCtrlBase)
+                    intCtrlBase = cpu->addr;
+                else if (intCtrlBase != cpu->addr)
                     NkLogWarning ("nexke: not all GICCs at same base, system may fail\n");
             }
             PltAddCpu (cpu);
+            // Firmware without GICR entries gives each CPU's redistributor here instead
+            if (gicc->gicrBase)
+            {
+                PltIntCtrl_t* intCtrl = MmCacheAlloc (intCtrlCache);
+                intCtrl->addr = gicc->gicrBase;
+                intCtrl->id = gicc->cpuNum;
+                intCtrl->gsiBase = 0;
+                intCtrl->version = 0;
+                intCtrl->len = 0;
+                intCtrl->type = PLT_INTCTRL_GICR;
+                PltAddIntCtrl (intCtrl);
+            }
         }
         else if (cur->type == ACPI_MADT_GICD)
         {
@@ -395,9 +784,23 @@ bool PltAcpiDetectCpus()
             intCtrl->addr = gicd->addr;
             intCtrl->id = gicd->gicId;
             intCtrl->gsiBase = gicd->gsiBase;
+            intCtrl->version = gicd->version;
+            intCtrl->len = 0;
             intCtrl->type = PLT_INTCTRL_GIC;
             PltAddIntCtrl (intCtrl);
         }
+        else if (cur->type == ACPI_MADT_GICR)
+        {
+            AcpiGicr_t* gicr = (AcpiGicr_t*) cur;
+            PltIntCtrl_t* intCtrl = MmCacheAlloc (intCtrlCache);
+            intCtrl->addr = gicr->addr;
+            intCtrl->id = 0;
+            intCtrl->gsiBase = 0;
+            intCtrl->version = 0;
+            intCtrl->len = gicr->len;
+            intCtrl->type = PLT_INTCTRL_GICR;
+            PltAddIntCtrl (intCtrl);
+        }
         // To next entry
         i += cur->length;
         cur = (void*) cur + cur->length;
@@ -19,9 +19,11 @@
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
 #include <nexke/platform/generic.h>
+#include <nexke/task.h>
 #include <string.h>
 
-// TODO: SMP stuff, v3 and v4 support
+// TODO: SMP stuff, v4 support
+// GICv3 and up are driven by gicv3.c when the CPU has the system register interface
 
 // GIC distributor registers
 #define PLT_GICD_CTRL         0
@@ -64,6 +66,13 @@
 // ICPIDR2
 #define PLT_GIC_ICPIDR_REV 4
 
+// GICD_SGIR
+#define PLT_GICD_SGI_TARGET 16
+
+// SGIs we use
+#define PLT_GIC_SGI_TLB     0    // TLB shootdown
+#define PLT_GIC_SGI_RESCHED 1    // Reschedule
+
 // GIC CPU interface registers
 #define PLT_GICC_CTRL       0
 #define PLT_GICC_PMR        0x4
@@ -104,6 +113,11 @@ typedef struct _pltgic
 
 static pltGic_t gic = {0};
 
+static bool gicV3 = false;    // If the GICv3 driver is in use
+
+static NkHwInterrupt_t tlbInt = {0};
+static NkHwInterrupt_t reschedInt = {0};
+
 // Reads from GICC register
 static inline uint32_t pltGiccReadReg (uint16_t reg)
 {
@@ -298,6 +312,39 @@ static int PltGicGetVector (NkCcb_t* ccb, CpuIntContext_t* ctx)
     return CPU_BASE_HWINT + (iar & PLT_GICC_INTID_MASK);
 }
 
+static void PltGicSendIpi (NkCcb_t* ccb, PltCpu_t* cpu, int ipi)
+{
+    assert (ipi == PLT_IPI_TLB || ipi == PLT_IPI_RESCHED);
+    int sgi = (ipi == PLT_IPI_TLB) ? PLT_GIC_SGI_TLB : PLT_GIC_SGI_RESCHED;
+    // Make sure our writes are visible before the target hears about them
+    asm volatile ("dsb ishst");
+    NkSpinLock (&gic.gicdLock);
+    pltGicdWriteReg (PLT_GICD_SGI, (1 << (cpu->id + PLT_GICD_SGI_TARGET)) | sgi);
+    NkSpinUnlock (&gic.gicdLock);
+}
+
+// TLB shootdown IPI handler
+static bool pltGicTlb (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    if (intObj->vector == CPU_BASE_HWINT + PLT_GIC_SGI_TLB)
+    {
+        MmTlbIpi();
+        return true;
+    }
+    return false;
+}
+
+// Reschedule IPI handler
+static bool pltGicResched (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    if (intObj->vector == CPU_BASE_HWINT + PLT_GIC_SGI_RESCHED)
+    {
+        TskReschedIpi();
+        return true;
+    }
+    return false;
+}
+
 // GIC structure
 PltHwIntCtrl_t gicIntCtrl = {.type = PLT_HWINT_GIC,
                              .beginInterrupt = PltGicBeginInterrupt,
@@ -307,18 +354,26 @@ PltHwIntCtrl_t gicIntCtrl = {.type = PLT_HWINT_GIC,
                              .setIpl = PltGicSetIpl,
                              .connectInterrupt = PltGicConnectInterrupt,
                              .disconnectInterrupt = PltGicDisconnectInterrupt,
-                             .getVector = PltGicGetVector};
+                             .getVector = PltGicGetVector,
+                             .sendIpi = PltGicSendIpi};
+
+// Finds GICD from platform, we only support one
+static PltIntCtrl_t* pltGicdFind()
+{
+    NkLink_t* iter = NkListFront (&PltGetPlatform()->intCtrls);
+    while (iter)
+    {
+        PltIntCtrl_t* ctrl = LINK_CONTAINER (iter, PltIntCtrl_t, link);
+        if (ctrl->type == PLT_INTCTRL_GIC)
+            return ctrl;
+        iter = NkListIterate (&PltGetPlatform()->intCtrls, iter);
+    }
+    return NULL;
+}
 
 // Initializes GICD
-static bool pltGicdInit()
+static bool pltGicdInit (PltIntCtrl_t* ctrl)
 {
-    // Grab first int controller from platform, we only support one GICD
-    NkLink_t* gicdLink = NkListFront (&PltGetPlatform()->intCtrls);
-    if (!gicdLink)
-        return false;
-    PltIntCtrl_t* ctrl = LINK_CONTAINER (gicdLink, PltIntCtrl_t, link);
-    if (ctrl->type != PLT_INTCTRL_GIC)
-        return false;
     // Map it
     gic.gicdBase = MmAllocKvMmio ((paddr_t) ctrl->addr,
                                   1,
@@ -386,6 +441,7 @@ static bool pltGiccInit()
             // Set this as BSP
             NkLogDebug ("nexke: found BSP at CPU %d\n", curCpu->id);
             PltGetPlatform()->bsp = curCpu;
+            PltGetPlatform()->cpuMap[CpuGetCcb()->cpuNum] = curCpu;
             break;
         }
         iter = NkListIterate (&PltGetPlatform()->cpus, iter);
@@ -397,15 +453,68 @@ static bool pltGiccInit()
     pltGiccWriteReg (PLT_GICC_PMR, 0xFF);
     // Enable
     pltGiccWriteReg (PLT_GICC_CTRL, PLT_GICC_ENABLE);
+    // Set up TLB shootdown SGI. SGIs are always enabled, so only the priority needs setting
+    pltGicdWriteReg8 (PLT_GICD_PRIO_BASE + PLT_GIC_SGI_TLB, gic.basePrio - PLT_IPL_TIMER);
+    PltInitInternalInt (&tlbInt,
+                        pltGicTlb,
+                        CPU_BASE_HWINT + PLT_GIC_SGI_TLB,
+                        PLT_IPL_TIMER,
+                        PLT_MODE_EDGE,
+                        0);
+    PltConnectInterrupt (&tlbInt);
+    // Reschedule SGI
+    pltGicdWriteReg8 (PLT_GICD_PRIO_BASE + PLT_GIC_SGI_RESCHED, gic.basePrio - PLT_IPL_TIMER);
+    PltInitInternalInt (&reschedInt,
+                        pltGicResched,
+                        CPU_BASE_HWINT + PLT_GIC_SGI_RESCHED,
+                        PLT_IPL_TIMER,
+                        PLT_MODE_EDGE,
+                        0);
+    PltConnectInterrupt (&reschedInt);
     return true;
 }
 
+// Enables a PPI on the current CPU
+// PPIs belong to one CPU, so their enable and priority registers are banked, and each CPU
+// has to set up its own
+void PltGicEnablePpi (int ppi, ipl_t ipl)
+{
+    if (gicV3)
+    {
+        PltGicV3EnablePpi (ppi, ipl);
+        return;
+    }
+    assert (ppi >= 16 && ppi < 32);
+    NkSpinLock (&gic.gicdLock);
+    pltGicdWriteReg8 (PLT_GICD_PRIO_BASE + ppi, gic.basePrio - ipl);
+    pltGicdWriteReg (PLT_GICD_ISEN_BASE + PLT_GIC_INT_REG (ppi), 1 << PLT_GIC_INT_BIT (ppi));
+    NkSpinUnlock (&gic.gicdLock);
+}
+
 // Initializes GIC driver
 PltHwIntCtrl_t* PltGicInit()
 {
+    PltIntCtrl_t* gicd = pltGicdFind();
+    if (!gicd)
+        return NULL;
+    // Use GICv3 if the CPU has its system register interface. Firmware tells us the version of
+    // the GICD, which could still be a GICv2 one
+    NkCcb_t* ccb = CpuGetCcb();
+    if ((ccb->archCcb.features & (CPU_FEATURE_GIC3_4 | CPU_FEATURE_GIC41)) &&
+        (gicd->version == ACPI_GICD_VER_DETECT || gicd->version >= ACPI_GICD_VER_V3) &&
+        !NkReadArg ("-nogicv3"))
+    {
+        PltHwIntCtrl_t* ctrl = PltGicV3Init (gicd);
+        if (ctrl)
+        {
+            gicV3 = true;
+            return ctrl;
+        }
+        NkLogWarning ("nexke: GICv3 setup failed, trying GICv2\n");
+    }
     NkLogDebug ("nexke: using GIC as interrupt controller\n");
     // Initialize GICDs
-    if (!pltGicdInit())
+    if (!pltGicdInit (gicd))
         return NULL;
     // Initialize GICC
     if (!pltGiccInit())
@@ -0,0 +1,630 @@
+/*
+    gicv3.c - contains GICv3 interrupt controller implementation
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/platform/generic.h>
+#include <nexke/task.h>
+#include <string.h>
+
+// GICv3 moves the CPU interface into system registers and routes SPIs by affinity instead of
+// with 8 bit target masks. SGIs and PPIs live in a redistributor that each CPU has for itself
+
+// GIC distributor registers
+#define PLT_GICD_CTRL        0
+#define PLT_GICD_TYPE        0x4
+#define PLT_GICD_IGROUP_BASE 0x80
+#define PLT_GICD_ISEN_BASE   0x100
+#define PLT_GICD_ICEN_BASE   0x180
+#define PLT_GICD_PRIO_BASE   0x400
+#define PLT_GICD_ICFG_BASE   0xC00
+#define PLT_GICD_IROUTE_BASE 0x6000
+
+#define PLT_GICD_SIZE 0x10000
+
+// GICD_CTRL, non-secure view
+#define PLT_GICD_CTRL_EN_GRP1  (1 << 0)
+#define PLT_GICD_CTRL_EN_GRP1A (1 << 1)
+#define PLT_GICD_CTRL_ARE      (1 << 4)
+#define PLT_GICD_CTRL_RWP      (1U << 31)
+
+// GICD_TYPE
+#define PLT_GICD_LINES_MASK 0x1F
+
+// Redistributor RD_base registers
+#define PLT_GICR_CTRL  0
+#define PLT_GICR_TYPE  0x8
+#define PLT_GICR_WAKER 0x14
+
+// Redistributor SGI_base registers
+#define PLT_GICR_SGI_BASE  0x10000
+#define PLT_GICR_IGROUP0   (PLT_GICR_SGI_BASE + 0x80)
+#define PLT_GICR_ISEN0     (PLT_GICR_SGI_BASE + 0x100)
+#define PLT_GICR_ICEN0     (PLT_GICR_SGI_BASE + 0x180)
+#define PLT_GICR_PRIO_BASE (PLT_GICR_SGI_BASE + 0x400)
+
+// Each redistributor has an RD_base and SGI_base frame, GICv4 adds two more for vLPIs
+#define PLT_GICR_FRAME_SIZE   0x20000
+#define PLT_GICR_V4FRAME_SIZE 0x40000
+
+// GICR_CTRL
+#define PLT_GICR_CTRL_RWP (1 << 3)
+
+// GICR_TYPE
+#define PLT_GICR_TYPE_VLPIS (1 << 1)
+#define PLT_GICR_TYPE_LAST  (1 << 4)
+#define PLT_GICR_TYPE_AFF   32
+
+// GICR_WAKER
+#define PLT_GICR_WAKER_SLEEP    (1 << 1)
+#define PLT_GICR_WAKER_CHILDREN (1 << 2)
+
+// Helpers for indexed registers
+#define PLT_GIC_INT_REG(intNo)     (((intNo) / 32) * 4)
+#define PLT_GIC_INT_BIT(intNo)     ((intNo) % 32)
+#define PLT_GIC_INT_CFG(intNo)     (((intNo) / 16) * 4)
+#define PLT_GIC_INT_CFG_BIT(intNo) (((intNo) % 16) * 2)
+
+// Interrupt configuration bits
+#define PLT_GICD_CFG_EDGE (1 << 1)
+
+// ICC_SRE_EL1
+#define PLT_ICC_SRE_EN (1 << 0)
+
+// ICC_CTLR_EL1
+#define PLT_ICC_CTLR_EOIMODE (1 << 1)
+
+// ICC_IAR1_EL1
+#define PLT_ICC_INTID_MASK    0xFFFFFF
+#define PLT_ICC_INTID_SPECIAL 1020            // INTIDs from here to 1023 aren't interrupts
+#define PLT_ICC_IAR_VALID     (1ULL << 63)    // Set in saved IAR, as INTID 0 is a real SGI
+
+// ICC_SGI1R_EL1
+#define PLT_ICC_SGI_AFF1  16
+#define PLT_ICC_SGI_INTID 24
+#define PLT_ICC_SGI_AFF2  32
+#define PLT_ICC_SGI_RS    44
+#define PLT_ICC_SGI_AFF3  48
+
+// MPIDR affinity fields
+#define PLT_MPIDR_AFF0(mpidr) ((mpidr) & 0xFF)
+#define PLT_MPIDR_AFF1(mpidr) (((mpidr) >> 8) & 0xFF)
+#define PLT_MPIDR_AFF2(mpidr) (((mpidr) >> 16) & 0xFF)
+#define PLT_MPIDR_AFF3(mpidr) (((mpidr) >> 32) & 0xFF)
+
+#define PLT_MPIDR_AFF_MASK 0xFF00FFFFFFULL
+
+// Packs MPIDR affinity into the 32 bit form GICR_TYPER uses
+#define PLT_MPIDR_TO_AFF32(mpidr)                                      \
+    ((PLT_MPIDR_AFF3 (mpidr) << 24) | (PLT_MPIDR_AFF2 (mpidr) << 16) | \
+     (PLT_MPIDR_AFF1 (mpidr) << 8) | PLT_MPIDR_AFF0 (mpidr))
+
+// SGIs we use
+#define PLT_GIC_SGI_TLB     0    // TLB shootdown
+#define PLT_GIC_SGI_RESCHED 1    // Reschedule
+
+#define PLT_GIC_MAX_LINES 1020
+
+#define PLT_GICR_MAX_RANGES 8
+
+extern PltHwIntCtrl_t gicV3IntCtrl;
+
+typedef struct _pltgicrrange
+{
+    void* base;    // Where range is mapped
+    size_t len;    // Length of range
+} pltGicrRange_t;
+
+typedef struct _pltgicv3
+{
+    void* gicdBase;                                // Base of GICD
+    pltGicrRange_t ranges[PLT_GICR_MAX_RANGES];    // Redistributor ranges
+    int numRanges;
+    void* rdBase[NEXKE_MAX_CPUS];    // Redistributor of each logical CPU
+    uint8_t basePrio;                // Lowest priority the CPU interface implements
+    uint8_t prioStep;                // Distance between implemented priorities
+    int numLevels;                   // Number of implemented priorities
+    spinlock_t gicdLock;             // Lock on GICD registers
+} pltGicV3_t;
+
+static pltGicV3_t gic = {0};
+
+static NkHwInterrupt_t tlbInt = {0};
+static NkHwInterrupt_t reschedInt = {0};
+
+// Reads GICD register
+static inline uint32_t pltGicdReadReg (uint32_t reg)
+{
+    return *((volatile uint32_t*) (gic.gicdBase + reg));
+}
+
+// Writes GICD register
+static inline void pltGicdWriteReg (uint32_t reg, uint32_t val)
+{
+    *((volatile uint32_t*) (gic.gicdBase + reg)) = val;
+}
+
+// Writes byte to GICD register
+static inline void pltGicdWriteReg8 (uint32_t reg, uint8_t val)
+{
+    *((volatile uint8_t*) (gic.gicdBase + reg)) = val;
+}
+
+// Writes 64 bit GICD register
+static inline void pltGicdWriteReg64 (uint32_t reg, uint64_t val)
+{
+    *((volatile uint64_t*) (gic.gicdBase + reg)) = val;
+}
+
+// Waits for GICD register writes to take effect
+static inline void pltGicdWait()
+{
+    while (pltGicdReadReg (PLT_GICD_CTRL) & PLT_GICD_CTRL_RWP)
+        CpuSpin();
+}
+
+// Reads register of redistributor
+static inline uint32_t pltGicrReadReg (void* rdBase, uint32_t reg)
+{
+    return *((volatile uint32_t*) (rdBase + reg));
+}
+
+// Reads 64 bit register of redistributor
+static inline uint64_t pltGicrReadReg64 (void* rdBase, uint32_t reg)
+{
+    return *((volatile uint64_t*) (rdBase + reg));
+}
+
+// Writes register of redistributor
+static inline void pltGicrWriteReg (void* rdBase, uint32_t reg, uint32_t val)
+{
+    *((volatile uint32_t*) (rdBase + reg)) = val;
+}
+
+// Writes byte to register of redistributor
+static inline void pltGicrWriteReg8 (void* rdBase, uint32_t reg, uint8_t val)
+{
+    *((volatile uint8_t*) (rdBase + reg)) = val;
+}
+
+// Waits for redistributor register writes to take effect
+static inline void pltGicrWait (void* rdBase)
+{
+    while (pltGicrReadReg (rdBase, PLT_GICR_CTRL) & PLT_GICR_CTRL_RWP)
+        CpuSpin();
+}
+
+// Gets redistributor of current CPU
+static inline void* pltGicrGetBase()
+{
+    return gic.rdBase[CpuGetCcb()->cpuNum];
+}
+
+// Converts an IPL to a priority
+// There are often fewer priorities than IPLs, so several IPLs may share one. The lowest
+// priority is left alone, so that a PMR at it lets everything through
+static inline uint8_t pltGicMapIpl (ipl_t ipl)
+{
+    int level = (ipl * (gic.numLevels - 2)) / PLT_IPL_HIGH;
+    return gic.basePrio - ((level + 1) * gic.prioStep);
+}
+
+// Converts MPIDR to the routing value GICD_IROUTER takes
+static inline uint64_t pltGicGetRoute (uint64_t mpidr)
+{
+    return (PLT_MPIDR_AFF3 (mpidr) << 32) | (PLT_MPIDR_AFF2 (mpidr) << 16) |
+           (PLT_MPIDR_AFF1 (mpidr) << 8) | PLT_MPIDR_AFF0 (mpidr);
+}
+
+// Sets up GICD for specified interrupt object
+static void pltGicdSetupInterrupt (NkHwInterrupt_t* intObj, PltCpu_t* cpu)
+{
+    uint32_t gsi = intObj->gsi;
+    NkSpinLock (&gic.gicdLock);
+    // Disable it first
+    pltGicdWriteReg (PLT_GICD_ICEN_BASE + PLT_GIC_INT_REG (gsi), 1 << PLT_GIC_INT_BIT (gsi));
+    pltGicdWait();
+    // Put it in group 1
+    uint32_t group = pltGicdReadReg (PLT_GICD_IGROUP_BASE + PLT_GIC_INT_REG (gsi));
+    group |= 1 << PLT_GIC_INT_BIT (gsi);
+    pltGicdWriteReg (PLT_GICD_IGROUP_BASE + PLT_GIC_INT_REG (gsi), group);
+    // Set priority
+    pltGicdWriteReg8 (PLT_GICD_PRIO_BASE + gsi, pltGicMapIpl (intObj->ipl));
+    // Set trigger mode. Polarity can't be changed, SPIs are always active high
+    uint32_t icfg = pltGicdReadReg (PLT_GICD_ICFG_BASE + PLT_GIC_INT_CFG (gsi));
+    icfg &= ~(PLT_GICD_CFG_EDGE << PLT_GIC_INT_CFG_BIT (gsi));
+    if (intObj->mode == PLT_MODE_EDGE)
+        icfg |= PLT_GICD_CFG_EDGE << PLT_GIC_INT_CFG_BIT (gsi);
+    pltGicdWriteReg (PLT_GICD_ICFG_BASE + PLT_GIC_INT_CFG (gsi), icfg);
+    // Route it to the CPU
+    pltGicdWriteReg64 (PLT_GICD_IROUTE_BASE + (gsi * 8), pltGicGetRoute (cpu->affinity));
+    NkSpinUnlock (&gic.gicdLock);
+}
+
+// Interface functions
+static bool PltGicBeginInterrupt (NkCcb_t* ccb, CpuIntContext_t* ctx)
+{
+    int vector = CPU_CTX_INTNUM (ctx);
+    if (vector >= CPU_BASE_HWINT + PLT_ICC_INTID_SPECIAL)
+        return false;    // Spurious interrupt
+    return true;
+}
+
+static void PltGicEndInterrupt (NkCcb_t* ccb, CpuIntContext_t* ctx)
+{
+    // EOImode is 0, so this drops priority and deactivates in one go
+    CpuWriteSpr ("ICC_EOIR1_EL1", ctx->iar & PLT_ICC_INTID_MASK);
+    asm volatile ("isb" ::: "memory");
+}
+
+static void PltGicDisableInterrupt (NkCcb_t* ccb, NkHwInterrupt_t* intObj)
+{
+    uint32_t gsi = intObj->gsi;
+    NkSpinLock (&gic.gicdLock);
+    pltGicdWriteReg (PLT_GICD_ICEN_BASE + PLT_GIC_INT_REG (gsi), 1 << PLT_GIC_INT_BIT (gsi));
+    pltGicdWait();
+    NkSpinUnlock (&gic.gicdLock);
+}
+
+static void PltGicEnableInterrupt (NkCcb_t* ccb, NkHwInterrupt_t* intObj)
+{
+    uint32_t gsi = intObj->gsi;
+    NkSpinLock (&gic.gicdLock);
+    pltGicdWriteReg (PLT_GICD_ISEN_BASE + PLT_GIC_INT_REG (gsi), 1 << PLT_GIC_INT_BIT (gsi));
+    NkSpinUnlock (&gic.gicdLock);
+}
+
+static void PltGicSetIpl (NkCcb_t* ccb, ipl_t ipl)
+{
+    uint64_t pmr = 0xFF;
+    if (ipl)
+        pmr = pltGicMapIpl (ipl);
+    CpuWriteSpr ("ICC_PMR_EL1", pmr);
+}
+
+static int PltGicConnectInterrupt (NkCcb_t* ccb, NkHwInterrupt_t* intObj)
+{
+    // SGIs and PPIs belong to redistributors, and are set up with PltGicEnablePpi
+    if (intObj->gsi < 32 || intObj->gsi >= gicV3IntCtrl.numLines)
+        return -1;
+    PltHwIntChain_t* chain = &gicV3IntCtrl.lineMap[intObj->gsi];
+    if (NkListFront (&chain->list))
+    {
+        NkHwInterrupt_t* chainFront =
+            LINK_CONTAINER (NkListFront (&chain->list), NkHwInterrupt_t, link);
+        // Interrupt is in use, make sure this will work
+        if (intObj->flags & PLT_HWINT_NON_CHAINABLE || !PltAreIntsCompatible (intObj, chainFront) ||
+            intObj->mode == PLT_MODE_EDGE)
+        {
+            return -1;
+        }
+        if (intObj->flags & PLT_HWINT_FORCE_IPL)
+        {
+            // Remap if we can
+            if (chain->noRemap)
+                return -1;
+            if (!PltRemapInterrupt (PltGetInterrupt (chainFront->vector),
+                                    chainFront->vector,
+                                    intObj->ipl))
+            {
+                return -1;
+            }
+        }
+        else
+            intObj->ipl = chainFront->ipl;
+        // They share a line, so they go to the same CPU
+        intObj->cpuNum = chainFront->cpuNum;
+    }
+    intObj->vector = intObj->gsi + CPU_BASE_HWINT;
+    pltGicdSetupInterrupt (intObj, PltGetPlatform()->cpuMap[intObj->cpuNum]);
+    if (intObj->flags & PLT_HWINT_FORCE_IPL)
+        chain->noRemap = true;
+    return intObj->vector;
+}
+
+static void PltGicDisconnectInterrupt (NkCcb_t* ccb, NkHwInterrupt_t* intObj)
+{
+    PltHwIntChain_t* chain = &gicV3IntCtrl.lineMap[intObj->gsi];
+    if (chain->chainLen == 0)
+        PltGicDisableInterrupt (ccb, intObj);
+}
+
+static int PltGicGetVector (NkCcb_t* ccb, CpuIntContext_t* ctx)
+{
+    // If IAR is saved, use that. Otherwise ack the interrupt too
+    uint64_t iar = ctx->iar;
+    if (!(iar & PLT_ICC_IAR_VALID))
+    {
+        iar = CpuReadSpr ("ICC_IAR1_EL1") | PLT_ICC_IAR_VALID;
+        ctx->iar = iar;
+    }
+    return CPU_BASE_HWINT + (iar & PLT_ICC_INTID_MASK);
+}
+
+static void PltGicSendIpi (NkCcb_t* ccb, PltCpu_t* cpu, int ipi)
+{
+    assert (ipi == PLT_IPI_TLB || ipi == PLT_IPI_RESCHED);
+    uint64_t sgi = (ipi == PLT_IPI_TLB) ? PLT_GIC_SGI_TLB : PLT_GIC_SGI_RESCHED;
+    // The target list holds 16 CPUs, the range selector picks which 16 of Aff0 it means
+    uint64_t aff0 = PLT_MPIDR_AFF0 (cpu->affinity);
+    uint64_t val = (1ULL << (aff0 % 16)) | ((aff0 / 16) << PLT_ICC_SGI_RS) |
+                   (sgi << PLT_ICC_SGI_INTID) |
+                   (PLT_MPIDR_AFF1 (cpu->affinity) << PLT_ICC_SGI_AFF1) |
+                   (PLT_MPIDR_AFF2 (cpu->affinity) << PLT_ICC_SGI_AFF2) |
+                   (PLT_MPIDR_AFF3 (cpu->affinity) << PLT_ICC_SGI_AFF3);
+    // Make sure our writes are visible before the target hears about them
+    asm volatile ("dsb ishst");
+    CpuWriteSpr ("ICC_SGI1R_EL1", val);
+    asm volatile ("isb" ::: "memory");
+}
+
+static bool PltGicSetAffinity (NkCcb_t* ccb, NkHwInterrupt_t* intObj, PltCpu_t* cpu)
+{
+    if (cpu->type != PLT_CPU_GIC)
+        return false;
+    // IROUTER is only looked at when the interrupt is next delivered, so no need to disable it
+    NkSpinLock (&gic.gicdLock);
+    pltGicdWriteReg64 (PLT_GICD_IROUTE_BASE + (intObj->gsi * 8), pltGicGetRoute (cpu->affinity));
+    NkSpinUnlock (&gic.gicdLock);
+    return true;
+}
+
+// TLB shootdown IPI handler
+static bool pltGicTlb (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    if (intObj->vector == CPU_BASE_HWINT + PLT_GIC_SGI_TLB)
+    {
+        MmTlbIpi();
+        return true;
+    }
+    return false;
+}
+
+// Reschedule IPI handler
+static bool pltGicResched (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    if (intObj->vector == CPU_BASE_HWINT + PLT_GIC_SGI_RESCHED)
+    {
+        TskReschedIpi();
+        return true;
+    }
+    return false;
+}
+
+// Finds redistributor of current CPU by walking through the ranges firmware gave us
+static void* pltGicrFind()
+{
+    uint32_t aff = PLT_MPIDR_TO_AFF32 (CpuReadSpr ("MPIDR_EL1"));
+    for (int i = 0; i < gic.numRanges; ++i)
+    {
+        pltGicrRange_t* range = &gic.ranges[i];
+        void* rdBase = range->base;
+        while (1)
+        {
+            uint64_t type = pltGicrReadReg64 (rdBase, PLT_GICR_TYPE);
+            if ((type >> PLT_GICR_TYPE_AFF) == aff)
+                return rdBase;
+            if (type & PLT_GICR_TYPE_LAST)
+                break;
+            rdBase += (type & PLT_GICR_TYPE_VLPIS) ? PLT_GICR_V4FRAME_SIZE : PLT_GICR_FRAME_SIZE;
+            if (rdBase >= range->base + range->len)
+                break;
+        }
+    }
+    return NULL;
+}
+
+// Sets up the redistributor and CPU interface of the current CPU
+static bool pltGicInitCpu (NkCcb_t* ccb)
+{
+    void* rdBase = pltGicrFind();
+    if (!rdBase)
+    {
+        NkLogWarning ("nexke: can't find redistributor of CPU %d\n", ccb->cpuNum);
+        return false;
+    }
+    gic.rdBase[ccb->cpuNum] = rdBase;
+    // Wake it up
+    uint32_t waker = pltGicrReadReg (rdBase, PLT_GICR_WAKER);
+    pltGicrWriteReg (rdBase, PLT_GICR_WAKER, waker & ~PLT_GICR_WAKER_SLEEP);
+    while (pltGicrReadReg (rdBase, PLT_GICR_WAKER) & PLT_GICR_WAKER_CHILDREN)
+        CpuSpin();
+    // Disable all PPIs, and put every SGI and PPI in group 1
+    pltGicrWriteReg (rdBase, PLT_GICR_ICEN0, 0xFFFF0000);
+    pltGicrWait (rdBase);
+    pltGicrWriteReg (rdBase, PLT_GICR_IGROUP0, 0xFFFFFFFF);
+    // Switch over to system registers
+    CpuWriteSpr ("ICC_SRE_EL1", CpuReadSpr ("ICC_SRE_EL1") | PLT_ICC_SRE_EN);
+    asm volatile ("isb" ::: "memory");
+    if (!(CpuReadSpr ("ICC_SRE_EL1") & PLT_ICC_SRE_EN))
+    {
+        NkLogWarning ("nexke: GIC system register interface is disabled by firmware\n");
+        return false;
+    }
+    // Let the CPU interface tell us how many priorities it has
+    if (!gic.basePrio)
+    {
+        CpuWriteSpr ("ICC_PMR_EL1", (uint64_t) 0xFF);
+        asm volatile ("isb" ::: "memory");
+        gic.basePrio = CpuReadSpr ("ICC_PMR_EL1");
+        gic.prioStep = gic.basePrio & -gic.basePrio;
+        gic.numLevels = (gic.basePrio / gic.prioStep) + 1;
+        assert (gic.numLevels > 2);
+    }
+    // Use one register write for EOI, and one priority group for preemption
+    CpuWriteSpr ("ICC_CTLR_EL1", CpuReadSpr ("ICC_CTLR_EL1") & ~PLT_ICC_CTLR_EOIMODE);
+    CpuWriteSpr ("ICC_BPR1_EL1", (uint64_t) 0);
+    CpuWriteSpr ("ICC_PMR_EL1", (uint64_t) 0xFF);
+    CpuWriteSpr ("ICC_IGRPEN1_EL1", (uint64_t) 1);
+    asm volatile ("isb" ::: "memory");
+    // Set up SGIs. They're always enabled on the distributor side, so enable them here
+    pltGicrWriteReg8 (rdBase, PLT_GICR_PRIO_BASE + PLT_GIC_SGI_TLB, pltGicMapIpl (PLT_IPL_TIMER));
+    pltGicrWriteReg8 (rdBase,
+                      PLT_GICR_PRIO_BASE + PLT_GIC_SGI_RESCHED,
+                      pltGicMapIpl (PLT_IPL_TIMER));
+    pltGicrWriteReg (rdBase,
+                     PLT_GICR_ISEN0,
+                     (1 << PLT_GIC_SGI_TLB) | (1 << PLT_GIC_SGI_RESCHED));
+    return true;
+}
+
+// Sets up a newly started CPU
+static void PltGicInitCpu (NkCcb_t* ccb)
+{
+    if (!pltGicInitCpu (ccb))
+        NkPanic ("nexke: can't set up GIC on CPU %d\n", ccb->cpuNum);
+}
+
+// GIC structure
+PltHwIntCtrl_t gicV3IntCtrl = {.type = PLT_HWINT_GICV3,
+                               .beginInterrupt = PltGicBeginInterrupt,
+                               .endInterrupt = PltGicEndInterrupt,
+                               .disableInterrupt = PltGicDisableInterrupt,
+                               .enableInterrupt = PltGicEnableInterrupt,
+                               .setIpl = PltGicSetIpl,
+                               .connectInterrupt = PltGicConnectInterrupt,
+                               .disconnectInterrupt = PltGicDisconnectInterrupt,
+                               .getVector = PltGicGetVector,
+                               .sendIpi = PltGicSendIpi,
+                               .initCpu = PltGicInitCpu,
+                               .setAffinity = PltGicSetAffinity};
+
+// Maps redistributor ranges
+static bool pltGicrInit()
+{
+    NkLink_t* iter = NkListFront (&PltGetPlatform()->intCtrls);
+    while (iter)
+    {
+        PltIntCtrl_t* ctrl = LINK_CONTAINER (iter, PltIntCtrl_t, link);
+        if (ctrl->type == PLT_INTCTRL_GICR)
+        {
+            if (gic.numRanges == PLT_GICR_MAX_RANGES)
+            {
+                NkLogWarning ("nexke: too many redistributor ranges found\n");
+                break;
+            }
+            pltGicrRange_t* range = &gic.ranges[gic.numRanges];
+            // Ranges of one redistributor might be GICv4 ones, so map enough for that
+            range->len = ctrl->len;
+            size_t mapLen = (range->len) ? range->len : PLT_GICR_V4FRAME_SIZE;
+            range->base = MmAllocKvMmio ((paddr_t) ctrl->addr,
+                                         CpuPageAlignUp (mapLen) / NEXKE_CPU_PAGESZ,
+                                         MUL_PAGE_DEV | MUL_PAGE_R | MUL_PAGE_RW | MUL_PAGE_KE);
+            if (!range->base)
+                return false;
+            if (!range->len)
+                range->len = mapLen;
+            ++gic.numRanges;
+        }
+        iter = NkListIterate (&PltGetPlatform()->intCtrls, iter);
+    }
+    return gic.numRanges != 0;
+}
+
+// Initializes GICD
+static bool pltGicdInit (PltIntCtrl_t* ctrl)
+{
+    gic.gicdBase = MmAllocKvMmio ((paddr_t) ctrl->addr,
+                                  PLT_GICD_SIZE / NEXKE_CPU_PAGESZ,
+                                  MUL_PAGE_DEV | MUL_PAGE_R | MUL_PAGE_RW | MUL_PAGE_KE);
+    if (!gic.gicdBase)
+        return false;
+    uint32_t type = pltGicdReadReg (PLT_GICD_TYPE);
+    size_t numLines = ((type & PLT_GICD_LINES_MASK) + 1) * 32;
+    if (numLines > PLT_GIC_MAX_LINES)
+        numLines = PLT_GIC_MAX_LINES;
+    // We can't go past the end of the interrupt table
+    if (numLines > NK_MAX_INTS - CPU_BASE_HWINT)
+        numLines = NK_MAX_INTS - CPU_BASE_HWINT;
+    gicV3IntCtrl.numLines = numLines;
+    // Allocate line map
+    size_t mapSz = gicV3IntCtrl.numLines * sizeof (PltHwIntChain_t);
+    gicV3IntCtrl.lineMap =
+        (PltHwIntChain_t*) MmAllocKvRegion (CpuPageAlignUp (mapSz) / NEXKE_CPU_PAGESZ,
+                                            MM_KV_NO_DEMAND);
+    assert (gicV3IntCtrl.lineMap);
+    memset (gicV3IntCtrl.lineMap, 0, mapSz);
+    // Disable it while we set it up
+    pltGicdWriteReg (PLT_GICD_CTRL, 0);
+    pltGicdWait();
+    // Disable all SPIs on it
+    for (int i = 32; i < numLines; i += 32)
+        pltGicdWriteReg (PLT_GICD_ICEN_BASE + PLT_GIC_INT_REG (i), 0xFFFFFFFF);
+    pltGicdWait();
+    // Enable with affinity routing
+    pltGicdWriteReg (PLT_GICD_CTRL,
+                     PLT_GICD_CTRL_ARE | PLT_GICD_CTRL_EN_GRP1A | PLT_GICD_CTRL_EN_GRP1);
+    pltGicdWait();
+    return true;
+}
+
+// Finds the BSP by its affinity
+static void pltGicFindBsp()
+{
+    uint64_t aff = CpuReadSpr ("MPIDR_EL1") & PLT_MPIDR_AFF_MASK;
+    NkLink_t* iter = NkListFront (&PltGetPlatform()->cpus);
+    while (iter)
+    {
+        PltCpu_t* curCpu = LINK_CONTAINER (iter, PltCpu_t, link);
+        if ((curCpu->affinity & PLT_MPIDR_AFF_MASK) == aff)
+        {
+            NkLogDebug ("nexke: found BSP at CPU %d\n", curCpu->id);
+            PltGetPlatform()->bsp = curCpu;
+            PltGetPlatform()->cpuMap[CpuGetCcb()->cpuNum] = curCpu;
+            break;
+        }
+        iter = NkListIterate (&PltGetPlatform()->cpus, iter);
+    }
+}
+
+// Enables a PPI on the current CPU
+void PltGicV3EnablePpi (int ppi, ipl_t ipl)
+{
+    assert (ppi >= 16 && ppi < 32);
+    void* rdBase = pltGicrGetBase();
+    pltGicrWriteReg8 (rdBase, PLT_GICR_PRIO_BASE + ppi, pltGicMapIpl (ipl));
+    pltGicrWriteReg (rdBase, PLT_GICR_ISEN0, 1 << ppi);
+}
+
+// Initializes GICv3 driver
+PltHwIntCtrl_t* PltGicV3Init (PltIntCtrl_t* gicd)
+{
+    NkLogDebug ("nexke: using GICv3 as interrupt controller\n");
+    if (!pltGicdInit (gicd))
+        return NULL;
+    if (!pltGicrInit())
+        return NULL;
+    pltGicFindBsp();
+    if (!PltGetPlatform()->bsp || !pltGicInitCpu (CpuGetCcb()))
+        return NULL;
+    PltInitInternalInt (&tlbInt,
+                        pltGicTlb,
+                        CPU_BASE_HWINT + PLT_GIC_SGI_TLB,
+                        PLT_IPL_TIMER,
+                        PLT_MODE_EDGE,
+                        0);
+    PltConnectInterrupt (&tlbInt);
+    PltInitInternalInt (&reschedInt,
+                        pltGicResched,
+                        CPU_BASE_HWINT + PLT_GIC_SGI_RESCHED,
+                        PLT_IPL_TIMER,
+                        PLT_MODE_EDGE,
+                        0);
+    PltConnectInterrupt (&reschedInt);
+    return &gicV3IntCtrl;
+}
@@ -40,11 +40,19 @@
 
 // Flag register defines
 #define PL011_FR_TXEMPTY (1 << 7)
+#define PL011_FR_TXFULL  (1 << 5)
 #define PL011_FR_RXEMPTY (1 << 4)
 
 // LCR defines
+#define PL011_LCR_FIFO  (1 << 4)
 #define PL011_LCR_8BITS (3 << 5)
 
+// Interrupt bits
+#define PL011_INT_TX (1 << 5)
+
+// SPCR interrupt type for a GIC
+#define PL011_SPCR_INT_GIC (1 << 3)
+
 // UART CR defines
 #define PL011_CR_UARTEN (1 << 0)
 #define PL011_CR_TXEN   (1 << 8)
@@ -58,6 +66,22 @@
 // PL011 base
 static uintptr_t pl011Base = NEXKE_SERIAL_MMIO_BASE;
 
+#define PL011_TXRING_SIZE 4096    // Must be a power of 2
+
+// Output goes in a ring, and is moved into the TX FIFO until it's full. Once interrupts are up,
+// the TX interrupt refills the FIFO as it runs low, so writers don't wait on the line
+// Before that, and after a panic, writers drain the ring themselves
+static char pl011TxRing[PL011_TXRING_SIZE];
+static size_t pl011TxHead = 0, pl011TxTail = 0;
+
+static uint32_t pl011Gsi = 0;        // GSI of interrupt, 0 if SPCR doesn't give one
+static bool pl011IntOn = false;      // Whether the interrupt drains the ring
+static bool pl011TxBusy = false;     // Whether the TX interrupt is unmasked
+static bool pl011Sync = false;       // Whether writers drain the ring themselves for good
+static spinlock_t pl011Lock = 0;     // Protects ring and TX between writers and the interrupt
+
+static NkHwInterrupt_t pl011Int = {0};
+
 // Reads a PL011 register
 static uint32_t pl011ReadReg (int reg)
 {
@@ -96,6 +120,8 @@ bool PltPL011Init (AcpiGas_t* gas)
     AcpiSpcr_t* spcr = (AcpiSpcr_t*) PltAcpiFindTableEarly ("SPCR");
     if (!spcr)
         return false;    // No way to determine baud rate
+    if (spcr->intType & PL011_SPCR_INT_GIC)
+        pl011Gsi = spcr->gsi;
     // Determine clock
     uint32_t clock = 0;
     if (spcr->sdt.rev > 2 && spcr->uartClock)
@@ -152,11 +178,13 @@ bool PltPL011Init (AcpiGas_t* gas)
         pl011WriteReg (PL011_FBRD, fdiv);
     }
     // Set up LCR
-    pl011WriteReg (PL011_LCR, PL011_LCR_8BITS);
+    pl011WriteReg (PL011_LCR, PL011_LCR_8BITS | PL011_LCR_FIFO);
     // Set CR
     pl011WriteReg (PL011_CR, PL011_CR_RXEN | PL011_CR_TXEN | PL011_CR_CTS | PL011_CR_RTS);
-    // Set interrupt masks
-    pl011WriteReg (PL011_IMSC, 0x3FF);
+    // Mask all interrupts until something handles them. TX interrupts when FIFO is 1/8 full
+    pl011WriteReg (PL011_IMSC, 0);
+    pl011WriteReg (PL011_ICE, 0x7FF);
+    pl011WriteReg (PL011_FLS, 0);
     // Set DMA
     pl011WriteReg (PL011_DMACR, 0);
     // Enable
@@ -173,20 +201,107 @@ static bool pl011Read (char* out)
     return true;
 }
 
+// Moves as much of the ring as fits into the TX FIFO
+static void pl011FillFifo()
+{
+    while (pl011TxTail != pl011TxHead && !(pl011ReadReg (PL011_FR) & PL011_FR_TXFULL))
+        pl011WriteReg (PL011_DR, pl011TxRing[pl011TxTail++ & (PL011_TXRING_SIZE - 1)]);
+}
+
+// Writes out the whole ring
+static void pl011Drain()
+{
+    while (pl011TxTail != pl011TxHead)
+        pl011FillFifo();
+}
+
+// Puts a character in the ring, making room if it's full
+static void pl011Queue (char c)
+{
+    while (pl011TxHead - pl011TxTail == PL011_TXRING_SIZE)
+        pl011FillFifo();
+    pl011TxRing[pl011TxHead++ & (PL011_TXRING_SIZE - 1)] = c;
+}
+
+// PL011 interrupt handler
+static bool pl011Handler (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    if (!(pl011ReadReg (PL011_MIS) & PL011_INT_TX))
+        return false;
+    NkSpinLock (&pl011Lock);
+    pl011FillFifo();
+    // The interrupt stays up while the FIFO is low, so mask it once there's nothing left
+    if (pl011TxTail == pl011TxHead)
+    {
+        pl011WriteReg (PL011_IMSC, pl011ReadReg (PL011_IMSC) & ~(PL011_INT_TX));
+        pl011TxBusy = false;
+    }
+    pl011WriteReg (PL011_ICE, PL011_INT_TX);
+    NkSpinUnlock (&pl011Lock);
+    return true;
+}
+
+// Starts draining output from the PL011's interrupt
+void PltPL011InitInt()
+{
+    if (!pl011Gsi)
+        return;
+    PltInitInterrupt (&pl011Int, pl011Handler, pl011Gsi, PLT_IPL_TIMER, PLT_MODE_LEVEL, 0);
+    if (!PltConnectInterrupt (&pl011Int))
+    {
+        NkLogWarning ("nexke: warning: can't install PL011 interrupt, output will be polled\n");
+        return;
+    }
+    pl011IntOn = true;
+}
+
 static void pl011Write (const char* s)
 {
+    if (!pl011IntOn || pl011Sync)
+    {
+        while (*s)
+        {
+            // Translate CRLF
+            if (*s == '\n')
+                pl011Queue ('\r');
+            pl011Queue (*s);
+            ++s;
+        }
+        pl011Drain();
+        return;
+    }
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_TIMER);
+    NkSpinLock (&pl011Lock);
     while (*s)
     {
         // Translate CRLF
         if (*s == '\n')
+            pl011Queue ('\r');
+        pl011Queue (*s);
+        ++s;
+    }
+    // Start off the FIFO, and let the interrupt take it from there
+    if (!pl011TxBusy)
+    {
+        pl011FillFifo();
+        if (pl011TxTail != pl011TxHead)
         {
-            pl011WaitForTx();
-            pl011WriteReg (PL011_DR, '\r');
+            pl011TxBusy = true;
+            pl011WriteReg (PL011_IMSC, pl011ReadReg (PL011_IMSC) | PL011_INT_TX);
         }
-        pl011WaitForTx();
-        pl011WriteReg (PL011_DR, *s);
-        ++s;
     }
+    NkSpinUnlock (&pl011Lock);
+    PltLowerIpl (ipl);
+}
+
+// Writes out what's buffered, and stops buffering
+// The lock may be held by a CPU that's gone, so don't take it
+static void pl011SyncOut()
+{
+    pl011Sync = true;
+    if (pl011IntOn)
+        pl011WriteReg (PL011_IMSC, pl011ReadReg (PL011_IMSC) & ~(PL011_INT_TX));
+    pl011Drain();
 }
 
-NkConsole_t pl011Cons = {.read = pl011Read, .write = pl011Write};
+NkConsole_t pl011Cons = {.read = pl011Read, .write = pl011Write, .sync = pl011SyncOut};
@@ -15,6 +15,7 @@
     limitations under the License.
 */
 
+#include <nexke/mm.h>
 #include <nexke/nexboot.h>
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
@@ -157,12 +158,44 @@ PltHwIntCtrl_t* PltInitHwInts()
     if (!ctrl)
         NkPanic ("nexke: can't find interrupt controller");
     nkPlatform.intCtrl = ctrl;
+    PltUpdateIntCalls (ctrl);
 #endif
 }
 
+// Initializes system clock
+PltHwClock_t* PltInitClock()
+{
+#ifdef NEXNIX_BASEARCH_ARM
+    // The generic timer is architectural, so there's nothing else to look for
+    nkPlatform.clock = CpuInitGtClock();
+    NK_STATIC_CALL_UPDATE (PltGetTime, nkPlatform.clock->getTime);
+#elif defined(NEXNIX_BASEARCH_RISCV)
+    // So is the time CSR
+    nkPlatform.clock = CpuInitTimeClock();
+    NK_STATIC_CALL_UPDATE (PltGetTime, nkPlatform.clock->getTime);
+#endif
+    return nkPlatform.clock;
+}
+
+// Initializes system timer
+PltHwTimer_t* PltInitTimer()
+{
+#ifdef NEXNIX_BASEARCH_ARM
+    nkPlatform.timer = CpuInitGtTimer();
+    NK_STATIC_CALL_UPDATE (PltArmTimer, nkPlatform.timer->armTimer);
+#elif defined(NEXNIX_BASEARCH_RISCV)
+    nkPlatform.timer = CpuInitTimeTimer();
+    NK_STATIC_CALL_UPDATE (PltArmTimer, nkPlatform.timer->armTimer);
+#endif
+    return nkPlatform.timer;
+}
+
 void PltInitPhase2()
 {
     PltInitInterrupts();
+    // The page allocator needs to know which node memory is in before it comes up
+    if (nkPlatform.subType == PLT_PC_SUBTYPE_ACPI && !NkReadArg ("-nonuma"))
+        PltAcpiDetectNuma();
 }
 
 void PltInitPhase3()
@@ -173,6 +206,16 @@ void PltInitPhase3()
         NkPanic ("nexke: CPU detection failed\n");
     // Initialize interrupt controller for architecture
     PltInitHwInts();
+#ifdef NEXNIX_BASEARCH_ARM
+    if (nkPlatform.secondaryCons == &pl011Cons)
+        PltPL011InitInt();
+#endif
+    // Now that we know which CPU we are, allocate from our own node
+    if (nkPlatform.bsp)
+        MmSetCpuNode (CpuGetCcb(), nkPlatform.bsp->node);
+    // Now the clock and timer, which needs the interrupt controller
+    PltInitClock();
+    PltInitTimer();
 }
 
 // Returns platform
@@ -21,5 +21,6 @@ list(APPEND NEXKE_SOURCES
 if(NEXNIX_BASEARCH STREQUAL "arm")
     list(APPEND NEXKE_SOURCES 
          platform/generic/arch/arm/gic.c
+         platform/generic/arch/arm/gicv3.c
          platform/generic/arch/arm/pl011.c)
 endif()
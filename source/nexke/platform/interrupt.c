@@ -19,31 +19,102 @@
 #include <nexke/cpu.h>
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
+#include <nexke/synch.h>
+#include <nexke/task.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
 // Interrupt table
+// Everything in it is seen by every CPU
 static NkInterrupt_t* nkIntTable[NK_MAX_INTS] = {NULL};
 static spinlock_t nkIntTabLock = 0;
 
+// Interrupts only one CPU sees
+// MSIs are aimed at one CPU, so the controller can give them vectors that only mean something
+// there, and the same vector can be a different MSI on each CPU. A CPU's table is made when its
+// first MSI gets connected, and is never freed. The lock of the main table covers these as well
+typedef struct _cpuints
+{
+    NkInterrupt_t* table[NK_MAX_INTS];         // Interrupts on each vector
+    PltHwIntChain_t msiChains[NK_MAX_INTS];    // Chains of MSIs on them
+    long long lastCounts[NK_MAX_INTS];         // Counts as of the last balancer pass
+} pltCpuInts_t;
+
+static pltCpuInts_t* pltCpuInts[NEXKE_MAX_CPUS] = {NULL};
+
 // Slab cache
 static SlabCache_t* nkIntCache = NULL;
 static SlabCache_t* nkHwIntCache = NULL;
 
+// Thread of a threaded interrupt
+typedef struct _intthread
+{
+    NkHwInterrupt_t* hwInt;    // Interrupt it works for
+    NkThread_t* thread;        // Thread itself
+    TskCondition_t cond;       // Set when the interrupt gets claimed
+    bool exiting;              // Whether it should leave
+} PltIntThread_t;
+
+static SlabCache_t* nkIntThreadCache = NULL;
+
+// Hardware interrupts held off by each CPU
+// An interrupt that comes in under the IPL is saved and left in service, which keeps everything
+// of lower priority out in the controller. Once the IPL drops under it, it gets run
+#define PLT_MAX_DEFERRED 4
+
+typedef struct _deferredint
+{
+    CpuIntContext_t ctx;    // Trap as it came in
+    ipl_t ipl;              // IPL it runs at
+    uint64_t entry;         // When it came in, for statistics
+} pltDeferredInt_t;
+
+typedef struct _deferredints
+{
+    pltDeferredInt_t ints[PLT_MAX_DEFERRED];
+    int count;
+} pltDeferredInts_t;
+
+static pltDeferredInts_t pltDeferred[NEXKE_MAX_CPUS] = {0};
+
+static void pltReplayInts (NkCcb_t* ccb, ipl_t ipl);
+
 // Platform static pointer
 static NkPlatform_t* platform = NULL;
 
+static NkStat_t pltStatTraps = {.name = "plt.traps", .type = NK_STAT_COUNTER};
+
 // Chain for all internal interrupts
 static PltHwIntChain_t internalChain = {0};
 
+// Hooks the controller's static calls go to until it's picked. Nothing comes in before then
+static bool pltNoBeginInt (NkCcb_t* ccb, CpuIntContext_t* ctx)
+{
+    return false;
+}
+
+static void pltNoEndInt (NkCcb_t* ccb, CpuIntContext_t* ctx)
+{
+}
+
+static void pltNoSetIpl (NkCcb_t* ccb, ipl_t ipl)
+{
+}
+
+NK_STATIC_CALL_DEFINE (PltBeginInt, PltHwBeginInterrupt, pltNoBeginInt);
+NK_STATIC_CALL_DEFINE (PltEndInt, PltHwEndInterrupt, pltNoEndInt);
+NK_STATIC_CALL_DEFINE (PltSetHwIpl, PltHwSetIpl, pltNoSetIpl);
+
 // Chain helpers
 
-static inline PltHwIntChain_t* pltGetChain (uint32_t gsi)
+static inline PltHwIntChain_t* pltGetChain (NkHwInterrupt_t* hwInt)
 {
-    if (gsi == PLT_GSI_INTERNAL)
+    if (hwInt->gsi == PLT_GSI_INTERNAL)
         return &internalChain;
-    return &platform->intCtrl->lineMap[gsi];
+    else if (hwInt->gsi == PLT_GSI_MSI)
+        return &pltCpuInts[hwInt->cpuNum]->msiChains[hwInt->vector];    // MSIs never share
+    return &platform->intCtrl->lineMap[hwInt->gsi];
 }
 
 static inline size_t pltGetLineMapSize()
@@ -58,12 +129,53 @@ static inline void pltInitChain (PltHwIntChain_t* chain)
     chain->noRemap = false;
 }
 
+// Clears statistics of a hardware interrupt
+static inline void pltInitStats (NkHwInterrupt_t* hwInt)
+{
+#ifdef NEXKE_INT_STATS
+    memset (&hwInt->stats, 0, sizeof (PltIntStats_t));
+#endif
+}
+
+// Gets the table slot of vector on cpuNum, or in the main table if it's PLT_INT_ALL_CPUS
+static inline NkInterrupt_t** pltGetIntSlot (int cpuNum, int vector)
+{
+    if (cpuNum == PLT_INT_ALL_CPUS)
+        return &nkIntTable[vector];
+    return &pltCpuInts[cpuNum]->table[vector];
+}
+
+// Makes sure cpuNum has a table of its own
+static bool pltInitCpuInts (int cpuNum)
+{
+    if (NkRcuDeref (pltCpuInts[cpuNum]))
+        return true;
+    pltCpuInts_t* cpuInts = kmalloc (sizeof (pltCpuInts_t), MM_TAG_PLATFORM);
+    if (!cpuInts)
+        return false;
+    memset (cpuInts, 0, sizeof (pltCpuInts_t));
+    // Somebody else may have gotten there first
+    pltCpuInts_t* expected = NULL;
+    if (!__atomic_compare_exchange_n (&pltCpuInts[cpuNum],
+                                      &expected,
+                                      cpuInts,
+                                      false,
+                                      __ATOMIC_RELEASE,
+                                      __ATOMIC_RELAXED))
+    {
+        kfree (cpuInts, sizeof (pltCpuInts_t), MM_TAG_PLATFORM);
+    }
+    return true;
+}
+
 // Interrupt allocation
-static inline NkInterrupt_t* pltAllocInterrupt (int vector, int type)
+// cpuNum is the CPU whose table it goes in, or PLT_INT_ALL_CPUS
+static inline NkInterrupt_t* pltAllocInterrupt (int cpuNum, int vector, int type)
 {
     NkSpinLock (&nkIntTabLock);
+    NkInterrupt_t** slot = pltGetIntSlot (cpuNum, vector);
     // Ensure vector is free
-    if (nkIntTable[vector])
+    if (*slot)
     {
         NkSpinUnlock (&nkIntTabLock);
         return NULL;    // Interrupt is in use
@@ -76,8 +188,9 @@ static inline NkInterrupt_t* pltAllocInterrupt (int vector, int type)
     obj->callCount = 0;
     obj->type = type;
     obj->vector = vector;
-    // Insert in table
-    nkIntTable[vector] = obj;
+    obj->cpuNum = cpuNum;
+    // Insert in table. Traps look it up without the lock
+    NkRcuAssign (*slot, obj);
     NkSpinUnlock (&nkIntTabLock);
     return obj;
 }
@@ -94,12 +207,13 @@ static inline void pltIncCallCount (NkInterrupt_t* obj)
 static inline void pltChainInterrupt (NkInterrupt_t* obj, NkHwInterrupt_t* hwInt)
 {
     assert (obj->type == PLT_INT_HWINT);
-    assert (hwInt->gsi == PLT_GSI_INTERNAL || hwInt->gsi < pltGetLineMapSize());
-    PltHwIntChain_t* chain = pltGetChain (hwInt->gsi);
+    assert (hwInt->gsi == PLT_GSI_INTERNAL || hwInt->gsi == PLT_GSI_MSI ||
+            hwInt->gsi < pltGetLineMapSize());
+    PltHwIntChain_t* chain = pltGetChain (hwInt);
     if (!chain->chainLen)
         pltInitChain (chain);
-    // Link it
-    NkListAddFront (&chain->list, &hwInt->link);
+    // Link it. Interrupts walk the chain without the lock
+    NkRcuListAddFront (&chain->list, &hwInt->link);
     ++chain->chainLen;
     // Check if we need to mark it as chained
     if (chain->chainLen > 1)
@@ -118,11 +232,14 @@ static inline void pltChainInterrupt (NkInterrupt_t* obj, NkHwInterrupt_t* hwInt
 static inline void pltUnchainInterrupt (NkInterrupt_t* obj, NkHwInterrupt_t* hwInt)
 {
     assert (obj->type == PLT_INT_HWINT);
-    PltHwIntChain_t* chain = pltGetChain (hwInt->gsi);
-    assert (hwInt->gsi == PLT_GSI_INTERNAL || hwInt->gsi < pltGetLineMapSize());
-    // Unlink it
-    NkListRemove (&chain->list, &hwInt->link);
+    PltHwIntChain_t* chain = pltGetChain (hwInt);
+    assert (hwInt->gsi == PLT_GSI_INTERNAL || hwInt->gsi == PLT_GSI_MSI ||
+            hwInt->gsi < pltGetLineMapSize());
+    // Unlink it, and make sure new interrupts don't go to it first
+    NkRcuListRemove (&chain->list, &hwInt->link);
     --chain->chainLen;
+    if (obj->lastClaim == hwInt)
+        NkRcuAssign (obj->lastClaim, NULL);
     if (chain->chainLen == 1)
     {
         // Unmark it as chained
@@ -143,14 +260,75 @@ bool PltAreIntsCompatible (NkHwInterrupt_t* int1, NkHwInterrupt_t* int2)
     return true;
 }
 
-// Retrieves interrupt obejct from table
-NkInterrupt_t* PltGetInterrupt (int vector)
+// Retrieves interrupt object vector is on CPU cpuNum
+// Uninstalled objects are freed after a grace period, so anyone who might race with that
+// has to be in an RCU read section
+NkInterrupt_t* PltGetCpuInterrupt (int cpuNum, int vector)
 {
     assert (vector < NK_MAX_INTS);
-    NkSpinLock (&nkIntTabLock);
-    NkInterrupt_t* intObj = nkIntTable[vector];
-    NkSpinUnlock (&nkIntTabLock);
-    return intObj;
+    // Vectors in the main table are kept out of every CPU's own, so at most one has it
+    NkInterrupt_t* obj = NkRcuDeref (nkIntTable[vector]);
+    if (obj || cpuNum == PLT_INT_ALL_CPUS)
+        return obj;
+    pltCpuInts_t* cpuInts = NkRcuDeref (pltCpuInts[cpuNum]);
+    return (cpuInts) ? NkRcuDeref (cpuInts->table[vector]) : NULL;
+}
+
+// Retrieves interrupt obejct vector is on this CPU
+NkInterrupt_t* PltGetInterrupt (int vector)
+{
+    return PltGetCpuInterrupt (CpuGetCcb()->cpuNum, vector);
+}
+
+// Sends an IPI to logical CPU
+void PltSendIpi (int cpuNum, int ipi)
+{
+    PltCpu_t* cpu = platform->cpuMap[cpuNum];
+    assert (cpu && platform->intCtrl->sendIpi);
+    // Controllers need a few register writes to send an IPI, keep them from being interrupted
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    platform->intCtrl->sendIpi (CpuGetCcb(), cpu, ipi);
+    PltLowerIpl (ipl);
+}
+
+// Checks if other CPUs can be started and run on their own
+bool PltCanStartCpus()
+{
+    // Other CPUs need to be sent IPIs, and each needs a timer of its own to preempt threads
+    if (!platform->intCtrl->startCpu || !platform->intCtrl->sendIpi)
+        return false;
+    return platform->timer->initCpu != NULL;
+}
+
+// Gets the most CPUs that can run at once
+int PltGetMaxCpus()
+{
+    int maxCpus = platform->timer->maxCpus;
+    return (maxCpus && maxCpus < NEXKE_MAX_CPUS) ? maxCpus : NEXKE_MAX_CPUS;
+}
+
+// Starts CPU executing at physical address entry
+bool PltStartCpu (PltCpu_t* cpu, paddr_t entry)
+{
+    assert (platform->intCtrl->startCpu);
+    return platform->intCtrl->startCpu (CpuGetCcb(), cpu, entry);
+}
+
+// Sets up interrupt controller and timer of the current CPU, after it has been started
+void PltInitCpu()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    if (platform->intCtrl->initCpu)
+        platform->intCtrl->initCpu (ccb);
+    if (platform->timer->initCpu)
+        platform->timer->initCpu (ccb);
+}
+
+// Checks clock of a CPU that's being started against ours
+void PltSyncClock (NkCcb_t* ccb)
+{
+    if (platform->clock->syncCpu)
+        platform->clock->syncCpu (ccb);
 }
 
 // Installs an exception handler
@@ -160,7 +338,7 @@ NkInterrupt_t* PltInstallExec (int vector, PltIntHandler hndlr)
     if (vector > CPU_BASE_HWINT)
         return NULL;    // Can't cross into hardware vectors
     CpuDisable();
-    NkInterrupt_t* obj = pltAllocInterrupt (vector, PLT_INT_EXEC);
+    NkInterrupt_t* obj = pltAllocInterrupt (PLT_INT_ALL_CPUS, vector, PLT_INT_EXEC);
     if (!obj)
     {
         CpuEnable();
@@ -180,7 +358,7 @@ NkInterrupt_t* PltInstallSvc (int vector, PltIntHandler hndlr)
     if (vector > CPU_BASE_HWINT)
         return NULL;    // Can't cross into hardware vectors
     CpuDisable();
-    NkInterrupt_t* obj = pltAllocInterrupt (vector, PLT_INT_SVC);
+    NkInterrupt_t* obj = pltAllocInterrupt (PLT_INT_ALL_CPUS, vector, PLT_INT_SVC);
     if (!obj)
     {
         CpuEnable();
@@ -203,11 +381,16 @@ void PltInitInterrupt (NkHwInterrupt_t* hwInt,
 {
     hwInt->handler = handler;
     hwInt->gsi = gsi;
+    hwInt->cpuNum = 0;
     hwInt->ipl = ipl;
     if (hwInt->ipl == 0)
         ++hwInt->ipl;    // Cant have an IPL of 0
     hwInt->mode = mode;
     hwInt->flags = flags;
+    hwInt->threadFn = NULL;
+    hwInt->thread = NULL;
+    hwInt->poll = NULL;
+    pltInitStats (hwInt);
 }
 
 // Initializes a  internal interrupt
@@ -221,22 +404,103 @@ void PltInitInternalInt (NkHwInterrupt_t* hwInt,
     hwInt->handler = handler;
     hwInt->gsi = PLT_GSI_INTERNAL;
     hwInt->vector = vector;
+    hwInt->cpuNum = 0;
     hwInt->ipl = ipl;
     if (hwInt->ipl == 0)
         ++hwInt->ipl;    // Cant have an IPL of 0
     hwInt->mode = mode;
     hwInt->flags = flags | PLT_HWINT_INTERNAL;
+    hwInt->threadFn = NULL;
+    hwInt->thread = NULL;
+    hwInt->poll = NULL;
+    pltInitStats (hwInt);
+}
+
+// Makes an interrupt threaded
+void PltSetIntThread (NkHwInterrupt_t* hwInt, PltIntThreadFn fn, int prio)
+{
+    hwInt->threadFn = fn;
+    hwInt->threadPrio = prio;
+    hwInt->flags |= PLT_HWINT_THREADED;
+}
+
+// Thread of a threaded interrupt
+static void pltIntThread (void* arg)
+{
+    PltIntThread_t* intThread = arg;
+    NkHwInterrupt_t* hwInt = intThread->hwInt;
+    for (;;)
+    {
+        // Anything that comes in after this sets it again, so nothing gets missed
+        TskWaitCondition (&intThread->cond, NULL);
+        TskUnsetCondition (&intThread->cond);
+        if (__atomic_load_n (&intThread->exiting, __ATOMIC_ACQUIRE))
+            break;
+        hwInt->threadFn (hwInt);
+    }
+    TskTerminateSelf (0);
+}
+
+// Starts the thread of a threaded interrupt
+static bool pltStartIntThread (NkHwInterrupt_t* hwInt)
+{
+    if (!hwInt->threadFn)
+        return false;
+    PltIntThread_t* intThread = MmCacheAlloc (nkIntThreadCache);
+    if (!intThread)
+        return false;
+    intThread->hwInt = hwInt;
+    intThread->exiting = false;
+    TskInitCondition (&intThread->cond);
+    // These run as FIFO, so device work only gives the CPU up to more important device work
+    NkThread_t* thread = TskCreateThread (pltIntThread,
+                                          intThread,
+                                          "PltIntThread",
+                                          TSK_POLICY_FIFO,
+                                          hwInt->threadPrio,
+                                          0);
+    if (!thread)
+    {
+        MmCacheFree (nkIntThreadCache, intThread);
+        return false;
+    }
+    // Hold on to it so it can be joined even after it's gone
+    TskRefThread (thread);
+    intThread->thread = thread;
+    hwInt->thread = intThread;
+    TskStartThread (thread);
+    return true;
+}
+
+// Stops the thread of a threaded interrupt
+// Nothing may wake it anymore
+static void pltStopIntThread (NkHwInterrupt_t* hwInt)
+{
+    PltIntThread_t* intThread = hwInt->thread;
+    if (!intThread)
+        return;
+    __atomic_store_n (&intThread->exiting, true, __ATOMIC_RELEASE);
+    TskBroadcastCondition (&intThread->cond);
+    // Wait for it to finish up. If it already did, the join holds on to a reference for nothing
+    if (TskJoinThread (intThread->thread) != EOK)
+        TskDestroyThread (intThread->thread);
+    TskDestroyThread (intThread->thread);    // Now drop ours
+    MmCacheFree (nkIntThreadCache, intThread);
+    hwInt->thread = NULL;
 }
 
 // Installs a hardware interrupt
 NkInterrupt_t* PltConnectInterrupt (NkHwInterrupt_t* hwInt)
 {
     // Validate interrupt
-    if (hwInt->ipl > PLT_IPL_TIMER)
+    if (hwInt->ipl > PLT_IPL_TIMER || hwInt->flags & PLT_HWINT_MSI)
+        return NULL;
+    // Threaded interrupts need their thread before anything can come in
+    if (hwInt->flags & PLT_HWINT_THREADED && !pltStartIntThread (hwInt))
         return NULL;
     CpuDisable();
     // Connect the interrupt first if this is not an internal interrupt
-    PltHwIntChain_t* chain = pltGetChain (hwInt->gsi);
+    PltHwIntChain_t* chain = pltGetChain (hwInt);
     NkSpinLock (&chain->lock);
     int vector = 0;
     if (!(hwInt->flags & PLT_HWINT_INTERNAL))
@@ -249,13 +513,18 @@ NkInterrupt_t* PltConnectInterrupt (NkHwInterrupt_t* hwInt)
     {
         // Make sure this is allowed
         if (hwInt->flags & PLT_HWINT_NON_CHAINABLE || !(hwInt->flags & PLT_HWINT_INTERNAL))
+        {
+            NkSpinUnlock (&chain->lock);
+            CpuEnable();
+            pltStopIntThread (hwInt);
             return NULL;
+        }
         pltChainInterrupt (obj, hwInt);
     }
     else
     {
         // Allocate a new interrupt
-        obj = pltAllocInterrupt (vector, PLT_INT_HWINT);
+        obj = pltAllocInterrupt (PLT_INT_ALL_CPUS, vector, PLT_INT_HWINT);
         // Set chain
         NkSpinLock (&obj->lock);
         obj->intChain = chain;
@@ -272,17 +541,35 @@ NkInterrupt_t* PltConnectInterrupt (NkHwInterrupt_t* hwInt)
 }
 
 // Disconnects interrupt from hardware controller
+// Waits for interrupts that may still be running the handler, so hwInt is free to reuse after
 void PltDisconnectInterrupt (NkHwInterrupt_t* hwInt)
 {
     // Unchain and then disconnect it
     CpuDisable();
-    PltHwIntChain_t* chain = pltGetChain (hwInt->gsi);
+    PltHwIntChain_t* chain = pltGetChain (hwInt);
     NkSpinLock (&chain->lock);
     pltUnchainInterrupt (PltGetInterrupt (hwInt->vector), hwInt);
     // NOTE: if interrupt is not chained, disconnect will disable it for us
     platform->intCtrl->disconnectInterrupt (CpuGetCcb(), hwInt);
     NkSpinUnlock (&chain->lock);
     CpuEnable();
+    NkRcuSynchronize();
+    pltStopIntThread (hwInt);
+    // An interrupt that found it before it got unchained may have cached it after all
+    // Nothing can find it anymore, so once that one's done it's safe to take out
+    NkRcuReadLock();
+    NkInterrupt_t* obj = PltGetInterrupt (hwInt->vector);
+    NkHwInterrupt_t* expected = hwInt;
+    if (obj && obj->type == PLT_INT_HWINT)
+    {
+        __atomic_compare_exchange_n (&obj->lastClaim,
+                                     &expected,
+                                     NULL,
+                                     false,
+                                     __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED);
+    }
+    NkRcuReadUnlock();
 }
 
 // Remaps hardware interrupts on specified object to a new vector and IPL
@@ -296,7 +583,7 @@ NkInterrupt_t* PltRemapInterrupt (NkInterrupt_t* oldInt, int newVector, ipl_t ne
     NkInterrupt_t* newInt = NULL;
     if (oldInt->vector != newVector)
     {
-        newInt = pltAllocInterrupt (newVector, PLT_INT_HWINT);
+        newInt = pltAllocInterrupt (oldInt->cpuNum, newVector, PLT_INT_HWINT);
         if (!newInt)
             return NULL;
         NkSpinLock (&newInt->lock);
@@ -321,11 +608,124 @@ NkInterrupt_t* PltRemapInterrupt (NkInterrupt_t* oldInt, int newVector, ipl_t ne
     return newInt;
 }
 
+// Initializes a message signalled interrupt
+void PltInitMsi (NkHwInterrupt_t* hwInt, PltIntHandler handler, ipl_t ipl, int flags)
+{
+    hwInt->handler = handler;
+    hwInt->gsi = PLT_GSI_MSI;
+    hwInt->vector = 0;
+    hwInt->cpuNum = 0;
+    hwInt->ipl = ipl;
+    if (hwInt->ipl == 0)
+        ++hwInt->ipl;    // Cant have an IPL of 0
+    hwInt->mode = PLT_MODE_EDGE;    // Messages are always edge triggered
+    hwInt->flags = flags | PLT_HWINT_MSI | PLT_HWINT_NON_CHAINABLE;
+    hwInt->threadFn = NULL;
+    hwInt->thread = NULL;
+    hwInt->poll = NULL;
+    pltInitStats (hwInt);
+}
+
+// Connects count message signalled interrupts to consecutive vectors, delivered to CPU cpuNum
+bool PltConnectMsi (NkHwInterrupt_t* hwInts, int count, int cpuNum, PltMsiMsg_t* msg)
+{
+    // Validate interrupts. Devices pick which one to send by changing the low bits of data,
+    // so there have to be a power of two of them
+    if (!count || (count & (count - 1)) || !platform->intCtrl->allocMsi)
+        return false;
+    // A CPU that's starting can connect its own
+    bool starting = cpuNum == CpuGetCcb()->cpuNum;
+    if (cpuNum < 0 || (cpuNum >= NkGetNumCpus() && !starting) || !platform->cpuMap[cpuNum])
+        return false;
+    for (int i = 0; i < count; ++i)
+    {
+        if (!(hwInts[i].flags & PLT_HWINT_MSI) || hwInts[i].ipl > PLT_IPL_TIMER)
+            return false;
+    }
+    for (int i = 0; i < count; ++i)
+    {
+        if (hwInts[i].flags & PLT_HWINT_THREADED && !pltStartIntThread (&hwInts[i]))
+        {
+            while (i--)
+                pltStopIntThread (&hwInts[i]);
+            return false;
+        }
+    }
+    // The vectors are only good on the CPU they go to
+    if (!pltInitCpuInts (cpuNum))
+    {
+        for (int i = 0; i < count; ++i)
+            pltStopIntThread (&hwInts[i]);
+        return false;
+    }
+    for (int i = 0; i < count; ++i)
+        hwInts[i].cpuNum = cpuNum;
+    CpuDisable();
+    // Get the vectors and the message to send to hit them
+    int vector = platform->intCtrl->allocMsi (CpuGetCcb(),
+                                              hwInts,
+                                              count,
+                                              platform->cpuMap[cpuNum],
+                                              msg);
+    if (vector < 0)
+    {
+        CpuEnable();
+        for (int i = 0; i < count; ++i)
+            pltStopIntThread (&hwInts[i]);
+        return false;
+    }
+    // Each one gets its own interrupt object, with itself as the only thing on the chain
+    for (int i = 0; i < count; ++i)
+    {
+        NkHwInterrupt_t* hwInt = &hwInts[i];
+        PltHwIntChain_t* chain = pltGetChain (hwInt);
+        NkSpinLock (&chain->lock);
+        NkInterrupt_t* obj = pltAllocInterrupt (cpuNum, hwInt->vector, PLT_INT_HWINT);
+        assert (obj);    // Controller handed us the vector, so nothing else can be on it
+        NkSpinLock (&obj->lock);
+        obj->intChain = chain;
+        NkSpinUnlock (&obj->lock);
+        pltChainInterrupt (obj, hwInt);
+        NkSpinUnlock (&chain->lock);
+    }
+    CpuEnable();
+    return true;
+}
+
+// Disconnects message signalled interrupts that were connected together
+// Device must have stopped sending them
+void PltDisconnectMsi (NkHwInterrupt_t* hwInts, int count)
+{
+    CpuDisable();
+    for (int i = 0; i < count; ++i)
+    {
+        NkHwInterrupt_t* hwInt = &hwInts[i];
+        PltHwIntChain_t* chain = pltGetChain (hwInt);
+        NkSpinLock (&chain->lock);
+        pltUnchainInterrupt (PltGetCpuInterrupt (hwInt->cpuNum, hwInt->vector), hwInt);
+        NkSpinUnlock (&chain->lock);
+    }
+    CpuEnable();
+    // Get rid of the interrupt objects, and wait for handlers still running on other CPUs
+    // before the vectors can be handed out again
+    for (int i = 0; i < count; ++i)
+        PltUninstallInterrupt (PltGetCpuInterrupt (hwInts[i].cpuNum, hwInts[i].vector));
+    NkRcuSynchronize();
+    for (int i = 0; i < count; ++i)
+        pltStopIntThread (&hwInts[i]);
+    CpuDisable();
+    platform->intCtrl->freeMsi (CpuGetCcb(), hwInts, count);
+    CpuEnable();
+}
+
 // Enables an interrupt
+// Message signalled interrupts are masked in the device, so this does nothing for them
 void PltEnableInterrupt (NkHwInterrupt_t* hwInt)
 {
+    if (hwInt->flags & PLT_HWINT_MSI)
+        return;
     CpuDisable();
-    PltHwIntChain_t* chain = pltGetChain (hwInt->gsi);
+    PltHwIntChain_t* chain = pltGetChain (hwInt);
     NkSpinLock (&chain->lock);
     platform->intCtrl->enableInterrupt (CpuGetCcb(), hwInt);
     NkSpinUnlock (&chain->lock);
@@ -333,27 +733,463 @@ void PltEnableInterrupt (NkHwInterrupt_t* hwInt)
 }
 
 // Disables an interrupt
+// Message signalled interrupts are masked in the device, so this does nothing for them
 void PltDisableInterrupt (NkHwInterrupt_t* hwInt)
 {
+    if (hwInt->flags & PLT_HWINT_MSI)
+        return;
     CpuDisable();
-    PltHwIntChain_t* chain = pltGetChain (hwInt->gsi);
+    PltHwIntChain_t* chain = pltGetChain (hwInt);
     NkSpinLock (&chain->lock);
     platform->intCtrl->disableInterrupt (CpuGetCcb(), hwInt);
     NkSpinUnlock (&chain->lock);
     CpuEnable();
 }
 
+// Polled interrupts
+
+// Polling tunables
+#define PLT_POLL_WEIGHT 64                        // Default weight of a poll
+#define PLT_POLL_BUDGET 300                       // Work done each DPC before others get a go
+#define PLT_POLL_RATE   20000                     // Interrupts per second that make a storm
+#define PLT_POLL_TICK   (PLT_NS_IN_SEC / 1000)    // How often storming interrupts get polled
+#define PLT_POLL_IDLE   10                        // Idle ticks before a storm is over
+
+// Polls waiting on each CPU
+typedef struct _pollcpu
+{
+    NkDpc_t dpc;        // Runs the polls
+    PltPoll_t* head;    // Polls waiting to run
+    PltPoll_t* tail;
+} pltPollCpu_t;
+
+static pltPollCpu_t pltPollCpus[NEXKE_MAX_CPUS] = {0};
+
+// Locks a poll
+static inline ipl_t pltLockPoll (PltPoll_t* poll)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&poll->lock);
+    return ipl;
+}
+
+// Unlocks a poll
+static inline void pltUnlockPoll (PltPoll_t* poll, ipl_t ipl)
+{
+    NkSpinUnlock (&poll->lock);
+    PltLowerIpl (ipl);
+}
+
+// Masks or unmasks the interrupt of a poll
+// Called with interrupts off, as the controller can't take PltDisableInterrupt turning them on
+static void pltMaskPoll (PltPoll_t* poll, bool mask)
+{
+    NkHwInterrupt_t* hwInt = poll->hwInt;
+    if (poll->mask)
+        poll->mask (poll, mask);
+    else
+    {
+        PltHwIntChain_t* chain = pltGetChain (hwInt);
+        NkSpinLock (&chain->lock);
+        if (mask)
+            platform->intCtrl->disableInterrupt (CpuGetCcb(), hwInt);
+        else
+            platform->intCtrl->enableInterrupt (CpuGetCcb(), hwInt);
+        NkSpinUnlock (&chain->lock);
+    }
+}
+
+// Puts a scheduled poll on this CPU's list
+static void pltQueuePoll (PltPoll_t* poll)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    pltPollCpu_t* cpu = &pltPollCpus[CpuGetCcb()->cpuNum];
+    poll->next = NULL;
+    if (cpu->tail)
+        cpu->tail->next = poll;
+    else
+        cpu->head = poll;
+    cpu->tail = poll;
+    NkQueueDpc (&cpu->dpc);
+    PltLowerIpl (ipl);
+}
+
+// Finishes a poll that ran dry
+static void pltFinishPoll (PltPoll_t* poll, int done)
+{
+    bool startTimer = false;
+    ipl_t ipl = pltLockPoll (poll);
+    if (poll->state & PLT_POLL_STORM)
+    {
+        // Storms end once the device stays quiet for a bit
+        if (done)
+            poll->idleTicks = 0;
+        else if (++poll->idleTicks >= PLT_POLL_IDLE)
+            poll->state &= ~PLT_POLL_STORM;
+    }
+    if (__atomic_exchange_n (&poll->stormReq, false, __ATOMIC_RELAXED) &&
+        !(poll->state & PLT_POLL_STOPPED))
+    {
+        poll->state |= PLT_POLL_STORM;
+        poll->idleTicks = 0;
+        // The timer may still be around from the last storm
+        startTimer = !(poll->state & PLT_POLL_TIMER);
+        poll->state |= PLT_POLL_TIMER;
+    }
+    poll->state &= ~PLT_POLL_SCHED;
+    if (!(poll->state & (PLT_POLL_STORM | PLT_POLL_STOPPED)))
+        pltMaskPoll (poll, false);
+    pltUnlockPoll (poll, ipl);
+    // The timer goes off with its own lock held, and takes ours, so it can't be registered here
+    if (startTimer)
+        NkTimeRegEvent (poll->timer, PLT_POLL_TICK, NK_TIME_REG_PERIODIC | NK_TIME_REG_PINNED);
+}
+
+// Runs the polls waiting on a CPU
+// Every poll put on the list queues this again, so running out of budget just leaves the rest
+// for the next go, after other DPCs had theirs
+static void pltPollDpc (NkDpc_t* dpc, void* arg)
+{
+    pltPollCpu_t* cpu = arg;
+    int budget = PLT_POLL_BUDGET;
+    while (budget > 0)
+    {
+        ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+        PltPoll_t* poll = cpu->head;
+        if (poll)
+        {
+            cpu->head = poll->next;
+            if (!cpu->head)
+                cpu->tail = NULL;
+        }
+        PltLowerIpl (ipl);
+        if (!poll)
+            break;
+        int done = poll->fn (poll, poll->weight);
+        budget -= done;
+        // If it used all its weight there's likely more, so it goes to the back
+        if (done >= poll->weight)
+            pltQueuePoll (poll);
+        else
+            pltFinishPoll (poll, done);
+    }
+}
+
+// Polls a storming interrupt
+static void pltPollTick (NkTimeEvent_t* event, void* arg)
+{
+    PltPoll_t* poll = arg;
+    bool queue = false;
+    ipl_t ipl = pltLockPoll (poll);
+    if (!(poll->state & PLT_POLL_STORM))
+    {
+        poll->state &= ~PLT_POLL_TIMER;
+        NkTimeStopPeriodic (event);
+    }
+    else if (!(poll->state & PLT_POLL_SCHED))
+    {
+        poll->state |= PLT_POLL_SCHED;
+        queue = true;
+    }
+    pltUnlockPoll (poll, ipl);
+    if (queue)
+        pltQueuePoll (poll);
+}
+
+// Sets up a poll
+void PltInitPoll (PltPoll_t* poll,
+                  NkHwInterrupt_t* hwInt,
+                  PltPollFn fn,
+                  PltPollMask mask,
+                  int weight)
+{
+    assert (mask || !(hwInt->flags & PLT_HWINT_MSI));
+    memset (poll, 0, sizeof (PltPoll_t));
+    poll->hwInt = hwInt;
+    poll->fn = fn;
+    poll->mask = mask;
+    poll->weight = weight ? weight : PLT_POLL_WEIGHT;
+    poll->timer = NkTimeNewEvent();
+    if (!poll->timer)
+        NkPanicOom();
+    NkTimeSetCbEvent (poll->timer, pltPollTick, poll);
+    hwInt->poll = poll;
+}
+
+// Schedules a poll
+void PltSchedulePoll (PltPoll_t* poll)
+{
+    ipl_t ipl = pltLockPoll (poll);
+    bool queue = !(poll->state & (PLT_POLL_SCHED | PLT_POLL_STOPPED));
+    if (queue)
+    {
+        poll->state |= PLT_POLL_SCHED;
+        // Storming interrupts are masked already
+        if (!(poll->state & PLT_POLL_STORM))
+            pltMaskPoll (poll, true);
+    }
+    pltUnlockPoll (poll, ipl);
+    if (queue)
+        pltQueuePoll (poll);
+}
+
+// Stops a poll
+void PltStopPoll (PltPoll_t* poll)
+{
+    ipl_t ipl = pltLockPoll (poll);
+    poll->state |= PLT_POLL_STOPPED;
+    poll->state &= ~PLT_POLL_STORM;
+    pltUnlockPoll (poll, ipl);
+    // Let it finish up, and the timer notice the storm is over
+    while (__atomic_load_n (&poll->state, __ATOMIC_ACQUIRE) & (PLT_POLL_SCHED | PLT_POLL_TIMER))
+        TskYield();
+    NkTimeFreeEvent (poll->timer);
+    poll->hwInt->poll = NULL;
+}
+
+// Switches everything on a storming interrupt over to polling, if it all can be
+// The polls pick it up the next time they run dry
+static void pltStormPoll (NkInterrupt_t* obj)
+{
+    PltHwIntChain_t* chain = obj->intChain;
+    CpuDisable();
+    NkSpinLock (&chain->lock);
+    bool canPoll = true;
+    NkLink_t* iter = NkListFront (&chain->list);
+    for (; iter; iter = NkListIterate (&chain->list, iter))
+    {
+        if (!LINK_CONTAINER (iter, NkHwInterrupt_t, link)->poll)
+            canPoll = false;
+    }
+    iter = canPoll ? NkListFront (&chain->list) : NULL;
+    for (; iter; iter = NkListIterate (&chain->list, iter))
+    {
+        PltPoll_t* poll = LINK_CONTAINER (iter, NkHwInterrupt_t, link)->poll;
+        __atomic_store_n (&poll->stormReq, true, __ATOMIC_RELAXED);
+    }
+    NkSpinUnlock (&chain->lock);
+    CpuEnable();
+}
+
+// Interrupt balancing
+// Interrupts that come in often enough are spread out over CPUs, busiest first, each going to
+// whichever CPU has the least interrupt load so far. Everything else stays on the BSP, so CPUs
+// that don't have to deal with interrupts aren't bothered
+// Only lines are moved, as MSIs are placed by their drivers
+// The same pass looks for storms, which happens even if there's nowhere to move anything
+
+// Balancing tunables
+#define PLT_BALANCE_INTERVAL PLT_NS_IN_SEC    // How often interrupts get balanced
+#define PLT_BALANCE_HOT      1000             // Interrupts per interval to get moved
+
+// Interrupts per interval that make a storm
+#define PLT_BALANCE_STORM ((PLT_POLL_RATE * (long long) PLT_BALANCE_INTERVAL) / PLT_NS_IN_SEC)
+
+// Interrupt counts as of the last pass, and rates since then
+static long long pltLastCounts[NK_MAX_INTS] = {0};
+static long long pltIntRates[NK_MAX_INTS] = {0};
+
+static bool pltCanBalance = false;    // Whether there's more than one CPU to balance over
+
+// Checks if chain belongs to a line
+static inline bool pltIsLineChain (PltHwIntChain_t* chain)
+{
+    PltHwIntCtrl_t* ctrl = platform->intCtrl;
+    return chain >= ctrl->lineMap && chain < ctrl->lineMap + ctrl->numLines;
+}
+
+// Sends everything on chain to logical CPU cpuNum
+// Chain must be locked
+static bool pltSetChainAffinity (PltHwIntChain_t* chain, int cpuNum)
+{
+    NkLink_t* iter = NkListFront (&chain->list);
+    if (!iter)
+        return false;
+    NkHwInterrupt_t* front = LINK_CONTAINER (iter, NkHwInterrupt_t, link);
+    if (front->cpuNum == cpuNum)
+        return true;
+    if (!platform->intCtrl->setAffinity (CpuGetCcb(), front, platform->cpuMap[cpuNum]))
+        return false;
+    // They share a line, so they all go
+    while (iter)
+    {
+        LINK_CONTAINER (iter, NkHwInterrupt_t, link)->cpuNum = cpuNum;
+        iter = NkListIterate (&chain->list, iter);
+    }
+    return true;
+}
+
+// Sends an interrupt to logical CPU cpuNum
+bool PltSetIntAffinity (NkHwInterrupt_t* hwInt, int cpuNum)
+{
+    if (hwInt->flags & (PLT_HWINT_MSI | PLT_HWINT_INTERNAL) || !platform->intCtrl->setAffinity)
+        return false;
+    if (cpuNum < 0 || cpuNum >= NkGetNumCpus() || !platform->cpuMap[cpuNum])
+        return false;
+    CpuDisable();
+    PltHwIntChain_t* chain = pltGetChain (hwInt);
+    NkSpinLock (&chain->lock);
+    bool res = pltSetChainAffinity (chain, cpuNum);
+    NkSpinUnlock (&chain->lock);
+    CpuEnable();
+    return res;
+}
+
+// Moves line on vector to logical CPU cpuNum, if it's still there
+static void pltMoveVector (int vector, int cpuNum)
+{
+    CpuDisable();
+    NkRcuReadLock();
+    NkInterrupt_t* obj = PltGetCpuInterrupt (PLT_INT_ALL_CPUS, vector);
+    if (obj && obj->type == PLT_INT_HWINT && pltIsLineChain (obj->intChain))
+    {
+        NkSpinLock (&obj->intChain->lock);
+        pltSetChainAffinity (obj->intChain, cpuNum);
+        NkSpinUnlock (&obj->intChain->lock);
+    }
+    NkRcuReadUnlock();
+    CpuEnable();
+}
+
+// Looks for storms on interrupts only cpuInts's CPU sees
+static void pltCheckCpuStorms (pltCpuInts_t* cpuInts)
+{
+    for (int i = CPU_BASE_HWINT; i < NK_MAX_INTS; ++i)
+    {
+        NkRcuReadLock();
+        NkInterrupt_t* obj = NkRcuDeref (cpuInts->table[i]);
+        if (obj)
+        {
+            long long count = obj->callCount;
+            long long last = cpuInts->lastCounts[i];
+            cpuInts->lastCounts[i] = count;
+            if (((count >= last) ? count - last : count) >= PLT_BALANCE_STORM)
+                pltStormPoll (obj);
+        }
+        else
+            cpuInts->lastCounts[i] = 0;
+        NkRcuReadUnlock();
+    }
+}
+
+// Spreads out interrupts based on how often they came in since last time
+static void pltBalanceInts()
+{
+    static int hot[NK_MAX_INTS];
+    long long loads[NEXKE_MAX_CPUS] = {0};
+    int numHot = 0;
+    int numCpus = NkGetNumCpus();
+    for (int cpu = 0; cpu < numCpus; ++cpu)
+    {
+        pltCpuInts_t* cpuInts = NkRcuDeref (pltCpuInts[cpu]);
+        if (cpuInts)
+            pltCheckCpuStorms (cpuInts);
+    }
+    // Figure out rates of every line
+    for (int i = CPU_BASE_HWINT; i < NK_MAX_INTS; ++i)
+    {
+        pltIntRates[i] = 0;
+        NkRcuReadLock();
+        NkInterrupt_t* obj = PltGetCpuInterrupt (PLT_INT_ALL_CPUS, i);
+        bool isLine = false;
+        if (obj && obj->type == PLT_INT_HWINT)
+        {
+            long long count = obj->callCount;
+            // If the vector got reused, the count started over
+            pltIntRates[i] = (count >= pltLastCounts[i]) ? count - pltLastCounts[i] : count;
+            pltLastCounts[i] = count;
+            isLine = pltIsLineChain (obj->intChain);
+            if (pltIntRates[i] >= PLT_BALANCE_STORM)
+                pltStormPoll (obj);
+        }
+        else
+            pltLastCounts[i] = 0;
+        NkRcuReadUnlock();
+        if (!isLine || !pltCanBalance)
+            continue;
+        if (pltIntRates[i] >= PLT_BALANCE_HOT)
+        {
+            // Keep hot interrupts sorted, busiest first
+            int j = numHot++;
+            while (j && pltIntRates[hot[j - 1]] < pltIntRates[i])
+            {
+                hot[j] = hot[j - 1];
+                --j;
+            }
+            hot[j] = i;
+        }
+        else if (pltIntRates[i])
+        {
+            loads[0] += pltIntRates[i];
+            pltMoveVector (i, 0);    // Consolidate it on the BSP
+        }
+    }
+    // Now place the hot ones
+    for (int i = 0; i < numHot; ++i)
+    {
+        int best = 0;
+        for (int cpu = 1; cpu < numCpus; ++cpu)
+        {
+            if (loads[cpu] < loads[best])
+                best = cpu;
+        }
+        loads[best] += pltIntRates[hot[i]];
+        pltMoveVector (hot[i], best);
+    }
+}
+
+// Interrupt balancer thread
+static void pltIntBalancer (void*)
+{
+    for (;;)
+    {
+        TskSleepThread (PLT_BALANCE_INTERVAL);
+        pltBalanceInts();
+    }
+}
+
+// Starts spreading busy interrupts out over CPUs
+void PltStartIntBalancer()
+{
+    pltCanBalance = NkGetNumCpus() >= 2 && platform->intCtrl->setAffinity;
+    NkThread_t* thread = TskCreateThread (pltIntBalancer,
+                                          NULL,
+                                          "PltIntBalancer",
+                                          TSK_POLICY_NORMAL,
+                                          TSK_PRIO_KERNEL,
+                                          TSK_THREAD_SMALL_STACK);
+    if (!thread)
+        NkPanicOom();
+    TskStartThread (thread);
+}
+
+// Frees an interrupt object once nobody can be looking at it
+static void pltFreeInterrupt (NkRcuHead_t* head)
+{
+    MmCacheFree (nkIntCache, LINK_CONTAINER (head, NkInterrupt_t, rcu));
+}
+
 // Uninstalls an interrupt handler
 void PltUninstallInterrupt (NkInterrupt_t* intObj)
 {
     CpuDisable();
     NkSpinLock (&nkIntTabLock);
-    if (!nkIntTable[intObj->vector])
+    NkInterrupt_t** slot = pltGetIntSlot (intObj->cpuNum, intObj->vector);
+    if (!*slot)
         NkPanic ("nexke: can't uninstall non-existant interrupt");
-    nkIntTable[intObj->vector] = NULL;
+    NkRcuAssign (*slot, NULL);
     NkSpinUnlock (&nkIntTabLock);
     CpuEnable();
-    MmCacheFree (nkIntCache, intObj);
+    // Traps on other CPUs may have just looked it up
+    NkRcuCall (&intObj->rcu, pltFreeInterrupt);
+}
+
+// Points the controller's static calls at ctrl's hooks
+void PltUpdateIntCalls (PltHwIntCtrl_t* ctrl)
+{
+    NK_STATIC_CALL_UPDATE (PltBeginInt, ctrl->beginInterrupt);
+    NK_STATIC_CALL_UPDATE (PltEndInt, ctrl->endInterrupt);
+    NK_STATIC_CALL_UPDATE (PltSetHwIpl, ctrl->setIpl);
 }
 
 // Initializes interrupt system
@@ -361,14 +1197,22 @@ void PltInitInterrupts()
 {
     // Store platform pointer
     platform = PltGetPlatform();
+    NkStatRegister (&pltStatTraps);
     // Create cache
-    nkIntCache = MmCacheCreate (sizeof (NkInterrupt_t), "NkInterrupt_t", 0, 0);
-    nkHwIntCache = MmCacheCreate (sizeof (NkHwInterrupt_t), "NkHwInterrupt_t", 0, 0);
+    nkIntCache = MmCacheCreate (sizeof (NkInterrupt_t), "NkInterrupt_t", MM_TAG_PLATFORM, 0, 0);
+    nkHwIntCache =
+        MmCacheCreate (sizeof (NkHwInterrupt_t), "NkHwInterrupt_t", MM_TAG_PLATFORM, 0, 0);
+    nkIntThreadCache =
+        MmCacheCreate (sizeof (PltIntThread_t), "PltIntThread_t", MM_TAG_PLATFORM, 0, 0);
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+        NkInitDpcObj (&pltPollCpus[i].dpc, pltPollDpc, &pltPollCpus[i]);
     // Register CPU exception handlers
     CpuRegisterExecs();
 }
 
 // Raises IPL to specified level
+// Levels under high are only kept in software. Interrupts that come in under them get held off
+// then, so the controller doesn't have to be touched unless one does
 ipl_t PltRaiseIpl (ipl_t newIpl)
 {
     CpuDisable();    // For safety
@@ -380,7 +1224,12 @@ ipl_t PltRaiseIpl (ipl_t newIpl)
     // Re-enable if needed
     if (newIpl != PLT_IPL_HIGH)
     {
-        platform->intCtrl->setIpl (ccb, newIpl);    // Do it on the hardware side
+        // If nothing else can be held off, the controller has to block the level itself
+        if (pltDeferred[ccb->cpuNum].count == PLT_MAX_DEFERRED && ccb->hwIpl < newIpl)
+        {
+            NK_STATIC_CALL (PltSetHwIpl) (ccb, newIpl);
+            ccb->hwIpl = newIpl;
+        }
         CpuEnable();
     }
     return oldIpl;
@@ -397,8 +1246,13 @@ void PltLowerIpl (ipl_t oldIpl)
     // Re-enable if needed
     if (oldIpl != PLT_IPL_HIGH)
     {
-        platform->intCtrl->setIpl (ccb, oldIpl);    // Do it on the hardware side
+        // Run whatever came in while we were up there
+        pltReplayInts (ccb, oldIpl);
+        // Back at IPL low with nothing held, so anything interrupts left behind can run
+        bool dpcs = oldIpl == PLT_IPL_LOW && !ccb->preemptDisable && !ccb->intActive;
         CpuEnable();
+        if (dpcs)
+            NkDispatchDpcs();
     }
 }
 
@@ -429,11 +1283,337 @@ void PltExecDispatch (NkInterrupt_t* intObj, CpuIntContext_t* context)
     PltBadTrap (context, "%s", execInf.name);
 }
 
+#ifdef NEXKE_INT_STATS
+
+// Cycles each CPU has spent in hardware interrupts, not counting ones they interrupted
+// Anything timed can leave out how much this went up while it ran
+static uint64_t pltIntCycles[NEXKE_MAX_CPUS] = {0};
+
+// Raises max to val
+static void pltStatMax (uint64_t* max, uint64_t val)
+{
+    uint64_t cur = __atomic_load_n (max, __ATOMIC_RELAXED);
+    while (val > cur)
+    {
+        if (__atomic_compare_exchange_n (max,
+                                         &cur,
+                                         val,
+                                         false,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+}
+
+// Gets the time for statistics
+static inline uint64_t pltStatTime()
+{
+    return CpuGetCycles();
+}
+
+// Gets how long the current CPU has been in interrupts
+static inline uint64_t pltStatNested (NkCcb_t* ccb)
+{
+    return __atomic_load_n (&pltIntCycles[ccb->cpuNum], __ATOMIC_RELAXED);
+}
+
+// Records something that started at start, when the CPU's interrupt time was nested
+// Returns the cycles it took itself
+static uint64_t pltStatRecord (NkCcb_t* ccb,
+                               PltIntStats_t* stats,
+                               uint64_t start,
+                               uint64_t nested,
+                               uint64_t latency,
+                               bool claimed)
+{
+    // Take the interrupt time before the clock, so an interrupt in between can only make this
+    // come out a bit long instead of wrapping around
+    uint64_t nestedEnd = pltStatNested (ccb);
+    uint64_t cycles = (pltStatTime() - start) - (nestedEnd - nested);
+    // Interrupts can run on several CPUs at once
+    __atomic_fetch_add (&stats->calls, 1, __ATOMIC_RELAXED);
+    if (!claimed)
+        __atomic_fetch_add (&stats->unclaimed, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&stats->cycles, cycles, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&stats->latency, latency, __ATOMIC_RELAXED);
+    pltStatMax (&stats->maxCycles, cycles);
+    pltStatMax (&stats->maxLatency, latency);
+    return cycles;
+}
+
+// Records a call of a handler made at start, for a trap that came in at entry
+static inline void pltStatHandler (NkCcb_t* ccb,
+                                   NkHwInterrupt_t* hwInt,
+                                   uint64_t entry,
+                                   uint64_t start,
+                                   uint64_t nested,
+                                   bool claimed)
+{
+    pltStatRecord (ccb, &hwInt->stats, start, nested, start - entry, claimed);
+}
+
+// Records a whole interrupt that came in at entry and got to its first handler at start
+static inline void pltStatInt (NkCcb_t* ccb,
+                               NkInterrupt_t* obj,
+                               uint64_t entry,
+                               uint64_t start,
+                               uint64_t nested,
+                               bool claimed)
+{
+    uint64_t cycles = pltStatRecord (ccb, &obj->stats, entry, nested, start - entry, claimed);
+    // Whatever we interrupted shouldn't be charged for this
+    __atomic_fetch_add (&pltIntCycles[ccb->cpuNum], cycles, __ATOMIC_RELAXED);
+}
+
+// Dumps a set of interrupt statistics
+static void pltDumpStats (PltIntStats_t* stats)
+{
+    NkLogDebug ("    %llu calls, %llu unclaimed\n",
+                (unsigned long long) stats->calls,
+                (unsigned long long) stats->unclaimed);
+    NkLogDebug ("    %llu cycles on average, %llu at most\n",
+                (unsigned long long) (stats->cycles / stats->calls),
+                (unsigned long long) stats->maxCycles);
+    NkLogDebug ("    latency: %llu cycles on average, %llu at most\n",
+                (unsigned long long) (stats->latency / stats->calls),
+                (unsigned long long) stats->maxLatency);
+}
+
+// Dumps interrupt statistics of table, belonging to cpuNum or PLT_INT_ALL_CPUS
+static void pltDumpTableStats (NkInterrupt_t** table, int cpuNum)
+{
+    for (int i = CPU_BASE_HWINT; i < NK_MAX_INTS; ++i)
+    {
+        NkRcuReadLock();
+        NkInterrupt_t* obj = NkRcuDeref (table[i]);
+        if (!obj || obj->type != PLT_INT_HWINT || !obj->stats.calls)
+        {
+            NkRcuReadUnlock();
+            continue;
+        }
+        if (cpuNum == PLT_INT_ALL_CPUS)
+            NkLogDebug ("vector %d:\n", i);
+        else
+            NkLogDebug ("vector %d on CPU %d:\n", i, cpuNum);
+        pltDumpStats (&obj->stats);
+        // Now each handler on it
+        // Internal interrupts all share a chain, so only look at the ones on this vector
+        NkList_t* chain = &obj->intChain->list;
+        NkLink_t* iter = NkRcuListFront (chain);
+        while (iter)
+        {
+            NkHwInterrupt_t* hwInt = LINK_CONTAINER (iter, NkHwInterrupt_t, link);
+            if (hwInt->stats.calls && hwInt->vector == i)
+            {
+                if (hwInt->gsi == PLT_GSI_INTERNAL)
+                    NkLogDebug ("  internal handler %p:\n", hwInt->handler);
+                else if (hwInt->gsi == PLT_GSI_MSI)
+                    NkLogDebug ("  MSI handler %p:\n", hwInt->handler);
+                else
+                    NkLogDebug ("  GSI %u handler %p:\n", hwInt->gsi, hwInt->handler);
+                pltDumpStats (&hwInt->stats);
+            }
+            iter = NkRcuListIterate (chain, iter);
+        }
+        NkRcuReadUnlock();
+    }
+}
+
+// Dumps interrupt statistics
+void PltDumpIntStats()
+{
+    NkLogDebug ("Interrupt statistics:\n");
+    pltDumpTableStats (nkIntTable, PLT_INT_ALL_CPUS);
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+    {
+        pltCpuInts_t* cpuInts = NkRcuDeref (pltCpuInts[i]);
+        if (cpuInts)
+            pltDumpTableStats (cpuInts->table, i);
+    }
+}
+
+#else
+
+static inline uint64_t pltStatTime()
+{
+    return 0;
+}
+
+static inline uint64_t pltStatNested (NkCcb_t* ccb)
+{
+    return 0;
+}
+
+static inline void pltStatHandler (NkCcb_t* ccb,
+                                   NkHwInterrupt_t* hwInt,
+                                   uint64_t entry,
+                                   uint64_t start,
+                                   uint64_t nested,
+                                   bool claimed)
+{
+}
+
+static inline void pltStatInt (NkCcb_t* ccb,
+                               NkInterrupt_t* obj,
+                               uint64_t entry,
+                               uint64_t start,
+                               uint64_t nested,
+                               bool claimed)
+{
+}
+
+// Dumps interrupt statistics
+void PltDumpIntStats()
+{
+    NkLogDebug ("Interrupt statistics aren't enabled in this build\n");
+}
+
+#endif
+
+// Calls handler of hwInt for a trap that came in at entry
+// Interrupts are enabled while it runs, and left that way if it claims the interrupt
+static inline bool pltCallHandler (NkCcb_t* ccb,
+                                   NkInterrupt_t* intObj,
+                                   NkHwInterrupt_t* hwInt,
+                                   CpuIntContext_t* context,
+                                   uint64_t entry)
+{
+    CpuEnable();
+    uint64_t start = pltStatTime();
+    uint64_t nested = pltStatNested (ccb);
+    bool claimed = hwInt->handler (intObj, context);
+    pltStatHandler (ccb, hwInt, entry, start, nested, claimed);
+    if (!claimed)
+        CpuDisable();
+    else if (hwInt->flags & PLT_HWINT_THREADED)
+        TskBroadcastCondition (&hwInt->thread->cond);    // Let the thread do the rest
+    return claimed;
+}
+
+// Runs the chain of a hardware interrupt that came in at entry, and ends it
+// Interrupts must be disabled, and the controller must have begun it
+static void pltRunHwInt (NkCcb_t* ccb,
+                         NkInterrupt_t* intObj,
+                         CpuIntContext_t* context,
+                         uint64_t entry)
+{
+    // Disable preemption if needed
+    bool preemptSet = ccb->preemptDisable;
+    if (!preemptSet)
+        TskDisablePreempt();
+    bool wasActive = ccb->intActive;
+    ccb->intActive = true;
+    uint64_t nested = pltStatNested (ccb);
+    // Loop over the entire chain, trying to find a interrupt that can handle it
+    // The chain is RCU protected, and preemption is already off, so walking it needs
+    // no lock even with interrupts enabled
+    NkRcuReadLock();
+    NkList_t* chain = &intObj->intChain->list;
+    NkLink_t* iter = NkRcuListFront (chain);
+    NkHwInterrupt_t* curInt = LINK_CONTAINER (iter, NkHwInterrupt_t, link);
+    ipl_t oldIpl = ccb->curIpl;
+    ccb->curIpl = curInt->ipl;    // Set IPL
+    NK_TRACE (NK_TRACE_INT_ENTER, intObj->vector, 0);
+    uint64_t firstCall = pltStatTime();
+    // On a shared line, whoever claimed the last one most likely raised this one too, so
+    // ask it first. That saves polling every other device's status on each interrupt
+    NkHwInterrupt_t* lastInt = NkRcuDeref (intObj->lastClaim);
+    bool claimed = lastInt && pltCallHandler (ccb, intObj, lastInt, context, entry);
+    while (iter && !claimed)
+    {
+        if (curInt != lastInt && pltCallHandler (ccb, intObj, curInt, context, entry))
+        {
+            // Found one
+            claimed = true;
+            NkRcuAssign (intObj->lastClaim, curInt);
+            break;
+        }
+        iter = NkRcuListIterate (chain, iter);
+        curInt = LINK_CONTAINER (iter, NkHwInterrupt_t, link);
+    }
+    NkRcuReadUnlock();
+    NK_TRACE (NK_TRACE_INT_EXIT, intObj->vector, claimed);
+    CpuDisable();
+    ccb->curIpl = oldIpl;    // Restore IPL
+    // Anything that got deferred under us is above us in the controller, so it has to be ended
+    // before we are
+    pltReplayInts (ccb, oldIpl);
+    // End the interrupt
+    NK_STATIC_CALL (PltEndInt) (ccb, context);
+    pltStatInt (ccb, intObj, entry, firstCall, nested, claimed);
+    ccb->intActive = wasActive;
+    // If we interrupted IPL low and nothing was held, run DPCs before going back
+    if (oldIpl == PLT_IPL_LOW && !preemptSet && !wasActive)
+        NkDispatchDpcs();
+    // Make sure ints are enabled
+    if (!preemptSet)
+        TskEnablePreempt();    // Re-enable preemption
+}
+
+// Holds off a hardware interrupt that came in under the current IPL
+// Returns false if it has to run now
+static bool pltDeferInt (NkCcb_t* ccb,
+                         NkInterrupt_t* intObj,
+                         CpuIntContext_t* context,
+                         uint64_t entry)
+{
+    NkRcuReadLock();
+    NkLink_t* front = NkRcuListFront (&intObj->intChain->list);
+    ipl_t ipl = (front) ? LINK_CONTAINER (front, NkHwInterrupt_t, link)->ipl : PLT_IPL_HIGH;
+    NkRcuReadUnlock();
+    pltDeferredInts_t* deferred = &pltDeferred[ccb->cpuNum];
+    if (ipl > ccb->curIpl || deferred->count == PLT_MAX_DEFERRED)
+        return false;
+    // Save it, and leave it in service. The controller doesn't give us anything that isn't
+    // more important until it's ended
+    deferred->ints[deferred->count].ctx = *context;
+    deferred->ints[deferred->count].ipl = ipl;
+    deferred->ints[deferred->count].entry = entry;
+    // If that was the last slot, have the controller hold everything else off itself
+    if (++deferred->count == PLT_MAX_DEFERRED && ccb->hwIpl < ccb->curIpl)
+    {
+        NK_STATIC_CALL (PltSetHwIpl) (ccb, ccb->curIpl);
+        ccb->hwIpl = ccb->curIpl;
+    }
+    return true;
+}
+
+// Runs interrupts that were held off above ipl
+// Interrupts must be disabled
+static void pltReplayInts (NkCcb_t* ccb, ipl_t ipl)
+{
+    pltDeferredInts_t* deferred = &pltDeferred[ccb->cpuNum];
+    // They came in in order of priority, so the last one is the most important
+    while (deferred->count && deferred->ints[deferred->count - 1].ipl > ipl)
+    {
+        // Take it off first, as others may be held off while it runs
+        pltDeferredInt_t defInt = deferred->ints[--deferred->count];
+        // It may have been disconnected in the meantime, but it still has to be ended
+        NkRcuReadLock();
+        NkInterrupt_t* intObj = PltGetInterrupt (CPU_CTX_INTNUM (&defInt.ctx));
+        if (intObj && intObj->type == PLT_INT_HWINT)
+            pltRunHwInt (ccb, intObj, &defInt.ctx, defInt.entry);
+        else
+            NK_STATIC_CALL (PltEndInt) (ccb, &defInt.ctx);
+        NkRcuReadUnlock();
+    }
+    // Stop blocking levels we aren't at anymore
+    if (ccb->hwIpl > ipl)
+    {
+        NK_STATIC_CALL (PltSetHwIpl) (ccb, ipl);
+        ccb->hwIpl = ipl;
+    }
+}
+
 // Trap dispatcher
 void PltTrapDispatch (CpuIntContext_t* context)
 {
+    uint64_t entry = pltStatTime();
     NkCcb_t* ccb = CpuGetCcb();
     ++ccb->intCount;
+    NkStatInc (&pltStatTraps);
     // Grab the interrupt object
     NkInterrupt_t* intObj = PltGetInterrupt (CPU_CTX_INTNUM (context));
     if (!intObj)
@@ -470,47 +1650,11 @@ void PltTrapDispatch (CpuIntContext_t* context)
     }
     else if (intObj->type == PLT_INT_HWINT)
     {
-        // Disable preemption if needed
-        bool preemptSet = ccb->preemptDisable;
-        if (!preemptSet)
-            TskDisablePreempt();
-        ccb->intActive = true;
         //  Check if this interrupt is spurious
-        if (!platform->intCtrl->beginInterrupt (ccb, context))
-        {
-            // This interrupt is spurious. Increase counter and return
-            ++ccb->spuriousInts;
-        }
-        else
-        {
-            // Loop over the entire chain, trying to find a interrupt that can handle it
-            NkSpinLock (&intObj->intChain->lock);
-            NkList_t* chain = &intObj->intChain->list;
-            NkLink_t* iter = NkListFront (chain);
-            NkHwInterrupt_t* curInt = LINK_CONTAINER (iter, NkHwInterrupt_t, link);
-            ipl_t oldIpl = ccb->curIpl;
-            ccb->curIpl = curInt->ipl;    // Set IPL
-            while (iter)
-            {
-                NkSpinUnlock (&intObj->intChain->lock);
-                // Re-enable interrupts
-                CpuEnable();
-                if (curInt->handler (intObj, context))
-                    break;    // Found one
-                // Disable them again
-                CpuDisable();
-                NkSpinLock (&intObj->intChain->lock);
-                iter = NkListIterate (chain, iter);
-                curInt = LINK_CONTAINER (iter, NkHwInterrupt_t, link);
-            }
-            ccb->curIpl = oldIpl;    // Restore IPL
-            // End the interrupt
-            platform->intCtrl->endInterrupt (ccb, context);
-        }
-        ccb->intActive = false;
-        // Make sure ints are enabled
-        if (!preemptSet)
-            TskEnablePreempt();    // Re-enable preemption
+        if (!NK_STATIC_CALL (PltBeginInt) (ccb, context))
+            ++ccb->spuriousInts;    // This interrupt is spurious. Increase counter and return
+        else if (!pltDeferInt (ccb, intObj, context, entry))
+            pltRunHwInt (ccb, intObj, context, entry);
     }
     else
         assert (!"Invalid interrupt type");
@@ -20,11 +20,10 @@
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
 #include <nexke/platform/pc.h>
+#include <nexke/task.h>
 #include <stdlib.h>
 #include <string.h>
 
-// TODO: SMP and X2APIC
-
 // For disabing to 8259A
 #define PLT_PIC_MASTER_DATA 0x21
 #define PLT_PIC_SLAVE_DATA  0xA1
@@ -57,12 +56,14 @@
 #define PLT_TIMER_DIVIDE        0x3E0
 
 // APIC MSR defines
-#define PLT_APIC_MSR_BASE   0x800
-#define PLT_APIC_X2_SHIFT   4
-#define PLT_APIC_BASE       0xFEE00000
-#define PLT_APIC_BASE_MSR   0x1B
-#define PLT_APIC_MSR_ENABLE (1 << 11)
-#define PLT_APIC_MSR_X2     (1 << 10)
+#define PLT_APIC_MSR_BASE     0x800
+#define PLT_APIC_X2_SHIFT     4
+#define PLT_APIC_BASE         0xFEE00000
+#define PLT_APIC_BASE_MSR     0x1B
+#define PLT_APIC_MSR_ENABLE   (1 << 11)
+#define PLT_APIC_MSR_X2       (1 << 10)
+#define PLT_APIC_DEADLINE_MSR 0x6E0
+#define PLT_APIC_X2_ICR       0x830    // ICR is one 64-bit register in x2APIC mode
 
 // LVT bits
 #define PLT_APIC_PENDING        (1 << 12)
@@ -139,6 +140,7 @@
 #define PLT_IOAPIC_EDGE          (0 << 15)
 #define PLT_IOAPIC_MASK          (1 << 16)
 #define PLT_IOAPIC_DEST_SHIFT    56ULL
+#define PLT_IOAPIC_DEST_MASK     (0xFFULL << PLT_IOAPIC_DEST_SHIFT)
 
 // Array of all IO APICs
 #define PLT_IOAPIC_MAX 128
@@ -167,9 +169,15 @@ typedef struct _priority
 
 #define PLT_APIC_PRIO_NUM_VECT 16
 
-// Vector map
+// Vector maps
+// Lines and our own interrupts get their vector on every CPU, so lines can be moved just by
+// changing where they're sent. MSIs stay on the CPU they're connected to, and only take a vector
+// there, so each CPU can have a whole vector space worth of them
+// Connections of different lines and MSIs can race each other, so they have a lock of their own
 #define PLT_APIC_NUM_PRIORITY 16
 static pltApicPriority_t vectorMap[PLT_APIC_NUM_PRIORITY] = {0};
+static pltApicPriority_t cpuVectorMaps[NEXKE_MAX_CPUS][PLT_APIC_NUM_PRIORITY] = {0};
+static spinlock_t vectorLock = 0;
 
 static uint8_t prioToIplMap[] = {0, 0, 0, 1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24};
 
@@ -177,23 +185,39 @@ static uint8_t prioToIplMap[] = {0, 0, 0, 1, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20,
 #define PLT_APIC_SPURIOUS       243
 #define PLT_APIC_ERROR          241
 #define PLT_APIC_TIMER          242
+#define PLT_APIC_TLB            244
+#define PLT_APIC_RESCHED        245
 #define PLT_APIC_BASE_VECTOR    (CPU_BASE_HWINT)
 #define PLT_APIC_LAST_USER_PRIO 15
 
+// MSI message format
+#define PLT_MSI_ADDR_BASE  0xFEE00000
+#define PLT_MSI_DEST_SHIFT 12
+#define PLT_MSI_MAX_DEST   0xFF    // Higher APIC IDs need interrupt remapping
+
 // Base address of APIC
 static volatile void* apicBase = NULL;
 
+// Whether the LAPIC is accessed through MSRs
+// Set before any CPU is started, so every CPU uses the same mode
+static bool apicX2 = false;
+
 // APIC timer state
+// Every CPU has its own timer, so arm state is kept per CPU
 static bool isApicTimer = false;
-static int armCount = 0;
-static int finalArm = 0;
+static int armCount[NEXKE_MAX_CPUS] = {0};
+static int finalArm[NEXKE_MAX_CPUS] = {0};
 extern PltHwTimer_t pltApicTimer;
 
 extern PltHwIntCtrl_t pltApic;
 
+static void pltLapicSetup();
+
 static NkHwInterrupt_t spuriousInt = {0};
 static NkHwInterrupt_t errorInt = {0};
 static NkHwInterrupt_t timerInt = {0};
+static NkHwInterrupt_t tlbInt = {0};
+static NkHwInterrupt_t reschedInt = {0};
 
 // Maps IPL to APIC priority
 static inline uint8_t pltLapicMapIpl (ipl_t ipl)
@@ -218,6 +242,8 @@ static inline ipl_t pltLapicMapPrio (uint8_t class)
 // Reads lapic register
 static uint32_t pltLapicRead (uint16_t regIdx)
 {
+    if (apicX2)
+        return (uint32_t) CpuRdmsr (PLT_APIC_MSR_BASE + (regIdx >> PLT_APIC_X2_SHIFT));
     // Should be volatile so reads are cached by compiler
     volatile uint32_t* reg = (volatile uint32_t*) (apicBase + regIdx);
     return *reg;
@@ -226,6 +252,11 @@ static uint32_t pltLapicRead (uint16_t regIdx)
 // Writes lapic register
 static void pltLapicWrite (uint16_t regIdx, uint32_t value)
 {
+    if (apicX2)
+    {
+        CpuWrmsr (PLT_APIC_MSR_BASE + (regIdx >> PLT_APIC_X2_SHIFT), value);
+        return;
+    }
     volatile uint32_t* reg = (volatile uint32_t*) (apicBase + regIdx);
     *reg = value;
 }
@@ -286,13 +317,14 @@ static bool pltLapicTimer (NkInterrupt_t* intObj, CpuIntContext_t* context)
 {
     if (intObj->vector != PLT_APIC_TIMER)
         return false;
-    if (armCount)
+    int cpu = CpuGetCcb()->cpuNum;
+    if (armCount[cpu])
     {
-        --armCount;    // Decrease pending arm counter
-        if (!armCount)
+        --armCount[cpu];    // Decrease pending arm counter
+        if (!armCount[cpu])
         {
             // Set final arm
-            pltLapicWrite (PLT_TIMER_INITIAL_COUNT, finalArm);
+            pltLapicWrite (PLT_TIMER_INITIAL_COUNT, finalArm[cpu]);
         }
         else
             pltLapicWrite (PLT_TIMER_INITIAL_COUNT, 0xFFFFFFFF);
@@ -327,79 +359,151 @@ static bool pltLapicError (NkInterrupt_t* intObj, CpuIntContext_t* context)
     return false;
 }
 
+// TLB shootdown IPI handler
+static bool pltLapicTlb (NkInterrupt_t* intObj, CpuIntContext_t* context)
+{
+    if (intObj->vector == PLT_APIC_TLB)
+    {
+        MmTlbIpi();
+        return true;
+    }
+    return false;
+}
+
+// Reschedule IPI handler
+static bool pltLapicResched (NkInterrupt_t* intObj, CpuIntContext_t* context)
+{
+    if (intObj->vector == PLT_APIC_RESCHED)
+    {
+        TskReschedIpi();
+        return true;
+    }
+    return false;
+}
+
 #define PLT_APIC_DIST_UNUSABLE 16
 
-static inline pltApicPriority_t* pltApicGetClosestUp (uint8_t baseClass, int* dist)
+// Gets the map vectors on cpu come out of
+static inline pltApicPriority_t* pltApicGetMap (int cpu)
+{
+    return (cpu == PLT_INT_ALL_CPUS) ? vectorMap : cpuVectorMaps[cpu];
+}
+
+// Checks if vector idx of class is free on cpu, or every CPU if it's PLT_INT_ALL_CPUS
+static inline bool pltApicIsFree (int class, int idx, int cpu)
+{
+    if (vectorMap[class].vectors[idx])
+        return false;
+    if (cpu != PLT_INT_ALL_CPUS)
+        return !cpuVectorMaps[cpu][class].vectors[idx];
+    for (int i = 0; i < NEXKE_MAX_CPUS; ++i)
+    {
+        if (cpuVectorMaps[i][class].vectors[idx])
+            return false;
+    }
+    return true;
+}
+
+// Finds count free vectors in a row in class on cpu, aligned to count
+// Returns index of the first one, or -1 if there aren't any
+static inline int pltApicFindRun (int class, int cpu, int count)
+{
+    size_t numAlloced = vectorMap[class].numAlloced;
+    if (cpu != PLT_INT_ALL_CPUS)
+        numAlloced += cpuVectorMaps[cpu][class].numAlloced;
+    if (numAlloced + count > PLT_APIC_PRIO_NUM_VECT)
+        return -1;
+    for (int i = 0; i < PLT_APIC_PRIO_NUM_VECT; i += count)
+    {
+        int j = 0;
+        while (j < count && pltApicIsFree (class, i + j, cpu))
+            ++j;
+        if (j == count)
+            return i;
+    }
+    return -1;
+}
+
+static inline int pltApicGetClosestUp (uint8_t baseClass, int cpu, int count, int* dist)
 {
     for (int i = baseClass; i < PLT_APIC_NUM_PRIORITY; ++i)
     {
-        // Get the priority there
-        pltApicPriority_t* curPrio = &vectorMap[i];
-        if (curPrio->numAlloced < PLT_APIC_PRIO_NUM_VECT)
+        if (pltApicFindRun (i, cpu, count) != -1)
         {
             *dist = i - baseClass;
-            return curPrio;
+            return i;
         }
     }
     *dist = PLT_APIC_DIST_UNUSABLE;    // Set it to something large so we don't use it
-    return NULL;
+    return -1;
 }
 
-static inline pltApicPriority_t* pltApicGetClosestDown (uint8_t baseClass, int* dist)
+static inline int pltApicGetClosestDown (uint8_t baseClass, int cpu, int count, int* dist)
 {
-    for (int i = baseClass; i >= 0; --i)
+    // Classes below the first hardware vector belong to exceptions
+    for (int i = baseClass; i >= PLT_APIC_PRI_TO_CLASS (PLT_APIC_BASE_VECTOR); --i)
     {
-        // Get the priority there
-        pltApicPriority_t* curPrio = &vectorMap[i];
-        if (curPrio->numAlloced < PLT_APIC_PRIO_NUM_VECT)
+        if (pltApicFindRun (i, cpu, count) != -1)
         {
             *dist = baseClass - i;
-            return curPrio;
+            return i;
         }
     }
     *dist = PLT_APIC_DIST_UNUSABLE;    // Set it to something large so we don't use it
-    return NULL;
-}
-
-static inline int pltApicGetVector (pltApicPriority_t* prio, uint8_t class)
-{
-    for (int i = 0; i < PLT_APIC_PRIO_NUM_VECT; ++i)
-    {
-        if (!prio->vectors[i])
-            return (class << 4) + i;
-    }
-    return 0;
+    return -1;
 }
 
-// Allocates a new interrupt vector
-static pltApicPriority_t* pltApicAllocVector (uint8_t* class, int* vectorOut)
+// Allocates count new interrupt vectors in a row on cpu, aligned to count
+// With PLT_INT_ALL_CPUS they're taken on every CPU
+static bool pltApicAllocVector (uint8_t* class, int cpu, int* vectorOut, int count)
 {
     // Basically our algorithm is to check the desired class, if that's not available,
     // we see what the closest priority upwards from the base class is, and what the closest one
     // down from the base class is We will pick the closer of the two, or upwards if they are equal
     uint8_t baseClass = *class;
+    NkSpinLock (&vectorLock);
     // Get the closest one upwards
     int distUp = 0, distDown = 0;
-    pltApicPriority_t* prioUp = pltApicGetClosestUp (baseClass, &distUp);
-    pltApicPriority_t* prioDown = pltApicGetClosestDown (baseClass, &distDown);
+    int classUp = pltApicGetClosestUp (baseClass, cpu, count, &distUp);
+    int classDown = pltApicGetClosestDown (baseClass, cpu, count, &distDown);
     // Now handle the different cases
-    pltApicPriority_t* prio = NULL;
+    int newClass = -1;
     if (distUp <= distDown)
-        prio = prioUp;
+        newClass = classUp;
     else if (distDown < distUp)
-        prio = prioDown;
+        newClass = classDown;
     else
         assert (0);
     // Check if there is a priority
-    if (!prio)
-        return NULL;
-    // Get the class
-    *class = baseClass + (prio - &vectorMap[baseClass]);
-    // Now allocate it
-    *vectorOut = pltApicGetVector (prio, *class);
-    assert (*vectorOut);
+    if (newClass == -1)
+    {
+        NkSpinUnlock (&vectorLock);
+        return false;
+    }
+    *class = newClass;
+    // Now reserve them
+    pltApicPriority_t* prio = &pltApicGetMap (cpu)[newClass];
+    int idx = pltApicFindRun (newClass, cpu, count);
+    assert (idx != -1);
+    for (int i = 0; i < count; ++i)
+        prio->vectors[idx + i] = true;
+    prio->numAlloced += count;
+    NkSpinUnlock (&vectorLock);
+    *vectorOut = PLT_APIC_CLASS_TO_PRI (*class) + idx;
     // We're done
-    return prio;
+    return true;
+}
+
+// Frees count vectors in a row, allocated on cpu
+static void pltApicFreeVector (int vector, int cpu, int count)
+{
+    int class = PLT_APIC_PRI_TO_CLASS (vector);
+    pltApicPriority_t* mapEnt = &pltApicGetMap (cpu)[class];
+    NkSpinLock (&vectorLock);
+    for (int i = 0; i < count; ++i)
+        mapEnt->vectors[vector - PLT_APIC_CLASS_TO_PRI (class) + i] = false;
+    mapEnt->numAlloced -= count;
+    NkSpinUnlock (&vectorLock);
 }
 
 // Maps an interrupt to a redirection entry
@@ -410,23 +514,19 @@ static bool pltApicMapInterrupt (NkHwInterrupt_t* intObj)
     assert (priority >= PLT_APIC_CLASS_TO_PRI (2));
     uint8_t class = PLT_APIC_PRI_TO_CLASS (priority);
     int vector = 0;
-    pltApicPriority_t* mapEnt = pltApicAllocVector (&class, &vector);
-    if (!vector)
+    if (!pltApicAllocVector (&class, PLT_INT_ALL_CPUS, &vector, 1))
     {
         // No free vectors
         return false;
     }
-    // We found a vector, make sure we set the right IPL
-    if (intObj->ipl == PLT_IPL_TIMER && class != PLT_APIC_NUM_PRIORITY - 1)
+    // We found a vector, make sure it's at the right IPL and the line exists
+    pltIoApic_t* apic = pltApicGetIoApic (intObj->gsi);
+    if ((intObj->ipl == PLT_IPL_TIMER && class != PLT_APIC_NUM_PRIORITY - 1) || !apic)
+    {
+        pltApicFreeVector (vector, PLT_INT_ALL_CPUS, 1);
         return false;    // Not valid
+    }
     intObj->ipl = pltLapicMapPrio (class);
-    // Get IO APIC
-    pltIoApic_t* apic = pltApicGetIoApic (intObj->gsi);
-    if (!apic)
-        return false;    // Invalid line
-    // We are error safe, reserve the vector
-    mapEnt->vectors[vector - (class << 4)] = true;
-    ++mapEnt->numAlloced;
     intObj->vector = vector;
     // Setup the redirection entry
     uint64_t redir = PLT_APIC_FIXED | PLT_IOAPIC_MASK;
@@ -439,7 +539,10 @@ static bool pltApicMapInterrupt (NkHwInterrupt_t* intObj)
     else
         redir |= PLT_IOAPIC_LEVEL;
     redir |= vector & 0xFF;
-    redir |= (uint64_t) (PltGetPlatform()->bsp->id) << PLT_IOAPIC_DEST_SHIFT;
+    PltCpu_t* cpu = PltGetPlatform()->cpuMap[intObj->cpuNum];
+    if (!cpu)
+        cpu = PltGetPlatform()->bsp;
+    redir |= (uint64_t) (cpu->id) << PLT_IOAPIC_DEST_SHIFT;
     // Now write it out
     NkSpinLock (&apic->lock);
     pltIoApicWriteRedir (apic, intObj->gsi - apic->gsiBase, redir);
@@ -483,6 +586,22 @@ static void PltApicEnableInterrupt (NkCcb_t* ccb, NkHwInterrupt_t* intObj)
     NkSpinUnlock (&apic->lock);
 }
 
+static bool PltApicSetAffinity (NkCcb_t* ccb, NkHwInterrupt_t* intObj, PltCpu_t* cpu)
+{
+    if (cpu->type != PLT_CPU_APIC || cpu->id > 0xFF)
+        return false;    // Can't be reached in physical mode
+    pltIoApic_t* apic = pltApicGetIoApic (intObj->gsi);
+    assert (apic);
+    uint32_t line = intObj->gsi - apic->gsiBase;
+    NkSpinLock (&apic->lock);
+    uint64_t redir = pltIoApicReadRedir (apic, line) & ~(PLT_IOAPIC_DEST_MASK);
+    // Mask it while we change it, so it can't go out half-written
+    pltIoApicWriteRedir (apic, line, redir | PLT_IOAPIC_MASK);
+    pltIoApicWriteRedir (apic, line, redir | ((uint64_t) cpu->id << PLT_IOAPIC_DEST_SHIFT));
+    NkSpinUnlock (&apic->lock);
+    return true;
+}
+
 static void PltApicSetIpl (NkCcb_t* ccb, ipl_t ipl)
 {
     uint8_t priority = 0;
@@ -546,17 +665,63 @@ static int PltApicConnectInterrupt (NkCcb_t* ccb, NkHwInterrupt_t* intObj)
     return intObj->vector;
 }
 
+// Writes ICR to send an IPI to APIC ID dest
+static void pltLapicSendIcr (uint32_t dest, uint32_t cmd)
+{
+    // In x2APIC mode the whole ICR is written at once, and there's no delivery status to wait on
+    // WRMSR to it doesn't serialize, so make sure what the target is meant to see gets out first
+    if (apicX2)
+    {
+        __atomic_thread_fence (__ATOMIC_SEQ_CST);
+        CpuWrmsr (PLT_APIC_X2_ICR, ((uint64_t) dest << 32) | cmd);
+        return;
+    }
+    // Wait for the last IPI to go out
+    while (pltLapicRead (PLT_LAPIC_ICR1) & PLT_APIC_IPI_STATUS_PENDING)
+        CpuSpin();
+    pltLapicWrite (PLT_LAPIC_ICR2, dest << PLT_APIC_ID_SHIFT);
+    pltLapicWrite (PLT_LAPIC_ICR1, cmd);
+}
+
+static void PltApicSendIpi (NkCcb_t* ccb, PltCpu_t* cpu, int ipi)
+{
+    assert (ipi == PLT_IPI_TLB || ipi == PLT_IPI_RESCHED);
+    uint32_t vector = (ipi == PLT_IPI_TLB) ? PLT_APIC_TLB : PLT_APIC_RESCHED;
+    pltLapicSendIcr (cpu->id,
+                     vector | PLT_APIC_DEST_PHYS | PLT_APIC_IPI_ASSERT | PLT_APIC_IPI_EDGE);
+}
+
+static bool PltApicStartCpu (NkCcb_t* ccb, PltCpu_t* cpu, paddr_t entry)
+{
+    if (cpu->type != PLT_CPU_APIC)
+        return false;    // Can't reach it
+    // Startup IPIs can only point to a page under 1 MiB
+    if (entry & (NEXKE_CPU_PAGESZ - 1) || entry >= 0x100000)
+        return false;
+    // Send INIT to reset the CPU, then deassert it
+    pltLapicSendIcr (cpu->id,
+                     PLT_APIC_INIT_IPI | PLT_APIC_DEST_PHYS | PLT_APIC_IPI_ASSERT |
+                         PLT_APIC_IPI_LEVEL);
+    pltLapicSendIcr (cpu->id, PLT_APIC_INIT_IPI | PLT_APIC_DEST_PHYS | PLT_APIC_IPI_LEVEL);
+    NkDelayUs (10000);
+    // Now send two startup IPIs, older CPUs can miss the first one
+    uint32_t vector = entry >> 12;
+    for (int i = 0; i < 2; ++i)
+    {
+        pltLapicSendIcr (cpu->id,
+                         PLT_APIC_STARTUP_IPI | PLT_APIC_DEST_PHYS | PLT_APIC_IPI_ASSERT | vector);
+        NkDelayUs (200);
+    }
+    return true;
+}
+
 static void PltApicDisconnectInterrupt (NkCcb_t* ccb, NkHwInterrupt_t* intObj)
 {
     PltHwIntChain_t* chain = &pltApic.lineMap[intObj->gsi];
     if (chain->chainLen == 0)
     {
         // Grab the vector and free it
-        int class = PLT_APIC_PRI_TO_CLASS (intObj->vector);
-        pltApicPriority_t* mapEnt = &vectorMap[class];
-        // Free it
-        mapEnt->vectors[intObj->vector - PLT_APIC_CLASS_TO_PRI (class)] = false;
-        --mapEnt->numAlloced;
+        pltApicFreeVector (intObj->vector, PLT_INT_ALL_CPUS, 1);
         // Unmap interrupt from vector
         pltIoApic_t* apic = pltApicGetIoApic (intObj->gsi);
         assert (apic);
@@ -582,6 +747,61 @@ int PltApicGetRedirs (paddr_t base)
     return ((ver >> 16) & 0xFF) + 1;
 }
 
+// Routes performance counter overflows on this CPU to an NMI
+// Delivering one masks the LVT entry, so this gets done again after each one
+bool PltApicArmPmi()
+{
+    if (!apicBase && !apicX2)
+        return false;
+    if (((pltLapicRead (PLT_LAPIC_VERSION) >> 16) & 0xFF) < 4)
+        return false;    // No performance counter entry
+    pltLapicWrite (PLT_LVT_PMC, PLT_APIC_NMI);
+    return true;
+}
+
+static void PltApicInitCpu (NkCcb_t* ccb)
+{
+    pltLapicSetup();
+}
+
+// Allocates vectors for message signalled interrupts, delivered straight to cpu's LAPIC
+// They only come out of cpu's vectors, which is the logical CPU in ints
+static int PltApicAllocMsi (NkCcb_t* ccb,
+                            NkHwInterrupt_t* ints,
+                            int count,
+                            PltCpu_t* cpu,
+                            PltMsiMsg_t* msg)
+{
+    // Every vector has to be in one class, and the APIC ID has to fit in the address
+    if (count > PLT_APIC_PRIO_NUM_VECT || cpu->type != PLT_CPU_APIC || cpu->id > PLT_MSI_MAX_DEST)
+        return -1;
+    uint8_t class = PLT_APIC_PRI_TO_CLASS (pltLapicMapIpl (ints[0].ipl));
+    int vector = 0;
+    if (!pltApicAllocVector (&class, ints[0].cpuNum, &vector, count))
+        return -1;
+    // Timer interrupts have to be in the top class
+    if (ints[0].ipl == PLT_IPL_TIMER && class != PLT_APIC_NUM_PRIORITY - 1)
+    {
+        pltApicFreeVector (vector, ints[0].cpuNum, count);
+        return -1;
+    }
+    ipl_t ipl = pltLapicMapPrio (class);
+    for (int i = 0; i < count; ++i)
+    {
+        ints[i].vector = vector + i;
+        ints[i].ipl = ipl;
+    }
+    msg->addr = PLT_MSI_ADDR_BASE | ((uint64_t) cpu->id << PLT_MSI_DEST_SHIFT);
+    msg->data = vector | PLT_APIC_FIXED | PLT_APIC_IPI_EDGE;
+    return vector;
+}
+
+// Frees vectors of message signalled interrupts
+static void PltApicFreeMsi (NkCcb_t* ccb, NkHwInterrupt_t* ints, int count)
+{
+    pltApicFreeVector (ints[0].vector, ints[0].cpuNum, count);
+}
+
 PltHwIntCtrl_t pltApic = {.type = PLT_HWINT_APIC,
                           .beginInterrupt = PltApicBeginInterrupt,
                           .connectInterrupt = PltApicConnectInterrupt,
@@ -590,12 +810,19 @@ PltHwIntCtrl_t pltApic = {.type = PLT_HWINT_APIC,
                           .enableInterrupt = PltApicEnableInterrupt,
                           .endInterrupt = PltApicEndInterrupt,
                           .setIpl = PltApicSetIpl,
-                          .getVector = PltApicGetVector};
+                          .getVector = PltApicGetVector,
+                          .sendIpi = PltApicSendIpi,
+                          .startCpu = PltApicStartCpu,
+                          .initCpu = PltApicInitCpu,
+                          .allocMsi = PltApicAllocMsi,
+                          .freeMsi = PltApicFreeMsi,
+                          .setAffinity = PltApicSetAffinity};
 
 static void pltApicArmTimer (ktime_t delta)
 {
-    if (armCount)
-        armCount = 0, finalArm = 0;
+    int cpu = CpuGetCcb()->cpuNum;
+    if (armCount[cpu])
+        armCount[cpu] = 0, finalArm[cpu] = 0;
     delta /= pltApicTimer.precision;    // Get to timer precision
     // Make sure delta is not 0
     if (!delta)
@@ -605,8 +832,8 @@ static void pltApicArmTimer (ktime_t delta)
     if (delta > maxInterval)
     {
         // Figure out the number of arms we will need to do
-        armCount = delta / maxInterval;
-        finalArm = delta % maxInterval;
+        armCount[cpu] = delta / maxInterval;
+        finalArm[cpu] = delta % maxInterval;
         // Set delta to max
         delta = maxInterval;
     }
@@ -614,22 +841,17 @@ static void pltApicArmTimer (ktime_t delta)
     pltLapicWrite (PLT_TIMER_INITIAL_COUNT, (uint32_t) delta);
 }
 
-static bool pltLapicInit()
+// Sets up the LAPIC of the current CPU
+static void pltLapicSetup()
 {
-    // Check if APIC exists
-    NkCcb_t* ccb = CpuGetCcb();
-    if (!(ccb->archCcb.features & CPU_FEATURE_APIC))
-        return false;    // APIC doesn't exist
-    // Get APIC base
-    apicBase =
-        MmAllocKvMmio (PLT_APIC_BASE, 1, MUL_PAGE_DEV | MUL_PAGE_RW | MUL_PAGE_R | MUL_PAGE_KE);
     // Enable it in the MSR
+    // x2APIC mode can only be entered from xAPIC mode, so both bits get set in order
     uint64_t apicBase = CpuRdmsr (PLT_APIC_BASE_MSR);
     apicBase |= PLT_APIC_MSR_ENABLE;
     CpuWrmsr (PLT_APIC_BASE_MSR, apicBase);
-    // Disable 8295A PIC
-    CpuOutb (PLT_PIC_MASTER_DATA, 0xFF);
-    CpuOutb (PLT_PIC_SLAVE_DATA, 0xFF);
+    if (apicX2)
+        apicBase |= PLT_APIC_MSR_X2;
+    CpuWrmsr (PLT_APIC_BASE_MSR, apicBase);
     // Get number LVT entries
     uint32_t maxLvt = (pltLapicRead (PLT_LAPIC_VERSION) >> 16) & 0xFF;
     // Setup SVR to enable APIC
@@ -653,8 +875,37 @@ static bool pltLapicInit()
     pltLapicWrite (PLT_LAPIC_EOI, 0);
     // Set TPR
     pltLapicWrite (PLT_LAPIC_TPR, 0);
+}
+
+static bool pltLapicInit()
+{
+    // Check if APIC exists
+    NkCcb_t* ccb = CpuGetCcb();
+    if (!(ccb->archCcb.features & CPU_FEATURE_APIC))
+        return false;    // APIC doesn't exist
+    // Use x2APIC mode if we can, as MSRs are cheaper than MMIO and IPIs go out in one write
+    if ((ccb->archCcb.features & CPU_FEATURE_X2APIC) && !NkReadArg ("-nox2apic"))
+    {
+        apicX2 = true;
+        NkLogDebug ("nexke: using x2APIC mode\n");
+    }
+    else
+    {
+        // Get APIC base
+        // Every LAPIC sits at the same address, so one mapping works for all CPUs
+        apicBase = MmAllocKvMmio (PLT_APIC_BASE,
+                                  1,
+                                  MUL_PAGE_DEV | MUL_PAGE_RW | MUL_PAGE_R | MUL_PAGE_KE);
+    }
+    // Disable 8295A PIC
+    CpuOutb (PLT_PIC_MASTER_DATA, 0xFF);
+    CpuOutb (PLT_PIC_SLAVE_DATA, 0xFF);
+    pltLapicSetup();
     // Find platform CPU with this APIC ID so we can determine the BSP
-    int selfId = pltLapicRead (PLT_LAPIC_ID) >> 24;
+    // x2APIC IDs take up the whole register
+    int selfId = (int) pltLapicRead (PLT_LAPIC_ID);
+    if (!apicX2)
+        selfId >>= PLT_APIC_ID_SHIFT;
     NkLink_t* iter = NkListFront (&PltGetPlatform()->cpus);
     while (iter)
     {
@@ -664,17 +915,29 @@ static bool pltLapicInit()
             // Set this as BSP
             NkLogDebug ("nexke: found BSP at CPU %d\n", curCpu->id);
             PltGetPlatform()->bsp = curCpu;
+            PltGetPlatform()->cpuMap[ccb->cpuNum] = curCpu;
             break;
         }
         iter = NkListIterate (&PltGetPlatform()->cpus, iter);
     }
     assert (PltGetPlatform()->bsp);
+    // Keep the vectors of our own interrupts from being handed out
+    pltApicPriority_t* fixed = &vectorMap[PLT_APIC_PRI_TO_CLASS (PLT_APIC_ERROR)];
+    for (int i = PLT_APIC_ERROR; i <= PLT_APIC_RESCHED; ++i)
+        fixed->vectors[i - PLT_APIC_CLASS_TO_PRI (PLT_APIC_PRI_TO_CLASS (i))] = true;
+    fixed->numAlloced += PLT_APIC_RESCHED - PLT_APIC_ERROR + 1;
     // Install spurious and error interrupts
     PltInitInternalInt (&spuriousInt, pltLapicSpurious, PLT_APIC_SPURIOUS, PLT_IPL_HIGH, 0, 0);
     PltConnectInterrupt (&spuriousInt);
     // Error interrupt
     PltInitInternalInt (&errorInt, pltLapicError, PLT_APIC_ERROR, PLT_IPL_HIGH, 0, 0);
     PltConnectInterrupt (&errorInt);
+    // TLB shootdown IPI
+    PltInitInternalInt (&tlbInt, pltLapicTlb, PLT_APIC_TLB, PLT_IPL_TIMER, 0, 0);
+    PltConnectInterrupt (&tlbInt);
+    // Reschedule IPI
+    PltInitInternalInt (&reschedInt, pltLapicResched, PLT_APIC_RESCHED, PLT_IPL_TIMER, 0, 0);
+    PltConnectInterrupt (&reschedInt);
     return true;
 }
 
@@ -721,15 +984,62 @@ PltHwIntCtrl_t* PltApicInit()
     }
     // Set up line map
     size_t mapSz = sizeof (PltHwIntChain_t) * numLines;
-    // NOTE: we would ideally malloc here, but for now, malloc sizes are limited
-    pltApic.lineMap = (PltHwIntChain_t*) MmAllocKvRegion (2, MM_KV_NO_DEMAND);
+    pltApic.lineMap = (PltHwIntChain_t*) kmalloc (mapSz, MM_TAG_PLATFORM);
     pltApic.numLines = numLines;
     assert (pltApic.lineMap);
     memset (pltApic.lineMap, 0, mapSz);
     return &pltApic;
 }
 
-PltHwTimer_t pltApicTimer = {.type = PLT_TIMER_APIC, .armTimer = pltApicArmTimer};
+// Sets up timer of a newly started CPU
+// Calibration on the BSP holds for every CPU, as they all run off the same bus clock
+static void pltApicInitTimerCpu (NkCcb_t* ccb)
+{
+    pltLapicWrite (PLT_TIMER_DIVIDE, PLT_APIC_DIV_16);
+    pltLapicWrite (PLT_LVT_TIMER, PLT_APIC_TIMER | PLT_APIC_TIMER_ONE_SHOT);
+}
+
+PltHwTimer_t pltApicTimer = {.type = PLT_TIMER_APIC,
+                             .armTimer = pltApicArmTimer,
+                             .initCpu = pltApicInitTimerCpu};
+
+// TSC deadline mode
+// The timer goes off when the TSC reaches the value in the deadline MSR, so arming it is one
+// MSR write, and it can reach any deadline without being re-armed
+
+// Arms deadline timer to delta
+static void pltApicArmDeadline (ktime_t delta)
+{
+    CpuWrmsr (PLT_APIC_DEADLINE_MSR, CpuTscDeadline (delta));
+}
+
+// Sets up deadline timer of a newly started CPU
+static void pltApicInitDeadlineCpu (NkCcb_t* ccb)
+{
+    pltLapicWrite (PLT_LVT_TIMER, PLT_APIC_TIMER | PLT_APIC_TIMER_TSC);
+    // The MSR write that arms it mustn't get ahead of the mode change
+    CpuMfence();
+}
+
+PltHwTimer_t pltApicDeadlineTimer = {.type = PLT_TIMER_TSC,
+                                     .armTimer = pltApicArmDeadline,
+                                     .initCpu = pltApicInitDeadlineCpu};
+
+// Sets up the APIC timer in TSC deadline mode
+static PltHwTimer_t* pltApicInitDeadline()
+{
+    // Deadlines are in TSC counts, so the TSC has to be the clock
+    PltHwClock_t* clock = PltGetPlatform()->clock;
+    pltApicDeadlineTimer.precision = clock->precision;
+    pltApicDeadlineTimer.maxInterval = INT64_MAX;
+    isApicTimer = true;
+    PltInitInternalInt (&timerInt, pltLapicTimer, PLT_APIC_TIMER, PLT_IPL_TIMER, 0, 0);
+    PltConnectInterrupt (&timerInt);
+    pltApicInitDeadlineCpu (CpuGetCcb());
+    NkLogDebug ("nexke: using APIC TSC deadline as timer, precision %uns\n",
+                pltApicDeadlineTimer.precision);
+    return &pltApicDeadlineTimer;
+}
 
 PltHwTimer_t* PltApicInitTimer()
 {
@@ -737,6 +1047,13 @@ PltHwTimer_t* PltApicInitTimer()
     NkCcb_t* ccb = CpuGetCcb();
     if (!(CpuGetFeatures() & CPU_FEATURE_APIC))
         return false;
+    // Prefer TSC deadline mode
+    if ((CpuGetFeatures() & CPU_FEATURE_TSC_DEADLINE) &&
+        PltGetPlatform()->clock->type == PLT_CLOCK_TSC && !NkReadArg ("-nodeadline"))
+    {
+        return pltApicInitDeadline();
+    }
+    // Otherwise use one shot mode
     // Set up divide register
     pltLapicWrite (PLT_TIMER_DIVIDE, PLT_APIC_DIV_16);
     // Set up LVT entry, still keeping it masked
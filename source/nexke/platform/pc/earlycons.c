@@ -187,6 +187,15 @@ NkConsole_t vgaCons = {.read = vgaRead, .write = vgaWriteString};
 #define UART_DIVISOR_LSB_REG  0
 #define UART_DIVISOR_MSB_REG  1
 
+// IER bits
+#define UART_IER_THRE (1 << 1)
+
+// IIR bits
+#define UART_IIR_NOINT   (1 << 0)
+#define UART_IIR_ID_MASK (7 << 1)
+#define UART_IIR_THRE    (1 << 1)
+#define UART_IIR_FIFO    (3 << 6)    // Both set if the FIFOs work
+
 // FCR bits
 #define UART_FIFO_ENABLE   (1 << 0)
 #define UART_FIFO_RX_RESET (1 << 1)
@@ -208,6 +217,7 @@ NkConsole_t vgaCons = {.read = vgaRead, .write = vgaWriteString};
 // MCR bits
 #define UART_MCR_DTS      (1 << 0)
 #define UART_MCR_RTS      (1 << 1)
+#define UART_MCR_OUT2     (1 << 3)    // Connects the UART to the IRQ line
 #define UART_MCR_LOOPBACK (1 << 4)
 
 // Freqeuncy of UART crystal
@@ -215,6 +225,24 @@ NkConsole_t vgaCons = {.read = vgaRead, .write = vgaWriteString};
 #define UART_DEFAULT_BAUDRATE 38400
 
 #define UART_IOBASE 0x3F8
+#define UART_IRQ    4
+
+#define UART_FIFO_DEPTH  16
+#define UART_TXRING_SIZE 4096    // Must be a power of 2
+
+// Output goes in a ring, and is moved into the TX FIFO a FIFO's worth at a time. Once interrupts
+// are up, the TX empty interrupt refills the FIFO, so writers don't wait on the line
+// Before that, and after a panic, writers drain the ring themselves
+static char uartTxRing[UART_TXRING_SIZE];
+static size_t uartTxHead = 0, uartTxTail = 0;
+
+static int uartFifoSz = 1;         // Bytes we can write each time the FIFO empties
+static bool uartIntOn = false;     // Whether the interrupt drains the ring
+static bool uartTxBusy = false;    // Whether the TX empty interrupt is enabled
+static bool uartSync = false;      // Whether writers drain the ring themselves for good
+static spinlock_t uartLock = 0;    // Protects ring and TX between writers and the interrupt
+
+static NkHwInterrupt_t uartInt = {0};
 
 // UART helper functions
 static inline void uartWriteReg (uint8_t reg, uint8_t data)
@@ -245,6 +273,9 @@ bool PltUartInit()
 {
     // Program FIFO
     uartWriteReg (UART_FIFO_CTRL_REG, UART_FIFO_ENABLE | UART_FIFO_TX_RESET | UART_FIFO_RX_RESET);
+    // Older UARTs have no FIFO, or one that doesn't work
+    if ((uartReadReg (UART_INT_IDENT_REF) & UART_IIR_FIFO) == UART_IIR_FIFO)
+        uartFifoSz = UART_FIFO_DEPTH;
     // Clear all interrupts
     uartWriteReg (UART_INT_ENABLE_REG, 0);
     // Write MCR
@@ -278,21 +309,117 @@ bool PltUartInit()
     return true;
 }
 
+// Moves as much of the ring as fits into the TX FIFO, which must be empty
+// Returns false if the ring was empty
+static bool uartFillFifo()
+{
+    int i = 0;
+    for (; i < uartFifoSz && uartTxTail != uartTxHead; ++i)
+        uartWriteReg (UART_TXBUF, uartTxRing[uartTxTail++ & (UART_TXRING_SIZE - 1)]);
+    return i != 0;
+}
+
+// Writes out the whole ring
+static void uartDrain()
+{
+    while (uartTxTail != uartTxHead)
+    {
+        uartWaitForTx();
+        uartFillFifo();
+    }
+}
+
+// Puts a character in the ring, making room if it's full
+static void uartQueue (char c)
+{
+    if (uartTxHead - uartTxTail == UART_TXRING_SIZE)
+    {
+        uartWaitForTx();
+        uartFillFifo();
+    }
+    uartTxRing[uartTxHead++ & (UART_TXRING_SIZE - 1)] = c;
+}
+
+// UART interrupt handler
+static bool uartHandler (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    // Reading IIR acknowledges TX empty
+    uint8_t iir = uartReadReg (UART_INT_IDENT_REF);
+    if (iir & UART_IIR_NOINT)
+        return false;
+    NkSpinLock (&uartLock);
+    if ((iir & UART_IIR_ID_MASK) == UART_IIR_THRE && !uartFillFifo())
+    {
+        // Nothing left, so stop interrupting until there is
+        uartWriteReg (UART_INT_ENABLE_REG, 0);
+        uartTxBusy = false;
+    }
+    NkSpinUnlock (&uartLock);
+    return true;
+}
+
+// Starts draining output from the UART's interrupt
+void PltUartInitInt()
+{
+    PltInitInterrupt (&uartInt,
+                      uartHandler,
+                      PltGetGsi (PLT_BUS_ISA, UART_IRQ),
+                      PLT_IPL_TIMER,
+                      PLT_MODE_EDGE,
+                      0);
+    if (!PltConnectInterrupt (&uartInt))
+    {
+        NkLogWarning ("nexke: warning: can't install UART interrupt, output will be polled\n");
+        return;
+    }
+    uartWriteReg (UART_MODEM_CTRL_REG, uartReadReg (UART_MODEM_CTRL_REG) | UART_MCR_OUT2);
+    uartIntOn = true;
+}
+
 // Writes a string to UART
 static void uartWrite (const char* s)
 {
+    if (!uartIntOn || uartSync)
+    {
+        while (*s)
+        {
+            // Translate CRLF
+            if (*s == '\n')
+                uartQueue ('\r');
+            uartQueue (*s);
+            ++s;
+        }
+        uartDrain();
+        return;
+    }
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_TIMER);
+    NkSpinLock (&uartLock);
     while (*s)
     {
         // Translate CRLF
         if (*s == '\n')
-        {
-            uartWaitForTx();
-            uartWriteReg (UART_TXBUF, '\r');
-        }
-        uartWaitForTx();
-        uartWriteReg (UART_TXBUF, *s);
+            uartQueue ('\r');
+        uartQueue (*s);
         ++s;
     }
+    // Enabling the interrupt while TX is empty raises it right away
+    if (!uartTxBusy)
+    {
+        uartTxBusy = true;
+        uartWriteReg (UART_INT_ENABLE_REG, UART_IER_THRE);
+    }
+    NkSpinUnlock (&uartLock);
+    PltLowerIpl (ipl);
+}
+
+// Writes out what's buffered, and stops buffering
+// The lock may be held by a CPU that's gone, so don't take it
+static void uartSyncOut()
+{
+    uartSync = true;
+    if (uartIntOn)
+        uartWriteReg (UART_INT_ENABLE_REG, 0);
+    uartDrain();
 }
 
 // Reads a string from UART
@@ -306,4 +433,4 @@ static bool uartRead (char* s)
 }
 
 // Console definition
-NkConsole_t uartCons = {.read = uartRead, .write = uartWrite};
+NkConsole_t uartCons = {.read = uartRead, .write = uartWrite, .sync = uartSyncOut};
@@ -42,7 +42,7 @@ typedef struct _hpetacpi
 // Cap register defines
 #define PLT_HPET_REV_MASK     0xFF
 #define PLT_HPET_TIMER_SHIFT  8
-#define PLT_HPET_TIMER_MASK   0xF
+#define PLT_HPET_TIMER_MASK   0x1F
 #define PLT_HPET_COUNT_SZ     (1 << 13)
 #define PLT_HPET_LEG_ROUTE    (1 << 15)
 #define PLT_HPET_PERIOD_SHIFT 32ULL
@@ -72,6 +72,27 @@ typedef struct _hpetacpi
 #define PLT_HPET_FSB_CAP         (1 << 15)
 #define PLT_HPET_ROUTE_CAP_SHIFT 32
 
+// FSB route register
+#define PLT_HPET_FSB_ADDR_SHIFT 32
+
+#define PLT_HPET_MAX_COMPS 32
+
+// Comparators either all go to one line, in which case only comparator 0 is used and the timer
+// is global, or each CPU gets one of its own that sends it an MSI straight from the HPET
+// A comparator goes off when the counter equals it. 32 bit comparators only look at the low half
+// of the counter, so targets further out than that take stops on the way. 64 bit ones don't
+// need any
+
+// A comparator
+typedef struct _hpetcomp
+{
+    int idx;                  // Index of comparator
+    bool is64;                // Does it compare every bit of the counter?
+    bool fsb;                 // Can it send MSIs?
+    uint64_t target;          // Count the timer is armed for
+    NkHwInterrupt_t hwInt;    // Interrupt of comparator
+} pltHpetComp_t;
+
 typedef struct _hpet
 {
     uintptr_t addr;       // Address of HPET
@@ -79,13 +100,15 @@ typedef struct _hpet
     ktime_t lastRead;     // Last clock read
     int overflowCount;    // Number of overflows to occur
     uint32_t div;         // If precision is beyond nanosec, divide by this
-    int armCount;         // Times to arm timer before expiration
-    ktime_t finalArm;     // Final arm value
     uint32_t minDelta;    // Minimum delta
+    int numComps;         // Number of comparators
+    int nextComp;         // Next comparator to give a CPU
 } pltHpet_t;
 
 static pltHpet_t hpet = {0};
-static NkHwInterrupt_t hpetInt = {0};
+static pltHpetComp_t hpetComps[PLT_HPET_MAX_COMPS] = {0};
+static pltHpetComp_t* hpetCpuComps[NEXKE_MAX_CPUS] = {NULL};    // Comparator of each CPU
+static spinlock_t hpetCompLock = 0;
 
 // Forward declarations of clock and timer
 extern PltHwClock_t pltHpetClock;
@@ -149,27 +172,6 @@ static inline ktime_t pltToHpetTime (ktime_t val)
     return val / pltHpetClock.precision;
 }
 
-// Timer interrupt handler
-static bool PltHpetDispatch (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
-{
-    if (hpet.armCount)
-    {
-        --hpet.armCount;
-        if (!hpet.armCount)
-            pltHpetTimerWrite (0, PLT_HPET_TIMER_COMP, hpet.finalArm);    // Arm the final arm
-        else
-            pltHpetTimerWrite (0, PLT_HPET_TIMER_COMP, UINT32_MAX);    // Normal arm
-    }
-    else
-    {
-        // Call handler
-        NkTimeHandler();
-    }
-    // Clear timer 0 interrupt
-    pltHpetWrite64 (PLT_HPET_INT_STATUS, (1 << 0));
-    return true;
-}
-
 // Gets time of clock
 static FORCEINLINE ktime_t pltHpetGetCount()
 {
@@ -218,39 +220,51 @@ static ktime_t PltHpetGetTime()
     return pltFromHpetTime (pltHpetGetCount());
 }
 
+// Programs comp to go off at its target, or the furthest stop on the way it can reach
+// Returns false if the target has already passed
+static bool pltHpetArmComp (pltHpetComp_t* comp)
+{
+    while (1)
+    {
+        uint64_t now = pltHpetGetCount();
+        if ((int64_t) (comp->target - now) <= 0)
+            return false;
+        uint64_t next = comp->target;
+        if (!comp->is64 && (next - now) > UINT32_MAX)
+            next = now + UINT32_MAX;
+        pltHpetTimerWrite (comp->idx,
+                           PLT_HPET_TIMER_COMP,
+                           (comp->is64) ? next : (uint32_t) next);
+        // The comparator only matches the counter exactly, so if the counter got past it while
+        // we were writing it, it won't go off
+        if ((int64_t) (pltHpetGetCount() - next) < 0)
+            return true;
+    }
+}
+
+// Timer interrupt handler
+static bool PltHpetDispatch (NkInterrupt_t* intObj, CpuIntContext_t* ctx)
+{
+    pltHpetComp_t* comp = hpetCpuComps[CpuGetCcb()->cpuNum];
+    // Lines are level triggered, so the interrupt has to be cleared first
+    if (!(comp->hwInt.flags & PLT_HWINT_MSI))
+        pltHpetWrite64 (PLT_HPET_INT_STATUS, (1ULL << comp->idx));
+    // If this was a stop on the way, go on to the next one
+    if (!pltHpetArmComp (comp))
+        NkTimeHandler();
+    return true;
+}
+
 // Arms timer
 static void PltHpetArmTimer (ktime_t delta)
 {
     PltHwClock_t* clock = PltGetPlatform()->clock;
     assert (clock->type == PLT_CLOCK_HPET);
-    // Disarm if needed
-    if (hpet.armCount)
-        hpet.armCount = 0, hpet.finalArm = 0;
-    ktime_t hpetDelta = pltToHpetTime (delta);
-    ktime_t refTick = pltHpetGetCount();
-    ktime_t compVal = refTick + hpetDelta;
-    // Check for overflow on 32 bit timers
-    if (!hpet.isTimer64 && compVal > UINT32_MAX)
-    {
-        // We have three parts: the intial arm, how many max arms,
-        // and the final arm
-        // Compute them
-        uint32_t firstArm = 0xFFFFFFFF - refTick;
-        compVal -= firstArm;
-        // Now get how many times we need to arm at UINT32_MAX
-        hpet.armCount = compVal / (UINT32_MAX + 1);
-        hpet.finalArm = compVal % (UINT32_MAX + 1);
-        compVal = firstArm;
-    }
-    pltHpetTimerWrite (0, PLT_HPET_TIMER_COMP, compVal);
-    // Check if we missed the interrupt
-    // If the clock has surpassed the comparator and the interrupt hasn't been set
-    // we have to handle it now
-    if (compVal < pltHpetGetCount() && !(pltHpetRead64 (PLT_HPET_INT_STATUS) & (1 << 0)))
-    {
-        // Handle the interrupt now
+    pltHpetComp_t* comp = hpetCpuComps[CpuGetCcb()->cpuNum];
+    comp->target = pltHpetGetCount() + pltToHpetTime (delta);
+    // If we missed it, handle it now
+    if (!pltHpetArmComp (comp))
         NkTimeHandler();
-    }
 }
 
 // Polls clock for specified ns
@@ -274,6 +288,9 @@ PltHwTimer_t pltHpetTimer = {.type = PLT_TIMER_HPET, .armTimer = PltHpetArmTimer
 PltHwClock_t* PltHpetInitClock()
 {
     pltHpetClock.private = (uintptr_t) &hpet;
+    // The TSC may have already set us up to calibrate against
+    if (hpet.addr)
+        return &pltHpetClock;
     // Find ACPI table
     AcpiHpet_t* hpetAcpi = (AcpiHpet_t*) PltAcpiFindTable ("HPET");
     if (!hpetAcpi)
@@ -311,20 +328,49 @@ PltHwClock_t* PltHpetInitClock()
     return &pltHpetClock;
 }
 
-// HPET timer intialization function
-PltHwTimer_t* PltHpetInitTimer()
+// Gives ccb a comparator that sends it MSIs
+static bool pltHpetConnectComp (NkCcb_t* ccb)
 {
-    pltHpetTimer.private = (uintptr_t) &hpet;
-    if (!hpet.addr)
-        return NULL;    // No HPET was found when looking for a clock
-    // Set precision
-    pltHpetTimer.precision = pltHpetClock.precision;
-    // Figure out max interval
-    pltHpetTimer.maxInterval = pltFromHpetTime ((hpet.isTimer64) ? UINT64_MAX : UINT32_MAX);
-    // Program timer
+    NkSpinLock (&hpetCompLock);
+    pltHpetComp_t* comp = NULL;
+    while (hpet.nextComp < hpet.numComps && !comp)
+    {
+        if (hpetComps[hpet.nextComp].fsb)
+            comp = &hpetComps[hpet.nextComp];
+        ++hpet.nextComp;
+    }
+    NkSpinUnlock (&hpetCompLock);
+    if (!comp)
+        return false;
+    PltMsiMsg_t msg = {0};
+    PltInitMsi (&comp->hwInt, PltHpetDispatch, PLT_IPL_TIMER, 0);
+    if (!PltConnectMsi (&comp->hwInt, 1, ccb->cpuNum, &msg))
+        return false;
+    pltHpetTimerWrite (comp->idx,
+                       PLT_HPET_TIMER_FSB_ROUTE,
+                       (msg.addr << PLT_HPET_FSB_ADDR_SHIFT) | msg.data);
+    // Messages are edge triggered
+    uint64_t timerCnf = pltHpetTimerRead (comp->idx, PLT_HPET_TIMER_CONF);
+    timerCnf &= ~(PLT_HPET_TIMER_LEVEL | PLT_HPET_TIMER_PERIODIC | PLT_HPET_TIMER_32);
+    timerCnf |= PLT_HPET_FSB_ENABLE | PLT_HPET_TIMER_INT;
+    pltHpetTimerWrite (comp->idx, PLT_HPET_TIMER_CONF, timerCnf);
+    hpetCpuComps[ccb->cpuNum] = comp;
+    return true;
+}
+
+// Sets up the comparator of a newly started CPU
+static void PltHpetInitCpu (NkCcb_t* ccb)
+{
+    // There are at least as many comparators as CPUs we let start, but vectors could run out
+    if (!pltHpetConnectComp (ccb))
+        NkPanic ("nexke: unable to connect HPET comparator of CPU %d\n", ccb->cpuNum);
+}
+
+// Routes comparator 0 to a line, making the timer global
+static bool pltHpetConnectLine()
+{
+    pltHpetComp_t* comp = &hpetComps[0];
     uint64_t timerCnf = pltHpetTimerRead (0, PLT_HPET_TIMER_CONF);
-    if (timerCnf & PLT_HPET_FSB_CAP)
-        NkLogDebug ("nexke: unable to use HPET FSB interrupt\n");
     // Check if we can use legacy replacement mode
     int line = 0;
     if (pltHpetRead64 (PLT_HPET_GEN_CAP) & PLT_HPET_LEG_ROUTE)
@@ -344,7 +390,6 @@ PltHwTimer_t* PltHpetInitTimer()
         // Figure out interrupts we are capable of
         uint32_t ints = timerCnf >> PLT_HPET_ROUTE_CAP_SHIFT;
         // Find the first available interrupt
-        int line = 0;
         for (int i = 0; i < 32; ++i)
         {
             if (ints & (1 << i))
@@ -354,19 +399,62 @@ PltHwTimer_t* PltHpetInitTimer()
             }
         }
         // Set line
-        timerCnf |= (line << PLT_HPET_ROUTE_SHIFT) & PLT_HPET_ROUTE_MASK;
-        pltHpetTimerWrite (0, PLT_HPET_TIMER_CONF, timerCnf);
+        timerCnf |= (uint64_t) (line & PLT_HPET_ROUTE_MASK) << PLT_HPET_ROUTE_SHIFT;
     }
+    timerCnf &= ~(PLT_HPET_FSB_ENABLE | PLT_HPET_TIMER_PERIODIC | PLT_HPET_TIMER_32);
     timerCnf |= PLT_HPET_TIMER_LEVEL |
                 PLT_HPET_TIMER_INT;    // We want level trigerred since they're more robust
     pltHpetTimerWrite (0, PLT_HPET_TIMER_CONF, timerCnf);
     // Install the interrupt
-    hpetInt.mode = PLT_MODE_LEVEL;
-    hpetInt.gsi = line;
-    hpetInt.ipl = PLT_IPL_TIMER;
-    hpetInt.flags = 0;
-    hpetInt.handler = PltHpetDispatch;
-    if (!PltConnectInterrupt (&hpetInt))
+    comp->hwInt.mode = PLT_MODE_LEVEL;
+    comp->hwInt.gsi = line;
+    comp->hwInt.ipl = PLT_IPL_TIMER;
+    comp->hwInt.flags = 0;
+    comp->hwInt.handler = PltHpetDispatch;
+    if (!PltConnectInterrupt (&comp->hwInt))
+        return false;
+    hpetCpuComps[0] = comp;
+    return true;
+}
+
+// HPET timer intialization function
+PltHwTimer_t* PltHpetInitTimer (bool perCpu)
+{
+    pltHpetTimer.private = (uintptr_t) &hpet;
+    if (!hpet.addr)
+        return NULL;    // No HPET was found when looking for a clock
+    // Set precision
+    pltHpetTimer.precision = pltHpetClock.precision;
+    // Figure out max interval
+    pltHpetTimer.maxInterval = pltFromHpetTime ((hpet.isTimer64) ? UINT64_MAX : UINT32_MAX);
+    // Find out what each comparator can do
+    uint64_t genCap = pltHpetRead64 (PLT_HPET_GEN_CAP);
+    hpet.numComps = ((genCap >> PLT_HPET_TIMER_SHIFT) & PLT_HPET_TIMER_MASK) + 1;
+    int numFsb = 0;
+    for (int i = 0; i < hpet.numComps; ++i)
+    {
+        pltHpetComp_t* comp = &hpetComps[i];
+        uint64_t timerCnf = pltHpetTimerRead (i, PLT_HPET_TIMER_CONF);
+        comp->idx = i;
+        comp->is64 = hpet.isTimer64 && (timerCnf & PLT_HPET_TIMER_64);
+        comp->fsb = (timerCnf & PLT_HPET_FSB_CAP) != 0;
+        numFsb += comp->fsb;
+    }
+    // Give each CPU a comparator if we can, so every CPU can have a timer
+    if (numFsb && PltGetPlatform()->intCtrl->allocMsi && !NkReadArg ("-nohpetfsb") &&
+        pltHpetConnectComp (CpuGetCcb()))
+    {
+        pltHpetTimer.initCpu = PltHpetInitCpu;
+        pltHpetTimer.maxCpus = numFsb;
+        NkLogDebug ("nexke: using %d%s HPET comparators as per-CPU timers, precision %ldns\n",
+                    numFsb,
+                    (hpetCpuComps[0]->is64) ? " 64 bit" : "",
+                    pltHpetTimer.precision);
+        return &pltHpetTimer;
+    }
+    if (perCpu)
+        return NULL;
+    if (!pltHpetConnectLine())
     {
         NkLogWarning ("nexke: unable to install HPET interrupt\n");
         return NULL;
@@ -175,9 +175,9 @@ bool PltMpsDetectCpus()
     if (!NkVerifyChecksum ((uint8_t*) mpTable, sizeof (PltMpTable_t)))
         return false;
     // Create caches
-    cpuCache = MmCacheCreate (sizeof (PltCpu_t), "PltCpu_t", 0, 0);
-    intCache = MmCacheCreate (sizeof (PltIntOverride_t), "PltIntOverride_t", 0, 0);
-    intCtlCache = MmCacheCreate (sizeof (PltIntCtrl_t), "PltIntCtrl_t", 0, 0);
+    cpuCache = MmCacheCreate (sizeof (PltCpu_t), "PltCpu_t", MM_TAG_PLATFORM, 0, 0);
+    intCache = MmCacheCreate (sizeof (PltIntOverride_t), "PltIntOverride_t", MM_TAG_PLATFORM, 0, 0);
+    intCtlCache = MmCacheCreate (sizeof (PltIntCtrl_t), "PltIntCtrl_t", MM_TAG_PLATFORM, 0, 0);
     // Check IMCR
     if (mpTable->features & PLT_MP_FEAT_IMCRP)
     {
@@ -258,6 +258,7 @@ bool PltMpsDetectCpus()
                 PltCpu_t* cpu = (PltCpu_t*) MmCacheAlloc (cpuCache);
                 cpu->id = proc->apicId;
                 cpu->type = PLT_CPU_APIC;
+                cpu->node = 0;
                 PltAddCpu (cpu);
                 iter += 20;
             }
@@ -16,6 +16,7 @@
 */
 
 #include <assert.h>
+#include <nexke/mm.h>
 #include <nexke/nexboot.h>
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
@@ -139,20 +140,22 @@ void PltFallbackDetectCpus()
     if (CpuGetFeatures() & CPU_FEATURE_APIC)
     {
         // Create a CPU
-        PltCpu_t* cpu = (PltCpu_t*) kmalloc (sizeof (PltCpu_t));
+        PltCpu_t* cpu = (PltCpu_t*) kmalloc (sizeof (PltCpu_t), MM_TAG_PLATFORM);
         assert (cpu);
         cpu->id = 0;
         cpu->type = PLT_CPU_APIC;
+        cpu->node = 0;
         PltAddCpu (cpu);
         // Create a interrupt controller
-        PltIntCtrl_t* ctrl =
-            (PltIntCtrl_t*) kmalloc (sizeof (PltIntCtrl_t));    // We can't access the normal cache
+        // We can't access the normal cache
+        PltIntCtrl_t* ctrl = (PltIntCtrl_t*) kmalloc (sizeof (PltIntCtrl_t), MM_TAG_PLATFORM);
         ctrl->addr = PLT_IOAPIC_BASE;
         ctrl->gsiBase = 0;
         ctrl->type = PLT_INTCTRL_IOAPIC;
         PltAddIntCtrl (ctrl);    // Add it to the system
         // Create override from INT2 to INT0
-        PltIntOverride_t* intOv = (PltIntOverride_t*) kmalloc (sizeof (PltIntCtrl_t));
+        PltIntOverride_t* intOv =
+            (PltIntOverride_t*) kmalloc (sizeof (PltIntOverride_t), MM_TAG_PLATFORM);
         intOv->bus = PLT_BUS_ISA;
         intOv->gsi = 2;
         intOv->line = 0;
@@ -162,14 +165,14 @@ void PltFallbackDetectCpus()
     else
     {
         // Create a CPU
-        PltCpu_t* cpu = (PltCpu_t*) kmalloc (sizeof (PltCpu_t));
+        PltCpu_t* cpu = (PltCpu_t*) kmalloc (sizeof (PltCpu_t), MM_TAG_PLATFORM);
         assert (cpu);
         cpu->id = 0;
         cpu->type = PLT_CPU_UP;
         PltAddCpu (cpu);
         // Create a interrupt controller
-        PltIntCtrl_t* ctrl =
-            (PltIntCtrl_t*) kmalloc (sizeof (PltIntCtrl_t));    // We can't access the normal cache
+        // We can't access the normal cache
+        PltIntCtrl_t* ctrl = (PltIntCtrl_t*) kmalloc (sizeof (PltIntCtrl_t), MM_TAG_PLATFORM);
         ctrl->addr = 0;
         ctrl->gsiBase = 0;
         ctrl->type = PLT_INTCTRL_8259A;
@@ -183,6 +186,9 @@ bool PltAcpiSciHandler (NkInterrupt_t* intObj, CpuIntContext_t* ctx);
 void PltInitPhase2()
 {
     PltInitInterrupts();
+    // The page allocator needs to know which node memory is in before it comes up
+    if (nkPlatform.subType == PLT_PC_SUBTYPE_ACPI && !NkReadArg ("-nonuma"))
+        PltAcpiDetectNuma();
 }
 
 // Initialize phase 3
@@ -200,6 +206,11 @@ void PltInitPhase3()
         }
     }
     PltInitHwInts();
+    if (nkPlatform.secondaryCons == &uartCons)
+        PltUartInitInt();
+    // Now that we know which CPU we are, allocate from our own node
+    if (nkPlatform.bsp)
+        MmSetCpuNode (CpuGetCcb(), nkPlatform.bsp->node);
     PltAcpiPcEnable();
     PltInitClock();
     CpuEnable();
@@ -213,6 +224,7 @@ PltHwIntCtrl_t* PltInitHwInts()
     if (!ctrl)
         ctrl = PltPicInit();
     nkPlatform.intCtrl = ctrl;
+    PltUpdateIntCalls (ctrl);
     return ctrl;
 }
 
@@ -238,6 +250,7 @@ PltHwClock_t* PltInitClock()
     }
     assert (clock);
     nkPlatform.clock = clock;
+    NK_STATIC_CALL_UPDATE (PltGetTime, clock->getTime);
     return clock;
 }
 
@@ -245,19 +258,25 @@ PltHwClock_t* PltInitClock()
 PltHwTimer_t* PltInitTimer()
 {
     PltHwTimer_t* timer = NULL;
-    // Prefer APIC
-    if (!NkReadArg ("-usehpet"))
+    // Only use HPET timer with HPET clock
+    bool hpetClock = nkPlatform.clock->type == PLT_CLOCK_HPET;
+    // The APIC timer stops in deep C-states unless it's always running, so if each CPU can have
+    // an HPET comparator of its own, that's better
+    if (hpetClock && !(CpuGetFeatures() & CPU_FEATURE_ARAT))
+        timer = PltHpetInitTimer (true);
+    // Otherwise prefer APIC
+    if (!timer && !NkReadArg ("-usehpet"))
         timer = PltApicInitTimer();
     if (!timer)
     {
-        // Only use HPET timer with HPET clock
-        if (nkPlatform.clock->type == PLT_CLOCK_HPET)
-            timer = PltHpetInitTimer();
+        if (hpetClock)
+            timer = PltHpetInitTimer (false);
         if (!timer)
             timer = PltPitInitTimer();
     }
     assert (timer);
     nkPlatform.timer = timer;
+    NK_STATIC_CALL_UPDATE (PltArmTimer, timer->armTimer);
     return timer;
 }
 
@@ -250,7 +250,7 @@ PltHwIntCtrl_t* PltPicInit()
         NkLogDebug ("nexke: no ELCR found, only edge-triggered interrupts are supported\n");
     // Set up line map
     size_t mapSz = sizeof (PltHwIntChain_t) * 16;
-    plt8259A.lineMap = (PltHwIntChain_t*) kmalloc (mapSz);
+    plt8259A.lineMap = (PltHwIntChain_t*) kmalloc (mapSz, MM_TAG_PLATFORM);
     plt8259A.numLines = 16;
     assert (plt8259A.lineMap);
     memset (plt8259A.lineMap, 0, mapSz);
@@ -45,6 +45,12 @@
 #define PLT_PIT_SEL_CHAN2  (2 << 6)
 #define PLT_PIT_READBACK   (3 << 6)
 
+// Port B of the keyboard controller, which gates channel 2
+#define PLT_PIT_PORTB      0x61
+#define PLT_PIT_PORTB_GATE (1 << 0)
+#define PLT_PIT_PORTB_SPKR (1 << 1)
+#define PLT_PIT_PORTB_OUT2 (1 << 5)
+
 extern PltHwTimer_t pitTimer;
 extern PltHwClock_t pitClock;
 
@@ -172,6 +178,23 @@ PltHwClock_t* PltPitInitClk()
     return &pitClock;
 }
 
+// Busy waits for ns on channel 2, without using interrupts
+void PltPitWait (ktime_t ns)
+{
+    // Gate channel 2 off with the speaker disconnected, and load it as a one shot
+    uint8_t portB = CpuInb (PLT_PIT_PORTB);
+    CpuOutb (PLT_PIT_PORTB, portB & ~(PLT_PIT_PORTB_GATE | PLT_PIT_PORTB_SPKR));
+    CpuOutb (PLT_PIT_MODE_CMD, PLT_PIT_ONESHOT | PLT_PIT_LOHI | PLT_PIT_SEL_CHAN2);
+    uint16_t count = (PLT_PIT_FREQUENCY * ns) / PLT_NS_IN_SEC;
+    CpuOutb (PLT_PIT_CHAN2, (uint8_t) count);
+    CpuOutb (PLT_PIT_CHAN2, count >> 8);
+    // Raise the gate to start counting, and wait for the output to go high
+    CpuOutb (PLT_PIT_PORTB, (portB & ~PLT_PIT_PORTB_SPKR) | PLT_PIT_PORTB_GATE);
+    while (!(CpuInb (PLT_PIT_PORTB) & PLT_PIT_PORTB_OUT2))
+        CpuSpin();
+    CpuOutb (PLT_PIT_PORTB, portB);
+}
+
 // Initializes PIT timer part
 PltHwTimer_t* PltPitInitTimer()
 {
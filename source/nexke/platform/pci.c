@@ -0,0 +1,412 @@
+/*
+    pci.c - contains PCI bus enumeration
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <assert.h>
+#include <nexke/io.h>
+#include <nexke/io/virtio.h>
+#include <nexke/mm.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/platform/pci.h>
+#include <string.h>
+
+// Config space is memory mapped where ACPI's MCFG says, with 4 KiB for each function. A bus's
+// window is mapped the first time it gets scanned, and functions point into it
+// PCs without MCFG only have the old 0xCF8 / 0xCFC ports, which reach the first 256 bytes of
+// segment 0. That's enough for the capabilities we use
+// Buses are found by walking down from the first bus of each segment through bridges. Root buses
+// that are only described in AML don't get found
+
+#define PLT_PCI_CFG_ADDR 0xCF8
+#define PLT_PCI_CFG_DATA 0xCFC
+
+#define PLT_PCI_CFG_ENABLE (1U << 31)
+
+#define PLT_PCI_BUS_SZ    (1 << 20)    // Size of a bus's config space
+#define PLT_PCI_MAX_DEVS  32
+#define PLT_PCI_MAX_FUNCS 8
+#define PLT_PCI_MAX_CAPS  48    // Stops a looping capability list
+
+// Segment from MCFG
+typedef struct _pltpciseg
+{
+    paddr_t base;                 // Address of bus 0
+    uint16_t seg;                 // Segment number
+    uint8_t startBus;             // First bus
+    uint8_t endBus;               // Last bus
+    volatile uint8_t** buses;     // Mapped buses, NULL until they're scanned
+} pltPciSeg_t;
+
+// Drivers
+static PltPciDriver_t pltPciDrivers[] = {
+    {.name = "ahci", .classCode = 0x01, .subclass = 0x06, .progIf = 0x01, .probe = IoAhciProbe},
+    {.name = "nvme", .classCode = 0x01, .subclass = 0x08, .progIf = 0x02, .probe = IoNvmeProbe},
+    {.name = "virtio-blk", .vendor = 0x1AF4, .device = 0x1042, .probe = IoVirtBlkProbe},
+    {.name = "virtio-blk", .vendor = 0x1AF4, .device = 0x1001, .probe = IoVirtBlkProbe},
+    {.name = "virtio-net", .vendor = 0x1AF4, .device = 0x1041, .probe = IoVirtNetProbe},
+    {.name = "virtio-net", .vendor = 0x1AF4, .device = 0x1000, .probe = IoVirtNetProbe},
+};
+
+static NkList_t pltPciDevs = {&pltPciDevs, &pltPciDevs};
+static spinlock_t pltPciPortLock = 0;
+
+// Selects a register through the ports. Port lock must be held
+static FORCEINLINE void pltPciSelect (PltPciDev_t* dev, int reg)
+{
+    CpuOutl (PLT_PCI_CFG_ADDR,
+             PLT_PCI_CFG_ENABLE | (dev->bus << 16) | (dev->dev << 11) | (dev->func << 8) |
+                 (reg & 0xFC));
+}
+
+// Reads config space of dev
+uint32_t PltPciRead32 (PltPciDev_t* dev, int reg)
+{
+    if (dev->cfg)
+        return *(volatile uint32_t*) (dev->cfg + reg);
+    NkSpinLock (&pltPciPortLock);
+    pltPciSelect (dev, reg);
+    uint32_t val = CpuInl (PLT_PCI_CFG_DATA);
+    NkSpinUnlock (&pltPciPortLock);
+    return val;
+}
+
+uint16_t PltPciRead16 (PltPciDev_t* dev, int reg)
+{
+    if (dev->cfg)
+        return *(volatile uint16_t*) (dev->cfg + reg);
+    NkSpinLock (&pltPciPortLock);
+    pltPciSelect (dev, reg);
+    uint16_t val = CpuInw (PLT_PCI_CFG_DATA + (reg & 2));
+    NkSpinUnlock (&pltPciPortLock);
+    return val;
+}
+
+uint8_t PltPciRead8 (PltPciDev_t* dev, int reg)
+{
+    if (dev->cfg)
+        return dev->cfg[reg];
+    NkSpinLock (&pltPciPortLock);
+    pltPciSelect (dev, reg);
+    uint8_t val = CpuInb (PLT_PCI_CFG_DATA + (reg & 3));
+    NkSpinUnlock (&pltPciPortLock);
+    return val;
+}
+
+// Writes config space of dev
+void PltPciWrite32 (PltPciDev_t* dev, int reg, uint32_t val)
+{
+    if (dev->cfg)
+    {
+        *(volatile uint32_t*) (dev->cfg + reg) = val;
+        return;
+    }
+    NkSpinLock (&pltPciPortLock);
+    pltPciSelect (dev, reg);
+    CpuOutl (PLT_PCI_CFG_DATA, val);
+    NkSpinUnlock (&pltPciPortLock);
+}
+
+void PltPciWrite16 (PltPciDev_t* dev, int reg, uint16_t val)
+{
+    if (dev->cfg)
+    {
+        *(volatile uint16_t*) (dev->cfg + reg) = val;
+        return;
+    }
+    NkSpinLock (&pltPciPortLock);
+    pltPciSelect (dev, reg);
+    CpuOutw (PLT_PCI_CFG_DATA + (reg & 2), val);
+    NkSpinUnlock (&pltPciPortLock);
+}
+
+// Finds a capability after prev
+int PltPciFindNextCap (PltPciDev_t* dev, int id, int prev)
+{
+    if (!(PltPciRead16 (dev, PLT_PCI_STATUS) & PLT_PCI_STATUS_CAPS))
+        return 0;
+    int cap = PltPciRead8 (dev, prev ? prev + 1 : PLT_PCI_CAPPTR) & 0xFC;
+    for (int i = 0; cap && i < PLT_PCI_MAX_CAPS; ++i)
+    {
+        if (PltPciRead8 (dev, cap) == id)
+            return cap;
+        cap = PltPciRead8 (dev, cap + 1) & 0xFC;
+    }
+    return 0;
+}
+
+// Finds a capability
+int PltPciFindCap (PltPciDev_t* dev, int id)
+{
+    return PltPciFindNextCap (dev, id, 0);
+}
+
+// Sets bits in command register
+void PltPciEnable (PltPciDev_t* dev, uint16_t bits)
+{
+    PltPciWrite16 (dev, PLT_PCI_COMMAND, PltPciRead16 (dev, PLT_PCI_COMMAND) | bits);
+}
+
+// Maps a memory BAR
+void* PltPciMapBar (PltPciDev_t* dev, int bar, size_t* size)
+{
+    assert (bar < PLT_PCI_MAX_BARS);
+    // Sizing turns decoding off, which shouldn't happen under a driver that's using the BAR
+    if (dev->bars[bar] && !size)
+        return dev->bars[bar];
+    int reg = PLT_PCI_BAR0 + (bar * 4);
+    uint32_t low = PltPciRead32 (dev, reg);
+    if (low & PLT_PCI_BAR_IO)
+        return NULL;
+    bool is64 = (low & PLT_PCI_BAR_TYPE) == PLT_PCI_BAR_64;
+    // Size it by writing all ones and seeing which bits stick. Decoding is off while it's done,
+    // so the BAR doesn't claim addresses it shouldn't in the meantime
+    uint16_t cmd = PltPciRead16 (dev, PLT_PCI_COMMAND);
+    PltPciWrite16 (dev, PLT_PCI_COMMAND, cmd & ~(PLT_PCI_CMD_IO | PLT_PCI_CMD_MEM));
+    PltPciWrite32 (dev, reg, 0xFFFFFFFF);
+    uint64_t mask = (PltPciRead32 (dev, reg) & ~0xF) | 0xFFFFFFFF00000000;
+    PltPciWrite32 (dev, reg, low);
+    uint64_t phys = low & ~0xF;
+    if (is64)
+    {
+        uint32_t high = PltPciRead32 (dev, reg + 4);
+        PltPciWrite32 (dev, reg + 4, 0xFFFFFFFF);
+        mask = (mask & 0xFFFFFFFF) | ((uint64_t) PltPciRead32 (dev, reg + 4) << 32);
+        PltPciWrite32 (dev, reg + 4, high);
+        phys |= (uint64_t) high << 32;
+    }
+    PltPciWrite16 (dev, PLT_PCI_COMMAND, cmd);
+    size_t sz = (size_t) (~mask + 1);
+    if (size)
+        *size = sz;
+    if (dev->bars[bar])
+        return dev->bars[bar];
+    if (!phys || !sz)
+        return NULL;
+    dev->bars[bar] = MmAllocKvMmio ((paddr_t) phys,
+                                    CpuPageAlignUp (sz) / NEXKE_CPU_PAGESZ,
+                                    MUL_PAGE_DEV | MUL_PAGE_R | MUL_PAGE_RW | MUL_PAGE_KE);
+    return dev->bars[bar];
+}
+
+// Masks or unmasks an MSI-X entry
+void PltPciMaskMsix (PltPciDev_t* dev, int idx, bool mask)
+{
+    assert (dev->msixTable && idx < dev->numMsix);
+    volatile uint32_t* ent = dev->msixTable + (idx * PLT_PCI_MSIX_ENT_SZ);
+    uint32_t ctl = ent[PLT_PCI_MSIX_VECCTL];
+    if (mask)
+        ctl |= PLT_PCI_MSIX_MASKED;
+    else
+        ctl &= ~PLT_PCI_MSIX_MASKED;
+    ent[PLT_PCI_MSIX_VECCTL] = ctl;
+}
+
+// Enables MSI-X
+int PltPciEnableMsix (PltPciDev_t* dev)
+{
+    int cap = PltPciFindCap (dev, PLT_PCI_CAP_MSIX);
+    if (!cap)
+        return 0;
+    uint16_t ctrl = PltPciRead16 (dev, cap + PLT_PCI_MSIX_CTRL);
+    uint32_t table = PltPciRead32 (dev, cap + PLT_PCI_MSIX_TABLE);
+    // The table is usually in a BAR the driver maps too, and this gets the same mapping
+    void* bar = PltPciMapBar (dev, table & PLT_PCI_MSIX_BIR, NULL);
+    if (!bar)
+        return 0;
+    dev->msixTable = bar + (table & ~PLT_PCI_MSIX_BIR);
+    dev->numMsix = (ctrl & PLT_PCI_MSIX_SIZE) + 1;
+    // Everything is masked before the function mask comes off, so nothing is sent from an entry
+    // that hasn't been set up
+    PltPciWrite16 (dev, cap + PLT_PCI_MSIX_CTRL, ctrl | PLT_PCI_MSIX_ENABLE | PLT_PCI_MSIX_MASKALL);
+    for (int i = 0; i < dev->numMsix; ++i)
+        PltPciMaskMsix (dev, i, true);
+    ctrl = (ctrl | PLT_PCI_MSIX_ENABLE) & ~PLT_PCI_MSIX_MASKALL;
+    PltPciWrite16 (dev, cap + PLT_PCI_MSIX_CTRL, ctrl);
+    PltPciEnable (dev, PLT_PCI_CMD_NOINTX);
+    return dev->numMsix;
+}
+
+// Points an MSI-X entry at a message
+void PltPciSetMsix (PltPciDev_t* dev, int idx, PltMsiMsg_t* msg)
+{
+    PltPciMaskMsix (dev, idx, true);
+    volatile uint32_t* ent = dev->msixTable + (idx * PLT_PCI_MSIX_ENT_SZ);
+    ent[PLT_PCI_MSIX_ADDR_LO] = (uint32_t) msg->addr;
+    ent[PLT_PCI_MSIX_ADDR_HI] = (uint32_t) (msg->addr >> 32);
+    ent[PLT_PCI_MSIX_DATA] = msg->data;
+    PltPciMaskMsix (dev, idx, false);
+}
+
+// Enables MSI with one message
+bool PltPciEnableMsi (PltPciDev_t* dev, PltMsiMsg_t* msg)
+{
+    int cap = PltPciFindCap (dev, PLT_PCI_CAP_MSI);
+    if (!cap)
+        return false;
+    uint16_t ctrl = PltPciRead16 (dev, cap + PLT_PCI_MSI_CTRL);
+    bool is64 = ctrl & PLT_PCI_MSI_64;
+    if (!is64 && (msg->addr >> 32))
+        return false;
+    PltPciWrite32 (dev, cap + PLT_PCI_MSI_ADDR_LO, (uint32_t) msg->addr);
+    if (is64)
+    {
+        PltPciWrite32 (dev, cap + PLT_PCI_MSI_ADDR_HI, (uint32_t) (msg->addr >> 32));
+        PltPciWrite16 (dev, cap + PLT_PCI_MSI_DATA64, msg->data);
+    }
+    else
+        PltPciWrite16 (dev, cap + PLT_PCI_MSI_DATA32, msg->data);
+    ctrl = (ctrl & ~PLT_PCI_MSI_MME) | PLT_PCI_MSI_ENABLE;
+    PltPciWrite16 (dev, cap + PLT_PCI_MSI_CTRL, ctrl);
+    PltPciEnable (dev, PLT_PCI_CMD_NOINTX);
+    return true;
+}
+
+// Gets the config space of a function on seg, or NULL if it's reached through the ports
+static volatile uint8_t* pltPciGetCfg (pltPciSeg_t* seg, int bus, int dev, int func)
+{
+    if (!seg)
+        return NULL;
+    volatile uint8_t** win = &seg->buses[bus - seg->startBus];
+    if (!*win)
+    {
+        *win = MmAllocKvMmio (seg->base + ((paddr_t) bus * PLT_PCI_BUS_SZ),
+                              PLT_PCI_BUS_SZ / NEXKE_CPU_PAGESZ,
+                              MUL_PAGE_DEV | MUL_PAGE_R | MUL_PAGE_RW | MUL_PAGE_KE);
+    }
+    return *win + (dev << 15) + (func << 12);
+}
+
+// Scans a bus, and the buses behind bridges on it
+static void pltPciScanBus (pltPciSeg_t* seg, int bus)
+{
+    if (seg && (bus < seg->startBus || bus > seg->endBus))
+        return;
+    for (int dev = 0; dev < PLT_PCI_MAX_DEVS; ++dev)
+    {
+        for (int func = 0; func < PLT_PCI_MAX_FUNCS; ++func)
+        {
+            PltPciDev_t probe = {0};
+            probe.seg = seg ? seg->seg : 0;
+            probe.bus = bus;
+            probe.dev = dev;
+            probe.func = func;
+            probe.cfg = pltPciGetCfg (seg, bus, dev, func);
+            uint16_t vendor = PltPciRead16 (&probe, PLT_PCI_VENDOR);
+            if (vendor == 0xFFFF)
+            {
+                // Functions other than 0 can be missing when others are there
+                if (!func)
+                    break;
+                continue;
+            }
+            PltPciDev_t* pciDev = kmalloc (sizeof (PltPciDev_t), MM_TAG_PLATFORM);
+            if (!pciDev)
+                NkPanicOom();
+            *pciDev = probe;
+            pciDev->vendor = vendor;
+            pciDev->device = PltPciRead16 (pciDev, PLT_PCI_DEVICE);
+            pciDev->classCode = PltPciRead8 (pciDev, PLT_PCI_CLASS);
+            pciDev->subclass = PltPciRead8 (pciDev, PLT_PCI_SUBCLS);
+            pciDev->progIf = PltPciRead8 (pciDev, PLT_PCI_PROGIF);
+            NkListAddBack (&pltPciDevs, &pciDev->link);
+            NkLogDebug ("nexke: PCI %x:%x:%x.%x: %04x:%04x class %02x:%02x:%02x\n",
+                        pciDev->seg,
+                        bus,
+                        dev,
+                        func,
+                        vendor,
+                        pciDev->device,
+                        pciDev->classCode,
+                        pciDev->subclass,
+                        pciDev->progIf);
+            uint8_t hdr = PltPciRead8 (pciDev, PLT_PCI_HDRTYPE);
+            if ((hdr & PLT_PCI_HDR_TYPE) == PLT_PCI_HDR_BRIDGE)
+            {
+                // Buses behind a bridge are numbered above it, so this can't go around in circles
+                int secBus = PltPciRead8 (pciDev, PLT_PCI_SECBUS);
+                if (secBus > bus)
+                    pltPciScanBus (seg, secBus);
+            }
+            if (!func && !(hdr & PLT_PCI_HDR_MF))
+                break;
+        }
+    }
+}
+
+// Finds a driver for dev
+static void pltPciProbe (PltPciDev_t* dev)
+{
+    for (int i = 0; i < sizeof (pltPciDrivers) / sizeof (PltPciDriver_t); ++i)
+    {
+        PltPciDriver_t* drv = &pltPciDrivers[i];
+        if (drv->vendor && (drv->vendor != dev->vendor || drv->device != dev->device))
+            continue;
+        if (!drv->vendor && (drv->classCode != dev->classCode || drv->subclass != dev->subclass ||
+                             drv->progIf != dev->progIf))
+            continue;
+        if (drv->probe (dev))
+        {
+            NkLogInfo ("nexke: %s driving PCI %x:%x:%x.%x\n",
+                       drv->name,
+                       dev->seg,
+                       dev->bus,
+                       dev->dev,
+                       dev->func);
+            return;
+        }
+    }
+}
+
+// Finds PCI functions
+void PltInitPci()
+{
+    NkListInit (&pltPciDevs);
+    AcpiMcfg_t* mcfg = (AcpiMcfg_t*) PltAcpiFindTable ("MCFG");
+    if (mcfg)
+    {
+        int numSegs = (mcfg->sdt.length - sizeof (AcpiMcfg_t)) / sizeof (AcpiMcfgEnt_t);
+        AcpiMcfgEnt_t* ents = (AcpiMcfgEnt_t*) (mcfg + 1);
+        for (int i = 0; i < numSegs; ++i)
+        {
+            pltPciSeg_t* seg = kmalloc (sizeof (pltPciSeg_t), MM_TAG_PLATFORM);
+            size_t busesSz = (ents[i].endBus - ents[i].startBus + 1) * sizeof (uint8_t*);
+            if (!seg || !(seg->buses = kmalloc (busesSz, MM_TAG_PLATFORM)))
+                NkPanicOom();
+            memset (seg->buses, 0, busesSz);
+            seg->base = (paddr_t) ents[i].base;
+            seg->seg = ents[i].seg;
+            seg->startBus = ents[i].startBus;
+            seg->endBus = ents[i].endBus;
+            pltPciScanBus (seg, seg->startBus);
+        }
+    }
+    else
+    {
+#ifdef NEXNIX_BOARD_PC
+        pltPciScanBus (NULL, 0);
+#else
+        NkLogDebug ("nexke: no PCI config space\n");
+        return;
+#endif
+    }
+    NkLink_t* iter = NkListFront (&pltPciDevs);
+    while (iter)
+    {
+        pltPciProbe (LINK_CONTAINER (iter, PltPciDev_t, link));
+        iter = NkListIterate (&pltPciDevs, iter);
+    }
+}
@@ -0,0 +1,163 @@
+/*
+    idle.c - contains idle governor
+    Copyright 2024 The NexNix Project
+
+    Licensed under the Apache License, Version 2.0 (the "License");
+    you may not use this file except in compliance with the License.
+    You may obtain a copy of the License at
+
+         http://www.apache.org/licenses/LICENSE-2.0
+
+    Unless required by applicable law or agreed to in writing, software
+    distributed under the License is distributed on an "AS IS" BASIS,
+    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+    See the License for the specific language governing permissions and
+    limitations under the License.
+*/
+
+#include <nexke/cpu.h>
+#include <nexke/nexke.h>
+#include <nexke/platform.h>
+#include <nexke/task.h>
+#include <stdlib.h>
+
+// Deeper idle states save more power, but take longer to get out of, and only pay off if the CPU
+// stays in them long enough. So the idle thread guesses how long it's going to be idle, and picks
+// the deepest state that pays off in that time and wakes up fast enough
+// The next timer deadline bounds how long we'll be idle, but wakeups from other CPUs and devices
+// mostly come first. So the last few idle periods are kept too, and if they've been steady,
+// their average is used when it's shorter. Periods way out of line are thrown out first, so one
+// long sleep doesn't ruin the guess
+// States that monitor get woken by clearing ccb->idleState, so other CPUs that want us to check
+// for preemption can do that instead of sending an IPI
+
+#define TSK_IDLE_HIST     8                        // Idle periods kept
+#define TSK_IDLE_HIST_MAX (PLT_NS_IN_SEC / 10)    // Longest period that gets kept
+
+// Values of idleState
+#define TSK_IDLE_RUN  0    // Idle thread isn't watching it
+#define TSK_IDLE_POLL 1    // Idle thread will notice when it's cleared
+
+typedef struct _tskidlegov
+{
+    ktime_t hist[TSK_IDLE_HIST];    // Recent idle periods
+    int next;                       // Where the next one goes
+} tskIdleGov_t;
+
+static NK_PERCPU tskIdleGov_t tskIdleGov;
+
+static CpuIdleState_t tskIdleStates[CPU_IDLE_MAX] = {0};
+static int tskNumIdle = 0;
+static ktime_t tskIdleMaxLatency = (ktime_t) -1;    // Exit latency we'll put up with
+
+// Guesses how long we'll be idle from recent periods, or returns 0 if they're all over the place
+static ktime_t tskIdlePredict (tskIdleGov_t* gov)
+{
+    ktime_t limit = TSK_IDLE_HIST_MAX;
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        ktime_t sum = 0, max = 0;
+        int count = 0;
+        for (int i = 0; i < TSK_IDLE_HIST; ++i)
+        {
+            ktime_t period = gov->hist[i];
+            if (!period || period > limit)
+                continue;
+            sum += period;
+            max = (period > max) ? period : max;
+            ++count;
+        }
+        // Not enough left to go on
+        if (count < (TSK_IDLE_HIST / 2))
+            return 0;
+        ktime_t avg = sum / count;
+        ktime_t var = 0;
+        for (int i = 0; i < TSK_IDLE_HIST; ++i)
+        {
+            ktime_t period = gov->hist[i];
+            if (!period || period > limit)
+                continue;
+            ktime_t diff = (period > avg) ? period - avg : avg - period;
+            var += diff * diff;
+        }
+        var /= count;
+        // Steady if the standard deviation is within a sixth of the average
+        if ((var * 36) <= (avg * avg))
+            return avg;
+        // Throw out the longest and try again
+        limit = max - 1;
+    }
+    return 0;
+}
+
+// Picks a state to idle in
+static const CpuIdleState_t* tskIdleSelect (NkCcb_t* ccb, tskIdleGov_t* gov, ktime_t now)
+{
+    // This is read without the time lock, but it's only a guess anyway
+    ktime_t deadline = ccb->nextDeadline;
+    ktime_t expect = (ktime_t) -1;
+    if (deadline)
+        expect = (deadline > now) ? deadline - now : 0;
+    ktime_t typical = tskIdlePredict (gov);
+    if (typical && typical < expect)
+        expect = typical;
+    int state = 0;
+    for (int i = 1; i < tskNumIdle; ++i)
+    {
+        if (tskIdleStates[i].residency > expect || tskIdleStates[i].latency > tskIdleMaxLatency)
+            break;
+        state = i;
+    }
+    return &tskIdleStates[state];
+}
+
+// Idles the current CPU until something happens
+void TskIdle()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    tskIdleGov_t* gov = NK_PERCPU_PTR (tskIdleGov);
+    CpuDisable();
+    ktime_t start = NK_STATIC_CALL (PltGetTime)();
+    const CpuIdleState_t* state = tskIdleSelect (ccb, gov, start);
+    if (state->monitor)
+        NkAtomicStore (&ccb->idleState, TSK_IDLE_POLL);
+    CpuIdle (state, &ccb->idleState);
+    // If it isn't still set, somebody cleared it to wake us
+    bool woken = false;
+    if (state->monitor)
+    {
+        atomic_t expect = TSK_IDLE_POLL;
+        woken = !NkAtomicCmpXchg (&ccb->idleState, &expect, TSK_IDLE_RUN);
+    }
+    ktime_t period = NK_STATIC_CALL (PltGetTime)() - start;
+    gov->hist[gov->next] = (period > TSK_IDLE_HIST_MAX) ? TSK_IDLE_HIST_MAX : period;
+    gov->next = (gov->next + 1) % TSK_IDLE_HIST;
+    CpuEnable();
+    // Do what the IPI we didn't get would have done
+    if (woken)
+    {
+        TskDisablePreempt();
+        TskReschedIpi();
+        TskEnablePreempt();
+    }
+}
+
+// Wakes ccb's idle thread without an interrupt, if it's watching for that
+bool TskIdleKick (NkCcb_t* ccb)
+{
+    atomic_t expect = TSK_IDLE_POLL;
+    return NkAtomicCmpXchg (&ccb->idleState, &expect, TSK_IDLE_RUN);
+}
+
+// Sets up idle governor
+void TskInitIdle()
+{
+    tskNumIdle = CpuInitIdle (tskIdleStates);
+    // Latency limit is given in microseconds
+    const char* latArg = NkReadArg ("-idlelatency");
+    if (latArg && *latArg)
+        tskIdleMaxLatency = (ktime_t) atoi (latArg) * 1000;
+    NkLogDebug ("nexke: %d idle states, deepest is %s\n",
+                tskNumIdle,
+                tskIdleStates[tskNumIdle - 1].name);
+}
@@ -16,13 +16,95 @@
 */
 
 #include <assert.h>
+#include <nexke/mm.h>
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
 #include <nexke/task.h>
 #include <string.h>
 
 // Globals (try to avoid these)
-static PltHwClock_t* clock = NULL;
+
+static NkStat_t tskStatSwitches = {.name = "task.switches", .type = NK_STAT_COUNTER};
+
+// Priority a CPU runs at while idle, below that of every thread
+#define TSK_PRIO_IDLE NEXKE_MAX_PRIO
+
+// Load balancing
+// Every CPU owns its ready queues, and threads get placed on a CPU when they are readied. A thread
+// that ran a short while ago goes back to the CPU it ran on, as its working set is likely still in
+// that CPU's caches; otherwise it goes to the least busy CPU, closest to its old one on ties
+// Queues that get uneven anyway are evened out by every CPU pulling threads from its busiest
+// neighbor now and then, looking further out the less often. Idle CPUs steal work whenever they
+// find some
+#define TSK_CACHE_HOT_TIME (PLT_NS_IN_SEC / 500)    // How long a thread's cache stays warm
+#define TSK_BALANCE_TICKS  4                        // Time slice ticks between balancing passes
+#define TSK_BALANCE_MAX    4                        // Max threads pulled in one pass
+
+// Tickless operation
+// The time slice tick only matters when a CPU has more than one thread that wants to run. When it
+// goes off with nothing on the ready queues, it stops itself, and the timer only goes off for
+// real events. Readying a thread onto a CPU that stopped asks for the tick back
+// Time event locks come before run queue locks, so the tick can't be registered where threads get
+// readied. Instead, the CPU restarts it itself the next time it enables preemption, which is when
+// it's holding no locks. Other CPUs get an IPI to make them do that
+// Time events go on the queue of the CPU that registers them. Before a CPU halts, it hands the
+// ones that aren't pinned to it to the closest CPU that's running something, so its timer doesn't
+// have to wake it up just to run them. The time slice tick is always pinned
+
+// Fair share scheduling
+// Fair share threads all run at TSK_PRIO_FAIR, so they get what's left over by real time threads
+// and normal threads above them. Among themselves, each gets the CPU in proportion to the weight
+// its nice value gives it. Run time is scaled by weight into virtual runtime, and the thread that's
+// had the least goes first, from a tree of ready fair share threads each CPU keeps
+// Threads that slept start no further back than a little behind the CPU's minimum, so they can't
+// bank time while asleep but still get to run soon after waking. Threads moving between CPUs keep
+// how far they are from the minimum. Threads lent a better priority by a mutex waiter leave the
+// tree until they give it back
+#define TSK_FAIR_GRAN         (PLT_NS_IN_SEC / 250)     // Lead over next thread before giving way
+#define TSK_FAIR_WAKE_GRAN    (PLT_NS_IN_SEC / 1000)    // Lag a woken thread needs to preempt
+#define TSK_FAIR_SLEEP_CREDIT (TSK_TIMESLICE_DELTA * 2)    // How far back sleepers may start
+
+// Weight of each nice value, each step being worth about 10% of CPU time against the next
+static const int tskFairWeights[TSK_NICE_MAX - TSK_NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+// Gets thread of a fair share tree node
+#define TSK_FAIR_THREAD(node) LINK_CONTAINER (node, NkThread_t, fairNode)
+
+// Deadline scheduling
+// Deadline threads reserve runtime out of every period, and go before every other thread, earliest
+// deadline first, from a tree each CPU keeps. Admission keeps the reserved share of all CPUs under
+// TSK_DL_MAX_BW each, so there's room for every deadline to be met
+// Each thread is a constant bandwidth server: runtime it uses comes out of its budget, and once
+// that's gone it's throttled until its next period starts, so overruns can't take time reserved by
+// others. A thread that wakes keeps its deadline only if what's left of its budget fits in the time
+// left at its reserved rate, and gets a fresh period otherwise
+// Each CPU has one pinned event for when its running deadline thread runs out and when its next
+// throttled one is replenished. It's registered by the scheduler with the run queue locked, which
+// the tick can't be: only the CPU itself ever touches the event, and the scheduler never runs
+// from inside its timer handler, which is the only thing that locks run queues under its time lock
+#define TSK_DL_SHIFT  20                                  // Fraction bits of bandwidths
+#define TSK_DL_MAX_BW ((95ULL << TSK_DL_SHIFT) / 100)    // Max share of a CPU deadlines may take
+
+// Gets thread of a deadline tree node
+#define TSK_DL_THREAD(node) LINK_CONTAINER (node, NkThread_t, dlNode)
+
+// Bandwidth reserved by deadline threads, in CPUs
+static uint64_t tskDlTotalBw = 0;
+static spinlock_t tskDlLock = 0;
+
+// Topology distances between CPUs
+// Each level of the CPU topology is one further out
+#define TSK_DIST_SELF 0    // Same CPU
+#define TSK_DIST_CORE 1    // Threads of one core, sharing all caches
+#define TSK_DIST_L2   2    // Cores sharing an L2 cache
+#define TSK_DIST_LLC  3    // Cores sharing the last level cache
+#define TSK_DIST_PKG  4    // Cores of one package, with caches of their own
+#define TSK_DIST_SYS  5    // Different packages
 
 // NOTE: most routines in here are interrupt-unsafe, but do not actually disable interrupts
 // It's the caller's responsibilty to disable interrupts
@@ -36,45 +118,693 @@ static PltHwClock_t* clock = NULL;
 // NOTE: most routines that use threads will lock the thread before use. Ordering is queue followed
 // by thread
 
+// NOTE4: the run queue lock is held across context switches, and gets unlocked by the thread
+// switched to. As that thread may have last run on another CPU, code that resumes after a switch
+// must always go through CpuGetCcb() again instead of using the CCB it had before
+// Only one run queue gets locked at a time, except when pulling threads from another CPU, which
+// only tries to lock the other queue
+
+// Forward declaration as this is called by the idle thread
+static void tskMigrateTimers (NkCcb_t* ccb);
+
 // Idle thread routine
 static void TskIdleThread (void*)
 {
+    // On APs this is the first thread to run, so interrupts are still held
+    CpuUnholdInts();
     for (;;)
-        CpuHalt();
+    {
+        // We aren't reading anything here, so let RCU know
+        TskDisablePreempt();
+        NkRcuQuiescent();
+        TskEnablePreempt();
+        // Reclaim memory if we couldn't do it when it ran low, and then
+        // fill the page table reserve and zeroed page pool while we have nothing better to do
+        // Once they're full, halt until something happens
+        if (!MmReclaimIfLow() && !MmFillPtReserve() && !MmFillZeroPool())
+        {
+            // We're a kernel thread, so shootdowns of user mappings already skip us
+            tskMigrateTimers (CpuGetCcb());
+            TskIdle();
+        }
+    }
 }
 
-// Forward declaration as this is called by tskReadyThread
+// Forward declarations as these are called by tskReadyThread
 static inline void tskPreempt();
+static void tskPreemptCpu (NkCcb_t* ccb);
+
+// Gets topology distance between two CPUs
+static FORCEINLINE int tskCpuDistance (NkCcb_t* ccb1, NkCcb_t* ccb2)
+{
+    if (ccb1 == ccb2)
+        return TSK_DIST_SELF;
+    for (int level = 0; level < NK_TOPO_LEVELS; ++level)
+    {
+        if (ccb1->topoId[level] == ccb2->topoId[level])
+            return TSK_DIST_CORE + level;
+    }
+    return TSK_DIST_SYS;
+}
+
+// Gets load of a CPU, i.e., the number of threads that want to run on it
+// This is read without the CPU's run queue locked, so it's only a hint
+static FORCEINLINE int tskCpuLoad (NkCcb_t* ccb)
+{
+    return ccb->readyCount + (ccb->curPriority != TSK_PRIO_IDLE);
+}
+
+// Checks if thread likely still has its working set in the caches of the CPU it ran on
+static FORCEINLINE bool tskIsCacheHot (NkThread_t* thread, ktime_t now)
+{
+    return thread->ccb && (now - thread->lastStop) < TSK_CACHE_HOT_TIME;
+}
+
+// Checks if thread may run on a CPU
+static FORCEINLINE bool tskCpuAllowed (NkThread_t* thread, NkCcb_t* ccb)
+{
+    return (thread->affinity & TSK_AFFINITY_CPU (ccb->cpuNum)) != 0;
+}
+
+// Checks if thread is queued by virtual runtime
+static FORCEINLINE bool tskIsFair (NkThread_t* thread)
+{
+    return thread->policy == TSK_POLICY_FAIR && thread->priority == TSK_PRIO_FAIR;
+}
+
+// Scales time thread ran for into virtual runtime
+static FORCEINLINE ktime_t tskFairScale (NkThread_t* thread, ktime_t time)
+{
+    if (thread->weight == TSK_FAIR_WEIGHT0)
+        return time;
+    return (time * TSK_FAIR_WEIGHT0) / thread->weight;
+}
+
+// Adds thread to the fair share tree of ccb
+static void tskFairEnqueue (NkCcb_t* ccb, NkThread_t* thread)
+{
+    NkRbNode_t** link = &ccb->fairTree.root;
+    NkRbNode_t* parent = NULL;
+    bool leftmost = true;
+    while (*link)
+    {
+        parent = *link;
+        // Ties go after threads already there
+        if (thread->vruntime < TSK_FAIR_THREAD (parent)->vruntime)
+            link = &parent->left;
+        else
+        {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    NkRbLink (&thread->fairNode, parent, link);
+    NkRbInsert (&ccb->fairTree, &thread->fairNode, leftmost);
+}
+
+// Moves the minimum virtual runtime of ccb up to where its fair share threads are
+// It never goes back, so it stays a good place to start threads from
+// Run queue must be locked
+static void tskFairUpdateMin (NkCcb_t* ccb)
+{
+    NkThread_t* cur = ccb->curThread;
+    NkRbNode_t* first = NkRbFirst (&ccb->fairTree);
+    ktime_t min = 0;
+    if (cur && cur->state == TSK_THREAD_RUNNING && tskIsFair (cur))
+        min = cur->vruntime;
+    if (first && (!min || TSK_FAIR_THREAD (first)->vruntime < min))
+        min = TSK_FAIR_THREAD (first)->vruntime;
+    if (min > ccb->fairMinVrt)
+        ccb->fairMinVrt = min;
+}
+
+// Places thread on the timeline of ccb before it's queued there
+// Run queue must be locked
+static void tskFairPlace (NkCcb_t* ccb, NkThread_t* thread, bool slept)
+{
+    tskFairUpdateMin (ccb);
+    NkCcb_t* last = thread->ccb;
+    if (last && last != ccb)
+    {
+        // The minimum of the CPU it's coming from may not be locked, so this is only close
+        int64_t lag = (int64_t) (thread->vruntime - last->fairMinVrt);
+        if (lag < 0 && (ktime_t) -lag > ccb->fairMinVrt)
+            thread->vruntime = 0;
+        else
+            thread->vruntime = ccb->fairMinVrt + lag;
+    }
+    if (slept)
+    {
+        ktime_t floor = 0;
+        if (ccb->fairMinVrt > TSK_FAIR_SLEEP_CREDIT)
+            floor = ccb->fairMinVrt - TSK_FAIR_SLEEP_CREDIT;
+        if (thread->vruntime < floor)
+            thread->vruntime = floor;
+    }
+}
+
+// Checks if woken fair share thread is far enough behind the one running on ccb to take over
+// Run queue must be locked
+static FORCEINLINE bool tskFairWakePreempt (NkCcb_t* ccb, NkThread_t* thread)
+{
+    NkThread_t* cur = ccb->curThread;
+    return cur != thread && tskIsFair (thread) && tskIsFair (cur) &&
+           (thread->vruntime + TSK_FAIR_WAKE_GRAN) < cur->vruntime;
+}
+
+// Checks if thread is a deadline thread
+static FORCEINLINE bool tskIsDeadline (NkThread_t* thread)
+{
+    return thread->policy == TSK_POLICY_DEADLINE;
+}
+
+// Gets when a throttled deadline thread's next period starts
+static FORCEINLINE ktime_t tskDlReplTime (NkThread_t* thread)
+{
+    return thread->dlAbsDeadline - thread->dlDeadline + thread->dlPeriod;
+}
+
+// Adds deadline thread to ccb, on the tree if it has runtime left and throttled if not
+// Run queue must be locked
+static void tskDlEnqueue (NkCcb_t* ccb, NkThread_t* thread)
+{
+    if (thread->dlBudget <= 0)
+    {
+        // Keep them in order of replenishment, looking from the back as they mostly come in order
+        ktime_t repl = tskDlReplTime (thread);
+        NkLink_t* iter = ccb->dlThrottled.prev;
+        while (iter != &ccb->dlThrottled && tskDlReplTime ((NkThread_t*) iter) > repl)
+            iter = iter->prev;
+        NkListAdd (&ccb->dlThrottled, iter, &thread->link);
+        return;
+    }
+    NkRbNode_t** link = &ccb->dlTree.root;
+    NkRbNode_t* parent = NULL;
+    bool leftmost = true;
+    while (*link)
+    {
+        parent = *link;
+        if (thread->dlAbsDeadline < TSK_DL_THREAD (parent)->dlAbsDeadline)
+            link = &parent->left;
+        else
+        {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    NkRbLink (&thread->dlNode, parent, link);
+    NkRbInsert (&ccb->dlTree, &thread->dlNode, leftmost);
+    ++ccb->readyCount;
+}
+
+// Takes deadline thread off of ccb
+// Run queue must be locked
+static void tskDlDequeue (NkCcb_t* ccb, NkThread_t* thread)
+{
+    if (thread->dlBudget <= 0)
+        NkListRemove (&ccb->dlThrottled, &thread->link);
+    else
+    {
+        NkRbRemove (&ccb->dlTree, &thread->dlNode);
+        --ccb->readyCount;
+    }
+}
+
+// Starts a new period for a deadline thread that woke up, unless it can keep its current one
+static void tskDlWake (NkThread_t* thread, ktime_t now)
+{
+    // Runtime left over has to fit in the time left at its reserved rate
+    if (now >= thread->dlAbsDeadline ||
+        (thread->dlBudget > 0 &&
+         (((uint64_t) thread->dlBudget << TSK_DL_SHIFT) / (thread->dlAbsDeadline - now)) >
+             thread->dlBw))
+    {
+        thread->dlAbsDeadline = now + thread->dlDeadline;
+        thread->dlBudget = thread->dlRuntime;
+    }
+}
+
+// Moves throttled deadline threads whose next period has started onto the tree
+// Run queue must be locked
+static void tskDlReplenish (NkCcb_t* ccb)
+{
+    NkLink_t* iter = NkListFront (&ccb->dlThrottled);
+    if (!iter)
+        return;
+    ktime_t now = NK_STATIC_CALL (PltGetTime)();
+    while (iter)
+    {
+        NkThread_t* thread = (NkThread_t*) iter;
+        ktime_t start = tskDlReplTime (thread);
+        if (start > now)
+            break;
+        NkListRemove (&ccb->dlThrottled, iter);
+        // Keep to its periods, unless it's fallen so far behind that its deadline is gone
+        if ((start + thread->dlDeadline) <= now)
+            start = now;
+        thread->dlAbsDeadline = start + thread->dlDeadline;
+        thread->dlBudget = thread->dlRuntime;
+        tskDlEnqueue (ccb, thread);
+        iter = NkListFront (&ccb->dlThrottled);
+    }
+}
+
+// Checks if thread should take ccb as a deadline thread
+// Run queue must be locked
+static FORCEINLINE bool tskDlWantsCpu (NkCcb_t* ccb, NkThread_t* thread)
+{
+    NkThread_t* cur = ccb->curThread;
+    if (cur == thread || !tskIsDeadline (thread) || thread->dlBudget <= 0)
+        return false;
+    return !tskIsDeadline (cur) || thread->dlAbsDeadline < cur->dlAbsDeadline;
+}
+
+// Registers the deadline event of ccb for when next runs out or a throttled thread gets more
+// runtime, whichever comes first
+// Run queue must be locked, and we must be on ccb
+static void tskDlArm (NkCcb_t* ccb, NkThread_t* next)
+{
+    NkThread_t* throttled = (NkThread_t*) NkListFront (&ccb->dlThrottled);
+    if (!throttled && !tskIsDeadline (next))
+    {
+        if (ccb->dlArmed)
+        {
+            NkTimeDeRegEvent (ccb->dlEvent);
+            ccb->dlArmed = false;
+        }
+        return;
+    }
+    ktime_t delta = UINT64_MAX;
+    if (tskIsDeadline (next))
+        delta = (next->dlBudget > 0) ? next->dlBudget : 0;
+    if (throttled)
+    {
+        ktime_t now = NK_STATIC_CALL (PltGetTime)();
+        ktime_t repl = tskDlReplTime (throttled);
+        ktime_t wait = (repl > now) ? (repl - now) : 0;
+        if (wait < delta)
+            delta = wait;
+    }
+    NkTimeRegEvent (ccb->dlEvent, delta, NK_TIME_REG_DEREG | NK_TIME_REG_PINNED);
+    ccb->dlArmed = true;
+}
+
+// Checks if thread should preempt what ccb is running
+// Run queue must be locked
+static FORCEINLINE bool tskShouldPreempt (NkCcb_t* ccb, NkThread_t* thread)
+{
+    // Deadline threads run at the best priority, but go by deadline among each other
+    if (tskIsDeadline (thread))
+        return tskDlWantsCpu (ccb, thread);
+    if (tskIsDeadline (ccb->curThread))
+        return false;
+    return thread->priority < ccb->curPriority || tskFairWakePreempt (ccb, thread);
+}
+
+#ifdef NEXKE_SCHED_STATS
+
+// Statistics of each priority, shared between CPUs
+static TskSchedStats_t tskPrioStats[NEXKE_MAX_PRIO] = {0};
+
+// Records that thread got readied
+static FORCEINLINE void tskStatReady (NkThread_t* thread)
+{
+    thread->readyTime = NK_STATIC_CALL (PltGetTime)();
+}
+
+// Records that thread is about to run
+// A thread only gets dispatched on one CPU at a time, so its own stats need no atomics
+static FORCEINLINE void tskStatDispatch (NkThread_t* thread, ktime_t now)
+{
+    if (!thread->readyTime)
+        return;    // It didn't come off of a ready queue
+    uint64_t delay = now - thread->readyTime;
+    thread->readyTime = 0;
+    int bucket = (delay) ? (63 - __builtin_clzll (delay)) : 0;
+    if (bucket >= TSK_DELAY_BUCKETS)
+        bucket = TSK_DELAY_BUCKETS - 1;
+    ++thread->stats.delays[bucket];
+    thread->stats.totalDelay += delay;
+    if (delay > thread->stats.maxDelay)
+        thread->stats.maxDelay = delay;
+    TskSchedStats_t* stats = &tskPrioStats[thread->priority];
+    __atomic_fetch_add (&stats->delays[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&stats->totalDelay, delay, __ATOMIC_RELAXED);
+    uint64_t maxDelay = __atomic_load_n (&stats->maxDelay, __ATOMIC_RELAXED);
+    while (delay > maxDelay)
+    {
+        if (__atomic_compare_exchange_n (&stats->maxDelay,
+                                         &maxDelay,
+                                         delay,
+                                         false,
+                                         __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+}
+
+// Records that thread got switched away from
+static FORCEINLINE void tskStatSwitch (NkThread_t* thread)
+{
+    TskSchedStats_t* stats = &tskPrioStats[thread->priority];
+    // Threads that could have kept going had the CPU taken away, the rest gave it up
+    if (thread->state == TSK_THREAD_READY || thread->state == TSK_THREAD_RUNNING)
+    {
+        ++thread->stats.involSwitches;
+        __atomic_fetch_add (&stats->involSwitches, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        ++thread->stats.volSwitches;
+        __atomic_fetch_add (&stats->volSwitches, 1, __ATOMIC_RELAXED);
+    }
+}
+
+#else
+
+#define tskStatReady(thread)
+#define tskStatDispatch(thread, now)
+#define tskStatSwitch(thread)
+
+#endif
+
+// Adds thread to a ready queue
+// Run queue must be locked
+static FORCEINLINE void tskEnqueueThread (NkCcb_t* ccb, NkThread_t* thread, bool front)
+{
+    thread->ccb = ccb;
+    // Deadline threads have their own event, and don't need the tick
+    if (tskIsDeadline (thread))
+    {
+        tskDlEnqueue (ccb, thread);
+        return;
+    }
+    NkList_t* queue = &ccb->readyQueues[thread->priority];
+    if (tskIsFair (thread))
+        tskFairEnqueue (ccb, thread);
+    else if (front)
+        NkListAddFront (queue, &thread->link);
+    else
+        NkListAddBack (queue, &thread->link);
+    // Update priority mask
+    ccb->readyMask |= (1ULL << thread->priority);
+    ++ccb->readyCount;
+    // There's something to share the CPU with now
+    TskWantTick (ccb);
+}
+
+// Removes thread from its ready queue
+// Run queue must be locked
+static FORCEINLINE void tskDequeueThread (NkCcb_t* ccb, NkThread_t* thread)
+{
+    if (tskIsDeadline (thread))
+    {
+        tskDlDequeue (ccb, thread);
+        return;
+    }
+    NkList_t* queue = &ccb->readyQueues[thread->priority];
+    if (tskIsFair (thread))
+        NkRbRemove (&ccb->fairTree, &thread->fairNode);
+    else
+        NkListRemove (queue, &thread->link);
+    if (!NkListFront (queue) &&
+        (thread->priority != TSK_PRIO_FAIR || !NkRbFirst (&ccb->fairTree)))
+    {
+        ccb->readyMask &= ~(1ULL << thread->priority);
+    }
+    --ccb->readyCount;
+}
+
+// Gets the thread that should run next at prio
+// Run queue must be locked
+static FORCEINLINE NkThread_t* tskFrontThread (NkCcb_t* ccb, int prio)
+{
+    NkLink_t* front = NkListFront (&ccb->readyQueues[prio]);
+    // Threads of other policies at the fair share level don't share by weight, so they go first
+    if (!front && prio == TSK_PRIO_FAIR)
+        return TSK_FAIR_THREAD (NkRbFirst (&ccb->fairTree));
+    return (NkThread_t*) front;
+}
 
-// Admits thread to ready queue
+// Admits thread to ready queue of ccb without checking for preemption
 // If this thread was preempted, it's added to the front;
 // otherwise, its added to the tail
 // IPL must be high and run queue must be locked
-static FORCEINLINE void tskReadyThread (NkCcb_t* ccb, NkThread_t* thread)
+static FORCEINLINE void tskQueueReady (NkCcb_t* ccb, NkThread_t* thread)
 {
     assert (PltGetIpl() == PLT_IPL_HIGH);
+    bool front = false;    // For FCFS
     // Check if we were preempted
     if (thread->preempted)
     {
         thread->preempted = false;    // Reset flag as preemption doesn't matter anymore
         // Only add to front if this wasn't due to quantum expirt
-        if (thread->quantaLeft == 0)
-            NkListAddBack (&ccb->readyQueues[thread->priority], &thread->link);
-        else
-            NkListAddFront (&ccb->readyQueues[thread->priority], &thread->link);
+        if (thread->quantaLeft != 0)
+            front = true;
     }
-    else
-    {
-        NkListAddBack (&ccb->readyQueues[thread->priority], &thread->link);    // For FCFS
-    }
-    // Update priority mask
-    ccb->readyMask |= (1ULL << thread->priority);
+    if (tskIsFair (thread))
+        tskFairPlace (ccb, thread, thread->state != TSK_THREAD_RUNNING);
+    else if (tskIsDeadline (thread) && thread->state != TSK_THREAD_RUNNING)
+        tskDlWake (thread, NK_STATIC_CALL (PltGetTime)());
+    tskEnqueueThread (ccb, thread, front);
+    tskStatReady (thread);
     // Reset quantum of thread
     thread->quantaLeft = thread->quantum;
     thread->state = TSK_THREAD_READY;
+}
+
+// Admits thread to ready queue of ccb
+// IPL must be high and run queue must be locked
+static FORCEINLINE void tskReadyThread (NkCcb_t* ccb, NkThread_t* thread)
+{
+    tskQueueReady (ccb, thread);
     // Check for preemption
-    if (thread->priority < ccb->curPriority)
+    if (tskShouldPreempt (ccb, thread))
+        tskPreemptCpu (ccb);
+}
+
+// Finds the busiest CPU at a distance between minDist and maxDist from us
+// Only CPUs with threads waiting on their queues are considered
+static NkCcb_t* tskFindBusiest (NkCcb_t* ccb, int minDist, int maxDist)
+{
+    NkCcb_t* busiest = NULL;
+    int busiestLoad = 0;
+    int busiestDist = 0;
+    int numCpus = NkGetNumCpus();
+    for (int i = 0; i < numCpus; ++i)
+    {
+        NkCcb_t* cur = NkGetCcb (i);
+        int dist = tskCpuDistance (ccb, cur);
+        if (dist < minDist || dist > maxDist || !cur->readyCount)
+            continue;
+        // Closer CPUs win ties
+        int load = tskCpuLoad (cur);
+        if (load > busiestLoad || (load == busiestLoad && dist < busiestDist))
+        {
+            busiest = cur;
+            busiestLoad = load;
+            busiestDist = dist;
+        }
+    }
+    return busiest;
+}
+
+// Checks if thread may be pulled from src to ccb
+static FORCEINLINE bool tskCanPull (NkCcb_t* ccb,
+                                    NkCcb_t* src,
+                                    NkThread_t* thread,
+                                    bool hotOk,
+                                    ktime_t now)
+{
+    if (!tskCpuAllowed (thread, ccb))
+        return false;
+    // Threads on the CPU they prefer count as cache hot
+    return hotOk || !(tskIsCacheHot (thread, now) || thread->prefCpu == src->cpuNum);
+}
+
+// Moves thread from the ready queues of src to ours
+static FORCEINLINE void tskMoveThread (NkCcb_t* ccb, NkCcb_t* src, NkThread_t* thread)
+{
+    TskLockThread (thread);
+    tskDequeueThread (src, thread);
+    if (tskIsFair (thread))
+        tskFairPlace (ccb, thread, false);
+    tskEnqueueThread (ccb, thread, false);
+    TskUnlockThread (thread);
+}
+
+// Moves up to count threads from the ready queues of src to ours, best priorities first
+// Cache hot threads are left alone unless hotOk is set
+// Returns number of threads moved
+// Our run queue must be locked. The queue of src is only tried, as src may be pulling from us
+static int tskPullThreads (NkCcb_t* ccb, NkCcb_t* src, int count, bool hotOk)
+{
+    if (!NkMcsTryLock (&src->rqLock))
+        return 0;
+    ktime_t now = NK_STATIC_CALL (PltGetTime)();
+    int moved = 0;
+    uint64_t mask = src->readyMask;
+    while (mask && moved < count)
+    {
+        int prio = CpuScanPriority (mask);
+        mask &= ~(1ULL << prio);
+        NkList_t* queue = &src->readyQueues[prio];
+        NkLink_t* iter = NkListFront (queue);
+        while (iter && moved < count)
+        {
+            NkThread_t* thread = (NkThread_t*) iter;
+            iter = NkListIterate (queue, iter);
+            if (!tskCanPull (ccb, src, thread, hotOk, now))
+                continue;
+            tskMoveThread (ccb, src, thread);
+            ++moved;
+        }
+        // Fair share threads at this level are in the tree instead
+        if (prio != TSK_PRIO_FAIR)
+            continue;
+        NkRbNode_t* node = NkRbFirst (&src->fairTree);
+        while (node && moved < count)
+        {
+            NkThread_t* thread = TSK_FAIR_THREAD (node);
+            node = NkRbNext (node);
+            if (!tskCanPull (ccb, src, thread, hotOk, now))
+                continue;
+            tskMoveThread (ccb, src, thread);
+            ++moved;
+        }
+    }
+    TskUnlockRq (src);
+    return moved;
+}
+
+// Steals a thread from the busiest CPU closest to us
+// Returns priority of the thread, or -1 if nothing could be found
+// Run queue must be locked
+static int tskSteal (NkCcb_t* ccb)
+{
+    // Look at closer CPUs first, as threads moved between them keep more of their caches
+    // Anything is better than idling, so cache hot threads are fair game
+    for (int dist = TSK_DIST_CORE; dist <= TSK_DIST_SYS; ++dist)
+    {
+        NkCcb_t* busiest = tskFindBusiest (ccb, dist, dist);
+        if (busiest && tskPullThreads (ccb, busiest, 1, true))
+            return CpuScanPriority (ccb->readyMask);
+    }
+    return -1;
+}
+
+// Evens out load between us and the busiest CPU around us
+// Run queue must be locked
+static void tskBalance (NkCcb_t* ccb)
+{
+    // Balance with CPUs sharing our L2 on every pass, and look further out every few passes
+    int pass = ++ccb->balancePasses;
+    int maxDist = TSK_DIST_L2;
+    if (!(pass % 4))
+        maxDist = TSK_DIST_SYS;
+    else if (!(pass % 2))
+        maxDist = TSK_DIST_LLC;
+    NkCcb_t* busiest = tskFindBusiest (ccb, TSK_DIST_CORE, maxDist);
+    if (!busiest)
+        return;
+    // Moving a thread only helps if it doesn't leave us busier than they were
+    int diff = tskCpuLoad (busiest) - tskCpuLoad (ccb);
+    if (diff < 2)
+        return;
+    int count = diff / 2;
+    if (count > TSK_BALANCE_MAX)
+        count = TSK_BALANCE_MAX;
+    if (tskPullThreads (ccb, busiest, count, false) &&
+        CpuScanPriority (ccb->readyMask) < ccb->curPriority)
+    {
         tskPreempt();
+    }
+}
+
+// Picks the CPU thread should be readied on
+static NkCcb_t* tskSelectCpu (NkThread_t* thread)
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    int numCpus = NkGetNumCpus();
+    if (numCpus == 1)
+        return ccb;
+    // New threads start out next to whoever started them
+    NkCcb_t* last = (thread->ccb) ? thread->ccb : ccb;
+    // Go back to where we ran if it's free, or our cache is still there
+    if (tskCpuAllowed (thread, last) &&
+        (last->curPriority == TSK_PRIO_IDLE ||
+         tskIsCacheHot (thread, NK_STATIC_CALL (PltGetTime)())))
+    {
+        return last;
+    }
+    // Take the preferred CPU if it's free, and otherwise stay close to it
+    if (thread->prefCpu >= 0 && thread->prefCpu < numCpus)
+    {
+        NkCcb_t* pref = NkGetCcb (thread->prefCpu);
+        if (pref->curPriority == TSK_PRIO_IDLE)
+            return pref;
+        last = pref;
+    }
+    // Find the least busy CPU, preferring close ones
+    NkCcb_t* best = NULL;
+    int bestLoad = 0;
+    int bestDist = 0;
+    for (int i = 0; i < numCpus; ++i)
+    {
+        NkCcb_t* cur = NkGetCcb (i);
+        if (!tskCpuAllowed (thread, cur))
+            continue;
+        int load = tskCpuLoad (cur);
+        int dist = tskCpuDistance (last, cur);
+        if (!best || load < bestLoad || (load == bestLoad && dist < bestDist))
+        {
+            best = cur;
+            bestLoad = load;
+            bestDist = dist;
+        }
+    }
+    // If none of its CPUs are up yet, it has to run somewhere
+    return (best) ? best : ccb;
+}
+
+// Moves time events of ccb to the closest busy CPU
+static void tskMigrateTimers (NkCcb_t* ccb)
+{
+    NkCcb_t* best = NULL;
+    int bestDist = 0;
+    int numCpus = NkGetNumCpus();
+    for (int i = 0; i < numCpus; ++i)
+    {
+        NkCcb_t* cur = NkGetCcb (i);
+        if (cur == ccb || cur->curPriority == TSK_PRIO_IDLE)
+            continue;
+        int dist = tskCpuDistance (ccb, cur);
+        if (!best || dist < bestDist)
+        {
+            best = cur;
+            bestDist = dist;
+        }
+    }
+    if (best)
+        NkTimeMigrate (best);
+}
+
+// Gets an idle CPU that stopped ticking to come steal from ccb
+static void tskKickIdle (NkCcb_t* ccb)
+{
+    int numCpus = NkGetNumCpus();
+    for (int i = 0; i < numCpus; ++i)
+    {
+        NkCcb_t* other = NkGetCcb (i);
+        if (other != ccb && other->curPriority == TSK_PRIO_IDLE &&
+            NkAtomicLoad (&other->tickStopped))
+        {
+            TskWantTick (other);
+            return;
+        }
+    }
 }
 
 // Hook to prepare thread to stop running and let another thread run
@@ -83,13 +813,26 @@ static FORCEINLINE void tskStopThread (NkCcb_t* ccb, NkThread_t* thread)
     TskLockThread (thread);
     assert (PltGetIpl() == PLT_IPL_HIGH);
     // Update runtime of thread
-    thread->runTime += (clock->getTime() - thread->lastSchedule);
+    ktime_t now = NK_STATIC_CALL (PltGetTime)();
+    thread->runTime += (now - thread->lastSchedule);
+    if (thread->policy == TSK_POLICY_FAIR)
+        thread->vruntime += tskFairScale (thread, now - thread->lastSchedule);
+    else if (tskIsDeadline (thread))
+        thread->dlBudget -= (int64_t) (now - thread->lastSchedule);
+    thread->lastStop = now;
     // Figure out state
     if (thread->state == TSK_THREAD_RUNNING)
     {
         // If this is not the idle thread, add it to run queue
         if (!(thread->flags & TSK_THREAD_IDLE))
-            tskReadyThread (ccb, thread);    // Admit it to run queue
+        {
+            // If it may not run here anymore, it goes to another CPU once we're off of its
+            // stack, as we can't lock another queue while holding ours
+            if (!tskCpuAllowed (thread, ccb) && (thread->affinity & NkGetCpuMask()))
+                ccb->migrateThread = thread;
+            else
+                tskReadyThread (ccb, thread);    // Admit it to run queue
+        }
     }
     else if (thread->state == TSK_THREAD_WAITING)
         TskThreadSetAssert (thread, 0);
@@ -102,16 +845,31 @@ static FORCEINLINE void tskSetCurrentThread (NkCcb_t* ccb, NkThread_t* thread)
 {
     assert (PltGetIpl() == PLT_IPL_HIGH);
     NkThread_t* oldThread = ccb->curThread;
+    if (thread != oldThread && oldThread != ccb->idleThread)
+        tskStatSwitch (oldThread);
+    if (thread != oldThread)
+        NkStatInc (&tskStatSwitches);
     // Set new thread as running
     thread->state = TSK_THREAD_RUNNING;
     // Set last schedule time
-    thread->lastSchedule = clock->getTime();
+    thread->lastSchedule = NK_STATIC_CALL (PltGetTime)();
+    tskStatDispatch (thread, thread->lastSchedule);
     // Make it current
+    thread->ccb = ccb;
     ccb->curThread = thread;
-    ccb->curPriority = thread->priority;
+    ccb->curPriority = (thread == ccb->idleThread) ? TSK_PRIO_IDLE : thread->priority;
     // Do a context swap
     if (thread != oldThread)
+    {
+        // The old thread's stack stays in use until the switch is done
+        TskThreadSetOnCpu (thread, 1);
+        ccb->prevThread = oldThread;
+        MmSwitchThreadSpace (thread->space);
+        CpuSwitchState (oldThread, thread);
+        NK_TRACE (NK_TRACE_SWITCH, oldThread->tid, thread->tid);
         CpuSwitchContext (thread->context, &oldThread->context);
+        TskFinishSwitch();
+    }
     // NOTE: from the CPU's perspective, we return from CpuSwitchContext in the new thread
     // From oldThread's perspective, it pauses, and then whenever it gets queue again, returns here
     // From thread's perspective, it resumes from a previous pause here
@@ -119,35 +877,68 @@ static FORCEINLINE void tskSetCurrentThread (NkCcb_t* ccb, NkThread_t* thread)
     // (besides the below function)
 }
 
+// Finishes a context switch on the current CPU
+// Called by the thread switched to, as the thread switched away from can't know when it's done
+void TskFinishSwitch()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    NkThread_t* prevThread = ccb->prevThread;
+    ccb->prevThread = NULL;
+    // Its stack isn't ours anymore, so it's free to run on other CPUs
+    if (prevThread)
+        TskThreadSetOnCpu (prevThread, 0);
+}
+
 // Schedules a thread to execute
 // The main interface to the scheduler
 // NOTE: interrupt unsafe, call with IPL raised and run queue locked
 static FORCEINLINE void tskSchedule (NkCcb_t* ccb)
 {
     assert (PltGetIpl() == PLT_IPL_HIGH);
+    // RCU readers can't block or be preempted, so every trip through here is a quiescent state,
+    // even if we end up staying on the same thread
+    NkRcuQuiescent();
     NkThread_t* nextThread = NULL;
     NkThread_t* curThread = ccb->curThread;
     // Stop current thread
     tskStopThread (ccb, curThread);
+    tskFairUpdateMin (ccb);
+    // A thread that's being moved off of us can't keep going
+    bool canKeep = curThread->state == TSK_THREAD_RUNNING && ccb->migrateThread != curThread;
+    // Deadline threads go before everything else
+    tskDlReplenish (ccb);
+    NkRbNode_t* dlFirst = NkRbFirst (&ccb->dlTree);
+    if (dlFirst)
+    {
+        nextThread = TSK_DL_THREAD (dlFirst);
+        tskDequeueThread (ccb, nextThread);
+        tskDlArm (ccb, nextThread);
+        tskSetCurrentThread (ccb, nextThread);
+        return;
+    }
     // Get highest runnable priority
     int highPrio = CpuScanPriority (ccb->readyMask);
+    // If we would be idle, see if we can get work from somebody else first
+    if (highPrio == -1 && (!canKeep || curThread == ccb->idleThread))
+        highPrio = tskSteal (ccb);
     if (highPrio == -1)
     {
         // We either keep going or idle
         // This depends on the thread's state
-        if (curThread->state == TSK_THREAD_RUNNING)
-            return;                      // Don't do anything
+        if (canKeep)
+        {
+            tskDlArm (ccb, curThread);
+            return;    // Don't do anything
+        }
         nextThread = ccb->idleThread;    // Run idle thread
     }
     else
     {
-        NkList_t* queue = &ccb->readyQueues[highPrio];
-        nextThread = (NkThread_t*) NkListFront (queue);
-        NkListRemove (queue, (NkLink_t*) nextThread);
-        if (!NkListFront (queue))
-            ccb->readyMask &= ~(1ULL << highPrio);
+        nextThread = tskFrontThread (ccb, highPrio);
+        tskDequeueThread (ccb, nextThread);
     }
     // Execute the thread
+    tskDlArm (ccb, nextThread);
     tskSetCurrentThread (ccb, nextThread);
 }
 
@@ -159,11 +950,14 @@ void __attribute__ ((noreturn)) TskSetInitialThread (NkThread_t* thread)
     NkCcb_t* ccb = CpuGetCcb();
     thread->state = TSK_THREAD_RUNNING;
     // Set last schedule time
-    thread->lastSchedule = clock->getTime();
+    thread->lastSchedule = NK_STATIC_CALL (PltGetTime)();
     // Set quanta left
     thread->quantaLeft = thread->quantum;
     // Set as current
+    thread->ccb = ccb;
+    TskThreadSetOnCpu (thread, 1);
     ccb->curThread = thread;
+    ccb->curPriority = (thread == ccb->idleThread) ? TSK_PRIO_IDLE : thread->priority;
     CpuContext_t* fakeCtx = NULL;    // Fake context pointer
     CpuSwitchContext (thread->context, &fakeCtx);
     // UNREACHABLE
@@ -184,92 +978,250 @@ static inline void tskPreempt()
         ccb->preemptReq = false;
         TskLockRq (ccb);
         tskSchedule (ccb);    // Schedule the next thread
-        TskUnlockRq (ccb);
+        TskUnlockRq (CpuGetCcb());
     }
 }
 
-// Sets the priority of a thread
-void TskSetThreadPrio (NkThread_t* thread, int newPrio)
+// Makes ccb check if it should preempt its current thread
+static void tskPreemptCpu (NkCcb_t* ccb)
 {
-    NkCcb_t* ccb = CpuGetCcb();
+    if (ccb == CpuGetCcb())
+        tskPreempt();
+    else if (!TskIdleKick (ccb))
+        PltSendIpi (ccb->cpuNum, PLT_IPI_RESCHED);    // It has to do this itself
+}
+
+// Changes the priority a thread runs at, leaving its base priority alone
+void TskChangeThreadPrio (NkThread_t* thread, int newPrio)
+{
+    if (thread->priority == newPrio)
+        return;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    // We need to loop this in case the thread moves between the read and the lock
+    for (;;)
+    {
+        // Lock the queue of the CPU it's on, if it's been on one
+        NkCcb_t* ccb = thread->ccb;
+        if (ccb)
+            TskLockRq (ccb);
+        TskLockThread (thread);
+        // Make sure it didn't change
+        if (thread->ccb != ccb)
+        {
+            TskUnlockThread (thread);
+            if (ccb)
+                TskUnlockRq (ccb);
+            continue;
+        }
+        int curPrio = thread->priority;
+        if (thread->state == TSK_THREAD_RUNNING && ccb->curThread == thread)
+        {
+            thread->priority = newPrio;
+            ccb->curPriority = newPrio;
+            // Check if we need to preempt as this may have resulted in it no longer being the
+            // highest priority runnable thread
+            if (newPrio > curPrio && ccb->readyMask && CpuScanPriority (ccb->readyMask) < newPrio)
+                tskPreemptCpu (ccb);    // Queue up preemption
+        }
+        else if (thread->state == TSK_THREAD_READY)
+        {
+            // Move it to the new queue
+            tskDequeueThread (ccb, thread);
+            thread->priority = newPrio;
+            tskEnqueueThread (ccb, thread, false);
+            // Check for preemption
+            if (thread->priority < ccb->curPriority)
+                tskPreemptCpu (ccb);
+        }
+        else
+            thread->priority = newPrio;
+        TskUnlockThread (thread);
+        if (ccb)
+            TskUnlockRq (ccb);
+        break;
+    }
+    PltLowerIpl (ipl);
+}
+
+// Makes a thread that hasn't been started a deadline thread
+errno_t TskSetThreadDeadline (NkThread_t* thread,
+                              ktime_t runtime,
+                              ktime_t deadline,
+                              ktime_t period)
+{
+    if (!runtime || runtime > deadline || deadline > period)
+        return EINVAL;
+    uint64_t bw = (runtime << TSK_DL_SHIFT) / period;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    TskLockThread (thread);
+    // Deadline threads that are already going can have their parameters changed. They take
+    // effect at their next period
+    bool isDl = tskIsDeadline (thread);
+    if (!isDl && thread->state != TSK_THREAD_CREATED)
+    {
+        TskUnlockThread (thread);
+        PltLowerIpl (ipl);
+        return EINVAL;
+    }
+    // See if it fits alongside everything already admitted
+    NkSpinLock (&tskDlLock);
+    uint64_t total = tskDlTotalBw - ((isDl) ? thread->dlBw : 0) + bw;
+    if (total > (NkGetNumCpus() * TSK_DL_MAX_BW))
+    {
+        NkSpinUnlock (&tskDlLock);
+        TskUnlockThread (thread);
+        PltLowerIpl (ipl);
+        return EBUSY;
+    }
+    tskDlTotalBw = total;
+    NkSpinUnlock (&tskDlLock);
+    thread->dlBw = bw;
+    thread->dlRuntime = runtime;
+    thread->dlDeadline = deadline;
+    thread->dlPeriod = period;
+    if (!isDl)
+    {
+        // Its first period starts when it's readied
+        thread->dlAbsDeadline = 0;
+        thread->dlBudget = 0;
+        thread->policy = TSK_POLICY_DEADLINE;
+        thread->priority = thread->basePrio = TSK_PRIO_HIGH;
+        thread->flags |= TSK_THREAD_FIXED_PRIO;
+    }
+    TskUnlockThread (thread);
+    PltLowerIpl (ipl);
+    return EOK;
+}
+
+// Gives back the CPU time a deadline thread reserved
+void TskReleaseDeadline (NkThread_t* thread)
+{
+    if (!tskIsDeadline (thread))
+        return;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&tskDlLock);
+    tskDlTotalBw -= thread->dlBw;
+    NkSpinUnlock (&tskDlLock);
+    thread->dlBw = 0;
+    PltLowerIpl (ipl);
+}
+
+// Sets the nice value of a fair share thread
+bool TskSetThreadNice (NkThread_t* thread, int nice)
+{
+    if (nice < TSK_NICE_MIN || nice > TSK_NICE_MAX)
+        return false;
+    // Weight is only used when run time gets charged, which happens with the thread locked
     ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
-    // Lock the thread briefly to sample the current state
     TskLockThread (thread);
-    int state = thread->state;
+    thread->nice = nice;
+    thread->weight = tskFairWeights[nice - TSK_NICE_MIN];
     TskUnlockThread (thread);
-    if (thread->priority != newPrio)
+    PltLowerIpl (ipl);
+    return true;
+}
+
+// Makes sure the time slice tick of ccb is running
+void TskWantTick (NkCcb_t* ccb)
+{
+    if (!NkAtomicLoad (&ccb->tickStopped))
+        return;
+    ccb->tickReq = true;
+    if (ccb != CpuGetCcb() && !TskIdleKick (ccb))
+        PltSendIpi (ccb->cpuNum, PLT_IPI_RESCHED);
+}
+
+// Restarts the time slice tick on the current CPU
+// Must be called with no locks held
+static void tskStartTick (NkCcb_t* ccb)
+{
+    ccb->tickReq = false;
+    // Nobody else touches the event while it's stopped
+    if (NkAtomicLoad (&ccb->tickStopped))
     {
-        // We need to loop this in case there is a state change between the read and the lock
-        for (;;)
+        NkAtomicStore (&ccb->tickStopped, 0);
+        NkTimeRegEvent (ccb->tickEvent,
+                        TSK_TIMESLICE_DELTA,
+                        NK_TIME_REG_PERIODIC | NK_TIME_REG_PINNED);
+    }
+}
+
+// Stops the time slice tick if nothing needs it
+// Called from the tick
+static void tskStopTick (NkCcb_t* ccb, NkTimeEvent_t* evt)
+{
+    TskLockRq (ccb);
+    // Mark it stopped before checking if RCU needs it, so a grace period starting at the same
+    // time either gets seen here or sees that it has to restart us
+    NkAtomicStore (&ccb->tickStopped, 1);
+    if (ccb->readyCount || NkRcuNeedsTick())
+        NkAtomicStore (&ccb->tickStopped, 0);
+    else
+        NkTimeStopPeriodic (evt);
+    TskUnlockRq (ccb);
+}
+
+// Sets the CPUs a thread may run on, and the one it prefers
+bool TskSetThreadAffinity (NkThread_t* thread, long mask, int prefCpu)
+{
+    // Idle threads belong to their CPU
+    if (!mask || (thread->flags & TSK_THREAD_IDLE) || prefCpu >= NEXKE_MAX_CPUS)
+        return false;
+    if (prefCpu >= 0 && !(mask & TSK_AFFINITY_CPU (prefCpu)))
+        return false;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    // We need to loop this in case the thread moves between the read and the lock
+    for (;;)
+    {
+        NkCcb_t* ccb = thread->ccb;
+        if (ccb)
+            TskLockRq (ccb);
+        TskLockThread (thread);
+        if (thread->ccb != ccb)
         {
-            if (state == TSK_THREAD_RUNNING)
-            {
-                TskLockThread (thread);
-                // Make sure it didn't change
-                if (thread != ccb->curThread)
-                {
-                    TskUnlockThread (thread);
-                    continue;
-                }
-                // Set the new priority and save the onld one
-                int curPrio = thread->priority;
-                thread->priority = newPrio;
-                ccb->curPriority = newPrio;
-                // Check if we need to preempt as this may have resulted in it no longer being the
-                // highest priority runnable thread
-                if (newPrio > curPrio)
-                {
-                    if (ccb->readyMask && CpuScanPriority (ccb->readyMask) < newPrio)
-                    {
-                        tskPreempt();    // Queue up preemption
-                    }
-                }
-                TskUnlockThread (thread);
-            }
-            else if (state == TSK_THREAD_READY)
-            {
-                // Thread is current on the ready queue, lock and then make sure it didn't change
-                TskLockRq (ccb);
-                TskLockThread (thread);
-                if (thread->state != TSK_THREAD_READY)
-                {
-                    TskUnlockThread (thread);
-                    TskUnlockRq (ccb);
-                    continue;
-                }
-                // Remove from old queue
-                int curPrio = thread->priority;
-                NkList_t* curQueue = &ccb->readyQueues[curPrio];
-                NkListRemove (curQueue, &thread->link);
-                if (!NkListFront (curQueue))
-                    ccb->readyMask &= ~(1ULL << curPrio);
-                // Add to new queue
-                NkList_t* newQueue = &ccb->readyQueues[newPrio];
-                thread->priority = newPrio;
-                NkListAddBack (newQueue, &thread->link);
-                ccb->readyMask |= (1ULL << newPrio);
-                // Check for preemption
-                if (thread->priority < ccb->curPriority)
-                    tskPreempt();
-                TskUnlockThread (thread);
+            TskUnlockThread (thread);
+            if (ccb)
                 TskUnlockRq (ccb);
-            }
-            else
+            continue;
+        }
+        thread->affinity = mask;
+        thread->prefCpu = prefCpu;
+        // Move it off of its CPU if it can't stay there
+        bool requeue = false;
+        if (ccb && !tskCpuAllowed (thread, ccb))
+        {
+            if (thread->state == TSK_THREAD_RUNNING && ccb->curThread == thread)
+                tskPreemptCpu (ccb);    // It gets moved once it stops
+            else if (thread->state == TSK_THREAD_READY)
             {
-                TskLockThread (thread);
-                // Make sure it didn't change
-                if (thread->state != state)
-                {
-                    TskUnlockThread (thread);
-                    continue;
-                }
-                thread->priority = newPrio;
-                TskUnlockThread (thread);
+                // It's on no queue until it's readied again, like a new thread
+                tskDequeueThread (ccb, thread);
+                thread->state = TSK_THREAD_CREATED;
+                requeue = true;
             }
-            break;
         }
+        TskUnlockThread (thread);
+        if (ccb)
+            TskUnlockRq (ccb);
+        if (requeue)
+            TskReadyThread (thread);
+        break;
     }
     PltLowerIpl (ipl);
+    return true;
+}
+
+// Gets the CPUs a thread may run on
+long TskGetThreadAffinity (NkThread_t* thread, int* prefCpu)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    TskLockThread (thread);
+    long mask = thread->affinity;
+    if (prefCpu)
+        *prefCpu = thread->prefCpu;
+    TskUnlockThread (thread);
+    PltLowerIpl (ipl);
+    return mask;
 }
 
 // Enables preemption
@@ -279,6 +1231,16 @@ void TskEnablePreemptUnsafe()
     ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
     NkCcb_t* ccb = CpuGetCcb();
     assert (!ccb->preemptDisable);
+    // Nothing is locked now, so this is where the tick gets restarted, and threads that had to
+    // leave get moved
+    if (ccb->tickReq)
+        tskStartTick (ccb);
+    if (ccb->migrateThread)
+    {
+        NkThread_t* thread = ccb->migrateThread;
+        ccb->migrateThread = NULL;
+        TskReadyThread (thread);
+    }
     if (ccb->preemptReq)
         tskPreempt();    // Preempt the current thread
     PltLowerIpl (ipl);
@@ -296,12 +1258,14 @@ void TskSetCurrentThread (NkThread_t* thread)
     NkCcb_t* ccb = CpuGetCcb();
     TskLockRq (ccb);
     tskSetCurrentThread (ccb, thread);
-    TskUnlockRq (ccb);
+    TskUnlockRq (CpuGetCcb());
 }
 
 void TskReadyThread (NkThread_t* thread)
 {
-    NkCcb_t* ccb = CpuGetCcb();
+    // Make sure it's left the CPU it was on, so it can't run in two places at once
+    TskThreadWaitOffCpu (thread);
+    NkCcb_t* ccb = tskSelectCpu (thread);
     // Lock 'er up
     TskLockRq (ccb);
     TskLockThread (thread);
@@ -317,14 +1281,16 @@ void TskSchedule()
     NkCcb_t* ccb = CpuGetCcb();
     TskLockRq (ccb);
     tskSchedule (ccb);
-    TskUnlockRq (ccb);
+    TskUnlockRq (CpuGetCcb());
 }
 
 // In this module for performance reasons
 void TskWakeObj (TskWaitObj_t* obj)
 {
-    NkCcb_t* ccb = CpuGetCcb();
     NkThread_t* thread = obj->waiter;
+    // It may still be switching away on another CPU
+    TskThreadWaitOffCpu (thread);
+    NkCcb_t* ccb = tskSelectCpu (thread);
     // Lock
     TskLockRq (ccb);
     TskLockThread (thread);
@@ -334,6 +1300,92 @@ void TskWakeObj (TskWaitObj_t* obj)
     TskUnlockRq (ccb);
 }
 
+// Wakes every wait object on objs
+// Threads going to the same CPU one after the other are readied under one hold of its run queue
+// lock, and only the best of them is checked against what that CPU is running
+// objs is left in pieces, as each thread may wait again as soon as it's readied
+void TskWakeObjList (NkList_t* objs)
+{
+    // Make sure they're all off their CPUs first, as spinning on that with a run queue held
+    // could keep them from ever getting off
+    NkLink_t* iter = NkListFront (objs);
+    while (iter)
+    {
+        TskThreadWaitOffCpu (LINK_CONTAINER (iter, TskWaitObj_t, link)->waiter);
+        iter = NkListIterate (objs, iter);
+    }
+    NkCcb_t* locked = NULL;
+    bool preempt = false;
+    iter = NkListFront (objs);
+    while (iter)
+    {
+        NkThread_t* thread = LINK_CONTAINER (iter, TskWaitObj_t, link)->waiter;
+        // The link isn't ours once the thread is ready
+        iter = NkListIterate (objs, iter);
+        NkCcb_t* ccb = tskSelectCpu (thread);
+        if (ccb != locked)
+        {
+            if (locked)
+            {
+                if (preempt)
+                    tskPreemptCpu (locked);
+                TskUnlockRq (locked);
+            }
+            TskLockRq (ccb);
+            locked = ccb;
+            preempt = false;
+        }
+        TskLockThread (thread);
+        tskQueueReady (ccb, thread);
+        preempt |= tskShouldPreempt (ccb, thread);
+        TskUnlockThread (thread);
+    }
+    if (locked)
+    {
+        if (preempt)
+            tskPreemptCpu (locked);
+        TskUnlockRq (locked);
+    }
+}
+
+// Handles a reschedule IPI
+// Whoever sent it already put a thread on our queues, we just need to see if it should run now
+void TskReschedIpi()
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkCcb_t* ccb = CpuGetCcb();
+    NkThread_t* curThread = ccb->curThread;
+    TskLockRq (ccb);
+    // Deadline threads can only be taken over by ones with earlier deadlines
+    bool preempt = false;
+    NkRbNode_t* dlFirst = NkRbFirst (&ccb->dlTree);
+    if (dlFirst)
+        preempt = tskDlWantsCpu (ccb, TSK_DL_THREAD (dlFirst));
+    else if (!tskIsDeadline (curThread))
+        preempt = ccb->readyMask && CpuScanPriority (ccb->readyMask) < ccb->curPriority;
+    TskUnlockRq (ccb);
+    // It may have been told to move
+    if (preempt || !tskCpuAllowed (curThread, ccb))
+        tskPreempt();
+    PltLowerIpl (ipl);
+}
+
+// Checks if the running fair share thread has gotten far enough ahead to give way
+static bool tskFairTick (NkCcb_t* ccb, NkThread_t* thread)
+{
+    TskLockRq (ccb);
+    bool res = NkListFront (&ccb->readyQueues[TSK_PRIO_FAIR]) != NULL;
+    NkRbNode_t* first = NkRbFirst (&ccb->fairTree);
+    if (!res && first)
+    {
+        ktime_t ran = NK_STATIC_CALL (PltGetTime)() - thread->lastSchedule;
+        ktime_t vrt = thread->vruntime + tskFairScale (thread, ran);
+        res = vrt > (TSK_FAIR_THREAD (first)->vruntime + TSK_FAIR_GRAN);
+    }
+    TskUnlockRq (ccb);
+    return res;
+}
+
 // Time slice handler
 static void TskTimeSlice (NkTimeEvent_t* evt, void* arg)
 {
@@ -342,7 +1394,8 @@ static void TskTimeSlice (NkTimeEvent_t* evt, void* arg)
     NkCcb_t* ccb = CpuGetCcb();
     NkThread_t* curThread = ccb->curThread;
     TskLockThread (curThread);
-    if (!(curThread->flags & TSK_THREAD_FIFO))
+    bool fair = tskIsFair (curThread);
+    if (!fair && !tskIsDeadline (curThread) && !(curThread->flags & TSK_THREAD_FIFO))
     {
         // Check for quantum expiry
         if (curThread->quantaLeft == 0)
@@ -351,29 +1404,166 @@ static void TskTimeSlice (NkTimeEvent_t* evt, void* arg)
             --curThread->quantaLeft;
     }
     TskUnlockThread (curThread);
+    // Fair share threads go until they've gotten ahead of the next one
+    if (fair && tskFairTick (ccb, curThread))
+        tskPreempt();
+    // If RCU is waiting on us, go through the scheduler so it sees a quiescent state
+    if (NkRcuNeedsQuiescent())
+        tskPreempt();
+    if (NkGetNumCpus() > 1)
+    {
+        // If we're idle and someone has work waiting, go steal it
+        if (curThread == ccb->idleThread && tskFindBusiest (ccb, TSK_DIST_CORE, TSK_DIST_SYS))
+            tskPreempt();
+        // Periodically even out load
+        if (++ccb->balanceTicks >= TSK_BALANCE_TICKS)
+        {
+            ccb->balanceTicks = 0;
+            TskLockRq (ccb);
+            tskBalance (ccb);
+            TskUnlockRq (ccb);
+            // Idle CPUs that stopped ticking won't come steal on their own
+            if (ccb->readyCount)
+                tskKickIdle (ccb);
+        }
+    }
+    NkRcuTick();
+    tskStopTick (ccb, evt);
+    PltLowerIpl (ipl);
+}
+
+// Deadline event handler
+// Going through the scheduler charges the running deadline thread and replenishes throttled ones
+static void TskDlEvent (NkTimeEvent_t* evt, void* arg)
+{
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    CpuGetCcb()->dlArmed = false;
+    tskPreempt();
     PltLowerIpl (ipl);
 }
 
+// Sets up time slicing on the current CPU
+static void tskStartTimeSlice()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    ccb->dlEvent = NkTimeNewEvent();
+    assert (ccb->dlEvent);
+    NkTimeSetCbEvent (ccb->dlEvent, TskDlEvent, NULL);
+    NkTimeEvent_t* evt = NkTimeNewEvent();
+    assert (evt);
+    NkTimeSetCbEvent (evt, TskTimeSlice, NULL);
+    ccb->tickEvent = evt;
+    NkTimeRegEvent (evt, TSK_TIMESLICE_DELTA, NK_TIME_REG_PERIODIC | NK_TIME_REG_PINNED);
+}
+
 // Initializes scheduler
 void TskInitSched()
 {
-    // Create the idle thread
+    NkStatRegister (&tskStatSwitches);
+    TskInitIdle();
     NkCcb_t* ccb = CpuGetCcb();
+    if (!TskInitSchedCpu (ccb))
+        NkPanicOom();
     ccb->preemptDisable = 0;
+    tskStartTimeSlice();
+}
+
+// Sets up scheduler state of a CPU
+bool TskInitSchedCpu (NkCcb_t* ccb)
+{
+    // Create the idle thread
     ccb->idleThread = TskCreateThread (TskIdleThread,
                                        NULL,
                                        "TskIdleThread",
                                        TSK_POLICY_FIFO,
                                        TSK_PRIO_WORKER,
                                        TSK_THREAD_IDLE);
-    assert (ccb->idleThread);
+    if (!ccb->idleThread)
+        return false;
+    ccb->idleThread->ccb = ccb;
+    ccb->idleThread->affinity = TSK_AFFINITY_CPU (ccb->cpuNum);
+    ccb->idleThread->prefCpu = ccb->cpuNum;
     for (int i = 0; i < NEXKE_MAX_PRIO; ++i)
         NkListInit (&ccb->readyQueues[i]);
-    // Get clock
-    clock = PltGetPlatform()->clock;
-    // Set initial time slicing event
-    NkTimeEvent_t* evt = NkTimeNewEvent();
-    assert (evt);
-    NkTimeSetCbEvent (evt, TskTimeSlice, NULL);
-    NkTimeRegEvent (evt, TSK_TIMESLICE_DELTA, NK_TIME_REG_PERIODIC);
+    NkRbInit (&ccb->fairTree);
+    ccb->fairMinVrt = 0;
+    NkRbInit (&ccb->dlTree);
+    NkListInit (&ccb->dlThrottled);
+    ccb->dlArmed = false;
+    return true;
+}
+
+// Starts scheduling on the current CPU, which must not be the BSP
+void __attribute__ ((noreturn)) TskStartCpu()
+{
+    NkCcb_t* ccb = CpuGetCcb();
+    assert (ccb->cpuNum);
+    ccb->preemptDisable = 0;
+    tskStartTimeSlice();
+    // Nothing is on our queues yet, so just idle until something shows up
+    TskSetInitialThread (ccb->idleThread);
 }
+
+#ifdef NEXKE_SCHED_STATS
+
+// Dumps a set of scheduler statistics
+static void tskDumpStats (TskSchedStats_t* stats)
+{
+    NkLogDebug ("    %llu voluntary switches, %llu involuntary switches\n",
+                (unsigned long long) stats->volSwitches,
+                (unsigned long long) stats->involSwitches);
+    uint64_t count = 0;
+    for (int i = 0; i < TSK_DELAY_BUCKETS; ++i)
+        count += stats->delays[i];
+    if (!count)
+        return;
+    NkLogDebug ("    run delay: %llu ns on average, %llu ns at most\n",
+                (unsigned long long) (stats->totalDelay / count),
+                (unsigned long long) stats->maxDelay);
+    for (int i = 0; i < TSK_DELAY_BUCKETS; ++i)
+    {
+        if (!stats->delays[i])
+            continue;
+        NkLogDebug ("    %llu - %llu ns: %llu\n",
+                    (i) ? (1ULL << i) : 0ULL,
+                    (2ULL << i) - 1,
+                    (unsigned long long) stats->delays[i]);
+    }
+}
+
+// Dumps scheduler statistics of every priority
+void TskDumpSchedStats()
+{
+    NkLogDebug ("Scheduler statistics:\n");
+    for (int i = 0; i < NEXKE_MAX_PRIO; ++i)
+    {
+        TskSchedStats_t* stats = &tskPrioStats[i];
+        if (!stats->volSwitches && !stats->involSwitches && !stats->totalDelay)
+            continue;
+        NkLogDebug ("priority %d:\n", i);
+        tskDumpStats (stats);
+    }
+}
+
+// Dumps scheduler statistics of a thread
+void TskDumpThreadStats (NkThread_t* thread)
+{
+    NkLogDebug ("Scheduler statistics of thread %d (%s):\n", thread->tid, thread->name);
+    tskDumpStats (&thread->stats);
+}
+
+#else
+
+// Dumps scheduler statistics of every priority
+void TskDumpSchedStats()
+{
+    NkLogDebug ("Scheduler statistics aren't enabled in this build\n");
+}
+
+// Dumps scheduler statistics of a thread
+void TskDumpThreadStats (NkThread_t* thread)
+{
+    NkLogDebug ("Scheduler statistics aren't enabled in this build\n");
+}
+
+#endif
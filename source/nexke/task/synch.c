@@ -17,44 +17,269 @@
 
 #include <assert.h>
 #include <nexke/nexke.h>
+#include <nexke/platform.h>
 #include <nexke/synch.h>
 #include <nexke/task.h>
 
+// Sleeping lock statistics
+#ifdef NEXKE_SYNCH_STATS
+
+#define TSK_SYNCH_CLASSES 256    // Classes there's room for, must be a power of two
+#define TSK_SYNCH_SITES   4      // Waiting sites kept for each class
+
+// Object types
+#define TSK_SYNCH_MUTEX     0
+#define TSK_SYNCH_SEMAPHORE 1
+#define TSK_SYNCH_CONDITION 2
+
+static const char* tskSynchTypes[] = {"mutex", "semaphore", "condition"};
+
+typedef struct _tsksynchsite
+{
+    uintptr_t pc;         // Site that waited
+    uint64_t waits;       // Times it waited
+    uint64_t waitTime;    // Time it spent waiting
+} tskSynchSite_t;
+
+typedef struct _tsksynchclass
+{
+    uintptr_t pc;                             // Site that first used objects of class
+    int type;                                 // Type of objects in class
+    uint64_t uses;                            // Times objects were acquired or waited on
+    uint64_t contended;                       // Times a thread had to block
+    uint64_t waitTime;                        // Total time spent blocked
+    uint64_t maxWait;                         // Longest time blocked
+    uint64_t holdTime;                        // Total time mutexes were held
+    uint64_t maxHold;                         // Longest time a mutex was held
+    tskSynchSite_t sites[TSK_SYNCH_SITES];    // Sites that waited the most
+} TskSynchClass_t;
+
+static TskSynchClass_t tskSynchClasses[TSK_SYNCH_CLASSES] = {0};
+static TskSynchClass_t tskSynchOther = {0};    // Everything once the table fills up
+static spinlock_t tskSynchLock = 0;            // Protects table and sites of classes
+
+// Gets class of an object, making one named after pc if it doesn't have one yet
+static TskSynchClass_t* tskSynchGetClass (TskSynchClass_t** clsPtr, int type, uintptr_t pc)
+{
+    TskSynchClass_t* cls = __atomic_load_n (clsPtr, __ATOMIC_ACQUIRE);
+    if (cls)
+        return cls;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&tskSynchLock);
+    cls = &tskSynchOther;
+    size_t slot = (pc >> 2) & (TSK_SYNCH_CLASSES - 1);
+    for (int i = 0; i < TSK_SYNCH_CLASSES; ++i)
+    {
+        TskSynchClass_t* iter = &tskSynchClasses[(slot + i) & (TSK_SYNCH_CLASSES - 1)];
+        if (!iter->pc)
+        {
+            iter->pc = pc;
+            iter->type = type;
+        }
+        if (iter->pc == pc && iter->type == type)
+        {
+            cls = iter;
+            break;
+        }
+    }
+    __atomic_store_n (clsPtr, cls, __ATOMIC_RELEASE);
+    NkSpinUnlock (&tskSynchLock);
+    PltLowerIpl (ipl);
+    return cls;
+}
+
+// Raises max to val
+static FORCEINLINE void tskSynchMax (uint64_t* max, uint64_t val)
+{
+    uint64_t cur = __atomic_load_n (max, __ATOMIC_RELAXED);
+    while (val > cur &&
+           !__atomic_compare_exchange_n (max, &cur, val, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Records a use of an object
+static void tskSynchUse (TskSynchClass_t** clsPtr, int type, uintptr_t pc)
+{
+    TskSynchClass_t* cls = tskSynchGetClass (clsPtr, type, pc);
+    __atomic_fetch_add (&cls->uses, 1, __ATOMIC_RELAXED);
+}
+
+// Records that a thread at pc blocked on an object of cls for time
+// When the sites are full, the one that waited least makes way, and the new site takes over its
+// count, so counts of sites are upper bounds
+static void tskSynchWaited (TskSynchClass_t* cls, uintptr_t pc, uint64_t time)
+{
+    __atomic_fetch_add (&cls->contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add (&cls->waitTime, time, __ATOMIC_RELAXED);
+    tskSynchMax (&cls->maxWait, time);
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&tskSynchLock);
+    tskSynchSite_t* site = &cls->sites[0];
+    for (int i = 0; i < TSK_SYNCH_SITES; ++i)
+    {
+        if (cls->sites[i].pc == pc)
+        {
+            site = &cls->sites[i];
+            break;
+        }
+        if (cls->sites[i].waits < site->waits)
+            site = &cls->sites[i];
+    }
+    site->pc = pc;
+    ++site->waits;
+    site->waitTime += time;
+    NkSpinUnlock (&tskSynchLock);
+    PltLowerIpl (ipl);
+}
+
+// Records that a mutex was held for time
+static void tskSynchHeld (TskSynchClass_t* cls, uint64_t time)
+{
+    __atomic_fetch_add (&cls->holdTime, time, __ATOMIC_RELAXED);
+    tskSynchMax (&cls->maxHold, time);
+}
+
+// These have to be used in the function the caller called, so the return address is theirs
+#define TSK_SYNCH_USE(obj, type) \
+    tskSynchUse (&(obj)->synchClass, type, (uintptr_t) __builtin_return_address (0))
+#define TSK_SYNCH_WAIT_START(start) uint64_t start = CpuGetCycles()
+#define TSK_SYNCH_WAITED(obj, start)                                 \
+    tskSynchWaited ((obj)->synchClass,                              \
+                    (uintptr_t) __builtin_return_address (0),       \
+                    CpuGetCycles() - (start))
+#define TSK_SYNCH_TAKEN(mtx)    ((mtx)->holdStart = CpuGetCycles())
+#define TSK_SYNCH_RELEASED(mtx) tskSynchHeld ((mtx)->synchClass, CpuGetCycles() - (mtx)->holdStart)
+
+// Dumps sleeping lock statistics
+void TskDumpSynchStats()
+{
+    NkLogDebug ("Sleeping lock statistics:\n");
+    for (int i = 0; i <= TSK_SYNCH_CLASSES; ++i)
+    {
+        TskSynchClass_t* cls = (i < TSK_SYNCH_CLASSES) ? &tskSynchClasses[i] : &tskSynchOther;
+        if (!cls->contended)
+            continue;
+        NkLogDebug ("%s first used at %p: used %llu times, blocked on %llu times\n",
+                    tskSynchTypes[cls->type],
+                    (void*) cls->pc,
+                    (unsigned long long) cls->uses,
+                    (unsigned long long) cls->contended);
+        NkLogDebug ("    waited for %llu cycles on average, %llu at most\n",
+                    (unsigned long long) (cls->waitTime / cls->contended),
+                    (unsigned long long) cls->maxWait);
+        if (cls->type == TSK_SYNCH_MUTEX && cls->uses)
+        {
+            NkLogDebug ("    held for %llu cycles on average, %llu at most\n",
+                        (unsigned long long) (cls->holdTime / cls->uses),
+                        (unsigned long long) cls->maxHold);
+        }
+        for (int j = 0; j < TSK_SYNCH_SITES; ++j)
+        {
+            tskSynchSite_t* site = &cls->sites[j];
+            if (!site->waits)
+                continue;
+            NkLogDebug ("    %p: waited %llu times, for %llu cycles\n",
+                        (void*) site->pc,
+                        (unsigned long long) site->waits,
+                        (unsigned long long) site->waitTime);
+        }
+    }
+}
+
+#else
+
+#define TSK_SYNCH_USE(obj, type)
+#define TSK_SYNCH_WAIT_START(start)
+#define TSK_SYNCH_WAITED(obj, start)
+#define TSK_SYNCH_TAKEN(mtx)
+#define TSK_SYNCH_RELEASED(mtx)
+
+// Dumps sleeping lock statistics
+void TskDumpSynchStats()
+{
+    NkLogDebug ("Sleeping lock statistics aren't enabled in this build\n");
+}
+
+#endif
+
 // Semaphore implementation
 
 // Initializes a semaphore
 void TskInitSemaphore (TskSemaphore_t* sem, int count)
 {
     TskInitWaitQueue (&sem->queue, TSK_WAITOBJ_SEMAPHORE);
-    sem->count = count;
+    sem->state = (atomic_t) count * TSK_SEM_ONE;
+#ifdef NEXKE_SYNCH_STATS
+    sem->synchClass = NULL;
+#endif
+}
+
+// Takes a count from a semaphore if there is one
+static FORCEINLINE bool tskTakeSemaphore (TskSemaphore_t* sem)
+{
+    atomic_t state = NkAtomicLoad (&sem->state);
+    while (TSK_SEM_COUNT (state) > 0)
+    {
+        if (NkAtomicCmpXchg (&sem->state, &state, state - TSK_SEM_ONE))
+            return true;
+    }
+    return false;
 }
 
 // Acquires a semaphore
 errno_t TskAcquireSemaphore (TskSemaphore_t* sem)
 {
-    // Assert the wait
+    TSK_SYNCH_USE (sem, TSK_SYNCH_SEMAPHORE);
+    // Fast path
+    if (tskTakeSemaphore (sem))
+        return EOK;
+    // Sleep until there's a count for us. Releases have to take the queue lock once they see
+    // the waiters bit, so they can't miss us
+    TSK_SYNCH_WAIT_START (start);
     ipl_t ipl = TskAssertWaitQueue (&sem->queue);
     errno_t err = EOK;
-    // This is a loop as between release and wakeup someone else could have
-    // acquired the semaphore
-    while (sem->count <= 0 && err == EOK)
+    for (;;)
+    {
+        atomic_t state = NkAtomicLoad (&sem->state);
+        if (TSK_SEM_COUNT (state) > 0)
+        {
+            // Take it, and let releases skip the queue once nobody is left on it
+            atomic_t newState = state - TSK_SEM_ONE;
+            if (!NkListFront (&sem->queue.waiters))
+                newState &= ~(atomic_t) TSK_SEM_WAITERS;
+            if (NkAtomicCmpXchg (&sem->state, &state, newState))
+                break;
+            continue;
+        }
+        if (!(state & TSK_SEM_WAITERS) &&
+            !NkAtomicCmpXchg (&sem->state, &state, state | TSK_SEM_WAITERS))
+        {
+            continue;
+        }
         err = TskWaitQueueFlags (&sem->queue, TSK_WAIT_ASSERTED, 0);
-    // Decrement count if we suceeded
-    if (err == EOK)
-        --sem->count;
-    // De assert the wait
+        if (err != EOK)
+            break;
+    }
     TskDeAssertWaitQueue (&sem->queue, ipl);
+    TSK_SYNCH_WAITED (sem, start);
     return err;
 }
 
 // Releases a semaphore
 errno_t TskReleaseSemaphore (TskSemaphore_t* sem)
 {
-    // Assert the wait queue
+    // Fast path
+    atomic_t state = NkAtomicLoad (&sem->state);
+    while (!(state & TSK_SEM_WAITERS))
+    {
+        if (NkAtomicCmpXchg (&sem->state, &state, state + TSK_SEM_ONE))
+            return EOK;
+    }
+    // Someone is sleeping, wake them up
     ipl_t ipl = TskAssertWaitQueue (&sem->queue);
     errno_t err = EOK;
-    ++sem->count;
-    if (sem->count > 0)
+    state = NkAtomicAdd (&sem->state, TSK_SEM_ONE);
+    if (TSK_SEM_COUNT (state) > 0)
         err = TskWakeWaitQueue (&sem->queue, TSK_WAIT_ASSERTED);    // Wake someone
     TskDeAssertWaitQueue (&sem->queue, ipl);
     return err;
@@ -63,16 +288,10 @@ errno_t TskReleaseSemaphore (TskSemaphore_t* sem)
 // Attempts to lock a semaphore
 errno_t TskTryAcquireSemaphore (TskSemaphore_t* sem)
 {
-    // Assert the queue
-    ipl_t ipl = TskAssertWaitQueue (&sem->queue);
-    errno_t err = EOK;
-    if (sem->count <= 0)
-        err = EWOULDBLOCK;
-    // Decrement count if we are able
-    if (err == EOK)
-        --sem->count;
-    TskDeAssertWaitQueue (&sem->queue, ipl);
-    return err;
+    TSK_SYNCH_USE (sem, TSK_SYNCH_SEMAPHORE);
+    if (!tskTakeSemaphore (sem))
+        return EWOULDBLOCK;
+    return EOK;
 }
 
 // Closes a semaphore
@@ -83,34 +302,255 @@ errno_t TskCloseSemaphore (TskSemaphore_t* sem)
 
 // Mutex implementation
 
+// Max times we spin on a running owner before sleeping anyway
+#define TSK_MUTEX_SPIN_MAX 4096
+
+// Gets owner thread of an owner value
+#define TSK_MUTEX_OWNER(owner) ((NkThread_t*) ((owner) & ~(atomic_t) TSK_MUTEX_WAITERS))
+
+// Priority inheritance
+// All inheritance state sits under one lock, as a chain can cross any number of mutexes and
+// threads. It's taken with the queue lock of the mutex held, and before scheduler locks
+static spinlock_t tskPiLock = 0;
+
+// Longest chain of mutexes we lend priority down
+// This also stops us if threads are deadlocked in a cycle
+#define TSK_PI_MAX_DEPTH 16
+
+// Gets the priority thread should run at, which is the best of its own and its waiters'
+static int tskPiGetPrio (NkThread_t* thread)
+{
+    int prio = thread->basePrio;
+    NkLink_t* iter = NkListFront (&thread->piMutexes);
+    while (iter)
+    {
+        TskMutex_t* mtx = LINK_CONTAINER (iter, TskMutex_t, piLink);
+        NkLink_t* waitIter = NkListFront (&mtx->piWaiters);
+        while (waitIter)
+        {
+            NkThread_t* waiter = LINK_CONTAINER (waitIter, NkThread_t, piLink);
+            if (waiter->priority < prio)
+                prio = waiter->priority;
+            waitIter = NkListIterate (&mtx->piWaiters, waitIter);
+        }
+        iter = NkListIterate (&thread->piMutexes, iter);
+    }
+    return prio;
+}
+
+// Brings the priority of thread, and of everyone down the chain it's blocked on, up to date
+static void tskPiUpdate (NkThread_t* thread)
+{
+    for (int i = 0; thread && i < TSK_PI_MAX_DEPTH; ++i)
+    {
+        int prio = tskPiGetPrio (thread);
+        if (prio == thread->priority)
+            break;    // Nothing changes further down
+        TskChangeThreadPrio (thread, prio);
+        thread = (thread->piWait) ? thread->piWait->piOwner : NULL;
+    }
+}
+
+// Lends our priority to owner of mtx before we block on it
+static void tskPiBlock (TskMutex_t* mtx, NkThread_t* self, NkThread_t* owner)
+{
+    NkSpinLock (&tskPiLock);
+    if (!mtx->piOwner)
+    {
+        mtx->piOwner = owner;
+        NkListAddFront (&owner->piMutexes, &mtx->piLink);
+    }
+    NkListAddFront (&mtx->piWaiters, &self->piLink);
+    self->piWait = mtx;
+    tskPiUpdate (owner);
+    NkSpinUnlock (&tskPiLock);
+}
+
+// Takes back our priority once we stop blocking on mtx, whether we got it or not
+static void tskPiUnblock (TskMutex_t* mtx, NkThread_t* self)
+{
+    NkSpinLock (&tskPiLock);
+    NkListRemove (&mtx->piWaiters, &self->piLink);
+    self->piWait = NULL;
+    // If someone still owns it, they don't need our priority anymore
+    if (mtx->piOwner)
+    {
+        NkThread_t* owner = mtx->piOwner;
+        if (!NkListFront (&mtx->piWaiters))
+        {
+            NkListRemove (&owner->piMutexes, &mtx->piLink);
+            mtx->piOwner = NULL;
+        }
+        tskPiUpdate (owner);
+    }
+    NkSpinUnlock (&tskPiLock);
+}
+
+// Starts taking priority from waiters that are still on mtx after we took it
+static void tskPiTake (TskMutex_t* mtx, NkThread_t* self)
+{
+    NkSpinLock (&tskPiLock);
+    if (NkListFront (&mtx->piWaiters))
+    {
+        assert (!mtx->piOwner);
+        mtx->piOwner = self;
+        NkListAddFront (&self->piMutexes, &mtx->piLink);
+        tskPiUpdate (self);
+    }
+    NkSpinUnlock (&tskPiLock);
+}
+
+// Gives back what waiters on mtx lent us, and puts the best of them first in line for it
+static void tskPiRelease (TskMutex_t* mtx, NkThread_t* self)
+{
+    NkSpinLock (&tskPiLock);
+    if (mtx->piOwner == self)
+    {
+        NkListRemove (&self->piMutexes, &mtx->piLink);
+        mtx->piOwner = NULL;
+        tskPiUpdate (self);
+    }
+    // Put the best sleeper first in line, even ahead of threads that have been waiting longer
+    TskWaitObj_t* best = NULL;
+    NkLink_t* iter = NkListFront (&mtx->queue.waiters);
+    while (iter)
+    {
+        TskWaitObj_t* waitObj = (TskWaitObj_t*) iter;
+        if (!best || waitObj->waiter->priority < best->waiter->priority)
+            best = waitObj;
+        iter = NkListIterate (&mtx->queue.waiters, iter);
+    }
+    if (best && NkListFront (&mtx->queue.waiters) != &best->link)
+    {
+        NkListRemove (&mtx->queue.waiters, &best->link);
+        NkListAddFront (&mtx->queue.waiters, &best->link);
+    }
+    NkSpinUnlock (&tskPiLock);
+}
+
+// Sets the priority of a thread
+void TskSetThreadPrio (NkThread_t* thread, int newPrio)
+{
+    if (thread->policy == TSK_POLICY_FAIR || thread->policy == TSK_POLICY_DEADLINE)
+        return;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&tskPiLock);
+    thread->basePrio = newPrio;
+    // Mutexes it holds may keep it higher, and whatever it's blocked on has to follow
+    tskPiUpdate (thread);
+    NkSpinUnlock (&tskPiLock);
+    PltLowerIpl (ipl);
+}
+
 // Initializes a mutex
 void TskInitMutex (TskMutex_t* mtx)
 {
     TskInitWaitQueue (&mtx->queue, TSK_WAITOBJ_MUTEX);
-    mtx->state = false;
+    mtx->owner = 0;
+    NkListInit (&mtx->piWaiters);
+    mtx->piOwner = NULL;
+#ifdef NEXKE_SYNCH_STATS
+    mtx->synchClass = NULL;
+#endif
+}
+
+// Spins while owner of mutex is running on another CPU
+// Returns true if we got the mutex
+static bool tskSpinMutex (TskMutex_t* mtx, atomic_t self)
+{
+#ifndef NEXKE_UP
+    for (int i = 0; i < TSK_MUTEX_SPIN_MAX; ++i)
+    {
+        atomic_t owner = NkAtomicLoad (&mtx->owner);
+        if (!owner)
+        {
+            if (NkAtomicCmpXchg (&mtx->owner, &owner, self))
+                return true;
+            continue;
+        }
+        // Once there are sleepers, go join them so they get it in order
+        if (owner & TSK_MUTEX_WAITERS)
+            return false;
+        // Threads are type safe, so this is fine even if the owner just exited
+        NkThread_t* thread = TSK_MUTEX_OWNER (owner);
+        if (!__atomic_load_n (&thread->onCpu, __ATOMIC_ACQUIRE))
+            return false;    // It won't let go until it runs again
+        CpuSpin();
+    }
+#endif
+    return false;
 }
 
 // Acquires a mutex
 errno_t TskAcquireMutex (TskMutex_t* mtx)
 {
+    atomic_t self = (atomic_t) TskGetCurrentThread();
+    assert (TSK_MUTEX_OWNER (mtx->owner) != (NkThread_t*) self);
+    TSK_SYNCH_USE (mtx, TSK_SYNCH_MUTEX);
+    // Fast path
+    atomic_t owner = 0;
+    if (NkAtomicCmpXchg (&mtx->owner, &owner, self) || tskSpinMutex (mtx, self))
+    {
+        TSK_SYNCH_TAKEN (mtx);
+        return EOK;
+    }
+    // Sleep until it's ours. The owner has to take the queue lock to see the waiters bit
+    // we set, so it can't miss us
+    TSK_SYNCH_WAIT_START (start);
     ipl_t ipl = TskAssertWaitQueue (&mtx->queue);
     errno_t err = EOK;
-    while (mtx->state && err == EOK)
+    for (;;)
+    {
+        owner = NkAtomicLoad (&mtx->owner);
+        if (!owner)
+        {
+            // Take it, and make sure anyone still waiting gets woken when we release
+            atomic_t newOwner = self;
+            if (NkListFront (&mtx->queue.waiters))
+                newOwner |= TSK_MUTEX_WAITERS;
+            if (NkAtomicCmpXchg (&mtx->owner, &owner, newOwner))
+            {
+                // They lend their priority to us now
+                if (newOwner & TSK_MUTEX_WAITERS)
+                    tskPiTake (mtx, (NkThread_t*) self);
+                break;
+            }
+            continue;
+        }
+        if (!(owner & TSK_MUTEX_WAITERS) &&
+            !NkAtomicCmpXchg (&mtx->owner, &owner, owner | TSK_MUTEX_WAITERS))
+        {
+            continue;
+        }
+        // The owner can't release without the queue lock, so it's safe to lend it our priority
+        tskPiBlock (mtx, (NkThread_t*) self, TSK_MUTEX_OWNER (owner));
         err = TskWaitQueueFlags (&mtx->queue, TSK_WAIT_ASSERTED, 0);
-    if (err == EOK)
-        mtx->state = true;
+        tskPiUnblock (mtx, (NkThread_t*) self);
+        if (err != EOK)
+            break;
+    }
     TskDeAssertWaitQueue (&mtx->queue, ipl);
+    TSK_SYNCH_WAITED (mtx, start);
+    if (err == EOK)
+        TSK_SYNCH_TAKEN (mtx);
     return err;
 }
 
 // Releases a mutex
 errno_t TskReleaseMutex (TskMutex_t* mtx)
 {
+    atomic_t self = (atomic_t) TskGetCurrentThread();
+    assert (TSK_MUTEX_OWNER (mtx->owner) == (NkThread_t*) self);
+    TSK_SYNCH_RELEASED (mtx);
+    // Fast path
+    atomic_t owner = self;
+    if (NkAtomicCmpXchg (&mtx->owner, &owner, 0))
+        return EOK;
+    // Someone is sleeping, wake them up
     ipl_t ipl = TskAssertWaitQueue (&mtx->queue);
-    errno_t err = EOK;
-    assert (mtx->state);
-    mtx->state = false;
-    err = TskWakeWaitQueue (&mtx->queue, TSK_WAIT_ASSERTED);
+    tskPiRelease (mtx, (NkThread_t*) self);
+    NkAtomicStore (&mtx->owner, 0);
+    errno_t err = TskWakeWaitQueue (&mtx->queue, TSK_WAIT_ASSERTED);
     TskDeAssertWaitQueue (&mtx->queue, ipl);
     return err;
 }
@@ -118,16 +558,12 @@ errno_t TskReleaseMutex (TskMutex_t* mtx)
 // Tries to acquire a mutex
 errno_t TskTryAcquireMutex (TskMutex_t* mtx)
 {
-    // Assert the queue
-    ipl_t ipl = TskAssertWaitQueue (&mtx->queue);
-    errno_t err = EOK;
-    if (mtx->state)
-        err = EWOULDBLOCK;
-    // Decrement count if we are able
-    if (err == EOK)
-        mtx->state = true;
-    TskDeAssertWaitQueue (&mtx->queue, ipl);
-    return err;
+    atomic_t owner = 0;
+    if (!NkAtomicCmpXchg (&mtx->owner, &owner, (atomic_t) TskGetCurrentThread()))
+        return EWOULDBLOCK;
+    TSK_SYNCH_USE (mtx, TSK_SYNCH_MUTEX);
+    TSK_SYNCH_TAKEN (mtx);
+    return EOK;
 }
 
 // Closes a mutex
@@ -136,35 +572,182 @@ errno_t TskCloseMutex (TskMutex_t* mtx)
     return TskCloseWaitQueue (&mtx->queue, 0);
 }
 
+// Reader-writer locks
+// State is protected by the queue lock. Readers and writers sleep on the same queue, so releases
+// that may let more than one thread in wake every reader, and whoever can't go yet sleeps again
+// Writers wait exclusively, as only one of them could get in anyway
+
+// Initializes a reader-writer lock
+void TskInitRwLock (TskRwLock_t* rw, int flags)
+{
+    TskInitWaitQueue (&rw->queue, TSK_WAITOBJ_RWLOCK);
+    rw->readers = 0;
+    rw->writersWaiting = 0;
+    rw->writer = false;
+    rw->flags = flags;
+}
+
+// Checks if a reader would have to wait
+static FORCEINLINE bool tskReadBlocked (TskRwLock_t* rw)
+{
+    if (rw->writer)
+        return true;
+    return (rw->flags & TSK_RWLOCK_PREFER_WRITER) && rw->writersWaiting;
+}
+
+// Acquires a reader-writer lock for reading
+errno_t TskAcquireRead (TskRwLock_t* rw)
+{
+    ipl_t ipl = TskAssertWaitQueue (&rw->queue);
+    errno_t err = EOK;
+    while (tskReadBlocked (rw) && err == EOK)
+        err = TskWaitQueueFlags (&rw->queue, TSK_WAIT_ASSERTED, 0);
+    if (err == EOK)
+        ++rw->readers;
+    TskDeAssertWaitQueue (&rw->queue, ipl);
+    return err;
+}
+
+// Acquires a reader-writer lock for writing
+errno_t TskAcquireWrite (TskRwLock_t* rw)
+{
+    ipl_t ipl = TskAssertWaitQueue (&rw->queue);
+    errno_t err = EOK;
+    ++rw->writersWaiting;
+    while ((rw->writer || rw->readers) && err == EOK)
+        err = TskWaitQueueFlags (&rw->queue, TSK_WAIT_ASSERTED | TSK_WAIT_EXCLUSIVE, 0);
+    --rw->writersWaiting;
+    if (err == EOK)
+        rw->writer = true;
+    else if (!rw->writer && rw->writersWaiting == 0)
+        TskBroadcastWaitQueue (&rw->queue, TSK_WAIT_ASSERTED);    // Let readers we held off go
+    TskDeAssertWaitQueue (&rw->queue, ipl);
+    return err;
+}
+
+// Releases a reader-writer lock held for reading
+errno_t TskReleaseRead (TskRwLock_t* rw)
+{
+    ipl_t ipl = TskAssertWaitQueue (&rw->queue);
+    errno_t err = EOK;
+    assert (rw->readers && !rw->writer);
+    --rw->readers;
+    // Only writers can be waiting on readers
+    if (!rw->readers && rw->writersWaiting)
+        err = TskBroadcastWaitQueue (&rw->queue, TSK_WAIT_ASSERTED);
+    TskDeAssertWaitQueue (&rw->queue, ipl);
+    return err;
+}
+
+// Releases a reader-writer lock held for writing
+errno_t TskReleaseWrite (TskRwLock_t* rw)
+{
+    ipl_t ipl = TskAssertWaitQueue (&rw->queue);
+    assert (rw->writer);
+    rw->writer = false;
+    errno_t err = TskBroadcastWaitQueue (&rw->queue, TSK_WAIT_ASSERTED);
+    TskDeAssertWaitQueue (&rw->queue, ipl);
+    return err;
+}
+
+// Closes a reader-writer lock
+errno_t TskCloseRwLock (TskRwLock_t* rw)
+{
+    return TskCloseWaitQueue (&rw->queue, 0);
+}
+
 // Condition variables
 
 // Initializes a condition
 void TskInitCondition (TskCondition_t* cond)
 {
     TskInitWaitQueue (&cond->queue, TSK_WAITOBJ_CONDITION);
+    cond->state = false;
+    cond->mtx = NULL;
+#ifdef NEXKE_SYNCH_STATS
+    cond->synchClass = NULL;
+#endif
 }
 
 // Waits on a condition, taking a mutex to unlock before blocking
 // to prevent lost-wakeup
 errno_t TskWaitCondition (TskCondition_t* cond, TskMutex_t* mtx)
 {
+    TSK_SYNCH_USE (cond, TSK_SYNCH_CONDITION);
+    TSK_SYNCH_WAIT_START (start);
     ipl_t ipl = TskAssertWaitQueue (&cond->queue);
     if (mtx)
     {
         // Relelase the mutex now that we are locked to prevent lost wakeup
+        cond->mtx = mtx;
         TskReleaseMutex (mtx);
     }
     errno_t err = EOK;
     if (!cond->state)
+    {
         err = TskWaitQueueFlags (&cond->queue, TSK_WAIT_ASSERTED, 0);
+        TSK_SYNCH_WAITED (cond, start);
+    }
+    // Waiters that come later may use another mutex
+    if (!NkListFront (&cond->queue.waiters))
+        cond->mtx = NULL;
     TskDeAssertWaitQueue (&cond->queue, ipl);
+    // If we were moved to the mutex's queue, we were woken by it being released, and just have to
+    // take it like anyone else it woke
+    if (mtx)
+        TskAcquireMutex (mtx);
     return err;
 }
 
+// Checks if waiters on cond can be moved to its mutex instead of being woken
+// Queue must be locked
+static FORCEINLINE bool tskCanMorph (TskCondition_t* cond)
+{
+    if (!cond->mtx)
+        return false;
+    atomic_t owner = NkAtomicLoad (&cond->mtx->owner);
+    return TSK_MUTEX_OWNER (owner) == TskGetCurrentThread();
+}
+
+// Moves waiters on cond over to its mutex, which we own, so its release wakes them
+// Queue must be locked
+static errno_t tskMorphWaiters (TskCondition_t* cond, bool all)
+{
+    if (cond->queue.done)
+        return EAGAIN;
+    TskMutex_t* mtx = cond->mtx;
+    NkSpinLock (&mtx->queue.lock);
+    bool moved = false;
+    NkLink_t* iter = NkListFront (&cond->queue.waiters);
+    while (iter)
+    {
+        // Condition waits don't time out, so everyone here is still asleep
+        TskWaitObj_t* waiter = LINK_CONTAINER (iter, TskWaitObj_t, link);
+        iter = NkListIterate (&cond->queue.waiters, iter);
+        NkListRemove (&cond->queue.waiters, &waiter->link);
+        NkListAddBack (&mtx->queue.waiters, &waiter->link);
+        moved = true;
+        if (!all)
+            break;
+    }
+    // Make sure our release goes through the queue
+    if (moved)
+        NkAtomicOr (&mtx->owner, TSK_MUTEX_WAITERS);
+    NkSpinUnlock (&mtx->queue.lock);
+    return EOK;
+}
+
 // Signals a thread to wake up on condition
 errno_t TskSignalCondition (TskCondition_t* cond)
 {
-    return TskWakeWaitQueue (&cond->queue, 0);
+    ipl_t ipl = TskAssertWaitQueue (&cond->queue);
+    errno_t err = EOK;
+    if (tskCanMorph (cond))
+        err = tskMorphWaiters (cond, false);
+    else
+        err = TskWakeWaitQueue (&cond->queue, TSK_WAIT_ASSERTED);
+    TskDeAssertWaitQueue (&cond->queue, ipl);
+    return err;
 }
 
 // Broadcasts a condition
@@ -172,7 +755,11 @@ errno_t TskBroadcastCondition (TskCondition_t* cond)
 {
     ipl_t ipl = TskAssertWaitQueue (&cond->queue);
     cond->state = true;
-    errno_t err = TskBroadcastWaitQueue (&cond->queue, TSK_WAIT_ASSERTED);
+    errno_t err = EOK;
+    if (tskCanMorph (cond))
+        err = tskMorphWaiters (cond, true);
+    else
+        err = TskBroadcastWaitQueue (&cond->queue, TSK_WAIT_ASSERTED);
     TskDeAssertWaitQueue (&cond->queue, ipl);
     return err;
 }
@@ -15,6 +15,7 @@
     limitations under the License.
 */
 
+#include <nexke/mm.h>
 #include <nexke/nexke.h>
 #include <nexke/platform.h>
 #include <nexke/task.h>
@@ -33,11 +34,36 @@ static NkWorkQueue_t* nkTerminator = NULL;
 
 #define NK_TERMINATOR_THRESHOLD 5
 
+// Deepest any thread has gone into a stack of each class, as of when it terminated
+static atomic_t tskStackMax[CPU_KSTACK_CLASSES] = {0};
+
+static long long tskStatReadStackMax()
+{
+    return (long long) NkAtomicLoad (&tskStackMax[CPU_KSTACK_NORMAL]);
+}
+
+static long long tskStatReadSmallStackMax()
+{
+    return (long long) NkAtomicLoad (&tskStackMax[CPU_KSTACK_SMALL]);
+}
+
+static NkStat_t tskStatStackMax = {.name = "task.kstack_peak",
+                                   .type = NK_STAT_GAUGE,
+                                   .read = tskStatReadStackMax};
+static NkStat_t tskStatSmallStackMax = {.name = "task.small_kstack_peak",
+                                        .type = NK_STAT_GAUGE,
+                                        .read = tskStatReadSmallStackMax};
+
+// Threads that come within this fraction of the end of their stack get warned about
+#define TSK_STACK_WARN_DIV 8
+
 // Standard thread entry point
 static void TskThreadEntry()
 {
     // Get the thread structure
     NkThread_t* thread = CpuGetCcb()->curThread;
+    // Let go of the thread we switched from
+    TskFinishSwitch();
     // Unlock ready queue, as we start with it locked
     NkCcb_t* ccb = CpuGetCcb();
     if (ccb->preemptDisable)
@@ -56,6 +82,16 @@ static void TskTerminator (NkWorkItem_t* item)
     TskDestroyThread (thread);
 }
 
+// Constructs a thread object
+static void tskThreadCtor (void* obj)
+{
+    NkThread_t* thread = obj;
+    memset (thread, 0, sizeof (NkThread_t));
+    TskInitWaitQueue (&thread->joinQueue, TSK_WAITOBJ_QUEUE);
+    NkListInit (&thread->ownedWaits);
+    NkListInit (&thread->piMutexes);
+}
+
 // Creates a new thread object
 NkThread_t* TskCreateThread (NkThreadEntry entry,
                              void* arg,
@@ -66,6 +102,8 @@ NkThread_t* TskCreateThread (NkThreadEntry entry,
 {
     // Allocate a thread
     NkThread_t* thread = MmCacheAlloc (nkThreadCache);
+    if (!thread)
+        return NULL;
     // Allocate a thread table entry
     id_t tid = NkAllocResource (nkThreadRes);
     if (tid == -1)
@@ -74,8 +112,7 @@ NkThread_t* TskCreateThread (NkThreadEntry entry,
         MmCacheFree (nkThreadCache, thread);
         return NULL;
     }
-    // Setup thread
-    memset (thread, 0, sizeof (NkThread_t));
+    // Setup thread. Wait structures are already constructed
     thread->arg = arg;
     thread->name = name;
     thread->entry = entry;
@@ -83,16 +120,38 @@ NkThread_t* TskCreateThread (NkThreadEntry entry,
     thread->refCount = 1;
     thread->flags = flags;
     thread->priority = prio;
+    thread->basePrio = prio;
+    thread->piWait = NULL;
     thread->policy = policy;
+    thread->exitCode = 0;
+    thread->runTime = 0, thread->lastSchedule = 0;
+    thread->vruntime = 0;
+    thread->nice = 0, thread->weight = TSK_FAIR_WEIGHT0;
+    thread->dlBw = 0;
+    thread->space = NULL;
+    thread->preempted = false, thread->timeoutPending = false;
+    thread->waitAsserted = 0;
+    thread->onCpu = 0;
+    thread->ccb = NULL, thread->lastStop = 0;
+    thread->affinity = TSK_AFFINITY_ALL, thread->prefCpu = -1;
+    thread->memNode = MM_NODE_LOCAL;
+    thread->stackPeak = 0;
+#ifdef NEXKE_SCHED_STATS
+    // Threads get reused, so don't carry over what the last one did
+    thread->readyTime = 0;
+    memset (&thread->stats, 0, sizeof (TskSchedStats_t));
+#endif
     // Set flags of policy
     if (policy == TSK_POLICY_FIFO)
         thread->flags |= (TSK_THREAD_FIFO | TSK_THREAD_FIXED_PRIO);
     else if (policy == TSK_POLICY_RR)
         thread->flags |= TSK_THREAD_FIXED_PRIO;
-    TskInitWaitQueue (&thread->joinQueue, TSK_WAITOBJ_QUEUE);
-    NkListInit (&thread->ownedWaits);
+    else if (policy == TSK_POLICY_FAIR)
+        thread->priority = thread->basePrio = TSK_PRIO_FAIR;
     // Initialize CPU specific context
-    thread->context = CpuAllocContext ((uintptr_t) TskThreadEntry);
+    thread->stackClass = (flags & TSK_THREAD_SMALL_STACK) ? CPU_KSTACK_SMALL : CPU_KSTACK_NORMAL;
+    thread->context = CpuAllocContext ((uintptr_t) TskThreadEntry, thread->stackClass);
+    thread->baseContext = thread->context;
     if (!thread->context)
     {
         // Failure
@@ -100,6 +159,7 @@ NkThread_t* TskCreateThread (NkThreadEntry entry,
         MmCacheFree (nkThreadCache, thread);
         return NULL;
     }
+    CpuInitThread (thread);
     // Setup scheduling info
     thread->state = TSK_THREAD_CREATED;
     thread->quantum = TSK_TIMESLICE_LEN;
@@ -107,7 +167,7 @@ NkThread_t* TskCreateThread (NkThreadEntry entry,
     if (!thread->timeout)
     {
         // Failure
-        CpuDestroyContext (thread->context);
+        CpuDestroyContext (thread->baseContext, thread->stackClass);
         NkFreeResource (nkThreadRes, tid);
         MmCacheFree (nkThreadCache, thread);
         return NULL;
@@ -119,9 +179,39 @@ NkThread_t* TskCreateThread (NkThreadEntry entry,
     return thread;
 }
 
+// Records how deep thread went into its stack
+static void tskRecordStackPeak (NkThread_t* thread)
+{
+    size_t peak = CpuGetStackPeak (thread->baseContext, thread->stackClass);
+    thread->stackPeak = peak;
+    atomic_t* max = &tskStackMax[thread->stackClass];
+    atomic_t old = NkAtomicLoad (max);
+    while ((atomic_t) peak > old && !NkAtomicCmpXchg (max, &old, (atomic_t) peak))
+        ;
+    size_t sz = CpuGetStackSize (thread->stackClass);
+    if (sz && peak > (sz - (sz / TSK_STACK_WARN_DIV)))
+    {
+        NkLogWarning ("nexke: warning: thread %s used %lu of %lu bytes of its stack\n",
+                      thread->name,
+                      peak,
+                      sz);
+    }
+}
+
+// Gets the most of its kernel stack thread has used
+size_t TskGetStackPeak (NkThread_t* thread)
+{
+    // Stacks of threads that terminated may already be in use by someone else
+    if (thread->state == TSK_THREAD_TERMINATING)
+        return thread->stackPeak;
+    return CpuGetStackPeak (thread->baseContext, thread->stackClass);
+}
+
 // Terminates ourself
 void TskTerminateSelf (int code)
 {
+    // Find out how deep we went, while the stack is still ours
+    tskRecordStackPeak (TskGetCurrentThread());
     // Lock the scheduler
     ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
     NkThread_t* thread = TskGetCurrentThread();
@@ -130,6 +220,7 @@ void TskTerminateSelf (int code)
     // Set our state and exit code
     thread->state = TSK_THREAD_TERMINATING;
     thread->exitCode = code;
+    TskReleaseDeadline (thread);
     // Awake all joined threads
     TskBroadcastWaitQueue (&thread->joinQueue, 0);
     // Close it in case someone else trys to join before being destroyed
@@ -171,10 +262,19 @@ void TskDestroyThread (NkThread_t* thread)
     {
         // Remove from table
         nkThreadTable[thread->tid] = NULL;
+        TskUnlockThread (thread);
+        // The CPU it terminated on may not be done switching away from it yet
+        TskThreadWaitOffCpu (thread);
         // Destroy all components of thread
         NkTimeFreeEvent (thread->timeout);
-        CpuDestroyContext (thread->context);
+        CpuDestroyThread (thread);
+        // The saved context can be anywhere on the stack, so find it from the one we started with
+        CpuDestroyContext (thread->baseContext, thread->stackClass);
         NkFreeResource (nkThreadRes, thread->tid);
+        // Return it to constructed state, as the join queue was closed on termination
+        TskInitWaitQueue (&thread->joinQueue, TSK_WAITOBJ_QUEUE);
+        NkListInit (&thread->ownedWaits);
+        NkListInit (&thread->piMutexes);
         MmCacheFree (nkThreadCache, thread);
     }
     else
@@ -182,6 +282,20 @@ void TskDestroyThread (NkThread_t* thread)
     NkSpinUnlock (&nkThreadsLock);
 }
 
+// Gets how late timeouts of thread may go off
+static ktime_t tskGetSlack (NkThread_t* thread)
+{
+    // Real time threads need their timeouts on time, and fair share threads are there for
+    // throughput
+    if (thread->policy == TSK_POLICY_FAIR)
+        return TSK_SLACK_BATCH;
+    if (thread->policy != TSK_POLICY_NORMAL)
+        return 0;
+    if (thread->basePrio >= TSK_PRIO_BATCH)
+        return TSK_SLACK_BATCH;
+    return TSK_SLACK_DEFAULT;
+}
+
 // Asserts and sets up a wait
 // IPL must be raised and object must be locked
 // Locks the current thread while asserting the wait
@@ -201,11 +315,13 @@ TskWaitObj_t* TskAssertWait (ktime_t timeout, void* obj, int type)
     waitObj->waiter = thread;
     waitObj->timeout = timeout;
     waitObj->result = TSK_WAITOBJ_IN_PROG;
+    waitObj->exclusive = false;
     // Setup a timeout
     if (timeout)
     {
         thread->timeoutPending = true;
         NkTimeSetWakeEvent (thread->timeout, waitObj);
+        NkTimeSetSlack (thread->timeout, tskGetSlack (thread));
         NkTimeRegEvent (thread->timeout, timeout, 0);
     }
     return waitObj;
@@ -215,8 +331,14 @@ TskWaitObj_t* TskAssertWait (ktime_t timeout, void* obj, int type)
 // Returns true if wait was successful, false if it failed
 bool TskWaitOnObj (TskWaitObj_t* waitObj, int flags)
 {
+    // Workers let their pool know they're blocking, so it can keep its work going
+    NkThread_t* cur = TskGetCurrentThread();
+    if (cur->flags & TSK_THREAD_WORKER)
+        NkWorkSleeping (cur);
     // Wait
     TskSchedule();
+    if (cur->flags & TSK_THREAD_WORKER)
+        NkWorkRunning (cur);
     if (waitObj->result != TSK_WAITOBJ_SUCCESS)
         return false;
     if (flags & TSK_WAITOBJ_OWN)
@@ -311,9 +433,20 @@ void TskInitSys()
 {
     NkLogDebug ("nexke: initializing multitasking\n");
     // Create cache and resource
-    nkThreadCache = MmCacheCreate (sizeof (NkThread_t), "NkThread_t", 0, 0);
+    // Threads are type safe so mutex waiters can look at an owner that has just exited
+    // They start on a cache line, so their scheduling state takes up as few as it can
+    nkThreadCache = MmCacheCreateCtor (sizeof (NkThread_t),
+                                       "NkThread_t",
+                                       MM_TAG_TASK,
+                                       NEXKE_CACHELINE,
+                                       SLAB_CACHE_TYPESAFE,
+                                       tskThreadCtor,
+                                       NULL);
     nkThreadRes = NkCreateResource ("NkThread", 0, NEXKE_MAX_THREAD - 1);
     assert (nkThreadCache && nkThreadRes);
+    NkStatRegister (&tskStatStackMax);
+    NkStatRegister (&tskStatSmallStackMax);
     TskInitSched();
+    TskInitWaitAddress();
     nkTerminator = NkWorkQueueCreate (TskTerminator, NK_WORK_DEMAND, 0, 0, NK_TERMINATOR_THRESHOLD);
 }
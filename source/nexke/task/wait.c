@@ -64,6 +64,7 @@ errno_t TskWaitQueueFlags (TskWaitQueue_t* queue, int flags, ktime_t timeout)
     // Now we can prepare to wait
     TskWaitObj_t* waitObj = TskAssertWait (timeout, queue, queue->queueObject);
     assert (waitObj);
+    waitObj->exclusive = (flags & TSK_WAIT_EXCLUSIVE) != 0;
     // Add to sleepers
     NkListAddBack (&queue->waiters, &waitObj->link);
     // Block now, but first unlock the queue
@@ -104,7 +105,8 @@ errno_t TskWaitQueue (TskWaitQueue_t* queue)
 }
 
 // Unsafe function to wake a thread off the wait queue
-static FORCEINLINE void tskWakeThread (TskWaitQueue_t* queue, TskWaitObj_t* waitObj)
+// Returns false if it's already been woken by its timeout
+static FORCEINLINE bool tskWakeThread (TskWaitQueue_t* queue, TskWaitObj_t* waitObj)
 {
     // Clear the wait
     bool wakeSuccess = TskClearWait (waitObj, TSK_WAITOBJ_SUCCESS);
@@ -115,20 +117,35 @@ static FORCEINLINE void tskWakeThread (TskWaitQueue_t* queue, TskWaitObj_t* wait
         // Now ready the new thread of needed (which may request preemption)
         TskWakeObj (waitObj);
     }
+    return wakeSuccess;
 }
 
-// Unsafe function to wake all threads off the queue
-static FORCEINLINE void tskWakeQueue (TskWaitQueue_t* queue)
+// Unsafe function to wake threads off the queue
+// Waiters that have timed out are left for themselves to remove. Past the first exclusive waiter
+// woken, other exclusive waiters are left alone unless all is set
+// Everyone woken is readied in one go, so the scheduler only has to decide once whether to
+// preempt, instead of once for every waiter
+static FORCEINLINE void tskWakeQueue (TskWaitQueue_t* queue, bool all)
 {
-    // Iterate through list
+    NkList_t woken;
+    NkListInit (&woken);
+    bool wokeExclusive = false;
     NkLink_t* iter = NkListFront (&queue->waiters);
     while (iter)
     {
-        TskWaitObj_t* waiter = (TskWaitObj_t*) iter;
-        // Wake it
-        tskWakeThread (queue, waiter);
+        TskWaitObj_t* waiter = LINK_CONTAINER (iter, TskWaitObj_t, link);
         iter = NkListIterate (&queue->waiters, iter);
+        if (waiter->exclusive && wokeExclusive && !all)
+            continue;
+        if (!TskClearWait (waiter, TSK_WAITOBJ_SUCCESS))
+            continue;    // Timed out, the wakeup goes to someone else
+        if (waiter->exclusive)
+            wokeExclusive = true;
+        NkListRemove (&queue->waiters, &waiter->link);
+        NkListAddBack (&woken, &waiter->link);
     }
+    if (NkListFront (&woken))
+        TskWakeObjList (&woken);
 }
 
 // Wakes a thread off the wait queue
@@ -144,10 +161,15 @@ errno_t TskWakeWaitQueue (TskWaitQueue_t* queue, int flags)
         err = EAGAIN;
         goto cleanup;
     }
-    // Get first sleeping thread
-    TskWaitObj_t* waiter = (TskWaitObj_t*) NkListFront (&queue->waiters);
-    if (waiter)
-        tskWakeThread (queue, waiter);    // Wake the thread
+    // Wake the first waiter that hasn't timed out yet
+    NkLink_t* iter = NkListFront (&queue->waiters);
+    while (iter)
+    {
+        TskWaitObj_t* waiter = LINK_CONTAINER (iter, TskWaitObj_t, link);
+        iter = NkListIterate (&queue->waiters, iter);
+        if (tskWakeThread (queue, waiter))
+            break;
+    }
 cleanup:
     // Deassert if we need to
     if (!(flags & TSK_WAIT_ASSERTED))
@@ -169,7 +191,7 @@ errno_t TskBroadcastWaitQueue (TskWaitQueue_t* queue, int flags)
         goto cleanup;
     }
     // Wake the entire queue
-    tskWakeQueue (queue);
+    tskWakeQueue (queue, false);
 cleanup:
     // Deassert if we need to
     if (!(flags & TSK_WAIT_ASSERTED))
@@ -192,10 +214,110 @@ errno_t TskCloseWaitQueue (TskWaitQueue_t* queue, int flags)
     }
     // Wake the entire queue and close it
     queue->done = true;
-    tskWakeQueue (queue);
+    tskWakeQueue (queue, true);
 cleanup:
     // Deassert if we need to
     if (!(flags & TSK_WAIT_ASSERTED))
         TskDeAssertWaitQueue (queue, ipl);
     return err;
 }
+
+// Address waits
+// Threads can wait on any word in memory, without it needing a wait queue of its own. Waiters
+// are kept in a fixed table of buckets, hashed by address, so a word costs nothing until someone
+// actually blocks on it. Each bucket counts its waiters, so wakers can skip taking the bucket
+// lock when nobody is there
+
+// Number of address wait buckets, must be a power of two
+#define TSK_ADDR_BUCKETS     256
+#define TSK_ADDR_BUCKET_BITS 8
+
+typedef struct _addrbucket
+{
+    NkList_t waiters;    // Waiters on addresses in this bucket
+    spinlock_t lock;     // Bucket lock
+    atomic_t count;      // Number of threads waiting, or about to
+} TskAddrBucket_t;
+
+static TskAddrBucket_t tskAddrBuckets[TSK_ADDR_BUCKETS];
+
+// Finds the bucket of an address
+static FORCEINLINE TskAddrBucket_t* tskGetAddrBucket (atomic_t* addr)
+{
+    // Fibonacci hash, so nearby words land in different buckets
+    uint32_t key = (uint32_t) ((uintptr_t) addr / sizeof (atomic_t));
+    return &tskAddrBuckets[(key * 0x9E3779B9U) >> (32 - TSK_ADDR_BUCKET_BITS)];
+}
+
+// Waits on an address for as long as it contains expected
+errno_t TskWaitAddress (atomic_t* addr, atomic_t expected, ktime_t timeout)
+{
+    TskAddrBucket_t* bucket = tskGetAddrBucket (addr);
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&bucket->lock);
+    // Count ourselves before checking the word. A waker changes the word before looking at the
+    // count, so either it sees us, or we see its change
+    NkAtomicAdd (&bucket->count, 1);
+    errno_t err = EOK;
+    if (NkAtomicLoad (addr) != expected)
+    {
+        err = EAGAIN;
+        goto cleanup;
+    }
+    TskWaitObj_t* waitObj = TskAssertWait (timeout, addr, TSK_WAITOBJ_ADDRESS);
+    assert (waitObj);
+    NkListAddBack (&bucket->waiters, &waitObj->link);
+    NkSpinUnlock (&bucket->lock);
+    bool waitStatus = TskWaitOnObj (waitObj, 0);
+    NkSpinLock (&bucket->lock);
+    if (!waitStatus)
+    {
+        // Timed out, so nobody took us off the bucket
+        NkListRemove (&bucket->waiters, &waitObj->link);
+        err = ETIMEDOUT;
+    }
+cleanup:
+    NkAtomicSub (&bucket->count, 1);
+    NkSpinUnlock (&bucket->lock);
+    PltLowerIpl (ipl);
+    return err;
+}
+
+// Wakes up to count threads waiting on an address
+// Returns number of threads woken
+int TskWakeAddress (atomic_t* addr, int count)
+{
+    TskAddrBucket_t* bucket = tskGetAddrBucket (addr);
+    if (!NkAtomicLoad (&bucket->count))
+        return 0;
+    NkList_t woken;
+    NkListInit (&woken);
+    int numWoken = 0;
+    ipl_t ipl = PltRaiseIpl (PLT_IPL_HIGH);
+    NkSpinLock (&bucket->lock);
+    NkLink_t* iter = NkListFront (&bucket->waiters);
+    while (iter && numWoken < count)
+    {
+        TskWaitObj_t* waiter = LINK_CONTAINER (iter, TskWaitObj_t, link);
+        iter = NkListIterate (&bucket->waiters, iter);
+        if (waiter->obj != addr)
+            continue;
+        if (!TskClearWait (waiter, TSK_WAITOBJ_SUCCESS))
+            continue;    // Timed out, the wakeup goes to someone else
+        NkListRemove (&bucket->waiters, &waiter->link);
+        NkListAddBack (&woken, &waiter->link);
+        ++numWoken;
+    }
+    if (numWoken)
+        TskWakeObjList (&woken);
+    NkSpinUnlock (&bucket->lock);
+    PltLowerIpl (ipl);
+    return numWoken;
+}
+
+// Sets up address wait buckets
+void TskInitWaitAddress()
+{
+    for (int i = 0; i < TSK_ADDR_BUCKETS; ++i)
+        NkListInit (&tskAddrBuckets[i].waiters);
+}